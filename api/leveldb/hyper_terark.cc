@@ -33,32 +33,34 @@
 
 using leveldb::ReplayIterator;
 using leveldb::Status;
+using terark::db::ChangeLog;
+using terark::db::ChangeOp;
+using terark::db::ChangeRecord;
 
 // Fill in missing methods from the interface
 ReplayIterator::ReplayIterator() {}
 ReplayIterator::~ReplayIterator() {}
 
+// Timestamps are seq of DbTable::getChangeLog(), a timestamp is the seq of
+// the first change after it, "all" is the oldest change in the log and
+// "now" is the next change. The iterator tails the log, it is valid again
+// after new changes are appended.
 class ReplayIteratorImpl : public ReplayIterator {
  public:
-  ReplayIteratorImpl(OperationContext *context) : context_(context), cursor_(NULL) {
-    WT_SESSION *session = context_->GetSession();
-    int ret = session->open_cursor(
-        session, "log:", NULL, NULL, &cursor_);
-    status_ = WiredTigerErrorToStatus(ret);
+  ReplayIteratorImpl(DbImpl* db) : db_(db), log_(db->m_tab->getChangeLog()) {
+    seq_ = 0;
+    pos_ = 0;
     valid_ = false;
-    // Position on first record.  valid_ will be set appropriately.
-    Next();
+    lost_ = false;
+    if (NULL == log_)
+      status_ = Status::NotSupported("replay", "change log is not enabled");
+    const terark::db::SchemaConfig& sconf = db->m_tab->getSchemaConfig();
+    keyColumnId_ = db->m_tab->getColumnId(sconf.getIndexSchema(0).getColumnName(0));
+    valColumnId_ = db->m_tab->getColumnId("val");
   }
 
-  ReplayIteratorImpl(OperationContext *context, const std::string& timestamp) :
-    context_(context), cursor_(NULL) {
-
-    WT_SESSION *session = context_->GetSession();
-    int ret = session->open_cursor(
-        session, "log:", NULL, NULL, &cursor_);
-    status_ = WiredTigerErrorToStatus(ret);
-    valid_ = false;
-    // Position on requested record.  valid_ will be set appropriately.
+  ReplayIteratorImpl(DbImpl* db, const std::string& timestamp)
+    : ReplayIteratorImpl(db) {
     SeekTo(timestamp);
   }
 
@@ -71,13 +73,8 @@ class ReplayIteratorImpl : public ReplayIterator {
   // REQUIRES: Valid()
   virtual void Next();
 
-  // Position at the first key in the source that at or past target for this
-  // pass.  Note that this is unlike the Seek call, as the ReplayIterator is
-  // unsorted.
-  // The iterator is Valid() after this call iff the source contains
-  // an entry that comes at or past target.
   // Per Robert at Hyperdex, the SkipTo functions are hacky optimizations
-  // for LevelDB and its key layout.  It is okay for them to be no-ops. 
+  // for LevelDB and its key layout.  It is okay for them to be no-ops.
   virtual void SkipTo(const Slice& target) { }
   virtual void SkipToLast() { }
   virtual void SeekTo(const std::string& timestamp);
@@ -85,260 +82,172 @@ class ReplayIteratorImpl : public ReplayIterator {
 
   // Return true if the current entry points to a key-value pair.  If this
   // returns false, it means the current entry is a deleted entry.
-  virtual bool HasValue() { 
-    assert(Valid());
-    if (optype == WT_LOGOP_ROW_PUT ||
-	optype == WT_LOGOP_COL_PUT)
-	  return true;
-    else
-	  return false;
-  }
-
-  int Compare(ReplayIteratorImpl* other) {
-    int cmp;
+  virtual bool HasValue() {
     assert(Valid());
-    // assert(other->Valid());
-    int ret = cursor_->compare(cursor_, other->cursor_, &cmp);
-    status_ = WiredTigerErrorToStatus(ret);
-    return (cmp);
+    return buf_[pos_].op != ChangeOp::remove;
   }
 
   // Return the key for the current entry.  The underlying storage for
   // the returned slice is valid only until the next modification of
   // the iterator.
   // REQUIRES: Valid()
-  virtual Slice key() const { return Slice((const char *)key_.data, key_.size); }
+  virtual Slice key() const { return Slice(key_.data(), key_.size()); }
 
   // Return the value for the current entry.  The underlying storage for
   // the returned slice is valid only until the next modification of
   // the iterator.
   // REQUIRES: !AtEnd() && !AtStart()
-  virtual Slice value() const { return Slice((const char *)value_.data, value_.size); }
+  virtual Slice value() const { return Slice(value_.data(), value_.size()); }
 
   // If an error has occurred, return it.  Else return an ok status.
   virtual Status status() const { return status_; }
 
   // must be released by giving it back to the DB
-  virtual ~ReplayIteratorImpl() {
-    int ret = Close();
-    assert(ret == 0);
-  }
+  virtual ~ReplayIteratorImpl() {}
 
-  std::string GetTimestamp() {
-	char lsn[256];
-        assert(Valid());
-	snprintf(lsn, sizeof(lsn), WT_TIMESTAMP_FORMAT,
-	    lsn_.file, lsn_.offset);
-	return (std::string(lsn));
+  std::string GetTimestamp() const {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)seq_);
+    return std::string(buf);
   }
 
-  int Close() {
-    int ret = 0;
-    if (cursor_ != NULL)
-      ret = cursor_->close(cursor_);
-    status_ = WiredTigerErrorToStatus(ret);
-    valid_ = false;
-    cursor_ = NULL;
-    return (ret);
+  // resolve "all", "now" and numbers to a seq, returns false if invalid
+  bool ParseTimestamp(const std::string& timestamp, terark::ullong* seq) const {
+    if (NULL == log_)
+      return false;
+    if (timestamp == "all")
+      *seq = log_->oldestSeq();
+    else if (timestamp == "now")
+      *seq = log_->nextSeq();
+    else {
+      char* endp = NULL;
+      *seq = strtoull(timestamp.c_str(), &endp, 10);
+      if (timestamp.empty() || *endp)
+        return false;
+    }
+    return true;
   }
 
  private:
-  void SeekTo(WT_LSN *lsn);
+  void Fetch();
   // No copying allowed
   ReplayIteratorImpl(const ReplayIterator&) { }
   void operator=(const ReplayIterator&) { }
-  OperationContext *context_;
+  DbImpl* db_;
+  ChangeLog* log_;
   Status status_;
-  WT_CURSOR *cursor_;
-  WT_ITEM key_, value_;
-  WT_LSN lsn_;
+  terark::ullong seq_; // seq of the current or the next change
+  std::vector<ChangeRecord> buf_; // read ahead of the log
+  size_t pos_;
+  std::string key_, value_;
+  size_t keyColumnId_, valColumnId_;
+  terark::db::ColumnVec cols_;
   bool valid_;
-  uint64_t txnid;
-  uint32_t fileid, opcount, optype, rectype;
+  bool lost_; // changes were dropped from the log before they were read
 };
 
+// read ahead changes from seq_, decode the first replayable one
+void
+ReplayIteratorImpl::Fetch() {
+	valid_ = false;
+	if (NULL == log_ || lost_)
+		return;
+	const terark::db::Schema& rowSchema = db_->m_tab->rowSchema();
+	for (;;) {
+		if (pos_ >= buf_.size()) {
+			buf_.clear();
+			pos_ = 0;
+			if (!log_->read(seq_, 256, &buf_)) {
+				lost_ = true;
+				status_ = Status::IOError("replay",
+				    "changes after the timestamp were dropped from the change log");
+				return;
+			}
+			if (buf_.empty())
+				return; // at the end, Valid() will try again
+		}
+		const ChangeRecord& rec = buf_[pos_];
+		seq_ = rec.seq;
+		if (!rec.row.empty()) {
+			rowSchema.parseRow(rec.row, &cols_);
+			if (keyColumnId_ < cols_.size()) {
+				key_ = cols_[keyColumnId_].str();
+				if (rec.op == ChangeOp::remove)
+					value_.clear();
+				else if (valColumnId_ < cols_.size())
+					value_ = cols_[valColumnId_].str();
+				else
+					value_ = rec.row;
+				valid_ = true;
+				return;
+			}
+		}
+		// the removed row could not be read, its key is unknown
+		pos_++;
+		seq_++;
+	}
+}
+
 bool
 ReplayIteratorImpl::Valid() {
 	// If we're invalid and at the end, try again.
-	if (valid_ == false && cursor_ != NULL && status_.IsNotFound())
-		Next();
+	if (!valid_ && status_.ok())
+		Fetch();
 	return valid_;
 }
 
 void
 ReplayIteratorImpl::Next() {
-	int ret = 0;
-
-	if (cursor_ != NULL) {
-		while ((ret = cursor_->next(cursor_)) == 0) {
-			ret = cursor_->get_key(cursor_,
-			    &lsn_.file, &lsn_.offset, &opcount);
-			if (ret != 0)
-				break;
-			ret = cursor_->get_value(cursor_,
-			    &txnid, &rectype, &optype, &fileid, &key_, &value_);
-			if (ret != 0)
-				break;
-			// Next() is only interested in modification operations.
-			// Continue for any other type of record.
-			if (WT_VALID_OPERATION(fileid, optype)) {
-				valid_ = true;
-				break;
-			}
-		}
-		status_ = WiredTigerErrorToStatus(ret);
-		if (ret != 0) {
-			valid_ = false;
-			if (ret != WT_NOTFOUND)
-				ret = Close();
-			else
-				ret = 0;
-			assert(ret == 0);
-		}
+	if (valid_) {
+		pos_++;
+		seq_++;
 	}
+	Fetch();
 }
 
 void
 ReplayIteratorImpl::SeekToLast() {
-	int ret = 0;
-	WT_LSN last_lsn;
-
-	last_lsn.file = 0;
-	if (cursor_ != NULL) {
-		// Walk the log to the end, then set the cursor on the
-		// last valid LSN we saw.
-		while ((ret = cursor_->next(cursor_)) == 0) {
-			ret = cursor_->get_key(cursor_,
-			    &lsn_.file, &lsn_.offset, &opcount);
-			if (ret != 0)
-				break;
-			ret = cursor_->get_value(cursor_,
-			    &txnid, &rectype, &optype, &fileid, &key_, &value_);
-			if (ret != 0)
-				break;
-			// We're only interested in modification operations.
-			// Continue for any other type of record.
-			if (WT_VALID_OPERATION(fileid, optype)) {
-				valid_ = true;
-				last_lsn = lsn_;
-			}
-		}
-		// We reached the end of log
-		if (ret != WT_NOTFOUND || last_lsn.file == 0) {
-			valid_ = false;
-			ret = Close();
-			assert(ret == 0);
-		} else
-			SeekTo(&last_lsn);
-	}
+	if (NULL == log_)
+		return;
+	terark::ullong next = log_->nextSeq();
+	buf_.clear();
+	pos_ = 0;
+	seq_ = next > log_->oldestSeq() ? next - 1 : next;
+	Fetch();
 }
 
 void
 ReplayIteratorImpl::SeekTo(const std::string& timestamp) {
-	WT_LSN target_lsn;
-	int ret = 0;
-
-	if (timestamp == "all") {
-		if (cursor_ != NULL) {
-			ret = cursor_->reset(cursor_);
-			status_ = WiredTigerErrorToStatus(ret);
-			if (ret != 0)
-				return;
-			Next();
-			return;
-		}
-	}
-	if (timestamp == "now") {
-		SeekToLast();
+	terark::ullong seq = 0;
+	if (!ParseTimestamp(timestamp, &seq)) {
+		valid_ = false;
+		if (status_.ok())
+			status_ = Status::InvalidArgument("replay", "bad timestamp: " + timestamp);
 		return;
 	}
-	sscanf(timestamp.c_str(), WT_TIMESTAMP_FORMAT,
-	    &target_lsn.file, &target_lsn.offset);
-	SeekTo(&target_lsn);
-}
-
-// Set the cursor on the first modification record at or after the
-// given LSN.
-void
-ReplayIteratorImpl::SeekTo(WT_LSN *target_lsn) {
-	int ret = 0;
-
-	valid_ = false;
-	if (cursor_ != NULL) {
-		cursor_->set_key(cursor_,
-		    target_lsn->file, target_lsn->offset, 0, 0);
-		ret = cursor_->search(cursor_);
-		status_ = WiredTigerErrorToStatus(ret);
-		if (ret != 0)
-			return;
-		// If we were successful, set up the info.
-		ret = cursor_->get_key(cursor_,
-		    &lsn_.file, &lsn_.offset, &opcount);
-		status_ = WiredTigerErrorToStatus(ret);
-		if (ret != 0)
-			return;
-		ret = cursor_->get_value(cursor_,
-		    &txnid, &rectype, &optype, &fileid, &key_, &value_);
-		status_ = WiredTigerErrorToStatus(ret);
-		if (ret != 0)
-			return;
-		valid_ = true;
-		// We're only interested in modification operations.
-		// Continue for any other type of record.
-		if (!WT_VALID_OPERATION(fileid, optype))
-			Next();
-	}
+	buf_.clear();
+	pos_ = 0;
+	seq_ = seq;
+	lost_ = false;
+	Fetch();
 }
 
 // Create a live backup of a live LevelDB instance.
 // The backup is stored in a directory named "backup-<name>" under the top
-// level of the open LevelDB database.  The implementation is permitted, and
-// even encouraged, to improve the performance of this call through
-// hard-links.
+// level of the open LevelDB database.  Files of readonly segments are hard
+// linked by DbTable::backupTo.
 Status
 DbImpl::LiveBackup(const Slice& name)
 {
-	OperationContext *context = GetContext();
-	WT_SESSION *session = context->GetSession();
-	WT_CURSOR *cursor;
-	int ret = session->open_cursor(
-            session, "backup:", NULL, NULL, &cursor);
-	int t_ret;
-	const char *filename;
-	const char *home = conn_->get_home(conn_);
-	char backup[MAXPATHLEN], buf[MAXPATHLEN * 2];
- 
-	// If we couldn't open the backup cursor, we're done.
-	if (ret != 0)
-		return (WiredTigerErrorToStatus(ret));
-
-	// Remove any old directory and create the backup directory.
-	// WT single-threads hot backups.  If we get here we already have
-	// the backup cursor open and we do not have to worry about other
-	// threads trying to remove and recreate the same directory out
-	// from under us.
-	snprintf(buf, sizeof(buf), "rm -rf %s/backup-%s", home,
-	    (char *)name.data());
-	if ((ret = system(buf)) != 0)
-		return WiredTigerErrorToStatus(ret);
-	snprintf(backup, sizeof(backup), "%s/backup-%s", home,
-	    (char *)name.data());
-	if ((ret = mkdir(backup, 0777)) != 0)
-		return WiredTigerErrorToStatus(ret);
-	// Copy all files returned by backup cursor.
-	while ((ret = cursor->next(cursor)) == 0 &&
-	    (ret = cursor->get_key(cursor, &filename)) == 0) {
-		snprintf(buf, sizeof(buf), "cp %s/%s %s/%s",
-		    home, filename, backup, filename);
-		if ((ret = system(buf)) != 0)
-			break;
+	fs::path backup = m_tab->getDir() / ("backup-" + name.ToString());
+	try {
+		fs::remove_all(backup);
+		m_tab->backupTo(backup);
 	}
-	if (ret == WT_NOTFOUND)
-		ret = 0;
-	if ((t_ret = cursor->close(cursor)) != 0 && ret == 0)
-		ret = t_ret;
-
-	return (WiredTigerErrorToStatus(ret));
+	catch (const std::exception& ex) {
+		return Status::IOError("LiveBackup", ex.what());
+	}
+	return Status::OK();
 }
 
 // Return an opaque timestamp that identifies the current point in time of the
@@ -347,12 +256,9 @@ DbImpl::LiveBackup(const Slice& name)
 void
 DbImpl::GetReplayTimestamp(std::string* timestamp)
 {
-	OperationContext *context = GetContext();
-	ReplayIteratorImpl *iter = new ReplayIteratorImpl(context);
-
-	iter->SeekToLast();
-	*timestamp = iter->GetTimestamp();
-	ReleaseReplayIterator(iter);
+	ReplayIteratorImpl iter(this);
+	iter.SeekTo("now");
+	*timestamp = iter.GetTimestamp();
 }
 
 // Set the lower bound for manual garbage collection.  This method only takes
@@ -362,38 +268,26 @@ DbImpl::AllowGarbageCollectBeforeTimestamp(const std::string& timestamp)
 {
 }
 
-// Validate the timestamp
+// Validate the timestamp, changes before the oldest one in the change log
+// are dropped
 bool
 DbImpl::ValidateTimestamp(const std::string& timestamp)
 {
-	bool valid;
-	OperationContext *context = GetContext();
-	ReplayIteratorImpl *iter = new ReplayIteratorImpl(context);
-
-	// The SeekTo function will handle "all" or "now".
-	iter->SeekTo(timestamp);
-	valid = iter->Valid();
-	ReleaseReplayIterator(iter);
-	return valid;
+	ReplayIteratorImpl iter(this);
+	terark::ullong seq = 0;
+	ChangeLog* log = m_tab->getChangeLog();
+	return iter.ParseTimestamp(timestamp, &seq) && seq >= log->oldestSeq();
 }
 
 // Compare two timestamps and return -1, 0, 1 for lt, eq, gt
 int
 DbImpl::CompareTimestamps(const std::string& lhs, const std::string& rhs)
 {
-	OperationContext *context = GetContext();
-	ReplayIteratorImpl *lhiter = new ReplayIteratorImpl(context);
-	ReplayIteratorImpl *rhiter = new ReplayIteratorImpl(context);
-	int cmp = 0;
-	
-	// The SeekTo function will handle "all" or "now".
-	lhiter->SeekTo(lhs);
-	rhiter->SeekTo(rhs);
-	if (lhiter->Valid() && rhiter->Valid())
-		cmp = lhiter->Compare(rhiter);
-	ReleaseReplayIterator(lhiter);
-	ReleaseReplayIterator(rhiter);
-	return cmp;
+	ReplayIteratorImpl iter(this);
+	terark::ullong lseq = 0, rseq = 0;
+	if (!iter.ParseTimestamp(lhs, &lseq) || !iter.ParseTimestamp(rhs, &rseq))
+		return 0;
+	return lseq < rseq ? -1 : lseq > rseq ? 1 : 0;
 }
 
 // Return a ReplayIterator that returns every write operation performed after
@@ -402,8 +296,7 @@ Status
 DbImpl::GetReplayIterator(const std::string& timestamp,
 			   ReplayIterator** iter)
 {
-	OperationContext *context = GetContext();
-	*iter = new ReplayIteratorImpl(context, timestamp);
+	*iter = new ReplayIteratorImpl(this, timestamp);
 	return ((*iter)->status());
 }
 
@@ -11,6 +11,7 @@
 #endif
 
 #include <memory>
+#include <string>
 #include <stddef.h>
 #include <terark/db/db_dll_decl.hpp>
 
@@ -21,6 +22,7 @@ class Comparator;
 class Env;
 class FilterPolicy;
 class Logger;
+class Slice;
 class Snapshot;
 
 // DB contents are stored in a set of blocks, each of which holds a
@@ -186,13 +188,54 @@ struct TERARK_DB_DLL Options {
   bool manual_garbage_collection;
 #endif
 
+#ifdef HAVE_ROCKSDB
+  // Semantics of DB::Merge and WriteBatch::Merge, Merge fails if NULL.
+  // Default: NULL
+  std::shared_ptr<const class MergeOperator> merge_operator;
+#endif
+
   // Create an Options object with default values for all fields.
   Options();
 };
 
 #ifdef HAVE_ROCKSDB
+// Merge is applied at once, there is no partial merge of operands.
+// Values of the same key are merged one by one under a lock of the key.
+class TERARK_DB_DLL MergeOperator {
+ public:
+  virtual ~MergeOperator();
+  virtual const char* Name() const = 0;
+
+  // existing_value is NULL if the key does not exist
+  // returns false if the operand or existing_value is corrupted
+  virtual bool FullMerge(const Slice& key, const Slice* existing_value,
+                         const Slice& operand, std::string* new_value) const = 0;
+
+  // If true, the value and operand are little endian 8 bytes integers and
+  // merge is their sum, then merging into an existing record whose value
+  // column is an inplace updatable int64 is just an inplace increment.
+  virtual bool IsInt64Add() const { return false; }
+};
+
+// The int64 add operator, IsInt64Add() is true
+TERARK_DB_DLL std::shared_ptr<const MergeOperator> NewInt64AddOperator();
+#endif
+
+#ifdef HAVE_ROCKSDB
+// A column family is a colgroup of the only DbTable, these options are
+// used just when the schema is generated by DB::Open with column families.
 struct TERARK_DB_DLL ColumnFamilyOptions : public Options {
-  ColumnFamilyOptions() : Options() {}
+  // If > 0, values of the column family are fixed length, the colgroup
+  // is a FixedLenStore, which is also inplace updatable.
+  // Default: 0
+  size_t value_fixed_len;
+
+  // A json object of extra colgroup options such as dictZipSampleRatio,
+  // it is merged into the generated colgroup config.
+  // Default: ""
+  std::string colgroup_options;
+
+  ColumnFamilyOptions() : Options(), value_fixed_len(0) {}
 };
 
 struct TERARK_DB_DLL DBOptions : public Options {
@@ -219,10 +262,30 @@ struct TERARK_DB_DLL ReadOptions {
   // Default: NULL
   const Snapshot* snapshot;
 
+  // If non-NULL, iterators only see keys less than *iterate_upper_bound,
+  // the Slice must be valid during the lifetime of the iterator.
+  // Default: NULL
+  const Slice* iterate_upper_bound;
+
+  // If non-NULL, iterators only see keys which start with *iterate_prefix,
+  // SeekToFirst/SeekToLast are positioned in the prefix, the Slice must be
+  // valid during the lifetime of the iterator.
+  // Default: NULL
+  const Slice* iterate_prefix;
+
+  // Forward iteration fetches values of the next prefetch_rows keys by
+  // one batch get, 0 is taken from env TerarkDB_IterPrefetchRows if
+  // fill_cache is false(bulk scan), else prefetching is disabled.
+  // Default: 0
+  size_t prefetch_rows;
+
   ReadOptions()
       : verify_checksums(false),
         fill_cache(true),
-        snapshot(NULL) {
+        snapshot(NULL),
+        iterate_upper_bound(NULL),
+        iterate_prefix(NULL),
+        prefetch_rows(0) {
   }
 };
 
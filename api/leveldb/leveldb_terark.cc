@@ -27,6 +27,7 @@
 
 #include "leveldb_terark.h"
 #include <errno.h>
+#include <algorithm>
 #include <sstream>
 #include <stdint.h>
 #include <terark/stdtypes.hpp>
@@ -283,7 +284,11 @@ DB::Open(const Options &options, const std::string &name, leveldb::DB** dbptr) {
 		return Status::InvalidArgument("dbmeta.json is missing", dbdir.string());
 	}
 	try {
-		*dbptr = new DbImpl(dbdir);
+		DbImpl* db = new DbImpl(dbdir);
+#ifdef HAVE_ROCKSDB
+		db->m_mergeOperator = options.merge_operator;
+#endif
+		*dbptr = db;
 		return Status::OK();
 	}
 	catch (const std::exception& ex) {
@@ -294,15 +299,6 @@ DB::Open(const Options &options, const std::string &name, leveldb::DB** dbptr) {
 }
 } // namespace leveldb
 
-DbImpl::DbImpl(const fs::path& dbdir) {
-	m_tab = terark::db::DbTable::open(dbdir);
-}
-
-DbImpl::~DbImpl() {
-  // m_tab destruct must after m_ctx destruct
-  BOOST_STATIC_ASSERT(offsetof(DbImpl, m_tab) < offsetof(DbImpl, m_ctx));
-}
-
 static void
 encodeKeyVal(terark::valvec<unsigned char>& buf,
 			 const Slice& key, const Slice& val) {
@@ -382,38 +378,359 @@ void WriteBatchHandler::Delete(const Slice& key) {
 	}
 }
 
+namespace {
+struct BatchOp {
+	Slice key;
+	Slice val;
+	bool  isDel;
+	bool  isMerge;
+	uint32_t cgId; // 0 is the default column family
+};
+// collect ops of a WriteBatch, the slices point into the batch
+class CollectBatchHandler : public WriteBatch::Handler {
+public:
+	std::vector<BatchOp>& ops;
+	explicit CollectBatchHandler(std::vector<BatchOp>* v) : ops(*v) {}
+	void Put(const Slice& key, const Slice& value) override {
+		ops.push_back(BatchOp{key, value, false, false, 0});
+	}
+	void Delete(const Slice& key) override {
+		ops.push_back(BatchOp{key, Slice(), true, false, 0});
+	}
+#ifdef HAVE_ROCKSDB
+	// column family id is the colgroup id, see DB::Open
+	Status PutCF(uint32_t column_family_id, const Slice& key, const Slice& value) override {
+		ops.push_back(BatchOp{key, value, false, false, column_family_id});
+		return Status::OK();
+	}
+	Status DeleteCF(uint32_t column_family_id, const Slice& key) override {
+		ops.push_back(BatchOp{key, Slice(), true, false, column_family_id});
+		return Status::OK();
+	}
+	Status MergeCF(uint32_t column_family_id, const Slice& key, const Slice& value) override {
+		ops.push_back(BatchOp{key, value, false, true, column_family_id});
+		return Status::OK();
+	}
+#endif
+};
+} // namespace
+
+// ops of a batch are kept for the next batch of the thread unless the
+// capacity is larger than it
+static const size_t g_maxPooledBatchOps =
+	terark::getEnvLong("TerarkLevelDB_maxPooledBatchOps", 64 * 1024);
+
+// the DbContext is synced lazily by its users, OperationContext and the
+// scratch of Write are kept with their capacities
+struct DbImpl::ThreadContext {
+	DbContextPtr ctx;
+	std::unique_ptr<OperationContext> opctx;
+	std::vector<BatchOp> ops;
+	terark::valvec<terark::fstring> delKeys;
+	terark::valvec<size_t> offsets;
+	unsigned long long hits = 0; // not yet flushed to m_ctxPoolHits
+};
+
+DbImpl::DbImpl(const fs::path& dbdir)
+  : m_ctxPoolHits(0), m_ctxPoolMisses(0) {
+	m_tab = terark::db::DbTable::open(dbdir);
+	// colgroup 1 in the key-value schema, a user defined schema may have
+	// column "val" in any colgroup
+	m_defaultCgId = 1;
+	size_t valColumnId = m_tab->getColumnId("val");
+	if (valColumnId < m_tab->rowSchema().columnNum()) {
+		m_defaultCgId = m_tab->getSchemaConfig().m_colproject[valColumnId].colgroupId;
+	}
+#ifdef HAVE_HYPERLEVELDB
+	// replay iterators read the change log
+	m_tab->enableChangeLog(
+		terark::getEnvLong("TerarkLevelDB_replayLogRecords", 1L << 20),
+		terark::getEnvLong("TerarkLevelDB_replayLogBytes", 256L << 20));
+#endif
+}
+
+DbImpl::~DbImpl() {
+  // m_tab destruct must after m_ctx destruct
+  BOOST_STATIC_ASSERT(offsetof(DbImpl, m_tab) < offsetof(DbImpl, m_ctx));
+}
+
 // Apply the specified updates to the database.
 // Returns OK on success, non-OK on failure.
 // Note: consider setting options.sync = true.
+//
+// The batch is sorted by key and deduped(last write wins), so each key is
+// applied at most once and index updates are in key order. Existence of
+// all deleted keys is checked by one indexSearchExactBatch.
+// Merges of a key are applied in order after its last put/delete.
+// Ops of column families in a multi column family row are applied by
+// PutColumn one by one after the plain (key, val) rows.
+// Rows are applied one by one, the batch is not atomic.
 Status
 DbImpl::Write(const WriteOptions& options, WriteBatch* updates) {
-  Status status = Status::OK();
-  std::unique_ptr<OperationContext> context(GetContext());
-  WriteBatchHandler handler(context.get());
-#if 0
-  status = updates->Iterate(&handler);
-#else
-  try {
-    status = updates->Iterate(&handler);
-  } catch(...) {
-    context->m_batchWriter.rollback();
-    throw;
+  ThreadContext& tc = GetThreadContext();
+  if (tc.ops.capacity() > g_maxPooledBatchOps)
+    std::vector<BatchOp>().swap(tc.ops); // release memory of a huge batch
+  else
+    tc.ops.clear();
+  CollectBatchHandler handler(&tc.ops);
+  Status status = updates->Iterate(&handler);
+  if (!status.ok()) {
+    return status;
+  }
+  auto& ops = handler.ops;
+  for (BatchOp& op : ops) {
+    if (0 == op.cgId)
+      op.cgId = uint32_t(m_defaultCgId);
+  }
+  std::stable_sort(ops.begin(), ops.end(),
+    [](const BatchOp& x, const BatchOp& y) {
+      int c = x.key.compare(y.key);
+      return c < 0 || (c == 0 && x.cgId < y.cgId);
+    });
+  size_t n = 0;
+  for (size_t i = 0; i < ops.size(); ) {
+    // ops before the last put/delete of the key are overwritten by it,
+    // merges after it are kept in order
+    size_t end = i + 1, last = i;
+    while (end < ops.size() && ops[end].key == ops[i].key &&
+           ops[end].cgId == ops[i].cgId) {
+      if (!ops[end].isMerge)
+        last = end;
+      ++end;
+    }
+    while (last < end)
+      ops[n++] = ops[last++];
+    i = end;
   }
+  ops.resize(n);
+  terark::db::DbContext* ctx = tc.ctx.get();
+  assert(NULL != ctx);
+  auto& delKeys = tc.delKeys;
+  delKeys.erase_all();
+  for (const BatchOp& op : ops) {
+    if (op.isDel && !op.isMerge && IsKeyValueRow(op.cgId))
+      delKeys.push_back(terark::fstring(op.key.data(), op.key.size()));
+  }
+  size_t removeNotFound = 0;
+  try {
+    if (!delKeys.empty()) {
+      auto& offsets = tc.offsets;
+      auto& recIdvec = ctx->exactMatchRecIdvec;
+      ctx->indexSearchExactBatch(0, delKeys.data(), delKeys.size(), &recIdvec, &offsets);
+      for (size_t i = 0; i < delKeys.size(); ++i) {
+        if (offsets[i] < offsets[i+1]) {
+          try {
+            ctx->removeRow(recIdvec[offsets[i]]);
+          }
+          catch (const std::exception&) {
+            removeNotFound++; // removed concurrently
+          }
+        }
+        else {
+          removeNotFound++;
+          if (g_logBatchRemoveNotFound >= 2)
+            fprintf(stderr, "ERROR: Delete(key = %s), NotFound\n", escape(delKeys[i]).c_str());
+        }
+      }
+    }
+    auto userBuf = ctx->bufs.get();
+    {
+      // non-unique index keys of the rows are inserted by one insertBatch
+      terark::db::IndexBatchScope indexBatch(ctx->m_tab, ctx);
+      for (const BatchOp& op : ops) {
+        if (op.isDel || op.isMerge || !IsKeyValueRow(op.cgId))
+          continue;
+        TRACE_KEY_VAL(op.key, op.val);
+        encodeKeyVal(*userBuf, op.key, op.val);
+        long long recId = ctx->upsertRow(*userBuf);
+        TERARK_RT_assert(recId >= 0, std::logic_error);
+      }
+    }
+#ifdef HAVE_ROCKSDB
+    for (const BatchOp& op : ops) {
+      if (op.isMerge || IsKeyValueRow(op.cgId))
+        continue;
+      Status s = PutColumn(ctx, op.cgId, op.key, op.isDel ? NULL : &op.val);
+      if (!s.ok())
+        return s;
+    }
+    // after the put/delete of the same key
+    for (const BatchOp& op : ops) {
+      if (!op.isMerge)
+        continue;
+      Status s = MergeOne(ctx, op.cgId, op.key, op.val);
+      if (!s.ok())
+        return s;
+    }
 #endif
-  if (context->m_batchWriter.commit()) {
-    if (g_logBatchRemoveNotFound >= 1 && context->m_removeNotFound) {
-      fprintf(stderr, "ERROR: DB BatchWrite success, but removeNotFound = %zd", context->m_removeNotFound);
-	}
-	return status;
   }
-  else {
-    if (g_logBatchRemoveNotFound >= 1 && context->m_removeNotFound) {
-     fprintf(stderr, "ERROR: DB BatchWrite failed, and removeNotFound = %zd", context->m_removeNotFound);
-	}
-	return Status::InvalidArgument("Commit BatchWriter failed", context->m_batchWriter.strError());
+  catch (const std::exception& ex) {
+    return Status::Corruption("DbImpl::Write failed", ex.what());
+  }
+  if (g_logBatchRemoveNotFound >= 1 && removeNotFound) {
+    fprintf(stderr, "ERROR: DB BatchWrite success, but removeNotFound = %zd\n", removeNotFound);
   }
+  return Status::OK();
 }
 
+#ifdef HAVE_ROCKSDB
+// An int64 add into an existing record is pushed down to an inplace
+// incrementColumnValue if the value colgroup is one inplace updatable int64
+// column, others are read-modify-write under the lock of the key.
+Status
+DbImpl::MergeOne(terark::db::DbContext* ctx, size_t cgId,
+				 const Slice& key, const Slice& operand) {
+  if (!m_mergeOperator) {
+    return Status::NotSupported("DB::Merge", "Options.merge_operator is NULL");
+  }
+  using terark::db::ColumnType;
+  const auto& sconf = m_tab->getSchemaConfig();
+  if (cgId >= sconf.getColgroupNum()) {
+    return Status::InvalidArgument("DB::Merge", "bad column family id");
+  }
+  std::lock_guard<std::mutex> lock(KeyLock(key));
+  try {
+    ctx->indexSearchExact(0, key, &ctx->exactMatchRecIdvec);
+    long long recId = -1;
+    if (!ctx->exactMatchRecIdvec.empty())
+      recId = ctx->exactMatchRecIdvec[0];
+    const terark::db::Schema& cgSchema = sconf.getColgroupSchema(cgId);
+    if (recId >= 0 && m_mergeOperator->IsInt64Add() &&
+        cgSchema.columnNum() == 1 && cgSchema.m_isInplaceUpdatable &&
+        (cgSchema.getColumnType(0) == ColumnType::Sint64 ||
+         cgSchema.getColumnType(0) == ColumnType::Uint64)) {
+      if (operand.size() != 8) {
+        return Status::InvalidArgument("DB::Merge", "int64 operand size is not 8");
+      }
+      size_t columnId = m_tab->getColumnId(cgSchema.getColumnName(0));
+      long long incVal = unaligned_load<int64_t>(operand.data());
+      m_tab->incrementColumnValue(recId, columnId, incVal, ctx);
+      return Status::OK();
+    }
+    // read-modify-write of the value or the column family
+    if (!IsKeyValueRow(cgId) && cgSchema.columnNum() != 1) {
+      return Status::NotSupported("DB::Merge", "colgroup is not a column family");
+    }
+    auto userBuf = ctx->bufs.get();
+    std::string newVal;
+    bool merged;
+    if (recId >= 0) {
+      terark::fstring oldVal = ctx->selectOneColgroupRef(recId, cgId, userBuf.get());
+      Slice existing(oldVal.data(), oldVal.size());
+      merged = m_mergeOperator->FullMerge(key, &existing, operand, &newVal);
+    }
+    else {
+      merged = m_mergeOperator->FullMerge(key, NULL, operand, &newVal);
+    }
+    if (!merged) {
+      return Status::Corruption("DB::Merge", m_mergeOperator->Name());
+    }
+    if (!IsKeyValueRow(cgId)) {
+      Slice newSlice(newVal);
+      return PutColumnNoLock(ctx, cgId, key, &newSlice);
+    }
+    encodeKeyVal(*userBuf, key, newVal);
+    recId = ctx->upsertRow(*userBuf);
+    TERARK_RT_assert(recId >= 0, std::logic_error);
+    return Status::OK();
+  }
+  catch (const std::exception& ex) {
+    return Status::Corruption("DB::Merge failed", ex.what());
+  }
+}
+
+std::mutex& DbImpl::KeyLock(const Slice& key) {
+  size_t h = std::hash<std::string>()(std::string(key.data(), key.size()));
+  return m_mergeLocks[h % 64];
+}
+
+// A row of column families is (key, column of cf1, column of cf2, ...),
+// each column family is a one column colgroup. Put or delete of a column
+// family is a read-modify-write of the row under the lock of the key:
+// other column families of a new row are empty(zeros for fixed length),
+// and the row is removed when all of its column families are empty.
+Status
+DbImpl::PutColumn(terark::db::DbContext* ctx, size_t cgId,
+				  const Slice& key, const Slice* value) {
+  std::lock_guard<std::mutex> lock(KeyLock(key));
+  return PutColumnNoLock(ctx, cgId, key, value);
+}
+
+Status
+DbImpl::PutColumnNoLock(terark::db::DbContext* ctx, size_t cgId,
+						const Slice& key, const Slice* value) {
+  using terark::fstring;
+  const auto& sconf = m_tab->getSchemaConfig();
+  if (cgId < sconf.getIndexNum() || cgId >= sconf.getColgroupNum()) {
+    return Status::InvalidArgument("DB::Put", "bad column family id");
+  }
+  const terark::db::Schema& cgSchema = sconf.getColgroupSchema(cgId);
+  if (cgSchema.columnNum() != 1) {
+    return Status::NotSupported("DB::Put", "colgroup is not a column family");
+  }
+  const terark::db::Schema& rowSchema = m_tab->rowSchema();
+  const size_t keyColumnId = m_tab->getColumnId(sconf.getIndexSchema(0).getColumnName(0));
+  const size_t columnId = m_tab->getColumnId(cgSchema.getColumnName(0));
+  const size_t fixedLen = rowSchema.getColumnMeta(columnId).fixedLen;
+  if (value && fixedLen && value->size() != fixedLen) {
+    return Status::InvalidArgument("DB::Put", "value size is not the fixed length of column family");
+  }
+  try {
+    ctx->indexSearchExact(0, key, &ctx->exactMatchRecIdvec);
+    long long recId = -1;
+    if (!ctx->exactMatchRecIdvec.empty())
+      recId = ctx->exactMatchRecIdvec[0];
+    if (recId < 0 && !value)
+      return Status::OK();
+    terark::valvec<unsigned char> oldRow;
+    terark::db::ColumnVec oldCols;
+    if (recId >= 0) {
+      ctx->getValue(recId, &oldRow);
+      rowSchema.parseRow(oldRow, &oldCols);
+    }
+    // columns are concatenated into newData, then combined into the row
+    terark::valvec<unsigned char> newData;
+    terark::db::ColumnVec newCols;
+    bool allEmpty = true;
+    for (size_t i = 0; i < rowSchema.columnNum(); ++i) {
+      fstring col;
+      if (i == keyColumnId)
+        col = fstring(key.data(), key.size());
+      else if (i == columnId)
+        col = value ? fstring(value->data(), value->size()) : fstring();
+      else if (recId >= 0)
+        col = oldCols[i];
+      const size_t colFixedLen = rowSchema.getColumnMeta(i).fixedLen;
+      const size_t pos = newData.size();
+      if (col.empty() && colFixedLen)
+        newData.resize(pos + colFixedLen, 0);
+      else
+        newData.append(col.udata(), col.size());
+      if (i != keyColumnId && allEmpty) {
+        allEmpty = std::all_of(newData.begin() + pos, newData.end(),
+                               [](unsigned char c) { return 0 == c; })
+                   && (colFixedLen || newData.size() == pos);
+      }
+      newCols.push_back(pos, newData.size() - pos);
+    }
+    if (allEmpty) {
+      if (recId >= 0)
+        ctx->removeRow(recId);
+      return Status::OK();
+    }
+    newCols.m_base = newData.data();
+    auto userBuf = ctx->bufs.get();
+    rowSchema.combineRow(newCols, userBuf.get());
+    recId = ctx->upsertRow(*userBuf);
+    TERARK_RT_assert(recId >= 0, std::logic_error);
+    return Status::OK();
+  }
+  catch (const std::exception& ex) {
+    return Status::Corruption("DB::Put column family failed", ex.what());
+  }
+}
+#endif
+
 // If the database contains an entry for "key" store the
 // corresponding value in *value and return OK.
 //
@@ -425,17 +742,18 @@ Status
 DbImpl::Get(const ReadOptions& options, const Slice& key, std::string* value) {
   terark::db::DbContext* ctx = GetDbContext();
   assert(NULL != ctx);
+  SnapshotScope snapshot(ctx, options.snapshot);
   auto userBuf = ctx->bufs.get();
   ctx->indexSearchExact(0, key, &ctx->exactMatchRecIdvec);
-  if (!ctx->exactMatchRecIdvec.empty()) {
+  if (!ctx->exactMatchRecIdvec.empty() &&
+	  snapshot.IsVisible(ctx->exactMatchRecIdvec[0])) {
 	  auto recId = ctx->exactMatchRecIdvec[0];
 	  try {
-		  ctx->selectOneColgroup(recId, 1, userBuf.get());
+		  terark::fstring val = ctx->selectOneColgroupRef(recId, m_defaultCgId, userBuf.get());
 	//	  fprintf(stderr
 	//		, "DEBUG: recId=%lld, colgroup[1]={size=%zd, content=%.*s}\n"
-	//		, recId, ctx->userBuf.size(), (int)ctx->userBuf.size(), ctx->userBuf.data());
-		  value->resize(0);
-		  value->append((char*)userBuf->data(), userBuf->size());
+	//		, recId, val.size(), (int)val.size(), val.data());
+		  value->assign(val.data(), val.size());
 		  return Status::OK();
 	  }
 	  catch (const std::exception&) {
@@ -484,21 +802,19 @@ err:
 // The returned iterator should be deleted before this db is deleted.
 Iterator*
 DbImpl::NewIterator(const ReadOptions& options) {
-	return new IteratorImpl(m_tab.get());
-}
-
-SnapshotImpl::SnapshotImpl(DbImpl *db) :
-    Snapshot(), db_(db), context_(db->NewContext()), status_(Status::OK())
-{
+	return new IteratorImpl(m_tab.get(), options, m_defaultCgId);
 }
 
 // Return a handle to the current DB state.  Iterators created with
 // this handle will all observe a stable snapshot of the current DB
 // state.  The caller must call ReleaseSnapshot(result) when the
 // snapshot is no longer needed.
+//
+// The snapshot is just a version, reads by it hide rows inserted after
+// it, and rows deleted after it are still visible if the schema has
+// "EnableSnapshot". Values updated inplace are not versioned.
 const Snapshot* DbImpl::GetSnapshot() {
-  THROW_STD(invalid_argument, "terark-db-leveldb-api doesn't support snapshot");
-  return NULL;
+  return new SnapshotImpl(m_tab->acquireSnapshot());
 }
 
 // Release a previously acquired snapshot.  The caller must not
@@ -506,14 +822,9 @@ const Snapshot* DbImpl::GetSnapshot() {
 void
 DbImpl::ReleaseSnapshot(const Snapshot* snapshot)
 {
-  THROW_STD(invalid_argument, "terark-db-leveldb-api doesn't support snapshot");
-  SnapshotImpl *si =
-    static_cast<SnapshotImpl*>(const_cast<Snapshot*>(snapshot));
+  auto si = static_cast<const SnapshotImpl*>(snapshot);
   if (si != NULL) {
-    // We started a transaction: we could commit it here, but it will be rolled
-    // back automatically by closing the session, which we have to do anyway.
-    int ret = si->GetContext()->Close();
-    TERARK_RT_assert(ret == 0, std::logic_error);
+    m_tab->releaseSnapshot(si->GetVersion());
     delete si;
   }
 }
@@ -532,10 +843,129 @@ DbImpl::ReleaseSnapshot(const Snapshot* snapshot)
 //     about the internal operation of the DB.
 //  "leveldb.sstables" - returns a multi-line string that describes all
 //     of the sstables that make up the db contents.
+//
+// prefix "leveldb." and "rocksdb." are both accepted, rocksdb names are
+// mapped to similar segment stats: mem tables are writable segments,
+// sst files are readonly segments. "terarkdb.*" are the raw stats.
 bool
 DbImpl::GetProperty(const Slice& property, std::string* value)
 {
-  /* Not supported */
+  using terark::db::DbTable;
+  Slice name = property;
+  if (name.starts_with("leveldb."))
+    name.remove_prefix(8);
+  else if (name.starts_with("rocksdb."))
+    name.remove_prefix(8);
+  else if (name.starts_with("terarkdb."))
+    name.remove_prefix(9);
+  else
+    return false;
+  terark::db::TableSegmentStat seg;
+  m_tab->getSegmentStat(&seg);
+  terark::db::FlushQueueStat flush;
+  DbTable::getFlushQueueStat(&flush);
+  const size_t compressQueued = DbTable::getCompressQueueSize();
+  const size_t bgTasks = m_tab->getBackgroundTaskNum();
+  const double delRatio = seg.rows ? double(seg.deletedRows) / seg.rows : 0.0;
+  const bool throttled = m_tab->isWriteThrottled();
+  char buf[2048];
+  auto setNum = [&](unsigned long long x) {
+    snprintf(buf, sizeof(buf), "%llu", x);
+    value->assign(buf);
+    return true;
+  };
+  auto setReal = [&](double x) {
+    snprintf(buf, sizeof(buf), "%f", x);
+    value->assign(buf);
+    return true;
+  };
+  if (name == "stats") {
+    snprintf(buf, sizeof(buf),
+      "segments: readonly = %zd, writable = %zd, frozen writable = %zd\n"
+      "bytes: writable = %lld, index = %lld, store = %lld\n"
+      "rows: total = %lld, deleted = %lld, deleted ratio = %f\n"
+      "flush queue: threads = %zd, queued = %zd, running = %zd, tables = %zd\n"
+      "compress queue: queued = %zd, table background tasks = %zd\n"
+      "write amplification = %f, write throttled = %d\n"
+      , seg.readonlySegNum, seg.writableSegNum, seg.frozenWritableSegNum
+      , seg.writableSegBytes, seg.indexBytes, seg.storeBytes
+      , seg.rows, seg.deletedRows, delRatio
+      , flush.threadNum, flush.queuedNum, flush.runningNum, flush.tableNum
+      , compressQueued, bgTasks
+      , m_tab->getWriteAmplification(), int(throttled));
+    value->assign(buf);
+    return true;
+  }
+  if (name == "context-pool") {
+    // hits of each thread are counted in batches of 1024
+    snprintf(buf, sizeof(buf), "hits = %llu, misses = %llu\n"
+      , m_ctxPoolHits.load(std::memory_order_relaxed)
+      , m_ctxPoolMisses.load(std::memory_order_relaxed));
+    value->assign(buf);
+    return true;
+  }
+  if (name == "memory" || name == "memory-resident") {
+    terark::db::TableMemoryStat mem;
+    m_tab->getMemoryStat(&mem, name == "memory-resident");
+    snprintf(buf, sizeof(buf),
+      "writable: store = %lld, index = %lld\n"
+      "readonly: store = %lld, index = %lld\n"
+      "readonly files: store = %lld(resident %lld), index = %lld(resident %lld)\n"
+      "bitmaps = %lld, value cache = %lld, unique key filter = %lld\n"
+      "contexts: num = %lld, bytes = %lld, iterators = %lld\n"
+      "total: heap = %lld, virtual = %lld, resident = %lld\n"
+      , mem.writableStoreBytes, mem.writableIndexBytes
+      , mem.readonlyStoreBytes, mem.readonlyIndexBytes
+      , mem.readonlyStoreFileBytes, mem.readonlyStoreResident
+      , mem.readonlyIndexFileBytes, mem.readonlyIndexResident
+      , mem.bitmapBytes, mem.valueCacheBytes, mem.uniqKeyFilterBytes
+      , mem.contextNum, mem.contextBytes, mem.contextIterNum
+      , mem.heapBytes(), mem.virtualBytes(), mem.residentBytes());
+    value->assign(buf);
+    return true;
+  }
+  // rocksdb compatible
+  if (name == "estimate-num-keys")
+    return setNum(seg.rows - seg.deletedRows);
+  if (name == "num-immutable-mem-table")
+    return setNum(seg.frozenWritableSegNum);
+  if (name == "cur-size-all-mem-tables" || name == "size-all-mem-tables")
+    return setNum(seg.writableSegBytes);
+  if (name == "mem-table-flush-pending")
+    return setNum(flush.queuedNum + flush.runningNum ? 1 : 0);
+  if (name == "num-running-flushes")
+    return setNum(flush.runningNum);
+  if (name == "compaction-pending")
+    return setNum(bgTasks ? 1 : 0);
+  if (name == "estimate-table-readers-mem")
+    return setNum(seg.indexBytes);
+  if (name == "total-sst-files-size" || name == "estimate-live-data-size")
+    return setNum(seg.indexBytes + seg.storeBytes - seg.writableSegBytes);
+  if (name == "is-write-stopped")
+    return setNum(throttled ? 1 : 0);
+  // terark db stats
+  if (name == "readonly-segments")
+    return setNum(seg.readonlySegNum);
+  if (name == "writable-segments")
+    return setNum(seg.writableSegNum);
+  if (name == "writable-segment-bytes")
+    return setNum(seg.writableSegBytes);
+  if (name == "index-bytes")
+    return setNum(seg.indexBytes);
+  if (name == "store-bytes")
+    return setNum(seg.storeBytes);
+  if (name == "deleted-ratio")
+    return setReal(delRatio);
+  if (name == "pending-flush-tasks")
+    return setNum(flush.queuedNum);
+  if (name == "pending-compress-tasks")
+    return setNum(compressQueued);
+  if (name == "background-tasks")
+    return setNum(bgTasks);
+  if (name == "write-amplification")
+    return setReal(m_tab->getWriteAmplification());
+  if (name == "write-throttled")
+    return setNum(throttled ? 1 : 0);
   return false;
 }
 
@@ -550,11 +980,27 @@ DbImpl::GetProperty(const Slice& property, std::string* value)
 void
 DbImpl::GetApproximateSizes(const Range* range, int n, uint64_t* sizes)
 {
-  int i;
-
-  /* XXX Not supported */
-  for (i = 0; i < n; i++)
-    sizes[i] = 1;
+  // by rank of range bounds in key index of each segment, data is not read
+  terark::db::DbContext* ctx = GetDbContext();
+  assert(NULL != ctx);
+  for (int i = 0; i < n; i++) {
+    const Slice& start = range[i].start;
+    const Slice& limit = range[i].limit;
+    if (start.compare(limit) >= 0) {
+      sizes[i] = 0;
+      continue;
+    }
+    try {
+      terark::llong bytes = ctx->indexApproximateRangeSize(0,
+          terark::fstring(start.data(), start.size()),
+          terark::fstring(limit.data(), limit.size()));
+      sizes[i] = uint64_t(std::max<terark::llong>(bytes, 0));
+    }
+    catch (const std::exception& ex) {
+      fprintf(stderr, "WARN: %s: %s\n", BOOST_CURRENT_FUNCTION, ex.what());
+      sizes[i] = 0;
+    }
+  }
 }
 
 // Compact the underlying storage for the key range [*begin,*end].
@@ -573,59 +1019,108 @@ DbImpl::CompactRange(const Slice* begin, const Slice* end)
   // The compact doesn't need a cursor, but the context always opens a
   // cursor when opening the session - so grab that, and use the session.
   fprintf(stderr, "INFO: %s\n", BOOST_CURRENT_FUNCTION);
-  m_tab->compact();
+  terark::fstring lo, hi;
+  std::string hiBuf;
+  if (begin)
+    lo = terark::fstring(begin->data(), begin->size());
+  if (end) {
+    // end is inclusive, compactRange's hi is exclusive
+    hiBuf.assign(end->data(), end->size());
+    hiBuf.push_back('\0');
+    hi = hiBuf;
+  }
+  m_tab->compactRange(0, lo, hi);
 }
 
 // Suspends the background compaction thread.  This methods
 // returns once suspended.
 void DbImpl::SuspendCompactions()
 {
-  fprintf(stderr, "ERROR: Not supported and ignored: %s\n", BOOST_CURRENT_FUNCTION);
+  m_tab->suspendCompaction();
 }
 
 // Resumes a suspended background compaction thread.
 void DbImpl::ResumeCompactions()
 {
-  fprintf(stderr, "ERROR: Not supported and ignored: %s\n", BOOST_CURRENT_FUNCTION);
+  m_tab->resumeCompaction();
 }
 
 OperationContext* DbImpl::GetContext() {
-	return new OperationContext(m_tab.get(), GetDbContext());
+	ThreadContext& tc = GetThreadContext();
+	if (tc.opctx)
+		tc.opctx->Reset();
+	else
+		tc.opctx.reset(new OperationContext(m_tab.get(), tc.ctx.get()));
+	return tc.opctx.get();
 }
 
+// snapshot is applied to DbContext by SnapshotScope, not here
 OperationContext* DbImpl::GetContext(const ReadOptions &options) {
-  if (options.snapshot == NULL) {
-    return GetContext();
-  }
-  THROW_STD(invalid_argument,
-    "terark-db-leveldb-api doesn't support snapshot, "
-    "ReadOptions.snapshot should alsway be NULL"
-    );
-  auto si = static_cast<const SnapshotImpl*>(options.snapshot);
-  assert(si->GetStatus().ok());
-  return si->GetContext();
+  return GetContext();
 }
 
-terark::db::DbContext* DbImpl::GetDbContext() {
-  DbContextPtr& refctx = m_ctx.local();
-  if (!refctx) {
-	refctx.reset(m_tab->createDbContext());
-    if (terark::getEnvBool("TerarkDB_TrackBuggyObjectLife")) {
-	  fprintf(stderr, "DEBUG: thread DbContext object number = %zd\n", m_ctx.size());
+// hits are flushed to the shared counter in batches, so the counter is
+// not a contended cache line of all threads
+DbImpl::ThreadContext& DbImpl::GetThreadContext() {
+  std::unique_ptr<ThreadContext>& tc = m_ctx.local();
+  if (terark_likely(tc != nullptr)) {
+    if (++tc->hits == 1024) {
+      m_ctxPoolHits.fetch_add(tc->hits, std::memory_order_relaxed);
+      tc->hits = 0;
     }
+    return *tc;
+  }
+  tc.reset(new ThreadContext());
+  tc->ctx.reset(m_tab->createDbContext());
+  m_ctxPoolMisses.fetch_add(1, std::memory_order_relaxed);
+  if (terark::getEnvBool("TerarkDB_TrackBuggyObjectLife")) {
+    fprintf(stderr, "DEBUG: thread DbContext object number = %zd\n", m_ctx.size());
   }
-  return refctx.get();
+  return *tc;
+}
+
+terark::db::DbContext* DbImpl::GetDbContext() {
+  return GetThreadContext().ctx.get();
 }
 
 std::atomic<size_t> g_iterLiveCnt;
 std::atomic<size_t> g_iterCreatedCnt;
 
-IteratorImpl::IteratorImpl(terark::db::DbTable *db) {
+static const long g_iterPrefetchRows =
+	terark::getEnvLong("TerarkDB_IterPrefetchRows", 64);
+
+IteratorImpl::IteratorImpl(terark::db::DbTable *db, const ReadOptions& options,
+						   size_t cgId) {
 	m_tab = db;
 	m_ctx = db->createDbContext();
+	m_cgId = cgId;
+	if (options.snapshot) {
+		// on the iterator's own DbContext, see DbImpl::GetSnapshot
+		m_ctx->setSnapshot(static_cast<const SnapshotImpl*>(options.snapshot)->GetVersion());
+	}
 	m_recId = -1;
 	m_valid = false;
 	m_direction = Direction::forward;
+	m_prefetchRows = options.prefetch_rows;
+	if (0 == m_prefetchRows && !options.fill_cache) {
+		m_prefetchRows = size_t(std::max(g_iterPrefetchRows, 0L));
+	}
+	m_prefetchPos = 0;
+	m_prefetchEof = false;
+	if (options.iterate_prefix) {
+		m_prefix.assign(options.iterate_prefix->data(), options.iterate_prefix->size());
+		// the min key greater than all keys with the prefix
+		m_upperBound = m_prefix;
+		while (!m_upperBound.empty() && (unsigned char)m_upperBound.back() == 0xFF)
+			m_upperBound.pop_back();
+		if (!m_upperBound.empty())
+			m_upperBound.back()++;
+	}
+	if (options.iterate_upper_bound) {
+		std::string ub(options.iterate_upper_bound->data(), options.iterate_upper_bound->size());
+		if (m_upperBound.empty() || ub < m_upperBound)
+			m_upperBound.swap(ub);
+	}
 	g_iterLiveCnt++;
 	g_iterCreatedCnt++;
     if (terark::getEnvBool("TerarkDB_TrackBuggyObjectLife")) {
@@ -641,11 +1136,82 @@ IteratorImpl::~IteratorImpl() {
 	g_iterLiveCnt--;
 }
 
+bool IteratorImpl::isOutOfBound(terark::fstring key) const {
+	if (!m_upperBound.empty() && !(key < terark::fstring(m_upperBound)))
+		return true;
+	if (!m_prefix.empty() && !key.startsWith(m_prefix))
+		return true;
+	return false;
+}
+
+// fill prefetch buffer by next m_prefetchRows keys of m_iter, and their
+// values by one batch get, keys whose values fail to read are skipped
+void IteratorImpl::prefetch() {
+	m_prefetchIds.erase_all();
+	m_prefetchPos = 0;
+	m_prefetchKeys.resize(m_prefetchRows);
+	m_prefetchVals.resize(m_prefetchRows);
+	size_t n = 0;
+	while (n < m_prefetchRows) {
+		long long recId;
+		if (!m_iter->increment(&recId, &m_prefetchKeys[n]) ||
+				isOutOfBound(m_prefetchKeys[n])) {
+			m_prefetchEof = true; // needn't to scan more
+			break;
+		}
+		m_prefetchIds.push_back(recId);
+		n++;
+	}
+	if (0 == n) {
+		return;
+	}
+	try {
+		m_tab->selectOneColgroupBatch(m_prefetchIds.data(), n, m_cgId,
+									  m_prefetchVals.data(), m_ctx.get());
+		return;
+	}
+	catch (const std::exception&) {
+		// some records are deleted after iterated, read one by one
+	}
+	size_t k = 0;
+	for (size_t i = 0; i < n; ++i) {
+		try {
+			m_tab->selectOneColgroup(m_prefetchIds[i], m_cgId, &m_prefetchVals[k], m_ctx.get());
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: %s: what=%s\n", BOOST_CURRENT_FUNCTION, ex.what());
+			continue;
+		}
+		if (k != i) {
+			m_prefetchIds[k] = m_prefetchIds[i];
+			m_prefetchKeys[k].swap(m_prefetchKeys[i]);
+		}
+		k++;
+	}
+	m_prefetchIds.trim(k);
+}
+
 void IteratorImpl::iterIncrement() {
+	if (m_prefetchRows && Direction::forward == m_direction) {
+		while (m_prefetchPos >= m_prefetchIds.size() && !m_prefetchEof)
+			prefetch();
+		m_valid = m_prefetchPos < m_prefetchIds.size();
+		if (m_valid) {
+			m_recId = m_prefetchIds[m_prefetchPos];
+			m_key.swap(m_prefetchKeys[m_prefetchPos]);
+			m_val.swap(m_prefetchVals[m_prefetchPos]);
+			m_prefetchPos++;
+		}
+		return;
+	}
 	m_valid = m_iter->increment(&m_recId, &m_key);
 	while (m_valid) {
+		if (isOutOfBound(m_key)) {
+			m_valid = false;
+			break;
+		}
 		try {
-			m_tab->selectOneColgroup(m_recId, 1, &m_val, m_ctx.get());
+			m_tab->selectOneColgroup(m_recId, m_cgId, &m_val, m_ctx.get());
 			break;
 		}
 		catch (const std::exception& ex) {
@@ -666,6 +1232,11 @@ IteratorImpl::SeekToFirst() {
 	if (!m_iter) {
 		m_iter = m_tab->createIndexIterForward(0, nullptr);
 	}
+	clearPrefetch();
+	if (!m_prefix.empty()) {
+		Seek(m_prefix);
+		return;
+	}
 	m_iter->reset();
 	iterIncrement();
 	TRACE_KEY_VAL(m_key, m_val);
@@ -682,6 +1253,28 @@ IteratorImpl::SeekToLast() {
 	if (!m_iter) {
 		m_iter = m_tab->createIndexIterBackward(0, nullptr);
 	}
+	clearPrefetch();
+	if (!m_upperBound.empty()) {
+		// backward seekLowerBound finds the max key <= bound
+		int cmp = m_iter->seekLowerBound(m_upperBound, &m_recId, &m_key);
+		if (cmp < 0) {
+			m_valid = false;
+		}
+		else if (0 == cmp) {
+			iterIncrement();
+		}
+		else try {
+			m_tab->selectOneColgroup(m_recId, m_cgId, &m_val, m_ctx.get());
+			m_valid = true;
+			checkBound();
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: %s: what=%s\n", BOOST_CURRENT_FUNCTION, ex.what());
+			iterIncrement();
+		}
+		TRACE_KEY_VAL(m_key, m_val);
+		return;
+	}
 	m_iter->reset();
 	iterIncrement();
 	TRACE_KEY_VAL(m_key, m_val);
@@ -692,6 +1285,7 @@ IteratorImpl::SeekToLast() {
 // an entry that comes at or past target.
 void
 IteratorImpl::Seek(const Slice& target) {
+	terark::fstring seekKey(target.data(), target.size());
 	if (Direction::backward == m_direction) {
 		if (!m_iter) {
 			m_iter = m_tab->createIndexIterBackward(0, nullptr);
@@ -702,15 +1296,20 @@ IteratorImpl::Seek(const Slice& target) {
 		if (!m_iter) {
 			m_iter = m_tab->createIndexIterForward(0, nullptr);
 		}
+		if (seekKey < terark::fstring(m_prefix)) {
+			seekKey = m_prefix; // keys before the prefix are out of bound
+		}
 	//	fprintf(stderr, "DEBUG: %s: direction=forward\n", BOOST_CURRENT_FUNCTION);
 	}
-	int cmp = m_iter->seekLowerBound(target, &m_recId, &m_key);
+	clearPrefetch();
+	int cmp = m_iter->seekLowerBound(seekKey, &m_recId, &m_key);
 	if (cmp < 0) {
 		m_valid = false;
 	}
 	else {
-		m_tab->selectOneColgroup(m_recId, 1, &m_val, m_ctx.get());
+		m_tab->selectOneColgroup(m_recId, m_cgId, &m_val, m_ctx.get());
 		m_valid = true;
+		checkBound();
 	}
 	TRACE_KEY_VAL(m_key, m_val);
 }
@@ -729,6 +1328,7 @@ IteratorImpl::Next() {
 	else {
 		m_iter = m_tab->createIndexIterForward(0, nullptr);
 		m_direction = Direction::forward;
+		clearPrefetch();
 		m_posKey.swap(m_key);
 		int cmp = m_iter->seekLowerBound(m_posKey, &m_recId, &m_key);
 		TRACE_CMP_KEY_VAL();
@@ -740,8 +1340,9 @@ IteratorImpl::Next() {
 			TRACE_KEY_VAL(m_key, m_val);
 		}
 		else try {
-			m_tab->selectOneColgroup(m_recId, 1, &m_val, m_ctx.get());
+			m_tab->selectOneColgroup(m_recId, m_cgId, &m_val, m_ctx.get());
 			m_valid = true;
+			checkBound();
 			TRACE_KEY_VAL(m_key, m_val);
 		}
 		catch (const std::exception& ex) {
@@ -776,8 +1377,9 @@ IteratorImpl::Prev() {
 			TRACE_KEY_VAL(m_key, m_val);
 		}
 		else try {
-			m_tab->selectOneColgroup(m_recId, 1, &m_val, m_ctx.get());
+			m_tab->selectOneColgroup(m_recId, m_cgId, &m_val, m_ctx.get());
 			m_valid = true;
+			checkBound();
 			TRACE_KEY_VAL(m_key, m_val);
 		}
 		catch (const std::exception& ex) {
@@ -30,6 +30,9 @@
 
 #include <leveldb/leveldb_terark_config.h>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include "leveldb/cache.h"
 #include "leveldb/comparator.h"
@@ -94,6 +97,7 @@ using leveldb::Value;
 #if HAVE_ROCKSDB
 using leveldb::FlushOptions;
 using leveldb::ColumnFamilyHandle;
+using leveldb::MergeOperator;
 #endif
 
 extern Status WiredTigerErrorToStatus(int wiredTigerError, const char *msg = "");
@@ -117,6 +121,12 @@ public:
   int Close() {
     return 0;
   }
+
+  // for reuse by the next operation of the thread
+  void Reset() {
+    m_batchWriter.rollback();
+    m_removeNotFound = 0;
+  }
 /*
   WT_CURSOR *GetCursor() { return cursor_; }
   void SetCursor(WT_CURSOR *c) { cursor_ = c; }
@@ -180,7 +190,9 @@ class ColumnFamilyHandleImpl : public ColumnFamilyHandle {
 
 class IteratorImpl : public Iterator {
 public:
-  IteratorImpl(terark::db::DbTable *db);
+  // value() is the colgroup cgId of the row
+  IteratorImpl(terark::db::DbTable *db, const ReadOptions& options = ReadOptions(),
+               size_t cgId = 1);
   virtual ~IteratorImpl();
 
   // An iterator is either positioned at a key/value pair, or
@@ -211,12 +223,25 @@ public:
 
 private:
   void iterIncrement();
+  void prefetch();
+  void clearPrefetch() { m_prefetchPos = m_prefetchIds.size(); m_prefetchEof = false; }
+  bool isOutOfBound(terark::fstring key) const;
+  void checkBound() { if (m_valid && isOutOfBound(m_key)) m_valid = false; }
   terark::db::DbTable*  m_tab;
   terark::db::DbContextPtr     m_ctx;
   terark::db::IndexIteratorPtr m_iter;
+  size_t    m_cgId;
   long long m_recId;
   terark::valvec<unsigned char> m_posKey;
   terark::valvec<unsigned char> m_key, m_val;
+  // keys in [m_prefetchPos, size) of prefetched are not consumed yet
+  size_t m_prefetchRows; // 0 disables prefetching
+  size_t m_prefetchPos;
+  bool   m_prefetchEof;
+  terark::valvec<long long> m_prefetchIds;
+  terark::valvec<terark::valvec<unsigned char> > m_prefetchKeys, m_prefetchVals;
+  std::string m_upperBound; // empty is unbounded, includes the prefix bound
+  std::string m_prefix;
   Status m_status;
   bool m_valid;
 //bool m_isPositioned;
@@ -232,20 +257,34 @@ private:
   void operator=(const IteratorImpl&);
 };
 
+// Just a version of DbTable::acquireSnapshot, it is applied to the
+// DbContext of a read by SnapshotScope, so GetSnapshot is O(1)
 class SnapshotImpl : public Snapshot {
-friend class DbImpl;
-friend class IteratorImpl;
 public:
-  SnapshotImpl(DbImpl *db);
-  virtual ~SnapshotImpl() { delete context_; }
-protected:
-  OperationContext *GetContext() const { return context_; }
-  Status GetStatus() const { return status_; }
-  Status SetupTransaction();
+  explicit SnapshotImpl(long long version) : m_version(version) {}
+  long long GetVersion() const { return m_version; }
 private:
-  DbImpl *db_;
-  OperationContext *context_;
-  Status status_;
+  long long m_version;
+};
+
+// read by ReadOptions.snapshot on ctx in the scope, NULL is the latest
+class SnapshotScope {
+public:
+  SnapshotScope(terark::db::DbContext* ctx, const Snapshot* snapshot) : m_ctx(NULL) {
+    if (snapshot) {
+      ctx->setSnapshot(static_cast<const SnapshotImpl*>(snapshot)->GetVersion());
+      m_ctx = ctx;
+    }
+  }
+  ~SnapshotScope() { if (m_ctx) m_ctx->clearSnapshot(); }
+  // rows inserted after the snapshot are invisible
+  bool IsVisible(long long recId) const {
+    return !m_ctx || recId <= m_ctx->getSnapshotMaxRecId();
+  }
+private:
+  terark::db::DbContext* m_ctx;
+  SnapshotScope(const SnapshotScope&);
+  void operator=(const SnapshotScope&);
 };
 
 class DbImpl : public leveldb::DB {
@@ -359,13 +398,34 @@ public:
   terark::db::DbContext* GetDbContext();
 
   terark::db::DbTablePtr m_tab;
+  size_t m_defaultCgId; // colgroup of column "val", the default column family
+  // true if the row is just (key, val) and cgId is m_defaultCgId
+  bool IsKeyValueRow(size_t cgId) const {
+    return m_tab->rowSchema().columnNum() == 2 && cgId == m_defaultCgId;
+  }
 private:
-  tbb::enumerable_thread_specific<DbContextPtr> m_ctx;
+  // objects of a thread, they are reset between calls, not reconstructed
+  struct ThreadContext;
+  ThreadContext& GetThreadContext();
+  tbb::enumerable_thread_specific<std::unique_ptr<ThreadContext> > m_ctx;
+  std::atomic<unsigned long long> m_ctxPoolHits; // flushed by threads in batches
+  std::atomic<unsigned long long> m_ctxPoolMisses; // contexts created
 
 #ifdef HAVE_ROCKSDB
   std::vector<ColumnFamilyHandle*> columns_;
+public:
+  // merge operand into value of colgroup cgId of key
+  Status MergeOne(terark::db::DbContext*, size_t cgId, const Slice& key, const Slice& operand);
+  // put(value != NULL) or delete the column family cgId of key
+  Status PutColumn(terark::db::DbContext*, size_t cgId, const Slice& key, const Slice* value);
+  std::shared_ptr<const MergeOperator> m_mergeOperator;
+private:
+  Status PutColumnNoLock(terark::db::DbContext*, size_t cgId, const Slice& key, const Slice* value);
+  std::mutex& KeyLock(const Slice& key);
+  std::mutex m_mergeLocks[64]; // by hash of key, for read-modify-write
 #endif
 
+  // owned by the thread context, it is reset for each call
   OperationContext* GetContext();
   OperationContext* GetContext(const ReadOptions &options);
 
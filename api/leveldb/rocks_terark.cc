@@ -33,11 +33,14 @@
   #include <unistd.h>
 #endif
 #include <sstream>
+#include <algorithm>
+#include <terark/db/json.hpp>
 
 using leveldb::Cache;
 using leveldb::DB;
 using leveldb::FlushOptions;
 using leveldb::FilterPolicy;
+using leveldb::MergeOperator;
 using leveldb::Iterator;
 using leveldb::Options;
 using leveldb::ReadOptions;
@@ -74,6 +77,62 @@ wtrocks_get_cursor(OperationContext *context, ColumnFamilyHandle *cfhp, WT_CURSO
 	return (0);
 }
 
+const std::string leveldb::kDefaultColumnFamilyName("default");
+
+// colgroup of column "val", same as DbImpl::m_defaultCgId
+static size_t
+defaultColgroupId(const terark::db::SchemaConfig& sconf) {
+	size_t valColumnId = sconf.m_rowSchema->getColumnId("val");
+	if (valColumnId < sconf.columnNum())
+		return sconf.m_colproject[valColumnId].colgroupId;
+	return 1;
+}
+
+// NULL is the default column family, handle id is the colgroup id
+static size_t
+getColgroupId(const DbImpl* db, ColumnFamilyHandle* cfhp) {
+	auto cf = static_cast<ColumnFamilyHandleImpl*>(cfhp);
+	return cf && cf->GetID() ? cf->GetID() : db->m_defaultCgId;
+}
+
+// Each column family is a one column colgroup named by the column family,
+// the column is "val" for the default column family and "cf_<name>" for
+// others, so reading a column family doesn't touch other colgroups.
+static std::string
+makeColumnFamilySchema(const std::vector<leveldb::ColumnFamilyDescriptor>& column_families) {
+	using terark::json;
+	json columns, colgroups;
+	columns["key"]["type"] = "carbin";
+	for (const auto& cf : column_families) {
+		std::string colname = cf.name == leveldb::kDefaultColumnFamilyName
+							? "val" : "cf_" + cf.name;
+		json& col = columns[colname];
+		json cg = json::object();
+		if (!cf.options.colgroup_options.empty())
+			cg = json::parse(cf.options.colgroup_options);
+		if (cf.options.value_fixed_len) {
+			col["type"] = "fixed";
+			col["length"] = cf.options.value_fixed_len;
+			if (cg.find("inplaceUpdatable") == cg.end())
+				cg["inplaceUpdatable"] = true;
+		}
+		else {
+			col["type"] = "carbin";
+		}
+		cg["fields"] = colname;
+		colgroups[cf.name] = cg;
+	}
+	json meta;
+	meta["RowSchema"]["columns"] = columns;
+	json index;
+	index["fields"] = "key";
+	index["unique"] = true;
+	meta["TableIndex"].push_back(index);
+	meta["ColumnGroups"] = colgroups;
+	meta["MinMergeSegNum"] = 3;
+	return meta.dump(2);
+}
+
 Status
 DB::ListColumnFamilies(
 	Options const &options, std::string const &name,
@@ -90,17 +149,23 @@ DB::ListColumnFamilies(
 		terark::db::SchemaConfigPtr sconf = new terark::db::SchemaConfig();
 		sconf->loadJsonFile(metaPath.string());
 		column_families->resize(0);
+		column_families->push_back(leveldb::kDefaultColumnFamilyName);
+		size_t defaultCgId = defaultColgroupId(*sconf);
 		size_t cgNum = sconf->getColgroupNum();
-		for (size_t i = 0; i < cgNum; ++i) {
+		for (size_t i = sconf->getIndexNum(); i < cgNum; ++i) {
 			const terark::db::Schema& schema = sconf->getColgroupSchema(i);
-			column_families->push_back(schema.m_name);
+			if (i != defaultCgId && schema.columnNum() == 1)
+				column_families->push_back(schema.m_name);
 		}
+		return Status::OK();
 	}
 	catch (const std::exception& ex) {
 		return Status::InvalidArgument("ListColumnFamilies: load dbmeta.json failed", dbdir.string());
 	}
 }
 
+// If the db is created, its schema is generated by column_families, else
+// each of column_families must be a column family colgroup of the schema.
 Status
 DB::Open(Options const &options,
 		 std::string const &name,
@@ -108,14 +173,38 @@ DB::Open(Options const &options,
 		 std::vector<ColumnFamilyHandle*> *handles,
 		 DB**dbptr)
 {
+	fs::path dbdir = fs::path(name) / "TerarkDB";
+	if (options.create_if_missing && !fs::exists(dbdir)) {
+		try {
+			std::string schema = makeColumnFamilySchema(column_families);
+			fs::create_directories(dbdir);
+			leveldb::WriteStringToFile(leveldb::Env::Default(), schema,
+									   (dbdir / "dbmeta.json").string());
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: make schema of column families: %s\n", ex.what());
+			return Status::InvalidArgument("DB::Open: bad column family options", ex.what());
+		}
+	}
 	Status status = Open(options, name, dbptr);
 	if (!status.ok())
 		return status;
 	DbImpl *db = static_cast<DbImpl*>(*dbptr);
-	std::vector<ColumnFamilyHandle*> cfhandles(column_families.size());
-	for (size_t i = 0; i < column_families.size(); i++) {
-		printf("Open column families: [%d] = %s\n", (int)i, column_families[i].name.c_str());
-		cfhandles[i] = new ColumnFamilyHandleImpl(db, column_families[i].name, i);
+	const auto& sconf = db->m_tab->getSchemaConfig();
+	std::vector<ColumnFamilyHandle*> cfhandles;
+	for (const auto& cf : column_families) {
+		size_t cgId = cf.name == leveldb::kDefaultColumnFamilyName
+					? db->m_defaultCgId : sconf.getColgroupId(cf.name);
+		if (cgId < sconf.getIndexNum() || cgId >= sconf.getColgroupNum() ||
+			(cgId != db->m_defaultCgId && sconf.getColgroupSchema(cgId).columnNum() != 1)) {
+			fprintf(stderr, "ERROR: column family %s is not in schema\n", cf.name.c_str());
+			for (ColumnFamilyHandle* h : cfhandles)
+				delete h;
+			delete db;
+			*dbptr = NULL;
+			return Status::InvalidArgument("DB::Open: column family is not in schema", cf.name);
+		}
+		cfhandles.push_back(new ColumnFamilyHandleImpl(db, cf.name, uint32_t(cgId)));
 	}
 	db->SetColumns(*handles = cfhandles);
 	return Status::OK();
@@ -170,132 +259,211 @@ WriteBatchHandler::DeleteCF(uint32_t column_family_id, const Slice& key)
 	return WiredTigerErrorToStatus(ret);
 }
 
+MergeOperator::~MergeOperator() {}
+
+namespace {
+class Int64AddOperator : public MergeOperator {
+public:
+	const char* Name() const override { return "Int64AddOperator"; }
+	bool FullMerge(const Slice&, const Slice* existing_value,
+				   const Slice& operand, std::string* new_value)
+	const override {
+		if (operand.size() != 8)
+			return false;
+		int64_t sum = unaligned_load<int64_t>(operand.data());
+		if (existing_value) {
+			if (existing_value->size() != 8)
+				return false;
+			sum += unaligned_load<int64_t>(existing_value->data());
+		}
+		new_value->resize(8);
+		unaligned_save(&(*new_value)[0], sum);
+		return true;
+	}
+	bool IsInt64Add() const override { return true; }
+};
+} // namespace
+
+std::shared_ptr<const MergeOperator> leveldb::NewInt64AddOperator() {
+	return std::make_shared<Int64AddOperator>();
+}
+
 Status
-DbImpl::Merge(WriteOptions const&, ColumnFamilyHandle*, Slice const&, Slice const&)
+DbImpl::Merge(WriteOptions const&, ColumnFamilyHandle* cfhp, Slice const& key, Slice const& value)
 {
-	return WiredTigerErrorToStatus(ENOTSUP);
+	size_t cgId = getColgroupId(this, cfhp);
+	terark::db::DbContext* ctx = GetDbContext();
+	assert(NULL != ctx);
+	return MergeOne(ctx, cgId, key, value);
 }
 
+// column families are colgroups, which are fixed by the schema
 Status
-DbImpl::CreateColumnFamily(Options const &options, std::string const &name, ColumnFamilyHandle **cfhp)
+DbImpl::CreateColumnFamily(Options const&, std::string const &name, ColumnFamilyHandle**)
 {
-	extern int wtleveldb_create(WT_CONNECTION *,
-	    const Options &, std::string const &uri);
-	int ret = wtleveldb_create(conn_, options, "table:" + name);
-	if (ret != 0)
-		return WiredTigerErrorToStatus(ret);
-	int id = (int)columns_.size();
-	*cfhp = new ColumnFamilyHandleImpl(this, name, id);
-	printf("Create column family: [%d] = %s\n", id, name.c_str());
-	columns_.push_back(*cfhp);
-	return Status::OK();
+	return Status::NotSupported("CreateColumnFamily: column families are defined by schema", name);
 }
 
 Status
-DbImpl::DropColumnFamily(ColumnFamilyHandle *cfhp)
+DbImpl::DropColumnFamily(ColumnFamilyHandle*)
 {
-	ColumnFamilyHandleImpl *cf =
-	    static_cast<ColumnFamilyHandleImpl *>(cfhp);
-	WT_SESSION *session = GetContext()->GetSession();
-	int ret = session->drop(session, cf->GetURI().c_str(), NULL);
-	return WiredTigerErrorToStatus(ret);
+	return Status::NotSupported("DropColumnFamily: column families are defined by schema");
 }
 
 Status
 DbImpl::Delete(WriteOptions const &write_options, ColumnFamilyHandle *cfhp, Slice const &key)
 {
-	WT_CURSOR *cursor;
-	int ret = wtrocks_get_cursor(GetContext(), cfhp, &cursor);
-	if (ret != 0)
-		return WiredTigerErrorToStatus(ret);
-	WT_ITEM item;
-	item.data = key.data();
-	item.size = key.size();
-	cursor->set_key(cursor, &item);
-	ret = cursor->remove(cursor);
-	// Reset the WiredTiger cursor so it doesn't keep any pages pinned.
-	// Track failures in debug builds since we don't expect failure, but
-	// don't pass failures on - it's not necessary for correct operation.
-	int t_ret = cursor->reset(cursor);
-	assert(t_ret == 0);
-	return WiredTigerErrorToStatus(ret);
+	size_t cgId = getColgroupId(this, cfhp);
+	if (IsKeyValueRow(cgId))
+		return Delete(write_options, key);
+	terark::db::DbContext* ctx = GetDbContext();
+	assert(NULL != ctx);
+	return PutColumn(ctx, cgId, key, NULL);
 }
 
+// all column families are in one DbTable
 Status
-DbImpl::Flush(FlushOptions const&, ColumnFamilyHandle* cfhp)
+DbImpl::Flush(FlushOptions const&, ColumnFamilyHandle*)
 {
-	ColumnFamilyHandleImpl *cf =
-	    static_cast<ColumnFamilyHandleImpl *>(cfhp);
-	WT_SESSION *session = GetContext()->GetSession();
-	return WiredTigerErrorToStatus(session->checkpoint(session, ("target=(\"" + cf->GetURI() + "\")").c_str()));
+	try {
+		m_tab->flush();
+	}
+	catch (const std::exception& ex) {
+		return Status::IOError("DB::Flush failed", ex.what());
+	}
+	return Status::OK();
 }
 
 Status
 DbImpl::Get(ReadOptions const &options, ColumnFamilyHandle *cfhp, Slice const &key, std::string *value)
 {
-	const char *errmsg = NULL;
-	OperationContext *context = GetContext(options);
-
-	WT_CURSOR *cursor;
-	int ret = wtrocks_get_cursor(context, cfhp, &cursor);
-	if (ret != 0)
-		return WiredTigerErrorToStatus(ret);
-
-	WT_ITEM item;
-	item.data = key.data();
-	item.size = key.size();
-	cursor->set_key(cursor, &item);
-	if ((ret = cursor->search(cursor)) == 0 &&
-	    (ret = cursor->get_value(cursor, &item)) == 0) {
-		*value = std::string((const char *)item.data, item.size);
-		ret = cursor->reset(cursor);
+	size_t cgId = getColgroupId(this, cfhp);
+	if (cgId == m_defaultCgId)
+		return Get(options, key, value);
+	terark::db::DbContext* ctx = GetDbContext();
+	assert(NULL != ctx);
+	SnapshotScope snapshot(ctx, options.snapshot);
+	auto userBuf = ctx->bufs.get();
+	ctx->indexSearchExact(0, key, &ctx->exactMatchRecIdvec);
+	if (!ctx->exactMatchRecIdvec.empty() &&
+		snapshot.IsVisible(ctx->exactMatchRecIdvec[0])) {
+		try {
+			auto recId = ctx->exactMatchRecIdvec[0];
+			terark::fstring val = ctx->selectOneColgroupRef(recId, cgId, userBuf.get());
+			value->assign(val.data(), val.size());
+			return Status::OK();
+		}
+		catch (const std::exception&) {
+		}
 	}
-	if (ret == WT_NOTFOUND)
-		errmsg = "DB::Get key not found";
-	return WiredTigerErrorToStatus(ret, errmsg);
+	return Status::NotFound(key);
 }
 
 bool
-DbImpl::GetProperty(ColumnFamilyHandle*, Slice const&, std::string*)
+DbImpl::GetProperty(ColumnFamilyHandle*, Slice const& property, std::string* value)
 {
-	return false;
+	// all column families are in one DbTable
+	return GetProperty(property, value);
 }
 
+// All keys are searched by one indexSearchExactBatch, found records are
+// read by selectOneColgroupBatch per column family, with one DbContext
 std::vector<Status>
-DbImpl::MultiGet(ReadOptions const&, std::vector<ColumnFamilyHandle*> const&, std::vector<Slice> const&, std::vector<std::string, std::allocator<std::string> >*)
+DbImpl::MultiGet(ReadOptions const& options,
+				 std::vector<ColumnFamilyHandle*> const& column_family,
+				 std::vector<Slice> const& keys,
+				 std::vector<std::string>* values)
 {
-	std::vector<Status> ret;
-	ret.push_back(WiredTigerErrorToStatus(ENOTSUP));
+	using terark::fstring;
+	using terark::valvec;
+	using terark::valvec_reserve;
+	const size_t num = keys.size();
+	assert(column_family.size() == num);
+	std::vector<Status> ret(num);
+	values->resize(num);
+	if (0 == num)
+		return ret;
+	terark::db::DbContext* ctx = GetDbContext();
+	assert(NULL != ctx);
+	SnapshotScope snapshot(ctx, options.snapshot);
+	auto getCgId = [&](size_t i) -> size_t {
+		return getColgroupId(this, column_family[i]);
+	};
+	// sorted keys are faster for indexSearchExactBatch, group them by
+	// column family to read each colgroup in one batch
+	valvec<size_t> perm(num, valvec_reserve());
+	for (size_t i = 0; i < num; ++i)
+		perm.unchecked_push_back(i);
+	std::sort(perm.begin(), perm.end(), [&](size_t x, size_t y) {
+		size_t cx = getCgId(x), cy = getCgId(y);
+		if (cx != cy)
+			return cx < cy;
+		return keys[x].compare(keys[y]) < 0;
+	});
+	valvec<fstring> sortedKeys(num, valvec_reserve());
+	for (size_t i = 0; i < num; ++i) {
+		const Slice& k = keys[perm[i]];
+		sortedKeys.unchecked_push_back(fstring(k.data(), k.size()));
+	}
+	valvec<size_t> offsets;
+	ctx->indexSearchExactBatch(0, sortedKeys.data(), num,
+							   &ctx->exactMatchRecIdvec, &offsets);
+	valvec<long long> ids(num, valvec_reserve());
+	valvec<size_t>    keyIdx(num, valvec_reserve());
+	for (size_t i = 0; i < num; ++i) {
+		if (offsets[i] < offsets[i+1] &&
+			snapshot.IsVisible(ctx->exactMatchRecIdvec[offsets[i]])) {
+			ids.unchecked_push_back(ctx->exactMatchRecIdvec[offsets[i]]);
+			keyIdx.unchecked_push_back(perm[i]);
+		}
+		else {
+			ret[perm[i]] = Status::NotFound(keys[perm[i]]);
+		}
+	}
+	valvec<valvec<unsigned char> > vals(ids.size());
+	for (size_t beg = 0; beg < ids.size(); ) {
+		const size_t cgId = getCgId(keyIdx[beg]);
+		size_t end = beg + 1;
+		while (end < ids.size() && getCgId(keyIdx[end]) == cgId)
+			++end;
+		try {
+			ctx->selectOneColgroupBatch(ids.data() + beg, end - beg, cgId,
+										vals.data() + beg);
+		}
+		catch (const std::exception&) {
+			// some records were deleted after search, read one by one
+			for (size_t j = beg; j < end; ++j) {
+				try {
+					vals[j].risk_set_size(0);
+					ctx->selectOneColgroup(ids[j], cgId, &vals[j]);
+				}
+				catch (const std::exception&) {
+					ret[keyIdx[j]] = Status::NotFound(keys[keyIdx[j]]);
+				}
+			}
+		}
+		for (size_t j = beg; j < end; ++j) {
+			if (ret[keyIdx[j]].ok())
+				(*values)[keyIdx[j]].assign((const char*)vals[j].data(), vals[j].size());
+		}
+		beg = end;
+	}
 	return ret;
 }
 
 Iterator *
 DbImpl::NewIterator(ReadOptions const &options, ColumnFamilyHandle *cfhp)
 {
-	OperationContext *context = GetContext(options);
-
-	WT_CURSOR *c;
-	int ret = wtrocks_get_cursor(context, cfhp, &c, 1);
-	assert(ret == 0);
-	return new IteratorImpl(this, c,
-	    static_cast<ColumnFamilyHandleImpl *>(cfhp)->GetID());
+	return new IteratorImpl(m_tab.get(), options, getColgroupId(this, cfhp));
 }
 
 Status
 DbImpl::Put(WriteOptions const &options, ColumnFamilyHandle *cfhp, Slice const &key, Slice const &value)
 {
-	WT_CURSOR *cursor;
-	int ret = wtrocks_get_cursor(GetContext(), cfhp, &cursor);
-	if (ret != 0)
-		return WiredTigerErrorToStatus(ret);
-
-	WT_ITEM item;
-	item.data = key.data();
-	item.size = key.size();
-	cursor->set_key(cursor, &item);
-	item.data = value.data();
-	item.size = value.size();
-	cursor->set_value(cursor, &item);
-	ret = cursor->insert(cursor);
-	return WiredTigerErrorToStatus(ret, NULL);
+	size_t cgId = getColgroupId(this, cfhp);
+	if (IsKeyValueRow(cgId))
+		return Put(options, key, value);
+	terark::db::DbContext* ctx = GetDbContext();
+	assert(NULL != ctx);
+	return PutColumn(ctx, cgId, key, &value);
 }
@@ -16,6 +16,8 @@
 #include <mongo/db/storage/recovery_unit.h>
 #include <mongo/bson/bsonobjbuilder.h>
 #include <boost/filesystem.hpp>
+#include <atomic>
+#include <memory>
 #include <thread>
 #include <tbb/enumerable_thread_specific.h>
 #include <terark/db/db_table.hpp>
@@ -51,7 +53,7 @@ public:
 
 class TableThreadData : public terark::RefCounter {
 public:
-	explicit TableThreadData(DbTable* tab);
+	TableThreadData(DbTable* tab, FieldNameDict* fieldDict);
     terark::db::DbContextPtr m_dbCtx;
     terark::valvec<unsigned char> m_buf;
     mongo::terarkdb::SchemaRecordCoder m_coder;
@@ -85,6 +87,16 @@ struct IndexIterData : public terark::RefCounter {
 };
 typedef boost::intrusive_ptr<IndexIterData> IndexIterDataPtr;
 
+// a version of DbTable::acquireSnapshot, released on destruct
+class TableSnapshot : public terark::RefCounter {
+public:
+	explicit TableSnapshot(DbTable* tab);
+	~TableSnapshot();
+	DbTablePtr m_tab;
+	llong      m_version;
+};
+typedef boost::intrusive_ptr<TableSnapshot> TableSnapshotPtr;
+
 class RecoveryUnitData : public terark::RefCounter {
 public:
 	struct MVCCTime {
@@ -97,6 +109,7 @@ public:
 	ThreadSafeTable*     m_tst;
 	uint32_t m_iterNum;
 	uint32_t m_mvccTime;
+	bool     m_changeRegistered; // ChangeForRecoveryUnit of batched mode
 	explicit RecoveryUnitData(ThreadSafeTable* tst);
 	~RecoveryUnitData();
 };
@@ -112,15 +125,35 @@ public:
 	RuStoreIteratorBase(RecoveryUnit* ru, ThreadSafeTable* tst);
 	~RuStoreIteratorBase();
 	bool getVal(llong id, valvec<unsigned char>* val) const;
+	bool isVisible(llong id) const;
+	size_t fetchBatch(const valvec<llong>& ids, terark::db::StoreBatch* batch);
 	void traceFunc(const char* func) const;
+
+	// scratch of fetchBatch
+	valvec<valvec<unsigned char> > m_batchVals;
+	valvec<llong> m_batchIds;
 };
 
 class ThreadSafeTable : public terark::RefCounter {
 public:
 	~ThreadSafeTable();
 	void destroy(); // workaround mongodb
-	DbTablePtr m_tab;
-	explicit ThreadSafeTable(const fs::path& dbPath);
+	///@param lazyOpen if true, just load dbmeta.json, DbTable is opened
+	///                on first call of tab()
+	explicit ThreadSafeTable(const fs::path& dbPath, bool lazyOpen = false);
+
+	DbTable* tab() {
+		DbTable* t = m_tabRaw.load(std::memory_order_acquire);
+		return terark_likely(nullptr != t) ? t : openDbTable();
+	}
+	bool isOpened() const {
+		return m_tabRaw.load(std::memory_order_acquire) != nullptr;
+	}
+	// available without opening DbTable
+	const terark::db::SchemaConfig& schema() const { return *m_schema; }
+	const fs::path& getDir() const { return m_dir; }
+	FieldNameDict* getFieldDict() const { return m_fieldDict.get(); }
+
 	TableThreadData& getMyThreadData();
 
 	// not owned by a thread, but by a cursor
@@ -144,19 +177,64 @@ public:
 	void commitDelete(RecoveryUnit*, RecordId id);
 	void rollbackDelete(RecoveryUnit*, RecordId id);
 
+	// batched mode: all inserts and deletes of a unit of work are applied
+	// by one Change, with one batched DbTable call for each kind of change
+	void commitRecoveryUnit(RecoveryUnit*);
+	void rollbackRecoveryUnit(RecoveryUnit*);
+
 	RuStoreIteratorBase* createStoreIter(RecoveryUnit*, bool forward);
 
 	void registerCleanOnOwnerDead(ICleanOnOwnerDead*);
 	void unregisterCleanOnOwnerDead(ICleanOnOwnerDead*);
 
+	// hits, misses, expire time of index iterator cache
+	void appendIndexIterCacheStats(BSONObjBuilder&) const;
+
+	// segments, write throttle, compaction and latency stats of DbTable,
+	// nothing is appended if DbTable is not opened
+	void appendTableStats(BSONObjBuilder&, bool memoryResident) const;
+
 protected:
+	DbTable* openDbTable();
+	fs::path   m_dir;
+	terark::db::SchemaConfigPtr m_schema;
+	std::mutex m_openMutex;
+	DbTablePtr m_tab; // guarded by m_openMutex
+	std::atomic<DbTable*> m_tabRaw; // == m_tab.get() when opened
+	bool m_destroyed;
+	FieldNameDictPtr m_fieldDict; // nullptr if TerarkDB_FieldNameDict is false
+
 	tbb::enumerable_thread_specific<TableThreadDataPtr> m_ttd;
 	std::mutex m_cursorCacheMutex;
 	valvec<TableThreadDataPtr> m_cursorCache; // for RecordStore Iterator
+
+	// Index iterators are cached in per thread free lists, accessed without
+	// lock. A thread keeps at most kLocalIndexIterNum iterators per index
+	// and direction, excess iterators are moved to the global lists, which
+	// are guarded by m_cursorCacheMutex and are the fallback on local miss.
+	static const size_t kLocalIndexIterNum = 4;
+	struct LocalIndexIterCache {
+		valvec<valvec<IndexIterDataPtr> > forward;
+		valvec<valvec<IndexIterDataPtr> > backward;
+	};
+	tbb::enumerable_thread_specific<LocalIndexIterCache> m_localIndexIterCache;
 	valvec<valvec<IndexIterDataPtr> > m_indexForwardIterCache;
 	valvec<valvec<IndexIterDataPtr> > m_indexBackwardIterCache;
 	llong m_cacheExpireMillisec;
+	bool  m_batchRecoveryUnitChanges;
+	// expire time of an index adapts to its alloc interval
+	struct IndexIterStat {
+		std::atomic<llong> lastAllocTime;
+		std::atomic<llong> avgIntervalMillisec;
+		std::atomic<ullong> hits;
+		std::atomic<ullong> misses;
+		IndexIterStat() : lastAllocTime(0), avgIntervalMillisec(0), hits(0), misses(0) {}
+	};
+	std::unique_ptr<IndexIterStat[]> m_indexIterStat;
+	llong indexIterExpireMillisec(size_t indexId) const;
+	void expiringCacheItems(valvec<IndexIterDataPtr>& v, llong now, llong expireMillisec);
 	void expiringCacheItems(valvec<valvec<IndexIterDataPtr> >& vv, llong now);
+	LocalIndexIterCache& getLocalIndexIterCache();
 
 	std::mutex m_ruMapMutex;
 	gold_hash_map<RecoveryUnit*, RecoveryUnitDataPtr> m_ruMap;
@@ -17,6 +17,15 @@
 #include <terark/io/DataIO.hpp>
 #include <terark/io/MemStream.hpp>
 #include <terark/lcast.hpp>
+#include <terark/io/var_int.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#if !defined(_MSC_VER)
+	#include <unistd.h>
+#endif
 
 namespace mongo { namespace terarkdb {
 
@@ -199,11 +208,170 @@ static void terarkEncodeBsonObject(const BSONObj& obj, valvec<char>& encoded) {
 	encoded.push_back((unsigned char)EOO);
 }
 
+FieldNameDict::FieldNameDict(const std::string& fpath) : m_fpath(fpath) {
+	m_fp = nullptr;
+	m_maxNames = std::max(getEnvLong("TerarkDB_FieldNameDictMaxNames", 65536), 0L);
+	m_offsets.push_back(0);
+	FILE* fp = fopen(fpath.c_str(), "rb");
+	if (!fp) {
+		return; // created by first findOrAdd
+	}
+	fseek(fp, 0, SEEK_END);
+	long fsize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	m_pool.resize_no_init(std::max(fsize, 0L));
+	size_t rd = fread(m_pool.data(), 1, m_pool.size(), fp);
+	fclose(fp);
+	if (rd != m_pool.size()) {
+		THROW_STD(runtime_error, "fread(%s) = %zd, expect %zd"
+			, fpath.c_str(), rd, m_pool.size());
+	}
+	size_t beg = 0;
+	for (size_t i = 0; i < m_pool.size(); ++i) {
+		if ('\0' == m_pool[i]) {
+			m_ids.insert_i(fstring(m_pool.data() + beg, i - beg), m_offsets.size()-1);
+			m_offsets.push_back(uint32_t(i + 1));
+			beg = i + 1;
+		}
+	}
+	if (beg != m_pool.size()) {
+		// torn append of a name, no doc has its id
+		log() << "FieldNameDict: truncate partial name of " << fpath
+			  << ": size " << m_pool.size() << " -> " << beg;
+		m_pool.resize(beg);
+		boost::filesystem::resize_file(fpath, beg);
+	}
+}
+
+FieldNameDict::~FieldNameDict() {
+	if (m_fp)
+		fclose(m_fp);
+}
+
+uint32_t FieldNameDict::findOrAdd(fstring name) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t i = m_ids.find_i(name);
+	if (i < m_ids.end_i()) {
+		return m_ids.val(i);
+	}
+	size_t id = m_offsets.size() - 1;
+	if (id >= m_maxNames) {
+		return UINT32_MAX;
+	}
+	if (!m_fp) {
+		m_fp = fopen(m_fpath.c_str(), "ab");
+		if (!m_fp) {
+			THROW_STD(runtime_error, "fopen(%s, ab) = %s"
+				, m_fpath.c_str(), strerror(errno));
+		}
+	}
+	// id is persisted before any doc is written by it
+	if (fwrite(name.data(), 1, name.size() + 1, m_fp) != name.size() + 1 ||
+			fflush(m_fp) != 0) {
+		THROW_STD(runtime_error, "fwrite(%s) = %s", m_fpath.c_str(), strerror(errno));
+	}
+#if !defined(_MSC_VER)
+	fsync(fileno(m_fp));
+#endif
+	m_pool.append(name.data(), name.size());
+	m_pool.push_back('\0');
+	m_offsets.push_back(uint32_t(m_pool.size()));
+	m_ids.insert_i(name, uint32_t(id));
+	return uint32_t(id);
+}
+
+void FieldNameDict::copyTo(valvec<char>* pool, valvec<uint32_t>* offsets) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t have = offsets->size() - 1;
+	assert(pool->size() == m_offsets[have]);
+	pool->append(m_pool.data() + pool->size(), m_pool.size() - pool->size());
+	offsets->append(m_offsets.data() + have + 1, m_offsets.size() - have - 1);
+}
+
 SchemaRecordCoder::SchemaRecordCoder() {
+	m_orderSchema = nullptr;
+	m_dictOffsets.push_back(0);
+	m_dictFull = false;
+	m_arena = &m_ownArena;
 }
 SchemaRecordCoder::~SchemaRecordCoder() {
 }
 
+void SchemaRecordCoder::setFieldDict(FieldNameDict* dict) {
+	m_fieldDict = dict;
+	m_dictPool.erase_all();
+	m_dictOffsets.erase_all();
+	m_dictOffsets.push_back(0);
+	m_dictIds.clear();
+	m_dictFull = false;
+	m_orderSchema = nullptr; // m_fieldIds is stale
+}
+
+void SchemaRecordCoder::setArena(terark::db::DbContextArena* arena) {
+	m_arena = arena ? arena : &m_ownArena;
+}
+
+void SchemaRecordCoder::syncFieldDict() {
+	size_t oldNum = m_dictOffsets.size() - 1;
+	m_fieldDict->copyTo(&m_dictPool, &m_dictOffsets);
+	for (size_t i = oldNum; i < m_dictOffsets.size() - 1; ++i) {
+		m_dictIds.insert_i(fieldNameOf(uint32_t(i)), uint32_t(i));
+	}
+}
+
+// encoding side, the name is added to m_fieldDict if it is new
+uint32_t SchemaRecordCoder::fieldNameId(fstring name) {
+	if (!m_fieldDict) {
+		return UINT32_MAX;
+	}
+	size_t i = m_dictIds.find_i(name);
+	if (i < m_dictIds.end_i()) {
+		return m_dictIds.val(i);
+	}
+	if (m_dictFull) {
+		return UINT32_MAX; // the dict is never shrinked
+	}
+	uint32_t id = m_fieldDict->findOrAdd(name);
+	if (UINT32_MAX == id) {
+		m_dictFull = true;
+	}
+	syncFieldDict();
+	return id;
+}
+
+// decoding side, the id may be added by coders of other threads
+fstring SchemaRecordCoder::fieldNameOf(uint32_t id) {
+	if (terark_unlikely(size_t(id) + 1 >= m_dictOffsets.size())) {
+		if (m_fieldDict)
+			syncFieldDict();
+		if (size_t(id) + 1 >= m_dictOffsets.size()) {
+			THROW_STD(invalid_argument, "bad field name id: %u, dict size: %zd"
+				, id, m_dictOffsets.size() - 1);
+		}
+	}
+	const char* name = m_dictPool.data() + m_dictOffsets[id];
+	return fstring(name, m_dictOffsets[id+1] - m_dictOffsets[id] - 1);
+}
+
+// EOO is not a type of field, it marks a field encoded by name id:
+// EOO, type, var_uint32 id, value
+void SchemaRecordCoder::encodeSchemaLessField(const BSONElement& elem, uint32_t id,
+											  valvec<char>* encoded) {
+	if (UINT32_MAX == id) {
+		fstring fieldName = elem.fieldName();
+		encoded->push_back((unsigned char)elem.type());
+		encoded->append(fieldName.data(), fieldName.size()+1);
+	}
+	else {
+		unsigned char* p = (unsigned char*)encoded->grow_no_init(7);
+		p[0] = (unsigned char)EOO;
+		p[1] = (unsigned char)elem.type();
+		p = save_var_uint32(p + 2, id);
+		encoded->risk_set_size((char*)p - encoded->data());
+	}
+	terarkEncodeBsonElemVal(elem, *encoded);
+}
+
 template<class Vec>
 static void Move_AutoGrownMemIO_to_valvec(AutoGrownMemIO& io, Vec& v) {
 	BOOST_STATIC_ASSERT(sizeof(typename Vec::value_type) == 1);
@@ -709,6 +877,227 @@ void encodeMaxValueField(const ColumnMeta& colmeta, valvec<char>* encoded) {
 	}
 }
 
+static void
+encodeSchemaField(const ColumnMeta& colmeta, const BSONElement& elem,
+				  bool isLastField, valvec<char>* encoded) {
+	BSONType elemType = elem.type();
+	const char* value = elem.value();
+	switch (elemType) {
+	case EOO:
+		break;
+	case Undefined:
+	case jstNULL:
+		encodeMissingField(colmeta, encoded);
+		break;
+	case MaxKey:
+		encodeMaxValueField(colmeta, encoded);
+		break;
+	case MinKey:
+		encodeMinValueField(colmeta, encoded);
+		break;
+	case mongo::Bool:
+		encoded->push_back(value[0] ? 1 : 0);
+		assert(colmeta.type == terark::db::ColumnType::Uint08);
+		break;
+	case NumberInt:
+		encodeConvertFrom<int32_t>(colmeta.type, value, encoded, isLastField);
+		break;
+	case NumberDouble:
+		encodeConvertFromDouble(colmeta.type, value, encoded, isLastField);
+		break;
+	case NumberLong:
+		encodeConvertFrom<int64_t>(colmeta.type, value, encoded, isLastField);
+		break;
+	case bsonTimestamp: // low 32 bit is always positive
+		invariant(colmeta.type == ColumnType::Sint64 ||
+				  colmeta.type == ColumnType::Uint64);
+		encoded->append(value, 8);
+		break;
+	case mongo::Date:
+		if (colmeta.type == ColumnType::Uint32 ||
+			colmeta.type == ColumnType::Sint32)
+		{
+			int64_t millisec = ConstDataView(value).read<LittleEndian<int64_t>>();
+			int64_t sec = millisec / 1000;
+			DataView(encoded->grow_no_init(4)).write<LittleEndian<int>>(sec);
+		}
+		else if (colmeta.type == ColumnType::Uint64 ||
+				 colmeta.type == ColumnType::Sint64) {
+			encoded->append(value, 8);
+		}
+		else {
+			invariant(!"mongo::Date must map to one of terark sint32, uint32, sint64, uint64");
+		}
+		break;
+	case jstOID:
+	//	log() << "encode: OID=" << toHexLower(value, OID::kOIDSize);
+		encoded->append(value, OID::kOIDSize);
+		assert(colmeta.type == terark::db::ColumnType::Fixed);
+		assert(colmeta.fixedLen == OID::kOIDSize);
+		break;
+	case Symbol:
+	case Code:
+	case mongo::String:
+	//	log() << "encode: strlen+1=" << elem.valuestrsize() << ", str=" << elem.valuestr();
+		if (colmeta.type == terark::db::ColumnType::StrZero) {
+			encoded->append(value + 4, elem.valuestrsize());
+		}
+		else {
+			encodeConvertString(colmeta.type, value + 4, encoded);
+		}
+		break;
+	case DBRef:
+	//	assert(0); // deprecated, should not in data
+		encoded->append(value + 4, elem.valuestrsize() + OID::kOIDSize);
+		break;
+	case mongo::Array:
+		assert(colmeta.type == terark::db::ColumnType::CarBin);
+		{
+			size_t oldsize = encoded->size();
+			encoded->resize(oldsize + 4); // reserve for uint32 length
+			terarkEncodeBsonArray(elem.embeddedObject(), *encoded);
+			size_t len = encoded->size() - (oldsize + 4);
+			DataView(encoded->data()+oldsize)
+					.write(LittleEndian<uint32_t>(uint32_t(len)));
+		}
+		break;
+	case Object:
+		assert(colmeta.type == terark::db::ColumnType::CarBin);
+		{
+			size_t oldsize = encoded->size();
+			encoded->resize(oldsize + 4); // reserve for uint32 length
+			terarkEncodeBsonObject(elem.embeddedObject(), *encoded);
+			size_t len = encoded->size() - (oldsize + 4);
+			DataView(encoded->data()+oldsize)
+					.write(LittleEndian<uint32_t>(uint32_t(len)));
+		}
+		break;
+	case CodeWScope:
+		assert(colmeta.type == terark::db::ColumnType::CarBin);
+		{
+			assert(colmeta.type == terark::db::ColumnType::CarBin);
+			size_t oldsize = encoded->size();
+			encoded->resize(oldsize + 8); // reserve for uint32 length + uint32 codelen
+			DataView(encoded->data()+oldsize + 4)
+					.write(LittleEndian<uint32_t>(elem.codeWScopeCodeLen()));
+			encoded->append(elem.codeWScopeCode(), elem.codeWScopeCodeLen());
+			terarkEncodeBsonObject(elem.codeWScopeObject(), *encoded);
+			size_t len = encoded->size() - (oldsize + 4);
+			DataView(encoded->data()+oldsize)
+					.write(LittleEndian<uint32_t>(uint32_t(len)));
+		}
+		encoded->append(value, elem.objsize());
+		break;
+	case BinData:
+		if (colmeta.type == terark::db::ColumnType::CarBin) {
+			uint32_t len = elem.valuestrsize() + 1; // 1 is for subtype byte
+			encoded->resize(encoded->size() + 4);
+			DataView(encoded->end() - 4)
+					.write(LittleEndian<uint32_t>(len));
+			encoded->append(value + 4, 1 + elem.valuestrsize());
+		}
+		else if (colmeta.type == terark::db::ColumnType::StrZero) {
+			BsonBinDataToTerarkStrZero(elem, *encoded, isLastField);
+		}
+		else {
+			invariant(!"mongo bindata must be terark carbin or strzero");
+		}
+		break;
+	case RegEx:
+		{
+			const char* p = value;
+			size_t len1 = strlen(p); // regex len
+			size_t len2 = strlen(p + len1 + 1);
+			encoded->append(p, len1 + 1 + len2 + 1);
+		}
+		assert(colmeta.type == terark::db::ColumnType::TwoStrZero);
+		break;
+	default:
+		{
+			StringBuilder ss;
+			ss << BOOST_CURRENT_FUNCTION
+			   << ": BSONElement: bad elem.type " << (int)elem.type();
+			std::string msg = ss.str();
+		//	damnbrain(314159266, msg.c_str(), false);
+			throw std::invalid_argument(msg);
+		}
+	}
+}
+
+// Fast path: fields of obj are in the same order as the last encoded obj,
+// this is the common case, documents of a collection are mostly written by
+// the same code. Each field name is just compared with the cached column,
+// no hash lookup for schema fields.
+// @returns false if field order or field set is changed, encoded is garbage
+// called in the arena Scope of encode
+bool SchemaRecordCoder::encodeByCachedOrder(const Schema* schema,
+											size_t schemaColumn,
+											const BSONObj& obj,
+											valvec<char>* encoded) {
+	if (schema != m_orderSchema)
+		return false;
+	const size_t colnum = schema->columnNum();
+	const size_t fieldNum = m_fieldOrder.size();
+	const char** colElems = m_arena->alloc<const char*>(schemaColumn);
+	size_t k = 0, matched = 0, extra = 0, unverified = 0;
+	for (BSONObjIterator it(obj); it.more(); ++k) {
+		BSONElement elem = it.next();
+		if (k >= fieldNum)
+			return false;
+		fstring fieldname(elem.fieldName(), elem.fieldNameSize()-1);
+		size_t c = m_fieldOrder[k];
+		if (c < schemaColumn) {
+			if (schema->m_columnsMeta.key(c) != fieldname)
+				return false;
+			colElems[c] = elem.rawdata();
+			matched++;
+		}
+		else {
+			// same name as last obj is known not in schema and not dup
+			uint32_t id = m_fieldIds[k];
+			if (UINT32_MAX == id || fieldNameOf(id) != fieldname) {
+				if (schema->m_columnsMeta.find_i(fieldname) < schemaColumn)
+					return false;
+				unverified++;
+			}
+			extra++;
+		}
+	}
+	if (k != fieldNum || matched != schemaColumn)
+		return false;
+	if (extra && schemaColumn == colnum)
+		return false; // let slow path report the error
+	encoded->resize(0);
+	for (size_t c = 0; c < schemaColumn; ++c) {
+		fstring     colname = schema->m_columnsMeta.key(c);
+		const auto& colmeta = schema->m_columnsMeta.val(c);
+		BSONElement elem(colElems[c], colname.size()+1,
+						 BSONElement::FieldNameSizeTag());
+		encodeSchemaField(colmeta, elem, colnum-1 == c, encoded);
+	}
+	if (extra) {
+		m_fields.erase_all();
+		k = 0;
+		for (BSONObjIterator it(obj); it.more(); ++k) {
+			BSONElement elem = it.next();
+			if (m_fieldOrder[k] < schemaColumn)
+				continue;
+			fstring fieldName = elem.fieldName();
+			if (extra > 1 && unverified && !m_fields.insert_i(fieldName).second) {
+				THROW_STD(invalid_argument,
+						"bad bson: duplicate fieldname: %s", fieldName.c_str());
+			}
+			uint32_t id = m_fieldIds[k];
+			if (UINT32_MAX == id || fieldNameOf(id) != fieldName) {
+				id = fieldNameId(fieldName);
+				m_fieldIds[k] = id;
+			}
+			encodeSchemaLessField(elem, id, encoded);
+		}
+	}
+	return true;
+}
+
 // for WritableSegment, param schema is m_rowSchema, param exclude is nullptr
 // for ReadonlySegment, param schema is m_nonIndexSchema,
 //                      param exclude is m_uniqIndexFields
@@ -716,9 +1105,6 @@ void SchemaRecordCoder::encode(const Schema* schema, const Schema* exclude,
 							   const BSONObj& obj, valvec<char>* encoded) {
 	assert(nullptr != schema);
 	LOG(3)	<< "SchemaRecordCoder::encode: bson = " << obj.toString();
-	encoded->resize(0);
-	parseToFields(obj, &m_fields);
-	m_stored.resize_fill(m_fields.end_i(), false);
 
 	// last is $$ field, the schema-less fields
 	size_t schemaColumn
@@ -726,6 +1112,22 @@ void SchemaRecordCoder::encode(const Schema* schema, const Schema* exclude,
 		? schema->m_columnsMeta.end_i() - 1
 		: schema->m_columnsMeta.end_i()
 		;
+	terark::db::DbContextArena::Scope arenaScope(*m_arena);
+	if (nullptr == exclude && encodeByCachedOrder(schema, schemaColumn, obj, encoded)) {
+		return;
+	}
+	encoded->resize(0);
+	parseToFields(obj, &m_fields);
+	const size_t fieldNum = m_fields.end_i();
+	bool* stored = m_arena->alloc<bool>(fieldNum);
+	std::fill_n(stored, fieldNum, false);
+
+	// field order of obj is cached for encodeByCachedOrder if all schema
+	// fields are present, m_fields is in the same order as obj
+	bool cacheable = nullptr == exclude;
+	m_orderSchema = nullptr;
+	m_fieldOrder.resize_fill(m_fields.end_i(), UINT32_MAX);
+	m_fieldIds.resize_fill(m_fields.end_i(), UINT32_MAX);
 	for(size_t i = 0; i < schemaColumn; ++i) {
 		fstring     colname = schema->m_columnsMeta.key(i);
 		const auto& colmeta = schema->m_columnsMeta.val(i);
@@ -737,171 +1139,36 @@ void SchemaRecordCoder::encode(const Schema* schema, const Schema* exclude,
 					<< ", m_fields.end_i()=" << m_fields.end_i()
 					<< ", bson=" << obj.toString();
 			encodeMissingField(colmeta, encoded);
+			cacheable = false;
 			continue;
 		}
 		invariant(j < m_fields.end_i());
 		bool isLastField = schema->m_columnsMeta.end_i() - 1 == i;
 		BSONElement elem(m_fields.key(j).data() - 1, colname.size()+1,
 						 BSONElement::FieldNameSizeTag());
-		BSONType elemType = elem.type();
-		const char* value = elem.value();
-		switch (elemType) {
-		case EOO:
-			break;
-		case Undefined:
-		case jstNULL:
-			encodeMissingField(colmeta, encoded);
-			break;
-		case MaxKey:
-			encodeMaxValueField(colmeta, encoded);
-			break;
-		case MinKey:
-			encodeMinValueField(colmeta, encoded);
-			break;
-		case mongo::Bool:
-			encoded->push_back(value[0] ? 1 : 0);
-			assert(colmeta.type == terark::db::ColumnType::Uint08);
-			break;
-		case NumberInt:
-			encodeConvertFrom<int32_t>(colmeta.type, value, encoded, isLastField);
-			break;
-		case NumberDouble:
-			encodeConvertFromDouble(colmeta.type, value, encoded, isLastField);
-			break;
-		case NumberLong:
-			encodeConvertFrom<int64_t>(colmeta.type, value, encoded, isLastField);
-			break;
-		case bsonTimestamp: // low 32 bit is always positive
-			invariant(colmeta.type == ColumnType::Sint64 ||
-					  colmeta.type == ColumnType::Uint64);
-			encoded->append(value, 8);
-			break;
-		case mongo::Date:
-			if (colmeta.type == ColumnType::Uint32 ||
-				colmeta.type == ColumnType::Sint32)
-			{
-				int64_t millisec = ConstDataView(value).read<LittleEndian<int64_t>>();
-				int64_t sec = millisec / 1000;
-				DataView(encoded->grow_no_init(4)).write<LittleEndian<int>>(sec);
-			}
-			else if (colmeta.type == ColumnType::Uint64 ||
-					 colmeta.type == ColumnType::Sint64) {
-				encoded->append(value, 8);
-			}
-			else {
-				invariant(!"mongo::Date must map to one of terark sint32, uint32, sint64, uint64");
-			}
-			break;
-		case jstOID:
-		//	log() << "encode: OID=" << toHexLower(value, OID::kOIDSize);
-			encoded->append(value, OID::kOIDSize);
-			assert(colmeta.type == terark::db::ColumnType::Fixed);
-			assert(colmeta.fixedLen == OID::kOIDSize);
-			break;
-		case Symbol:
-		case Code:
-		case mongo::String:
-		//	log() << "encode: strlen+1=" << elem.valuestrsize() << ", str=" << elem.valuestr();
-			if (colmeta.type == terark::db::ColumnType::StrZero) {
-				encoded->append(value + 4, elem.valuestrsize());
-			}
-			else {
-				encodeConvertString(colmeta.type, value + 4, encoded);
-			}
-			break;
-		case DBRef:
-		//	assert(0); // deprecated, should not in data
-			encoded->append(value + 4, elem.valuestrsize() + OID::kOIDSize);
-			break;
-		case mongo::Array:
-			assert(colmeta.type == terark::db::ColumnType::CarBin);
-			{
-				size_t oldsize = encoded->size();
-				encoded->resize(oldsize + 4); // reserve for uint32 length
-				terarkEncodeBsonArray(elem.embeddedObject(), *encoded);
-				size_t len = encoded->size() - (oldsize + 4);
-				DataView(encoded->data()+oldsize)
-						.write(LittleEndian<uint32_t>(uint32_t(len)));
-			}
-			break;
-		case Object:
-			assert(colmeta.type == terark::db::ColumnType::CarBin);
-			{
-				size_t oldsize = encoded->size();
-				encoded->resize(oldsize + 4); // reserve for uint32 length
-				terarkEncodeBsonObject(elem.embeddedObject(), *encoded);
-				size_t len = encoded->size() - (oldsize + 4);
-				DataView(encoded->data()+oldsize)
-						.write(LittleEndian<uint32_t>(uint32_t(len)));
-			}
-			break;
-		case CodeWScope:
-			assert(colmeta.type == terark::db::ColumnType::CarBin);
-			{
-				assert(colmeta.type == terark::db::ColumnType::CarBin);
-				size_t oldsize = encoded->size();
-				encoded->resize(oldsize + 8); // reserve for uint32 length + uint32 codelen
-				DataView(encoded->data()+oldsize + 4)
-						.write(LittleEndian<uint32_t>(elem.codeWScopeCodeLen()));
-				encoded->append(elem.codeWScopeCode(), elem.codeWScopeCodeLen());
-				terarkEncodeBsonObject(elem.codeWScopeObject(), *encoded);
-				size_t len = encoded->size() - (oldsize + 4);
-				DataView(encoded->data()+oldsize)
-						.write(LittleEndian<uint32_t>(uint32_t(len)));
-			}
-			encoded->append(value, elem.objsize());
-			break;
-		case BinData:
-			if (colmeta.type == terark::db::ColumnType::CarBin) {
-				uint32_t len = elem.valuestrsize() + 1; // 1 is for subtype byte
-				encoded->resize(encoded->size() + 4);
-				DataView(encoded->end() - 4)
-						.write(LittleEndian<uint32_t>(len));
-				encoded->append(value + 4, 1 + elem.valuestrsize());
-			}
-			else if (colmeta.type == terark::db::ColumnType::StrZero) {
-				BsonBinDataToTerarkStrZero(elem, *encoded, isLastField);
-			}
-			else {
-				invariant(!"mongo bindata must be terark carbin or strzero");
-			}
-			break;
-		case RegEx:
-			{
-				const char* p = value;
-				size_t len1 = strlen(p); // regex len
-				size_t len2 = strlen(p + len1 + 1);
-				encoded->append(p, len1 + 1 + len2 + 1);
-			}
-			assert(colmeta.type == terark::db::ColumnType::TwoStrZero);
-			break;
-		default:
-			{
-				StringBuilder ss;
-				ss << BOOST_CURRENT_FUNCTION
-				   << ": BSONElement: bad elem.type " << (int)elem.type();
-				std::string msg = ss.str();
-			//	damnbrain(314159266, msg.c_str(), false);
-				throw std::invalid_argument(msg);
-			}
-		}
-		m_stored.set1(j);
+		encodeSchemaField(colmeta, elem, isLastField, encoded);
+		stored[j] = true;
+		m_fieldOrder[j] = uint32_t(i);
 	}
 
 	if (schemaColumn == schema->columnNum()) {
 		// has no schema-less column
-		bool isAllStored = m_stored.isall1();
+		bool isAllStored = std::find(stored, stored + fieldNum, false) == stored + fieldNum;
 		assert(isAllStored);
 		if (!isAllStored) {
 			THROW_STD(invalid_argument,
 				"schema is forced on all fields, but input data has extra fields");
 		}
+		if (cacheable)
+			m_orderSchema = schema;
 		return;
 	}
+	if (cacheable)
+		m_orderSchema = schema;
 
 	size_t idx = 0;
 	for (auto it = obj.begin(), End = obj.end(); it != End; ++it, ++idx) {
-		if (m_stored.is1(idx))
+		if (stored[idx])
 			continue;
 		BSONElement elem = *it;
 		fstring fieldName = elem.fieldName();
@@ -911,9 +1178,9 @@ void SchemaRecordCoder::encode(const Schema* schema, const Schema* exclude,
 			if (colid >= exclude->columnNum())
 				continue;
 		}
-		encoded->push_back((unsigned char)elem.type());
-		encoded->append(fieldName.data(), fieldName.size()+1);
-		terarkEncodeBsonElemVal(elem, *encoded);
+		uint32_t id = fieldNameId(fieldName);
+		m_fieldIds[idx] = id;
+		encodeSchemaLessField(elem, id, encoded);
 	}
 }
 
@@ -1189,225 +1456,243 @@ static void terarkEncodeNull(MyBsonBuilder& bb, ColumnType coltype) {
 }
 */
 
-SharedBuffer
-SchemaRecordCoder::decode(const Schema* schema, const char* data, size_t size) {
-	assert(nullptr != schema);
-	LOG(3) << "SchemaRecordCoder::decode: data=" << schema->toJsonStr(fstring(data, size));
-	MyBsonBuilder bb;
-	const char* pos = data;
-#if 0
-	bb.resize(sizeof(SharedBuffer::Holder) + 4 + 2 * size);
-	bb.skip(sizeof(SharedBuffer::Holder));
-#else
-// The fucking brain dead mongo::SharedBuffer::Holder become private and
-// mongo::SharedBuffer::takeOwnership was removed
-	bb.resize(4 + 2 * size);
-#endif
-	bb.skip(4); // object size
-	size_t colnum = schema->m_columnsMeta.end_i();
-	// last is $$ field, the schema-less fields
-	size_t schemaColumn
-		= schema->m_columnsMeta.end_key(1) == G_schemaLessFieldName
-		? colnum - 1
-		: colnum
-		;
-	const char* end = data + size;
-	for (size_t i = 0; i < schemaColumn; ++i) {
-		fstring     colname = schema->m_columnsMeta.key(i);
-		const auto& colmeta = schema->m_columnsMeta.val(i);
-		bb.writeByte(colmeta.mongoType);
-		bb.ensureWrite(colname.data(), colname.size()+1); // include '\0'
-		switch ((signed char)colmeta.mongoType) {
-		case EOO:
-			invariant(!"terarkDecodeBsonElemVal: encountered EOO");
-			break;
-		case Undefined:
-			LOG(2) << "SchemaRecordCoder::decode: field('" << colname.c_str() << "') = undefined";
-			assert(0);
-			break;
-		case jstNULL:
-			LOG(2) << "SchemaRecordCoder::decode: field('" << colname.c_str() << "') = null";
-			assert(0);
-			break;
-		case MaxKey:
-			LOG(2) << "SchemaRecordCoder::decode: field('" << colname.c_str() << "') = MaxKey";
-			assert(0);
-			break;
-		case MinKey:
-			LOG(2) << "SchemaRecordCoder::decode: field('" << colname.c_str() << "') = MinKey";
-			assert(0);
-			break;
-		case mongo::Bool:
-			assert(colmeta.fixedLen == 1);
-			bb << char(decodeConvertTo<char>(colmeta.type, pos) ? 1 : 0);
+static void
+decodeSchemaField(MyBsonBuilder& bb, fstring colname, const ColumnMeta& colmeta,
+				  const char*& pos, const char* end, bool isLast) {
+	bb.writeByte(colmeta.mongoType);
+	bb.ensureWrite(colname.data(), colname.size()+1); // include '\0'
+	switch ((signed char)colmeta.mongoType) {
+	case EOO:
+		invariant(!"terarkDecodeBsonElemVal: encountered EOO");
+		break;
+	case Undefined:
+		LOG(2) << "SchemaRecordCoder::decode: field('" << colname.c_str() << "') = undefined";
+		assert(0);
+		break;
+	case jstNULL:
+		LOG(2) << "SchemaRecordCoder::decode: field('" << colname.c_str() << "') = null";
+		assert(0);
+		break;
+	case MaxKey:
+		LOG(2) << "SchemaRecordCoder::decode: field('" << colname.c_str() << "') = MaxKey";
+		assert(0);
+		break;
+	case MinKey:
+		LOG(2) << "SchemaRecordCoder::decode: field('" << colname.c_str() << "') = MinKey";
+		assert(0);
+		break;
+	case mongo::Bool:
+		assert(colmeta.fixedLen == 1);
+		bb << char(decodeConvertTo<char>(colmeta.type, pos) ? 1 : 0);
+		break;
+	case NumberInt:
+		bb << decodeConvertTo<int>(colmeta.type, pos);
+		break;
+	case bsonTimestamp:
+		invariant(colmeta.type == ColumnType::Sint64 ||
+				  colmeta.type == ColumnType::Uint64);
+		bb.ensureWrite(pos, 8);
+		pos += 8;
+		break;
+	case mongo::Date:
+		switch (colmeta.type) {
+		default:
+			invariant(!"SchemaRecordCoder::decode: mongo::Date must map to one of terark sint32, uint32, sint64, uint64");
 			break;
-		case NumberInt:
-			bb << decodeConvertTo<int>(colmeta.type, pos);
+		case ColumnType::Sint32:
+		case ColumnType::Uint32:
+			{
+				int64_t ival = ConstDataView(pos).read<LittleEndian<int>>();
+				int64_t millisec = 1000 * ival;
+				bb << millisec;
+				pos += 4;
+			}
 			break;
-		case bsonTimestamp:
-			invariant(colmeta.type == ColumnType::Sint64 ||
-					  colmeta.type == ColumnType::Uint64);
+		case ColumnType::Sint64:
+		case ColumnType::Uint64:
 			bb.ensureWrite(pos, 8);
 			pos += 8;
 			break;
-		case mongo::Date:
-			switch (colmeta.type) {
-			default:
-				invariant(!"SchemaRecordCoder::decode: mongo::Date must map to one of terark sint32, uint32, sint64, uint64");
-				break;
-			case ColumnType::Sint32:
-			case ColumnType::Uint32:
-				{
-					int64_t ival = ConstDataView(pos).read<LittleEndian<int>>();
-					int64_t millisec = 1000 * ival;
-					bb << millisec;
-					pos += 4;
-				}
-				break;
-			case ColumnType::Sint64:
-			case ColumnType::Uint64:
-				bb.ensureWrite(pos, 8);
-				pos += 8;
-				break;
-			}
-			break;
-		case NumberDouble:
-			bb << decodeConvertTo<double>(colmeta.type, pos);
-			break;
-		case NumberLong:
-			bb << decodeConvertTo<int64_t>(colmeta.type, pos);
-			break;
-		case jstOID:
-			invariant(colmeta.type == ColumnType::Fixed);
-			invariant(colmeta.fixedLen == OID::kOIDSize);
-			bb.ensureWrite(pos, OID::kOIDSize);
-			pos += OID::kOIDSize;
-			break;
-		case Symbol:
-		case Code:
-		case mongo::String:
-			invariant(colmeta.type == ColumnType::StrZero);
-			if (colnum-1 == i) {
-				size_t len = end - pos;
-				if (terark_unlikely(0 == len)) {
-					bb << int(1);
-					bb.writeByte('\0');
-				}
-				else if ('\0' != end[-1]) {
-					bb << int(len + 1);
-					bb.ensureWrite(pos, len);
-					bb.writeByte('\0');
-				}
-				else {
-					bb << int(len);
-					bb.ensureWrite(pos, len);
-				}
-				pos = end;
-			}
-			else {
-				size_t len = strlen(pos);
-				bb << int(len + 1);
-				bb.ensureWrite(pos, len + 1);
-				pos += len + 1;
+		}
+		break;
+	case NumberDouble:
+		bb << decodeConvertTo<double>(colmeta.type, pos);
+		break;
+	case NumberLong:
+		bb << decodeConvertTo<int64_t>(colmeta.type, pos);
+		break;
+	case jstOID:
+		invariant(colmeta.type == ColumnType::Fixed);
+		invariant(colmeta.fixedLen == OID::kOIDSize);
+		bb.ensureWrite(pos, OID::kOIDSize);
+		pos += OID::kOIDSize;
+		break;
+	case Symbol:
+	case Code:
+	case mongo::String:
+		invariant(colmeta.type == ColumnType::StrZero);
+		if (isLast) {
+			size_t len = end - pos;
+			if (terark_unlikely(0 == len)) {
+				bb << int(1);
+				bb.writeByte('\0');
 			}
-			break;
-		case DBRef:
-			{
-				size_t len = strlen(pos);
+			else if ('\0' != end[-1]) {
 				bb << int(len + 1);
-				bb.ensureWrite(pos, len + 1 + OID::kOIDSize);
-				pos += len + 1 + OID::kOIDSize;
-			}
-			break;
-		case mongo::Array:
-			{
-				invariant(colmeta.type == ColumnType::CarBin);
-				size_t len = ConstDataView(pos).read<LittleEndian<uint32_t> >();
-				auto   end = pos + len;
-				terarkDecodeBsonArray(bb, pos, end);
-			}
-			break;
-		case Object:
-			{
-				invariant(colmeta.type == ColumnType::CarBin);
-				size_t len = ConstDataView(pos).read<LittleEndian<uint32_t> >();
-				auto   end = pos + len;
-				terarkDecodeBsonObject(bb, pos, end);
-			}
-			break;
-		case CodeWScope:
-			{
-				invariant(colmeta.type == ColumnType::CarBin);
-				int binlen = ConstDataView(pos).read<LittleEndian<int>>();
-				size_t oldpos = bb.tell();
-				bb << uint32_t(0); // reserve for whole len
-				int codelen = ConstDataView(pos+4).read<LittleEndian<int>>();
-				bb << uint32_t(codelen);
-				bb.ensureWrite(pos + 8, codelen);
-				auto end = pos + binlen;
-				pos += 8 + codelen;
-				terarkDecodeBsonObject(bb, pos, end);
-				uint32_t wholeLen = uint32_t(bb.tell() - oldpos);
-				DataView((char*)bb.buf() + oldpos).write<LittleEndian<uint32_t> >(wholeLen);
-			}
-			break;
-		case BinData:
-			if (colmeta.type == ColumnType::CarBin) {
-				int len = ConstDataView(pos).read<LittleEndian<int>>();
-				bb << len - 1; // pos[4] is binary data subtype
-				bb.ensureWrite(pos + 4, len);
-				pos += 4 + len;
-			}
-			else if (colmeta.type == ColumnType::StrZero) {
-				TerarkStrZeroToBsonBinData(bb, pos, end, colnum-1 == i);
+				bb.ensureWrite(pos, len);
+				bb.writeByte('\0');
 			}
 			else {
-				invariant(!"mongo bindata must be terark carbin or strzero");
+				bb << int(len);
+				bb.ensureWrite(pos, len);
 			}
-			break;
-		case RegEx:
-			invariant(colmeta.type == ColumnType::TwoStrZero);
-			if (colnum-1 == i && '\0' != end[-1]) {
-				size_t len1 = strlen(pos); // regex len
-				size_t len2 = end - (pos + len1 + 1);
-				bb.ensureWrite(pos, len1 + 1 + len2);
-				bb.writeByte('\0');
-				pos = end;
-			} else {
-				size_t len1 = strlen(pos); // regex len
-				size_t len2 = strlen(pos + len1 + 1);
-				size_t len3 = len1 + len2 + 2;
-				bb.ensureWrite(pos, len3);
-				pos += len3;
-			}
-			break;
-		default:
-			{
-				StringBuilder ss;
-				ss << "SchemaRecordCoder::decode(): field('"
-				   << colname.c_str()
-				   << "') = bad subkey.type " << (int)colmeta.mongoType;
-				std::string msg = ss.str();
+			pos = end;
+		}
+		else {
+			size_t len = strlen(pos);
+			bb << int(len + 1);
+			bb.ensureWrite(pos, len + 1);
+			pos += len + 1;
+		}
+		break;
+	case DBRef:
+		{
+			size_t len = strlen(pos);
+			bb << int(len + 1);
+			bb.ensureWrite(pos, len + 1 + OID::kOIDSize);
+			pos += len + 1 + OID::kOIDSize;
+		}
+		break;
+	case mongo::Array:
+		{
+			invariant(colmeta.type == ColumnType::CarBin);
+			size_t len = ConstDataView(pos).read<LittleEndian<uint32_t> >();
+			auto   end = pos + len;
+			terarkDecodeBsonArray(bb, pos, end);
+		}
+		break;
+	case Object:
+		{
+			invariant(colmeta.type == ColumnType::CarBin);
+			size_t len = ConstDataView(pos).read<LittleEndian<uint32_t> >();
+			auto   end = pos + len;
+			terarkDecodeBsonObject(bb, pos, end);
+		}
+		break;
+	case CodeWScope:
+		{
+			invariant(colmeta.type == ColumnType::CarBin);
+			int binlen = ConstDataView(pos).read<LittleEndian<int>>();
+			size_t oldpos = bb.tell();
+			bb << uint32_t(0); // reserve for whole len
+			int codelen = ConstDataView(pos+4).read<LittleEndian<int>>();
+			bb << uint32_t(codelen);
+			bb.ensureWrite(pos + 8, codelen);
+			auto end = pos + binlen;
+			pos += 8 + codelen;
+			terarkDecodeBsonObject(bb, pos, end);
+			uint32_t wholeLen = uint32_t(bb.tell() - oldpos);
+			DataView((char*)bb.buf() + oldpos).write<LittleEndian<uint32_t> >(wholeLen);
+		}
+		break;
+	case BinData:
+		if (colmeta.type == ColumnType::CarBin) {
+			int len = ConstDataView(pos).read<LittleEndian<int>>();
+			bb << len - 1; // pos[4] is binary data subtype
+			bb.ensureWrite(pos + 4, len);
+			pos += 4 + len;
+		}
+		else if (colmeta.type == ColumnType::StrZero) {
+			TerarkStrZeroToBsonBinData(bb, pos, end, isLast);
+		}
+		else {
+			invariant(!"mongo bindata must be terark carbin or strzero");
+		}
+		break;
+	case RegEx:
+		invariant(colmeta.type == ColumnType::TwoStrZero);
+		if (isLast && '\0' != end[-1]) {
+			size_t len1 = strlen(pos); // regex len
+			size_t len2 = end - (pos + len1 + 1);
+			bb.ensureWrite(pos, len1 + 1 + len2);
+			bb.writeByte('\0');
+			pos = end;
+		} else {
+			size_t len1 = strlen(pos); // regex len
+			size_t len2 = strlen(pos + len1 + 1);
+			size_t len3 = len1 + len2 + 2;
+			bb.ensureWrite(pos, len3);
+			pos += len3;
+		}
+		break;
+	default:
+		{
+			StringBuilder ss;
+			ss << "SchemaRecordCoder::decode(): field('"
+			   << colname.c_str()
+			   << "') = bad subkey.type " << (int)colmeta.mongoType;
+			std::string msg = ss.str();
 //				damnbrain(314159268, msg.c_str(), false);
-				throw std::invalid_argument(msg);
-			}
+			throw std::invalid_argument(msg);
 		}
 	}
-	if (pos < end) {
-		while (pos < end) {
-			const int type = (signed char)(*pos++);
+}
+
+void SchemaRecordCoder::decodeSchemaLessFields(MyBsonBuilder& bb,
+											   const char*& pos, const char* end) {
+	while (pos < end) {
+		int type = (signed char)(*pos++);
+		if (EOO == type) { // encoded by name id
+			type = (signed char)(*pos++);
+			const unsigned char* idEnd = nullptr;
+			uint32_t id = load_var_uint32((const unsigned char*)pos, &idEnd);
+			pos = (const char*)idEnd;
+			fstring fieldname = fieldNameOf(id);
+			bb << char(type);
+			bb.ensureWrite(fieldname.data(), fieldname.size()+1);
+		}
+		else {
 			bb << char(type);
-			assert(EOO != type);
 			StringData fieldname = pos;
 			bb.ensureWrite(fieldname.begin(), fieldname.size()+1);
 			pos += fieldname.size() + 1;
-			terarkDecodeBsonElemVal(bb, pos, end, type);
 		}
-		invariant(pos == end);
+		terarkDecodeBsonElemVal(bb, pos, end, type);
 	}
-	else {
-		invariant(pos == end);
+	invariant(pos == end);
+}
+
+SharedBuffer
+SchemaRecordCoder::decode(const Schema* schema, const char* data, size_t size) {
+	assert(nullptr != schema);
+	LOG(3) << "SchemaRecordCoder::decode: data=" << schema->toJsonStr(fstring(data, size));
+	MyBsonBuilder& bb = m_bsonBuf;
+	const char* pos = data;
+	bb.rewind();
+#if 0
+	bb.resize(sizeof(SharedBuffer::Holder) + 4 + 2 * size);
+	bb.skip(sizeof(SharedBuffer::Holder));
+#else
+// The fucking brain dead mongo::SharedBuffer::Holder become private and
+// mongo::SharedBuffer::takeOwnership was removed
+	if (bb.size() < 4 + 2 * size)
+		bb.resize(4 + 2 * size);
+#endif
+	bb.skip(4); // object size
+	size_t colnum = schema->m_columnsMeta.end_i();
+	// last is $$ field, the schema-less fields
+	size_t schemaColumn
+		= schema->m_columnsMeta.end_key(1) == G_schemaLessFieldName
+		? colnum - 1
+		: colnum
+		;
+	const char* end = data + size;
+	for (size_t i = 0; i < schemaColumn; ++i) {
+		fstring     colname = schema->m_columnsMeta.key(i);
+		const auto& colmeta = schema->m_columnsMeta.val(i);
+		decodeSchemaField(bb, colname, colmeta, pos, end, colnum-1 == i);
 	}
+	decodeSchemaLessFields(bb, pos, end);
 	bb << char(EOO); // End of object
 
 #if 0
@@ -1426,6 +1711,92 @@ SchemaRecordCoder::decode(const Schema* schema, const char* data, size_t size) {
 #endif
 }
 
+SharedBuffer
+SchemaRecordCoder::decodeColumns(const Schema* schema,
+								 const size_t* colsId, size_t colsNum,
+								 const char* data, size_t size) {
+	assert(nullptr != schema);
+	MyBsonBuilder& bb = m_bsonBuf;
+	bb.rewind();
+	if (bb.size() < 4 + 2 * size)
+		bb.resize(4 + 2 * size);
+	bb.skip(4); // object size
+	const char* pos = data;
+	const char* end = data + size;
+	for (size_t i = 0; i < colsNum; ++i) {
+		fstring     colname = schema->m_columnsMeta.key(colsId[i]);
+		const auto& colmeta = schema->m_columnsMeta.val(colsId[i]);
+		if (colname == G_schemaLessFieldName) {
+			invariant(colsNum-1 == i);
+			decodeSchemaLessFields(bb, pos, end);
+		}
+		else {
+			decodeSchemaField(bb, colname, colmeta, pos, end, colsNum-1 == i);
+		}
+	}
+	invariant(pos == end);
+	bb << char(EOO); // End of object
+	int bsonSize = int(bb.tell());
+	DataView((char*)bb.buf()).write<LittleEndian<int>>(bsonSize);
+	SharedBuffer sb = SharedBuffer::allocate(bsonSize);
+	memcpy(sb.get(), bb.begin(), bsonSize);
+	return sb;
+}
+
+void
+SchemaRecordCoder::projectColumns(const Schema* schema, const BSONObj& projection,
+								  terark::valvec<size_t>* colsId) {
+	colsId->erase_all();
+	const size_t colnum = schema->columnNum();
+	bool hasSchemaLess = false;
+	bool withId = true;
+	bool exclusion = false;
+	for (const BSONElement& elem : projection) {
+		fstring fieldname(elem.fieldName(), elem.fieldNameSize()-1);
+		if (elem.isBoolean() || elem.isNumber()) {
+			if (!elem.trueValue()) {
+				if (fieldname == "_id") {
+					withId = false;
+					continue;
+				}
+				exclusion = true; // needs all fields
+				break;
+			}
+		}
+		const char* dot = (const char*)memchr(fieldname.data(), '.', fieldname.size());
+		if (dot) { // "a.b" needs top level field "a"
+			fieldname = fstring(fieldname.data(), dot);
+		}
+		size_t columnId = schema->getColumnId(fieldname);
+		if (columnId < colnum && fieldname != G_schemaLessFieldName) {
+			if (std::find(colsId->begin(), colsId->end(), columnId) == colsId->end())
+				colsId->push_back(columnId);
+		}
+		else {
+			hasSchemaLess = true;
+		}
+	}
+	if (exclusion) {
+		colsId->erase_all();
+	}
+	else if (hasSchemaLess) {
+		size_t columnId = schema->getColumnId(G_schemaLessFieldName);
+		if (columnId < colnum) {
+			colsId->push_back(columnId); // will be expanded to all fields
+		}
+	}
+	if (colsId->empty()) {
+		colsId->resize(colnum);
+		for (size_t i = 0; i < colnum; ++i) (*colsId)[i] = i;
+		return;
+	}
+	size_t idColumn = schema->getColumnId("_id");
+	if (withId && idColumn < colnum &&
+			std::find(colsId->begin(), colsId->end(), idColumn) == colsId->end()) {
+		colsId->insert(colsId->begin(), idColumn);
+	}
+}
+
 SharedBuffer
 SchemaRecordCoder::decode(const Schema* schema, const terark::valvec<char>& encoded) {
 	return decode(schema, encoded.data(), encoded.size());
@@ -1602,17 +1973,15 @@ void encodeIndexKey(const Schema& indexSchema,
 		reinterpret_cast<terark::valvec<char>*>(encoded));
 }
 
-SharedBuffer
-decodeIndexKey(const Schema& indexSchema, const char* data, size_t size) {
+// BSON of the key is written to [bb.begin(), bb.tell())
+static void
+decodeIndexKeyTo(MyBsonBuilder& bb, const Schema& indexSchema,
+				 const char* data, size_t size) {
 	LOG(3)	<< "decodeIndexKey: size=" << size << ", data=" << indexSchema.toJsonStr(data, size);
-	MyBsonBuilder bb;
 	const char* pos = data;
-#if 0
-	bb.resize(sizeof(SharedBuffer::Holder) + 4 + 2*size);
-	bb.skip(sizeof(SharedBuffer::Holder));
-#else
-	bb.resize(4 + 2*size);
-#endif
+	bb.rewind();
+	if (bb.size() < 4 + 2*size)
+		bb.resize(4 + 2*size);
 	bb.skip(4); // object size loc
 	const size_t colnum = indexSchema.m_columnsMeta.end_i();
 	const char* end = data + size;
@@ -1773,20 +2142,24 @@ decodeIndexKey(const Schema& indexSchema, const char* data, size_t size) {
 	}
 	invariant(pos == end);
 	bb << char(EOO); // end of object
-
-#if 0
-	bb.shrink_to_fit();
-	int bsonSize = int(bb.tell() - sizeof(SharedBuffer::Holder));
-	DataView((char*)bb.buf() + sizeof(SharedBuffer::Holder))
-			.write<LittleEndian<int>>(bsonSize);
-	return SharedBuffer::takeOwnership((char*)bb.release());
-#else
 	int bsonSize = int(bb.tell());
 	DataView((char*)bb.buf()).write<LittleEndian<int>>(bsonSize);
+}
+
+SharedBuffer
+decodeIndexKey(const Schema& indexSchema, const char* data, size_t size) {
+	MyBsonBuilder bb;
+	return decodeIndexKey(indexSchema, data, size, &bb);
+}
+
+SharedBuffer
+decodeIndexKey(const Schema& indexSchema, const char* data, size_t size,
+			   MyBsonBuilder* buf) {
+	decodeIndexKeyTo(*buf, indexSchema, data, size);
+	int bsonSize = int(buf->tell());
 	SharedBuffer sb = SharedBuffer::allocate(bsonSize);
-	memcpy(sb.get(), bb.begin(), bsonSize);
+	memcpy(sb.get(), buf->begin(), bsonSize);
 	return sb;
-#endif
 }
 
 } } // namespace mongo::terarkdb
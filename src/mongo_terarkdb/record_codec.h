@@ -10,7 +10,15 @@
 #include <terark/valvec.hpp>
 #include <terark/fstring.hpp>
 #include <terark/db/db_conf.hpp>
+#include <terark/db/db_context.hpp>
 #include <terark/db/db_segment.hpp>
+#include <terark/io/DataIO.hpp>
+#include <terark/io/MemStream.hpp>
+#include <terark/hash_strmap.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <mutex>
+#include <string>
 
 namespace mongo { namespace terarkdb {
 
@@ -21,16 +29,78 @@ using terark::db::SchemaSetPtr;
 
 extern const char G_schemaLessFieldName[];
 
+// Field names of schema-less fields of a collection, a schema-less field
+// is encoded by the id of its name instead of the name. Ids are appended
+// to file "fieldnames.dict" of the table dir as '\0' terminated names and
+// are never changed, coders keep lock free copies, see fieldNameId.
+// At most env TerarkDB_FieldNameDictMaxNames(default 65536) names, more
+// names are stored inline, so do docs of a table without the dict
+class FieldNameDict : public terark::RefCounter {
+	std::mutex m_mutex;
+	terark::valvec<char>     m_pool; // '\0' terminated names
+	terark::valvec<uint32_t> m_offsets;
+	terark::hash_strmap<uint32_t> m_ids;
+	std::string m_fpath;
+	FILE*  m_fp;
+	size_t m_maxNames;
+public:
+	explicit FieldNameDict(const std::string& fpath);
+	~FieldNameDict();
+
+	///@returns UINT32_MAX if the dict is full
+	uint32_t findOrAdd(terark::fstring name);
+
+	/// append names [pool->size() in names, end) to the copy of a coder
+	void copyTo(terark::valvec<char>* pool, terark::valvec<uint32_t>* offsets);
+};
+typedef boost::intrusive_ptr<FieldNameDict> FieldNameDictPtr;
+
 class SchemaRecordCoder {
 public:
-	terark::febitvec m_stored;
 	typedef terark::gold_hash_set<terark::fstring,
 		terark::fstring_func::hash, terark::fstring_func::equal> FieldsMap;
 	FieldsMap m_fields;
+	// reused by decode, thus decoding a record needs just one malloc
+	terark::LittleEndianDataOutput<terark::AutoGrownMemIO> m_bsonBuf;
+
+	// field order of last encoded obj: m_fieldOrder[k] is the schema column
+	// of field k, or UINT32_MAX for schema-less fields
+	const Schema* m_orderSchema;
+	terark::valvec<uint32_t> m_fieldOrder;
+	// dict ids of fields of last encoded obj, UINT32_MAX if not in dict
+	terark::valvec<uint32_t> m_fieldIds;
+
+	// lock free copy of m_fieldDict, names are '\0' terminated
+	FieldNameDictPtr m_fieldDict;
+	terark::valvec<char>     m_dictPool;
+	terark::valvec<uint32_t> m_dictOffsets; // dict size + 1
+	terark::hash_strmap<uint32_t> m_dictIds;
+	bool m_dictFull;
+
+	// per call temporaries of encode are allocated in m_arena, it is the
+	// arena of the DbContext of the thread if set by setArena
+	terark::db::DbContextArena* m_arena;
+	terark::db::DbContextArena  m_ownArena;
+
+	uint32_t fieldNameId(terark::fstring name);
+	terark::fstring fieldNameOf(uint32_t id);
+	void syncFieldDict();
+	void encodeSchemaLessField(const BSONElement&, uint32_t id,
+							   terark::valvec<char>* encoded);
+	void decodeSchemaLessFields(terark::LittleEndianDataOutput<terark::AutoGrownMemIO>& bb,
+								const char*& pos, const char* end);
+
+	bool encodeByCachedOrder(const Schema*, size_t schemaColumn,
+							 const BSONObj&, terark::valvec<char>* encoded);
 
 	SchemaRecordCoder();
 	~SchemaRecordCoder();
 
+	/// schema-less fields are encoded by ids of dict, nullptr by names
+	void setFieldDict(FieldNameDict* dict);
+	/// arena must outlive the coder, nullptr is the arena of the coder
+	void setArena(terark::db::DbContextArena* arena);
+
 	static void parseToFields(const BSONObj&, FieldsMap*);
 	static bool fieldsEqual(const FieldsMap&, const FieldsMap&);
 
@@ -52,6 +122,24 @@ public:
 	SharedBuffer decode(const Schema* schema, const terark::valvec<char>& encoded);
 	SharedBuffer decode(const Schema* schema, StringData encoded);
 	SharedBuffer decode(const Schema* schema, terark::fstring encoded);
+
+	///@param colsId columns of schema, G_schemaLessFieldName must be last
+	///@param data   returned by DbTable::selectColumns(colsId)
+	///@returns BSON of the columns, G_schemaLessFieldName is expanded
+	SharedBuffer decodeColumns(const Schema* schema,
+							   const size_t* colsId, size_t colsNum,
+							   const char* data, size_t size);
+	SharedBuffer decodeColumns(const Schema* schema,
+							   const terark::valvec<size_t>& colsId,
+							   terark::fstring data) {
+		return decodeColumns(schema, colsId.data(), colsId.size(),
+							 data.data(), data.size());
+	}
+
+	/// columns needed by projection, fields which are not in schema, or
+	/// all fields if projection is empty, needs G_schemaLessFieldName
+	static void projectColumns(const Schema* schema, const BSONObj& projection,
+							   terark::valvec<size_t>* colsId);
 };
 
 void encodeIndexKey(const Schema& indexSchema,
@@ -69,6 +157,17 @@ decodeIndexKey(const Schema& indexSchema, terark::fstring data) {
 	return decodeIndexKey(indexSchema, data.data(), data.size());
 }
 
+/// buf is reused by decoding keys, thus decoding a key needs just one malloc
+SharedBuffer
+decodeIndexKey(const Schema& indexSchema, const char* data, size_t size,
+			   terark::LittleEndianDataOutput<terark::AutoGrownMemIO>* buf);
+
+inline SharedBuffer
+decodeIndexKey(const Schema& indexSchema, terark::fstring data,
+			   terark::LittleEndianDataOutput<terark::AutoGrownMemIO>* buf) {
+	return decodeIndexKey(indexSchema, data.data(), data.size(), buf);
+}
+
 } } // namespace mongo::terarkdb
 
 
@@ -33,6 +33,7 @@
 
 #include "terarkdb_index.h"
 
+#include <algorithm>
 #include <set>
 
 #include "mongo/base/checked_cast.h"
@@ -138,9 +139,10 @@ TerarkDbIndex::TerarkDbIndex(ThreadSafeTable* table, OperationContext* ctx, cons
 	}
 	indexColumnNames.pop_back();
 	LOG(2) << "TerarkDbIndex::TerarkDbIndex(): indexColumnNames=" << indexColumnNames;
-	DbTable* tab = table->m_tab.get();
-	const size_t indexId = tab->getIndexId(indexColumnNames);
-	if (indexId == tab->getIndexNum()) {
+	// use the schema of ThreadSafeTable, DbTable may not be opened yet
+	const terark::db::SchemaConfig& sconf = table->schema();
+	const size_t indexId = sconf.getIndexId(indexColumnNames);
+	if (indexId == sconf.getIndexNum()) {
 		// no such index
 		THROW_STD(invalid_argument,
 			"index(%s) on collection(%s) is not defined",
@@ -148,12 +150,11 @@ TerarkDbIndex::TerarkDbIndex(ThreadSafeTable* table, OperationContext* ctx, cons
 			desc->parentNS().c_str());
 	}
 	m_indexId = indexId;
-	invariant(desc->unique() == getIndexSchema()->m_isUnique);
+	invariant(desc->unique() == sconf.getIndexSchema(indexId).m_isUnique);
 }
 
 TerarkDbIndex::~TerarkDbIndex() {
-	DbTable* tab = m_table->m_tab.get();
-    LOG(1) << BOOST_CURRENT_FUNCTION << ": dir: " << tab->getDir().string();
+    LOG(1) << BOOST_CURRENT_FUNCTION << ": dir: " << m_table->getDir().string();
 }
 
 struct UnindexOnFail : RecoveryUnit::Change {
@@ -178,7 +179,7 @@ Status TerarkDbIndex::insert(OperationContext* txn,
                            bool dupsAllowed)
 {
 	ThreadSafeTable* tst = m_table.get();
-	DbTable* tab = tst->m_tab.get();
+	DbTable* tab = tst->tab();
     LOG(2) << "TerarkDbIndex::insert(): key = " << key << ", id = " << id
 		<< ",  dir: " << tab->getDir().string();
 	RecoveryUnitDataPtr rud = NULL;
@@ -216,7 +217,7 @@ void TerarkDbIndex::do_unindex(const char* func,
 	auto indexSchema = getIndexSchema();
 	encodeIndexKey(*indexSchema, key, &td.m_buf);
 	llong recIdx = id.repr() - 1;
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
     LOG(2) << func << ": key = " << key << ", id = " << id
 		<< ",  dir: " << tab->getDir().string();
 	tab->indexRemove(m_indexId, td.m_buf, recIdx, &*td.m_dbCtx);
@@ -227,7 +228,7 @@ void TerarkDbIndex::fullValidate(OperationContext* txn,
 							   ValidateResults* output) const {
 	LOG(2) << BOOST_CURRENT_FUNCTION << ": just get the [numKeysOut]";
 	if (numKeysOut) {
-		*numKeysOut = m_table->m_tab->existingRows();
+		*numKeysOut = m_table->tab()->existingRows();
 	}
 }
 
@@ -247,7 +248,7 @@ Status TerarkDbIndex::dupKeyCheck(OperationContext* txn, const BSONObj& key, con
 	auto indexSchema = getIndexSchema();
 	encodeIndexKey(*indexSchema, key, &td.m_buf);
 	auto& tmpIdvec = td.m_dbCtx->exactMatchRecIdvec;
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
 	tab->indexSearchExact(m_indexId, td.m_buf, &tmpIdvec, &*td.m_dbCtx);
 	if (tmpIdvec.empty()) {
 	    return Status::OK();
@@ -260,7 +261,7 @@ Status TerarkDbIndex::dupKeyCheck(OperationContext* txn, const BSONObj& key, con
 }
 
 bool TerarkDbIndex::isEmpty(OperationContext* txn) {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
     return tab->numDataRows() == 0;
 }
 
@@ -269,7 +270,7 @@ Status TerarkDbIndex::touch(OperationContext* txn) const {
 }
 
 long long TerarkDbIndex::getSpaceUsedBytes(OperationContext* txn) const {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
     return tab->indexStorageSize(m_indexId);
 }
 
@@ -282,7 +283,7 @@ bool
 TerarkDbIndex::insertIndexKey(const BSONObj& newKey, const RecordId& id, bool dupsAllowed,
 							  OperationContext* txn, TableThreadData* td) {
 	encodeIndexKey(*getIndexSchema(), newKey, &td->m_buf);
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
 	if (tab->indexInsert(m_indexId, td->m_buf, id.repr()-1, &*td->m_dbCtx)) {
 		if (txn && txn->recoveryUnit()) {
 			txn->recoveryUnit()->registerChange(new UnindexOnFail(this, txn, newKey, id, dupsAllowed));
@@ -478,8 +479,8 @@ protected:
         dassert(!_id.isNull());
 		invariant(nullptr != _cursor);
         BSONObj bson;
-        if (TRACING_ENABLED || (parts & kWantKey)) {
-            bson = BSONObj(decodeIndexKey(*_idx.getIndexSchema(), _cursor->m_curKey));
+        if (TRACING_ENABLED || (parts & kWantKey)) { // no decode for kWantLoc
+            bson = BSONObj(decodeIndexKey(*_idx.getIndexSchema(), _cursor->m_curKey, &_keyBuf));
             TRACE_CURSOR << "curr() returning " << bson << ' ' << _id;
         }
         return {{std::move(bson), _id}};
@@ -577,6 +578,9 @@ protected:
     const TerarkDbIndex& _idx;  // not owned
     mutable IndexIterDataPtr  _cursor;
 
+    // reused by decoding keys in curr(), keys are decoded only for kWantKey
+    terark::LittleEndianDataOutput<terark::AutoGrownMemIO> _keyBuf;
+
     // These are where this cursor instance is. They are not changed in the face of a failing
     // next().
     RecordId _id;
@@ -620,6 +624,30 @@ public:
 		else {
 			m_ttd = tst->allocTableThreadData();
 		}
+		// Index of a readonly segment is built with the segment, keys of
+		// its records are already in it, only writable segments need keys.
+		// A segment never goes back from readonly to writable, thus this
+		// snapshot is still valid when the segment array is changed.
+		DbTable* tab = tst->tab();
+		terark::db::MyRwLock lock(tab->m_rwMutex, false);
+		llong baseId = 0;
+		for (size_t i = 0, n = tab->getSegNum(); i < n; ++i) {
+			auto seg = tab->getSegmentPtr(i);
+			llong rows = seg->numDataRows();
+			if (!seg->m_indices[idx->m_indexId]->getWritableIndex()) {
+				if (!m_indexedRanges.empty() && m_indexedRanges.back().second == baseId)
+					m_indexedRanges.back().second = baseId + rows;
+				else
+					m_indexedRanges.emplace_back(baseId, baseId + rows);
+			}
+			baseId += rows;
+		}
+	}
+
+	bool isIndexedRecord(llong recIdx) const {
+		auto iter = std::upper_bound(m_indexedRanges.begin(), m_indexedRanges.end(),
+			std::make_pair(recIdx, LLONG_MAX));
+		return iter != m_indexedRanges.begin() && recIdx < iter[-1].second;
 	}
 
     Status addKey(const BSONObj& newKey, const RecordId& id) override {
@@ -628,6 +656,10 @@ public:
             if (!s.isOK())
                 return s;
         }
+		if (isIndexedRecord(id.repr() - 1)) {
+			m_skippedKeys++;
+			return Status::OK();
+		}
 		if (_idx->insertIndexKey(newKey, id, _dupsAllowed, _txn, &*m_ttd)) {
 	        return Status::OK();
 		} else {
@@ -637,6 +669,8 @@ public:
     }
 
     void commit(bool mayInterrupt) override {
+		LOG(1) << "TerarkDbIndex::BulkBuilder::commit(): skipped " << m_skippedKeys
+			<< " keys of readonly segments, dir: " << _idx->m_table->tab()->getDir().string();
         // TODO do we still need this?
         // this is bizarre, but required as part of the contract
         WriteUnitOfWork uow(_txn);
@@ -649,6 +683,9 @@ private:
 	RecoveryUnitDataPtr     m_rud;
 	TableThreadDataPtr      m_ttd;
     const bool _dupsAllowed;
+	// record index ranges [first, second) of readonly segments
+	valvec<std::pair<llong, llong> > m_indexedRanges;
+	size_t m_skippedKeys = 0;
 };
 
 TerarkDbIndexUnique::TerarkDbIndexUnique(ThreadSafeTable* tab,
@@ -99,7 +99,7 @@ public:
     ThreadSafeTablePtr m_table;
 
 	const terark::db::Schema* getIndexSchema() const {
-		return &m_table->m_tab->getIndexSchema(m_indexId);
+		return &m_table->tab()->getIndexSchema(m_indexId);
 	}
 
 	bool insertIndexKey(const BSONObj& newKey, const RecordId& id, bool dupsAllowed,
@@ -62,6 +62,7 @@
 #include "terarkdb_record_store_capped.h"
 #include "terarkdb_recovery_unit.h"
 #include "terarkdb_size_storer.h"
+#include "terarkdb_snapshot_manager.h"
 #include "mongo/db/storage/storage_options.h"
 #include "mongo/util/log.h"
 #include "mongo/util/background.h"
@@ -73,6 +74,7 @@
 #include "mongo/db/storage/kv/kv_catalog.h"
 #include <terark/io/FileStream.hpp>
 #include <terark/util/profiling.hpp>
+#include <algorithm>
 
 #if !defined(__has_feature)
 #define __has_feature(x) 0
@@ -94,9 +96,11 @@ inline int32_t toSigned(uint32_t x) { return x; }
 ICleanOnOwnerDead::~ICleanOnOwnerDead() {
 }
 
-TableThreadData::TableThreadData(DbTable* tab) {
+TableThreadData::TableThreadData(DbTable* tab, FieldNameDict* fieldDict) {
 	m_dbCtx.reset(tab->createDbContext());
 	m_dbCtx->syncIndex = false;
+	m_coder.setFieldDict(fieldDict);
+	m_coder.setArena(&m_dbCtx->arena);
 }
 
 IndexIterData::IndexIterData(DbTable* tab, size_t indexId, bool forward) {
@@ -119,28 +123,64 @@ void IndexIterData::reset(llong now) {
 	m_ctx->trySyncSegCtxSpeculativeLock(m_ctx->m_tab);
 }
 
-ThreadSafeTable::ThreadSafeTable(const fs::path& dbPath) {
-	m_tab = DbTable::open(dbPath);
-	m_indexForwardIterCache.resize(m_tab->getIndexNum());
-	m_indexBackwardIterCache.resize(m_tab->getIndexNum());
+ThreadSafeTable::ThreadSafeTable(const fs::path& dbPath, bool lazyOpen)
+	: m_dir(dbPath), m_tabRaw(nullptr), m_destroyed(false) {
+	if (lazyOpen) {
+		m_schema = new terark::db::SchemaConfig();
+		m_schema->loadJsonFile((dbPath / "dbmeta.json").string());
+	}
+	else {
+		m_tab = DbTable::open(dbPath);
+		m_schema = &m_tab->getSchemaConfig();
+		m_tabRaw.store(m_tab.get(), std::memory_order_release);
+	}
+	const size_t indexNum = m_schema->getIndexNum();
+	m_indexForwardIterCache.resize(indexNum);
+	m_indexBackwardIterCache.resize(indexNum);
+	m_indexIterStat.reset(new IndexIterStat[indexNum]);
 	m_cacheExpireMillisec = terark::getEnvLong("ThreadSafeTable_cacheExpireMillisec", 5 * 1000);
+	m_batchRecoveryUnitChanges = terark::getEnvBool("ThreadSafeTable_batchRecoveryUnitChanges", true);
+	if (terark::getEnvBool("TerarkDB_FieldNameDict", true)) {
+		m_fieldDict = new FieldNameDict((dbPath / "fieldnames.dict").string());
+	}
 }
 
 ThreadSafeTable::~ThreadSafeTable() {
-	log() << BOOST_CURRENT_FUNCTION << ": tabDir: " << m_tab->getDir().string()
-		<< ", refcnt = " << m_tab->get_refcount();
+	log() << BOOST_CURRENT_FUNCTION << ": tabDir: " << m_dir.string()
+		<< ", refcnt = " << (m_tab ? m_tab->get_refcount() : 0);
 	destroy();
 }
 
+DbTable* ThreadSafeTable::openDbTable() {
+	std::lock_guard<std::mutex> lock(m_openMutex);
+	if (m_tab) {
+		return m_tab.get(); // opened by another thread
+	}
+	if (m_destroyed) {
+		THROW_STD(logic_error, "table is destroyed: %s", m_dir.string().c_str());
+	}
+	auto t0 = g_profiling.now();
+	DbTablePtr tab = DbTable::open(m_dir);
+	if (tab->getIndexNum() != m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "indexNum changed: %zd -> %zd, dir: %s"
+			, m_schema->getIndexNum(), tab->getIndexNum(), m_dir.string().c_str());
+	}
+	m_tab = tab;
+	m_tabRaw.store(m_tab.get(), std::memory_order_release);
+	LOG(1) << "ThreadSafeTable::openDbTable(): dir: " << m_dir.string()
+		<< ", time = " << g_profiling.mf(t0, g_profiling.now()) << " ms";
+	return m_tab.get();
+}
+
 TableThreadDataPtr ThreadSafeTable::allocTableThreadData() {
 	TableThreadDataPtr ret;
 	std::unique_lock<std::mutex> lock(this->m_cursorCacheMutex);
 	if (m_cursorCache.empty()) {
 		lock.unlock();
-		ret = new TableThreadData(this->m_tab.get());
+		ret = new TableThreadData(tab(), m_fieldDict.get());
 	}
 	else {
-		auto tab = m_tab.get();
+		auto tab = this->tab();
 		for (auto& p : m_cursorCache) {
 			p->m_dbCtx->trySyncSegCtxSpeculativeLock(tab);
 		}
@@ -154,55 +194,85 @@ void ThreadSafeTable::releaseTableThreadData(TableThreadDataPtr ttd) {
 	m_cursorCache.push_back(std::move(ttd));
 }
 
+void
+ThreadSafeTable::expiringCacheItems(valvec<IndexIterDataPtr>& v, llong now,
+									llong expireMillisec) {
+	// items are pushed back, so the front are the oldest
+	size_t pos = 0;
+	for (; pos < v.size(); ++pos) {
+		if (g_profiling.ms(v[pos]->m_lastUseTime, now) < expireMillisec)
+			break;
+	}
+	v.erase_i(0, pos);
+}
+
 void
 ThreadSafeTable::expiringCacheItems(valvec<valvec<IndexIterDataPtr> >& vv, llong now) {
-	llong expireMillisec = m_cacheExpireMillisec;
-	for (auto& v : vv) {
-		size_t pos = 0;
-		for (; pos < v.size(); ++pos) {
-			if (g_profiling.ms(v[pos]->m_lastUseTime, now) < expireMillisec)
-				break;
-		}
-		v.erase_i(pos, v.size() - pos);
+	for (size_t indexId = 0; indexId < vv.size(); ++indexId) {
+		expiringCacheItems(vv[indexId], now, indexIterExpireMillisec(indexId));
+	}
+}
+
+// An iterator is worth keeping only if it is likely to be allocated again
+// before expired: indices allocated less often than m_cacheExpireMillisec
+// get the minimal expire time, others keep iterators for a few intervals,
+// this frees iterators of a burst quickly on a hot index.
+llong ThreadSafeTable::indexIterExpireMillisec(size_t indexId) const {
+	const llong maxExpire = m_cacheExpireMillisec;
+	const llong minExpire = std::max<llong>(maxExpire / 16, 1);
+	llong avg = m_indexIterStat[indexId].avgIntervalMillisec.load(std::memory_order_relaxed);
+	if (avg >= maxExpire)
+		return minExpire;
+	return std::min(std::max(4 * avg, minExpire), maxExpire);
+}
+
+ThreadSafeTable::LocalIndexIterCache& ThreadSafeTable::getLocalIndexIterCache() {
+	LocalIndexIterCache& lc = m_localIndexIterCache.local();
+	if (terark_unlikely(lc.forward.empty())) {
+		lc.forward.resize(m_schema->getIndexNum());
+		lc.backward.resize(m_schema->getIndexNum());
 	}
+	return lc;
 }
 
 IndexIterDataPtr ThreadSafeTable::allocIndexIter(size_t indexId, bool forward) {
-	auto tab = m_tab.get();
+	auto tab = this->tab();
 	IndexIterDataPtr iter;
 	assert(indexId < tab->getIndexNum());
 	assert(m_indexForwardIterCache.size() == tab->getIndexNum());
 	assert(m_indexBackwardIterCache.size() == tab->getIndexNum());
 	llong now = g_profiling.now();
-	{
+	IndexIterStat& stat = m_indexIterStat[indexId];
+	llong last = stat.lastAllocTime.exchange(now, std::memory_order_relaxed);
+	if (last) { // racy update is ok, it is just a hint
+		llong interval = g_profiling.ms(last, now);
+		llong avg = stat.avgIntervalMillisec.load(std::memory_order_relaxed);
+		stat.avgIntervalMillisec.store((7 * avg + interval) / 8, std::memory_order_relaxed);
+	}
+	const llong expire = indexIterExpireMillisec(indexId);
+	LocalIndexIterCache& lc = getLocalIndexIterCache();
+	auto& local = forward ? lc.forward[indexId] : lc.backward[indexId];
+	expiringCacheItems(local, now, expire);
+	if (!local.empty()) {
+		iter = local.pop_val();
+	}
+	else {
 		std::unique_lock<std::mutex> lock(m_cursorCacheMutex);
-		if (forward) {
-			if (m_indexForwardIterCache[indexId].empty()) {
-				expiringCacheItems(m_indexForwardIterCache, now);
-				expiringCacheItems(m_indexBackwardIterCache, now);
-				lock.unlock();
-				iter = new IndexIterData(tab, indexId, forward);
-			} else {
-				iter = m_indexForwardIterCache[indexId].pop_val();
-				expiringCacheItems(m_indexForwardIterCache, now);
-				expiringCacheItems(m_indexBackwardIterCache, now);
-			}
-		}
-		else {
-			if (m_indexBackwardIterCache[indexId].empty()) {
-				expiringCacheItems(m_indexForwardIterCache, now);
-				expiringCacheItems(m_indexBackwardIterCache, now);
-				lock.unlock();
-				iter = new IndexIterData(tab, indexId, forward);
-				iter->m_cursor = tab->createIndexIterBackward(indexId, nullptr);
-			} else {
-				iter = m_indexBackwardIterCache[indexId].pop_val();
-				expiringCacheItems(m_indexForwardIterCache, now);
-				expiringCacheItems(m_indexBackwardIterCache, now);
-			}
+		auto& global = forward ? m_indexForwardIterCache : m_indexBackwardIterCache;
+		expiringCacheItems(global[indexId], now, expire);
+		if (!global[indexId].empty()) {
+			iter = global[indexId].pop_val();
 		}
 	}
-	iter->reset(now);
+	if (iter) {
+		stat.hits.fetch_add(1, std::memory_order_relaxed);
+		iter->reset(now);
+	}
+	else {
+		stat.misses.fetch_add(1, std::memory_order_relaxed);
+		iter = new IndexIterData(tab, indexId, forward);
+		iter->m_lastUseTime = now;
+	}
 	return iter;
 }
 
@@ -211,13 +281,118 @@ void ThreadSafeTable::releaseIndexIter(size_t indexId, bool forward, IndexIterDa
 	assert(m_indexForwardIterCache.size() == m_indexBackwardIterCache.size());
 	llong now = g_profiling.now();
 	iter->reset(now);
+	const llong expire = indexIterExpireMillisec(indexId);
+	LocalIndexIterCache& lc = getLocalIndexIterCache();
+	auto& local = forward ? lc.forward[indexId] : lc.backward[indexId];
+	expiringCacheItems(local, now, expire);
+	if (local.size() < kLocalIndexIterNum) {
+		local.push_back(std::move(iter));
+		return;
+	}
+	// rebalance: the oldest local iterator goes to the global list
+	IndexIterDataPtr oldest = std::move(local[0]);
+	local.erase_i(0, 1);
+	local.push_back(std::move(iter));
 	std::unique_lock<std::mutex> lock(m_cursorCacheMutex);
-	expiringCacheItems(m_indexForwardIterCache, now);
-	expiringCacheItems(m_indexBackwardIterCache, now);
-	if (forward) {
-		m_indexForwardIterCache[indexId].push_back(std::move(iter));
-	} else {
-		m_indexBackwardIterCache[indexId].push_back(std::move(iter));
+	auto& global = forward ? m_indexForwardIterCache : m_indexBackwardIterCache;
+	expiringCacheItems(global[indexId], now, expire);
+	auto& gv = global[indexId];
+	// keep global list in m_lastUseTime order
+	auto pos = std::upper_bound(gv.begin(), gv.end(), oldest->m_lastUseTime,
+		[](llong t, const IndexIterDataPtr& x) { return t < x->m_lastUseTime; });
+	gv.insert(pos - gv.begin(), std::move(oldest));
+}
+
+void ThreadSafeTable::appendIndexIterCacheStats(BSONObjBuilder& bob) const {
+	const size_t indexNum = m_schema->getIndexNum();
+	for (size_t indexId = 0; indexId < indexNum; ++indexId) {
+		const IndexIterStat& stat = m_indexIterStat[indexId];
+		BSONObjBuilder sub(bob.subobjStart(m_schema->getIndexSchema(indexId).m_name));
+		sub.append("hits", (long long)stat.hits.load(std::memory_order_relaxed));
+		sub.append("misses", (long long)stat.misses.load(std::memory_order_relaxed));
+		sub.append("avgAllocIntervalMillisec",
+			(long long)stat.avgIntervalMillisec.load(std::memory_order_relaxed));
+		sub.append("expireMillisec", (long long)indexIterExpireMillisec(indexId));
+	}
+}
+
+void ThreadSafeTable::appendTableStats(BSONObjBuilder& bob, bool memoryResident) const {
+	const DbTable* tab = m_tabRaw.load(std::memory_order_acquire);
+	if (!tab)
+		return;
+	terark::db::TableSegmentStat ss;
+	tab->getSegmentStat(&ss);
+	{
+		BSONObjBuilder sub(bob.subobjStart("segments"));
+		sub.append("readonly", (long long)ss.readonlySegNum);
+		sub.append("writable", (long long)ss.writableSegNum);
+		sub.append("frozenWritable", (long long)ss.frozenWritableSegNum);
+		sub.append("writableBytes", (long long)ss.writableSegBytes);
+		sub.append("indexBytes", (long long)ss.indexBytes);
+		sub.append("storeBytes", (long long)ss.storeBytes);
+		sub.append("rows", (long long)ss.rows);
+		sub.append("deletedRows", (long long)ss.deletedRows);
+		sub.append("deletedRatio", ss.rows ? double(ss.deletedRows) / ss.rows : 0.0);
+	}
+	{
+		terark::db::TableMemoryStat ms;
+		tab->getMemoryStat(&ms, memoryResident);
+		BSONObjBuilder sub(bob.subobjStart("memory"));
+		sub.append("writableStore", (long long)ms.writableStoreBytes);
+		sub.append("writableIndex", (long long)ms.writableIndexBytes);
+		sub.append("readonlyStore", (long long)ms.readonlyStoreBytes);
+		sub.append("readonlyIndex", (long long)ms.readonlyIndexBytes);
+		sub.append("readonlyStoreFiles", (long long)ms.readonlyStoreFileBytes);
+		sub.append("readonlyIndexFiles", (long long)ms.readonlyIndexFileBytes);
+		if (memoryResident) {
+			sub.append("readonlyStoreResident", (long long)ms.readonlyStoreResident);
+			sub.append("readonlyIndexResident", (long long)ms.readonlyIndexResident);
+		}
+		sub.append("bitmaps", (long long)ms.bitmapBytes);
+		sub.append("valueCache", (long long)ms.valueCacheBytes);
+		sub.append("uniqueKeyFilter", (long long)ms.uniqKeyFilterBytes);
+		sub.append("contexts", (long long)ms.contextNum);
+		sub.append("contextBytes", (long long)ms.contextBytes);
+		sub.append("contextIterators", (long long)ms.contextIterNum);
+		sub.append("heap", (long long)ms.heapBytes());
+		sub.append("virtual", (long long)ms.virtualBytes());
+		if (memoryResident)
+			sub.append("resident", (long long)ms.residentBytes());
+	}
+	bob.append("backgroundTasks", (long long)tab->getBackgroundTaskNum());
+	bob.append("writeThrottled", tab->isWriteThrottled());
+	switch (tab->getWriteStall()) {
+	case DbTable::WriteStall::none:     bob.append("writeStall", "none");     break;
+	case DbTable::WriteStall::slowdown: bob.append("writeStall", "slowdown"); break;
+	case DbTable::WriteStall::stop:     bob.append("writeStall", "stop");     break;
+	}
+	bob.append("ingestedBytes", (long long)tab->getIngestedBytes());
+	bob.append("compactionWrittenBytes", (long long)tab->getCompactionWrittenBytes());
+	bob.append("writeAmplification", tab->getWriteAmplification());
+	if (const terark::db::ValueCache* vc = tab->getValueCache()) {
+		BSONObjBuilder sub(bob.subobjStart("valueCache"));
+		sub.append("hits", (long long)vc->hits());
+		sub.append("misses", (long long)vc->misses());
+		sub.append("usedBytes", (long long)vc->usedBytes());
+	}
+	if (tab->getPerfCounters()) {
+		using terark::db::DbPerfOp;
+		terark::db::DbPerfSnapshot snap;
+		tab->getPerfSnapshot(&snap);
+		BSONObjBuilder sub(bob.subobjStart("latency"));
+		for (size_t i = 0; i < size_t(DbPerfOp::Num); ++i) {
+			const terark::db::DbPerfOpStat& s = snap.ops[i];
+			if (0 == s.count)
+				continue;
+			BSONObjBuilder op(sub.subobjStart(terark::db::DbPerfOpName(DbPerfOp(i))));
+			op.append("count", (long long)s.count);
+			op.append("sumNs", (long long)s.sumNs);
+			op.append("maxNs", (long long)s.maxNs);
+			op.append("p50Ns", (long long)s.p50Ns);
+			op.append("p90Ns", (long long)s.p90Ns);
+			op.append("p99Ns", (long long)s.p99Ns);
+			op.append("p999Ns", (long long)s.p999Ns);
+		}
 	}
 }
 
@@ -237,24 +412,35 @@ void ThreadSafeTable::destroy() {
 	m_ruMap.clear();
 	m_indexForwardIterCache.clear();
 	m_indexBackwardIterCache.clear();
+	m_localIndexIterCache.clear();
 	m_cursorCache.clear();
 	m_ttd.clear();
-	log() << "ThreadSafeTable::destroy(): m_tab->refcnt = " << m_tab->get_refcount()
+	std::lock_guard<std::mutex> lock(m_openMutex);
+	log() << "ThreadSafeTable::destroy(): m_tab->refcnt = " << (m_tab ? m_tab->get_refcount() : 0)
 		<< ", thread local m_ttd.size = " << m_ttd.size();
+	m_tabRaw.store(nullptr, std::memory_order_release);
 	m_tab = nullptr;
+	m_destroyed = true;
 }
 
 TableThreadData& ThreadSafeTable::getMyThreadData() {
 	TableThreadDataPtr& ttd = m_ttd.local();
 	if (terark_unlikely(!ttd)) {
-		DbTable* tab = m_tab.get();
-		ttd = new TableThreadData(tab);
+		DbTable* tab = this->tab();
+		ttd = new TableThreadData(tab, m_fieldDict.get());
 	}
 	return *ttd;
 }
 
+TableSnapshot::TableSnapshot(DbTable* tab) : m_tab(tab) {
+	m_version = tab->acquireSnapshot();
+}
+TableSnapshot::~TableSnapshot() {
+	m_tab->releaseSnapshot(m_version);
+}
+
 RecoveryUnitData::RecoveryUnitData(ThreadSafeTable* tst)
-  : m_iterNum(0), m_mvccTime(1)
+  : m_iterNum(0), m_mvccTime(1), m_changeRegistered(false)
 {
 	m_ttd = tst->allocTableThreadData();
 	m_tst = tst;
@@ -273,7 +459,7 @@ RecoveryUnitData* ThreadSafeTable::getRecoveryUnitData(RecoveryUnit* ru) {
 		LOG(2) << "ThreadSafeTable::getRecoveryUnitData(): create new RecoveryUnitData()"
 			   ", m_ruMap.size() = " << m_ruMap.size()
 			<< ", ru = " << (void*)ru
-			<< ", dir: " << m_tab->getDir().string();
+			<< ", dir: " << m_dir.string();
 		x = new RecoveryUnitData(this);
 	}
 	return x.get();
@@ -301,7 +487,7 @@ void ThreadSafeTable::removeRecoveryUnitData(RecoveryUnit* ru) {
 		<< ", rud->m_records.size() = " << rud->m_records.size()
 		<< ", m_ruMap.size() = " << m_ruMap.size()
 		<< ", ru = " << (void*)ru
-		<< ", dir: " << m_tab->getDir().string();
+		<< ", dir: " << m_dir.string();
 }
 void ThreadSafeTable::removeRegisterEntry(RecoveryUnit* ru, RecoveryUnitData* rud, size_t f) {
 	invariant(rud->m_records.size() > 0);
@@ -344,8 +530,26 @@ struct ChangeForDelete : public RecoveryUnit::Change {
 	RecordId m_id;
 };
 
+// the records of a unit of work are in RecoveryUnitData::m_records, which
+// are also checked by reads of the unit of work, thus one Change is enough
+// to commit or rollback all of them
+struct ChangeForRecoveryUnit : public RecoveryUnit::Change {
+    void commit() override {
+		invariant(nullptr != m_ru);
+		m_tst->commitRecoveryUnit(m_ru);
+	}
+    void rollback() override {
+		invariant(nullptr != m_ru);
+		m_tst->rollbackRecoveryUnit(m_ru);
+	}
+	ChangeForRecoveryUnit(ThreadSafeTable* tst, RecoveryUnit* ru)
+		: m_tst(tst), m_ru(ru) {}
+	ThreadSafeTable* m_tst;
+	RecoveryUnit* m_ru;
+};
+
 void ThreadSafeTable::registerInsert(RecoveryUnit* ru, RecordId id) {
-	m_tab->delmarkSet1(id.repr()-1);
+	tab()->delmarkSet1(id.repr()-1);
 	auto  x = this->getRecoveryUnitData(ru);
 	auto& v = x->m_records[id.repr()-1];
 	v.deleteTime = UINT32_MAX;
@@ -354,8 +558,14 @@ void ThreadSafeTable::registerInsert(RecoveryUnit* ru, RecordId id) {
 		<< ", insertTime = " << toSigned(v.insertTime)
 		<< ", deleteTime = " << toSigned(v.deleteTime)
 		<< ", ru = " << (void*)ru
-		<< ", dir: " << m_tab->getDir().string();
-	ru->registerChange(new ChangeForInsert(this, ru, id));
+		<< ", dir: " << m_dir.string();
+	if (!m_batchRecoveryUnitChanges) {
+		ru->registerChange(new ChangeForInsert(this, ru, id));
+	}
+	else if (!x->m_changeRegistered) {
+		x->m_changeRegistered = true;
+		ru->registerChange(new ChangeForRecoveryUnit(this, ru));
+	}
 }
 
 void ThreadSafeTable::commitInsert(RecoveryUnit* ru, RecordId id) {
@@ -365,14 +575,14 @@ void ThreadSafeTable::commitInsert(RecoveryUnit* ru, RecordId id) {
 	invariant(f < rud->m_records.end_i());
 	auto& v = rud->m_records.val(f);
 	LOG(2) << "ThreadSafeTable::commitInsert(): id = " << id
-		<< ", existingRows = " << m_tab->existingRows()
-		<< ", totalRows = " << m_tab->numDataRows()
+		<< ", existingRows = " << tab()->existingRows()
+		<< ", totalRows = " << tab()->numDataRows()
 		<< ", insertTime = " << toSigned(v.insertTime)
 		<< ", deleteTime = " << toSigned(v.deleteTime)
 		<< ", ru = " << (void*)ru
-		<< ", dir: " << m_tab->getDir().string();
+		<< ", dir: " << m_dir.string();
 	if (UINT32_MAX == v.deleteTime) {
-		m_tab->delmarkSet0(recIdx); //!!!!
+		tab()->delmarkSet0(recIdx); //!!!!
 		removeRegisterEntry(ru, rud, f);
 	}
 	else {
@@ -387,12 +597,12 @@ void ThreadSafeTable::rollbackInsert(RecoveryUnit* ru, RecordId id) {
 	invariant(f < rud->m_records.end_i());
 	auto& v = rud->m_records.val(f);
 	LOG(2) << "ThreadSafeTable::rollbackInsert(): id = " << id
-		<< ", existingRows = " << m_tab->existingRows()
+		<< ", existingRows = " << tab()->existingRows()
 		<< ", insertTime = " << toSigned(v.insertTime)
 		<< ", deleteTime = " << toSigned(v.deleteTime)
 		<< ", ru = " << (void*)ru
-		<< ", dir: " << m_tab->getDir().string();
-	m_tab->putToFreeList(recIdx); //!!!!
+		<< ", dir: " << m_dir.string();
+	tab()->putToFreeList(recIdx); //!!!!
 	removeRegisterEntry(ru, rud, f);
 }
 
@@ -404,8 +614,14 @@ void ThreadSafeTable::registerDelete(RecoveryUnit* ru, RecordId id) {
 		<< ", insertTime = " << toSigned(v.insertTime)
 		<< ", deleteTime = " << toSigned(v.deleteTime)
 		<< ", ru = " << (void*)ru
-		<< ", dir: " << m_tab->getDir().string();
-	ru->registerChange(new ChangeForDelete(this, ru, id));
+		<< ", dir: " << m_dir.string();
+	if (!m_batchRecoveryUnitChanges) {
+		ru->registerChange(new ChangeForDelete(this, ru, id));
+	}
+	else if (!x->m_changeRegistered) {
+		x->m_changeRegistered = true;
+		ru->registerChange(new ChangeForRecoveryUnit(this, ru));
+	}
 }
 
 void ThreadSafeTable::commitDelete(RecoveryUnit* ru, RecordId id) {
@@ -416,24 +632,24 @@ void ThreadSafeTable::commitDelete(RecoveryUnit* ru, RecordId id) {
 	auto& v = rud->m_records.val(f);
 	terark::db::DbContext* ctx = rud->m_ttd->m_dbCtx.get();
 	LOG(2) << "ThreadSafeTable::commitDelete(): id = " << id
-		<< ", existingRows = " << m_tab->existingRows(ctx)
-		<< ", totalRows = " << m_tab->numDataRows()
+		<< ", existingRows = " << tab()->existingRows(ctx)
+		<< ", totalRows = " << tab()->numDataRows()
 		<< ", insertTime = " << toSigned(v.insertTime)
 		<< ", deleteTime = " << toSigned(v.deleteTime)
 		<< ", ru = " << (void*)ru
-		<< ", dir: " << m_tab->getDir().string();
+		<< ", dir: " << m_dir.string();
 	invariant(v.deleteTime != UINT32_MAX);
 	const bool reuseRecId = false;
 	if (reuseRecId) {
 		if (0 == v.insertTime) {
-			m_tab->removeRow(recIdx, ctx);
+			tab()->removeRow(recIdx, ctx);
 		} else {
-			m_tab->putToFreeList(recIdx);
+			tab()->putToFreeList(recIdx);
 		}
 	}
 	else {
 		if (0 == v.insertTime) {
-			m_tab->delmarkSet1(recIdx);
+			tab()->delmarkSet1(recIdx);
 		} else {
 			// do nothing
 		}
@@ -448,21 +664,80 @@ void ThreadSafeTable::rollbackDelete(RecoveryUnit* ru, RecordId id) {
 	invariant(f < rud->m_records.end_i());
 	auto& v = rud->m_records.val(f);
 	LOG(2) << "ThreadSafeTable::rollbackDelete(): id = " << id
-		<< ", existingRows = " << m_tab->existingRows()
+		<< ", existingRows = " << tab()->existingRows()
 		<< ", insertTime = " << toSigned(v.insertTime)
 		<< ", deleteTime = " << toSigned(v.deleteTime)
 		<< ", ru = " << (void*)ru
-		<< ", dir: " << m_tab->getDir().string();
+		<< ", dir: " << m_dir.string();
 //	terark::db::DbContext* ctx = rud->m_ttd->m_dbCtx.get();
 	if (0 == v.insertTime) {
 		removeRegisterEntry(ru, rud, f);
 	}
 	else {
-		// m_tab->delmarkSet0(recIdx); //!!!!
+		// tab()->delmarkSet0(recIdx); //!!!!
 		// will be rollback'ed in rollbackInsert
 	}
 }
 
+// same as commitInsert and commitDelete of each record:
+//   inserted          : delmarkSet0
+//   deleted existing  : delmarkSet1
+//   inserted & deleted: keep the delmark
+void ThreadSafeTable::commitRecoveryUnit(RecoveryUnit* ru) {
+	auto rud = this->getRecoveryUnitData(ru);
+	auto& records = rud->m_records;
+	valvec<llong> inserted, deleted;
+	for (size_t i = 0; i < records.end_i(); ++i) {
+		if (records.is_deleted(i))
+			continue;
+		const auto& v = records.val(i);
+		if (UINT32_MAX == v.deleteTime)
+			inserted.push_back(records.key(i));
+		else if (0 == v.insertTime)
+			deleted.push_back(records.key(i));
+	}
+	LOG(2) << "ThreadSafeTable::commitRecoveryUnit(): records = " << records.size()
+		<< ", inserted = " << inserted.size()
+		<< ", deleted = " << deleted.size()
+		<< ", ru = " << (void*)ru
+		<< ", dir: " << m_dir.string();
+	std::sort(inserted.begin(), inserted.end());
+	std::sort(deleted.begin(), deleted.end());
+	DbTable* tab = this->tab();
+	tab->delmarkSet0Batch(inserted.data(), inserted.size());
+	tab->delmarkSet1Batch(deleted.data(), deleted.size());
+	rud->m_changeRegistered = false;
+	records.clear();
+	if (0 == rud->m_iterNum) {
+		removeRecoveryUnitData(ru);
+	}
+}
+
+// same as rollbackInsert and rollbackDelete of each record, deletes are
+// just dropped, inserted rows are put to free list
+void ThreadSafeTable::rollbackRecoveryUnit(RecoveryUnit* ru) {
+	auto rud = this->getRecoveryUnitData(ru);
+	auto& records = rud->m_records;
+	valvec<llong> inserted;
+	for (size_t i = 0; i < records.end_i(); ++i) {
+		if (records.is_deleted(i))
+			continue;
+		if (0 != records.val(i).insertTime)
+			inserted.push_back(records.key(i));
+	}
+	LOG(2) << "ThreadSafeTable::rollbackRecoveryUnit(): records = " << records.size()
+		<< ", inserted = " << inserted.size()
+		<< ", ru = " << (void*)ru
+		<< ", dir: " << m_dir.string();
+	std::sort(inserted.begin(), inserted.end());
+	this->tab()->putToFreeListBatch(inserted.data(), inserted.size());
+	rud->m_changeRegistered = false;
+	records.clear();
+	if (0 == rud->m_iterNum) {
+		removeRecoveryUnitData(ru);
+	}
+}
+
 void RuStoreIteratorBase::traceFunc(const char* func) const {
 	auto tab = static_cast<DbTable*>(m_store.get());
 	LOG(2) << func << ": rud->m_iterNum = " << m_rud->m_iterNum
@@ -478,7 +753,7 @@ RuStoreIteratorBase::RuStoreIteratorBase(RecoveryUnit* ru, ThreadSafeTable* tst)
 	m_tst = tst;
 	m_rud = tst->getRecoveryUnitData(ru);
 	m_rud->m_iterNum++;
-	m_store = tst->m_tab.get();
+	m_store = tst->tab();
 }
 RuStoreIteratorBase::~RuStoreIteratorBase() {
 	if (0 == --m_rud->m_iterNum && m_rud->m_records.size() == 0) {
@@ -507,6 +782,33 @@ bool RuStoreIteratorBase::getVal(llong id, valvec<unsigned char>* val) const {
 		<< "not exists in table";
 	return false;
 }
+// same visibility as getVal, but without fetching the value
+bool RuStoreIteratorBase::isVisible(llong id) const {
+	auto rud = m_rud.get();
+	size_t f = rud->m_records.find_i(id);
+	if (f < rud->m_records.end_i()) {
+		return rud->m_records.val(f).deleteTime == UINT32_MAX;
+	}
+	auto tab = static_cast<DbTable*>(m_store.get());
+	return tab->exists(id);
+}
+// ids are visible ids, values are fetched by one DbTable::getValuesBatch,
+// which calls each segment once for the ids of that segment
+size_t RuStoreIteratorBase::fetchBatch(const valvec<llong>& ids,
+									   terark::db::StoreBatch* batch) {
+	auto tab = static_cast<DbTable*>(m_store.get());
+	batch->erase_all();
+	if (ids.empty()) {
+		return 0;
+	}
+	m_batchVals.resize(ids.size());
+	tab->getValuesBatch(ids.data(), ids.size(), m_batchVals.data(),
+						m_rud->m_ttd->m_dbCtx.get());
+	for (size_t i = 0; i < ids.size(); ++i) {
+		batch->push_back(ids[i], m_batchVals[i]);
+	}
+	return batch->size();
+}
 
 class RuStoreIterForward : public RuStoreIteratorBase {
 public:
@@ -526,6 +828,18 @@ public:
 		}
 		return false;
 	}
+	size_t incrementBatch(terark::db::StoreBatch* batch, size_t maxRows,
+						  size_t /*maxBytes*/) override {
+		auto tab = static_cast<DbTable*>(m_store.get());
+		llong rows = tab->inlineGetRowNum();
+		m_batchIds.erase_all();
+		while (m_id < rows && m_batchIds.size() < maxRows) {
+			llong id = m_id++;
+			if (isVisible(id))
+				m_batchIds.push_back(id);
+		}
+		return fetchBatch(m_batchIds, batch);
+	}
 	bool seekExact(llong id, valvec<unsigned char>* val) {
 		auto tab = static_cast<DbTable*>(m_store.get());
 		if (terark_unlikely(id >= tab->inlineGetRowNum())) {
@@ -559,6 +873,16 @@ public:
 		}
 		return false;
 	}
+	size_t incrementBatch(terark::db::StoreBatch* batch, size_t maxRows,
+						  size_t /*maxBytes*/) override {
+		m_batchIds.erase_all();
+		while (m_id > 0 && m_batchIds.size() < maxRows) {
+			llong id = --m_id;
+			if (isVisible(id))
+				m_batchIds.push_back(id);
+		}
+		return fetchBatch(m_batchIds, batch);
+	}
 	bool seekExact(llong id, valvec<unsigned char>* val) {
 		auto tab = static_cast<DbTable*>(m_store.get());
 		if (terark_unlikely(id >= tab->inlineGetRowNum())) {
@@ -623,6 +947,7 @@ TerarkDbKVEngine::TerarkDbKVEngine(const std::string& path,
       _sizeStorerSyncTracker(getGlobalServiceContext()->getFastClockSource(), 100000, Milliseconds(60 * 1000))
 {
 	m_fuckKVCatalog = nullptr;
+	m_snapshotManager.reset(new TerarkDbSnapshotManager(this));
     boost::filesystem::path basePath = path;
 	m_pathTerark = basePath / "terark";
 	m_pathWt = basePath / "wt";
@@ -651,6 +976,8 @@ TerarkDbKVEngine::TerarkDbKVEngine(const std::string& path,
 				false));
 
     _previousCheckedDropsQueued = Date_t::now();
+	// dirs of tables dropped by the previous process
+	DbTable::removeTrashInBackground(m_pathTerarkTables / ".trash");
 /*
     log() << "terarkdb_open : " << path;
     for (auto& tabDir : fs::directory_iterator(m_pathTerark / "tables")) {
@@ -667,17 +994,149 @@ TerarkDbKVEngine::TerarkDbKVEngine(const std::string& path,
         if (fs::exists(fpath)) {
 			_sizeStorer.fillCache();
         }
+		_sizeStorer.startSyncThread(
+			terark::getEnvLong("TerarkDbSizeStorer_syncIntervalMillisec", 60 * 1000),
+			terark::getEnvLong("TerarkDbSizeStorer_syncDeltaThreshold", 100000));
     }
 //	DbTable::setCompressionThreadsNum(4);
+	m_lazyOpenTable = terark::getEnvBool("TerarkDbKVEngine_lazyOpenTable", true);
+	m_stopPrewarm = false;
+	if (m_lazyOpenTable && terark::getEnvBool("TerarkDbKVEngine_prewarm", false)) {
+		if (const char* env = getenv("TerarkDbKVEngine_prewarmTables")) {
+			valvec<fstring> names;
+			fstring(env).split(',', &names);
+			for (fstring name : names) {
+				if (!name.empty())
+					m_prewarmRank.insert_i(name, m_prewarmRank.size());
+			}
+		}
+		m_prewarmThread = std::thread(&TerarkDbKVEngine::prewarmThreadProc, this);
+	}
 }
 
 TerarkDbKVEngine::~TerarkDbKVEngine() {
     cleanShutdown();
 }
 
+void TerarkDbKVEngine::getOpenedTables(valvec<ThreadSafeTablePtr>* tables) const {
+	tables->erase_all();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_tables.end_i(); ++i) {
+		if (m_tables.is_deleted(i))
+			continue;
+		ThreadSafeTable* tab = m_tables.val(i).get();
+		if (tab && tab->isOpened())
+			tables->push_back(tab);
+	}
+}
+
+SnapshotManager* TerarkDbKVEngine::getSnapshotManager() const {
+	return m_snapshotManager.get();
+}
+
+void TerarkDbKVEngine::appendIndexIterCacheStats(BSONObjBuilder& bob) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_tables.end_i(); ++i) {
+		if (m_tables.is_deleted(i))
+			continue;
+		const ThreadSafeTable* tab = m_tables.val(i).get();
+		if (!tab || !tab->isOpened() || tab->schema().getIndexNum() == 0)
+			continue;
+		BSONObjBuilder sub(bob.subobjStart(m_tables.key(i).str()));
+		tab->appendIndexIterCacheStats(sub);
+	}
+}
+
+void TerarkDbKVEngine::appendEngineStats(BSONObjBuilder& bob, bool memoryResident) const {
+	{
+		terark::db::FlushQueueStat fq;
+		DbTable::getFlushQueueStat(&fq);
+		BSONObjBuilder sub(bob.subobjStart("flushQueue"));
+		sub.append("threads", (long long)fq.threadNum);
+		sub.append("queued", (long long)fq.queuedNum);
+		sub.append("running", (long long)fq.runningNum);
+		sub.append("tables", (long long)fq.tableNum);
+		sub.append("finished", (long long)fq.finishedNum);
+		sub.append("lastLatencyNs", (long long)fq.lastLatencyNs);
+		sub.append("maxLatencyNs", (long long)fq.maxLatencyNs);
+		sub.append("avgLatencyNs", (long long)(fq.finishedNum ? fq.sumLatencyNs / fq.finishedNum : 0));
+	}
+	{
+		BSONObjBuilder sub(bob.subobjStart("compressQueue"));
+		sub.append("queued", (long long)DbTable::getCompressQueueSize());
+		sub.append("workMemInUse", (long long)DbTable::getCompressingWorkMemInUse());
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	BSONObjBuilder tables(bob.subobjStart("collections"));
+	for (size_t i = 0; i < m_tables.end_i(); ++i) {
+		if (m_tables.is_deleted(i))
+			continue;
+		const ThreadSafeTable* tab = m_tables.val(i).get();
+		if (!tab || !tab->isOpened())
+			continue;
+		BSONObjBuilder sub(tables.subobjStart(m_tables.key(i).str()));
+		tab->appendTableStats(sub, memoryResident);
+	}
+}
+
+void TerarkDbKVEngine::prewarmThreadProc() {
+	log() << "TerarkDbKVEngine::prewarmThreadProc(): started, prewarmTables = "
+		<< m_prewarmRank.size();
+	valvec<ThreadSafeTablePtr> failed;
+	size_t opened = 0;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stopPrewarm) {
+		ThreadSafeTablePtr best;
+		size_t bestRank = size_t(-1);
+		for (size_t i = 0; i < m_tables.end_i(); ++i) {
+			if (m_tables.is_deleted(i))
+				continue;
+			ThreadSafeTable* tab = m_tables.val(i).get();
+			if (tab->isOpened() || failed.end() !=
+					std::find(failed.begin(), failed.end(), m_tables.val(i)))
+				continue;
+			size_t j = m_prewarmRank.find_i(m_tables.key(i));
+			size_t rank = j < m_prewarmRank.end_i()
+						? m_prewarmRank.val(j) : m_prewarmRank.size();
+			if (rank < bestRank) {
+				best = tab;
+				bestRank = rank;
+			}
+		}
+		if (!best) {
+			// all registered tables are opened, wait for new tables
+			m_prewarmCond.wait_for(lock, std::chrono::seconds(1));
+			continue;
+		}
+		lock.unlock();
+		try {
+			best->tab();
+			opened++;
+		}
+		catch (const std::exception& ex) {
+			log() << "TerarkDbKVEngine::prewarmThreadProc(): open "
+				<< best->getDir().string() << " failed: " << ex.what();
+			failed.push_back(best);
+		}
+		best = nullptr; // release out of lock
+		lock.lock();
+	}
+	log() << "TerarkDbKVEngine::prewarmThreadProc(): stopped, opened tables = " << opened;
+}
+
 void TerarkDbKVEngine::cleanShutdown() {
     log() << "TerarkDbKVEngine shutting down ...";
+	if (m_prewarmThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopPrewarm = true;
+		}
+		m_prewarmCond.notify_all();
+		m_prewarmThread.join();
+	}
+	_sizeStorer.stopSyncThread();
 //  syncSizeInfo(true);
+	m_snapshotManager->shutdown();
 	std::lock_guard<std::mutex> lock(m_mutex);
 	m_indices.clear();
 	for (size_t i = 0; i < m_tables.end_i(); ++i) {
@@ -685,9 +1144,9 @@ void TerarkDbKVEngine::cleanShutdown() {
 			continue;
 		const fstring    key = m_tables.key(i);
 		ThreadSafeTable* tab = m_tables.val(i).get();
-		log() << "table: " << key.str() << ", dir: " << tab->m_tab->getDir().string()
+		log() << "table: " << key.str() << ", dir: " << tab->getDir().string()
 			<< ", ThreadSafeTable.refcnt = " << tab->get_refcount()
-			<< ", DbTable.refcnt = " << tab->m_tab->get_refcount();
+			<< ", opened = " << tab->isOpened();
 
 		// brain damaged mongodb leaks objects, so destroy it manually
 		tab->destroy();
@@ -736,7 +1195,7 @@ TerarkDbKVEngine::getIdentSize(OperationContext* opCtx, StringData ident) {
 		return m_wtEngine->getIdentSize(opCtx, ident);
 	}
 	ThreadSafeTable* tab = m_tables.val(i).get();
-	return tab->m_tab->dataStorageSize();
+	return tab->tab()->dataStorageSize();
 }
 
 Status
@@ -760,7 +1219,8 @@ int TerarkDbKVEngine::flushAllFiles(bool sync) {
 	{
 		std::lock_guard<std::mutex> lock(m_mutex);
 		m_tables.for_each([&](const TableMap::value_type& x) {
-			tabCopy.push_back(x.second->m_tab);
+			if (x.second->isOpened()) // not opened table has nothing to flush
+				tabCopy.push_back(x.second->tab());
 		});
 	}
 //  syncSizeInfo(true);
@@ -772,14 +1232,76 @@ int TerarkDbKVEngine::flushAllFiles(bool sync) {
     return 1;
 }
 
+// files of readonly segments are immutable, suspending compaction keeps
+// the set of segment dirs unchanged until endBackup, so a file copy or a
+// filesystem snapshot of the flushed tables is consistent
 Status TerarkDbKVEngine::beginBackup(OperationContext* txn) {
     invariant(!_backupSession);
-	m_wtEngine->beginBackup(txn);
+	Status s = m_wtEngine->beginBackup(txn);
+	if (!s.isOK()) {
+		return s;
+	}
+	valvec<ThreadSafeTablePtr> tables;
+	getOpenedTables(&tables);
+	std::unique_ptr<TableMap> session(new TableMap());
+	for (auto& tabPtr : tables) {
+		tabPtr->tab()->suspendCompaction();
+		tabPtr->tab()->flush();
+		session->insert_i(tabPtr->getDir().string(), tabPtr);
+	}
+	_backupSession = std::move(session);
     return Status::OK();
 }
 
 void TerarkDbKVEngine::endBackup(OperationContext* txn) {
+	if (_backupSession) {
+		for (size_t i = 0; i < _backupSession->end_i(); ++i) {
+			if (!_backupSession->is_deleted(i))
+				_backupSession->val(i)->tab()->resumeCompaction();
+		}
+	}
     _backupSession.reset();
+	m_wtEngine->endBackup(txn);
+}
+
+Status TerarkDbKVEngine::hotBackup(const fs::path& dir) {
+	valvec<ThreadSafeTablePtr> tables;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t i = 0; i < m_tables.end_i(); ++i) {
+			if (!m_tables.is_deleted(i) && m_tables.val(i))
+				tables.push_back(m_tables.val(i));
+		}
+	}
+	auto t0 = g_profiling.now();
+	const size_t rootLen = m_pathTerarkTables.string().size();
+	TableBackupStat sum;
+	try {
+		for (auto& tabPtr : tables) {
+			TableBackupStat st;
+			std::string rel = tabPtr->getDir().string().substr(rootLen + 1);
+			tabPtr->tab()->backupTo(dir / "tables" / rel, &st);
+			sum.linkedFiles += st.linkedFiles;
+			sum.linkedBytes += st.linkedBytes;
+			sum.copiedFiles += st.copiedFiles;
+			sum.copiedBytes += st.copiedBytes;
+			sum.writableSegNum += st.writableSegNum;
+		}
+		_sizeStorer.syncCache(true);
+		fs::path sizeStore = m_pathTerark / "size-store.hash_strmap";
+		if (fs::exists(sizeStore)) {
+			fs::copy_file(sizeStore, dir / sizeStore.filename());
+		}
+	}
+	catch (const std::exception& ex) {
+		return Status(ErrorCodes::InternalError, ex.what());
+	}
+	log() << "TerarkDbKVEngine::hotBackup(" << dir.string() << "): tables = "
+		<< tables.size() << ", linked files = " << sum.linkedFiles
+		<< ", bytes = " << sum.linkedBytes << ", copied files = " << sum.copiedFiles
+		<< ", bytes = " << sum.copiedBytes << ", time = "
+		<< g_profiling.mf(t0, g_profiling.now()) << " ms";
+	return Status::OK();
 }
 
 RecoveryUnit* TerarkDbKVEngine::newRecoveryUnit() {
@@ -885,8 +1407,13 @@ TerarkDbKVEngine::openTable(StringData ns, StringData ident) {
 	if (fidx < m_tables.end_i()) {
 		tab = m_tables.val(fidx).get();
 	} else {
-		tab = new ThreadSafeTable(tabDir);
+		tab = new ThreadSafeTable(tabDir, m_lazyOpenTable);
 		m_tables.insert_i(ident, tab);
+		size_t rankIdx = m_prewarmRank.find_i(ns);
+		if (rankIdx < m_prewarmRank.end_i()) {
+			m_prewarmRank.insert_i(ident, m_prewarmRank.val(rankIdx));
+		}
+		m_prewarmCond.notify_one();
 	}
 	return tab;
 }
@@ -966,12 +1493,12 @@ TerarkDbKVEngine::createSortedDataInterface(OperationContext* opCtx,
 	ThreadSafeTable* tst = openTable(tableNS, tableIdent);
 	if (tst) {
 		std::string strkp = getIndexKeyPattern(desc->keyPattern());
-		DbTable* tab = tst->m_tab.get();
-		size_t indexId = tab->getIndexId(strkp);
+		const terark::db::SchemaConfig& sconf = tst->schema();
+		size_t indexId = sconf.getIndexId(strkp);
 		LOG(2) << "TerarkDbKVEngine::createSortedDataInterface: "
 			<< "strkp = (" << strkp << "), kp = " << desc->keyPattern().toString()
-			<< ", indexId = " << indexId << ", indexNum = " << tab->getIndexNum();
-		if (indexId < tab->getIndexNum()) {
+			<< ", indexId = " << indexId << ", indexNum = " << sconf.getIndexNum();
+		if (indexId < sconf.getIndexNum()) {
 			return Status::OK();
 		}
 		if (terark::getEnvBool("MongoTerarkDB_DynamicCreateIndex")) {
@@ -1007,9 +1534,9 @@ TerarkDbKVEngine::getSortedDataInterface(OperationContext* opCtx,
 		return NULL;
 	}
 	std::string strkp = getIndexKeyPattern(desc->keyPattern());
-	DbTable* tab = tst->m_tab.get();
-	size_t indexId = tab->getIndexId(strkp);
-	if (indexId < tab->getIndexNum()) {
+	const terark::db::SchemaConfig& sconf = tst->schema();
+	size_t indexId = sconf.getIndexId(strkp);
+	if (indexId < sconf.getIndexNum()) {
 		if (desc->unique())
 			return new TerarkDbIndexUnique(tst, opCtx, desc);
 		else
@@ -1035,7 +1562,7 @@ Status TerarkDbKVEngine::dropIdent(OperationContext* opCtx, StringData ident) {
 		if (i < m_tables.end_i()) {
 			if (ident == tableIdent) {
 				ThreadSafeTablePtr& tabPtr = m_tables.val(i);
-				tabPtr->m_tab->dropTable();
+				tabPtr->tab()->dropTable();
 				m_tables.erase_i(i);
 				isTerarkDb = true;
 			}
@@ -1053,13 +1580,26 @@ Status TerarkDbKVEngine::dropIdent(OperationContext* opCtx, StringData ident) {
 	return m_wtEngine->dropIdent(opCtx, ident);
 #else
 	// The fucking mongodb deleted opCtx->getNS()
-	std::lock_guard<std::mutex> lock(m_mutex);
-	size_t i = m_tables.find_i(ident);
-	if (i < m_tables.end_i()) {
-		ThreadSafeTablePtr& tabPtr = m_tables.val(i);
-		tabPtr->m_tab->dropTable();
-		LOG(1) << "tab->refcnt = " << tabPtr->m_tab->get_refcount();
-		m_tables.erase_i(i);
+	// just detach the table in m_mutex, dropTable renames the table dir
+	// into trash, the files and the table object are destroyed out of lock
+	ThreadSafeTablePtr tabPtr;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t i = m_tables.find_i(ident);
+		if (i < m_tables.end_i()) {
+			tabPtr.swap(m_tables.val(i));
+			m_tables.erase_i(i);
+		}
+	}
+	if (tabPtr) {
+		if (tabPtr->isOpened()) {
+			tabPtr->tab()->dropTable();
+			LOG(1) << "tab->refcnt = " << tabPtr->tab()->get_refcount();
+		}
+		else { // don't open a lazy table just for dropping it
+			const fs::path& dir = tabPtr->getDir();
+			DbTable::removeDirInBackground(dir, dir.parent_path() / ".trash");
+		}
 	}
 	else {
 		Status s = m_wtEngine->dropIdent(opCtx, ident);
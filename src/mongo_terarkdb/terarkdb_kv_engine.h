@@ -32,6 +32,7 @@
 
 #pragma once
 
+#include <condition_variable>
 #include <set>
 #include <string>
 
@@ -53,6 +54,8 @@ namespace mongo {
 
 namespace mongo { namespace terarkdb {
 
+class TerarkDbSnapshotManager;
+
 class TerarkDbKVEngine final : public KVEngine {
 public:
     TerarkDbKVEngine(const std::string& path,
@@ -109,6 +112,11 @@ public:
 
     virtual void endBackup(OperationContext* txn) override;
 
+	/// online backup of all TerarkDb tables to dir/tables, readonly
+	/// segments are hard linked by DbTable::backupTo, dir must be on the
+	/// same filesystem for hard links, WiredTiger files are not included
+	Status hotBackup(const fs::path& dir);
+
     virtual int64_t getIdentSize(OperationContext* opCtx, StringData ident) override;
 
     virtual Status repairIdent(OperationContext* opCtx, StringData ident) override;
@@ -126,6 +134,19 @@ public:
     // held by this class
     int reconfigure(const char* str);
 
+    // index iterator cache stats of all tables, for serverStatus
+    void appendIndexIterCacheStats(BSONObjBuilder&) const;
+
+    // background task queues and DbTable stats of opened tables, resident
+    // memory of mmap'ed files is estimated by mincore if memoryResident
+    void appendEngineStats(BSONObjBuilder&, bool memoryResident) const;
+
+    SnapshotManager* getSnapshotManager() const override;
+    TerarkDbSnapshotManager& snapshotManager() const { return *m_snapshotManager; }
+
+    // tables whose DbTable is opened
+    void getOpenedTables(valvec<ThreadSafeTablePtr>*) const;
+
 	const KVCatalog* m_fuckKVCatalog;
 
 private:
@@ -168,9 +189,23 @@ private:
 
     mutable Date_t _previousCheckedDropsQueued;
 
+	// tables whose compaction is suspended between beginBackup/endBackup
 	std::unique_ptr<TableMap> _backupSession;
 
 	ThreadSafeTable* openTable(StringData ns, StringData ident);
+
+	std::unique_ptr<TerarkDbSnapshotManager> m_snapshotManager;
+
+	// Tables are opened lazily by ThreadSafeTable::tab(), the optional
+	// prewarm thread opens not yet opened tables in background, tables
+	// in env TerarkDbKVEngine_prewarmTables(comma separated ns or ident)
+	// are opened first, in the listed order
+	bool m_lazyOpenTable;
+	bool m_stopPrewarm; // guarded by m_mutex
+	terark::hash_strmap<size_t> m_prewarmRank; // ns or ident -> rank
+	std::condition_variable m_prewarmCond;
+	std::thread m_prewarmThread;
+	void prewarmThreadProc();
 	boost::filesystem::path getTableDir(StringData ns, StringData ident) const;
 };
 } }  // namespace mongo::terark
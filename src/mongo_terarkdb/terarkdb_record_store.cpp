@@ -46,6 +46,7 @@
 #include "mongo/db/operation_context.h"
 #include "mongo/db/service_context.h"
 #include "mongo/db/storage/oplog_hack.h"
+#include "mongo/db/storage/storage_engine.h"
 #include "terarkdb_customization_hooks.h"
 #include "terarkdb_global_options.h"
 //#include "terarkdb_kv_engine.h"
@@ -53,6 +54,7 @@
 #include "terarkdb_recovery_unit.h"
 //#include "terarkdb_session_cache.h"
 #include "terarkdb_size_storer.h"
+#include "terarkdb_snapshot_manager.h"
 //#include "terarkdb_util.h"
 #include "mongo/stdx/memory.h"
 #include "mongo/util/assert_util.h"
@@ -62,6 +64,9 @@
 #include "mongo/util/scopeguard.h"
 #include "mongo/util/time_support.h"
 #include <boost/none.hpp>
+#include <algorithm>
+#include <random>
+#include <thread>
 
 //#define RS_ITERATOR_TRACE(x) log() << "TerarkDbRS::Iterator " << x
 #define RS_ITERATOR_TRACE(x)
@@ -87,17 +92,21 @@ static_assert(kCurrentRecordStoreVersion <= kMaximumRecordStoreVersion,
 
 class TerarkDbRecordStore::Cursor final : public SeekableRecordCursor, public ICleanOnOwnerDead {
 public:
-    Cursor(OperationContext* txn, const TerarkDbRecordStore& rs, bool forward)
+    // a forward cursor may be limited to record index range [begId, endId)
+    Cursor(OperationContext* txn, const TerarkDbRecordStore& rs, bool forward,
+           llong begId = 0, llong endId = LLONG_MAX)
         : _rs(rs),
-          _txn(txn), _forward(forward) {
-		LOG(1) << "TerarkDbRecordStore::Cursor::Cursor(): forward = " << forward;
+          _txn(txn), _forward(forward), m_begId(begId), m_endId(endId) {
+		LOG(1) << "TerarkDbRecordStore::Cursor::Cursor(): forward = " << forward
+			<< ", begId = " << begId << ", endId = " << endId;
+		invariant(forward || (0 == begId && LLONG_MAX == endId));
 		init(txn);
 		rs.m_table->registerCleanOnOwnerDead(this);
     }
 
 	void init(OperationContext* txn) {
 		ThreadSafeTable* tst = _rs.m_table.get();
-		DbTable* tab = tst->m_tab.get();
+		DbTable* tab = tst->tab();
 		if (txn && txn->recoveryUnit()) {
 			auto iter = tst->createStoreIter(txn->recoveryUnit(), _forward);
 			_cursor = iter;
@@ -112,6 +121,19 @@ public:
     		else
     			_cursor = tab->createStoreIterBackward(m_ttd->m_dbCtx.get());
 		}
+		if (txn && txn->recoveryUnit() &&
+				txn->recoveryUnit()->isReadingFromMajorityCommittedSnapshot()) {
+			auto sm = getGlobalServiceContext()->getGlobalStorageEngine()->getSnapshotManager();
+			m_snapshot = checked_cast<TerarkDbSnapshotManager*>(sm)->getCommittedSnapshot(tst);
+			m_ttd->m_dbCtx->setSnapshot(m_snapshot->m_version);
+		}
+	}
+
+	void clearSnapshot() {
+		if (m_snapshot) {
+			m_ttd->m_dbCtx->clearSnapshot();
+			m_snapshot = nullptr;
+		}
 	}
 
 	~Cursor() {
@@ -122,6 +144,7 @@ public:
 			return;
 		}
 		ThreadSafeTable* tst = _rs.m_table.get();
+		clearSnapshot();
 		if (!m_hasRecoveryUnit) {
 			tst->releaseTableThreadData(m_ttd);
 		}
@@ -132,6 +155,7 @@ public:
 
 	void onOwnerPrematureDeath() override final {
 		ThreadSafeTable* tst = _rs.m_table.get();
+		clearSnapshot();
 		if (!m_hasRecoveryUnit) {
 			tst->releaseTableThreadData(m_ttd);
 		}
@@ -145,10 +169,26 @@ public:
             return {};
 
         llong recIdx = _lastReturnedId.repr() - 1;
+        terark::fstring val = m_ttd->m_buf;
         if (!_skipNextAdvance) {
-            if (!_cursor->increment(&recIdx, &m_ttd->m_buf)) {
-                _eof = true;
-                return {};
+            if (_lastReturnedId.isNull() && m_begId > 0) {
+                // first record of the range
+                clearReadAhead();
+                recIdx = _cursor->seekLowerBound(m_begId, &m_ttd->m_buf);
+                if (recIdx < 0) {
+                    _eof = true;
+                    return {};
+                }
+                val = m_ttd->m_buf;
+            }
+            else {
+                if (m_aheadPos == m_ahead.size() && !fillReadAhead(recIdx)) {
+                    _eof = true;
+                    return {};
+                }
+                recIdx = m_ahead.ids[m_aheadPos];
+                val = m_ahead.row(m_aheadPos);
+                m_aheadPos++;
             }
 			if (_forward && _lastReturnedId.repr() >= recIdx+1) {
 				LOG(1) << "TerarkDbRecordStore::Cursor::next -- c->next_key ( " << RecordId(recIdx+1)
@@ -156,16 +196,22 @@ public:
 					   << ") which is a bug, _cursor class: " << demangleName(typeid(*_cursor));
 				// Force a retry of the operation from our last known position by acting as-if
 				// we received a WT_ROLLBACK error.
-				assert(!m_ttd->m_buf.empty());
+				assert(!val.empty());
+				clearReadAhead();
 				throw WriteConflictException();
 			}
-			assert(!m_ttd->m_buf.empty());
+			assert(!val.empty());
         }
 		else {
 			assert(!m_ttd->m_buf.empty());
 		}
-		DbTable* tab = _rs.m_table->m_tab.get();
-        SharedBuffer sbuf = m_ttd->m_coder.decode(&tab->rowSchema(), m_ttd->m_buf);
+		if (recIdx >= m_endId) {
+			_skipNextAdvance = false;
+			_eof = true;
+			return {};
+		}
+		DbTable* tab = _rs.m_table->tab();
+        SharedBuffer sbuf = m_ttd->m_coder.decode(&tab->rowSchema(), val);
         const RecordId id(recIdx + 1);
 		int len = ConstDataView(sbuf.get()).read<LittleEndian<int>>();
 		LOG(1) << "TerarkDbRecordStore::Cursor::next(): _skipNextAdvance = " << _skipNextAdvance
@@ -190,7 +236,7 @@ public:
 			<< ", _skipNextAdvance = " << _skipNextAdvance
 			<< ", _eof = " << _eof << ", _lastReturnedId = " << _lastReturnedId;
         _skipNextAdvance = false;
-		DbTable& tab = *_rs.m_table->m_tab;
+		DbTable& tab = *_rs.m_table->tab();
         llong recIdx = id.repr() - 1;
 		assert(recIdx >= 0);
 		if (recIdx < 0) {
@@ -201,11 +247,30 @@ public:
 			return boost::none;
 		}
 		auto& ttd = *m_ttd;
-		if (!_cursor->seekExact(recIdx, &ttd.m_buf)) {
-			return boost::none;
+		terark::fstring val;
+		if (!seekReadAhead(recIdx, &val)) {
+			// ascending seeks with small gaps, such as a fetch driven by an
+			// index whose keys are correlated with insertion order, are
+			// hints that the next seeks hit the records just after recIdx
+			bool ascending = _forward && m_lastSeekIdx >= 0 &&
+				recIdx > m_lastSeekIdx && recIdx - m_lastSeekIdx <= SeekAheadMaxGap;
+			m_seekRun = ascending ? m_seekRun + 1 : 0;
+			m_lastSeekIdx = recIdx;
+			if (!ascending)
+				m_aheadRows = MinReadAheadRows;
+			clearReadAhead();
+			if (!_cursor->seekExact(recIdx, &ttd.m_buf)) {
+				return boost::none;
+			}
+			val = ttd.m_buf;
+			if (m_seekRun >= SeekAheadMinRun) {
+				// cursor points to recIdx+1, the copy in ttd.m_buf is
+				// not touched by fillReadAhead
+				fillReadAhead(recIdx);
+			}
 		}
-		assert(!ttd.m_buf.empty());
-        SharedBuffer sbuf = ttd.m_coder.decode(&tab.rowSchema(), ttd.m_buf);
+		assert(!val.empty());
+        SharedBuffer sbuf = ttd.m_coder.decode(&tab.rowSchema(), val);
 		int len = ConstDataView(sbuf.get()).read<LittleEndian<int>>();
         _lastReturnedId = id;
         _eof = false;
@@ -219,6 +284,10 @@ public:
 	}
 
 	void do_save() {
+		clearReadAhead();
+		m_aheadRows = MinReadAheadRows;
+		m_lastSeekIdx = -1;
+		m_seekRun = 0;
         try {
         	_cursor->reset();
         } catch (const WriteConflictException&) {
@@ -249,6 +318,7 @@ public:
             return true;
 		}
         llong recIdx = _lastReturnedId.repr() - 1;
+		clearReadAhead();
 		llong recIdx2 = _cursor->seekLowerBound(recIdx, &m_ttd->m_buf);
 		LOG(1) << "TerarkDbRecordStore::Cursor::restore(): _skipNextAdvance = " << _skipNextAdvance
 			<< ", _eof = " << _eof << ", _lastReturnedId = " << _lastReturnedId
@@ -278,9 +348,11 @@ public:
     void detachFromOperationContext() final {
 		LOG(1) << "TerarkDbRecordStore::Cursor::detachFromOperationContext(): _skipNextAdvance = " << _skipNextAdvance
 			<< ", _eof = " << _eof << ", _lastReturnedId = " << _lastReturnedId;
+		clearSnapshot();
 		if (m_ttd && !m_hasRecoveryUnit) {
 			_rs.m_table->releaseTableThreadData(m_ttd);
 		}
+		clearReadAhead();
 		m_ttd = nullptr;
         _txn = nullptr;
 		_cursor = nullptr;
@@ -294,6 +366,52 @@ public:
     }
 
 private:
+	// read ahead: next() serves records from a batch fetched by
+	// StoreIterator::incrementBatch, the batch grows from MinReadAheadRows
+	// to MaxReadAheadRows until save() or a non-ascending seekExact, thus a
+	// short scan does not read much more than it returns. The underlying _cursor is positioned after the batch, so
+	// the batch must be cleared whenever _cursor is repositioned
+	enum {
+		MinReadAheadRows = 4,
+		MaxReadAheadRows = 256,
+		MaxReadAheadBytes = 1024 * 1024,
+		SeekAheadMaxGap = 64,
+		SeekAheadMinRun = 2,
+	};
+	void clearReadAhead() {
+		m_ahead.erase_all();
+		m_aheadPos = 0;
+	}
+	// lastIdx is the record index just returned, -1 if none
+	bool fillReadAhead(llong lastIdx) {
+		size_t rows = m_aheadRows;
+		if (_forward && m_endId != LLONG_MAX) {
+			// ids are ascending, at most (m_endId - lastIdx - 1) are in range
+			llong inRange = m_endId - lastIdx - 1;
+			rows = size_t(std::max<llong>(std::min<llong>(rows, inRange), 1));
+		}
+		m_aheadPos = 0;
+		size_t n = _cursor->incrementBatch(&m_ahead, rows, MaxReadAheadBytes);
+		if (m_aheadRows < MaxReadAheadRows)
+			m_aheadRows *= 2;
+		return n > 0;
+	}
+	// records in read ahead are ascending for a forward cursor
+	bool seekReadAhead(llong recIdx, terark::fstring* val) {
+		if (!_forward || m_aheadPos >= m_ahead.size())
+			return false;
+		auto beg = m_ahead.ids.begin() + m_aheadPos;
+		auto end = m_ahead.ids.end();
+		auto iter = std::lower_bound(beg, end, recIdx);
+		if (iter == end || *iter != recIdx)
+			return false;
+		size_t pos = iter - m_ahead.ids.begin();
+		*val = m_ahead.row(pos);
+		m_aheadPos = pos + 1;
+		m_lastSeekIdx = recIdx;
+		return true;
+	}
+
     const TerarkDbRecordStore& _rs;
     OperationContext* _txn;
     bool _skipNextAdvance = false;
@@ -301,9 +419,105 @@ private:
 	bool m_hasRecoveryUnit = false;
 	bool m_isOwnerAlive = true;
 	const bool _forward;
+	const llong m_begId;
+	const llong m_endId;
 	TableThreadDataPtr m_ttd;
+	TableSnapshotPtr   m_snapshot; // the committed snapshot of majority read
     terark::db::StoreIteratorPtr _cursor;
     RecordId _lastReturnedId;  // If null, need to seek to first/last record.
+	terark::db::StoreBatch m_ahead;
+	size_t m_aheadPos = 0;
+	size_t m_aheadRows = MinReadAheadRows;
+	llong  m_lastSeekIdx = -1; // record index of last seekExact
+	size_t m_seekRun = 0; // number of successive ascending seekExact
+};
+
+// Each next() returns a uniformly random existing record, records may be
+// returned more than once. A random record index is drawn in all rows,
+// this is the same as picking a segment weighted by its numDataRows and a
+// random id in it, deleted rows(include uncommitted inserts) are redrawn.
+class TerarkDbRecordStore::RandomCursor final : public RecordCursor, public ICleanOnOwnerDead {
+public:
+    RandomCursor(OperationContext* txn, const TerarkDbRecordStore& rs)
+        : _rs(rs), _txn(txn), m_rand(std::random_device()()) {
+		LOG(1) << "TerarkDbRecordStore::RandomCursor::RandomCursor()";
+		m_ttd = rs.m_table->allocTableThreadData();
+		rs.m_table->registerCleanOnOwnerDead(this);
+    }
+
+	~RandomCursor() {
+		if (!m_isOwnerAlive) {
+			return;
+		}
+		ThreadSafeTable* tst = _rs.m_table.get();
+		if (m_ttd) {
+			tst->releaseTableThreadData(m_ttd);
+		}
+		m_ttd = nullptr;
+		tst->unregisterCleanOnOwnerDead(this);
+	}
+
+	void onOwnerPrematureDeath() override final {
+		if (m_ttd) {
+			_rs.m_table->releaseTableThreadData(m_ttd);
+		}
+		m_ttd = nullptr;
+		m_isOwnerAlive = false;
+	}
+
+    boost::optional<Record> next() final {
+		DbTable* tab = _rs.m_table->tab();
+		auto& ttd = *m_ttd;
+		// give up after so many deleted rows, table is almost empty
+		for (size_t retry = 0; retry < 1024; ++retry) {
+			llong rows = tab->numDataRows();
+			if (rows <= 0) {
+				return {};
+			}
+			llong recIdx = std::uniform_int_distribution<llong>(0, rows-1)(m_rand);
+			if (!tab->exists(recIdx)) {
+				continue;
+			}
+			terark::fstring row;
+			try {
+				row = tab->getValueRef(recIdx, &ttd.m_buf, ttd.m_dbCtx.get());
+			} catch (const terark::db::ReadDeletedRecordException&) {
+				continue; // deleted after exists()
+			}
+			SharedBuffer sbuf = ttd.m_coder.decode(&tab->rowSchema(), row);
+			int len = ConstDataView(sbuf.get()).read<LittleEndian<int>>();
+			const RecordId id(recIdx + 1);
+			LOG(2) << "TerarkDbRecordStore::RandomCursor::next(): id = " << id
+				<< ", retry = " << retry;
+			return {{id, {sbuf, len}}};
+		}
+		LOG(1) << "TerarkDbRecordStore::RandomCursor::next(): too many deleted rows"
+			<< ", dir: " << tab->getDir().string();
+		return {};
+    }
+
+    void save() final {}
+    bool restore() final { return true; }
+
+    void detachFromOperationContext() final {
+		if (m_ttd) {
+			_rs.m_table->releaseTableThreadData(m_ttd);
+		}
+		m_ttd = nullptr;
+        _txn = nullptr;
+    }
+
+    void reattachToOperationContext(OperationContext* txn) final {
+        _txn = txn;
+		m_ttd = _rs.m_table->allocTableThreadData();
+    }
+
+private:
+    const TerarkDbRecordStore& _rs;
+    OperationContext* _txn;
+	bool m_isOwnerAlive = true;
+	TableThreadDataPtr m_ttd;
+	std::mt19937_64 m_rand;
 };
 
 StatusWith<std::string> parseOptionsField(const BSONObj options) {
@@ -339,9 +553,10 @@ TerarkDbRecordStore::TerarkDbRecordStore(OperationContext* ctx,
 
 TerarkDbRecordStore::~TerarkDbRecordStore() {
     _shuttingDown = true;
-	DbTable* tab = m_table->m_tab.get();
-	tab->flush();
-    LOG(1) << BOOST_CURRENT_FUNCTION << ": namespace: " << ns() << ", dir: " << tab->getDir().string();
+	if (m_table->isOpened()) {
+		m_table->tab()->flush();
+	}
+    LOG(1) << BOOST_CURRENT_FUNCTION << ": namespace: " << ns() << ", dir: " << m_table->getDir().string();
 }
 
 const char* TerarkDbRecordStore::name() const {
@@ -353,11 +568,11 @@ bool TerarkDbRecordStore::inShutdown() const {
 }
 
 long long TerarkDbRecordStore::dataSize(OperationContext* txn) const {
-    return m_table->m_tab->dataStorageSize();
+    return m_table->tab()->dataStorageSize();
 }
 
 long long TerarkDbRecordStore::numRecords(OperationContext* txn) const {
-	auto tab = m_table->m_tab.get();
+	auto tab = m_table->tab();
 	long long existing = tab->existingRows();
 	long long total = tab->inlineGetRowNum();
     LOG(1) << "TerarkDbRecordStore::numRecords(): existing = " << existing
@@ -372,7 +587,7 @@ bool TerarkDbRecordStore::isCapped() const {
 int64_t TerarkDbRecordStore::storageSize(OperationContext* txn,
 									   BSONObjBuilder* extraInfo,
 									   int infoLevel) const {
-	return m_table->m_tab->dataStorageSize();
+	return m_table->tab()->dataStorageSize();
 }
 
 RecordData
@@ -383,7 +598,7 @@ TerarkDbRecordStore::dataFor(OperationContext* txn, const RecordId& id) const {
 bool TerarkDbRecordStore::findRecord(OperationContext* txn,
 								   const RecordId& id,
 								   RecordData* out) const {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
 	if (id.isNull()) {
 		LOG(2) << "TerarkDbRecordStore::findRecord(): id = null, dir: " << tab->getDir().string();
 		return false;
@@ -402,8 +617,8 @@ bool TerarkDbRecordStore::findRecord(OperationContext* txn,
 		rud = NULL;
 		ttd = &m_table->getMyThreadData();
 	}
-    tab->getValue(recIdx, &ttd->m_buf, ttd->m_dbCtx.get());
-    SharedBuffer bson = ttd->m_coder.decode(&tab->rowSchema(), ttd->m_buf);
+    terark::fstring row = tab->getValueRef(recIdx, &ttd->m_buf, ttd->m_dbCtx.get());
+    SharedBuffer bson = ttd->m_coder.decode(&tab->rowSchema(), row);
 	LOG(2) << "TerarkDbRecordStore::findRecord(): id = " << id
 		<< ", rud = " << (void*)rud.get()
 		<< ", bson = " << BSONObj(bson.get())
@@ -414,9 +629,49 @@ bool TerarkDbRecordStore::findRecord(OperationContext* txn,
     return true;
 }
 
+bool TerarkDbRecordStore::findRecordProjected(OperationContext* txn,
+								   const RecordId& id,
+								   const BSONObj& projection,
+								   RecordData* out) const {
+	DbTable* tab = m_table->tab();
+	if (id.isNull()) {
+		return false;
+	}
+    llong recIdx = id.repr() - 1;
+	RecoveryUnitDataPtr rud = NULL;
+	TableThreadData* ttd = NULL;
+	if (txn && txn->recoveryUnit()) {
+		rud = m_table->tryRecoveryUnitData(txn->recoveryUnit());
+		if (rud) {
+			ttd = rud->m_ttd.get();
+			assert(NULL != ttd);
+		}
+	}
+	if (!ttd) {
+		rud = NULL;
+		ttd = &m_table->getMyThreadData();
+	}
+	const Schema& rowSchema = tab->rowSchema();
+	valvec<size_t> colsId;
+	SchemaRecordCoder::projectColumns(&rowSchema, projection, &colsId);
+	try {
+		tab->selectColumns(recIdx, colsId, &ttd->m_buf, ttd->m_dbCtx.get());
+	} catch (const terark::db::ReadDeletedRecordException&) {
+		return false;
+	}
+    SharedBuffer bson = ttd->m_coder.decodeColumns(&rowSchema, colsId, ttd->m_buf);
+	LOG(2) << "TerarkDbRecordStore::findRecordProjected(): id = " << id
+		<< ", projection = " << projection
+		<< ", bson = " << BSONObj(bson.get())
+		<< ", dir: " << tab->getDir().string();
+    int bufsize = ConstDataView(bson.get()).read<LittleEndian<int>>();
+    *out = RecordData(bson, bufsize);
+    return true;
+}
+
 void TerarkDbRecordStore::deleteRecord(OperationContext* txn, const RecordId& id) {
     auto& td = m_table->getMyThreadData();
-	auto tab = m_table->m_tab.get();
+	auto tab = m_table->tab();
 	if (txn && txn->recoveryUnit()) {
 		LOG(2) << "TerarkDbRecordStore::deleteRecord(): id = " << id
 			<< ", dir: " << tab->getDir().string() << ", to registerDelete()";
@@ -432,7 +687,7 @@ void TerarkDbRecordStore::deleteRecord(OperationContext* txn, const RecordId& id
 Status TerarkDbRecordStore::insertRecords(OperationContext* txn,
 										std::vector<Record>* records,
 										bool enforceQuota) {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
     auto& td = m_table->getMyThreadData();
 	if (0 == records->size()) {
 	    LOG(1) << "TerarkDbRecordStore::insertRecords(): records->size() = 0";
@@ -463,7 +718,7 @@ StatusWith<RecordId> TerarkDbRecordStore::insertRecord(OperationContext* txn,
 													 const char* data,
 													 int len,
 													 bool enforceQuota) {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
     auto& td = m_table->getMyThreadData();
     BSONObj bson(data);
 	invariant(bson.objsize() == len);
@@ -493,7 +748,7 @@ TerarkDbRecordStore::insertRecordsWithDocWriter(OperationContext* txn,
 	    LOG(1) << "TerarkDbRecordStore::insertRecordsWithDocWriter(): nDocs = 0";
 		return Status::OK();
 	}
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
     auto& td = m_table->getMyThreadData();
     std::unique_ptr<Record[]> records(new Record[nDocs]);
 
@@ -557,7 +812,7 @@ TerarkDbRecordStore::updateRecord(OperationContext* txn,
 								int len,
 								bool enforceQuota,
 								UpdateNotifier* notifier) {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
 	terark::db::IncrementGuard_size_t incrGuard(tab->m_inprogressWritingCount);
 	invariant(id.repr() != 0);
 	llong recId = id.repr() - 1;
@@ -600,9 +855,84 @@ TerarkDbRecordStore::updateRecord(OperationContext* txn,
 }
 
 bool TerarkDbRecordStore::updateWithDamagesSupported() const {
-    return false;
+    return true;
+}
+
+namespace {
+
+// bytes of a BSON value of type elemType are the same as the encoded column
+// data, thus the column can be updated by the raw value bytes
+static bool
+isRawValueColumn(BSONType elemType, const terark::db::ColumnMeta& colmeta) {
+	using terark::db::ColumnType;
+	switch (elemType) {
+	default:
+		return false;
+	case mongo::Bool:
+		return colmeta.type == ColumnType::Uint08;
+	case NumberInt:
+		return colmeta.type == ColumnType::Sint32;
+	case NumberLong:
+		return colmeta.type == ColumnType::Sint64;
+	case NumberDouble:
+		return colmeta.type == ColumnType::Float64;
+	case bsonTimestamp:
+	case mongo::Date:
+		return colmeta.type == ColumnType::Sint64 ||
+			   colmeta.type == ColumnType::Uint64;
+	}
 }
 
+struct ChangeForUpdateColumns : public RecoveryUnit::Change {
+    void commit() override {}
+    void rollback() override {
+		for (size_t i = 0; i < m_columnIds.size(); ++i) {
+			fstring oldData(m_oldData.data() + m_offsets[i],
+							m_offsets[i+1] - m_offsets[i]);
+			m_tab->updateColumn(m_recId, m_columnIds[i], oldData);
+		}
+	}
+	ChangeForUpdateColumns(DbTable* tab, llong recId)
+		: m_tab(tab), m_recId(recId) { m_offsets.push_back(0); }
+	DbTablePtr m_tab;
+	llong m_recId;
+	valvec<size_t> m_columnIds;
+	valvec<size_t> m_offsets;
+	valvec<char>   m_oldData;
+};
+
+struct ChangeForUpdateRow : public RecoveryUnit::Change {
+    void commit() override {}
+    void rollback() override {
+		try {
+			terark::db::DbContextPtr ctx(m_tab->createDbContext());
+			llong newRecId = m_tab->updateRow(m_recId, m_oldRow, ctx.get());
+			if (newRecId != m_recId) {
+				error() << "ChangeForUpdateRow::rollback(): recId = " << m_recId
+					<< " was moved to " << newRecId << " because segment was frozen";
+			}
+		} catch (const std::exception& ex) {
+			error() << "ChangeForUpdateRow::rollback(): recId = " << m_recId
+				<< ", " << ex.what();
+		}
+	}
+	ChangeForUpdateRow(DbTable* tab, llong recId)
+		: m_tab(tab), m_recId(recId) {}
+	DbTablePtr m_tab;
+	llong m_recId;
+	valvec<unsigned char> m_oldRow;
+};
+
+} // namespace
+
+// Damages never change BSON size and never touch indexed fields(mongo checks
+// it before choosing damages), so RecordId must be kept:
+//  1. If all damaged top level fields are raw value columns in inplace
+//     updatable colgroups, just overwrite these columns by updateColumn,
+//     this works even if the segment of the record is frozen.
+//  2. Else if the segment is writable, encode the damaged BSON and
+//     updateRow, the old record is never decoded.
+//  3. Else needs document move.
 StatusWith<RecordData> TerarkDbRecordStore::updateWithDamages(
 							OperationContext* txn,
 							const RecordId& id,
@@ -610,7 +940,112 @@ StatusWith<RecordData> TerarkDbRecordStore::updateWithDamages(
 							const char* damageSource,
 							const mutablebson::DamageVector& damages)
 {
-    MONGO_UNREACHABLE;
+	DbTable* tab = m_table->tab();
+	terark::db::IncrementGuard_size_t incrGuard(tab->m_inprogressWritingCount);
+	invariant(id.repr() != 0);
+	llong recId = id.repr() - 1;
+	const int size = oldRec.size();
+	SharedBuffer newBuf = SharedBuffer::allocate(size);
+	char* root = newBuf.get();
+	memcpy(root, oldRec.data(), size);
+	for (const auto& d : damages) {
+		invariant(d.targetOffset + d.size <= size_t(size));
+		memcpy(root + d.targetOffset, damageSource + d.sourceOffset, d.size);
+	}
+	const terark::db::Schema& rowSchema = tab->rowSchema();
+	const terark::db::SchemaConfig& sconf = tab->getSchemaConfig();
+	// top level fields covered by damages
+	valvec<std::pair<size_t, BSONElement> > updCols;
+	bool inplace = true;
+	BSONObj newObj(root);
+	for (BSONObjIterator it(newObj); it.more() && inplace; ) {
+		BSONElement elem = *it; it.next();
+		size_t beg = elem.rawdata() - root;
+		size_t end = beg + elem.size();
+		size_t valBeg = elem.value() - root;
+		bool damaged = false, headDamaged = false;
+		for (const auto& d : damages) {
+			if (d.targetOffset < end && beg < d.targetOffset + d.size) {
+				damaged = true;
+				if (d.targetOffset < valBeg)
+					headDamaged = true;
+			}
+		}
+		if (!damaged)
+			continue;
+		size_t columnId = rowSchema.getColumnId(
+				fstring(elem.fieldName(), elem.fieldNameSize() - 1));
+		if (headDamaged || columnId >= rowSchema.columnNum()
+				|| !sconf.isInplaceUpdatableColumn(columnId)
+				|| !isRawValueColumn(elem.type(), rowSchema.getColumnMeta(columnId))) {
+			inplace = false;
+		} else {
+			updCols.emplace_back(columnId, elem);
+		}
+	}
+	auto& td = m_table->getMyThreadData();
+	if (inplace) {
+		LOG(2) << "TerarkDbRecordStore::updateWithDamages(): id = " << id
+			<< ", update " << updCols.size() << " columns inplace";
+		std::unique_ptr<ChangeForUpdateColumns> change;
+		if (txn && txn->recoveryUnit()) {
+			change.reset(new ChangeForUpdateColumns(tab, recId));
+			const char* oldRoot = oldRec.data();
+			for (const auto& x : updCols) {
+				size_t valBeg = x.second.value() - root;
+				size_t valLen = x.second.valuesize();
+				change->m_columnIds.push_back(x.first);
+				change->m_oldData.append(oldRoot + valBeg, valLen);
+				change->m_offsets.push_back(change->m_oldData.size());
+			}
+		}
+		try {
+			for (const auto& x : updCols) {
+				fstring val(x.second.value(), x.second.valuesize());
+				tab->updateColumn(recId, x.first, val, &*td.m_dbCtx);
+			}
+		} catch (const std::exception& ex) {
+			return Status(ErrorCodes::InternalError, ex.what());
+		}
+		if (change) {
+			txn->recoveryUnit()->registerChange(change.release());
+		}
+		return RecordData(std::move(newBuf), size);
+	}
+	{
+		terark::db::MyRwLock lock(tab->m_rwMutex, false);
+		size_t segIdx = tab->getSegmentIndexOfRecordIdNoLock(recId);
+		if (segIdx >= tab->getSegNum()) {
+			return Status(ErrorCodes::InvalidIdField, "record id is out of range");
+		}
+		if (tab->getSegmentPtr(segIdx)->m_isFreezed) {
+			LOG(2) << "TerarkDbRecordStore::updateWithDamages(): id = " << id
+				<< ", NeedsDocumentMove because segment of record is frozen";
+			return Status(ErrorCodes::NeedsDocumentMove, "segment of record is frozen");
+		}
+	}
+	LOG(2) << "TerarkDbRecordStore::updateWithDamages(): id = " << id
+		<< ", update row inplace";
+	std::unique_ptr<ChangeForUpdateRow> change;
+	try {
+		if (txn && txn->recoveryUnit()) {
+			change.reset(new ChangeForUpdateRow(tab, recId));
+			tab->getValue(recId, &change->m_oldRow, &*td.m_dbCtx);
+		}
+	    td.m_coder.encode(&rowSchema, nullptr, newObj, &td.m_buf);
+	} catch (const std::exception& ex) {
+		return Status(ErrorCodes::InvalidBSON, ex.what());
+	}
+	try {
+		llong newRecId = tab->updateRow(recId, td.m_buf, &*td.m_dbCtx);
+		invariant(newRecId == recId);
+	} catch (const std::exception& ex) {
+		return Status(ErrorCodes::InternalError, ex.what());
+	}
+	if (change) {
+		txn->recoveryUnit()->registerChange(change.release());
+	}
+	return RecordData(std::move(newBuf), size);
 }
 
 std::unique_ptr<SeekableRecordCursor>
@@ -620,18 +1055,50 @@ TerarkDbRecordStore::getCursor(OperationContext* txn, bool forward) const {
 
 std::unique_ptr<RecordCursor>
 TerarkDbRecordStore::getRandomCursor(OperationContext* txn) const {
-    return nullptr;
+    return stdx::make_unique<RandomCursor>(txn, *this);
 }
 
+// One cursor per group of consecutive segments, groups have about the same
+// number of rows and the number of groups is at most number of cpu cores.
+// The last range is open, so records inserted during the scan are visited
+// as with a single cursor. Boundary of a range is a fixed record index,
+// records which were moved by merge/purge after this call may be visited
+// by a neighbour cursor or be skipped, as with a concurrent update.
 std::vector<std::unique_ptr<RecordCursor>>
 TerarkDbRecordStore::getManyCursors(OperationContext* txn) const {
-    std::vector<std::unique_ptr<RecordCursor>> cursors(1);
-    cursors[0] = stdx::make_unique<Cursor>(txn, *this, /*forward=*/true);
+	DbTable* tab = m_table->tab();
+	valvec<llong> bounds;
+	bounds.push_back(0);
+	{
+		terark::db::MyRwLock lock(tab->m_rwMutex, false);
+		const size_t segNum = tab->getSegNum();
+		const size_t maxCursors = std::max(1u, std::thread::hardware_concurrency());
+		llong totalRows = 0;
+		for (size_t i = 0; i < segNum; ++i) {
+			totalRows += tab->getSegmentPtr(i)->numDataRows();
+		}
+		const llong groupRows = std::max<llong>(totalRows / maxCursors, 1);
+		llong baseId = 0;
+		for (size_t i = 0; i + 1 < segNum && bounds.size() < maxCursors; ++i) {
+			baseId += tab->getSegmentPtr(i)->numDataRows();
+			if (baseId - bounds.back() >= groupRows) {
+				bounds.push_back(baseId);
+			}
+		}
+	}
+	bounds.push_back(LLONG_MAX);
+	LOG(1) << "TerarkDbRecordStore::getManyCursors(): cursors = " << bounds.size() - 1
+		<< ", dir: " << tab->getDir().string();
+    std::vector<std::unique_ptr<RecordCursor>> cursors(bounds.size() - 1);
+	for (size_t i = 0; i < cursors.size(); ++i) {
+		cursors[i] = stdx::make_unique<Cursor>(txn, *this, /*forward=*/true,
+											   bounds[i], bounds[i+1]);
+	}
     return cursors;
 }
 
 Status TerarkDbRecordStore::truncate(OperationContext* txn) {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
 	LOG(2) << "TerarkDbRecordStore::truncate()";
 	tab->clear();
     return Status::OK();
@@ -641,7 +1108,7 @@ Status TerarkDbRecordStore::compact(OperationContext* txn,
 								  RecordStoreCompactAdaptor* adaptor,
 								  const CompactOptions* options,
 								  CompactStats* stats) {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
 	tab->compact(); // will wait for compact complete
     return Status::OK();
 }
@@ -651,7 +1118,7 @@ Status TerarkDbRecordStore::validate(OperationContext* txn,
                                    ValidateAdaptor* adaptor,
                                    ValidateResults* results,
                                    BSONObjBuilder* output) {
-	DbTable* tab = m_table->m_tab.get();
+	DbTable* tab = m_table->tab();
     output->appendNumber("nrecords", tab->numDataRows());
     return Status::OK();
 }
@@ -76,6 +76,11 @@ public:
 
     virtual bool findRecord(OperationContext* txn, const RecordId& id, RecordData* out) const override;
 
+    // as findRecord, but only columns needed by projection are read and decoded,
+    // out may have more fields than projection, which should still be applied
+    bool findRecordProjected(OperationContext* txn, const RecordId& id,
+                             const BSONObj& projection, RecordData* out) const;
+
     virtual void deleteRecord(OperationContext* txn, const RecordId& id) override;
 
     virtual Status insertRecords(OperationContext* txn,
@@ -160,6 +165,7 @@ public:
 
 private:
     class Cursor;
+    class RandomCursor;
     const std::string _ident;
     bool _shuttingDown;
 };
@@ -66,6 +66,15 @@ TerarkDbServerStatusSection::generateSection(OperationContext* txn,
     BSONObjBuilder bob;
 
 //    TerarkDbRecoveryUnit::appendGlobalStats(bob);
+    {
+        BSONObjBuilder sub(bob.subobjStart("indexIterCache"));
+        _engine->appendIndexIterCacheStats(sub);
+    }
+    // db.serverStatus({terarkDb: {memoryResident: 1}}) mincore's mmap'ed
+    // files of readonly segments, it is off by default for large tables
+    bool memoryResident = configElement.isABSONObj() &&
+                          configElement.Obj()["memoryResident"].trueValue();
+    _engine->appendEngineStats(bob, memoryResident);
 
     return bob.obj();
 }
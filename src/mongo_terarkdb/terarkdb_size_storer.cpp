@@ -45,6 +45,10 @@
 #include <terark/io/FileStream.hpp>
 #include <terark/io/MemStream.hpp>
 #include <terark/io/StreamBuffer.hpp>
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <string.h>
 
 namespace mongo { namespace terarkdb {
 
@@ -52,101 +56,212 @@ using namespace terark;
 
 using std::string;
 
-//DATA_IO_LOAD_SAVE_E(TerarkDbSizeStorer::Entry, &numRecords&dataSize)
+//DATA_IO_LOAD_SAVE_E(TerarkDbSizeStorer::SavedEntry, &numRecords&dataSize)
 
 template<class DataIO>
-void DataIO_loadObject(DataIO& dio, TerarkDbSizeStorer::Entry& x) {
+void DataIO_loadObject(DataIO& dio, TerarkDbSizeStorer::SavedEntry& x) {
 	dio >> x.numRecords;
 	dio >> x.dataSize;
 }
 template<class DataIO>
-void DataIO_saveObject(DataIO& dio, const TerarkDbSizeStorer::Entry& x) {
+void DataIO_saveObject(DataIO& dio, const TerarkDbSizeStorer::SavedEntry& x) {
 	dio << x.numRecords;
 	dio << x.dataSize;
 }
 
-TerarkDbSizeStorer::TerarkDbSizeStorer() {
+TerarkDbSizeStorer::Shard::~Shard() {
+	for (size_t i = entries.beg_i(); entries.end_i() != i; i = entries.next_i(i)) {
+		delete entries.val(i);
+	}
+}
+
+TerarkDbSizeStorer::TerarkDbSizeStorer() : m_pendingDelta(0), m_stopSync(false) {
 }
 
 TerarkDbSizeStorer::~TerarkDbSizeStorer() {
+	if (m_syncThread.joinable())
+		stopSyncThread();
+}
+
+TerarkDbSizeStorer::Shard& TerarkDbSizeStorer::getShard(fstring ns) const {
+	size_t h = fstring_func::hash()(ns);
+	return const_cast<Shard&>(m_shards[h % ShardNum]);
+}
+
+TerarkDbSizeStorer::Entry* TerarkDbSizeStorer::getEntry(fstring ns) {
+	Shard& shard = getShard(ns);
+	terark::db::MyRwLock lock(shard.rwMutex, false);
+	size_t i = shard.entries.find_i(ns);
+	if (i < shard.entries.end_i()) {
+		return shard.entries.val(i);
+	}
+	lock.upgrade_to_writer();
+	auto ib = shard.entries.insert_i(ns, nullptr);
+	if (ib.second) {
+		shard.entries.val(ib.first) = new Entry();
+	}
+	return shard.entries.val(ib.first);
+}
+
+const TerarkDbSizeStorer::Entry* TerarkDbSizeStorer::findEntry(fstring ns) const {
+	Shard& shard = getShard(ns);
+	terark::db::MyRwLock lock(shard.rwMutex, false);
+	size_t i = shard.entries.find_i(ns);
+	return i < shard.entries.end_i() ? shard.entries.val(i) : NULL;
+}
+
+void TerarkDbSizeStorer::addDelta(Entry* entry, llong numRecordsDelta, llong dataSizeDelta) {
+	entry->numRecords.fetch_add(numRecordsDelta, std::memory_order_relaxed);
+	entry->dataSize.fetch_add(dataSizeDelta, std::memory_order_relaxed);
+	entry->dirty.store(true, std::memory_order_relaxed);
+	m_pendingDelta.fetch_add(1, std::memory_order_relaxed);
 }
 
 void TerarkDbSizeStorer::onCreate(RecordStore* rs, llong numRecords, llong dataSize) {
-    std::lock_guard<std::mutex> lk(m_mutex);
-    Entry& entry = m_entries[rs->ns()];
-    entry.numRecords = numRecords;
-    entry.dataSize = dataSize;
-    entry.rs = rs;
-    entry.dirty = true;
+	Entry* entry = getEntry(rs->ns());
+	entry->numRecords = numRecords;
+	entry->dataSize = dataSize;
+	entry->rs = rs;
+	entry->dirty = true;
+	m_pendingDelta.fetch_add(1, std::memory_order_relaxed);
 }
 
 void TerarkDbSizeStorer::onDestroy(RecordStore* rs) {
-    stdx::lock_guard<stdx::mutex> lk(m_mutex);
-    Entry& entry = m_entries[rs->ns()];
-    entry.numRecords = rs->numRecords(NULL);
-    entry.dataSize = rs->dataSize(NULL);
-    entry.dirty = true;
-    entry.rs = NULL;
+	Entry* entry = getEntry(rs->ns());
+	entry->numRecords = rs->numRecords(NULL);
+	entry->dataSize = rs->dataSize(NULL);
+	entry->dirty = true;
+	entry->rs = NULL;
+	m_pendingDelta.fetch_add(1, std::memory_order_relaxed);
 }
 
 void TerarkDbSizeStorer::storeToCache(terark::fstring uri, llong numRecords, llong dataSize) {
-    stdx::lock_guard<stdx::mutex> lk(m_mutex);
-    Entry& entry = m_entries[uri];
-    entry.numRecords = numRecords;
-    entry.dataSize = dataSize;
-    entry.dirty = true;
+	Entry* entry = getEntry(uri);
+	entry->numRecords = numRecords;
+	entry->dataSize = dataSize;
+	entry->dirty = true;
+	m_pendingDelta.fetch_add(1, std::memory_order_relaxed);
 }
 
 void TerarkDbSizeStorer::loadFromCache(terark::fstring uri, llong* numRecords, llong* dataSize) const {
-    stdx::lock_guard<stdx::mutex> lk(m_mutex);
-    size_t it = m_entries.find_i(uri);
-    if (it == m_entries.end_i()) {
-        *numRecords = 0;
-        *dataSize = 0;
-        return;
-    }
-    *numRecords = m_entries.val(it).numRecords;
-    *dataSize = m_entries.val(it).dataSize;
+	const Entry* entry = findEntry(uri);
+	if (NULL == entry) {
+		*numRecords = 0;
+		*dataSize = 0;
+		return;
+	}
+	*numRecords = entry->numRecords.load(std::memory_order_relaxed);
+	*dataSize = entry->dataSize.load(std::memory_order_relaxed);
 }
 
 void TerarkDbSizeStorer::fillCache() {
-    hash_strmap<Entry> m;
-    {
-    	FileStream fp(m_filepath.c_str(), "rb");
+	hash_strmap<SavedEntry> m;
+	{
+		FileStream fp(m_filepath.c_str(), "rb");
 		NativeDataInput<InputBuffer> dio;
 		dio.attach(&fp);
-		dio >> m_entries;
-    }
-    stdx::lock_guard<stdx::mutex> lk(m_mutex);
-    m_entries.swap(m);
+		dio >> m;
+	}
+	for (size_t i = m.beg_i(); m.end_i() != i; i = m.next_i(i)) {
+		Entry* entry = getEntry(m.key(i));
+		entry->numRecords = m.val(i).numRecords;
+		entry->dataSize = m.val(i).dataSize;
+		entry->dirty = false;
+	}
 }
 
 void TerarkDbSizeStorer::syncCache(bool syncToDisk) {
 	using namespace terark;
-	NativeDataOutput<AutoGrownMemIO> buf;
-	{
-		stdx::lock_guard<stdx::mutex> lk(m_mutex);
-		for (size_t i = m_entries.beg_i(); m_entries.end_i() != i; i = m_entries.next_i(i)) {
-			fstring uriKey = m_entries.key(i);
-			Entry& entry = m_entries.val(i);
-			if (entry.rs) {
-				if (entry.dataSize != entry.rs->dataSize(NULL)) {
-					entry.dataSize = entry.rs->dataSize(NULL);
+	hash_strmap<SavedEntry> m;
+	size_t dirtyNum = 0;
+	for (size_t k = 0; k < ShardNum; ++k) {
+		Shard& shard = m_shards[k];
+		terark::db::MyRwLock lock(shard.rwMutex, false);
+		auto& entries = shard.entries;
+		for (size_t i = entries.beg_i(); entries.end_i() != i; i = entries.next_i(i)) {
+			Entry& entry = *entries.val(i);
+			if (RecordStore* rs = entry.rs.load()) {
+				llong dataSize = rs->dataSize(NULL);
+				llong numRecords = rs->numRecords(NULL);
+				if (entry.dataSize != dataSize) {
+					entry.dataSize = dataSize;
 					entry.dirty = true;
 				}
-				if (entry.numRecords != entry.rs->numRecords(NULL)) {
-					entry.numRecords = entry.rs->numRecords(NULL);
+				if (entry.numRecords != numRecords) {
+					entry.numRecords = numRecords;
 					entry.dirty = true;
 				}
 			}
+			if (!syncToDisk)
+				continue;
+			if (entry.dirty.exchange(false))
+				dirtyNum++;
+			SavedEntry& saved = m[entries.key(i)];
+			saved.numRecords = entry.numRecords.load(std::memory_order_relaxed);
+			saved.dataSize = entry.dataSize.load(std::memory_order_relaxed);
+		}
+	}
+	if (!syncToDisk || 0 == dirtyNum)
+		return;
+	NativeDataOutput<AutoGrownMemIO> buf;
+	buf.resize(m.total_key_size() + m.size() * SavedEntry::MySize);
+	buf << m;
+	std::lock_guard<std::mutex> lock(m_syncMutex);
+	std::string tmpFile = m_filepath + ".tmp";
+	{
+		FileStream fp(tmpFile.c_str(), "wb");
+		fp.ensureWrite(buf.begin(), buf.tell());
+	}
+	if (::rename(tmpFile.c_str(), m_filepath.c_str()) != 0) {
+		THROW_STD(runtime_error, "rename(%s, %s) = %s"
+			, tmpFile.c_str(), m_filepath.c_str(), strerror(errno));
+	}
+	LOG(2) << "TerarkDbSizeStorer::syncCache(): saved " << m.size()
+		<< " entries, dirty = " << dirtyNum << ", file: " << m_filepath;
+}
+
+void TerarkDbSizeStorer::startSyncThread(llong intervalMillisec, llong deltaThreshold) {
+	invariant(!m_syncThread.joinable());
+	m_stopSync = false;
+	m_syncThread = std::thread(&TerarkDbSizeStorer::syncThreadProc, this,
+							   intervalMillisec, deltaThreshold);
+}
+
+void TerarkDbSizeStorer::stopSyncThread() {
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_stopSync = true;
+	}
+	m_threadCond.notify_all();
+	if (m_syncThread.joinable())
+		m_syncThread.join();
+	syncCache(true);
+}
+
+void TerarkDbSizeStorer::syncThreadProc(llong intervalMillisec, llong deltaThreshold) {
+	// check the delta more frequently than interval, but not busy
+	const auto pollTime = std::chrono::milliseconds(std::max<llong>(intervalMillisec / 16, 10));
+	auto lastSync = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(m_threadMutex);
+	while (!m_stopSync) {
+		m_threadCond.wait_for(lock, pollTime);
+		if (m_stopSync)
+			break;
+		auto now = std::chrono::steady_clock::now();
+		if (m_pendingDelta.load(std::memory_order_relaxed) < deltaThreshold &&
+				now - lastSync < std::chrono::milliseconds(intervalMillisec))
+			continue;
+		lock.unlock();
+		m_pendingDelta.store(0, std::memory_order_relaxed);
+		try {
+			syncCache(true);
+		}
+		catch (const std::exception& ex) {
+			log() << "TerarkDbSizeStorer::syncThreadProc(): " << ex.what();
 		}
-		if (!syncToDisk)
-			return;
-		buf.resize(m_entries.total_key_size() + m_entries.size() * Entry::MySize);
-		buf << m_entries;
+		lastSync = now;
+		lock.lock();
 	}
-	FileStream fp(m_filepath.c_str(), "wb");
-	fp.ensureWrite(buf.begin(), buf.tell());
 }
 
 } }  // namespace mongo::terark
@@ -40,9 +40,12 @@
 
 #include "mongo_terarkdb_common.hpp"
 #include "mongo/base/string_data.h"
+#include <atomic>
+#include <condition_variable>
 #include <map>
 #include <string>
 #include <mutex>
+#include <thread>
 #include <terark/hash_strmap.hpp>
 #include <terark/db/db_table.hpp>
 
@@ -52,11 +55,26 @@ namespace mongo {
 
 namespace mongo { namespace terarkdb {
 
+// Entries are never freed before ~TerarkDbSizeStorer, so a RecordStore can
+// hold the Entry* from getEntry() and update its counters by addDelta()
+// without any lock. The name -> Entry lookup is sharded and read mostly,
+// persisting to m_filepath is done by the sync thread, either every
+// intervalMillisec or after deltaThreshold changes.
 class TerarkDbSizeStorer {
 public:
     TerarkDbSizeStorer();
     ~TerarkDbSizeStorer();
 
+    struct Entry {
+        Entry() : numRecords(0), dataSize(0), rs(NULL), dirty(false) {}
+        std::atomic<llong> numRecords;
+        std::atomic<llong> dataSize;
+        std::atomic<RecordStore*> rs;  // not owned
+        std::atomic<bool> dirty;
+    };
+    Entry* getEntry(fstring ns);
+    void addDelta(Entry*, llong numRecordsDelta, llong dataSizeDelta);
+
     void setFilePath(const std::string& fpath) { m_filepath = fpath; }
     const std::string& getFilePath() { return m_filepath; }
     void onCreate(RecordStore* rs, llong nr, llong ds);
@@ -68,18 +86,34 @@ public:
     void fillCache();
     void syncCache(bool syncToDisk);
 
-    struct Entry {
-        Entry() : numRecords(0), dataSize(0), rs(NULL), dirty(false) {}
+    void startSyncThread(llong intervalMillisec, llong deltaThreshold);
+    void stopSyncThread(); // and sync to disk
+
+    // persistent format of an Entry
+    struct SavedEntry {
         llong numRecords;
         llong dataSize;
-        RecordStore* rs;  // not owned
-        bool dirty;
         static const size_t MySize = 2 * sizeof(llong);
     };
 private:
+    static const size_t ShardNum = 16;
+    struct Shard {
+        terark::hash_strmap<Entry*> entries;
+        mutable terark::db::MyRwMutex rwMutex;
+        ~Shard();
+    };
+    Shard& getShard(fstring ns) const;
+    const Entry* findEntry(fstring ns) const;
+    void syncThreadProc(llong intervalMillisec, llong deltaThreshold);
+
     std::string m_filepath;
-    terark::hash_strmap<Entry> m_entries;
-    mutable stdx::mutex m_mutex;
+    Shard m_shards[ShardNum];
+    std::atomic<llong> m_pendingDelta; // changes since last sync to disk
+    std::mutex m_syncMutex; // serialize writing m_filepath
+    std::mutex m_threadMutex;
+    std::condition_variable m_threadCond;
+    bool m_stopSync; // guarded by m_threadMutex
+    std::thread m_syncThread;
 };
 } }  // namespace mongo::terark
 
@@ -31,10 +31,7 @@
 
 #include "mongo/platform/basic.h"
 
-#include "mongo/base/checked_cast.h"
-#include "terarkdb_record_store.h"
-#include "terarkdb_recovery_unit.h"
-#include "terarkdb_session_cache.h"
+#include "terarkdb_kv_engine.h"
 #include "terarkdb_snapshot_manager.h"
 #include "mongo/util/log.h"
 #include "mongo/util/mongoutils/str.h"
@@ -42,14 +39,28 @@
 namespace mongo { namespace terarkdb {
 
 Status TerarkDbSnapshotManager::prepareForCreateSnapshot(OperationContext* txn) {
-    TerarkDbRecoveryUnit::get(txn)->prepareForCreateSnapshot(txn);
+    // DbTable::acquireSnapshot is atomic to writers, nothing to prepare
     return Status::OK();
 }
 
 Status TerarkDbSnapshotManager::createSnapshot(OperationContext* txn, const SnapshotName& name) {
-    auto session = TerarkDbRecoveryUnit::get(txn)->getSession(txn)->getSession();
-    const std::string config = str::stream() << "name=" << name.asU64();
-    return terarkDbRCToStatus(session->snapshot(session, config.c_str()));
+    valvec<ThreadSafeTablePtr> tables;
+    _engine->getOpenedTables(&tables);
+    TableSnapshots snapshots;
+    snapshots.reserve(tables.size());
+    try {
+        for (auto& tst : tables) {
+            TableSnapshotPtr snap(new TableSnapshot(tst->tab()));
+            snapshots.emplace_back(tst, std::move(snap));
+        }
+    } catch (const std::exception& ex) {
+        return Status(ErrorCodes::InternalError, ex.what());
+    }
+    LOG(2) << "TerarkDbSnapshotManager::createSnapshot(): name = " << name.asU64()
+        << ", tables = " << snapshots.size();
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _namedSnapshots[name].swap(snapshots);
+    return Status::OK();
 }
 
 void TerarkDbSnapshotManager::setCommittedSnapshot(const SnapshotName& name) {
@@ -59,29 +70,31 @@ void TerarkDbSnapshotManager::setCommittedSnapshot(const SnapshotName& name) {
     _committedSnapshot = name;
 }
 
+// readers keep their TableSnapshotPtr, a DbTable snapshot version is
+// released when the last reference is gone
 void TerarkDbSnapshotManager::cleanupUnneededSnapshots() {
     stdx::lock_guard<stdx::mutex> lock(_mutex);
 
     if (!_committedSnapshot)
         return;
 
-    const std::string config = str::stream() << "drop=(before=" << _committedSnapshot->asU64()
-                                             << ')';
-    invariantTerarkDbOK(_session->snapshot(_session, config.c_str()));
+    _namedSnapshots.erase(_namedSnapshots.begin(),
+                          _namedSnapshots.lower_bound(*_committedSnapshot));
 }
 
 void TerarkDbSnapshotManager::dropAllSnapshots() {
     stdx::lock_guard<stdx::mutex> lock(_mutex);
+    dropAllSnapshotsNoLock();
+}
+
+void TerarkDbSnapshotManager::dropAllSnapshotsNoLock() {
     _committedSnapshot = boost::none;
-    invariantTerarkDbOK(_session->snapshot(_session, "drop=(all)"));
+    _namedSnapshots.clear();
 }
 
 void TerarkDbSnapshotManager::shutdown() {
     stdx::lock_guard<stdx::mutex> lock(_mutex);
-    if (!_session)
-        return;
-    invariantTerarkDbOK(_session->close(_session, NULL));
-    _session = nullptr;
+    dropAllSnapshotsNoLock();
 }
 
 boost::optional<SnapshotName> TerarkDbSnapshotManager::getMinSnapshotForNextCommittedRead()
@@ -90,19 +103,24 @@ boost::optional<SnapshotName> TerarkDbSnapshotManager::getMinSnapshotForNextComm
     return _committedSnapshot;
 }
 
-SnapshotName TerarkDbSnapshotManager::beginTransactionOnCommittedSnapshot(
-    TerarkDb_SESSION* session) const {
+TableSnapshotPtr TerarkDbSnapshotManager::getCommittedSnapshot(ThreadSafeTable* tst) const {
     stdx::lock_guard<stdx::mutex> lock(_mutex);
 
     uassert(ErrorCodes::ReadConcernMajorityNotAvailableYet,
             "Committed view disappeared while running operation",
             _committedSnapshot);
 
-    StringBuilder config;
-    config << "snapshot=" << _committedSnapshot->asU64();
-    invariantTerarkDbOK(session->begin_transaction(session, config.str().c_str()));
-
-    return *_committedSnapshot;
+    auto iter = _namedSnapshots.find(*_committedSnapshot);
+    invariant(_namedSnapshots.end() != iter);
+    for (const auto& x : iter->second) {
+        if (x.first.get() == tst)
+            return x.second;
+    }
+    // the table was not opened when the committed snapshot was created
+    uasserted(ErrorCodes::ReadConcernMajorityNotAvailableYet,
+              str::stream() << "table is not in committed snapshot: "
+                            << tst->getDir().string());
+    return nullptr; // remove compiler warning
 }
 
 } } // namespace mongo::terarkdb
@@ -33,22 +33,28 @@
 #pragma once
 
 #include <boost/optional.hpp>
+#include <map>
 #include "mongo_terarkdb_common.hpp"
 
 #include "mongo/base/disallow_copying.h"
 #include "mongo/db/storage/snapshot_manager.h"
-#include "terarkdb_util.h"
 #include "mongo/stdx/mutex.h"
 
 namespace mongo { namespace terarkdb {
 
+class TerarkDbKVEngine;
+
+// A named snapshot is a DbTable snapshot version of each opened table, it
+// is just a version number, no data is copied. Majority reads set the
+// version of the committed snapshot to their DbContext, released snapshots
+// advance DbTable::getOldestSnapshotVersion(), then purge and merge can
+// reclaim the rows deleted before it.
 class TerarkDbSnapshotManager final : public SnapshotManager {
     MONGO_DISALLOW_COPYING(TerarkDbSnapshotManager);
 
 public:
-    explicit TerarkDbSnapshotManager(TerarkDb_CONNECTION* conn) {
-        invariantTerarkDbOK(conn->open_session(conn, NULL, NULL, &_session));
-    }
+    explicit TerarkDbSnapshotManager(const TerarkDbKVEngine* engine)
+        : _engine(engine) {}
 
     ~TerarkDbSnapshotManager() {
         shutdown();
@@ -65,31 +71,32 @@ public:
     //
 
     /**
-     * Prepares for a shutdown of the TerarkDb_CONNECTION.
+     * Releases all snapshots, called before tables are closed.
      */
     void shutdown();
 
     /**
-     * Starts a transaction and returns the SnapshotName used.
+     * Returns the committed snapshot of the table, it is alive until the
+     * returned pointer is released.
      *
-     * Throws if there is currently no committed snapshot.
+     * Throws if there is currently no committed snapshot of the table.
      */
-    SnapshotName beginTransactionOnCommittedSnapshot(TerarkDb_SESSION* session) const;
+    TableSnapshotPtr getCommittedSnapshot(ThreadSafeTable* tst) const;
 
     /**
      * Returns lowest SnapshotName that could possibly be used by a future call to
-     * beginTransactionOnCommittedSnapshot, or boost::none if there is currently no committed
+     * getCommittedSnapshot, or boost::none if there is currently no committed
      * snapshot.
-     *
-     * This should not be used for starting a transaction on this SnapshotName since the named
-     * snapshot may be deleted by the time you start the transaction.
      */
     boost::optional<SnapshotName> getMinSnapshotForNextCommittedRead() const;
 
 private:
+    typedef std::vector<std::pair<ThreadSafeTablePtr, TableSnapshotPtr> > TableSnapshots;
+    void dropAllSnapshotsNoLock();
+
+    const TerarkDbKVEngine* _engine;
     mutable stdx::mutex _mutex;  // Guards all members.
     boost::optional<SnapshotName> _committedSnapshot;
-    TerarkDb_SESSION* _session;  // only used for dropping snapshots.
+    std::map<SnapshotName, TableSnapshots> _namedSnapshots;
 };
 } }  // namespace mongo::terark
-
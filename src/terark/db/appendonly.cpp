@@ -1,18 +1,26 @@
 #include "appendonly.hpp"
+#include "db_env.hpp"
 #include <terark/num_to_str.hpp>
 #include <terark/io/DataIO.hpp>
+#include <terark/io/DataIO_VarIntGroup.hpp>
 #include <terark/io/FileStream.hpp>
+#include <terark/io/MemStream.hpp>
 #include <terark/io/StreamBuffer.hpp>
 #include <terark/util/autoclose.hpp>
 #include <terark/util/mmap.hpp>
 #include <terark/util/truncate_file.hpp>
+#include <atomic>
 
 #if defined(_MSC_VER)
 	#include <io.h>
 #else
 	#include <unistd.h>
+	#include <sys/mman.h>
 #endif
 #include <fcntl.h>
+#if defined(TERARK_DB_WITH_ZSTD)
+	#include <zstd.h>
+#endif
 
 namespace terark { namespace db {
 
@@ -54,8 +62,8 @@ RandomReadAppendonlyStore::RandomReadAppendonlyStore(const Schema& schema) {
 RandomReadAppendonlyStore::~RandomReadAppendonlyStore() {
 	if (m_index) {
 		assert(NULL != m_store);
-		mmap_close(m_index, m_indexBytes);
-		mmap_close(m_store, m_storeBytes);
+		DbEnv::current()->mmapClose(m_index, m_indexBytes);
+		DbEnv::current()->mmapClose(m_store, m_storeBytes);
 	}
 }
 
@@ -84,6 +92,58 @@ const {
 	val->append(m_store + offset0, offset1 - offset0);
 }
 
+bool RandomReadAppendonlyStore::hasValueRef() const {
+	return m_isFreezed && NULL != m_index;
+}
+
+fstring RandomReadAppendonlyStore::getValueRef(llong id, DbContext*) const {
+	assert(id >= 0);
+	assert(m_isFreezed);
+	llong rows = llong(m_index->rowsNum);
+	if (id >= rows) {
+		THROW_STD(out_of_range, "id = %lld, rows = %lld", id, rows);
+	}
+	uint64_t offset0 = m_index->getOffset(id+0);
+	uint64_t offset1 = m_index->getOffset(id+1);
+	TERARK_RT_assert(offset0 <= offset1, std::logic_error);
+	return fstring(m_store + offset0, offset1 - offset0);
+}
+
+// Issue MADV_WILLNEED for the rows before copying them, so the kernel
+// reads cold pages concurrently instead of one page fault at a time
+void
+RandomReadAppendonlyStore::getValuesAppendBatch(const llong* ids, size_t num,
+												valvec<byte>* vals,
+												DbContext* ctx)
+const {
+#if !defined(_MSC_VER)
+	if (num > 1) {
+		const uint64_t PageSize = 4096;
+		const llong rows = llong(m_index->rowsNum);
+		uint64_t advBeg = 0, advEnd = 0;
+		for (size_t i = 0; i < num; ++i) {
+			if (ids[i] < 0 || ids[i] >= rows)
+				continue; // getValueAppend will throw
+			uint64_t beg = m_index->getOffset(ids[i]) & ~(PageSize - 1);
+			uint64_t end = m_index->getOffset(ids[i] + 1);
+			if (advBeg < advEnd && beg >= advBeg && beg <= advEnd + PageSize) {
+				advEnd = std::max(advEnd, end);
+				continue;
+			}
+			if (advBeg < advEnd)
+				madvise(m_store + advBeg, size_t(advEnd - advBeg), MADV_WILLNEED);
+			advBeg = beg;
+			advEnd = end;
+		}
+		if (advBeg < advEnd)
+			madvise(m_store + advBeg, size_t(advEnd - advBeg), MADV_WILLNEED);
+	}
+#endif
+	for (size_t i = 0; i < num; ++i) {
+		getValueAppend(ids[i], &vals[i], ctx);
+	}
+}
+
 StoreIterator* RandomReadAppendonlyStore::createStoreIterForward(DbContext* ctx) const {
 	return nullptr;
 }
@@ -98,7 +158,7 @@ llong RandomReadAppendonlyStore::append(fstring row, DbContext*) {
 	if (terark_unlikely(NULL == h)) {
 		h = allocIndexRows(256);
 		truncate_file(m_storeFile, ChunkBytes);
-		m_store = (byte_t*)mmap_load(m_storeFile, &m_storeBytes);
+		m_store = (byte_t*)DbEnv::current()->mmapLoad(m_storeFile, &m_storeBytes);
 		h->dataCap = ChunkBytes;
 	}
 	else {
@@ -109,11 +169,11 @@ llong RandomReadAppendonlyStore::append(fstring row, DbContext*) {
 	}
 	TERARK_RT_assert(h->dataLen <= h->dataCap, std::logic_error);
 	if (terark_unlikely(h->dataLen + row.size() > h->dataCap)) {
-		mmap_close(m_store, m_storeBytes); m_store = NULL;
+		DbEnv::current()->mmapClose(m_store, m_storeBytes); m_store = NULL;
 		ullong require = ullong((h->dataLen + row.size()) * 1.618);
 		ullong aligned = (require + ChunkBytes-1) & ~(ChunkBytes-1);
 		truncate_file(m_storeFile, aligned);
-		m_store = (byte_t*)mmap_load(m_storeFile, &m_storeBytes);
+		m_store = (byte_t*)DbEnv::current()->mmapLoad(m_storeFile, &m_storeBytes);
 	}
 	TERARK_RT_assert(h->getOffset(h->rowsNum) == h->dataLen, std::logic_error);
 	memcpy(m_store + h->dataLen, row.data(), row.size());
@@ -127,12 +187,12 @@ void RandomReadAppendonlyStore::shrinkToFit() {
 	m_index->rowsCap = m_index->rowsNum;
 	uint64_t indexBytes = sizeof(Header) + (m_index->rowsNum * m_index->offsetBits + 7) / 8;
 	uint64_t storeBytes = m_index->dataLen;
-	mmap_close(m_index, m_indexBytes); m_index = NULL;
-	mmap_close(m_store, m_storeBytes); m_store = NULL;
+	DbEnv::current()->mmapClose(m_index, m_indexBytes); m_index = NULL;
+	DbEnv::current()->mmapClose(m_store, m_storeBytes); m_store = NULL;
 	truncate_file(m_indexFile, indexBytes);
 	truncate_file(m_storeFile, storeBytes);
-	m_index = (Header*)mmap_load(m_indexFile, &m_indexBytes);
-	m_store = (byte_t*)mmap_load(m_storeFile, &m_storeBytes);
+	m_index = (Header*)DbEnv::current()->mmapLoad(m_indexFile, &m_indexBytes);
+	m_store = (byte_t*)DbEnv::current()->mmapLoad(m_storeFile, &m_storeBytes);
 }
 
 void RandomReadAppendonlyStore::shrinkToSize(size_t)
@@ -141,8 +201,8 @@ void RandomReadAppendonlyStore::shrinkToSize(size_t)
 }
 
 void RandomReadAppendonlyStore::deleteFiles() {
-	mmap_close(m_index, m_indexBytes); m_index = NULL;
-	mmap_close(m_store, m_storeBytes); m_store = NULL;
+	DbEnv::current()->mmapClose(m_index, m_indexBytes); m_index = NULL;
+	DbEnv::current()->mmapClose(m_store, m_storeBytes); m_store = NULL;
 	boost::filesystem::remove(m_indexFile);
 	boost::filesystem::remove(m_storeFile);
 }
@@ -155,8 +215,8 @@ void RandomReadAppendonlyStore::load(PathRef fpath) {
 	m_storeFile = strFile + ".ap-index";
 	m_indexFile = strFile + ".ap-store";
 	bool writable = true;
-	m_index = (Header*)mmap_load(m_indexFile, &m_indexBytes, writable);
-	m_store = (byte_t*)mmap_load(m_storeFile, &m_storeBytes, writable);
+	m_index = (Header*)DbEnv::current()->mmapLoad(m_indexFile, &m_indexBytes, writable);
+	m_store = (byte_t*)DbEnv::current()->mmapLoad(m_storeFile, &m_storeBytes, writable);
 }
 
 void RandomReadAppendonlyStore::save(PathRef path) const {
@@ -171,12 +231,12 @@ RandomReadAppendonlyStore::allocIndexRows(ullong rows) {
 	newBytes = ullong((newBytes+ChunkBytes-1)) & ~(ChunkBytes-1);
 	Header* h = m_index;
 	if (h) {
-		mmap_close(h, m_indexBytes);
+		DbEnv::current()->mmapClose(h, m_indexBytes);
 		m_index = nullptr;
 	}
 	truncate_file(m_indexFile, newBytes);
 	const bool writable = true;
-	m_index = (Header*)mmap_load(m_indexFile, &m_indexBytes, writable);
+	m_index = (Header*)DbEnv::current()->mmapLoad(m_indexFile, &m_indexBytes, writable);
 	if (nullptr == h) {
 		h = m_index;
 		h->init();
@@ -192,22 +252,45 @@ RandomReadAppendonlyStore::allocIndexRows(ullong rows) {
 /////////////////////////////////////////////////////////////////////////////
 
 struct SeqReadAppendonlyStore::IoImpl {
-	FileStream fp;
+	EnvFileStream fp;
 	NativeDataOutput<OutputBuffer> dio;
 };
 
+// Scans keep the next readahead window of the file in flight by
+// POSIX_FADV_WILLNEED, the kernel then reads it asynchronously with deep
+// queue depth while rows of the current window are being consumed
 class SeqReadAppendonlyStore::MyStoreIterForward : public StoreIterator {
 	llong   m_id;
 	int64_t m_rows;
 	int64_t m_inflateSize;
+	llong   m_pos; // file offset of next row
+	llong   m_advisedEnd;
+	size_t  m_readaheadSize;
 	FileStream m_fp;
 	NativeDataInput<InputBuffer> m_di;
+
+	void readahead() {
+#if defined(__linux__)
+		if (m_readaheadSize && m_pos + llong(m_readaheadSize / 2) >= m_advisedEnd) {
+			int fd = fileno(m_fp.fp());
+			posix_fadvise(fd, m_advisedEnd, m_readaheadSize, POSIX_FADV_WILLNEED);
+			m_advisedEnd += m_readaheadSize;
+		}
+#endif
+	}
 public:
 	MyStoreIterForward(const SeqReadAppendonlyStore* store, fstring fname) {
 		m_id = 0;
 		m_store.reset(const_cast<SeqReadAppendonlyStore*>(store));
 		m_fp.open(fname.c_str(), "rb");
 		m_fp.disbuf();
+#if defined(__linux__)
+		posix_fadvise(fileno(m_fp.fp()), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		m_readaheadSize = store->m_readaheadSize;
+		m_pos = 16;
+		m_advisedEnd = 0;
+		readahead();
 		m_di.attach(&m_fp);
 		m_di >> m_rows;
 		m_di >> m_inflateSize;
@@ -217,6 +300,10 @@ public:
 			size_t len = m_di.load_as<var_size_t>();
 			val->resize_no_init(len);
 			m_di.ensureRead(val->data(), len);
+			size_t lenBytes = 1;
+			for (size_t x = len; x >= 128; x >>= 7) lenBytes++;
+			m_pos += lenBytes + len;
+			readahead();
 			*id = m_id++;
 			return true;
 		}
@@ -229,7 +316,10 @@ public:
 	}
 	void reset() override {
 		m_id = 0;
+		m_pos = 16;
+		m_advisedEnd = 0;
 		m_fp.rewind();
+		readahead();
 		m_di.resetbuf();
 		m_di >> m_rows;
 		m_di >> m_inflateSize;
@@ -244,6 +334,7 @@ AppendableStore* SeqReadAppendonlyStore::getAppendableStore() {
 }
 
 SeqReadAppendonlyStore::SeqReadAppendonlyStore(const Schema& schema) {
+	m_readaheadSize = schema.m_readaheadSize;
 	m_fsize = -1;
 	m_inflateSize = -1;
 	m_rows = -1;
@@ -252,6 +343,7 @@ SeqReadAppendonlyStore::SeqReadAppendonlyStore(const Schema& schema) {
 SeqReadAppendonlyStore::SeqReadAppendonlyStore(PathRef segDir, const Schema& schema) {
 	auto fpath = segDir / "linear-" + schema.m_name + ".seq";
 	m_fpath = fpath.string();
+	m_readaheadSize = schema.m_readaheadSize;
 	if (boost::filesystem::exists(fpath)) {
 		// just for read, by createStoreIterForward()
 		m_fsize = -1;
@@ -364,4 +456,362 @@ void SeqReadAppendonlyStore::save(PathRef path) const {
 }
 
 
+/////////////////////////////////////////////////////////////////////////////
+
+// file layout: Header, blocks, blockOffsets[blockNum+1], blockRowBase[blockNum+1]
+// the two arrays are raw uint64 in g_blockZipMagic files, and are delta
+// coded as_var_int_group in g_blockZipMagicV2 files
+// a block is: byte BlockZipType, then the (compressed) payload:
+//             uint32 rowOffsets[rows+1], row data
+struct BlockZipAppendonlyStore::Header {
+	char      magic[40];
+	uint64_t  rows;
+	uint64_t  inflateSize;
+	uint64_t  blockNum;
+	uint64_t  indexOffset;
+};
+static const char g_blockZipMagic[] = "terark::db::BlockZipAppendonlyStore";
+static const char g_blockZipMagicV2[] = "terark::db::BlockZipAppendonlyStore.v2";
+
+enum BlockZipType : byte_t {
+	kRawBlock = 0,
+	kZstdBlock = 1,
+};
+
+struct BlockZipAppendonlyStore::IoImpl {
+	EnvFileStream fp;
+};
+
+static ullong newBlockZipStoreId() {
+	static std::atomic<ullong> s_nextId(1);
+	return s_nextId++;
+}
+
+class BlockZipAppendonlyStore::MyStoreIterForward : public StoreIterator {
+	llong m_id;
+	ZipBlockCache m_cache;
+public:
+	MyStoreIterForward(const BlockZipAppendonlyStore* store) {
+		m_id = 0;
+		m_store.reset(const_cast<BlockZipAppendonlyStore*>(store));
+	}
+	bool increment(llong* id, valvec<byte>* val) override {
+		auto store = static_cast<const BlockZipAppendonlyStore*>(m_store.get());
+		if (m_id < store->m_rows) {
+			val->erase_all();
+			store->rowAppend(m_id, &m_cache, val);
+			*id = m_id++;
+			return true;
+		}
+		return false;
+	}
+	bool seekExact(llong id, valvec<byte>* val) override {
+		auto store = static_cast<const BlockZipAppendonlyStore*>(m_store.get());
+		if (id < 0 || id >= store->m_rows) {
+			return false;
+		}
+		val->erase_all();
+		store->rowAppend(id, &m_cache, val);
+		m_id = id + 1;
+		return true;
+	}
+	void reset() override {
+		m_id = 0;
+	}
+};
+
+AppendableStore* BlockZipAppendonlyStore::getAppendableStore() {
+	if (m_io)
+		return this;
+	else
+		return NULL;
+}
+
+BlockZipAppendonlyStore::BlockZipAppendonlyStore(const Schema& schema) {
+	m_mmapBase = NULL;
+	m_mmapSize = 0;
+	m_fsize = -1;
+	m_inflateSize = -1;
+	m_rows = -1;
+	m_storeId = newBlockZipStoreId();
+}
+
+BlockZipAppendonlyStore::BlockZipAppendonlyStore(PathRef segDir, const Schema& schema) {
+	auto fpath = segDir / "blockzip-" + schema.m_name + ".bzap";
+	m_fpath = fpath.string();
+	m_mmapBase = NULL;
+	m_mmapSize = 0;
+	m_storeId = newBlockZipStoreId();
+	if (boost::filesystem::exists(fpath)) {
+		this->doLoad();
+	}
+	else {
+		m_fsize = sizeof(Header);
+		m_inflateSize = 0;
+		m_rows = 0;
+		m_rowOffsets.push_back(0);
+		m_io.reset(new IoImpl());
+		m_io->fp.open(m_fpath.c_str(), "wb");
+		Header header;
+		memset(&header, 0, sizeof(header));
+		m_io->fp.ensureWrite(&header, sizeof(header)); // rewrite on finish
+	}
+}
+
+BlockZipAppendonlyStore::~BlockZipAppendonlyStore() {
+	if (m_io)
+		this->shrinkToFit();
+	if (m_mmapBase)
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
+}
+
+llong BlockZipAppendonlyStore::dataInflateSize() const {
+	return m_inflateSize;
+}
+llong BlockZipAppendonlyStore::dataStorageSize() const {
+	return m_fsize;
+}
+
+llong BlockZipAppendonlyStore::numDataRows() const {
+	return m_rows;
+}
+
+size_t BlockZipAppendonlyStore::findBlock(llong id) const {
+	assert(id >= 0 && id < m_rows);
+	size_t upp = upper_bound_a(m_blockRowBase, uint64_t(id));
+	assert(upp >= 1 && upp < m_blockRowBase.size());
+	return upp - 1;
+}
+
+void BlockZipAppendonlyStore::getBlock(size_t blockIdx, ZipBlockCache* cache)
+const {
+	if (cache->storeId == m_storeId && cache->blockIdx == blockIdx) {
+		return;
+	}
+	assert(blockIdx + 1 < m_blockOffsets.size());
+	const byte_t* zdata = m_mmapBase + m_blockOffsets[blockIdx];
+	const size_t  zsize = size_t(m_blockOffsets[blockIdx+1] - m_blockOffsets[blockIdx]);
+	TERARK_RT_assert(zsize >= 1, std::logic_error);
+	cache->storeId = 0; // invalid until decompressed
+	switch (zdata[0]) {
+	default:
+		THROW_STD(logic_error, "bad block type %d of block %zd in %s"
+			, zdata[0], blockIdx, m_fpath.c_str());
+	case kRawBlock:
+		cache->data.assign(zdata + 1, zsize - 1);
+		break;
+	case kZstdBlock: {
+#if defined(TERARK_DB_WITH_ZSTD)
+		unsigned long long size = ZSTD_getFrameContentSize(zdata + 1, zsize - 1);
+		if (ZSTD_CONTENTSIZE_ERROR == size || ZSTD_CONTENTSIZE_UNKNOWN == size) {
+			THROW_STD(logic_error, "bad zstd block %zd in %s"
+				, blockIdx, m_fpath.c_str());
+		}
+		cache->data.resize_no_init(size_t(size));
+		size_t res = ZSTD_decompress(cache->data.data(), cache->data.size(),
+									 zdata + 1, zsize - 1);
+		if (ZSTD_isError(res) || res != size) {
+			THROW_STD(logic_error, "decompress block %zd of %s failed: %s"
+				, blockIdx, m_fpath.c_str()
+				, ZSTD_isError(res) ? ZSTD_getErrorName(res) : "size mismatch");
+		}
+#else
+		THROW_STD(invalid_argument
+			, "block %zd of %s is zstd compressed, but zstd is not enabled(WITH_ZSTD=1)"
+			, blockIdx, m_fpath.c_str());
+#endif
+		break; }
+	}
+	cache->storeId = m_storeId;
+	cache->blockIdx = blockIdx;
+}
+
+void
+BlockZipAppendonlyStore::rowAppend(llong id, ZipBlockCache* cache,
+								   valvec<byte>* val)
+const {
+	size_t blockIdx = findBlock(id);
+	getBlock(blockIdx, cache);
+	size_t rows = size_t(m_blockRowBase[blockIdx+1] - m_blockRowBase[blockIdx]);
+	size_t k = size_t(id - m_blockRowBase[blockIdx]);
+	auto offsets = (const uint32_t*)cache->data.data();
+	auto rowData = cache->data.data() + sizeof(uint32_t) * (rows + 1);
+	TERARK_RT_assert(sizeof(uint32_t) * (rows + 1) + offsets[rows]
+					 == cache->data.size(), std::logic_error);
+	val->append(rowData + offsets[k], offsets[k+1] - offsets[k]);
+}
+
+void
+BlockZipAppendonlyStore::getValueAppend(llong id, valvec<byte>* val, DbContext* ctx)
+const {
+	assert(id >= 0);
+	if (m_io) {
+		THROW_STD(invalid_argument, "Unsupportted method when writing");
+	}
+	if (id < 0 || id >= m_rows) {
+		THROW_STD(out_of_range, "id = %lld, rows = %lld", id, m_rows);
+	}
+	if (ctx) {
+		rowAppend(id, &ctx->m_zipBlockCache, val);
+	}
+	else {
+		ZipBlockCache cache;
+		rowAppend(id, &cache, val);
+	}
+}
+
+StoreIterator* BlockZipAppendonlyStore::createStoreIterForward(DbContext*) const {
+	if (m_io) {
+		THROW_STD(invalid_argument, "Unsupportted method when writing");
+	}
+	return new MyStoreIterForward(this);
+}
+StoreIterator* BlockZipAppendonlyStore::createStoreIterBackward(DbContext*) const {
+	return nullptr;
+}
+
+llong BlockZipAppendonlyStore::append(fstring row, DbContext*) {
+	assert(m_io);
+	TERARK_RT_assert(m_blockBuf.size() + row.size() < UINT32_MAX, std::length_error);
+	m_blockBuf.append(row.udata(), row.size());
+	m_rowOffsets.push_back(uint32_t(m_blockBuf.size()));
+	m_inflateSize += row.size();
+	llong id = m_rows++;
+	if (m_blockBuf.size() >= BlockBytes) {
+		flushBlock();
+	}
+	return id;
+}
+
+void BlockZipAppendonlyStore::flushBlock() {
+	const size_t rows = m_rowOffsets.size() - 1;
+	if (0 == rows) {
+		return;
+	}
+	valvec<byte> payload;
+	payload.reserve(sizeof(uint32_t) * (rows + 1) + m_blockBuf.size());
+	payload.append((const byte*)m_rowOffsets.data(), sizeof(uint32_t) * (rows + 1));
+	payload.append(m_blockBuf);
+	byte_t zipType = kRawBlock;
+	const byte_t* zdata = payload.data();
+	size_t zsize = payload.size();
+#if defined(TERARK_DB_WITH_ZSTD)
+	valvec<byte> zbuf(ZSTD_compressBound(payload.size()), valvec_no_init());
+	size_t res = ZSTD_compress(zbuf.data(), zbuf.size(),
+							   payload.data(), payload.size(), 3);
+	if (!ZSTD_isError(res) && res < payload.size()) {
+		zipType = kZstdBlock;
+		zdata = zbuf.data();
+		zsize = res;
+	}
+#endif
+	m_blockOffsets.push_back(m_fsize);
+	m_blockRowBase.push_back(m_rows - rows);
+	m_io->fp.ensureWrite(&zipType, 1);
+	m_io->fp.ensureWrite(zdata, zsize);
+	m_fsize += 1 + zsize;
+	m_blockBuf.erase_all();
+	m_rowOffsets.erase_all();
+	m_rowOffsets.push_back(0);
+}
+
+void BlockZipAppendonlyStore::shrinkToFit() {
+	if (!m_io) {
+		return;
+	}
+	flushBlock();
+	BOOST_STATIC_ASSERT(sizeof(Header) == 72);
+	Header header;
+	memset(&header, 0, sizeof(header));
+	BOOST_STATIC_ASSERT(sizeof(g_blockZipMagicV2) <= sizeof(header.magic));
+	strcpy(header.magic, g_blockZipMagicV2);
+	header.rows = m_rows;
+	header.inflateSize = m_inflateSize;
+	header.blockNum = m_blockOffsets.size();
+	header.indexOffset = m_fsize;
+	m_blockOffsets.push_back(m_fsize); // end guard
+	m_blockRowBase.push_back(m_rows);  // end guard
+	{
+		NativeDataOutput<AutoGrownMemIO> index;
+		index << as_var_int_group(m_blockOffsets, true);
+		index << as_var_int_group(m_blockRowBase, true);
+		m_io->fp.ensureWrite(index.begin(), index.tell());
+	}
+	m_io->fp.rewind();
+	m_io->fp.ensureWrite(&header, sizeof(header));
+	m_io.reset();
+	m_blockBuf.clear();
+	m_rowOffsets.clear();
+	doLoad();
+}
+
+void BlockZipAppendonlyStore::shrinkToSize(size_t)
+{
+    assert(0);
+}
+
+void BlockZipAppendonlyStore::deleteFiles() {
+	m_io.reset();
+	if (m_mmapBase) {
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
+		m_mmapBase = NULL;
+	}
+	try {
+		boost::filesystem::remove(m_fpath);
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: remove(%s) = %s\n", m_fpath.c_str(), ex.what());
+		throw;
+	}
+}
+
+void BlockZipAppendonlyStore::load(PathRef fpath) {
+	m_fpath = fpath.string();
+	if (!fstring(m_fpath).endsWith(".bzap"))
+		m_fpath += ".bzap";
+	doLoad();
+}
+
+void BlockZipAppendonlyStore::doLoad() {
+	assert(NULL == m_mmapBase);
+	m_mmapBase = (byte_t*)DbEnv::current()->mmapLoad(m_fpath, &m_mmapSize);
+	auto header = (const Header*)m_mmapBase;
+	if (m_mmapSize < sizeof(Header)) {
+		THROW_STD(invalid_argument, "bad file: %s", m_fpath.c_str());
+	}
+	size_t blockNum = size_t(header->blockNum);
+	TERARK_RT_assert(header->indexOffset <= m_mmapSize, std::logic_error);
+	if (strcmp(header->magic, g_blockZipMagicV2) == 0) {
+		NativeDataInput<MemIO> index;
+		index.set(m_mmapBase + header->indexOffset, m_mmapBase + m_mmapSize);
+		auto offsets = as_var_int_group(m_blockOffsets);
+		auto rowBase = as_var_int_group(m_blockRowBase);
+		index >> offsets;
+		index >> rowBase;
+		TERARK_RT_assert(index.current() == m_mmapBase + m_mmapSize,
+						 std::logic_error);
+	}
+	else if (strcmp(header->magic, g_blockZipMagic) == 0) {
+		size_t indexBytes = sizeof(uint64_t) * (blockNum + 1);
+		TERARK_RT_assert(header->indexOffset + 2 * indexBytes == m_mmapSize,
+						 std::logic_error);
+		auto index = (const uint64_t*)(m_mmapBase + header->indexOffset);
+		m_blockOffsets.assign(index, blockNum + 1);
+		m_blockRowBase.assign(index + blockNum + 1, blockNum + 1);
+	}
+	else {
+		THROW_STD(invalid_argument, "bad file: %s", m_fpath.c_str());
+	}
+	TERARK_RT_assert(m_blockOffsets.size() == blockNum + 1, std::logic_error);
+	TERARK_RT_assert(m_blockRowBase.size() == blockNum + 1, std::logic_error);
+	m_rows = header->rows;
+	m_inflateSize = header->inflateSize;
+	m_fsize = m_mmapSize;
+}
+
+void BlockZipAppendonlyStore::save(PathRef path) const {
+	// do nothing
+}
+
+
 } } // namespace terark::db
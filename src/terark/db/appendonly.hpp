@@ -2,6 +2,7 @@
 #define __terark_db_appendonly_hpp__
 
 #include "db_store.hpp"
+#include "db_context.hpp"
 
 namespace terark { namespace db {
 
@@ -15,6 +16,10 @@ public:
 	llong dataStorageSize() const override;
 	llong numDataRows() const override;
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	void getValuesAppendBatch(const llong* ids, size_t num,
+							  valvec<byte>* vals, DbContext*) const override;
+	bool hasValueRef() const override; // after frozen, append may remap
+	fstring getValueRef(llong id, DbContext*) const override;
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
 
@@ -67,6 +72,61 @@ private:
 	llong       m_fsize;
 	llong       m_inflateSize;
 	llong       m_rows;
+	size_t      m_readaheadSize;
+	std::string m_fpath;
+};
+
+// Append only store of write-once var length rows(such as JSON blobs).
+// Rows are grouped into blocks of about BlockBytes, each block is compressed
+// by zstd(if built with WITH_ZSTD=1, else stored raw), and a block index
+// maps row id to block. A random read decompresses one block, the last
+// decompressed block is kept in DbContext::m_zipBlockCache(or the iterator),
+// so sequential reads decompress each block once.
+class TERARK_DB_DLL BlockZipAppendonlyStore final : public ReadableStore, public AppendableStore {
+	class MyStoreIterForward; friend class MyStoreIterForward;
+public:
+	static const size_t BlockBytes = 64 * 1024;
+
+	explicit BlockZipAppendonlyStore(const Schema&);
+	BlockZipAppendonlyStore(PathRef segDir, const Schema&);
+	~BlockZipAppendonlyStore();
+
+	AppendableStore* getAppendableStore() override;
+	llong dataInflateSize() const override;
+	llong dataStorageSize() const override;
+	llong numDataRows() const override;
+	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	StoreIterator* createStoreIterForward(DbContext*) const override;
+	StoreIterator* createStoreIterBackward(DbContext*) const override;
+
+	llong append(fstring row, DbContext*) override;
+	void  shrinkToFit() override;
+    void  shrinkToSize(size_t size) override;
+	void  deleteFiles() override;
+
+	void load(PathRef fpath) override;
+	void save(PathRef fpath) const override;
+
+private:
+	struct Header;
+	struct IoImpl;
+	void flushBlock();
+	void doLoad();
+	size_t findBlock(llong id) const;
+	void getBlock(size_t blockIdx, ZipBlockCache* cache) const;
+	void rowAppend(llong id, ZipBlockCache* cache, valvec<byte>* val) const;
+
+	std::unique_ptr<IoImpl> m_io; // not null when writing
+	valvec<byte>     m_blockBuf; // row offsets + rows of the writing block
+	valvec<uint32_t> m_rowOffsets; // of the writing block
+	valvec<uint64_t> m_blockOffsets; // file offset of blocks + end guard
+	valvec<uint64_t> m_blockRowBase; // first row id of blocks + end guard
+	byte_t*     m_mmapBase;
+	size_t      m_mmapSize;
+	llong       m_fsize;
+	llong       m_inflateSize;
+	llong       m_rows;
+	ullong      m_storeId; // for DbContext::m_zipBlockCache
 	std::string m_fpath;
 };
 
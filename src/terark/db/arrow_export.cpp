@@ -0,0 +1,407 @@
+#include "arrow_export.hpp"
+#include "columnar_scan.hpp"
+#include "db_segment.hpp"
+#include <terark/io/var_int.hpp>
+#include <terark/util/throw.hpp>
+#include <tbb/task_arena.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <initializer_list>
+#include <thread>
+
+namespace terark { namespace db {
+
+namespace {
+
+// flatbuffers are written front to back, a table is preceded by its
+// vtable, offsets to strings, vectors and sub tables are linked after the
+// target is written, so all offsets are forward as flatbuffers requires
+class FlatBuf {
+public:
+	struct Field {
+		uint16_t id;
+		uint8_t  size; // 1, 2, 4 or 8, offsets are 4
+		uint64_t val;
+	};
+	valvec<byte> m_buf;
+	FlatBuf() { m_buf.resize(4, 0); } // offset to the root table
+	void pad(size_t align) {
+		while (m_buf.size() % align)
+			m_buf.push_back(0);
+	}
+	void link(size_t pos, size_t target) {
+		assert(target > pos);
+		unaligned_save<uint32_t>(m_buf.data() + pos, uint32_t(target - pos));
+	}
+	template<class T>
+	void put(size_t pos, T x) { unaligned_save<T>(m_buf.data() + pos, x); }
+	///@param fieldPos fieldPos[id] is set to position of field id
+	///@returns position of the table
+	size_t table(std::initializer_list<Field> fields, size_t* fieldPos = NULL) {
+		size_t numIds = 0;
+		for (const Field& f : fields)
+			numIds = std::max<size_t>(numIds, f.id + 1);
+		// fields are laid out by size desc, they are aligned because the
+		// table is aligned to 8
+		uint16_t fieldOff[16] = {0};
+		assert(numIds <= 16);
+		size_t off = 4; // soffset to vtable
+		for (size_t size = 8; size; size /= 2) {
+			for (const Field& f : fields) {
+				if (f.size == size) {
+					off = (off + size - 1) / size * size;
+					fieldOff[f.id] = uint16_t(off);
+					off += size;
+				}
+			}
+		}
+		pad(2);
+		size_t vt = m_buf.size();
+		m_buf.resize(vt + 4 + 2 * numIds);
+		put<uint16_t>(vt, uint16_t(4 + 2 * numIds));
+		put<uint16_t>(vt + 2, uint16_t(off));
+		for (size_t i = 0; i < numIds; ++i)
+			put<uint16_t>(vt + 4 + 2*i, fieldOff[i]);
+		pad(8);
+		size_t tab = m_buf.size();
+		m_buf.resize(tab + off, 0);
+		put<int32_t>(tab, int32_t(tab - vt));
+		for (const Field& f : fields) {
+			size_t pos = tab + fieldOff[f.id];
+			switch (f.size) {
+			default: assert(0); break;
+			case 1: put<uint8_t >(pos, uint8_t (f.val)); break;
+			case 2: put<uint16_t>(pos, uint16_t(f.val)); break;
+			case 4: put<uint32_t>(pos, uint32_t(f.val)); break;
+			case 8: put<uint64_t>(pos, uint64_t(f.val)); break;
+			}
+			if (fieldPos)
+				fieldPos[f.id] = pos;
+		}
+		return tab;
+	}
+	///@returns position of the length, elements of elemAlign follow it
+	size_t vector(size_t num, size_t elemSize, size_t elemAlign) {
+		elemAlign = std::max<size_t>(elemAlign, 4);
+		while ((m_buf.size() + 4) % elemAlign)
+			m_buf.push_back(0);
+		size_t pos = m_buf.size();
+		m_buf.resize(pos + 4 + num * elemSize, 0);
+		put<uint32_t>(pos, uint32_t(num));
+		return pos;
+	}
+	size_t string(fstring str) {
+		pad(4);
+		size_t pos = m_buf.size();
+		m_buf.resize(pos + 4);
+		put<uint32_t>(pos, uint32_t(str.size()));
+		m_buf.append(str.udata(), str.size());
+		m_buf.push_back(0);
+		return pos;
+	}
+};
+
+// enums of Arrow Schema.fbs and Message.fbs
+const uint16_t MetadataV5 = 4;
+enum MessageHeader : uint8_t { HeaderSchema = 1, HeaderRecordBatch = 3 };
+enum ArrowType : uint8_t {
+	TypeInt = 2, TypeFloatingPoint = 3, TypeBinary = 4, TypeUtf8 = 5,
+	TypeFixedSizeBinary = 15,
+};
+enum FloatPrecision : uint16_t { PrecisionSingle = 1, PrecisionDouble = 2 };
+
+struct ArrowColumn {
+	ArrowType type;
+	int  bitWidth;  // of Int
+	bool isSigned;  // of Int
+	int  precision; // of FloatingPoint
+	int  fixedLen;  // of FixedSizeBinary
+	bool isVar() const { return TypeBinary == type || TypeUtf8 == type; }
+};
+
+ArrowColumn arrowColumn(const ColumnMeta& colmeta) {
+	ArrowColumn c = {TypeBinary, 0, false, 0, 0};
+	switch (colmeta.type) {
+	default:
+		if (colmeta.fixedLen) {
+			c.type = TypeFixedSizeBinary;
+			c.fixedLen = colmeta.fixedLen;
+		}
+		break;
+	case ColumnType::Sint08: c.isSigned = true; // fall through
+	case ColumnType::Uint08: c.type = TypeInt; c.bitWidth = 8; break;
+	case ColumnType::Sint16: c.isSigned = true; // fall through
+	case ColumnType::Uint16: c.type = TypeInt; c.bitWidth = 16; break;
+	case ColumnType::Sint32: c.isSigned = true; // fall through
+	case ColumnType::Uint32: c.type = TypeInt; c.bitWidth = 32; break;
+	case ColumnType::Sint64: case ColumnType::VarSint: c.isSigned = true; // fall through
+	case ColumnType::Uint64: case ColumnType::VarUint: c.type = TypeInt; c.bitWidth = 64; break;
+	case ColumnType::Float32: c.type = TypeFloatingPoint; c.precision = PrecisionSingle; break;
+	case ColumnType::Float64: c.type = TypeFloatingPoint; c.precision = PrecisionDouble; break;
+	case ColumnType::StrZero: c.type = TypeUtf8; break;
+	}
+	return c;
+}
+
+} // namespace
+
+// data of a column of a batch, offsets is used by Binary and Utf8
+struct ArrowStreamExporter::ColumnBuf {
+	valvec<byte> data;
+	valvec<uint32_t> offsets;
+};
+
+ArrowStreamExporter::ArrowStreamExporter(const SchemaConfig& sconf, PathRef fpath,
+										 size_t batchRows, int threads) {
+	m_sconf = &sconf;
+	m_file.open(fpath.string().c_str(), "wb");
+	m_file.disbuf();
+	m_batchRows = std::max<size_t>(batchRows, 1);
+	m_threads = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+	m_wroteSchema = false;
+	m_fileSize = 0;
+	const Schema& rowSchema = *sconf.m_rowSchema;
+	for (size_t columnId = 0; columnId < rowSchema.columnNum(); ++columnId) {
+		const ColumnMeta& colmeta = rowSchema.getColumnMeta(columnId);
+		if (colmeta.fixedLen) {
+			m_fixedColumns.push_back(columnId);
+			continue;
+		}
+		size_t cgId = sconf.m_colproject[columnId].colgroupId;
+		size_t k = std::find(m_varColgroups.begin(), m_varColgroups.end(), cgId)
+				 - m_varColgroups.begin();
+		if (k == m_varColgroups.size()) {
+			m_varColgroups.push_back(cgId);
+			m_varColumns.emplace_back();
+		}
+		m_varColumns[k].push_back(columnId);
+	}
+}
+
+ArrowStreamExporter::~ArrowStreamExporter() {
+}
+
+void ArrowStreamExporter::writePadded(const void* data, size_t len) {
+	static const byte zeros[8] = {0};
+	m_file.ensureWrite(data, len);
+	size_t padding = (8 - len % 8) % 8;
+	m_file.ensureWrite(zeros, padding);
+	m_fileSize += len + padding;
+}
+
+// encapsulated message: continuation, metadata size, metadata, body
+void ArrowStreamExporter::writeMessage(const valvec<byte>& meta) {
+	uint32_t prefix[2] = { 0xFFFFFFFF, uint32_t((meta.size() + 7) / 8 * 8) };
+	m_file.ensureWrite(prefix, sizeof(prefix));
+	m_fileSize += sizeof(prefix);
+	writePadded(meta.data(), meta.size());
+}
+
+void ArrowStreamExporter::writeSchema() {
+	const Schema& rowSchema = *m_sconf->m_rowSchema;
+	const size_t colnum = rowSchema.columnNum();
+	FlatBuf fb;
+	size_t mp[4], sp[2];
+	fb.link(0, fb.table({{0, 2, MetadataV5}, {1, 1, HeaderSchema},
+						 {2, 4, 0}, {3, 8, 0}}, mp));
+	fb.link(mp[2], fb.table({{0, 2, 0}, {1, 4, 0}}, sp)); // little endian
+	size_t fields = fb.vector(colnum, 4, 4);
+	fb.link(sp[1], fields);
+	for (size_t i = 0; i < colnum; ++i) {
+		ArrowColumn c = arrowColumn(rowSchema.getColumnMeta(i));
+		size_t fp[6];
+		fb.link(fields + 4 + 4*i, fb.table({{0, 4, 0}, {1, 1, 0},
+							{2, 1, c.type}, {3, 4, 0}, {5, 4, 0}}, fp));
+		fb.link(fp[0], fb.string(rowSchema.getColumnName(i)));
+		size_t type;
+		switch (c.type) {
+		default: type = fb.table({}); break; // Binary and Utf8
+		case TypeInt:
+			type = fb.table({{0, 4, uint64_t(c.bitWidth)}, {1, 1, c.isSigned}});
+			break;
+		case TypeFloatingPoint:
+			type = fb.table({{0, 2, uint64_t(c.precision)}});
+			break;
+		case TypeFixedSizeBinary:
+			type = fb.table({{0, 4, uint64_t(c.fixedLen)}});
+			break;
+		}
+		fb.link(fp[3], type);
+		fb.link(fp[5], fb.vector(0, 4, 4)); // children
+	}
+	writeMessage(fb.m_buf);
+	m_wroteSchema = true;
+}
+
+// buffers of a column are validity(empty, no nulls), [offsets], data
+void ArrowStreamExporter::writeBatch(const ColumnBuf* cols, size_t rows) {
+	const Schema& rowSchema = *m_sconf->m_rowSchema;
+	const size_t colnum = rowSchema.columnNum();
+	struct Buffer { llong offset, length; };
+	valvec<Buffer> bufs;
+	valvec<std::pair<const void*, size_t> > bodies;
+	llong bodyLen = 0;
+	auto addBuffer = [&](const void* data, size_t len) {
+		bufs.push_back({bodyLen, llong(len)});
+		bodies.emplace_back(data, len);
+		bodyLen += (len + 7) / 8 * 8;
+	};
+	for (size_t i = 0; i < colnum; ++i) {
+		ArrowColumn c = arrowColumn(rowSchema.getColumnMeta(i));
+		addBuffer(NULL, 0);
+		if (c.isVar())
+			addBuffer(cols[i].offsets.data(), 4 * cols[i].offsets.size());
+		addBuffer(cols[i].data.data(), cols[i].data.size());
+	}
+	FlatBuf fb;
+	size_t mp[4], rp[3];
+	fb.link(0, fb.table({{0, 2, MetadataV5}, {1, 1, HeaderRecordBatch},
+						 {2, 4, 0}, {3, 8, uint64_t(bodyLen)}}, mp));
+	fb.link(mp[2], fb.table({{0, 8, rows}, {1, 4, 0}, {2, 4, 0}}, rp));
+	size_t nodes = fb.vector(colnum, 16, 8);
+	fb.link(rp[1], nodes);
+	for (size_t i = 0; i < colnum; ++i) {
+		fb.put<llong>(nodes + 4 + 16*i, llong(rows)); // length
+		fb.put<llong>(nodes + 4 + 16*i + 8, 0);       // null_count
+	}
+	size_t buffers = fb.vector(bufs.size(), 16, 8);
+	fb.link(rp[2], buffers);
+	for (size_t i = 0; i < bufs.size(); ++i) {
+		fb.put<llong>(buffers + 4 + 16*i, bufs[i].offset);
+		fb.put<llong>(buffers + 4 + 16*i + 8, bufs[i].length);
+	}
+	writeMessage(fb.m_buf);
+	for (auto& body : bodies) {
+		writePadded(body.first, body.second);
+	}
+}
+
+size_t ArrowStreamExporter::exportSegment(const ColgroupSegment* seg) {
+	if (!m_wroteSchema) {
+		writeSchema();
+	}
+	const Schema& rowSchema = *m_sconf->m_rowSchema;
+	const size_t colnum = rowSchema.columnNum();
+	const size_t physicRows = seg->getPhysicRows();
+	valvec<ColumnarBatchIterPtr> fixedIters;
+	for (size_t columnId : m_fixedColumns) {
+		fixedIters.push_back(new ColumnarBatchIter(seg, &columnId, 1, m_batchRows));
+	}
+	std::vector<ColumnBuf> cols(colnum);
+	febitvec live;
+	size_t logicId = 0, exported = 0;
+	const size_t numTasks = m_fixedColumns.size() + m_varColgroups.size();
+	tbb::task_arena arena{m_threads};
+	for (size_t beg = 0; beg < physicRows; beg += m_batchRows) {
+		const size_t num = std::min(m_batchRows, physicRows - beg);
+		size_t rows = 0;
+		live.resize_no_init(num);
+		for (size_t k = 0; k < num; ++k, ++logicId) {
+			if (!seg->m_isPurged.empty()) {
+				while (seg->m_isPurged.is1(logicId))
+					logicId++;
+			}
+			live.set(k, !seg->m_isDel[logicId]);
+			rows += !seg->m_isDel[logicId];
+		}
+		auto fixedTask = [&](size_t j) {
+			const ColumnMeta& colmeta = rowSchema.getColumnMeta(m_fixedColumns[j]);
+			ColumnBuf& cb = cols[m_fixedColumns[j]];
+			const size_t width = colmeta.fixedLen;
+			ColumnBatch batch;
+			if (!fixedIters[j]->next(&batch) || batch.m_rows != num) {
+				THROW_STD(runtime_error, "bad batch of %s"
+					, seg->m_segDir.string().c_str());
+			}
+			const ColumnArray& col = batch.m_cols[0];
+			cb.data.resize_no_init(width * rows);
+			byte* dst = cb.data.data();
+			for (size_t k = 0; k < num; ++k) {
+				if (live.is1(k)) {
+					memcpy(dst, col.data + col.stride * k, width);
+					dst += width;
+				}
+			}
+		};
+		auto varTask = [&](size_t j) {
+			const size_t cgId = m_varColgroups[j];
+			const ReadableStore* store = seg->m_colgroups[cgId].get();
+			const Schema& schema = m_sconf->getColgroupSchema(cgId);
+			const valvec<size_t>& columnIds = m_varColumns[j];
+			valvec<size_t> subIds(columnIds.size(), valvec_no_init());
+			for (size_t i = 0; i < columnIds.size(); ++i) {
+				subIds[i] = m_sconf->m_colproject[columnIds[i]].subColumnId;
+				ColumnBuf& cb = cols[columnIds[i]];
+				cb.data.erase_all();
+				cb.offsets.erase_all();
+				cb.offsets.push_back(0);
+			}
+			valvec<byte> buf;
+			ColumnVec cv;
+			for (size_t k = 0; k < num; ++k) {
+				if (!live.is1(k))
+					continue;
+				store->getValue(beg + k, &buf, NULL);
+				schema.parseRow(buf, &cv);
+				for (size_t i = 0; i < columnIds.size(); ++i) {
+					ColumnBuf& cb = cols[columnIds[i]];
+					fstring val = cv[subIds[i]];
+					switch (rowSchema.getColumnType(columnIds[i])) {
+					default:
+						cb.data.append(val.udata(), val.size());
+						if (cb.data.size() > UINT32_MAX) {
+							THROW_STD(length_error, "column data of a batch > 4G");
+						}
+						cb.offsets.push_back(uint32_t(cb.data.size()));
+						break;
+					case ColumnType::VarSint: {
+							const byte* end = NULL;
+							int64_t x = load_var_int64(val.udata(), &end);
+							unaligned_save<int64_t>(cb.data.grow_no_init(8), x);
+						}
+						break;
+					case ColumnType::VarUint: {
+							const byte* end = NULL;
+							uint64_t x = load_var_uint64(val.udata(), &end);
+							unaligned_save<uint64_t>(cb.data.grow_no_init(8), x);
+						}
+						break;
+					}
+				}
+			}
+			for (size_t columnId : columnIds) {
+				ColumnType type = rowSchema.getColumnType(columnId);
+				if (ColumnType::VarSint == type || ColumnType::VarUint == type)
+					cols[columnId].offsets.clear(); // they are Int 64
+			}
+		};
+		arena.execute([&]() {
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, numTasks, 1),
+				[&](const tbb::blocked_range<size_t>& r) {
+					for (size_t t = r.begin(); t < r.end(); ++t) {
+						if (t < m_fixedColumns.size())
+							fixedTask(t);
+						else
+							varTask(t - m_fixedColumns.size());
+					}
+				}, tbb::simple_partitioner());
+		});
+		if (rows) {
+			writeBatch(cols.data(), rows);
+			exported += rows;
+		}
+	}
+	return exported;
+}
+
+void ArrowStreamExporter::close() {
+	if (!m_wroteSchema) {
+		writeSchema(); // an empty stream still has the schema
+	}
+	uint32_t eos[2] = { 0xFFFFFFFF, 0 };
+	m_file.ensureWrite(eos, sizeof(eos));
+	m_fileSize += sizeof(eos);
+	m_file.close();
+}
+
+} } // namespace terark::db
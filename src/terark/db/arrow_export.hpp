@@ -0,0 +1,52 @@
+#ifndef __terark_db_arrow_export_hpp__
+#define __terark_db_arrow_export_hpp__
+
+#include "db_store.hpp"
+#include <terark/io/FileStream.hpp>
+
+namespace terark { namespace db {
+
+class TERARK_DB_DLL ColgroupSegment;
+
+// Export live rows of frozen segments to a file of Arrow IPC streaming
+// format, a schema message, then a record batch of each batchRows(or
+// less) rows, then the end of stream marker. Columns are the row schema:
+//   Sint/Uint 8..64           -> Int
+//   Float32, Float64          -> FloatingPoint
+//   other fixed length types  -> FixedSizeBinary of fixedLen
+//   VarSint, VarUint          -> Int 64
+//   StrZero                   -> Utf8
+//   other var length types    -> Binary of the column bytes
+// Columns of a batch are read from colgroup stores in parallel, fixed
+// length columns are decoded in bulk by ColumnarBatchIter, var length
+// columns are parsed from colgroup rows, each colgroup is read once.
+class TERARK_DB_DLL ArrowStreamExporter {
+	struct ColumnBuf;
+	const SchemaConfig* m_sconf;
+	FileStream m_file;
+	size_t m_batchRows;
+	int    m_threads;
+	bool   m_wroteSchema;
+	llong  m_fileSize;
+	valvec<size_t> m_fixedColumns; // of row schema
+	valvec<size_t> m_varColgroups; // having var length columns
+	valvec<valvec<size_t> > m_varColumns; // parallel with m_varColgroups
+	void writeSchema();
+	void writeBatch(const ColumnBuf* cols, size_t rows);
+	void writeMessage(const valvec<byte>& meta);
+	void writePadded(const void* data, size_t len);
+public:
+	///@param threads 0 is cpu num
+	ArrowStreamExporter(const SchemaConfig&, PathRef fpath,
+						size_t batchRows = 65536, int threads = 0);
+	~ArrowStreamExporter();
+	///@returns exported rows
+	size_t exportSegment(const ColgroupSegment*);
+	/// write end of stream and close the file
+	void close();
+	llong fileSize() const { return m_fileSize; }
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_arrow_export_hpp__
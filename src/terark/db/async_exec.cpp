@@ -0,0 +1,111 @@
+#include "async_exec.hpp"
+#include "db_context.hpp"
+#include <terark/util/throw.hpp>
+#include <tbb/tbb_thread.h>
+#include <algorithm>
+#include <stdio.h>
+
+namespace terark { namespace db {
+
+AsyncExecutor::AsyncExecutor(size_t threads) {
+	m_stop = false;
+	if (0 == threads) {
+		THROW_STD(invalid_argument, "threads must be positive");
+	}
+	for (size_t i = 0; i < threads; ++i)
+		m_threads.emplace_back(&AsyncExecutor::threadProc, this);
+}
+
+AsyncExecutor::~AsyncExecutor() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	for (auto& t : m_threads)
+		t.join();
+}
+
+void AsyncExecutor::post(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_stop) {
+			THROW_STD(logic_error, "AsyncExecutor is stopped");
+		}
+		m_jobs.push_back(std::move(job));
+	}
+	m_cond.notify_one();
+}
+
+size_t AsyncExecutor::pendingJobs() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_jobs.size();
+}
+
+void AsyncExecutor::threadProc() {
+	for (;;) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+			if (m_jobs.empty()) {
+				return; // m_stop
+			}
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+		}
+		try {
+			job();
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: AsyncExecutor: job failed: %s\n", ex.what());
+		}
+	}
+}
+
+AsyncExecutor& AsyncExecutor::instance() {
+	static AsyncExecutor executor([]() {
+		size_t cpu = tbb::tbb_thread::hardware_concurrency();
+		size_t cfg = getEnvLong("TerarkDB_AsyncThreads", 0);
+		return cfg ? cfg : 4 * std::max<size_t>(cpu, 1);
+	}());
+	return executor;
+}
+
+AsyncTableQueue::AsyncTableQueue() {
+	m_drainers = 0;
+	size_t cfg = getEnvLong("TerarkDB_AsyncTableConcurrency", 0);
+	m_maxDrainers = cfg ? cfg : AsyncExecutor::instance().threads();
+	m_batchSize = std::max<long>(getEnvLong("TerarkDB_AsyncBatchSize", 32), 1);
+}
+
+AsyncTableQueue::~AsyncTableQueue() {
+	assert(0 == m_drainers);
+	assert(m_reqs.empty());
+}
+
+bool AsyncTableQueue::push(Request&& req) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_reqs.push_back(std::move(req));
+	if (m_drainers < m_maxDrainers) {
+		m_drainers++;
+		return true;
+	}
+	return false; // a running drainer will take it
+}
+
+bool AsyncTableQueue::take(std::vector<Request>* batch) {
+	batch->clear();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_reqs.empty()) {
+		m_drainers--;
+		return false;
+	}
+	while (!m_reqs.empty() && batch->size() < m_batchSize) {
+		batch->push_back(std::move(m_reqs.front()));
+		m_reqs.pop_front();
+	}
+	return true;
+}
+
+} } // namespace terark::db
@@ -0,0 +1,76 @@
+#ifndef __terark_db_async_exec_hpp__
+#define __terark_db_async_exec_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/fstring.hpp>
+#include <terark/valvec.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace terark { namespace db {
+
+typedef boost::intrusive_ptr<class DbContext> DbContextPtr;
+
+// Process wide worker threads of the async API of DbTable. A read of a cold
+// page of a mmap'ed store blocks its thread on the page fault, and faults
+// of different threads are served by the disk in parallel, so the workers
+// are many more than cpus: env TerarkDB_AsyncThreads, default 4 * cpu.
+class TERARK_DB_DLL AsyncExecutor {
+	std::deque<std::function<void()> > m_jobs;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_stop;
+	void threadProc();
+public:
+	explicit AsyncExecutor(size_t threads);
+	~AsyncExecutor(); // queued jobs are run before the threads are joined
+	void post(std::function<void()> job);
+	size_t threads() const { return m_threads.size(); }
+	size_t pendingJobs();
+	static AsyncExecutor& instance(); // created on the first use
+};
+
+struct AsyncRequest {
+	enum Op { getValue, searchExact, insertRow };
+	Op     op;
+	size_t indexId;
+	llong  id;
+	std::string data; // key of searchExact, row of insertRow
+	std::function<void(std::exception_ptr, valvec<byte>&)>  onValue;
+	std::function<void(std::exception_ptr, valvec<llong>&)> onRecIds;
+	std::function<void(std::exception_ptr, llong recId)>    onRecId;
+};
+
+// pending async requests of a DbTable, they are taken in order by at most
+// TerarkDB_AsyncTableConcurrency drainers, a drainer takes at most
+// TerarkDB_AsyncBatchSize requests at once, so reads of the same kind
+// which were queued under load are executed by one batch call
+class TERARK_DB_DLL AsyncTableQueue {
+public:
+	typedef AsyncRequest Request;
+	std::mutex m_mutex;
+	std::deque<Request> m_reqs;
+	valvec<DbContextPtr> m_freeCtx; // reused by drainers
+	size_t m_drainers;
+	size_t m_maxDrainers;
+	size_t m_batchSize;
+
+	AsyncTableQueue();
+	~AsyncTableQueue();
+	///@returns true if the caller should post a new drainer
+	bool push(Request&&);
+	///@returns false and the drainer is ended if there are no requests
+	bool take(std::vector<Request>* batch);
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_async_exec_hpp__
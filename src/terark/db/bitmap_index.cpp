@@ -0,0 +1,582 @@
+#include "bitmap_index.hpp"
+#include "db_env.hpp"
+#include <terark/bitmanip.hpp>
+#include <terark/io/FileStream.hpp>
+#include <terark/io/DataIO.hpp>
+#include <terark/util/mmap.hpp>
+#include <algorithm>
+
+namespace terark { namespace db {
+
+BitmapIndex::BitmapIndex(const Schema& schema) : m_schema(schema) {
+	m_isOrdered = true;
+	m_isIndexKeyByteLex = true;
+	m_mmapBase = nullptr;
+	m_mmapSize = 0;
+	m_rows = 0;
+	m_fixedLen = 0;
+	m_dataInflateSize = 0;
+}
+
+BitmapIndex::~BitmapIndex() {
+	if (m_mmapBase) {
+		m_valueData.risk_release_ownership();
+		m_valueOffsets.risk_release_ownership();
+		m_counts.risk_release_ownership();
+		m_bitmapOffsets.risk_release_ownership();
+		m_bitmaps.risk_release_ownership();
+		m_rowValue.risk_release_ownership();
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
+	}
+}
+
+size_t BitmapIndex::maxValues() {
+	static const size_t maxv =
+		std::max<long>(1, getEnvLong("TerarkDB_BitmapIndexMaxValues", 4096));
+	return maxv;
+}
+
+ReadableStore* BitmapIndex::getReadableStore() {
+	return this;
+}
+
+ReadableIndex* BitmapIndex::getReadableIndex() {
+	return this;
+}
+
+fstring BitmapIndex::value(size_t v) const {
+	assert(v < valueNum());
+	if (m_fixedLen) {
+		return fstring(m_valueData.data() + m_fixedLen * v, m_fixedLen);
+	}
+	size_t beg = m_valueOffsets[v];
+	return fstring(m_valueData.data() + beg, m_valueOffsets[v+1] - beg);
+}
+
+void BitmapIndex::valueAppend(size_t v, valvec<byte>* key) const {
+	fstring val = value(v);
+	size_t oldsize = key->size();
+	key->append(val.udata(), val.size());
+	if (m_fixedLen && m_schema.m_needEncodeToLexByteComparable) {
+		m_schema.byteLexDecode(key->data() + oldsize, m_fixedLen);
+	}
+}
+
+fstring BitmapIndex::encodeKey(fstring key, valvec<byte>* buf) const {
+	if (m_fixedLen && m_schema.m_needEncodeToLexByteComparable) {
+		assert(key.size() == m_fixedLen);
+		buf->assign(key.udata(), key.size());
+		m_schema.byteLexEncode(buf->data(), buf->size());
+		return fstring(buf->data(), buf->size());
+	}
+	return key;
+}
+
+size_t BitmapIndex::lowerBound(fstring key) const {
+	valvec<byte> buf;
+	fstring enc = encodeKey(key, &buf);
+	size_t lo = 0, hi = valueNum();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (value(mid) < enc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+size_t BitmapIndex::upperBound(fstring key) const {
+	valvec<byte> buf;
+	fstring enc = encodeKey(key, &buf);
+	size_t lo = 0, hi = valueNum();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (enc < value(mid))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+size_t BitmapIndex::findValue(fstring key) const {
+	if (m_fixedLen && key.size() != m_fixedLen) {
+		return valueNum();
+	}
+	size_t v = lowerBound(key);
+	if (v < valueNum()) {
+		valvec<byte> buf;
+		if (value(v) == encodeKey(key, &buf))
+			return v;
+	}
+	return valueNum();
+}
+
+///@{ ordered and unordered index
+llong BitmapIndex::indexStorageSize() const {
+	return m_bitmaps.used_mem_size() + m_bitmapOffsets.used_mem_size()
+		+ m_counts.used_mem_size() + m_valueOffsets.used_mem_size()
+		+ m_valueData.used_mem_size();
+}
+
+void
+BitmapIndex::searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*)
+const {
+	size_t v = findValue(key);
+	if (v == valueNum()) {
+		return;
+	}
+	const uint64_t* b = bitmap(v);
+	if (isDense(v)) {
+		const size_t nWords = (m_rows + 63) / 64;
+		for (size_t i = 0; i < nWords; ++i) {
+			for (uint64_t w = b[i]; w; w &= w - 1)
+				recIdvec->push_back(llong(i * 64 + fast_ctz64(w)));
+		}
+	}
+	else {
+		const uint32_t* ids = (const uint32_t*)b;
+		for (size_t j = 0, n = m_counts[v]; j < n; ++j)
+			recIdvec->push_back(ids[j]);
+	}
+}
+///@}
+
+// an array is added to words directly for Or and AndNot
+void BitmapIndex::combine(fstring key, BitmapOp op, uint64_t* words) const {
+	const size_t nWords = (m_rows + 63) / 64;
+	const size_t v = findValue(key);
+	if (v == valueNum()) {
+		if (BitmapOp::And == op)
+			std::fill_n(words, nWords, 0);
+		return;
+	}
+	const uint64_t* b = bitmap(v);
+	valvec<uint64_t> tmp;
+	if (!isDense(v)) {
+		const uint32_t* ids = (const uint32_t*)b;
+		const size_t n = m_counts[v];
+		if (BitmapOp::Or == op) {
+			for (size_t j = 0; j < n; ++j)
+				words[ids[j] / 64] |= uint64_t(1) << (ids[j] % 64);
+			return;
+		}
+		if (BitmapOp::AndNot == op) {
+			for (size_t j = 0; j < n; ++j)
+				words[ids[j] / 64] &= ~(uint64_t(1) << (ids[j] % 64));
+			return;
+		}
+		tmp.resize(nWords, 0);
+		for (size_t j = 0; j < n; ++j)
+			tmp[ids[j] / 64] |= uint64_t(1) << (ids[j] % 64);
+		b = tmp.data();
+	}
+	combineWords(op, words, b, nWords);
+}
+
+// the loops are simple enough to be vectorized by the compiler
+void BitmapIndex::combineWords(BitmapOp op, uint64_t* words,
+							   const uint64_t* bits, size_t n) {
+	switch (op) {
+	case BitmapOp::And:
+		for (size_t i = 0; i < n; ++i) words[i] &= bits[i];
+		break;
+	case BitmapOp::Or:
+		for (size_t i = 0; i < n; ++i) words[i] |= bits[i];
+		break;
+	case BitmapOp::AndNot:
+		for (size_t i = 0; i < n; ++i) words[i] &= ~bits[i];
+		break;
+	}
+}
+
+llong BitmapIndex::dataStorageSize() const {
+	return m_rowValue.mem_size() + m_valueData.used_mem_size();
+}
+
+llong BitmapIndex::dataInflateSize() const {
+	return m_dataInflateSize;
+}
+
+llong BitmapIndex::numDataRows() const {
+	return m_rows;
+}
+
+void BitmapIndex::getValueAppend(llong id, valvec<byte>* val, DbContext*) const {
+	assert(id >= 0);
+	assert(size_t(id) < m_rows);
+	valueAppend(m_rowValue.get(size_t(id)), val);
+}
+
+StoreIterator* BitmapIndex::createStoreIterForward(DbContext*) const {
+	return nullptr; // not needed
+}
+
+StoreIterator* BitmapIndex::createStoreIterBackward(DbContext*) const {
+	return nullptr; // not needed
+}
+
+// keys are map ids in rowValue, they are renumbered in key order
+void BitmapIndex::buildBitmaps(const hash_strmap<uint32_t>& keys,
+							   valvec<uint32_t>& rowValue) {
+	const size_t n = keys.end_i();
+	valvec<uint32_t> order(n, valvec_no_init());
+	for (size_t i = 0; i < n; ++i) order[i] = uint32_t(i);
+	std::sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+		return keys.key(x) < keys.key(y);
+	});
+	valvec<uint32_t> rank(n, valvec_no_init());
+	m_valueData.erase_all();
+	m_valueOffsets.erase_all();
+	for (size_t r = 0; r < n; ++r) {
+		fstring k = keys.key(order[r]);
+		rank[order[r]] = uint32_t(r);
+		if (!m_fixedLen)
+			m_valueOffsets.push_back(uint32_t(m_valueData.size()));
+		m_valueData.append(k.udata(), k.size());
+	}
+	if (!m_fixedLen)
+		m_valueOffsets.push_back(uint32_t(m_valueData.size()));
+	m_counts.resize(n, 0);
+	for (uint32_t& x : rowValue) {
+		x = rank[x];
+		m_counts[x]++;
+	}
+	m_bitmapOffsets.resize_no_init(n + 1);
+	size_t words = 0;
+	for (size_t v = 0; v < n; ++v) {
+		m_bitmapOffsets[v] = words;
+		words += isDense(v) ? (m_rows + 63) / 64 : (m_counts[v] + 1) / 2;
+	}
+	m_bitmapOffsets[n] = words;
+	m_bitmaps.resize(words, 0);
+	valvec<uint32_t> fill(n, 0);
+	for (size_t id = 0; id < m_rows; ++id) {
+		size_t v = rowValue[id];
+		uint64_t* b = m_bitmaps.data() + m_bitmapOffsets[v];
+		if (isDense(v))
+			b[id / 64] |= uint64_t(1) << (id % 64);
+		else
+			((uint32_t*)b)[fill[v]++] = uint32_t(id);
+	}
+	auto minVal = m_rowValue.build_from(rowValue);
+	(void)minVal;
+	assert(0 == minVal);
+	m_isUnique = n == m_rows;
+}
+
+bool BitmapIndex::build(const Schema& schema, SortableStrVec& strVec) {
+	m_fixedLen = schema.getFixedRowLen();
+	const bool fixedPool = strVec.m_index.size() == 0;
+	if (fixedPool) {
+		m_rows = m_fixedLen ? strVec.str_size() / m_fixedLen : 0;
+	} else {
+		m_rows = strVec.size();
+	}
+	const size_t maxv = maxValues();
+	hash_strmap<uint32_t> keys;
+	valvec<uint32_t> rowValue(m_rows, valvec_no_init());
+	valvec<byte> buf;
+	for (size_t i = 0; i < m_rows; ++i) {
+		fstring key;
+		size_t recId = i;
+		if (fixedPool) {
+			key = fstring(strVec.m_strpool.data() + m_fixedLen * i, m_fixedLen);
+		} else {
+			key = strVec[i];
+			recId = strVec.m_index[i].seq_id;
+			assert(recId < m_rows);
+		}
+		size_t k = keys.insert_i(encodeKey(key, &buf)).first;
+		if (keys.end_i() > maxv) {
+			return false;
+		}
+		rowValue[recId] = uint32_t(k);
+	}
+	m_dataInflateSize = strVec.str_size();
+	buildBitmaps(keys, rowValue);
+	return true;
+}
+
+bool BitmapIndex::buildFromSorted(const Schema& schema, SortedIndexInput& input) {
+	m_fixedLen = schema.getFixedRowLen();
+	m_rows = size_t(input.numRows());
+	m_dataInflateSize = 0;
+	const size_t maxv = maxValues();
+	hash_strmap<uint32_t> keys;
+	valvec<uint32_t> rowValue(m_rows, valvec_no_init());
+	valvec<byte> key, buf;
+	llong recId = -1;
+	size_t pos = 0;
+	while (input.next(&recId, &key)) {
+		if (pos >= m_rows || recId < 0 || size_t(recId) >= m_rows ||
+				(m_fixedLen && key.size() != m_fixedLen)) {
+			THROW_STD(invalid_argument
+				, "bad sorted input: pos = %zd, recId = %lld, rows = %zd"
+				, pos, recId, m_rows);
+		}
+		size_t k = keys.insert_i(encodeKey(key, &buf)).first;
+		if (keys.end_i() > maxv) {
+			return false;
+		}
+		rowValue[size_t(recId)] = uint32_t(k);
+		m_dataInflateSize += key.size();
+		pos++;
+	}
+	if (pos != m_rows) {
+		THROW_STD(invalid_argument
+			, "bad sorted input: got %zd keys, rows = %zd", pos, m_rows);
+	}
+	buildBitmaps(keys, rowValue);
+	return true;
+}
+
+struct BitmapIndex::Header {
+	uint32_t rows;
+	uint32_t values;
+	uint32_t fixlen;
+	uint32_t rowValueBits;
+	uint64_t valueBytes;
+	uint64_t bitmapWords;
+	uint64_t dataInflateSize;
+	uint64_t padding[3];
+};
+
+namespace {
+	inline size_t align16(size_t x) { return (x + 15) & ~size_t(15); }
+}
+
+void BitmapIndex::load(PathRef path) {
+	BOOST_STATIC_ASSERT(sizeof(Header) == 64);
+	auto fpath = path + ".bitmap";
+	m_mmapBase = (byte_t*)DbEnv::current()->mmapLoad(fpath.string(), &m_mmapSize);
+	auto h = (const Header*)m_mmapBase;
+	const size_t values = h->values;
+	m_rows = h->rows;
+	m_fixedLen = h->fixlen;
+	m_dataInflateSize = size_t(h->dataInflateSize);
+	byte* p = (byte*)(h + 1);
+	m_valueData.risk_set_data(p, size_t(h->valueBytes));
+	p += align16(size_t(h->valueBytes));
+	if (!m_fixedLen) {
+		m_valueOffsets.risk_set_data((uint32_t*)p, values + 1);
+		p += align16(sizeof(uint32_t) * (values + 1));
+	}
+	m_counts.risk_set_data((uint32_t*)p, values);
+	p += align16(sizeof(uint32_t) * values);
+	m_bitmapOffsets.risk_set_data((uint64_t*)p, values + 1);
+	p += align16(sizeof(uint64_t) * (values + 1));
+	m_bitmaps.risk_set_data((uint64_t*)p, size_t(h->bitmapWords));
+	p += align16(sizeof(uint64_t) * size_t(h->bitmapWords));
+	m_rowValue.risk_set_data(p, m_rows, h->rowValueBits);
+	m_isUnique = values == m_rows;
+}
+
+void BitmapIndex::save(PathRef path) const {
+	auto fpath = path + ".bitmap";
+	NativeDataOutput<EnvFileStream> dio;
+	dio.open(fpath.string().c_str(), "wb");
+	Header h;
+	memset(&h, 0, sizeof(h));
+	h.rows = uint32_t(m_rows);
+	h.values = uint32_t(valueNum());
+	h.fixlen = uint32_t(m_fixedLen);
+	h.rowValueBits = uint32_t(m_rowValue.uintbits());
+	h.valueBytes = m_valueData.used_mem_size();
+	h.bitmapWords = m_bitmaps.size();
+	h.dataInflateSize = m_dataInflateSize;
+	dio.ensureWrite(&h, sizeof(h));
+	byte zero[16];
+	memset(zero, 0, sizeof(zero));
+	auto writeAligned = [&](const void* data, size_t size) {
+		dio.ensureWrite(data, size);
+		if (size % 16 != 0) {
+			dio.ensureWrite(zero, 16 - size % 16);
+		}
+	};
+	writeAligned(m_valueData.data(), m_valueData.used_mem_size());
+	if (!m_fixedLen) {
+		writeAligned(m_valueOffsets.data(), m_valueOffsets.used_mem_size());
+	}
+	writeAligned(m_counts.data(), m_counts.used_mem_size());
+	writeAligned(m_bitmapOffsets.data(), m_bitmapOffsets.used_mem_size());
+	writeAligned(m_bitmaps.data(), m_bitmaps.used_mem_size());
+	dio.ensureWrite(m_rowValue.data(), m_rowValue.mem_size());
+}
+
+namespace {
+	// first 1 bit at or after from, there must be one
+	inline size_t nextBit(const uint64_t* w, size_t from) {
+		size_t i = from / 64;
+		uint64_t x = w[i] & (~uint64_t(0) << (from % 64));
+		while (!x)
+			x = w[++i];
+		return i * 64 + fast_ctz64(x);
+	}
+	// last 1 bit before before, there must be one
+	inline size_t prevBit(const uint64_t* w, size_t before) {
+		size_t i = before / 64;
+		uint64_t x = before % 64 ? w[i] & ((uint64_t(1) << (before % 64)) - 1) : 0;
+		while (!x)
+			x = w[--i];
+		return i * 64 + terark_bsr_u64(x);
+	}
+}
+
+// m_j is the ordinal of next recId in value m_v, m_bit is where the scan
+// of a dense bitmap starts
+class BitmapIndex::MyIndexIterForward : public IndexIterator {
+public:
+	const BitmapIndex* m_owner;
+	size_t m_v;
+	size_t m_j;
+	size_t m_bit;
+
+	MyIndexIterForward(const BitmapIndex* owner) {
+		m_owner = owner;
+		seekValue(0);
+	}
+	void seekValue(size_t v) {
+		m_v = v;
+		m_j = 0;
+		m_bit = 0;
+	}
+	bool nextId(llong* id) {
+		const size_t n = m_owner->valueNum();
+		while (m_v < n) {
+			if (m_j < m_owner->m_counts[m_v]) {
+				const uint64_t* b = m_owner->bitmap(m_v);
+				if (m_owner->isDense(m_v)) {
+					m_bit = nextBit(b, m_bit);
+					*id = llong(m_bit++);
+				} else {
+					*id = ((const uint32_t*)b)[m_j];
+				}
+				m_j++;
+				return true;
+			}
+			seekValue(m_v + 1);
+		}
+		return false;
+	}
+
+	void reset() override {
+		seekValue(0);
+	}
+
+	bool increment(llong* id, valvec<byte>* key) override {
+		assert(nullptr != key);
+		if (nextId(id)) {
+			key->erase_all();
+			m_owner->valueAppend(m_v, key);
+			return true;
+		}
+		return false;
+	}
+
+	int seekLowerBound(fstring key, llong* id, valvec<byte>* retKey) override {
+		assert(nullptr != retKey);
+		seekValue(key.empty() ? 0 : m_owner->lowerBound(key));
+		if (nextId(id)) {
+			retKey->erase_all();
+			m_owner->valueAppend(m_v, retKey);
+			return key == *retKey ? 0 : 1;
+		}
+		return -1;
+	}
+
+	int seekUpperBound(fstring key, llong* id, valvec<byte>* retKey) override {
+		assert(nullptr != retKey);
+		seekValue(key.empty() ? 0 : m_owner->upperBound(key));
+		if (nextId(id)) {
+			retKey->erase_all();
+			m_owner->valueAppend(m_v, retKey);
+			return 1;
+		}
+		return -1;
+	}
+};
+
+// m_v is one past the current value, m_j is the number of recIds of it
+// which are not visited, m_bit is where the backward scan ends
+class BitmapIndex::MyIndexIterBackward : public IndexIterator {
+public:
+	const BitmapIndex* m_owner;
+	size_t m_v;
+	size_t m_j;
+	size_t m_bit;
+
+	MyIndexIterBackward(const BitmapIndex* owner) {
+		m_owner = owner;
+		seekValue(owner->valueNum());
+	}
+	void seekValue(size_t v) {
+		m_v = v;
+		m_j = v ? m_owner->m_counts[v-1] : 0;
+		m_bit = m_owner->m_rows;
+	}
+	bool prevId(llong* id) {
+		while (m_v > 0) {
+			size_t v = m_v - 1;
+			if (m_j > 0) {
+				m_j--;
+				const uint64_t* b = m_owner->bitmap(v);
+				if (m_owner->isDense(v)) {
+					m_bit = prevBit(b, m_bit);
+					*id = llong(m_bit);
+				} else {
+					*id = ((const uint32_t*)b)[m_j];
+				}
+				return true;
+			}
+			seekValue(v);
+		}
+		return false;
+	}
+
+	void reset() override {
+		seekValue(m_owner->valueNum());
+	}
+
+	bool increment(llong* id, valvec<byte>* key) override {
+		assert(nullptr != key);
+		if (prevId(id)) {
+			key->erase_all();
+			m_owner->valueAppend(m_v - 1, key);
+			return true;
+		}
+		return false;
+	}
+
+	int seekLowerBound(fstring key, llong* id, valvec<byte>* retKey) override {
+		assert(nullptr != retKey);
+		seekValue(key.empty() ? m_owner->valueNum() : m_owner->upperBound(key));
+		if (prevId(id)) {
+			retKey->erase_all();
+			m_owner->valueAppend(m_v - 1, retKey);
+			return key == *retKey ? 0 : 1;
+		}
+		return -1;
+	}
+
+	int seekUpperBound(fstring key, llong* id, valvec<byte>* retKey) override {
+		assert(nullptr != retKey);
+		seekValue(key.empty() ? m_owner->valueNum() : m_owner->lowerBound(key));
+		if (prevId(id)) {
+			retKey->erase_all();
+			m_owner->valueAppend(m_v - 1, retKey);
+			return 1;
+		}
+		return -1;
+	}
+};
+
+IndexIterator* BitmapIndex::createIndexIterForward(DbContext*) const {
+	return new MyIndexIterForward(this);
+}
+IndexIterator* BitmapIndex::createIndexIterBackward(DbContext*) const {
+	return new MyIndexIterBackward(this);
+}
+
+}} // namespace terark::db
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <terark/db/db_index.hpp>
+#include <terark/hash_strmap.hpp>
+#include <terark/int_vector.hpp>
+#include <terark/util/sortable_strvec.hpp>
+
+namespace terark { namespace db {
+
+enum class BitmapOp : unsigned char {
+	And,
+	Or,
+	AndNot,
+};
+
+/// a predicate of DbTable::bitmapFilter, recIds which have key in index
+struct BitmapTerm {
+	size_t   indexId;
+	fstring  key;
+	BitmapOp op; // with the result of previous terms, ignored for the first
+};
+
+// Index of a low cardinality column of a readonly segment, it is selected
+// by Schema::m_bitmapIndex: a bitmap of recIds for each distinct key, or a
+// sorted recId array if it is smaller than the bit words. Keys of recIds
+// are value ids in m_rowValue, so it is also the store of the colgroup.
+// Filters on several bitmap indices are combined by words, see combine
+class TERARK_DB_DLL BitmapIndex : public ReadableIndex, public ReadableStore {
+public:
+	explicit BitmapIndex(const Schema& schema);
+	~BitmapIndex();
+
+	/// env TerarkDB_BitmapIndexMaxValues, more keys use other index types
+	static size_t maxValues();
+
+	///@{ ordered and unordered index
+	llong indexStorageSize() const override;
+
+	void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override;
+	///@}
+
+	IndexIterator* createIndexIterForward(DbContext*) const override;
+	IndexIterator* createIndexIterBackward(DbContext*) const override;
+
+	ReadableStore* getReadableStore() override;
+	ReadableIndex* getReadableIndex() override;
+
+	llong dataStorageSize() const override;
+	llong dataInflateSize() const override;
+	llong numDataRows() const override;
+	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	StoreIterator* createStoreIterForward(DbContext*) const override;
+	StoreIterator* createStoreIterBackward(DbContext*) const override;
+
+	///@returns false if there are more than maxValues() distinct keys
+	bool build(const Schema& schema, SortableStrVec& strVec);
+	bool buildFromSorted(const Schema& schema, SortedIndexInput& input);
+	void load(PathRef path) override;
+	void save(PathRef path) const override;
+
+	size_t rows() const { return m_rows; }
+	/// words[0, (rows+63)/64) op= bits of recIds of key
+	void combine(fstring key, BitmapOp op, uint64_t* words) const;
+	/// words[0, n) op= bits[0, n)
+	static void combineWords(BitmapOp op, uint64_t* words, const uint64_t* bits, size_t n);
+
+protected:
+	class MyIndexIterForward;  friend class MyIndexIterForward;
+	class MyIndexIterBackward; friend class MyIndexIterBackward;
+
+	struct Header;
+	size_t valueNum() const { return m_counts.size(); }
+	fstring value(size_t v) const; // encoded if m_needEncodeToLexByteComparable
+	void valueAppend(size_t v, valvec<byte>* key) const;
+	size_t lowerBound(fstring key) const; // key is raw
+	size_t upperBound(fstring key) const;
+	size_t findValue(fstring key) const; // valueNum() if not found
+	fstring encodeKey(fstring key, valvec<byte>* buf) const;
+	// a dense bitmap has rows bits, else it is a uint32 recId array
+	bool isDense(size_t v) const { return size_t(m_counts[v]) * 32 >= m_rows; }
+	const uint64_t* bitmap(size_t v) const { return m_bitmaps.data() + m_bitmapOffsets[v]; }
+	void buildBitmaps(const hash_strmap<uint32_t>& keys, valvec<uint32_t>& rowValue);
+
+	const Schema&    m_schema;
+	byte_t*          m_mmapBase;
+	size_t           m_mmapSize;
+	size_t           m_rows;
+	size_t           m_fixedLen; // 0 for var len keys
+	size_t           m_dataInflateSize;
+	valvec<byte>     m_valueData;    // sorted distinct keys
+	valvec<uint32_t> m_valueOffsets; // valueNum()+1, empty if m_fixedLen
+	valvec<uint32_t> m_counts;       // recIds of each value
+	valvec<uint64_t> m_bitmapOffsets;// valueNum()+1, in words of m_bitmaps
+	valvec<uint64_t> m_bitmaps;
+	UintVecMin0      m_rowValue;     // value id of each recId
+};
+
+}} // namespace terark::db
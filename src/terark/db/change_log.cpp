@@ -0,0 +1,148 @@
+#include "change_log.hpp"
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+
+namespace terark { namespace db {
+
+const char* ChangeOpName(ChangeOp op) {
+	switch (op) {
+	case ChangeOp::insert: return "insert";
+	case ChangeOp::update: return "update";
+	case ChangeOp::remove: return "remove";
+	}
+	return "unknown";
+}
+
+ChangeLog::ChangeLog(size_t maxRecords, size_t maxBytes, size_t maxBlockMillisec) {
+	using namespace std::chrono;
+	m_maxRecords = std::max<size_t>(maxRecords, 1);
+	m_maxBytes = maxBytes;
+	m_bytes = 0;
+	m_maxBlockMillisec = maxBlockMillisec;
+	m_nextSeq = 1;
+	m_epoch = duration_cast<microseconds>(
+				system_clock::now().time_since_epoch()).count();
+}
+
+ChangeLog::~ChangeLog() {
+	assert(m_backpressureCursors.empty());
+}
+
+// the oldest change will be dropped by the next append, but a backpressure
+// cursor has not read it
+bool ChangeLog::isBlockedNoLock() const {
+	if (m_ring.empty() || m_backpressureCursors.empty()) {
+		return false;
+	}
+	if (m_ring.size() < m_maxRecords && (0 == m_maxBytes || m_bytes < m_maxBytes)) {
+		return false;
+	}
+	ullong oldest = m_ring.front().seq;
+	for (const ChangeCursor* c : m_backpressureCursors) {
+		if (c->m_nextSeq <= oldest)
+			return true;
+	}
+	return false;
+}
+
+bool ChangeLog::waitForConsumers() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!isBlockedNoLock()) {
+		return false;
+	}
+	m_consumeCond.wait_for(lock, std::chrono::milliseconds(m_maxBlockMillisec),
+		[this]() { return !isBlockedNoLock(); });
+	return true;
+}
+
+ullong ChangeLog::append(ChangeOp op, llong recId, fstring row) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	while (!m_ring.empty() && (m_ring.size() >= m_maxRecords ||
+			(m_maxBytes && m_bytes + row.size() > m_maxBytes))) {
+		m_bytes -= m_ring.front().row.size();
+		m_ring.pop_front();
+	}
+	m_ring.emplace_back();
+	ChangeRecord& rec = m_ring.back();
+	rec.seq = m_nextSeq++;
+	rec.recId = recId;
+	rec.op = op;
+	rec.row.assign(row.data(), row.size());
+	m_bytes += row.size();
+	m_appendCond.notify_all();
+	return rec.seq;
+}
+
+ullong ChangeLog::oldestSeq() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_ring.empty() ? m_nextSeq : m_ring.front().seq;
+}
+
+ullong ChangeLog::nextSeq() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_nextSeq;
+}
+
+bool
+ChangeLog::read(ullong fromSeq, size_t maxNum, std::vector<ChangeRecord>* out)
+const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	ullong oldest = m_ring.empty() ? m_nextSeq : m_ring.front().seq;
+	bool complete = fromSeq >= oldest;
+	size_t pos = complete ? size_t(fromSeq - oldest) : 0;
+	for (size_t n = 0; pos < m_ring.size() && n < maxNum; ++pos, ++n) {
+		out->push_back(m_ring[pos]);
+	}
+	return complete;
+}
+
+ChangeCursor::ChangeCursor(ChangeLog* log, ullong fromSeq, bool backpressure)
+  : m_log(log), m_nextSeq(fromSeq), m_backpressure(backpressure) {
+	if (backpressure) {
+		std::lock_guard<std::mutex> lock(log->m_mutex);
+		log->m_backpressureCursors.push_back(this);
+	}
+}
+
+ChangeCursor::~ChangeCursor() {
+	if (m_backpressure) {
+		std::lock_guard<std::mutex> lock(m_log->m_mutex);
+		auto& v = m_log->m_backpressureCursors;
+		v.erase(std::find(v.begin(), v.end(), this));
+		m_log->m_consumeCond.notify_all();
+	}
+}
+
+bool
+ChangeCursor::next(std::vector<ChangeRecord>* out, size_t maxNum,
+				   size_t timeoutMillisec) {
+	ChangeLog* log = m_log.get();
+	std::unique_lock<std::mutex> lock(log->m_mutex);
+	if (timeoutMillisec && m_nextSeq >= log->m_nextSeq) {
+		log->m_appendCond.wait_for(lock, std::chrono::milliseconds(timeoutMillisec),
+			[&]() { return m_nextSeq < log->m_nextSeq; });
+	}
+	const auto& ring = log->m_ring;
+	ullong oldest = ring.empty() ? log->m_nextSeq : ring.front().seq;
+	bool complete = m_nextSeq >= oldest;
+	if (!complete) {
+		m_nextSeq = oldest;
+	}
+	size_t pos = size_t(m_nextSeq - oldest);
+	for (size_t n = 0; pos < ring.size() && n < maxNum; ++pos, ++n) {
+		out->push_back(ring[pos]);
+		m_nextSeq++;
+	}
+	if (m_backpressure) {
+		log->m_consumeCond.notify_all();
+	}
+	return complete;
+}
+
+ullong ChangeCursor::position() const {
+	std::lock_guard<std::mutex> lock(m_log->m_mutex);
+	return m_nextSeq;
+}
+
+} } // namespace terark::db
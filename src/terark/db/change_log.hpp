@@ -0,0 +1,107 @@
+#ifndef __terark_db_change_log_hpp__
+#define __terark_db_change_log_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/fstring.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace terark { namespace db {
+
+enum class ChangeOp : unsigned char {
+	insert,
+	update, // row of recId is updated inplace in the writable segment
+	remove,
+};
+TERARK_DB_DLL const char* ChangeOpName(ChangeOp);
+
+struct ChangeRecord {
+	ullong   seq;
+	llong    recId;
+	ChangeOp op;
+	std::string row; // removed row for remove, empty if it can not be read
+};
+
+class ChangeCursor;
+
+// Recent changes of a table in a ring buffer bounded by records and bytes,
+// seq of changes are 1, 2, 3... in the order of append. An update which
+// moves the row to a new id, such as update or upsert of a row in a frozen
+// segment, is an insert of the new id.
+//
+// The log is in memory, epoch() is changed when the table is reopened, a
+// consumer resumes from a saved seq only if the epoch is not changed.
+class TERARK_DB_DLL ChangeLog : public RefCounter {
+	friend class ChangeCursor;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_appendCond;  // ChangeCursor::next waits
+	std::condition_variable m_consumeCond; // waitForConsumers waits
+	std::deque<ChangeRecord> m_ring;
+	std::vector<ChangeCursor*> m_backpressureCursors;
+	size_t m_maxRecords;
+	size_t m_maxBytes;
+	size_t m_bytes;
+	size_t m_maxBlockMillisec;
+	ullong m_nextSeq;
+	ullong m_epoch;
+	bool isBlockedNoLock() const;
+public:
+	ChangeLog(size_t maxRecords, size_t maxBytes, size_t maxBlockMillisec = 1000);
+	~ChangeLog();
+
+	/// microseconds since epoch when the log is created
+	ullong epoch() const { return m_epoch; }
+
+	/// called by writers before a write, it waits while the ring is full
+	/// and its oldest change is not read by a backpressure cursor, at most
+	/// maxBlockMillisec, then the oldest change is dropped by append
+	///@returns true if it waited
+	bool waitForConsumers();
+
+	/// returns seq of the change
+	ullong append(ChangeOp op, llong recId, fstring row);
+
+	/// seq of the oldest change in the ring, nextSeq() if the ring is empty
+	ullong oldestSeq() const;
+	/// seq of the next change to be appended
+	ullong nextSeq() const;
+
+	/// append at most maxNum changes which seq >= fromSeq to out
+	///@returns false if fromSeq < oldestSeq(), changes were dropped from
+	///         the ring, the available changes are still appended
+	bool read(ullong fromSeq, size_t maxNum, std::vector<ChangeRecord>* out) const;
+};
+typedef boost::intrusive_ptr<ChangeLog> ChangeLogPtr;
+
+// A subscriber of a ChangeLog, it reads changes in seq order from fromSeq.
+// A backpressure cursor slows down writers when it lags the whole ring.
+// A cursor is used by one thread.
+class TERARK_DB_DLL ChangeCursor : public RefCounter {
+	friend class ChangeLog;
+	ChangeLogPtr m_log;
+	ullong m_nextSeq; // guarded by m_log->m_mutex
+	bool   m_backpressure;
+public:
+	ChangeCursor(ChangeLog*, ullong fromSeq, bool backpressure);
+	~ChangeCursor();
+
+	/// append at most maxNum changes to out, wait at most timeoutMillisec
+	/// if there are no new changes, 0 timeout does not wait
+	///@returns false if changes after position() were dropped, then the
+	///         cursor skips to the oldest change in the ring
+	bool next(std::vector<ChangeRecord>* out, size_t maxNum, size_t timeoutMillisec);
+
+	/// seq of the next change to read, save it with epoch() to resume
+	ullong position() const;
+	ullong epoch() const { return m_log->epoch(); }
+};
+typedef boost::intrusive_ptr<ChangeCursor> ChangeCursorPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_change_log_hpp__
@@ -0,0 +1,517 @@
+#include "columnar_scan.hpp"
+#include "db_segment.hpp"
+#include "db_env.hpp"
+#include <terark/io/FileStream.hpp>
+#if defined(__AVX2__)
+	#include <immintrin.h>
+#endif
+
+namespace terark { namespace db {
+
+ColumnBatch::ColumnBatch() {
+	m_basePhysicId = 0;
+	m_rows = 0;
+}
+ColumnBatch::~ColumnBatch() {
+}
+
+ColumnarBatchIter::ColumnarBatchIter(const ColgroupSegment* seg,
+									 const size_t* columnIds, size_t num,
+									 size_t batchRows) {
+	if (!seg->m_isFreezed) {
+		THROW_STD(invalid_argument, "segment %s is not frozen"
+			, seg->m_segDir.string().c_str());
+	}
+	const SchemaConfig& sconf = *seg->m_schema;
+	m_colInfo.resize_no_init(num);
+	for (size_t i = 0; i < num; ++i) {
+		if (columnIds[i] >= sconf.columnNum()) {
+			THROW_STD(out_of_range, "columnId = %zd, columnNum = %zd"
+				, columnIds[i], sconf.columnNum());
+		}
+		auto cp = sconf.m_colproject[columnIds[i]];
+		const Schema& schema = sconf.getColgroupSchema(cp.colgroupId);
+		const ColumnMeta& colmeta = schema.getColumnMeta(cp.subColumnId);
+		if (0 == colmeta.fixedLen) {
+			THROW_STD(invalid_argument
+				, "column %s is not fixed length"
+				, sconf.m_rowSchema->getColumnName(columnIds[i]).c_str());
+		}
+		ColInfo& ci = m_colInfo[i];
+		ci.colgroupId = cp.colgroupId;
+		ci.subColumnId = cp.subColumnId;
+		ci.offset = schema.isFixedOffsetColumn(cp.subColumnId)
+				  ? colmeta.fixedOffset : size_t(-1);
+		ci.colmeta = &colmeta;
+	}
+	m_seg = seg;
+	m_batchRows = std::max<size_t>(batchRows, 1);
+	m_physicRows = seg->getPhysicRows();
+	m_nextPhysicId = 0;
+	m_nextLogicId = 0;
+}
+
+ColumnarBatchIter::~ColumnarBatchIter() {
+}
+
+void ColumnarBatchIter::reset() {
+	m_nextPhysicId = 0;
+	m_nextLogicId = 0;
+}
+
+void ColumnarBatchIter::seek(size_t physicId) {
+	const rank_select_se& isPurged = m_seg->m_isPurged;
+	if (physicId >= m_physicRows) {
+		m_nextPhysicId = m_physicRows;
+		m_nextLogicId = m_seg->m_isDel.size();
+	}
+	else {
+		m_nextPhysicId = physicId;
+		m_nextLogicId = isPurged.empty() ? physicId : isPurged.select0(physicId);
+	}
+}
+
+void ColumnarBatchIter::fillColumn(size_t i, size_t beg, size_t num,
+								   ColumnBatch* batch) {
+	const ColInfo& ci = m_colInfo[i];
+	const ReadableStore* store = m_seg->m_colgroups[ci.colgroupId].get();
+	const size_t width = ci.colmeta->fixedLen;
+	ColumnArray& col = batch->m_cols[i];
+	valvec<byte>& buf = batch->m_bufs[i];
+	col.width = width;
+	col.type = ci.colmeta->type;
+	if (size_t(-1) != ci.offset) {
+		col.stride = store->getFieldArray(beg, num, ci.offset, width,
+										  &buf, &col.data);
+		if (col.stride)
+			return;
+	}
+	// fallback: read and parse each row
+	const Schema& schema = m_seg->m_schema->getColgroupSchema(ci.colgroupId);
+	buf.resize_no_init(width * num);
+	for (size_t k = 0; k < num; ++k) {
+		store->getValue(beg + k, &m_rowBuf, NULL);
+		schema.parseRow(m_rowBuf, &m_rowCols);
+		fstring field = m_rowCols[ci.subColumnId];
+		assert(field.size() == width);
+		memcpy(buf.data() + width * k, field.data(), width);
+	}
+	col.data = buf.data();
+	col.stride = width;
+}
+
+bool ColumnarBatchIter::next(ColumnBatch* batch) {
+	if (m_nextPhysicId >= m_physicRows)
+		return false;
+	const size_t beg = m_nextPhysicId;
+	const size_t num = std::min(m_batchRows, m_physicRows - beg);
+	batch->m_basePhysicId = beg;
+	batch->m_rows = num;
+	batch->m_select.resize_no_init(num);
+	const febitvec& isDel = m_seg->m_isDel;
+	const rank_select_se& isPurged = m_seg->m_isPurged;
+	if (isPurged.empty()) { // logic id == physic id
+		for (size_t k = 0; k < num; ++k)
+			batch->m_select.set(k, !isDel[beg + k]);
+		m_nextLogicId = beg + num;
+	}
+	else {
+		size_t logicId = m_nextLogicId;
+		for (size_t k = 0; k < num; ++k) {
+			while (isPurged.is1(logicId))
+				logicId++;
+			batch->m_select.set(k, !isDel[logicId]);
+			logicId++;
+		}
+		m_nextLogicId = logicId;
+	}
+	batch->m_cols.resize_no_init(m_colInfo.size());
+	batch->m_bufs.resize(m_colInfo.size());
+	for (size_t i = 0; i < m_colInfo.size(); ++i) {
+		fillColumn(i, beg, num, batch);
+	}
+	m_nextPhysicId = beg + num;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+inline void clearBit(bm_uint_t* sel, size_t k) {
+	sel[k / TERARK_WORD_BITS] &= ~(bm_uint_t(1) << (k % TERARK_WORD_BITS));
+}
+inline bool testBit(const bm_uint_t* sel, size_t k) {
+	return (sel[k / TERARK_WORD_BITS] >> (k % TERARK_WORD_BITS)) & 1;
+}
+
+template<class T>
+void filterScalar(const ColumnArray& col, size_t beg, size_t end,
+				  T lo, T hi, bm_uint_t* sel) {
+	for (size_t k = beg; k < end; ++k) {
+		T v = col.get<T>(k);
+		if (v < lo || v > hi)
+			clearBit(sel, k);
+	}
+}
+
+template<class T>
+llong sumScalar(const ColumnArray& col, size_t beg, size_t end,
+				const bm_uint_t* sel) {
+	llong sum = 0;
+	for (size_t k = beg; k < end; ++k) {
+		if (testBit(sel, k))
+			sum += llong(col.get<T>(k));
+	}
+	return sum;
+}
+
+#if defined(__AVX2__)
+// 64-bit lanes: unsigned compare is signed compare after flipping sign bit
+template<bool Unsigned>
+size_t filterAvx2_64(const byte* data, size_t num, llong lo, llong hi,
+					 bm_uint_t* sel) {
+	const __m256i flip = _mm256_set1_epi64x(Unsigned ? LLONG_MIN : 0);
+	const __m256i vlo = _mm256_xor_si256(_mm256_set1_epi64x(lo), flip);
+	const __m256i vhi = _mm256_xor_si256(_mm256_set1_epi64x(hi), flip);
+	size_t k = 0;
+	for (; k + 4 <= num; k += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(data + 8 * k));
+		v = _mm256_xor_si256(v, flip);
+		__m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(vlo, v),
+									  _mm256_cmpgt_epi64(v, vhi));
+		bm_uint_t bad = _mm256_movemask_pd(_mm256_castsi256_pd(out));
+		sel[k / TERARK_WORD_BITS] &= ~(bad << (k % TERARK_WORD_BITS));
+	}
+	return k;
+}
+template<bool Unsigned>
+size_t filterAvx2_32(const byte* data, size_t num, llong lo, llong hi,
+					 bm_uint_t* sel) {
+	const __m256i flip = _mm256_set1_epi32(Unsigned ? INT_MIN : 0);
+	const __m256i vlo = _mm256_xor_si256(_mm256_set1_epi32(int(lo)), flip);
+	const __m256i vhi = _mm256_xor_si256(_mm256_set1_epi32(int(hi)), flip);
+	size_t k = 0;
+	for (; k + 8 <= num; k += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(data + 4 * k));
+		v = _mm256_xor_si256(v, flip);
+		__m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(vlo, v),
+									  _mm256_cmpgt_epi32(v, vhi));
+		bm_uint_t bad = _mm256_movemask_ps(_mm256_castsi256_ps(out));
+		sel[k / TERARK_WORD_BITS] &= ~(bad << (k % TERARK_WORD_BITS));
+	}
+	return k;
+}
+// lane masks of 4 selection bits
+inline __m256i laneMask4(unsigned bits) {
+	return _mm256_set_epi64x(-llong(bits >> 3 & 1), -llong(bits >> 2 & 1),
+							 -llong(bits >> 1 & 1), -llong(bits & 1));
+}
+template<class T>
+size_t sumAvx2(const byte* data, size_t num, const bm_uint_t* sel,
+			   llong* sum) {
+	__m256i acc = _mm256_setzero_si256();
+	size_t k = 0;
+	for (; k + 4 <= num; k += 4) {
+		__m256i v;
+		if (sizeof(T) == 8)
+			v = _mm256_loadu_si256((const __m256i*)(data + 8 * k));
+		else if (boost::is_signed<T>::value)
+			v = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)(data + 4 * k)));
+		else
+			v = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(data + 4 * k)));
+		unsigned bits = unsigned(sel[k / TERARK_WORD_BITS] >> (k % TERARK_WORD_BITS)) & 15;
+		acc = _mm256_add_epi64(acc, _mm256_and_si256(v, laneMask4(bits)));
+	}
+	alignas(32) llong lanes[4];
+	_mm256_store_si256((__m256i*)lanes, acc);
+	*sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	return k;
+}
+#endif
+
+template<class T>
+void filterColumn(const ColumnArray& col, size_t num, llong lo, llong hi,
+				  bm_uint_t* sel) {
+	size_t k = 0;
+	// [lo, hi] must be representable by T, else clamp it
+	const llong tmin = llong(std::numeric_limits<T>::min());
+	const ullong tmax = ullong(std::numeric_limits<T>::max());
+	if (boost::is_signed<T>::value || sizeof(T) < 8) {
+		if (hi < tmin || (lo > 0 && ullong(lo) > tmax)) {
+			for (size_t i = 0; i < num; ++i) clearBit(sel, i);
+			return;
+		}
+		lo = std::max(lo, tmin);
+		if (hi > 0 && ullong(hi) > tmax) hi = llong(tmax);
+	}
+	else if (hi < 0) { // unsigned 64
+		for (size_t i = 0; i < num; ++i) clearBit(sel, i);
+		return;
+	}
+	else {
+		lo = std::max<llong>(lo, 0);
+	}
+#if defined(__AVX2__)
+	if (col.isDense()) {
+		bool isUnsigned = !boost::is_signed<T>::value;
+		if (sizeof(T) == 8)
+			k = isUnsigned ? filterAvx2_64<true >(col.data, num, lo, hi, sel)
+						   : filterAvx2_64<false>(col.data, num, lo, hi, sel);
+		else
+			k = isUnsigned ? filterAvx2_32<true >(col.data, num, lo, hi, sel)
+						   : filterAvx2_32<false>(col.data, num, lo, hi, sel);
+	}
+#endif
+	filterScalar<T>(col, k, num, T(lo), T(hi), sel);
+}
+
+template<class T>
+llong sumColumn(const ColumnArray& col, size_t num, const bm_uint_t* sel) {
+	llong sum = 0;
+	size_t k = 0;
+#if defined(__AVX2__)
+	if (col.isDense())
+		k = sumAvx2<T>(col.data, num, sel, &sum);
+#endif
+	return sum + sumScalar<T>(col, k, num, sel);
+}
+
+} // namespace
+
+size_t
+columnarFilterRange(ColumnBatch& batch, size_t colIdx, llong lo, llong hi) {
+	assert(colIdx < batch.m_cols.size());
+	const ColumnArray& col = batch.m_cols[colIdx];
+	bm_uint_t* sel = batch.m_select.bldata();
+	const size_t num = batch.m_rows;
+	switch (col.type) {
+	default:
+		THROW_STD(invalid_argument, "not an int32/int64 column: %s"
+			, Schema::columnTypeStr(col.type));
+	case ColumnType::Sint32: filterColumn< int32_t>(col, num, lo, hi, sel); break;
+	case ColumnType::Uint32: filterColumn<uint32_t>(col, num, lo, hi, sel); break;
+	case ColumnType::Sint64: filterColumn< int64_t>(col, num, lo, hi, sel); break;
+	case ColumnType::Uint64: filterColumn<uint64_t>(col, num, lo, hi, sel); break;
+	}
+	return batch.m_select.popcnt();
+}
+
+llong columnarSum(const ColumnBatch& batch, size_t colIdx) {
+	assert(colIdx < batch.m_cols.size());
+	const ColumnArray& col = batch.m_cols[colIdx];
+	const bm_uint_t* sel = batch.m_select.bldata();
+	const size_t num = batch.m_rows;
+	switch (col.type) {
+	default:
+		THROW_STD(invalid_argument, "not an int32/int64 column: %s"
+			, Schema::columnTypeStr(col.type));
+	case ColumnType::Sint32: return sumColumn< int32_t>(col, num, sel);
+	case ColumnType::Uint32: return sumColumn<uint32_t>(col, num, sel);
+	case ColumnType::Sint64: return sumColumn< int64_t>(col, num, sel);
+	case ColumnType::Uint64: return sumColumn<uint64_t>(col, num, sel);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	struct ZoneFileHeader {
+		char     magic[8];
+		uint32_t version;
+		uint32_t numColumns;
+		uint64_t blockRows;
+		uint64_t physicRows;
+	};
+	BOOST_STATIC_ASSERT(sizeof(ZoneFileHeader) == 32);
+	struct ZoneFileColumn {
+		uint32_t columnId;
+		uint32_t type;
+	};
+	const char g_zoneMagic[8] = {'T','d','b','Z','o','n','e','M'};
+
+	template<class T>
+	SegmentZoneMap::Zone blockZone(const ColumnArray& col, size_t num) {
+		assert(num > 0);
+		T lo = col.get<T>(0), hi = lo;
+		for (size_t k = 1; k < num; ++k) {
+			T v = col.get<T>(k);
+			if (v < lo) lo = v;
+			if (v > hi) hi = v;
+		}
+		return SegmentZoneMap::Zone{llong(lo), llong(hi)};
+	}
+
+	// zones are compared as ullong for Uint64, llong for others
+	inline bool zoneLess(ColumnType type, llong x, llong y) {
+		return ColumnType::Uint64 == type ? ullong(x) < ullong(y) : x < y;
+	}
+}
+
+SegmentZoneMap::SegmentZoneMap() {
+	m_blockRows = 0;
+	m_physicRows = 0;
+}
+SegmentZoneMap::~SegmentZoneMap() {
+}
+
+bool SegmentZoneMap::isZoneColumn(const SchemaConfig& sconf, size_t columnId) {
+	switch (sconf.m_rowSchema->getColumnMeta(columnId).type) {
+	default:
+		return false;
+	case ColumnType::Uint08: case ColumnType::Sint08:
+	case ColumnType::Uint16: case ColumnType::Sint16:
+	case ColumnType::Uint32: case ColumnType::Sint32:
+	case ColumnType::Uint64: case ColumnType::Sint64:
+		break;
+	}
+	size_t colgroupId = sconf.m_colproject[columnId].colgroupId;
+	for (size_t cgId : sconf.m_updatableColgroups) {
+		if (cgId == colgroupId)
+			return false;
+	}
+	return true;
+}
+
+bool
+SegmentZoneMap::overlaps(ColumnType type, const Zone& z, llong lo, llong hi) {
+	if (ColumnType::Uint64 == type) {
+		if (hi < 0)
+			return false;
+		return ullong(z.max) >= ullong(std::max<llong>(lo, 0)) &&
+			   ullong(z.min) <= ullong(hi);
+	}
+	return z.max >= lo && z.min <= hi;
+}
+
+bool SegmentZoneMap::inRange(ColumnType type, const byte* data,
+							 llong lo, llong hi) {
+	llong v;
+	switch (type) {
+	default:
+		THROW_STD(invalid_argument, "not an integer column: %s"
+			, Schema::columnTypeStr(type));
+	case ColumnType::Uint08: v = *data; break;
+	case ColumnType::Sint08: v = int8_t(*data); break;
+	case ColumnType::Uint16: v = unaligned_load<uint16_t>(data); break;
+	case ColumnType::Sint16: v = unaligned_load< int16_t>(data); break;
+	case ColumnType::Uint32: v = unaligned_load<uint32_t>(data); break;
+	case ColumnType::Sint32: v = unaligned_load< int32_t>(data); break;
+	case ColumnType::Sint64: v = unaligned_load< int64_t>(data); break;
+	case ColumnType::Uint64:
+		v = llong(unaligned_load<uint64_t>(data));
+		return overlaps(type, Zone{v, v}, lo, hi);
+	}
+	return v >= lo && v <= hi;
+}
+
+void SegmentZoneMap::build(const ColgroupSegment* seg, size_t blockRows) {
+	const SchemaConfig& sconf = *seg->m_schema;
+	valvec<size_t> columnIds;
+	for (size_t i = 0; i < sconf.columnNum(); ++i) {
+		if (isZoneColumn(sconf, i))
+			columnIds.push_back(i);
+	}
+	m_blockRows = std::max<size_t>(blockRows, 1);
+	m_physicRows = seg->getPhysicRows();
+	m_columns.erase_all();
+	if (columnIds.empty() || 0 == m_physicRows) {
+		return;
+	}
+	m_columns.resize(columnIds.size());
+	for (size_t i = 0; i < columnIds.size(); ++i) {
+		Column& c = m_columns[i];
+		c.columnId = columnIds[i];
+		c.type = sconf.m_rowSchema->getColumnMeta(columnIds[i]).type;
+		c.zones.reserve(1 + numBlocks());
+		c.zones.push_back(Zone{0, 0}); // set after blocks
+	}
+	ColumnarBatchIter iter(seg, columnIds.data(), columnIds.size(), m_blockRows);
+	ColumnBatch batch;
+	while (iter.next(&batch)) {
+		for (size_t i = 0; i < m_columns.size(); ++i) {
+			const ColumnArray& col = batch.m_cols[i];
+			const size_t num = batch.m_rows;
+			Zone z;
+			switch (col.type) {
+			default: assert(0); abort();
+			case ColumnType::Uint08: z = blockZone<uint8_t >(col, num); break;
+			case ColumnType::Sint08: z = blockZone< int8_t >(col, num); break;
+			case ColumnType::Uint16: z = blockZone<uint16_t>(col, num); break;
+			case ColumnType::Sint16: z = blockZone< int16_t>(col, num); break;
+			case ColumnType::Uint32: z = blockZone<uint32_t>(col, num); break;
+			case ColumnType::Sint32: z = blockZone< int32_t>(col, num); break;
+			case ColumnType::Uint64: z = blockZone<uint64_t>(col, num); break;
+			case ColumnType::Sint64: z = blockZone< int64_t>(col, num); break;
+			}
+			m_columns[i].zones.push_back(z);
+		}
+	}
+	for (Column& c : m_columns) {
+		assert(c.zones.size() == 1 + numBlocks());
+		Zone all = c.zones[1];
+		for (size_t k = 2; k < c.zones.size(); ++k) {
+			if (zoneLess(c.type, c.zones[k].min, all.min))
+				all.min = c.zones[k].min;
+			if (zoneLess(c.type, all.max, c.zones[k].max))
+				all.max = c.zones[k].max;
+		}
+		c.zones[0] = all;
+	}
+}
+
+const SegmentZoneMap::Column*
+SegmentZoneMap::findColumn(size_t columnId) const {
+	for (const Column& c : m_columns) {
+		if (c.columnId == columnId)
+			return &c;
+	}
+	return NULL;
+}
+
+size_t SegmentZoneMap::numBlocks() const {
+	return (m_physicRows + m_blockRows - 1) / m_blockRows;
+}
+
+void SegmentZoneMap::load(PathRef fpath) {
+	std::string strFile = fpath.string();
+	FileStream fp(strFile.c_str(), "rb");
+	ZoneFileHeader hdr;
+	fp.ensureRead(&hdr, sizeof(hdr));
+	if (memcmp(hdr.magic, g_zoneMagic, 8) != 0 || hdr.version != 1
+			|| hdr.blockRows == 0) {
+		TERARK_THROW(DbException, "bad zone map file: %s", strFile.c_str());
+	}
+	m_blockRows = size_t(hdr.blockRows);
+	m_physicRows = size_t(hdr.physicRows);
+	m_columns.resize(hdr.numColumns);
+	for (Column& c : m_columns) {
+		ZoneFileColumn fc;
+		fp.ensureRead(&fc, sizeof(fc));
+		c.columnId = fc.columnId;
+		c.type = ColumnType(fc.type);
+		c.zones.resize_no_init(1 + numBlocks());
+		fp.ensureRead(c.zones.data(), sizeof(Zone) * c.zones.size());
+	}
+}
+
+void SegmentZoneMap::save(PathRef fpath) const {
+	ZoneFileHeader hdr;
+	memcpy(hdr.magic, g_zoneMagic, 8);
+	hdr.version = 1;
+	hdr.numColumns = uint32_t(m_columns.size());
+	hdr.blockRows = m_blockRows;
+	hdr.physicRows = m_physicRows;
+	EnvFileStream fp(fpath.string().c_str(), "wb");
+	fp.ensureWrite(&hdr, sizeof(hdr));
+	for (const Column& c : m_columns) {
+		assert(c.zones.size() == 1 + numBlocks());
+		ZoneFileColumn fc;
+		fc.columnId = uint32_t(c.columnId);
+		fc.type = uint32_t(c.type);
+		fp.ensureWrite(&fc, sizeof(fc));
+		fp.ensureWrite(c.zones.data(), sizeof(Zone) * c.zones.size());
+	}
+}
+
+} } // namespace terark::db
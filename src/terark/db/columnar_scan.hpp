@@ -0,0 +1,120 @@
+#ifndef __terark_db_columnar_scan_hpp__
+#define __terark_db_columnar_scan_hpp__
+
+#include "db_store.hpp"
+#include <terark/bitmap.hpp>
+
+namespace terark { namespace db {
+
+class TERARK_DB_DLL ColgroupSegment;
+
+// one fixed length column of a ColumnBatch, value of row k of the batch
+// is at (data + stride * k), data may point into store memory(zero-copy)
+struct ColumnArray {
+	const byte* data;
+	size_t      stride;
+	size_t      width;
+	ColumnType  type;
+	bool isDense() const { return stride == width; }
+	template<class T> T get(size_t k) const {
+		assert(sizeof(T) == width);
+		return unaligned_load<T>(data + stride * k);
+	}
+};
+
+// rows [m_basePhysicId, m_basePhysicId + m_rows) of a segment
+class TERARK_DB_DLL ColumnBatch {
+	friend class ColumnarBatchIter;
+	valvec<valvec<byte> > m_bufs; // decoded columns, parallel with m_cols
+public:
+	llong    m_basePhysicId;
+	size_t   m_rows;
+	febitvec m_select; // m_select.is1(k) means row k is not deleted
+	valvec<ColumnArray> m_cols; // parallel with columnIds of the iter
+	ColumnBatch();
+	~ColumnBatch();
+};
+
+// Scan fixed length columns of a frozen ColgroupSegment by batches, rows
+// are in physic id order. FixedLenStore fields are returned zero-copy,
+// ZipIntStore is decoded in bulk, other stores fall back to parseRow.
+class TERARK_DB_DLL ColumnarBatchIter : public RefCounter {
+	struct ColInfo {
+		size_t colgroupId;
+		size_t subColumnId;
+		size_t offset; // fixedOffset in colgroup row, size_t(-1) if unknown
+		const ColumnMeta* colmeta;
+	};
+	const ColgroupSegment* m_seg;
+	valvec<ColInfo> m_colInfo;
+	size_t m_batchRows;
+	size_t m_physicRows;
+	size_t m_nextPhysicId;
+	size_t m_nextLogicId;
+	valvec<byte> m_rowBuf;
+	ColumnVec    m_rowCols;
+	void fillColumn(size_t i, size_t beg, size_t num, ColumnBatch*);
+public:
+	///@param columnIds ids of row schema, all columns must be fixed length
+	ColumnarBatchIter(const ColgroupSegment*, const size_t* columnIds,
+					  size_t num, size_t batchRows = 4096);
+	~ColumnarBatchIter();
+	bool next(ColumnBatch* batch);
+	void reset();
+	/// next batch starts at physicId
+	void seek(size_t physicId);
+};
+typedef boost::intrusive_ptr<ColumnarBatchIter> ColumnarBatchIterPtr;
+
+///@{ kernels on integer columns(Sint32, Uint32, Sint64, Uint64) of a
+/// batch, vectorized for dense columns. Rows not in m_select are skipped.
+
+/// narrow batch.m_select to rows whose value is in [lo, hi]
+///@returns number of rows in m_select after filtering
+TERARK_DB_DLL size_t
+columnarFilterRange(ColumnBatch& batch, size_t colIdx, llong lo, llong hi);
+
+/// sum of selected values, unsigned values are summed as wrapped llong
+TERARK_DB_DLL llong
+columnarSum(const ColumnBatch& batch, size_t colIdx);
+///@}
+
+// min/max of integer columns of a frozen ColgroupSegment, of the whole
+// segment and of each block of m_blockRows physic rows, a scan by a range
+// predicate skips the segment and the blocks whose zone doesn't overlap.
+// Deleted rows are included, so a zone map is never stale, columns of
+// updatable colgroups are excluded because they are updated inplace.
+// Zone of an unsigned column is ullong(min), ullong(max).
+class TERARK_DB_DLL SegmentZoneMap : public RefCounter {
+public:
+	struct Zone {
+		llong min;
+		llong max;
+	};
+	struct Column {
+		size_t     columnId; // of row schema
+		ColumnType type;
+		valvec<Zone> zones; // zones[0] is the segment, zones[1+k] is block k
+	};
+	size_t m_blockRows;
+	size_t m_physicRows;
+	valvec<Column> m_columns;
+
+	SegmentZoneMap();
+	~SegmentZoneMap();
+	static bool isZoneColumn(const SchemaConfig&, size_t columnId);
+	static bool overlaps(ColumnType, const Zone&, llong lo, llong hi);
+	/// data is a value of an integer column
+	static bool inRange(ColumnType, const byte* data, llong lo, llong hi);
+	void build(const ColgroupSegment*, size_t blockRows);
+	/// NULL if the column has no zone map
+	const Column* findColumn(size_t columnId) const;
+	size_t numBlocks() const;
+	void load(PathRef fpath);
+	void save(PathRef fpath) const;
+};
+typedef boost::intrusive_ptr<SegmentZoneMap> SegmentZoneMapPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_columnar_scan_hpp__
@@ -11,6 +11,7 @@
 #include <terark/util/linebuf.hpp>
 #include <string.h>
 #include "json.hpp"
+#include "json_codec.hpp"
 #include <boost/algorithm/string/join.hpp>
 //#include <boost/multiprecision/cpp_int.hpp>
 
@@ -20,6 +21,10 @@
 #endif
 
 #include <set>
+#include <map>
+#include <mutex>
+#include <limits>
+#include <type_traits>
 
 namespace terark { namespace db {
 
@@ -190,10 +195,12 @@ ColumnVec& ColumnVec::operator=(ColumnVec&&) = default;
 /////////////////////////////////////////////////////////////////////////////
 
 const unsigned int DEFAULT_nltNestLevel = 4;
+const size_t DEFAULT_readaheadSize = 4 * 1024 * 1024;
 
 Schema::Schema() {
 	m_fixedLen = size_t(-1);
 	m_parent = nullptr;
+	m_rowCodec = nullptr;
 	m_isCompiled = false;
 	m_isOrdered = false;
 //	m_isPrimary = false;
@@ -206,18 +213,32 @@ Schema::Schema() {
 	m_dictZipEntropyType = byte(DictZipEntropyAlgo::kNoEntropy);
 #endif
 	m_dictZipUseSuffixArrayLocalMatch = false;
+	m_dictZipReuse = false;
 	m_isInplaceUpdatable = false;
 	m_enableLinearScan = false;
+	m_enableLearnedSearch = false;
 	m_mmapPopulate = false;
+	m_appendonlyBlockZip = false;
+	m_writableBtree = false;
+	m_writableHash = false;
+	m_compactKey = false;
+	m_nltLazyIdToKey = false;
+	m_nltHugePage = false;
+	m_bitmapIndex = false;
 	m_keepCols.fill(true);
 	m_minFragLen = 0;
 	m_maxFragLen = 0;
 	m_sufarrMinFreq = 0;
 	m_rankSelectClass = 512;
 	m_checksumLevel = 2; // checksum all
+	m_bloomBitsPerKey = 0;
 	m_nltNestLevel = DEFAULT_nltNestLevel;
 	m_lastVarLenCol = 0;
 	m_restFixLenSum = 0;
+	m_fixedPrefixNum = 0;
+	m_fixedPrefixLen = 0;
+	m_readaheadSize = DEFAULT_readaheadSize;
+	m_valueLogThreshold = 0;
 }
 Schema::~Schema() {
 }
@@ -271,6 +292,20 @@ void Schema::compile(const Schema* parent) {
 			TERARK_RT_assert(colmeta.fixedLen > 0, std::invalid_argument);
 		}
 	}
+	// fixed length columns are not length prefixed, so the leading ones can
+	// be projected by offset without parseRow
+	m_fixedPrefixNum = 0;
+	m_fixedPrefixCols.erase_all();
+	uint32_t offset = 0;
+	for (; m_fixedPrefixNum < colnum; ++m_fixedPrefixNum) {
+		auto& colmeta = m_columnsMeta.val(m_fixedPrefixNum);
+		if (0 == colmeta.fixedLen)
+			break;
+		colmeta.fixedOffset = offset;
+		m_fixedPrefixCols.push_back({offset, colmeta.fixedLen});
+		offset += colmeta.fixedLen;
+	}
+	m_fixedPrefixLen = offset;
 #if 0 // TODO:
 	// theoretically, m_lastVarLenCol can be "last non-binary col",
 	// StrZero and TwoStrZero are non-binary col, it need reverse scan to
@@ -308,6 +343,77 @@ void Schema::compile(const Schema* parent) {
 	if (m_name.empty()) {
 		m_name = joinColumnNames();
 	}
+	if (m_compactKey && !canCompactKey()) {
+		fprintf(stderr
+			, "WARN: schema=%s has columns can not be compact, compactKey is disabled\n"
+			, m_name.c_str());
+		m_compactKey = false;
+	}
+	m_rowCodec = findRowCodec(rowCodecHash());
+	if (m_rowCodec && m_rowCodec->columnNum != colnum) {
+		fprintf(stderr
+			, "WARN: schema=%s RowCodec hash collision, colnum: %zd != %zd\n"
+			, m_name.c_str(), m_rowCodec->columnNum, colnum);
+		m_rowCodec = nullptr;
+	}
+}
+
+uint64_t Schema::rowCodecHash() const {
+	// FNV-1a on (colnum, [type, fixedLen]...), it is also computed by the
+	// schema compiler, so it must not depend on anything else
+	uint64_t h = 14695981039346656037ULL;
+	auto mix = [&h](uint64_t x) {
+		for (int i = 0; i < 8; ++i) {
+			h ^= byte(x >> (8 * i));
+			h *= 1099511628211ULL;
+		}
+	};
+	size_t colnum = m_columnsMeta.end_i();
+	mix(colnum);
+	for (size_t i = 0; i < colnum; ++i) {
+		const ColumnMeta& colmeta = m_columnsMeta.val(i);
+		mix(uint64_t(colmeta.type) << 32 | colmeta.fixedLen);
+	}
+	return h;
+}
+
+namespace {
+struct RowCodecRegistry {
+	std::mutex mutex;
+	std::map<uint64_t, const RowCodec*> codecs;
+	bool disabled;
+	RowCodecRegistry() {
+		const char* env = getenv("TerarkDB_DisableRowCodec");
+		disabled = env && atoi(env) != 0;
+	}
+	static RowCodecRegistry& get() {
+		static RowCodecRegistry reg;
+		return reg;
+	}
+};
+}
+
+void Schema::registerRowCodec(const RowCodec* codec) {
+	assert(nullptr != codec);
+	auto& reg = RowCodecRegistry::get();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	reg.codecs[codec->schemaHash] = codec;
+}
+
+const RowCodec* Schema::findRowCodec(uint64_t schemaHash) {
+	auto& reg = RowCodecRegistry::get();
+	if (reg.disabled)
+		return nullptr;
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	auto iter = reg.codecs.find(schemaHash);
+	return reg.codecs.end() == iter ? nullptr : iter->second;
+}
+
+void Schema::throwRowOutOfRange(const Schema& schema, size_t columnId,
+								size_t len, size_t remain) {
+	THROW_STD(out_of_range, "schema=%s colname=%s len=%ld remain=%ld",
+		schema.m_name.c_str(), schema.getColumnName(columnId).c_str(),
+		long(len), long(remain));
 }
 
 void Schema::parseRow(fstring row, ColumnVec* columns) const {
@@ -318,6 +424,10 @@ void Schema::parseRow(fstring row, ColumnVec* columns) const {
 
 void Schema::parseRowAppend(fstring row, size_t start, ColumnVec* columns) const {
 	assert(size_t(-1) != m_fixedLen);
+	if (m_rowCodec) {
+		m_rowCodec->parseRowAppend(*this, row, start, columns);
+		return;
+	}
 	const byte* base = row.udata();
 	const byte* curr = row.udata() + start;
 	const byte* last = row.size() + base;
@@ -339,7 +449,26 @@ void Schema::parseRowAppend(fstring row, size_t start, ColumnVec* columns) const
 
 #define CHECK_CURR_LAST(len) CHECK_CURR_LAST3(curr, last, len)
 	size_t colnum = m_columnsMeta.end_i();
-	for (size_t i = 0; i < colnum; ++i) {
+	size_t i = 0;
+	columns->reserve(columns->size() + colnum);
+	if (m_fixedPrefixNum && terark_likely(curr + m_fixedPrefixLen <= last)) {
+		// offsets of fixed prefix are static, a short row falls through
+		// to the column loop, which reports the column out of range
+		const ColumnVec::Elem* src = m_fixedPrefixCols.data();
+		ColumnVec::Elem* dst = columns->m_cols.grow_no_init(m_fixedPrefixNum);
+		if (0 == start) {
+			memcpy(dst, src, sizeof(ColumnVec::Elem) * m_fixedPrefixNum);
+		}
+		else {
+			for (size_t j = 0; j < m_fixedPrefixNum; ++j) {
+				dst[j].pos = uint32_t(start + src[j].pos);
+				dst[j].len = src[j].len;
+			}
+		}
+		curr += m_fixedPrefixLen;
+		i = m_fixedPrefixNum;
+	}
+	for (; i < colnum; ++i) {
 		const fstring colname = m_columnsMeta.key(i);
 		const ColumnMeta& colmeta = m_columnsMeta.val(i);
 		size_t collen = 0;
@@ -503,6 +632,10 @@ Schema::combineRowAppend(const ColumnVec& myCols, valvec<byte>* myRowData)
 const {
 	assert(size_t(-1) != m_fixedLen);
 	assert(myCols.size() == m_columnsMeta.end_i());
+	if (m_rowCodec) {
+		m_rowCodec->combineRowAppend(*this, myCols, myRowData);
+		return;
+	}
 	size_t colnum = m_columnsMeta.end_i();
 	for (size_t i = 0; i < colnum; ++i) {
 		const ColumnMeta& colmeta = m_columnsMeta.val(i);
@@ -695,6 +828,10 @@ const {
 	assert(m_proj.size() == m_columnsMeta.end_i());
 	assert(m_parent->columnNum() == parentCols.size());
 	myRowData->erase_all();
+	if (m_rowCodec) {
+		m_rowCodec->selectParent(*this, parentCols, myRowData);
+		return;
+	}
 	size_t colnum = m_proj.size();
 	for(size_t i = 0; i < colnum; ++i) {
 		size_t j = m_proj[i];
@@ -980,6 +1117,337 @@ void Schema::byteLexConvert(byte* data, size_t size) const {
 	}
 }
 
+// order-preserving varints of compact keys, memcmp of encoded integers is
+// same as compare of the integers:
+//   unsigned: [0x00, 0xF6] is the value, [0xF7, 0xFE] is followed by
+//             (byte - 0xF6) big endian bytes
+//   signed  : non-negative x is (0x80 + x) or [0xF7, 0xFE] + bytes of x,
+//             negative x is (0x7F - ~x) or [0x01, 0x08] + inverted bytes of ~x
+static inline size_t compactBytesOf(ullong x) {
+	size_t n = 1;
+	while (n < 8 && (x >> (8 * n)))
+		n++;
+	return n;
+}
+static inline void
+compactPutBytes(ullong x, size_t n, byte inv, valvec<byte>* out) {
+	byte* p = out->grow_no_init(n);
+	for (size_t i = 0; i < n; ++i)
+		p[i] = byte(x >> (8 * (n - 1 - i))) ^ inv;
+}
+static void compactSaveUint(ullong x, valvec<byte>* out) {
+	if (x < 0xF7) {
+		out->push_back(byte(x));
+	}
+	else {
+		size_t n = compactBytesOf(x);
+		out->push_back(byte(0xF6 + n));
+		compactPutBytes(x, n, 0, out);
+	}
+}
+static void compactSaveSint(llong x, valvec<byte>* out) {
+	if (x >= 0) {
+		if (x < 0x77) {
+			out->push_back(byte(0x80 + x));
+		} else {
+			size_t n = compactBytesOf(ullong(x));
+			out->push_back(byte(0xF6 + n));
+			compactPutBytes(ullong(x), n, 0, out);
+		}
+	}
+	else {
+		ullong u = ~ullong(x);
+		if (u < 0x77) {
+			out->push_back(byte(0x7F - u));
+		} else {
+			size_t n = compactBytesOf(u);
+			out->push_back(byte(0x09 - n));
+			compactPutBytes(u, n, 0xFF, out);
+		}
+	}
+}
+static ullong
+compactGetBytes(const byte*& curr, const byte* last, size_t n, byte inv) {
+	if (terark_unlikely(curr + n > last)) {
+		THROW_STD(invalid_argument, "compact key is truncated");
+	}
+	ullong x = 0;
+	for (size_t i = 0; i < n; ++i)
+		x = x << 8 | byte(curr[i] ^ inv);
+	curr += n;
+	return x;
+}
+static ullong compactLoadUint(const byte*& curr, const byte* last) {
+	byte b = *curr++;
+	if (b < 0xF7)
+		return b;
+	if (terark_unlikely(0xFF == b)) {
+		THROW_STD(invalid_argument, "bad compact key");
+	}
+	return compactGetBytes(curr, last, b - 0xF6, 0);
+}
+static const byte*
+compactGetBytesPtr(const byte*& curr, const byte* last, size_t n) {
+	if (terark_unlikely(curr + n > last)) {
+		THROW_STD(invalid_argument, "compact key is truncated");
+	}
+	const byte* p = curr;
+	curr += n;
+	return p;
+}
+static llong compactLoadSint(const byte*& curr, const byte* last) {
+	byte b = *curr++;
+	if (b >= 0x80) {
+		if (b < 0xF7)
+			return b - 0x80;
+		if (terark_unlikely(0xFF == b)) {
+			THROW_STD(invalid_argument, "bad compact key");
+		}
+		return llong(compactGetBytes(curr, last, b - 0xF6, 0));
+	}
+	if (b >= 0x09)
+		return ~llong(0x7F - b);
+	if (terark_unlikely(0 == b)) {
+		THROW_STD(invalid_argument, "bad compact key");
+	}
+	return ~llong(compactGetBytes(curr, last, 0x09 - b, 0xFF));
+}
+
+bool Schema::canCompactKey() const {
+	size_t colnum = m_columnsMeta.end_i();
+	for (size_t i = 0; i < colnum; ++i) {
+		switch (m_columnsMeta.val(i).type) {
+		default:
+			return false;
+		case ColumnType::Uint08:
+		case ColumnType::Sint08:
+		case ColumnType::Uint16:
+		case ColumnType::Sint16:
+		case ColumnType::Uint32:
+		case ColumnType::Sint32:
+		case ColumnType::Uint64:
+		case ColumnType::Sint64:
+		case ColumnType::Float32:
+		case ColumnType::Float64:
+		case ColumnType::Uuid:
+		case ColumnType::Fixed:
+		case ColumnType::VarSint:
+		case ColumnType::VarUint:
+		case ColumnType::StrZero:
+			break;
+		case ColumnType::Binary:
+		case ColumnType::CarBin:
+			if (i + 1 < colnum) // last column is not length prefixed
+				return false;
+			break;
+		}
+	}
+	return true;
+}
+
+// key may be a prefix for seeking, a truncated string or fixed column is
+// encoded as a prefix of its encoding, a truncated number is invalid
+void Schema::compactKeyEncode(fstring key, valvec<byte>* enc) const {
+	assert(m_compactKey);
+	enc->erase_all();
+	const byte* curr = key.udata();
+	const byte* last = curr + key.size();
+	const size_t colnum = m_columnsMeta.end_i();
+	for (size_t i = 0; i < colnum && curr < last; ++i) {
+		const ColumnMeta& colmeta = m_columnsMeta.val(i);
+		const size_t remain = last - curr;
+		if (colmeta.fixedLen && colmeta.isNumber() && remain < colmeta.fixedLen) {
+			THROW_STD(invalid_argument, "schema=%s colname=%s len=%zd remain=%zd"
+				, m_name.c_str(), m_columnsMeta.key(i).c_str()
+				, size_t(colmeta.fixedLen), remain);
+		}
+		switch (colmeta.type) {
+		default:
+			THROW_STD(invalid_argument, "schema=%s colname=%s can not be compact: %s"
+				, m_name.c_str(), m_columnsMeta.key(i).c_str()
+				, columnTypeStr(colmeta.type));
+			break;
+		case ColumnType::Uint08:
+		case ColumnType::Uuid:
+		case ColumnType::Fixed:
+			{
+				size_t n = std::min<size_t>(colmeta.fixedLen, remain);
+				enc->append(curr, n);
+				curr += n;
+			}
+			break;
+		case ColumnType::Sint08:
+			enc->push_back(curr[0] ^ 0x80);
+			curr += 1;
+			break;
+		case ColumnType::Uint16:
+			compactSaveUint(unaligned_load<uint16_t>(curr), enc);
+			curr += 2;
+			break;
+		case ColumnType::Sint16:
+			compactSaveSint(unaligned_load<int16_t>(curr), enc);
+			curr += 2;
+			break;
+		case ColumnType::Uint32:
+			compactSaveUint(unaligned_load<uint32_t>(curr), enc);
+			curr += 4;
+			break;
+		case ColumnType::Sint32:
+			compactSaveSint(unaligned_load<int32_t>(curr), enc);
+			curr += 4;
+			break;
+		case ColumnType::Uint64:
+			compactSaveUint(unaligned_load<uint64_t>(curr), enc);
+			curr += 8;
+			break;
+		case ColumnType::Sint64:
+			compactSaveSint(unaligned_load<int64_t>(curr), enc);
+			curr += 8;
+			break;
+		case ColumnType::Float32:
+			{
+				uint32_t x = EncodeOffsetCoding::convert(unaligned_load<uint32_t>(curr));
+				unaligned_save(enc->grow_no_init(4), x);
+				curr += 4;
+			}
+			break;
+		case ColumnType::Float64:
+			{
+				uint64_t x = EncodeOffsetCoding::convert(unaligned_load<uint64_t>(curr));
+				unaligned_save(enc->grow_no_init(8), x);
+				curr += 8;
+			}
+			break;
+		case ColumnType::VarUint:
+			{
+				const byte* next = nullptr;
+				ullong x = load_var_uint64(curr, &next);
+				if (terark_unlikely(next > last)) {
+					THROW_STD(invalid_argument, "schema=%s colname=%s is truncated"
+						, m_name.c_str(), m_columnsMeta.key(i).c_str());
+				}
+				compactSaveUint(x, enc);
+				curr = next;
+			}
+			break;
+		case ColumnType::VarSint:
+			{
+				const byte* next = nullptr;
+				llong x = load_var_int64(curr, &next);
+				if (terark_unlikely(next > last)) {
+					THROW_STD(invalid_argument, "schema=%s colname=%s is truncated"
+						, m_name.c_str(), m_columnsMeta.key(i).c_str());
+				}
+				compactSaveSint(x, enc);
+				curr = next;
+			}
+			break;
+		case ColumnType::StrZero:
+			if (i + 1 < colnum) {
+				size_t n = std::min(strnlen((const char*)curr, remain) + 1, remain);
+				enc->append(curr, n);
+				curr += n;
+				break;
+			}
+			// the last StrZero is same as binary
+			// fall through
+		case ColumnType::Binary:
+		case ColumnType::CarBin:
+			enc->append(curr, remain);
+			curr = last;
+			break;
+		}
+	}
+}
+
+void Schema::compactKeyDecode(fstring enc, valvec<byte>* key) const {
+	assert(m_compactKey);
+	key->erase_all();
+	const byte* curr = enc.udata();
+	const byte* last = curr + enc.size();
+	const size_t colnum = m_columnsMeta.end_i();
+	for (size_t i = 0; i < colnum && curr < last; ++i) {
+		const ColumnMeta& colmeta = m_columnsMeta.val(i);
+		const size_t remain = last - curr;
+		switch (colmeta.type) {
+		default:
+			THROW_STD(invalid_argument, "schema=%s colname=%s can not be compact: %s"
+				, m_name.c_str(), m_columnsMeta.key(i).c_str()
+				, columnTypeStr(colmeta.type));
+			break;
+		case ColumnType::Uint08:
+		case ColumnType::Uuid:
+		case ColumnType::Fixed:
+			{
+				size_t n = std::min<size_t>(colmeta.fixedLen, remain);
+				key->append(curr, n);
+				curr += n;
+			}
+			break;
+		case ColumnType::Sint08:
+			key->push_back(curr[0] ^ 0x80);
+			curr += 1;
+			break;
+		case ColumnType::Uint16:
+			unaligned_save(key->grow_no_init(2), uint16_t(compactLoadUint(curr, last)));
+			break;
+		case ColumnType::Sint16:
+			unaligned_save(key->grow_no_init(2), int16_t(compactLoadSint(curr, last)));
+			break;
+		case ColumnType::Uint32:
+			unaligned_save(key->grow_no_init(4), uint32_t(compactLoadUint(curr, last)));
+			break;
+		case ColumnType::Sint32:
+			unaligned_save(key->grow_no_init(4), int32_t(compactLoadSint(curr, last)));
+			break;
+		case ColumnType::Uint64:
+			unaligned_save(key->grow_no_init(8), uint64_t(compactLoadUint(curr, last)));
+			break;
+		case ColumnType::Sint64:
+			unaligned_save(key->grow_no_init(8), int64_t(compactLoadSint(curr, last)));
+			break;
+		case ColumnType::Float32:
+			{
+				uint32_t x = unaligned_load<uint32_t>(compactGetBytesPtr(curr, last, 4));
+				unaligned_save(key->grow_no_init(4), DecodeOffsetCoding::convert(x));
+			}
+			break;
+		case ColumnType::Float64:
+			{
+				uint64_t x = unaligned_load<uint64_t>(compactGetBytesPtr(curr, last, 8));
+				unaligned_save(key->grow_no_init(8), DecodeOffsetCoding::convert(x));
+			}
+			break;
+		case ColumnType::VarUint:
+			{
+				byte* p = key->grow_no_init(10);
+				key->trim(save_var_uint64(p, compactLoadUint(curr, last)));
+			}
+			break;
+		case ColumnType::VarSint:
+			{
+				byte* p = key->grow_no_init(10);
+				key->trim(save_var_int64(p, compactLoadSint(curr, last)));
+			}
+			break;
+		case ColumnType::StrZero:
+			if (i + 1 < colnum) {
+				size_t n = std::min(strnlen((const char*)curr, remain) + 1, remain);
+				key->append(curr, n);
+				curr += n;
+				break;
+			}
+			// the last StrZero is same as binary
+			// fall through
+		case ColumnType::Binary:
+		case ColumnType::CarBin:
+			key->append(curr, remain);
+			curr = last;
+			break;
+		}
+	}
+}
+
 size_t
 Schema::parseDelimText(char delim, fstring text, valvec<byte>* row)
 const {
@@ -1068,17 +1536,29 @@ std::string Schema::toJsonStr(fstring row) const {
 	return toJsonStr(row.data(), row.size());
 }
 std::string Schema::toJsonStr(const char* row, size_t rowlen) const {
+	std::string js;
+	appendJson(fstring(row, rowlen), &js);
+	return js;
+}
+
+// columns are written in schema order by JsonWriter, without a json DOM
+void Schema::appendJson(fstring row, std::string* out) const {
 	assert(size_t(-1) != m_fixedLen);
-	if (0 == rowlen) {
-		return "emptyJson{}";
+	if (row.empty()) {
+		out->append("emptyJson{}");
+		return;
 	}
-	const byte* curr = (const byte*)(row);
-	const byte* last = (const byte*)(row) + rowlen;
-	terark::json js;
+	const byte* curr = row.udata();
+	const byte* last = row.udata() + row.size();
 	size_t colnum = m_columnsMeta.end_i();
+	out->push_back('{');
 	for (size_t i = 0; i < colnum; ++i) {
 		fstring colname = m_columnsMeta.key(i);
 		const ColumnMeta& colmeta = m_columnsMeta.val(i);
+		if (i)
+			out->push_back(',');
+		JsonWriter::appendString(out, colname);
+		out->push_back(':');
 		switch (colmeta.type) {
 		default:
 			THROW_STD(runtime_error, "Invalid data row");
@@ -1087,58 +1567,75 @@ std::string Schema::toJsonStr(const char* row, size_t rowlen) const {
 			THROW_STD(invalid_argument, "ColumnType::Any to json is not implemented");
 			break;
 		case ColumnType::Uint08:
+			CHECK_CURR_LAST(1);
+			JsonWriter::appendUint(out, *curr);
+			curr += 1;
+			break;
 		case ColumnType::Sint08:
 			CHECK_CURR_LAST(1);
-			js[colname.str()] = int(*curr);
+			JsonWriter::appendInt(out, int8_t(*curr));
 			curr += 1;
 			break;
 		case ColumnType::Uint16:
+			CHECK_CURR_LAST(2);
+			JsonWriter::appendUint(out, unaligned_load<uint16_t>(curr));
+			curr += 2;
+			break;
 		case ColumnType::Sint16:
 			CHECK_CURR_LAST(2);
-			js[colname.str()] = unaligned_load<int16_t>(curr);
+			JsonWriter::appendInt(out, unaligned_load<int16_t>(curr));
 			curr += 2;
 			break;
 		case ColumnType::Uint32:
+			CHECK_CURR_LAST(4);
+			JsonWriter::appendUint(out, unaligned_load<uint32_t>(curr));
+			curr += 4;
+			break;
 		case ColumnType::Sint32:
 			CHECK_CURR_LAST(4);
-			js[colname.str()] = unaligned_load<int32_t>(curr);
+			JsonWriter::appendInt(out, unaligned_load<int32_t>(curr));
 			curr += 4;
 			break;
 		case ColumnType::Uint64:
+			CHECK_CURR_LAST(8);
+			JsonWriter::appendUint(out, unaligned_load<uint64_t>(curr));
+			curr += 8;
+			break;
 		case ColumnType::Sint64:
 			CHECK_CURR_LAST(8);
-			js[colname.str()] = unaligned_load<int64_t>(curr);
+			JsonWriter::appendInt(out, unaligned_load<int64_t>(curr));
 			curr += 8;
 			break;
 		case ColumnType::Uint128:
 		case ColumnType::Sint128:
 			CHECK_CURR_LAST(16);
 			// TODO: int128
-			js[colname.str()] = unaligned_load<int64_t>(curr);
+			JsonWriter::appendInt(out, unaligned_load<int64_t>(curr));
 			curr += 16;
 			break;
 		case ColumnType::Float32:
 			CHECK_CURR_LAST(4);
-			js[colname.str()] = unaligned_load<float>(curr);
+			JsonWriter::appendDouble(out, unaligned_load<float>(curr), 9);
 			curr += 4;
 			break;
 		case ColumnType::Float64:
 			CHECK_CURR_LAST(8);
-			js[colname.str()] = unaligned_load<double>(curr);
+			JsonWriter::appendDouble(out, unaligned_load<double>(curr), 17);
 			curr += 8;
 			break;
 		case ColumnType::Float128:
 			CHECK_CURR_LAST(16);
-			js[colname.str()] = unaligned_load<long double>(curr);
+			JsonWriter::appendDouble(out, double(unaligned_load<long double>(curr)), 17);
 			curr += 16;
 			break;
 		case ColumnType::Uuid:    // 16 bytes(128 bits) binary
-			js[colname.str()] = std::string((char*)curr, 16);
+			CHECK_CURR_LAST(16);
+			JsonWriter::appendString(out, fstring(curr, 16));
 			curr += 16;
 			break;
 		case ColumnType::Fixed:   // Fixed length binary
 			CHECK_CURR_LAST(colmeta.fixedLen);
-			js[colname.str()] = std::string((char*)curr, colmeta.fixedLen);
+			JsonWriter::appendString(out, fstring(curr, colmeta.fixedLen));
 			curr += colmeta.fixedLen;
 			break;
 		case ColumnType::VarSint:
@@ -1146,7 +1643,7 @@ std::string Schema::toJsonStr(const char* row, size_t rowlen) const {
 				const byte* next = nullptr;
 				int64_t x = load_var_int64(curr, &next);
 				CHECK_CURR_LAST(next - curr);
-				js[colname.str()] = x;
+				JsonWriter::appendInt(out, x);
 				curr = next;
 			}
 			break;
@@ -1155,7 +1652,7 @@ std::string Schema::toJsonStr(const char* row, size_t rowlen) const {
 				const byte* next = nullptr;
 				uint64_t x = load_var_uint64(curr, &next);
 				CHECK_CURR_LAST(next - curr);
-				js[colname.str()] = x;
+				JsonWriter::appendUint(out, x);
 				curr = next;
 			}
 			break;
@@ -1173,20 +1670,21 @@ std::string Schema::toJsonStr(const char* row, size_t rowlen) const {
 							"'\\0' in StrZero is not at string end");
 					}
 				}
-				js[colname.str()] = std::string((char*)curr, len);
+				JsonWriter::appendString(out, fstring(curr, len));
 				curr += len + 1;
 			}
 			break;
 		case ColumnType::TwoStrZero: // Two Zero ended string
 			{
 				intptr_t n1 = strnlen((const char*)curr, last - curr);
-				auto& arr = js[colname.str()] = json::array();
-				arr.push_back(std::string((char*)curr, n1));
+				out->push_back('[');
+				JsonWriter::appendString(out, fstring(curr, n1));
+				out->push_back(',');
 				if (i < colnum - 1) {
 					CHECK_CURR_LAST(n1 + 1);
 					intptr_t n2 = strnlen((const char*)curr+n1+1, last-curr-n1-1);
 					CHECK_CURR_LAST(n1 + 1 + n2 + 1);
-					arr.push_back(std::string((char*)curr+n1+1, n2));
+					JsonWriter::appendString(out, fstring(curr+n1+1, n2));
 					curr += n1 + 1 + n2 + 1;
 				}
 				else { // the last column
@@ -1197,11 +1695,12 @@ std::string Schema::toJsonStr(const char* row, size_t rowlen) const {
 							THROW_STD(invalid_argument,
 								"second '\\0' in TwoStrZero is not at string end");
 						}
-						arr.push_back(std::string((char*)curr+n1+1, n2));
+						JsonWriter::appendString(out, fstring(curr+n1+1, n2));
 					} else {
-						arr.push_back(std::string(""));
+						JsonWriter::appendString(out, "");
 					}
 				}
+				out->push_back(']');
 			}
 			break;
 		case ColumnType::Binary:  // Prefixed by length(var_uint) in bytes
@@ -1209,11 +1708,11 @@ std::string Schema::toJsonStr(const char* row, size_t rowlen) const {
 				const byte* next;
 				intptr_t len = load_var_uint64(curr, &next);
 				CHECK_CURR_LAST3(next, last, len);
-				js[colname.str()] = std::string((char*)next, len);
+				JsonWriter::appendString(out, fstring(next, len));
 				curr = next + len;
 			}
 			else { // the last column
-				js[colname.str()] = std::string((char*)curr, last-curr);
+				JsonWriter::appendString(out, fstring(curr, last-curr));
 			}
 			break;
 		case ColumnType::CarBin:  // Prefixed by uint32 length
@@ -1223,16 +1722,223 @@ std::string Schema::toJsonStr(const char* row, size_t rowlen) const {
 				len = byte_swap(len);
 			#endif
 				CHECK_CURR_LAST3(curr+4, last, len);
-				js[colname.str()] = std::string((char*)curr+4, len);
+				JsonWriter::appendString(out, fstring(curr+4, len));
 				curr += 4 + len;
 			}
 			else { // the last column
-				js[colname.str()] = std::string((char*)curr, last-curr);
+				JsonWriter::appendString(out, fstring(curr, last-curr));
+			}
+			break;
+		}
+	}
+	out->push_back('}');
+}
+
+// Int is of the column size, the value must be in the range of the signed
+// or the unsigned Int, negative values are out of range of unsigned
+template<class Int>
+static Int parseJsonInt(fstring tok, bool isSigned) {
+	typedef typename std::make_signed<Int>::type   Sint;
+	typedef typename std::make_unsigned<Int>::type Uint;
+	std::string str = tok.str(); // tok is not '\0' ended
+	char* end = NULL;
+	errno = 0;
+	bool inRange;
+	Int x;
+	if (isSigned) {
+		llong y = strtoll(str.c_str(), &end, 10);
+		inRange = y >= llong(std::numeric_limits<Sint>::min())
+			   && y <= llong(std::numeric_limits<Sint>::max());
+		x = Int(y);
+	} else {
+		ullong y = strtoull(str.c_str(), &end, 10);
+		inRange = '-' != str.c_str()[0]
+			   && y <= ullong(std::numeric_limits<Uint>::max());
+		x = Int(y);
+	}
+	if (*end || str.empty() || ERANGE == errno || !inRange) {
+		THROW_STD(invalid_argument, "bad integer: %s", str.c_str());
+	}
+	return x;
+}
+
+static long double parseJsonFloat(fstring tok) {
+	std::string str = tok.str();
+	char* end = NULL;
+	long double x = strtold(str.c_str(), &end);
+	if (*end || str.empty()) {
+		THROW_STD(invalid_argument, "bad number: %s", str.c_str());
+	}
+	return x;
+}
+
+// values of an object are found in the first pass, then they are encoded
+// in schema order, only strings are copied by decoding
+size_t Schema::parseJson(fstring json, valvec<byte>* row) const {
+	const size_t colnum = m_columnsMeta.end_i();
+	static thread_local valvec<fstring> values;
+	static thread_local valvec<byte> key;
+	values.resize(colnum);
+	values.fill(fstring());
+	size_t parsed = 0;
+	JsonReader rd(json);
+	rd.expect('{');
+	if (!rd.consume('}')) {
+		do {
+			if (rd.peek() != '"')
+				rd.error("expect a key");
+			key.erase_all();
+			JsonReader::decodeString(rd.skipValue(), &key);
+			rd.expect(':');
+			fstring val = rd.skipValue();
+			size_t columnId = getColumnId(fstring(key));
+			if (columnId < colnum) { // unknown keys are ignored
+				parsed += values[columnId].empty();
+				values[columnId] = val;
+			}
+		} while (rd.consume(','));
+		rd.expect('}');
+	}
+	if (rd.peek()) {
+		rd.error("extra chars after object");
+	}
+	row->erase_all();
+	for (size_t i = 0; i < colnum; ++i) {
+		const ColumnMeta& colmeta = m_columnsMeta.val(i);
+		fstring val = values[i];
+		if (val == "null")
+			val = fstring();
+		const bool isStr = !val.empty() && '"' == val[0];
+		if (isStr && !colmeta.isString() && ColumnType::TwoStrZero != colmeta.type
+				&& ColumnType::Uuid != colmeta.type && ColumnType::Fixed != colmeta.type) {
+			THROW_STD(invalid_argument, "column %s is not a string"
+				, m_columnsMeta.key(i).c_str());
+		}
+		const bool isNum = !val.empty() && !isStr;
+		switch (colmeta.type) {
+		default:
+			THROW_STD(invalid_argument,
+				"type=%s is not supported", columnTypeStr(colmeta.type));
+			break;
+		case ColumnType::Uint08:
+		case ColumnType::Sint08:
+			row->push_back(isNum ? parseJsonInt<byte>(val, ColumnType::Sint08 == colmeta.type) : 0);
+			break;
+		case ColumnType::Uint16:
+		case ColumnType::Sint16:
+			unaligned_save<uint16_t>(row->grow_no_init(2), isNum ?
+				parseJsonInt<uint16_t>(val, ColumnType::Sint16 == colmeta.type) : 0);
+			break;
+		case ColumnType::Uint32:
+		case ColumnType::Sint32:
+			unaligned_save<uint32_t>(row->grow_no_init(4), isNum ?
+				parseJsonInt<uint32_t>(val, ColumnType::Sint32 == colmeta.type) : 0);
+			break;
+		case ColumnType::Uint64:
+		case ColumnType::Sint64:
+			unaligned_save<uint64_t>(row->grow_no_init(8), isNum ?
+				parseJsonInt<uint64_t>(val, ColumnType::Sint64 == colmeta.type) : 0);
+			break;
+		case ColumnType::Uint128:
+		case ColumnType::Sint128:
+			{
+				// TODO: int128, same as appendJson
+				llong x = isNum ? parseJsonInt<llong>(val, ColumnType::Sint128 == colmeta.type) : 0;
+				unaligned_save<llong>(row->grow_no_init(8), x);
+				unaligned_save<llong>(row->grow_no_init(8), x < 0 && ColumnType::Sint128 == colmeta.type ? -1 : 0);
+			}
+			break;
+		case ColumnType::Float32:
+			unaligned_save<float>(row->grow_no_init(4), isNum ? float(parseJsonFloat(val)) : 0);
+			break;
+		case ColumnType::Float64:
+			unaligned_save<double>(row->grow_no_init(8), isNum ? double(parseJsonFloat(val)) : 0);
+			break;
+		case ColumnType::Float128:
+			{
+				long double x = isNum ? parseJsonFloat(val) : 0;
+				byte* p = row->grow(16); // zero padded
+				memcpy(p, &x, std::min<size_t>(sizeof(x), 16));
+			}
+			break;
+		case ColumnType::Uuid:
+		case ColumnType::Fixed:
+			{
+				size_t oldsize = row->size();
+				if (isStr)
+					JsonReader::decodeString(val, row);
+				size_t fixlen = ColumnType::Uuid == colmeta.type ? 16 : colmeta.fixedLen;
+				if (row->size() - oldsize > fixlen) {
+					THROW_STD(invalid_argument, "column %s is longer than %zd"
+						, m_columnsMeta.key(i).c_str(), fixlen);
+				}
+				row->resize(oldsize + fixlen, 0);
+			}
+			break;
+		case ColumnType::VarSint:
+			{
+				byte* end = save_var_int64(row->grow_no_init(10),
+					isNum ? parseJsonInt<int64_t>(val, true) : 0);
+				row->risk_set_size(end - row->data());
+			}
+			break;
+		case ColumnType::VarUint:
+			{
+				byte* end = save_var_uint64(row->grow_no_init(10),
+					isNum ? parseJsonInt<uint64_t>(val, false) : 0);
+				row->risk_set_size(end - row->data());
+			}
+			break;
+		case ColumnType::StrZero:
+			if (isStr)
+				JsonReader::decodeString(val, row);
+			if (i < colnum-1) {
+				row->push_back('\0');
+			}
+			break;
+		case ColumnType::TwoStrZero:
+			if (!val.empty()) {
+				JsonReader arr(val);
+				arr.expect('[');
+				JsonReader::decodeString(arr.skipValue(), row);
+				row->push_back('\0');
+				arr.expect(',');
+				JsonReader::decodeString(arr.skipValue(), row);
+				arr.expect(']');
+			}
+			else {
+				row->push_back('\0');
+			}
+			if (i < colnum-1) {
+				row->push_back('\0');
+			}
+			break;
+		case ColumnType::Binary:
+		case ColumnType::CarBin:
+			{
+				static thread_local valvec<byte> bin;
+				bin.erase_all();
+				if (isStr)
+					JsonReader::decodeString(val, &bin);
+				if (i < colnum-1) {
+					if (ColumnType::Binary == colmeta.type) {
+						byte* end = save_var_uint64(row->grow_no_init(10), bin.size());
+						row->risk_set_size(end - row->data());
+					}
+					else {
+						uint32_t len = uint32_t(bin.size());
+					#if defined(BOOST_BIG_ENDIAN)
+						len = byte_swap(len);
+					#endif
+						unaligned_save<uint32_t>(row->grow_no_init(4), len);
+					}
+				}
+				row->append(bin);
 			}
 			break;
 		}
 	}
-	return js.dump();
+	return parsed;
 }
 
 ColumnType Schema::getColumnType(size_t columnId) const {
@@ -2003,17 +2709,64 @@ const llong  DEFAULT_compressingWorkMemSize = 2LL * 1024 * 1024 * 1024;
 const llong  DEFAULT_maxWritingSegmentSize  = 3LL * 1024 * 1024 * 1024;
 const size_t DEFAULT_minMergeSegNum         = 5;
 const size_t DEFAULT_suggestWritableSegNum  = 4;
+const size_t DEFAULT_insertIdReserveNum     = 1;
 const double DEFAULT_purgeDeleteThreshold   = 0.10;
+const llong  DEFAULT_maxMergeSegSize        = 64LL * 1024 * 1024 * 1024;
+const size_t DEFAULT_maxMergeFanIn          = 10;
+const double DEFAULT_mergeSizeRatio         = 4.0;
+const llong  DEFAULT_mergeTierFloorSize     = 64LL * 1024 * 1024;
+const size_t DEFAULT_writeSlowdownFrozenSegNum   = 8;
+const size_t DEFAULT_writeStopFrozenSegNum       = 20;
+const size_t DEFAULT_writeSlowdownBytesPerSecond = 16 * 1024 * 1024;
+const llong  DEFAULT_coldSegmentAgeSeconds       = 7 * 24 * 3600;
 
 SchemaConfig::SchemaConfig() {
 	m_compressingWorkMemSize = DEFAULT_compressingWorkMemSize;
 	m_maxWritingSegmentSize = DEFAULT_maxWritingSegmentSize;
+	m_minWritingSegmentSize = DEFAULT_maxWritingSegmentSize / 16;
+	m_autoTuneWrSegSize = false;
 	m_minMergeSegNum = DEFAULT_minMergeSegNum;
 	m_suggestWritableSegNum = DEFAULT_suggestWritableSegNum;
+	m_insertIdReserveNum = DEFAULT_insertIdReserveNum;
 	m_writeThrottleBytesPerSecond = 0; // no limit
+	m_writeSlowdownFrozenSegNum = DEFAULT_writeSlowdownFrozenSegNum;
+	m_writeStopFrozenSegNum = DEFAULT_writeStopFrozenSegNum;
+	m_writeSlowdownCompressQueue = 0;
+	m_writeStopCompressQueue = 0;
+	m_writeSlowdownWritableBytes = 0;
+	m_writeStopWritableBytes = 0;
+	m_writeSlowdownBytesPerSecond = DEFAULT_writeSlowdownBytesPerSecond;
+	m_compactWriteBytesPerSecond = 0; // no limit
+	m_compactWriteMinBytesPerSecond = 0;
+	m_compactReadLatencyMicros = 0;
 	m_purgeDeleteThreshold = DEFAULT_purgeDeleteThreshold;
+	m_maxMergeSegSize = DEFAULT_maxMergeSegSize;
+	m_maxMergeFanIn = DEFAULT_maxMergeFanIn;
+	m_mergeSizeRatio = DEFAULT_mergeSizeRatio;
+	m_mergeTierFloorSize = DEFAULT_mergeTierFloorSize;
+	m_valueCacheSize = 0;
+	m_coldSegmentAgeSeconds = DEFAULT_coldSegmentAgeSeconds;
+	m_coldSegmentMaxReadsPerSec = 0;
+	m_ttlColumnId = size_t(-1);
+	m_ttlSeconds = 0;
+	m_timePartitionColumnId = size_t(-1);
+	m_timePartitionSeconds = 0;
+	m_hotColumnUpdateRatio = 0;
+	m_hotColumnMinUpdates = 10000;
 	m_usePermanentRecordId = false;
 	m_enableSnapshot = false;
+	m_incrementalPurge = false;
+	m_enablePerfCounters = true;
+	m_verifySegmentsOnLoad = false;
+	m_asyncIndex = false;
+	m_numaNode = -1;
+	m_numaInterleaveMmap = false;
+	m_numaMmapMinBytes = 1 << 20;
+	m_scrubIntervalSeconds = 0;
+	m_scrubBytesPerSecond = 16 << 20;
+	m_scrubQuarantine = false;
+	m_segmentLoadPolicy = SegmentLoadPolicy::schema;
+	m_tableLock = TableLockType::queuing;
 }
 SchemaConfig::~SchemaConfig() {
 }
@@ -2221,6 +2974,8 @@ public:
 static EntropyTypeNameMap g_strToEntropyType;
 #endif
 
+llong getJsonSizeValue(const terark::json& js, const std::string& key, llong Default);
+
 static void
 parseJsonColgroup(Schema& schema, const terark::json& js, int sufarrMinFreq) {
 	schema.m_isInplaceUpdatable = getJsonValue(js, "inplaceUpdatable", false);
@@ -2231,11 +2986,16 @@ parseJsonColgroup(Schema& schema, const terark::json& js, int sufarrMinFreq) {
 #endif
 	schema.m_dictZipUseSuffixArrayLocalMatch =
 		getJsonValue(js, "dictZipUseSuffixArrayLocalMatch", false);
+	schema.m_dictZipReuse = getJsonValue(js, "dictZipReuse", false);
 	schema.m_nltDelims  = getJsonValue(js, "nltDelims", std::string());
 	schema.m_maxFragLen = getJsonValue(js, "maxFragLen", 0);
 	schema.m_minFragLen = getJsonValue(js, "minFragLen", 0);
 	schema.m_sufarrMinFreq = getJsonValue(js, "sufarrMinFreq", sufarrMinFreq);
 	schema.m_mmapPopulate = getJsonValue(js, "mmapPopulate", false);
+	schema.m_appendonlyBlockZip = getJsonValue(js, "appendonlyBlockZip", false);
+	schema.m_readaheadSize = size_t(getJsonSizeValue(js, "readaheadSize",
+										llong(DEFAULT_readaheadSize)));
+	schema.m_valueLogThreshold = size_t(getJsonSizeValue(js, "valueLogThreshold", 0));
 	//  512: rank_select_se_512
 	//  256: rank_select_se_256
 	// -256: rank_select_il_256
@@ -2731,6 +3491,14 @@ if (colgroupsIter != meta.end()) {
 	m_compressingWorkMemSize = getJsonSizeValue(meta, "CompressingWorkMemSize", m_compressingWorkMemSize);
 	m_maxWritingSegmentSize = getJsonSizeValue(meta, "MaxWrSegSize", DEFAULT_maxWritingSegmentSize);
 	m_maxWritingSegmentSize = getJsonSizeValue(meta, "MaxWritingSegmentSize", m_maxWritingSegmentSize);
+	m_minWritingSegmentSize = getJsonSizeValue(
+		meta, "MinWritingSegmentSize", m_maxWritingSegmentSize / 16);
+	m_autoTuneWrSegSize = getJsonValue(meta, "AutoTuneWrSegSize", false);
+	if (m_minWritingSegmentSize > m_maxWritingSegmentSize) {
+		THROW_STD(invalid_argument
+			, "MinWritingSegmentSize = %lld, must be <= MaxWritingSegmentSize = %lld"
+			, m_minWritingSegmentSize, m_maxWritingSegmentSize);
+	}
 
 	m_minMergeSegNum = getJsonValue(
 		meta, "MinMergeSegNum", DEFAULT_minMergeSegNum);
@@ -2738,10 +3506,117 @@ if (colgroupsIter != meta.end()) {
 		meta, "SuggestWritableSegNum", DEFAULT_suggestWritableSegNum);
 	m_writeThrottleBytesPerSecond = getJsonSizeValue(
 		meta, "WriteThrottleBytesPerSecond", 0);
+	m_writeSlowdownFrozenSegNum = getJsonValue(
+		meta, "WriteSlowdownFrozenSegNum", DEFAULT_writeSlowdownFrozenSegNum);
+	m_writeStopFrozenSegNum = getJsonValue(
+		meta, "WriteStopFrozenSegNum", DEFAULT_writeStopFrozenSegNum);
+	m_writeSlowdownCompressQueue = getJsonValue(
+		meta, "WriteSlowdownCompressQueue", size_t(0));
+	m_writeStopCompressQueue = getJsonValue(
+		meta, "WriteStopCompressQueue", size_t(0));
+	m_writeSlowdownWritableBytes = getJsonSizeValue(
+		meta, "WriteSlowdownWritableBytes", 0);
+	m_writeStopWritableBytes = getJsonSizeValue(
+		meta, "WriteStopWritableBytes", 0);
+	m_writeSlowdownBytesPerSecond = getJsonSizeValue(
+		meta, "WriteSlowdownBytesPerSecond", DEFAULT_writeSlowdownBytesPerSecond);
+	m_compactWriteBytesPerSecond = getJsonSizeValue(
+		meta, "CompactWriteBytesPerSecond", 0);
+	m_compactWriteMinBytesPerSecond = getJsonSizeValue(
+		meta, "CompactWriteMinBytesPerSecond", m_compactWriteBytesPerSecond / 16);
+	m_compactReadLatencyMicros = getJsonValue(
+		meta, "CompactReadLatencyMicros", size_t(0));
+	if (m_compactWriteBytesPerSecond &&
+			m_compactWriteMinBytesPerSecond > m_compactWriteBytesPerSecond) {
+		THROW_STD(invalid_argument
+			, "CompactWriteMinBytesPerSecond = %zd, must be <= CompactWriteBytesPerSecond = %zd"
+			, m_compactWriteMinBytesPerSecond, m_compactWriteBytesPerSecond);
+	}
 	m_purgeDeleteThreshold = getJsonValue(
 		meta, "PurgeDeleteThreshold", DEFAULT_purgeDeleteThreshold);
+	m_mergePolicy = getJsonValue(meta, "MergePolicy", std::string());
+	m_maxMergeSegSize = getJsonSizeValue(
+		meta, "MaxMergeSegSize", DEFAULT_maxMergeSegSize);
+	m_maxMergeFanIn = getJsonValue(
+		meta, "MaxMergeFanIn", DEFAULT_maxMergeFanIn);
+	m_mergeSizeRatio = getJsonValue(
+		meta, "MergeSizeRatio", DEFAULT_mergeSizeRatio);
+	m_mergeTierFloorSize = getJsonSizeValue(
+		meta, "MergeTierFloorSize", DEFAULT_mergeTierFloorSize);
+	m_valueCacheSize = getJsonSizeValue(meta, "ValueCacheSize", 0);
+	m_coldSegmentPath = getJsonValue(meta, "ColdSegmentPath", std::string());
+	m_coldSegmentAgeSeconds = getJsonValue(
+		meta, "ColdSegmentAgeSeconds", DEFAULT_coldSegmentAgeSeconds);
+	m_coldSegmentMaxReadsPerSec = getJsonValue(
+		meta, "ColdSegmentMaxReadsPerSec", 0.0);
+	if (m_coldSegmentAgeSeconds < 0 || m_coldSegmentMaxReadsPerSec < 0) {
+		THROW_STD(invalid_argument
+			, "ColdSegmentAgeSeconds = %lld, ColdSegmentMaxReadsPerSec = %f, must be >= 0"
+			, m_coldSegmentAgeSeconds, m_coldSegmentMaxReadsPerSec);
+	}
+	m_hotColumnUpdateRatio = getJsonValue(meta, "HotColumnUpdateRatio", 0.0);
+	m_hotColumnMinUpdates = getJsonValue(meta, "HotColumnMinUpdates", size_t(10000));
+	if (m_hotColumnUpdateRatio < 0 || m_hotColumnUpdateRatio > 1) {
+		THROW_STD(invalid_argument
+			, "HotColumnUpdateRatio = %f, must be in [0, 1]", m_hotColumnUpdateRatio);
+	}
+	if (m_maxMergeFanIn < 2) {
+		THROW_STD(invalid_argument
+			, "MaxMergeFanIn = %zd, must be >= 2", m_maxMergeFanIn);
+	}
+	if (m_mergeSizeRatio < 1.0) {
+		THROW_STD(invalid_argument
+			, "MergeSizeRatio = %f, must be >= 1.0", m_mergeSizeRatio);
+	}
 
 	m_enableSnapshot = getJsonValue(meta, "EnableSnapshot", false);
+	m_incrementalPurge = getJsonValue(meta, "IncrementalPurge", false);
+	m_enablePerfCounters = getJsonValue(meta, "EnablePerfCounters", true);
+	m_verifySegmentsOnLoad = getJsonValue(meta, "VerifySegmentsOnLoad", false);
+	m_asyncIndex = getJsonValue(meta, "AsyncIndex", false);
+	m_numaNode = getJsonValue(meta, "NumaNode", -1);
+	m_numaInterleaveMmap = getJsonValue(meta, "NumaInterleaveMmap", false);
+	m_numaMmapMinBytes = getJsonSizeValue(meta, "NumaMmapMinBytes", 1 << 20);
+	if (m_numaNode < -1) {
+		THROW_STD(invalid_argument, "NumaNode = %d, must be >= -1", m_numaNode);
+	}
+	m_scrubIntervalSeconds = getJsonValue(meta, "ScrubIntervalSeconds", llong(0));
+	m_scrubBytesPerSecond = getJsonSizeValue(meta, "ScrubBytesPerSecond", 16 << 20);
+	m_scrubQuarantine = getJsonValue(meta, "ScrubQuarantine", false);
+	if (m_scrubIntervalSeconds < 0) {
+		THROW_STD(invalid_argument
+			, "ScrubIntervalSeconds = %lld, must be >= 0", m_scrubIntervalSeconds);
+	}
+{
+	std::string policy = getJsonValue(meta, "SegmentLoadPolicy", std::string());
+	if (policy.empty() || "schema" == policy)
+		m_segmentLoadPolicy = SegmentLoadPolicy::schema;
+	else if ("eager" == policy)
+		m_segmentLoadPolicy = SegmentLoadPolicy::eager;
+	else if ("lazy" == policy)
+		m_segmentLoadPolicy = SegmentLoadPolicy::lazy;
+	else if ("background" == policy)
+		m_segmentLoadPolicy = SegmentLoadPolicy::background;
+	else
+		THROW_STD(invalid_argument
+			, "SegmentLoadPolicy = %s, must be one of eager, lazy, background"
+			, policy.c_str());
+}
+{
+	// env overrides the default, such as by the pick of lock_bench
+	const char* env = getenv("TerarkDB_TableLock");
+	std::string lock = getJsonValue(meta, "TableLock", std::string(env ? env : ""));
+	if (lock.empty() || "queuing" == lock)
+		m_tableLock = TableLockType::queuing;
+	else if ("spin" == lock)
+		m_tableLock = TableLockType::spin;
+	else if ("speculative" == lock)
+		m_tableLock = TableLockType::speculative;
+	else
+		THROW_STD(invalid_argument
+			, "TableLock = %s, must be one of queuing, spin, speculative"
+			, lock.c_str());
+}
 {
 	// PermanentRecordId means record id will not be changed by table reload
 	auto it = meta.find("UsePermanentRecordId");
@@ -2756,10 +3631,18 @@ if (colgroupsIter != meta.end()) {
 		m_usePermanentRecordId = m_enableSnapshot;
 	}
 }
-	if (m_enableSnapshot) {
-		m_snapshotSchema = new Schema();
-		m_snapshotSchema->m_columnsMeta.insert_i("__mvccDeletionTime", ColumnMeta(ColumnType::Uint64));
-		m_snapshotSchema->compile();
+	m_insertIdReserveNum = getJsonValue(
+		meta, "InsertIdReserveNum", DEFAULT_insertIdReserveNum);
+	if (m_insertIdReserveNum < 1 || m_insertIdReserveNum > 65536) {
+		THROW_STD(invalid_argument
+			, "InsertIdReserveNum = %zd, must be in [1, 65536]"
+			, m_insertIdReserveNum);
+	}
+	if (m_enableSnapshot && m_insertIdReserveNum > 1) {
+		// record id is also used as snapshot version, it must be
+		// allocated in time order
+		THROW_STD(invalid_argument
+			, "When EnableSnapshot, InsertIdReserveNum must be 1");
 	}
 
 	auto tableIndex = meta.find("TableIndex");
@@ -2810,7 +3693,16 @@ if (tableIndex != meta.end()) {
 //		indexSchema->m_isPrimary = getJsonValue(index, "primary", false);
 		indexSchema->m_isUnique  = getJsonValue(index, "unique" , false);
 		indexSchema->m_enableLinearScan = getJsonValue(index, "enableLinearScan", false);
+		indexSchema->m_enableLearnedSearch = getJsonValue(index, "learnedSearch", false);
+		indexSchema->m_writableBtree = getJsonValue(index, "writableBtree", false);
+		indexSchema->m_writableHash = getJsonValue(index, "writableHash", false);
+		indexSchema->m_compactKey = getJsonValue(index, "compactKey", false);
+		indexSchema->m_nltLazyIdToKey = getJsonValue(index, "nltLazyIdToKey", false);
+		indexSchema->m_nltHugePage = getJsonValue(index, "nltHugePage", false);
+		indexSchema->m_bitmapIndex = getJsonValue(index, "bitmap", false);
 		indexSchema->m_rankSelectClass = getJsonValue(index, "rs", 512);
+		indexSchema->m_bloomBitsPerKey = limitInBound(
+			getJsonValue(index, "bloomBitsPerKey", 0), 0, 32);
 		indexSchema->m_nltNestLevel = (byte)limitInBound(
 			getJsonValue(index, "nltNestLevel", DEFAULT_nltNestLevel), 1u, 20u);
 
@@ -2836,6 +3728,66 @@ if (tableIndex != meta.end()) {
 	}
 */
 	compileSchema();
+{
+	std::string ttlColumn = getJsonValue(meta, "TtlColumn", std::string());
+	m_ttlSeconds = getJsonValue(meta, "TtlSeconds", llong(0));
+	if (!ttlColumn.empty()) {
+		size_t columnId = m_rowSchema->getColumnId(ttlColumn);
+		if (columnId >= m_rowSchema->columnNum()) {
+			THROW_STD(invalid_argument
+				, "TtlColumn '%s' is not found in RowSchema", ttlColumn.c_str());
+		}
+		// zone maps of segments have min/max of such columns
+		const ColumnMeta& colmeta = m_rowSchema->getColumnMeta(columnId);
+		if (!colmeta.isInteger() || 0 == colmeta.fixedLen ||
+				isInplaceUpdatableColumn(columnId)) {
+			THROW_STD(invalid_argument
+				, "TtlColumn '%s' must be a fixed integer column, not inplaceUpdatable"
+				, ttlColumn.c_str());
+		}
+		if (m_ttlSeconds < 0) {
+			THROW_STD(invalid_argument
+				, "TtlSeconds = %lld, must be >= 0", m_ttlSeconds);
+		}
+		m_ttlColumnId = columnId;
+	}
+}
+{
+	std::string partColumn = getJsonValue(meta, "TimePartitionColumn", std::string());
+	m_timePartitionSeconds = getJsonValue(meta, "TimePartitionSeconds", llong(86400));
+	if (!partColumn.empty()) {
+		size_t columnId = m_rowSchema->getColumnId(partColumn);
+		if (columnId >= m_rowSchema->columnNum()) {
+			THROW_STD(invalid_argument
+				, "TimePartitionColumn '%s' is not found in RowSchema", partColumn.c_str());
+		}
+		const ColumnMeta& colmeta = m_rowSchema->getColumnMeta(columnId);
+		if (!colmeta.isInteger() || 0 == colmeta.fixedLen ||
+				isInplaceUpdatableColumn(columnId)) {
+			THROW_STD(invalid_argument
+				, "TimePartitionColumn '%s' must be a fixed integer column, not inplaceUpdatable"
+				, partColumn.c_str());
+		}
+		if (m_timePartitionSeconds <= 0) {
+			THROW_STD(invalid_argument
+				, "TimePartitionSeconds = %lld, must be > 0", m_timePartitionSeconds);
+		}
+		// dropped partitions shift record ids of later segments
+		if (m_usePermanentRecordId) {
+			THROW_STD(invalid_argument
+				, "TimePartitionColumn '%s' needs UsePermanentRecordId = false"
+				, partColumn.c_str());
+		}
+		m_timePartitionColumnId = columnId;
+	}
+}
+	if (SegmentLoadPolicy::schema != m_segmentLoadPolicy) {
+		bool populate = SegmentLoadPolicy::eager == m_segmentLoadPolicy;
+		for (size_t i = 0; i < getColgroupNum(); ++i)
+			m_colgroupSchemaSet->m_nested.elem_at(i)->m_mmapPopulate = populate;
+		for (size_t i = 0; i < getIndexNum(); ++i)
+			m_indexSchemaSet->m_nested.elem_at(i)->m_mmapPopulate = populate;
+	}
 }
 
 void SchemaConfig::saveJsonFile(fstring jsonFile) const {
@@ -180,6 +180,16 @@ namespace terark { namespace db {
 		}
 	};
 
+	// specialized codec of a row layout, it is generated by
+	// terark-db-schema-compile, see row_codec.hpp
+	struct RowCodec {
+		uint64_t schemaHash; // Schema::rowCodecHash()
+		size_t   columnNum;
+		void (*parseRowAppend)(const Schema&, fstring row, size_t start, ColumnVec*);
+		void (*combineRowAppend)(const Schema&, const ColumnVec&, valvec<byte>*);
+		void (*selectParent)(const Schema&, const ColumnVec& parentCols, valvec<byte>*);
+	};
+
 	class TERARK_DB_DLL Schema : public RefCounter {
 		friend class SchemaSet;
 	public:
@@ -201,6 +211,15 @@ namespace terark { namespace db {
 		void selectParent(const ColumnVec& parentCols, valvec<byte>* myRowData) const;
 		void selectParent(const ColumnVec& parentCols, ColumnVec* myCols) const;
 
+		/// hash of column types and fixed lengths, names are not included
+		uint64_t rowCodecHash() const;
+		/// codecs must be registered before the schema is compiled
+		static void registerRowCodec(const RowCodec*);
+		static const RowCodec* findRowCodec(uint64_t schemaHash);
+		const RowCodec* getRowCodec() const { return m_rowCodec; }
+		static void throwRowOutOfRange(const Schema&, size_t columnId,
+									   size_t len, size_t remain);
+
 		size_t parentColumnId(size_t myColumnId) const {
 			assert(m_proj.size() == m_columnsMeta.end_i());
 			assert(myColumnId < m_proj.size());
@@ -213,10 +232,24 @@ namespace terark { namespace db {
 		void byteLexEncode(byte* data, size_t size) const;
 		void byteLexDecode(byte* data, size_t size) const;
 
+		///@{ compact keys of writable indexes, integers are order-preserving
+		/// varints, others are same as byteLexEncode, memcmp order of the
+		/// compact keys is the order of columns
+		bool canCompactKey() const;
+		void compactKeyEncode(fstring key, valvec<byte>* enc) const;
+		void compactKeyDecode(fstring enc, valvec<byte>* key) const;
+		///@}
+
 		size_t parseDelimText(char delim, fstring text, valvec<byte>* row) const;
 
 		std::string toJsonStr(fstring row) const;
 		std::string toJsonStr(const char* row, size_t rowlen) const;
+		/// json object of row is appended to out, without a json DOM
+		void appendJson(fstring row, std::string* out) const;
+		/// parse a json object of toJsonStr, absent and null columns are
+		/// 0 or empty, unknown keys are ignored
+		///@returns number of columns in the object
+		size_t parseJson(fstring json, valvec<byte>* row) const;
 
 		ColumnType getColumnType(size_t columnId) const;
 		fstring getColumnName(size_t columnId) const;
@@ -225,6 +258,9 @@ namespace terark { namespace db {
 		size_t columnNum() const { return m_columnsMeta.end_i(); }
 
 		size_t getFixedRowLen() const { return m_fixedLen; }
+		bool isFixedOffsetColumn(size_t columnId) const {
+			return columnId < m_fixedPrefixNum;
+		}
 
 		bool should_use_FixedLenStore() const;
 
@@ -272,11 +308,23 @@ namespace terark { namespace db {
 		// if not zero, len of (m_lastVarLenCol-1) is omitted
 		size_t m_lastVarLenCol;
 		size_t m_restFixLenSum; // len sum of [m_lastVarLenCol, colnum)
+		// columns [0, m_fixedPrefixNum) are fixed length, they are at
+		// ColumnMeta::fixedOffset of every row, even if row is var length
+		size_t m_fixedPrefixNum;
+		size_t m_fixedPrefixLen; // len sum of [0, m_fixedPrefixNum)
+		// {fixedOffset, fixedLen} of [0, m_fixedPrefixNum), parseRow copies
+		// them to ColumnVec at once, only the var length tail is parsed
+		valvec<ColumnVec::Elem> m_fixedPrefixCols;
+		size_t m_readaheadSize; // async readahead window of sequential file scans
+		// values which are not smaller are kept in a value log file by the
+		// writable store of trbdb, 0 is disabled
+		size_t m_valueLogThreshold;
 		int    m_minFragLen;
 		int    m_maxFragLen;
 		int    m_sufarrMinFreq;
 		int    m_rankSelectClass;
 		int    m_checksumLevel;
+		int    m_bloomBitsPerKey; // just for index schema, 0 is disabled
 		float  m_dictZipSampleRatio;
 		byte   m_nltNestLevel;
 		byte   m_dictZipEntropyType; // DictBlobStore::EntropyAlgo
@@ -288,9 +336,18 @@ namespace terark { namespace db {
 		bool   m_canEncodeToLexByteComparable  : 1;
 		bool   m_useFastZip : 1;
 		bool   m_dictZipUseSuffixArrayLocalMatch : 1;
+		bool   m_dictZipReuse : 1; // save dict samples, reuse them on merge
 		bool   m_isInplaceUpdatable: 1;
 		bool   m_enableLinearScan  : 1;
+		bool   m_enableLearnedSearch : 1; // FixedLenKeyIndex model
 		bool   m_mmapPopulate : 1;
+		bool   m_appendonlyBlockZip : 1; // use BlockZipAppendonlyStore
+		bool   m_writableBtree : 1; // trbdb writable index is a B+tree
+		bool   m_writableHash : 1; // trbdb unique writable index has a hash
+		bool   m_compactKey : 1; // writable index stores compactKeyEncode keys
+		bool   m_nltLazyIdToKey : 1; // nlt index does not save id to key map
+		bool   m_nltHugePage : 1; // nlt index dfa is copied into huge pages
+		bool   m_bitmapIndex : 1; // readonly index is a BitmapIndex if it fits
 		static_bitmap<MaxProjColumns> m_keepCols;
 
 		// used for ordered index, m_indexOrder.is1(i) means i'th column
@@ -315,6 +372,7 @@ namespace terark { namespace db {
 	*/
 		const Schema*    m_parent;
 		valvec<size_t>   m_proj;
+		const RowCodec*  m_rowCodec; // nullptr: interpret m_columnsMeta
 
 	public:
 		// Helpers for define & serializing object
@@ -521,6 +579,21 @@ namespace terark { namespace db {
 	};
 	typedef boost::intrusive_ptr<SchemaSet> SchemaSetPtr;
 
+	// how mmap'ed files of readonly segments are loaded on table load
+	enum class SegmentLoadPolicy : unsigned char {
+		schema,     // by mmapPopulate of each index/colgroup schema
+		eager,      // populate all files on mmap
+		lazy,       // page in on demand
+		background, // lazy, and read files ahead by a warm-up thread
+	};
+
+	// the table lock DbTable::m_rwMutex, see TableRwMutex
+	enum class TableLockType : unsigned char {
+		queuing,     // tbb::queuing_rw_mutex, fair, scales with many writers
+		spin,        // tbb::spin_rw_mutex, cheapest when it is not contended
+		speculative, // tbb::speculative_spin_rw_mutex, elided by HTM(intel tsx)
+	};
+
 	class TERARK_DB_DLL SchemaConfig : public RefCounter {
 	public:
 		struct Colproject {
@@ -529,7 +602,6 @@ namespace terark { namespace db {
 		};
 		SchemaPtr      m_rowSchema;
 		SchemaPtr      m_wrtSchema;
-		SchemaPtr      m_snapshotSchema;
 		SchemaSetPtr   m_indexSchemaSet;
 		SchemaSetPtr   m_colgroupSchemaSet;
 		valvec<size_t> m_uniqIndices;
@@ -539,15 +611,83 @@ namespace terark { namespace db {
 		valvec<Colproject> m_colproject; // parallel with m_rowSchema
 		llong    m_compressingWorkMemSize;
 		llong    m_maxWritingSegmentSize;
+		// if m_autoTuneWrSegSize, the freeze size of writable segments is
+		// tuned in [m_minWritingSegmentSize, m_maxWritingSegmentSize] by
+		// the insert rate, see DbTable::tuneWrSegSizeInLock
+		llong    m_minWritingSegmentSize;
+		bool     m_autoTuneWrSegSize;
 		size_t   m_minMergeSegNum;
 		size_t   m_suggestWritableSegNum;
+		size_t   m_insertIdReserveNum; // per DbContext, 1 means no reserve
 		size_t   m_bestUniqueIndexId;
 		size_t   m_writeThrottleBytesPerSecond;
+		// write stall triggers by compaction backlog, 0 disables a trigger,
+		// writers are limited to m_writeSlowdownBytesPerSecond on slowdown
+		// and are blocked until the backlog is reduced on stop
+		size_t   m_writeSlowdownFrozenSegNum; // frozen unconverted wrseg
+		size_t   m_writeStopFrozenSegNum;
+		size_t   m_writeSlowdownCompressQueue; // global compress queue size
+		size_t   m_writeStopCompressQueue;
+		llong    m_writeSlowdownWritableBytes; // bytes of all wrseg
+		llong    m_writeStopWritableBytes;
+		size_t   m_writeSlowdownBytesPerSecond;
+		// writes of conv, purge and merge, 0 is unlimited, the rate is
+		// adapted in [min, max] to foreground reads if the latency target
+		// is not 0, see AdaptiveWriteRateLimiter
+		size_t   m_compactWriteBytesPerSecond;
+		size_t   m_compactWriteMinBytesPerSecond;
+		size_t   m_compactReadLatencyMicros;
 		double   m_purgeDeleteThreshold;
+		llong    m_maxMergeSegSize;    // merged segment size limit
+		size_t   m_maxMergeFanIn;      // max segments in one merge
+		double   m_mergeSizeRatio;     // max/min size of merged segments
+		llong    m_mergeTierFloorSize; // smaller segments are in one tier
+		std::string m_mergePolicy; // empty is builtin, see MergePolicy
+		llong    m_valueCacheSize; // 0 disables ValueCache
+		// tiered storage, stores of cold readonly segments are moved to
+		// m_coldSegmentPath, see DbTable::moveColdSegments
+		std::string m_coldSegmentPath; // empty disables tiered storage
+		llong    m_coldSegmentAgeSeconds;     // 0 disables the age trigger
+		double   m_coldSegmentMaxReadsPerSec; // 0 disables the read trigger
+		// rows whose integer column m_ttlColumnId + m_ttlSeconds <= now
+		// are expired, see DbTable::expireRows
+		size_t   m_ttlColumnId; // size_t(-1) disables ttl
+		llong    m_ttlSeconds;  // 0 means the column is the expire time
+		// rows are partitioned by floor(value / m_timePartitionSeconds) of
+		// the integer column m_timePartitionColumnId, writable segments roll
+		// on partition boundaries, merges never mix partitions, and whole
+		// segments of old partitions are removed by dropPartitionsOlderThan
+		size_t   m_timePartitionColumnId; // size_t(-1) disables partitions
+		llong    m_timePartitionSeconds;
+		// fixed width columns changed by more than m_hotColumnUpdateRatio
+		// of at least m_hotColumnMinUpdates updateRow are promoted to inplace
+		// updatable colgroups on table load, see DbTable::saveHotColumns
+		double   m_hotColumnUpdateRatio; // 0 disables promotion
+		size_t   m_hotColumnMinUpdates;
 		std::string m_writableSegmentClass;
 		std::string m_readonlySegmentClass;
 		bool     m_usePermanentRecordId;
 		bool     m_enableSnapshot;
+		bool     m_incrementalPurge; // keep colgroups by PurgeRemapStore
+		bool     m_enablePerfCounters; // latency histograms of DbTable ops
+		bool     m_verifySegmentsOnLoad; // by a background task after load
+		// non-unique indices of the writable segment are updated by a job on
+		// AsyncExecutor after the insert, see DbTable::waitAsyncIndex
+		bool     m_asyncIndex;
+		// background tasks and loads of the table run on cpus of the node
+		// and allocate on it, readonly mmaps of at least m_numaMmapMinBytes
+		// are preferred on the node, or interleaved on all nodes, see NumaEnv
+		int      m_numaNode; // -1 is no binding
+		bool     m_numaInterleaveMmap;
+		size_t   m_numaMmapMinBytes;
+		// files of readonly segments are verified by a SegmentScrubber in
+		// each m_scrubIntervalSeconds, corrupt segments are excluded from
+		// merges and purges if m_scrubQuarantine, see DbTable::getScrubStat
+		llong    m_scrubIntervalSeconds; // 0 disables the scrubber
+		size_t   m_scrubBytesPerSecond;
+		bool     m_scrubQuarantine;
+		SegmentLoadPolicy m_segmentLoadPolicy;
+		TableLockType m_tableLock;
 
 		SchemaConfig();
 		~SchemaConfig();
@@ -5,6 +5,7 @@
  *      Author: leipeng
  */
 #include "db_context.hpp"
+#include "async_exec.hpp"
 #include "db_segment.hpp"
 #include "db_table.hpp"
 #include <terark/num_to_str.hpp>
@@ -48,17 +49,21 @@ void DbContext::SegCtx::destory(SegCtx*& rp, size_t indexNum) {
 	::free(p);
 	rp = NULL;
 }
-void DbContext::SegCtx::reset(SegCtx* p, size_t indexNum, ReadableSegment* seg) {
-	for (size_t i = 0; i < indexNum; ++i) {
-		RefcntPtr_release(p->indexIter[i]);
+// the last ref of a dropped segment may unmap and delete its files, and the
+// iterators are released, so it is not paid by the next op of the context
+void DbContext::SegCtx::destoryAsync(std::vector<SegCtx*>&& vec, size_t indexNum) {
+	auto destoryAll = [indexNum](std::vector<SegCtx*>& v) {
+		for (SegCtx*& p : v)
+			destory(p, indexNum);
+	};
+	auto job = std::make_shared<std::vector<SegCtx*> >(std::move(vec));
+	try {
+		AsyncExecutor::instance().post([job, destoryAll]() { destoryAll(*job); });
+	}
+	catch (const std::exception&) {
+		destoryAll(*job); // the executor is stopped
 	}
-	RefcntPtr_release(p->wrtStoreIter);
-	assert(NULL != p->seg);
-	p->seg->release();
-	p->seg = seg;
-	seg->add_ref();
 }
-
 DbContextLink::DbContextLink() {
 //	m_prev = m_next = this;
 }
@@ -69,6 +74,51 @@ DbContextLink::~DbContextLink() {
 static std::atomic<size_t> g_dbCtxLiveCnt;
 static std::atomic<size_t> g_dbCtxCreatedCnt;
 
+DbContextArena::DbContextArena() {
+	m_cur = 0;
+	m_pos = 0;
+	m_depth = 0;
+	m_opCount = 0;
+	m_allocCount = 0;
+	m_blockCount = 0;
+}
+
+DbContextArena::~DbContextArena() {
+	assert(0 == m_depth);
+	for (auto& b : m_blocks)
+		::free(b.base);
+}
+
+size_t DbContextArena::memSize() const {
+	size_t bytes = m_blocks.capacity() * sizeof(Block);
+	for (auto& b : m_blocks)
+		bytes += b.size;
+	return bytes;
+}
+
+// current block is full, use the next block which is large enough,
+// blocks skipped over are just unused until the arena is rewound
+byte* DbContextArena::allocSlow(size_t bytes, size_t align) {
+	assert(align <= 16); // malloc alignment
+	(void)align;
+	size_t i = m_cur < m_blocks.size() ? m_cur + 1 : m_cur;
+	while (i < m_blocks.size() && m_blocks[i].size < bytes)
+		++i;
+	if (i == m_blocks.size()) {
+		size_t size = m_blocks.empty() ? 4096 : m_blocks.back().size * 2;
+		while (size < bytes)
+			size *= 2;
+		byte* base = (byte*)::malloc(size);
+		if (NULL == base)
+			throw std::bad_alloc();
+		m_blocks.push_back({base, size});
+		m_blockCount++;
+	}
+	m_cur = i;
+	m_pos = bytes;
+	return m_blocks[i].base;
+}
+
 DbContext::DbContext(const DbTable* tab)
     : m_tab(const_cast<DbTable*>(tab))
     , syncOnCommit(false)
@@ -77,6 +127,7 @@ DbContext::DbContext(const DbTable* tab)
 	size_t oldtab_segArrayUpdateSeq = tab->getSegArrayUpdateSeq();
 //	tab->registerDbContext(this);
 	regexMatchMemLimit = 16*1024*1024; // 16MB
+	regexMatchMaxResults = 0;
 	size_t indexNum = tab->getIndexNum();
 	size_t segNum = tab->getSegNum();
 	m_segCtx.resize(segNum, NULL);
@@ -85,13 +136,17 @@ DbContext::DbContext(const DbTable* tab)
 		sctx[i] = SegCtx::create(tab->getSegmentPtr(i), indexNum);
 	}
 	m_rowNumVec.assign(tab->m_rowNumVec);
+	m_segLocator.build(m_rowNumVec.data(), segNum);
 
-	// record id is also used as a snapshot version
+	// max visible record id, it is the snapshot bound of new rows
 	m_mySnapshotVersion = tab->m_rowNum - 1;
+	m_mySnapshotSeq = LLONG_MAX;
 	m_isUserDefineSnapshot = false;
 
 	segArrayUpdateSeq = tab->m_segArrayUpdateSeq;
 	syncIndex = true;
+	waitAsyncIndex = false;
+	m_indexBatchOn = false;
 	isUpsertOverwritten = 0;
 	TERARK_RT_assert(tab->getSegArrayUpdateSeq() == oldtab_segArrayUpdateSeq,
 					 std::logic_error);
@@ -102,10 +157,43 @@ DbContext::DbContext(const DbTable* tab)
 			, g_dbCtxLiveCnt.load(), g_dbCtxCreatedCnt.load());
 	}
 	upsertMaxRetry = 0;
+	m_reservedWrSubIdGen = 0;
+	m_uniqNegCacheSeq = 0;
+	m_reportedMemBytes = 0;
+	m_reportedIterNum = 0;
+	m_tab->m_ctxNum++;
+	reportMemSize();
+}
+
+bool
+DbContext::uniqNegCacheFind(size_t indexId, fstring key, size_t tabSegArraySeq)
+const {
+	if (m_uniqNegCacheSeq != tabSegArraySeq) {
+		return false;
+	}
+	size_t slot = IndexBloomFilter::hashKey(key) % UniqNegCacheSize;
+	const UniqNegKey& e = m_uniqNegCache[slot];
+	return e.indexId == indexId && fstring(e.key) == key;
+}
+
+void
+DbContext::uniqNegCachePut(size_t indexId, fstring key, size_t tabSegArraySeq) {
+	if (m_uniqNegCacheSeq != tabSegArraySeq) {
+		for (auto& e : m_uniqNegCache)
+			e.indexId = size_t(-1);
+		m_uniqNegCacheSeq = tabSegArraySeq;
+	}
+	size_t slot = IndexBloomFilter::hashKey(key) % UniqNegCacheSize;
+	UniqNegKey& e = m_uniqNegCache[slot];
+	e.indexId = indexId;
+	e.key.assign(key.udata(), key.size());
 }
 
 DbContext::~DbContext() {
 //	m_tab->unregisterDbContext(this);
+	m_tab->m_ctxNum--;
+	m_tab->m_ctxMemBytes -= m_reportedMemBytes;
+	m_tab->m_ctxIterNum -= m_reportedIterNum;
 	this->m_transaction.reset(); // destory before m_segCtx
 	size_t indexNum = m_tab->getIndexNum();
 	for (auto& x : m_segCtx) {
@@ -113,73 +201,127 @@ DbContext::~DbContext() {
 		SegCtx::destory(x, indexNum);
 	}
 	g_dbCtxLiveCnt--;
+#if !defined(NDEBUG)
+	static const bool arenaStat = getEnvBool("TerarkDB_DbContextArenaStat");
+	if (arenaStat && arena.m_opCount) {
+		fprintf(stderr
+			, "DEBUG: DbContext(%p) arena: ops = %zd, allocs = %zd(%.2f/op)"
+			  ", blocks = %zd, pool new: bufs = %zd, cols = %zd\n"
+			, this, arena.m_opCount, arena.m_allocCount
+			, double(arena.m_allocCount) / arena.m_opCount
+			, arena.m_blockCount, bufs.newCount, cols.newCount);
+	}
+#endif
 }
 
 void DbContext::doSyncSegCtxNoLock(const DbTable* tab) {
 	assert(tab == m_tab);
 	assert(this->segArrayUpdateSeq < tab->getSegArrayUpdateSeq());
+	// in lock tab->m_rwMutex, m_segArrayVersion is consistent with tab
+	const SegArrayVersion* version = tab->m_segArrayVersion.load();
+	assert(version->m_segArrayUpdateSeq == tab->getSegArrayUpdateSeq());
+	doSyncSegCtx(tab, *version);
+}
+
+// version must be pinned by tab->m_rwMutex or by a SegArrayReadGuard
+void DbContext::doSyncSegCtx(const DbTable* tab, const SegArrayVersion& version) {
+	assert(tab == m_tab);
 	if (!m_isUserDefineSnapshot) {
 		m_mySnapshotVersion = tab->m_rowNum - 1;
 	}
+	if (this->segArrayUpdateSeq == version.m_segArrayUpdateSeq) {
+		// tab->m_segArrayUpdateSeq was incremented, but the new version
+		// is not published yet
+		m_rowNumVec.back() = tab->m_rowNum;
+		return;
+	}
+	assert(this->segArrayUpdateSeq < version.m_segArrayUpdateSeq);
 	size_t indexNum = tab->getIndexNum();
-	size_t oldtab_segArrayUpdateSeq = tab->getSegArrayUpdateSeq();
 	size_t oldSegNum = m_segCtx.size();
-	size_t segNum = tab->getSegNum();
-	if (m_segCtx.size() < segNum) {
-		m_segCtx.resize(segNum, NULL);
-		for (size_t i = oldSegNum; i < segNum; ++i)
-			m_segCtx[i] = SegCtx::create(tab->getSegmentPtr(i), indexNum);
-	}
-	if (m_transaction && tab->m_wrSeg.get() != m_wrSegPtr) {
+	size_t segNum = version.m_segments.size();
+	const ReadableSegmentPtr* segBase = version.m_segments.data();
+	if (m_transaction && version.m_wrSeg != m_wrSegPtr) {
 		// m_transaction is useless, reset it!
 		m_transaction.reset();
 		m_wrSegPtr = NULL;
 	}
-	SegCtx** sctx = m_segCtx.data();
+	// segments which survived a merge, a compression or a purge are in the
+	// same order in both arrays, they keep their SegCtx and iterators. New
+	// segments get an empty SegCtx, their iterators are created on demand
+	SegCtx** old = m_segCtx.data();
+	valvec<SegCtx*> sctx(segNum, valvec_no_init());
+	std::vector<SegCtx*> dropped;
+	size_t r = 0;
 	for (size_t i = 0; i < segNum; ++i) {
-		ReadableSegment* seg = tab->getSegmentPtr(i);
-		if (NULL == sctx[i]) {
-			sctx[i] = SegCtx::create(seg, indexNum);
-			continue;
+		ReadableSegment* seg = segBase[i].get();
+		size_t j = r;
+		while (j < oldSegNum && old[j]->seg != seg)
+			++j;
+		if (j < oldSegNum) {
+			// old[r, j) are merged or replaced segments
+			dropped.insert(dropped.end(), old + r, old + j);
+			sctx[i] = old[j];
+			r = j + 1;
 		}
-		if (sctx[i]->seg == seg)
-			continue;
-		for (size_t j = i; j < oldSegNum; ++j) {
-			assert(NULL != sctx[j]);
-			if (sctx[j]->seg == seg) {
-				for (size_t k = i; k < j; ++k) {
-					// this should be a merged segments range
-					assert(NULL != sctx[k]);
-					SegCtx::destory(sctx[k], indexNum);
-				}
-				for (size_t k = 0; k < oldSegNum - j; ++k) {
-					sctx[i + k] = sctx[j + k];
-					sctx[j + k] = NULL;
-				}
-				oldSegNum -= j - i;
-				goto Done;
-			}
+		else {
+			sctx[i] = SegCtx::create(seg, indexNum);
 		}
-		// a WritableSegment was compressed into a ReadonlySegment, or
-		// a ReadonlySegment was purged into a new ReadonlySegment
-		SegCtx::reset(sctx[i], indexNum, seg);
-	Done:;
 	}
-	for (size_t i = segNum; i < m_segCtx.size(); ++i) {
-		if (sctx[i])
-			SegCtx::destory(sctx[i], indexNum);
+	dropped.insert(dropped.end(), old + r, old + oldSegNum);
+	m_segCtx.swap(sctx);
+	if (!dropped.empty()) {
+		SegCtx::destoryAsync(std::move(dropped), indexNum);
 	}
 	for (size_t i = 0; i < segNum; ++i) {
-		TERARK_RT_assert(NULL != sctx[i], std::logic_error);
-		TERARK_RT_assert(NULL != sctx[i]->seg, std::logic_error);
-		TERARK_RT_assert(tab->getSegmentPtr(i) == sctx[i]->seg, std::logic_error);
+		TERARK_RT_assert(NULL != m_segCtx[i], std::logic_error);
+		TERARK_RT_assert(segBase[i].get() == m_segCtx[i]->seg, std::logic_error);
 	}
-	m_segCtx.risk_set_size(segNum);
-	m_rowNumVec.assign(tab->m_rowNumVec);
+	m_rowNumVec.assign(version.m_rowNumVec);
 	TERARK_RT_assert(m_rowNumVec.size() == segNum + 1, std::logic_error);
-	TERARK_RT_assert(tab->getSegArrayUpdateSeq() == oldtab_segArrayUpdateSeq,
-					 std::logic_error);
-	segArrayUpdateSeq = tab->getSegArrayUpdateSeq();
+	m_rowNumVec.back() = tab->m_rowNum; // version.m_rowNumVec.back() is stale
+	m_segLocator.build(m_rowNumVec.data(), segNum);
+	segArrayUpdateSeq = version.m_segArrayUpdateSeq;
+	reportMemSize();
+}
+
+size_t DbContext::memSize(size_t* iterNum) const {
+	const size_t indexNum = m_tab->getIndexNum();
+	size_t bytes = sizeof(*this) + bufs.memSize() + cols.memSize() + arena.memSize();
+	size_t iters = 0;
+	bytes += m_segCtx.capacity() * sizeof(SegCtx*);
+	for (const SegCtx* x : m_segCtx) {
+		bytes += sizeof(SegCtx) + sizeof(IndexIterator*) * (indexNum - 1);
+		iters += NULL != x->wrtStoreIter;
+		for (size_t i = 0; i < indexNum; ++i)
+			iters += NULL != x->indexIter[i];
+	}
+	bytes += m_rowNumVec.capacity() * sizeof(llong);
+	bytes += errMsg.capacity();
+	bytes += offsets.capacity() * sizeof(uint32_t);
+	bytes += exactMatchRecIdvec.capacity() * sizeof(llong);
+	bytes += m_batchOrder.capacity() * sizeof(size_t);
+	bytes += m_batchSubIds.capacity() * sizeof(llong);
+	bytes += m_batchVals.capacity() * sizeof(valvec<byte>);
+	for (auto& v : m_batchVals)
+		bytes += v.capacity();
+	bytes += m_zipBlockCache.data.capacity();
+	bytes += m_reservedWrSubIds.capacity() * sizeof(uint32_t);
+	for (auto& e : m_uniqNegCache)
+		bytes += e.key.capacity();
+	bytes += m_indexBatchKeys.strpool.capacity();
+	bytes += m_indexBatchKeys.offsets.capacity() * sizeof(m_indexBatchKeys.offsets[0]);
+	bytes += m_indexBatchSubIds.capacity() * sizeof(llong);
+	*iterNum = iters;
+	return bytes;
+}
+
+void DbContext::reportMemSize() {
+	size_t iters = 0;
+	size_t bytes = memSize(&iters);
+	m_tab->m_ctxMemBytes += llong(bytes) - llong(m_reportedMemBytes);
+	m_tab->m_ctxIterNum  += llong(iters) - llong(m_reportedIterNum);
+	m_reportedMemBytes = bytes;
+	m_reportedIterNum = iters;
 }
 
 StoreIterator* DbContext::getWrtStoreIterNoLock(size_t segIdx) {
@@ -220,6 +362,18 @@ void DbContext::debugCheckUnique(fstring row, size_t uniqueIndexId) {
 	assert(exactMatchRecIdvec.size() <= 1);
 }
 
+void DbContext::setSnapshot(llong version) {
+	m_mySnapshotVersion = m_tab->getSnapshotMaxRecId(version);
+	m_mySnapshotSeq = version;
+	m_isUserDefineSnapshot = true;
+}
+
+void DbContext::clearSnapshot() {
+	m_isUserDefineSnapshot = false;
+	m_mySnapshotVersion = m_tab->m_rowNum - 1;
+	m_mySnapshotSeq = LLONG_MAX;
+}
+
 void
 DbContext::getWrSegWrtStoreData(const ReadableSegment* seg, llong subId, valvec<byte>* buf) {
 	assert(seg->getPlainWritableSegment() != NULL);
@@ -282,6 +436,7 @@ void DbContext::freeWritableSegmentResources() {
 	}
 	m_wrSegPtr = nullptr;
 	m_transaction.reset();
+	m_reservedWrSubIds.clear(); // they will be deleted rows
 }
 
 } } // namespace terark::db
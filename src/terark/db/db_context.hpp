@@ -2,6 +2,10 @@
 #define __terark_db_db_context_hpp__
 
 #include "db_conf.hpp"
+#include "segment_locator.hpp"
+#include <terark/util/fstrvec.hpp>
+#include <functional>
+#include <vector>
 
 namespace terark {
 	class BaseDFA;
@@ -26,6 +30,15 @@ struct DbContextObjCacheFreeExcessMem<valvec<byte>> {
     }
 };
 
+template<class T>
+struct DbContextObjCacheMemSize {
+    static size_t invoke(const T*) { return 0; }
+};
+template<>
+struct DbContextObjCacheMemSize<valvec<byte>> {
+    static size_t invoke(const valvec<byte>* obj) { return obj->capacity(); }
+};
+
 template<class T>
 class DbContextObjCache {
 private:
@@ -54,13 +67,22 @@ private:
     };
     valvec<Wrapper*> pool;
 public:
+    size_t newCount = 0; // objects created because pool is empty
     ~DbContextObjCache() {
         for (auto item : pool) {
             delete item;
         }
     }
+    size_t memSize() const { // of pooled objects
+        size_t bytes = pool.capacity() * sizeof(Wrapper*);
+        for (auto item : pool) {
+            bytes += sizeof(Wrapper) + DbContextObjCacheMemSize<T>::invoke(&item->x);
+        }
+        return bytes;
+    }
     CacheItem get() {
         if (pool.empty()) {
+            newCount++;
             return CacheItem(new Wrapper{this, {}});
         }
         else {
@@ -69,6 +91,75 @@ public:
     }
 };
 
+// bump pointer arena for trivial temporaries(id arrays, offsets, fstring)
+// of an operation on a DbContext, memory blocks are kept, so an operation
+// does not malloc once the arena is warm.
+// Memory is allocated in a Scope, the outermost Scope is a top level
+// operation, the arena is rewound to the Scope start when a Scope exits.
+class TERARK_DB_DLL DbContextArena {
+	struct Block {
+		byte*  base;
+		size_t size;
+	};
+	valvec<Block> m_blocks;
+	size_t m_cur; // index of current block
+	size_t m_pos; // alloc position in current block
+	size_t m_depth; // Scope nesting level
+	byte* allocSlow(size_t bytes, size_t align);
+	DbContextArena(const DbContextArena&) = delete;
+	DbContextArena& operator=(const DbContextArena&) = delete;
+public:
+	///@{ statistics
+	size_t m_opCount; // number of outermost Scope
+	size_t m_allocCount;
+	size_t m_blockCount; // malloc-ed blocks
+	///@}
+
+	DbContextArena();
+	~DbContextArena();
+	size_t memSize() const; // malloc-ed blocks
+
+	class Scope {
+		DbContextArena* m_arena;
+		size_t m_cur, m_pos;
+	public:
+		explicit Scope(DbContextArena& a)
+		  : m_arena(&a), m_cur(a.m_cur), m_pos(a.m_pos) { a.m_depth++; }
+		~Scope() {
+			m_arena->m_cur = m_cur;
+			m_arena->m_pos = m_pos;
+			if (0 == --m_arena->m_depth)
+				m_arena->m_opCount++;
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+
+	/// uninitialized array, valid until the enclosing Scope exits
+	template<class T>
+	T* alloc(size_t n) {
+		static_assert(boost::has_trivial_destructor<T>::value,
+					  "DbContextArena does not call destructors");
+		assert(m_depth > 0);
+		m_allocCount++;
+		const size_t bytes = sizeof(T) * n;
+		if (m_cur < m_blocks.size()) {
+			size_t pos = (m_pos + alignof(T) - 1) & ~(alignof(T) - 1);
+			if (pos + bytes <= m_blocks[m_cur].size) {
+				m_pos = pos + bytes;
+				return (T*)(m_blocks[m_cur].base + pos);
+			}
+		}
+		return (T*)allocSlow(bytes, alignof(T));
+	}
+	template<class T>
+	T* allocCopy(const T* src, size_t n) {
+		T* p = alloc<T>(n);
+		std::copy(src, src + n, p);
+		return p;
+	}
+};
+
 class TERARK_DB_DLL DbContextLink : public RefCounter {
 	friend class DbTable;
 protected:
@@ -76,6 +167,13 @@ protected:
 	~DbContextLink();
 //	DbContextLink *m_prev, *m_next;
 };
+// last decompressed block of a block compressed store(BlockZipAppendonlyStore)
+struct ZipBlockCache {
+	ullong storeId = 0; // 0 is invalid
+	size_t blockIdx = 0;
+	valvec<byte> data;
+};
+
 class TERARK_DB_DLL DbContext : public DbContextLink {
 	friend class DbTable;
 public:
@@ -83,21 +181,43 @@ public:
 	~DbContext();
 
 	void doSyncSegCtxNoLock(const DbTable* tab);
+	void doSyncSegCtx(const DbTable* tab, const class SegArrayVersion&);
 	void trySyncSegCtxNoLock(const DbTable* tab);
 	void trySyncSegCtxSpeculativeLock(const DbTable* tab);
 	class StoreIterator* getWrtStoreIterNoLock(size_t segIdx);
 	class IndexIterator* getIndexIterNoLock(size_t segIdx, size_t indexId);
 
+	/// heap bytes of buffers and SegCtx, iterators are just counted
+	size_t memSize(size_t* iterNum) const;
+	/// memSize is reported to DbTable::getMemoryStat when the context is
+	/// created and when segments are synced
+	void reportMemSize();
+
 	void getWrSegWrtStoreData(const class ReadableSegment* seg, llong subId, valvec<byte>* buf);
 
 	void debugCheckUnique(fstring row, size_t uniqIndexId);
 
+	///@{ read by a version of DbTable::acquireSnapshot, until clearSnapshot
+	/// rows deleted after the version are still visible to searches,
+	/// rows inserted after it are beyond getSnapshotMaxRecId()
+	void setSnapshot(llong version);
+	void clearSnapshot();
+	bool hasSnapshot() const { return m_isUserDefineSnapshot; }
+	llong getSnapshotVersion() const { return m_mySnapshotSeq; }
+	llong getSnapshotMaxRecId() const { return m_mySnapshotVersion; }
+	///@}
+
 /// @{ delegate methods
 	StoreIteratorPtr createTableIterForward();
 	StoreIteratorPtr createTableIterBackward();
+	StoreIteratorPtr createTableIterColumnRange(size_t columnId, llong lo, llong hi);
 
 	void getValueAppend(llong id, valvec<byte>* val);
 	void getValue(llong id, valvec<byte>* val);
+	fstring getValueRef(llong id, valvec<byte>* buf); // maybe zero-copy
+
+	void getValuesBatch(const valvec<llong>& ids, valvec<valvec<byte> >* vals);
+	void getValuesBatch(const llong* ids, size_t num, valvec<byte>* vals);
 
 	llong insertRow(fstring row);
 	llong upsertRow(fstring row);
@@ -112,18 +232,32 @@ public:
 	bool indexKeyExists(size_t indexId, fstring key);
 
 	void indexSearchExactNoLock(size_t indexId, fstring key, valvec<llong>* recIdvec);
+
+	void indexSearchExactBatch(size_t indexId, const fstring* keys, size_t num, valvec<llong>* recIdvec, valvec<size_t>* offsets);
+	void indexSearchExactBatchNoLock(size_t indexId, const fstring* keys, size_t num, valvec<llong>* recIdvec, valvec<size_t>* offsets);
+	size_t getValuesByKeyBatch(size_t indexId, const fstring* keys, size_t num, llong* recIds, valvec<byte>* vals);
+	llong indexCountRange(size_t indexId, fstring lo, fstring hi);
+	llong indexScanRange(size_t indexId, fstring lo, fstring hi, const std::function<bool(llong recId)>& onRecord);
+	size_t indexSearchPrefix(size_t indexId, fstring prefix, size_t k, valvec<llong>* recIdvec, fstrvecl* keys = NULL);
+	llong indexApproximateRangeSize(size_t indexId, fstring lo, fstring hi);
 	bool indexKeyExistsNoLock(size_t indexId, fstring key);
 
 	bool indexMatchRegex(size_t indexId, class RegexForIndex*, valvec<llong>* recIdvec);
 
 	void selectColumns(llong id, const valvec<size_t>& cols, valvec<byte>* colsData);
 	void selectColumns(llong id, const size_t* colsId, size_t colsNum, valvec<byte>* colsData);
+	void selectColumnsFromIndexKey(size_t indexId, fstring key, const size_t* colsId, size_t colsNum, valvec<byte>* colsData);
 	void selectOneColumn(llong id, size_t columnId, valvec<byte>* colsData);
 
+	void selectColumnsBatch(const valvec<llong>& ids, const valvec<size_t>& cols, valvec<valvec<byte> >* colsDataVec);
+	void selectColumnsBatch(const llong* ids, size_t num, const size_t* colsId, size_t colsNum, valvec<byte>* colsDataVec);
+	void selectOneColgroupBatch(const llong* ids, size_t num, size_t cgId, valvec<byte>* cgDataVec);
+
 	void selectColgroups(llong id, const valvec<size_t>& cgIdvec, valvec<valvec<byte> >* cgDataVec);
 	void selectColgroups(llong id, const size_t* cgIdvec, size_t cgIdvecSize, valvec<byte>* cgDataVec);
 
 	void selectOneColgroup(llong id, size_t cgId, valvec<byte>* cgData);
+	fstring selectOneColgroupRef(llong id, size_t cgId, valvec<byte>* buf);
 
 	void selectColumnsNoLock(llong id, const valvec<size_t>& cols, valvec<byte>* colsData);
 	void selectColumnsNoLock(llong id, const size_t* colsId, size_t colsNum, valvec<byte>* colsData);
@@ -140,6 +274,12 @@ public:
 	void ensureTransactionNoLock();
 	void freeWritableSegmentResources();
 
+	///@{ keys of unique indices known to have no live rows in frozen
+	/// segments, valid while DbTable::m_segArrayUpdateSeq is not changed
+	bool uniqNegCacheFind(size_t indexId, fstring key, size_t tabSegArraySeq) const;
+	void uniqNegCachePut(size_t indexId, fstring key, size_t tabSegArraySeq);
+	///@}
+
 public:
 	struct SegCtx {
 		class ReadableSegment* seg;
@@ -153,24 +293,48 @@ public:
 		SegCtx& operator=(const SegCtx&) = delete;
 		static SegCtx* create(ReadableSegment* seg, size_t indexNum);
 		static void destory(SegCtx*& p, size_t indexNum);
-		static void reset(SegCtx* p, size_t indexNum, ReadableSegment* seg);
+		static void destoryAsync(std::vector<SegCtx*>&& vec, size_t indexNum);
 	};
 	DbTable* m_tab;
 	class WritableSegment* m_wrSegPtr;
 	std::unique_ptr<class DbTransaction> m_transaction;
 	valvec<SegCtx*> m_segCtx;
 	valvec<llong>   m_rowNumVec; // copy of DbTable::m_rowNumVec
-	llong           m_mySnapshotVersion;
+	SegmentLocator  m_segLocator; // on m_rowNumVec, excluding end guard
+	llong           m_mySnapshotVersion; // max visible record id
+	llong           m_mySnapshotSeq; // LLONG_MAX if no snapshot
 	std::string  errMsg;
     DbContextObjCache<valvec<byte>> bufs;
     DbContextObjCache<ColumnVec> cols;
+	DbContextArena arena;
 	valvec<uint32_t> offsets;
 	valvec<llong> exactMatchRecIdvec;
+	valvec<size_t> m_batchOrder; // id order grouped by segment, and segment ranges
+	valvec<llong>  m_batchSubIds; // parallel with m_batchOrder[0, num)
+	valvec<valvec<byte> > m_batchVals;
+	ZipBlockCache    m_zipBlockCache;
+	valvec<uint32_t> m_reservedWrSubIds; // reversed, pop_val is the smallest
+	size_t        m_reservedWrSubIdGen;
+	struct UniqNegKey {
+		size_t indexId = size_t(-1);
+		valvec<byte> key;
+	};
+	enum { UniqNegCacheSize = 8 };
+	UniqNegKey    m_uniqNegCache[UniqNegCacheSize]; // direct mapped by key hash
+	size_t        m_uniqNegCacheSeq;
+	size_t        m_reportedMemBytes; // by reportMemSize
+	size_t        m_reportedIterNum;
     boost::intrusive_ptr<RefCounter> trbLog;
 	size_t regexMatchMemLimit;
+	size_t regexMatchMaxResults; // 0 is unlimited
 	size_t segArrayUpdateSeq;
 	int  upsertMaxRetry;
 	bool syncIndex;
+	bool waitAsyncIndex; // indexSearchExact waits SchemaConfig::m_asyncIndex
+	bool m_indexBatchOn; // DbTable::beginIndexBatch
+	boost::intrusive_ptr<class WritableSegment> m_indexBatchSeg; // of the keys
+	fstrvecl         m_indexBatchKeys;   // keys of m_multIndices of each row
+	valvec<llong>    m_indexBatchSubIds; // staged rows
 	bool m_isUserDefineSnapshot;
     bool syncOnCommit;
 	byte isUpsertOverwritten;
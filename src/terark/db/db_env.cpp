@@ -0,0 +1,439 @@
+#include "db_env.hpp"
+#include <terark/util/mmap.hpp>
+#include <terark/util/throw.hpp>
+#include <boost/filesystem.hpp>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#if defined(_MSC_VER)
+	#include <io.h>
+	#include <fcntl.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+#if defined(__linux__)
+	#include <sched.h>
+	#include <pthread.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+#endif
+
+namespace terark { namespace db {
+
+static thread_local DbEnv* tls_currentEnv = NULL;
+static DbEnvPtr g_defaultEnv;
+
+DbEnv::~DbEnv() {
+}
+
+void DbEnv::fileWritten(fstring fpath) {
+	boost::system::error_code ec;
+	ullong bytes = boost::filesystem::file_size(fpath.str(), ec);
+	if (!ec) {
+		onWrite(size_t(bytes));
+	}
+}
+
+DbEnv* DbEnv::posix() {
+	static DbEnvPtr env = new PosixEnv();
+	return env.get();
+}
+
+DbEnv* DbEnv::current() {
+	if (DbEnv* env = tls_currentEnv)
+		return env;
+	return getDefault();
+}
+
+// the default is set before tables are opened, it is not guarded
+DbEnv* DbEnv::getDefault() {
+	if (DbEnv* env = g_defaultEnv.get())
+		return env;
+	return posix();
+}
+
+void DbEnv::setDefault(DbEnv* env) {
+	g_defaultEnv = env;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+void* PosixEnv::mmapLoad(fstring fpath, size_t* fsize,
+						 bool writable, bool populate) {
+	return mmap_load(fpath.c_str(), fsize, writable, populate);
+}
+
+void PosixEnv::mmapClose(void* base, size_t size) {
+	mmap_close(base, size);
+}
+
+void PosixEnv::openFile(FileStream* fp, fstring fpath, fstring mode) {
+	fp->open(fpath, mode);
+}
+
+void PosixEnv::onWrite(size_t) {
+}
+
+void PosixEnv::syncFile(fstring fpath) {
+#if defined(_MSC_VER)
+	int fd = ::_open(fpath.c_str(), _O_RDWR | _O_BINARY);
+#else
+	int fd = ::open(fpath.c_str(), O_RDONLY);
+#endif
+	if (fd < 0) {
+		THROW_STD(runtime_error, "open(%s) = %s", fpath.c_str(), strerror(errno));
+	}
+#if defined(_MSC_VER)
+	int err = ::_commit(fd);
+	int errnum = errno;
+	::_close(fd);
+#else
+	int err = ::fsync(fd);
+	int errnum = errno;
+	::close(fd);
+#endif
+	if (err) {
+		THROW_STD(runtime_error, "fsync(%s) = %s", fpath.c_str(), strerror(errnum));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+DbEnvWrapper::DbEnvWrapper(DbEnv* target) : m_target(target) {
+	assert(NULL != target);
+}
+DbEnvWrapper::~DbEnvWrapper() {
+}
+
+void* DbEnvWrapper::mmapLoad(fstring fpath, size_t* fsize,
+							 bool writable, bool populate) {
+	return m_target->mmapLoad(fpath, fsize, writable, populate);
+}
+
+void DbEnvWrapper::mmapClose(void* base, size_t size) {
+	m_target->mmapClose(base, size);
+}
+
+void DbEnvWrapper::openFile(FileStream* fp, fstring fpath, fstring mode) {
+	m_target->openFile(fp, fpath, mode);
+}
+
+void DbEnvWrapper::onWrite(size_t bytes) {
+	m_target->onWrite(bytes);
+}
+
+void DbEnvWrapper::syncFile(fstring fpath) {
+	m_target->syncFile(fpath);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+RateLimitedEnv::RateLimitedEnv(DbEnv* target, WriteRateLimiter* limiter)
+  : DbEnvWrapper(target), m_limiter(limiter) {
+	assert(NULL != limiter);
+	m_sleepMicros = 0;
+}
+RateLimitedEnv::~RateLimitedEnv() {
+}
+
+void RateLimitedEnv::onWrite(size_t bytes) {
+	m_target->onWrite(bytes);
+	size_t us = m_limiter->consume(bytes);
+	if (us) {
+		m_sleepMicros.fetch_add(us, std::memory_order_relaxed);
+		std::this_thread::sleep_for(std::chrono::microseconds(us));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+IoStatsEnv::IoStatsEnv(DbEnv* target) : DbEnvWrapper(target) {
+	m_openFiles = 0;
+	m_mmapFiles = 0;
+	m_mmapBytes = 0;
+	m_writeBytes = 0;
+	m_syncFiles = 0;
+}
+IoStatsEnv::~IoStatsEnv() {
+}
+
+DbIoStat IoStatsEnv::getStat() const {
+	DbIoStat st;
+	st.openFiles  = m_openFiles .load(std::memory_order_relaxed);
+	st.mmapFiles  = m_mmapFiles .load(std::memory_order_relaxed);
+	st.mmapBytes  = m_mmapBytes .load(std::memory_order_relaxed);
+	st.writeBytes = m_writeBytes.load(std::memory_order_relaxed);
+	st.syncFiles  = m_syncFiles .load(std::memory_order_relaxed);
+	return st;
+}
+
+void* IoStatsEnv::mmapLoad(fstring fpath, size_t* fsize,
+						   bool writable, bool populate) {
+	void* base = m_target->mmapLoad(fpath, fsize, writable, populate);
+	m_mmapFiles.fetch_add(1, std::memory_order_relaxed);
+	m_mmapBytes.fetch_add(*fsize, std::memory_order_relaxed);
+	return base;
+}
+
+void IoStatsEnv::openFile(FileStream* fp, fstring fpath, fstring mode) {
+	m_target->openFile(fp, fpath, mode);
+	m_openFiles.fetch_add(1, std::memory_order_relaxed);
+}
+
+void IoStatsEnv::onWrite(size_t bytes) {
+	m_writeBytes.fetch_add(bytes, std::memory_order_relaxed);
+	m_target->onWrite(bytes);
+}
+
+void IoStatsEnv::syncFile(fstring fpath) {
+	m_target->syncFile(fpath);
+	m_syncFiles.fetch_add(1, std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// numa without dependency to libnuma, nodes are limited to 64
+
+namespace {
+	const int MPOL_DEFAULT_    = 0;
+	const int MPOL_PREFERRED_  = 1;
+	const int MPOL_INTERLEAVE_ = 3;
+	const unsigned long MaxNumaNode = 64;
+
+	struct NumaTopology {
+		int nodeNum = 0;
+		unsigned long onlineNodes = 0;
+		std::vector<std::vector<int> > nodeCpus;
+
+		// "0-3,8,10-11" of sysfs, a missing file is empty
+		static std::vector<int> readList(const char* fpath) {
+			std::vector<int> list;
+			FILE* fp = fopen(fpath, "r");
+			if (NULL == fp)
+				return list;
+			char buf[4096];
+			if (fgets(buf, sizeof(buf), fp)) {
+				for (char* p = buf; *p >= '0' && *p <= '9'; ) {
+					long beg = strtol(p, &p, 10), end = beg;
+					if ('-' == *p)
+						end = strtol(p + 1, &p, 10);
+					for (long i = beg; i <= end; ++i)
+						list.push_back(int(i));
+					if (',' == *p)
+						++p;
+				}
+			}
+			fclose(fp);
+			return list;
+		}
+		NumaTopology() {
+		#if defined(__linux__)
+			for (int node : readList("/sys/devices/system/node/online")) {
+				if (node >= int(MaxNumaNode))
+					break;
+				char fpath[128];
+				sprintf(fpath, "/sys/devices/system/node/node%d/cpulist", node);
+				nodeCpus.resize(node + 1);
+				nodeCpus[node] = readList(fpath);
+				onlineNodes |= 1UL << node;
+				nodeNum = node + 1;
+			}
+		#endif
+		}
+	};
+	const NumaTopology& numaTopology() {
+		static NumaTopology topo;
+		return topo;
+	}
+	bool isNumaNode(int node) {
+		const NumaTopology& topo = numaTopology();
+		return topo.nodeNum > 1 && node >= 0 && node < topo.nodeNum
+			&& (topo.onlineNodes & (1UL << node));
+	}
+	// maxnode of the syscalls is bits + 1
+	long numaSetMemPolicy(int mode, const unsigned long* nodes) {
+	#if defined(SYS_set_mempolicy)
+		return syscall(SYS_set_mempolicy, mode, nodes, MaxNumaNode + 1);
+	#else
+		(void)mode; (void)nodes;
+		return -1;
+	#endif
+	}
+	bool numaGetMemPolicy(int* mode, unsigned long* nodes) {
+		*mode = MPOL_DEFAULT_;
+		*nodes = 0;
+	#if defined(SYS_get_mempolicy)
+		return syscall(SYS_get_mempolicy, mode, nodes, MaxNumaNode + 1, NULL, 0UL) == 0;
+	#else
+		return false;
+	#endif
+	}
+	// mempolicy of this thread is restored on destruction
+	struct MemPolicyRestorer {
+		int mode;
+		unsigned long nodes;
+		bool saved;
+		MemPolicyRestorer() { saved = numaGetMemPolicy(&mode, &nodes); }
+		~MemPolicyRestorer() {
+			if (saved)
+				numaSetMemPolicy(mode, nodes ? &nodes : NULL);
+		}
+	};
+}
+
+int numaNodeNum() {
+	return numaTopology().nodeNum;
+}
+
+NumaEnv::NumaEnv(DbEnv* target, int node, bool interleave, size_t minBytes)
+  : DbEnvWrapper(target) {
+	m_node = node;
+	m_interleave = interleave;
+	m_minBytes = minBytes;
+}
+NumaEnv::~NumaEnv() {
+}
+
+void* NumaEnv::mmapLoad(fstring fpath, size_t* fsize,
+						bool writable, bool populate) {
+	const NumaTopology& topo = numaTopology();
+	int mode = m_interleave ? MPOL_INTERLEAVE_ : MPOL_PREFERRED_;
+	unsigned long nodes = m_interleave ? topo.onlineNodes : 0;
+	if (!m_interleave && isNumaNode(m_node))
+		nodes = 1UL << m_node;
+	if (writable || topo.nodeNum <= 1 || 0 == nodes) {
+		return m_target->mmapLoad(fpath, fsize, writable, populate);
+	}
+	boost::system::error_code ec;
+	ullong bytes = boost::filesystem::file_size(fpath.str(), ec);
+	if (ec || bytes < m_minBytes) {
+		return m_target->mmapLoad(fpath, fsize, writable, populate);
+	}
+	MemPolicyRestorer restorer;
+	numaSetMemPolicy(mode, &nodes);
+	void* base = m_target->mmapLoad(fpath, fsize, writable, populate);
+#if defined(SYS_mbind)
+	const size_t pageSize = 4096;
+	size_t len = (*fsize + pageSize - 1) & ~(pageSize - 1);
+	if (syscall(SYS_mbind, base, len, mode, &nodes, MaxNumaNode + 1, 0U) != 0) {
+		static bool warned = false;
+		if (!warned) {
+			warned = true;
+			fprintf(stderr, "WARN: NumaEnv::mmapLoad(%s): mbind = %s\n"
+				, fpath.c_str(), strerror(errno));
+		}
+	}
+#endif
+	return base;
+}
+
+NumaNodeScope::NumaNodeScope(int node) {
+	m_node = -1;
+	m_hasCpus = false;
+#if defined(__linux__)
+	static_assert(sizeof(m_prevCpus) >= sizeof(cpu_set_t), "cpu_set_t");
+	if (!isNumaNode(node) || !numaGetMemPolicy(&m_prevPolicy, &m_prevNodes))
+		return;
+	m_node = node;
+	cpu_set_t* prevCpus = (cpu_set_t*)m_prevCpus;
+	if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), prevCpus) == 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (int cpu : numaTopology().nodeCpus[node]) {
+			if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, prevCpus))
+				CPU_SET(cpu, &cpus);
+		}
+		// keeps TerarkDB_CompressionThreadsCpuSet if no cpu of the node is in
+		if (CPU_COUNT(&cpus)) {
+			m_hasCpus = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+		}
+	}
+	unsigned long nodes = 1UL << node;
+	numaSetMemPolicy(MPOL_PREFERRED_, &nodes);
+#else
+	(void)node;
+#endif
+}
+
+NumaNodeScope::~NumaNodeScope() {
+#if defined(__linux__)
+	if (m_node < 0)
+		return;
+	if (m_hasCpus) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+							   (cpu_set_t*)m_prevCpus);
+	}
+	numaSetMemPolicy(m_prevPolicy, m_prevNodes ? &m_prevNodes : NULL);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+DbEnvScope::DbEnvScope(DbEnv* env) {
+	m_prev = tls_currentEnv;
+	tls_currentEnv = env;
+}
+DbEnvScope::~DbEnvScope() {
+	tls_currentEnv = m_prev;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+EnvFileStream::EnvFileStream() : m_env(DbEnv::current()) {
+	m_reported = 0;
+}
+
+EnvFileStream::EnvFileStream(fstring fpath, fstring mode)
+  : m_env(DbEnv::current()) {
+	m_reported = 0;
+	open(fpath, mode);
+}
+
+EnvFileStream::~EnvFileStream() {
+	close();
+}
+
+void EnvFileStream::open(fstring fpath, fstring mode) {
+	m_env->openFile(this, fpath, mode);
+	m_reported = fpsize(m_fp); // existing bytes are not written
+}
+
+// bytes written by the base class are the growth of the file, exceptions
+// of onWrite are dropped, since close is nothrow
+void EnvFileStream::close() {
+	if (NULL == m_fp) {
+		return;
+	}
+	fflush(m_fp);
+	struct stat st;
+	bool hasSize = ::fstat(fileno(m_fp), &st) == 0;
+	FileStream::close();
+	if (hasSize && ullong(st.st_size) > m_reported) {
+		try { m_env->onWrite(size_t(st.st_size - m_reported)); }
+		catch (const std::exception&) {}
+	}
+	m_reported = 0;
+}
+
+void EnvFileStream::ensureWrite(const void* vbuf, size_t length) {
+	auto buf = (const char*)vbuf;
+	while (length) {
+		size_t n = std::min<size_t>(length, ChunkSize);
+		FileStream::ensureWrite(buf, n);
+		m_reported += n;
+		m_env->onWrite(n);
+		buf += n;
+		length -= n;
+	}
+}
+
+void EnvFileStream::sync(fstring fpath) {
+	fflush(m_fp);
+	m_env->syncFile(fpath);
+}
+
+} } // namespace terark::db
@@ -0,0 +1,190 @@
+#ifndef __terark_db_db_env_hpp__
+#define __terark_db_db_env_hpp__
+
+#include "db_dll_decl.hpp"
+#include "rate_limiter.hpp"
+#include <terark/fstring.hpp>
+#include <terark/io/FileStream.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+
+// I/O environment of segment files, stores and indices open, mmap, write
+// and sync their files by DbEnv::current(), the env of the thread is set
+// by DbEnvScope, such as the env of a DbTable during its loads and its
+// background tasks. Files written by terark-base(such as save_mmap of a
+// DFA) can not be intercepted, they are reported by DbEnv::fileWritten.
+
+namespace terark { namespace db {
+
+class TERARK_DB_DLL DbEnv : public RefCounter {
+public:
+	virtual ~DbEnv();
+
+	/// same as terark::mmap_load/mmap_close, mmapClose may be called in
+	/// another scope than the mmapLoad, such as in destructors of stores,
+	/// so an env must release a mapping just by its address
+	virtual void* mmapLoad(fstring fpath, size_t* fsize,
+						   bool writable = false, bool populate = false) = 0;
+	virtual void  mmapClose(void* base, size_t size) = 0;
+
+	/// open fp as FileStream::open, by EnvFileStream
+	virtual void  openFile(FileStream* fp, fstring fpath, fstring mode) = 0;
+
+	/// bytes have been written to a file, it may sleep for rate limiting
+	virtual void  onWrite(size_t bytes) = 0;
+
+	/// fsync
+	virtual void  syncFile(fstring fpath) = 0;
+
+	/// onWrite(file size) for a file written without EnvFileStream
+	void fileWritten(fstring fpath);
+
+	/// the env set by DbEnvScope for this thread, or getDefault()
+	static DbEnv* current();
+	static DbEnv* getDefault();
+	/// default of new tables and of threads without DbEnvScope, NULL is
+	/// the posix env
+	static void setDefault(DbEnv*);
+	static DbEnv* posix();
+};
+typedef boost::intrusive_ptr<DbEnv> DbEnvPtr;
+
+class TERARK_DB_DLL PosixEnv : public DbEnv {
+public:
+	void* mmapLoad(fstring fpath, size_t* fsize,
+				   bool writable, bool populate) override;
+	void  mmapClose(void* base, size_t size) override;
+	void  openFile(FileStream* fp, fstring fpath, fstring mode) override;
+	void  onWrite(size_t bytes) override;
+	void  syncFile(fstring fpath) override;
+};
+
+// forwards all to the target env, base of stacked envs
+class TERARK_DB_DLL DbEnvWrapper : public DbEnv {
+protected:
+	DbEnvPtr m_target;
+public:
+	explicit DbEnvWrapper(DbEnv* target);
+	~DbEnvWrapper();
+	DbEnv* target() const { return m_target.get(); }
+	void* mmapLoad(fstring fpath, size_t* fsize,
+				   bool writable, bool populate) override;
+	void  mmapClose(void* base, size_t size) override;
+	void  openFile(FileStream* fp, fstring fpath, fstring mode) override;
+	void  onWrite(size_t bytes) override;
+	void  syncFile(fstring fpath) override;
+};
+
+// writers sleep for the debt of the limiter, for background builds
+class TERARK_DB_DLL RateLimitedEnv : public DbEnvWrapper {
+	WriteRateLimiterPtr m_limiter;
+	std::atomic<ullong> m_sleepMicros;
+public:
+	RateLimitedEnv(DbEnv* target, WriteRateLimiter* limiter);
+	~RateLimitedEnv();
+	WriteRateLimiter* limiter() const { return m_limiter.get(); }
+	ullong sleepMicros() const { return m_sleepMicros.load(std::memory_order_relaxed); }
+	void onWrite(size_t bytes) override;
+};
+typedef boost::intrusive_ptr<RateLimitedEnv> RateLimitedEnvPtr;
+
+// sizes are in bytes, reads are not counted, they are page faults of mmap
+struct DbIoStat {
+	ullong openFiles  = 0; // by openFile
+	ullong mmapFiles  = 0;
+	ullong mmapBytes  = 0;
+	ullong writeBytes = 0;
+	ullong syncFiles  = 0;
+};
+
+// counts I/O, a DbTable has one over the env of the table
+class TERARK_DB_DLL IoStatsEnv : public DbEnvWrapper {
+	std::atomic<ullong> m_openFiles;
+	std::atomic<ullong> m_mmapFiles;
+	std::atomic<ullong> m_mmapBytes;
+	std::atomic<ullong> m_writeBytes;
+	std::atomic<ullong> m_syncFiles;
+public:
+	explicit IoStatsEnv(DbEnv* target);
+	~IoStatsEnv();
+	DbIoStat getStat() const;
+	void* mmapLoad(fstring fpath, size_t* fsize,
+				   bool writable, bool populate) override;
+	void  openFile(FileStream* fp, fstring fpath, fstring mode) override;
+	void  onWrite(size_t bytes) override;
+	void  syncFile(fstring fpath) override;
+};
+typedef boost::intrusive_ptr<IoStatsEnv> IoStatsEnvPtr;
+
+// numa nodes are from /sys/devices/system/node, numa functions are noop
+// on hosts of one node and on non-linux, see SchemaConfig::m_numaNode
+TERARK_DB_DLL int numaNodeNum();
+
+// page cache of a file is allocated by the mempolicy of the faulting
+// thread, readonly mappings of at least minBytes are loaded under the
+// policy and are mbind-ed for later faults: interleaved on all nodes, or
+// preferred on node if node >= 0
+class TERARK_DB_DLL NumaEnv : public DbEnvWrapper {
+	int    m_node;
+	bool   m_interleave;
+	size_t m_minBytes;
+public:
+	NumaEnv(DbEnv* target, int node, bool interleave, size_t minBytes);
+	~NumaEnv();
+	void* mmapLoad(fstring fpath, size_t* fsize,
+				   bool writable, bool populate) override;
+};
+
+// this thread runs on cpus of the node and allocates on the node in the
+// scope, the affinity and the mempolicy are restored on destruction,
+// it is noop if node is not an online node, such as -1 of a table without
+// NumaNode or a node missing on this host
+class TERARK_DB_DLL NumaNodeScope {
+	int  m_node;
+	bool m_hasCpus;
+	int  m_prevPolicy;
+	unsigned long m_prevNodes;
+	char m_prevCpus[128]; // cpu_set_t
+	NumaNodeScope(const NumaNodeScope&) = delete;
+	NumaNodeScope& operator=(const NumaNodeScope&) = delete;
+public:
+	explicit NumaNodeScope(int node);
+	~NumaNodeScope();
+};
+
+// the env of this thread in the scope, scopes can be nested
+class TERARK_DB_DLL DbEnvScope {
+	DbEnv* m_prev;
+	DbEnvScope(const DbEnvScope&) = delete;
+	DbEnvScope& operator=(const DbEnvScope&) = delete;
+public:
+	explicit DbEnvScope(DbEnv*);
+	~DbEnvScope();
+};
+
+// FileStream which is opened and written by an env, the env is the current
+// one on construction, it is kept by files opened for appending. Writes
+// are reported to the env in chunks, bytes written by the base class, such
+// as by operator<< of NativeDataOutput, are reported on close by the size
+class TERARK_DB_DLL EnvFileStream : public FileStream {
+	DbEnvPtr m_env;
+	ullong   m_reported; // file size which is reported to m_env
+	EnvFileStream(const EnvFileStream&) = delete;
+	EnvFileStream& operator=(const EnvFileStream&) = delete;
+public:
+	enum { ChunkSize = 1 << 20 };
+	EnvFileStream();
+	EnvFileStream(fstring fpath, fstring mode);
+	~EnvFileStream();
+	DbEnv* env() const { return m_env.get(); }
+	void open(fstring fpath, fstring mode);
+	void close();
+	void ensureWrite(const void* vbuf, size_t length);
+	/// fflush and sync by the env
+	void sync(fstring fpath);
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_db_env_hpp__
@@ -1,11 +1,23 @@
 #include "db_index.hpp"
+#include "db_env.hpp"
 #include <terark/io/FileStream.hpp>
+#include <algorithm>
 
 namespace terark { namespace db {
 
 RegexForIndex::RegexForIndex() {}
 RegexForIndex::~RegexForIndex() {}
 
+bool RegexForIndex::matchOrNext(fstring key, valvec<byte>* next) {
+	if (matchText(key)) {
+		return true;
+	}
+	// min key greater than key, nothing is skipped
+	next->assign(key.udata(), key.size());
+	next->push_back('\0');
+	return false;
+}
+
 static hash_strmap<RegexForIndex::Factory>& g_getFactroyMap() {
 	static hash_strmap<RegexForIndex::Factory> map;
 	return map;
@@ -56,11 +68,67 @@ IndexIterator* ReadableIndex::createIndexIterBackward(DbContext*) const {
 	return nullptr;
 }
 
+void
+ReadableIndex::searchExactAppendBatch(const fstring* keys, size_t num,
+									  valvec<llong>* recIdvec, size_t* offsets,
+									  DbContext* ctx)
+const {
+	for (size_t k = 0; k < num; ++k) {
+		offsets[k] = recIdvec->size();
+		searchExactAppend(keys[k], recIdvec, ctx);
+	}
+	offsets[num] = recIdvec->size();
+}
+
+llong ReadableIndex::countRange(fstring, fstring, DbContext*) const {
+	return -1;
+}
+
+llong ReadableIndex::scanRange(fstring, fstring,
+							   const std::function<bool(llong)>&, DbContext*)
+const {
+	return -1;
+}
+
+llong ReadableIndex::scanPrefix(fstring,
+								const std::function<bool(fstring, llong)>&,
+								DbContext*)
+const {
+	return -1;
+}
+
 bool ReadableIndex::matchRegexAppend(RegexForIndex* regex,
-									 valvec<llong>* recIdvec, DbContext*)
+									 valvec<llong>* recIdvec, DbContext* ctx)
 const {
-	// not supported
-	return false;
+	IndexIteratorPtr iter(createIndexIterForward(ctx));
+	if (!iter) {
+		// unordered index, not supported
+		return false;
+	}
+	valvec<byte> key, next, matchedKey;
+	bool hasMatched = false;
+	llong id = -1;
+	bool hasKey = iter->increment(&id, &key);
+	while (hasKey) {
+		// dup keys of a matched key
+		if (hasMatched && fstring(key) == fstring(matchedKey)) {
+			recIdvec->push_back(id);
+			hasKey = iter->increment(&id, &key);
+			continue;
+		}
+		if (regex->matchOrNext(key, &next)) {
+			recIdvec->push_back(id);
+			matchedKey.swap(key);
+			hasMatched = true;
+			hasKey = iter->increment(&id, &key);
+			continue;
+		}
+		if (next.empty()) {
+			break;
+		}
+		hasKey = iter->seekLowerBound(next, &id, &key) >= 0;
+	}
+	return true;
 }
 
 void ReadableIndex::encodeIndexKey(const Schema& schema, valvec<byte>& key) const {
@@ -123,6 +191,29 @@ WritableIndex* ReadableIndex::getWritableIndex() {
 WritableIndex::~WritableIndex() {
 }
 
+size_t WritableIndex::insertBatch(const fstring* keys, const llong* ids,
+								  size_t num, DbContext* ctx) {
+	valvec<size_t> order;
+	sortBatchOrder(keys, ids, num, &order);
+	size_t inserted = 0;
+	for (size_t i : order) {
+		if (insert(keys[i], ids[i], ctx))
+			inserted++;
+	}
+	return inserted;
+}
+
+void WritableIndex::sortBatchOrder(const fstring* keys, const llong* ids,
+								   size_t num, valvec<size_t>* order) {
+	order->resize_no_init(num);
+	for (size_t i = 0; i < num; ++i)
+		(*order)[i] = i;
+	std::sort(order->begin(), order->end(), [=](size_t x, size_t y) {
+		int c = fstring_func::compare3()(keys[x], keys[y]);
+		return c ? c < 0 : ids[x] < ids[y];
+	});
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
 IndexIterator::IndexIterator() {
@@ -132,6 +223,9 @@ IndexIterator::IndexIterator() {
 IndexIterator::~IndexIterator() {
 }
 
+SortedIndexInput::~SortedIndexInput() {
+}
+
 int
 IndexIterator::seekUpperBound(fstring key, llong* id, valvec<byte>* retKey) {
 	int ret = seekLowerBound(key, id, retKey);
@@ -152,6 +246,10 @@ IndexIterator::seekMaxPrefix(fstring key, llong* id, valvec<byte>* retKey) {
 		);
 }
 
+bool IndexIterator::setEndKey(fstring endKey) {
+	return endKey.empty();
+}
+
 /////////////////////////////////////////////////////////////////////////////
 EmptyIndexStore::EmptyIndexStore() {}
 EmptyIndexStore::EmptyIndexStore(const Schema&) {}
@@ -209,7 +307,7 @@ void EmptyIndexStore::save(PathRef fpath) const {
 	else {
 		strFpath = strFpath;
 	}
-	FileStream fp(strFpath.c_str(), "wb");
+	EnvFileStream fp(strFpath.c_str(), "wb");
 }
 
 TERARK_DB_REGISTER_STORE("empty", EmptyIndexStore);
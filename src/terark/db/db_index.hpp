@@ -2,6 +2,7 @@
 #define __terark_db_db_index_hpp__
 
 #include "db_store.hpp"
+#include <functional>
 
 namespace terark { namespace db {
 
@@ -37,10 +38,27 @@ public:
 	///         if the return value is 0, it has the same effect as reset
 	virtual size_t seekMaxPrefix(fstring key, llong* id, valvec<byte>* retKey);
 
+	///@param endKey forward iter stops at the first key >= endKey, backward
+	///       iter stops at the first key <= endKey, empty endKey is unbounded
+	///@returns false if not supported, the caller should check keys itself
+	virtual bool setEndKey(fstring endKey);
+
 	inline bool isUniqueInSchema() const { return m_isUniqueInSchema; }
 };
 typedef boost::intrusive_ptr<IndexIterator> IndexIteratorPtr;
 
+// index keys in index order with their record ids, used for building an
+// index incrementally without a SortableStrVec of all keys
+class TERARK_DB_DLL SortedIndexInput {
+public:
+	virtual ~SortedIndexInput();
+	///@returns number of records, recIds are a permutation of [0, numRows)
+	virtual llong numRows() = 0;
+	///@returns false if there are no keys, bounds may be looser than actual
+	virtual bool keyBounds(valvec<byte>* minKey, valvec<byte>* maxKey) = 0;
+	virtual bool next(llong* recId, valvec<byte>* key) = 0;
+};
+
 class TERARK_DB_DLL RegexForIndex : public RefCounter {
 	TERARK_DB_NON_COPYABLE_CLASS(RegexForIndex);
 public:
@@ -57,7 +75,16 @@ public:
 
 	RegexForIndex();
 	virtual ~RegexForIndex();
+
+	/// segments are matched in parallel, methods must be thread safe
 	virtual bool matchText(fstring text) = 0;
+
+	///@returns true if key is matched, else *next is set to the min key
+	///         greater than key which may be matched, *next is empty if
+	///         there is no such key
+	/// used by matching on ordered index, keys in (key, *next) are skipped
+	virtual bool matchOrNext(fstring key, valvec<byte>* next);
+
 	static
 	RegexForIndex* create(fstring clazz, fstring regex, fstring opt);
 };
@@ -84,8 +111,18 @@ public:
 		searchExactAppend(key, recIdvec, ctx);
 	}
 	virtual void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const = 0;
+
+	///@param offsets size is num+1, recIds of keys[k] are appended to
+	///       recIdvec[offsets[k], offsets[k+1])
+	/// sorted keys let implementations reuse search state between keys
+	virtual void searchExactAppendBatch(const fstring* keys, size_t num,
+										valvec<llong>* recIdvec, size_t* offsets,
+										DbContext*) const;
 	///@}
 
+	///@returns false if not supported
+	/// default implementation seeks an ordered index by
+	/// RegexForIndex::matchOrNext, keys must be in byte lex order
 	virtual bool matchRegexAppend(RegexForIndex* regex, valvec<llong>* recIdvec, DbContext*) const;
 
 	///@{ ordered index only
@@ -97,6 +134,28 @@ public:
 
 	virtual IndexIterator* createIndexIterForward(DbContext*) const = 0;
 	virtual IndexIterator* createIndexIterBackward(DbContext*) const = 0;
+
+	///@{ records whose key is in [lo, hi), empty lo or hi is unbounded,
+	/// keys are same as IndexIterator::seekLowerBound, deleted records
+	/// are included, no key is materialized
+	///@returns -1 if not supported, caller should use IndexIterator
+	virtual llong countRange(fstring lo, fstring hi, DbContext*) const;
+
+	///@param onRecord is called with recId in key order, returns false to stop
+	///@returns number of onRecord calls, or -1 if not supported
+	virtual llong scanRange(fstring lo, fstring hi,
+							const std::function<bool(llong recId)>& onRecord,
+							DbContext*) const;
+	///@}
+
+	///@param onKey is called with keys which start with prefix and their
+	///       recIds in key order, returns false to stop, deleted records
+	///       are included
+	///@returns number of onKey calls, or -1 if not supported, caller
+	///         should use IndexIterator
+	virtual llong scanPrefix(fstring prefix,
+				const std::function<bool(fstring key, llong recId)>& onKey,
+				DbContext*) const;
 	///@}
 
 	/// ReadableIndex can be a ReadableStore
@@ -115,6 +174,17 @@ public:
 	virtual bool insert(fstring key, llong id, DbContext*) = 0;
 	virtual bool replace(fstring key, llong id, llong newId, DbContext*) = 0;
 	virtual void clear() = 0;
+
+	/// insert keys[i] with ids[i] for i in [0, num), in key order, so the
+	/// paths of adjacent keys are reused, same as insert for each key
+	///@returns number of inserted keys, dup keys of unique index are skipped
+	virtual size_t insertBatch(const fstring* keys, const llong* ids,
+							   size_t num, DbContext*);
+
+protected:
+	/// order of [0, num) by bytewise key, then by id
+	static void sortBatchOrder(const fstring* keys, const llong* ids,
+							   size_t num, valvec<size_t>* order);
 };
 
 class TERARK_DB_DLL EmptyIndexStore : public ReadableIndex, public ReadableStore {
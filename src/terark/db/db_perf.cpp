@@ -0,0 +1,146 @@
+#include "db_perf.hpp"
+#include <terark/bitmanip.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdio.h>
+#include <string.h>
+
+namespace terark { namespace db {
+
+const char* DbPerfOpName(DbPerfOp op) {
+	static const char* names[] = {
+		"insert", "upsert", "update", "remove", "get", "indexSearch",
+		"iterSeek", "lockWait", "throttle", "flush", "convert", "merge",
+		"purge",
+	};
+	static_assert(sizeof(names)/sizeof(names[0]) == size_t(DbPerfOp::Num),
+				  "names and DbPerfOp mismatch");
+	return size_t(op) < size_t(DbPerfOp::Num) ? names[size_t(op)] : "unknown";
+}
+
+size_t DbPerfCounters::bucketOf(ullong ns) {
+	if (ns < SubNum)
+		return size_t(ns);
+	int hi = 63 - fast_clz64(ns);
+	if (hi >= MaxBits)
+		return BucketNum - 1;
+	size_t sub = size_t(ns >> (hi - SubBits)) & (SubNum - 1);
+	return size_t(hi - SubBits + 1) * SubNum + sub;
+}
+
+ullong DbPerfCounters::bucketUpper(size_t idx) {
+	if (idx < SubNum)
+		return idx;
+	int hi = int(idx / SubNum) + SubBits - 1;
+	ullong sub = idx % SubNum;
+	return ((SubNum + sub + 1) << (hi - SubBits)) - 1;
+}
+
+ullong DbPerfCounters::nowNs() {
+	using namespace std::chrono;
+	return ullong(duration_cast<nanoseconds>(
+		steady_clock::now().time_since_epoch()).count());
+}
+
+static std::atomic<DbPerfCounters::SampleHook> g_perfSampleHook(NULL);
+static std::atomic<size_t> g_perfSampleEvery(1);
+
+void DbPerfCounters::setSampleHook(SampleHook hook, size_t sampleEvery) {
+	g_perfSampleEvery.store(std::max<size_t>(sampleEvery, 1));
+	g_perfSampleHook.store(hook);
+}
+
+DbPerfCounters::DbPerfCounters(const void* owner)
+  : m_shards(new Shard[ShardNum]), m_owner(owner) {
+	reset();
+}
+
+DbPerfCounters::~DbPerfCounters() {
+}
+
+static size_t currentPerfShard() {
+	static std::atomic<size_t> s_next(0);
+	static thread_local size_t t_shard = s_next++ % DbPerfCounters::ShardNum;
+	return t_shard;
+}
+
+void DbPerfCounters::add(DbPerfOp op, ullong ns) {
+	Hist& h = m_shards[currentPerfShard()].hists[size_t(op)];
+	h.buckets[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+	h.sumNs.fetch_add(ns, std::memory_order_relaxed);
+	ullong old = h.maxNs.load(std::memory_order_relaxed);
+	while (ns > old && !h.maxNs.compare_exchange_weak(old, ns,
+									std::memory_order_relaxed)) {}
+	if (SampleHook hook = g_perfSampleHook.load(std::memory_order_relaxed)) {
+		static thread_local size_t t_countdown = 0;
+		if (0 == t_countdown) {
+			t_countdown = g_perfSampleEvery.load(std::memory_order_relaxed);
+			hook(m_owner, op, ns);
+		}
+		t_countdown--;
+	}
+}
+
+void DbPerfCounters::snapshot(DbPerfSnapshot* snap) const {
+	ullong buckets[BucketNum];
+	for (size_t op = 0; op < size_t(DbPerfOp::Num); ++op) {
+		DbPerfOpStat& st = snap->ops[op];
+		memset(&st, 0, sizeof(st));
+		memset(buckets, 0, sizeof(buckets));
+		for (size_t s = 0; s < ShardNum; ++s) {
+			const Hist& h = m_shards[s].hists[op];
+			for (size_t i = 0; i < BucketNum; ++i) {
+				ullong n = h.buckets[i].load(std::memory_order_relaxed);
+				buckets[i] += n;
+				st.count += n;
+			}
+			st.sumNs += h.sumNs.load(std::memory_order_relaxed);
+			st.maxNs = std::max(st.maxNs, h.maxNs.load(std::memory_order_relaxed));
+		}
+		if (0 == st.count)
+			continue;
+		const double pct[4] = { 0.50, 0.90, 0.99, 0.999 };
+		ullong* out[4] = { &st.p50Ns, &st.p90Ns, &st.p99Ns, &st.p999Ns };
+		ullong acc = 0;
+		size_t k = 0;
+		for (size_t i = 0; i < BucketNum && k < 4; ++i) {
+			acc += buckets[i];
+			while (k < 4 && acc >= std::max<ullong>(1, ullong(std::ceil(pct[k] * st.count)))) {
+				*out[k++] = std::min(bucketUpper(i), st.maxNs);
+			}
+		}
+		while (k < 4)
+			*out[k++] = st.maxNs;
+	}
+}
+
+void DbPerfCounters::reset() {
+	for (size_t s = 0; s < ShardNum; ++s) {
+		for (Hist& h : m_shards[s].hists) {
+			for (auto& b : h.buckets)
+				b.store(0, std::memory_order_relaxed);
+			h.sumNs.store(0, std::memory_order_relaxed);
+			h.maxNs.store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+std::string DbPerfSnapshot::toJsonStr() const {
+	std::string js = "{";
+	char buf[320];
+	for (size_t op = 0; op < size_t(DbPerfOp::Num); ++op) {
+		const DbPerfOpStat& st = ops[op];
+		int len = snprintf(buf, sizeof(buf)
+			, "%s\"%s\":{\"count\":%llu,\"sumNs\":%llu,\"maxNs\":%llu"
+			  ",\"p50Ns\":%llu,\"p90Ns\":%llu,\"p99Ns\":%llu,\"p999Ns\":%llu}"
+			, op ? "," : "", DbPerfOpName(DbPerfOp(op))
+			, st.count, st.sumNs, st.maxNs
+			, st.p50Ns, st.p90Ns, st.p99Ns, st.p999Ns);
+		js.append(buf, len);
+	}
+	js.push_back('}');
+	return js;
+}
+
+} } // namespace terark::db
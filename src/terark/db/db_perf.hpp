@@ -0,0 +1,109 @@
+#ifndef __terark_db_db_perf_hpp__
+#define __terark_db_db_perf_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/stdtypes.hpp>
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace terark { namespace db {
+
+enum class DbPerfOp : unsigned char {
+	insert,
+	upsert,
+	update,
+	remove,
+	get,
+	indexSearch,
+	iterSeek,
+	lockWait, // wait for m_rwMutex by writers
+	throttle, // sleep of throttleWrite
+	flush,    // freezeFlushWritableSegment
+	convert,  // frozen writable segment to readonly segment
+	merge,
+	purge,
+	Num
+};
+TERARK_DB_DLL const char* DbPerfOpName(DbPerfOp);
+
+// percentiles are upper bounds of histogram buckets, 0 if count is 0
+struct DbPerfOpStat {
+	ullong count;
+	ullong sumNs;
+	ullong maxNs;
+	ullong p50Ns;
+	ullong p90Ns;
+	ullong p99Ns;
+	ullong p999Ns;
+};
+
+struct TERARK_DB_DLL DbPerfSnapshot {
+	DbPerfOpStat ops[size_t(DbPerfOp::Num)];
+	const DbPerfOpStat& operator[](DbPerfOp op) const { return ops[size_t(op)]; }
+	std::string toJsonStr() const;
+};
+
+// Counters and HDR style histograms of nanoseconds: each power of 2 is
+// split into 8 log-linear buckets, relative error of percentiles is less
+// than 12.5%. Threads are spread over shards, so add() is a few relaxed
+// atomic adds on mostly thread local cache lines, snapshot() merges shards.
+class TERARK_DB_DLL DbPerfCounters {
+public:
+	enum {
+		SubBits = 3,
+		SubNum = 1 << SubBits,
+		MaxBits = 40, // about 18 minutes, larger latencies are clamped
+		BucketNum = (MaxBits - SubBits + 1) * SubNum,
+		ShardNum = 8,
+	};
+	static size_t bucketOf(ullong ns);
+	static ullong bucketUpper(size_t idx);
+	static ullong nowNs();
+
+	/// process wide hook of sampled ops, it is called by add() in the thread
+	/// of the op for 1 of each sampleEvery ops of the thread, owner is from
+	/// the constructor, such as the DbTable. NULL hook disables sampling
+	typedef void (*SampleHook)(const void* owner, DbPerfOp, ullong ns);
+	static void setSampleHook(SampleHook, size_t sampleEvery);
+
+	explicit DbPerfCounters(const void* owner = NULL);
+	~DbPerfCounters();
+	void add(DbPerfOp op, ullong ns);
+	void snapshot(DbPerfSnapshot*) const;
+	void reset();
+
+private:
+	struct Hist {
+		std::atomic<ullong> buckets[BucketNum];
+		std::atomic<ullong> sumNs;
+		std::atomic<ullong> maxNs;
+	};
+	struct Shard {
+		Hist hists[size_t(DbPerfOp::Num)];
+		char padding[64]; // no false sharing with the next shard
+	};
+	std::unique_ptr<Shard[]> m_shards;
+	const void* m_owner;
+};
+
+// time the scope or until stop(), it is a noop if counters is NULL
+class DbPerfTimer {
+	DbPerfCounters* m_pc;
+	DbPerfOp m_op;
+	ullong   m_t0;
+public:
+	DbPerfTimer(DbPerfCounters* pc, DbPerfOp op)
+		: m_pc(pc), m_op(op), m_t0(pc ? DbPerfCounters::nowNs() : 0) {}
+	~DbPerfTimer() { stop(); }
+	void stop() {
+		if (m_pc) {
+			m_pc->add(m_op, DbPerfCounters::nowNs() - m_t0);
+			m_pc = NULL;
+		}
+	}
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_db_perf_hpp__
@@ -0,0 +1,86 @@
+#ifndef __terark_db_db_probes_hpp__
+#define __terark_db_db_probes_hpp__
+
+// USDT probes of provider "terarkdb" on hot paths of DbTable, they are
+// compiled in by WITH_USDT=1 of the Makefile(needs <sys/sdt.h> of systemtap
+// sdt dev package), else they are compiled out. A probe is a nop
+// instruction until a tracer attaches, arguments are registers or memory
+// which are read just by the tracer, list probes of a build by:
+//     bpftrace -l 'usdt:/path/to/libterark-db-*.so:terarkdb:*'
+// Tracers increment the semaphore of a probe(TERARK_DB_PROBE_ENABLED) when
+// they attach, so arguments which are not free are computed just if traced.
+//
+// Probes, the first argument is the DbTable*:
+//   insert__start/done(tab)          upsert__start/done(tab)
+//   update__start/done(tab, id)      remove__start/done(tab, id)
+//   lock__wait__start/done(tab)      wait of writers for m_rwMutex
+//   throttle__start/done(tab)        sleeps of throttleWrite
+//   index__probe__start(tab, segIdx, indexId, segKind)
+//   index__probe__done(tab, segIdx, indexId, hits)
+//                                    indexSearchExact on one segment,
+//                                    segKind is "readonly", "writable" ...
+//   bgtask__start/done(tab, taskName) tasks of compress and flush threads
+
+#define TERARK_DB_PROBE_LIST(X) \
+	X(insert__start) X(insert__done) \
+	X(upsert__start) X(upsert__done) \
+	X(update__start) X(update__done) \
+	X(remove__start) X(remove__done) \
+	X(lock__wait__start) X(lock__wait__done) \
+	X(throttle__start) X(throttle__done) \
+	X(index__probe__start) X(index__probe__done) \
+	X(bgtask__start) X(bgtask__done)
+
+#if defined(TERARK_DB_WITH_USDT) && defined(__linux__)
+	#define _SDT_HAS_SEMAPHORES 1
+	#include <sys/sdt.h>
+
+	#define TERARK_DB_PROBE_SEMAPHORE_DECL(name) \
+		extern unsigned short terarkdb_##name##_semaphore;
+	extern "C" { TERARK_DB_PROBE_LIST(TERARK_DB_PROBE_SEMAPHORE_DECL) }
+
+	/// semaphores are defined once, by a translation unit of the probes
+	#define TERARK_DB_PROBE_SEMAPHORE_DEF(name) \
+		unsigned short terarkdb_##name##_semaphore \
+			__attribute__((section(".probes"), visibility("hidden"))) = 0;
+	#define TERARK_DB_DEFINE_PROBE_SEMAPHORES() \
+		extern "C" { TERARK_DB_PROBE_LIST(TERARK_DB_PROBE_SEMAPHORE_DEF) }
+
+	#define TERARK_DB_PROBE_ENABLED(name) \
+		__builtin_expect(terarkdb_##name##_semaphore != 0, 0)
+	#define TERARK_DB_PROBE1(name, a1) \
+		DTRACE_PROBE1(terarkdb, name, a1)
+	#define TERARK_DB_PROBE2(name, a1, a2) \
+		DTRACE_PROBE2(terarkdb, name, a1, a2)
+	#define TERARK_DB_PROBE4(name, a1, a2, a3, a4) \
+		DTRACE_PROBE4(terarkdb, name, a1, a2, a3, a4)
+#else
+	#define TERARK_DB_DEFINE_PROBE_SEMAPHORES()
+	#define TERARK_DB_PROBE_ENABLED(name) false
+	#define TERARK_DB_PROBE1(name, a1) do {} while (0)
+	#define TERARK_DB_PROBE2(name, a1, a2) do {} while (0)
+	#define TERARK_DB_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#endif
+
+/// name##__start(a1, a2) on this statement and name##__done(a1, a2) on the
+/// exit of the scope, including exceptions, a1 and a2 are plain variables
+#if defined(TERARK_DB_WITH_USDT) && defined(__linux__)
+	#define TERARK_DB_PROBE_SCOPE1(name, a1) \
+		TERARK_DB_PROBE1(name##__start, a1); \
+		struct TerarkDbProbe_##name { \
+			decltype(a1) x1; \
+			~TerarkDbProbe_##name() { TERARK_DB_PROBE1(name##__done, x1); } \
+		} terarkDbProbe_##name = { a1 }
+	#define TERARK_DB_PROBE_SCOPE2(name, a1, a2) \
+		TERARK_DB_PROBE2(name##__start, a1, a2); \
+		struct TerarkDbProbe_##name { \
+			decltype(a1) x1; \
+			decltype(a2) x2; \
+			~TerarkDbProbe_##name() { TERARK_DB_PROBE2(name##__done, x1, x2); } \
+		} terarkDbProbe_##name = { a1, a2 }
+#else
+	#define TERARK_DB_PROBE_SCOPE1(name, a1) do { (void)(a1); } while (0)
+	#define TERARK_DB_PROBE_SCOPE2(name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#endif
+
+#endif // __terark_db_db_probes_hpp__
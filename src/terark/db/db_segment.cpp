@@ -4,8 +4,14 @@
 #include "zip_int_store.hpp"
 #include "fixed_len_key_index.hpp"
 #include "fixed_len_store.hpp"
+#include "seq_num_index.hpp"
+#include "bitmap_index.hpp"
 #include "appendonly.hpp"
+#include "value_cache.hpp"
+#include "segment_events.hpp"
+#include "db_env.hpp"
 #include <terark/util/autoclose.hpp>
+#include <terark/util/linebuf.hpp>
 #include <terark/io/FileStream.hpp>
 #include <terark/io/StreamBuffer.hpp>
 #include <terark/io/DataIO.hpp>
@@ -15,6 +21,8 @@
 #include <terark/util/mmap.hpp>
 #include <terark/util/sortable_strvec.hpp>
 #include <terark/util/truncate_file.hpp>
+#include <terark/util/profiling.hpp>
+#include <terark/thread/pipeline.hpp>
 //#include <boost/dll.hpp>
 
 //#define TERARK_DB_ENABLE_DFA_META
@@ -34,6 +42,8 @@
 #include "json.hpp"
 
 #include <boost/scope_exit.hpp>
+#include <condition_variable>
+#include <mutex>
 
 //#define SLOW_DEBUG_CHECK
 
@@ -142,19 +152,22 @@ ReadableSegment::ReadableSegment() {
 	m_hasLockFreePointSearch = true;
 	m_bookUpdates = false;
 	m_withPurgeBits = false;
+	m_isReplica = false;
     m_onProcess = false;
+	m_isQuarantined = false;
+	m_timePartition = LLONG_MIN;
 	m_isPurgedMmap = nullptr;
+	m_uniqKeyFilterGen = 0;
 }
 ReadableSegment::~ReadableSegment() {
 	if (m_isDelMmap) {
 		closeIsDel();
 	}
-	else if (m_isDirty && !m_tobeDel && !m_segDir.empty()) {
+	else if (m_isDirty && !m_tobeDel && !m_isReplica && !m_segDir.empty()) {
 		saveIsDel(m_segDir);
 	}
 	m_indices.clear(); // destroy index objects
 	m_colgroups.clear();
-	m_deletionTime = nullptr;
 	assert(!m_segDir.empty());
 	if (m_tobeDel && !m_segDir.empty()) {
 		fprintf(stderr, "INFO: remove: %s\n", m_segDir.string().c_str());
@@ -192,6 +205,113 @@ llong ReadableSegment::numDataRows() const {
 	return m_isDel.size();
 }
 
+void
+ReadableSegment::indexSearchExactAppendBatch(size_t mySegIdx, size_t indexId,
+										const fstring* keys, size_t num,
+										valvec<llong>* recIdvec, size_t* offsets,
+										DbContext* ctx) const {
+	for (size_t k = 0; k < num; ++k) {
+		offsets[k] = recIdvec->size();
+		indexSearchExactAppend(mySegIdx, indexId, keys[k], recIdvec, ctx);
+	}
+	offsets[num] = recIdvec->size();
+}
+
+fstring
+ReadableSegment::selectOneColgroupRef(llong id, size_t cgId,
+									  valvec<byte>* buf, DbContext* ctx)
+const {
+	selectColgroups(id, &cgId, 1, buf, ctx);
+	return *buf;
+}
+
+llong
+ReadableSegment::indexCountRange(size_t mySegIdx, size_t indexId,
+								 fstring lo, fstring hi, DbContext* ctx)
+const {
+	size_t purgeCnt = m_isPurged.empty() ? 0 : m_isPurged.max_rank1();
+	if (m_isFreezed && m_delcnt == purgeCnt) {
+		// no deleted record in index
+		llong cnt = m_indices[indexId]->countRange(lo, hi, ctx);
+		if (cnt >= 0)
+			return cnt;
+	}
+	return indexScanRange(mySegIdx, indexId, lo, hi,
+						  [](llong) { return true; }, ctx);
+}
+
+llong
+ReadableSegment::indexScanRange(size_t mySegIdx, size_t indexId,
+								fstring lo, fstring hi,
+								const std::function<bool(llong)>& onRecord,
+								DbContext* ctx)
+const {
+	auto index = m_indices[indexId].get();
+	llong cnt = 0;
+	bool  hasNext = true;
+	auto onIndexRecord = [&](llong physicId) {
+		size_t logicId = getLogicId(size_t(physicId));
+		if (testIsDel(logicId, ctx))
+			return true;
+		++cnt;
+		return hasNext = onRecord(logicId);
+	};
+	if (index->scanRange(lo, hi, onIndexRecord, ctx) >= 0) {
+		return cnt;
+	}
+	// index has no scanRange, keys are materialized by iterator
+	const Schema& schema = m_schema->getIndexSchema(indexId);
+	IndexIteratorPtr iter(index->createIndexIterForward(ctx));
+	llong physicId = -1;
+	auto key = ctx->bufs.get();
+	bool found;
+	if (lo.empty())
+		found = iter->increment(&physicId, key.get());
+	else
+		found = iter->seekLowerBound(lo, &physicId, key.get()) >= 0;
+	while (found && hasNext) {
+		if (!hi.empty() && schema.compareData(*key, hi) >= 0)
+			break;
+		onIndexRecord(physicId);
+		found = iter->increment(&physicId, key.get());
+	}
+	return cnt;
+}
+
+llong
+ReadableSegment::indexScanPrefix(size_t mySegIdx, size_t indexId, fstring prefix,
+						const std::function<bool(fstring, llong)>& onKey,
+						DbContext* ctx)
+const {
+	auto index = m_indices[indexId].get();
+	llong cnt = 0;
+	bool  hasNext = true;
+	auto onIndexKey = [&](fstring key, llong physicId) {
+		size_t logicId = getLogicId(size_t(physicId));
+		if (testIsDel(logicId, ctx))
+			return true;
+		++cnt;
+		return hasNext = onKey(key, logicId);
+	};
+	if (index->scanPrefix(prefix, onIndexKey, ctx) >= 0) {
+		return cnt;
+	}
+	// index has no scanPrefix
+	IndexIteratorPtr iter(index->createIndexIterForward(ctx));
+	llong physicId = -1;
+	auto key = ctx->bufs.get();
+	bool found;
+	if (prefix.empty())
+		found = iter->increment(&physicId, key.get());
+	else
+		found = iter->seekLowerBound(prefix, &physicId, key.get()) >= 0;
+	while (found && hasNext && fstring(*key).startsWith(prefix)) {
+		onIndexKey(*key, physicId);
+		found = iter->increment(&physicId, key.get());
+	}
+	return cnt;
+}
+
 void ReadableSegment::saveIsDel(PathRef dir) const {
 	assert(m_isDel.popcnt() == m_delcnt);
 	if (m_isDelMmap && dir == m_segDir) {
@@ -201,7 +321,7 @@ void ReadableSegment::saveIsDel(PathRef dir) const {
 	fs::path isDelFpath = dir / "IsDel";
 	fs::path tmpFpath = isDelFpath + ".tmp";
 	{
-		NativeDataOutput<FileStream> file;
+		NativeDataOutput<EnvFileStream> file;
 		file.open(tmpFpath.string().c_str(), "wb");
 		file << uint64_t(m_isDel.size());
 		file.ensureWrite(m_isDel.bldata(), m_isDel.mem_size());
@@ -219,15 +339,101 @@ void ReadableSegment::loadIsDel(PathRef dir) {
 	}
 	m_delcnt = 0;
 	m_isDelMmap = loadIsDel_aux(dir, m_isDel);
-	m_delcnt = m_isDel.popcnt();
+	m_delcnt = rebuildIsDelBlocks();
+}
+
+static inline std::atomic<bm_uint_t>& atomicWord(bm_uint_t* words, size_t bitpos) {
+	static_assert(sizeof(std::atomic<bm_uint_t>) == sizeof(bm_uint_t), "atomic word");
+	return reinterpret_cast<std::atomic<bm_uint_t>&>(words[bitpos / WordBits]);
+}
+
+bool ReadableSegment::atomicSetIsDel1(size_t logicId) {
+	assert(logicId < m_isDel.size());
+	bm_uint_t mask = bm_uint_t(1) << (logicId % WordBits);
+	bm_uint_t old = atomicWord(m_isDel.bldata(), logicId).fetch_or(mask);
+	if (old & mask) {
+		return false;
+	}
+	if (!m_isDelBlocks.empty()) {
+		size_t b = logicId >> IsDelBlockBits;
+		atomicWord(m_isDelBlocks.bldata(), b).fetch_or(bm_uint_t(1) << (b % WordBits));
+	}
+	m_delcnt++;
+	return true;
+}
+
+bool ReadableSegment::atomicSetIsDel0(size_t logicId) {
+	assert(logicId < m_isDel.size());
+	bm_uint_t mask = bm_uint_t(1) << (logicId % WordBits);
+	bm_uint_t old = atomicWord(m_isDel.bldata(), logicId).fetch_and(~mask);
+	if (!(old & mask)) {
+		return false;
+	}
+	m_delcnt--; // m_isDelBlocks is a superset, keep it
+	return true;
+}
+
+size_t ReadableSegment::atomicSetIsDelAll() {
+	const size_t rows = m_isDel.size();
+	bm_uint_t* words = m_isDel.bldata();
+	size_t newDel = 0;
+	for (size_t i = 0; i < rows; i += WordBits) {
+		bm_uint_t mask = rows - i >= WordBits ? ~bm_uint_t(0)
+					   : (bm_uint_t(1) << (rows - i)) - 1;
+		bm_uint_t old = atomicWord(words, i).fetch_or(mask);
+		newDel += fast_popcount(bm_uint_t(mask & ~old));
+	}
+	if (!m_isDelBlocks.empty()) {
+		m_isDelBlocks.set1(0, m_isDelBlocks.size()); // only sets bits
+	}
+	m_delcnt += newDel;
+	return newDel;
+}
+
+size_t ReadableSegment::rebuildIsDelBlocks() {
+	static_assert(IsDelBlockRows % WordBits == 0, "IsDelBlockRows");
+	const size_t BlockWords = IsDelBlockRows / WordBits;
+	const size_t rows = m_isDel.size();
+	const bm_uint_t* words = m_isDel.bldata();
+	const size_t nWords = rows / WordBits;
+	const size_t nBlocks = (rows + IsDelBlockRows - 1) / IsDelBlockRows;
+	if (NULL == getReadonlySegment() || 0 == rows) {
+		m_isDelBlocks.clear();
+		return m_isDel.popcnt();
+	}
+	febitvec blocks(nBlocks, false);
+	size_t delcnt = 0, dirtyBlocks = 0;
+	for (size_t b = 0; b < nBlocks; ++b) {
+		size_t beg = b * BlockWords;
+		size_t end = std::min(beg + BlockWords, nWords);
+		size_t cnt = 0;
+		for (size_t i = beg; i < end; ++i)
+			cnt += fast_popcount(words[i]);
+		if (end == nWords && rows % WordBits && end < beg + BlockWords)
+			cnt += fast_popcount_trail(words[nWords], rows % WordBits);
+		if (cnt) {
+			blocks.set1(b);
+			dirtyBlocks++;
+		}
+		delcnt += cnt;
+	}
+	// a replica shares the mmap of IsDel with the writer, which does not
+	// update m_isDelBlocks of the replica, so m_isDel is checked directly
+	if (dirtyBlocks * 2 > nBlocks || m_isReplica) {
+		m_isDelBlocks.clear(); // dense, m_isDel is checked directly
+	} else {
+		m_isDelBlocks.swap(blocks);
+	}
+	return delcnt;
 }
 
+
 byte* ReadableSegment::loadIsDel_aux(PathRef segDir, febitvec& isDel) const {
 	fs::path isDelFpath = segDir / "IsDel";
 	size_t bytes = 0;
-	bool writable = true;
+	bool writable = !m_isReplica; // shared readonly, sees delmarks of writer
 	std::string fpath = isDelFpath.string();
-	byte* isDelMmap = (byte*)mmap_load(fpath, &bytes, writable);
+	byte* isDelMmap = (byte*)DbEnv::current()->mmapLoad(fpath, &bytes, writable);
 	uint64_t rowNum = ((uint64_t*)isDelMmap)[0];
 	isDel.risk_mmap_from(isDelMmap + 8, bytes - 8);
 	assert(isDel.size() >= rowNum);
@@ -238,13 +444,14 @@ byte* ReadableSegment::loadIsDel_aux(PathRef segDir, febitvec& isDel) const {
 void ReadableSegment::closeIsDel() {
 	if (m_isDelMmap) {
 		size_t bitBytes = m_isDel.capacity()/8;
-		mmap_close(m_isDelMmap, sizeof(uint64_t) + bitBytes);
+		DbEnv::current()->mmapClose(m_isDelMmap, sizeof(uint64_t) + bitBytes);
 		m_isDel.risk_release_ownership();
 		m_isDelMmap = NULL;
 	}
 	else {
 		m_isDel.clear();
 	}
+	m_isDelBlocks.clear();
 }
 
 void ReadableSegment::openIndices(PathRef segDir) {
@@ -281,21 +488,6 @@ void ReadableSegment::load(PathRef segDir) {
 	this->loadIsDel(segDir);
 	this->openIndices(segDir);
 	this->loadRecordStore(segDir);
-	if (m_schema->m_snapshotSchema) {
-		fs::path fpath = segDir / "deletion-time.fixlen";
-		auto deltime = new FixedLenStore(*m_schema->m_snapshotSchema);
-		if (this->getReadonlySegment()) {
-			deltime->unneedsLock();
-		}
-		m_deletionTime = deltime;
-		m_deletionTime->load(fpath);
-		size_t physicRows = this->getPhysicRows();
-		if (size_t(m_deletionTime->numDataRows()) != physicRows) {
-			THROW_STD(invalid_argument
-				, "m_deletionTime->numDataRows() = %lld, m_isDel.size() = %zd, must be the same"
-				, m_deletionTime->numDataRows(), physicRows);
-		}
-	}
 }
 
 void ReadableSegment::save(PathRef segDir) const {
@@ -306,10 +498,6 @@ void ReadableSegment::save(PathRef segDir) const {
 	this->saveRecordStore(segDir);
 	this->saveIndices(segDir);
 	this->saveIsDel(segDir);
-	if (m_deletionTime) {
-		assert(getPhysicRows() == size_t(m_deletionTime->numDataRows()));
-		m_deletionTime->save(segDir / "deletion-time");
-	}
 }
 
 size_t ReadableSegment::getPhysicRows() const {
@@ -344,35 +532,117 @@ size_t ReadableSegment::getLogicId(size_t physicId) const {
 	}
 }
 
+bool ReadableSegment::testIsDel(size_t logicId, const DbContext* ctx) const {
+	return testIsDel(logicId) && !isDelAfterSnapshot(logicId, ctx);
+}
+
+// stamps are only in frozen segments, whose readers don't hold m_segMutex
+bool
+ReadableSegment::isDelAfterSnapshot(size_t logicId, const DbContext* ctx) const {
+	if (!ctx->m_isUserDefineSnapshot || !m_isFreezed) {
+		return false;
+	}
+	SpinRwLock lock(m_segMutex, false);
+	size_t i = m_delVersions.find_i(uint32_t(logicId));
+	return i < m_delVersions.end_i() &&
+		m_delVersions.val(i) >= ctx->m_mySnapshotSeq;
+}
+
+void ReadableSegment::setDelVersionNoLock(size_t logicId, llong version) {
+	assert(m_isFreezed);
+	assert(logicId < m_isDel.size());
+	m_delVersions[uint32_t(logicId)] = version;
+}
+
+size_t
+ReadableSegment::keepSnapshotRows(febitvec* purgeBits, llong oldestVersion)
+const {
+	if (LLONG_MAX == oldestVersion) {
+		return 0;
+	}
+	SpinRwLock lock(m_segMutex, false);
+	size_t kept = 0;
+	for (size_t i = 0; i < m_delVersions.end_i(); ++i) {
+		size_t logicId = m_delVersions.key(i);
+		if (m_delVersions.val(i) >= oldestVersion && logicId < purgeBits->size()
+				&& purgeBits->is1(logicId)) {
+			purgeBits->set0(logicId);
+			kept++;
+		}
+	}
+	return kept;
+}
+
+void
+ReadableSegment::copyDelVersions(const ReadableSegment& src, size_t baseId,
+								 llong oldestVersion) {
+	assert(this != &src);
+	if (LLONG_MAX == oldestVersion) {
+		return;
+	}
+	SpinRwLock srcLock(src.m_segMutex, false);
+	SpinRwLock dstLock(m_segMutex, true);
+	for (size_t i = 0; i < src.m_delVersions.end_i(); ++i) {
+		if (src.m_delVersions.val(i) >= oldestVersion) {
+			size_t logicId = baseId + src.m_delVersions.key(i);
+			assert(logicId < m_isDel.size());
+			m_delVersions[uint32_t(logicId)] = src.m_delVersions.val(i);
+		}
+	}
+}
+
+void ReadableSegment::gcDelVersions(llong oldestVersion) {
+	SpinRwLock lock(m_segMutex, true);
+	if (LLONG_MAX == oldestVersion) {
+		m_delVersions.clear();
+		return;
+	}
+	m_delVersions.erase_if([=](const std::pair<uint32_t, llong>& kv) {
+		return kv.second < oldestVersion;
+	});
+}
+
+bool ReadableSegment::hasDelVersions() const {
+	SpinRwLock lock(m_segMutex, false);
+	return m_delVersions.size() != 0;
+}
+
 void ReadableSegment::addtoUpdateList(size_t logicId) {
 	assert(m_isFreezed);
 	if (!m_bookUpdates) {
 		return;
 	}
-	const size_t rows = m_isDel.size();
-	if ((m_updateList.unused() > 0 || m_updateList.size() < rows / 256) && m_updateBits.empty()) {
-		m_updateList.push_back(logicId);
-	}
-	else if (!m_updateBits.empty()) {
-		assert(m_updateBits.size() == rows + 1);
-		m_updateBits.set1(logicId);
+	assert(logicId < m_isDel.size());
+	m_updateIds.add(logicId);
+}
+
+void UpdatedIdRuns::mergePending() {
+	if (m_pending.empty()) {
+		return;
 	}
-	else {
-		// reserve an extra bit as the guard
-		m_updateBits.resize(rows + 1, false);
-		bm_uint_t* bits = m_updateBits.bldata();
-		uint32_t* idvec = m_updateList.data();
-		size_t    idnum = m_updateList.size();
-		for(size_t i = 0; i < idnum; ++i) {
-			size_t id = idvec[i];
-			assert(id < rows);
-			terark_bit_set1(bits, id);
+	std::sort(m_pending.begin(), m_pending.end());
+	valvec<Run> merged(m_runs.size() + m_pending.size(), valvec_reserve());
+	auto append = [&merged](uint32_t beg, uint32_t end) {
+		if (!merged.empty() && merged.back().end >= beg) {
+			merged.back().end = std::max(merged.back().end, end);
+		} else {
+			merged.push_back({beg, end});
+		}
+	};
+	size_t i = 0, j = 0;
+	while (i < m_runs.size() || j < m_pending.size()) {
+		if (j == m_pending.size() ||
+				(i < m_runs.size() && m_runs[i].beg <= m_pending[j])) {
+			append(m_runs[i].beg, m_runs[i].end);
+			i++;
+		} else {
+			append(m_pending[j], m_pending[j] + 1);
+			j++;
 		}
-		terark_bit_set1(bits, logicId);
-		// set the last bit to 1 as the guard
-		terark_bit_set1(bits, rows);
-		m_updateList.clear();
 	}
+	merged.shrink_to_fit();
+	m_runs.swap(merged);
+	m_pending.erase_all();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -381,6 +651,7 @@ ColgroupSegment::ColgroupSegment() {
 	m_dataMemSize = 0;
 	m_totalStorageSize = 0;
 	m_dataInflateSize = 0;
+	m_valueCacheSegId = 0;
 }
 ColgroupSegment::~ColgroupSegment() {
 	assert(nullptr == m_isPurgedMmap);
@@ -391,12 +662,311 @@ ColgroupSegment* ColgroupSegment::getColgroupSegment() const {
 	return const_cast<ColgroupSegment*>(this);
 }
 
+IndexBloomFilter::IndexBloomFilter() {
+	m_blocks = NULL;
+	m_mmapBase = NULL;
+	m_mmapSize = 0;
+	m_numBlocks = 0;
+	m_numProbes = 0;
+}
+IndexBloomFilter::~IndexBloomFilter() {
+	if (m_mmapBase) {
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
+	}
+}
+
+namespace {
+	struct BloomFileHeader {
+		char     magic[8];
+		uint32_t version;
+		uint32_t numProbes;
+		uint64_t numBlocks;
+		uint64_t reserved;
+	};
+	BOOST_STATIC_ASSERT(sizeof(BloomFileHeader) == 32);
+	const char g_bloomMagic[8] = {'T','d','b','B','l','o','o','m'};
+}
+
+uint64_t IndexBloomFilter::hashKey(fstring key) {
+	const uint64_t mul = 0x9E3779B97F4A7C15ULL;
+	const byte* p = key.udata();
+	const size_t n = key.size();
+	uint64_t h = n * mul;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		h = (h ^ unaligned_load<uint64_t>(p + i)) * mul;
+		h ^= h >> 29;
+	}
+	if (i < n) {
+		uint64_t x = 0;
+		memcpy(&x, p + i, n - i);
+		h = (h ^ x) * mul;
+	}
+	// murmur3 fmix64
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// high 32 bits of hash select the block, low 32 bits generate probes
+static inline size_t bloomBlockIdx(uint64_t h, size_t numBlocks) {
+	return size_t(((h >> 32) * uint64_t(numBlocks)) >> 32);
+}
+static inline uint32_t bloomProbeDelta(uint32_t h1) {
+	return (h1 >> 17) | (h1 << 15);
+}
+
+void IndexBloomFilter::init(size_t numKeys, int bitsPerKey) {
+	assert(bitsPerKey > 0);
+	assert(NULL == m_mmapBase);
+	size_t numBits = std::max<size_t>(numKeys * bitsPerKey, 512);
+	m_numBlocks = std::min<size_t>((numBits + 511) / 512, UINT32_MAX);
+	m_numProbes = std::max(1, std::min(16, int(bitsPerKey * 0.69 + 0.5)));
+	m_owned.resize(8 * m_numBlocks, 0);
+	m_blocks = m_owned.data();
+}
+
+void IndexBloomFilter::add(fstring key) {
+	assert(m_owned.data() == m_blocks);
+	uint64_t h = hashKey(key);
+	uint64_t* block = m_owned.data() + 8 * bloomBlockIdx(h, m_numBlocks);
+	uint32_t h1 = uint32_t(h), h2 = bloomProbeDelta(h1);
+	for (uint32_t k = 0; k < m_numProbes; ++k, h1 += h2) {
+		uint32_t bit = h1 & 511;
+		block[bit >> 6] |= uint64_t(1) << (bit & 63);
+	}
+}
+
+void IndexBloomFilter::build(const SortableStrVec& keys, size_t fixlen,
+							 int bitsPerKey) {
+	size_t numKeys = keys.m_index.size();
+	if (0 == numKeys && fixlen) {
+		numKeys = keys.str_size() / fixlen;
+	}
+	init(numKeys, bitsPerKey);
+	if (keys.m_index.size()) {
+		for (size_t i = 0; i < numKeys; ++i)
+			add(keys[i]);
+	}
+	else {
+		const byte* base = keys.m_strpool.data();
+		for (size_t i = 0; i < numKeys; ++i)
+			add(fstring(base + fixlen * i, fixlen));
+	}
+}
+
+bool IndexBloomFilter::mayContain(fstring key) const {
+	assert(m_numBlocks > 0);
+	uint64_t h = hashKey(key);
+	const uint64_t* block = m_blocks + 8 * bloomBlockIdx(h, m_numBlocks);
+	uint32_t h1 = uint32_t(h), h2 = bloomProbeDelta(h1);
+	for (uint32_t k = 0; k < m_numProbes; ++k, h1 += h2) {
+		uint32_t bit = h1 & 511;
+		if (!((block[bit >> 6] >> (bit & 63)) & 1))
+			return false;
+	}
+	return true;
+}
+
+void IndexBloomFilter::load(PathRef fpath) {
+	assert(NULL == m_mmapBase);
+	std::string strFile = fpath.string();
+	size_t fsize = 0;
+	byte* base = (byte*)DbEnv::current()->mmapLoad(strFile, &fsize);
+	auto hdr = (const BloomFileHeader*)base;
+	if (fsize < sizeof(BloomFileHeader)
+			|| memcmp(hdr->magic, g_bloomMagic, 8) != 0
+			|| hdr->version != 1
+			|| hdr->numBlocks == 0
+			|| fsize != sizeof(BloomFileHeader) + 64 * hdr->numBlocks) {
+		DbEnv::current()->mmapClose(base, fsize);
+		TERARK_THROW(DbException, "bad bloom filter file: %s, fsize = %zd"
+			, strFile.c_str(), fsize);
+	}
+	m_mmapBase = base;
+	m_mmapSize = fsize;
+	m_numBlocks = size_t(hdr->numBlocks);
+	m_numProbes = hdr->numProbes;
+	m_blocks = (const uint64_t*)(base + sizeof(BloomFileHeader));
+	m_owned.clear();
+}
+
+void IndexBloomFilter::save(PathRef fpath) const {
+	BloomFileHeader hdr;
+	memcpy(hdr.magic, g_bloomMagic, 8);
+	hdr.version = 1;
+	hdr.numProbes = m_numProbes;
+	hdr.numBlocks = m_numBlocks;
+	hdr.reserved = 0;
+	EnvFileStream fp(fpath.string().c_str(), "wb");
+	fp.ensureWrite(&hdr, sizeof(hdr));
+	fp.ensureWrite(m_blocks, 64 * m_numBlocks);
+}
+
+PurgeRemapStore::PurgeRemapStore(ReadableStore* store, const febitvec& purged)
+	: m_store(store) {
+	assert(size_t(store->numDataRows()) == purged.size());
+	m_remapMmap = NULL;
+	m_remapMmapSize = 0;
+	m_remap.assign(purged);
+	m_remap.build_cache(true, false); // need select0
+	m_isFreezed = true;
+}
+PurgeRemapStore::PurgeRemapStore(ReadableStore* store, PathRef remapFile)
+	: m_store(store) {
+	m_remapFile = remapFile.string();
+	m_remapMmap = (byte*)DbEnv::current()->mmapLoad(m_remapFile, &m_remapMmapSize);
+	m_remap.risk_mmap_from(m_remapMmap, m_remapMmapSize);
+	m_isFreezed = true;
+	if (m_remap.size() != size_t(store->numDataRows())) {
+		TERARK_THROW(DbException
+			, "FATAL: %s: remap.size = %zd, store.rows = %lld"
+			, m_remapFile.c_str(), m_remap.size(), store->numDataRows());
+	}
+}
+PurgeRemapStore::~PurgeRemapStore() {
+	if (m_remapMmap) {
+		m_remap.risk_release_ownership();
+		DbEnv::current()->mmapClose(m_remapMmap, m_remapMmapSize);
+	}
+}
+
+fs::path PurgeRemapStore::remapFilePath(PathRef storePath) {
+	return storePath.parent_path() / ("remap-" + storePath.filename().string() + ".rs");
+}
+
+llong PurgeRemapStore::dataStorageSize() const {
+	return m_store->dataStorageSize() + m_remap.mem_size();
+}
+llong PurgeRemapStore::dataInflateSize() const {
+	// purged rows are not excluded, it is just an estimation
+	double liveRatio = double(m_remap.max_rank0()) / m_remap.size();
+	return llong(m_store->dataInflateSize() * liveRatio);
+}
+llong PurgeRemapStore::numDataRows() const {
+	return m_remap.max_rank0();
+}
+void PurgeRemapStore::getValueAppend(llong id, valvec<byte>* val, DbContext* ctx) const {
+	assert(id >= 0);
+	assert(size_t(id) < m_remap.max_rank0());
+	m_store->getValueAppend(m_remap.select0(size_t(id)), val, ctx);
+}
+bool PurgeRemapStore::hasValueRef() const {
+	return m_store->hasValueRef();
+}
+fstring PurgeRemapStore::getValueRef(llong id, DbContext* ctx) const {
+	assert(id >= 0);
+	assert(size_t(id) < m_remap.max_rank0());
+	return m_store->getValueRef(m_remap.select0(size_t(id)), ctx);
+}
+StoreIterator* PurgeRemapStore::createStoreIterForward(DbContext*) const {
+	return nullptr; // use default iterator
+}
+StoreIterator* PurgeRemapStore::createStoreIterBackward(DbContext*) const {
+	return nullptr; // use default iterator
+}
+void PurgeRemapStore::load(PathRef) {
+	THROW_STD(invalid_argument, "Unsupported, opened by loadRecordStore");
+}
+void PurgeRemapStore::save(PathRef path) const {
+	m_store->save(path);
+	fs::path remapFile = remapFilePath(path);
+	if (m_remapMmap && remapFile.string() == m_remapFile)
+		return;
+	EnvFileStream fp(remapFile.string().c_str(), "wb");
+	fp.ensureWrite(m_remap.data(), m_remap.mem_size());
+}
+
+LayoutProjectStore::LayoutProjectStore() {
+	m_isFreezed = true;
+}
+LayoutProjectStore::~LayoutProjectStore() {
+}
+
+void LayoutProjectStore::addColumn(ReadableStore* store, const SchemaPtr& schema,
+								   size_t subColumnId) {
+	size_t k = 0;
+	while (k < m_sources.size() && m_sources[k].store.get() != store)
+		++k;
+	if (k == m_sources.size()) {
+		m_sources.push_back({store, schema, 0});
+	}
+	m_sources[k].usedColumns++;
+	m_columns.push_back({uint32_t(k), uint32_t(subColumnId)});
+}
+
+// sizes are estimated by the ratio of used columns of each source
+llong LayoutProjectStore::dataStorageSize() const {
+	llong size = 0;
+	for (auto& src : m_sources) {
+		size += src.store->dataStorageSize() * src.usedColumns / src.schema->columnNum();
+	}
+	return size;
+}
+llong LayoutProjectStore::dataInflateSize() const {
+	llong size = 0;
+	for (auto& src : m_sources) {
+		size += src.store->dataInflateSize() * src.usedColumns / src.schema->columnNum();
+	}
+	return size;
+}
+llong LayoutProjectStore::numDataRows() const {
+	assert(!m_sources.empty());
+	return m_sources[0].store->numDataRows();
+}
+
+// same as ColgroupSegment::selectColumnsByPhysicId, the callers such as
+// ColumnarBatchIter may pass a NULL ctx, so buffers are thread local
+void LayoutProjectStore::getValueAppend(llong id, valvec<byte>* val, DbContext* ctx) const {
+	static thread_local valvec<byte>   tls_buf;
+	static thread_local ColumnVec      tls_cols;
+	static thread_local valvec<size_t> tls_offsets;
+	tls_buf.erase_all();
+	tls_cols.erase_all();
+	tls_offsets.resize_fill(m_sources.size(), size_t(-1));
+	for (size_t i = 0; i < m_columns.size(); ++i) {
+		const Column& c = m_columns[i];
+		const Source& src = m_sources[c.source];
+		if (size_t(-1) == tls_offsets[c.source]) {
+			size_t oldsize = tls_buf.size();
+			tls_offsets[c.source] = tls_cols.size();
+			src.store->getValueAppend(id, &tls_buf, ctx);
+			src.schema->parseRowAppend(tls_buf, oldsize, &tls_cols);
+		}
+		fstring d = tls_cols[tls_offsets[c.source] + c.subColumnId];
+		if (i < m_columns.size()-1)
+			src.schema->projectToNorm(d, c.subColumnId, val);
+		else
+			src.schema->projectToLast(d, c.subColumnId, val);
+	}
+}
+StoreIterator* LayoutProjectStore::createStoreIterForward(DbContext*) const {
+	return nullptr; // use default iterator
+}
+StoreIterator* LayoutProjectStore::createStoreIterBackward(DbContext*) const {
+	return nullptr; // use default iterator
+}
+void LayoutProjectStore::load(PathRef) {
+	THROW_STD(invalid_argument, "Unsupported, opened by loadRecordStore");
+}
+void LayoutProjectStore::save(PathRef) const {
+	THROW_STD(invalid_argument, "Unsupported, sources are saved by saveRecordStore");
+}
+
 ReadonlySegment::ReadonlySegment() {
 	m_isFreezed = true;
+	m_valueRefColgroup = size_t(-1);
+	m_readCnt = 0;
+	m_loadTime = 0;
+	m_buildTab = NULL;
+	m_buildCancelOnSuspend = false;
 }
 ReadonlySegment::~ReadonlySegment() {
 	if (m_isPurgedMmap) {
-		mmap_close(m_isPurgedMmap, m_isPurged.mem_size());
+		DbEnv::current()->mmapClose(m_isPurgedMmap, m_isPurged.mem_size());
 		m_isPurged.risk_release_ownership();
 		m_isPurgedMmap = nullptr;
 	}
@@ -407,6 +977,111 @@ ReadonlySegment* ReadonlySegment::getReadonlySegment() const {
 	return const_cast<ReadonlySegment*>(this);
 }
 
+// the sample tick is per thread, so counting is not a shared write per read
+void ReadonlySegment::countReads(size_t num) const {
+	static thread_local size_t tls_tick = 0;
+	size_t tick = tls_tick + num;
+	tls_tick = tick % ReadSampleRate;
+	if (tick >= ReadSampleRate) {
+		m_readCnt.fetch_add(tick - tls_tick, std::memory_order_relaxed);
+	}
+}
+
+void ReadonlySegment::countColgroupReads(size_t colgroupId, size_t num) const {
+	static thread_local size_t tls_tick = 0;
+	size_t tick = tls_tick + num;
+	tls_tick = tick % ReadSampleRate;
+	if (tick >= ReadSampleRate && m_colgroupReadCnt) {
+		assert(colgroupId < m_colgroups.size());
+		m_colgroupReadCnt[colgroupId].fetch_add(tick - tls_tick,
+												std::memory_order_relaxed);
+	}
+}
+
+// non-index colgroups are also read by whole row reads
+ullong ReadonlySegment::colgroupReads(size_t colgroupId) const {
+	assert(colgroupId < m_colgroups.size());
+	ullong reads = m_colgroupReadCnt ?
+		m_colgroupReadCnt[colgroupId].load(std::memory_order_relaxed) : 0;
+	if (colgroupId >= m_schema->getIndexNum()) {
+		reads += m_readCnt.load(std::memory_order_relaxed);
+	}
+	return reads;
+}
+
+double ReadonlySegment::readsPerSec(time_t now) const {
+	llong seconds = std::max<llong>(1, llong(now - m_loadTime));
+	return double(m_readCnt.load(std::memory_order_relaxed)) / seconds;
+}
+
+// colgroups are saved by name, so heat of colgroups is kept when colgroup
+// layout is changed, the file is small and rewritten by rename
+void ReadonlySegment::saveReadHeat(PathRef segDir) const {
+	using terark::json;
+	json colgroups = json::object();
+	for (size_t i = 0; i < m_colgroups.size(); ++i) {
+		ullong cnt = m_colgroupReadCnt[i].load(std::memory_order_relaxed);
+		if (cnt)
+			colgroups[m_schema->getColgroupSchema(i).m_name] = cnt;
+	}
+	json js;
+	js["since"] = llong(m_loadTime);
+	js["saved"] = llong(::time(NULL));
+	js["reads"] = m_readCnt.load(std::memory_order_relaxed);
+	js["colgroups"] = colgroups;
+	std::string str = js.dump(2);
+	std::string fpath = (segDir / "ReadHeat.json").string();
+	std::string tmpFile = fpath + ".tmp";
+	{
+		EnvFileStream fp(tmpFile, "w");
+		fp.ensureWrite(str.data(), str.size());
+	}
+	fs::rename(tmpFile, fpath);
+}
+
+void ReadonlySegment::loadReadHeat(PathRef segDir) {
+	using terark::json;
+	m_colgroupReadCnt.reset(new std::atomic<ullong>[m_colgroups.size()]());
+	fs::path fpath = segDir / "ReadHeat.json";
+	if (!fs::exists(fpath)) {
+		return;
+	}
+	try {
+		LineBuf text;
+		text.read_all(fpath.string().c_str());
+		json js = json::parse(std::string(text.p, text.n));
+		m_loadTime = time_t(js["since"].get<llong>());
+		m_readCnt = js["reads"].get<ullong>();
+		const json& colgroups = js["colgroups"];
+		for (size_t i = 0; i < m_colgroups.size(); ++i) {
+			const std::string& name = m_schema->getColgroupSchema(i).m_name;
+			auto iter = colgroups.find(name);
+			if (colgroups.end() != iter)
+				m_colgroupReadCnt[i] = iter->get<ullong>();
+		}
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "WARN: read heat is ignored: %s: %s\n"
+			, fpath.string().c_str(), ex.what());
+		m_readCnt = 0;
+		m_loadTime = ::time(NULL);
+	}
+}
+
+// the heat is an estimate of the future reads of the output, keep the
+// earliest start, then the reads per sec is not inflated
+void ReadonlySegment::addReadHeat(const ReadonlySegment& input) {
+	m_readCnt += input.m_readCnt.load(std::memory_order_relaxed);
+	m_loadTime = std::min(m_loadTime, input.m_loadTime);
+	if (!m_colgroupReadCnt || !input.m_colgroupReadCnt) {
+		return;
+	}
+	size_t num = std::min(m_colgroups.size(), input.m_colgroups.size());
+	for (size_t i = 0; i < num; ++i) {
+		m_colgroupReadCnt[i] += input.m_colgroupReadCnt[i].load(std::memory_order_relaxed);
+	}
+}
+
 llong ColgroupSegment::dataInflateSize() const {
 	return m_dataMemSize;
 }
@@ -423,9 +1098,29 @@ void ReadonlySegment::getValueAppend(llong id, valvec<byte>* val, DbContext* ctx
 	if (terark_unlikely(id < 0 || id >= rows)) {
 		THROW_STD(out_of_range, "invalid id=%lld, rows=%lld", id, rows);
 	}
+	countReads(1);
 	getValueByPhysicId(getPhysicId(id), val, ctx);
 }
 
+void
+ReadonlySegment::getValuesAppendBatch(const llong* ids, size_t num,
+									  valvec<byte>* vals, DbContext* ctx)
+const {
+	assert(ctx != nullptr);
+	llong rows = m_isDel.size();
+	DbContextArena::Scope arenaScope(ctx->arena);
+	llong* physicIds = ctx->arena.alloc<llong>(num);
+	for (size_t i = 0; i < num; ++i) {
+		llong id = ids[i];
+		if (terark_unlikely(id < 0 || id >= rows)) {
+			THROW_STD(out_of_range, "invalid id=%lld, rows=%lld", id, rows);
+		}
+		physicIds[i] = getPhysicId(id);
+	}
+	countReads(num);
+	getValuesByPhysicIdBatch(physicIds, num, vals, ctx);
+}
+
 void
 ColgroupWritableSegment::getValueAppend(llong id, valvec<byte>* val, DbContext* ctx)
 const {
@@ -438,6 +1133,21 @@ const {
 	getValueByPhysicId(id, val, ctx);
 }
 
+void
+ColgroupWritableSegment::getValuesAppendBatch(const llong* ids, size_t num,
+											  valvec<byte>* vals, DbContext* ctx)
+const {
+	assert(ctx != nullptr);
+	assert(m_isPurged.empty());
+	llong rows = m_isDel.size();
+	for (size_t i = 0; i < num; ++i) {
+		if (terark_unlikely(ids[i] < 0 || ids[i] >= rows)) {
+			THROW_STD(out_of_range, "invalid id=%lld, rows=%lld", ids[i], rows);
+		}
+	}
+	getValuesByPhysicIdBatch(ids, num, vals, ctx);
+}
+
 void
 ColgroupSegment::getValueByPhysicId(size_t id, valvec<byte>* val, DbContext* ctx)
 const {
@@ -454,7 +1164,7 @@ const {
 		const Schema& iSchema = m_schema->getColgroupSchema(i);
 		if (iSchema.m_keepCols.has_any1()) {
 			size_t oldsize = buf1->size();
-			m_colgroups[i]->getValueAppend(id, buf1.get(), ctx);
+			getColgroupValueAppend(i, id, buf1.get(), ctx);
 			iSchema.parseRowAppend(*buf1, oldsize, cols1.get());
 		}
 		else {
@@ -463,16 +1173,46 @@ const {
 	}
 	assert(cols1->size() == m_schema->m_colgroupSchemaSet->m_flattenColumnNum);
 
+	combineColgroupColumns(*cols1, cols2.get(), val);
+}
+
+void
+ColgroupSegment::getColgroupValueAppend(size_t cgId, llong physicId,
+										valvec<byte>* val, DbContext* ctx)
+const {
+	ValueCache* cache = NULL;
+	if (m_valueCacheSegId && m_valueCacheable.is1(cgId) && ctx->m_tab) {
+		cache = ctx->m_tab->getValueCache();
+	}
+	if (NULL == cache) {
+		m_colgroups[cgId]->getValueAppend(physicId, val, ctx);
+		return;
+	}
+	if (cache->get(m_valueCacheSegId, cgId, physicId, val)) {
+		return;
+	}
+	size_t oldsize = val->size();
+	m_colgroups[cgId]->getValueAppend(physicId, val, ctx);
+	cache->put(m_valueCacheSegId, cgId, physicId,
+			   fstring(val->data() + oldsize, val->size() - oldsize));
+}
+
+// cols1 are flatten columns of all colgroups, combine them to row
+void
+ColgroupSegment::combineColgroupColumns(const ColumnVec& cols1, ColumnVec* cols2,
+										valvec<byte>* val)
+const {
 	// combine columns to ctx->cols2
+	const size_t colgroupNum = m_colgroups.size();
 	size_t baseColumnId = 0;
-	cols2->m_base = cols1->m_base;
+	cols2->m_base = cols1.m_base;
 	cols2->m_cols.resize_fill(m_schema->columnNum());
 	for (size_t i = 0; i < colgroupNum; ++i) {
 		const Schema& iSchema = m_schema->getColgroupSchema(i);
 		for (size_t j = 0; j < iSchema.columnNum(); ++j) {
 			if (iSchema.m_keepCols[j]) {
 				size_t parentColId = iSchema.parentColumnId(j);
-				cols2->m_cols[parentColId] = cols1->m_cols[baseColumnId + j];
+				cols2->m_cols[parentColId] = cols1.m_cols[baseColumnId + j];
 			}
 		}
 		baseColumnId += iSchema.columnNum();
@@ -488,6 +1228,54 @@ const {
 	m_schema->m_rowSchema->combineRow(*cols2, val);
 }
 
+// vals[i] is overwritten by the row of physicIds[i], each colgroup store
+// is called once for the whole batch, then rows are combined one by one
+void
+ColgroupSegment::getValuesByPhysicIdBatch(const llong* physicIds, size_t num,
+										  valvec<byte>* vals, DbContext* ctx)
+const {
+	const size_t colgroupNum = m_colgroups.size();
+	// offsets[i*num + k] is the start of colgroup i in vals[k]
+	DbContextArena::Scope arenaScope(ctx->arena);
+	size_t* offsets = ctx->arena.alloc<size_t>((colgroupNum + 1) * num);
+	for (size_t k = 0; k < num; ++k) {
+		vals[k].risk_set_size(0);
+		offsets[k] = 0;
+	}
+	for (size_t i = 0; i < colgroupNum; ++i) {
+		const Schema& iSchema = m_schema->getColgroupSchema(i);
+		if (iSchema.m_keepCols.has_any1()) {
+			m_colgroups[i]->getValuesAppendBatch(physicIds, num, vals, ctx);
+		}
+		size_t* next = offsets + (i + 1) * num;
+		for (size_t k = 0; k < num; ++k) {
+			next[k] = vals[k].size();
+		}
+	}
+	auto cols1 = ctx->cols.get();
+	auto cols2 = ctx->cols.get();
+	auto buf1 = ctx->bufs.get();
+	for (size_t k = 0; k < num; ++k) {
+		cols1->erase_all();
+		for (size_t i = 0; i < colgroupNum; ++i) {
+			const Schema& iSchema = m_schema->getColgroupSchema(i);
+			if (iSchema.m_keepCols.has_any1()) {
+				size_t beg = offsets[(i + 0) * num + k];
+				size_t end = offsets[(i + 1) * num + k];
+				fstring row(vals[k].data(), end);
+				iSchema.parseRowAppend(row, beg, cols1.get());
+			}
+			else {
+				cols1->grow(iSchema.columnNum());
+			}
+		}
+		assert(cols1->size() == m_schema->m_colgroupSchemaSet->m_flattenColumnNum);
+		buf1->risk_set_size(0);
+		combineColgroupColumns(*cols1, cols2.get(), buf1.get());
+		vals[k].swap(*buf1);
+	}
+}
+
 void
 ColgroupWritableSegment::indexSearchExactAppend(size_t mySegIdx, size_t indexId,
 										fstring key, valvec<llong>* recIdvec,
@@ -499,88 +1287,157 @@ ColgroupWritableSegment::indexSearchExactAppend(size_t mySegIdx, size_t indexId,
 	if (recIdvec->size() == oldsize) {
 		return;
 	}
-	size_t newsize = oldsize;
-	size_t recIdvecSize = recIdvec->size();
-	llong* recIdvecData = recIdvec->data();
 	SpinRwLock lock;
 	if (!m_isFreezed) {
 		lock.acquire(m_segMutex, false);
 	}
-	if (m_deletionTime) {
-		auto deltime = (const llong*)m_deletionTime->getRecordsBasePtr();
-		auto snapshotVersion = ctx->m_mySnapshotVersion;
-		for(size_t k = oldsize; k < recIdvecSize; ++k) {
-			llong logicId = recIdvecData[k];
-			if (deltime[logicId] > snapshotVersion)
-				recIdvecData[newsize++] = logicId;
-		}
+	size_t newsize = filterSearchExactResult(recIdvec->data(),
+							oldsize, recIdvec->size(), oldsize, ctx);
+	recIdvec->risk_set_size(newsize);
+}
+
+void
+ColgroupWritableSegment::indexSearchExactAppendBatch(size_t mySegIdx,
+								size_t indexId, const fstring* keys, size_t num,
+								valvec<llong>* recIdvec, size_t* offsets,
+								DbContext* ctx) const {
+	assert(m_isPurged.empty());
+	auto index = m_indices[indexId].get();
+	index->searchExactAppendBatch(keys, num, recIdvec, offsets, ctx);
+	if (recIdvec->size() == offsets[0]) {
+		return;
 	}
-	else {
-		auto isDel = m_isDel.bldata();
-		for(size_t k = oldsize; k < recIdvecSize; ++k) {
-			llong logicId = recIdvecData[k];
-			if (!terark_bit_test(isDel, logicId))
-				recIdvecData[newsize++] = logicId;
-		}
+	SpinRwLock lock;
+	if (!m_isFreezed) {
+		lock.acquire(m_segMutex, false);
 	}
+	size_t newsize = offsets[0];
+	for (size_t k = 0; k < num; ++k) {
+		size_t beg = offsets[k], end = offsets[k+1];
+		offsets[k] = newsize;
+		newsize = filterSearchExactResult(recIdvec->data(), beg, end, newsize, ctx);
+	}
+	offsets[num] = newsize;
 	recIdvec->risk_set_size(newsize);
 }
 
+// caller should hold m_segMutex if not frozen
+// keep non-deleted ids of recIds[beg, end) starting at recIds[newsize]
+size_t
+ColgroupWritableSegment::filterSearchExactResult(llong* recIdvecData,
+								size_t beg, size_t end, size_t newsize,
+								DbContext* ctx) const {
+	auto isDel = m_isDel.bldata();
+	for(size_t k = beg; k < end; ++k) {
+		llong logicId = recIdvecData[k];
+		if (!terark_bit_test(isDel, logicId) || isDelAfterSnapshot(logicId, ctx))
+			recIdvecData[newsize++] = logicId;
+	}
+	return newsize;
+}
+
 void
 ReadonlySegment::indexSearchExactAppend(size_t mySegIdx, size_t indexId,
 										fstring key, valvec<llong>* recIdvec,
 										DbContext* ctx) const {
+	countColgroupReads(indexId, 1);
+	if (indexId < m_bloomFilters.size()) {
+		auto bf = m_bloomFilters[indexId].get();
+		if (bf && !bf->mayContain(key))
+			return;
+	}
 	size_t oldsize = recIdvec->size();
 	auto index = m_indices[indexId].get();
 	index->searchExactAppend(key, recIdvec, ctx);
 	if (recIdvec->size() == oldsize) {
 		return;
 	}
-	size_t newsize = oldsize;
-	llong* recIdvecData = recIdvec->data();
-	if (m_deletionTime) {
-		auto deltime = (const llong*)m_deletionTime->getRecordsBasePtr();
-		auto snapshotVersion = ctx->m_mySnapshotVersion;
-		if (m_isPurged.empty()) {
-			for(size_t k = oldsize; k < recIdvec->size(); ++k) {
-				llong logicId = recIdvecData[k];
-				if (deltime[logicId] > snapshotVersion)
-					recIdvecData[newsize++] = logicId;
+	size_t newsize = filterSearchExactResult(recIdvec->data(),
+							oldsize, recIdvec->size(), oldsize, ctx);
+	recIdvec->risk_set_size(newsize);
+}
+
+void
+ReadonlySegment::indexSearchExactAppendBatch(size_t mySegIdx, size_t indexId,
+										const fstring* keys, size_t num,
+										valvec<llong>* recIdvec, size_t* offsets,
+										DbContext* ctx) const {
+	countColgroupReads(indexId, num);
+	auto index = m_indices[indexId].get();
+	auto bf = indexId < m_bloomFilters.size()
+			? m_bloomFilters[indexId].get() : NULL;
+	DbContextArena::Scope arenaScope(ctx->arena);
+	fstring* passKeys = NULL;
+	size_t*  passIdx = NULL;
+	size_t   passNum = num;
+	if (bf) {
+		passKeys = ctx->arena.alloc<fstring>(num);
+		passIdx = ctx->arena.alloc<size_t>(num);
+		passNum = 0;
+		for (size_t k = 0; k < num; ++k) {
+			if (bf->mayContain(keys[k])) {
+				passKeys[passNum] = keys[k];
+				passIdx[passNum] = k;
+				passNum++;
 			}
 		}
-		else {
-			assert(m_isPurged.size() == m_isDel.size());
-			assert(this->getReadonlySegment() != NULL);
-			for(size_t k = oldsize; k < recIdvec->size(); ++k) {
-				size_t physicId = (size_t)recIdvecData[k];
-				assert(physicId < m_isPurged.max_rank0());
-				size_t logicId = m_isPurged.select0(physicId);
-				if (deltime[physicId] > snapshotVersion)
-					recIdvecData[newsize++] = logicId;
-			}
+	}
+	if (bf && passNum < num) {
+		// keys rejected by bloom filter have empty result range
+		size_t* passOffsets = ctx->arena.alloc<size_t>(passNum + 1);
+		if (passNum)
+			index->searchExactAppendBatch(passKeys, passNum,
+										  recIdvec, passOffsets, ctx);
+		else
+			passOffsets[0] = recIdvec->size();
+		for (size_t k = 0, j = 0; k < num; ++k) {
+			offsets[k] = passOffsets[j];
+			if (j < passNum && passIdx[j] == k)
+				j++;
 		}
+		offsets[num] = passOffsets[passNum];
 	}
 	else {
-		if (m_isPurged.empty()) {
-			for(size_t k = oldsize; k < recIdvec->size(); ++k) {
-				llong logicId = recIdvecData[k];
-				if (!m_isDel[logicId])
-					recIdvecData[newsize++] = logicId;
-			}
+		index->searchExactAppendBatch(keys, num, recIdvec, offsets, ctx);
+	}
+	if (recIdvec->size() == offsets[0]) {
+		return;
+	}
+	size_t newsize = offsets[0];
+	for (size_t k = 0; k < num; ++k) {
+		size_t beg = offsets[k], end = offsets[k+1];
+		offsets[k] = newsize;
+		newsize = filterSearchExactResult(recIdvec->data(), beg, end, newsize, ctx);
+	}
+	offsets[num] = newsize;
+	recIdvec->risk_set_size(newsize);
+}
+
+// keep visible ids of recIds[beg, end) starting at recIds[newsize],
+// physic ids returned by index are converted to logic ids
+size_t
+ReadonlySegment::filterSearchExactResult(llong* recIdvecData,
+										 size_t beg, size_t end, size_t newsize,
+										 DbContext* ctx) const {
+	if (m_isPurged.empty()) {
+		for(size_t k = beg; k < end; ++k) {
+			llong logicId = recIdvecData[k];
+			if (!isDelBit(logicId) || isDelAfterSnapshot(logicId, ctx))
+				recIdvecData[newsize++] = logicId;
 		}
-		else {
-			assert(m_isPurged.size() == m_isDel.size());
-			assert(this->getReadonlySegment() != NULL);
-			for(size_t k = oldsize; k < recIdvec->size(); ++k) {
-				size_t physicId = (size_t)recIdvecData[k];
-				assert(physicId < m_isPurged.max_rank0());
-				size_t logicId = m_isPurged.select0(physicId);
-				if (!m_isDel[logicId])
-					recIdvecData[newsize++] = logicId;
-			}
+	}
+	else {
+		assert(m_isPurged.size() == m_isDel.size());
+		assert(this->getReadonlySegment() != NULL);
+		for(size_t k = beg; k < end; ++k) {
+			size_t physicId = (size_t)recIdvecData[k];
+			assert(physicId < m_isPurged.max_rank0());
+			size_t logicId = m_isPurged.select0(physicId);
+			if (!isDelBit(logicId) || isDelAfterSnapshot(logicId, ctx))
+				recIdvecData[newsize++] = logicId;
 		}
 	}
-	recIdvec->risk_set_size(newsize);
+	return newsize;
 }
 
 void
@@ -626,9 +1483,17 @@ const {
 		size_t colgroupId = cp.colgroupId;
 		size_t oldsize = buf->size();
 		const Schema& schema = m_schema->getColgroupSchema(colgroupId);
+		if (offsets[colgroupId] == UINT32_MAX &&
+				schema.isFixedOffsetColumn(cp.subColumnId)) {
+			// fixed length column is same in norm and last form
+			const ColumnMeta& colmeta = schema.getColumnMeta(cp.subColumnId);
+			if (m_colgroups[colgroupId]->getValueSliceAppend(physicId,
+					colmeta.fixedOffset, colmeta.fixedLen, colsData, ctx))
+				continue;
+		}
 		if (offsets[colgroupId] == UINT32_MAX) {
 			offsets[colgroupId] = cols->size();
-			m_colgroups[colgroupId]->getValueAppend(physicId, buf.get(), ctx);
+			getColgroupValueAppend(colgroupId, physicId, buf.get(), ctx);
 			schema.parseRowAppend(*buf, oldsize, cols.get());
 		}
 		fstring d = (*cols)[offsets[colgroupId] + cp.subColumnId];
@@ -673,27 +1538,71 @@ const {
 	const Schema& schema = m_schema->getColgroupSchema(colgroupId);
 //	printf("colprojects = %zd, colgroupId = %zd, schema.cols = %zd\n"
 //		, m_schema->m_colproject.size(), colgroupId, schema.columnNum());
+	colsData->erase_all();
 	if (schema.columnNum() == 1) {
-		m_colgroups[colgroupId]->getValue(physicId, colsData, ctx);
+		getColgroupValueAppend(colgroupId, physicId, colsData, ctx);
+		return;
 	}
-	else {
-        auto cols = ctx->cols.get();
-        auto buf = ctx->bufs.get();
-		m_colgroups[colgroupId]->getValue(physicId, buf.get(), ctx);
-		schema.parseRow(*buf, cols.get());
-		colsData->erase_all();
-		colsData->append((*cols)[cp.subColumnId]);
+	if (schema.isFixedOffsetColumn(cp.subColumnId)) {
+		const ColumnMeta& colmeta = schema.getColumnMeta(cp.subColumnId);
+		if (m_colgroups[colgroupId]->getValueSliceAppend(physicId,
+				colmeta.fixedOffset, colmeta.fixedLen, colsData, ctx))
+			return;
 	}
+	auto cols = ctx->cols.get();
+	auto buf = ctx->bufs.get();
+	buf->erase_all();
+	getColgroupValueAppend(colgroupId, physicId, buf.get(), ctx);
+	schema.parseRow(*buf, cols.get());
+	colsData->append((*cols)[cp.subColumnId]);
 }
 
 void ReadonlySegment::selectColgroups(llong recId,
 						const size_t* cgIdvec, size_t cgIdvecSize,
 						valvec<byte>* cgDataVec, DbContext* ctx) const {
 	assert(recId >= 0);
+	countReads(1);
+	for (size_t i = 0; i < cgIdvecSize; ++i) {
+		if (cgIdvec[i] < m_colgroups.size())
+			countColgroupReads(cgIdvec[i], 1);
+	}
 	llong physicId = getPhysicId(size_t(recId));
 	selectColgroupsByPhysicId(physicId, cgIdvec, cgIdvecSize, cgDataVec, ctx);
 }
 
+fstring ReadonlySegment::selectOneColgroupRef(llong recId, size_t cgId,
+						valvec<byte>* buf, DbContext* ctx) const {
+	assert(recId >= 0);
+	if (cgId >= m_colgroups.size()) {
+		THROW_STD(out_of_range, "cgId = %zd, cgNum = %zd"
+			, cgId, m_colgroups.size());
+	}
+	countColgroupReads(cgId, 1);
+	llong physicId = getPhysicId(size_t(recId));
+	const ReadableStore* store = m_colgroups[cgId].get();
+	if (store->hasValueRef()) {
+		return store->getValueRef(physicId, ctx);
+	}
+	buf->erase_all();
+	getColgroupValueAppend(cgId, physicId, buf, ctx);
+	return *buf;
+}
+
+bool ReadonlySegment::hasValueRef() const {
+	return m_valueRefColgroup < m_colgroups.size();
+}
+
+fstring ReadonlySegment::getValueRef(llong id, DbContext* ctx) const {
+	assert(m_valueRefColgroup < m_colgroups.size());
+	llong rows = m_isDel.size();
+	if (terark_unlikely(id < 0 || id >= rows)) {
+		THROW_STD(out_of_range, "invalid id=%lld, rows=%lld", id, rows);
+	}
+	countReads(1);
+	llong physicId = getPhysicId(size_t(id));
+	return m_colgroups[m_valueRefColgroup]->getValueRef(physicId, ctx);
+}
+
 void ColgroupWritableSegment::selectColgroups(llong recId,
 						const size_t* cgIdvec, size_t cgIdvecSize,
 						valvec<byte>* cgDataVec, DbContext* ctx) const {
@@ -716,22 +1625,74 @@ void ColgroupSegment::selectColgroupsByPhysicId(llong physicId,
 			THROW_STD(out_of_range, "cgId = %zd, cgNum = %zd"
 				, cgId, m_schema->getColgroupNum());
 		}
-		m_colgroups[cgId]->getValue(physicId, &cgDataVec[i], ctx);
+		cgDataVec[i].erase_all();
+		getColgroupValueAppend(cgId, physicId, &cgDataVec[i], ctx);
 	}
 }
 
+// on a readonly segment, the next live rows are read ahead by one
+// getValuesAppendBatch, so each colgroup store reads the rows of the batch
+// together and stores prefetch their mmap'ed ranges, instead of one page
+// fault per row. The batch is doubled from 8 rows to the max readahead rows
 class ColgroupSegment::MyStoreIterForward : public StoreIterator {
 	llong  m_id = 0;
 	DbContextPtr m_ctx;
+	size_t m_aheadMax; // 0 if the segment is writable
+	size_t m_aheadNum = 0;
+	size_t m_aheadPos = 0;
+	valvec<llong> m_aheadIds;
+	valvec<valvec<byte> > m_aheadVals;
+
+	bool readAhead(const ColgroupSegment* owner) {
+		size_t rows = owner->m_isDel.size();
+		m_aheadNum = std::min(std::max<size_t>(2 * m_aheadNum, 8), m_aheadMax);
+		m_aheadIds.erase_all();
+		while (size_t(m_id) < rows && m_aheadIds.size() < m_aheadNum) {
+			if (!owner->isDelBit(m_id))
+				m_aheadIds.push_back(m_id);
+			m_id++;
+		}
+		m_aheadPos = 0;
+		if (m_aheadIds.empty()) {
+			return false;
+		}
+		if (m_aheadVals.size() < m_aheadIds.size()) {
+			m_aheadVals.resize(m_aheadIds.size());
+		}
+		owner->getValuesAppendBatch(m_aheadIds.data(), m_aheadIds.size(),
+									m_aheadVals.data(), m_ctx.get());
+		return true;
+	}
+	void dropAhead() {
+		m_aheadIds.erase_all();
+		m_aheadNum = 0;
+		m_aheadPos = 0;
+	}
+
 public:
 	MyStoreIterForward(const ColgroupSegment* owner, DbContext* ctx)
 	  : m_ctx(ctx) {
 		m_store.reset(const_cast<ColgroupSegment*>(owner));
+		static const size_t aheadMax = getEnvLong("TerarkDB_ScanReadaheadRows", 256);
+		m_aheadMax = dynamic_cast<const ReadonlySegment*>(owner) ? aheadMax : 0;
 	}
 	bool increment(llong* id, valvec<byte>* val) override {
 		auto owner = static_cast<const ColgroupSegment*>(m_store.get());
+		if (m_aheadMax) {
+			for (;;) {
+				if (m_aheadPos == m_aheadIds.size() && !readAhead(owner))
+					return false;
+				size_t k = m_aheadPos++;
+				if (owner->isDelBit(m_aheadIds[k]))
+					continue; // deleted after it was read ahead
+				*id = m_aheadIds[k];
+				val->swap(m_aheadVals[k]);
+				m_aheadVals[k].erase_all();
+				return true;
+			}
+		}
 		size_t rows = owner->m_isDel.size();
-		while (size_t(m_id) < rows && owner->m_isDel[m_id])
+		while (size_t(m_id) < rows && owner->isDelBit(m_id))
 			m_id++;
 		if (terark_likely(size_t(m_id) < rows)) {
 			*id = m_id++;
@@ -744,6 +1705,7 @@ public:
 		auto owner = static_cast<const ColgroupSegment*>(m_store.get());
 		llong rows = owner->m_isDel.size();
 		assert(id >= 0);
+		dropAhead();
 		m_id = id + 1;
 		if (id < rows) {
 			// do not check m_isDel, always success!
@@ -755,6 +1717,7 @@ public:
 		return false;
 	}
 	void reset() override {
+		dropAhead();
 		m_id = 0;
 	}
 };
@@ -769,7 +1732,7 @@ public:
 	}
 	bool increment(llong* id, valvec<byte>* val) override {
 		auto owner = static_cast<const ColgroupSegment*>(m_store.get());
-		while (m_id > 0 && owner->m_isDel[m_id-1])
+		while (m_id > 0 && owner->isDelBit(m_id-1))
 			 --m_id;
 		if (terark_likely(m_id > 0)) {
 			*id = --m_id;
@@ -825,6 +1788,9 @@ public:
 				store->unneedsLock();
 				m_readers[i] = store;
 			}
+			else if (schema.m_appendonlyBlockZip) {
+				m_readers[i] = new BlockZipAppendonlyStore(segDir, schema);
+			}
 			else {
 				m_readers[i] = new SeqReadAppendonlyStore(segDir, schema);
 			}
@@ -848,6 +1814,26 @@ public:
 			m_appenders[i]->append(m_projRowBuf, NULL);
 		}
 	}
+	// split for the conversion pipeline: projections of rows are made by
+	// workers concurrently, then they are appended in row order
+	void projectColgroups(const ColumnVec& columns, valvec<byte>* buf,
+						  fstrvecl* cgRows) const {
+		size_t colgroupNum = m_readers.size();
+		for (size_t i = 0; i < colgroupNum; ++i) {
+			const Schema& schema = *m_schemaSet.m_nested.elem_at(i);
+			schema.selectParent(columns, buf);
+			cgRows[i].push_back(fstring(*buf));
+		}
+	}
+	void appendColgroups(const fstrvecl* cgRows) {
+		size_t colgroupNum = m_readers.size();
+		for (size_t i = 0; i < colgroupNum; ++i) {
+			const fstrvecl& rows = cgRows[i];
+			for (size_t j = 0; j < rows.size(); ++j) {
+				m_appenders[i]->append(fstring(rows[j]), NULL);
+			}
+		}
+	}
 	void completeWrite() {
 		size_t colgroupNum = m_readers.size();
 		for (size_t i = 0; i < colgroupNum; ++i) {
@@ -891,7 +1877,8 @@ public:
 ///@note  physical deleted records must also be logical deleted
 ReadableStore*
 ReadonlySegment::buildDictZipStore(const Schema&, PathRef, StoreIterator& iter,
-								   const bm_uint_t* isDel, const febitvec* isPurged) const {
+								   const bm_uint_t* isDel, const febitvec* isPurged,
+								   fstring reuseDict) const {
 	THROW_STD(invalid_argument,
 		"Not Implemented, Only Implemented by DfaDbReadonlySegment");
 }
@@ -934,31 +1921,395 @@ public:
 }
 */
 
+namespace {
+// External sort of the keys of one index for the SortedIndexInput path:
+// keys are buffered and sorted in runs of at most maxMem bytes, a full run
+// is spilled to a file under the tmp dir of the segment, all runs are merged
+// while the index builder pulls the keys. If all keys fit in one run, it is
+// not spilled.
+class SpillSortedIndexInput : public SortedIndexInput {
+	struct Entry {
+		llong  recId;
+		size_t offset;
+		size_t length;
+	};
+	struct Run {
+		FileStream fp;
+		NativeDataInput<InputBuffer> di;
+		llong remain;
+		llong recId;
+		valvec<byte> key;
+		bool next() {
+			if (0 == remain)
+				return false;
+			remain--;
+			recId = di.load_as<var_uint64_t>();
+			size_t len = di.load_as<var_size_t>();
+			key.resize_no_init(len);
+			di.ensureRead(key.data(), len);
+			return true;
+		}
+	};
+	const Schema& m_schema;
+	std::string   m_filePrefix;
+	size_t        m_maxMem;
+	valvec<byte>  m_pool;    // keys of current run
+	valvec<Entry> m_entries; // current run
+	size_t        m_memPos;  // current run is not spilled, next is here
+	std::vector<std::string> m_runFiles;
+	valvec<llong> m_runRows;
+	std::vector<std::unique_ptr<Run> > m_runs;
+	valvec<size_t> m_heap;
+	valvec<byte>  m_minKey, m_maxKey;
+	llong m_rows;
+	bool  m_finished;
+
+	fstring entryKey(const Entry& e) const {
+		return fstring(m_pool.data() + e.offset, e.length);
+	}
+	void sortRun() {
+		std::sort(m_entries.begin(), m_entries.end(),
+			[this](const Entry& x, const Entry& y) {
+				int ret = m_schema.compareData(entryKey(x), entryKey(y));
+				if (ret)
+					return ret < 0;
+				return x.recId < y.recId;
+			});
+	}
+	void spillRun() {
+		sortRun();
+		std::string fname = m_filePrefix + lcast(m_runFiles.size());
+		EnvFileStream fp(fname.c_str(), "wb");
+		fp.disbuf();
+		NativeDataOutput<OutputBuffer> dio;
+		dio.attach(&fp);
+		for (const Entry& e : m_entries) {
+			dio << var_uint64_t(e.recId);
+			dio << var_size_t(e.length);
+			dio.ensureWrite(m_pool.data() + e.offset, e.length);
+		}
+		dio.flush();
+		fp.close();
+		m_runFiles.push_back(fname);
+		m_runRows.push_back(m_entries.size());
+		m_pool.clear();
+		m_entries.clear();
+	}
+	bool heapLess(size_t x, size_t y) const {
+		const Run& rx = *m_runs[x];
+		const Run& ry = *m_runs[y];
+		int ret = m_schema.compareData(rx.key, ry.key);
+		if (ret)
+			return ret > 0;
+		return rx.recId > ry.recId;
+	}
+	void startMerge() {
+		m_runs.resize(m_runFiles.size());
+		for (size_t i = 0; i < m_runFiles.size(); ++i) {
+			m_runs[i].reset(new Run());
+			Run& r = *m_runs[i];
+			r.fp.open(m_runFiles[i].c_str(), "rb");
+			r.fp.disbuf();
+			r.di.attach(&r.fp);
+			r.remain = m_runRows[i];
+			if (r.next())
+				m_heap.push_back(i);
+		}
+		auto cmp = [this](size_t x, size_t y) { return heapLess(x, y); };
+		std::make_heap(m_heap.begin(), m_heap.end(), cmp);
+	}
+
+public:
+	SpillSortedIndexInput(const Schema& schema, PathRef tmpDir, size_t maxMem)
+		: m_schema(schema) {
+		m_filePrefix = (tmpDir / ("spill-index-" + schema.m_name + "-")).string();
+		m_maxMem = std::max<size_t>(maxMem, 1024*1024);
+		m_memPos = size_t(-1);
+		m_rows = 0;
+		m_finished = false;
+	}
+	~SpillSortedIndexInput() {
+		m_runs.clear(); // close files
+		for (auto& fname : m_runFiles) {
+			boost::system::error_code ec;
+			fs::remove(fname, ec);
+		}
+	}
+	static bool isApplicable(const Schema& schema) {
+		// same index classes as ReadonlySegment::buildIndexFromSorted
+		size_t fixlen = schema.getFixedRowLen();
+		return schema.m_isOrdered && !schema.m_enableLinearScan
+			&& fixlen && fixlen <= 16;
+	}
+	void add(llong recId, fstring key) {
+		assert(!m_finished);
+		if (0 == m_rows || m_schema.compareData(key, m_minKey) < 0)
+			m_minKey.assign(key.udata(), key.size());
+		if (0 == m_rows || m_schema.compareData(key, m_maxKey) > 0)
+			m_maxKey.assign(key.udata(), key.size());
+		m_entries.push_back({recId, m_pool.size(), key.size()});
+		m_pool.append(key.udata(), key.size());
+		m_rows++;
+		if (m_pool.size() + sizeof(Entry) * m_entries.size() >= m_maxMem)
+			spillRun();
+	}
+	void finish() {
+		assert(!m_finished);
+		m_finished = true;
+		if (m_runFiles.empty()) {
+			sortRun();
+			m_memPos = 0;
+			return;
+		}
+		if (!m_entries.empty())
+			spillRun();
+		m_pool.clear();
+		m_entries.clear();
+		fprintf(stderr
+			, "INFO: index %s: %lld keys are spilled to %zd sorted runs\n"
+			, m_schema.m_name.c_str(), m_rows, m_runFiles.size());
+		startMerge();
+	}
+	llong numRows() override { return m_rows; }
+	bool keyBounds(valvec<byte>* minKey, valvec<byte>* maxKey) override {
+		if (0 == m_rows)
+			return false;
+		minKey->assign(m_minKey);
+		maxKey->assign(m_maxKey);
+		return true;
+	}
+	bool next(llong* recId, valvec<byte>* key) override {
+		assert(m_finished);
+		if (size_t(-1) != m_memPos) {
+			if (m_memPos == m_entries.size())
+				return false;
+			const Entry& e = m_entries[m_memPos++];
+			*recId = e.recId;
+			key->assign(m_pool.data() + e.offset, e.length);
+			return true;
+		}
+		if (m_heap.empty())
+			return false;
+		auto cmp = [this](size_t x, size_t y) { return heapLess(x, y); };
+		std::pop_heap(m_heap.begin(), m_heap.end(), cmp);
+		Run& r = *m_runs[m_heap.back()];
+		*recId = r.recId;
+		key->swap(r.key);
+		if (r.next())
+			std::push_heap(m_heap.begin(), m_heap.end(), cmp);
+		else
+			m_heap.pop_back();
+		return true;
+	}
+};
+} // namespace
+
+// run job(0..num-1) on up to TerarkDB_ConvertBuildThreads threads(default
+// is min(cpu, 4)), bigger jobs first. A job is started only when estimated
+// memory of all running jobs plus itself is within memBudget or no other job
+// is running. The first exception thrown by a job is rethrown after all
+// running jobs finished, jobs not yet started are skipped.
+static void
+runConcurrentBuildJobs(size_t num, size_t memBudget,
+					   const std::function<size_t(size_t)>& memSize,
+					   const std::function<void(size_t)>& job) {
+	valvec<std::pair<size_t, size_t> > jobs(num, valvec_reserve());
+	for (size_t i = 0; i < num; ++i) {
+		jobs.emplace_back(std::min(memSize(i), memBudget), i);
+	}
+	std::stable_sort(jobs.begin(), jobs.end(),
+		[](const std::pair<size_t, size_t>& x, const std::pair<size_t, size_t>& y) {
+			return x.first > y.first;
+		});
+	size_t cpu = tbb::tbb_thread::hardware_concurrency();
+	size_t cfg = getEnvLong("TerarkDB_ConvertBuildThreads", 0);
+	size_t threadNum = std::min(num, cfg ? cfg : std::min<size_t>(cpu, 4));
+	if (threadNum <= 1) {
+		for (auto& x : jobs)
+			job(x.second);
+		return;
+	}
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::exception_ptr except;
+	size_t next = 0, memUsed = 0, running = 0;
+	auto worker = [&]() {
+		for (;;) {
+			std::pair<size_t, size_t> x;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				for (;;) {
+					if (next == num || except)
+						return;
+					x = jobs[next];
+					if (0 == running || memUsed + x.first <= memBudget)
+						break;
+					cond.wait(lock);
+				}
+				next++;
+				memUsed += x.first;
+				running++;
+			}
+			try {
+				job(x.second);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!except)
+					except = std::current_exception();
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				memUsed -= x.first;
+				running--;
+			}
+			cond.notify_all();
+		}
+	};
+	valvec<tbb::tbb_thread*> threads(threadNum - 1, valvec_reserve());
+	for (size_t i = 0; i < threadNum - 1; ++i) {
+		threads.push_back(new tbb::tbb_thread(worker));
+	}
+	worker(); // this thread is also a worker
+	for (auto th : threads) {
+		th->join();
+		delete th;
+	}
+	if (except) {
+		std::rethrow_exception(except);
+	}
+}
+
+void ReadonlySegment::checkBuildCancelled() const {
+	if (m_buildTab) {
+		m_buildTab->checkBgTaskCancelled(m_buildCancelOnSuspend);
+	}
+}
+
+// rows of a StoreIterator::incrementBatch when converting a segment
+static const size_t ConvBatchRows = 4096;
+static const size_t ConvBatchBytes = 4 << 20;
+
+namespace {
+// a batch of the conversion scan, live rows are parsed and projected to
+// colgroups by the workers, then appended to the temp files in scan order
+struct ConvScanTask : public PipelineTask {
+	StoreBatch       batch;
+	valvec<uint32_t> live; // index in batch of rows which are not deleted
+	valvec<fstrvecl> cgRows;
+};
+}
+
 void
 ReadonlySegment::compressMultipleColgroups(ReadableSegment* input, DbContext* ctx) {
 	llong logicRowNum = input->m_isDel.size();
 	llong newRowNum = 0;
 	assert(logicRowNum > 0);
-	size_t indexNum = m_schema->getIndexNum();
 	auto tmpDir = m_segDir + ".tmp";
 	TempFileList colgroupTempFiles(tmpDir, *m_schema->m_colgroupSchemaSet);
 {
+	SegmentPhaseTimer scanPhase(SegmentEventScope::current(), SegmentPhase::scan);
+	// reading the input, parsing and appending to temp files are pipelined,
+	// at most 2*pipeThreads queued batches bound the memory, 0 is serial
+	const size_t pipeThreads = getEnvLong("TerarkDB_ConvertPipelineThreads", 2);
+	const Schema& rowSchema = *m_schema->m_rowSchema;
+	std::mutex pipeMutex;
+	std::exception_ptr pipeExcept;
+	auto setExcept = [&]() {
+		std::lock_guard<std::mutex> lock(pipeMutex);
+		if (!pipeExcept)
+			pipeExcept = std::current_exception();
+	};
+	auto hasExcept = [&]() {
+		std::lock_guard<std::mutex> lock(pipeMutex);
+		return bool(pipeExcept);
+	};
+	PipelineProcessor pipeline;
+	if (pipeThreads) {
+		pipeline.m_silent = true;
+		pipeline.setQueueSize(int(2 * pipeThreads));
+		pipeline
+		| new FunPipelineStage(int(pipeThreads),
+			[&](PipelineStage*, int, PipelineQueueItem* item) {
+				auto task = static_cast<ConvScanTask*>(item->task);
+				try {
+					ColumnVec columns(m_schema->columnNum(), valvec_reserve());
+					valvec<byte> buf;
+					task->cgRows.resize(colgroupTempFiles.size());
+					for (uint32_t i : task->live) {
+						rowSchema.parseRow(task->batch.row(i), &columns);
+						colgroupTempFiles.projectColgroups(columns, &buf, task->cgRows.data());
+					}
+				}
+				catch (...) {
+					setExcept();
+				}
+			}, "convProject")
+		| new FunPipelineStage(0, // keep scan order
+			[&](PipelineStage*, int, PipelineQueueItem* item) {
+				auto task = static_cast<ConvScanTask*>(item->task);
+				if (hasExcept())
+					return;
+				try {
+					colgroupTempFiles.appendColgroups(task->cgRows.data());
+				}
+				catch (...) {
+					setExcept();
+				}
+			}, "convAppend")
+		;
+		pipeline.compile();
+	}
+	auto drainPipeline = [&]() {
+		if (pipeThreads) {
+			pipeline.stop();
+			pipeline.wait();
+		}
+	};
 	ColumnVec columns(m_schema->columnNum(), valvec_reserve());
-	valvec<byte> buf;
+	std::unique_ptr<ConvScanTask> task(new ConvScanTask());
 	StoreIteratorPtr iter(input->createStoreIterForward(ctx));
 	llong prevId = -1, id = -1;
-	while (iter->increment(&id, &buf) && id < logicRowNum) {
-		assert(id >= 0);
-		assert(id < logicRowNum);
-		assert(prevId < id);
-		if (!m_isDel[id]) {
-			m_schema->m_rowSchema->parseRow(buf, &columns);
-			colgroupTempFiles.writeColgroups(columns);
-			newRowNum++;
-			m_isDel.beg_end_set1(prevId + 1, id);
-			prevId = id;
+	try {
+		while (iter->incrementBatch(&task->batch, ConvBatchRows, ConvBatchBytes)) {
+			checkBuildCancelled();
+			const StoreBatch& batch = task->batch;
+			size_t i = 0;
+			for (; i < batch.size() && (id = batch.ids[i]) < logicRowNum; ++i) {
+				assert(id >= 0);
+				assert(prevId < id);
+				if (!m_isDel[id]) {
+					if (pipeThreads) {
+						task->live.push_back(uint32_t(i));
+					}
+					else {
+						rowSchema.parseRow(batch.row(i), &columns);
+						colgroupTempFiles.writeColgroups(columns);
+					}
+					newRowNum++;
+					m_isDel.beg_end_set1(prevId + 1, id);
+					prevId = id;
+				}
+			}
+			const bool inputEnd = i < batch.size();
+			if (pipeThreads && !task->live.empty()) {
+				pipeline.inqueue(task.release());
+				task.reset(new ConvScanTask());
+				if (hasExcept())
+					break;
+			}
+			if (inputEnd)
+				break;
 		}
 	}
+	catch (...) {
+		drainPipeline();
+		throw;
+	}
+	drainPipeline();
+	if (pipeExcept) {
+		std::rethrow_exception(pipeExcept);
+	}
 	if (prevId != id) {
 		assert(prevId < id);
 		assert(m_isDel[id]);
@@ -977,31 +2328,59 @@ ReadonlySegment::compressMultipleColgroups(ReadableSegment* input, DbContext* ct
 	assert(newRowNum <= inputRowNum);
 	assert(size_t(logicRowNum - newRowNum) == m_delcnt);
 }
-	// build index from temporary index files
+	buildColgroupsFromTempFiles(colgroupTempFiles, newRowNum);
+}
+
+// build indices and colgroups from temporary files, they are
+// independent of each other, so they are built concurrently
+void
+ReadonlySegment::buildColgroupsFromTempFiles(TempFileList& colgroupTempFiles,
+											 llong newRowNum) {
+	const size_t indexNum = m_schema->getIndexNum();
+	auto tmpDir = m_segDir + ".tmp";
 	colgroupTempFiles.completeWrite();
-	for (size_t i = 0; i < indexNum; ++i) {
-		SortableStrVec strVec;
+	const size_t maxMem = m_schema->m_compressingWorkMemSize;
+	auto buildIndexJob = [&](size_t i) {
 		const Schema& schema = m_schema->getIndexSchema(i);
 		auto tmpStore = colgroupTempFiles.getStore(i);
 		StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
-		colgroupTempFiles.collectData(i, iter.get(), strVec);
-		m_indices[i] = this->buildIndex(schema, strVec);
+		ReadableIndex* index = NULL;
+		if (newRowNum && tmpStore->dataInflateSize() > llong(maxMem) &&
+				SpillSortedIndexInput::isApplicable(schema)) {
+			SpillSortedIndexInput input(schema, tmpDir, maxMem);
+			valvec<byte> key;
+			llong recId = -1;
+			while (iter->increment(&recId, &key)) {
+				input.add(recId, key);
+				if ((recId & 0xFFFF) == 0)
+					checkBuildCancelled();
+			}
+			input.finish();
+			index = this->buildIndexAndFilterFromSorted(i, schema, input);
+			iter->reset();
+		}
+		if (NULL == index) {
+			SortableStrVec strVec;
+			colgroupTempFiles.collectData(i, iter.get(), strVec);
+			index = this->buildIndexAndFilter(i, schema, strVec);
+		}
+		m_indices[i] = index;
 		m_colgroups[i] = m_indices[i]->getReadableStore();
 		if (!schema.m_enableLinearScan) {
 			iter.reset();
 			tmpStore->deleteFiles();
 		}
-	}
-	for (size_t i = indexNum; i < colgroupTempFiles.size(); ++i) {
+	};
+	auto buildColgroupJob = [&](size_t i) {
 		if (0 == newRowNum) {
 			m_colgroups[i] = new EmptyIndexStore();
-			continue;
+			return;
 		}
 		const Schema& schema = m_schema->getColgroupSchema(i);
 		auto tmpStore = colgroupTempFiles.getStore(i);
 		if (schema.should_use_FixedLenStore()) {
 			m_colgroups[i] = tmpStore;
-			continue;
+			return;
 		}
 		// dictZipSampleRatio < 0 indicate don't use dictZip
 		if (schema.m_dictZipSampleRatio >= 0.0) {
@@ -1009,17 +2388,17 @@ ReadonlySegment::compressMultipleColgroups(ReadableSegment* input, DbContext* ct
 			double avgLen = double(tmpStore->dataInflateSize()) / newRowNum;
 			if (sRatio > 0 || (sRatio < FLT_EPSILON && avgLen > 100)) {
 				StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
-				m_colgroups[i] = buildDictZipStore(schema, tmpDir, *iter, NULL, NULL);
+				m_colgroups[i] = buildDictZipStore(schema, tmpDir, *iter, NULL, NULL, fstring());
 				iter.reset();
 				tmpStore->deleteFiles();
-				continue;
+				return;
 			}
 		}
-		size_t maxMem = m_schema->m_compressingWorkMemSize;
 		llong rows = 0;
 		MultiPartStorePtr parts = new MultiPartStore();
 		StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
 		while (rows < newRowNum) {
+			checkBuildCancelled();
 			SortableStrVec strVec;
 			rows += colgroupTempFiles.collectData(i, iter.get(), strVec, maxMem);
 			parts->addpart(this->buildStore(schema, strVec));
@@ -1027,7 +2406,37 @@ ReadonlySegment::compressMultipleColgroups(ReadableSegment* input, DbContext* ct
 		m_colgroups[i] = parts->finishParts();
 		iter.reset();
 		tmpStore->deleteFiles();
-	}
+	};
+	// estimated peak memory of building colgroup i
+	auto jobMemSize = [&](size_t i) -> size_t {
+		const Schema& schema = m_schema->getColgroupSchema(i);
+		if (0 == newRowNum || (i >= indexNum && schema.should_use_FixedLenStore()))
+			return 0;
+		size_t inflate = size_t(colgroupTempFiles.getStore(i)->dataInflateSize());
+		if (i >= indexNum && schema.m_dictZipSampleRatio < 0.0)
+			return std::min(inflate, maxMem); // multi part, bounded by maxMem
+		return inflate;
+	};
+	std::string strDir = m_segDir.string();
+	SegmentEventScope* evScope = SegmentEventScope::current();
+	auto buildJob = [&](size_t i) {
+		SegmentPhaseTimer phase(evScope, i < indexNum ? SegmentPhase::index
+													  : SegmentPhase::store);
+		checkBuildCancelled();
+		profiling pf;
+		llong t0 = pf.now();
+		if (i < indexNum)
+			buildIndexJob(i);
+		else
+			buildColgroupJob(i);
+		llong t1 = pf.now();
+		fprintf(stderr, "INFO: %s: build %s %s done, %f seconds\n"
+			, strDir.c_str(), i < indexNum ? "index" : "colgroup"
+			, m_schema->getColgroupSchema(i).m_name.c_str(), pf.sf(t0, t1));
+	};
+	// buildIndexAndFilter must not resize m_bloomFilters concurrently
+	m_bloomFilters.resize(indexNum);
+	runConcurrentBuildJobs(colgroupTempFiles.size(), maxMem, jobMemSize, buildJob);
 }
 
 void
@@ -1036,26 +2445,40 @@ ReadonlySegment::compressSingleKeyIndex(ReadableSegment* input, DbContext* ctx)
 	llong newRowNum = 0;
 	assert(logicRowNum > 0);
 	auto tmpDir = m_segDir + ".tmp";
-	ColumnVec columns(m_schema->columnNum(), valvec_reserve());
-	valvec<byte> key;
+	StoreBatch batch;
 	StoreIteratorPtr iter(input->createStoreIterForward(ctx));
 	llong prevId = -1, id = -1;
 	SortableStrVec keyVec;
 	const Schema& keySchema = m_schema->getIndexSchema(0);
-	while (iter->increment(&id, &key) && id < logicRowNum) {
-		assert(id >= 0);
-		assert(id < logicRowNum);
-		assert(prevId < id);
-		if (!m_isDel[id]) {
-			if (keySchema.getFixedRowLen() > 0) {
-				keyVec.m_strpool.append(key);
-			} else {
-				keyVec.push_back(key);
+	const size_t maxMem = m_schema->m_compressingWorkMemSize;
+	SegmentPhaseTimer scanPhase(SegmentEventScope::current(), SegmentPhase::scan);
+	std::unique_ptr<SpillSortedIndexInput> spill;
+	if (input->dataInflateSize() > llong(maxMem) &&
+			SpillSortedIndexInput::isApplicable(keySchema)) {
+		spill.reset(new SpillSortedIndexInput(keySchema, tmpDir, maxMem));
+	}
+	while (iter->incrementBatch(&batch, ConvBatchRows, ConvBatchBytes)) {
+		checkBuildCancelled();
+		size_t i = 0;
+		for (; i < batch.size() && (id = batch.ids[i]) < logicRowNum; ++i) {
+			assert(id >= 0);
+			assert(prevId < id);
+			if (!m_isDel[id]) {
+				fstring key = batch.row(i);
+				if (spill) {
+					spill->add(newRowNum, key); // physic id
+				} else if (keySchema.getFixedRowLen() > 0) {
+					keyVec.m_strpool.append(key.udata(), key.size());
+				} else {
+					keyVec.push_back(key);
+				}
+				newRowNum++;
+				m_isDel.beg_end_set1(prevId+1, id);
+				prevId = id;
 			}
-			newRowNum++;
-			m_isDel.beg_end_set1(prevId+1, id);
-			prevId = id;
 		}
+		if (i < batch.size())
+			break;
 	}
 	if (prevId != id) {
 		assert(prevId < id);
@@ -1072,7 +2495,17 @@ ReadonlySegment::compressSingleKeyIndex(ReadableSegment* input, DbContext* ctx)
 		this->m_isDel.beg_end_set1(inputRowNum, logicRowNum);
 	}
 	m_delcnt = m_isDel.popcnt(); // recompute delcnt
-	m_indices[0] = buildIndex(keySchema, keyVec); // memory heavy
+	scanPhase.stop();
+	checkBuildCancelled();
+	SegmentPhaseTimer indexPhase(SegmentEventScope::current(), SegmentPhase::index);
+	if (spill && newRowNum) {
+		spill->finish();
+		m_indices[0] = buildIndexAndFilterFromSorted(0, keySchema, *spill);
+		assert(m_indices[0] != NULL); // spill is only for streamable index
+	}
+	else {
+		m_indices[0] = buildIndexAndFilter(0, keySchema, keyVec); // memory heavy
+	}
 	m_colgroups[0] = m_indices[0]->getReadableStore();
 }
 
@@ -1099,11 +2532,11 @@ ReadonlySegment::convFrom(DbTable* tab, size_t segIdx) {
 	}
 	assert(input->getWritableStore() != nullptr);
 	assert(input->m_isFreezed);
-	assert(input->m_updateList.empty());
+	assert(input->m_updateIds.empty());
 	assert(input->m_bookUpdates == false);
-	input->m_updateList.reserve(1024);
 	input->m_bookUpdates = true;
 	m_isDel = input->m_isDel; // make a copy, input->m_isDel[*] may be changed
+	input->keepSnapshotRows(&m_isDel, tab->getOldestSnapshotVersion());
 
 	const size_t indexNum = m_schema->getIndexNum();
 	const size_t colgroupNum = m_schema->getColgroupNum();
@@ -1111,20 +2544,30 @@ ReadonlySegment::convFrom(DbTable* tab, size_t segIdx) {
 	m_indices.resize(indexNum);
 	m_colgroups.resize(colgroupNum);
 
-	if (colgroupNum == 1 && indexNum == 0) {
-		// single-value-only
-		compressSingleColgroup(input.get(), ctx.get());
-	}
-	else if (colgroupNum == 1 && indexNum == 1) {
-		// single-key-only
-		compressSingleKeyIndex(input.get(), ctx.get());
-	}
-	else if (colgroupNum == 2 && indexNum == 1) {
-		// key-value
-		compressSingleKeyValue(input.get(), ctx.get());
+	try {
+		if (colgroupNum == 1 && indexNum == 0) {
+			// single-value-only
+			compressSingleColgroup(input.get(), ctx.get());
+		}
+		else if (colgroupNum == 1 && indexNum == 1) {
+			// single-key-only
+			compressSingleKeyIndex(input.get(), ctx.get());
+		}
+		else if (colgroupNum == 2 && indexNum == 1) {
+			// key-value
+			compressSingleKeyValue(input.get(), ctx.get());
+		}
+		else {
+			compressMultipleColgroups(input.get(), ctx.get());
+		}
+		checkBuildCancelled(); // the last checkpoint, before commit
 	}
-	else {
-		compressMultipleColgroups(input.get(), ctx.get());
+	catch (const TaskCancelledException&) {
+		m_indices.erase_all();
+		m_colgroups.erase_all();
+		tab->cancelBookUpdates(input.get());
+		fs::remove_all(tmpDir);
+		throw;
 	}
 	completeAndReload(tab, segIdx, &*input);
 
@@ -1132,9 +2575,52 @@ ReadonlySegment::convFrom(DbTable* tab, size_t segIdx) {
 	input->deleteSegment();
 }
 
+void
+ReadonlySegment::buildFromRows(const fstrvecl& rows) {
+	const size_t rowNum = rows.size();
+	if (0 == rowNum) {
+		THROW_STD(invalid_argument, "rows must not be empty");
+	}
+	if (fs::exists(m_segDir)) {
+		THROW_STD(invalid_argument, "segDir existed: %s", m_segDir.string().c_str());
+	}
+	auto tmpDir = m_segDir + ".tmp";
+	fs::create_directories(tmpDir);
+	m_indices.resize(m_schema->getIndexNum());
+	m_colgroups.resize(m_schema->getColgroupNum());
+	m_isDel.resize_fill(rowNum, false);
+	m_delcnt = 0;
+	{
+		TempFileList colgroupTempFiles(tmpDir, *m_schema->m_colgroupSchemaSet);
+		ColumnVec columns(m_schema->columnNum(), valvec_reserve());
+		for (size_t i = 0; i < rowNum; ++i) {
+			m_schema->m_rowSchema->parseRow(rows[i], &columns);
+			colgroupTempFiles.writeColgroups(columns);
+		}
+		buildColgroupsFromTempFiles(colgroupTempFiles, rowNum);
+	}
+	m_dataMemSize = 0;
+	m_dataInflateSize = 0;
+	for (size_t i = 0; i < m_colgroups.size(); ++i) {
+		m_dataMemSize += m_colgroups[i]->dataStorageSize();
+		m_dataInflateSize += m_colgroups[i]->dataInflateSize();
+	}
+	this->buildZoneMap();
+	this->buildIndexStats();
+	this->save(tmpDir);
+	m_isDel.clear();
+	m_indices.erase_all();
+	m_colgroups.erase_all();
+	m_bloomFilters.erase_all();
+	m_zoneMap = nullptr;
+	m_indexStats = nullptr;
+	fs::rename(tmpDir, m_segDir);
+}
+
 void
 ReadonlySegment::completeAndReload(DbTable* tab, size_t segIdx,
 								   ReadableSegment* input) {
+	SegmentPhaseTimer reloadPhase(SegmentEventScope::current(), SegmentPhase::reload);
 	m_dataMemSize = 0;
 	m_dataInflateSize = 0;
 	for (size_t i = 0; i < m_colgroups.size(); ++i) {
@@ -1155,6 +2641,8 @@ ReadonlySegment::completeAndReload(DbTable* tab, size_t segIdx,
 		assert(physicRows1 == physicRows2);
 	}
 #endif
+	this->buildZoneMap();
+	this->buildIndexStats();
 	auto tmpDir = m_segDir + ".tmp";
 	this->save(tmpDir);
 
@@ -1168,61 +2656,46 @@ ReadonlySegment::completeAndReload(DbTable* tab, size_t segIdx,
 	assert(this->m_isDel.popcnt() == this->m_delcnt);
 	assert(this->m_isPurged.max_rank1() == this->m_delcnt);
 
-	valvec<uint32_t> updateList;
-	febitvec         updateBits;
-	auto syncNewDeletionMark = [&]() {
+	UpdatedIdRuns updateIds;
+	// returns number of updated and deleted rows synced
+	auto syncNewDeletionMark = [&]() -> size_t {
 		assert(input->m_bookUpdates);
 		{
 			SpinRwLock inputLock(input->m_segMutex, true);
-			updateList.swap(input->m_updateList);
-			updateBits.swap(input->m_updateBits);
-		}
-		if (updateList.size() > 0) {
-			// this is the likely branch when lock(tab->m_rwMutex)
-			assert(updateBits.size() == 0);
-			std::sort(updateList.begin(), updateList.end());
-			updateList.trim(
-				std::unique(updateList.begin(),
-							updateList.end())
-			);
-			auto dlist = updateList.data();
-			auto isDel = this->m_isDel.bldata();
-			size_t dlistSize = updateList.size();
-			for (size_t i = 0; i < dlistSize; ++i) {
-				assert(dlist[i] < m_isDel.size());
-				size_t logicId = dlist[i];
-				if (input->m_isDel[logicId])
-					terark_bit_set1(isDel, logicId);
-				else
-					this->syncUpdateRecordNoLock(0, logicId, input);
-			}
-		}
-		else if (updateBits.size() > 0) {
-			assert(updateBits.size() == m_isDel.size()+1);
-			size_t logicId = updateBits.zero_seq_len(0);
-			while (logicId < m_isDel.size()) {
-				if (!input->m_isDel[logicId]) {
-					this->syncUpdateRecordNoLock(0, logicId, input);
-				}
-				logicId += 1 + updateBits.zero_seq_len(logicId + 1);
-			}
-			m_isDel.risk_memcpy(input->m_isDel);
-		}
-		else {
-			// have nothing to update
-			assert(updateList.size() == 0); // for set break point
+			updateIds.swap(input->m_updateIds);
 		}
-		// m_updateBits and m_updateList is safe to change in reader lock here
-		updateBits.erase_all();
-		updateList.erase_all();
+		auto isDel = this->m_isDel.bldata();
+		size_t synced = updateIds.for_each([&](size_t logicId) {
+			assert(logicId < m_isDel.size());
+			if (input->m_isDel[logicId])
+				terark_bit_set1(isDel, logicId);
+			else
+				this->syncUpdateRecordNoLock(0, logicId, input);
+		});
+		// updateIds is safe to change in reader lock here
+		updateIds.erase_all();
+		return synced;
 	};
-	syncNewDeletionMark(); // no lock
+	// catch up without lock until the delta is small, each pass only syncs
+	// updates during the previous pass, the passes are bounded because
+	// writers may be faster than catch up
+	size_t passes = std::max<long>(1, getEnvLong("TerarkDB_ConvertCatchUpPasses", 8));
+	size_t minDelta = getEnvLong("TerarkDB_ConvertCatchUpRows", 4096);
+	size_t delta = syncNewDeletionMark(); // no lock
+	for (size_t pass = 1; pass < passes && delta > minDelta; ++pass) {
+		delta = syncNewDeletionMark(); // no lock
+	}
 	MyRwLock lock(tab->m_rwMutex, false);
 	assert(tab->m_segments[segIdx].get() == input);
 	syncNewDeletionMark(); // reader locked
 	lock.upgrade_to_writer();
 	syncNewDeletionMark(); // writer locked
-	m_delcnt = input->m_delcnt;
+	if (input->hasDelVersions()) {
+		// rows kept by keepSnapshotRows are deleted but not purged
+		m_isDel.risk_memcpy(input->m_isDel);
+		copyDelVersions(*input, 0, tab->getOldestSnapshotVersion());
+	}
+	m_delcnt = input->m_delcnt.load();
 #if defined(SLOW_DEBUG_CHECK)
 	{
 		size_t computed_delcnt1 = this->m_isDel.popcnt();
@@ -1262,8 +2735,11 @@ ReadonlySegment::completeAndReload(DbTable* tab, size_t segIdx,
 	}
 #endif
 	assert(tab->m_segments[segIdx].get() == input);
+	rebuildIsDelBlocks(); // not published yet, delmarks are synced
 	tab->m_segments[segIdx] = this;
+	m_uniqKeyFilterGen = input->m_uniqKeyFilterGen; // keys are not changed
 	tab->m_segArrayUpdateSeq++;
+	tab->publishSegArrayInLock();
 }
 
 // dstBaseId is for merge update
@@ -1285,11 +2761,6 @@ ReadonlySegment::syncUpdateRecordNoLock(size_t dstBaseId, size_t logicId,
 		auto srcDataPtr = srcColstore->getRecordsBasePtr() + fixlen * srcPhysicId;
 		memcpy(dstDataPtr, srcDataPtr, fixlen);
 	}
-	if (m_deletionTime) {
-		auto dstDataPtr = (uint64_t*)this->m_deletionTime->getRecordsBasePtr();
-		auto srcDataPtr = (uint64_t*)input->m_deletionTime->getRecordsBasePtr();
-		dstDataPtr[dstPhysicId] = srcDataPtr[srcPhysicId];
-	}
 }
 
 static inline
@@ -1348,26 +2819,45 @@ ReadonlySegment::purgeDeletedRecords(DbTable* tab, size_t segIdx) {
 		assert(NULL != input);
 		assert(input->m_isFreezed);
 		assert(!input->m_bookUpdates);
-		input->m_updateList.reserve(1024);
-		input->m_bookUpdates = true;
+			input->m_bookUpdates = true;
 	}
 	std::string strDir = m_segDir.string();
 	m_isDel = input->m_isDel; // make a copy, input->m_isDel[*] may be changed
+	input->keepSnapshotRows(&m_isDel, tab->getOldestSnapshotVersion());
 	m_delcnt = m_isDel.popcnt(); // recompute delcnt
 	m_indices.resize(m_schema->getIndexNum());
 	m_colgroups.resize(m_schema->getColgroupNum());
 	auto tmpSegDir = m_segDir + ".tmp";
 	fs::create_directories(tmpSegDir);
 	try {
+		SegmentEventScope* evScope = SegmentEventScope::current();
+		SegmentPhaseTimer indexPhase(evScope, SegmentPhase::index);
 		for (size_t i = 0; i < m_indices.size(); ++i) {
+			checkBuildCancelled();
 			m_indices[i] = purgeIndex(i, input.get(), ctx.get());
 			m_colgroups[i] = m_indices[i]->getReadableStore();
 		}
+		indexPhase.stop();
+		SegmentPhaseTimer storePhase(evScope, SegmentPhase::store);
 		for (size_t i = m_indices.size(); i < m_colgroups.size(); ++i) {
+			checkBuildCancelled();
+			if (ReadableStore* store = remapColgroup(i, input.get())) {
+				m_colgroups[i] = store;
+				continue;
+			}
 			m_colgroups[i] = purgeColgroup(i, input.get(), ctx.get(), tmpSegDir);
 		}
+		storePhase.stop();
+		checkBuildCancelled(); // the last checkpoint, before commit
 		completeAndReload(tab, segIdx, input.get());
 	}
+	catch (const TaskCancelledException&) {
+		m_indices.erase_all();
+		m_colgroups.erase_all();
+		tab->cancelBookUpdates(input.get());
+		fs::remove_all(tmpSegDir);
+		throw;
+	}
 	catch (const std::exception& ex) {
 		fs::remove_all(tmpSegDir);
 		THROW_STD(logic_error, "generate new segment %s failed: %s"
@@ -1451,7 +2941,7 @@ ReadonlySegment::purgeIndex(size_t indexId, ColgroupSegment* input, DbContext* c
 			}
 		}
 	}
-	return this->buildIndex(schema, strVec);
+	return this->buildIndexAndFilter(indexId, schema, strVec);
 }
 
 ReadableStorePtr
@@ -1460,6 +2950,71 @@ ReadonlySegment::purgeColgroup(size_t colgroupId, ColgroupSegment* input, DbCont
 	return purgeColgroup_s(colgroupId, m_isDel, m_delcnt, input, ctx, tmpSegDir);
 }
 
+// for incremental purge, colgroups whose dead rows ratio is not greater
+// than m_purgeDeleteThreshold are not rewritten, they are kept by a remap
+// from new physic id to row of the old store, fixed len colgroups are
+// always rewritten because it is cheap.
+// returns NULL if the colgroup should be rewritten
+ReadableStore*
+ReadonlySegment::remapColgroup(size_t colgroupId, const ColgroupSegment* input)
+const {
+	assert(m_isDel.size() == input->m_isDel.size());
+	if (!m_schema->m_incrementalPurge || input->getWritableSegment()) {
+		return NULL;
+	}
+	const Schema& schema = m_schema->getColgroupSchema(colgroupId);
+	if (schema.should_use_FixedLenStore() || schema.m_isInplaceUpdatable) {
+		return NULL;
+	}
+	ReadableStore* inner = input->m_colgroups[colgroupId].get();
+	if (dynamic_cast<const LayoutProjectStore*>(inner)) {
+		return NULL; // rewrite into the layout of m_schema
+	}
+	const rank_select_se* oldRemap = NULL;
+	if (auto remapStore = dynamic_cast<const PurgeRemapStore*>(inner)) {
+		inner = remapStore->getInnerStore();
+		oldRemap = &remapStore->getRemap();
+	}
+	if (dynamic_cast<EmptyIndexStore*>(inner)) {
+		return NULL;
+	}
+	const size_t innerRows = size_t(inner->numDataRows());
+	const size_t liveRows = m_isDel.size() - m_delcnt;
+	if (0 == liveRows || 0 == innerRows) {
+		return NULL;
+	}
+	double deadRatio = 1.0 - double(liveRows) / innerRows;
+	if (deadRatio > m_schema->m_purgeDeleteThreshold) {
+		fprintf(stderr, "INFO: %s: colgroup %s dead ratio = %f, rewrite it\n"
+			, m_segDir.string().c_str(), schema.m_name.c_str(), deadRatio);
+		return NULL;
+	}
+	const bm_uint_t* oldPurged = input->m_isPurged.bldata();
+	const bm_uint_t* newIsDel = m_isDel.bldata();
+	febitvec purged(innerRows, false);
+	size_t row = 0;
+	for (size_t logicId = 0; logicId < m_isDel.size(); ++logicId) {
+		if (oldPurged && terark_bit_test(oldPurged, logicId)) {
+			continue; // has no physic row
+		}
+		while (oldRemap && row < innerRows && oldRemap->is1(row)) {
+			purged.set1(row++);
+		}
+		TERARK_RT_assert(row < innerRows, std::logic_error);
+		if (terark_bit_test(newIsDel, logicId)) {
+			purged.set1(row);
+		}
+		row++;
+	}
+	for (; row < innerRows; ++row) {
+		assert(oldRemap && oldRemap->is1(row));
+		purged.set1(row);
+	}
+	fprintf(stderr, "INFO: %s: colgroup %s dead ratio = %f, keep it by remap\n"
+		, m_segDir.string().c_str(), schema.m_name.c_str(), deadRatio);
+	return new PurgeRemapStore(inner, purged);
+}
+
 // should be a static/factory method in the future refactory
 ReadableStorePtr
 ReadonlySegment::purgeColgroup_s(size_t colgroupId,
@@ -1499,7 +3054,7 @@ ReadonlySegment::purgeColgroup_s(size_t colgroupId,
 		double avgLen = 1.0 * colgroup.dataInflateSize() / colgroup.numDataRows();
 		if (schema.m_dictZipSampleRatio > FLT_EPSILON || avgLen > 100) {
 			StoreIteratorPtr iter = colgroup.ensureStoreIterForward(ctx);
-			auto store = buildDictZipStore(schema, tmpSegDir, *iter, isDel, &input->m_isPurged);
+			auto store = buildDictZipStore(schema, tmpSegDir, *iter, isDel, &input->m_isPurged, fstring());
 			assert(llong(newIsDel.size() - newDelcnt) == store->numDataRows());
 			return store;
 		}
@@ -1567,7 +3122,47 @@ ReadonlySegment::purgeColgroup_s(size_t colgroupId,
 
 void ReadonlySegment::load(PathRef segDir) {
 	ColgroupSegment::load(segDir);
+	m_readCnt = 0;
+	m_loadTime = ::time(NULL);
 	removePurgeBitsForCompactIdspace(segDir);
+	loadBloomFilters(segDir);
+	loadZoneMap(segDir);
+	loadIndexStats(segDir);
+	loadReadHeat(segDir);
+
+	// fixed length and int stores are cheap to read, updatable
+	// colgroups may be changed inplace, they are not cached, colgroups
+	// which were not read during the heat window are not admitted
+	const bool heatKnown = ::time(NULL) - m_loadTime >= ReadHeatWindowSeconds;
+	m_valueCacheSegId = ValueCache::newSegmentId();
+	m_valueCacheable.resize_fill(m_colgroups.size(), false);
+	for (size_t i = 0; i < m_colgroups.size(); ++i) {
+		const Schema& schema = m_schema->getColgroupSchema(i);
+		bool isInt = schema.columnNum() == 1 &&
+					 schema.getColumnMeta(0).isInteger();
+		if (!schema.m_isInplaceUpdatable && !isInt &&
+				!schema.should_use_FixedLenStore() &&
+				!(heatKnown && 0 == colgroupReads(i)))
+			m_valueCacheable.set1(i);
+	}
+
+	// non-index colgroup which has all columns in row order, then its value
+	// is encoded as same as the row
+	m_valueRefColgroup = size_t(-1);
+	for (size_t i = m_schema->getIndexNum(); i < m_colgroups.size(); ++i) {
+		const Schema& schema = m_schema->getColgroupSchema(i);
+		if (schema.columnNum() != m_schema->columnNum() ||
+				!m_colgroups[i]->hasValueRef())
+			continue;
+		size_t j = 0;
+		while (j < schema.columnNum() && schema.m_keepCols[j] &&
+				schema.parentColumnId(j) == j)
+			++j;
+		if (j == schema.columnNum()) {
+			m_valueRefColgroup = i;
+			break;
+		}
+	}
 
 	size_t physicRows = this->getPhysicRows();
 	for (size_t i = 0; i < m_colgroups.size(); ++i) {
@@ -1595,12 +3190,12 @@ void ReadonlySegment::removePurgeBitsForCompactIdspace(PathRef segDir) {
 	fs::path formalFile = segDir / "IsDel";
 	fs::path backupFile = segDir / "IsDel.backup";
 	size_t isPurgedMmapBytes = 0;
-	m_isPurgedMmap = (byte*)mmap_load(purgeFpath.string(), &isPurgedMmapBytes);
+	m_isPurgedMmap = (byte*)DbEnv::current()->mmapLoad(purgeFpath.string(), &isPurgedMmapBytes);
 	m_isPurged.risk_mmap_from(m_isPurgedMmap, isPurgedMmapBytes);
 	if (m_isDel.size() != m_isPurged.size()) {
 		assert(m_isDel.size() < m_isPurged.size());
 		// maybe last calling of this function was interupted
-		if (fs::exists(backupFile)) {
+		if (fs::exists(backupFile) && !m_isReplica) {
 			closeIsDel();
 			fs::remove(formalFile);
 			fs::rename(backupFile, formalFile);
@@ -1645,7 +3240,7 @@ void ReadonlySegment::removePurgeBitsForCompactIdspace(PathRef segDir) {
 	}
 	m_isDel.clear(); // by malloc, of newIsDel
 	loadIsDel(segDir);
-	mmap_close(m_isPurgedMmap, isPurgedMmapBytes);
+	DbEnv::current()->mmapClose(m_isPurgedMmap, isPurgedMmapBytes);
 	m_isPurgedMmap = NULL;
 	m_isPurged.risk_release_ownership();
 	fs::remove(purgeFpath);
@@ -1660,7 +3255,7 @@ void ReadonlySegment::savePurgeBits(PathRef segDir) const {
 	assert(m_isPurged.size() == m_isDel.size());
 	assert(m_isPurged.max_rank1() <= m_delcnt);
 	PathRef purgeFpath = segDir / "IsPurged.rs";
-	FileStream fp(purgeFpath.string().c_str(), "wb");
+	EnvFileStream fp(purgeFpath.string().c_str(), "wb");
 	fp.ensureWrite(m_isPurged.data(), m_isPurged.mem_size());
 }
 
@@ -1671,18 +3266,244 @@ void ReadonlySegment::save(PathRef segDir) const {
 	}
 	savePurgeBits(segDir);
 	ColgroupSegment::save(segDir);
+	saveBloomFilters(segDir);
+	saveZoneMap(segDir);
+	saveIndexStats(segDir);
+}
+
+void ReadonlySegment::loadBloomFilters(PathRef segDir) {
+	m_bloomFilters.erase_all();
+	m_bloomFilters.resize(m_schema->getIndexNum());
+	for (size_t i = 0; i < m_bloomFilters.size(); ++i) {
+		const Schema& schema = m_schema->getIndexSchema(i);
+		fs::path fpath = segDir / ("index-" + schema.m_name + ".bloom");
+		if (fs::exists(fpath)) {
+			IndexBloomFilterPtr bf = new IndexBloomFilter();
+			bf->load(fpath);
+			m_bloomFilters[i] = bf;
+		}
+	}
+}
+
+void ReadonlySegment::buildZoneMap() {
+	m_zoneMap = nullptr;
+	size_t blockRows = getEnvLong("TerarkDB_ZoneMapBlockRows", 4096);
+	if (0 == blockRows) {
+		return;
+	}
+	SegmentZoneMapPtr zm = new SegmentZoneMap();
+	zm->build(this, blockRows);
+	if (!zm->m_columns.empty()) {
+		m_zoneMap = zm;
+	}
+}
+
+// segments without zone map file are scanned without pruning
+void ReadonlySegment::loadZoneMap(PathRef segDir) {
+	m_zoneMap = nullptr;
+	fs::path fpath = segDir / "ZoneMap.bin";
+	if (!fs::exists(fpath)) {
+		return;
+	}
+	SegmentZoneMapPtr zm = new SegmentZoneMap();
+	zm->load(fpath);
+	if (zm->m_physicRows != getPhysicRows()) {
+		fprintf(stderr
+			, "WARN: zone map of %s is ignored, physicRows = %zd, expected %zd\n"
+			, segDir.string().c_str(), zm->m_physicRows, getPhysicRows());
+		return;
+	}
+	m_zoneMap = zm;
+}
+
+void ReadonlySegment::saveZoneMap(PathRef segDir) const {
+	if (m_zoneMap) {
+		m_zoneMap->save(segDir / "ZoneMap.bin");
+	}
+}
+
+void ReadonlySegment::buildIndexStats() {
+	m_indexStats = nullptr;
+	size_t buckets = getEnvLong("TerarkDB_IndexStatsBuckets", 64);
+	if (0 == buckets) {
+		return;
+	}
+	SegmentIndexStatsPtr st = new SegmentIndexStats();
+	st->build(this, buckets);
+	m_indexStats = st;
+}
+
+// segments without index stats file are estimated by DbTable::getIndexStats
+void ReadonlySegment::loadIndexStats(PathRef segDir) {
+	m_indexStats = nullptr;
+	fs::path fpath = segDir / "IndexStats.bin";
+	if (!fs::exists(fpath)) {
+		return;
+	}
+	SegmentIndexStatsPtr st = new SegmentIndexStats();
+	st->load(fpath);
+	if (st->m_physicRows != getPhysicRows() ||
+		st->m_indices.size() != m_schema->getIndexNum()) {
+		fprintf(stderr
+			, "WARN: index stats of %s is ignored, physicRows = %zd, expected %zd\n"
+			, segDir.string().c_str(), st->m_physicRows, getPhysicRows());
+		return;
+	}
+	m_indexStats = st;
+}
+
+void ReadonlySegment::saveIndexStats(PathRef segDir) const {
+	if (m_indexStats) {
+		m_indexStats->save(segDir / "IndexStats.bin");
+	}
+}
+
+void ReadonlySegment::saveBloomFilters(PathRef segDir) const {
+	for (size_t i = 0; i < m_bloomFilters.size(); ++i) {
+		auto bf = m_bloomFilters[i].get();
+		if (!bf || (bf->isMmaped() && segDir == m_segDir))
+			continue;
+		const Schema& schema = m_schema->getIndexSchema(i);
+		bf->save(segDir / ("index-" + schema.m_name + ".bloom"));
+	}
 }
 
 void ColgroupSegment::saveRecordStore(PathRef segDir) const {
 	size_t indexNum = m_schema->getIndexNum();
 	size_t colgroupNum = m_schema->getColgroupNum();
 	for (size_t i = indexNum; i < colgroupNum; ++i) {
+		if (dynamic_cast<const LayoutProjectStore*>(m_colgroups[i].get()))
+			continue; // has no files, sources are saved by ReadonlySegment
 		const Schema& schema = m_schema->getColgroupSchema(i);
 		fs::path fpath = segDir / ("colgroup-" + schema.m_name);
 		m_colgroups[i]->save(fpath.string());
 	}
 }
 
+static ReadableStorePtr
+openColgroupStore(const Schema& schema, PathRef segDir, SortableStrVec& files) {
+	std::string prefix = "colgroup-" + schema.m_name;
+	size_t lo = files.lower_bound(prefix);
+	if (lo >= files.size() || !files[lo].startsWith(prefix)) {
+		THROW_STD(invalid_argument, "missing: %s",
+			(segDir / prefix).string().c_str());
+	}
+	ReadableStorePtr store;
+	fstring fname = files[lo];
+	if (fname.substr(prefix.size()).startsWith(".0000.")) {
+		MultiPartStorePtr parts = new MultiPartStore();
+		size_t j = lo;
+		while (j < files.size() && (fname = files[j]).startsWith(prefix)) {
+			size_t partIdx = lcast(fname.substr(prefix.size()+1));
+			assert(partIdx == j - lo);
+			if (partIdx != j - lo) {
+				THROW_STD(invalid_argument, "missing part: %s.%zd",
+					(segDir / prefix).string().c_str(), j - lo);
+			}
+			parts->addpart(ReadableStore::openStore(schema, segDir, fname));
+			++j;
+		}
+		store = parts->finishParts();
+		assert(parts->numParts() > 1);
+	}
+	else {
+		store = ReadableStore::openStore(schema, segDir, fname);
+	}
+	fs::path remapFile = PurgeRemapStore::remapFilePath(segDir / prefix);
+	if (fs::exists(remapFile)) {
+		store = new PurgeRemapStore(store.get(), remapFile);
+	}
+	return store;
+}
+
+static bool isSameColgroup(const Schema& x, const Schema& y) {
+	if (x.m_name != y.m_name || x.columnNum() != y.columnNum())
+		return false;
+	for (size_t i = 0; i < x.columnNum(); ++i) {
+		if (x.getColumnName(i) != y.getColumnName(i))
+			return false;
+	}
+	return true;
+}
+
+// colgroup schemas of Colgroups.json, columns are of the row schema, store
+// options of the colgroups are not needed because they are just opened
+static valvec<SchemaPtr>
+loadColgroupLayoutFile(const SchemaConfig& sconf, const std::string& fpath) {
+	using terark::json;
+	LineBuf text;
+	text.read_all(fpath);
+	const json js = json::parse(std::string(text.p, text.n));
+	valvec<SchemaPtr> layout;
+	for (const auto& cg : js["colgroups"]) {
+		SchemaPtr schema(new Schema());
+		schema->m_name = cg["name"].get<std::string>();
+		for (const auto& col : cg["columns"]) {
+			std::string colname = col.get<std::string>();
+			size_t columnId = sconf.m_rowSchema->getColumnId(colname);
+			if (columnId >= sconf.columnNum()) {
+				THROW_STD(invalid_argument, "%s: colname=%s is not in RowSchema"
+					, fpath.c_str(), colname.c_str());
+			}
+			schema->m_columnsMeta.insert_i(colname,
+				sconf.m_rowSchema->getColumnMeta(columnId));
+		}
+		schema->compile(sconf.m_rowSchema.get());
+		layout.push_back(schema);
+	}
+	return layout;
+}
+
+void ReadonlySegment::saveColgroupLayout(PathRef segDir) const {
+	using terark::json;
+	json colgroups = json::array();
+	auto add = [&](const Schema& schema) {
+		json cg;
+		json columns = json::array();
+		for (size_t j = 0; j < schema.columnNum(); ++j)
+			columns.push_back(schema.getColumnName(j).str());
+		cg["name"] = schema.m_name;
+		cg["columns"] = columns;
+		colgroups.push_back(cg);
+	};
+	for (size_t i = m_schema->getIndexNum(); i < m_colgroups.size(); ++i) {
+		if (!isProjectedColgroup(i))
+			add(m_schema->getColgroupSchema(i));
+	}
+	for (auto& schema : m_layoutSchemas) {
+		add(*schema);
+	}
+	json js;
+	js["colgroups"] = colgroups;
+	std::string str = js.dump(2);
+	std::string fpath = (segDir / "Colgroups.json").string();
+	std::string tmpFile = fpath + ".tmp";
+	{
+		EnvFileStream fp(tmpFile, "w");
+		fp.ensureWrite(str.data(), str.size());
+	}
+	fs::rename(tmpFile, fpath);
+}
+
+bool ReadonlySegment::isProjectedColgroup(size_t colgroupId) const {
+	assert(colgroupId < m_colgroups.size());
+	return dynamic_cast<const LayoutProjectStore*>(m_colgroups[colgroupId].get()) != NULL;
+}
+
+void ReadonlySegment::saveRecordStore(PathRef segDir) const {
+	ColgroupSegment::saveRecordStore(segDir);
+	for (size_t i = 0; i < m_layoutSchemas.size(); ++i) {
+		fs::path fpath = segDir / ("colgroup-" + m_layoutSchemas[i]->m_name);
+		m_layoutColgroups[i]->save(fpath.string());
+	}
+	saveColgroupLayout(segDir);
+}
+
+// Colgroups.json is the colgroup layout of the segment, it is written on
+// the first load. If colgroups of m_schema were changed since then, the
+// changed colgroups are LayoutProjectStore on colgroups of the layout, and
+// fixed length ones are materialized into FixedLenStore files, because they
+// may be inplace updatable. Indices and the row schema must not be changed.
 void ReadonlySegment::loadRecordStore(PathRef segDir) {
 	if (!m_colgroups.empty()) {
 		THROW_STD(invalid_argument, "m_colgroups must be empty");
@@ -1693,6 +3514,8 @@ void ReadonlySegment::loadRecordStore(PathRef segDir) {
 	size_t indexNum = m_schema->getIndexNum();
 	size_t colgroupNum = m_schema->getColgroupNum();
 	m_colgroups.resize(colgroupNum);
+	m_layoutSchemas.erase_all();
+	m_layoutColgroups.erase_all();
 	for (size_t i = 0; i < indexNum; ++i) {
 		assert(m_indices[i]); // index must have be loaded
 		auto store = m_indices[i]->getReadableStore();
@@ -1707,41 +3530,106 @@ void ReadonlySegment::loadRecordStore(PathRef segDir) {
 		}
 	}
 	files.sort();
+	fs::path layoutFile = segDir / "Colgroups.json";
+	if (!fs::exists(layoutFile)) {
+		for (size_t i = indexNum; i < colgroupNum; ++i) {
+			const Schema& schema = m_schema->getColgroupSchema(i);
+			m_colgroups[i] = openColgroupStore(schema, segDir, files);
+		}
+		if (!m_isReplica)
+			saveColgroupLayout(segDir);
+		return;
+	}
+	valvec<SchemaPtr> layout = loadColgroupLayoutFile(*m_schema, layoutFile.string());
+	for (auto& schema : layout) {
+		size_t cgId = m_schema->getColgroupId(schema->m_name);
+		if (cgId >= indexNum && cgId < colgroupNum &&
+				isSameColgroup(*schema, m_schema->getColgroupSchema(cgId))) {
+			m_colgroups[cgId] = openColgroupStore(m_schema->getColgroupSchema(cgId), segDir, files);
+		} else {
+			m_layoutColgroups.push_back(openColgroupStore(*schema, segDir, files));
+			m_layoutSchemas.push_back(schema);
+		}
+	}
+	if (m_layoutSchemas.empty()) {
+		return; // layout is same as m_schema
+	}
+	// where columns of the row are stored in the layout of the segment
+	struct ColSource {
+		ReadableStore* store;
+		const SchemaPtr* schema;
+		size_t subColumnId;
+	};
+	const size_t columnNum = m_schema->columnNum();
+	valvec<ColSource> colSources(columnNum, ColSource{NULL, NULL, 0});
+	auto addSource = [&](ReadableStore* store, const SchemaPtr& schema) {
+		for (size_t j = 0; j < schema->columnNum(); ++j) {
+			ColSource& cs = colSources[schema->parentColumnId(j)];
+			if (NULL == cs.store)
+				cs = ColSource{store, &schema, j};
+		}
+	};
+	const auto& nested = m_schema->m_colgroupSchemaSet->m_nested;
+	for (size_t i = 0; i < colgroupNum; ++i) {
+		if (m_colgroups[i])
+			addSource(m_colgroups[i].get(), nested.elem_at(i));
+	}
+	for (size_t k = 0; k < m_layoutSchemas.size(); ++k) {
+		addSource(m_layoutColgroups[k].get(), m_layoutSchemas[k]);
+	}
+	bool materialized = false;
 	for (size_t i = indexNum; i < colgroupNum; ++i) {
+		if (m_colgroups[i])
+			continue;
 		const Schema& schema = m_schema->getColgroupSchema(i);
-		std::string prefix = "colgroup-" + schema.m_name;
-		size_t lo = files.lower_bound(prefix);
-		if (lo >= files.size() || !files[lo].startsWith(prefix)) {
-			THROW_STD(invalid_argument, "missing: %s",
-				(segDir / prefix).string().c_str());
-		}
-		fstring fname = files[lo];
-		if (fname.substr(prefix.size()).startsWith(".0000.")) {
-			MultiPartStorePtr parts = new MultiPartStore();
-			size_t j = lo;
-			while (j < files.size() && (fname = files[j]).startsWith(prefix)) {
-				size_t partIdx = lcast(fname.substr(prefix.size()+1));
-				assert(partIdx == j - lo);
-				if (partIdx != j - lo) {
-					THROW_STD(invalid_argument, "missing part: %s.%zd",
-						(segDir / prefix).string().c_str(), j - lo);
-				}
-				parts->addpart(ReadableStore::openStore(schema, segDir, fname));
-				++j;
+		LayoutProjectStorePtr proj = new LayoutProjectStore();
+		for (size_t j = 0; j < schema.columnNum(); ++j) {
+			const ColSource& cs = colSources[schema.parentColumnId(j)];
+			if (NULL == cs.store) {
+				THROW_STD(invalid_argument, "column %s is not in colgroups of %s"
+					, schema.getColumnName(j).c_str(), segDir.string().c_str());
 			}
-			m_colgroups[i] = parts->finishParts();
-			assert(parts->numParts() > 1);
+			proj->addColumn(cs.store, *cs.schema, cs.subColumnId);
 		}
-		else {
-			m_colgroups[i] = ReadableStore::openStore(schema, segDir, fname);
+		fprintf(stderr, "INFO: %s: colgroup %s is projected from the old layout\n"
+			, segDir.string().c_str(), schema.m_name.c_str());
+		// a replica never updates inplace, it reads by the projection
+		if (m_isReplica ||
+			(!schema.m_isInplaceUpdatable && !schema.should_use_FixedLenStore())) {
+			m_colgroups[i] = proj;
+			continue;
+		}
+		for (auto& old : m_layoutSchemas) {
+			if (old->m_name == schema.m_name) {
+				THROW_STD(invalid_argument
+					, "%s: columns of colgroup %s are changed, it must be renamed"
+					, segDir.string().c_str(), schema.m_name.c_str());
+			}
+		}
+		fs::path fpath = segDir / ("colgroup-" + schema.m_name + ".fixlen");
+		fs::remove(fpath); // maybe last materialization was interrupted
+		FixedLenStorePtr store = new FixedLenStore(segDir, schema);
+		store->unneedsLock();
+		size_t rows = size_t(proj->numDataRows());
+		store->reserveRows(rows);
+		valvec<byte> buf;
+		for (size_t physicId = 0; physicId < rows; ++physicId) {
+			proj->getValue(physicId, &buf, NULL);
+			store->append(buf, NULL);
 		}
+		store->shrinkToFit();
+		m_colgroups[i] = store;
+		materialized = true;
+	}
+	if (materialized) {
+		saveColgroupLayout(segDir);
 	}
 }
 
 void ColgroupSegment::closeFiles() {
 	if (m_isDelMmap) {
 		size_t bitBytes = m_isDel.capacity()/8;
-		mmap_close(m_isDelMmap, sizeof(uint64_t) + bitBytes);
+		DbEnv::current()->mmapClose(m_isDelMmap, sizeof(uint64_t) + bitBytes);
 		m_isDelMmap = nullptr;
 		m_isDel.risk_release_ownership();
 	}
@@ -1751,6 +3639,9 @@ void ColgroupSegment::closeFiles() {
 
 ReadableIndex*
 ReadonlySegment::openIndex(const Schema& schema, PathRef path) const {
+	if (boost::filesystem::exists(path + ".seqnum")) {
+		return openSeqNumIndex(schema.getColumnMeta(0).type, path);
+	}
 	if (boost::filesystem::exists(path + ".zint")) {
 		std::unique_ptr<ZipIntKeyIndex> store(new ZipIntKeyIndex(schema));
 		store->load(path);
@@ -1761,6 +3652,11 @@ ReadonlySegment::openIndex(const Schema& schema, PathRef path) const {
 		store->load(path);
 		return store.release();
 	}
+	if (boost::filesystem::exists(path + ".bitmap")) {
+		std::unique_ptr<BitmapIndex> store(new BitmapIndex(schema));
+		store->load(path);
+		return store.release();
+	}
 	if (boost::filesystem::exists(path + ".empty")) {
 		std::unique_ptr<EmptyIndexStore> store(new EmptyIndexStore());
 		store->load(path);
@@ -1769,6 +3665,124 @@ ReadonlySegment::openIndex(const Schema& schema, PathRef path) const {
 	return nullptr;
 }
 
+ReadableIndex*
+ReadonlySegment::buildIndexAndFilter(size_t indexId, const Schema& schema,
+									 SortableStrVec& indexData) {
+	assert(indexId < m_schema->getIndexNum());
+	if (m_bloomFilters.size() != m_schema->getIndexNum()) {
+		m_bloomFilters.resize(m_schema->getIndexNum());
+	}
+	m_bloomFilters[indexId] = NULL;
+	if (schema.m_bloomBitsPerKey > 0 && indexData.str_size() > 0) {
+		IndexBloomFilterPtr bf = new IndexBloomFilter();
+		bf->build(indexData, schema.getFixedRowLen(), schema.m_bloomBitsPerKey);
+		m_bloomFilters[indexId] = bf;
+	}
+	return this->buildIndex(schema, indexData);
+}
+
+namespace {
+// pass through sorted input and add keys to bloom filter
+class BloomFilterTeeInput : public SortedIndexInput {
+	SortedIndexInput& m_input;
+	IndexBloomFilter* m_filter;
+public:
+	BloomFilterTeeInput(SortedIndexInput& input, IndexBloomFilter* bf)
+		: m_input(input), m_filter(bf) {}
+	llong numRows() override { return m_input.numRows(); }
+	bool keyBounds(valvec<byte>* minKey, valvec<byte>* maxKey) override {
+		return m_input.keyBounds(minKey, maxKey);
+	}
+	bool next(llong* recId, valvec<byte>* key) override {
+		if (m_input.next(recId, key)) {
+			if (m_filter)
+				m_filter->add(*key);
+			return true;
+		}
+		return false;
+	}
+};
+} // namespace
+
+ReadableIndex*
+ReadonlySegment::buildIndexAndFilterFromSorted(size_t indexId,
+											   const Schema& schema,
+											   SortedIndexInput& input) {
+	assert(indexId < m_schema->getIndexNum());
+	if (m_bloomFilters.size() != m_schema->getIndexNum()) {
+		m_bloomFilters.resize(m_schema->getIndexNum());
+	}
+	IndexBloomFilterPtr bf;
+	if (schema.m_bloomBitsPerKey > 0 && input.numRows() > 0) {
+		bf = new IndexBloomFilter();
+		bf->init(size_t(input.numRows()), schema.m_bloomBitsPerKey);
+	}
+	BloomFilterTeeInput tee(input, bf.get());
+	ReadableIndex* index = this->buildIndexFromSorted(schema, tee);
+	m_bloomFilters[indexId] = index ? bf : NULL;
+	return index;
+}
+
+// min of rows / (maxKey - minKey + 1) of SeqNumIndex, in percent, 0 disables
+static double seqNumIndexMinDensity() {
+	static const double density =
+		std::max<long>(0, getEnvLong("TerarkDB_SeqNumIndexMinDensity", 10)) / 100.0;
+	return density;
+}
+
+ReadableIndex*
+ReadonlySegment::buildIndexFromSorted(const Schema& schema,
+									  SortedIndexInput& input)
+const {
+	const size_t fixlen = schema.getFixedRowLen();
+	if (schema.m_bitmapIndex) {
+		// input is consumed, buildIndex is the fallback if there are too
+		// many distinct keys
+		std::unique_ptr<BitmapIndex> index(new BitmapIndex(schema));
+		if (index->buildFromSorted(schema, input))
+			return index.release();
+		return nullptr;
+	}
+	if (schema.columnNum() == 1 &&
+			seqNumIndexMayFit(schema.getColumnMeta(0).type, input,
+							  seqNumIndexMinDensity())) {
+		// SeqNumIndex needs keys in recId order, the key array of fixlen
+		// bytes per key is not larger than ZipIntKeyIndex build buffer
+		const size_t rows = size_t(input.numRows());
+		SortableStrVec indexData;
+		indexData.m_strpool.resize(rows * fixlen);
+		valvec<byte> key;
+		llong recId = -1;
+		size_t pos = 0;
+		while (input.next(&recId, &key)) {
+			if (key.size() != fixlen || pos >= rows ||
+					recId < 0 || size_t(recId) >= rows) {
+				THROW_STD(invalid_argument
+					, "bad sorted input: pos = %zd, recId = %lld, rows = %zd"
+					, pos, recId, rows);
+			}
+			memcpy(indexData.m_strpool.data() + fixlen * recId, key.data(), fixlen);
+			pos++;
+		}
+		if (pos != rows) {
+			THROW_STD(invalid_argument
+				, "bad sorted input: got %zd keys, rows = %zd", pos, rows);
+		}
+		return buildIndex(schema, indexData);
+	}
+	if (schema.columnNum() == 1 && schema.getColumnMeta(0).isInteger()) {
+		std::unique_ptr<ZipIntKeyIndex> index(new ZipIntKeyIndex(schema));
+		if (index->buildFromSorted(schema.getColumnMeta(0).type, input))
+			return index.release();
+	}
+	if (fixlen && fixlen <= 16) {
+		std::unique_ptr<FixedLenKeyIndex> index(new FixedLenKeyIndex(schema));
+		index->buildFromSorted(schema, input);
+		return index.release();
+	}
+	return nullptr; // needs SortableStrVec by buildIndex
+}
+
 ReadableIndex*
 ReadonlySegment::buildIndex(const Schema& schema, SortableStrVec& indexData)
 const {
@@ -1776,6 +3790,19 @@ const {
 		return new EmptyIndexStore();
 	}
 	const size_t fixlen = schema.getFixedRowLen();
+	if (schema.m_bitmapIndex) {
+		std::unique_ptr<BitmapIndex> index(new BitmapIndex(schema));
+		if (index->build(schema, indexData))
+			return index.release();
+		fprintf(stderr, "INFO: %s has more than %zd distinct keys, not a BitmapIndex\n"
+			, schema.m_name.c_str(), BitmapIndex::maxValues());
+	}
+	if (schema.columnNum() == 1) {
+		ReadableIndex* index = buildSeqNumIndex(schema.getColumnMeta(0).type,
+					indexData.m_strpool, seqNumIndexMinDensity());
+		if (index)
+			return index;
+	}
 	if (schema.columnNum() == 1 && schema.getColumnMeta(0).isInteger()) {
 		try {
 			std::unique_ptr<ZipIntKeyIndex> index(new ZipIntKeyIndex(schema));
@@ -1875,6 +3902,10 @@ WritableSegment::~WritableSegment() {
 		flushSegment();
 }
 
+bool WritableSegment::needFreezeByMemBudget() const {
+	return false;
+}
+
 void WritableSegment::pushIsDel(bool val) {
 	const size_t ChunkBits = TERARK_IF_DEBUG(4*1024, 1*1024*1024);
 	if (terark_unlikely(nullptr == m_isDelMmap)) {
@@ -3,10 +3,16 @@
 
 #include "db_index.hpp"
 #include "db_store.hpp"
+#include "columnar_scan.hpp"
+#include "index_stats.hpp"
 #include <terark/bitmap.hpp>
+#include <terark/gold_hash_map.hpp>
 #include <terark/rank_select.hpp>
+#include <terark/util/fstrvec.hpp>
 #include <tbb/spin_rw_mutex.h>
 #include <tbb/tbb_thread.h>
+#include <atomic>
+#include <time.h>
 
 namespace terark {
 	class SortableStrVec;
@@ -14,9 +20,150 @@ namespace terark {
 
 namespace terark { namespace db {
 
+class TempFileList;
+
 typedef tbb::spin_rw_mutex        SpinRwMutex;
 typedef SpinRwMutex::scoped_lock  SpinRwLock;
 
+// Cache line blocked bloom filter on the keys of one index of a
+// ReadonlySegment, all probes of a key hit the same 512-bit block.
+// There are no false negatives, so a miss skips probing the index.
+class TERARK_DB_DLL IndexBloomFilter : public RefCounter {
+	const uint64_t* m_blocks;
+	valvec<uint64_t> m_owned;
+	byte*    m_mmapBase;
+	size_t   m_mmapSize;
+	size_t   m_numBlocks;
+	uint32_t m_numProbes;
+public:
+	IndexBloomFilter();
+	~IndexBloomFilter();
+	static uint64_t hashKey(fstring key);
+	void build(const SortableStrVec& keys, size_t fixlen, int bitsPerKey);
+	void init(size_t numKeys, int bitsPerKey);
+	void add(fstring key);
+	bool mayContain(fstring key) const;
+	bool isMmaped() const { return NULL != m_mmapBase; }
+	size_t mem_size() const { return 64 * m_numBlocks; }
+	void load(PathRef fpath);
+	void save(PathRef fpath) const;
+};
+typedef boost::intrusive_ptr<IndexBloomFilter> IndexBloomFilterPtr;
+
+// Bloom filters on the unique index keys of all covered segments of a
+// DbTable, a segment is covered if its m_uniqKeyFilterGen == m_gen, so a
+// miss skips probing all covered segments. Keys are added only by
+// DbTable::updateUniqueKeyFilter, deleted keys are never removed.
+class TERARK_DB_DLL UniqueKeyFilter : public RefCounter {
+public:
+	size_t m_gen;
+	size_t m_capacity; // keys of each filter for the designed fp rate
+	size_t m_numKeys;  // keys added to each filter
+	valvec<IndexBloomFilterPtr> m_filters; // parallel with m_uniqIndices
+	UniqueKeyFilter() : m_gen(0), m_capacity(0), m_numKeys(0) {}
+	bool covers(const class ReadableSegment* seg) const;
+};
+typedef boost::intrusive_ptr<UniqueKeyFilter> UniqueKeyFilterPtr;
+
+// A colgroup store kept as is by incremental purge, rows of m_store are
+// in the physic id space before purge, m_remap.is1(k) means row k of
+// m_store has been purged, physic id x is row m_remap.select0(x)
+class TERARK_DB_DLL PurgeRemapStore : public ReadableStore {
+	ReadableStorePtr m_store;
+	rank_select_se   m_remap;
+	byte*            m_remapMmap;
+	size_t           m_remapMmapSize;
+	std::string      m_remapFile; // loaded from, empty if built
+public:
+	PurgeRemapStore(ReadableStore* store, const febitvec& purged);
+	PurgeRemapStore(ReadableStore* store, PathRef remapFile);
+	~PurgeRemapStore();
+	static boost::filesystem::path remapFilePath(PathRef storePath);
+
+	ReadableStore* getInnerStore() const { return m_store.get(); }
+	const rank_select_se& getRemap() const { return m_remap; }
+
+	llong dataStorageSize() const override;
+	llong dataInflateSize() const override;
+	llong numDataRows() const override;
+	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	bool hasValueRef() const override;
+	fstring getValueRef(llong id, DbContext*) const override;
+	StoreIterator* createStoreIterForward(DbContext*) const override;
+	StoreIterator* createStoreIterBackward(DbContext*) const override;
+	void load(PathRef path) override;
+	void save(PathRef path) const override;
+};
+
+// A colgroup of the table schema on a readonly segment which was built by
+// another colgroup layout(Colgroups.json in the segment dir), rows are
+// projected from colgroups of the segment, the segment is rewritten to the
+// layout of the table schema by the next merge or purge of it
+class TERARK_DB_DLL LayoutProjectStore : public ReadableStore {
+	struct Source {
+		ReadableStorePtr store;
+		SchemaPtr        schema; // of store
+		size_t           usedColumns;
+	};
+	struct Column {
+		uint32_t source; // index of m_sources
+		uint32_t subColumnId;
+	};
+	valvec<Source> m_sources;
+	valvec<Column> m_columns; // parallel with columns of the colgroup
+public:
+	LayoutProjectStore();
+	~LayoutProjectStore();
+	/// columns are added in the order of the projected colgroup
+	void addColumn(ReadableStore* store, const SchemaPtr& schema, size_t subColumnId);
+
+	llong dataStorageSize() const override;
+	llong dataInflateSize() const override;
+	llong numDataRows() const override;
+	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	StoreIterator* createStoreIterForward(DbContext*) const override;
+	StoreIterator* createStoreIterBackward(DbContext*) const override;
+	void load(PathRef path) override;
+	void save(PathRef path) const override;
+};
+typedef boost::intrusive_ptr<LayoutProjectStore> LayoutProjectStorePtr;
+
+// Ids of rows updated or deleted while a segment is being converted, merged
+// or purged. Ids are appended to a pending list, which is sorted and merged
+// into sorted disjoint runs [beg, end) when it is half of the runs, so the
+// memory is O(distinct updated rows), not a bitmap of all rows, and the
+// catch up only visits the updated rows.
+class TERARK_DB_DLL UpdatedIdRuns {
+public:
+	struct Run { uint32_t beg, end; };
+private:
+	valvec<Run>      m_runs;    // sorted and disjoint
+	valvec<uint32_t> m_pending; // unsorted, may be duplicated
+	void mergePending();
+public:
+	void add(size_t id) {
+		m_pending.push_back(uint32_t(id));
+		if (m_pending.size() >= 4096 && m_pending.size() >= m_runs.size() / 2)
+			mergePending();
+	}
+	bool empty() const { return m_runs.empty() && m_pending.empty(); }
+	void swap(UpdatedIdRuns& y) { m_runs.swap(y.m_runs); m_pending.swap(y.m_pending); }
+	void erase_all() { m_runs.erase_all(); m_pending.erase_all(); }
+	void clear() { m_runs.clear(); m_pending.clear(); }
+	/// visit distinct ids in increasing order, @returns number of ids
+	template<class OnId>
+	size_t for_each(OnId onId) {
+		mergePending();
+		size_t num = 0;
+		for (const Run& r : m_runs) {
+			for (size_t id = r.beg; id < r.end; ++id)
+				onId(id);
+			num += r.end - r.beg;
+		}
+		return num;
+	}
+};
+
 // This ReadableStore is used for return full-row
 // A full-row is of one table, the table has multiple indices
 class TERARK_DB_DLL ReadableSegment : public ReadableStore {
@@ -63,6 +210,28 @@ public:
 										fstring key, valvec<llong>* recIdvec,
 										DbContext*) const = 0;
 
+	///@param offsets size is num+1, same as ReadableIndex::searchExactAppendBatch
+	virtual void indexSearchExactAppendBatch(size_t mySegIdx, size_t indexId,
+										const fstring* keys, size_t num,
+										valvec<llong>* recIdvec, size_t* offsets,
+										DbContext*) const;
+
+	///@{ non-deleted records whose key is in [lo, hi), same as
+	/// ReadableIndex::countRange, onRecord is called with logic ids
+	virtual llong indexCountRange(size_t mySegIdx, size_t indexId,
+								  fstring lo, fstring hi, DbContext*) const;
+	virtual llong indexScanRange(size_t mySegIdx, size_t indexId,
+								 fstring lo, fstring hi,
+								 const std::function<bool(llong logicId)>& onRecord,
+								 DbContext*) const;
+	///@}
+
+	/// non-deleted records whose index key starts with prefix, in key order,
+	/// same as ReadableIndex::scanPrefix, onKey is called with logic ids
+	virtual llong indexScanPrefix(size_t mySegIdx, size_t indexId, fstring prefix,
+								  const std::function<bool(fstring key, llong logicId)>& onKey,
+								  DbContext*) const;
+
 	virtual void selectColumns(llong recId, const size_t* colsId, size_t colsNum,
 							   valvec<byte>* colsData, DbContext*) const = 0;
 	virtual void selectOneColumn(llong recId, size_t columnId,
@@ -71,6 +240,11 @@ public:
 	virtual void selectColgroups(llong id, const size_t* cgIdvec, size_t cgIdvecSize,
 								 valvec<byte>* cgDataVec, DbContext*) const = 0;
 
+	/// returns the colgroup value in store memory if the store hasValueRef,
+	/// else the value is copied to buf, default is copying
+	virtual fstring selectOneColgroupRef(llong id, size_t cgId,
+										 valvec<byte>* buf, DbContext*) const;
+
 	void openIndices(PathRef dir);
 	void saveIndices(PathRef dir) const;
 	llong totalIndexSize() const;
@@ -97,31 +271,89 @@ public:
 	}
     bool testIsDel(size_t logicId) const
     {
-        return m_isFreezed ? m_isDel[logicId] : locked_testIsDel(logicId);
+        return m_isFreezed ? isDelBit(logicId) : locked_testIsDel(logicId);
     }
 
+	///@{ m_isDelBlocks has a bit for each IsDelBlockRows rows of a readonly
+	/// segment, it is 0 if the rows have no deletion, so lookups and scans
+	/// of rows in clean blocks do not touch the mmap of m_isDel, and pages
+	/// of a sparsely deleted IsDel are not resident. It is built on load
+	/// and before the segment is published, it is empty for writable and
+	/// densely deleted segments. Writers of a published readonly segment
+	/// must set delmark by atomicSetIsDel1
+	static const size_t IsDelBlockBits = 12;
+	static const size_t IsDelBlockRows = size_t(1) << IsDelBlockBits;
+	bool isDelBit(size_t logicId) const {
+		return (m_isDelBlocks.empty() || m_isDelBlocks[logicId >> IsDelBlockBits])
+			&& m_isDel[logicId];
+	}
+	/// delmark by atomic fetch-or(fetch-and) on the words of m_isDel and
+	/// m_isDelBlocks, m_delcnt is updated if the bit is changed. m_segMutex
+	/// is needed for a frozen segment only if m_bookUpdates or the deletion
+	/// is stamped, and for a writable segment since m_isDel may grow
+	///@returns false if the bit is not changed
+	bool atomicSetIsDel1(size_t logicId);
+	bool atomicSetIsDel0(size_t logicId);
+	/// delmark all rows, @returns number of newly deleted rows
+	size_t atomicSetIsDelAll();
+	/// @returns popcnt of m_isDel, must not be called if the segment is
+	/// published, since readers read m_isDelBlocks without lock
+	size_t rebuildIsDelBlocks();
+	///@}
+
+	///@{ mvcc of deletions, see DbTable::acquireSnapshot
+	/// rows of a frozen segment deleted while any snapshot is alive are
+	/// stamped by the version of the latest snapshot, such rows are still
+	/// visible to snapshots no newer than the stamp, until purge drops them
+	/// after all these snapshots are released.
+	/// deleted and invisible to ctx
+	bool testIsDel(size_t logicId, const DbContext* ctx) const;
+	/// deleted after the snapshot of ctx, so it is still visible to ctx
+	bool isDelAfterSnapshot(size_t logicId, const DbContext* ctx) const;
+	/// caller should hold m_segMutex as writer
+	void setDelVersionNoLock(size_t logicId, llong version);
+	/// clear purge bits of rows visible to snapshots no older than
+	/// oldestVersion, returns the number of cleared bits
+	size_t keepSnapshotRows(febitvec* purgeBits, llong oldestVersion) const;
+	/// copy stamps no older than oldestVersion, logicId is offset by baseId
+	void copyDelVersions(const ReadableSegment& src, size_t baseId, llong oldestVersion);
+	/// drop stamps older than oldestVersion, all if LLONG_MAX
+	void gcDelVersions(llong oldestVersion);
+	bool hasDelVersions() const;
+	///@}
+
 	SchemaConfigPtr          m_schema;
 	valvec<ReadableIndexPtr> m_indices; // parallel with m_indexSchemaSet
 	valvec<ReadableStorePtr> m_colgroups; // indices + pure_colgroups
-	size_t      m_delcnt;
+	std::atomic_size_t m_delcnt; // atomic for lock free delmark
 	febitvec    m_isDel;
 	byte*       m_isDelMmap = nullptr;
+	febitvec    m_isDelBlocks; // see isDelBit
 	rank_select_se m_isPurged; // just for ReadonlySegment
 	byte*          m_isPurgedMmap;
 	boost::filesystem::path m_segDir;
 	mutable SpinRwMutex m_segMutex;
-	valvec<uint32_t> m_updateList; // including deletions
-	febitvec    m_updateBits; // if m_updateList is too large, use updateBits
-	ReadableStorePtr m_deletionTime; // for snapshot, an uint64 array
+	UpdatedIdRuns m_updateIds; // including deletions, if m_bookUpdates
+	gold_hash_map<uint32_t, llong> m_delVersions; // guarded by m_segMutex
 	bool        m_tobeDel;
 	bool        m_isDirty;
 	bool        m_hasLockFreePointSearch;
-	bool        m_bookUpdates;
+	std::atomic<bool> m_bookUpdates; // seq_cst, see atomicSetIsDel1
 	bool        m_withPurgeBits;  // just for ReadonlySegment
+	bool        m_isReplica; // opened by DbTable::openReplica, never writes
     bool        m_onProcess;
+	bool        m_isQuarantined; // by the scrubber, never merged or purged
+	// newest time partition of rows, LLONG_MIN if unknown, such segments
+	// are never dropped, see SchemaConfig::m_timePartitionColumnId
+	std::atomic<llong> m_timePartition;
+	size_t      m_uniqKeyFilterGen; // 0 is not covered by UniqueKeyFilter
 };
 typedef boost::intrusive_ptr<ReadableSegment> ReadableSegmentPtr;
 
+inline bool UniqueKeyFilter::covers(const ReadableSegment* seg) const {
+	return seg->m_uniqKeyFilterGen == m_gen;
+}
+
 class TERARK_DB_DLL ColgroupSegment : public ReadableSegment {
 public:
 	ColgroupSegment();
@@ -140,6 +372,13 @@ public:
 
 protected:
 	void getValueByPhysicId(size_t id, valvec<byte>* val, DbContext*) const;
+	void getValuesByPhysicIdBatch(const llong* physicIds, size_t num,
+								  valvec<byte>* vals, DbContext*) const;
+	void combineColgroupColumns(const ColumnVec& cols1, ColumnVec* cols2,
+								valvec<byte>* val) const;
+	// through the ValueCache of the table if it is enabled for cgId
+	void getColgroupValueAppend(size_t cgId, llong physicId,
+								valvec<byte>* val, DbContext*) const;
 
 	void selectColumnsByPhysicId(llong recId, const size_t* colsId,
 				size_t colsNum, valvec<byte>* colsData, DbContext*) const;
@@ -155,11 +394,14 @@ public:
 
 	friend class DbTable;
 	friend class TableIndexIter;
+	friend class OnlineIndex;
 	class MyStoreIterForward;  friend class MyStoreIterForward;
 	class MyStoreIterBackward; friend class MyStoreIterBackward;
 	llong  m_dataInflateSize;
 	llong  m_dataMemSize;
 	llong  m_totalStorageSize;
+	ullong m_valueCacheSegId; // 0 if values are not cached
+	febitvec m_valueCacheable; // parallel with m_colgroups
 };
 typedef boost::intrusive_ptr<ColgroupSegment> ColgroupSegmentPtr;
 
@@ -183,12 +425,23 @@ public:
 	ReadonlySegment* getReadonlySegment() const override;
 
 	void convFrom(class DbTable*, size_t segIdx);
+
+	/// build and save this segment into m_segDir from rows of the row
+	/// schema, all rows are alive, unique indices are not checked, the
+	/// segment is not loaded, load(m_segDir) to use it
+	void buildFromRows(const fstrvecl& rows);
 	void purgeDeletedRecords(class DbTable*, size_t segIdx);
 
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	void getValuesAppendBatch(const llong* ids, size_t num,
+							  valvec<byte>* vals, DbContext*) const override;
 	void indexSearchExactAppend(size_t mySegIdx, size_t indexId,
 								fstring key, valvec<llong>* recIdvec,
 								DbContext*) const override;
+	void indexSearchExactAppendBatch(size_t mySegIdx, size_t indexId,
+								const fstring* keys, size_t num,
+								valvec<llong>* recIdvec, size_t* offsets,
+								DbContext*) const override;
 
 	void selectColumns(llong recId, const size_t* colsId, size_t colsNum,
 					   valvec<byte>* colsData, DbContext*) const override;
@@ -197,9 +450,28 @@ public:
 
 	void selectColgroups(llong id, const size_t* cgIdvec, size_t cgIdvecSize,
 						 valvec<byte>* cgDataVec, DbContext*) const override;
+	fstring selectOneColgroupRef(llong id, size_t cgId,
+								 valvec<byte>* buf, DbContext*) const override;
+
+	///@{ the whole row is zero-copy if it is stored by a single colgroup
+	bool hasValueRef() const override;
+	fstring getValueRef(llong id, DbContext*) const override;
+	///@}
 
 	void load(PathRef segDir) override;
 	void save(PathRef segDir) const override;
+	void loadBloomFilters(PathRef segDir);
+	void saveBloomFilters(PathRef segDir) const;
+	/// build m_zoneMap on loaded stores, block rows is env
+	/// TerarkDB_ZoneMapBlockRows(default 4096), 0 disables zone maps
+	void buildZoneMap();
+	void loadZoneMap(PathRef segDir);
+	void saveZoneMap(PathRef segDir) const;
+	/// build m_indexStats on loaded stores, histogram buckets is env
+	/// TerarkDB_IndexStatsBuckets(default 64), 0 disables index stats
+	void buildIndexStats();
+	void loadIndexStats(PathRef segDir);
+	void saveIndexStats(PathRef segDir) const;
 
 	virtual ReadableIndex* openIndex(const Schema&, PathRef path) const override = 0;
 
@@ -211,12 +483,30 @@ public:
 			buildStore(const Schema&, SortableStrVec& storeData)
 			const = 0;
 
+	// build bloom filter(if enabled by schema) before buildIndex,
+	// because buildIndex may consume indexData
+	ReadableIndex*
+			buildIndexAndFilter(size_t indexId, const Schema&,
+								SortableStrVec& indexData);
+
+	// build index by streaming sorted keys, returns NULL if the index
+	// type needs the whole SortableStrVec, then input is not consumed
+	virtual ReadableIndex*
+			buildIndexFromSorted(const Schema&, SortedIndexInput& input)
+			const;
+	ReadableIndex*
+			buildIndexAndFilterFromSorted(size_t indexId, const Schema&,
+										  SortedIndexInput& input);
+
+	///@param reuseDict saved dict samples of an input store, may be empty
 	virtual ReadableStore*
 			buildDictZipStore(const Schema&, PathRef dir, StoreIterator& inputIter,
-							  const bm_uint_t* isDel, const febitvec* isPurged)
+							  const bm_uint_t* isDel, const febitvec* isPurged,
+							  fstring reuseDict)
 			const;
 
 	void compressMultipleColgroups(ReadableSegment* input, DbContext* ctx);
+	void buildColgroupsFromTempFiles(TempFileList&, llong newRowNum);
 	void compressSingleKeyIndex(ReadableSegment* input, DbContext* ctx);
 	virtual
 	void compressSingleColgroup(ReadableSegment* input, DbContext* ctx);
@@ -230,14 +520,73 @@ public:
 
 	ReadableIndexPtr purgeIndex(size_t indexId, ColgroupSegment* input, DbContext* ctx);
 	ReadableStorePtr purgeColgroup(size_t colgroupId, ColgroupSegment* input, DbContext* ctx, PathRef tmpSegDir);
+	ReadableStore*   remapColgroup(size_t colgroupId, const ColgroupSegment* input) const;
 	ReadableStorePtr purgeColgroup_s(size_t colgroupId,
 			const febitvec& newIsDel, size_t newDelcnt,
 			ColgroupSegment* input, DbContext* ctx, PathRef tmpSegDir);
 
 	void loadRecordStore(PathRef segDir) override;
+	void saveRecordStore(PathRef segDir) const override;
+	/// Colgroups.json, non-index colgroups stored in segDir and their columns
+	void saveColgroupLayout(PathRef segDir) const;
+	/// colgroup is a LayoutProjectStore, it has no files in segment dir
+	bool isProjectedColgroup(size_t colgroupId) const;
 
 	void removePurgeBitsForCompactIdspace(PathRef segDir);
 	void savePurgeBits(PathRef segDir) const;
+
+	size_t filterSearchExactResult(llong* recIds, size_t beg, size_t end,
+								   size_t newsize, DbContext*) const;
+
+	// parallel with m_indices, NULL if filter is disabled for the index
+	valvec<IndexBloomFilterPtr> m_bloomFilters;
+
+	// NULL if there is no zone column or zone map is disabled
+	SegmentZoneMapPtr m_zoneMap;
+
+	// NULL if index stats is disabled or the segment is older than it
+	SegmentIndexStatsPtr m_indexStats;
+
+	// the colgroup whose value is the whole row and whose store hasValueRef,
+	// size_t(-1) if there is no such colgroup
+	size_t m_valueRefColgroup;
+
+	// colgroups of the layout of segment dir which are not in m_schema,
+	// projected colgroups are read from them, empty if the segment has
+	// the layout of m_schema
+	valvec<SchemaPtr>        m_layoutSchemas;
+	valvec<ReadableStorePtr> m_layoutColgroups; // parallel with m_layoutSchemas
+
+	// the table of a background build, builders call checkBuildCancelled
+	// between steps, NULL if the build can not be cancelled
+	const class DbTable* m_buildTab;
+	bool m_buildCancelOnSuspend; // false for explicit compact
+	void checkBuildCancelled() const; // throws TaskCancelledException
+
+	///@{ access stats for ColdSegmentMaxReadsPerSec, point reads are
+	/// sampled, each sample counts ReadSampleRate reads
+	enum { ReadSampleRate = 64 };
+	enum { ReadHeatWindowSeconds = 3600 }; // heat is trusted after it
+	void countReads(size_t num) const;
+	mutable std::atomic<ullong> m_readCnt;
+	time_t m_loadTime; // time(NULL) of load
+	///@}
+
+	///@{ read heat map, m_readCnt is reads of the segment by all read paths,
+	/// m_colgroupReadCnt are sampled reads of a colgroup alone by
+	/// selectColgroups, selectOneColgroupRef and index probes(the colgroup
+	/// of the index). They are saved to ReadHeat.json with m_loadTime as the
+	/// start, and restored by load, so prewarm order, value cache admission
+	/// and ColdSegment placement do not start cold after restart
+	void   countColgroupReads(size_t colgroupId, size_t num) const;
+	ullong colgroupReads(size_t colgroupId) const; // including row reads
+	double readsPerSec(time_t now) const;
+	void loadReadHeat(PathRef segDir);
+	void saveReadHeat(PathRef segDir) const;
+	/// inherit heat from an input of convert, purge or merge
+	void addReadHeat(const ReadonlySegment& input);
+	std::unique_ptr<std::atomic<ullong>[]> m_colgroupReadCnt;
+	///@}
 };
 typedef boost::intrusive_ptr<ReadonlySegment> ReadonlySegmentPtr;
 
@@ -337,6 +686,9 @@ public:
 
 	virtual void initEmptySegment() = 0;
 	virtual void markFrozen() = 0;
+	/// segments in a shared memory budget return true to be frozen before
+	/// reaching m_maxWritingSegmentSize, default returns false
+	virtual bool needFreezeByMemBudget() const;
 
 	void indexSearchExactAppend(size_t mySegIdx, size_t indexId,
 								fstring key, valvec<llong>* recIdvec,
@@ -413,10 +765,16 @@ protected:
 	void markFrozen() override;
 
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	void getValuesAppendBatch(const llong* ids, size_t num,
+							  valvec<byte>* vals, DbContext*) const override;
 
 	void indexSearchExactAppend(size_t mySegIdx, size_t indexId,
 								fstring key, valvec<llong>* recIdvec,
 								DbContext* ctx) const override;
+	void indexSearchExactAppendBatch(size_t mySegIdx, size_t indexId,
+								const fstring* keys, size_t num,
+								valvec<llong>* recIdvec, size_t* offsets,
+								DbContext*) const override;
 
 	void loadRecordStore(PathRef segDir) override;
 	void saveRecordStore(PathRef segDir) const override;
@@ -431,6 +789,9 @@ protected:
 
 	void selectColgroups(llong id, const size_t* cgIdvec, size_t cgIdvecSize,
 						 valvec<byte>* cgDataVec, DbContext*) const override;
+
+	size_t filterSearchExactResult(llong* recIds, size_t beg, size_t end,
+								   size_t newsize, DbContext*) const;
 };
 typedef boost::intrusive_ptr<ColgroupWritableSegment> SmartWritableSegmentPtr;
 
@@ -17,6 +17,19 @@ void Permanentable::load(PathRef) {
 StoreIterator::~StoreIterator() {
 }
 
+size_t StoreIterator::incrementBatch(StoreBatch* batch, size_t maxRows,
+									 size_t maxBytes) {
+	batch->erase_all();
+	llong id = -1;
+	valvec<byte> val;
+	while (batch->size() < maxRows && batch->vals.size() < maxBytes) {
+		if (!increment(&id, &val))
+			break;
+		batch->push_back(id, val);
+	}
+	return batch->size();
+}
+
 llong StoreIterator::seekLowerBound(llong id, valvec<byte>* val) {
 	if (seekExact(id, val)) {
 		return id;
@@ -57,6 +70,37 @@ ReadableStore::ReadableStore()
 ReadableStore::~ReadableStore() {
 }
 
+void
+ReadableStore::getValuesAppendBatch(const llong* ids, size_t num,
+									valvec<byte>* vals, DbContext* ctx)
+const {
+	for (size_t i = 0; i < num; ++i) {
+		getValueAppend(ids[i], &vals[i], ctx);
+	}
+}
+
+bool
+ReadableStore::getValueSliceAppend(llong, size_t, size_t, valvec<byte>*,
+								   DbContext*)
+const {
+	return false;
+}
+
+size_t
+ReadableStore::getFieldArray(llong, size_t, size_t, size_t, valvec<byte>*,
+							 const byte**)
+const {
+	return 0;
+}
+
+bool ReadableStore::hasValueRef() const {
+	return false;
+}
+
+fstring ReadableStore::getValueRef(llong, DbContext*) const {
+	THROW_STD(invalid_argument, "Unsupported method, check hasValueRef() first");
+}
+
 ReadableStore* ReadableStore::openStore(const Schema& schema, PathRef segDir, fstring fname) {
 	size_t sufpos = fname.size();
 	while (sufpos > 0 && fname[sufpos-1] != '.') --sufpos;
@@ -263,6 +307,68 @@ const {
 	m_parts[upp-1]->getValueAppend(id - baseId, val, ctx);
 }
 
+size_t
+MultiPartStore::getFieldArray(llong beg, size_t num, size_t offset, size_t len,
+							  valvec<byte>* buf, const byte** data)
+const {
+	assert(m_parts.size() + 1 == m_rowNumVec.size());
+	assert(beg + llong(num) <= llong(m_rowNumVec.back()));
+	size_t upp = upper_bound_a(m_rowNumVec, uint32_t(beg));
+	assert(upp < m_rowNumVec.size());
+	size_t part = upp - 1;
+	llong baseId = m_rowNumVec[part];
+	if (beg + llong(num) <= llong(m_rowNumVec[upp])) {
+		return m_parts[part]->getFieldArray(beg - baseId, num, offset, len,
+											buf, data);
+	}
+	// the range spans multiple parts, copy them into buf densely
+	buf->resize_no_init(len * num);
+	valvec<byte> partBuf;
+	size_t k = 0;
+	while (k < num) {
+		llong  id = beg + k;
+		size_t cnt = std::min<size_t>(num - k, m_rowNumVec[part+1] - id);
+		const byte* partData = NULL;
+		size_t stride = m_parts[part]->getFieldArray(id - m_rowNumVec[part],
+									cnt, offset, len, &partBuf, &partData);
+		if (0 == stride)
+			return 0;
+		byte* dst = buf->data() + len * k;
+		if (stride == len) {
+			memcpy(dst, partData, len * cnt);
+		}
+		else {
+			for (size_t i = 0; i < cnt; ++i)
+				memcpy(dst + len * i, partData + stride * i, len);
+		}
+		k += cnt;
+		part++;
+	}
+	*data = buf->data();
+	return len;
+}
+
+bool MultiPartStore::hasValueRef() const {
+	for (auto& part : m_parts) {
+		if (!part->hasValueRef())
+			return false;
+	}
+	return true;
+}
+
+fstring MultiPartStore::getValueRef(llong id, DbContext* ctx) const {
+	assert(m_parts.size() + 1 == m_rowNumVec.size());
+	llong maxId = m_rowNumVec.back();
+	assert(id < maxId);
+	if (id >= maxId) {
+		THROW_STD(out_of_range, "id %lld, maxId = %lld", id, maxId);
+	}
+	size_t upp = upper_bound_a(m_rowNumVec, uint32_t(id));
+	assert(upp < m_rowNumVec.size());
+	llong baseId = m_rowNumVec[upp-1];
+	return m_parts[upp-1]->getValueRef(id - baseId, ctx);
+}
+
 class MultiPartStore::MyStoreIterForward : public StoreIterator {
 	size_t m_partIdx = 0;
 	llong  m_id = 0;
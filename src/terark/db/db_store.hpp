@@ -36,6 +36,29 @@ public:
 typedef boost::intrusive_ptr<class Permanentable> PermanentablePtr;
 typedef boost::intrusive_ptr<class ReadableStore> ReadableStorePtr;
 
+// rows of StoreIterator::incrementBatch, row(i) is id[i]'s value
+struct StoreBatch {
+	valvec<llong>  ids;
+	valvec<byte>   vals;
+	valvec<size_t> offsets; // offsets.size() == ids.size() + 1
+	StoreBatch() { offsets.push_back(0); }
+	size_t size() const { return ids.size(); }
+	fstring row(size_t i) const {
+		assert(i < ids.size());
+		return fstring(vals.data() + offsets[i], offsets[i+1] - offsets[i]);
+	}
+	void erase_all() {
+		ids.erase_all();
+		vals.erase_all();
+		offsets.resize_no_init(1);
+	}
+	void push_back(llong id, fstring val) {
+		ids.push_back(id);
+		vals.append(val.udata(), val.size());
+		offsets.push_back(vals.size());
+	}
+};
+
 class TERARK_DB_DLL StoreIterator : public RefCounter {
 protected:
 	ReadableStorePtr m_store;
@@ -43,6 +66,11 @@ public:
 	ReadableStore* getStore() const { return m_store.get(); }
 	virtual ~StoreIterator();
 	virtual bool increment(llong* id, valvec<byte>* val) = 0;
+	/// clear batch and fetch at most maxRows rows, stop after maxBytes,
+	/// returns batch->size(), 0 means end, it is an increment loop by
+	/// default, stores with per record overhead should override it
+	virtual size_t incrementBatch(StoreBatch* batch, size_t maxRows,
+								  size_t maxBytes);
 	virtual bool seekExact(llong  id, valvec<byte>* val) = 0;
 	virtual llong seekLowerBound(llong  id, valvec<byte>* val);
 	virtual void reset() = 0;
@@ -78,6 +106,33 @@ public:
 	virtual llong dataInflateSize() const = 0;
 	virtual llong numDataRows() const = 0;
 	virtual void getValueAppend(llong id, valvec<byte>* val, DbContext*) const = 0;
+
+	///@param vals vals[i] is appended with the value of ids[i]
+	/// default is calling getValueAppend for each id, stores can override
+	/// it to save per-row virtual calls and prefetch records
+	virtual void getValuesAppendBatch(const llong* ids, size_t num,
+									  valvec<byte>* vals, DbContext*) const;
+
+	/// append bytes [offset, offset+len) of the value to val, for stores
+	/// which can read a field without decoding the whole value
+	///@returns false if not supported, then val is not changed
+	virtual bool getValueSliceAppend(llong id, size_t offset, size_t len,
+									 valvec<byte>* val, DbContext*) const;
+
+	/// get field [offset, offset+len) of rows [beg, beg+num) as an array,
+	/// field of row beg+k is at (*data + stride * k), *data may point to
+	/// store memory(zero-copy) or to buf, it is valid until store changed
+	///@returns stride, or 0 if not supported
+	virtual size_t getFieldArray(llong beg, size_t num,
+								 size_t offset, size_t len,
+								 valvec<byte>* buf, const byte** data) const;
+
+	///@{ zero-copy read, if hasValueRef(), getValueRef returns the value in
+	/// store memory, it is valid while the store is alive(a DbContext keeps
+	/// its segments alive until it is synced to a new segment array)
+	virtual bool hasValueRef() const; // default false
+	virtual fstring getValueRef(llong id, DbContext*) const; // default throw
+	///@}
 	virtual void deleteFiles();
 	virtual StoreIterator* createStoreIterForward(DbContext*) const = 0;
 	virtual StoreIterator* createStoreIterBackward(DbContext*) const = 0;
@@ -132,6 +187,10 @@ public:
 	llong dataStorageSize() const override;
 	llong numDataRows() const override;
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	size_t getFieldArray(llong beg, size_t num, size_t offset, size_t len,
+						 valvec<byte>* buf, const byte** data) const override;
+	bool hasValueRef() const override;
+	fstring getValueRef(llong id, DbContext*) const override;
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
 
@@ -211,6 +270,13 @@ public:
 //	using DbException::DbException;
 };
 
+// thrown at checkpoints of a background build which is cancelled
+class TERARK_DB_DLL TaskCancelledException : public DbException {
+public:
+	template<class String>
+	TaskCancelledException(const String& msg) : DbException(msg) {}
+};
+
 } } // namespace terark::db
 
 #endif // __terark_db_db_store_hpp__
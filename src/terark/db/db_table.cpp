@@ -1,6 +1,9 @@
 #include "db_table.hpp"
 #include "db_segment.hpp"
 #include "appendonly.hpp"
+#include "segment_events.hpp"
+#include "mem_budget.hpp"
+#include "db_probes.hpp"
 #include <terark/db/fixed_len_store.hpp>
 #include <terark/util/autoclose.hpp>
 #include <terark/util/linebuf.hpp>
@@ -11,17 +14,35 @@
 #include <terark/lcast.hpp>
 #include <terark/num_to_str.hpp>
 #include <terark/util/fstrvec.hpp>
+#include <terark/bitmanip.hpp>
 #include <terark/util/sortable_strvec.hpp>
 #include <boost/scope_exit.hpp>
 #include <thread> // for std::this_thread::sleep_for
+#include <condition_variable>
+#include <map>
+#include <set>
+#include <typeinfo>
+#if defined(__linux__)
+	#include <pthread.h>
+	#include <sched.h>
+#endif
 #include <tbb/tbb_thread.h>
+#include <tbb/task_arena.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 #include <terark/util/concurrent_queue.hpp>
 #include <float.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <terark/util/profiling.hpp>
+#include <terark/util/mmap.hpp>
+#include "json.hpp"
 
 #undef min
 #undef max
 
+TERARK_DB_DEFINE_PROBE_SEMAPHORES()
+
 using std::min;
 using std::max;
 
@@ -35,6 +56,129 @@ namespace fs = boost::filesystem;
 
 const size_t DEFAULT_maxSegNum = 4095;
 
+// dirs of dropped tables and truncated segments are renamed into a trash
+// dir and removed by this thread, so a drop is O(1) in the caller, files
+// are truncated step by step at TerarkDB_TrashDeleteBytesPerSec(0 is not
+// throttled) to avoid an unlink I/O storm, a file which has other hard
+// links is just unlinked
+class TrashDeleter {
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<fs::path> m_queue;
+	tbb::tbb_thread* m_thread;
+	llong m_bytesPerSec;
+	std::atomic<bool> m_stop; // also read by removeDir without m_mutex
+
+	void throttle(llong bytes) {
+		if (m_bytesPerSec > 0 && bytes > 0) {
+			auto us = bytes * 1000000 / m_bytesPerSec;
+			std::this_thread::sleep_for(std::chrono::microseconds(us));
+		}
+	}
+	void removeFile(PathRef file) {
+		const llong step = std::max<llong>(m_bytesPerSec / 4, 1<<20);
+		boost::system::error_code ec;
+		llong size = fs::file_size(file, ec);
+		if (ec) size = 0;
+		if (m_bytesPerSec > 0 && size > step && fs::hard_link_count(file, ec) == 1) {
+			while (size > step && !m_stop) {
+				size -= step;
+				fs::resize_file(file, size, ec);
+				if (ec) break;
+				throttle(step);
+			}
+		}
+		fs::remove(file, ec);
+		throttle(size);
+	}
+	void removeDir(PathRef dir) {
+		boost::system::error_code ec;
+		std::vector<fs::path> files;
+		for (fs::recursive_directory_iterator iter(dir, ec), end;
+			 !ec && iter != end; iter.increment(ec)) {
+			if (fs::is_regular_file(iter->symlink_status()))
+				files.push_back(iter->path());
+		}
+		for (size_t i = 0; i < files.size() && !m_stop; ++i) {
+			removeFile(files[i]);
+		}
+		if (m_stop) {
+			return; // the rest is removed by the next process
+		}
+		fs::remove_all(dir, ec);
+		if (ec) {
+			fprintf(stderr, "ERROR: TrashDeleter: remove_all(%s) = %s\n"
+				, dir.string().c_str(), ec.message().c_str());
+		}
+	}
+	void threadProc() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_stop) {
+			if (m_queue.empty()) {
+				m_cond.wait(lock);
+				continue;
+			}
+			fs::path dir = std::move(m_queue.front());
+			m_queue.pop_front();
+			lock.unlock();
+			fprintf(stderr, "INFO: TrashDeleter: remove %s\n", dir.string().c_str());
+			removeDir(dir);
+			lock.lock();
+		}
+	}
+
+public:
+	TrashDeleter() {
+		m_thread = NULL;
+		m_bytesPerSec = getEnvLong("TerarkDB_TrashDeleteBytesPerSec", 256L << 20);
+		m_stop = false;
+	}
+	~TrashDeleter() {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stop = true;
+			m_cond.notify_all();
+		}
+		if (m_thread) {
+			m_thread->join();
+			delete m_thread;
+		}
+	}
+	void push(PathRef dir) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_stop) {
+			return;
+		}
+		if (NULL == m_thread) {
+			m_thread = new tbb::tbb_thread(&TrashDeleter::threadProc, this);
+		}
+		m_queue.push_back(dir);
+		m_cond.notify_one();
+	}
+	static fs::path trashName(PathRef dir, PathRef trashDir) {
+		static std::atomic<ullong> seq(0);
+		char szBuf[64];
+		snprintf(szBuf, sizeof(szBuf), ".%llx-%llu"
+			, (ullong)time(NULL), (ullong)seq.fetch_add(1));
+		return trashDir / (dir.filename().string() + szBuf);
+	}
+};
+TrashDeleter g_trashDeleter;
+
+static bool renameToTrash(PathRef dir, PathRef trash) {
+	boost::system::error_code ec;
+	fs::create_directories(trash.parent_path(), ec);
+	if (!ec) {
+		fs::rename(dir, trash, ec);
+	}
+	if (ec) {
+		fprintf(stderr, "WARN: rename(%s, %s) = %s\n", dir.string().c_str()
+			, trash.string().c_str(), ec.message().c_str());
+		return false;
+	}
+	return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #if 1 || defined(NDEBUG)
@@ -55,12 +199,135 @@ const size_t DEFAULT_maxSegNum = 4095;
     TERARK_IF_DEBUG((ctx)->debugCheckUnique((row), (uniqueIndexId)),;);
 #endif
 
-DbTable* DbTable::open(PathRef dbPath) {
-	fs::path jsonFile = dbPath / "dbmeta.json";
+// hot columns are not promotable if they have indices, if they are already
+// alone in a colgroup, or if their colgroup is fixed length, because the
+// colgroup would change its columns with the same name, see
+// ReadonlySegment::loadRecordStore
+static bool isPromotableColumn(const SchemaConfig& sconf, size_t columnId) {
+	if (sconf.getRowSchema().getColumnMeta(columnId).fixedLen == 0 ||
+			sconf.m_ttlColumnId == columnId ||
+			sconf.m_timePartitionColumnId == columnId) {
+		return false;
+	}
+	size_t cgId = sconf.m_colproject[columnId].colgroupId;
+	if (cgId < sconf.getIndexNum()) {
+		return false;
+	}
+	const Schema& schema = sconf.getColgroupSchema(cgId);
+	return !schema.m_isInplaceUpdatable && schema.columnNum() > 1 &&
+		   !schema.should_use_FixedLenStore();
+}
+
+// writable segments which have rows are saved with IsDel
+static bool hasWritableSegmentRows(PathRef dir) {
+	for (auto& mergeDir : fs::directory_iterator(dir)) {
+		long mergeSeq = -1;
+		std::string name = mergeDir.path().filename().string();
+		if (sscanf(name.c_str(), "g-%04ld", &mergeSeq) != 1 ||
+				!fs::is_directory(mergeDir.path()))
+			continue;
+		for (auto& segDir : fs::directory_iterator(mergeDir.path())) {
+			if (fstring(segDir.path().filename().string()).startsWith("wr-") &&
+					fs::exists(segDir.path() / "IsDel"))
+				return true;
+		}
+	}
+	return false;
+}
+
+// dbmeta.json, and hot columns in HotColumns.json are moved from their
+// colgroups to new inplace updatable colgroups "hot-<column>" by editing
+// the json, so readonly segments are read by their old layouts
+static SchemaConfigPtr loadTableSchema(PathRef dir) {
+	using terark::json;
+	fs::path jsonFile = dir / "dbmeta.json";
 	SchemaConfigPtr sconf = new SchemaConfig();
 	sconf->loadJsonFile(jsonFile.string());
+	fs::path hotFile = dir / "HotColumns.json";
+	if (sconf->m_hotColumnUpdateRatio <= 0 || !fs::exists(hotFile)) {
+		return sconf;
+	}
+	LineBuf hotText;
+	hotText.read_all(hotFile.string());
+	json hot = json::parse(std::string(hotText.p, hotText.n));
+	valvec<size_t> columnIds;
+	for (const auto& col : hot["columns"]) {
+		size_t columnId = sconf->getRowSchema().getColumnId(col.get<std::string>());
+		if (columnId < sconf->columnNum() && isPromotableColumn(*sconf, columnId))
+			columnIds.push_back(columnId);
+	}
+	if (columnIds.empty()) {
+		return sconf;
+	}
+	if (hasWritableSegmentRows(dir)) {
+		fprintf(stderr, "INFO: %s: %zd hot columns are not promoted, writable segments have rows\n"
+			, dir.string().c_str(), columnIds.size());
+		return sconf;
+	}
+	LineBuf metaText;
+	metaText.read_all(jsonFile.string());
+	json meta = json::parse(std::string(metaText.p, metaText.n));
+	std::string cgKey = "ColumnGroups";
+	for (const char* key : {"ColumnGroups", "ColumnGroup", "colgroup"}) {
+		if (meta.find(key) != meta.end()) {
+			cgKey = key;
+			break;
+		}
+	}
+	json& colgroups = meta[cgKey];
+	std::string names;
+	for (size_t columnId : columnIds) {
+		std::string colname = sconf->getRowSchema().getColumnName(columnId).str();
+		for (auto iter = colgroups.begin(); iter != colgroups.end(); ++iter) {
+			json& cg = iter.value();
+			const char* fieldsKey = cg.find("fields") != cg.end() ? "fields" : "columns";
+			if (cg.find(fieldsKey) == cg.end())
+				continue;
+			std::vector<std::string> fields;
+			if (cg[fieldsKey].is_string())
+				fstring(cg[fieldsKey].get<std::string>()).split(',', &fields);
+			else
+				for (const auto& f : cg[fieldsKey])
+					fields.push_back(f.get<std::string>());
+			json kept = json::array();
+			for (const std::string& f : fields) {
+				if (f != colname)
+					kept.push_back(f);
+			}
+			cg[fieldsKey] = kept;
+		}
+		json cg;
+		cg["fields"] = json::array({colname});
+		cg["inplaceUpdatable"] = true;
+		colgroups["hot-" + colname] = cg;
+		names += " " + colname;
+	}
+	SchemaConfigPtr promoted = new SchemaConfig();
+	promoted->loadJsonString(meta.dump());
+	fprintf(stderr, "INFO: %s: promoted hot columns to inplace updatable colgroups:%s\n"
+		, dir.string().c_str(), names.c_str());
+	return promoted;
+}
+
+DbTable* DbTable::open(PathRef dbPath, DbEnv* env) {
+	SchemaConfigPtr sconf = loadTableSchema(dbPath);
+	std::unique_ptr<DbTable> tab(new DbTable());
+	if (env) {
+		tab->m_env = new IoStatsEnv(env);
+	}
+	tab->m_schema = sconf;
+	tab->doLoad(dbPath);
+	return tab.release();
+}
+
+DbTable* DbTable::openReplica(PathRef dbPath, DbEnv* env) {
+	SchemaConfigPtr sconf = loadTableSchema(dbPath);
 	std::unique_ptr<DbTable> tab(new DbTable());
+	if (env) {
+		tab->m_env = new IoStatsEnv(env);
+	}
 	tab->m_schema = sconf;
+	tab->m_isReplica = true;
 	tab->doLoad(dbPath);
 	return tab.release();
 }
@@ -69,33 +336,100 @@ DbTable::DbTable()
     : m_inprogressWritingCount{0}
 {
 	m_tableScanningRefCount = 0;
+	m_asyncIndexPosted = 0;
+	m_asyncIndexDone = 0;
+	m_asyncIndexRunning = false;
+	m_asyncIndexMarks = 0;
 	m_tobeDrop = false;
 	m_isMerging = false;
     m_isPurging = false;
     m_autoTask = true;
+	m_hasDeferredAutoTask = false;
+	m_purgeCheckPending = false;
+	m_movingColdSegments = false;
+	m_isReplica = false;
+	m_readHeatSaveTime = ::time(NULL);
+	m_coldGcSegArrayUpdateSeq = size_t(-1);
+	m_corruptSegNum = 0;
+	m_lastExpireTime = 0;
+	m_updateRowCnt = 0;
+	m_env = new IoStatsEnv(DbEnv::getDefault());
+	m_numaNode = -1;
+	m_readLatencyLimiter = NULL;
 	m_segments.reserve(DEFAULT_maxSegNum);
 	m_rowNumVec.reserve(DEFAULT_maxSegNum+1);
 	m_mergeSeqNum = 0;
 	m_newWrSegNum = 0;
 	m_bgTaskNum = 0;
+	m_compactSuspendCnt = 0;
+	m_runningAutoTaskNum = 0;
 	m_rowNum = 0;
-	m_oldestSnapshotVersion = 0;
+	m_oldestSnapshotVersion = LLONG_MAX;
+	m_snapshotSeq = 0;
 	m_segArrayUpdateSeq = 1;
+	m_uniqKeyFilterGenSeq = 0;
+	m_wrSubIdReserveGen = 1;
+	m_bulkSegSeqNum = 0;
+	m_lastThrottledTime = 0;
+	m_quotaWriteBytesPerSec = 0;
+	m_quotaWritableBytes = 0;
+	m_compressWeight = 1.0;
+	m_compressNanos = 0;
+	m_sharedLimiterBytes = 0;
+	m_accumulateWrittenBytes = 0;
+	m_compactWrittenBytes = 0;
+	m_frozenWrSegNum = 0;
+	m_writableSegBytes = 0;
+	m_wrSegFreezeSize = 0;
+	m_ctxNum = 0;
+	m_ctxMemBytes = 0;
+	m_ctxIterNum = 0;
+	m_wrSegStartTime = 0;
+	m_wrSegInsertRate = 0;
+	m_wrSegConvRate = 0;
+	m_writtenBytesAtPublish = 0;
+	m_writeStallSeq = 0;
+	m_segArrayEpoch = 0;
+	m_segArrayReaders[0] = 0;
+	m_segArrayReaders[1] = 0;
+	m_segArrayVersion = NULL;
 	m_throwOnThrottle = false; // if true, auto delay/sleep on throttle
 //	m_ctxListHead = new DbContextLink();
 }
 
 DbTable::~DbTable() {
+	m_async.reset(); // drainers hold the table, they are all ended
+	if (m_scrubber) {
+		m_scrubber->stop();
+		m_scrubber = nullptr;
+	}
+	if (m_segWarmer) {
+		m_segWarmer->stop();
+		m_segWarmer = nullptr;
+	}
 	m_wrSeg = nullptr;
+	if (SegArrayVersion* version = m_segArrayVersion.exchange(NULL)) {
+		version->release();
+	}
 //	fprintf(stderr, "INFO: DbTable::~DbTable(): m_dir = %s\n", m_dir.string().c_str());
 //	fprintf(stderr, "INFO: DbTable::~DbTable(): m_segments.size = %zd\n", m_segments.size());
 	if (m_dir.empty()) {
 		return;
 	}
+	if (m_isReplica) {
+		m_segments.clear(); // nothing to flush, run.lock is of the writer
+		return;
+	}
 	fprintf(stderr, "INFO: DbTable::~DbTable(): m_tobeDrop = %d\n", m_tobeDrop);
 	if (m_tobeDrop) {
-		// should delete m_dir?
 		m_segments.clear();
+		if (!m_trashDir.empty()) {
+			g_trashDeleter.push(m_trashDir);
+			return;
+		}
+		if (removeDirInBackground(m_dir, m_dir.parent_path() / ".trash")) {
+			return;
+		}
 		fprintf(stderr, "INFO: DbTable::~DbTable(): remove(%s)\n", m_dir.string().c_str());
 		try {
 			fs::remove_all(m_dir);
@@ -107,6 +441,13 @@ DbTable::~DbTable() {
 		return;
 	}
 	flush();
+	try {
+		saveReadHeat();
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: DbTable::~DbTable(): saveReadHeat(%s) failed: %s\n"
+			, m_dir.string().c_str(), ex.what());
+	}
 	m_segments.clear();
 	try {
 		fs::remove(m_dir / "run.lock");
@@ -185,6 +526,8 @@ void DbTable::removeStaleDir(PathRef root, size_t inUseMergeSeq) const {
 			if (mergeSeq != inUseMergeSeq) {
 				fprintf(stderr, "INFO: Remove stale dir: %s\n"
 					, x.path().string().c_str());
+				if (removeDirInBackground(x.path(), root / ".trash"))
+					continue;
 				try { fs::remove_all(x.path()); }
 				catch (const std::exception& ex) {
 					fprintf(stderr, "ERROR: ex.what = %s\n", ex.what());
@@ -234,6 +577,114 @@ void DbTable::discoverMergeDir(PathRef dir) {
 		removeStaleDir(dir, mergeSeq);
 		m_mergeSeqNum = mergeSeq;
 	}
+	if (fs::exists(dir / ".trash")) {
+		removeTrashInBackground(dir / ".trash");
+	}
+}
+
+// open by the manifest without listing dirs, @returns false if there is no
+// manifest or it does not match the dirs, then the dirs are scanned
+bool DbTable::recoverByManifest(std::vector<std::string>* segDirNames) {
+	if (!m_manifest.load(m_dir.string())) {
+		return false;
+	}
+	SegmentManifest::State st = m_manifest.state();
+	fs::path mergeDir = getMergePath(m_dir, st.mergeSeq);
+	if (!fs::exists(mergeDir)) {
+		disableManifest(("missing " + mergeDir.string()).c_str());
+		return false;
+	}
+	fs::remove(mergeDir / "merging.lock"); // crashed after the commit
+	for (const std::string& name : st.segments) {
+		fs::path segDir = mergeDir / name;
+		tryReduceSymlink(segDir, mergeDir);
+		long segIdx = -1;
+		if (sscanf(name.c_str(), "wr-%ld", &segIdx) == 1 && segIdx >= 0) {
+			std::string rdName = getSegPath2(m_dir, st.mergeSeq, "rd", segIdx)
+								 .filename().string();
+			if (fs::exists(mergeDir / rdName)) {
+				// converted, crashed before the edit, wr dir is removed by load
+				if (!st.segments.count(rdName))
+					segDirNames->push_back(rdName);
+				if (fs::exists(segDir))
+					segDirNames->push_back(name);
+				continue;
+			}
+		}
+		if (!fs::exists(segDir)) { // such as a crash in purge of the segment
+			disableManifest(("missing " + segDir.string()).c_str());
+			segDirNames->clear();
+			return false;
+		}
+		segDirNames->push_back(name);
+	}
+	// symlinks to old merge dirs were reduced, a crashed merge is also stale
+	if (size_t(-1) != st.pendingMergeSeq) {
+		st.oldMergeSeqs.insert(st.pendingMergeSeq);
+	}
+	for (size_t seq : st.oldMergeSeqs) {
+		fs::path staleDir = getMergePath(m_dir, seq);
+		if (seq == st.mergeSeq || !fs::exists(staleDir)) {
+			continue;
+		}
+		fprintf(stderr, "INFO: Remove stale dir: %s\n", staleDir.string().c_str());
+		if (removeDirInBackground(staleDir, m_dir / ".trash"))
+			continue;
+		try { fs::remove_all(staleDir); }
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: ex.what = %s\n", ex.what());
+		}
+	}
+	m_mergeSeqNum = st.mergeSeq;
+	if (fs::exists(m_dir / ".trash")) {
+		removeTrashInBackground(m_dir / ".trash");
+	}
+	fprintf(stderr, "INFO: DbTable::load(%s): %zd segs by %s\n"
+		, m_dir.string().c_str(), segDirNames->size(), SegmentManifest::FileName);
+	return true;
+}
+
+// snapshot of m_segments in m_mergeSeqNum, in write lock or in load
+void DbTable::resetManifestInLock(const std::set<size_t>& oldMergeSeqs) {
+	SegmentManifest::State st;
+	st.mergeSeq = m_mergeSeqNum;
+	st.oldMergeSeqs = oldMergeSeqs;
+	for (size_t i = 0; i < m_segments.size(); ++i) {
+		const char* type = m_segments[i]->getWritableStore() ? "wr" : "rd";
+		st.segments.insert(getSegPath(type, i).filename().string());
+	}
+	try {
+		m_manifest.reset(m_dir.string(), st);
+	}
+	catch (const std::exception& ex) {
+		disableManifest(ex.what());
+	}
+}
+
+// an edit which is not logged must not be lost silently, so the manifest
+// is removed and the next open scans the dirs
+void DbTable::logManifestEdit(const std::string& edit) {
+	if (!m_manifest.isOpen()) {
+		return;
+	}
+	try {
+		m_manifest.logEdit(edit);
+	}
+	catch (const std::exception& ex) {
+		disableManifest(ex.what());
+	}
+}
+
+void DbTable::disableManifest(const char* reason) {
+	fprintf(stderr, "WARN: DbTable: disable %s of %s: %s\n"
+		, SegmentManifest::FileName, m_dir.string().c_str(), reason);
+	m_manifest.close();
+	boost::system::error_code ec;
+	fs::remove(m_dir / SegmentManifest::FileName, ec);
+	if (ec) {
+		fprintf(stderr, "ERROR: remove(%s/%s) = %s\n", m_dir.string().c_str()
+			, SegmentManifest::FileName, ec.message().c_str());
+	}
 }
 
 static bool isBackupSegDir(fstring segDirName) {
@@ -296,16 +747,59 @@ void DbTable::load(PathRef dir) {
 		THROW_STD(invalid_argument, "Invalid: schema.columnNum=%ld is not empty",
 			long(m_schema->columnNum()));
 	}
-	{
-		fs::path jsonFile = fs::path(dir) / "dbmeta.json";
-		m_schema.reset(new SchemaConfig());
-		m_schema->loadJsonFile(jsonFile.string());
-	}
+	m_schema = loadTableSchema(dir);
 	doLoad(dir);
 }
 
 void DbTable::doLoad(PathRef dir) {
 	assert(m_schema.get() != nullptr);
+	m_rwMutex.setType(m_schema->m_tableLock); // the table is not used yet
+#if !TERARK_DB_HAS_SPECULATIVE_RW_MUTEX
+	if (TableLockType::speculative == m_schema->m_tableLock) {
+		fprintf(stderr, "WARN: %s: TableLock = speculative is spin, tbb is built without tsx\n"
+			, dir.string().c_str());
+	}
+#endif
+	if (m_schema->m_numaNode >= 0 || m_schema->m_numaInterleaveMmap) {
+		int numaNum = numaNodeNum();
+		if (m_schema->m_numaNode < numaNum) {
+			m_numaNode = m_schema->m_numaNode;
+		} else {
+			fprintf(stderr, "WARN: %s: NumaNode = %d is ignored, numa nodes = %d\n"
+				, dir.string().c_str(), m_schema->m_numaNode, numaNum);
+		}
+		if (numaNum > 1) {
+			m_env = new IoStatsEnv(new NumaEnv(m_env->target(), m_numaNode,
+				m_schema->m_numaInterleaveMmap, m_schema->m_numaMmapMinBytes));
+		}
+	}
+	DbEnvScope envScope(m_env.get());
+	NumaNodeScope numaScope(m_numaNode);
+	if (!m_schema->m_mergePolicy.empty()) {
+		m_mergePolicy = MergePolicy::createMergePolicy(m_schema->m_mergePolicy);
+	}
+	if (m_schema->m_valueCacheSize > 0) {
+		m_valueCache = new ValueCache(size_t(m_schema->m_valueCacheSize));
+	}
+	if (m_schema->m_enablePerfCounters) {
+		m_perf.reset(new DbPerfCounters(this));
+	}
+	if (size_t maxRate = m_schema->m_compactWriteBytesPerSecond) {
+		WriteRateLimiterPtr limiter;
+		if (size_t latencyUs = m_schema->m_compactReadLatencyMicros) {
+			m_readLatencyLimiter = new AdaptiveWriteRateLimiter(
+				m_schema->m_compactWriteMinBytesPerSecond, maxRate,
+				ullong(latencyUs) * 1000);
+			limiter = m_readLatencyLimiter;
+		} else {
+			limiter = new WriteRateLimiter(maxRate);
+		}
+		m_compactEnv = new RateLimitedEnv(m_env.get(), limiter.get());
+	}
+	if (m_isReplica) {
+		doLoadReplica(dir);
+		return;
+	}
 	fs::path runLockFpath = dir / "run.lock";
 	if (fs::exists(runLockFpath)) {
 		THROW_STD(invalid_argument
@@ -320,9 +814,21 @@ void DbTable::doLoad(PathRef dir) {
 		}
 	} BOOST_SCOPE_EXIT_END;
 	m_dir = dir;
-	discoverMergeDir(m_dir);
+	loadHotColumnCounts();
+	SortableStrVec segDirList;
+	std::vector<std::string> manifestSegDirs;
+	if (recoverByManifest(&manifestSegDirs)) {
+		for (const std::string& name : manifestSegDirs)
+			segDirList.push_back(name);
+		segDirList.sort();
+	}
+	else {
+		discoverMergeDir(m_dir);
+		SortableStrVec scanned = getWorkingSegDirList(getMergePath(m_dir, m_mergeSeqNum));
+		segDirList.swap(scanned);
+	}
 	fs::path mergeDir = getMergePath(m_dir, m_mergeSeqNum);
-	SortableStrVec segDirList = getWorkingSegDirList(mergeDir);
+	valvec<size_t> rdSegIdxVec; // loaded in parallel
 	for (size_t i = 0; i < segDirList.size(); ++i) {
 		std::string fname = segDirList[i].str();
 		fs::path    segDir = mergeDir / fname;
@@ -347,6 +853,8 @@ void DbTable::doLoad(PathRef dir) {
 			auto wseg = openWritableSegment(segDir);
 			wseg->m_segDir = segDir;
 			seg = wseg;
+			fprintf(stdout, "done, records: total = %zd, deleted = %zd, purged = %zd\n"
+				, seg->m_isDel.size(), seg->m_delcnt.load(), seg->m_isPurged.max_rank1());
 		}
 		else if (sscanf(fname.c_str(), "rd-%ld", &segIdx) > 0) {
 			if (segIdx < 0) {
@@ -354,24 +862,24 @@ void DbTable::doLoad(PathRef dir) {
 			}
 			seg = myCreateReadonlySegment(segDir);
 			assert(seg);
-			fprintf(stdout, "INFO: loading segment: %s ... ", strDir.c_str());
-			fflush(stdout);
 			// If m_withPurgeBits is false, ReadonlySegment::load will
 			// delete purge bits and squeeze record id space tighter,
 			// so record id will be changed in this case
 			seg->m_withPurgeBits = m_schema->m_usePermanentRecordId;
-			seg->load(seg->m_segDir);
+			rdSegIdxVec.push_back(segIdx);
 		}
 		assert(seg);
-		fprintf(stdout, "done, records: total = %zd, deleted = %zd, purged = %zd\n"
-			, seg->m_isDel.size(), seg->m_delcnt, seg->m_isPurged.max_rank1());
 		m_segments.ensure_set(segIdx, seg);
 	}
+	loadReadonlySegments(rdSegIdxVec);
 	for (size_t i = 0; i < m_segments.size(); ++i) {
 		if (m_segments[i] == nullptr) {
 			THROW_STD(invalid_argument, "ERROR: missing segment: %s\n",
 				getSegPath("xx", i).string().c_str());
 		}
+		if (size_t(-1) != m_schema->m_timePartitionColumnId) {
+			loadTimePartition(m_segments[i].get());
+		}
 		if (i < m_segments.size()-1 && m_segments[i]->getWritableSegment()) {
 			m_segments[i]->getWritableSegment()->markFrozen();
 			this->putToCompressionQueue(i);
@@ -379,6 +887,15 @@ void DbTable::doLoad(PathRef dir) {
 	}
 	fprintf(stderr, "INFO: DbTable::load(%s): loaded %zd segs\n",
 		dir.string().c_str(), m_segments.size());
+	if (SegmentLoadPolicy::background == m_schema->m_segmentLoadPolicy) {
+		m_segWarmer = new SegmentWarmer();
+		time_t now = ::time(NULL);
+		for (auto& seg : m_segments) {
+			if (ReadonlySegment* rdseg = seg->getReadonlySegment())
+				m_segWarmer->addSegment(seg->m_segDir.string(), rdseg->readsPerSec(now));
+		}
+		m_segWarmer->start();
+	}
 	if (m_segments.size() == 0 || !m_segments.back()->getWritableStore()) {
 		// THROW_STD(invalid_argument, "no any segment found");
 		// allow user create an table dir which just contains json meta file
@@ -399,9 +916,239 @@ void DbTable::doLoad(PathRef dir) {
 	}
 	m_rowNumVec.back() = baseId; // the end guard
 	m_rowNum = baseId;
+	resetManifestInLock(std::set<size_t>()); // stale dirs were removed
+	publishSegArrayInLock();
+	putUniqueKeyFilterTask();
+	putColdSegmentTask();
+	putExpireTask();
+	putVerifySegmentTask();
+	startScrubber();
+	loadOnlineIndices();
 	runLockFile.close(); // notify DO NOT delete in BOOST_SCOPE_EXIT
 }
 
+// marker of a segment quarantined by the scrubber, see quarantineSegment
+static const char g_quarantineFile[] = "QUARANTINED";
+
+// readonly segments are independent, they are loaded by a tbb arena of env
+// TerarkDB_LoadSegmentThreads, default min(cpu, 8), the first error is
+// thrown after all loads are done
+void DbTable::loadReadonlySegments(const valvec<size_t>& segIdxVec) {
+	size_t cpu = tbb::tbb_thread::hardware_concurrency();
+	size_t cfg = getEnvLong("TerarkDB_LoadSegmentThreads", 0);
+	size_t threads = std::min(cfg ? cfg : std::min<size_t>(cpu, 8),
+							  segIdxVec.size());
+	DbEnv* env = m_env.get();
+	std::mutex errMutex;
+	std::string errMsg;
+	auto loadOne = [&](size_t i) {
+		ReadableSegment* seg = m_segments[segIdxVec[i]].get();
+		std::string strDir = seg->m_segDir.string();
+		try {
+			DbEnvScope envScope(env); // tbb threads have no env scope
+			NumaNodeScope numaScope(m_numaNode);
+			profiling pf;
+			llong t0 = pf.now();
+			seg->load(seg->m_segDir);
+			seg->m_isQuarantined = fs::exists(seg->m_segDir / g_quarantineFile);
+			fprintf(stdout, "INFO: loaded segment: %s in %.3f sec, records: total = %zd, deleted = %zd, purged = %zd\n"
+				, strDir.c_str(), pf.sf(t0, pf.now()), seg->m_isDel.size()
+				, seg->m_delcnt.load(), seg->m_isPurged.max_rank1());
+		}
+		catch (const std::exception& ex) {
+			std::lock_guard<std::mutex> lock(errMutex);
+			if (errMsg.empty())
+				errMsg = "load segment " + strDir + ": " + ex.what();
+		}
+	};
+	if (threads <= 1) {
+		for (size_t i = 0; i < segIdxVec.size() && errMsg.empty(); ++i)
+			loadOne(i);
+	}
+	else {
+		tbb::task_arena arena{int(threads)};
+		arena.execute([&]() {
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, segIdxVec.size(), 1),
+				[&](const tbb::blocked_range<size_t>& r) {
+					for (size_t i = r.begin(); i < r.end(); ++i)
+						loadOne(i);
+				}, tbb::simple_partitioner());
+		});
+	}
+	if (!errMsg.empty()) {
+		THROW_STD(invalid_argument, "%s", errMsg.c_str());
+	}
+}
+
+// a replica never writes the dir, the writer owns run.lock, merges and
+// background tasks, segments are from the manifest of the writer
+void DbTable::doLoadReplica(PathRef dir) {
+	m_dir = dir;
+	m_autoTask = false;
+	m_wrSeg = nullptr;
+	refreshReplica();
+	fprintf(stderr, "INFO: DbTable::openReplica(%s): loaded %zd segs\n",
+		dir.string().c_str(), m_segments.size());
+}
+
+// canonical dir and the inode of IsDel identify a loaded segment, the
+// writer replaces IsDel only when it compacts the id space on its open
+static std::string replicaSegKey(PathRef segDir) {
+	std::string key = fs::canonical(segDir).string();
+	std::string isDelFpath = (segDir / "IsDel").string();
+	struct stat st;
+	if (::stat(isDelFpath.c_str(), &st) != 0) {
+		THROW_STD(runtime_error, "stat(%s) = %s", isDelFpath.c_str(), strerror(errno));
+	}
+	char buf[64];
+	sprintf(buf, ":%llu:%llu", ullong(st.st_dev), ullong(st.st_ino));
+	return key + buf;
+}
+
+bool DbTable::refreshReplica() {
+	if (!m_isReplica) {
+		THROW_STD(invalid_argument, "not a replica: %s", m_dir.string().c_str());
+	}
+	DbEnvScope envScope(m_env.get());
+	std::lock_guard<std::mutex> refreshLock(m_replicaMutex);
+	// the writer may remove a segment after the manifest was read by us
+	for (int retry = 0; ; ++retry) {
+		try {
+			return refreshReplicaOnce();
+		}
+		catch (const std::exception& ex) {
+			if (retry >= 3) {
+				throw;
+			}
+			fprintf(stderr, "WARN: DbTable::refreshReplica(%s): %s, retry\n"
+				, m_dir.string().c_str(), ex.what());
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	}
+}
+
+bool DbTable::refreshReplicaOnce() {
+	SegmentManifest::State st;
+	if (!SegmentManifest::readState(m_dir.string(), &st)) {
+		THROW_STD(invalid_argument, "replica needs %s of the writer: %s"
+			, SegmentManifest::FileName, m_dir.string().c_str());
+	}
+	std::map<std::string, ReadableSegmentPtr> oldSegs;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		for (size_t i = 0; i < m_segments.size(); ++i)
+			oldSegs[m_replicaSegKeys[i]] = m_segments[i];
+	}
+	fs::path mergeDir = getMergePath(m_dir, st.mergeSeq);
+	valvec<ReadableSegmentPtr> segs;
+	std::vector<std::string> keys;
+	size_t loaded = 0, writable = 0;
+	for (const std::string& name : st.segments) { // sorted by segIdx
+		long segIdx = -1;
+		if (sscanf(name.c_str(), "rd-%ld", &segIdx) != 1 || segIdx < 0) {
+			writable++; // rows of the writer are visible after conversion
+			continue;
+		}
+		fs::path segDir = mergeDir / name;
+		std::string key = replicaSegKey(segDir);
+		auto iter = oldSegs.find(key);
+		if (oldSegs.end() != iter) {
+			segs.push_back(iter->second);
+			keys.push_back(key);
+			continue;
+		}
+		ReadonlySegmentPtr seg = myCreateReadonlySegment(segDir);
+		seg->m_withPurgeBits = true; // record ids are not squeezed in place
+		seg->m_isReplica = true;
+		profiling pf;
+		llong t0 = pf.now();
+		seg->load(segDir);
+		fprintf(stdout, "INFO: replica loaded segment: %s in %.3f sec, records: total = %zd, deleted = %zd\n"
+			, segDir.string().c_str(), pf.sf(t0, pf.now()), seg->m_isDel.size()
+			, seg->m_delcnt.load());
+		segs.push_back(seg);
+		keys.push_back(key);
+		loaded++;
+	}
+	{
+		MyRwLock lock(m_rwMutex, true);
+		if (keys == m_replicaSegKeys) {
+			return false;
+		}
+		m_segments.swap(segs);
+		m_replicaSegKeys.swap(keys);
+		m_rowNumVec.resize_no_init(m_segments.size() + 1);
+		llong baseId = 0;
+		for (size_t i = 0; i < m_segments.size(); ++i) {
+			m_rowNumVec[i] = baseId;
+			baseId += m_segments[i]->numDataRows();
+		}
+		m_rowNumVec.back() = baseId; // the end guard
+		m_rowNum = baseId;
+		m_mergeSeqNum = st.mergeSeq;
+		m_segArrayUpdateSeq++;
+		publishSegArrayInLock();
+	}
+	loadOnlineIndices(); // indices of new segments, built by the writer
+	fprintf(stderr, "INFO: DbTable::refreshReplica(%s): segs = %zd, loaded = %zd, writable skipped = %zd\n"
+		, m_dir.string().c_str(), m_segments.size(), loaded, writable);
+	return true;
+}
+
+void DbTable::checkNotReplica(const char* func) const {
+	if (terark_unlikely(m_isReplica)) {
+		THROW_STD(invalid_argument, "%s: table is a read replica: %s"
+			, func, m_dir.string().c_str());
+	}
+}
+
+SegArrayVersion::~SegArrayVersion() {
+}
+
+// must be called in write lock and after m_segArrayUpdateSeq was changed
+void DbTable::publishSegArrayInLock() {
+	SegArrayVersionPtr version = new SegArrayVersion();
+	version->m_segments.assign(m_segments);
+	version->m_rowNumVec.assign(m_rowNumVec);
+	version->m_wrSeg = m_wrSeg.get();
+	version->m_segArrayUpdateSeq = m_segArrayUpdateSeq;
+	version->add_ref(); // owned by m_segArrayVersion
+	SegArrayVersion* old = m_segArrayVersion.exchange(version.get());
+	updateWriteStallInLock();
+	if (NULL == old) {
+		return;
+	}
+	// new readers will pin the new version through the new epoch slot,
+	// wait for readers which may be reading the old version
+	size_t oldEpoch = m_segArrayEpoch.fetch_add(1);
+	auto& oldReaders = m_segArrayReaders[oldEpoch & 1];
+	while (oldReaders.load() != 0) {
+		std::this_thread::yield();
+	}
+	old->release();
+}
+
+// recount the backlog and wake writers waiting for a condition change
+void DbTable::updateWriteStallInLock() {
+	size_t frozenNum = 0;
+	llong  wrBytes = 0;
+	for (auto& seg : m_segments) {
+		if (seg->getWritableStore()) {
+			wrBytes += seg->dataStorageSize();
+			if (seg->m_isFreezed)
+				frozenNum++;
+		}
+	}
+	std::lock_guard<std::mutex> lock(m_writeStallMutex);
+	m_frozenWrSegNum.store(frozenNum, std::memory_order_relaxed);
+	m_writableSegBytes.store(wrBytes, std::memory_order_relaxed);
+	m_writtenBytesAtPublish.store(
+		m_accumulateWrittenBytes.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+	m_writeStallSeq.fetch_add(1, std::memory_order_release);
+	m_writeStallCond.notify_all();
+}
+
 size_t DbTable::findSegIdx(size_t segIdxBeg, ReadableSegment* seg) const {
 	const ReadableSegmentPtr* segBase = m_segments.data();
 	const size_t segNum = m_segments.size();
@@ -529,7 +1276,7 @@ protected:
 			assert(subId >= 0);
 			assert(subId < cur.seg->numDataRows());
 			llong baseId = m_rowNumVec[m_segIdx-1];
-			if (!cur.seg->m_isDel[subId]) {
+			if (!cur.seg->isDelBit(subId)) {
 				*id = baseId + subId;
 				assert(*id < m_rowNumVec[m_segIdx]);
 				return true;
@@ -582,7 +1329,7 @@ protected:
 			assert(size_t(subId) < seg->m_isDel.size());
 			const size_t ProtectNum = 100;
 			if (seg->m_isFreezed || seg->m_isDel.unused() >= ProtectNum) {
-				if (!seg->m_isDel[subId]) {
+				if (!seg->isDelBit(subId)) {
 					resetOneSegIter(cur);
 					return cur->iter->seekExact(subId, val);
 				}
@@ -651,348 +1398,521 @@ public:
 	}
 };
 
-const std::string& BatchWriter::strError() const {
-	return m_ctx->m_transaction->strError();
-}
-const char* BatchWriter::szError() const {
-	return m_ctx->m_transaction->strError().c_str();
-}
-
-// if ctx is NULL, will create a new DbContext for m_ctx
-BatchWriter::BatchWriter(DbTable* tab, DbContext* ctx)
-{
-    TERARK_THROW(DbException
-                 , "FATAL: "
-                 "BatchWriter temporarily unsupported ."
-    );
-//	assert(nullptr != tab);
-//	assert(nullptr == ctx || ctx->m_tab == tab);
-//	if (!tab->m_wrSeg) {
-//		THROW_STD(invalid_argument, "the writing segment is NULL: %s"
-//			, tab->m_dir.string().c_str());
-//	}
-//	const SchemaConfig& sconf = *tab->m_schema;
-//	if (sconf.m_uniqIndices.size() > 1) {
-//		THROW_STD(invalid_argument
-//			, "this table has %zd unique indices, "
-//				"must have at most one unique index for calling this method"
-//			, sconf.m_uniqIndices.size());
-//	}
-//	bool inprogressWritingCountInced = false;
-//	try {
-//		MyRwLock lock(tab->m_rwMutex, false);
-//		DebugCheckRowNumVecNoLock(tab);
-//		tab->maybeCreateNewSegment(lock);
-//		if (ctx == nullptr) {
-//			ctx = tab->createDbContextNoLock();
-//		}
-//		tab->m_inprogressWritingCount += 2;
-//		inprogressWritingCountInced = true;
-//		m_wrSeg = tab->m_wrSeg.get();
-//		m_ctx = ctx;
-//		ctx->trySyncSegCtxNoLock(tab);
-//		ctx->ensureTransactionNoLock();
-//		auto txn = ctx->m_transaction.get();
-//		m_txn = txn;
-//		txn->startTransaction();
-//		assert(txn->m_removeOnCommit.size() == 0); // strict on debug
-//		assert(txn->m_appearOnCommit.size() == 0);
-//		txn->m_removeOnCommit.erase_all(); // tolerate on release
-//		txn->m_appearOnCommit.erase_all();
-//	}
-//	catch (const std::exception&) {
-//		if (inprogressWritingCountInced) {
-//			tab->m_inprogressWritingCount -= 2;
-//		}
-//		throw;
-//	}
-}
-
-BatchWriter::~BatchWriter() {
-//	auto tab = m_ctx->m_tab;
-//	auto txn = m_ctx->m_transaction.get();
-//	assert(DbTransaction::started != txn->m_status);
-//	if (DbTransaction::started == txn->m_status) {
-//		// abort();
-//		fprintf(stderr
-//			, "ERROR: commit or rollback was not called for BatchWriter, rollback by default\n");
-//		this->rollback();
-//	}
-//	tab->m_inprogressWritingCount -= 2;
-//	txn->m_removeOnCommit.erase_all();
-//	txn->m_appearOnCommit.erase_all();
-}
-
-//llong BatchWriter::overwriteExisting(fstring row) {
-//	auto ctx = m_ctx.get();
-//	auto tab = ctx->m_tab;
-//	const SchemaConfig& sconf = *tab->m_schema;
-//	llong subId = ctx->exactMatchRecIdvec[0];
-//	llong baseId = tab->m_rowNumVec.ende(2);
-//	assert(ctx->exactMatchRecIdvec.size() == 1);
-//	DbTransaction* txn(ctx->m_transaction.get());
-//	assert(tab->m_wrSeg.get() == m_wrSeg);
-//	assert(txn == m_txn);
-//	if (!sconf.m_multIndices.empty()) {
-//		try {
-//			txn->storeGetRow(subId, &ctx->row2);
-//		}
-//		catch (const ReadRecordException&) {
-//			fprintf(stderr
-//				, "ERROR: upsertRow(baseId=%lld, subId=%lld): read old row data failed: %s\n"
-//				, baseId, subId, tab->m_wrSeg->m_segDir.string().c_str());
-//			throw ReadRecordException("pre updateSyncMultIndex",
-//						tab->m_wrSeg->m_segDir.string(), baseId, subId);
-//		}
-//		sconf.m_rowSchema->parseRow(ctx->row2, &ctx->cols2); // old
-//		tab->updateSyncMultIndex(subId, txn, ctx);
-//	}
-//	txn->storeUpsert(subId, row);
-//	return baseId + subId;
-//}
-
-llong BatchWriter::upsertRow(fstring row) {
-    return -1;
-//	for (size_t retry = 0; retry < 3; ++retry) {
-//		llong recId = upsertRowImpl(row);
-//		if (recId >= 0)
-//			return recId;
-//		std::this_thread::yield();
-//	}
-//	TERARK_THROW(NeedRetryException, "Concurrent transaction conflict, retry again");
-}
-
-//llong BatchWriter::upsertRowImpl(fstring row) {
-//	auto ctx = m_ctx.get();
-//	auto tab = ctx->m_tab;
-//	auto txn = ctx->m_transaction.get();
-//	const SchemaConfig& sconf = *tab->m_schema;
-//	assert(tab->m_wrSeg.get() == m_wrSeg);
-//	assert(txn == m_txn);
-//	if (!tab->m_wrSeg) {
-//		THROW_STD(invalid_argument
-//			, "syncFinishWriting('%s') was called, now writing is not allowed"
-//			, tab->m_dir.string().c_str());
-//	}
-//	assert(sconf.m_uniqIndices.size() <= 1);
-//	size_t uniqueIndexId = sconf.m_uniqIndices[0];
-//	llong  newRecId;
-//	// parseRow doesn't need lock
-//	sconf.m_rowSchema->parseRow(row, &ctx->cols1);
-//	const Schema& indexSchema = sconf.getIndexSchema(uniqueIndexId);
-//	indexSchema.selectParent(ctx->cols1, &ctx->key1);
-//{
-//	MyRwLock lock(tab->m_rwMutex, false);
-//	ctx->trySyncSegCtxNoLock(tab);
-//	ctx->ensureTransactionNoLock();
-//	txn->indexSearch(uniqueIndexId, ctx->key1, &ctx->exactMatchRecIdvec);
-//	if (!ctx->exactMatchRecIdvec.empty()) {
-//		return overwriteExisting(row);
-//	}
-//	llong wrBaseId = tab->m_rowNumVec.ende(2);
-//	llong wrSubId = tab->allocInvisibleWrSubId_NoTabLock();
-//	if (ctx->syncIndex) {
-//		if (tab->insertSyncIndex(wrSubId, txn, ctx)) {
-//			txn->storeUpsert(wrSubId, row);
-//			tab->m_accumulateWrittenBytes += row.size();
-//		} else {
-//			return -1; // fail
-//		}
-//	} else {
-//		txn->storeUpsert(wrSubId, row);
-//		tab->m_accumulateWrittenBytes += row.size();
-//	}
-//	newRecId = wrBaseId + wrSubId;
-//	assert(tab->m_wrSeg->m_isDel[wrSubId]); // unvisible
-//	txn->m_appearOnCommit.push_back(uint32_t(wrSubId));
-//}
-//// Find and put existing row with same unique key to txn->m_removeOnCommit
-//	for (size_t segIdx = 0; segIdx < ctx->m_segCtx.size()-1; ++segIdx) {
-//		auto seg = ctx->m_segCtx[segIdx]->seg;
-//		assert(seg->m_isFreezed);
-//		seg->indexSearchExact(segIdx, uniqueIndexId, ctx->key1, &ctx->exactMatchRecIdvec, ctx);
-//		if (!ctx->exactMatchRecIdvec.empty()) {
-//			llong subId = ctx->exactMatchRecIdvec[0];
-//			llong baseId = ctx->m_rowNumVec[segIdx];
-//			llong recId = baseId + subId;
-//			assert(ctx->exactMatchRecIdvec.size() == 1);
-//			MyRwLock lock(tab->m_rwMutex, false);
-//			if (ctx->segArrayUpdateSeq != tab->m_segArrayUpdateSeq) {
-//				ctx->doSyncSegCtxNoLock(tab);
-//				size_t upp = upper_bound_a(ctx->m_rowNumVec, recId);
-//#if !defined(NDEBUG)
-//				if (seg != ctx->m_segCtx[upp-1]->seg) {
-//					seg = ctx->m_segCtx[upp-1]->seg; // for set break point
-//				}
-//#endif
-//				segIdx = upp - 1;
-//				seg = ctx->m_segCtx[segIdx]->seg;
-//				baseId = ctx->m_rowNumVec[segIdx];
-//				subId = recId - baseId;
-//			}
-//			else {
-//				ctx->m_rowNumVec.back() = tab->m_rowNum;
-//			}
-//			if (seg->m_isDel[subId]) { // should be very rare
-//				//break;
-//			} else {
-//				txn->m_removeOnCommit.push_back(recId);
-//			}
-//		}
-//	}
-//	return newRecId;
-//}
-
-void BatchWriter::removeRow(llong recId) {
-//	auto ctx = m_ctx.get();
-//	auto tab = ctx->m_tab;
-//	auto txn = ctx->m_transaction.get();
-//	auto& sconf = *tab->m_schema;
-//	assert(recId >= 0);
-//	assert(recId < tab->m_rowNum);
-//	assert(tab->m_wrSeg.get() == m_wrSeg);
-//	assert(txn == m_txn);
-//	ctx->trySyncSegCtxSpeculativeLock(tab);
-//	size_t upp = upper_bound_a(ctx->m_rowNumVec, recId);
-//	llong baseId = ctx->m_rowNumVec[upp-1];
-//	llong subId = recId - baseId;
-//	assert(recId >= baseId);
-////	fprintf(stderr
-////		, "TRACE: BatchWriter::removeRow: recId = %lld, subId = %lld, segIdx = %zd, segNum = %zd\n"
-////		, recId, subId, upp-1, tab->m_segments.size());
-//	auto seg = ctx->m_segCtx[upp-1]->seg;
-//	if (upp == ctx->m_rowNumVec.size()-1) {
-//		auto wrseg = tab->m_wrSeg.get();
-//		assert(wrseg == seg);
-//		assert(!wrseg->m_isFreezed);
-//		assert(!wrseg->m_bookUpdates);
-//		{
-//			if (wrseg->locked_testIsDel(subId))
-//				return;
-//			else
-//				txn->m_removeOnCommit.push_back(recId);
-//		}
-//		valvec<byte> &row = ctx->row1, &key = ctx->key1;
-//		ColumnVec& columns = ctx->cols1;
-//		try {
-//			txn->storeGetRow(subId, &row);
-//		}
-//		catch (const ReadRecordException& ex) {
-//			fprintf(stderr
-//				, "ERROR: removeRow(id=%lld): read row data failed: %s\n"
-//				, recId, ex.what());
-//		//	throw ReadRecordException("removeRow: pre remove index",
-//		//		wrseg->m_segDir.string(), baseId, subId);
-//			return;
-//		}
-//		sconf.m_rowSchema->parseRow(row, &columns);
-//		for (size_t i = 0; i < wrseg->m_indices.size(); ++i) {
-//			const Schema& iSchema = sconf.getIndexSchema(i);
-//			iSchema.selectParent(columns, &key);
-//			txn->indexRemove(i, key, subId);
-//		}
-//		txn->storeRemove(subId);
-//	}
-//	else {
-//		if (!seg->m_isDel[subId])
-//			txn->m_removeOnCommit.push_back(recId);
-//	}
-}
-
-bool BatchWriter::commit() {
-    return false;
-//	auto tab = m_ctx->m_tab;
-//	DbTransaction* txn(m_ctx->m_transaction.get());
-//	auto& ws = *tab->m_wrSeg;
-//	assert(&ws == m_wrSeg);
-//	assert(txn == m_txn);
-//	assert(DbTransaction::started == txn->m_status);
-//	if (!txn->commit()) {
-//		return false;
-//	}
-//	const size_t batchCnt = 100; // don't lock too long time
-//	sort_a(txn->m_removeOnCommit);
-//	sort_a(txn->m_appearOnCommit);
-////	fprintf(stderr, "TRACE: BatchWriter::commit: txn->m_removeOnCommit.size = %zd\n", txn->m_removeOnCommit.size());
-//	ws.m_deletedWrIdSet.grow_capacity(txn->m_appearOnCommit.size());
-//	{
-//		MyRwLock lock(tab->m_rwMutex, false);
-//		SpinRwLock segLock(ws.m_segMutex, true);
-//		auto bits = ws.m_isDel.bldata();
-//		for (llong wrSubId : txn->m_appearOnCommit) {
-//			terark_bit_set0(bits, wrSubId);
-//		}
-//		ws.m_delcnt -= txn->m_appearOnCommit.size();
-//	}
-//	for(size_t i = 0; i < txn->m_removeOnCommit.size(); ) {
-//		size_t upper = std::min(i + batchCnt, txn->m_removeOnCommit.size());
-//		MyRwLock lock(tab->m_rwMutex, false);
-//		for(; i < upper; ++i) {
-//			llong recId = txn->m_removeOnCommit[i];
-//			size_t upp = upper_bound_a(tab->m_rowNumVec, recId);
-//			llong baseId = tab->m_rowNumVec[upp-1];
-//			size_t subId = size_t(recId - baseId);
-//			auto seg = tab->m_segments[upp-1].get();
-//			SpinRwLock segLock(seg->m_segMutex, true);
-//		//	fprintf(stderr
-//		//		, "TRACE: BatchWriter::commit: remove: recId = %lld, subId = %zd, segIdx = %zd, segNum = %zd, seg[del = %zd, all = %zd], delratio = %f\n"
-//		//		, recId, subId, upp-1, tab->m_segments.size(), seg->m_delcnt, seg->m_isDel.size(), double(seg->m_delcnt) / seg->m_isDel.size());
-//			if (seg->m_isDel[subId]) {
-//				continue;
-//			}
-//			seg->m_isDel.set1(subId);
-//			seg->m_delcnt++;
-//			if (&ws == seg) {
-//				ws.m_deletedWrIdSet.push_back(uint32_t(subId));
-//			} else {
-//				seg->addtoUpdateList(subId);
-//			}
-//		}
-//	}
-//	if (txn->m_removeOnCommit.size() > 0) {
-//		MyRwLock lock(tab->m_rwMutex, true);
-//		const size_t segNum = tab->m_segments.size();
-//		for(size_t i = 0; i < segNum-1; ++i) {
-//			auto seg = tab->m_segments[i].get();
-//			if (seg->getReadonlySegment()) {
-//				if (tab->checkPurgeDeleteNoLock(seg)) {
-//					tab->asyncPurgeDeleteInLock();
-//					break;
-//				}
-//			}
-//		}
-//	}
-//	return true;
-}
-
-void BatchWriter::rollback() {
-//	auto tab = m_ctx->m_tab;
-//	DbTransaction* txn(m_ctx->m_transaction.get());
-//	assert(tab->m_wrSeg.get() == m_wrSeg);
-//	assert(txn == m_txn);
-//	assert(DbTransaction::started == txn->m_status);
-//	txn->rollback();
-//	auto& ws = *tab->m_wrSeg;
-//	ws.m_deletedWrIdSet.append(txn->m_appearOnCommit);
-}
-
-StoreIterator* DbTable::createStoreIterForward(DbContext* ctx) const {
-	assert(m_schema);
-	return new MyStoreIterForward(this, ctx);
-}
-
-StoreIterator* DbTable::createStoreIterBackward(DbContext* ctx) const {
-	assert(m_schema);
-	return new MyStoreIterBackward(this, ctx);
-}
-
-DbContext* DbTable::createDbContext() const {
-	MyRwLock lock(m_rwMutex, false);
-	return this->createDbContextNoLock();
-}
+// rows whose integer column is in [lo, hi], zone maps of readonly segments
+// skip the segments and blocks out of range, other segments are filtered
+// by parsing each row. Segments are of the creation time of the iterator.
+class DbTable::MyColumnRangeIter : public MyStoreIterBase {
+	size_t m_columnId;
+	llong  m_lo;
+	llong  m_hi;
+	ColumnType m_type;
+	const SegmentZoneMap* m_zoneMap; // of current segment, NULL for row scan
+	const SegmentZoneMap::Column* m_zone;
+	ColumnarBatchIterPtr m_batchIter;
+	ColumnBatch m_batch;
+	size_t m_batchPos;
+	size_t m_nextBlock;
+	ColumnVec m_cols;
 
-DbContext* DbTable::createDbContextNoLock() const {
-	return new DbContext(this);
+	StoreIterator* createSegStoreIter(ReadableSegment* seg) override {
+		return seg->createStoreIterForward(m_ctx.get());
+	}
+	bool matchRow(fstring row) {
+		auto tab = static_cast<const DbTable*>(m_store.get());
+		tab->m_schema->m_rowSchema->parseRow(row, &m_cols);
+		return SegmentZoneMap::inRange(m_type, m_cols[m_columnId].udata(), m_lo, m_hi);
+	}
+	// prepare scanning of m_segs[m_segIdx-1], false if it is out of range
+	bool enterSeg() {
+		auto& cur = m_segs[m_segIdx-1];
+		m_zoneMap = NULL;
+		m_zone = NULL;
+		m_batchIter = NULL;
+		auto rdseg = cur.seg->getReadonlySegment();
+		if (rdseg && rdseg->m_zoneMap) {
+			m_zone = rdseg->m_zoneMap->findColumn(m_columnId);
+			if (m_zone) {
+				if (!SegmentZoneMap::overlaps(m_type, m_zone->zones[0], m_lo, m_hi))
+					return false;
+				m_zoneMap = rdseg->m_zoneMap.get();
+				m_batchIter = new ColumnarBatchIter(rdseg, &m_columnId, 1,
+													m_zoneMap->m_blockRows);
+				m_batch.m_rows = 0;
+				m_batchPos = 0;
+				m_nextBlock = 0;
+				return true;
+			}
+		}
+		resetOneSegIter(&cur);
+		return true;
+	}
+	// load next block whose zone overlaps [m_lo, m_hi]
+	bool nextBlock() {
+		const size_t numBlocks = m_zoneMap->numBlocks();
+		size_t k = m_nextBlock;
+		while (k < numBlocks &&
+			!SegmentZoneMap::overlaps(m_type, m_zone->zones[1+k], m_lo, m_hi))
+			k++;
+		if (k >= numBlocks)
+			return false;
+		m_nextBlock = k + 1;
+		m_batchIter->seek(k * m_zoneMap->m_blockRows);
+		if (!m_batchIter->next(&m_batch))
+			return false;
+		// deletion is checked by testIsDel(logicId, ctx) for snapshots
+		m_batch.m_select.fill(true);
+		switch (m_type) {
+		case ColumnType::Sint32:
+		case ColumnType::Uint32:
+		case ColumnType::Sint64:
+		case ColumnType::Uint64:
+			columnarFilterRange(m_batch, 0, m_lo, m_hi);
+			break;
+		default: {
+				const ColumnArray& col = m_batch.m_cols[0];
+				for (size_t i = 0; i < m_batch.m_rows; ++i) {
+					const byte* p = col.data + col.stride * i;
+					if (!SegmentZoneMap::inRange(m_type, p, m_lo, m_hi))
+						m_batch.m_select.set0(i);
+				}
+			}
+			break;
+		}
+		m_batchPos = 0;
+		return true;
+	}
+	bool incrementZone(llong* id, valvec<byte>* val) {
+		auto seg = m_segs[m_segIdx-1].seg.get();
+		for (;;) {
+			while (m_batchPos < m_batch.m_rows) {
+				size_t k = m_batchPos++;
+				if (!m_batch.m_select.is1(k))
+					continue;
+				size_t logicId = seg->getLogicId(size_t(m_batch.m_basePhysicId + k));
+				if (seg->testIsDel(logicId, m_ctx.get()))
+					continue;
+				val->erase_all();
+				seg->getValueAppend(logicId, val, m_ctx.get());
+				*id = m_rowNumVec[m_segIdx-1] + logicId;
+				return true;
+			}
+			if (!nextBlock())
+				return false;
+		}
+	}
+	bool incrementRow(llong* id, valvec<byte>* val) {
+		auto& cur = m_segs[m_segIdx-1];
+		llong subId = -1;
+		while (cur.iter->increment(&subId, val)) {
+			if (cur.seg->testIsDel(size_t(subId), m_ctx.get()))
+				continue;
+			if (matchRow(*val)) {
+				*id = m_rowNumVec[m_segIdx-1] + subId;
+				return true;
+			}
+		}
+		return false;
+	}
+public:
+	MyColumnRangeIter(const DbTable* tab, size_t columnId, llong lo, llong hi,
+					  DbContext* ctx) {
+		const Schema& rowSchema = *tab->m_schema->m_rowSchema;
+		if (columnId >= rowSchema.columnNum()) {
+			THROW_STD(out_of_range, "columnId = %zd, columnNum = %zd"
+				, columnId, rowSchema.columnNum());
+		}
+		m_type = rowSchema.getColumnMeta(columnId).type;
+		switch (m_type) {
+		default:
+			THROW_STD(invalid_argument, "column %s is not an integer: %s"
+				, rowSchema.getColumnName(columnId).str().c_str()
+				, Schema::columnTypeStr(m_type));
+		case ColumnType::Uint08:
+		case ColumnType::Sint08:
+		case ColumnType::Uint16:
+		case ColumnType::Sint16:
+		case ColumnType::Uint32:
+		case ColumnType::Sint32:
+		case ColumnType::Uint64:
+		case ColumnType::Sint64:
+			break;
+		}
+		m_columnId = columnId;
+		m_lo = lo;
+		m_hi = hi;
+		init(tab, ctx);
+		m_segIdx = 0;
+	}
+	bool incrementSegIndex() override {
+		while (m_segIdx < m_segs.size()) {
+			m_segIdx++;
+			if (enterSeg())
+				return true;
+		}
+		return false;
+	}
+	bool increment(llong* id, valvec<byte>* val) override {
+		assert(nullptr != id);
+		assert(nullptr != val);
+		if (0 == m_segIdx && !incrementSegIndex())
+			return false;
+		do {
+			if (m_batchIter ? incrementZone(id, val) : incrementRow(id, val))
+				return true;
+		} while (incrementSegIndex());
+		return false;
+	}
+	bool seekExact(llong id, valvec<byte>* val) override {
+		if (0 == m_segIdx)
+			m_segIdx = 1;
+		if (!MyStoreIterBase::seekExact(id, val))
+			return false;
+		// continue the row scan of the segment after id
+		m_zoneMap = NULL;
+		m_zone = NULL;
+		m_batchIter = NULL;
+		return matchRow(*val);
+	}
+	void reset() override {
+		resetIterBase();
+		m_segIdx = 0;
+	}
+};
+
+// iterates m_segs, a range of segments of the table when it is created, it
+// does not follow segment changes of the table to keep partitions disjoint,
+// merged and purged segments are kept alive by m_segs
+class DbTable::MyPartitionIter : public MyStoreIterBase {
+	StoreIterator* createSegStoreIter(ReadableSegment* seg) override {
+		return seg->createStoreIterForward(m_ctx.get());
+	}
+public:
+	// m_tableScanningRefCount is increased by createParallelStoreIter
+	MyPartitionIter(const DbTable* tab, DbContext* ctx,
+					const ReadableSegmentPtr* segs, const llong* rowNumVec,
+					size_t segNum) {
+		this->m_store.reset(const_cast<DbTable*>(tab));
+		this->m_ctx.reset(ctx);
+		m_segArrayUpdateSeq = 0; // unused
+		m_segs.resize(segNum);
+		for (size_t i = 0; i < segNum; ++i) {
+			m_segs[i].seg = segs[i];
+		}
+		m_rowNumVec.assign(rowNumVec, segNum + 1);
+		m_segIdx = 1;
+	}
+	bool incrementSegIndex() override {
+		if (m_segIdx < m_segs.size()) {
+			m_segIdx++;
+			return true;
+		}
+		return false;
+	}
+	bool increment(llong* id, valvec<byte>* val) override {
+		assert(nullptr != id);
+		assert(nullptr != val);
+		do {
+			auto& cur = m_segs[m_segIdx-1];
+			if (terark_unlikely(!cur.iter)) {
+				cur.iter = createSegStoreIter(cur.seg.get());
+			}
+			llong subId = -1;
+			while (cur.iter->increment(&subId, val)) {
+				if (!cur.seg->testIsDel(size_t(subId), m_ctx.get())) {
+					*id = m_rowNumVec[m_segIdx-1] + subId;
+					return true;
+				}
+			}
+		} while (incrementSegIndex());
+		return false;
+	}
+	bool seekExact(llong id, valvec<byte>* val) override {
+		if (id < m_rowNumVec[0]) {
+			return false;
+		}
+		size_t upp = upper_bound_0(m_rowNumVec.data(), m_segs.size(), id);
+		auto& cur = m_segs[upp-1];
+		llong subId = id - m_rowNumVec[upp-1];
+		if (subId >= cur.seg->numDataRows() ||
+				cur.seg->testIsDel(size_t(subId), m_ctx.get())) {
+			return false;
+		}
+		m_segIdx = upp;
+		resetOneSegIter(&cur);
+		return cur.iter->seekExact(subId, val);
+	}
+	void reset() override {
+		for (auto& x : m_segs) {
+			if (x.iter)
+				x.iter->reset();
+		}
+		m_segIdx = 1;
+	}
+};
+
+const std::string& BatchWriter::strError() const {
+	return m_errMsg;
+}
+const char* BatchWriter::szError() const {
+	return m_errMsg.c_str();
+}
+
+// if ctx is NULL, will create a new DbContext for m_ctx
+BatchWriter::BatchWriter(DbTable* tab, DbContext* ctx) {
+	assert(nullptr != tab);
+	assert(nullptr == ctx || ctx->m_tab == tab);
+	if (!tab->m_wrSeg) {
+		THROW_STD(invalid_argument, "the writing segment is NULL: %s"
+			, tab->m_dir.string().c_str());
+	}
+	m_ctx = ctx ? ctx : tab->createDbContext();
+	if (!m_ctx->syncIndex) {
+		THROW_STD(invalid_argument,
+			"ctx->syncIndex must be true for BatchWriter");
+	}
+}
+
+BatchWriter::~BatchWriter() {
+	if (m_rows.size() || m_removeIds.size()) {
+		fprintf(stderr
+			, "ERROR: commit or rollback was not called for BatchWriter, rollback by default\n");
+		this->rollback();
+	}
+}
+
+llong BatchWriter::upsertRow(fstring row) {
+	llong seq = llong(m_rows.size());
+	m_rows.push_back(row);
+	return seq;
+}
+
+void BatchWriter::removeRow(llong recId) {
+	assert(recId >= 0);
+	m_removeIds.push_back(recId);
+}
+
+static inline fstring fstrvecAt(const fstrvecl& v, size_t i) {
+	auto x = v[i];
+	return fstring(x.first, x.second - x.first);
+}
+
+// rows are ids of m_rows which are deduped by upsert key, keys[u][i] is the
+// key of uniq index u of m_rows[i]. replaced[k] is the existing recId which
+// has the same upsert key with m_rows[rows[k]], or -1
+bool
+BatchWriter::checkUniqueIndices(const valvec<size_t>& rows,
+								const valvec<fstrvecl>& keys,
+								valvec<llong>* replaced) {
+	DbContext* ctx = m_ctx.get();
+	const SchemaConfig& sconf = *ctx->m_tab->m_schema;
+	const size_t num = rows.size();
+	replaced->resize_fill(num, -1);
+	if (keys.empty()) {
+		return true;
+	}
+	valvec<fstring> probe(num, valvec_reserve());
+	valvec<size_t>  offsets;
+	valvec<llong>   gone(m_removeIds); // rows removed or replaced by batch
+	for (size_t u = 0; u < keys.size(); ++u) {
+		const size_t indexId = sconf.m_uniqIndices[u];
+		const Schema& iSchema = sconf.getIndexSchema(indexId);
+		probe.erase_all();
+		for (size_t k = 0; k < num; ++k) {
+			probe.push_back(fstrvecAt(keys[u], rows[k]));
+		}
+		if (u > 0) { // upsert keys(u == 0) have been deduped
+			valvec<fstring> sorted(probe);
+			std::sort(sorted.begin(), sorted.end());
+			for (size_t k = 1; k < num; ++k) {
+				if (sorted[k-1] == sorted[k]) {
+					m_errMsg = "DupKey=" + iSchema.toJsonStr(sorted[k])
+							 + ", in the batch";
+					return false;
+				}
+			}
+		}
+		ctx->indexSearchExactBatch(indexId, probe.data(), num,
+								   &ctx->exactMatchRecIdvec, &offsets);
+		const llong* found = ctx->exactMatchRecIdvec.data();
+		if (0 == u) {
+			for (size_t k = 0; k < num; ++k) {
+				if (offsets[k] < offsets[k+1]) {
+					(*replaced)[k] = found[offsets[k]];
+					gone.push_back(found[offsets[k]]);
+				}
+			}
+			std::sort(gone.begin(), gone.end());
+			continue;
+		}
+		for (size_t k = 0; k < num; ++k) {
+			for (size_t j = offsets[k]; j < offsets[k+1]; ++j) {
+				if (std::binary_search(gone.begin(), gone.end(), found[j]))
+					continue;
+				char szIdstr[96];
+				snprintf(szIdstr, sizeof(szIdstr), "recId = %lld", found[j]);
+				m_errMsg = "DupKey=" + iSchema.toJsonStr(probe[k])
+						 + ", existing " + szIdstr;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool BatchWriter::commit() {
+	DbContext* ctx = m_ctx.get();
+	const SchemaConfig& sconf = *ctx->m_tab->m_schema;
+	const size_t rowNum = m_rows.size();
+	BOOST_SCOPE_EXIT(this_) {
+		this_->m_rows.erase_all();
+		this_->m_removeIds.erase_all();
+	} BOOST_SCOPE_EXIT_END;
+	m_errMsg.clear();
+	// keys of all unique indices, parseRow once for each staged row
+	valvec<fstrvecl> keys(sconf.m_uniqIndices.size());
+	if (!keys.empty()) {
+		auto cols = ctx->cols.get();
+		auto key = ctx->bufs.get();
+		for (size_t i = 0; i < rowNum; ++i) {
+			sconf.m_rowSchema->parseRow(fstrvecAt(m_rows, i), cols.get());
+			for (size_t u = 0; u < keys.size(); ++u) {
+				const Schema& iSchema = sconf.getIndexSchema(sconf.m_uniqIndices[u]);
+				iSchema.selectParent(*cols, key.get());
+				keys[u].push_back(fstring(*key));
+			}
+		}
+	}
+	// sort by upsert key and dedup, the last staged row wins
+	valvec<size_t> rows(rowNum, valvec_reserve());
+	for (size_t i = 0; i < rowNum; ++i) {
+		rows.unchecked_push_back(i);
+	}
+	if (!keys.empty()) {
+		const fstrvecl& pk = keys[0];
+		std::stable_sort(rows.begin(), rows.end(), [&](size_t x, size_t y) {
+			return fstrvecAt(pk, x) < fstrvecAt(pk, y);
+		});
+		size_t n = 0;
+		for (size_t k = 0; k < rowNum; ++k) {
+			if (k + 1 < rowNum && fstrvecAt(pk, rows[k]) == fstrvecAt(pk, rows[k+1]))
+				continue;
+			rows[n++] = rows[k];
+		}
+		rows.risk_set_size(n);
+	}
+	std::sort(m_removeIds.begin(), m_removeIds.end());
+	m_removeIds.trim(std::unique(m_removeIds.begin(), m_removeIds.end()));
+	valvec<llong> replaced;
+	try {
+		if (!checkUniqueIndices(rows, keys, &replaced)) {
+			return false;
+		}
+		for (llong recId : m_removeIds) {
+			if (ctx->m_tab->exists(recId))
+				ctx->removeRow(recId);
+		}
+		auto oldRow = ctx->bufs.get();
+		IndexBatchScope indexBatch(ctx->m_tab, ctx);
+		for (size_t k = 0; k < rows.size(); ++k) {
+			llong oldId = replaced[k];
+			bool hasOld = oldId >= 0 &&
+				!std::binary_search(m_removeIds.begin(), m_removeIds.end(), oldId);
+			if (hasOld) {
+				ctx->getValue(oldId, oldRow.get());
+				ctx->removeRow(oldId);
+			}
+			llong recId = ctx->insertRow(fstrvecAt(m_rows, rows[k]));
+			if (recId < 0) {
+				m_errMsg = ctx->errMsg;
+				if (hasOld) {
+					ctx->insertRow(*oldRow); // restore the replaced row
+				}
+				return false;
+			}
+		}
+	}
+	catch (const std::exception& ex) {
+		m_errMsg = ex.what();
+		return false;
+	}
+	return true;
+}
+
+void BatchWriter::rollback() {
+	m_rows.erase_all();
+	m_removeIds.erase_all();
+}
+
+StoreIterator* DbTable::createStoreIterForward(DbContext* ctx) const {
+	assert(m_schema);
+	return new MyStoreIterForward(this, ctx);
+}
+
+StoreIterator* DbTable::createStoreIterBackward(DbContext* ctx) const {
+	assert(m_schema);
+	return new MyStoreIterBackward(this, ctx);
+}
+
+StoreIterator*
+DbTable::createTableIterColumnRange(size_t columnId, llong lo, llong hi,
+									DbContext* ctx) const {
+	assert(m_schema);
+	return new MyColumnRangeIter(this, columnId, lo, hi, ctx);
+}
+
+// segments are partitioned at the segment boundary nearest to each equal
+// split of rows, every partition has at least one segment
+void
+DbTable::createParallelStoreIter(size_t numPartitions,
+								 valvec<StoreIteratorPtr>* iters,
+								 DbContext* ctx)
+const {
+	assert(m_schema);
+	if (0 == numPartitions) {
+		THROW_STD(invalid_argument, "numPartitions must be positive");
+	}
+	iters->erase_all();
+	valvec<ReadableSegmentPtr> segs;
+	valvec<llong> rowNumVec;
+	valvec<size_t> bounds;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		segs.assign(m_segments.begin(), m_segments.end());
+		rowNumVec = m_rowNumVec;
+		assert(rowNumVec.size() == segs.size() + 1);
+		const size_t segNum = segs.size();
+		const size_t parts = std::min(numPartitions, segNum);
+		const llong  rows = rowNumVec[segNum];
+		bounds.push_back(0);
+		for (size_t k = 1; k < parts; ++k) {
+			llong target = llong(rows * double(k) / parts);
+			size_t b = lower_bound_0(rowNumVec.data(), segNum, target);
+			b = std::max(b, bounds.back() + 1);
+			b = std::min(b, segNum - (parts - k));
+			bounds.push_back(b);
+		}
+		bounds.push_back(segNum);
+		lock.upgrade_to_writer();
+		m_tableScanningRefCount += parts;
+	}
+	for (size_t k = 0; k + 1 < bounds.size(); ++k) {
+		DbContext* sub = this->createDbContext();
+		if (ctx->hasSnapshot()) {
+			sub->setSnapshot(ctx->getSnapshotVersion());
+		}
+		size_t beg = bounds[k];
+		iters->push_back(new MyPartitionIter(this, sub, segs.data() + beg,
+							rowNumVec.data() + beg, bounds[k+1] - beg));
+	}
+}
+
+DbContext* DbTable::createDbContext() const {
+	MyRwLock lock(m_rwMutex, false);
+	return this->createDbContextNoLock();
+}
+
+DbContext* DbTable::createDbContextNoLock() const {
+	return new DbContext(this);
 }
 
 llong DbTable::existingRows(DbContext* ctx) const {
@@ -1044,9 +1964,33 @@ llong DbTable::dataInflateSize() const {
 	return size;
 }
 
+// samples foreground reads for the adaptive rate of compaction writes,
+// it is a noop if limiter is NULL
+class ReadLatencySampler {
+	AdaptiveWriteRateLimiter* m_limiter;
+	ullong m_t0;
+public:
+	enum { SampleRate = 16 };
+	explicit ReadLatencySampler(AdaptiveWriteRateLimiter* limiter) {
+		static thread_local unsigned tls_tick = 0;
+		if (limiter && ++tls_tick % SampleRate == 0) {
+			m_limiter = limiter;
+			m_t0 = DbPerfCounters::nowNs();
+		} else {
+			m_limiter = NULL;
+		}
+	}
+	~ReadLatencySampler() {
+		if (m_limiter)
+			m_limiter->addReadLatency(DbPerfCounters::nowNs() - m_t0);
+	}
+};
+
 void
 DbTable::getValueAppend(llong id, valvec<byte>* val, DbContext* ctx)
 const {
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::get);
+	ReadLatencySampler sampler(m_readLatencyLimiter);
 	ctx->trySyncSegCtxSpeculativeLock(this);
 // this assert is very unlikely but still possibly failed
 //	assert(ctx->m_rowNumVec.size() == ctx->m_segCtx.size() + 1);
@@ -1055,68 +1999,276 @@ const {
 			"invalid id = %lld, m_rowNum = %lld", id, m_rowNum);
 	}
 	auto rowNumPtr = ctx->m_rowNumVec.data();
-	size_t upp = upper_bound_0(rowNumPtr, ctx->m_rowNumVec.size(), id);
+	size_t upp = ctx->m_segLocator.upper_bound(id);
 	assert(upp < ctx->m_rowNumVec.size());
 	llong baseId = rowNumPtr[upp-1];
 	llong subId = id - baseId;
 	auto seg = ctx->m_segCtx[upp-1]->seg;
-    if(seg->testIsDel(subId))
+    if(seg->testIsDel(subId, ctx))
     {
         throw ReadDeletedRecordException(seg->m_segDir.string(), baseId, subId);
     }
 	seg->getValueAppend(subId, val, ctx);
 }
 
-bool DbTable::maybeCreateNewSegment(MyRwLock& lock) {
-	DebugCheckRowNumVecNoLock(this);
-	if (m_isMerging) {
-		return false;
-	}
-	if (m_inprogressWritingCount > 1) {
-		return false;
+fstring
+DbTable::getValueRef(llong id, valvec<byte>* buf, DbContext* ctx)
+const {
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	if (terark_unlikely(id < 0 || id >= m_rowNum)) {
+		THROW_STD(out_of_range,
+			"invalid id = %lld, m_rowNum = %lld", id, m_rowNum);
 	}
-	if (m_wrSeg->dataStorageSize() < m_schema->m_maxWritingSegmentSize) {
-		return false;
+	auto rowNumPtr = ctx->m_rowNumVec.data();
+	size_t upp = ctx->m_segLocator.upper_bound(id);
+	assert(upp < ctx->m_rowNumVec.size());
+	llong baseId = rowNumPtr[upp-1];
+	llong subId = id - baseId;
+	auto seg = ctx->m_segCtx[upp-1]->seg;
+	if (seg->testIsDel(subId, ctx)) {
+		throw ReadDeletedRecordException(seg->m_segDir.string(), baseId, subId);
 	}
-	if (!lock.upgrade_to_writer()) {
-		// if upgrade_to_writer fails, it means the lock has been
-		// temporary released and re-acquired, so we need check
-		// the condition again
-		if (m_isMerging) {
-			return false;
-		}
-		if (m_inprogressWritingCount > 1) {
-			return false;
-		}
-		if (m_wrSeg->dataStorageSize() < m_schema->m_maxWritingSegmentSize) {
-			return false;
-		}
+	// ctx->m_segCtx refs seg, it keeps the store memory alive
+	if (seg->hasValueRef()) {
+		return seg->getValueRef(subId, ctx);
 	}
-	doCreateNewSegmentInLock();
-//	lock.downgrade_to_reader(); // TBB bug, sometimes didn't downgrade
-	return true;
+	buf->erase_all();
+	seg->getValueAppend(subId, buf, ctx);
+	return *buf;
 }
 
-void DbTable::maybeCreateNewSegmentInWriteLock() {
-	DebugCheckRowNumVecNoLock(this);
-	if (m_isMerging) {
-		return;
-	}
-	if (m_inprogressWritingCount > 1) {
-		return;
-	}
-	if (m_wrSeg->dataStorageSize() >= m_schema->m_maxWritingSegmentSize) {
-		doCreateNewSegmentInLock();
+// ctx->m_batchOrder[0, num) is segIdx of ids[i]
+// ctx->m_batchOrder[num, 2*num) is index of ids, grouped by segment
+// ctx->m_batchOrder[2*num+segIdx] is end of the segment's group
+// ctx->m_batchSubIds[j] is subId of ids[order[j]]
+void
+DbTable::groupIdsBySegmentNoLock(const llong* ids, size_t num, DbContext* ctx)
+const {
+	const size_t segNum = ctx->m_segCtx.size();
+	const llong  rows = m_rowNum;
+	const llong* rowNumPtr = ctx->m_rowNumVec.data();
+	ctx->m_batchOrder.resize_no_init(2*num + segNum + 1);
+	ctx->m_batchSubIds.resize_no_init(num);
+	size_t* segOf = ctx->m_batchOrder.data();
+	size_t* order = segOf + num;
+	size_t* segPos = order + num;
+	std::fill_n(segPos, segNum + 1, 0);
+	for (size_t i = 0; i < num; ++i) {
+		llong id = ids[i];
+		if (terark_unlikely(id < 0 || id >= rows)) {
+			THROW_STD(out_of_range, "invalid id = %lld, m_rowNum = %lld", id, rows);
+		}
+		size_t upp = ctx->m_segLocator.upper_bound(id);
+		assert(upp <= segNum);
+		segOf[i] = upp - 1;
+		segPos[upp]++;
+	}
+	for (size_t i = 1; i < segNum; ++i) {
+		segPos[i] += segPos[i-1];
+	}
+	// after this loop, segPos[segIdx] is end of the segment's group
+	llong* subIds = ctx->m_batchSubIds.data();
+	for (size_t i = 0; i < num; ++i) {
+		size_t segIdx = segOf[i];
+		size_t j = segPos[segIdx]++;
+		order[j] = i;
+		subIds[j] = ids[i] - rowNumPtr[segIdx];
 	}
 }
 
-void DbTable::doCreateNewSegmentInLock() {
-	assert(!m_isMerging);
-	if (m_segments.size() == m_segments.capacity()) {
-		THROW_STD(invalid_argument,
-			"Reaching maxSegNum=%d", int(m_segments.capacity()));
+void
+DbTable::getValuesBatch(const llong* ids, size_t num, valvec<byte>* vals,
+						DbContext* ctx)
+const {
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	groupIdsBySegmentNoLock(ids, num, ctx);
+	const size_t  segNum = ctx->m_segCtx.size();
+	const size_t* order  = ctx->m_batchOrder.data() + num;
+	const size_t* segEnd = order + num;
+	const llong*  subIds = ctx->m_batchSubIds.data();
+	auto& tmpVals = ctx->m_batchVals;
+	tmpVals.resize(num);
+	size_t beg = 0;
+	for (size_t i = 0; i < segNum; ++i) {
+		const size_t end = segEnd[i];
+		if (beg == end) {
+			continue;
+		}
+		auto seg = ctx->m_segCtx[i]->seg;
+		for (size_t j = beg; j < end; ++j) {
+			if (seg->testIsDel(subIds[j], ctx)) {
+				throw ReadDeletedRecordException(seg->m_segDir.string(),
+						ctx->m_rowNumVec[i], subIds[j]);
+			}
+			tmpVals[j].risk_set_size(0);
+		}
+		seg->getValuesAppendBatch(subIds + beg, end - beg, tmpVals.data() + beg, ctx);
+		beg = end;
+	}
+	for (size_t j = 0; j < num; ++j) {
+		vals[order[j]].swap(tmpVals[j]);
+	}
+}
+
+void
+DbTable::getValuesBatch(const valvec<llong>& ids, valvec<valvec<byte> >* vals,
+						DbContext* ctx)
+const {
+	vals->resize(ids.size());
+	getValuesBatch(ids.data(), ids.size(), vals->data(), ctx);
+}
+
+void
+DbTable::selectColumnsBatch(const llong* ids, size_t num,
+							const size_t* colsId, size_t colsNum,
+							valvec<byte>* colsDataVec, DbContext* ctx)
+const {
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	groupIdsBySegmentNoLock(ids, num, ctx);
+	const size_t  segNum = ctx->m_segCtx.size();
+	const size_t* order  = ctx->m_batchOrder.data() + num;
+	const size_t* segEnd = order + num;
+	const llong*  subIds = ctx->m_batchSubIds.data();
+	auto& tmpVals = ctx->m_batchVals;
+	tmpVals.resize(num);
+	size_t beg = 0;
+	for (size_t i = 0; i < segNum; ++i) {
+		const size_t end = segEnd[i];
+		auto seg = ctx->m_segCtx[i]->seg;
+		for (size_t j = beg; j < end; ++j) {
+			if (seg->testIsDel(subIds[j], ctx)) {
+				throw ReadDeletedRecordException(seg->m_segDir.string(),
+						ctx->m_rowNumVec[i], subIds[j]);
+			}
+			tmpVals[j].risk_set_size(0);
+			seg->selectColumns(subIds[j], colsId, colsNum, &tmpVals[j], ctx);
+		}
+		beg = end;
+	}
+	for (size_t j = 0; j < num; ++j) {
+		colsDataVec[order[j]].swap(tmpVals[j]);
+	}
+}
+
+void
+DbTable::selectColumnsBatch(const valvec<llong>& ids, const valvec<size_t>& cols,
+							valvec<valvec<byte> >* colsDataVec, DbContext* ctx)
+const {
+	colsDataVec->resize(ids.size());
+	selectColumnsBatch(ids.data(), ids.size(), cols.data(), cols.size(),
+					   colsDataVec->data(), ctx);
+}
+
+void
+DbTable::selectOneColgroupBatch(const llong* ids, size_t num, size_t cgId,
+								valvec<byte>* cgDataVec, DbContext* ctx)
+const {
+	assert(cgId < m_schema->getColgroupNum());
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	groupIdsBySegmentNoLock(ids, num, ctx);
+	const size_t  segNum = ctx->m_segCtx.size();
+	const size_t* order  = ctx->m_batchOrder.data() + num;
+	const size_t* segEnd = order + num;
+	const llong*  subIds = ctx->m_batchSubIds.data();
+	auto& tmpVals = ctx->m_batchVals;
+	tmpVals.resize(num);
+	size_t beg = 0;
+	for (size_t i = 0; i < segNum; ++i) {
+		const size_t end = segEnd[i];
+		auto seg = ctx->m_segCtx[i]->seg;
+		for (size_t j = beg; j < end; ++j) {
+			if (seg->testIsDel(subIds[j], ctx)) {
+				throw ReadDeletedRecordException(seg->m_segDir.string(),
+						ctx->m_rowNumVec[i], subIds[j]);
+			}
+			tmpVals[j].risk_set_size(0);
+			seg->selectColgroups(subIds[j], &cgId, 1, &tmpVals[j], ctx);
+		}
+		beg = end;
+	}
+	for (size_t j = 0; j < num; ++j) {
+		cgDataVec[order[j]].swap(tmpVals[j]);
+	}
+}
+
+static profiling g_pf;
+
+static bool
+wrSegNeedFreeze(const WritableSegment* wrseg, llong freezeSize) {
+	return wrseg->dataStorageSize() >= freezeSize
+		|| wrseg->needFreezeByMemBudget();
+}
+
+llong DbTable::getWrSegFreezeSize() const {
+	llong tuned = m_wrSegFreezeSize.load(std::memory_order_relaxed);
+	return tuned ? tuned : m_schema->m_maxWritingSegmentSize;
+}
+
+// a row of a newer time partition rolls the writable segment, rows of older
+// partitions(late rows) are kept in the writable segment
+static bool
+wrSegCrossPartition(const WritableSegment* wrseg, llong timePartition) {
+	llong cur = wrseg->m_timePartition.load(std::memory_order_relaxed);
+	return timePartition > cur && LLONG_MIN != cur && !wrseg->m_isDel.empty();
+}
+
+bool DbTable::maybeCreateNewSegment(MyRwLock& lock, llong timePartition) {
+	DebugCheckRowNumVecNoLock(this);
+	if (m_isMerging) {
+		return false;
+	}
+	if (m_inprogressWritingCount > 1) {
+		return false;
+	}
+	if (!wrSegNeedFreeze(m_wrSeg.get(), getWrSegFreezeSize()) &&
+			!wrSegCrossPartition(m_wrSeg.get(), timePartition)) {
+		return false;
+	}
+	if (!lock.upgrade_to_writer()) {
+		// if upgrade_to_writer fails, it means the lock has been
+		// temporary released and re-acquired, so we need check
+		// the condition again
+		if (m_isMerging) {
+			return false;
+		}
+		if (m_inprogressWritingCount > 1) {
+			return false;
+		}
+		if (!wrSegNeedFreeze(m_wrSeg.get(), getWrSegFreezeSize()) &&
+				!wrSegCrossPartition(m_wrSeg.get(), timePartition)) {
+			return false;
+		}
+	}
+	doCreateNewSegmentInLock();
+//	lock.downgrade_to_reader(); // TBB bug, sometimes didn't downgrade
+	return true;
+}
+
+void DbTable::maybeCreateNewSegmentInWriteLock() {
+	DebugCheckRowNumVecNoLock(this);
+	if (m_isMerging) {
+		return;
+	}
+	if (m_inprogressWritingCount > 1) {
+		return;
+	}
+	if (wrSegNeedFreeze(m_wrSeg.get(), getWrSegFreezeSize())) {
+		doCreateNewSegmentInLock();
+	}
+}
+
+void DbTable::doCreateNewSegmentInLock() {
+	assert(!m_isMerging);
+	DbEnvScope envScope(m_env.get()); // files of writable stores are opened
+	if (m_segments.size() == m_segments.capacity()) {
+		THROW_STD(invalid_argument,
+			"Reaching maxSegNum=%d", int(m_segments.capacity()));
 	}
 	auto oldwrseg = m_wrSeg.get();
+	asyncIndexDrainInLock();
+	// trailing reserved subId may be popped and all reserved subId
+	// will be in frozen segment, they are all invalid now
+	m_wrSubIdReserveGen++;
 	{
 		SpinRwLock wrsegLock(oldwrseg->m_segMutex, true);
 		while (oldwrseg->m_isDel.size() && oldwrseg->m_isDel.back()) {
@@ -1137,14 +2289,27 @@ void DbTable::doCreateNewSegmentInLock() {
 	putToFlushQueue(m_segments.size() - 1);
 	size_t newSegIdx = m_segments.size();
 	m_wrSeg = myCreateWritableSegment(getSegPath("wr", newSegIdx));
+	logManifestEdit("+" + getSegPath("wr", newSegIdx).filename().string());
     oldwrseg->shrinkToSize(oldwrseg->m_isDel.size());
 	oldwrseg->markFrozen();
+	tuneWrSegSizeInLock(oldwrseg);
+	m_wrSegStartTime = g_pf.now();
+	{
+		SegmentEventScope evScope(SegmentEventType::freeze, m_dir.string());
+		evScope.ev().inputSegs.push_back(oldwrseg->m_segDir.string());
+		evScope.ev().inputBytes = oldwrseg->dataStorageSize();
+		evScope.ev().inputRows = oldwrseg->m_isDel.size();
+		evScope.ev().inputDeletedRows = oldwrseg->m_delcnt;
+		evScope.ev().memBytes = oldwrseg->dataStorageSize() + oldwrseg->totalIndexSize();
+		evScope.setDone();
+	}
 	assert(oldwrseg->m_isFreezed);
 	m_segments.push_back(m_wrSeg);
 	llong newMaxRowNum = m_rowNumVec.back();
 	m_rowNumVec.push_back(newMaxRowNum);
 	m_newWrSegNum++;
 	m_segArrayUpdateSeq++;
+	publishSegArrayInLock();
 	oldwrseg->m_deletedWrIdSet.clear(); // free memory
 	// freeze oldwrseg, this may be too slow
 	// auto& oldwrseg = m_segments.ende(2);
@@ -1152,6 +2317,71 @@ void DbTable::doCreateNewSegmentInLock() {
 	// oldwrseg->loadIsDel(oldwrseg->m_segDir); // mmap
 }
 
+// Sizes the next writable segment by observations when one is frozen, if
+// AutoTuneWrSegSize. The target is TerarkDB_WrSegTuneFillSeconds(default
+// 600) of inserts, so segments of a slow table hold less memory and are
+// recovered faster, and segments of a fast table are not converted and
+// merged again and again. It is enlarged 1.5 times when frozen segments
+// are waiting for conversion: fewer conversions of the same bytes. It is
+// limited to TerarkDB_WrSegTuneConvSeconds(default 300) of conversion, to
+// 1/4 of WritableMemBudget(1/8 under pressure), and to 2x or 1/2 of the
+// current size by a freeze, the result is in [MinWritingSegmentSize,
+// MaxWritingSegmentSize].
+void DbTable::tuneWrSegSizeInLock(const WritableSegment* frozen) {
+	const SchemaConfig& sconf = *m_schema;
+	if (!sconf.m_autoTuneWrSegSize) {
+		return;
+	}
+	static const double fillSeconds = std::max<long>(
+		getEnvLong("TerarkDB_WrSegTuneFillSeconds", 600), 1);
+	static const double convSeconds = std::max<long>(
+		getEnvLong("TerarkDB_WrSegTuneConvSeconds", 300), 1);
+	const llong bytes = frozen->dataStorageSize();
+	if (m_wrSegStartTime && bytes > 0) {
+		double sec = std::max(g_pf.sf(m_wrSegStartTime, g_pf.now()), 1e-3);
+		double rate = bytes / sec;
+		m_wrSegInsertRate = m_wrSegInsertRate
+			? 0.5 * m_wrSegInsertRate + 0.5 * rate : rate;
+	}
+	if (0 == m_wrSegInsertRate) {
+		return;
+	}
+	const llong oldSize = getWrSegFreezeSize();
+	const size_t frozenNum = m_frozenWrSegNum.load(std::memory_order_relaxed);
+	const double convRate = m_wrSegConvRate.load(std::memory_order_relaxed);
+	double target = m_wrSegInsertRate * fillSeconds;
+	const char* limit = "insert rate";
+	if (frozenNum >= 2) {
+		target *= 1.5;
+		limit = "conversion backlog";
+	}
+	if (convRate > 0 && target > convRate * convSeconds) {
+		target = convRate * convSeconds;
+		limit = "conversion rate";
+	}
+	if (llong budget = WritableMemBudget::budget()) {
+		double cap = budget / 4.0;
+		if (WritableMemBudget::pressure() != WritableMemBudget::Pressure::none)
+			cap /= 2;
+		if (target > cap) {
+			target = cap;
+			limit = "memory budget";
+		}
+	}
+	target = std::min(std::max(target, oldSize / 2.0), oldSize * 2.0);
+	llong newSize = std::min(std::max(llong(target),
+		sconf.m_minWritingSegmentSize), sconf.m_maxWritingSegmentSize);
+	if (std::abs(newSize - oldSize) * 10 < oldSize) {
+		return; // less than 10%
+	}
+	m_wrSegFreezeSize.store(newSize, std::memory_order_relaxed);
+	fprintf(stderr
+		, "INFO: %s: writable segment size %.1f MB -> %.1f MB by %s, insert = %.2f MB/s"
+		  ", conv = %.2f MB/s, frozen = %zd\n"
+		, m_dir.string().c_str(), oldSize / 1048576.0, newSize / 1048576.0, limit
+		, m_wrSegInsertRate / 1048576.0, convRate / 1048576.0, frozenNum);
+}
+
 ReadonlySegment*
 DbTable::myCreateReadonlySegment(PathRef segDir) const {
 	fstring clazz = m_schema->m_readonlySegmentClass;
@@ -1197,32 +2427,105 @@ DbTable::openWritableSegment(PathRef segDir) const {
 	THROW_STD(invalid_argument, "bad WritableSegmentClass: %s", clazz.c_str());
 }
 
+std::string DbTable::buildBulkSegment(const fstrvecl& rows) {
+	char szBuf[32];
+	snprintf(szBuf, sizeof(szBuf), "bulk-%04ld", long(m_bulkSegSeqNum++));
+	fs::path stagingDir = m_dir / "bulk" / szBuf;
+	if (fs::exists(stagingDir)) {
+		fprintf(stderr, "WARN: remove stale bulk segment: %s\n"
+			, stagingDir.string().c_str());
+		fs::remove_all(stagingDir);
+	}
+	fs::remove_all(stagingDir + ".tmp");
+	fs::create_directories(stagingDir.parent_path());
+	profiling pf;
+	llong t0 = pf.now();
+	ReadonlySegmentPtr seg = myCreateReadonlySegment(stagingDir);
+	seg->buildFromRows(rows);
+	m_accumulateWrittenBytes += rows.strpool.size();
+	fprintf(stderr, "INFO: buildBulkSegment: %s, rows = %zd, bytes = %zd, time = %.3f sec\n"
+		, stagingDir.string().c_str(), rows.size(), rows.strpool.size()
+		, pf.sf(t0, pf.now()));
+	return stagingDir.string();
+}
+
+void DbTable::attachBulkSegments(const std::vector<std::string>& stagingDirs) {
+	checkNotReplica("attachBulkSegments");
+	if (stagingDirs.empty()) {
+		return;
+	}
+	MyRwLock lock(m_rwMutex, true);
+	if (m_isMerging) {
+		THROW_STD(invalid_argument, "table is merging: %s", m_dir.string().c_str());
+	}
+	if (!m_wrSeg->m_isDel.empty()) {
+		THROW_STD(invalid_argument
+			, "writable segment is not empty, rows = %zd", m_wrSeg->m_isDel.size());
+	}
+	const size_t segNum = stagingDirs.size();
+	const size_t wrSegIdx = m_segments.size() - 1;
+	assert(m_segments.back().get() == m_wrSeg.get());
+	if (m_segments.size() + segNum > m_segments.capacity()) {
+		THROW_STD(invalid_argument,
+			"Reaching maxSegNum=%d", int(m_segments.capacity()));
+	}
+	// segments are loaded in the lock, this is rare and offline
+	valvec<ReadableSegmentPtr> newSegs(segNum, valvec_reserve());
+	for (size_t i = 0; i < segNum; ++i) {
+		auto segDir = getSegPath("rd", wrSegIdx + i);
+		fs::rename(stagingDirs[i], segDir);
+		ReadonlySegmentPtr seg = myCreateReadonlySegment(segDir);
+		seg->m_withPurgeBits = m_schema->m_usePermanentRecordId;
+		seg->load(segDir);
+		newSegs.push_back(seg);
+	}
+	WritableSegmentPtr oldwrseg = m_wrSeg;
+	m_wrSubIdReserveGen++;
+	m_wrSeg = myCreateWritableSegment(getSegPath("wr", wrSegIdx + segNum));
+	m_wrSegStartTime = g_pf.now();
+	std::string edit = "-" + getSegPath("wr", wrSegIdx).filename().string();
+	for (size_t i = 0; i <= segNum; ++i) {
+		edit += " +";
+		edit += getSegPath(i < segNum ? "rd" : "wr", wrSegIdx + i).filename().string();
+	}
+	logManifestEdit(edit);
+	m_segments.pop_back();
+	m_rowNumVec.pop_back();
+	for (auto& seg : newSegs) {
+		llong baseId = m_rowNumVec.back();
+		m_segments.push_back(seg);
+		m_rowNumVec.push_back(baseId + seg->numDataRows());
+	}
+	m_segments.push_back(m_wrSeg);
+	m_rowNumVec.push_back(m_rowNumVec.back());
+	m_rowNum = m_rowNumVec.back();
+	m_segArrayUpdateSeq++;
+	publishSegArrayInLock();
+	oldwrseg->deleteSegment();
+	fprintf(stderr, "INFO: attachBulkSegments: %zd segments, rows = %lld\n"
+		, segNum, m_rowNum);
+}
+
 bool DbTable::exists(llong id) const {
 	assert(id >= 0);
 	if (terark_unlikely(id >= llong(m_rowNum))) {
 		return false;
 	}
-	MyRwLock lock(m_rwMutex, false);
-	size_t upp = upper_bound_a(m_rowNumVec, id);
-	assert(upp < m_rowNumVec.size());
-	llong baseId = m_rowNumVec[upp-1];
+	SegArrayReadGuard version(this);
+	// version->m_rowNumVec.back() may be stale, just search in base ids
+	auto rowNumPtr = version->m_rowNumVec.data();
+	size_t segNum = version->m_segments.size();
+	size_t upp = upper_bound_0(rowNumPtr, segNum, id);
+	assert(upp >= 1 && upp <= segNum);
+	llong baseId = rowNumPtr[upp-1];
 	size_t subId = size_t(id - baseId);
-	auto seg = m_segments[upp-1].get();
-#if !defined(NDEBUG)
-	size_t upperId = m_rowNumVec[upp];
-//	assert(subId < seg->m_isDel.size());
-	if (terark_unlikely(seg->m_isDel.size() != upperId - baseId)) {
-		fprintf(stderr, "INFO: DbTable::exists(id=%lld): "
-			"temporay error: seg->m_isDel.size() = %zd, (upperId - baseId) = %zd\n"
-			, id, seg->m_isDel.size() , size_t(upperId - baseId));
-	}
-#endif
+	auto seg = version->m_segments[upp-1].get();
 	const size_t ProtectNum = 100;
 	if (seg->m_isFreezed || seg->m_isDel.unused() >= ProtectNum) {
 		if (subId >= seg->m_isDel.size()) {
 			return false;
 		}
-		return !seg->m_isDel[subId];
+		return !seg->isDelBit(subId);
 	}
 	else {
 		SpinRwLock lock(seg->m_segMutex, false);
@@ -1234,33 +2537,51 @@ bool DbTable::exists(llong id) const {
 }
 
 llong DbTable::insertRow(fstring row, DbContext* txn) {
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::insert);
+	TERARK_DB_PROBE_SCOPE1(insert, this);
+	checkNotReplica("insertRow");
 	this->throttleWrite();
     auto cols = txn->cols.get();
 	if (txn->syncIndex) { // parseRow doesn't need lock
 		m_schema->m_rowSchema->parseRow(row, cols.get());
 	}
 	IncrementGuard_size_t guard(m_inprogressWritingCount);
+	DbPerfTimer lockPerf(m_perf.get(), DbPerfOp::lockWait);
+	TERARK_DB_PROBE1(lock__wait__start, this);
 	MyRwLock lock(m_rwMutex, false);
+	TERARK_DB_PROBE1(lock__wait__done, this);
+	lockPerf.stop();
 	assert(m_rowNumVec.size() == m_segments.size()+1);
 	return insertRowImpl(row, cols.get(), txn, lock);
 }
 
 llong DbTable::insertRowImpl(fstring row, ColumnVec *cols, DbContext* ctx, MyRwLock& lock) {
 	DebugCheckRowNumVecNoLock(this);
-	maybeCreateNewSegment(lock);
+	maybeCreateNewSegment(lock, rowTimePartition(row, ctx->syncIndex ? cols : NULL, ctx));
 	ctx->trySyncSegCtxNoLock(this);
 	ctx->ensureTransactionNoLock();
 	if (!ctx->syncIndex) {
 		return insertRowDoInsert(row, cols, ctx);
 	}
 	const SchemaConfig& sconf = *m_schema;
+	const UniqueKeyFilter* filter = m_uniqKeyFilter.get();
     auto key = ctx->bufs.get();
-	for (size_t segIdx = 0; segIdx < m_segments.size()-1; ++segIdx) {
-		auto seg = m_segments[segIdx].get();
-		for(size_t indexId : sconf.m_uniqIndices) {
-			const Schema& iSchema = sconf.getIndexSchema(indexId);
-			assert(iSchema.m_isUnique);
-			iSchema.selectParent(*cols, key.get());
+	for (size_t i = 0; i < sconf.m_uniqIndices.size(); ++i) {
+		size_t indexId = sconf.m_uniqIndices[i];
+		const Schema& iSchema = sconf.getIndexSchema(indexId);
+		assert(iSchema.m_isUnique);
+		iSchema.selectParent(*cols, key.get());
+		if (ctx->uniqNegCacheFind(indexId, *key, m_segArrayUpdateSeq)) {
+			continue;
+		}
+		bool filterMiss = uniqKeyFilterMiss(filter, i, *key);
+		size_t probed = 0;
+		for (size_t segIdx = 0; segIdx < m_segments.size()-1; ++segIdx) {
+			auto seg = m_segments[segIdx].get();
+			if (filterMiss && filter->covers(seg)) {
+				continue;
+			}
+			probed++;
 			seg->indexSearchExact(segIdx, indexId, *key, &ctx->exactMatchRecIdvec, ctx);
 			for(llong logicId : ctx->exactMatchRecIdvec) {
 				if (!seg->m_isDel[logicId]) {
@@ -1275,12 +2596,15 @@ llong DbTable::insertRowImpl(fstring row, ColumnVec *cols, DbContext* ctx, MyRwL
 				}
 			}
 		}
+		if (probed) {
+			ctx->uniqNegCachePut(indexId, *key, m_segArrayUpdateSeq);
+		}
 	}
 	return insertRowDoInsert(row, cols, ctx);
 }
 
 llong DbTable::insertRowDoInsert(fstring row, ColumnVec *cols, DbContext* ctx) {
-    llong subId = allocInvisibleWrSubId_NoTabLock();
+    llong subId = allocInvisibleWrSubId_NoTabLock(ctx);
 	TransactionGuard txn(ctx->m_transaction.get(), subId);
 	llong recId = insertRowDoInsertNoCommit(subId, row, cols, ctx);
 	if (recId >= 0) {
@@ -1292,6 +2616,12 @@ llong DbTable::insertRowDoInsert(fstring row, ColumnVec *cols, DbContext* ctx) {
 				, "commit failed: %s, baseId=%lld, subId=%lld, seg = %s"
 				, txn.szError(), wrBaseId, subId, ws.m_segDir.string().c_str());
 		}
+		if (ctx->syncIndex && m_schema->m_asyncIndex) {
+			asyncIndexPost(subId);
+		}
+		if (m_changeLog) {
+			m_changeLog->append(ChangeOp::insert, recId, row);
+		}
 	}
 	else {
 		txn.rollback();
@@ -1318,6 +2648,46 @@ llong DbTable::allocInvisibleWrSubId_NoTabLock() {
 	}
 }
 
+// reserve SchemaConfig::m_insertIdReserveNum subId for the ctx in one
+// m_segMutex lock, concurrent inserters do not contend on m_segMutex and
+// m_rowNum for each insertion, unused reserved subId are just deleted rows
+llong DbTable::allocInvisibleWrSubId_NoTabLock(DbContext* ctx) {
+	const size_t reserveNum = m_schema->m_insertIdReserveNum;
+	if (reserveNum <= 1) {
+		return allocInvisibleWrSubId_NoTabLock();
+	}
+	auto& ids = ctx->m_reservedWrSubIds;
+	if (ctx->m_reservedWrSubIdGen != m_wrSubIdReserveGen) {
+		ids.erase_all();
+		ctx->m_reservedWrSubIdGen = m_wrSubIdReserveGen;
+	}
+	if (terark_likely(!ids.empty())) {
+		return ids.pop_val();
+	}
+	auto& ws = *m_wrSeg;
+	SpinRwLock wsLock(ws.m_segMutex, true);
+	ids.reserve(reserveNum);
+	while (!ws.m_deletedWrIdSet.empty() && ids.size() < reserveNum) {
+		uint32_t subId = ws.m_deletedWrIdSet.pop_val();
+		assert(ws.m_isDel[subId]);
+		ids.push_back(subId);
+	}
+	if (ids.size() < reserveNum) {
+		size_t newNum = reserveNum - ids.size();
+		size_t subId = ws.m_isDel.size();
+		for (size_t i = 0; i < newNum; ++i) {
+			ws.pushIsDel(true); // invisible to others
+			ids.push_back(uint32_t(subId + i));
+		}
+		ws.m_delcnt += newNum;
+		m_rowNum += newNum;
+		m_rowNumVec.back() = m_rowNum;
+	}
+	assert(ws.m_isDel.popcnt() == ws.m_delcnt);
+	std::sort(ids.begin(), ids.end(), std::greater<uint32_t>());
+	return ids.pop_val();
+}
+
 void DbTable::freeInvisibleWrSubId_NoTabLock(llong wrSubId) {
 	auto& ws = *m_wrSeg;
 	SpinRwLock wsLock(ws.m_segMutex, true);
@@ -1340,6 +2710,83 @@ void DbTable::freeInvisibleWrSubId_NoTabLock(llong wrSubId) {
 #endif
 }
 
+// floor of value / m_timePartitionSeconds, values of Uint64 larger than
+// LLONG_MAX are clamped
+llong DbTable::rowTimePartition(fstring row, const ColumnVec* cols, DbContext* ctx) const {
+	const size_t columnId = m_schema->m_timePartitionColumnId;
+	if (size_t(-1) == columnId) {
+		return LLONG_MIN;
+	}
+	const Schema& rowSchema = *m_schema->m_rowSchema;
+	auto parsed = ctx->cols.get();
+	if (NULL == cols) {
+		rowSchema.parseRow(row, parsed.get());
+		cols = parsed.get();
+	}
+	const byte* data = (*cols)[columnId].udata();
+	llong v;
+	switch (rowSchema.getColumnMeta(columnId).type) {
+	default:
+		assert(false); // checked by SchemaConfig
+		return LLONG_MIN;
+	case ColumnType::Uint08: v = *data; break;
+	case ColumnType::Sint08: v = int8_t(*data); break;
+	case ColumnType::Uint16: v = unaligned_load<uint16_t>(data); break;
+	case ColumnType::Sint16: v = unaligned_load< int16_t>(data); break;
+	case ColumnType::Uint32: v = unaligned_load<uint32_t>(data); break;
+	case ColumnType::Sint32: v = unaligned_load< int32_t>(data); break;
+	case ColumnType::Sint64: v = unaligned_load< int64_t>(data); break;
+	case ColumnType::Uint64:
+		v = llong(std::min<ullong>(unaligned_load<uint64_t>(data), LLONG_MAX));
+		break;
+	}
+	const llong seconds = m_schema->m_timePartitionSeconds;
+	llong part = v / seconds;
+	return v % seconds < 0 ? part - 1 : part;
+}
+
+// called in the table lock, the partition of m_wrSeg is raised atomically
+void DbTable::raiseWrSegTimePartition(fstring row, const ColumnVec* cols, DbContext* ctx) {
+	llong part = rowTimePartition(row, cols, ctx);
+	if (LLONG_MIN == part) {
+		return;
+	}
+	auto& cur = m_wrSeg->m_timePartition;
+	llong old = cur.load(std::memory_order_relaxed);
+	while (part > old && !cur.compare_exchange_weak(old, part, std::memory_order_relaxed)) {}
+}
+
+// file TimePartition of the segment dir is written once, when the segment
+// is frozen or built, it is shared by symlinks of later merge dirs
+static const char g_timePartitionFile[] = "TimePartition";
+
+void DbTable::saveTimePartition(const ReadableSegment* seg) const {
+	llong part = seg->m_timePartition.load();
+	if (LLONG_MIN == part) {
+		return;
+	}
+	std::string fpath = (seg->m_segDir / g_timePartitionFile).string();
+	if (FILE* fp = fopen(fpath.c_str(), "w")) {
+		fprintf(fp, "%lld\n", part);
+		fclose(fp);
+	}
+	else {
+		fprintf(stderr, "WARN: saveTimePartition: fopen(%s) = %s\n"
+			, fpath.c_str(), strerror(errno));
+	}
+}
+
+void DbTable::loadTimePartition(ReadableSegment* seg) const {
+	std::string fpath = (seg->m_segDir / g_timePartitionFile).string();
+	llong part = LLONG_MIN;
+	if (FILE* fp = fopen(fpath.c_str(), "r")) {
+		if (fscanf(fp, "%lld", &part) != 1)
+			part = LLONG_MIN;
+		fclose(fp);
+	}
+	seg->m_timePartition = part;
+}
+
 llong DbTable::insertRowDoInsertNoCommit(llong subId, fstring row, ColumnVec *cols, DbContext* ctx) {
 	if (ctx->syncIndex) {
 		DbTransaction* txn = ctx->m_transaction.get();
@@ -1356,6 +2803,7 @@ llong DbTable::insertRowDoInsertNoCommit(llong subId, fstring row, ColumnVec *co
 		m_wrSeg->update(subId, row, ctx);
 		m_wrSeg->delmarkSet0(subId);
 	}
+	raiseWrSegTimePartition(row, ctx->syncIndex ? cols : NULL, ctx);
 	m_accumulateWrittenBytes += row.size();
 	llong  wrBaseId = m_rowNumVec.ende(2);
 	return wrBaseId + subId;
@@ -1378,6 +2826,14 @@ DbTable::insertSyncIndex(llong subId, ColumnVec *cols, DbTransaction* txn, DbCon
 			goto Fail;
 		}
 	}
+	if (sconf.m_asyncIndex) {
+		asyncIndexMark(subId); // non-unique index is inserted later
+		return true;
+	}
+	if (ctx->m_indexBatchOn && !sconf.m_multIndices.empty()) {
+		stageIndexBatchNoLock(subId, *cols, ctx);
+		return true;
+	}
 	// insert non-unique index
 	for (i = 0; i < sconf.m_multIndices.size(); ++i) {
 		size_t indexId = sconf.m_multIndices[i];
@@ -1400,6 +2856,9 @@ Fail:
 
 // dup keys in unique index errors will be ignored
 llong DbTable::upsertRow(fstring row, DbContext* ctx) {
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::upsert);
+	TERARK_DB_PROBE_SCOPE1(upsert, this);
+	checkNotReplica("upsertRow");
 	for (int retry = 0; ; ++retry) {
 		llong recId = doUpsertRow(row, ctx);
 		if (recId >= 0) {
@@ -1452,14 +2911,26 @@ llong DbTable::doUpsertRow(fstring row, DbContext* ctx) {
 	sconf.m_rowSchema->parseRow(row, cols1.get());
 	const Schema& indexSchema = sconf.getIndexSchema(uniqueIndexId);
 	indexSchema.selectParent(*cols1, key1.get());
+	// segments may be covered by m_uniqKeyFilter after the lock is
+	// released, so which segments are skipped is decided in the lock
+	auto skipSeg = ctx->bufs.get();
 	{
 		MyRwLock lock(m_rwMutex, false);
 		ctx->trySyncSegCtxNoLock(this);
 		ctx->ensureTransactionNoLock();
+		const UniqueKeyFilter* filter = m_uniqKeyFilter.get();
+		bool filterMiss = uniqKeyFilterMiss(filter, 0, *key1);
+		skipSeg->resize(ctx->m_segCtx.size());
+		for (size_t segIdx = 0; segIdx < ctx->m_segCtx.size(); ++segIdx) {
+			(*skipSeg)[segIdx] = filterMiss && filter->covers(ctx->m_segCtx[segIdx]->seg);
+		}
 	}
 	for (size_t segIdx = 0; segIdx < ctx->m_segCtx.size()-1; ++segIdx) {
 		auto seg = ctx->m_segCtx[segIdx]->seg;
 		assert(seg->m_isFreezed);
+		if ((*skipSeg)[segIdx]) {
+			continue;
+		}
 		seg->indexSearchExact(segIdx, uniqueIndexId, *key1, &ctx->exactMatchRecIdvec, ctx);
 		if (!ctx->exactMatchRecIdvec.empty()) {
 			llong subId = ctx->exactMatchRecIdvec[0];
@@ -1469,7 +2940,7 @@ llong DbTable::doUpsertRow(fstring row, DbContext* ctx) {
 			if (ctx->segArrayUpdateSeq != m_segArrayUpdateSeq) {
 				ctx->doSyncSegCtxNoLock(this);
 				llong recId = baseId + subId;
-				size_t upp = upper_bound_a(ctx->m_rowNumVec, recId);
+				size_t upp = ctx->m_segLocator.upper_bound(recId);
 #if !defined(NDEBUG)
 				if (seg != ctx->m_segCtx[upp-1]->seg) {
 					seg = ctx->m_segCtx[upp-1]->seg; // for set break point
@@ -1490,20 +2961,16 @@ llong DbTable::doUpsertRow(fstring row, DbContext* ctx) {
 			if (newRecId >= 0) {
 				{
 					SpinRwLock segLock(seg->m_segMutex, true);
-					seg->m_delcnt++;
-					seg->m_isDel.set1(subId);
+					seg->atomicSetIsDel1(subId);
 					seg->addtoUpdateList(subId);
+					stampDeletionNoLock(seg, size_t(subId));
 				}
 				DebugCheckUnique(ctx, row, uniqueIndexId);
 				ctx->isUpsertOverwritten = 2;
 				if (checkPurgeDeleteNoLock(seg)) {
-					lock.upgrade_to_writer();
-					inLockPutPurgeDeleteTaskToQueue();
-					maybeCreateNewSegmentInWriteLock();
-				}
-				else {
-					maybeCreateNewSegment(lock);
+					requestPurgeCheck();
 				}
+				maybeCreateNewSegment(lock);
 			}
 			return newRecId;
 		}
@@ -1546,6 +3013,10 @@ llong DbTable::doUpsertRow(fstring row, DbContext* ctx) {
 			, "commit failed: %s, baseId=%lld, subId=%lld, seg = %s, caller should retry"
 			, txn.szError(), baseId, subId, m_wrSeg->m_segDir.string().c_str());
 	}
+	raiseWrSegTimePartition(row, cols1.get(), ctx);
+	if (m_changeLog) {
+		m_changeLog->append(ChangeOp::update, baseId + subId, row);
+	}
 	ctx->isUpsertOverwritten = 1;
 	maybeCreateNewSegment(lock);
 	return baseId + subId;
@@ -1562,11 +3033,18 @@ DbTable::upsertRowMultiUniqueIndices(fstring row, valvec<llong>* resRecIdvec, Db
 
 llong
 DbTable::updateRow(llong id, fstring row, DbContext* ctx) {
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::update);
+	TERARK_DB_PROBE_SCOPE2(update, this, id);
+	checkNotReplica("updateRow");
 	this->throttleWrite();
     auto cols1 = ctx->cols.get();
 	m_schema->m_rowSchema->parseRow(row, cols1.get()); // new row
 	IncrementGuard_size_t guard(m_inprogressWritingCount);
+	DbPerfTimer lockPerf(m_perf.get(), DbPerfOp::lockWait);
+	TERARK_DB_PROBE1(lock__wait__start, this);
 	MyRwLock lock(m_rwMutex, false);
+	TERARK_DB_PROBE1(lock__wait__done, this);
+	lockPerf.stop();
 	DebugCheckRowNumVecNoLock(this);
 	assert(m_rowNumVec.size() == m_segments.size()+1);
 	assert(id < m_rowNumVec.back());
@@ -1595,6 +3073,9 @@ DbTable::updateRow(llong id, fstring row, DbContext* ctx) {
             auto row2 = ctx->bufs.get();
 			seg->getValue(subId, row2.get(), ctx);
 			m_schema->m_rowSchema->parseRow(*row2, cols2.get()); // old row
+			if (m_schema->m_hotColumnUpdateRatio > 0) {
+				countColumnUpdates(*cols1, *cols2);
+			}
 
 			if (!updateCheckSegDup(0, m_segments.size()-1, cols2.get(), ctx))
 				return -1;
@@ -1609,6 +3090,13 @@ DbTable::updateRow(llong id, fstring row, DbContext* ctx) {
 		}
 	}
 	else {
+		if (m_schema->m_hotColumnUpdateRatio > 0 && !seg->m_isDel[subId]) {
+			auto cols2 = ctx->cols.get();
+			auto row2 = ctx->bufs.get();
+			seg->getValue(subId, row2.get(), ctx);
+			m_schema->m_rowSchema->parseRow(*row2, cols2.get()); // old row
+			countColumnUpdates(*cols1, *cols2);
+		}
 		directUpgrade = lock.upgrade_to_writer();
 	}
 	if (!directUpgrade) {
@@ -1627,6 +3115,10 @@ DbTable::updateRow(llong id, fstring row, DbContext* ctx) {
 			m_wrSeg->m_isDirty = true;
 			m_wrSeg->update(subId, row, ctx);
 		}
+		raiseWrSegTimePartition(row, cols1.get(), ctx);
+		if (m_changeLog) {
+			m_changeLog->append(ChangeOp::update, id, row);
+		}
 		return id; // id is not changed
 	}
 	else {
@@ -1639,14 +3131,95 @@ DbTable::updateRow(llong id, fstring row, DbContext* ctx) {
 			// mark old subId as deleted
 			SpinRwLock segLock(seg->m_segMutex);
 			seg->addtoUpdateList(size_t(subId));
-			seg->m_isDel.set1(subId);
-			seg->m_delcnt++;
-			assert(seg->m_isDel.popcnt() == seg->m_delcnt);
+			seg->atomicSetIsDel1(subId);
+			stampDeletionNoLock(seg, size_t(subId));
 		}
 		return recId;
 	}
 }
 
+// true if key of m_uniqIndices[uniqIdx] is in none of segments covered by f
+bool
+DbTable::uniqKeyFilterMiss(const UniqueKeyFilter* f, size_t uniqIdx, fstring key) {
+	return f && !f->m_filters[uniqIdx]->mayContain(key);
+}
+
+// cover frozen ReadonlySegments by m_uniqKeyFilter, a new filter of twice
+// of current keys is built when the current filter is full. Merge, purge
+// and convert keep coverage of their inputs, so just new segments, such as
+// converted and bulk loaded segments, are scanned here.
+void DbTable::updateUniqueKeyFilter() {
+	const SchemaConfig& sconf = *m_schema;
+	static const long bitsPerKey =
+		getEnvLong("TerarkDB_UniqueKeyFilterBitsPerKey", 10);
+	if (sconf.m_uniqIndices.empty() || bitsPerKey <= 0) {
+		return;
+	}
+	std::unique_lock<std::mutex> fillLock(m_uniqKeyFilterMutex, std::try_to_lock);
+	if (!fillLock.owns_lock()) {
+		return; // another task is updating
+	}
+	UniqueKeyFilterPtr filter;
+	valvec<ReadableSegmentPtr> allSegs, newSegs;
+	size_t allRows = 0, newRows = 0;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		if (m_tobeDrop) {
+			return;
+		}
+		filter = m_uniqKeyFilter;
+		for (size_t i = 0; i + 1 < m_segments.size(); ++i) {
+			auto seg = m_segments[i]->getReadonlySegment();
+			if (!seg)
+				continue;
+			size_t rows = size_t(seg->getPhysicRows());
+			allSegs.push_back(seg);
+			allRows += rows;
+			if (!filter || !filter->covers(seg)) {
+				newSegs.push_back(seg);
+				newRows += rows;
+			}
+		}
+	}
+	if (newSegs.empty()) {
+		return;
+	}
+	bool isNewFilter = false;
+	if (!filter || filter->m_numKeys + newRows > filter->m_capacity) {
+		filter = new UniqueKeyFilter();
+		filter->m_gen = ++m_uniqKeyFilterGenSeq;
+		filter->m_capacity = std::max<size_t>(2 * allRows, 65536);
+		for (size_t i = 0; i < sconf.m_uniqIndices.size(); ++i) {
+			IndexBloomFilterPtr bf = new IndexBloomFilter();
+			bf->init(filter->m_capacity, int(bitsPerKey));
+			filter->m_filters.push_back(bf);
+		}
+		newSegs.swap(allSegs);
+		isNewFilter = true;
+	}
+	DbContextPtr ctx(this->createDbContext());
+	valvec<byte> key;
+	llong id = -1;
+	for (auto& seg : newSegs) {
+		for (size_t i = 0; i < sconf.m_uniqIndices.size(); ++i) {
+			size_t indexId = sconf.m_uniqIndices[i];
+			IndexBloomFilter* bf = filter->m_filters[i].get();
+			IndexIteratorPtr iter(seg->m_indices[indexId]->createIndexIterForward(ctx.get()));
+			while (iter->increment(&id, &key)) {
+				bf->add(key);
+			}
+		}
+		filter->m_numKeys += size_t(seg->getReadonlySegment()->getPhysicRows());
+	}
+	MyRwLock lock(m_rwMutex, true);
+	if (isNewFilter) {
+		m_uniqKeyFilter = filter;
+	}
+	for (auto& seg : newSegs) {
+		seg->m_uniqKeyFilterGen = filter->m_gen;
+	}
+}
+
 bool
 DbTable::updateCheckSegDup(size_t begSeg, size_t numSeg, ColumnVec *cols, DbContext* ctx) {
 	// m_wrSeg will be check in unique index insert
@@ -1655,15 +3228,20 @@ DbTable::updateCheckSegDup(size_t begSeg, size_t numSeg, ColumnVec *cols, DbCont
 	if (0 == numSeg)
 		return true;
 	const SchemaConfig& sconf = *m_schema;
+	const UniqueKeyFilter* filter = m_uniqKeyFilter.get();
     auto key = ctx->bufs.get();
 	for(size_t i = 0; i < sconf.m_uniqIndices.size(); ++i) {
 		size_t indexId = sconf.m_uniqIndices[i];
 		const Schema& iSchema = sconf.getIndexSchema(indexId);
+		iSchema.selectParent(*cols, key.get());
+		bool filterMiss = uniqKeyFilterMiss(filter, i, *key);
 		for (size_t segIdx = begSeg; segIdx < endSeg; ++segIdx) {
 			auto seg = &*m_segments[segIdx];
 			assert(iSchema.m_isUnique);
 			assert(seg->m_isFreezed);
-			iSchema.selectParent(*cols, key.get());
+			if (filterMiss && filter->covers(seg)) {
+				continue;
+			}
 			seg->indexSearchExact(segIdx, indexId, *key, &ctx->exactMatchRecIdvec, ctx);
 			for(llong physicId : ctx->exactMatchRecIdvec) {
 				llong logicId = seg->getLogicId(physicId);
@@ -1755,6 +3333,16 @@ DbTable::updateSyncMultIndex(llong subId, ColumnVec *cols1, ColumnVec *cols2, Db
 	const SchemaConfig& sconf = *m_schema;
     auto key1 = ctx->bufs.get();
     auto key2 = ctx->bufs.get();
+	if (asyncIndexClaim(subId)) {
+		// keys of the old row were not inserted
+		for (size_t i = 0; i < sconf.m_multIndices.size(); ++i) {
+			size_t indexId = sconf.m_multIndices[i];
+			const Schema& iSchema = sconf.getIndexSchema(indexId);
+			iSchema.selectParent(*cols1, key1.get()); // new
+			txn->indexInsert(indexId, *key1);
+		}
+		return;
+	}
 	for (size_t i = 0; i < sconf.m_multIndices.size(); ++i) {
 		size_t indexId = sconf.m_multIndices[i];
 		const Schema& iSchema = sconf.getIndexSchema(indexId);
@@ -1767,25 +3355,366 @@ DbTable::updateSyncMultIndex(llong subId, ColumnVec *cols1, ColumnVec *cols2, Db
 	}
 }
 
-static profiling g_pf;
+// the bit is set in the transaction of the insert, then the subId is queued
+// after the commit. A writer of the row and the indexer both claim the bit
+// under the row lock of their transactions, so the row is indexed once
+void DbTable::asyncIndexMark(llong subId) {
+	std::lock_guard<std::mutex> lock(m_asyncIndexMutex);
+	if (m_asyncIndexPending.size() <= size_t(subId)) {
+		m_asyncIndexPending.resize(size_t(subId) + 1, false);
+	}
+	if (!m_asyncIndexPending.is1(size_t(subId))) {
+		m_asyncIndexPending.set1(size_t(subId));
+		m_asyncIndexMarks++;
+	}
+}
 
-/// @returns number of sleep and retries for throttle
-size_t DbTable::throttleWrite() {
-	const SchemaConfig& sconf = *m_schema;
-	size_t retry = 0, sleepMicrosec = 500;
-	for (; ; retry++) {
-		size_t throttleRate = sconf.m_writeThrottleBytesPerSecond;
-		if (0 == throttleRate)
-			return retry;
-		ullong newBytes =
-			m_accumulateWrittenBytes.load(std::memory_order_relaxed) -
-			m_lastWriteThrottleBytes.load(std::memory_order_relaxed);
-		if (terark_likely(newBytes < 256*1024)) {
-			return retry;
+void DbTable::asyncIndexPost(llong subId) {
+	{
+		std::lock_guard<std::mutex> lock(m_asyncIndexMutex);
+		m_asyncIndexQueue.push_back(uint32_t(subId));
+		m_asyncIndexPosted++;
+		if (m_asyncIndexRunning) {
+			return;
 		}
-		ullong prev = m_lastWriteThrottleTimePoint.load(std::memory_order_relaxed);
-		if (terark_unlikely(0 == prev)) {
-			m_lastWriteThrottleTimePoint.store(g_pf.now());
+		m_asyncIndexRunning = true;
+	}
+	DbTablePtr tab(this); // alive until the indexer is ended
+	AsyncExecutor::instance().post([tab]() { tab->asyncIndexRun(); });
+}
+
+// rows are marked by SchemaConfig::m_asyncIndex or by beginIndexBatch
+bool DbTable::asyncIndexClaim(llong subId) {
+	if (0 == m_asyncIndexMarks) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(m_asyncIndexMutex);
+	if (size_t(subId) < m_asyncIndexPending.size() &&
+			m_asyncIndexPending[size_t(subId)]) {
+		m_asyncIndexPending.set0(size_t(subId));
+		m_asyncIndexMarks--;
+		return true;
+	}
+	return false;
+}
+
+// batches are taken and indexed under the reader lock, so the writer lock
+// of asyncIndexDrainInLock sees no popped but unindexed subId
+void DbTable::asyncIndexRun() {
+	const size_t batchSize = 64;
+	DbContextPtr ctx(createDbContext());
+	valvec<uint32_t> batch;
+	for (;;) {
+		MyRwLock lock(m_rwMutex, false);
+		batch.erase_all();
+		{
+			std::lock_guard<std::mutex> qlock(m_asyncIndexMutex);
+			if (m_asyncIndexQueue.empty()) {
+				m_asyncIndexRunning = false;
+				return;
+			}
+			while (!m_asyncIndexQueue.empty() && batch.size() < batchSize) {
+				batch.push_back(m_asyncIndexQueue.front());
+				m_asyncIndexQueue.pop_front();
+			}
+		}
+		ctx->trySyncSegCtxNoLock(this);
+		ctx->ensureTransactionNoLock();
+		for (uint32_t subId : batch) {
+			try {
+				asyncIndexOneRow(subId, ctx.get());
+			}
+			catch (const std::exception& ex) {
+				fprintf(stderr, "ERROR: asyncIndex: subId = %u, seg = %s: %s\n"
+					, subId, m_wrSeg->m_segDir.string().c_str(), ex.what());
+			}
+		}
+		{
+			std::lock_guard<std::mutex> qlock(m_asyncIndexMutex);
+			m_asyncIndexDone += batch.size();
+		}
+		m_asyncIndexCond.notify_all();
+	}
+}
+
+void DbTable::asyncIndexOneRow(llong subId, DbContext* ctx) {
+	const SchemaConfig& sconf = *m_schema;
+	TransactionGuard txn(ctx->m_transaction.get(), subId);
+	if (!asyncIndexClaim(subId) || m_wrSeg->testIsDel(size_t(subId))) {
+		txn.rollback(); // indexed by a writer, or removed
+		return;
+	}
+	auto cols = ctx->cols.get();
+	auto row = ctx->bufs.get();
+	auto key = ctx->bufs.get();
+	try {
+		txn.storeGetRow(row.get());
+	}
+	catch (const ReadRecordException&) {
+		txn.rollback();
+		throw;
+	}
+	sconf.m_rowSchema->parseRow(*row, cols.get());
+	for (size_t i = 0; i < sconf.m_multIndices.size(); ++i) {
+		size_t indexId = sconf.m_multIndices[i];
+		const Schema& iSchema = sconf.getIndexSchema(indexId);
+		iSchema.selectParent(*cols, key.get());
+		txn.indexInsert(indexId, *key);
+	}
+	m_wrSeg->m_isDirty = true;
+	if (!txn.commit()) {
+		fprintf(stderr, "WARN: asyncIndex: commit failed: %s, subId = %lld, seg = %s\n"
+			, txn.szError(), subId, m_wrSeg->m_segDir.string().c_str());
+	}
+}
+
+// m_wrSeg is going to be frozen, writers and indexers are excluded
+void DbTable::asyncIndexDrainInLock() {
+	DbContextPtr ctx;
+	auto oneRow = [&](uint32_t subId) {
+		if (!ctx) {
+			ctx = createDbContextNoLock();
+			ctx->trySyncSegCtxNoLock(this);
+			ctx->ensureTransactionNoLock();
+		}
+		asyncIndexOneRow(subId, ctx.get());
+	};
+	size_t num = 0;
+	for (;;) {
+		uint32_t subId;
+		{
+			std::lock_guard<std::mutex> lock(m_asyncIndexMutex);
+			if (m_asyncIndexQueue.empty()) {
+				m_asyncIndexDone += num;
+				break;
+			}
+			subId = m_asyncIndexQueue.front();
+			m_asyncIndexQueue.pop_front();
+		}
+		oneRow(subId);
+		num++;
+	}
+	if (num) {
+		m_asyncIndexCond.notify_all();
+	}
+	// rows staged by beginIndexBatch are not queued, flushIndexBatch drops
+	// the keys staged for this segment
+	valvec<uint32_t> staged;
+	{
+		std::lock_guard<std::mutex> lock(m_asyncIndexMutex);
+		for (size_t i = 0; m_asyncIndexMarks && i < m_asyncIndexPending.size(); ++i) {
+			if (m_asyncIndexPending[i])
+				staged.push_back(uint32_t(i));
+		}
+	}
+	for (uint32_t subId : staged) {
+		oneRow(subId);
+	}
+	std::lock_guard<std::mutex> lock(m_asyncIndexMutex);
+	m_asyncIndexPending.erase_all();
+	m_asyncIndexMarks = 0;
+}
+
+llong DbTable::asyncIndexLag() const {
+	std::lock_guard<std::mutex> lock(m_asyncIndexMutex);
+	return m_asyncIndexPosted - m_asyncIndexDone;
+}
+
+void DbTable::waitAsyncIndex() const {
+	std::unique_lock<std::mutex> lock(m_asyncIndexMutex);
+	const llong target = m_asyncIndexPosted;
+	m_asyncIndexCond.wait(lock, [&]() { return m_asyncIndexDone >= target; });
+}
+
+void DbTable::beginIndexBatch(DbContext* ctx) {
+	assert(ctx->m_tab == this);
+	ctx->m_indexBatchOn = true;
+}
+
+void DbTable::flushIndexBatch(DbContext* ctx) {
+	ctx->m_indexBatchOn = false;
+	if (ctx->m_indexBatchSubIds.empty()) {
+		ctx->m_indexBatchSeg = nullptr;
+		return;
+	}
+	MyRwLock lock(m_rwMutex, false);
+	flushIndexBatchNoLock(ctx);
+}
+
+// a staged row is marked as asyncIndex, so a writer of the row before the
+// flush claims it and inserts its keys, same as asyncIndexOneRow
+void DbTable::stageIndexBatchNoLock(llong subId, const ColumnVec& cols, DbContext* ctx) {
+	const size_t maxRows = 4096;
+	const SchemaConfig& sconf = *m_schema;
+	if (ctx->m_indexBatchSeg.get() != m_wrSeg.get() ||
+			ctx->m_indexBatchSubIds.size() >= maxRows) {
+		flushIndexBatchNoLock(ctx);
+		ctx->m_indexBatchSeg = m_wrSeg;
+	}
+	auto key = ctx->bufs.get();
+	for (size_t indexId : sconf.m_multIndices) {
+		sconf.getIndexSchema(indexId).selectParent(cols, key.get());
+		ctx->m_indexBatchKeys.push_back(*key);
+	}
+	ctx->m_indexBatchSubIds.push_back(subId);
+	asyncIndexMark(subId);
+}
+
+// claimed rows are inserted under m_asyncIndexMutex, a writer of such a row
+// waits on its claim, then it removes the old keys which are inserted here.
+// Rows staged for a frozen segment were indexed by asyncIndexDrainInLock
+void DbTable::flushIndexBatchNoLock(DbContext* ctx) {
+	const SchemaConfig& sconf = *m_schema;
+	const size_t multNum = sconf.m_multIndices.size();
+	const size_t rows = ctx->m_indexBatchSubIds.size();
+	const llong* subIds = ctx->m_indexBatchSubIds.data();
+	if (rows && ctx->m_indexBatchSeg.get() == m_wrSeg.get()) {
+		valvec<byte> claimed(rows, valvec_no_init());
+		valvec<fstring> keys;
+		valvec<llong> ids;
+		std::lock_guard<std::mutex> lock(m_asyncIndexMutex);
+		// a subId which is reused in the batch is claimed by its last row
+		for (size_t r = rows; r-- > 0; ) {
+			size_t subId = size_t(subIds[r]);
+			claimed[r] = subId < m_asyncIndexPending.size()
+					  && m_asyncIndexPending[subId]
+					  && !m_wrSeg->testIsDel(subId);
+			if (claimed[r]) {
+				m_asyncIndexPending.set0(subId);
+				m_asyncIndexMarks--;
+			}
+		}
+		for (size_t j = 0; j < multNum; ++j) {
+			keys.erase_all();
+			ids.erase_all();
+			for (size_t r = 0; r < rows; ++r) {
+				if (claimed[r]) {
+					keys.push_back(fstrvecAt(ctx->m_indexBatchKeys, r * multNum + j));
+					ids.push_back(subIds[r]);
+				}
+			}
+			if (keys.size()) {
+				size_t indexId = sconf.m_multIndices[j];
+				m_wrSeg->m_indices[indexId]->getWritableIndex()->
+					insertBatch(keys.data(), ids.data(), keys.size(), ctx);
+			}
+		}
+		m_wrSeg->m_isDirty = true;
+	}
+	ctx->m_indexBatchKeys.erase_all();
+	ctx->m_indexBatchSubIds.erase_all();
+	ctx->m_indexBatchSeg = nullptr;
+}
+
+
+DbTable::WriteStall DbTable::getWriteStall() const {
+	const SchemaConfig& sconf = *m_schema;
+	WriteStall stall = WriteStall::none;
+	auto trigger = [&stall](ullong val, ullong slowdown, ullong stop) {
+		if (stop && val >= stop)
+			stall = WriteStall::stop;
+		else if (slowdown && val >= slowdown && WriteStall::none == stall)
+			stall = WriteStall::slowdown;
+	};
+	trigger(m_frozenWrSegNum.load(std::memory_order_relaxed),
+			sconf.m_writeSlowdownFrozenSegNum, sconf.m_writeStopFrozenSegNum);
+	ullong quotaBytes = m_quotaWritableBytes.load(std::memory_order_relaxed);
+	if (sconf.m_writeSlowdownWritableBytes || sconf.m_writeStopWritableBytes
+		|| quotaBytes) {
+		ullong wrBytes = m_writableSegBytes.load(std::memory_order_relaxed)
+			+ m_accumulateWrittenBytes.load(std::memory_order_relaxed)
+			- m_writtenBytesAtPublish.load(std::memory_order_relaxed);
+		trigger(wrBytes, sconf.m_writeSlowdownWritableBytes,
+						 sconf.m_writeStopWritableBytes);
+		trigger(wrBytes, quotaBytes, quotaBytes + quotaBytes/4);
+	}
+	if (WriteStall::stop != stall &&
+		(sconf.m_writeSlowdownCompressQueue || sconf.m_writeStopCompressQueue)) {
+		trigger(getCompressQueueSize(), sconf.m_writeSlowdownCompressQueue,
+										sconf.m_writeStopCompressQueue);
+	}
+	switch (WritableMemBudget::pressure()) {
+	default: break;
+	case WritableMemBudget::Pressure::stop:
+		stall = WriteStall::stop;
+		break;
+	case WritableMemBudget::Pressure::slowdown:
+		if (WriteStall::none == stall)
+			stall = WriteStall::slowdown;
+		break;
+	}
+	if (WriteStall::stop == stall && m_compactSuspendCnt) {
+		// backlog can not be reduced when compaction is suspended
+		stall = WriteStall::slowdown;
+	}
+	return stall;
+}
+
+/// @returns number of sleep and retries for throttle
+/// writers are stopped or slowed down by compaction backlog, and limited by
+/// WriteThrottleBytesPerSecond, sleeps are woken by publishSegArrayInLock
+size_t DbTable::throttleWrite() {
+	if (m_changeLog) {
+		m_changeLog->waitForConsumers();
+	}
+	if (WriteRateLimiter* limiter = m_sharedWriteLimiter.get()) {
+		// consume by 64K, writers do not take the limiter mutex on each write
+		ullong curr = m_accumulateWrittenBytes.load(std::memory_order_relaxed);
+		ullong prev = m_sharedLimiterBytes.load(std::memory_order_relaxed);
+		if (curr >= prev + 64*1024 &&
+			m_sharedLimiterBytes.compare_exchange_strong(prev, curr)) {
+			size_t sleepMicrosec = limiter->consume(size_t(curr - prev));
+			if (sleepMicrosec) {
+				m_lastThrottledTime.store(g_pf.now(), std::memory_order_relaxed);
+				if (m_throwOnThrottle) {
+					std::string msg =
+						"WriteThrottleException(DataBase): dbdir = " + m_dir.string();
+					throw WriteThrottleException(msg);
+				}
+				DbPerfTimer perf(m_perf.get(), DbPerfOp::throttle);
+				TERARK_DB_PROBE_SCOPE1(throttle, this);
+				std::this_thread::sleep_for(std::chrono::microseconds(sleepMicrosec));
+			}
+		}
+	}
+	const SchemaConfig& sconf = *m_schema;
+	const size_t quotaRate = m_quotaWriteBytesPerSec.load(std::memory_order_relaxed);
+	size_t retry = 0, sleepMicrosec = 500;
+	for (; ; retry++) {
+		size_t stallSeq = m_writeStallSeq.load(std::memory_order_acquire);
+		size_t throttleRate = sconf.m_writeThrottleBytesPerSecond;
+		if (quotaRate && (0 == throttleRate || quotaRate < throttleRate))
+			throttleRate = quotaRate;
+		WriteStall stall = getWriteStall();
+		if (terark_unlikely(WriteStall::stop == stall)) {
+			m_lastThrottledTime.store(g_pf.now(), std::memory_order_relaxed);
+			if (m_throwOnThrottle) {
+				std::string msg =
+					"WriteThrottleException(stop): dbdir = " + m_dir.string();
+				throw WriteThrottleException(msg);
+			}
+			// the timeout is for the compress queue, it changes silently
+			DbPerfTimer perf(m_perf.get(), DbPerfOp::throttle);
+			TERARK_DB_PROBE_SCOPE1(throttle, this);
+			waitWriteStallChange(stallSeq, 100000);
+			continue;
+		}
+		if (WriteStall::slowdown == stall) {
+			size_t slowRate = sconf.m_writeSlowdownBytesPerSecond;
+			if (slowRate && (0 == throttleRate || slowRate < throttleRate))
+				throttleRate = slowRate;
+		}
+		if (0 == throttleRate)
+			return retry;
+		ullong newBytes =
+			m_accumulateWrittenBytes.load(std::memory_order_relaxed) -
+			m_lastWriteThrottleBytes.load(std::memory_order_relaxed);
+		if (terark_likely(newBytes < 256*1024)) {
+			return retry;
+		}
+		ullong prev = m_lastWriteThrottleTimePoint.load(std::memory_order_relaxed);
+		if (terark_unlikely(0 == prev)) {
+			m_lastWriteThrottleTimePoint.store(g_pf.now());
 		}
 		ullong curr = g_pf.now();
 		ullong dura = g_pf.ns(prev, curr); // nanoseconds
@@ -1797,20 +3726,372 @@ size_t DbTable::throttleWrite() {
 			}
 			return retry;
 		}
+		m_lastThrottledTime.store(curr, std::memory_order_relaxed);
 		if (m_throwOnThrottle) {
 			std::string msg =
 				 "WriteThrottleException: dbdir = " + m_dir.string();
 			throw WriteThrottleException(msg);
 		}
-		tbb::this_tbb_thread::sleep(tbb::tick_count::interval_t(sleepMicrosec*1e-6));
-	//	std::this_thread::sleep_for(std::chrono::microseconds(sleepMicrosec));
-		sleepMicrosec = sleepMicrosec*21/13; // fibonacci ratio
+		DbPerfTimer perf(m_perf.get(), DbPerfOp::throttle);
+		TERARK_DB_PROBE_SCOPE1(throttle, this);
+		if (waitWriteStallChange(stallSeq, sleepMicrosec))
+			sleepMicrosec = 500; // backlog changed, re-evaluate from scratch
+		else
+			sleepMicrosec = std::min<size_t>(sleepMicrosec*21/13, 100000);
 	}
 	abort();
 //	return 0; // never goes here
 }
 
+void DbTable::setQuota(const TableQuota& quota) {
+	m_quotaWriteBytesPerSec = ullong(std::max<llong>(quota.writeBytesPerSecond, 0));
+	m_quotaWritableBytes = ullong(std::max<llong>(quota.writableBytes, 0));
+	m_compressWeight = quota.compressWeight > 0 ? quota.compressWeight : 1.0;
+	std::unique_lock<std::mutex> lock(m_writeStallMutex);
+	m_writeStallSeq++; // writers re-evaluate the stall
+	m_writeStallCond.notify_all();
+}
+
+TableQuota DbTable::getQuota() const {
+	TableQuota quota;
+	quota.writeBytesPerSecond = llong(m_quotaWriteBytesPerSec.load());
+	quota.writableBytes = llong(m_quotaWritableBytes.load());
+	quota.compressWeight = m_compressWeight.load();
+	return quota;
+}
+
+void DbTable::setSharedWriteLimiter(WriteRateLimiter* limiter) {
+	MyRwLock lock(m_rwMutex, true);
+	m_sharedWriteLimiter = limiter;
+	m_sharedLimiterBytes = m_accumulateWrittenBytes.load();
+}
+
+DbEnv* DbTable::getCompactEnv() const {
+	if (m_compactEnv)
+		return m_compactEnv.get();
+	return m_env.get();
+}
+
+ullong DbTable::getCompactThrottleMicros() const {
+	return m_compactEnv ? m_compactEnv->sleepMicros() : 0;
+}
+
+size_t DbTable::getCompactWriteRate() const {
+	return m_compactEnv ? m_compactEnv->limiter()->rate() : 0;
+}
+
+double DbTable::getCompressVirtualTime() const {
+	return m_compressNanos.load(std::memory_order_relaxed) /
+		   m_compressWeight.load(std::memory_order_relaxed);
+}
+
+void DbTable::addCompressTime(ullong nanoseconds) {
+	m_compressNanos.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+/// @returns true if the backlog was updated, false on timeout
+bool DbTable::waitWriteStallChange(size_t stallSeq, size_t timeoutMicrosec) {
+	std::unique_lock<std::mutex> lock(m_writeStallMutex);
+	return m_writeStallCond.wait_for(lock,
+		std::chrono::microseconds(timeoutMicrosec),
+		[&]{ return m_writeStallSeq != stallSeq; });
+}
+
+void DbTable::getSegmentStat(TableSegmentStat* st) const {
+	memset(st, 0, sizeof(*st));
+	SegArrayReadGuard version(this);
+	if (NULL == version.get()) {
+		return;
+	}
+	for (auto& segPtr : version->m_segments) {
+		ReadableSegment* seg = segPtr.get();
+		llong bytes = seg->dataStorageSize();
+		if (seg->getWritableStore()) {
+			st->writableSegNum++;
+			st->writableSegBytes += bytes;
+			if (seg->m_isFreezed)
+				st->frozenWritableSegNum++;
+		}
+		else {
+			st->readonlySegNum++;
+		}
+		st->indexBytes += seg->totalIndexSize();
+		st->storeBytes += bytes;
+		st->rows += seg->m_isDel.size();
+		st->deletedRows += seg->m_delcnt;
+	}
+}
+
+void DbTable::getSegmentLoadStat(std::vector<SegmentLoadStat>* stats) const {
+	stats->clear();
+	std::vector<std::string> segDirs;
+	{
+		SegArrayReadGuard version(this);
+		if (NULL == version.get()) {
+			return;
+		}
+		for (auto& segPtr : version->m_segments) {
+			if (segPtr->getReadonlySegment())
+				segDirs.push_back(segPtr->m_segDir.string());
+		}
+	}
+	// files are mapped and mincore'd, out of SegArrayReadGuard
+	for (const std::string& segDir : segDirs) {
+		SegmentLoadStat st;
+		try {
+			SegmentWarmer::getSegmentStat(segDir, &st);
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "WARN: getSegmentLoadStat(%s): %s\n"
+				, segDir.c_str(), ex.what());
+			continue;
+		}
+		if (m_segWarmer)
+			st.warmedBytes = m_segWarmer->warmedBytes(st.segDir);
+		stats->push_back(std::move(st));
+	}
+}
+
+void DbTable::getMemoryStat(TableMemoryStat* st, bool withResident) const {
+	memset(st, 0, sizeof(*st));
+	st->contextNum = m_ctxNum.load(std::memory_order_relaxed);
+	st->contextBytes = m_ctxMemBytes.load(std::memory_order_relaxed);
+	st->contextIterNum = m_ctxIterNum.load(std::memory_order_relaxed);
+	if (m_valueCache)
+		st->valueCacheBytes = m_valueCache->usedBytes();
+	std::vector<std::string> segDirs;
+	{
+		SegArrayReadGuard version(this);
+		if (NULL == version.get()) {
+			return;
+		}
+		for (auto& segPtr : version->m_segments) {
+			ReadableSegment* seg = segPtr.get();
+			st->bitmapBytes += seg->m_isDel.mem_size() + seg->m_isPurged.mem_size();
+			if (seg->getWritableStore()) {
+				st->writableStoreBytes += seg->dataStorageSize();
+				st->writableIndexBytes += seg->totalIndexSize();
+			}
+			else {
+				st->readonlyStoreBytes += seg->dataStorageSize();
+				st->readonlyIndexBytes += seg->totalIndexSize();
+				segDirs.push_back(seg->m_segDir.string());
+			}
+		}
+	}
+	{
+		MyRwLock lock(m_rwMutex, false);
+		if (const UniqueKeyFilter* filter = m_uniqKeyFilter.get()) {
+			for (auto& bf : filter->m_filters)
+				st->uniqKeyFilterBytes += bf->mem_size();
+		}
+	}
+	// files are mapped and mincore'd out of SegArrayReadGuard, same as
+	// getSegmentLoadStat
+	for (const std::string& segDir : segDirs) {
+		try {
+			for (auto& ent : fs::recursive_directory_iterator(segDir)) {
+				if (!fs::is_regular_file(ent.status()))
+					continue;
+				llong bytes = llong(fs::file_size(ent.path()));
+				bool isIndex = ent.path().filename().string().compare(0, 6, "index-") == 0;
+				(isIndex ? st->readonlyIndexFileBytes : st->readonlyStoreFileBytes) += bytes;
+				if (!withResident || 0 == bytes)
+					continue;
+				size_t size = 0;
+				void* base = mmap_load(ent.path().string(), &size);
+				llong resident = mmap_resident_bytes(base, size);
+				mmap_close(base, size);
+				(isIndex ? st->readonlyIndexResident : st->readonlyStoreResident) += resident;
+			}
+		}
+		catch (const std::exception& ex) {
+			// removed by merge or purge
+			fprintf(stderr, "WARN: getMemoryStat(%s): %s\n", segDir.c_str(), ex.what());
+		}
+	}
+}
+
+IndexStats DbTable::getIndexStats(size_t indexId) const {
+	assert(indexId < m_schema->getIndexNum());
+	const Schema& schema = m_schema->getIndexSchema(indexId);
+	IndexStats res;
+	SegArrayReadGuard version(this);
+	if (NULL == version.get()) {
+		return res;
+	}
+	valvec<const IndexStats*> parts;
+	ullong otherRows = 0;
+	for (auto& segPtr : version->m_segments) {
+		ReadableSegment* seg = segPtr.get();
+		ReadonlySegment* rdseg = seg->getReadonlySegment();
+		if (rdseg && rdseg->m_indexStats) {
+			const IndexStats& st = rdseg->m_indexStats->m_indices[indexId];
+			res.rows += st.rows;
+			res.keyBytes += st.keyBytes;
+			res.hll.merge(st.hll);
+			parts.push_back(&st);
+		}
+		else {
+			otherRows += seg->m_isDel.size() - seg->m_delcnt;
+		}
+	}
+	size_t buckets = getEnvLong("TerarkDB_IndexStatsBuckets", 64);
+	res.mergeHistograms(schema, parts.data(), parts.size(), buckets);
+	if (parts.empty()) {
+		res.rows = otherRows;
+		res.distinctKeys = double(otherRows); // no stats, assume unique
+		return res;
+	}
+	double distinct = schema.m_isUnique ? double(res.rows) : res.hll.estimate();
+	if (otherRows && res.rows) {
+		double scale = double(res.rows + otherRows) / res.rows;
+		distinct *= scale;
+		res.keyBytes = ullong(res.keyBytes * scale);
+		for (ullong& n : res.bucketRows)
+			n = ullong(n * scale + 0.5);
+		res.rows += otherRows;
+	}
+	res.distinctKeys = std::min(distinct, double(res.rows));
+	return res;
+}
+
+double DbTable::getColgroupAvgRowSize(size_t cgId) const {
+	assert(cgId < m_schema->getColgroupNum());
+	SegArrayReadGuard version(this);
+	if (NULL == version.get()) {
+		return 0;
+	}
+	double bytes = 0, rows = 0;
+	for (auto& segPtr : version->m_segments) {
+		ColgroupSegment* seg = segPtr->getColgroupSegment();
+		if (seg && cgId < seg->m_colgroups.size() && seg->m_colgroups[cgId]) {
+			bytes += seg->m_colgroups[cgId]->dataInflateSize();
+			rows += seg->m_colgroups[cgId]->numDataRows();
+		}
+	}
+	return rows ? bytes / rows : 0;
+}
+
+SegArrayVersionPtr DbTable::getSegArrayVersion() const {
+	SegArrayReadGuard version(this);
+	return const_cast<SegArrayVersion*>(version.get());
+}
+
+void DbTable::enableChangeLog(size_t maxRecords, size_t maxBytes) {
+	MyRwLock lock(m_rwMutex, true);
+	if (!m_changeLog) {
+		size_t maxBlockMillisec = (size_t)getEnvLong("TerarkDB_ChangeLogMaxBlockMillisec", 1000);
+		m_changeLog = new ChangeLog(maxRecords, maxBytes, maxBlockMillisec);
+	}
+}
+
+ChangeCursorPtr DbTable::subscribeChanges(ullong fromSeq, bool backpressure) {
+	if (!m_changeLog) {
+		THROW_STD(invalid_argument, "change log of %s is not enabled", m_dir.string().c_str());
+	}
+	return new ChangeCursor(m_changeLog.get(), fromSeq, backpressure);
+}
+
+// lock must be a write lock, it may be released and re-acquired on retry,
+// returns true if m_wrSeg is NULL, empty or frozen
+bool DbTable::tryFreezeWrSegInLock(MyRwLock& lock) {
+	for (int retry = 0; m_wrSeg; ++retry) {
+		if (m_wrSeg->m_isDel.empty()) {
+			break;
+		}
+		if (!m_isMerging && 0 == m_inprogressWritingCount &&
+				m_segments.size() < m_segments.capacity()) {
+			doCreateNewSegmentInLock();
+			break;
+		}
+		if (retry == 10) {
+			return false;
+		}
+		lock.release();
+		tbb::this_tbb_thread::sleep(tbb::tick_count::interval_t(0.001));
+		lock.acquire(m_rwMutex, true);
+	}
+	return true;
+}
+
+llong DbTable::acquireSnapshot() {
+	MyRwLock lock(m_rwMutex, true);
+	// writable segment is updated and purged inplace, freeze it, then all
+	// rows visible to the snapshot are in frozen segments
+	if (m_schema->m_enableSnapshot && !tryFreezeWrSegInLock(lock)) {
+		fprintf(stderr
+			, "WARN: acquireSnapshot: can not freeze writable segment: %s, deletions of its rows are not versioned\n"
+			, m_wrSeg->m_segDir.string().c_str());
+	}
+	std::lock_guard<std::mutex> snapshotLock(m_snapshotMutex);
+	const llong version = ++m_snapshotSeq;
+	m_liveSnapshots.push_back(std::make_pair(version, m_rowNum - 1));
+	m_oldestSnapshotVersion = m_liveSnapshots[0].first;
+	return version;
+}
+
+void DbTable::releaseSnapshot(llong version) {
+	llong oldest;
+	{
+		std::lock_guard<std::mutex> lock(m_snapshotMutex);
+		auto beg = m_liveSnapshots.begin(), end = m_liveSnapshots.end();
+		auto iter = std::lower_bound(beg, end, std::make_pair(version, LLONG_MIN));
+		if (end == iter || iter->first != version) {
+			THROW_STD(invalid_argument,
+				"snapshot version = %lld is not alive", version);
+		}
+		m_liveSnapshots.erase_i(iter - beg, 1);
+		oldest = m_liveSnapshots.empty() ? LLONG_MAX : m_liveSnapshots[0].first;
+		if (oldest == m_oldestSnapshotVersion) {
+			return;
+		}
+		m_oldestSnapshotVersion = oldest;
+	}
+	if (m_schema->m_enableSnapshot) {
+		// stamps older than the oldest snapshot are never read
+		MyRwLock lock(m_rwMutex, false);
+		for (auto& seg : m_segments) {
+			if (seg->m_isFreezed && seg->hasDelVersions())
+				seg->gcDelVersions(oldest);
+		}
+	}
+}
+
+// caller should hold seg->m_segMutex as writer, concurrent acquireSnapshot
+// is excluded by m_rwMutex
+inline
+bool DbTable::needStampDeletionNoLock(const ReadableSegment* seg) const {
+	return m_schema->m_enableSnapshot && seg->m_isFreezed &&
+			LLONG_MAX != m_oldestSnapshotVersion;
+}
+
+void DbTable::stampDeletionNoLock(ReadableSegment* seg, size_t subId) const {
+	if (needStampDeletionNoLock(seg)) {
+		seg->setDelVersionNoLock(subId, m_snapshotSeq);
+	}
+}
+
+llong DbTable::getSnapshotMaxRecId(llong version) const {
+	std::lock_guard<std::mutex> lock(m_snapshotMutex);
+	auto beg = m_liveSnapshots.begin(), end = m_liveSnapshots.end();
+	auto iter = std::lower_bound(beg, end, std::make_pair(version, LLONG_MIN));
+	if (end == iter || iter->first != version) {
+		THROW_STD(invalid_argument,
+			"snapshot version = %lld is not alive", version);
+	}
+	return iter->second;
+}
+
+bool DbTable::isWriteThrottled() const {
+	ullong last = m_lastThrottledTime.load(std::memory_order_relaxed);
+	return 0 != last && g_pf.ns(last, g_pf.now()) < 1000000000;
+}
+
 bool DbTable::removeRow(llong id, DbContext* ctx) {
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::remove);
+	TERARK_DB_PROBE_SCOPE2(remove, this, id);
+	checkNotReplica("removeRow");
 	assert(ctx != nullptr);
 	assert(id >= 0);
 	assert(id < m_rowNum);
@@ -1818,10 +4099,15 @@ bool DbTable::removeRow(llong id, DbContext* ctx) {
 		THROW_STD(invalid_argument,
 			"Invalid id = %lld, m_rowNum = %lld\n", id, m_rowNum);
 	}
+	if (m_changeLog) {
+		m_changeLog->waitForConsumers(); // not in the lock
+	}
 	IncrementGuard_size_t guard(m_inprogressWritingCount);
-	const llong snapshotVersion = this->m_rowNum - 1;
-	assert(snapshotVersion >= id);
+	DbPerfTimer lockPerf(m_perf.get(), DbPerfOp::lockWait);
+	TERARK_DB_PROBE1(lock__wait__start, this);
 	MyRwLock lock(m_rwMutex, false);
+	TERARK_DB_PROBE1(lock__wait__done, this);
+	lockPerf.stop();
 	ctx->ensureTransactionNoLock();
 	ctx->trySyncSegCtxNoLock(this);
 	DebugCheckRowNumVecNoLock(this);
@@ -1832,6 +4118,15 @@ bool DbTable::removeRow(llong id, DbContext* ctx) {
 	llong baseId = m_rowNumVec[j-1];
 	llong subId = id - baseId;
 	auto seg = m_segments[j-1].get();
+	auto oldRow = ctx->bufs.get(); // for m_changeLog
+	if (m_changeLog) {
+		try {
+			seg->getValue(subId, oldRow.get(), ctx);
+		}
+		catch (const std::exception&) {
+			oldRow->erase_all(); // already deleted
+		}
+	}
 	if (!seg->m_isFreezed) {
 		auto wrseg = m_wrSeg.get();
 		assert(wrseg == seg);
@@ -1877,8 +4172,11 @@ bool DbTable::removeRow(llong id, DbContext* ctx) {
 					wrseg->m_segDir.string(), baseId, subId);
 			}
 			m_schema->m_rowSchema->parseRow(*row, cols.get());
+			const bool pending = asyncIndexClaim(subId);
 			for (size_t i = 0; i < wrseg->m_indices.size(); ++i) {
 				const Schema& iSchema = m_schema->getIndexSchema(i);
+				if (pending && !iSchema.m_isUnique)
+					continue; // not inserted yet
 				iSchema.selectParent(*cols, key.get());
 				txn.indexRemove(i, *key);
 			}
@@ -1892,38 +4190,38 @@ bool DbTable::removeRow(llong id, DbContext* ctx) {
 					, id, baseId, subId, wrseg->m_segDir.string().c_str());
 			}
 		}
+		if (m_changeLog) {
+			m_changeLog->append(ChangeOp::remove, id, *oldRow);
+		}
 		return true;
 	}
 	else { // freezed segment, just set del mark
 		bool success = false;
-		if (seg->m_deletionTime) {
-			assert(nullptr != m_schema->m_snapshotSchema);
-			llong* deltime = (llong*)seg->getRecordsBasePtr();
-			SpinRwLock wsLock(seg->m_segMutex);
-			if (deltime[subId] != LLONG_MAX) {
-				deltime[subId] = snapshotVersion;
+		if (!seg->m_bookUpdates && !needStampDeletionNoLock(seg)) {
+			// lock free, m_bookUpdates is checked again after the delmark,
+			// a compaction which begins booking concurrently either copies
+			// the delmark or finds it in the update list
+			success = seg->atomicSetIsDel1(subId);
+			if (success && seg->m_bookUpdates) {
+				SpinRwLock wsLock(seg->m_segMutex);
 				seg->addtoUpdateList(size_t(subId));
-				success = true;
 			}
 		}
 		else {
 			SpinRwLock wsLock(seg->m_segMutex);
-		//	assert(!seg->m_isDel[subId]);
-			if (!seg->m_isDel[subId]) {
+			if (seg->atomicSetIsDel1(subId)) {
 				seg->addtoUpdateList(size_t(subId));
-				seg->m_isDel.set1(subId);
-				seg->m_delcnt++;
-				seg->m_isDirty = true;
-		#if !defined(NDEBUG)
-				size_t delcnt = seg->m_isDel.popcnt();
-				assert(delcnt == seg->m_delcnt);
-		#endif
+				stampDeletionNoLock(seg, size_t(subId));
 				success = true;
 			}
 		}
-		if (checkPurgeDeleteNoLock(seg)) {
-			lock.upgrade_to_writer();
-			inLockPutPurgeDeleteTaskToQueue();
+		if (success) {
+			if (!seg->m_isDirty)
+				seg->m_isDirty = true;
+			if (m_changeLog)
+				m_changeLog->append(ChangeOp::remove, id, *oldRow);
+			if (checkPurgeDeleteNoLock(seg))
+				requestPurgeCheck();
 		}
 		return success;
 	}
@@ -1943,8 +4241,7 @@ void DbTable::delmarkSet0(llong id) {
 	size_t subId = size_t(id - baseId);
 	SpinRwLock segLock(seg->m_segMutex, true);
 	assert(seg->m_isDel[subId]);
-	seg->m_isDel.set0(subId);
-	seg->m_delcnt--;
+	seg->atomicSetIsDel0(subId);
 }
 
 void DbTable::delmarkSet1(llong id) {
@@ -1964,17 +4261,14 @@ void DbTable::delmarkSet1(llong id) {
 		SpinRwLock segLock(seg->m_segMutex, true);
 		assert(subId < seg->m_isDel.size());
 	//	assert(!seg->m_isDel[subId]);
-		if (!seg->m_isDel[subId]) {
-			seg->m_isDel.set1(subId);
-			seg->m_delcnt++;
+		if (seg->atomicSetIsDel1(subId)) {
+			stampDeletionNoLock(seg, subId);
 			success = true;
 		}
 	}
 	if (success && seg->getReadonlySegment()) {
-		if (checkPurgeDeleteNoLock(seg)) {
-			lock.upgrade_to_writer();
-			inLockPutPurgeDeleteTaskToQueue();
-		}
+		if (checkPurgeDeleteNoLock(seg))
+			requestPurgeCheck();
 	}
 }
 
@@ -2000,6 +4294,96 @@ void DbTable::putToFreeList(llong id) {
 	}
 }
 
+void DbTable::delmarkSet0Batch(const llong* ids, size_t num) {
+	assert(std::is_sorted(ids, ids + num));
+	if (0 == num) {
+		return;
+	}
+	MyRwLock lock(m_rwMutex, false);
+	if (ids[0] < 0 || ids[num-1] >= m_rowNum) {
+		THROW_STD(invalid_argument,
+			"Invalid id = %lld or %lld, m_rowNum = %lld\n", ids[0], ids[num-1], m_rowNum);
+	}
+	for (size_t i = 0; i < num; ) {
+		size_t upp = upper_bound_a(m_rowNumVec, ids[i]);
+		auto seg = m_segments[upp-1].get();
+		llong baseId = m_rowNumVec[upp-1];
+		llong endId = upp < m_segments.size() ? m_rowNumVec[upp] : m_rowNum;
+		SpinRwLock segLock(seg->m_segMutex, true);
+		for (; i < num && ids[i] < endId; ++i) {
+			size_t subId = size_t(ids[i] - baseId);
+			assert(seg->m_isDel[subId]);
+			seg->atomicSetIsDel0(subId);
+		}
+	}
+}
+
+void DbTable::delmarkSet1Batch(const llong* ids, size_t num) {
+	assert(std::is_sorted(ids, ids + num));
+	if (0 == num) {
+		return;
+	}
+	MyRwLock lock(m_rwMutex, false);
+	if (ids[0] < 0 || ids[num-1] >= m_rowNum) {
+		THROW_STD(invalid_argument,
+			"Invalid id = %lld or %lld, m_rowNum = %lld\n", ids[0], ids[num-1], m_rowNum);
+	}
+	bool needPurge = false;
+	for (size_t i = 0; i < num; ) {
+		size_t upp = upper_bound_a(m_rowNumVec, ids[i]);
+		auto seg = m_segments[upp-1].get();
+		llong baseId = m_rowNumVec[upp-1];
+		llong endId = upp < m_segments.size() ? m_rowNumVec[upp] : m_rowNum;
+		size_t setNum = 0;
+		{
+			SpinRwLock segLock(seg->m_segMutex, true);
+			for (; i < num && ids[i] < endId; ++i) {
+				size_t subId = size_t(ids[i] - baseId);
+				assert(subId < seg->m_isDel.size());
+				if (seg->atomicSetIsDel1(subId)) {
+					stampDeletionNoLock(seg, subId);
+					setNum++;
+				}
+			}
+		}
+		if (setNum && seg->getReadonlySegment() && checkPurgeDeleteNoLock(seg)) {
+			needPurge = true;
+		}
+	}
+	if (needPurge) {
+		requestPurgeCheck();
+	}
+}
+
+void DbTable::putToFreeListBatch(const llong* ids, size_t num) {
+	assert(std::is_sorted(ids, ids + num));
+	if (0 == num) {
+		return;
+	}
+	MyRwLock lock(m_rwMutex, false);
+	if (ids[0] < 0 || ids[num-1] >= m_rowNum) {
+		THROW_STD(invalid_argument,
+			"Invalid id = %lld or %lld, m_rowNum = %lld\n", ids[0], ids[num-1], m_rowNum);
+	}
+	for (size_t i = 0; i < num; ) {
+		size_t upp = upper_bound_a(m_rowNumVec, ids[i]);
+		auto seg = m_segments[upp-1].get();
+		llong baseId = m_rowNumVec[upp-1];
+		llong endId = upp < m_segments.size() ? m_rowNumVec[upp] : m_rowNum;
+		SpinRwLock segLock(seg->m_segMutex, true);
+		for (; i < num && ids[i] < endId; ++i) {
+			size_t subId = size_t(ids[i] - baseId);
+			assert(seg->m_isDel[subId]);
+			if (terark_likely(!seg->m_isFreezed)) {
+				auto wrseg = static_cast<WritableSegment*>(seg);
+				wrseg->m_deletedWrIdSet.push_back(subId);
+			} else {
+				seg->addtoUpdateList(subId);
+			}
+		}
+	}
+}
+
 ///! Can inplace update column in ReadonlySegment
 void
 DbTable::updateColumn(llong recordId, size_t columnId,
@@ -2031,9 +4415,42 @@ DbTable::updateColumn(llong recordId, fstring colname,
 	updateColumn(recordId, columnId, newColumnData, ctx);
 }
 
+// Fixed width fields of inplace updatable colgroups are updated by atomic
+// read-modify-write on the store memory, m_segMutex is needed only for
+// booking the update of a frozen segment. Misaligned fields(the colgroup
+// row length is not a multiple of the field width) fall back to m_segMutex.
+template<class WireType>
+static inline
+std::atomic<WireType>* atomicField(byte& byteRef) {
+	BOOST_STATIC_ASSERT(sizeof(std::atomic<WireType>) == sizeof(WireType));
+	if (size_t(&byteRef) % sizeof(WireType) != 0)
+		return NULL;
+	return reinterpret_cast<std::atomic<WireType>*>(&byteRef);
+}
+
+static inline
+void bookInplaceUpdate(ReadableSegment* seg, llong subId) {
+	if (seg->m_isFreezed) {
+		SpinRwLock segLock(seg->m_segMutex);
+		seg->addtoUpdateList(size_t(subId));
+	}
+}
+
+///@note op may be called multiple times when racing with other updaters
 template<class WireType, class LlongOrFloat, class OP>
 static inline
 bool updateValueByOp(ReadableSegment* seg, llong subId, byte& byteRef, const OP& op) {
+	if (std::atomic<WireType>* field = atomicField<WireType>(byteRef)) {
+		WireType oldVal = field->load(std::memory_order_relaxed);
+		LlongOrFloat val;
+		do {
+			val = oldVal;
+			if (!op(val))
+				return false;
+		} while (!field->compare_exchange_weak(oldVal, WireType(val)));
+		bookInplaceUpdate(seg, subId);
+		return true;
+	}
 	LlongOrFloat val = reinterpret_cast<WireType&>(byteRef);
 	if (op(val)) {
 		SpinRwLock segLock(seg->m_segMutex);
@@ -2045,6 +4462,38 @@ bool updateValueByOp(ReadableSegment* seg, llong subId, byte& byteRef, const OP&
 	return false;
 }
 
+template<class WireType, class LlongOrDouble>
+static inline
+void atomicFieldAdd(std::atomic<WireType>* field, LlongOrDouble incVal,
+					std::true_type /*integral add*/) {
+	field->fetch_add(WireType(incVal), std::memory_order_relaxed);
+}
+template<class WireType, class LlongOrDouble>
+static inline
+void atomicFieldAdd(std::atomic<WireType>* field, LlongOrDouble incVal,
+					std::false_type) {
+	WireType oldVal = field->load(std::memory_order_relaxed);
+	while (!field->compare_exchange_weak(oldVal, WireType(oldVal + incVal)))
+		{}
+}
+
+template<class WireType, class LlongOrDouble>
+static inline
+void incrementValue(ReadableSegment* seg, llong subId, byte& byteRef,
+					LlongOrDouble incVal) {
+	if (std::atomic<WireType>* field = atomicField<WireType>(byteRef)) {
+		atomicFieldAdd(field, incVal, std::integral_constant<bool,
+			std::is_integral<WireType>::value &&
+			std::is_integral<LlongOrDouble>::value>());
+		bookInplaceUpdate(seg, subId);
+		return;
+	}
+	SpinRwLock segLock(seg->m_segMutex);
+	reinterpret_cast<WireType&>(byteRef) += incVal;
+	if (seg->m_isFreezed)
+		seg->addtoUpdateList(size_t(subId));
+}
+
 void
 DbTable::updateColumnInteger(llong recordId, size_t columnId,
 									const std::function<bool(llong&val)>& op,
@@ -2079,7 +4528,7 @@ DbTable::updateColumnInteger(llong recordId, fstring colname,
 		THROW_STD(invalid_argument, "colname = %.*s is not existed"
 			, colname.ilen(), colname.data());
 	}
-	updateColumnInteger(recordId, colname, op, ctx);
+	updateColumnInteger(recordId, columnId, op, ctx);
 }
 
 void
@@ -2116,14 +4565,161 @@ DbTable::updateColumnDouble(llong recordId, fstring colname,
 		THROW_STD(invalid_argument, "colname = %.*s is not existed"
 			, colname.ilen(), colname.data());
 	}
-	updateColumnDouble(recordId, colname, op, ctx);
+	updateColumnDouble(recordId, columnId, op, ctx);
+}
+
+size_t
+DbTable::updateColumnBatch(size_t columnId, const llong* recIds,
+						   const fstring* values, size_t num, DbContext* ctx) {
+	checkNotReplica("updateColumnBatch");
+	const Schema& rowSchema = *m_schema->m_rowSchema;
+	if (columnId >= rowSchema.columnNum()) {
+		THROW_STD(invalid_argument
+			, "Invalid columnId=%zd, ge than columnNum=%zd"
+			, columnId, rowSchema.columnNum()
+			);
+	}
+	DbContextPtr ctxHolder;
+	if (NULL == ctx) {
+		ctxHolder = createDbContext();
+		ctx = ctxHolder.get();
+	}
+	const size_t fixlen = rowSchema.getColumnMeta(columnId).fixedLen;
+	const auto colproj = m_schema->m_colproject[columnId];
+	const Schema& cgSchema = m_schema->getColgroupSchema(colproj.colgroupId);
+	if (0 == fixlen || cgSchema.getFixedRowLen() == 0 || !cgSchema.m_isInplaceUpdatable) {
+		return updateColumnBatchByRows(columnId, recIds, values, num, ctx);
+	}
+	for (size_t i = 0; i < num; ++i) {
+		if (values[i].size() != fixlen) {
+			THROW_STD(invalid_argument
+				, "Invalid column(id=%zd, name=%s) which columnType=%s fixedLen=%zd newLen=%zd"
+				, columnId, rowSchema.getColumnName(columnId).c_str()
+				, Schema::columnTypeStr(rowSchema.getColumnType(columnId))
+				, fixlen, values[i].size()
+				);
+		}
+	}
+	const size_t cgLen  = cgSchema.getFixedRowLen();
+	const size_t offset = cgSchema.getColumnMeta(colproj.subColumnId).fixedOffset;
+	// m_segMutex is a spin lock, readers of the segment spin while it is
+	// held, so a large group is written by chunks
+	const size_t chunkRows = 1024;
+	size_t updated = 0;
+	MyRwLock lock(m_rwMutex, false);
+	ctx->trySyncSegCtxNoLock(this);
+	groupIdsBySegmentNoLock(recIds, num, ctx);
+	const size_t  segNum = ctx->m_segCtx.size();
+	const size_t* order  = ctx->m_batchOrder.data() + num;
+	const size_t* segEnd = order + num;
+	const llong*  subIds = ctx->m_batchSubIds.data();
+	size_t beg = 0;
+	for (size_t i = 0; i < segNum; ++i) {
+		const size_t end = segEnd[i];
+		auto seg = ctx->m_segCtx[i]->seg;
+		assert(seg->m_colgroups.size() == m_schema->getColgroupNum());
+		byte* recordsBasePtr = seg->m_colgroups[colproj.colgroupId]->getRecordsBasePtr();
+		assert(beg == end || nullptr != recordsBasePtr);
+		while (beg < end) {
+			const size_t chunkEnd = std::min(end, beg + chunkRows);
+			SpinRwLock segLock(seg->m_segMutex);
+			for (size_t j = beg; j < chunkEnd; ++j) {
+				size_t subId = size_t(subIds[j]);
+				if (seg->m_isDel.is1(subId)) {
+					continue;
+				}
+				llong physicId = seg->getPhysicId(subId);
+				byte* coldata = recordsBasePtr + cgLen * physicId + offset;
+				memcpy(coldata, values[order[j]].data(), fixlen);
+				if (seg->m_isFreezed)
+					seg->addtoUpdateList(subId);
+				updated++;
+			}
+			beg = chunkEnd;
+		}
+	}
+	return updated;
+}
+
+// the new column is appended to the old row and the row is combined again
+size_t
+DbTable::updateColumnBatchByRows(size_t columnId, const llong* recIds,
+								 const fstring* values, size_t num,
+								 DbContext* ctx) {
+	const Schema& rowSchema = *m_schema->m_rowSchema;
+	auto row = ctx->bufs.get();
+	auto newRow = ctx->bufs.get();
+	auto cols = ctx->cols.get();
+	size_t updated = 0;
+	for (size_t i = 0; i < num; ++i) {
+		row->erase_all();
+		try {
+			getValueAppend(recIds[i], row.get(), ctx);
+		}
+		catch (const ReadDeletedRecordException&) {
+			continue;
+		}
+		rowSchema.parseRow(*row, cols.get());
+		size_t pos = row->size();
+		row->append(values[i].data(), values[i].size());
+		cols->m_base = row->data();
+		cols->m_cols[columnId] = ColumnVec::Elem(uint32_t(pos), uint32_t(values[i].size()));
+		rowSchema.combineRow(*cols, newRow.get());
+		if (updateRow(recIds[i], *newRow, ctx) >= 0)
+			updated++;
+	}
+	return updated;
+}
+
+template<class WireType>
+static inline fstring integerAsColumn(llong val, byte* buf) {
+	WireType x = WireType(val);
+	memcpy(buf, &x, sizeof(x));
+	return fstring(buf, sizeof(x));
+}
+
+size_t
+DbTable::updateColumnIntegerBatch(size_t columnId, const llong* recIds,
+								  const llong* values, size_t num,
+								  DbContext* ctx) {
+	const Schema& rowSchema = *m_schema->m_rowSchema;
+	if (columnId >= rowSchema.columnNum()) {
+		THROW_STD(invalid_argument
+			, "Invalid columnId=%zd, ge than columnNum=%zd"
+			, columnId, rowSchema.columnNum()
+			);
+	}
+	const ColumnType type = rowSchema.getColumnType(columnId);
+	valvec<byte> buf(8 * num, valvec_no_init());
+	valvec<fstring> colvals(num, valvec_no_init());
+	for (size_t i = 0; i < num; ++i) {
+		byte* p = buf.data() + 8 * i;
+		switch (type) {
+		default:
+			THROW_STD(invalid_argument
+				, "Invalid column(id=%zd, name=%s) which columnType=%s"
+				, columnId, rowSchema.getColumnName(columnId).c_str()
+				, Schema::columnTypeStr(type)
+				);
+		case ColumnType::Uint08:  colvals[i] = integerAsColumn<uint8_t >(values[i], p); break;
+		case ColumnType::Sint08:  colvals[i] = integerAsColumn< int8_t >(values[i], p); break;
+		case ColumnType::Uint16:  colvals[i] = integerAsColumn<uint16_t>(values[i], p); break;
+		case ColumnType::Sint16:  colvals[i] = integerAsColumn< int16_t>(values[i], p); break;
+		case ColumnType::Uint32:  colvals[i] = integerAsColumn<uint32_t>(values[i], p); break;
+		case ColumnType::Sint32:  colvals[i] = integerAsColumn< int32_t>(values[i], p); break;
+		case ColumnType::Uint64:  colvals[i] = integerAsColumn<uint64_t>(values[i], p); break;
+		case ColumnType::Sint64:  colvals[i] = integerAsColumn< int64_t>(values[i], p); break;
+		case ColumnType::Float32: colvals[i] = integerAsColumn<   float>(values[i], p); break;
+		case ColumnType::Float64: colvals[i] = integerAsColumn<  double>(values[i], p); break;
+		}
+	}
+	return updateColumnBatch(columnId, recIds, colvals.data(), num, ctx);
 }
 
 void
 DbTable::incrementColumnValue(llong recordId, size_t columnId,
 									 llong incVal, DbContext* ctx) {
 #include "update_column_impl.hpp"
-	SpinRwLock segLock(seg->m_segMutex);
 	switch (rowSchema.getColumnType(columnId)) {
 	default:
 		THROW_STD(invalid_argument
@@ -2132,18 +4728,16 @@ DbTable::incrementColumnValue(llong recordId, size_t columnId,
 			, Schema::columnTypeStr(rowSchema.getColumnType(columnId))
 			);
 	case ColumnType::Uint08:
-	case ColumnType::Sint08: *(int8_t*)coldata += incVal; break;
+	case ColumnType::Sint08: incrementValue< int8_t>(seg, subId, *coldata, incVal); break;
 	case ColumnType::Uint16:
-	case ColumnType::Sint16: *(int16_t*)coldata += incVal; break;
+	case ColumnType::Sint16: incrementValue<int16_t>(seg, subId, *coldata, incVal); break;
 	case ColumnType::Uint32:
-	case ColumnType::Sint32: *(int32_t*)coldata += incVal; break;
+	case ColumnType::Sint32: incrementValue<int32_t>(seg, subId, *coldata, incVal); break;
 	case ColumnType::Uint64:
-	case ColumnType::Sint64: *(int64_t*)coldata += incVal; break;
-	case ColumnType::Float32: *(float *)coldata += incVal; break;
-	case ColumnType::Float64: *(double*)coldata += incVal; break;
+	case ColumnType::Sint64: incrementValue<int64_t>(seg, subId, *coldata, incVal); break;
+	case ColumnType::Float32: incrementValue<float >(seg, subId, *coldata, incVal); break;
+	case ColumnType::Float64: incrementValue<double>(seg, subId, *coldata, incVal); break;
 	}
-	if (seg->m_isFreezed)
-		seg->addtoUpdateList(subId);
 }
 
 void
@@ -2154,14 +4748,13 @@ DbTable::incrementColumnValue(llong recordId, fstring colname,
 		THROW_STD(invalid_argument, "colname = %.*s is not existed"
 			, colname.ilen(), colname.data());
 	}
-	incrementColumnValue(recordId, colname, incVal, ctx);
+	incrementColumnValue(recordId, columnId, incVal, ctx);
 }
 
 void
 DbTable::incrementColumnValue(llong recordId, size_t columnId,
 									 double incVal, DbContext* ctx) {
 #include "update_column_impl.hpp"
-	SpinRwLock segLock(seg->m_segMutex);
 	switch (rowSchema.getColumnType(columnId)) {
 	default:
 		THROW_STD(invalid_argument
@@ -2170,18 +4763,16 @@ DbTable::incrementColumnValue(llong recordId, size_t columnId,
 			, Schema::columnTypeStr(rowSchema.getColumnType(columnId))
 			);
 	case ColumnType::Uint08:
-	case ColumnType::Sint08: *(int8_t*)coldata += incVal; break;
+	case ColumnType::Sint08: incrementValue< int8_t>(seg, subId, *coldata, incVal); break;
 	case ColumnType::Uint16:
-	case ColumnType::Sint16: *(int16_t*)coldata += incVal; break;
+	case ColumnType::Sint16: incrementValue<int16_t>(seg, subId, *coldata, incVal); break;
 	case ColumnType::Uint32:
-	case ColumnType::Sint32: *(int32_t*)coldata += incVal; break;
+	case ColumnType::Sint32: incrementValue<int32_t>(seg, subId, *coldata, incVal); break;
 	case ColumnType::Uint64:
-	case ColumnType::Sint64: *(int64_t*)coldata += incVal; break;
-	case ColumnType::Float32: *(float *)coldata += incVal; break;
-	case ColumnType::Float64: *(double*)coldata += incVal; break;
+	case ColumnType::Sint64: incrementValue<int64_t>(seg, subId, *coldata, incVal); break;
+	case ColumnType::Float32: incrementValue<float >(seg, subId, *coldata, incVal); break;
+	case ColumnType::Float64: incrementValue<double>(seg, subId, *coldata, incVal); break;
 	}
-	if (seg->m_isFreezed)
-		seg->addtoUpdateList(subId);
 }
 
 void
@@ -2192,7 +4783,7 @@ DbTable::incrementColumnValue(llong recordId, fstring colname,
 		THROW_STD(invalid_argument, "colname = %.*s is not existed"
 			, colname.ilen(), colname.data());
 	}
-	incrementColumnValue(recordId, colname, incVal, ctx);
+	incrementColumnValue(recordId, columnId, incVal, ctx);
 }
 
 bool
@@ -2221,9 +4812,27 @@ const {
 	return false;
 }
 
+#if defined(TERARK_DB_WITH_USDT) && defined(__linux__)
+// segKind of probe index__probe__start
+static const char* segmentKindName(const ReadableSegment* seg) {
+	if (seg->getReadonlySegment())
+		return "readonly";
+	if (seg->getPlainWritableSegment())
+		return "writable";
+	if (seg->getColgroupSegment())
+		return "colgroupWritable";
+	return "writable";
+}
+#endif
+
 void
 DbTable::indexSearchExact(size_t indexId, fstring key, valvec<llong>* recIdvec, DbContext* ctx)
 const {
+	if (ctx->waitAsyncIndex) {
+		waitAsyncIndex();
+	}
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::indexSearch);
+	ReadLatencySampler sampler(m_readLatencyLimiter);
 	ctx->trySyncSegCtxSpeculativeLock(this);
 	indexSearchExactNoLock(indexId, key, recIdvec, ctx);
 }
@@ -2271,9 +4880,13 @@ const {
 		if (seg->m_isDel.size() == seg->m_delcnt)
 			continue;
 		size_t oldsize = recIdvec->size();
+		if (TERARK_DB_PROBE_ENABLED(index__probe__start)) {
+			TERARK_DB_PROBE4(index__probe__start, this, i, indexId, segmentKindName(seg));
+		}
 		seg->indexSearchExactAppend(i, indexId, key, recIdvec, ctx);
 		size_t newsize = recIdvec->size();
 		size_t len = newsize - oldsize;
+		TERARK_DB_PROBE4(index__probe__done, this, i, indexId, len);
 		if (len) {
 			llong* p = recIdvec->data() + oldsize;
 			llong baseId = ctx->m_rowNumVec[i];
@@ -2293,8 +4906,422 @@ const {
 #endif
 }
 
+void
+DbTable::indexSearchExactBatch(size_t indexId, const fstring* keys, size_t num,
+							   valvec<llong>* recIdvec, valvec<size_t>* offsets,
+							   DbContext* ctx)
+const {
+	if (ctx->waitAsyncIndex) {
+		waitAsyncIndex();
+	}
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	indexSearchExactBatchNoLock(indexId, keys, num, recIdvec, offsets, ctx);
+}
+
+// a lookup is two dependent misses: the dawg walk(and m_keyToId) of the
+// index, then the record of the store. Groups are small enough to be in
+// cache between the phases, and large enough to have many misses in flight
+size_t
+DbTable::getValuesByKeyBatch(size_t indexId, const fstring* keys, size_t num,
+							 llong* recIds, valvec<byte>* vals, DbContext* ctx)
+const {
+	static const size_t group = std::max<long>(getEnvLong("TerarkDB_LookupGroup", 32), 1);
+	if (ctx->waitAsyncIndex) {
+		waitAsyncIndex();
+	}
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	valvec<llong>  ids;
+	valvec<size_t> offsets;
+	valvec<llong>  hitIds(std::min(group, num), valvec_reserve());
+	valvec<size_t> hitKeys(std::min(group, num), valvec_reserve());
+	valvec<valvec<byte> > hitVals(std::min(group, num));
+	size_t found = 0;
+	for (size_t beg = 0; beg < num; beg += group) {
+		const size_t n = std::min(group, num - beg);
+		indexSearchExactBatchNoLock(indexId, keys + beg, n, &ids, &offsets, ctx);
+		hitIds.erase_all();
+		hitKeys.erase_all();
+		for (size_t k = 0; k < n; ++k) {
+			if (offsets[k] < offsets[k+1]) {
+				recIds[beg + k] = ids[offsets[k]]; // the newest
+				hitIds.push_back(ids[offsets[k]]);
+				hitKeys.push_back(beg + k);
+			}
+			else {
+				recIds[beg + k] = -1;
+				vals[beg + k].erase_all();
+			}
+		}
+		getValuesBatch(hitIds.data(), hitIds.size(), hitVals.data(), ctx);
+		for (size_t h = 0; h < hitKeys.size(); ++h) {
+			vals[hitKeys[h]].swap(hitVals[h]);
+		}
+		found += hitKeys.size();
+	}
+	return found;
+}
+
+void
+DbTable::bitmapFilter(const BitmapTerm* terms, size_t num,
+					  valvec<llong>* recIds, DbContext* ctx)
+const {
+	for (size_t k = 0; k < num; ++k) {
+		if (terms[k].indexId >= m_schema->getIndexNum()) {
+			THROW_STD(invalid_argument, "invalid indexId = %zd, indexNum = %zd"
+				, terms[k].indexId, m_schema->getIndexNum());
+		}
+	}
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	recIds->erase_all();
+	if (0 == num) {
+		return;
+	}
+	valvec<uint64_t> words, termWords;
+	valvec<llong> segIds;
+	const size_t segNum = ctx->m_segCtx.size();
+	for (size_t i = 0; i < segNum; ++i) {
+		auto seg = ctx->m_segCtx[i]->seg;
+		const size_t rows = seg->m_isDel.size();
+		if (rows == seg->m_delcnt)
+			continue;
+		const size_t nWords = (rows + 63) / 64;
+		words.resize_no_init(nWords);
+		std::fill_n(words.data(), nWords, 0);
+		bool hasBitmap = false; // bitmaps have deleted rows
+		for (size_t k = 0; k < num; ++k) {
+			const BitmapTerm& t = terms[k];
+			const BitmapOp op = k ? t.op : BitmapOp::Or;
+			const BitmapIndex* bi = nullptr;
+			if (seg->getReadonlySegment() && seg->m_isPurged.empty())
+				bi = dynamic_cast<const BitmapIndex*>(seg->m_indices[t.indexId].get());
+			if (bi && bi->rows() == rows) {
+				bi->combine(t.key, op, words.data());
+				hasBitmap = true;
+				continue;
+			}
+			segIds.erase_all();
+			seg->indexSearchExactAppend(i, t.indexId, t.key, &segIds, ctx);
+			termWords.resize_no_init(nWords);
+			std::fill_n(termWords.data(), nWords, 0);
+			for (llong id : segIds)
+				termWords[id / 64] |= uint64_t(1) << (id % 64);
+			BitmapIndex::combineWords(op, words.data(), termWords.data(), nWords);
+		}
+		const llong baseId = ctx->m_rowNumVec[i];
+		for (size_t w = 0; w < nWords; ++w) {
+			for (uint64_t x = words[w]; x; x &= x - 1) {
+				size_t id = w * 64 + fast_ctz64(x);
+				if (!hasBitmap || !seg->isDelBit(id) || seg->isDelAfterSnapshot(id, ctx))
+					recIds->push_back(baseId + id);
+			}
+		}
+	}
+}
+
+/// segments are iterated outermost, newer segments first, recIds of each
+/// key are in the same order as indexSearchExactNoLock
+void
+DbTable::indexSearchExactBatchNoLock(size_t indexId, const fstring* keys, size_t num,
+							   valvec<llong>* recIdvec, valvec<size_t>* offsets,
+							   DbContext* ctx)
+const {
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "invalid indexId = %zd, indexNum = %zd"
+			, indexId, m_schema->getIndexNum());
+	}
+	const bool isUnique = m_schema->getIndexSchema(indexId).m_isUnique;
+	const size_t segNum = ctx->m_segCtx.size();
+	DbContextArena::Scope arenaScope(ctx->arena);
+	// unique keys are removed from pendKeys once found
+	fstring* pendKeys = ctx->arena.allocCopy(keys, num);
+	size_t*  pendIdx = ctx->arena.alloc<size_t>(num);
+	size_t*  segOffsets = ctx->arena.alloc<size_t>(num + 1);
+	size_t   pendNum = num;
+	valvec<llong>   segRecIds;
+	valvec<size_t>  hitKey;
+	valvec<llong>   hitRecId;
+	for (size_t k = 0; k < num; ++k) {
+		pendIdx[k] = k;
+	}
+	for (size_t i = segNum; i > 0 && pendNum; ) {
+		auto seg = ctx->m_segCtx[--i]->seg;
+		if (seg->m_isDel.size() == seg->m_delcnt)
+			continue;
+		segRecIds.erase_all();
+		seg->indexSearchExactAppendBatch(i, indexId, pendKeys, pendNum,
+										 &segRecIds, segOffsets, ctx);
+		const llong baseId = ctx->m_rowNumVec[i];
+		size_t keep = 0;
+		for (size_t k = 0; k < pendNum; ++k) {
+			llong* p = segRecIds.data() + segOffsets[k];
+			size_t len = segOffsets[k+1] - segOffsets[k];
+			if (len >= 2) {
+				std::sort(p, p + len); // don't use std::greater
+				std::reverse(p, p + len); // in descending order
+			}
+			for (size_t j = 0; j < len; ++j) {
+				hitKey.push_back(pendIdx[k]);
+				hitRecId.push_back(p[j] + baseId);
+			}
+			if (isUnique && len) {
+				continue;
+			}
+			pendKeys[keep] = pendKeys[k];
+			pendIdx[keep] = pendIdx[k];
+			keep++;
+		}
+		pendNum = keep;
+	}
+	// stable counting sort hits by key
+	const size_t hitNum = hitKey.size();
+	offsets->resize_no_init(num + 1);
+	size_t* off = offsets->data();
+	std::fill_n(off, num + 1, 0);
+	for (size_t h = 0; h < hitNum; ++h) {
+		off[hitKey[h] + 1]++;
+	}
+	for (size_t k = 1; k < num; ++k) {
+		off[k] += off[k-1];
+	}
+	off[num] = hitNum;
+	recIdvec->resize_no_init(hitNum);
+	for (size_t h = 0; h < hitNum; ++h) {
+		(*recIdvec)[off[hitKey[h]]++] = hitRecId[h];
+	}
+	// now off[k] is end of key k, shift to be begin of key k
+	for (size_t k = num; k > 1; ) {
+		--k;
+		off[k] = off[k-1];
+	}
+	off[0] = 0;
+}
+
+llong
+DbTable::indexCountRange(size_t indexId, fstring lo, fstring hi, DbContext* ctx)
+const {
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "invalid indexId = %zd, indexNum = %zd"
+			, indexId, m_schema->getIndexNum());
+	}
+	if (!m_schema->getIndexSchema(indexId).m_isOrdered) {
+		THROW_STD(invalid_argument, "indexId = %zd is not ordered", indexId);
+	}
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	llong cnt = 0;
+	for (size_t i = 0; i < ctx->m_segCtx.size(); ++i) {
+		auto seg = ctx->m_segCtx[i]->seg;
+		if (seg->m_isDel.size() == seg->m_delcnt)
+			continue;
+		cnt += seg->indexCountRange(i, indexId, lo, hi, ctx);
+	}
+	return cnt;
+}
+
+llong
+DbTable::indexScanRange(size_t indexId, fstring lo, fstring hi,
+						const std::function<bool(llong)>& onRecord,
+						DbContext* ctx)
+const {
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "invalid indexId = %zd, indexNum = %zd"
+			, indexId, m_schema->getIndexNum());
+	}
+	if (!m_schema->getIndexSchema(indexId).m_isOrdered) {
+		THROW_STD(invalid_argument, "indexId = %zd is not ordered", indexId);
+	}
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	llong cnt = 0;
+	bool  hasNext = true;
+	for (size_t i = 0; i < ctx->m_segCtx.size() && hasNext; ++i) {
+		auto seg = ctx->m_segCtx[i]->seg;
+		if (seg->m_isDel.size() == seg->m_delcnt)
+			continue;
+		const llong baseId = ctx->m_rowNumVec[i];
+		cnt += seg->indexScanRange(i, indexId, lo, hi, [&](llong logicId) {
+			return hasNext = onRecord(baseId + logicId);
+		}, ctx);
+	}
+	return cnt;
+}
+
+size_t
+DbTable::indexSearchPrefix(size_t indexId, fstring prefix, size_t k,
+						   valvec<llong>* recIdvec, fstrvecl* keys,
+						   DbContext* ctx)
+const {
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "invalid indexId = %zd, indexNum = %zd"
+			, indexId, m_schema->getIndexNum());
+	}
+	if (!m_schema->getIndexSchema(indexId).m_isOrdered) {
+		THROW_STD(invalid_argument, "indexId = %zd is not ordered", indexId);
+	}
+	recIdvec->erase_all();
+	if (keys)
+		keys->erase_all();
+	if (0 == k)
+		return 0;
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	const Schema& schema = m_schema->getIndexSchema(indexId);
+	const size_t segNum = ctx->m_segCtx.size();
+	// top k of each segment, segment i is [segBeg[i], segBeg[i+1])
+	fstrvecl segKeys;
+	valvec<llong> segIds;
+	valvec<size_t> segBeg(segNum + 1, valvec_reserve());
+	for (size_t i = 0; i < segNum; ++i) {
+		segBeg.push_back(segIds.size());
+		auto seg = ctx->m_segCtx[i]->seg;
+		if (seg->m_isDel.size() == seg->m_delcnt)
+			continue;
+		const llong baseId = ctx->m_rowNumVec[i];
+		size_t cnt = 0;
+		seg->indexScanPrefix(i, indexId, prefix, [&](fstring key, llong logicId) {
+			segKeys.emplace_back(key.data(), key.size());
+			segIds.push_back(baseId + logicId);
+			return ++cnt < k;
+		}, ctx);
+	}
+	segBeg.push_back(segIds.size());
+	// heap merge, position in segIds breaks ties, it is in segment order
+	valvec<std::pair<size_t, size_t> > heap(segNum, valvec_reserve());
+	for (size_t i = 0; i < segNum; ++i) {
+		if (segBeg[i] < segBeg[i+1])
+			heap.emplace_back(segBeg[i], segBeg[i+1]);
+	}
+	auto greater = [&](const std::pair<size_t, size_t>& x,
+					   const std::pair<size_t, size_t>& y) {
+		int cmp = schema.compareData(segKeys[x.first], segKeys[y.first]);
+		return cmp ? cmp > 0 : x.first > y.first;
+	};
+	std::make_heap(heap.begin(), heap.end(), greater);
+	while (!heap.empty() && recIdvec->size() < k) {
+		std::pop_heap(heap.begin(), heap.end(), greater);
+		auto& top = heap.back();
+		recIdvec->push_back(segIds[top.first]);
+		if (keys) {
+			fstring key = segKeys[top.first];
+			keys->emplace_back(key.data(), key.size());
+		}
+		if (++top.first < top.second)
+			std::push_heap(heap.begin(), heap.end(), greater);
+		else
+			heap.pop_back();
+	}
+	return recIdvec->size();
+}
+
+llong
+DbTable::indexApproximateRangeSize(size_t indexId, fstring lo, fstring hi,
+								   DbContext* ctx)
+const {
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "invalid indexId = %zd, indexNum = %zd"
+			, indexId, m_schema->getIndexNum());
+	}
+	if (!m_schema->getIndexSchema(indexId).m_isOrdered) {
+		THROW_STD(invalid_argument, "indexId = %zd is not ordered", indexId);
+	}
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	double bytes = 0;
+	for (size_t i = 0; i < ctx->m_segCtx.size(); ++i) {
+		auto seg = ctx->m_segCtx[i]->seg;
+		const size_t rows = seg->m_isDel.size();
+		if (rows == seg->m_delcnt)
+			continue;
+		// rank based countRange includes deleted records, so discount it
+		double live = double(rows - seg->m_delcnt) / rows;
+		llong cnt = seg->m_indices[indexId]->countRange(lo, hi, ctx);
+		if (cnt < 0) {
+			// index has no rank(writable segment), count by the in memory
+			// index, size of writable segment is bounded, data is not read
+			cnt = seg->indexCountRange(i, indexId, lo, hi, ctx);
+			live = 1.0;
+		}
+		if (cnt > 0) {
+			llong phyRows = std::max<llong>(seg->getPhysicRows(), 1);
+			double avgRowSize = double(seg->dataStorageSize()) / phyRows;
+			bytes += cnt * live * avgRowSize;
+		}
+	}
+	return llong(bytes);
+}
+
+TERARK_DB_DLL llong parseSizeValue(fstring str); // defined in db_conf.cpp
+
+// process-wide memory budget of regex matching, each running segment match
+// reserves DbContext::regexMatchMemLimit, the budget is env
+// TerarkDB_RegexMatchMemBudget, 0 or unset is unlimited
+class RegexMatchMemBudget {
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	size_t m_limit; // 0 is unlimited
+	size_t m_inuse;
+public:
+	RegexMatchMemBudget() {
+		const char* env = getenv("TerarkDB_RegexMatchMemBudget");
+		m_limit = env ? size_t(parseSizeValue(env)) : 0;
+		m_inuse = 0;
+	}
+	size_t clampLimit(size_t mem) const {
+		return m_limit ? std::min(mem, m_limit) : mem;
+	}
+	void acquire(size_t mem) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_limit && m_inuse && m_inuse + mem > m_limit) {
+			m_cond.wait(lock);
+		}
+		m_inuse += mem;
+	}
+	void release(size_t mem) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		assert(m_inuse >= mem);
+		m_inuse -= mem;
+		m_cond.notify_all();
+	}
+};
+static RegexMatchMemBudget g_regexMatchMemBudget;
+
+class RegexMatchMemGuard {
+	size_t m_mem;
+public:
+	explicit RegexMatchMemGuard(size_t mem) : m_mem(mem) {
+		g_regexMatchMemBudget.acquire(mem);
+	}
+	~RegexMatchMemGuard() { g_regexMatchMemBudget.release(m_mem); }
+};
+
+// segments are matched in a tbb arena shared by all tables, its concurrency
+// is env TerarkDB_RegexMatchThreads, default is min(cpu, 8)
+class RegexMatchArena {
+	size_t m_threads;
+	std::unique_ptr<tbb::task_arena> m_arena;
+public:
+	RegexMatchArena() {
+		size_t cpu = tbb::tbb_thread::hardware_concurrency();
+		size_t cfg = getEnvLong("TerarkDB_RegexMatchThreads", 0);
+		m_threads = cfg ? cfg : std::min<size_t>(cpu, 8);
+		if (m_threads > 1)
+			m_arena.reset(new tbb::task_arena(int(m_threads)));
+	}
+	size_t threads() const { return m_threads; }
+	template<class Job>
+	void parallel_for(size_t num, const Job& job) {
+		assert(m_arena);
+		m_arena->execute([&]() {
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, num, 1),
+				[&](const tbb::blocked_range<size_t>& r) {
+					for (size_t i = r.begin(); i < r.end(); ++i)
+						job(i);
+				}, tbb::simple_partitioner());
+		});
+	}
+};
+static RegexMatchArena g_regexMatchArena;
+
 // implemented in DfaDbTable
 ///@params recIdvec result of matched record id list
+/// segments are matched in parallel, results are merged in segment order,
+/// at most ctx->regexMatchMaxResults(if not 0) results
 bool
 DbTable::indexMatchRegex(size_t indexId, RegexForIndex* regex,
 						 valvec<llong>* recIdvec, DbContext* ctx)
@@ -2318,40 +5345,43 @@ const {
 	}
 	ctx->trySyncSegCtxSpeculativeLock(this);
 	recIdvec->erase_all();
-	for (size_t i = 0; i < ctx->m_segCtx.size(); ++i) {
+	const size_t segNum = ctx->m_segCtx.size();
+	// per segment limit is also bounded by the global limit
+	const size_t oldMemLimit = ctx->regexMatchMemLimit;
+	ctx->regexMatchMemLimit = g_regexMatchMemBudget.clampLimit(oldMemLimit);
+	BOOST_SCOPE_EXIT(ctx, oldMemLimit) {
+		ctx->regexMatchMemLimit = oldMemLimit;
+	} BOOST_SCOPE_EXIT_END;
+	auto matchSegment = [&](size_t i, valvec<llong>* out) {
+		RegexMatchMemGuard memGuard(ctx->regexMatchMemLimit);
 		auto seg = ctx->m_segCtx[i]->seg;
-		if (seg->getWritableStore()) {
-			if (seg->m_isDel.size() > 0) {
-			  fprintf(stderr
-				, "WARN: segment: %s is a writable segment, can not MatchRegex\n"
-				, getSegPath("wr", i).string().c_str());
-			}
-			continue;
-		}
+		const bool isWritable = seg->getWritableStore() != nullptr;
 		auto index = seg->m_indices[indexId].get();
-		size_t oldsize = recIdvec->size();
-		const llong* deltime = nullptr;
+		size_t oldsize = out->size();
 		const llong  baseId = ctx->m_rowNumVec[i];
-		llong snapshotVersion = ctx->m_mySnapshotVersion;
-		if (seg->m_deletionTime) {
-			assert(nullptr != m_schema->m_snapshotSchema);
-			deltime = (const llong*)(seg->m_deletionTime->getRecordsBasePtr());
-		}
-		if (index->matchRegexAppend(regex, recIdvec, ctx)) {
-			size_t i = oldsize;
-			for(size_t j = oldsize; j < recIdvec->size(); ++j) {
-				size_t subPhysicId = (*recIdvec)[j];
+		if (index->matchRegexAppend(regex, out, ctx)) {
+			// writable segment may be growing, its rows are checked in lock
+			SpinRwLock segLock;
+			if (isWritable && !seg->m_isFreezed) {
+				segLock.acquire(seg->m_segMutex, false);
+			}
+			const size_t subRows = seg->m_isDel.size();
+			size_t n = oldsize;
+			for(size_t j = oldsize; j < out->size(); ++j) {
+				size_t subPhysicId = (*out)[j];
+				if (isWritable && subPhysicId >= subRows)
+					continue; // row is not yet visible
 				size_t subLogicId = seg->getLogicId(subPhysicId);
-				if (deltime) {
-					if (deltime[subPhysicId] > snapshotVersion)
-						(*recIdvec)[i++] = baseId + subLogicId;
-				}
-				else {
-					if (!seg->m_isDel[subLogicId])
-						(*recIdvec)[i++] = baseId + subLogicId;
-				}
+				if (!seg->isDelBit(subLogicId) ||
+						seg->isDelAfterSnapshot(subLogicId, ctx))
+					(*out)[n++] = baseId + subLogicId;
 			}
-			recIdvec->risk_set_size(i);
+			out->risk_set_size(n);
+		}
+		else if (isWritable) {
+			fprintf(stderr
+				, "WARN: index '%s' of writable segment: %s can not MatchRegex\n"
+				, schema.m_name.c_str(), getSegPath("wr", i).string().c_str());
 		}
 		else if (schema.m_enableLinearScan) {
 			fprintf(stderr
@@ -2373,18 +5403,10 @@ const {
 					bool hasData = iter->increment(&subCheckPhysicId, &key);
 					TERARK_RT_assert(hasData, std::logic_error);
 					TERARK_RT_assert(size_t(subCheckPhysicId) == subPhysicId, std::logic_error);
-					if (deltime) {
-						if (deltime[subPhysicId] > snapshotVersion) {
-							if (regex->matchText(key)) {
-								recIdvec->push_back(baseId + subLogicId);
-							}
-						}
-					}
-					else {
-						if (!terark_bit_test(isDel, subLogicId)) {
-							if (regex->matchText(key)) {
-								recIdvec->push_back(baseId + subLogicId);
-							}
+					if (!terark_bit_test(isDel, subLogicId) ||
+							seg->isDelAfterSnapshot(subLogicId, ctx)) {
+						if (regex->matchText(key)) {
+							out->push_back(baseId + subLogicId);
 						}
 					}
 					subPhysicId++;
@@ -2398,6 +5420,63 @@ const {
 				, ctx->regexMatchMemLimit
 				, schema.m_name.c_str(), seg->m_segDir.string().c_str());
 		}
+	};
+	const size_t maxResults = ctx->regexMatchMaxResults;
+	valvec<valvec<llong> > segResults(segNum);
+	size_t threadNum = std::min<size_t>(segNum, g_regexMatchArena.threads());
+	if (threadNum <= 1) {
+		size_t num = 0;
+		for (size_t i = 0; i < segNum && !(maxResults && num >= maxResults); ++i) {
+			matchSegment(i, &segResults[i]);
+			num += segResults[i].size();
+		}
+	}
+	else {
+		// a segment is skipped if finished segments before it have enough
+		// results, so the merged results are same as serial matching
+		std::unique_ptr<std::atomic<llong>[]> segFound(new std::atomic<llong>[segNum]);
+		for (size_t i = 0; i < segNum; ++i)
+			segFound[i].store(-1, std::memory_order_relaxed);
+		std::mutex exMutex;
+		std::exception_ptr except;
+		g_regexMatchArena.parallel_for(segNum, [&](size_t i) {
+			if (maxResults) {
+				size_t num = 0;
+				for (size_t j = 0; j < i; ++j) {
+					llong cnt = segFound[j].load(std::memory_order_acquire);
+					if (cnt > 0)
+						num += size_t(cnt);
+				}
+				if (num >= maxResults)
+					return;
+			}
+			try {
+				matchSegment(i, &segResults[i]);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(exMutex);
+				if (!except)
+					except = std::current_exception();
+				return;
+			}
+			segFound[i].store(segResults[i].size(), std::memory_order_release);
+		});
+		if (except) {
+			std::rethrow_exception(except);
+		}
+	}
+	// merge in segment order
+	size_t total = 0;
+	for (auto& r : segResults)
+		total += r.size();
+	if (maxResults)
+		total = std::min(total, maxResults);
+	recIdvec->reserve(total);
+	for (auto& r : segResults) {
+		size_t num = std::min(r.size(), total - recIdvec->size());
+		recIdvec->append(r.data(), num);
+		if (recIdvec->size() == total)
+			break;
 	}
 	return true;
 }
@@ -2537,114 +5616,144 @@ class TableIndexIter : public IndexIterator {
 		valvec<byte>       data;
 		llong              subId = -1;
 		llong              baseId = -1;
-		llong              padding = 0;
+		uint64_t           keyPrefix = 0; // big endian first 8 bytes of data
+		bool               eof = true;
 	};
 	valvec<OneSeg> m_segs;
-	static bool
-	lessThanImp(const Schema* schema, const OneSeg* segs, size_t x, size_t y) {
-		const auto& xkey = segs[x].data;
-		const auto& ykey = segs[y].data;
-		if (xkey.empty()) {
-			if (ykey.empty())
-				return false; // equal
-			else
-				return true; // xkey < ykey
-		}
-		if (ykey.empty())
-			return false; // xkey > ykey
-		int r = schema->compareData(xkey, ykey);
-		if (r) return r < 0;
-		else   return x < y;
-	}
-	template<bool Forward> class HeapKeyCompareMultiColumns {
-		const Schema* schema;
-		const OneSeg* segs;
-	public:
-		bool operator()(size_t x, size_t y) const {
-			// min heap's compare is 'greater'
-			if (Forward)
-				return lessThanImp(schema, segs, y, x);
-			else
-				return lessThanImp(schema, segs, x, y);
-		}
-		HeapKeyCompareMultiColumns(const Schema& schema1, const OneSeg* segs1)
-		: schema(&schema1), segs(segs1) {}
-	};
-	template<bool Forward> class HeapKeyCompareOneColumn {
-		const Schema::OneColumnComparator comp;
-		const OneSeg* segs;
-	public:
-		bool operator()(size_t x, size_t y) const {
-			// min heap's compare is 'greater'
-			const auto& xkey = segs[x].data;
-			const auto& ykey = segs[y].data;
-			if (Forward)
-				return comp(ykey, xkey) < 0;
-			else
-				return comp(xkey, ykey) < 0;
-		}
-		HeapKeyCompareOneColumn(const Schema& schema1, const OneSeg* segs1)
-		: comp(schema1.getOneColumnComparator()), segs(segs1) {}
-	};
 	valvec<byte> m_keyBuf;
+	valvec<byte> m_endKey;
+	uint64_t     m_endKeyPrefix;
 	ColumnVec    m_keyColvec;
-	terark::valvec<size_t> m_heap;
+	// loser tree of m_segs: m_tree[0] is the winner, m_tree[k] for k > 0 is
+	// the loser at node k, node i + m_segs.size() is the leaf of m_segs[i],
+	// an increment replays just the path of the winner's leaf
+	terark::valvec<size_t> m_tree;
+	terark::valvec<size_t> m_winner; // tmp for buildTree
+	Schema::OneColumnComparator m_oneColumnComp;
 	size_t m_oldsegArrayUpdateSeq;
 	const bool m_forward;
-	bool m_isHeapBuilt;
-
-	void makeHeap() {
-		size_t* beg = m_heap.begin();
-		size_t* end = m_heap.end();
-		const OneSeg* segs = m_segs.data();
-		if (m_ischema.columnNum() == 1) {
-			if (m_forward)
-				std::make_heap(beg, end, HeapKeyCompareOneColumn<1>(m_ischema, segs));
-			else
-				std::make_heap(beg, end, HeapKeyCompareOneColumn<0>(m_ischema, segs));
-		}
-		else {
-			if (m_forward)
-				std::make_heap(beg, end, HeapKeyCompareMultiColumns<1>(m_ischema, segs));
-			else
-				std::make_heap(beg, end, HeapKeyCompareMultiColumns<0>(m_ischema, segs));
+	const bool m_byteLex; // compareData order is byte lex order of keys
+	bool m_isTreeBuilt;
+
+	static bool isByteLexOrder(const Schema& schema) {
+		const size_t colnum = schema.columnNum();
+		for (size_t i = 0; i < colnum; ++i) {
+			switch (schema.getColumnType(i)) {
+			default:
+				return false;
+			case ColumnType::StrZero:
+			case ColumnType::Fixed:
+			case ColumnType::Uuid:
+				break;
+			case ColumnType::Binary:
+			case ColumnType::CarBin:
+				if (i + 1 < colnum)
+					return false; // length prefixed
+				break;
+			}
 		}
+		return true;
+	}
+	static uint64_t keyPrefixOf(fstring key) {
+		uint64_t x = 0;
+		memcpy(&x, key.data(), std::min<size_t>(key.size(), 8));
+	#if !defined(BOOST_BIG_ENDIAN)
+		x = byte_swap(x);
+	#endif
+		return x;
+	}
+
+	// different prefixes decide byte lex order without touching the keys
+	int compareKey(fstring x, uint64_t xp, fstring y, uint64_t yp) const {
+		if (m_byteLex && xp != yp)
+			return xp < yp ? -1 : +1;
+		if (m_oneColumnComp)
+			return m_oneColumnComp(x, y);
+		if (x.empty())
+			return y.empty() ? 0 : -1;
+		if (y.empty())
+			return +1;
+		return m_ischema.compareData(x, y);
+	}
+
+	// true if head of m_segs[x] goes before head of m_segs[y], older
+	// segment goes first on equal keys in forward order
+	bool headBefore(size_t x, size_t y) const {
+		const OneSeg& sx = m_segs[x];
+		const OneSeg& sy = m_segs[y];
+		if (sx.eof || sy.eof)
+			return !sx.eof || (sy.eof && x < y);
+		int r = compareKey(sx.data, sx.keyPrefix, sy.data, sy.keyPrefix);
+		if (r)
+			return m_forward ? r < 0 : r > 0;
+		return m_forward ? x < y : x > y;
+	}
+
+	bool pastEndKey(const OneSeg& cur) const {
+		if (m_endKey.empty())
+			return false;
+		int r = compareKey(cur.data, cur.keyPrefix, m_endKey, m_endKeyPrefix);
+		return m_forward ? r >= 0 : r <= 0;
 	}
 
-	void pushHeap() {
-		size_t* beg = m_heap.begin();
-		size_t* end = m_heap.end();
-		const OneSeg* segs = m_segs.data();
-		if (m_ischema.columnNum() == 1) {
-			if (m_forward)
-				std::push_heap(beg, end, HeapKeyCompareOneColumn<1>(m_ischema, segs));
-			else
-				std::push_heap(beg, end, HeapKeyCompareOneColumn<0>(m_ischema, segs));
+	// a segment past end key is pruned, its iter is not moved any more
+	void loadHead(OneSeg& cur, bool hasKey) {
+		if (hasKey) {
+			cur.subId = cur.seg->getLogicId(cur.subId);
+			if (m_byteLex)
+				cur.keyPrefix = keyPrefixOf(cur.data);
+			cur.eof = pastEndKey(cur);
 		}
 		else {
-			if (m_forward)
-				std::push_heap(beg, end, HeapKeyCompareMultiColumns<1>(m_ischema, segs));
-			else
-				std::push_heap(beg, end, HeapKeyCompareMultiColumns<0>(m_ischema, segs));
+			cur.eof = true;
+		}
+		if (cur.eof) {
+			cur.subId = -3;
+			cur.data.erase_all();
 		}
 	}
 
-	void popHeap() {
-		size_t* beg = m_heap.begin();
-		size_t* end = m_heap.end();
-		const OneSeg* segs = m_segs.data();
-		if (m_ischema.columnNum() == 1) {
-			if (m_forward)
-				std::pop_heap(beg, end, HeapKeyCompareOneColumn<1>(m_ischema, segs));
-			else
-				std::pop_heap(beg, end, HeapKeyCompareOneColumn<0>(m_ischema, segs));
+	// frozen segments don't get new rows, skip them if all rows are deleted
+	// and none of them is visible to the snapshot
+	bool isAllDeleted(const ReadableSegment* seg) const {
+		return seg->m_isFreezed && seg->m_delcnt == seg->m_isDel.size() &&
+			!(m_ctx->m_isUserDefineSnapshot && seg->hasDelVersions());
+	}
+
+	void buildTree() {
+		const size_t n = m_segs.size();
+		m_tree.resize_no_init(n);
+		m_isTreeBuilt = true;
+		if (n <= 1) {
+			if (n)
+				m_tree[0] = 0;
+			return;
 		}
-		else {
-			if (m_forward)
-				std::pop_heap(beg, end, HeapKeyCompareMultiColumns<1>(m_ischema, segs));
+		m_winner.resize_no_init(2 * n);
+		for (size_t i = 0; i < n; ++i)
+			m_winner[n + i] = i;
+		for (size_t k = n - 1; k > 0; --k) {
+			size_t x = m_winner[2*k + 0];
+			size_t y = m_winner[2*k + 1];
+			if (headBefore(x, y))
+				m_winner[k] = x, m_tree[k] = y;
 			else
-				std::pop_heap(beg, end, HeapKeyCompareMultiColumns<0>(m_ischema, segs));
+				m_winner[k] = y, m_tree[k] = x;
+		}
+		m_tree[0] = m_winner[1];
+	}
+
+	void replay(size_t segIdx) {
+		const size_t n = m_segs.size();
+		for (size_t k = (segIdx + n) / 2; k > 0; k /= 2) {
+			if (headBefore(m_tree[k], segIdx))
+				std::swap(m_tree[k], segIdx);
 		}
+		m_tree[0] = segIdx;
+	}
+
+	bool isTreeEmpty() const {
+		return m_segs.empty() || m_segs[m_tree[0]].eof;
 	}
 
 	IndexIterator* createIter(const ReadableSegment& seg) {
@@ -2675,11 +5784,13 @@ class TableIndexIter : public IndexIterator {
 			assert(NULL != seg);
 			size_t lo = lower_bound_ex_0(segA, segN, seg, By_seg_get());
 			if (lo < segN && segA[lo].seg.get() == seg) {
-				assert(segA[lo].baseId == rowNumVec[i]);
+				// baseId is shifted by dropPartitionsOlderThan
 				cur.seg .swap(segA[lo].seg);
 				cur.iter.swap(segA[lo].iter);
 				cur.data.swap(segA[lo].data);
 				cur.subId = segA[lo].subId;
+				cur.keyPrefix = segA[lo].keyPrefix;
+				cur.eof = segA[lo].eof;
 			}
 			else {
 				cur.seg = seg;
@@ -2688,7 +5799,7 @@ class TableIndexIter : public IndexIterator {
 			}
 			cur.baseId = rowNumVec[i];
 		}
-		assert(numChangedSegs > 0);
+		assert(numChangedSegs > 0 || tmp.size() < m_segs.size()); // a drop
 		m_segs.swap(tmp);
 		return numChangedSegs;
 	}
@@ -2700,6 +5811,7 @@ public:
 	  , m_indexId(indexId)
 	  , m_ischema(tab->getIndexSchema(m_indexId))
 	  , m_forward(forward)
+	  , m_byteLex(isByteLexOrder(m_ischema))
 	{
 		assert(tab->m_schema->getIndexSchema(indexId).m_isOrdered);
 		m_isUniqueInSchema = tab->m_schema->getIndexSchema(indexId).m_isUnique;
@@ -2707,23 +5819,41 @@ public:
 			MyRwLock lock(tab->m_rwMutex);
 			tab->m_tableScanningRefCount++;
 		}
+		m_endKeyPrefix = 0;
+		m_oneColumnComp = NULL;
+		if (m_ischema.columnNum() == 1)
+			m_oneColumnComp = m_ischema.getOneColumnComparator();
 		m_oldsegArrayUpdateSeq = 0;
-		m_isHeapBuilt = false;
+		m_isTreeBuilt = false;
 	}
 	~TableIndexIter() {
 		MyRwLock lock(m_tab->m_rwMutex);
 		m_tab->m_tableScanningRefCount--;
 	}
 	void reset() override {
-		m_heap.erase_all();
+		m_tree.erase_all();
 		m_segs.erase_all();
 		m_keyBuf.erase_all();
 		m_oldsegArrayUpdateSeq = 0;
-		m_isHeapBuilt = false;
+		m_isTreeBuilt = false;
 		m_ctx->trySyncSegCtxSpeculativeLock(m_tab.get());
 	}
+	///@{ end key is kept by reset and seek, it takes effect on next increment
+	bool setEndKey(fstring endKey) override {
+		m_endKey.assign(endKey);
+		m_endKeyPrefix = m_byteLex ? keyPrefixOf(endKey) : 0;
+		if (m_isTreeBuilt) {
+			for (auto& cur : m_segs) {
+				if (!cur.eof && pastEndKey(cur))
+					loadHead(cur, false);
+			}
+			buildTree();
+		}
+		return true;
+	}
+	///@}
 	bool increment(llong* id, valvec<byte>* key) override {
-		if (terark_unlikely(!m_isHeapBuilt)) {
+		if (terark_unlikely(!m_isTreeBuilt)) {
 			if (syncSegPtr()) {
 				for (auto& cur : m_segs) {
 					if (cur.iter == nullptr)
@@ -2732,19 +5862,15 @@ public:
 						cur.iter->reset();
 				}
 			}
-			m_heap.erase_all();
-			m_heap.reserve(m_segs.size());
-			for (size_t i = 0; i < m_segs.size(); ++i) {
-				auto& cur = m_segs[i];
-				if (cur.iter->increment(&cur.subId, &cur.data)) {
-					m_heap.push_back(i);
-					cur.subId = cur.seg->getLogicId(cur.subId);
-				}
+			for (auto& cur : m_segs) {
+				if (isAllDeleted(cur.seg.get()))
+					loadHead(cur, false);
+				else
+					loadHead(cur, cur.iter->increment(&cur.subId, &cur.data));
 			}
-			makeHeap();
-			m_isHeapBuilt = true;
+			buildTree();
 		}
-		while (!m_heap.empty()) {
+		while (!isTreeEmpty()) {
 			llong subId;
 			size_t segIdx = incrementNoCheckDel(&subId);
 			if (!isDeleted(segIdx, subId)) {
@@ -2760,28 +5886,22 @@ public:
 		return false;
 	}
 	size_t incrementNoCheckDel(llong* subId) {
-		assert(!m_heap.empty());
-		size_t segIdx = m_heap[0];
-		popHeap();
+		assert(!isTreeEmpty());
+		size_t segIdx = m_tree[0];
 		auto& cur = m_segs[segIdx];
 		*subId = cur.subId;
 		m_keyBuf.swap(cur.data); // should be assign, but swap is more efficient
-		if (cur.iter->increment(&cur.subId, &cur.data)) {
-			assert(m_heap.back() == segIdx);
-			pushHeap();
-			cur.subId = cur.seg->getLogicId(cur.subId);
-		}
-		else {
-			m_heap.pop_back();
-			cur.subId = -3; // eof
-			cur.data.erase_all();
-		}
+		loadHead(cur, cur.iter->increment(&cur.subId, &cur.data));
+		replay(segIdx);
 		return segIdx;
 	}
-	bool isDeleted(size_t segIdx, llong subId) {
+	bool isDeleted(size_t segIdx, llong subId) const {
 		auto seg = m_segs[segIdx].seg.get();
+		if (0 == seg->m_delcnt) {
+			return false; // no lock and no bit test
+		}
 		if (seg->m_isFreezed) {
-			return seg->m_isDel[subId];
+			return seg->m_isDel[subId] && !seg->isDelAfterSnapshot(subId, m_ctx.get());
 		} else {
 			return seg->locked_testIsDel(subId);
 		}
@@ -2793,6 +5913,8 @@ public:
 		return seekBound(key, id, retKey, false);
 	}
 	int seekBound(fstring key, llong* id, valvec<byte>* retKey, bool inclusive) {
+		DbPerfTimer perf(m_tab->m_perf.get(), DbPerfOp::iterSeek);
+		ReadLatencySampler sampler(m_tab->m_readLatencyLimiter);
 		const Schema& schema = m_ischema;
 #if 0//!defined(NDEBUG)
 		fprintf(stderr, "DEBUG: TableIndexIter::%s: segs=%zd key=%s, keylen=%zd\n",
@@ -2834,18 +5956,17 @@ public:
 				if (cur.iter == nullptr)
 					cur.iter = createIter(*cur.seg);
 		}
-		m_heap.erase_all();
-		m_heap.reserve(m_segs.size());
 		for(size_t i = 0; i < m_segs.size(); ++i) {
 			auto& cur = m_segs[i];
+			if (isAllDeleted(cur.seg.get())) {
+				loadHead(cur, false);
+				continue;
+			}
 			int ret = inclusive
 					? cur.iter->seekLowerBound(key, &cur.subId, &cur.data)
 					: cur.iter->seekUpperBound(key, &cur.subId, &cur.data)
 					;
-			if (ret >= 0) {
-				m_heap.push_back(i);
-				cur.subId = cur.seg->getLogicId(cur.subId);
-			}
+			loadHead(cur, ret >= 0);
 		#if 0//!defined(NDEBUG)
 			fprintf(stderr
 				, "DEBUG: %s, seg[%zd].iter->%s(%s) = %d, retKey=%s\n"
@@ -2856,10 +5977,9 @@ public:
 				);
 		#endif
 		}
-		m_isHeapBuilt = true;
-		if (m_heap.size()) {
-			makeHeap();
-			while (!m_heap.empty()) {
+		buildTree();
+		if (!isTreeEmpty()) {
+			while (!isTreeEmpty()) {
 				llong subId;
 				size_t segIdx = incrementNoCheckDel(&subId);
 				if (!isDeleted(segIdx, subId)) {
@@ -2888,7 +6008,7 @@ public:
 		}
 		else {
 		#if !defined(NDEBUG) && 0
-			fprintf(stderr, "DEBUG: heap is empty: key=%s\n"
+			fprintf(stderr, "DEBUG: tree is empty: key=%s\n"
 				, schema.toJsonStr(key).c_str());
 		#endif
 		}
@@ -2963,11 +6083,11 @@ const {
 	if (terark_unlikely(id < 0 || id >= rows)) {
 		THROW_STD(out_of_range, "id = %lld, rows=%lld", id, rows);
 	}
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, id);
+	size_t upp = ctx->m_segLocator.upper_bound(id);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	auto seg = ctx->m_segCtx[upp-1]->seg;
 	llong subId = id - baseId;
-    if(seg->testIsDel(subId))
+    if(seg->testIsDel(subId, ctx))
     {
         throw ReadDeletedRecordException(seg->m_segDir.string(), baseId, subId);
     }
@@ -2991,11 +6111,11 @@ const {
 	if (terark_unlikely(id < 0 || id >= rows)) {
 		THROW_STD(out_of_range, "id = %lld, rows=%lld", id, rows);
 	}
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, id);
+	size_t upp = ctx->m_segLocator.upper_bound(id);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	auto seg = ctx->m_segCtx[upp-1]->seg;
 	llong subId = id - baseId;
-    if(seg->testIsDel(subId))
+    if(seg->testIsDel(subId, ctx))
     {
         throw ReadDeletedRecordException(seg->m_segDir.string(), baseId, subId);
     }
@@ -3010,6 +6130,53 @@ const {
 	selectOneColumnNoLock(id, columnId, colsData, ctx);
 }
 
+// index column of row column columnId, columnNum() if it is not in index
+static size_t
+indexColumnOf(const Schema& indexSchema, size_t columnId) {
+	const valvec<size_t>& proj = indexSchema.getProj();
+	for (size_t k = 0; k < proj.size(); ++k) {
+		if (proj[k] == columnId)
+			return k;
+	}
+	return indexSchema.columnNum();
+}
+
+bool
+DbTable::indexCoversColumns(size_t indexId, const size_t* colsId, size_t colsNum)
+const {
+	assert(indexId < m_schema->getIndexNum());
+	const Schema& indexSchema = m_schema->getIndexSchema(indexId);
+	for (size_t i = 0; i < colsNum; ++i) {
+		if (indexColumnOf(indexSchema, colsId[i]) == indexSchema.columnNum())
+			return false;
+	}
+	return true;
+}
+
+void
+DbTable::selectColumnsFromIndexKey(size_t indexId, fstring key,
+								   const size_t* colsId, size_t colsNum,
+								   valvec<byte>* colsData, DbContext* ctx)
+const {
+	assert(indexId < m_schema->getIndexNum());
+	const Schema& indexSchema = m_schema->getIndexSchema(indexId);
+	auto cols = ctx->cols.get();
+	indexSchema.parseRow(key, cols.get());
+	colsData->erase_all();
+	for (size_t i = 0; i < colsNum; ++i) {
+		size_t k = indexColumnOf(indexSchema, colsId[i]);
+		if (k == indexSchema.columnNum()) {
+			THROW_STD(invalid_argument, "column %s is not in index %s"
+				, m_schema->m_rowSchema->getColumnName(colsId[i]).c_str()
+				, indexSchema.m_name.c_str());
+		}
+		if (i < colsNum-1)
+			indexSchema.projectToNorm((*cols)[k], k, colsData);
+		else
+			indexSchema.projectToLast((*cols)[k], k, colsData);
+	}
+}
+
 void
 DbTable::selectOneColumnNoLock(llong id, size_t columnId,
 									  valvec<byte>* colsData, DbContext* ctx)
@@ -3019,11 +6186,11 @@ const {
 	if (terark_unlikely(id < 0 || id >= rows)) {
 		THROW_STD(out_of_range, "id = %lld, rows=%lld", id, rows);
 	}
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, id);
+	size_t upp = ctx->m_segLocator.upper_bound(id);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	auto seg = ctx->m_segCtx[upp-1]->seg;
 	llong subId = id - baseId;
-    if(seg->testIsDel(subId))
+    if(seg->testIsDel(subId, ctx))
     {
         throw ReadDeletedRecordException(seg->m_segDir.string(), baseId, subId);
     }
@@ -3056,7 +6223,7 @@ void DbTable::selectColgroupsNoLock(llong recId,
 	if (terark_unlikely(recId < 0 || recId >= rows)) {
 		THROW_STD(out_of_range, "recId = %lld, rows=%lld", recId, rows);
 	}
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, recId);
+	size_t upp = ctx->m_segLocator.upper_bound(recId);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	llong subId = recId - baseId;
 	assert(recId >= baseId);
@@ -3075,6 +6242,21 @@ void DbTable::selectOneColgroupNoLock(llong recId, size_t cgId,
 	selectColgroupsNoLock(recId, &cgId, 1, cgData, ctx);
 }
 
+fstring DbTable::selectOneColgroupRef(llong recId, size_t cgId,
+						valvec<byte>* buf, DbContext* ctx) const {
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	llong rows = m_rowNum;
+	if (terark_unlikely(recId < 0 || recId >= rows)) {
+		THROW_STD(out_of_range, "recId = %lld, rows=%lld", recId, rows);
+	}
+	size_t upp = ctx->m_segLocator.upper_bound(recId);
+	llong baseId = ctx->m_rowNumVec[upp-1];
+	llong subId = recId - baseId;
+	assert(recId >= baseId);
+	auto seg = ctx->m_segCtx[upp-1]->seg;
+	return seg->selectOneColgroupRef(subId, cgId, buf, ctx);
+}
+
 #if 0
 StoreIteratorPtr
 DbTable::createProjectIterForward(const valvec<size_t>& cols, DbContext* ctx)
@@ -3115,8 +6297,7 @@ struct SegEntry {
 	febitvec newIsPurged;
 	size_t oldNumPurged;
 	size_t newNumPurged;
-	febitvec  updateBits;
-	valvec<uint32_t> updateList;
+	UpdatedIdRuns updateIds;
 
 	// constructor must be fast enough
 	SegEntry(ColgroupSegment* s, size_t i) : seg(s), idx(i) {
@@ -3182,6 +6363,7 @@ class DbTable::MergeParam {
 public:
 	valvec<SegEntry> m_segs;
     bool m_forcePurgeAndMerge = false;
+	bool m_cancelOnSuspend = false; // by auto task, not explicit compact
 	size_t m_tabSegNum = 0;
 	size_t m_newSegRows = 0;
 	size_t m_old_segArrayUpdateSeq = 0;
@@ -3191,7 +6373,7 @@ public:
 
 	std::string joinPathList() const;
 
-	void syncPurgeBits(double purgeThreshold);
+	void syncPurgeBits(double purgeThreshold, llong oldestSnapshotVersion);
 
 	ReadableIndex*
 	mergeIndex(ReadonlySegment* dseg, size_t indexId, DbContext* ctx);
@@ -3200,6 +6382,7 @@ public:
 
 	void mergeFixedLenColgroup(ReadonlySegment* dseg, size_t colgroupId);
 	void mergeGdictZipColgroup(ReadonlySegment* dseg, size_t colgroupId);
+	std::string findReusableDict(size_t colgroupId) const;
 	void mergeAndPurgeColgroup(ReadonlySegment* dseg, size_t colgroupId);
 };
 
@@ -3213,7 +6396,9 @@ std::string DbTable::MergeParam::joinPathList() const {
 	return str;
 }
 
-void DbTable::MergeParam::syncPurgeBits(double purgeThresholdRatio) {
+// rows visible to alive snapshots are not purged
+void DbTable::MergeParam::syncPurgeBits(double purgeThresholdRatio,
+										llong oldestSnapshotVersion) {
 	size_t newSumDelcnt = 0;
 	size_t oldSumPurged = 0;
 	for (const auto& e : m_segs) {
@@ -3250,6 +6435,7 @@ void DbTable::MergeParam::syncPurgeBits(double purgeThresholdRatio) {
 			}
 			seg->m_bookUpdates = true;
 			e.newIsPurged = seg->m_isDel;
+			seg->keepSnapshotRows(&e.newIsPurged, oldestSnapshotVersion);
 			e.newNumPurged = e.newIsPurged.popcnt();
 			e.oldNumPurged = seg->m_isPurged.max_rank1();
 			m_newpurgeBits.append(e.newIsPurged);
@@ -3265,11 +6451,11 @@ void DbTable::MergeParam::syncPurgeBits(double purgeThresholdRatio) {
 		double newMarkDelRatio = 1.0*newMarkDelcnt / (oldRealRecords + 0.1);
 		// may cause book more records during 'e.newIsPurged = seg->m_isDel'
 		// but this would not cause big problems
-		seg->m_updateList.reserve(1024); // reduce enlarge times
 		seg->m_bookUpdates = true;
 		if (seg->getWritableSegment() || newMarkDelRatio > purgeThresholdRatio) {
 			// do purge: physic delete
 			e.newIsPurged = seg->m_isDel; // don't lock
+			seg->keepSnapshotRows(&e.newIsPurged, oldestSnapshotVersion);
 			e.newNumPurged = e.newIsPurged.popcnt(); // recompute purge count
 		} else {
 			e.newIsPurged = seg->m_isPurged;
@@ -3279,9 +6465,177 @@ void DbTable::MergeParam::syncPurgeBits(double purgeThresholdRatio) {
 	}
 }
 
+// k-way merge of the sorted index iterators of input readonly segments,
+// record ids are mapped to physic ids of the merged segment and purged
+// records are skipped, keys are never materialized as a whole
+class MergeSortedIndexInput : public SortedIndexInput {
+	struct Cursor {
+		IndexIteratorPtr iter;
+		valvec<byte>     key;
+		llong            newId;
+		llong            baseId; // new physic id of the first record
+		valvec<uint32_t> idMap;  // old physic id => new id - baseId
+	};
+	const valvec<SegEntry>& m_segs;
+	const size_t   m_indexId;
+	const Schema&  m_schema;
+	DbContext*     m_ctx;
+	valvec<Cursor> m_cursors;
+	valvec<size_t> m_heap; // min heap of cursor index
+	llong          m_rows;
+	bool           m_started;
+
+	bool advance(Cursor& c) {
+		llong oldId = -1;
+		while (c.iter->increment(&oldId, &c.key)) {
+			if (c.idMap.empty()) {
+				c.newId = c.baseId + oldId;
+				return true;
+			}
+			assert(size_t(oldId) < c.idMap.size());
+			uint32_t subId = c.idMap[oldId];
+			if (UINT32_MAX != subId) {
+				c.newId = c.baseId + subId;
+				return true;
+			}
+		}
+		return false;
+	}
+	// for std heap functions: top is the min (key, newId)
+	bool heapLess(size_t x, size_t y) const {
+		const Cursor& cx = m_cursors[x];
+		const Cursor& cy = m_cursors[y];
+		int ret = m_schema.compareData(cx.key, cy.key);
+		if (ret)
+			return ret > 0;
+		return cx.newId > cy.newId;
+	}
+	void start() {
+		m_started = true;
+		m_cursors.resize(m_segs.size());
+		llong baseId = 0;
+		for (size_t i = 0; i < m_segs.size(); ++i) {
+			const SegEntry& e = m_segs[i];
+			const ColgroupSegment* seg = e.seg;
+			Cursor& c = m_cursors[i];
+			c.baseId = baseId;
+			if (e.needsRePurge()) {
+				const bm_uint_t* oldpurgeBits = seg->m_isPurged.bldata();
+				const bm_uint_t* newpurgeBits = e.newIsPurged.bldata();
+				size_t logicRows = seg->m_isDel.size();
+				uint32_t subId = 0;
+				c.idMap.reserve(seg->getPhysicRows());
+				for (size_t logicId = 0; logicId < logicRows; ++logicId) {
+					if (!oldpurgeBits || !terark_bit_test(oldpurgeBits, logicId)) {
+						if (!terark_bit_test(newpurgeBits, logicId))
+							c.idMap.push_back(subId++);
+						else
+							c.idMap.push_back(UINT32_MAX);
+					}
+				}
+				baseId += subId;
+			}
+			else {
+				baseId += seg->getPhysicRows();
+			}
+			c.iter = seg->m_indices[m_indexId]->createIndexIterForward(m_ctx);
+			if (advance(c)) {
+				m_heap.push_back(i);
+			}
+		}
+		assert(baseId == m_rows);
+		auto cmp = [this](size_t x, size_t y) { return heapLess(x, y); };
+		std::make_heap(m_heap.begin(), m_heap.end(), cmp);
+	}
+
+public:
+	MergeSortedIndexInput(const valvec<SegEntry>& segs, size_t indexId,
+						  DbContext* ctx)
+		: m_segs(segs), m_indexId(indexId)
+		, m_schema(segs[0].seg->m_schema->getIndexSchema(indexId))
+	{
+		m_ctx = ctx;
+		m_rows = 0;
+		m_started = false;
+		for (auto& e : segs) {
+			if (e.newIsPurged.empty())
+				m_rows += e.seg->getPhysicRows();
+			else // newIsPurged includes old purged records
+				m_rows += e.newIsPurged.size() - e.newNumPurged;
+		}
+	}
+	llong numRows() override { return m_rows; }
+
+	// may include purged keys, so the bounds are not tight
+	bool keyBounds(valvec<byte>* minKey, valvec<byte>* maxKey) override {
+		if (0 == m_rows)
+			return false;
+		bool hasKey = false;
+		valvec<byte> key;
+		llong id;
+		for (auto& e : m_segs) {
+			auto index = e.seg->m_indices[m_indexId].get();
+			IndexIteratorPtr fwd = index->createIndexIterForward(m_ctx);
+			IndexIteratorPtr bwd = index->createIndexIterBackward(m_ctx);
+			if (fwd->increment(&id, &key)) {
+				if (!hasKey || m_schema.compareData(key, *minKey) < 0)
+					minKey->assign(key);
+			}
+			if (bwd->increment(&id, &key)) {
+				if (!hasKey || m_schema.compareData(key, *maxKey) > 0)
+					maxKey->assign(key);
+				hasKey = true;
+			}
+		}
+		return hasKey;
+	}
+
+	bool next(llong* recId, valvec<byte>* key) override {
+		if (!m_started)
+			start();
+		if (m_heap.empty())
+			return false;
+		auto cmp = [this](size_t x, size_t y) { return heapLess(x, y); };
+		std::pop_heap(m_heap.begin(), m_heap.end(), cmp);
+		Cursor& c = m_cursors[m_heap.back()];
+		*recId = c.newId;
+		key->swap(c.key);
+		if (advance(c))
+			std::push_heap(m_heap.begin(), m_heap.end(), cmp);
+		else
+			m_heap.pop_back();
+		return true;
+	}
+};
+
+// merge index from index iterators of input segments, this path is only
+// available when all inputs are readonly segments with ordered index
+static ReadableIndex*
+mergeIndexFromSorted(const valvec<SegEntry>& segs, ReadonlySegment* dseg,
+					 size_t indexId, DbContext* ctx) {
+	const Schema& schema = segs[0].seg->m_schema->getIndexSchema(indexId);
+	if (!schema.m_isOrdered || schema.m_enableLinearScan) {
+		return NULL;
+	}
+	for (auto& e : segs) {
+		if (!e.seg->getReadonlySegment() || !e.seg->m_indices[indexId]->isOrdered())
+			return NULL;
+	}
+	MergeSortedIndexInput input(segs, indexId, ctx);
+	if (0 == input.numRows()) {
+		return new EmptyIndexStore();
+	}
+	return dseg->buildIndexAndFilterFromSorted(indexId, schema, input);
+}
+
 ReadableIndex*
 DbTable::MergeParam::
 mergeIndex(ReadonlySegment* dseg, size_t indexId, DbContext* ctx) {
+	if (ReadableIndex* index = mergeIndexFromSorted(m_segs, dseg, indexId, ctx)) {
+		fprintf(stderr, "INFO: merge index %s by streaming sorted input\n"
+			, m_segs[0].seg->m_schema->getIndexSchema(indexId).m_name.c_str());
+		return index;
+	}
 	valvec<byte> rec;
 	SortableStrVec strVec;
 	const Schema& schema = m_segs[0].seg->m_schema->getIndexSchema(indexId);
@@ -3329,7 +6683,7 @@ mergeIndex(ReadonlySegment* dseg, size_t indexId, DbContext* ctx) {
 	if (strVec.str_size() == 0 && strVec.size() == 0) {
 		return new EmptyIndexStore();
 	}
-	ReadableIndex* index = dseg->buildIndex(schema, strVec);
+	ReadableIndex* index = dseg->buildIndexAndFilter(indexId, schema, strVec);
 #if defined(SLOW_DEBUG_CHECK)
 	valvec<byte> rec2;
 	valvec<llong> recIdvec;
@@ -3521,8 +6875,45 @@ mergeGdictZipColgroup(ReadonlySegment* dseg, size_t colgroupId) {
 	TERARK_RT_assert(parts->numParts() > 0, std::logic_error);
 	ReadableStorePtr mpstore = parts->finishParts();
 	StoreIteratorPtr iter = mpstore->ensureStoreIterForward(m_ctx.get());
+	std::string reuseDict;
+	if (schema.m_dictZipReuse) {
+		reuseDict = findReusableDict(colgroupId);
+	}
 	dseg->m_colgroups[colgroupId] = dseg->buildDictZipStore(schema,
-		dseg->m_segDir, *iter, m_newpurgeBits.bldata(), &m_oldpurgeBits);
+		dseg->m_segDir, *iter, m_newpurgeBits.bldata(), &m_oldpurgeBits,
+		reuseDict);
+}
+
+// dict samples("colgroup-<name>...-dict") of the largest input segment,
+// empty if it has no saved dict samples
+std::string
+DbTable::MergeParam::findReusableDict(size_t colgroupId) const {
+	const ReadableSegment* largest = NULL;
+	llong maxSize = -1;
+	for (const auto& e : m_segs) {
+		llong size = e.seg->m_colgroups[colgroupId]->dataInflateSize();
+		if (size > maxSize) {
+			maxSize = size;
+			largest = e.seg;
+		}
+	}
+	if (NULL == largest || largest->getWritableSegment()) {
+		return std::string();
+	}
+	const Schema& schema = largest->m_schema->getColgroupSchema(colgroupId);
+	const std::string prefix = "colgroup-" + schema.m_name;
+	std::string found;
+	for (auto& entry : fs::directory_iterator(largest->m_segDir)) {
+		std::string fname = entry.path().filename().string();
+		if (fstring(fname).startsWith(prefix) && fstring(fname).endsWith("-dict")) {
+			if (found.empty() || fname < found)
+				found = fname;
+		}
+	}
+	if (found.empty()) {
+		return found;
+	}
+	return (largest->m_segDir / found).string();
 }
 
 void
@@ -3641,10 +7032,24 @@ moveStoreFiles(PathRef srcDir, PathRef destDir,
 	}
 }
 
+// index stores are the first colgroups, the inner store of a
+// PurgeRemapStore is kept from the old segment, it was not written
+static llong segmentStoreBytes(const ReadableSegment* seg) {
+	llong size = 0;
+	for (auto& store : seg->m_colgroups) {
+		if (auto remap = dynamic_cast<const PurgeRemapStore*>(store.get()))
+			size += remap->getRemap().mem_size();
+		else if (store)
+			size += store->dataStorageSize();
+	}
+	return size;
+}
+
 // If segments to be merged have purged records, these physical records id
 // must be mapped to logical records id, thus purge bitmap is required for
 // the merged result segment
 void DbTable::merge(MergeParam& toMerge) {
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::merge);
 	fs::path destMergeDir = getMergePath(m_dir, m_mergeSeqNum+1);
 	if (fs::exists(destMergeDir)) {
 		THROW_STD(logic_error, "dir: '%s' should not existed"
@@ -3654,18 +7059,33 @@ void DbTable::merge(MergeParam& toMerge) {
 	std::string segPathList = toMerge.joinPathList();
 	fprintf(stderr, "INFO: merge segments:\n%sTo\t%s ...\n"
 		, segPathList.c_str(), destSegDir.string().c_str());
-#if defined(NDEBUG)
+	SegmentEventScope evScope(SegmentEventType::merge, m_dir.string());
+	{
+		SegmentEvent& ev = evScope.ev();
+		llong inflate = 0;
+		for (auto& e : toMerge.m_segs) {
+			ev.inputSegs.push_back(e.seg->m_segDir.string());
+			ev.inputBytes += e.seg->dataStorageSize();
+			ev.inputRows += e.seg->m_isDel.size();
+			ev.inputDeletedRows += e.seg->m_delcnt;
+			inflate += e.seg->dataInflateSize();
+		}
+		ev.outputSeg = destSegDir.string();
+		ev.memBytes = std::min(inflate, m_schema->m_compressingWorkMemSize);
+	}
 try{
-#endif
 	fs::create_directories(destSegDir);
+	logManifestEdit("m" + std::to_string(m_mergeSeqNum + 1));
 	fs::path   mergingLockFile = destMergeDir / "merging.lock";
 	FileStream mergingLockFp(mergingLockFile.string().c_str(), "wb");
 	ReadonlySegmentPtr dseg = this->myCreateReadonlySegment(destSegDir);
+	dseg->m_buildTab = this;
+	dseg->m_buildCancelOnSuspend = toMerge.m_cancelOnSuspend;
 	const size_t indexNum = m_schema->getIndexNum();
 	const size_t colgroupNum = m_schema->getColgroupNum();
 	dseg->m_indices.resize(indexNum);
 	dseg->m_colgroups.resize(colgroupNum);
-	toMerge.syncPurgeBits(m_schema->m_purgeDeleteThreshold);
+	toMerge.syncPurgeBits(m_schema->m_purgeDeleteThreshold, m_oldestSnapshotVersion);
 	DbContextPtr ctx(this->createDbContext());
 	toMerge.m_ctx = ctx;
 	dseg->m_isDel.erase_all();
@@ -3695,11 +7115,15 @@ try{
 		dseg->m_isPurged.build_cache(true, false);
 		assert(dseg->m_isPurged.size() == toMerge.m_newSegRows);
 	}
+	SegmentPhaseTimer indexPhase(&evScope, SegmentPhase::index);
 	for (size_t i = 0; i < indexNum; ++i) {
+		dseg->checkBuildCancelled();
 		ReadableIndex* index = toMerge.mergeIndex(dseg.get(), i, ctx.get());
 		dseg->m_indices[i] = index;
 		dseg->m_colgroups[i] = index->getReadableStore();
 	}
+	indexPhase.stop();
+	SegmentPhaseTimer storePhase(&evScope, SegmentPhase::store);
 	for (auto& e : toMerge.m_segs) {
 		for(auto fpath : fs::directory_iterator(e.seg->m_segDir)) {
 			e.files.push_back(fpath.path().filename().string());
@@ -3708,6 +7132,7 @@ try{
 		assert(e.seg->m_bookUpdates);
 	}
 	for (size_t cgId = indexNum; cgId < colgroupNum; ++cgId) {
+		dseg->checkBuildCancelled();
 		const Schema& schema = m_schema->getColgroupSchema(cgId);
 		if (schema.should_use_FixedLenStore()) {
 			toMerge.mergeFixedLenColgroup(dseg.get(), cgId);
@@ -3725,17 +7150,30 @@ try{
 		const std::string prefix = "colgroup-" + schema.m_name;
 		size_t newPartIdx = 0;
 		for (auto& e : toMerge.m_segs) {
-			if (e.seg->getWritableSegment() || e.needsRePurge()) {
-				assert(e.newIsPurged.size() >= 1);
-				assert(e.newIsPurged.size() == e.seg->m_isDel.size());
-				if (e.newIsPurged.size() == e.newNumPurged) {
+			// files of PurgeRemapStore have purged rows, can not be reused,
+			// projected colgroups of an old layout have no files
+			bool isRemapped = nullptr !=
+				dynamic_cast<PurgeRemapStore*>(e.seg->m_colgroups[cgId].get());
+			bool isProjected = nullptr !=
+				dynamic_cast<LayoutProjectStore*>(e.seg->m_colgroups[cgId].get());
+			if (e.seg->getWritableSegment() || e.needsRePurge() || isRemapped || isProjected) {
+				febitvec noPurged;
+				const febitvec* newIsPurged = &e.newIsPurged;
+				if (e.newIsPurged.empty()) {
+					assert(isRemapped || isProjected); // compacted id space
+					noPurged.resize(e.seg->m_isDel.size(), false);
+					newIsPurged = &noPurged;
+				}
+				assert(newIsPurged->size() >= 1);
+				assert(newIsPurged->size() == e.seg->m_isDel.size());
+				if (newIsPurged->size() == e.newNumPurged) {
 					// new store is empty, all records are purged
 					continue;
 				}
 				auto tmpDir1 = destSegDir / "temp-store";
 				fs::create_directory(tmpDir1);
 				auto store = dseg->purgeColgroup_s(cgId,
-					e.newIsPurged, e.newNumPurged, e.seg, ctx.get(), tmpDir1);
+					*newIsPurged, e.newNumPurged, e.seg, ctx.get(), tmpDir1);
 				store->save(tmpDir1 / prefix);
 				moveStoreFiles(tmpDir1, destSegDir, prefix, newPartIdx);
 				fs::remove_all(tmpDir1);
@@ -3758,8 +7196,12 @@ try{
 		}
 	}
 
+	storePhase.stop();
+	dseg->checkBuildCancelled(); // the last checkpoint, before commit
+	SegmentPhaseTimer reloadPhase(&evScope, SegmentPhase::reload);
 	dseg->savePurgeBits(destSegDir);
 	dseg->saveIndices(destSegDir);
+	dseg->saveBloomFilters(destSegDir);
 	dseg->saveIsDel(destSegDir);
 
 	// load as mmap
@@ -3769,8 +7211,24 @@ try{
 	dseg->m_indices.erase_all();
 	dseg->m_colgroups.erase_all();
 	dseg->load(destSegDir);
+	dseg->buildZoneMap(); // merged stores are only complete after load
+	dseg->saveZoneMap(destSegDir);
+	dseg->buildIndexStats();
+	dseg->saveIndexStats(destSegDir);
+	for (auto& e : toMerge.m_segs) {
+		if (ReadonlySegment* rdseg = e.seg->getReadonlySegment())
+			dseg->addReadHeat(*rdseg);
+		// all are of one partition, or all are unknown
+		dseg->m_timePartition = std::max(dseg->m_timePartition.load(),
+										 e.seg->m_timePartition.load());
+	}
+	saveTimePartition(dseg.get());
 //	assert(dseg->m_isDel.size() == dseg->m_isPurged.size());
 	assert(dseg->m_isDel.size() == toMerge.m_newSegRows);
+	reloadPhase.stop();
+	evScope.ev().outputBytes = dseg->dataStorageSize();
+	evScope.ev().outputRows = dseg->getPhysicRows();
+	m_compactWrittenBytes += segmentStoreBytes(dseg.get());
 
 	// m_isMerging is true, m_segments will never be changed
 	// so lock is not needed
@@ -3827,7 +7285,7 @@ try{
 	auto syncOneRecord = [](ReadonlySegment* dseg, ReadableSegment* sseg,
 							size_t baseLogicId, size_t subId) {
 		if (sseg->m_isDel[subId]) {
-			dseg->m_isDel.set1(baseLogicId + subId);
+			dseg->m_isDel.set1(baseLogicId + subId); // blocks are rebuilt
 		}
 		else {
 			assert(!dseg->m_isDel[baseLogicId + subId]);
@@ -3839,52 +7297,53 @@ try{
 		for (auto& e : toMerge.m_segs) {
 			ReadableSegment* sseg = e.seg;
 			assert(sseg->m_bookUpdates);
-			assert(e.updateBits.empty());
-			assert(e.updateList.empty());
+			assert(e.updateIds.empty());
 			SpinRwLock segLock(sseg->m_segMutex, true);
-			e.updateBits.swap(sseg->m_updateBits);
-			e.updateList.swap(sseg->m_updateList);
+			e.updateIds.swap(sseg->m_updateIds);
 		}
 		size_t baseLogicId = 0;
 		for (auto& e : toMerge.m_segs) {
 			ReadableSegment* sseg = e.seg;
-			if (e.updateBits.empty()) {
-				for (size_t subId : e.updateList) {
-					syncOneRecord(dseg, sseg, baseLogicId, subId);
-				}
-			}
-			else {
-				assert(e.updateBits.size() == sseg->m_isDel.size() + 1);
-				assert(e.updateList.empty());
-				size_t subId = e.updateBits.zero_seq_len(0);
-				size_t subRows = sseg->m_isDel.size();
-				while (subId < subRows) {
-					syncOneRecord(dseg, sseg, baseLogicId, subId);
-					size_t zeroSeqLen = e.updateBits.zero_seq_len(subId + 1);
-					subId += 1 + zeroSeqLen;
-				}
-				assert(subId == subRows);
-			}
+			e.updateIds.for_each([&](size_t subId) {
+				syncOneRecord(dseg, sseg, baseLogicId, subId);
+			});
 			baseLogicId += sseg->m_isDel.size();
-			e.updateList.erase_all();
-			e.updateBits.erase_all();
+			e.updateIds.erase_all();
 		}
 		assert(baseLogicId == toMerge.m_newSegRows);
-		dseg->m_delcnt = dseg->m_isDel.popcnt();
+		dseg->m_delcnt = dseg->rebuildIsDelBlocks(); // dseg is not published
 	};
 	{
 		syncUpdates(dseg.get()); // no lock
 		MyRwLock lock(m_rwMutex, true);
 		syncUpdates(dseg.get()); // write locked
+		size_t verBaseId = 0;
 		for (auto& e : toMerge.m_segs) {
 			e.seg->m_bookUpdates = false;
+			if (e.seg->hasDelVersions())
+				dseg->copyDelVersions(*e.seg, verBaseId, m_oldestSnapshotVersion);
+			verBaseId += e.seg->m_isDel.size();
 		}
 		assert(toMerge.m_old_segArrayUpdateSeq == m_segArrayUpdateSeq);
+		if (m_uniqKeyFilter) {
+			// keys of dseg are a subset of keys of toMerge.m_segs
+			bool covered = true;
+			for (auto& e : toMerge.m_segs)
+				covered = covered && m_uniqKeyFilter->covers(e.seg);
+			if (covered)
+				dseg->m_uniqKeyFilterGen = m_uniqKeyFilter->m_gen;
+		}
 		m_segments.swap(newSegs);
 		m_rowNumVec.swap(newRowNumVec);
 		m_rowNumVec.back() = newRowNumVec.back();
 		m_mergeSeqNum++;
+		if (m_manifest.isOpen()) { // the commit of the merge
+			std::set<size_t> oldMergeSeqs = m_manifest.state().oldMergeSeqs;
+			oldMergeSeqs.insert(m_mergeSeqNum - 1);
+			resetManifestInLock(oldMergeSeqs);
+		}
 		m_segArrayUpdateSeq++;
+		publishSegArrayInLock();
 #if defined(SLOW_DEBUG_CHECK)
 		valvec<byte> r1, r2;
 		size_t baseLogicId = 0;
@@ -3927,9 +7386,22 @@ try{
 	}
 	fprintf(stderr, "INFO: merge segments:\n%sTo\t%s done!\n"
 		, segPathList.c_str(), destSegDir.string().c_str());
-#if defined(NDEBUG)
+	evScope.setDone();
+	saveHotColumns();
+}
+catch (const TaskCancelledException& ex) {
+	evScope.setFailed(ex.what());
+	fprintf(stderr
+		, "INFO: merge segments: %s\n%sTo\t%s cancelled, rollback!\n"
+		, ex.what(), segPathList.c_str(), destSegDir.string().c_str());
+	for (auto& e : toMerge.m_segs) {
+		cancelBookUpdates(e.seg);
+	}
+	fs::remove_all(destMergeDir);
 }
+#if defined(NDEBUG)
 catch (const std::exception& ex) {
+	evScope.setFailed(ex.what());
 	fprintf(stderr
 		, "ERROR: merge segments: ex.what = %s\n%sTo\t%s failed, rollback!\n"
 		, ex.what(), segPathList.c_str(), destSegDir.string().c_str());
@@ -3973,13 +7445,35 @@ void DbTable::clear() {
 	m_wrSeg = nullptr;
 	m_mergeSeqNum++;
 	m_segArrayUpdateSeq++;
+	m_wrSubIdReserveGen++;
+
+	// all segments are in old merge dirs, rename them into the trash, then
+	// dead segments just remove_all their non-existed dirs
+	std::vector<fs::path> oldMergeDirs;
+	for (auto& x : fs::directory_iterator(m_dir)) {
+		long mergeSeq = -1;
+		if (sscanf(x.path().filename().string().c_str(), "g-%04ld", &mergeSeq) == 1
+				&& size_t(mergeSeq) != m_mergeSeqNum) {
+			oldMergeDirs.push_back(x.path());
+		}
+	}
+	for (auto& mergeDir : oldMergeDirs) {
+		removeDirInBackground(mergeDir, m_dir / ".trash");
+	}
 
 	const size_t segIdx = 0;
 	m_wrSeg = myCreateWritableSegment(getSegPath("wr", segIdx));
+	m_wrSegStartTime = g_pf.now();
 	m_segments.push_back(m_wrSeg);
 	m_rowNumVec.push_back(0);
 	m_rowNumVec.push_back(0);
 	m_rowNum = 0;
+	if (m_manifest.isOpen()) {
+		std::set<size_t> oldMergeSeqs = m_manifest.state().oldMergeSeqs;
+		oldMergeSeqs.insert(m_mergeSeqNum - 1);
+		resetManifestInLock(oldMergeSeqs);
+	}
+	publishSegArrayInLock();
 }
 
 void DbTable::flush() {
@@ -3997,6 +7491,7 @@ void DbTable::flush() {
 		if (wStore) {
 			auto wSeg = dynamic_cast<WritableSegment*>(seg);
 			wSeg->flushSegment();
+			saveTimePartition(seg);
 		}
 	}
 }
@@ -4022,6 +7517,8 @@ static void waitForBackgroundTasks(MyRwMutex& m_rwMutex, size_t& m_bgTaskNum) {
 }
 
 void DbTable::compact() {
+	checkNotReplica("compact");
+	DbEnvScope envScope(getCompactEnv());
 	profiling pf;
 	llong t0 = pf.now();
 	llong t1 = t0;
@@ -4070,7 +7567,91 @@ void DbTable::compact() {
         ;
 }
 
+static bool
+segmentHasKeyInRange(const ReadableSegment* seg, size_t indexId,
+					 fstring lo, fstring hi, DbContext* ctx) {
+	if (seg->m_isDel.size() == 0)
+		return false;
+	const Schema& schema = seg->m_schema->getIndexSchema(indexId);
+	IndexIteratorPtr iter(seg->m_indices[indexId]->createIndexIterForward(ctx));
+	llong physicId = -1;
+	auto key = ctx->bufs.get();
+	bool found;
+	if (lo.empty())
+		found = iter->increment(&physicId, key.get());
+	else
+		found = iter->seekLowerBound(lo, &physicId, key.get()) >= 0;
+	return found && (hi.empty() || schema.compareData(*key, hi) < 0);
+}
+
+void DbTable::compactRange(size_t indexId, fstring lo, fstring hi) {
+	checkNotReplica("compactRange");
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "invalid indexId = %zd, indexNum = %zd"
+			, indexId, m_schema->getIndexNum());
+	}
+	if (!m_schema->getIndexSchema(indexId).m_isOrdered) {
+		THROW_STD(invalid_argument, "indexId = %zd is not ordered", indexId);
+	}
+	if (lo.empty() && hi.empty()) {
+		compact();
+		return;
+	}
+	DbEnvScope envScope(getCompactEnv());
+	DbContextPtr ctx(this->createDbContext());
+	for (;;) {
+		MyRwLock lock(m_rwMutex, true);
+		if (m_isMerging || m_inprogressWritingCount > 0) {
+			lock.release();
+			tbb::this_tbb_thread::sleep(tbb::tick_count::interval_t(0.05));
+			continue;
+		}
+		if (m_wrSeg && m_wrSeg->m_isDel.size() > 0 &&
+				segmentHasKeyInRange(m_wrSeg.get(), indexId, lo, hi, ctx.get())) {
+			doCreateNewSegmentInLock();
+		}
+		break;
+	}
+	waitForBackgroundTasks(m_rwMutex, m_bgTaskNum);
+	// each round converts, purges or merges some of the overlapped segments
+	for (size_t round = 0; round < DEFAULT_maxSegNum; ++round) {
+		valvec<ReadableSegmentPtr> segs;
+		{
+			MyRwLock lock(m_rwMutex, false);
+			segs.assign(m_segments);
+		}
+		size_t segBeg = size_t(-1), segEnd = 0;
+		for (size_t i = 0; i < segs.size(); ++i) {
+			auto seg = segs[i].get();
+			if (!seg->m_isFreezed || seg->m_isDel.size() == seg->m_delcnt)
+				continue;
+			if (segmentHasKeyInRange(seg, indexId, lo, hi, ctx.get())) {
+				segBeg = std::min(segBeg, i);
+				segEnd = i + 1;
+			}
+		}
+		if (segBeg >= segEnd)
+			break;
+		bool hasWork = segEnd - segBeg > 1;
+		for (size_t i = segBeg; i < segEnd && !hasWork; ++i) {
+			auto seg = segs[i].get();
+			hasWork = seg->getWritableSegment() != NULL ||
+				seg->m_delcnt > seg->m_isPurged.max_rank1();
+		}
+		if (!hasWork)
+			break;
+		{
+			MyRwLock lock(m_rwMutex, true);
+			this->m_bgTaskNum++; // decreased by autoConvMergePurge
+		}
+		if (!autoConvMergePurge(true, segBeg, segEnd))
+			break;
+	}
+}
+
 void DbTable::syncFinishWriting() {
+	checkNotReplica("syncFinishWriting");
+	waitAsyncIndex();
     m_autoTask = false;
 	m_wrSeg = nullptr; // can't write anymore
 	waitForBackgroundTasks(m_rwMutex, m_bgTaskNum);
@@ -4080,6 +7661,7 @@ void DbTable::syncFinishWriting() {
 		if (wrseg->m_isDel.empty()) {
 			wrseg->deleteSegment();
 			m_segments.pop_back();
+			logManifestEdit("-" + getSegPath("wr", m_segments.size()).filename().string());
 		}
 		else if (wrseg->getWritableSegment() != nullptr) {
 			wrseg->getWritableSegment()->markFrozen();
@@ -4096,16 +7678,372 @@ void DbTable::asyncPurgeDelete() {
 
 void DbTable::dropTable() {
 	assert(!m_dir.empty());
+	checkNotReplica("dropTable");
+	MyRwLock lock(m_rwMutex, true);
 	for (auto& seg : m_segments) {
 		seg->deleteSegment();
 	}
 	m_segments.erase_all();
 	m_wrSeg = nullptr;
 	m_tobeDrop = true;
+	// running background tasks may create files in m_dir, then the rename
+	// is deferred to ~DbTable
+	if (0 == m_bgTaskNum && m_trashDir.empty()) {
+		auto trash = TrashDeleter::trashName(m_dir, m_dir.parent_path() / ".trash");
+		if (renameToTrash(m_dir, trash)) {
+			m_trashDir = trash;
+		}
+	}
 }
 
-std::string DbTable::toJsonStr(fstring row) const {
-	return m_schema->m_rowSchema->toJsonStr(row);
+static void
+saveIsDelSnapshot(PathRef segDir, size_t rows, const valvec<byte>& bits) {
+	fs::path isDelFpath = segDir / "IsDel";
+	NativeDataOutput<FileStream> file;
+	file.open(isDelFpath.string().c_str(), "wb");
+	file << uint64_t(rows);
+	file.ensureWrite(bits.data(), bits.size());
+}
+
+void DbTable::backupTo(PathRef dir, TableBackupStat* stat) {
+	if (fs::exists(dir) && !fs::is_empty(dir)) {
+		THROW_STD(invalid_argument, "backup dir is not empty: %s",
+			dir.string().c_str());
+	}
+	TableBackupStat myStat;
+	if (NULL == stat) {
+		stat = &myStat;
+	}
+	*stat = TableBackupStat();
+	// merge and purge may rename or delete dirs of readonly segments
+	suspendCompaction();
+	BOOST_SCOPE_EXIT(this_) {
+		this_->resumeCompaction();
+	}BOOST_SCOPE_EXIT_END;
+	fs::create_directories(getMergePath(dir, 0));
+	valvec<ReadableSegmentPtr> segs;
+	valvec<valvec<byte> > isDel;
+	valvec<size_t> isDelRows;
+	std::string manifest;
+	manifest += "# backup of ";
+	manifest += m_dir.string();
+	manifest += "\n";
+	{
+		MyRwLock lock(m_rwMutex, true);
+		bool frozen = tryFreezeWrSegInLock(lock);
+		segs.assign(m_segments);
+		isDel.resize(segs.size());
+		isDelRows.resize(segs.size());
+		for (size_t i = 0; i < segs.size(); ++i) {
+			const febitvec& bits = segs[i]->m_isDel;
+			isDel[i].assign((const byte*)bits.bldata(), bits.mem_size());
+			isDelRows[i] = bits.size();
+		}
+		if (!frozen) {
+			// rows of m_wrSeg are changed inplace, save it in the lock
+			fprintf(stderr
+				, "WARN: backupTo: can not freeze writable segment: %s, save it in lock\n"
+				, m_wrSeg->m_segDir.string().c_str());
+			size_t segIdx = segs.size() - 1;
+			fs::path segDir = getSegPath2(dir, 0, "wr", segIdx);
+			fs::create_directories(segDir);
+			m_wrSeg->save(segDir);
+			saveIsDelSnapshot(segDir, isDelRows[segIdx], isDel[segIdx]);
+			stat->writableSegNum++;
+			manifest += "save " + segDir.filename().string() + "\n";
+			segs.pop_back();
+		}
+	}
+	for (size_t segIdx = 0; segIdx < segs.size(); ++segIdx) {
+		ReadableSegment* seg = segs[segIdx].get();
+		if (seg->getWritableStore()) {
+			fs::path segDir = getSegPath2(dir, 0, "wr", segIdx);
+			fs::create_directories(segDir);
+			seg->save(segDir);
+			saveIsDelSnapshot(segDir, isDelRows[segIdx], isDel[segIdx]);
+			stat->writableSegNum++;
+			manifest += "save " + segDir.filename().string() + "\n";
+			continue;
+		}
+		fs::path segDir = getSegPath2(dir, 0, "rd", segIdx);
+		fs::create_directories(segDir);
+		for (auto& x : fs::directory_iterator(seg->m_segDir)) {
+			std::string fname = x.path().filename().string();
+			if (!fs::is_regular_file(x.status()) || fstring(fname).startsWith("IsDel")) {
+				continue;
+			}
+			bool inplace = false;
+			for (size_t i = 0; i < m_schema->getColgroupNum(); ++i) {
+				const Schema& schema = m_schema->getColgroupSchema(i);
+				if (schema.m_isInplaceUpdatable &&
+					fstring(fname).startsWith("colgroup-" + schema.m_name)) {
+					inplace = true;
+					break;
+				}
+			}
+			fs::path src = fs::canonical(x.path());
+			fs::path dest = segDir / fname;
+			llong bytes = fs::file_size(src);
+			boost::system::error_code ec;
+			if (!inplace) {
+				fs::create_hard_link(src, dest, ec);
+			}
+			if (inplace || ec) {
+				fs::copy_file(src, dest);
+				stat->copiedFiles++;
+				stat->copiedBytes += bytes;
+				manifest += "copy ";
+			}
+			else {
+				stat->linkedFiles++;
+				stat->linkedBytes += bytes;
+				manifest += "link ";
+			}
+			manifest += segDir.filename().string() + "/" + fname + "\n";
+		}
+		saveIsDelSnapshot(segDir, isDelRows[segIdx], isDel[segIdx]);
+		stat->copiedFiles++;
+		stat->copiedBytes += isDel[segIdx].size() + 8;
+		manifest += "copy " + segDir.filename().string() + "/IsDel\n";
+	}
+	m_schema->saveJsonFile((dir / "dbmeta.json").string());
+	FileStream((dir / "BACKUP-MANIFEST").string().c_str(), "w").puts(manifest);
+	fprintf(stderr
+		, "INFO: backupTo(%s): linked files = %zd, bytes = %lld, copied files = %zd, bytes = %lld, writable segments = %zd\n"
+		, dir.string().c_str(), stat->linkedFiles, stat->linkedBytes
+		, stat->copiedFiles, stat->copiedBytes, stat->writableSegNum);
+}
+
+static const char* const g_onlineIndexFile = "OnlineIndex.json";
+
+// shipped files of a segment of a replica dir, lines of "<srcKey> <fname>",
+// srcKey is the identity of the immutable file of the writer
+static const char g_shippedFromFile[] = "SHIPPED-FROM";
+
+static std::string shipSrcKey(PathRef fpath) {
+	struct stat st;
+	if (::stat(fpath.string().c_str(), &st) != 0) {
+		THROW_STD(runtime_error, "stat(%s) = %s", fpath.string().c_str(), strerror(errno));
+	}
+	char buf[96];
+	sprintf(buf, "%llu:%llu:%llu:%llu", ullong(st.st_dev), ullong(st.st_ino)
+		, ullong(st.st_size), ullong(st.st_mtime));
+	return buf;
+}
+
+// fname -> srcKey, empty if segDir was not shipped
+static std::map<std::string, std::string> readShippedFrom(PathRef segDir) {
+	std::map<std::string, std::string> files;
+	fs::path fpath = segDir / g_shippedFromFile;
+	if (!fs::exists(fpath)) {
+		return files;
+	}
+	LineBuf text;
+	text.read_all(fpath.string());
+	valvec<fstring> lines, fields;
+	fstring(text.p, text.n).split('\n', &lines);
+	for (fstring line : lines) {
+		line.split(' ', &fields);
+		if (fields.size() == 2)
+			files[fields[1].str()] = fields[0].str();
+	}
+	return files;
+}
+
+// overwrite the blocks of dest which differ from src
+///@returns written bytes
+static llong patchChangedBlocks(PathRef src, PathRef dest) {
+	if (!fs::exists(dest) || fs::file_size(src) != fs::file_size(dest)) {
+		fs::copy_file(src, dest, fs::copy_option::overwrite_if_exists);
+		return fs::file_size(dest);
+	}
+	Auto_fclose fsrc(fopen(src.string().c_str(), "rb"));
+	Auto_fclose fdst(fopen(dest.string().c_str(), "rb+"));
+	if (!fsrc || !fdst) {
+		THROW_STD(runtime_error, "fopen(%s or %s) = %s"
+			, src.string().c_str(), dest.string().c_str(), strerror(errno));
+	}
+	const size_t BlockSize = 64 * 1024;
+	valvec<byte> sbuf(BlockSize, valvec_no_init());
+	valvec<byte> dbuf(BlockSize, valvec_no_init());
+	llong written = 0;
+	for (llong pos = 0; ; ) {
+		size_t n1 = fread(sbuf.data(), 1, BlockSize, fsrc);
+		size_t n2 = fread(dbuf.data(), 1, BlockSize, fdst);
+		if (0 == n1) {
+			break;
+		}
+		if (n1 != n2 || memcmp(sbuf.data(), dbuf.data(), n1) != 0) {
+			fseek(fdst, long(pos), SEEK_SET);
+			if (fwrite(sbuf.data(), 1, n1, fdst) != n1) {
+				THROW_STD(runtime_error, "fwrite(%s) = %s"
+					, dest.string().c_str(), strerror(errno));
+			}
+			fseek(fdst, long(pos + n1), SEEK_SET); // for next fread
+			written += n1;
+		}
+		pos += n1;
+	}
+	if (fflush(fdst) != 0) {
+		THROW_STD(runtime_error, "fflush(%s) = %s", dest.string().c_str(), strerror(errno));
+	}
+	return written;
+}
+
+void DbTable::shipSegmentsTo(PathRef dir, SegmentShipStat* stat) {
+	checkNotReplica("shipSegmentsTo");
+	SegmentShipStat myStat;
+	if (NULL == stat) {
+		stat = &myStat;
+	}
+	*stat = SegmentShipStat();
+	std::lock_guard<std::mutex> shipLock(m_shipMutex);
+	// merge and purge may rename or delete dirs of readonly segments
+	suspendCompaction();
+	BOOST_SCOPE_EXIT(this_) {
+		this_->resumeCompaction();
+	}BOOST_SCOPE_EXIT_END;
+	valvec<ReadableSegmentPtr> segs;
+	size_t mergeSeq;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		segs.assign(m_segments);
+		mergeSeq = m_mergeSeqNum;
+	}
+	SegmentManifest::State oldState;
+	bool hasOld = SegmentManifest::readState(dir.string(), &oldState);
+	fs::path mergeDir = getMergePath(dir, mergeSeq);
+	fs::path trashDir = dir / ".trash";
+	fs::create_directories(mergeDir);
+	// immutable files of the replica by srcKey, they are reused by the
+	// segments which are renamed or rebuilt by merges of the writer
+	std::map<std::string, fs::path> shippedFiles;
+	for (size_t seq : {oldState.mergeSeq, mergeSeq}) {
+		if (!hasOld && seq != mergeSeq)
+			continue;
+		fs::path oldMergeDir = getMergePath(dir, seq);
+		if (!fs::exists(oldMergeDir))
+			continue;
+		for (auto& x : fs::directory_iterator(oldMergeDir)) {
+			for (auto& kv : readShippedFrom(x.path()))
+				shippedFiles[kv.second] = x.path() / kv.first;
+		}
+	}
+	SegmentManifest::State st;
+	st.mergeSeq = mergeSeq;
+	for (size_t segIdx = 0; segIdx < segs.size(); ++segIdx) {
+		const ReadonlySegment* seg = segs[segIdx]->getReadonlySegment();
+		if (NULL == seg) {
+			continue; // rows of a writable segment are shipped by its conversion
+		}
+		std::string name = seg->m_segDir.filename().string();
+		std::vector<std::string> mutableFiles;
+		std::map<std::string, std::string> srcFiles; // immutable: fname -> srcKey
+		for (auto& x : fs::directory_iterator(seg->m_segDir)) {
+			std::string fname = x.path().filename().string();
+			if (!fs::is_regular_file(x.status()) || fname == g_shippedFromFile) {
+				continue;
+			}
+			if (fstring(fname).startsWith("IsDel")) {
+				if (fname == "IsDel")
+					mutableFiles.push_back(fname); // IsDel.* are backups
+				continue;
+			}
+			bool inplace = false;
+			for (size_t i = 0; i < m_schema->getColgroupNum(); ++i) {
+				const Schema& schema = m_schema->getColgroupSchema(i);
+				if (schema.m_isInplaceUpdatable &&
+					fstring(fname).startsWith("colgroup-" + schema.m_name)) {
+					inplace = true;
+					break;
+				}
+			}
+			if (inplace)
+				mutableFiles.push_back(fname);
+			else
+				srcFiles[fname] = shipSrcKey(fs::canonical(x.path()));
+		}
+		st.segments.insert(name);
+		fs::path destSegDir = mergeDir / name;
+		if (readShippedFrom(destSegDir) == srcFiles) {
+			for (const std::string& fname : mutableFiles) {
+				llong bytes = patchChangedBlocks(seg->m_segDir / fname, destSegDir / fname);
+				if (bytes) {
+					stat->patchedFiles++;
+					stat->patchedBytes += bytes;
+				}
+			}
+			stat->keptSegs++;
+			continue;
+		}
+		// a new IsDel inode of destSegDir lets the replica reload it
+		fs::path tmpSegDir = mergeDir / (".ship-" + name);
+		fs::remove_all(tmpSegDir);
+		fs::create_directories(tmpSegDir);
+		std::string shippedFrom;
+		for (auto& kv : srcFiles) {
+			fs::path dest = tmpSegDir / kv.first;
+			auto iter = shippedFiles.find(kv.second);
+			boost::system::error_code ec;
+			if (shippedFiles.end() != iter) {
+				fs::create_hard_link(iter->second, dest, ec);
+			}
+			llong bytes = fs::file_size(seg->m_segDir / kv.first);
+			if (shippedFiles.end() == iter || ec) {
+				fs::copy_file(seg->m_segDir / kv.first, dest);
+				stat->copiedBytes += bytes;
+			}
+			else {
+				stat->linkedBytes += bytes;
+			}
+			shippedFrom += kv.second + " " + kv.first + "\n";
+		}
+		for (const std::string& fname : mutableFiles) {
+			fs::copy_file(seg->m_segDir / fname, tmpSegDir / fname);
+			stat->copiedBytes += fs::file_size(tmpSegDir / fname);
+		}
+		FileStream((tmpSegDir / g_shippedFromFile).string().c_str(), "w").puts(shippedFrom);
+		if (fs::exists(destSegDir)) {
+			// the replica may have it mmap'ed, it is removed after the manifest
+			fs::create_directories(trashDir);
+			fs::rename(destSegDir, trashDir / (name + "-" + lcast(mergeSeq)));
+		}
+		fs::rename(tmpSegDir, destSegDir);
+		stat->copiedSegs++;
+	}
+	m_schema->saveJsonFile((dir / "dbmeta.json").string());
+	for (const char* fname : {"HotColumns.json", g_onlineIndexFile}) {
+		if (fs::exists(m_dir / fname))
+			fs::copy_file(m_dir / fname, dir / fname, fs::copy_option::overwrite_if_exists);
+	}
+	SegmentManifest manifest;
+	manifest.reset(dir.string(), st);
+	manifest.close();
+	// segments which are not in the manifest, the replica unmaps them on
+	// its refresh, files which are still mapped are released by then
+	for (auto& x : fs::directory_iterator(dir)) {
+		long seq = -1;
+		std::string fname = x.path().filename().string();
+		if (sscanf(fname.c_str(), "g-%04ld", &seq) == 1 && size_t(seq) != mergeSeq) {
+			fs::remove_all(x.path());
+		}
+	}
+	for (auto& x : fs::directory_iterator(mergeDir)) {
+		std::string fname = x.path().filename().string();
+		if (!st.segments.count(fname)) {
+			fs::remove_all(x.path());
+			stat->removedSegs++;
+		}
+	}
+	fs::remove_all(trashDir);
+	fprintf(stderr
+		, "INFO: shipSegmentsTo(%s): segs: copied = %zd, kept = %zd, removed = %zd, bytes: copied = %lld, linked = %lld, patched = %lld in %zd files\n"
+		, dir.string().c_str(), stat->copiedSegs, stat->keptSegs, stat->removedSegs
+		, stat->copiedBytes, stat->linkedBytes, stat->patchedBytes, stat->patchedFiles);
+}
+
+std::string DbTable::toJsonStr(fstring row) const {
+	return m_schema->m_rowSchema->toJsonStr(row);
 }
 
 boost::filesystem::path
@@ -4177,7 +8115,136 @@ void DbTable::save(PathRef dir) const {
 	m_schema->saveJsonFile(jsonFile.string());
 }
 
-bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
+// process-wide budget of work memory for background compressions,
+// SchemaConfig::m_compressingWorkMemSize is per table and per compression,
+// this is the sum limit of all running compressions of all tables
+class CompressingWorkMemBudget {
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	size_t m_limit; // 0 is unlimited
+	size_t m_inuse;
+public:
+	CompressingWorkMemBudget() {
+		const char* env = getenv("TerarkDB_CompressingWorkMemBudget");
+		m_limit = env ? size_t(parseSizeValue(env)) : 0;
+		m_inuse = 0;
+	}
+	size_t acquire(size_t mem) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (0 == m_limit) {
+			m_inuse += mem;
+			return mem;
+		}
+		// a huge compression can not wait forever
+		mem = std::min(mem, m_limit);
+		while (m_inuse + mem > m_limit) {
+			m_cond.wait(lock);
+		}
+		m_inuse += mem;
+		return mem;
+	}
+	void release(size_t mem) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		assert(m_inuse >= mem);
+		m_inuse -= mem;
+		m_cond.notify_all();
+	}
+	size_t inuse() const { return m_inuse; }
+};
+static CompressingWorkMemBudget g_compressingWorkMemBudget;
+
+class CompressingWorkMemGuard {
+	size_t m_mem;
+public:
+	explicit CompressingWorkMemGuard(size_t mem)
+		: m_mem(g_compressingWorkMemBudget.acquire(mem)) {}
+	~CompressingWorkMemGuard() { g_compressingWorkMemBudget.release(m_mem); }
+};
+
+size_t DbTable::getCompressingWorkMemInUse() {
+	return g_compressingWorkMemBudget.inuse();
+}
+
+double DbTable::getWriteAmplification() const {
+	ullong ingested = m_accumulateWrittenBytes.load(std::memory_order_relaxed);
+	ullong compacted = m_compactWrittenBytes.load(std::memory_order_relaxed);
+	if (0 == ingested)
+		return 0;
+	return double(ingested + compacted) / ingested;
+}
+
+void DbTable::getPerfSnapshot(DbPerfSnapshot* snap) const {
+	if (m_perf)
+		m_perf->snapshot(snap);
+	else
+		memset(snap->ops, 0, sizeof(snap->ops));
+}
+
+std::string DbTable::getPerfJsonStr() const {
+	DbPerfSnapshot snap;
+	getPerfSnapshot(&snap);
+	return snap.toJsonStr();
+}
+
+void DbTable::resetPerfCounters() {
+	if (m_perf)
+		m_perf->reset();
+}
+
+double DbTable::getCompressPriority(CompressTaskClass* cls) const {
+	if (m_isMerging) { // the running task of this table is not finished
+		*cls = CompressTaskClass::idle;
+		return 0;
+	}
+	SegArrayReadGuard guard(this);
+	const SegArrayVersion* version = guard.get(); // size and data of one version
+	if (NULL == version) {
+		*cls = CompressTaskClass::idle;
+		return 0;
+	}
+	const size_t segNum = version->m_segments.size();
+	const ReadableSegmentPtr* segs = version->m_segments.data();
+	double threshold = std::max(m_schema->m_purgeDeleteThreshold, 0.001);
+	size_t frozenWrSegNum = 0, mergableSegNum = 0;
+	double maxDelRatio = 0;
+	for (size_t i = 0; i < segNum; ++i) {
+		const ReadableSegment* seg = segs[i].get();
+		if (!seg->m_isFreezed) {
+			continue;
+		}
+		mergableSegNum++;
+		if (seg->getWritableSegment()) {
+			frozenWrSegNum++;
+		}
+		else if (seg->getReadonlySegment()) {
+			size_t physicNum = seg->getPhysicRows();
+			size_t newDelcnt = seg->m_delcnt - seg->m_isPurged.max_rank1();
+			if (physicNum) {
+				maxDelRatio = std::max(maxDelRatio, double(newDelcnt) / physicNum);
+			}
+		}
+	}
+	// frozen writable segments amplify reads and memory, convert first
+	if (frozenWrSegNum) {
+		*cls = CompressTaskClass::convert;
+		return 2.0 + frozenWrSegNum;
+	}
+	if (maxDelRatio > threshold) {
+		*cls = CompressTaskClass::purge;
+		return 1.0 + maxDelRatio;
+	}
+	size_t minMergeSegNum = std::max<size_t>(m_schema->m_minMergeSegNum, 2);
+	if (mergableSegNum >= minMergeSegNum) {
+		*cls = CompressTaskClass::merge;
+		return double(mergableSegNum) / minMergeSegNum;
+	}
+	*cls = CompressTaskClass::idle;
+	return 0;
+}
+
+// only segments in [segBeg, segEnd) are candidates
+bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge,
+                                 size_t segBeg, size_t segEnd) {
     BOOST_SCOPE_EXIT(&m_rwMutex, &m_bgTaskNum){
 		MyRwLock lock(m_rwMutex, true);
 		--m_bgTaskNum;
@@ -4197,6 +8264,7 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
 	double threshold = std::max(m_schema->m_purgeDeleteThreshold, 0.001);
     auto &m_segs = param.m_segs;
     param.m_forcePurgeAndMerge = forcePurgeAndMerge;
+    param.m_cancelOnSuspend = !forcePurgeAndMerge;
 	m_segs.reserve(m_segments.size() + 1);
 
     auto getRows = [&](size_t i) {
@@ -4244,13 +8312,25 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
         if (m_segments.ende(1)->getPlainWritableSegment()) {
             convPlainWritableSegment = true;
         }
-		for (size_t i = 0; i < m_segments.size(); ++i) {
+		// merges never mix time partitions, the longest run is kept
+		valvec<SegEntry> bestRun;
+		for (size_t i = segBeg; i < m_segments.size() && i < segEnd; ++i) {
 			auto seg = m_segments[i]->getMergableSegment();
-			if (seg)
+			if (seg && !m_segs.empty() && m_segs.back().seg->m_timePartition
+					!= seg->m_timePartition) {
+				if (m_segs.size() > bestRun.size())
+					bestRun.swap(m_segs);
+				m_segs.erase_all();
+			}
+			if (seg && seg->m_isQuarantined)
+				m_segs.erase_all(); // merged segments must be adjacent
+			else if (seg)
 				m_segs.emplace_back(seg, i);
 			else
                 break;
         }
+		if (bestRun.size() > m_segs.size())
+			m_segs.swap(bestRun);
 		if (m_segs.size() <= 1)
 			break;
 	    param.m_old_segArrayUpdateSeq = m_segArrayUpdateSeq;
@@ -4270,12 +8350,14 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
 		DebugCheckRowNumVecNoLock(tab);
 	    param.m_old_segArrayUpdateSeq = m_segArrayUpdateSeq;
     } while(false);
+    if (m_segs.empty()) // no mergable segment in [segBeg, segEnd)
+        return false;
 
     size_t findSegmentId = size_t(-1);
 	size_t rngBeg = 0, rngLen = 0;
     if (convPlainWritableSegment) {
 		MyRwLock lock(m_rwMutex, false);
-		for (size_t i = 0; i < m_segments.size(); ++i) {
+		for (size_t i = segBeg; i < m_segments.size() && i < segEnd; ++i) {
             if (m_segments[i]->getPlainWritableSegment()
                 && m_segments[i]->m_isFreezed
                 && !m_segments[i]->m_onProcess
@@ -4284,6 +8366,8 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
                 break;
             }
         }
+        if (findSegmentId == size_t(-1))
+            convPlainWritableSegment = false;
     }
     if (findSegmentId == size_t(-1)) {
 	    size_t sumSegRows = 0;
@@ -4371,6 +8455,31 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
                 }
             }
 	    }
+        if (m_mergePolicy && !forcePurgeAndMerge) {
+            valvec<MergeCandidate> cands(m_segs.size(), valvec_no_init());
+            for (size_t j = 0; j < m_segs.size(); ++j) {
+                auto seg = m_segs[j].seg;
+                cands[j].storageSize = segmentStoreBytes(seg);
+                cands[j].liveRows = getRows(j);
+                cands[j].isReadonly = seg->getReadonlySegment() != NULL;
+            }
+            rngBeg = rngLen = rdLen = wrLen = 0;
+            mergeColgroupSegment = mergeReadonlySegment = false;
+            if (m_mergePolicy->pickMergeRange(*m_schema,
+                        cands.data(), cands.size(), &rngBeg, &rngLen)) {
+                assert(rngBeg + rngLen <= m_segs.size());
+                for (size_t j = 0; j < rngLen; ++j) {
+                    if (cands[rngBeg + j].isReadonly)
+                        ++rdLen;
+                    else
+                        ++wrLen;
+                }
+                if (wrLen)
+                    mergeColgroupSegment = true;
+                else
+                    mergeReadonlySegment = true;
+            }
+        }
         // all are colgroup segments
         // needn't reuse old stores
         if (mergeColgroupSegment && rdLen == 0)
@@ -4388,8 +8497,16 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
 		    MyRwLock lock(m_rwMutex, true);
 		    seg->m_onProcess = false;
 	    }BOOST_SCOPE_EXIT_END;
+        const size_t workMem = size_t(std::min<llong>(
+				seg->dataInflateSize(), m_schema->m_compressingWorkMemSize));
+        CompressingWorkMemGuard memGuard(workMem);
         auto segDir = getSegPath("rd", i);
+        const char* oldType = seg->getWritableStore() ? "wr" : "rd";
 		ReadonlySegmentPtr newSeg = myCreateReadonlySegment(segDir);
+        newSeg->m_buildTab = this;
+        newSeg->m_buildCancelOnSuspend = !forcePurgeAndMerge;
+        newSeg->m_timePartition = seg->m_timePartition.load(); // frozen
+
         char const *processName =
             seg->getReadonlySegment()
                 ? "purgeReadonlySegment"
@@ -4409,10 +8526,42 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
                 , delcnt
 		        , purged
 		);
+        const bool isPurge = seg->getReadonlySegment() != nullptr;
+        SegmentEventScope evScope(isPurge ? SegmentEventType::purge
+                                          : SegmentEventType::convert,
+                                  m_dir.string());
+        SegmentEvent& ev = evScope.ev();
+        ev.inputSegs.push_back(strDir);
+        ev.outputSeg = segDir.string();
+        ev.inputBytes = seg->dataStorageSize();
+        ev.inputRows = rows;
+        ev.inputDeletedRows = delcnt;
+        ev.memBytes = workMem;
+        DbPerfTimer perf(m_perf.get(), isPurge ? DbPerfOp::purge
+                                               : DbPerfOp::convert);
+        const ullong t0 = g_pf.now();
         if (seg->getColgroupSegment())
 		    newSeg->purgeDeletedRecords(this, i);
         else
             newSeg->convFrom(this, i);
+        if (!isPurge) {
+            double sec = std::max(g_pf.sf(t0, g_pf.now()), 1e-3);
+            double rate = ev.inputBytes / sec, old = m_wrSegConvRate;
+            m_wrSegConvRate = old ? 0.5 * old + 0.5 * rate : rate;
+        }
+        if (ReadonlySegment* rdseg = seg->getReadonlySegment())
+            newSeg->addReadHeat(*rdseg);
+        saveTimePartition(newSeg.get());
+        perf.stop();
+        // m_segDir of a segment shared by a merge is in the old merge dir
+        std::string oldName = getSegPath(oldType, i).filename().string();
+        if (oldName != segDir.filename().string()) {
+            logManifestEdit("-" + oldName + " +" + segDir.filename().string());
+        }
+        ev.outputBytes = newSeg->dataStorageSize();
+        ev.outputRows = newSeg->getPhysicRows();
+        evScope.setDone();
+        m_compactWrittenBytes += segmentStoreBytes(newSeg.get());
         fprintf(stderr
 		        , "INFO: %s %s, rows = %zd, delcnt = %zd, purged = %zd done!\n"
 		        , processName
@@ -4433,11 +8582,18 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
         m_isMerging = false;
         return processSegment(seg.get(), findSegmentId);
     }
+    auto mergeWorkMem = [&]() {
+        llong mem = 0;
+        for (auto& e : m_segs)
+            mem += e.seg->dataInflateSize();
+        return size_t(std::min(mem, m_schema->m_compressingWorkMemSize));
+    };
     if (mergeColgroupSegment) {
         if (m_bgTaskNum > 1 || !trimSegs(rngBeg, rngLen)) {
 		    m_isMerging = false;
             return false;
         }
+        CompressingWorkMemGuard memGuard(mergeWorkMem());
         merge(param);
 		m_isMerging = false;
         return true;
@@ -4452,7 +8608,7 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
 		    MyRwLock lock(m_rwMutex, false);
 		    for (size_t i = 0; i < m_segs.size(); ++i) {
                 if (getLarge(i) && !m_segs[i].seg->m_onProcess) {
-                    findSegmentId = i;
+                    findSegmentId = m_segs[i].idx;
                     break;
                 }
             }
@@ -4470,6 +8626,7 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
 		    m_isMerging = false;
             return false;
         }
+        CompressingWorkMemGuard memGuard(mergeWorkMem());
         merge(param);
 		m_isMerging = false;
         return true;
@@ -4484,7 +8641,7 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
 		    MyRwLock lock(m_rwMutex, false);
 		    for (size_t i = 0; i < m_segs.size(); ++i) {
                 if (m_segs[i].seg->getWritableSegment() && !m_segs[i].seg->m_onProcess) {
-                    findSegmentId = i;
+                    findSegmentId = m_segs[i].idx;
                     break;
                 }
             }
@@ -4507,10 +8664,8 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
 		    MyRwLock lock(m_rwMutex, false);
 		    for (size_t i = 0; i < m_segs.size(); ++i) {
                 if (m_segs[i].purgePriority > 0) {
-                    if (findSegmentId == size_t(-1) || m_segs[i].purgePriority > m_segs[findSegmentId].purgePriority) {
-                        findSegmentId = i;
-                        break;
-                    }
+                    findSegmentId = m_segs[i].idx;
+                    break;
                 }
             }
             if (findSegmentId == size_t(-1)) {
@@ -4532,6 +8687,7 @@ bool DbTable::autoConvMergePurge(bool forcePurgeAndMerge) {
 }
 
 void DbTable::freezeFlushWritableSegment(size_t segIdx) {
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::flush);
 	ReadableSegmentPtr seg;
 	{
 		MyRwLock lock(m_rwMutex, false);
@@ -4540,10 +8696,18 @@ void DbTable::freezeFlushWritableSegment(size_t segIdx) {
 	if (seg->m_isDelMmap) {
 		return;
 	}
+	SegmentEventScope evScope(SegmentEventType::flush, m_dir.string());
+	evScope.ev().inputSegs.push_back(seg->m_segDir.string());
+	evScope.ev().inputBytes = seg->dataStorageSize();
+	evScope.ev().inputRows = seg->m_isDel.size();
+	evScope.ev().inputDeletedRows = seg->m_delcnt;
+	evScope.ev().memBytes = seg->dataStorageSize() + seg->totalIndexSize();
 	fprintf(stderr, "freezeFlushWritableSegment: %s\n", seg->m_segDir.string().c_str());
 	seg->saveIndices(seg->m_segDir);
 	seg->saveRecordStore(seg->m_segDir);
 	seg->saveIsDel(seg->m_segDir);
+	saveTimePartition(seg.get());
+	evScope.setDone();
 	fprintf(stderr, "freezeFlushWritableSegment: %s done!\n", seg->m_segDir.string().c_str());
 }
 
@@ -4557,124 +8721,1357 @@ public:
 };
 typedef boost::intrusive_ptr<MyTask> MyTaskPtr;
 std::mutex g_mutexForStop;
-terark::util::concurrent_queue<std::deque<MyTaskPtr> > g_flushQueue;
-terark::util::concurrent_queue<std::deque<MyTaskPtr> > g_compressQueue;
+
+// Compression tasks are picked by the class of current priority of their
+// tables: DbTable::getCompressPriority, convert > purge > merge, tables of
+// the same class share the threads by DbTable::getCompressVirtualTime, then
+// by priority, tie is FIFO. So an ingest heavy table, which always has
+// segments to convert, does not starve conversions of other tables.
+static int compressClassRank(CompressTaskClass cls) {
+	switch (cls) {
+	case CompressTaskClass::convert: return 3;
+	case CompressTaskClass::purge  : return 2;
+	case CompressTaskClass::merge  : return 1;
+	default: return 0;
+	}
+}
+class CompressScheduler {
+	struct TaskItem {
+		MyTaskPtr task;
+		DbTable*  tab;
+	};
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<TaskItem> m_queue;
+public:
+	void push_back(DbTable* tab, MyTask* task) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_queue.push_back({task, tab});
+		m_cond.notify_one();
+	}
+	// the task holds a ref of *tab
+	bool pop_front(MyTaskPtr& task, DbTable** tab, int timeoutMillisec) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_queue.empty()) {
+			m_cond.wait_for(lock, std::chrono::milliseconds(timeoutMillisec));
+			if (m_queue.empty())
+				return false;
+		}
+		struct Rank {
+			int    cls;
+			double vtime;
+			double priority;
+			bool operator<(const Rank& y) const { // better is smaller
+				if (cls != y.cls) return cls > y.cls;
+				if (vtime != y.vtime) return vtime < y.vtime;
+				return priority > y.priority;
+			}
+		};
+		size_t best = 0;
+		std::map<DbTable*, Rank> rankCache;
+		for (size_t i = 0; i < m_queue.size(); ++i) {
+			DbTable* t = m_queue[i].tab;
+			auto ib = rankCache.insert(std::make_pair(t, Rank()));
+			if (ib.second) {
+				CompressTaskClass cls;
+				Rank& r = ib.first->second;
+				r.priority = t->getCompressPriority(&cls);
+				r.cls = compressClassRank(cls);
+				r.vtime = t->getCompressVirtualTime();
+			}
+			if (0 == i || ib.first->second < rankCache[m_queue[best].tab]) {
+				best = i;
+			}
+		}
+		task = std::move(m_queue[best].task);
+		*tab = m_queue[best].tab;
+		m_queue.erase(m_queue.begin() + best);
+		return true;
+	}
+	bool empty() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_queue.empty();
+	}
+	void clearQueue() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_queue.clear();
+	}
+	size_t size() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_queue.size();
+	}
+};
+CompressScheduler g_compressQueue;
 
 volatile bool g_stopPutToFlushQueue = false;
 volatile bool g_stopCompress = false;
 volatile bool g_flushStopped = false;
 
-void FlushThreadFunc() {
-	while (true) {
+// Flush tasks of one table are executed one by one in FIFO order, tasks of
+// different tables are executed concurrently by a pool of flush threads,
+// tables whose writers are being throttled are picked first, then the
+// table which has the oldest task.
+class FlushScheduler {
+	struct TaskItem {
+		MyTaskPtr task;
+		llong     putTime;
+	};
+	struct TableQueue {
+		std::deque<TaskItem> tasks;
+		bool running = false;
+	};
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::map<DbTable*, TableQueue> m_tables;
+	std::vector<tbb::tbb_thread*> m_threads;
+	FlushQueueStat m_stat;
+	bool m_stop;
+
+	void threadProc() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;) {
+			auto iter = pickTable();
+			if (m_tables.end() == iter) {
+				if (m_stop && 0 == m_stat.queuedNum) {
+					break;
+				}
+				m_cond.wait(lock);
+				continue;
+			}
+			TableQueue& tq = iter->second;
+			TaskItem item = std::move(tq.tasks.front());
+			tq.tasks.pop_front();
+			tq.running = true;
+			m_stat.queuedNum--;
+			m_stat.runningNum++;
+			lock.unlock();
+			try {
+				DbEnvScope envScope(iter->first->getEnv());
+				NumaNodeScope numaScope(iter->first->getNumaNode());
+				DbTable* tab = iter->first;
+				const char* taskName = typeid(*item.task).name();
+				TERARK_DB_PROBE_SCOPE2(bgtask, tab, taskName);
+				item.task->execute();
+			}
+			catch (const std::exception& ex) {
+				fprintf(stderr, "ERROR: flush task of table %s failed: %s\n"
+					, iter->first->getDir().string().c_str(), ex.what());
+			}
+			ullong latency = g_pf.ns(item.putTime, g_pf.now());
+			item.task = nullptr; // release before lock
+			lock.lock();
+			tq.running = false;
+			m_stat.runningNum--;
+			m_stat.finishedNum++;
+			m_stat.lastLatencyNs = latency;
+			m_stat.maxLatencyNs = std::max(m_stat.maxLatencyNs, latency);
+			m_stat.sumLatencyNs += latency;
+			if (tq.tasks.empty()) {
+				m_tables.erase(iter);
+				m_stat.tableNum--;
+			}
+			else {
+				m_cond.notify_one(); // next task of this table is ready
+			}
+			if (m_stop && 0 == m_stat.queuedNum) {
+				m_cond.notify_all();
+			}
+		}
+	}
+
+	std::map<DbTable*, TableQueue>::iterator pickTable() {
+		auto best = m_tables.end();
+		bool bestIsThrottled = false;
+		for (auto iter = m_tables.begin(); iter != m_tables.end(); ++iter) {
+			const TableQueue& tq = iter->second;
+			if (tq.running || tq.tasks.empty()) {
+				continue;
+			}
+			bool isThrottled = iter->first->isWriteThrottled();
+			if (m_tables.end() == best
+				|| (isThrottled && !bestIsThrottled)
+				|| (isThrottled == bestIsThrottled &&
+					tq.tasks.front().putTime < best->second.tasks.front().putTime)) {
+				best = iter;
+				bestIsThrottled = isThrottled;
+			}
+		}
+		return best;
+	}
+
+public:
+	FlushScheduler() {
+		memset(&m_stat, 0, sizeof(m_stat));
+		m_stop = false;
+		size_t cpu = tbb::tbb_thread::hardware_concurrency();
+		size_t cfg = getEnvLong("TerarkDB_FlushThreadsNum", 0);
+		size_t num = cfg ? min(cpu, cfg) : min<size_t>(cpu, 2);
+		num = std::max<size_t>(num, 1);
+		m_stat.threadNum = num;
+		m_threads.resize(num);
+		for (size_t i = 0; i < num; ++i) {
+			m_threads[i] = new tbb::tbb_thread(&FlushScheduler::threadProc, this);
+		}
+	}
+	~FlushScheduler() {
+		if (!m_threads.empty())
+			stopAndJoin();
+	}
+	void push(DbTable* tab, MyTask* task) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		TableQueue& tq = m_tables[tab];
+		if (tq.tasks.empty() && !tq.running) {
+			m_stat.tableNum++;
+		}
+		tq.tasks.push_back({task, g_pf.now()});
+		m_stat.queuedNum++;
+		if (!tq.running) {
+			m_cond.notify_one();
+		}
+	}
+	/// all queued tasks will be executed before threads exit
+	void stopAndJoin() {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stop = true;
+			m_cond.notify_all();
+		}
+		for (auto& th : m_threads) {
+			th->join();
+			delete th;
+			th = NULL;
+		}
+		fprintf(stderr, "INFO: flushing threads(%zd) completed!\n", m_threads.size());
+		m_threads.clear();
+		assert(m_tables.empty());
+		g_flushStopped = true;
+	}
+	void getStat(FlushQueueStat* stat) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		*stat = m_stat;
+	}
+};
+
+// env TerarkDB_CompressionThreadsCpuSet is a cpu list such as "0-3,8,10"
+static void setCompressThreadAffinity() {
+#if defined(__linux__)
+	const char* env = getenv("TerarkDB_CompressionThreadsCpuSet");
+	if (NULL == env || '\0' == *env) {
+		return;
+	}
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	for (const char* p = env; *p; ) {
+		char* endp = NULL;
+		long beg = strtol(p, &endp, 10), end = beg;
+		if (endp == p) {
+			fprintf(stderr, "ERROR: bad TerarkDB_CompressionThreadsCpuSet=%s\n", env);
+			return;
+		}
+		if ('-' == *endp) {
+			p = endp + 1;
+			end = strtol(p, &endp, 10);
+		}
+		for (long cpu = beg; cpu <= end && cpu < CPU_SETSIZE; ++cpu) {
+			CPU_SET(cpu, &cpuset);
+		}
+		p = (',' == *endp) ? endp + 1 : endp;
+		if (endp == p && *p) {
+			fprintf(stderr, "ERROR: bad TerarkDB_CompressionThreadsCpuSet=%s\n", env);
+			return;
+		}
+	}
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+	if (err) {
+		fprintf(stderr, "ERROR: pthread_setaffinity_np(%s) = %s\n", env, strerror(err));
+	}
+#endif
+}
+
+void CompressThreadFunc() {
+	setCompressThreadAffinity();
+	while (!g_flushStopped && !g_stopCompress) {
 		MyTaskPtr t;
-		while (g_flushQueue.pop_front(t, 100)) {
-			if (t)
+		DbTable* tab = NULL;
+		while (!g_stopCompress && g_compressQueue.pop_front(t, &tab, 100)) {
+			if (g_stopCompress)
+				break;
+			ullong t0 = g_pf.now();
+			{
+				DbEnvScope envScope(tab->getCompactEnv());
+				NumaNodeScope numaScope(tab->getNumaNode());
+				const char* taskName = typeid(*t).name();
+				TERARK_DB_PROBE_SCOPE2(bgtask, tab, taskName);
 				t->execute();
-			else // must only one flush thread
-				goto Done; // nullptr is stop notifier
+			}
+			tab->addCompressTime(g_pf.ns(t0, g_pf.now()));
+			t = nullptr;
+		}
+	}
+}
+
+class CompressionThreadsList : private std::vector<tbb::tbb_thread*> {
+public:
+	CompressionThreadsList() {
+		size_t cpu = tbb::tbb_thread::hardware_concurrency();
+		size_t cfg = getEnvLong("TerarkDB_CompressionThreadsNum", 0);
+		size_t num = cfg ? min(cpu, cfg) : min<size_t>(cpu, 4);
+		this->resize(num);
+		for (size_t i = 0; i < num; ++i) {
+			(*this)[i] = new tbb::tbb_thread(&CompressThreadFunc);
+		}
+	}
+	~CompressionThreadsList() {
+		if (!this->empty())
+			DbTable::safeStopAndWaitForFlush();
+	}
+	void join() {
+		for (auto& th : *this) {
+			th->join();
+			delete th;
+			th = NULL;
+		}
+		fprintf(stderr, "INFO: compression threads(%zd) completed!\n", this->size());
+		this->clear();
+		g_compressQueue.clearQueue();
+	}
+};
+FlushScheduler g_flushScheduler;
+CompressionThreadsList g_compressThreads;
+
+class AutoTask : public MyTask {
+	DbTablePtr m_tab;
+public:
+	void execute() override {
+		if (!m_tab->beginAutoTask()) {
+			return;
+		}
+		BOOST_SCOPE_EXIT(&m_tab){
+			m_tab->endAutoTask();
+		}BOOST_SCOPE_EXIT_END;
+		try {
+			if (m_tab->autoConvMergePurge(false) && m_tab->isAutoTask()) {
+				m_tab->putAutoTask();
+			}
+		}
+		catch (const TaskCancelledException& ex) {
+			fprintf(stderr, "INFO: AutoTask cancelled: %s\n", ex.what());
+			m_tab->deferCancelledAutoTask();
+			return;
+		}
+		m_tab->updateUniqueKeyFilter();
+		m_tab->moveColdSegments();
+		m_tab->expireRows();
+		m_tab->buildOnlineIndices();
+		m_tab->saveReadHeat(true);
+	}
+	AutoTask(DbTablePtr tab) : m_tab(tab) {}
+};
+
+class ExpireTask : public MyTask {
+	DbTablePtr m_tab;
+public:
+	void execute() override { m_tab->expireRows(); }
+	ExpireTask(DbTablePtr tab) : m_tab(tab) {}
+};
+
+// tables without writes have no AutoTask, it checks them after load
+class ColdSegmentTask : public MyTask {
+	DbTablePtr m_tab;
+public:
+	void execute() override { m_tab->moveColdSegments(); }
+	ColdSegmentTask(DbTablePtr tab) : m_tab(tab) {}
+};
+
+class OnlineIndexTask : public MyTask {
+	DbTablePtr m_tab;
+public:
+	void execute() override { m_tab->buildOnlineIndices(); }
+	OnlineIndexTask(DbTablePtr tab) : m_tab(tab) {}
+};
+
+class VerifySegmentTask : public MyTask {
+	DbTablePtr m_tab;
+public:
+	void execute() override { m_tab->verifySegments(); }
+	VerifySegmentTask(DbTablePtr tab) : m_tab(tab) {}
+};
+
+// evaluates purge thresholds for writers, which just request the check
+class PurgeCheckTask : public MyTask {
+	DbTablePtr m_tab;
+public:
+	void execute() override { m_tab->doPurgeCheck(); }
+	PurgeCheckTask(DbTablePtr tab) : m_tab(tab) {}
+};
+
+class UniqueKeyFilterTask : public MyTask {
+	DbTablePtr m_tab;
+public:
+	void execute() override {
+		m_tab->updateUniqueKeyFilter();
+	}
+	UniqueKeyFilterTask(DbTablePtr tab) : m_tab(tab) {}
+};
+
+class WrSegFreezeFlushTask : public MyTask {
+	DbTablePtr m_tab;
+	size_t m_segIdx;
+public:
+	WrSegFreezeFlushTask(DbTablePtr tab, size_t segIdx)
+		: m_tab(tab), m_segIdx(segIdx) {}
+
+	void execute() override {
+		m_tab->freezeFlushWritableSegment(m_segIdx);
+		g_compressQueue.push_back(m_tab.get(), new AutoTask(m_tab));
+	}
+};
+
+} // namespace
+using namespace anonymousForDebugMSVC;
+
+void DbTable::putToFlushQueue(size_t segIdx) {
+	assert(!g_stopPutToFlushQueue);
+	if (g_stopPutToFlushQueue) {
+		return;
+	}
+	assert(segIdx < m_segments.size());
+	assert(m_segments[segIdx]->m_isDel.size() > 0);
+	assert(m_segments[segIdx]->getWritableStore() != nullptr);
+	g_flushScheduler.push(this, new WrSegFreezeFlushTask(this, segIdx));
+	m_bgTaskNum++;
+}
+
+void DbTable::putToCompressionQueue(size_t segIdx) {
+	assert(segIdx < m_segments.size());
+	assert(m_segments[segIdx]->m_isDel.size() > 0);
+	assert(m_segments[segIdx]->getWritableStore() != nullptr);
+	if (g_stopCompress) {
+		return;
+	}
+	g_compressQueue.push_back(this, new AutoTask(this));
+	m_bgTaskNum++;
+}
+
+// called by writers without the write lock, requests of a table are merged
+// into one pending PurgeCheckTask
+void DbTable::requestPurgeCheck() {
+	if (g_stopCompress || g_stopPutToFlushQueue) {
+		return;
+	}
+	if (!m_purgeCheckPending.exchange(true)) {
+		g_compressQueue.push_back(this, new PurgeCheckTask(this));
+	}
+}
+
+void DbTable::doPurgeCheck() {
+	m_purgeCheckPending = false;
+	if (g_stopPutToFlushQueue) {
+		return;
+	}
+	MyRwLock lock(m_rwMutex, true);
+	for (auto& seg : m_segments) {
+		if (seg->getReadonlySegment() && checkPurgeDeleteNoLock(seg.get())) {
+			inLockPutPurgeDeleteTaskToQueue();
+			break;
+		}
+	}
+}
+
+// inplace updatable colgroups are written inplace, they are never moved
+static bool isColdStoreFile(const SchemaConfig& sconf, fstring fname) {
+	if (!fname.startsWith("colgroup-")) {
+		return false;
+	}
+	for (size_t i = 0; i < sconf.getColgroupNum(); ++i) {
+		const Schema& schema = sconf.getColgroupSchema(i);
+		if (schema.m_isInplaceUpdatable &&
+			fname.startsWith("colgroup-" + schema.m_name)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// the read trigger needs the reads in a window longer than this
+static const llong ColdSegmentReadWindowSeconds = 3600;
+
+// files are the unmoved store files, they are immutable after the segment
+// is built, so their mtime is the age of the segment
+bool DbTable::isColdSegment(const ReadonlySegment* seg, time_t now,
+							std::vector<std::string>* files) const {
+	const SchemaConfig& sconf = *m_schema;
+	std::time_t mtime = 0;
+	files->clear();
+	for (auto& x : fs::directory_iterator(seg->m_segDir)) {
+		std::string fname = x.path().filename().string();
+		if (!fs::is_regular_file(x.symlink_status()) ||
+				!isColdStoreFile(sconf, fname)) {
+			continue; // symlinks are moved files
+		}
+		files->push_back(fname);
+		mtime = std::max(mtime, fs::last_write_time(x.path()));
+	}
+	if (files->empty()) {
+		return false;
+	}
+	if (sconf.m_coldSegmentAgeSeconds > 0 &&
+			now - mtime >= sconf.m_coldSegmentAgeSeconds) {
+		return true;
+	}
+	llong loaded = now - seg->m_loadTime;
+	if (sconf.m_coldSegmentMaxReadsPerSec > 0 &&
+			loaded >= ColdSegmentReadWindowSeconds &&
+			seg->m_readCnt < sconf.m_coldSegmentMaxReadsPerSec * loaded) {
+		return true;
+	}
+	return false;
+}
+
+// segments replaced during the save are skipped, their heat has been
+// inherited by the new segments
+void DbTable::saveReadHeat(bool onlyIfDue) {
+	if (m_isReplica) {
+		return; // files of the writer
+	}
+	llong now = ::time(NULL);
+	if (onlyIfDue) {
+		llong interval = getEnvLong("TerarkDB_ReadHeatSaveSeconds", 600);
+		llong last = m_readHeatSaveTime.load();
+		if (interval <= 0 || now - last < interval ||
+				!m_readHeatSaveTime.compare_exchange_strong(last, now))
+			return;
+	} else {
+		m_readHeatSaveTime = now;
+	}
+	valvec<ReadableSegmentPtr> segs;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		segs.assign(m_segments);
+	}
+	size_t saved = 0;
+	for (auto& seg : segs) {
+		ReadonlySegment* rdseg = seg->getReadonlySegment();
+		if (NULL == rdseg || !rdseg->m_colgroupReadCnt || !fs::exists(rdseg->m_segDir)) {
+			continue;
+		}
+		try {
+			rdseg->saveReadHeat(rdseg->m_segDir);
+			saved++;
+		}
+		catch (const std::exception& ex) {
+			// removed by a concurrent merge or purge
+			fprintf(stderr, "WARN: DbTable::saveReadHeat(%s): %s\n"
+				, rdseg->m_segDir.string().c_str(), ex.what());
+		}
+	}
+	if (!onlyIfDue) {
+		fprintf(stderr, "INFO: DbTable::saveReadHeat(%s): segments = %zd\n"
+			, m_dir.string().c_str(), saved);
+	}
+}
+
+size_t DbTable::moveColdSegments() {
+	if (m_schema->m_coldSegmentPath.empty() || g_stopCompress) {
+		return 0;
+	}
+	if (m_movingColdSegments.exchange(true)) {
+		return 0;
+	}
+	DbEnvScope envScope(getCompactEnv());
+	{
+		MyRwLock lock(m_rwMutex, true);
+		if (m_compactSuspendCnt) {
+			m_movingColdSegments = false;
+			return 0;
+		}
+		m_runningAutoTaskNum++; // waited by suspendCompaction
+	}
+	BOOST_SCOPE_EXIT(this_) {
+		this_->m_runningAutoTaskNum--;
+		this_->m_movingColdSegments = false;
+	}BOOST_SCOPE_EXIT_END;
+	fs::path coldDir = fs::absolute(m_schema->m_coldSegmentPath) / m_dir.filename();
+	valvec<ReadonlySegmentPtr> segs;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		for (auto& seg : m_segments) {
+			if (auto rdseg = seg->getReadonlySegment())
+				segs.push_back(rdseg);
+		}
+	}
+	size_t moved = 0;
+	std::vector<std::string> files;
+	time_t now = ::time(NULL);
+	for (auto& seg : segs) {
+		if (g_stopCompress) {
+			break;
+		}
+		try {
+			if (!seg->m_onProcess && !seg->m_bookUpdates && !seg->m_isQuarantined &&
+					isColdSegment(seg.get(), now, &files) &&
+					moveColdSegment(seg.get(), files, coldDir)) {
+				moved++;
+			}
+		}
+		catch (const std::exception& ex) {
+			// the segment keeps using its files, unused cold files are
+			// removed by removeUnusedColdFiles
+			fprintf(stderr, "WARN: moveColdSegment(%s): %s\n"
+				, seg->m_segDir.string().c_str(), ex.what());
+		}
+	}
+	if (moved || m_coldGcSegArrayUpdateSeq != m_segArrayUpdateSeq) {
+		removeUnusedColdFiles(coldDir);
+	}
+	return moved;
+}
+
+// store files are copied to the cold dir without lock, then in compaction
+// exclusion(m_isMerging) they are replaced by symlinks, the segment is
+// reopened and swapped in, the old one is freed with readers of it, then
+// the space on the fast volume is released
+bool DbTable::moveColdSegment(ReadonlySegment* seg,
+							  const std::vector<std::string>& files,
+							  PathRef coldDir) {
+	fs::path segDir = seg->m_segDir;
+	fs::path realDir = fs::canonical(segDir); // may be shared by merge dirs
+	fs::path segColdDir = coldDir / realDir.parent_path().filename()
+								  / realDir.filename();
+	profiling pf;
+	llong t0 = pf.now();
+	llong bytes = 0;
+	fs::create_directories(segColdDir);
+	for (const std::string& fname : files) {
+		fs::path coldFile = segColdDir / fname;
+		fs::path tmpFile = coldFile + ".tmp";
+		fs::remove(tmpFile); // by a failed move
+		fs::copy_file(segDir / fname, tmpFile);
+		DbEnv::current()->syncFile(tmpFile.string());
+		fs::rename(tmpFile, coldFile);
+		bytes += fs::file_size(coldFile);
+	}
+	{
+		MyRwLock lock(m_rwMutex, true);
+		if (m_isMerging || m_compactSuspendCnt || seg->m_onProcess ||
+				seg->m_bookUpdates || m_segments.size() == findSegIdx(0, seg)) {
+			return false; // copied files are unused
+		}
+		m_isMerging = true;
+		seg->m_onProcess = true;
+	}
+	BOOST_SCOPE_EXIT(this_, seg) {
+		MyRwLock lock(this_->m_rwMutex, true);
+		this_->m_isMerging = false;
+		seg->m_onProcess = false;
+	}BOOST_SCOPE_EXIT_END;
+	for (const std::string& fname : files) {
+		fs::path file = segDir / fname;
+		fs::path link = file + ".cold";
+		fs::remove(link);
+		fs::create_symlink(segColdDir / fname, link);
+		fs::rename(link, file); // seg still maps the old file
+	}
+	ReadonlySegmentPtr newSeg = myCreateReadonlySegment(segDir);
+	newSeg->m_withPurgeBits = seg->m_withPurgeBits;
+	newSeg->load(newSeg->m_segDir);
+
+	MyRwLock lock(m_rwMutex, true);
+	size_t segIdx = findSegIdx(0, seg);
+	if (segIdx == m_segments.size() ||
+			newSeg->m_isDel.size() != seg->m_isDel.size()) {
+		THROW_STD(logic_error, "segment %s is changed, rows = %zd, reopened = %zd"
+			, segDir.string().c_str(), seg->m_isDel.size(), newSeg->m_isDel.size());
+	}
+	// delmarks since the reopen, writers are excluded by the write lock
+	newSeg->m_isDel.risk_memcpy(seg->m_isDel);
+	newSeg->m_delcnt = newSeg->rebuildIsDelBlocks(); // not published yet
+	if (seg->hasDelVersions()) {
+		newSeg->copyDelVersions(*seg, 0, m_oldestSnapshotVersion);
+	}
+	newSeg->m_uniqKeyFilterGen = seg->m_uniqKeyFilterGen; // keys are same
+	newSeg->m_timePartition = seg->m_timePartition.load();
+	newSeg->m_isDirty = seg->m_isDirty;
+	newSeg->m_readCnt = seg->m_readCnt.load();
+	newSeg->m_loadTime = seg->m_loadTime;
+	for (size_t i = 0; i < seg->m_colgroups.size(); ++i) {
+		newSeg->m_colgroupReadCnt[i] = seg->m_colgroupReadCnt[i].load();
+	}
+	m_segments[segIdx] = newSeg;
+	m_segArrayUpdateSeq++;
+	publishSegArrayInLock();
+	lock.release();
+	fprintf(stderr
+		, "INFO: moveColdSegment: %s, files = %zd, bytes = %lld, to %s, %f sec\n"
+		, segDir.string().c_str(), files.size(), bytes
+		, segColdDir.string().c_str(), pf.sf(t0, pf.now()));
+	return true;
+}
+
+// cold files which are not targets of any symlink in m_dir, by a completed
+// merge, purge or a failed move, are removed. Merge and purge may rename
+// symlinks between segment dirs, so it runs in compaction exclusion
+void DbTable::removeUnusedColdFiles(PathRef coldDir) {
+	{
+		MyRwLock lock(m_rwMutex, true);
+		if (m_isMerging || m_compactSuspendCnt) {
+			return;
+		}
+		m_isMerging = true;
+	}
+	BOOST_SCOPE_EXIT(this_) {
+		MyRwLock lock(this_->m_rwMutex, true);
+		this_->m_isMerging = false;
+	}BOOST_SCOPE_EXIT_END;
+	size_t segArrayUpdateSeq = m_segArrayUpdateSeq;
+	try {
+		if (!fs::exists(coldDir)) {
+			m_coldGcSegArrayUpdateSeq = segArrayUpdateSeq;
+			return;
+		}
+		std::set<std::string> used;
+		for (fs::recursive_directory_iterator iter(m_dir), end; iter != end; ++iter) {
+			if (fs::is_symlink(iter->symlink_status()))
+				used.insert(fs::read_symlink(iter->path()).string());
+		}
+		std::vector<fs::path> unused, dirs;
+		for (fs::recursive_directory_iterator iter(coldDir), end; iter != end; ++iter) {
+			if (fs::is_directory(iter->symlink_status()))
+				dirs.push_back(iter->path());
+			else if (!used.count(iter->path().string()))
+				unused.push_back(iter->path());
+		}
+		for (auto& file : unused) {
+			fprintf(stderr, "INFO: remove unused cold file: %s\n", file.string().c_str());
+			fs::remove(file);
+		}
+		// deepest dirs are after their parents
+		for (size_t i = dirs.size(); i > 0; --i) {
+			if (fs::is_empty(dirs[i-1]))
+				fs::remove(dirs[i-1]);
+		}
+		m_coldGcSegArrayUpdateSeq = segArrayUpdateSeq;
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "WARN: removeUnusedColdFiles(%s): %s\n"
+			, coldDir.string().c_str(), ex.what());
+	}
+}
+
+void DbTable::putColdSegmentTask() {
+	if (g_stopCompress || m_schema->m_coldSegmentPath.empty()) {
+		return;
+	}
+	g_compressQueue.push_back(this, new ColdSegmentTask(this));
+}
+
+void DbTable::putExpireTask() {
+	if (g_stopCompress || size_t(-1) == m_schema->m_ttlColumnId) {
+		return;
+	}
+	g_compressQueue.push_back(this, new ExpireTask(this));
+}
+
+// logic ids of live rows whose ttl value is in [LLONG_MIN, hi], blocks
+// are skipped by the zone map
+static void
+collectExpiredRows(const ReadonlySegment* seg, size_t ttlColumnId,
+				   const SegmentZoneMap::Column* zone, size_t blockRows,
+				   llong hi, valvec<size_t>* logicIds) {
+	const ColumnType type = seg->m_schema->m_rowSchema->getColumnMeta(ttlColumnId).type;
+	const size_t physicRows = seg->getPhysicRows();
+	const size_t numBlocks = (physicRows + blockRows - 1) / blockRows;
+	ColumnarBatchIter iter(seg, &ttlColumnId, 1, blockRows);
+	ColumnBatch batch;
+	for (size_t k = 0; k < numBlocks; ++k) {
+		if (zone && !SegmentZoneMap::overlaps(type, zone->zones[1+k], LLONG_MIN, hi))
+			continue;
+		iter.seek(k * blockRows);
+		if (!iter.next(&batch))
+			break;
+		const ColumnArray& col = batch.m_cols[0];
+		for (size_t i = 0; i < batch.m_rows; ++i) {
+			if (batch.m_select.is1(i) &&
+				SegmentZoneMap::inRange(type, col.data + col.stride * i, LLONG_MIN, hi))
+				logicIds->push_back(seg->getLogicId(size_t(batch.m_basePhysicId + i)));
+		}
+	}
+}
+
+size_t DbTable::expireRows() {
+	const size_t ttlColumnId = m_schema->m_ttlColumnId;
+	if (size_t(-1) == ttlColumnId || g_stopCompress) {
+		return 0;
+	}
+	const llong now = ::time(NULL);
+	const llong checkSeconds = getEnvLong("TerarkDB_TtlCheckSeconds", 60);
+	llong last = m_lastExpireTime.load();
+	if (now - last < checkSeconds ||
+		!m_lastExpireTime.compare_exchange_strong(last, now)) {
+		return 0; // checked recently or by another thread
+	}
+	const llong hi = now - m_schema->m_ttlSeconds; // ttl <= hi is expired
+	const ColumnType type = m_schema->m_rowSchema->getColumnMeta(ttlColumnId).type;
+	valvec<ReadableSegmentPtr> segs;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		segs.assign(m_segments);
+	}
+	profiling pf;
+	llong t0 = pf.now();
+	size_t expired = 0, droppedSegs = 0;
+	bool needPurge = false;
+	valvec<size_t> logicIds;
+	for (auto& segPtr : segs) {
+		if (g_stopCompress)
+			break;
+		ReadonlySegment* seg = segPtr->getReadonlySegment();
+		if (NULL == seg || seg->m_isDel.size() == seg->m_delcnt)
+			continue;
+		const SegmentZoneMap* zm = seg->m_zoneMap.get();
+		const SegmentZoneMap::Column* zone = zm ? zm->findColumn(ttlColumnId) : NULL;
+		bool whole = false;
+		if (zone) {
+			if (!SegmentZoneMap::overlaps(type, zone->zones[0], LLONG_MIN, hi))
+				continue; // no expired rows
+			whole = !SegmentZoneMap::overlaps(type, zone->zones[0], hi + 1, LLONG_MAX);
+		}
+		logicIds.erase_all();
+		if (!whole) {
+			// the ttl column is scanned without lock
+			try {
+				collectExpiredRows(seg, ttlColumnId, zone,
+								   zone ? zm->m_blockRows : 4096, hi, &logicIds);
+			}
+			catch (const std::exception& ex) {
+				fprintf(stderr, "WARN: expireRows: %s: %s\n"
+					, seg->m_segDir.string().c_str(), ex.what());
+				continue;
+			}
+			if (logicIds.empty())
+				continue;
+		}
+		MyRwLock lock(m_rwMutex, false);
+		if (m_schema->m_enableSnapshot && LLONG_MAX != m_oldestSnapshotVersion) {
+			break; // alive snapshots need the rows
+		}
+		if (findSegIdx(0, seg) == m_segments.size()) {
+			continue; // merged or purged, expired by the next call
+		}
+		SpinRwLock wsLock(seg->m_segMutex);
+		size_t num = 0;
+		if (whole) {
+			if (seg->m_bookUpdates) { // segment is being purged or merged
+				for (size_t subId = 0; subId < seg->m_isDel.size(); ++subId) {
+					if (!seg->m_isDel[subId])
+						seg->addtoUpdateList(subId);
+				}
+			}
+			num = seg->atomicSetIsDelAll();
+			droppedSegs++;
+		}
+		else {
+			for (size_t logicId : logicIds) {
+				if (seg->atomicSetIsDel1(logicId)) {
+					if (seg->m_bookUpdates)
+						seg->addtoUpdateList(logicId);
+					num++;
+				}
+			}
+		}
+		if (num) {
+			seg->m_isDirty = true;
+			expired += num;
+			if (!g_stopPutToFlushQueue)
+				needPurge = needPurge || whole || checkPurgeDeleteNoLock(seg);
+		}
+	}
+	if (needPurge && !g_stopPutToFlushQueue) {
+		MyRwLock lock(m_rwMutex, true);
+		inLockPutPurgeDeleteTaskToQueue();
+	}
+	if (expired) {
+		fprintf(stderr
+			, "INFO: expireRows: %s, rows = %zd, whole segments = %zd, %.3f sec\n"
+			, m_dir.string().c_str(), expired, droppedSegs, pf.sf(t0, pf.now()));
+	}
+	return expired;
+}
+
+void DbTable::putVerifySegmentTask() {
+	if (g_stopCompress || !m_schema->m_verifySegmentsOnLoad) {
+		return;
+	}
+	g_compressQueue.push_back(this, new VerifySegmentTask(this));
+}
+
+// stores verify record checksums on read, such as DictZipBlobStore,
+// segments merged away in the scan are still readable by mmap
+size_t DbTable::verifySegments() {
+	valvec<ReadableSegmentPtr> segs;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		segs.assign(m_segments);
+	}
+	DbContextPtr ctx(this->createDbContext());
+	profiling pf;
+	llong t0 = pf.now();
+	size_t verified = 0, corrupt = 0;
+	llong id = -1;
+	valvec<byte> val;
+	for (auto& seg : segs) {
+		ReadonlySegment* rdseg = seg->getReadonlySegment();
+		if (NULL == rdseg) {
+			continue;
+		}
+		for (size_t i = 0; i < rdseg->m_colgroups.size(); ++i) {
+			const Schema& schema = m_schema->getColgroupSchema(i);
+			if (schema.m_checksumLevel < 2) {
+				continue;
+			}
+			try {
+				StoreIteratorPtr iter(rdseg->m_colgroups[i]->createStoreIterForward(ctx.get()));
+				for (size_t n = 1; iter->increment(&id, &val); ++n) {
+					if (n % 65536 == 0 && g_stopCompress)
+						return corrupt;
+				}
+			}
+			catch (const std::exception& ex) {
+				fprintf(stderr, "ERROR: DbTable::verifySegments: %s, colgroup %s: %s\n"
+					, rdseg->m_segDir.string().c_str(), schema.m_name.c_str(), ex.what());
+				corrupt++;
+				m_corruptSegNum++;
+				break;
+			}
+		}
+		verified++;
+	}
+	fprintf(stderr, "INFO: DbTable::verifySegments(%s): %zd segs, corrupt = %zd, time = %.3f sec\n"
+		, m_dir.string().c_str(), verified, corrupt, pf.sf(t0, pf.now()));
+	return corrupt;
+}
+
+void DbTable::startScrubber() {
+	const SchemaConfig& sconf = *m_schema;
+	if (0 == sconf.m_scrubIntervalSeconds || m_isReplica) {
+		return; // checksum files of a replica are written by the writer
+	}
+	DbTable* tab = this; // the scrubber is stopped first by ~DbTable
+	auto listSegments = [tab](std::vector<std::string>* segDirs) {
+		MyRwLock lock(tab->m_rwMutex, false);
+		for (auto& seg : tab->m_segments) {
+			if (seg->getReadonlySegment())
+				segDirs->push_back(seg->m_segDir.string());
+		}
+	};
+	SchemaConfigPtr schema = m_schema;
+	auto isMutable = [schema](fstring fname) {
+		if (fname.startsWith("IsDel") || fname == g_quarantineFile ||
+				fname.startsWith("ReadHeat.json"))
+			return true;
+		for (size_t i = 0; i < schema->getColgroupNum(); ++i) {
+			const Schema& cg = schema->getColgroupSchema(i);
+			if (cg.m_isInplaceUpdatable &&
+					fname.startsWith("colgroup-" + cg.m_name))
+				return true;
+		}
+		return false;
+	};
+	auto onCorrupt = [tab](const std::string& segDir, const std::string& reason) {
+		if (tab->m_schema->m_scrubQuarantine) {
+			tab->quarantineSegment(segDir, reason);
+		}
+	};
+	m_scrubber = new SegmentScrubber(sconf.m_scrubBytesPerSecond,
+		sconf.m_scrubIntervalSeconds, listSegments, isMutable, onCorrupt);
+	if (m_readLatencyLimiter) {
+		// backs off with compactions when foreground reads are slow
+		m_scrubber->followLimiter(m_readLatencyLimiter,
+								  sconf.m_compactWriteBytesPerSecond);
+	}
+	m_scrubber->start();
+}
+
+SegmentScrubStat DbTable::getScrubStat() const {
+	if (m_scrubber)
+		return m_scrubber->getStat();
+	return SegmentScrubStat();
+}
+
+bool DbTable::quarantineSegment(const std::string& segDir, const std::string& reason) {
+	ReadableSegmentPtr seg;
+	{
+		MyRwLock lock(m_rwMutex, true);
+		for (auto& x : m_segments) {
+			if (x->getReadonlySegment() && x->m_segDir.string() == segDir) {
+				seg = x;
+				break;
+			}
+		}
+		if (!seg || seg->m_isQuarantined) {
+			return false;
+		}
+		seg->m_isQuarantined = true;
+	}
+	m_corruptSegNum++;
+	std::string fpath = (seg->m_segDir / g_quarantineFile).string();
+	if (FILE* fp = fopen(fpath.c_str(), "w")) {
+		fprintf(fp, "%lld %s\n", llong(::time(NULL)), reason.c_str());
+		fclose(fp);
+	}
+	else {
+		fprintf(stderr, "WARN: quarantineSegment: fopen(%s) = %s\n"
+			, fpath.c_str(), strerror(errno));
+	}
+	fprintf(stderr, "ERROR: DbTable::quarantineSegment(%s): %s\n"
+		, segDir.c_str(), reason.c_str());
+	return true;
+}
+
+void DbTable::countColumnUpdates(const ColumnVec& newCols, const ColumnVec& oldCols) {
+	assert(newCols.size() == oldCols.size());
+	m_updateRowCnt.fetch_add(1, std::memory_order_relaxed);
+	for (size_t i = 0; i < newCols.size(); ++i) {
+		if (newCols[i] != oldCols[i])
+			m_columnUpdateCnt[i].fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+ullong DbTable::getColumnUpdateCounts(valvec<ullong>* counts) const {
+	counts->resize_no_init(m_schema->columnNum());
+	for (size_t i = 0; i < counts->size(); ++i) {
+		(*counts)[i] = m_columnUpdateCnt[i].load(std::memory_order_relaxed);
+	}
+	return m_updateRowCnt.load(std::memory_order_relaxed);
+}
+
+valvec<size_t> DbTable::getHotColumns() const {
+	const SchemaConfig& sconf = *m_schema;
+	valvec<size_t> hot;
+	valvec<ullong> counts;
+	ullong updates = getColumnUpdateCounts(&counts);
+	if (sconf.m_hotColumnUpdateRatio <= 0 || updates < sconf.m_hotColumnMinUpdates) {
+		return hot;
+	}
+	for (size_t i = 0; i < counts.size(); ++i) {
+		if (counts[i] >= sconf.m_hotColumnUpdateRatio * updates &&
+				isPromotableColumn(sconf, i))
+			hot.push_back(i);
+	}
+	return hot;
+}
+
+// counts are also saved, they are accumulated across table loads
+void DbTable::saveHotColumns() const {
+	using terark::json;
+	const SchemaConfig& sconf = *m_schema;
+	if (sconf.m_hotColumnUpdateRatio <= 0 || m_dir.empty()) {
+		return;
+	}
+	valvec<ullong> counts;
+	ullong updates = getColumnUpdateCounts(&counts);
+	json js;
+	json jcounts = json::object();
+	for (size_t i = 0; i < counts.size(); ++i) {
+		if (counts[i])
+			jcounts[sconf.getRowSchema().getColumnName(i).str()] = counts[i];
+	}
+	json columns = json::array();
+	for (size_t columnId : getHotColumns()) {
+		columns.push_back(sconf.getRowSchema().getColumnName(columnId).str());
+	}
+	js["updates"] = updates;
+	js["counts"] = jcounts;
+	js["columns"] = columns;
+	std::string str = js.dump(2);
+	std::string fpath = (m_dir / "HotColumns.json").string();
+	std::string tmpFile = fpath + ".tmp";
+	{
+		EnvFileStream fp(tmpFile, "w");
+		fp.ensureWrite(str.data(), str.size());
+	}
+	fs::rename(tmpFile, fpath);
+	if (!columns.empty()) {
+		fprintf(stderr, "INFO: DbTable::saveHotColumns(%s): %s, promoted on next load\n"
+			, m_dir.string().c_str(), columns.dump().c_str());
+	}
+}
+
+void DbTable::loadHotColumnCounts() {
+	using terark::json;
+	const size_t columnNum = m_schema->columnNum();
+	m_columnUpdateCnt.reset(new std::atomic<ullong>[columnNum]());
+	m_updateRowCnt = 0;
+	fs::path fpath = m_dir / "HotColumns.json";
+	if (m_schema->m_hotColumnUpdateRatio <= 0 || !fs::exists(fpath)) {
+		return;
+	}
+	LineBuf text;
+	text.read_all(fpath.string());
+	json js = json::parse(std::string(text.p, text.n));
+	m_updateRowCnt = js["updates"].get<ullong>();
+	const json& counts = js["counts"];
+	for (auto iter = counts.begin(); iter != counts.end(); ++iter) {
+		size_t columnId = m_schema->getRowSchema().getColumnId(iter.key());
+		if (columnId < columnNum)
+			m_columnUpdateCnt[columnId] = iter.value().get<ullong>();
+	}
+}
+
+
+// indices of readonly segments which have been built are opened, others
+// are built by OnlineIndexTask
+void DbTable::loadOnlineIndices() {
+	using terark::json;
+	fs::path fpath = m_dir / g_onlineIndexFile;
+	if (!fs::exists(fpath)) {
+		return;
+	}
+	LineBuf text;
+	text.read_all(fpath.string());
+	const json js = json::parse(std::string(text.p, text.n));
+	valvec<OnlineIndexPtr> indices;
+	for (const auto& index : js) {
+		std::vector<std::string> columns;
+		for (const auto& col : index["columns"])
+			columns.push_back(col.get<std::string>());
+		indices.push_back(new OnlineIndex(*m_schema->m_rowSchema,
+			index["name"].get<std::string>(), columns, index["ordered"].get<bool>()));
+	}
+	size_t pending = 0;
+	for (auto& oi : indices) {
+		for (auto& seg : m_segments) {
+			ReadonlySegment* rdseg = seg->getReadonlySegment();
+			if (rdseg && !oi->load(rdseg))
+				pending++;
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_onlineIndexMutex);
+		m_onlineIndices.swap(indices);
+	}
+	fprintf(stderr, "INFO: DbTable::loadOnlineIndices(%s): %zd indices, %zd segment indices to build\n"
+		, m_dir.string().c_str(), m_onlineIndices.size(), pending);
+	if (pending && !m_isReplica) {
+		putOnlineIndexTask();
+	}
+}
+
+// written to a temp file and renamed, caller should hold m_onlineIndexMutex
+void DbTable::saveOnlineIndicesInLock() const {
+	using terark::json;
+	json js = json::array();
+	for (auto& oi : m_onlineIndices) {
+		const Schema& schema = *oi->m_schema;
+		json index;
+		json columns = json::array();
+		for (size_t i = 0; i < schema.columnNum(); ++i)
+			columns.push_back(schema.getColumnName(i).str());
+		index["name"] = oi->name();
+		index["columns"] = columns;
+		index["ordered"] = schema.m_isOrdered;
+		js.push_back(index);
+	}
+	std::string str = js.dump(2);
+	std::string fpath = (m_dir / g_onlineIndexFile).string();
+	std::string tmpFile = fpath + ".tmp";
+	{
+		EnvFileStream fp(tmpFile, "w");
+		fp.ensureWrite(str.data(), str.size());
+		fp.sync(tmpFile);
+	}
+	fs::rename(tmpFile, fpath);
+}
+
+void DbTable::addOnlineIndex(fstring name, const std::vector<std::string>& columns,
+							 bool ordered) {
+	checkNotReplica("addOnlineIndex");
+	if (getIndexId(name) < getIndexNum()) {
+		THROW_STD(invalid_argument, "index %s is already in the schema", name.c_str());
+	}
+	OnlineIndexPtr oi = new OnlineIndex(*m_schema->m_rowSchema, name, columns, ordered);
+	{
+		std::lock_guard<std::mutex> lock(m_onlineIndexMutex);
+		for (auto& x : m_onlineIndices) {
+			if (x->name() == name) {
+				THROW_STD(invalid_argument, "duplicate online index: %s", name.c_str());
+			}
+		}
+		m_onlineIndices.push_back(oi);
+		try {
+			saveOnlineIndicesInLock();
+		}
+		catch (const std::exception&) {
+			m_onlineIndices.pop_back();
+			throw;
+		}
+	}
+	fprintf(stderr, "INFO: DbTable::addOnlineIndex(%s): %s\n"
+		, m_dir.string().c_str(), name.c_str());
+	putOnlineIndexTask();
+}
+
+OnlineIndexPtr DbTable::findOnlineIndex(fstring name) const {
+	std::lock_guard<std::mutex> lock(m_onlineIndexMutex);
+	for (auto& oi : m_onlineIndices) {
+		if (oi->name() == name)
+			return oi;
+	}
+	return NULL;
+}
+
+bool DbTable::isOnlineIndexReady(fstring name) const {
+	OnlineIndexPtr oi = findOnlineIndex(name);
+	if (!oi) {
+		THROW_STD(invalid_argument, "online index %s does not exist", name.c_str());
+	}
+	SegArrayReadGuard version(this);
+	for (auto& seg : version->m_segments) {
+		ReadonlySegment* rdseg = seg->getReadonlySegment();
+		if (rdseg && !oi->getIndex(rdseg))
+			return false;
+	}
+	return true;
+}
+
+/// returned recIdvec is in the same order as indexSearchExactNoLock
+void
+DbTable::onlineIndexSearchExact(fstring name, fstring key,
+								valvec<llong>* recIdvec, DbContext* ctx)
+const {
+	OnlineIndexPtr oi = findOnlineIndex(name);
+	if (!oi) {
+		THROW_STD(invalid_argument, "online index %s does not exist", name.c_str());
+	}
+	DbPerfTimer perf(m_perf.get(), DbPerfOp::indexSearch);
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	recIdvec->erase_all();
+	const size_t* colsId = oi->m_columnIds.data();
+	const size_t  colsNum = oi->m_columnIds.size();
+	auto buf = ctx->bufs.get();
+	for (size_t i = ctx->m_segCtx.size(); i > 0; ) {
+		auto seg = ctx->m_segCtx[--i]->seg;
+		if (seg->m_isDel.size() == seg->m_delcnt)
+			continue;
+		size_t oldsize = recIdvec->size();
+		ReadonlySegment* rdseg = seg->getReadonlySegment();
+		ReadableIndexPtr index = rdseg ? oi->getIndex(rdseg) : NULL;
+		if (index) {
+			index->searchExactAppend(key, recIdvec, ctx);
+			size_t newsize = rdseg->filterSearchExactResult(recIdvec->data(),
+								oldsize, recIdvec->size(), oldsize, ctx);
+			recIdvec->risk_set_size(newsize);
+		}
+		else { // not built yet or writable, scan the key columns
+			size_t rows;
+			{
+				SpinRwLock segLock(seg->m_segMutex, false);
+				rows = seg->m_isDel.size();
+			}
+			for (size_t logicId = 0; logicId < rows; ++logicId) {
+				if (seg->testIsDel(logicId, ctx))
+					continue;
+				seg->selectColumns(logicId, colsId, colsNum, buf.get(), ctx);
+				if (fstring(*buf) == key)
+					recIdvec->push_back(logicId);
+			}
 		}
-	}
-Done:
-	assert(g_flushQueue.empty());
-	g_flushStopped = true;
-	fprintf(stderr, "INFO: flushing thread completed!\n");
-}
-
-void CompressThreadFunc() {
-	while (!g_flushStopped && !g_stopCompress) {
-		MyTaskPtr t;
-		while (!g_stopCompress && g_compressQueue.pop_front(t, 100)) {
-			if (g_stopCompress)
-				break;
-			t->execute();
+		size_t len = recIdvec->size() - oldsize;
+		if (len) {
+			llong* p = recIdvec->data() + oldsize;
+			llong baseId = ctx->m_rowNumVec[i];
+			for (size_t j = 0; j < len; ++j) {
+				p[j] += baseId;
+			}
+			if (len >= 2) {
+				std::sort(p, p + len);
+				std::reverse(p, p + len); // in descending order
+			}
 		}
 	}
 }
 
-class CompressionThreadsList : private std::vector<tbb::tbb_thread*> {
-public:
-	CompressionThreadsList() {
-		size_t cpu = tbb::tbb_thread::hardware_concurrency();
-		size_t cfg = getEnvLong("TerarkDB_CompressionThreadsNum", 0);
-		size_t num = cfg ? min(cpu, cfg) : min<size_t>(cpu, 4);
-		this->resize(num);
-		for (size_t i = 0; i < num; ++i) {
-			(*this)[i] = new tbb::tbb_thread(&CompressThreadFunc);
-		}
+size_t DbTable::buildOnlineIndices() {
+	valvec<OnlineIndexPtr> indices;
+	{
+		std::lock_guard<std::mutex> lock(m_onlineIndexMutex);
+		indices.assign(m_onlineIndices);
 	}
-	~CompressionThreadsList() {
-		if (!this->empty())
-			DbTable::safeStopAndWaitForFlush();
+	if (indices.empty()) {
+		return 0;
 	}
-	void join() {
-		for (auto& th : *this) {
-			th->join();
-			delete th;
-			th = NULL;
-		}
-		fprintf(stderr, "INFO: compression threads(%zd) completed!\n", this->size());
-		this->clear();
-		g_compressQueue.clearQueue();
+	// a running build will be followed by the next AutoTask
+	std::unique_lock<std::mutex> buildLock(m_onlineIndexBuildMutex, std::try_to_lock);
+	if (!buildLock.owns_lock()) {
+		return 0;
 	}
-};
-tbb::tbb_thread g_flushThread(&FlushThreadFunc);
-CompressionThreadsList g_compressThreads;
-
-class AutoTask : public MyTask {
-	DbTablePtr m_tab;
-public:
-	void execute() override {
-		if (m_tab->autoConvMergePurge(false) && m_tab->isAutoTask()) {
-            m_tab->putAutoTask();
-        }
+	SegArrayVersionPtr version = getSegArrayVersion();
+	struct Job {
+		OnlineIndex* index;
+		const ReadonlySegment* seg;
+	};
+	valvec<Job> jobs;
+	for (auto& oi : indices) {
+		oi->retain(version->m_segments);
+		for (auto& seg : version->m_segments) {
+			ReadonlySegment* rdseg = seg->getReadonlySegment();
+			if (rdseg && !oi->getIndex(rdseg) && !oi->load(rdseg))
+				jobs.push_back({oi.get(), rdseg});
+		}
 	}
-	AutoTask(DbTablePtr tab) : m_tab(tab) {}
-};
-
-class WrSegFreezeFlushTask : public MyTask {
-	DbTablePtr m_tab;
-	size_t m_segIdx;
-public:
-	WrSegFreezeFlushTask(DbTablePtr tab, size_t segIdx)
-		: m_tab(tab), m_segIdx(segIdx) {}
-
-	void execute() override {
-		m_tab->freezeFlushWritableSegment(m_segIdx);
-		g_compressQueue.push_back(new AutoTask(m_tab));
+	if (jobs.empty()) {
+		return 0;
 	}
-};
-
-} // namespace
-using namespace anonymousForDebugMSVC;
+	size_t threads = (size_t)std::max(getEnvLong("TerarkDB_OnlineIndexThreads", 4), 1L);
+	threads = std::min(threads, jobs.size());
+	profiling pf;
+	llong t0 = pf.now();
+	std::atomic<size_t> built(0);
+	tbb::task_arena arena{int(threads)};
+	arena.execute([&]() {
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, jobs.size(), 1),
+			[&](const tbb::blocked_range<size_t>& r) {
+				DbContextPtr ctx(this->createDbContext());
+				for (size_t k = r.begin(); k < r.end(); ++k) {
+					if (g_stopCompress)
+						return;
+					const Job& job = jobs[k];
+					try {
+						job.index->build(job.seg, ctx.get());
+						built++;
+					}
+					catch (const std::exception& ex) {
+						fprintf(stderr, "WARN: DbTable::buildOnlineIndices: %s, index %s: %s\n"
+							, job.seg->m_segDir.string().c_str()
+							, job.index->name().c_str(), ex.what());
+					}
+				}
+			}, tbb::simple_partitioner());
+	});
+	fprintf(stderr, "INFO: DbTable::buildOnlineIndices(%s): built %zd of %zd, threads = %zd, time = %.3f sec\n"
+		, m_dir.string().c_str(), size_t(built), jobs.size(), threads, pf.sf(t0, pf.now()));
+	return built;
+}
 
-void DbTable::putToFlushQueue(size_t segIdx) {
-	assert(!g_stopPutToFlushQueue);
-	if (g_stopPutToFlushQueue) {
+void DbTable::putOnlineIndexTask() {
+	if (g_stopCompress) {
 		return;
 	}
-	assert(segIdx < m_segments.size());
-	assert(m_segments[segIdx]->m_isDel.size() > 0);
-	assert(m_segments[segIdx]->getWritableStore() != nullptr);
-	g_flushQueue.push_back(new WrSegFreezeFlushTask(this, segIdx));
-	m_bgTaskNum++;
+	g_compressQueue.push_back(this, new OnlineIndexTask(this));
 }
 
-void DbTable::putToCompressionQueue(size_t segIdx) {
-	assert(segIdx < m_segments.size());
-	assert(m_segments[segIdx]->m_isDel.size() > 0);
-	assert(m_segments[segIdx]->getWritableStore() != nullptr);
-	if (g_stopCompress) {
+void DbTable::putUniqueKeyFilterTask() {
+	if (g_stopCompress || m_schema->m_uniqIndices.empty()) {
 		return;
 	}
-	g_compressQueue.push_back(new AutoTask(this));
-	m_bgTaskNum++;
+	g_compressQueue.push_back(this, new UniqueKeyFilterTask(this));
 }
 
 void DbTable::putAutoTask() {
 	if (g_stopCompress || !m_autoTask) {
 		return;
 	}
-	g_compressQueue.push_back(new AutoTask(this));
+	g_compressQueue.push_back(this, new AutoTask(this));
 	m_bgTaskNum++;
 }
 
@@ -4682,6 +10079,93 @@ bool DbTable::isAutoTask() const {
     return m_autoTask;
 }
 
+void DbTable::suspendCompaction() {
+	{
+		MyRwLock lock(m_rwMutex, true);
+		m_compactSuspendCnt++;
+	}
+	size_t retryNum = 0;
+	while (m_runningAutoTaskNum > 0) {
+		if (retryNum++ % 100 == 0) {
+			fprintf(stderr
+				, "INFO: suspendCompaction: %s, wait for running tasks = %zd\n"
+				, m_dir.string().c_str(), size_t(m_runningAutoTaskNum));
+		}
+		tbb::this_tbb_thread::sleep(tbb::tick_count::interval_t(0.1));
+	}
+}
+
+void DbTable::resumeCompaction() {
+	MyRwLock lock(m_rwMutex, true);
+	assert(m_compactSuspendCnt > 0);
+	if (0 == m_compactSuspendCnt || --m_compactSuspendCnt > 0) {
+		return;
+	}
+	if (m_hasDeferredAutoTask) {
+		m_hasDeferredAutoTask = false;
+		putAutoTask();
+	}
+}
+
+bool DbTable::isCompactionSuspended() const {
+	MyRwLock lock(m_rwMutex, false);
+	return m_compactSuspendCnt > 0;
+}
+
+// called frequently by builders, so no lock, a stale value just delays
+// the cancellation to the next checkpoint
+bool DbTable::isBgTaskCancelled(bool cancelOnSuspend) const {
+	return g_stopCompress || m_tobeDrop ||
+		(cancelOnSuspend && m_compactSuspendCnt > 0);
+}
+
+void DbTable::checkBgTaskCancelled(bool cancelOnSuspend) const {
+	if (terark_likely(!isBgTaskCancelled(cancelOnSuspend))) {
+		return;
+	}
+	const char* reason = g_stopCompress ? "stopping" :
+						 m_tobeDrop ? "dropped" : "compaction suspended";
+	throw TaskCancelledException(std::string("TaskCancelledException(")
+		+ reason + "): dbdir = " + m_dir.string());
+}
+
+// the build is not committed, the input segment is unchanged and updates
+// booked for the build are discarded
+void DbTable::cancelBookUpdates(ReadableSegment* seg) {
+	MyRwLock lock(m_rwMutex, true);
+	SpinRwLock segLock(seg->m_segMutex, true);
+	seg->m_bookUpdates = false;
+	seg->m_updateIds.erase_all();
+}
+
+// check and count under m_rwMutex, so suspendCompaction can wait for
+// m_runningAutoTaskNum to be 0
+bool DbTable::beginAutoTask() {
+	MyRwLock lock(m_rwMutex, true);
+	if (m_compactSuspendCnt) {
+		// drop the task, it is put again by resumeCompaction
+		m_hasDeferredAutoTask = true;
+		m_bgTaskNum--;
+		return false;
+	}
+	m_runningAutoTaskNum++;
+	return true;
+}
+
+void DbTable::endAutoTask() {
+	assert(m_runningAutoTaskNum > 0);
+	m_runningAutoTaskNum--;
+}
+
+// a task cancelled by suspendCompaction is put again by resumeCompaction,
+// other cancellations(stop or drop) need no retry
+void DbTable::deferCancelledAutoTask() {
+	MyRwLock lock(m_rwMutex, true);
+	if (m_compactSuspendCnt && !g_stopCompress && !m_tobeDrop) {
+		m_hasDeferredAutoTask = true;
+	}
+}
+
 inline
 bool DbTable::checkPurgeDeleteNoLock(const ReadableSegment* seg) {
 	assert(!g_stopPutToFlushQueue);
@@ -4712,11 +10196,167 @@ void DbTable::inLockPutPurgeDeleteTaskToQueue() {
 	if (g_stopPutToFlushQueue) {
 		return;
 	}
-	g_compressQueue.push_back(new AutoTask(this));
+	g_compressQueue.push_back(this, new AutoTask(this));
 	m_bgTaskNum++;
 }
 
+llong DbTable::dropSegmentsBefore(llong recIdEnd) {
+	IncrementGuard_size_t guard(m_inprogressWritingCount);
+	MyRwLock lock(m_rwMutex, false);
+	DebugCheckRowNumVecNoLock(this);
+	if (m_schema->m_enableSnapshot && LLONG_MAX != m_oldestSnapshotVersion) {
+		return 0; // alive snapshots need the rows
+	}
+	llong dropped = 0;
+	for (size_t i = 0; i < m_segments.size(); ++i) {
+		auto seg = m_segments[i].get();
+		if (!seg->m_isFreezed || m_rowNumVec[i+1] > recIdEnd)
+			break; // writable segments are always the newest
+		SpinRwLock wsLock(seg->m_segMutex);
+		const size_t rows = seg->m_isDel.size();
+		if (seg->m_delcnt == rows)
+			continue;
+		if (seg->m_bookUpdates) { // segment is being purged or merged
+			for (size_t subId = 0; subId < rows; ++subId) {
+				if (!seg->m_isDel[subId])
+					seg->addtoUpdateList(subId);
+			}
+		}
+		dropped += seg->atomicSetIsDelAll();
+		seg->m_isDirty = true;
+	}
+	if (dropped && !g_stopPutToFlushQueue) {
+		// a fully deleted segment is purged to empty stores without
+		// reading its data
+		lock.upgrade_to_writer();
+		inLockPutPurgeDeleteTaskToQueue();
+	}
+	return dropped;
+}
+
+// the segments are removed as a merge: kept segments are linked into a
+// new merge dir whose commit swaps m_segments, merges, conversions and new
+// writable segments are excluded by m_isMerging
+size_t DbTable::dropPartitionsOlderThan(llong ts) {
+	checkNotReplica("dropPartitionsOlderThan");
+	const llong partSec = m_schema->m_timePartitionSeconds;
+	if (size_t(-1) == m_schema->m_timePartitionColumnId) {
+		THROW_STD(invalid_argument, "TimePartitionColumn is not defined");
+	}
+	const llong cutoff = ts / partSec - (ts % partSec < 0 ? 1 : 0);
+	for (;;) {
+		MyRwLock lock(m_rwMutex, true);
+		if (m_isMerging || m_compactSuspendCnt || m_bgTaskNum) {
+			lock.release();
+			tbb::this_tbb_thread::sleep(tbb::tick_count::interval_t(0.1));
+			continue;
+		}
+		if (m_schema->m_enableSnapshot && LLONG_MAX != m_oldestSnapshotVersion) {
+			return 0; // alive snapshots need the rows
+		}
+		m_isMerging = true;
+		break;
+	}
+	BOOST_SCOPE_EXIT(this_) {
+		MyRwLock lock(this_->m_rwMutex, true);
+		this_->m_isMerging = false;
+	}BOOST_SCOPE_EXIT_END;
+	valvec<ReadableSegmentPtr> segs;
+	{
+		MyRwLock lock(m_rwMutex, false);
+		segs.assign(m_segments);
+	}
+	valvec<ReadableSegment*> dropped;
+	for (auto& seg : segs) {
+		llong part = seg->m_timePartition;
+		if (seg->getReadonlySegment() && LLONG_MIN != part && part < cutoff)
+			dropped.push_back(seg.get());
+	}
+	if (dropped.empty()) {
+		return 0;
+	}
+	fs::path destMergeDir = getMergePath(m_dir, m_mergeSeqNum+1);
+	if (fs::exists(destMergeDir)) {
+		THROW_STD(logic_error, "dir: '%s' should not existed"
+			, destMergeDir.string().c_str());
+	}
+	fs::create_directories(destMergeDir);
+	logManifestEdit("m" + std::to_string(m_mergeSeqNum + 1));
+	fs::path   mergingLockFile = destMergeDir / "merging.lock";
+	FileStream mergingLockFp(mergingLockFile.string().c_str(), "wb");
+	valvec<ReadableSegmentPtr> newSegs(m_segments.capacity(), valvec_reserve());
+	for (auto& seg : segs) {
+		if (dropped.end() != std::find(dropped.begin(), dropped.end(), seg.get()))
+			continue;
+		fs::path Old = seg->m_segDir;
+		if (fs::is_symlink(Old))
+			Old = fs::read_symlink(Old);
+		fs::path New = getSegPath2(m_dir, m_mergeSeqNum + 1,
+				seg->getWritableStore() ? "wr" : "rd", newSegs.size());
+		fs::create_directory_symlink(".." / Old.parent_path().filename()
+										  / Old.filename(), New);
+		newSegs.push_back(seg);
+	}
+	llong droppedRows = 0;
+	for (;;) {
+		MyRwLock lock(m_rwMutex, true);
+		if (m_inprogressWritingCount > 0) { // writers may hold record ids
+			lock.release();
+			tbb::this_tbb_thread::sleep(tbb::tick_count::interval_t(0.05));
+			continue;
+		}
+		assert(m_segments.size() == segs.size());
+		valvec<llong> newRowNumVec(m_rowNumVec.capacity(), valvec_reserve());
+		newRowNumVec.push_back(0);
+		llong rows = 0;
+		for (auto& seg : newSegs) {
+			rows += seg->m_isDel.size();
+			newRowNumVec.push_back(rows);
+		}
+		droppedRows = m_rowNumVec.back() - newRowNumVec.back();
+		m_segments.swap(newSegs);
+		m_rowNumVec.swap(newRowNumVec);
+		m_rowNum = m_rowNumVec.back();
+		m_mergeSeqNum++;
+		if (m_manifest.isOpen()) { // the commit of the drop
+			std::set<size_t> oldMergeSeqs = m_manifest.state().oldMergeSeqs;
+			oldMergeSeqs.insert(m_mergeSeqNum - 1);
+			resetManifestInLock(oldMergeSeqs);
+		}
+		m_segArrayUpdateSeq++;
+		publishSegArrayInLock();
+		DebugCheckRowNumVecNoLock(this);
+		break;
+	}
+	mergingLockFp.close();
+	fs::remove(mergingLockFile);
+	for (auto seg : dropped) {
+		seg->deleteSegment(); // removed when the last reader releases it
+	}
+	fprintf(stderr
+		, "INFO: dropPartitionsOlderThan(%lld): %s, segs = %zd, rows = %lld\n"
+		, ts, m_dir.string().c_str(), dropped.size(), droppedRows);
+	return dropped.size();
+}
+
 // flush is the most urgent
+bool DbTable::removeDirInBackground(PathRef dir, PathRef trashDir) {
+	fs::path trash = TrashDeleter::trashName(dir, trashDir);
+	if (!renameToTrash(dir, trash)) {
+		return false;
+	}
+	g_trashDeleter.push(trash);
+	return true;
+}
+
+void DbTable::removeTrashInBackground(PathRef trashDir) {
+	boost::system::error_code ec;
+	for (fs::directory_iterator iter(trashDir, ec), end;
+		 !ec && iter != end; iter.increment(ec)) {
+		g_trashDeleter.push(iter->path());
+	}
+}
+
 void DbTable::safeStopAndWaitForFlush() {
 	std::unique_lock<std::mutex> lock(g_mutexForStop);
 	if (g_stopPutToFlushQueue) {
@@ -4724,11 +10364,9 @@ void DbTable::safeStopAndWaitForFlush() {
 	}
 	g_stopPutToFlushQueue = true;
 	g_stopCompress = true;
-	g_flushQueue.push_back(nullptr); // notify and stop flag
-	g_flushThread.join();
+	g_flushScheduler.stopAndJoin();
 	assert(g_flushStopped);
 	g_compressThreads.join();
-	assert(g_flushQueue.empty());
 	assert(g_compressQueue.empty());
 }
 
@@ -4738,11 +10376,223 @@ void DbTable::safeStopAndWaitForCompress() {
 		return;
 	}
 	g_stopPutToFlushQueue = true;
-	g_flushQueue.push_back(nullptr); // notify and stop flag
-	g_flushThread.join();
+	g_flushScheduler.stopAndJoin();
+	long timeout = getEnvLong("TerarkDB_StopCompressTimeoutSec", -1);
+	std::mutex timerMutex;
+	std::condition_variable timerCond;
+	bool joined = false;
+	std::thread timer;
+	if (timeout >= 0) {
+		timer = std::thread([&]() {
+			std::unique_lock<std::mutex> timerLock(timerMutex);
+			if (!timerCond.wait_for(timerLock, std::chrono::seconds(timeout),
+									[&]() { return joined; })) {
+				fprintf(stderr
+					, "WARN: safeStopAndWaitForCompress: timeout = %ld seconds, cancel compress tasks\n"
+					, timeout);
+				g_stopCompress = true;
+			}
+		});
+	}
 	g_compressThreads.join();
-	assert(g_flushQueue.empty());
-	assert(g_compressQueue.empty());
+	if (timer.joinable()) {
+		{
+			std::lock_guard<std::mutex> timerLock(timerMutex);
+			joined = true;
+		}
+		timerCond.notify_all();
+		timer.join();
+	}
+	assert(g_stopCompress || g_compressQueue.empty());
+}
+
+void DbTable::getFlushQueueStat(FlushQueueStat* stat) {
+	g_flushScheduler.getStat(stat);
+}
+
+size_t DbTable::getCompressQueueSize() {
+	return g_compressQueue.size();
+}
+
+void DbTable::postAsync(AsyncRequest&& req) {
+	std::call_once(m_asyncOnce, [this]() { m_async.reset(new AsyncTableQueue()); });
+	if (m_async->push(std::move(req))) {
+		DbTablePtr tab(this); // alive until the drainer is ended
+		AsyncExecutor::instance().post([tab]() { tab->drainAsync(); });
+	}
+}
+
+void DbTable::drainAsync() {
+	AsyncTableQueue* q = m_async.get();
+	DbContextPtr ctx;
+	{
+		std::lock_guard<std::mutex> lock(q->m_mutex);
+		if (!q->m_freeCtx.empty())
+			ctx = q->m_freeCtx.pop_val();
+	}
+	if (!ctx) {
+		ctx = createDbContext();
+	}
+	std::vector<AsyncRequest> batch;
+	while (q->take(&batch)) {
+		runAsyncBatch(batch, ctx.get());
+	}
+	std::lock_guard<std::mutex> lock(q->m_mutex);
+	q->m_freeCtx.push_back(ctx);
+}
+
+template<class Callback, class... Args>
+static void callAsyncCallback(const Callback& cb, Args&&... args) {
+	try {
+		cb(std::forward<Args>(args)...);
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: DbTable async callback: %s\n", ex.what());
+	}
+}
+
+// runs of requests of the same op, and of the same index for searchExact,
+// are executed by one batch call, if the batch call throws, requests of
+// the run are executed one by one for the error of each request
+void DbTable::runAsyncBatch(std::vector<AsyncRequest>& batch, DbContext* ctx) {
+	valvec<llong> ids;
+	valvec<valvec<byte> > vals;
+	valvec<fstring> keys;
+	valvec<llong> recIds;
+	valvec<size_t> offsets;
+	valvec<llong> one;
+	for (size_t i = 0; i < batch.size(); ) {
+		const AsyncRequest& first = batch[i];
+		size_t j = i + 1;
+		while (j < batch.size() && batch[j].op == first.op &&
+				(AsyncRequest::searchExact != first.op ||
+				 batch[j].indexId == first.indexId))
+			++j;
+		const size_t num = j - i;
+		bool batchOk = false;
+		switch (first.op) {
+		case AsyncRequest::getValue:
+			ids.erase_all();
+			for (size_t k = i; k < j; ++k)
+				ids.push_back(batch[k].id);
+			vals.resize(num);
+			if (num > 1) {
+				try { getValuesBatch(ids, &vals, ctx); batchOk = true; }
+				catch (const std::exception&) {}
+			}
+			for (size_t k = 0; k < num; ++k) {
+				std::exception_ptr err;
+				if (!batchOk) {
+					try { getValue(ids[k], &vals[k], ctx); }
+					catch (...) { err = std::current_exception(); vals[k].erase_all(); }
+				}
+				callAsyncCallback(batch[i + k].onValue, err, vals[k]);
+			}
+			break;
+		case AsyncRequest::searchExact:
+			keys.erase_all();
+			for (size_t k = i; k < j; ++k)
+				keys.push_back(batch[k].data);
+			if (num > 1) {
+				try {
+					indexSearchExactBatch(first.indexId, keys.data(), num,
+										  &recIds, &offsets, ctx);
+					batchOk = true;
+				}
+				catch (const std::exception&) {}
+			}
+			for (size_t k = 0; k < num; ++k) {
+				std::exception_ptr err;
+				if (batchOk) {
+					one.assign(recIds.data() + offsets[k], offsets[k+1] - offsets[k]);
+				} else {
+					try { indexSearchExact(first.indexId, keys[k], &one, ctx); }
+					catch (...) { err = std::current_exception(); one.erase_all(); }
+				}
+				callAsyncCallback(batch[i + k].onRecIds, err, one);
+			}
+			break;
+		case AsyncRequest::insertRow:
+			for (size_t k = i; k < j; ++k) {
+				std::exception_ptr err;
+				llong recId = -1;
+				try { recId = insertRow(batch[k].data, ctx); }
+				catch (...) { err = std::current_exception(); }
+				callAsyncCallback(batch[k].onRecId, err, recId);
+			}
+			break;
+		}
+		i = j;
+	}
+}
+
+void DbTable::getValueAsync(llong id, ValueCallback cb) {
+	AsyncRequest req;
+	req.op = AsyncRequest::getValue;
+	req.indexId = 0;
+	req.id = id;
+	req.onValue = std::move(cb);
+	postAsync(std::move(req));
+}
+
+void DbTable::indexSearchExactAsync(size_t indexId, fstring key, RecIdsCallback cb) {
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument
+			, "invalid indexId=%zd is not less than indexNum=%zd"
+			, indexId, m_schema->getIndexNum());
+	}
+	AsyncRequest req;
+	req.op = AsyncRequest::searchExact;
+	req.indexId = indexId;
+	req.id = -1;
+	req.data = key.str();
+	req.onRecIds = std::move(cb);
+	postAsync(std::move(req));
+}
+
+void DbTable::insertRowAsync(fstring row, RecIdCallback cb) {
+	checkNotReplica("insertRowAsync");
+	AsyncRequest req;
+	req.op = AsyncRequest::insertRow;
+	req.indexId = 0;
+	req.id = -1;
+	req.data = row.str();
+	req.onRecId = std::move(cb);
+	postAsync(std::move(req));
+}
+
+std::future<valvec<byte> > DbTable::getValueAsync(llong id) {
+	auto promise = std::make_shared<std::promise<valvec<byte> > >();
+	getValueAsync(id, [promise](std::exception_ptr err, valvec<byte>& val) {
+		if (err)
+			promise->set_exception(err);
+		else
+			promise->set_value(std::move(val));
+	});
+	return promise->get_future();
+}
+
+std::future<valvec<llong> > DbTable::indexSearchExactAsync(size_t indexId, fstring key) {
+	auto promise = std::make_shared<std::promise<valvec<llong> > >();
+	indexSearchExactAsync(indexId, key,
+		[promise](std::exception_ptr err, valvec<llong>& recIds) {
+			if (err)
+				promise->set_exception(err);
+			else
+				promise->set_value(std::move(recIds));
+		});
+	return promise->get_future();
+}
+
+std::future<llong> DbTable::insertRowAsync(fstring row) {
+	auto promise = std::make_shared<std::promise<llong> >();
+	insertRowAsync(row, [promise](std::exception_ptr err, llong recId) {
+		if (err)
+			promise->set_exception(err);
+		else
+			promise->set_value(recId);
+	});
+	return promise->get_future();
 }
 
 /*
@@ -3,8 +3,25 @@
 
 #include "db_store.hpp"
 #include "db_index.hpp"
-#include <tbb/queuing_rw_mutex.h>
+#include "merge_policy.hpp"
+#include "value_cache.hpp"
+#include "segment_warmer.hpp"
+#include "segment_scrubber.hpp"
+#include "change_log.hpp"
+#include "rate_limiter.hpp"
+#include "db_env.hpp"
+#include "seg_manifest.hpp"
+#include "index_stats.hpp"
+#include "online_index.hpp"
+#include "db_perf.hpp"
+#include "async_exec.hpp"
+#include "bitmap_index.hpp"
+#include <terark/util/fstrvec.hpp>
+#include "table_rwlock.hpp"
 #include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
 
 #if defined(TBB_VERSION_MAJOR)
 	#if TBB_VERSION_MAJOR * 1000 + TBB_VERSION_MINOR < 4004
@@ -20,10 +37,8 @@ namespace terark {
 
 namespace terark { namespace db {
 
-typedef tbb::queuing_rw_mutex           MyRwMutex;
-//typedef tbb::spin_rw_mutex              MyRwMutex;
-//typedef tbb::speculative_spin_rw_mutex  MyRwMutex;
-
+// type of the table lock is selected by SchemaConfig::m_tableLock
+typedef TableRwMutex             MyRwMutex;
 typedef MyRwMutex::scoped_lock MyRwLock;
 
 template<class IntType>
@@ -40,22 +55,140 @@ class TERARK_DB_DLL ReadonlySegment;
 class TERARK_DB_DLL WritableSegment;
 typedef boost::intrusive_ptr<ReadableSegment> ReadableSegmentPtr;
 typedef boost::intrusive_ptr<WritableSegment> WritableSegmentPtr;
+class TERARK_DB_DLL UniqueKeyFilter;
+typedef boost::intrusive_ptr<UniqueKeyFilter> UniqueKeyFilterPtr;
+
+// An immutable snapshot of DbTable's segment array, it is published by
+// DbTable::publishSegArrayInLock() in the same write-locked section which
+// increments m_segArrayUpdateSeq, so DbContext can sync its copy of the
+// segment array without taking DbTable::m_rwMutex.
+// m_rowNumVec.back() is the end guard when published and is not maintained,
+// use DbTable::m_rowNum for the realtime row number.
+class TERARK_DB_DLL SegArrayVersion : public RefCounter {
+public:
+	valvec<ReadableSegmentPtr> m_segments;
+	valvec<llong>    m_rowNumVec;
+	WritableSegment* m_wrSeg; // only for identity compare
+	size_t           m_segArrayUpdateSeq;
+	~SegArrayVersion();
+};
+typedef boost::intrusive_ptr<SegArrayVersion> SegArrayVersionPtr;
+
+struct FlushQueueStat {
+	size_t threadNum;
+	size_t queuedNum;   // tasks waiting in the queue
+	size_t runningNum;  // tasks being executed
+	size_t tableNum;    // tables which have queued or running tasks
+	ullong finishedNum;
+	// latency of finished tasks, from put to flush queue to done
+	ullong lastLatencyNs;
+	ullong maxLatencyNs;
+	ullong sumLatencyNs;
+};
+
+// sizes are in bytes, deleted rows are not purged yet
+struct TableSegmentStat {
+	size_t readonlySegNum;
+	size_t writableSegNum;       // including frozen writable segments
+	size_t frozenWritableSegNum; // waiting to be converted to readonly
+	llong  writableSegBytes;     // dataStorageSize of writable segments
+	llong  indexBytes;           // sum of totalIndexSize
+	llong  storeBytes;           // sum of dataStorageSize
+	llong  rows;
+	llong  deletedRows;
+};
+
+// memory of a table by component in bytes, see DbTable::getMemoryStat.
+// Stores and indices of writable segments are on the heap, except that
+// the cache of wiredtiger is process wide and is not counted. Readonly
+// segments are mostly mmap'ed, their files are virtual bytes, and resident
+// bytes of them are the pages in the page cache by mincore
+struct TableMemoryStat {
+	llong writableStoreBytes; // pools of trbdb stores
+	llong writableIndexBytes; // trees of trbdb indices
+	llong readonlyStoreBytes; // dataStorageSize
+	llong readonlyIndexBytes; // totalIndexSize, such as DAWG, keyToId, idToKey
+	llong readonlyStoreFileBytes; // mapped files of stores, isDel...
+	llong readonlyIndexFileBytes; // mapped index-* files
+	llong readonlyStoreResident;  // 0 if not requested
+	llong readonlyIndexResident;
+	llong bitmapBytes;  // isDel and isPurged of all segments
+	llong contextBytes; // bufs, cols, arena, SegCtx... of live DbContexts
+	llong contextNum;
+	llong contextIterNum; // iterators cached in SegCtx of DbContexts
+	llong valueCacheBytes;
+	llong uniqKeyFilterBytes;
+
+	/// heap bytes, they are resident unless swapped out
+	llong heapBytes() const {
+		return writableStoreBytes + writableIndexBytes + contextBytes
+			 + valueCacheBytes + uniqKeyFilterBytes;
+	}
+	llong virtualBytes() const {
+		return heapBytes() + readonlyStoreFileBytes + readonlyIndexFileBytes;
+	}
+	llong residentBytes() const {
+		return heapBytes() + readonlyStoreResident + readonlyIndexResident;
+	}
+};
+
+// files of a backup by DbTable::backupTo, sizes are in bytes
+struct TableBackupStat {
+	size_t linkedFiles = 0; // hard linked files of readonly segments
+	llong  linkedBytes = 0;
+	size_t copiedFiles = 0; // isDel, inplace updatable and unlinkable files
+	llong  copiedBytes = 0;
+	size_t writableSegNum = 0; // saved writable segments
+};
 
-// Now BatchWriter is supported only when table has at most one unique index
+// files of a replica dir by DbTable::shipSegmentsTo, sizes are in bytes
+struct SegmentShipStat {
+	size_t copiedSegs = 0;  // new or rebuilt segments written in whole
+	llong  copiedBytes = 0; // sent from the writer
+	llong  linkedBytes = 0; // hard linked from older segments of the replica
+	size_t patchedFiles = 0; // isDel and inplace updatable files of segments
+	llong  patchedBytes = 0; // which were shipped before, changed blocks only
+	size_t keptSegs = 0;
+	size_t removedSegs = 0;
+};
+
+// Per table quotas, DataBase sets them from TableQuota of its dbconf.json
+struct TableQuota {
+	llong  writeBytesPerSecond = 0; // 0 is none, the smaller of it and
+									// WriteThrottleBytesPerSecond is used
+	llong  writableBytes = 0; // slowdown at it, stop at 125% of it, 0 is none
+	double compressWeight = 1.0; // share of compression time of the table
+};
+
+enum class CompressTaskClass : unsigned {
+	idle,
+	convert, // convert frozen writable segments to readonly segments
+	merge,   // merge small segments
+	purge,   // purge deleted records of readonly segments
+};
+
+// Rows and removals are staged by upsertRow/removeRow and applied on
+// commit(). The first unique index is the upsert key, a staged row replaces
+// the existing row with same key, and the last one wins in the batch. All
+// unique indices of the whole batch are checked by batched index probes
+// before any change, commit() fails without changes on dup keys.
+// Rows are applied one by one on commit, it is not atomic to readers.
 class TERARK_DB_DLL BatchWriter {
 	DECLARE_NONE_COPYABLE_CLASS(BatchWriter);
 protected:
 	DbContextPtr     m_ctx;
-	WritableSegment* m_wrSeg; // for debug only
-	DbTransaction*   m_txn; // for debug only
-	llong overwriteExisting(fstring row);
-	llong upsertRowImpl(fstring row);
+	fstrvecl         m_rows;
+	valvec<llong>    m_removeIds;
+	std::string      m_errMsg;
+	bool checkUniqueIndices(const valvec<size_t>& rows,
+							const valvec<fstrvecl>& keys, valvec<llong>* replaced);
 public:
 	explicit BatchWriter(DbTable* tab, DbContext* ctx = NULL);
 	~BatchWriter();
 	DbContext* getCtx() const { return m_ctx.get(); }
 	const std::string& strError() const;
 	const char* szError() const;
+	///@returns sequence of the row in this batch, recId is known on commit
 	llong upsertRow(fstring row);
 	void  removeRow(llong recId);
 	bool  commit();
@@ -68,17 +201,51 @@ class TERARK_DB_DLL DbTable : public ReadableStore {
 	class MyStoreIterBase;	    friend class MyStoreIterBase;
 	class MyStoreIterForward;	friend class MyStoreIterForward;
 	class MyStoreIterBackward;	friend class MyStoreIterBackward;
+	class MyColumnRangeIter;	friend class MyColumnRangeIter;
+	class MyPartitionIter;	    friend class MyPartitionIter;
 public:
 	DbTable();
 	~DbTable();
 
-	static DbTable* open(PathRef dbPath);
+	/// env is the I/O env of the table, NULL is DbEnv::getDefault()
+	static DbTable* open(PathRef dbPath, DbEnv* env = NULL);
+	/// open dbPath read only in another process than the writer opened it
+	/// by open, readonly segments in the manifest of the writer are mmap'ed
+	/// shared, deletes of the writer are seen through the shared IsDel.
+	/// Rows in writable segments of the writer are not visible until they
+	/// are converted, record ids are of the replica, not of the writer.
+	/// Writes and compactions throw
+	static DbTable* openReplica(PathRef dbPath, DbEnv* env = NULL);
+	/// follow segments of the writer, unchanged segments are kept, all are
+	/// reloaded after the writer reopened and compacted the id space
+	///@returns true if the segment array is changed
+	bool refreshReplica();
+	bool isReplica() const { return m_isReplica; }
+	/// ship readonly segments to dir, which is opened by openReplica on
+	/// another node, that is by a network file system or by copying dir.
+	/// New segments are copied, immutable files of older segments of dir
+	/// are reused, segments shipped before are patched by changed blocks
+	/// of IsDel and inplace updatable colgroups, and the manifest of dir is
+	/// written last. Rows of writable segments are shipped after they are
+	/// converted, so call it periodically, compaction is suspended during it
+	void shipSegmentsTo(PathRef dir, SegmentShipStat* stat = NULL);
 
 	void load(PathRef dir) override;
 	void save(PathRef dir) const override;
 
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
+	/// forward iterator of rows whose integer column is in [lo, hi],
+	/// segments and blocks are skipped by zone maps
+	StoreIterator* createTableIterColumnRange(size_t columnId,
+							llong lo, llong hi, DbContext*) const;
+	/// at most numPartitions forward iterators over disjoint ranges of whole
+	/// segments of similar row numbers, in recId order. Each iterator has
+	/// its own DbContext with the snapshot of ctx, so they can be used by
+	/// different threads. Segments are of the creation time, rows appended
+	/// to the last writable segment are seen by the last iterator
+	void createParallelStoreIter(size_t numPartitions,
+							valvec<StoreIteratorPtr>* iters, DbContext*) const;
 	DbContext* createDbContext() const;
 	virtual DbContext* createDbContextNoLock() const;
 
@@ -91,6 +258,29 @@ public:
 	llong dataInflateSize() const override;
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
 
+	///@{ zero-copy read: returns the value in store memory if the segment
+	/// supports it, else the value is copied to buf and buf is returned.
+	/// the result is valid until the next read by ctx or buf is changed
+	fstring getValueRef(llong id, valvec<byte>* buf, DbContext*) const;
+	fstring selectOneColgroupRef(llong id, size_t cgId,
+								 valvec<byte>* buf, DbContext*) const;
+	///@}
+
+	///@{ batch point lookup, ids may be unsorted, vals[i] is for ids[i]
+	/// ids are grouped by segment, each segment is called once per batch
+	void getValuesBatch(const llong* ids, size_t num,
+						valvec<byte>* vals, DbContext*) const;
+	void getValuesBatch(const valvec<llong>& ids,
+						valvec<valvec<byte> >* vals, DbContext*) const;
+	void selectColumnsBatch(const llong* ids, size_t num,
+							const size_t* colsId, size_t colsNum,
+							valvec<byte>* colsDataVec, DbContext*) const;
+	void selectColumnsBatch(const valvec<llong>& ids, const valvec<size_t>& cols,
+							valvec<valvec<byte> >* colsDataVec, DbContext*) const;
+	void selectOneColgroupBatch(const llong* ids, size_t num, size_t cgId,
+								valvec<byte>* cgDataVec, DbContext*) const;
+	///@}
+
 	bool exists(llong id) const;
 
 	llong insertRow(fstring row, DbContext*);
@@ -98,6 +288,42 @@ public:
 	llong updateRow(llong id, fstring row, DbContext*);
 	bool  removeRow(llong id, DbContext*);
 
+	/// delete all records of frozen segments which are entirely before
+	/// recIdEnd by setting whole delmark bitmaps, without per record index
+	/// removal, then the segments are purged as a whole. For oplog/capped
+	/// truncation, where the oldest records are always deleted first.
+	///@returns number of records deleted
+	llong dropSegmentsBefore(llong recIdEnd);
+
+	/// remove readonly segments whose rows are all in time partitions older
+	/// than ts(TimePartitionColumn of the schema) from the table, by one
+	/// commit as a merge, their dirs are unlinked as a whole. Record ids of
+	/// later segments are shifted down by the removed rows. It waits for a
+	/// running merge, frozen writable segments are dropped after they are
+	/// converted. @returns number of removed segments
+	size_t dropPartitionsOlderThan(llong ts);
+
+	/// expire rows by TtlColumn and TtlSeconds of the schema, whole frozen
+	/// segments whose max ttl value is expired by zone map are deleted as
+	/// dropSegmentsBefore, expired rows of other frozen segments are marked
+	/// deleted by scanning the ttl column, they are dropped by purges and
+	/// merges. Writable segments are expired after they are frozen. It is
+	/// called by background compaction at most once per env
+	/// TerarkDB_TtlCheckSeconds(default 60), @returns expired rows
+	size_t expireRows();
+
+	/// counts of updateRow calls which change each column of the row schema,
+	/// tracked if HotColumnUpdateRatio of the schema is not 0, @returns the
+	/// number of updateRow calls
+	ullong getColumnUpdateCounts(valvec<ullong>* counts) const;
+	/// fixed width columns which are promotable to inplace updatable
+	/// colgroups and are changed by at least HotColumnUpdateRatio of updates
+	valvec<size_t> getHotColumns() const;
+	/// write HotColumns.json in table dir, it is called after each merge,
+	/// hot columns are promoted on the next load if no writable segment has
+	/// rows, because rows of writable segments are of the old layout
+	void saveHotColumns() const;
+
 	void upsertRowMultiUniqueIndices(fstring row, valvec<llong>* resRecIdvec, DbContext*);
 
 	void updateColumn(llong recordId, size_t columnId, fstring newColumnData, DbContext* = NULL);
@@ -114,6 +340,17 @@ public:
 	void incrementColumnValue(llong recordId, size_t columnId, double incVal, DbContext* = NULL);
 	void incrementColumnValue(llong recordId, fstring colname, double incVal, DbContext* = NULL);
 
+	///@{ set a column of many rows, values[i] is of recIds[i]. Ids are
+	/// grouped by segment, columns of inplace updatable colgroups are
+	/// written in place by one table lock, and by one segment lock of each
+	/// group of at most 1024 rows. Other columns are set by updateRow of
+	/// the rewritten rows. Deleted ids are skipped, a duplicate id takes
+	/// the last value. @returns number of updated rows
+	size_t updateColumnBatch(size_t columnId, const llong* recIds, const fstring* values, size_t num, DbContext* = NULL);
+	/// values are converted to the integer or float type of the column
+	size_t updateColumnIntegerBatch(size_t columnId, const llong* recIds, const llong* values, size_t num, DbContext* = NULL);
+	///@}
+
 	void setThrowOnThrottle(bool val) { m_throwOnThrottle = val; }
 	bool isThrowOnThrottle() const { return m_throwOnThrottle; }
 
@@ -155,6 +392,87 @@ public:
 	bool indexKeyExists(size_t indexId, fstring key, DbContext*) const;
 
 	void indexSearchExactNoLock(size_t indexId, fstring key, valvec<llong>* recIdvec, DbContext*) const;
+
+	///@{ recIds of keys[k] are recIdvec[offsets[k], offsets[k+1]),
+	/// offsets->size() is num+1, sorted keys are faster
+	void indexSearchExactBatch(size_t indexId, const fstring* keys, size_t num,
+							   valvec<llong>* recIdvec, valvec<size_t>* offsets,
+							   DbContext*) const;
+	void indexSearchExactBatchNoLock(size_t indexId, const fstring* keys, size_t num,
+							   valvec<llong>* recIdvec, valvec<size_t>* offsets,
+							   DbContext*) const;
+	///@}
+
+	/// point lookups of keys: recIds[k] is the newest recId of keys[k] or -1,
+	/// vals[k] is its value, empty if not found. Keys are looked up in groups
+	/// of env TerarkDB_LookupGroup(default 32) keys, the dawg walks of a group
+	/// then the store reads of the group are batched, so the cache misses and
+	/// page faults of the lookups of a group are overlapped. @returns found
+	size_t getValuesByKeyBatch(size_t indexId, const fstring* keys, size_t num,
+							   llong* recIds, valvec<byte>* vals, DbContext*) const;
+
+	///@{ SchemaConfig::m_asyncIndex, the table must be owned by a DbTablePtr.
+	/// Inserts update unique indices, non-unique indices of the rows are
+	/// updated later from the store, searches read them stale unless
+	/// DbContext::waitAsyncIndex. The writable segment is caught up before
+	/// it is frozen
+
+	/// rows of the writable segment whose non-unique indices are not updated
+	llong asyncIndexLag() const;
+	/// wait until rows inserted before the call are indexed
+	void waitAsyncIndex() const;
+	///@}
+
+	///@{ non-unique index keys of rows inserted by ctx after beginIndexBatch
+	/// are staged in ctx, flushIndexBatch inserts them by one insertBatch of
+	/// each index. Searches miss the staged rows until the flush, see
+	/// IndexBatchScope. Ignored if SchemaConfig::m_asyncIndex
+	void beginIndexBatch(DbContext*);
+	void flushIndexBatch(DbContext*);
+	///@}
+
+	/// recIds matching ((terms[0]) terms[1].op terms[1]) terms[2].op ...
+	/// in ascending order. A term on a BitmapIndex of a readonly segment is
+	/// combined by words of its bitmap, other terms by indexSearchExact
+	void bitmapFilter(const BitmapTerm* terms, size_t num,
+					  valvec<llong>* recIds, DbContext*) const;
+
+	///@{ async API for event loop threads, the table must be owned by a
+	/// DbTablePtr. Ops are run on AsyncExecutor by contexts of the table, so
+	/// snapshots of contexts of the caller are not applied. Callbacks are
+	/// called on worker threads, err is null on success. Reads queued under
+	/// load are coalesced into getValuesBatch and indexSearchExactBatch
+	typedef std::function<void(std::exception_ptr err, valvec<byte>& val)> ValueCallback;
+	typedef std::function<void(std::exception_ptr err, valvec<llong>& recIds)> RecIdsCallback;
+	typedef std::function<void(std::exception_ptr err, llong recId)> RecIdCallback;
+	void getValueAsync(llong id, ValueCallback);
+	void indexSearchExactAsync(size_t indexId, fstring key, RecIdsCallback);
+	void insertRowAsync(fstring row, RecIdCallback);
+	std::future<valvec<byte> > getValueAsync(llong id);
+	std::future<valvec<llong> > indexSearchExactAsync(size_t indexId, fstring key);
+	std::future<llong> insertRowAsync(fstring row);
+	///@}
+
+	///@{ non-deleted records whose key of ordered index is in [lo, hi),
+	/// empty lo or hi is unbounded, onRecord returns false to stop,
+	/// segments are scanned in order, recIds are in key order of a segment
+	llong indexCountRange(size_t indexId, fstring lo, fstring hi, DbContext*) const;
+	llong indexScanRange(size_t indexId, fstring lo, fstring hi,
+						 const std::function<bool(llong recId)>& onRecord,
+						 DbContext*) const;
+	///@}
+	/// first k non-deleted records whose key of ordered index starts with
+	/// prefix, top k of each segment are merged in key order, records of the
+	/// same key are in recId order, keys is optional and parallel with recIdvec
+	///@returns recIdvec->size()
+	size_t indexSearchPrefix(size_t indexId, fstring prefix, size_t k,
+							 valvec<llong>* recIdvec, fstrvecl* keys,
+							 DbContext*) const;
+	/// approximate data bytes of records whose key is in [lo, hi), by rank
+	/// of lo and hi in index of each segment times average row size, data
+	/// is not read, deleted records are discounted by the segment's ratio
+	llong indexApproximateRangeSize(size_t indexId, fstring lo, fstring hi,
+									DbContext*) const;
 	bool indexKeyExistsNoLock(size_t indexId, fstring key, DbContext*) const;
 
 	bool indexMatchRegex(size_t indexId, RegexForIndex*, valvec<llong>* recIdvec, DbContext*) const;
@@ -180,6 +498,15 @@ public:
 	void selectOneColumn(llong id, size_t columnId,
 						 valvec<byte>* colsData, DbContext*) const;
 
+	///@{ covering index reads, the columns are in the key of the index,
+	/// so they are projected from the key returned by an index iterator,
+	/// the row store is not read. colsData is same as selectColumns
+	bool indexCoversColumns(size_t indexId, const size_t* colsId, size_t colsNum) const;
+	void selectColumnsFromIndexKey(size_t indexId, fstring key,
+					   const size_t* colsId, size_t colsNum,
+					   valvec<byte>* colsData, DbContext*) const;
+	///@}
+
 	void selectColgroups(llong id, const valvec<size_t>& cgIdvec,
 						 valvec<valvec<byte> >* cgDataVec, DbContext*) const;
 	void selectColgroups(llong id, const size_t* cgIdvec, size_t cgIdvecSize,
@@ -202,6 +529,8 @@ protected:
 
 	void selectOneColgroupNoLock(llong id, size_t cgId, valvec<byte>* cgData, DbContext*) const;
 
+	void groupIdsBySegmentNoLock(const llong* ids, size_t num, DbContext*) const;
+
 #if 0
 	StoreIteratorPtr
 	createProjectIterForward(const valvec<size_t>& cols, DbContext*)
@@ -222,11 +551,113 @@ public:
 	void clear();
 	void flush();
 	void compact();
+	/// compact segments which have keys of ordered index in [lo, hi), empty
+	/// lo or hi is unbounded, overlapped segments are adjacent ones from the
+	/// first to the last overlapped, the writing segment is frozen if needed
+	void compactRange(size_t indexId, fstring lo, fstring hi);
 	void syncFinishWriting();
+
+	///@{ bulk load: readonly segments are built directly from rows, without
+	/// writable segments and compression. buildBulkSegment is thread safe,
+	/// it builds a segment in a staging dir and returns the dir, rows are of
+	/// the row schema and their unique keys must not be duplicated.
+	/// attachBulkSegments appends the staged segments in order to the table
+	/// in one SegArrayVersion, the writable segment must be empty and there
+	/// should be no concurrent writers
+	std::string buildBulkSegment(const fstrvecl& rows);
+	void attachBulkSegments(const std::vector<std::string>& stagingDirs);
+	///@}
+
+	///@{ pause/resume background compress tasks of this table, calls can be
+	/// nested, suspendCompaction returns after the running task finished,
+	/// tasks triggered when suspended run on resume, flush is not paused,
+	/// explicit compact() and compactRange() are not paused
+	void suspendCompaction();
+	void resumeCompaction();
+	bool isCompactionSuspended() const;
+	///@}
+
+	///@{ cooperative cancellation of background builds, builds check it
+	/// between index/colgroup builds and while scanning rows, cancelled
+	/// builds remove their temp dirs and keep input segments unchanged, so
+	/// the task is triggered again after resume or restart. A build is
+	/// cancelled when compress threads are stopping, the table is dropped,
+	/// or compaction is suspended if cancelOnSuspend(not explicit compact)
+	bool isBgTaskCancelled(bool cancelOnSuspend) const;
+	void checkBgTaskCancelled(bool cancelOnSuspend) const;
+	///@}
 	void asyncPurgeDelete();
 
 	void dropTable();
 
+	/// online backup to dir, which must be empty or not existed, it can be
+	/// opened by DbTable::open. The writable segment is frozen and isDel of
+	/// all segments are copied in one table lock, files of readonly segments
+	/// are hard linked, writable segments are saved, compaction is suspended
+	/// during the backup. Inplace updatable colgroups are copied, they may
+	/// see updates during the copy
+	void backupTo(PathRef dir, TableBackupStat* stat = NULL);
+
+	/// tiered storage by ColdSegmentPath, stores of readonly segments which
+	/// are older than ColdSegmentAgeSeconds, or read less than
+	/// ColdSegmentMaxReadsPerSec, are moved to ColdSegmentPath/<table name>
+	/// and replaced by symlinks, the segment dir is kept as a stub. Indices,
+	/// isDel, purge bits, filters and inplace updatable colgroups stay.
+	/// It is called by background compaction, returns moved segments
+	size_t moveColdSegments();
+
+	/// save read heat(ReadonlySegment::saveReadHeat) of readonly segments,
+	/// it is called on close, and by background compaction if onlyIfDue and
+	/// TerarkDB_ReadHeatSaveSeconds(default 600) passed since the last save
+	void saveReadHeat(bool onlyIfDue = false);
+
+	/// checksums of loaded segments are not verified by open, if
+	/// VerifySegmentsOnLoad is true, this is called by a background task
+	/// after load, it reads all records of colgroups of checksumLevel >= 2,
+	/// corrupt segments are logged, @returns number of corrupt segments
+	size_t verifySegments();
+	size_t getCorruptSegmentNum() const { return m_corruptSegNum; }
+
+	/// stat of the SegmentScrubber of ScrubIntervalSeconds, all 0 if it is
+	/// disabled, corrupt segments are counted by getCorruptSegmentNum
+	SegmentScrubStat getScrubStat() const;
+	/// the segment is excluded from merges, purges and moveColdSegments, it
+	/// is kept readable and is marked by a QUARANTINED file with the reason,
+	/// so it is still excluded after reopen, until it is restored(such as
+	/// by the segment of a replica, see shipSegmentsTo) and the file is
+	/// removed. @returns false if segDir is not a segment or is quarantined
+	bool quarantineSegment(const std::string& segDir, const std::string& reason);
+
+	/// files of the table are opened, mapped and written by this env in
+	/// loads, flushes and compactions, it counts I/O over the env of open
+	DbEnv* getEnv() const { return m_env.get(); }
+	DbIoStat getIoStat() const { return m_env->getStat(); }
+	/// NumaNode of the schema if it is online on this host, else -1,
+	/// background threads run tasks of the table in NumaNodeScope of it
+	int getNumaNode() const { return m_numaNode; }
+	/// env of conv, purge and merge, the env of the table limited by
+	/// CompactWriteBytesPerSecond, it is getEnv() if unlimited
+	DbEnv* getCompactEnv() const;
+	/// microseconds slept by compaction writes for the rate limit
+	ullong getCompactThrottleMicros() const;
+	/// current rate of compaction writes, 0 is unlimited
+	size_t getCompactWriteRate() const;
+	/// the writable segment is frozen at this size, it is tuned on each
+	/// freeze if AutoTuneWrSegSize, else it is MaxWritingSegmentSize
+	llong getWrSegFreezeSize() const;
+
+	///@{ recent inserts, updates and removes in a ChangeLog, it is off by
+	/// default, enableChangeLog should be called before writing
+	void enableChangeLog(size_t maxRecords, size_t maxBytes);
+	ChangeLog* getChangeLog() const { return m_changeLog.get(); }
+
+	/// change data capture: a cursor reads changes from fromSeq, resume
+	/// from ChangeCursor::position() if ChangeCursor::epoch() is not changed,
+	/// writers wait for a backpressure cursor at most the env
+	/// TerarkDB_ChangeLogMaxBlockMillisec(default 1000) when the log is full
+	ChangeCursorPtr subscribeChanges(ullong fromSeq, bool backpressure = false);
+	///@}
+
 	PathRef getDir() const { return m_dir; }
 
 	std::string toJsonStr(fstring row) const;
@@ -242,12 +673,26 @@ public:
 	size_t getSegmentIndexOfRecordIdNoLock(llong recId) const;
 
 	///@{ internal use only
-    bool autoConvMergePurge(bool forcePurgeAndMerge);
+	void publishSegArrayInLock();
+	void updateWriteStallInLock();
+    bool autoConvMergePurge(bool forcePurgeAndMerge,
+                            size_t segBeg = 0, size_t segEnd = size_t(-1));
+    bool beginAutoTask(); // false if compaction is suspended
+    void endAutoTask();
+    void deferCancelledAutoTask();
 	void freezeFlushWritableSegment(size_t segIdx);
 	void putToFlushQueue(size_t segIdx);
 	void putToCompressionQueue(size_t segIdx);
     void putAutoTask();
     bool isAutoTask() const;
+	void updateUniqueKeyFilter();
+	void putUniqueKeyFilterTask();
+	void putColdSegmentTask();
+	void putExpireTask();
+	void putVerifySegmentTask();
+	void startScrubber();
+	void loadReadonlySegments(const valvec<size_t>& segIdxVec);
+	void doPurgeCheck(); // by PurgeCheckTask
 	///@}
 
 	///@{
@@ -256,40 +701,201 @@ public:
 	void putToFreeList(llong id);
 	///@}
 
+	///@{ same as above for many ids, ids must be sorted, the table lock
+	/// is taken once and the lock of a segment is taken once for its ids
+	void delmarkSet0Batch(const llong* ids, size_t num);
+	void delmarkSet1Batch(const llong* ids, size_t num);
+	void putToFreeListBatch(const llong* ids, size_t num);
+	///@}
+
 	static void safeStopAndWaitForFlush();
+	/// waits for running and queued compress tasks, if they are not finished
+	/// in env TerarkDB_StopCompressTimeoutSec(default -1 is no limit), the
+	/// queued tasks are dropped and the running tasks are cancelled
 	static void safeStopAndWaitForCompress();
+	static void getFlushQueueStat(FlushQueueStat*);
+	/// tasks of all tables waiting in the compress queue
+	static size_t getCompressQueueSize();
+
+	/// rename dir into trashDir which is created if not existed, then dir
+	/// is removed by a background thread throttled by env
+	/// TerarkDB_TrashDeleteBytesPerSec, returns false if rename failed
+	static bool removeDirInBackground(PathRef dir, PathRef trashDir);
+	/// remove entries of trashDir left by a crashed or stopped process
+	static void removeTrashInBackground(PathRef trashDir);
+	/// queued or running flush and compress tasks of this table
+	size_t getBackgroundTaskNum() const { return m_bgTaskNum; }
+	/// it does not take m_rwMutex
+	void getSegmentStat(TableSegmentStat*) const;
+	/// file and page cache resident bytes of each readonly segment, and
+	/// warmed bytes if SegmentLoadPolicy is background
+	void getSegmentLoadStat(std::vector<SegmentLoadStat>*) const;
+	/// memory by component, files of readonly segments are mapped and
+	/// mincore'd if withResident, which takes time for large tables
+	void getMemoryStat(TableMemoryStat*, bool withResident) const;
+
+	///@{ statistics for query planning, they do not take m_rwMutex.
+	/// stats of readonly segments are built by conversion, purge and merge,
+	/// they are merged by this call, rows of other segments are added as
+	/// having the key distribution of readonly segments
+	IndexStats getIndexStats(size_t indexId) const;
+	/// average inflated bytes of a row of the colgroup
+	double getColgroupAvgRowSize(size_t cgId) const;
+	///@}
+
+	///@{ an online index is added to an existing table without changing
+	/// its schema and segments, see OnlineIndex. addOnlineIndex saves the
+	/// definition in OnlineIndex.json of the table, then the index of each
+	/// readonly segment is built in background, segments are built in
+	/// parallel by env TerarkDB_OnlineIndexThreads(default 4). Searches are
+	/// exact at any time, segments which are not built yet and writable
+	/// segments are scanned. It is ready when all readonly segments are
+	/// built, new readonly segments by compaction are built after publish
+	void addOnlineIndex(fstring name, const std::vector<std::string>& columns,
+						bool ordered = true);
+	bool isOnlineIndexReady(fstring name) const;
+	/// recIds of non-deleted records whose key is key, newer segments first
+	void onlineIndexSearchExact(fstring name, fstring key,
+								valvec<llong>* recIdvec, DbContext*) const;
+	/// build online indices of readonly segments which are not built yet,
+	/// it is called by background compaction, @returns built indices
+	size_t buildOnlineIndices();
+	void putOnlineIndexTask();
+	///@}
+
+	/// pin the current SegArrayVersion, its segments are alive while it is
+	/// held, but compaction may replace them in the table
+	SegArrayVersionPtr getSegArrayVersion() const;
+
+	/// writers was throttled by throttleWrite() in recent one second
+	bool isWriteThrottled() const;
+
+	enum class WriteStall : unsigned char { none, slowdown, stop };
+	/// state of backlog triggers WriteSlowdown* and WriteStop* of
+	/// SchemaConfig, it does not take m_rwMutex
+	WriteStall getWriteStall() const;
+
+	/// priority of background compression of this table, larger is more
+	/// urgent, it does not take m_rwMutex
+	double getCompressPriority(CompressTaskClass*) const;
+
+	///@{ quotas are thread safe, the shared limiter should be set before
+	/// writing, it is not owned by the table alone
+	void setQuota(const TableQuota&);
+	TableQuota getQuota() const;
+	void setSharedWriteLimiter(WriteRateLimiter*);
+	///@}
+
+	/// compression threads time used by this table divided by its
+	/// compressWeight, tasks of the same class are picked by the smallest
+	double getCompressVirtualTime() const;
+	void addCompressTime(ullong nanoseconds); // by compression threads
+
+	/// work memory in use of all background compressions in the process
+	static size_t getCompressingWorkMemInUse();
+
+	/// bytes of rows written by users since the table is opened
+	ullong getIngestedBytes() const { return m_accumulateWrittenBytes; }
+	/// bytes of segments written by conv, purge and merge since opened
+	ullong getCompactionWrittenBytes() const { return m_compactWrittenBytes; }
+	/// (ingested + compaction written) / ingested, 0 if nothing ingested
+	double getWriteAmplification() const;
+
+	/// cache of decompressed readonly segment values, NULL if disabled,
+	/// hits() and misses() of it are the counters of this table
+	ValueCache* getValueCache() const { return m_valueCache.get(); }
+
+	///@{ latency histograms of operations since opened or reset,
+	/// NULL and empty if EnablePerfCounters is false
+	DbPerfCounters* getPerfCounters() const { return m_perf.get(); }
+	void getPerfSnapshot(DbPerfSnapshot*) const;
+	std::string getPerfJsonStr() const;
+	void resetPerfCounters();
+	///@}
+
+	///@{ a snapshot is a version: the sequence number of acquireSnapshot,
+	/// any DbContext reads by it with DbContext::setSnapshot, rows inserted
+	/// after it are beyond getSnapshotMaxRecId(version).
+	/// Versions are acquired in ascending order, so acquire is O(1).
+	/// Deletions are snapshot-aware only if EnableSnapshot is true, then
+	/// acquireSnapshot freezes the writable segment, rows of frozen segments
+	/// deleted while snapshots are alive are stamped by the latest version,
+	/// convert, purge and merge keep the rows whose stamp is no older than
+	/// the oldest alive snapshot, see ReadableSegment::m_delVersions.
+	llong acquireSnapshot();
+	void  releaseSnapshot(llong version);
+	llong getSnapshotMaxRecId(llong version) const;
+	/// LLONG_MAX if no snapshot is alive
+	llong getOldestSnapshotVersion() const { return m_oldestSnapshotVersion; }
+	///@}
 
 protected:
 	static void registerTableClass(fstring tableClass, std::function<DbTable*()> tableFactory);
 
 	void doLoad(PathRef dir);
+	void doLoadReplica(PathRef dir);
+	bool refreshReplicaOnce();
+	void postAsync(AsyncRequest&&);
+	void drainAsync();
+	void runAsyncBatch(std::vector<AsyncRequest>& batch, DbContext*);
+	void checkNotReplica(const char* func) const;
+	void loadOnlineIndices();
+	void loadHotColumnCounts();
+	void countColumnUpdates(const ColumnVec& newCols, const ColumnVec& oldCols);
+	size_t updateColumnBatchByRows(size_t columnId, const llong* recIds, const fstring* values, size_t num, DbContext*);
+	void cancelBookUpdates(ReadableSegment*); // rollback of a cancelled build
+	void saveOnlineIndicesInLock() const;
+	OnlineIndexPtr findOnlineIndex(fstring name) const;
 
 	class MergeParam; friend class MergeParam;
 	void merge(MergeParam&);
 	void checkRowNumVecNoLock() const;
 
-	bool maybeCreateNewSegment(MyRwLock&);
+	bool maybeCreateNewSegment(MyRwLock&, llong timePartition = LLONG_MIN);
+	bool tryFreezeWrSegInLock(MyRwLock&);
 	void maybeCreateNewSegmentInWriteLock();
 	void doCreateNewSegmentInLock();
+	void tuneWrSegSizeInLock(const WritableSegment* frozen);
 	llong insertRowImpl(fstring row, ColumnVec *cols, DbContext*, MyRwLock&);
 	llong insertRowDoInsert(fstring row, ColumnVec *cols, DbContext*);
 	llong insertRowDoInsertNoCommit(llong subId, fstring row, ColumnVec *cols, DbContext*);
 	bool insertSyncIndex(llong subId, ColumnVec *cols, DbTransaction*, DbContext*);
 	bool updateCheckSegDup(size_t begSeg, size_t numSeg, ColumnVec *cols, DbContext*);
+	static bool uniqKeyFilterMiss(const UniqueKeyFilter*, size_t uniqIdx, fstring key);
 	bool updateWithSyncIndex(llong newSubId, fstring row, ColumnVec *cols1, DbContext*);
 	void updateSyncMultIndex(llong newSubId, ColumnVec *cols1, ColumnVec *cols2, DbTransaction*, DbContext*);
+	void asyncIndexMark(llong subId);
+	void asyncIndexPost(llong subId);
+	bool asyncIndexClaim(llong subId);
+	void asyncIndexRun();
+	void asyncIndexOneRow(llong subId, DbContext*);
+	void asyncIndexDrainInLock();
+	void stageIndexBatchNoLock(llong subId, const ColumnVec& cols, DbContext*);
+	void flushIndexBatchNoLock(DbContext*);
 
 	llong doUpsertRow(fstring row, DbContext*);
 
 	llong allocInvisibleWrSubId_NoTabLock();
+	llong allocInvisibleWrSubId_NoTabLock(DbContext*);
 	void freeInvisibleWrSubId_NoTabLock(llong wrSubId);
 
+	///@{ time partitions, cols is NULL if it is not parsed from row
+	llong rowTimePartition(fstring row, const ColumnVec* cols, DbContext*) const;
+	void raiseWrSegTimePartition(fstring row, const ColumnVec* cols, DbContext*);
+	void saveTimePartition(const ReadableSegment*) const;
+	void loadTimePartition(ReadableSegment*) const;
+	///@}
+
 	boost::filesystem::path getMergePath(PathRef dir, size_t mergeSeq) const;
 	boost::filesystem::path getSegPath(const char* type, size_t segIdx) const;
 	static
 	boost::filesystem::path getSegPath2(PathRef dir, size_t mergeSeq, const char* type, size_t segIdx);
 	void removeStaleDir(PathRef dir, size_t inUseMergeSeq) const;
 	void discoverMergeDir(PathRef dir);
+	bool recoverByManifest(std::vector<std::string>* segDirNames);
+	void resetManifestInLock(const std::set<size_t>& oldMergeSeqs);
+	void logManifestEdit(const std::string& edit);
+	void disableManifest(const char* reason);
 
 	ReadonlySegment* myCreateReadonlySegment(PathRef segDir) const;
 	WritableSegment* myCreateWritableSegment(PathRef segDir) const;
@@ -297,17 +903,34 @@ protected:
 
 	bool checkPurgeDeleteNoLock(const ReadableSegment* seg);
 	bool tryAsyncPurgeDeleteInLock(const ReadableSegment* seg);
+	void requestPurgeCheck();
+	bool needStampDeletionNoLock(const ReadableSegment* seg) const;
+	void stampDeletionNoLock(class ReadableSegment* seg, size_t subId) const;
 	void inLockPutPurgeDeleteTaskToQueue();
+	bool isColdSegment(const ReadonlySegment*, time_t now,
+					   std::vector<std::string>* files) const;
+	bool moveColdSegment(ReadonlySegment*, const std::vector<std::string>& files,
+						 PathRef coldDir);
+	void removeUnusedColdFiles(PathRef coldDir);
 
 //	void registerDbContext(DbContext* ctx) const;
 //	void unregisterDbContext(DbContext* ctx) const;
 
 	size_t throttleWrite();
+	bool waitWriteStallChange(size_t stallSeq, size_t timeoutMicrosec);
 
 public:
 	mutable MyRwMutex m_rwMutex;
 	mutable size_t m_tableScanningRefCount;
 	mutable std::atomic_size_t m_inprogressWritingCount;
+
+	// epoch based reclamation of m_segArrayVersion:
+	// readers register in m_segArrayReaders[epoch & 1], the writer flips
+	// the epoch after publishing a new version and waits for readers of the
+	// old epoch to leave before releasing the old version
+	mutable std::atomic<size_t> m_segArrayEpoch;
+	mutable std::atomic<size_t> m_segArrayReaders[2];
+	std::atomic<SegArrayVersion*> m_segArrayVersion;
 protected:
 	enum class TaskStatus : unsigned {
         error,
@@ -322,27 +945,152 @@ protected:
 	size_t m_mergeSeqNum;
 	size_t m_newWrSegNum;
 	size_t m_bgTaskNum;
+	size_t m_compactSuspendCnt;
+	std::atomic_size_t m_runningAutoTaskNum;
 	size_t m_segArrayUpdateSeq;
+	size_t m_wrSubIdReserveGen; // invalidate DbContext::m_reservedWrSubIds
+	std::atomic_size_t m_bulkSegSeqNum; // names bulk segment staging dirs
 	llong  m_rowNum;
 	llong  m_oldestSnapshotVersion;
+	llong  m_snapshotSeq; // version of the latest acquireSnapshot
+	mutable std::mutex m_snapshotMutex;
+	valvec<std::pair<llong, llong> > m_liveSnapshots; // (version, maxRecId)
 	std::atomic<ullong> m_lastWriteThrottleTimePoint;
 	std::atomic<ullong> m_lastWriteThrottleBytes;
 	std::atomic<ullong> m_accumulateWrittenBytes;
+	std::atomic<ullong> m_compactWrittenBytes;
+	std::atomic<ullong> m_lastThrottledTime;
+	std::atomic<ullong> m_quotaWriteBytesPerSec;
+	std::atomic<ullong> m_quotaWritableBytes;
+	std::atomic<double> m_compressWeight;
+	std::atomic<ullong> m_compressNanos;
+	std::atomic<ullong> m_sharedLimiterBytes; // bytes consumed from it
+	WriteRateLimiterPtr m_sharedWriteLimiter; // NULL if not in a DataBase
+	// backlog of write stall triggers, updated by publishSegArrayInLock,
+	// writable bytes is estimated by bytes written since the publish
+	std::atomic_size_t  m_frozenWrSegNum;
+	std::atomic<llong>  m_writableSegBytes;
+	// sums of DbContext::reportMemSize of live contexts
+	std::atomic<llong>  m_ctxNum;
+	std::atomic<llong>  m_ctxMemBytes;
+	std::atomic<llong>  m_ctxIterNum;
+	// observations of tuneWrSegSizeInLock, rates are moving averages of
+	// bytes per second, 0 is not observed yet
+	std::atomic<llong>  m_wrSegFreezeSize;
+	ullong              m_wrSegStartTime; // 0 if m_wrSeg was loaded
+	double              m_wrSegInsertRate;
+	std::atomic<double> m_wrSegConvRate;
+	std::atomic<ullong> m_writtenBytesAtPublish;
+	std::mutex m_writeStallMutex;
+	std::condition_variable m_writeStallCond; // notified by publish
+	std::atomic_size_t m_writeStallSeq; // changed in m_writeStallMutex
+	// NULL if there are no unique indices or the filter is not built yet,
+	// guarded by m_rwMutex, updated only by updateUniqueKeyFilter
+	UniqueKeyFilterPtr m_uniqKeyFilter;
+	std::mutex m_uniqKeyFilterMutex; // serializes updateUniqueKeyFilter
+	size_t     m_uniqKeyFilterGenSeq;
 	bool m_throwOnThrottle;
 	bool m_tobeDrop;
 	bool m_isMerging;
     bool m_isPurging;
     bool m_autoTask;
+	bool m_hasDeferredAutoTask; // AutoTask dropped when compaction suspended
+	std::atomic<bool> m_purgeCheckPending; // a PurgeCheckTask is queued
+	std::atomic<bool> m_movingColdSegments;
+	bool m_isReplica; // opened by openReplica, constant once loaded
+	std::mutex m_replicaMutex; // serializes refreshReplica
+	std::mutex m_shipMutex; // serializes shipSegmentsTo
+	std::once_flag m_asyncOnce;
+	std::unique_ptr<AsyncTableQueue> m_async; // created by the first async op
+	// pending rows of SchemaConfig::m_asyncIndex, subIds of m_wrSeg
+	mutable std::mutex m_asyncIndexMutex;
+	mutable std::condition_variable m_asyncIndexCond; // m_asyncIndexDone
+	std::deque<uint32_t> m_asyncIndexQueue;
+	febitvec m_asyncIndexPending; // claimed by the indexer or a writer
+	llong m_asyncIndexPosted;
+	llong m_asyncIndexDone;
+	bool  m_asyncIndexRunning; // an asyncIndexRun job is posted
+	std::atomic<size_t> m_asyncIndexMarks; // set bits, claims are lock free if 0
+	std::vector<std::string> m_replicaSegKeys; // of m_segments, see replicaSegKey
+	std::atomic<llong> m_readHeatSaveTime; // time(NULL) of last saveReadHeat
+	size_t m_coldGcSegArrayUpdateSeq; // of the last removeUnusedColdFiles
+	std::atomic<size_t> m_corruptSegNum; // found by verifySegments
+	std::atomic<llong>  m_lastExpireTime; // of expireRows
+	mutable std::mutex  m_onlineIndexMutex; // guards m_onlineIndices
+	valvec<OnlineIndexPtr> m_onlineIndices; // elements are never removed
+	std::mutex m_onlineIndexBuildMutex; // serializes buildOnlineIndices
+	std::unique_ptr<std::atomic<ullong>[]> m_columnUpdateCnt; // of row schema
+	std::atomic<ullong> m_updateRowCnt; // counted by m_columnUpdateCnt
 
 	// constant once constructed
 	boost::filesystem::path m_dir;
+	boost::filesystem::path m_trashDir; // m_dir renamed into by dropTable
 	SchemaConfigPtr m_schema;
+	MergePolicyPtr  m_mergePolicy; // NULL is the builtin rule
+	ValueCachePtr   m_valueCache;  // NULL if ValueCacheSize is 0
+	SegmentWarmerPtr m_segWarmer;  // just for SegmentLoadPolicy::background
+	SegmentScrubberPtr m_scrubber; // NULL if ScrubIntervalSeconds is 0
+	ChangeLogPtr    m_changeLog;   // NULL if not enabled
+	SegmentManifest m_manifest; // segment dirs of m_segments, see doLoad
+	IoStatsEnvPtr   m_env;
+	int             m_numaNode;
+	RateLimitedEnvPtr m_compactEnv; // NULL if compaction is unlimited
+	AdaptiveWriteRateLimiter* m_readLatencyLimiter; // of m_compactEnv, or NULL
+	std::unique_ptr<DbPerfCounters> m_perf; // NULL if !EnablePerfCounters
 	friend class TableIndexIter;
 	friend class TableIndexIterBackward;
 	friend class DbContext;
 	friend class ReadonlySegment;
 };
 typedef boost::intrusive_ptr<DbTable> DbTablePtr;
+
+// staged index keys are flushed even if the batch fails, the rows are
+// already committed
+class IndexBatchScope {
+	DbTable* m_tab;
+	DbContext* m_ctx;
+	DECLARE_NONE_COPYABLE_CLASS(IndexBatchScope);
+public:
+	IndexBatchScope(DbTable* tab, DbContext* ctx) : m_tab(tab), m_ctx(ctx) {
+		tab->beginIndexBatch(ctx);
+	}
+	~IndexBatchScope() {
+		try {
+			m_tab->flushIndexBatch(m_ctx);
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: flushIndexBatch: %s\n", ex.what());
+		}
+	}
+};
+
+// pin the current SegArrayVersion of a DbTable without m_rwMutex,
+// the critical section should be short: a publisher is waiting for it.
+// The version is loaded once, so all reads by the guard are of one version
+class SegArrayReadGuard {
+	const DbTable* m_tab;
+	const SegArrayVersion* m_version;
+	size_t m_slot;
+	DECLARE_NONE_COPYABLE_CLASS(SegArrayReadGuard);
+public:
+	explicit SegArrayReadGuard(const DbTable* tab) : m_tab(tab) {
+		for (;;) {
+			size_t epoch = tab->m_segArrayEpoch.load();
+			tab->m_segArrayReaders[epoch & 1]++;
+			if (terark_likely(tab->m_segArrayEpoch.load() == epoch)) {
+				m_slot = epoch & 1;
+				m_version = tab->m_segArrayVersion.load();
+				break;
+			}
+			// a publisher flipped the epoch, retry on the new slot
+			tab->m_segArrayReaders[epoch & 1]--;
+		}
+	}
+	~SegArrayReadGuard() { m_tab->m_segArrayReaders[m_slot]--; }
+	const SegArrayVersion* get() const { return m_version; }
+	const SegArrayVersion* operator->() const { return get(); }
+};
+
 typedef DbTable    CompositeTable; // for compatible
 typedef DbTablePtr CompositeTablePtr; // for compatible
 
@@ -358,6 +1106,11 @@ StoreIteratorPtr DbContext::createTableIterBackward() {
 //	assert(this != nullptr);
 	return m_tab->createStoreIterBackward(this);
 }
+inline
+StoreIteratorPtr
+DbContext::createTableIterColumnRange(size_t columnId, llong lo, llong hi) {
+	return m_tab->createTableIterColumnRange(columnId, lo, hi, this);
+}
 
 inline
 void DbContext::getValueAppend(llong id, valvec<byte>* val) {
@@ -369,6 +1122,18 @@ void DbContext::getValue(llong id, valvec<byte>* val) {
 //	assert(this != nullptr);
 	m_tab->getValue(id, val, this);
 }
+inline
+fstring DbContext::getValueRef(llong id, valvec<byte>* buf) {
+	return m_tab->getValueRef(id, buf, this);
+}
+inline
+void DbContext::getValuesBatch(const valvec<llong>& ids, valvec<valvec<byte> >* vals) {
+	m_tab->getValuesBatch(ids, vals, this);
+}
+inline
+void DbContext::getValuesBatch(const llong* ids, size_t num, valvec<byte>* vals) {
+	m_tab->getValuesBatch(ids, num, vals, this);
+}
 
 inline
 llong DbContext::insertRow(fstring row) {
@@ -419,6 +1184,34 @@ inline void
 DbContext::indexSearchExactNoLock(size_t indexId, fstring key, valvec<llong>* recIdvec) {
 	m_tab->indexSearchExactNoLock(indexId, key, recIdvec, this);
 }
+inline void
+DbContext::indexSearchExactBatch(size_t indexId, const fstring* keys, size_t num, valvec<llong>* recIdvec, valvec<size_t>* offsets) {
+	m_tab->indexSearchExactBatch(indexId, keys, num, recIdvec, offsets, this);
+}
+inline void
+DbContext::indexSearchExactBatchNoLock(size_t indexId, const fstring* keys, size_t num, valvec<llong>* recIdvec, valvec<size_t>* offsets) {
+	m_tab->indexSearchExactBatchNoLock(indexId, keys, num, recIdvec, offsets, this);
+}
+inline size_t
+DbContext::getValuesByKeyBatch(size_t indexId, const fstring* keys, size_t num, llong* recIds, valvec<byte>* vals) {
+	return m_tab->getValuesByKeyBatch(indexId, keys, num, recIds, vals, this);
+}
+inline llong
+DbContext::indexCountRange(size_t indexId, fstring lo, fstring hi) {
+	return m_tab->indexCountRange(indexId, lo, hi, this);
+}
+inline llong
+DbContext::indexScanRange(size_t indexId, fstring lo, fstring hi, const std::function<bool(llong recId)>& onRecord) {
+	return m_tab->indexScanRange(indexId, lo, hi, onRecord, this);
+}
+inline size_t
+DbContext::indexSearchPrefix(size_t indexId, fstring prefix, size_t k, valvec<llong>* recIdvec, fstrvecl* keys) {
+	return m_tab->indexSearchPrefix(indexId, prefix, k, recIdvec, keys, this);
+}
+inline llong
+DbContext::indexApproximateRangeSize(size_t indexId, fstring lo, fstring hi) {
+	return m_tab->indexApproximateRangeSize(indexId, lo, hi, this);
+}
 inline bool
 DbContext::indexKeyExistsNoLock(size_t indexId, fstring key) {
 	return m_tab->indexKeyExistsNoLock(indexId, key, this);
@@ -440,6 +1233,24 @@ inline void
 DbContext::selectOneColumn(llong id, size_t columnId, valvec<byte>* colsData) {
 	m_tab->selectOneColumn(id, columnId, colsData, this);
 }
+inline void
+DbContext::selectColumnsFromIndexKey(size_t indexId, fstring key,
+			const size_t* colsId, size_t colsNum, valvec<byte>* colsData) {
+	m_tab->selectColumnsFromIndexKey(indexId, key, colsId, colsNum, colsData, this);
+}
+inline void
+DbContext::selectColumnsBatch(const valvec<llong>& ids, const valvec<size_t>& cols, valvec<valvec<byte> >* colsDataVec) {
+	m_tab->selectColumnsBatch(ids, cols, colsDataVec, this);
+}
+inline void
+DbContext::selectColumnsBatch(const llong* ids, size_t num, const size_t* colsId, size_t colsNum, valvec<byte>* colsDataVec) {
+	m_tab->selectColumnsBatch(ids, num, colsId, colsNum, colsDataVec, this);
+}
+
+inline void
+DbContext::selectOneColgroupBatch(const llong* ids, size_t num, size_t cgId, valvec<byte>* cgDataVec) {
+	m_tab->selectOneColgroupBatch(ids, num, cgId, cgDataVec, this);
+}
 
 inline void
 DbContext::selectColgroups(llong id, const valvec<size_t>& cgIdvec, valvec<valvec<byte> >* cgDataVec) {
@@ -453,6 +1264,10 @@ inline void
 DbContext::selectOneColgroup(llong id, size_t cgId, valvec<byte>* cgData) {
 	m_tab->selectOneColgroup(id, cgId, cgData, this);
 }
+inline fstring
+DbContext::selectOneColgroupRef(llong id, size_t cgId, valvec<byte>* buf) {
+	return m_tab->selectOneColgroupRef(id, cgId, buf, this);
+}
 inline void
 DbContext::selectColumnsNoLock(llong id, const valvec<size_t>& cols, valvec<byte>* colsData) {
 	m_tab->selectColumnsNoLock(id, cols, colsData, this);
@@ -509,11 +1324,8 @@ inline
 void DbContext::trySyncSegCtxSpeculativeLock(const DbTable* tab) {
 	if (this->segArrayUpdateSeq != tab->m_segArrayUpdateSeq) {
 		assert(this->segArrayUpdateSeq < tab->m_segArrayUpdateSeq);
-		MyRwLock lock(tab->m_rwMutex, false);
-		this->doSyncSegCtxNoLock(tab);
-		assert(m_segCtx.size() == tab->m_segments.size());
-		assert(m_rowNumVec.size() == tab->m_segments.size()+1);
-		assert(m_rowNumVec.size() == tab->m_rowNumVec.size());
+		SegArrayReadGuard version(tab);
+		this->doSyncSegCtx(tab, *version.get());
 	}
 	else {
 		llong rowNum = tab->m_rowNum;
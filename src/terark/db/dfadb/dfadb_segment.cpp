@@ -2,6 +2,7 @@
 #include "nlt_index.hpp"
 #include "nlt_store.hpp"
 #include <terark/db/fixed_len_store.hpp>
+#include <terark/db/db_env.hpp>
 #include <terark/zbs/fast_zip_blob_store.hpp>
 #include <mutex>
 #include <random>
@@ -76,11 +77,12 @@ DfaDbReadonlySegment::buildDictZipStore(const Schema& schema,
 										PathRef dir,
 										StoreIterator& inputIter,
 										const bm_uint_t* isDel,
-										const febitvec* isPurged)
+										const febitvec* isPurged,
+										fstring reuseDict)
 const {
 	std::unique_ptr<NestLoudsTrieStore> nlt(new NestLoudsTrieStore(schema));
 	auto fpath = dir / ("colgroup-" + schema.m_name + ".nlt");
-	nlt->build_by_iter(schema, fpath, inputIter, isDel, isPurged);
+	nlt->build_by_iter(schema, fpath, inputIter, isDel, isPurged, reuseDict);
 	return nlt.release();
 }
 
@@ -99,6 +101,7 @@ DfaDbReadonlySegment::compressSingleColgroup(ReadableSegment* input, DbContext*
 	SortableStrVec valueVec;
 	const Schema& valueSchema = m_schema->getColgroupSchema(0);
 	std::unique_ptr<DictZipBlobStore::ZipBuilder> builder;
+	DictZipSample sample; // filled only if valueSchema.m_dictZipReuse
 	FixedLenStorePtr store;
 	if (valueSchema.should_use_FixedLenStore()) {
 		store = new FixedLenStore(tmpDir, valueSchema);
@@ -118,14 +121,19 @@ DfaDbReadonlySegment::compressSingleColgroup(ReadableSegment* input, DbContext*
 		(random.max() - random.min()) * valueSchema.m_dictZipSampleRatio;
 	size_t sampleLenSum = 0;
 	while (iter->increment(&id, &val) && id < logicRowNum) {
+		if ((id & 0xFFFF) == 0)
+			checkBuildCancelled();
 		assert(id >= 0);
 		assert(id < logicRowNum);
 		assert(prevId < id);
 		if (!m_isDel[id]) {
 			if (builder) {
+				sample.addRecordLen(val.size());
 				if (random() < sampleUpperBound) {
 					builder->addSample(val);
 					sampleLenSum += val.size();
+					if (valueSchema.m_dictZipReuse)
+						sample.addSample(val);
 				}
 			}
 			else {
@@ -160,12 +168,15 @@ DfaDbReadonlySegment::compressSingleColgroup(ReadableSegment* input, DbContext*
 		assert(valueVec.m_index.size() == 0);
 		assert(valueVec.m_strpool.size() == 0);
 		iter->reset(); // free resources and seek to begin
+		checkBuildCancelled(); // before dict training
 		std::lock_guard<std::mutex> lock(DictZip_reduceMemMutex());
 		auto fpath = tmpDir / ("colgroup-" + valueSchema.m_name + ".nlt");
 		emptyCheckProtect(sampleLenSum, val, *builder);
 		builder->prepare(newRowNum, fpath.string());
 		prevId = -1;
 		while (iter->increment(&id, &val) && id < inputRowNum) {
+			if ((id & 0xFFFF) == 0)
+				checkBuildCancelled();
 			for (llong j = prevId+1; j < id; ++j) {
 				if (!m_isDel[j]) {
 					// j was deleted during compressing
@@ -178,6 +189,10 @@ DfaDbReadonlySegment::compressSingleColgroup(ReadableSegment* input, DbContext*
 		}
 		iter = nullptr;
 		m_colgroups[0] = new NestLoudsTrieStore(valueSchema, builder->finish());
+		DbEnv::current()->fileWritten(fpath.string()); // written by builder
+		if (valueSchema.m_dictZipReuse && sample.sampleNum()) {
+			sample.save(fpath.string() + "-dict");
+		}
 	}
 	else if (store) {
 		m_colgroups[0] = std::move(store);
@@ -202,6 +217,7 @@ DfaDbReadonlySegment::compressSingleKeyValue(ReadableSegment* input, DbContext*
 	const Schema& keySchema = m_schema->getIndexSchema(0);
 	const Schema& valueSchema = m_schema->getColgroupSchema(1);
 	std::unique_ptr<DictZipBlobStore::ZipBuilder> builder;
+	DictZipSample sample; // filled only if valueSchema.m_dictZipReuse
 	FixedLenStorePtr store;
 	if (valueSchema.should_use_FixedLenStore()) {
 		store = new FixedLenStore(tmpDir, valueSchema);
@@ -222,6 +238,8 @@ DfaDbReadonlySegment::compressSingleKeyValue(ReadableSegment* input, DbContext*
 	size_t sampleLenSum = 0;
 	valvec<byte_t> key, val;
 	while (iter->increment(&id, &buf) && id < logicRowNum) {
+		if ((id & 0xFFFF) == 0)
+			checkBuildCancelled();
 		assert(id >= 0);
 		assert(id < logicRowNum);
 		assert(prevId < id);
@@ -235,9 +253,12 @@ DfaDbReadonlySegment::compressSingleKeyValue(ReadableSegment* input, DbContext*
 				keyVec.push_back(key);
 			}
 			if (builder) {
+				sample.addRecordLen(val.size());
 				if (random() < sampleUpperBound) {
 					builder->addSample(val);
 					sampleLenSum += val.size();
+					if (valueSchema.m_dictZipReuse)
+						sample.addSample(val);
 				}
 			}
 			else {
@@ -273,18 +294,22 @@ DfaDbReadonlySegment::compressSingleKeyValue(ReadableSegment* input, DbContext*
 	} else {
 		iter = nullptr;
 	}
-	m_indices[0] = buildIndex(keySchema, keyVec); // memory heavy
+	checkBuildCancelled();
+	m_indices[0] = buildIndexAndFilter(0, keySchema, keyVec); // memory heavy
 	m_colgroups[0] = m_indices[0]->getReadableStore();
 	keyVec.clear();
 	if (builder) {
 		assert(valueVec.m_index.size() == 0);
 		assert(valueVec.m_strpool.size() == 0);
+		checkBuildCancelled(); // before dict training
 		std::lock_guard<std::mutex> lock(DictZip_reduceMemMutex());
 		auto fpath = tmpDir / ("colgroup-" + valueSchema.m_name + ".nlt");
 		emptyCheckProtect(sampleLenSum, val, *builder);
 		builder->prepare(newRowNum, fpath.string());
 		prevId = -1;
 		while (iter->increment(&id, &buf) && id < inputRowNum) {
+			if ((id & 0xFFFF) == 0)
+				checkBuildCancelled();
 			for (llong j = prevId+1; j < id; ++j) {
 				if (!m_isDel[j]) {
 					// j was deleted during compressing
@@ -300,6 +325,10 @@ DfaDbReadonlySegment::compressSingleKeyValue(ReadableSegment* input, DbContext*
 		}
 		iter = nullptr;
 		m_colgroups[1] = new NestLoudsTrieStore(valueSchema, builder->finish());
+		DbEnv::current()->fileWritten(fpath.string()); // written by builder
+		if (valueSchema.m_dictZipReuse && sample.sampleNum()) {
+			sample.save(fpath.string() + "-dict");
+		}
 	}
 	else if (store) {
 		m_colgroups[1] = std::move(store);
@@ -19,7 +19,8 @@ protected:
 	ReadableStore* buildStore(const Schema&, SortableStrVec& storeData) const override;
 	ReadableStore*
 	buildDictZipStore(const Schema&, PathRef dir, StoreIterator&iter,
-		const bm_uint_t* isDel, const febitvec* isPurged) const override;
+		const bm_uint_t* isDel, const febitvec* isPurged,
+		fstring reuseDict) const override;
 	void compressSingleColgroup(ReadableSegment* input, DbContext* ctx) override;
 	void compressSingleKeyValue(ReadableSegment* input, DbContext* ctx) override;
 };
@@ -1,6 +1,9 @@
 #include "nlt_index.hpp"
+#include <terark/db/db_env.hpp>
 #include <terark/io/FileStream.hpp>
 #include <terark/io/DataIO.hpp>
+#include <terark/io/var_int.hpp>
+#include <terark/io/stream_vbyte.hpp>
 #include <terark/util/mmap.hpp>
 #include <terark/fsa/create_regex_dfa.hpp>
 #include <terark/fsa/dense_dfa.hpp>
@@ -8,13 +11,97 @@
 #include <terark/int_vector.hpp>
 #include <terark/rank_select.hpp>
 #include <terark/fsa/nest_trie_dawg.hpp>
+#if !defined(_MSC_VER)
+	#include <sys/mman.h>
+#endif
+#include <errno.h>
+#include <string.h>
 
 namespace terark { namespace db { namespace dfadb {
 
+static const size_t HugePageSize = size_t(2) << 20;
+
+// The dfa is accessed randomly, its lookups are bound by tlb misses of 4K
+// pages, so it may be copied into an anonymous mapping of 2M huge pages:
+// reserved hugetlb pages if there are enough, else transparent huge pages
+// by MADV_HUGEPAGE. The copy is not page cache, it is private memory of
+// the process. @returns NULL if huge pages are unavailable or the file is
+// smaller than a huge page, the caller falls back to mmap of the file
+static byte* loadHugePageCopy(fstring fpath, size_t* fsize, size_t* memSize) {
+#if defined(__linux__) && defined(MAP_ANONYMOUS)
+	if (FILE* thp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r")) {
+		char buf[128] = "";
+		bool never = fgets(buf, sizeof(buf), thp) && strstr(buf, "[never]");
+		fclose(thp);
+		if (never)
+			return NULL; // madvise would still be successful
+	}
+	size_t size = 0;
+	void* file = DbEnv::current()->mmapLoad(fpath, &size, false, false);
+	if (size < HugePageSize) {
+		DbEnv::current()->mmapClose(file, size);
+		return NULL;
+	}
+	size_t alignedSize = (size + HugePageSize - 1) & ~(HugePageSize - 1);
+	void* mem = MAP_FAILED;
+  #if defined(MAP_HUGETLB)
+	mem = ::mmap(NULL, alignedSize, PROT_READ|PROT_WRITE,
+				 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  #endif
+	if (MAP_FAILED == mem) {
+		// over allocate for the alignment, which is required by khugepaged
+		size_t mapSize = alignedSize + HugePageSize;
+		byte* base = (byte*)::mmap(NULL, mapSize, PROT_READ|PROT_WRITE,
+								   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == (void*)base) {
+			fprintf(stderr, "WARN: nltHugePage: mmap(%zd) = %s, fallback to mmap of %s\n"
+				, mapSize, strerror(errno), fpath.c_str());
+			DbEnv::current()->mmapClose(file, size);
+			return NULL;
+		}
+		byte* aligned = (byte*)((size_t(base) + HugePageSize - 1) & ~(HugePageSize - 1));
+		if (aligned > base)
+			::munmap(base, aligned - base);
+		if (base + mapSize > aligned + alignedSize)
+			::munmap(aligned + alignedSize, base + mapSize - (aligned + alignedSize));
+		mem = aligned;
+	#if defined(MADV_HUGEPAGE)
+		if (::madvise(mem, alignedSize, MADV_HUGEPAGE) != 0) {
+			fprintf(stderr, "WARN: nltHugePage: madvise(MADV_HUGEPAGE) = %s, fallback to mmap of %s\n"
+				, strerror(errno), fpath.c_str());
+			::munmap(mem, alignedSize);
+			DbEnv::current()->mmapClose(file, size);
+			return NULL;
+		}
+	#endif
+	}
+	memcpy(mem, file, size); // faults the huge pages
+	DbEnv::current()->mmapClose(file, size);
+	::mprotect(mem, alignedSize, PROT_READ);
+	*fsize = size;
+	*memSize = alignedSize;
+	return (byte*)mem;
+#else
+	return NULL;
+#endif
+}
+
+static void freeHugePageCopy(byte* mem, size_t memSize) {
+#if defined(__linux__) && defined(MAP_ANONYMOUS)
+	::munmap(mem, memSize);
+#endif
+}
+
 NestLoudsTrieIndex::NestLoudsTrieIndex(const Schema& schema) : m_schema(schema) {
+	m_dfaMem = nullptr;
+	m_dfaMemSize = 0;
 	m_idmapBase = nullptr;
 	m_idmapSize = 0;
 	m_dataInflateSize = 0;
+	m_lazyIdToKey = false;
+	m_keyToIdDelta = false;
+	m_postings = false;
+	m_keyToIdMin = 0;
 }
 NestLoudsTrieIndex::NestLoudsTrieIndex(const Schema& schema, SortableStrVec& strVec)
   : NestLoudsTrieIndex(schema)
@@ -23,10 +110,17 @@ NestLoudsTrieIndex::NestLoudsTrieIndex(const Schema& schema, SortableStrVec& str
 }
 NestLoudsTrieIndex::~NestLoudsTrieIndex() {
 	if (m_idmapBase) {
-		m_idToKey.risk_release_ownership();
+		if (!m_lazyIdToKey)
+			m_idToKey.risk_release_ownership();
 		m_keyToId.risk_release_ownership();
+		m_postOffsets.risk_release_ownership();
+		m_postData.risk_release_ownership();
 		m_recBits.risk_release_ownership();
-		mmap_close(m_idmapBase, m_idmapSize);
+		DbEnv::current()->mmapClose(m_idmapBase, m_idmapSize);
+	}
+	if (m_dfaMem) {
+		m_dfa.reset(); // it is on m_dfaMem
+		freeHugePageCopy(m_dfaMem, m_dfaMemSize);
 	}
 }
 
@@ -40,7 +134,8 @@ ReadableStore* NestLoudsTrieIndex::getReadableStore() {
 
 ///@{ ordered and unordered index
 llong NestLoudsTrieIndex::indexStorageSize() const {
-	return m_dfa->mem_size() + m_keyToId.mem_size();
+	return m_dfa->mem_size() + m_keyToId.mem_size()
+		 + m_postOffsets.mem_size() + m_postData.size();
 }
 
 void NestLoudsTrieIndex::searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const {
@@ -52,7 +147,7 @@ void NestLoudsTrieIndex::searchExactAppend(fstring key, valvec<llong>* recIdvec,
 	if (m_isUnique) {
 		assert(m_recBits.size() == 0);
 		if (dawgIdx < dawgNum) {
-			recIdvec->push_back(m_keyToId.get(dawgIdx));
+			recIdvec->push_back(keyToId(dawgIdx));
 			return;
 		}
 	}
@@ -63,15 +158,172 @@ void NestLoudsTrieIndex::searchExactAppend(fstring key, valvec<llong>* recIdvec,
 			assert(bitpos < m_recBits.size());
 			size_t dupcnt = m_recBits.zero_seq_len(bitpos+1) + 1;
 			for (size_t i = 0; i < dupcnt; ++i) {
-				recIdvec->push_back(m_keyToId.get(bitpos+i));
+				recIdvec->push_back(keyToId(bitpos+i));
 			}
 		}
 	}
 }
+
+#if defined(_MSC_VER)
+	#include <xmmintrin.h>
+	#define NLT_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+	#define NLT_PREFETCH(p) __builtin_prefetch(p)
+#endif
+
+// The dawg walk of one key is a chain of dependent loads in the fsa lib,
+// which has no multi key walk, so keys are still walked one by one, but
+// loads after the walks are overlapped: dupable rec bits are selected by
+// select1_batch, and m_keyToId of hits is prefetched PrefetchDist ahead
+void
+NestLoudsTrieIndex::searchExactAppendBatch(const fstring* keys, size_t num,
+										   valvec<llong>* recIdvec, size_t* offsets,
+										   DbContext*)
+const {
+	const size_t PrefetchDist = 8;
+	auto dawg = m_dfa->get_dawg();
+	assert(dawg);
+	const size_t dawgNum = dawg->num_words();
+	valvec<size_t> hitKey(num, valvec_reserve());
+	valvec<size_t> hitPos(num, valvec_reserve()); // dawgIdx, or bitpos
+	for (size_t k = 0; k < num; ++k) {
+		size_t dawgIdx = dawg->index(keys[k]);
+		assert(dawgIdx < dawgNum || size_t(-1) == dawgIdx);
+		if (dawgIdx < dawgNum) {
+			hitKey.push_back(k);
+			hitPos.push_back(dawgIdx);
+		}
+	}
+	const size_t hitNum = hitKey.size();
+	if (m_isUnique) {
+		assert(m_recBits.size() == 0);
+	}
+	else if (hitNum) {
+		assert(m_recBits.size() >= dawgNum+2);
+		valvec<size_t> bitpos(hitNum, valvec_no_init());
+		m_recBits.select1_batch(hitPos.data(), hitNum, bitpos.data());
+		hitPos.swap(bitpos);
+	}
+	const byte*  idData = m_keyToId.data();
+	const size_t idBits = m_keyToId.uintbits();
+	const size_t idMask = m_keyToId.uintmask();
+	for (size_t h = 0; h < hitNum && h < PrefetchDist && !m_postings; ++h) {
+		NLT_PREFETCH(idData + hitPos[h] * idBits / 8);
+	}
+	PostingBuf postBuf; // neighbor keys may share a block
+	size_t h = 0;
+	for (size_t k = 0; k < num; ++k) {
+		offsets[k] = recIdvec->size();
+		if (h == hitNum || hitKey[h] != k) {
+			continue;
+		}
+		if (h + PrefetchDist < hitNum && !m_postings) {
+			NLT_PREFETCH(idData + hitPos[h + PrefetchDist] * idBits / 8);
+		}
+		size_t pos = hitPos[h++];
+		if (m_postings) {
+			size_t dupcnt = m_recBits.zero_seq_len(pos+1) + 1;
+			for (size_t i = 0; i < dupcnt; ++i) {
+				recIdvec->push_back(keyToIdNext(pos+i, &postBuf));
+			}
+		}
+		else if (m_isUnique) {
+			recIdvec->push_back(unzipKeyToId(pos, UintVecMin0::fast_get(idData, idBits, idMask, pos)));
+		}
+		else {
+			assert(pos < m_recBits.size());
+			size_t dupcnt = m_recBits.zero_seq_len(pos+1) + 1;
+			for (size_t i = 0; i < dupcnt; ++i) {
+				size_t val = UintVecMin0::fast_get(idData, idBits, idMask, pos+i);
+				recIdvec->push_back(unzipKeyToId(pos+i, val));
+			}
+		}
+	}
+	offsets[num] = recIdvec->size();
+}
+
+bool NestLoudsTrieIndex::postingCursor(fstring key, PostingCursor* cur) const {
+	auto dawg = m_dfa->get_dawg();
+	assert(dawg);
+	size_t dawgIdx = dawg->index(key);
+	cur->m_owner = this;
+	if (dawgIdx >= dawg->num_words()) {
+		cur->m_pos = cur->m_end = 0;
+		return false;
+	}
+	if (m_isUnique) {
+		cur->m_pos = dawgIdx;
+		cur->m_end = dawgIdx + 1;
+	}
+	else {
+		cur->m_pos = m_recBits.select1(dawgIdx);
+		cur->m_end = m_recBits.zero_seq_len(cur->m_pos + 1) + cur->m_pos + 1;
+	}
+	cur->m_id = keyToIdNext(cur->m_pos, &cur->m_buf);
+	return true;
+}
+
+void NestLoudsTrieIndex::PostingCursor::next() {
+	assert(valid());
+	if (++m_pos < m_end)
+		m_id = m_owner->keyToIdNext(m_pos, &m_buf);
+}
+
+// ids of a key are ascending in the map, gallop then binary search
+void NestLoudsTrieIndex::PostingCursor::seek(llong minId) {
+	if (!valid() || llong(m_id) >= minId)
+		return;
+	size_t lo = m_pos + 1, hi = m_pos + 1, step = 1;
+	while (hi < m_end && llong(m_owner->keyToId(hi)) < minId) {
+		lo = hi + 1;
+		step *= 2;
+		hi = std::min(m_end, m_pos + step);
+	}
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (llong(m_owner->keyToId(mid)) < minId)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	m_pos = lo;
+	if (m_pos < m_end) {
+		m_id = m_owner->keyToIdNext(m_pos, &m_buf);
+	}
+}
+
+void
+NestLoudsTrieIndex::intersectPostings(PostingCursor* curs, size_t num,
+									  valvec<llong>* out) {
+	if (0 == num || !curs[0].valid())
+		return;
+	for (;;) {
+		llong x = curs[0].id();
+		bool same = true;
+		for (size_t i = 1; i < num; ++i) {
+			curs[i].seek(x);
+			if (!curs[i].valid())
+				return;
+			if (curs[i].id() != x) {
+				x = curs[i].id();
+				same = false;
+				break;
+			}
+		}
+		if (same) {
+			out->push_back(x);
+			curs[0].next();
+		} else {
+			curs[0].seek(x);
+		}
+		if (!curs[0].valid())
+			return;
+	}
+}
 ///@}
 
 llong NestLoudsTrieIndex::dataStorageSize() const {
-	return m_idToKey.mem_size();
+	return m_lazyIdToKey ? 0 : m_idToKey.mem_size();
 }
 
 llong NestLoudsTrieIndex::dataInflateSize() const {
@@ -100,12 +352,108 @@ const {
 	assert(dawg);
 	std::string buf;
 //	std::string& buf = ctx1->m_nltRecBuf;
-	size_t dawgIdx = m_idToKey.get(id);
+	size_t dawgIdx = idToKey().get(id);
 	assert(dawgIdx < dawg->num_words());
 	dawg->nth_word(dawgIdx, &buf);
 	val->append(buf);
 }
 
+const UintVecMin0& NestLoudsTrieIndex::idToKey() const {
+	if (m_lazyIdToKey) {
+		std::call_once(m_idToKeyOnce, [this]() { buildIdToKey(); });
+	}
+	return m_idToKey;
+}
+
+// inverse of m_keyToId, the word id of map pos i of a dupable index is
+// the number of 1 bits of m_recBits in [0, i] minus 1
+void NestLoudsTrieIndex::buildIdToKey() const {
+	const size_t rows = size_t(numDataRows());
+	valvec<uint32_t> idToKey(rows, valvec_no_init());
+	size_t keyIdx = 0;
+	PostingBuf buf;
+	for (size_t i = 0; i < rows; ++i) {
+		if (!m_isUnique && i && m_recBits.is1(i))
+			keyIdx++;
+		size_t id = keyToIdNext(i, &buf);
+		idToKey[id] = uint32_t(m_isUnique ? i : keyIdx);
+	}
+	m_idToKey.build_from(idToKey);
+}
+
+// all blocks are full, the last block is padded by zero deltas
+void NestLoudsTrieIndex::decodePostingBlock(size_t block, uint32_t* ids) const {
+	assert(m_postings);
+	const byte* p = m_postData.data() + m_postOffsets.get(block);
+	stream_vbyte_decode(p, PostingBlock, ids);
+	for (size_t j = 1; j < PostingBlock; ++j) {
+		uint32_t zz = ids[j];
+		ids[j] = ids[j-1] + ((zz >> 1) ^ (0 - (zz & 1)));
+	}
+}
+
+size_t NestLoudsTrieIndex::postingGet(size_t pos) const {
+	uint32_t ids[PostingBlock];
+	decodePostingBlock(pos / PostingBlock, ids);
+	return ids[pos % PostingBlock];
+}
+
+size_t NestLoudsTrieIndex::keyToIdNext(size_t pos, PostingBuf* buf) const {
+	if (!m_postings)
+		return keyToId(pos);
+	size_t block = pos / PostingBlock;
+	if (buf->block != block) {
+		decodePostingBlock(block, buf->ids);
+		buf->block = block;
+	}
+	return buf->ids[pos % PostingBlock];
+}
+
+///@returns false if postings are not smaller than m_keyToId
+bool NestLoudsTrieIndex::buildPostings(UintVecMin0* offsets, valvec<byte>* data) const {
+	assert(!m_isUnique);
+	assert(!m_postings);
+	const size_t rows = m_keyToId.size();
+	const size_t limit = m_keyToId.mem_size();
+	const size_t blocks = (rows + PostingBlock - 1) / PostingBlock;
+	valvec<size_t> blockOffsets(blocks + 1, valvec_reserve());
+	uint32_t vals[PostingBlock];
+	byte buf[(PostingBlock + 3) / 4 + 4 * PostingBlock];
+	assert(sizeof(buf) == stream_vbyte_max_bytes(PostingBlock));
+	data->erase_all();
+	for (size_t b = 0; b < blocks; ++b) {
+		size_t prev = 0;
+		for (size_t j = 0; j < PostingBlock; ++j) {
+			size_t i = b * PostingBlock + j;
+			if (i >= rows) {
+				vals[j] = 0; // zero deltas
+				continue;
+			}
+			size_t id = keyToId(i);
+			if (id > UINT32_MAX)
+				return false;
+			if (0 == j) {
+				vals[j] = uint32_t(id);
+			} else {
+				llong delta = llong(id) - llong(prev);
+				if (delta < INT32_MIN || delta > INT32_MAX)
+					return false;
+				int32_t d = int32_t(delta);
+				vals[j] = (uint32_t(d) << 1) ^ uint32_t(d >> 31); // zigzag
+			}
+			prev = id;
+		}
+		blockOffsets.push_back(data->size());
+		data->append(buf, stream_vbyte_encode(vals, PostingBlock, buf));
+		if (data->size() >= limit)
+			return false;
+	}
+	blockOffsets.push_back(data->size());
+	data->resize((data->size() + 15) & ~size_t(15), 0); // align to 16
+	offsets->build_from(blockOffsets);
+	return offsets->mem_size() + data->size() < limit;
+}
+
 StoreIterator* NestLoudsTrieIndex::createStoreIterForward(DbContext*) const {
 	return nullptr; // not needed
 }
@@ -204,21 +552,40 @@ struct NestLoudsTrieIndex::FileHeader {
 	uint32_t idToKeyBytesDiv16; // real size may overflow uint32
 	uint32_t recBitsMemSize;
 	uint64_t dataInflateSize;
-	uint64_t pad1;
-	uint64_t pad2[4];
+	uint32_t flags; // 0 in old files
+	uint32_t keyToIdBits; // if FlagKeyToIdDelta
+	int64_t  keyToIdMin;  // keyToId[i] = delta[i] + i + keyToIdMin
+	uint64_t postingBytes; // if FlagPostings, aligned to 16
+	uint32_t postingOffsetBits;
+	uint32_t pad1;
+	uint64_t pad2[1];
+	enum {
+		FlagNoIdToKey = 1,
+		FlagKeyToIdDelta = 2,
+		FlagPostings = 4, // then FlagKeyToIdDelta is not set
+	};
 };
 
 void NestLoudsTrieIndex::load(PathRef path) {
 	BOOST_STATIC_ASSERT(sizeof(FileHeader) == 64);
 	auto pathNLT = path + ".nlt";
-	std::unique_ptr<BaseDFA> dfa(BaseDFA::load_mmap(pathNLT.string(), m_schema.m_mmapPopulate));
+	std::unique_ptr<BaseDFA> dfa;
+	if (m_schema.m_nltHugePage) {
+		size_t fsize = 0;
+		m_dfaMem = loadHugePageCopy(pathNLT.string(), &fsize, &m_dfaMemSize);
+		if (m_dfaMem)
+			dfa.reset(BaseDFA::load_mmap_user_mem(m_dfaMem, fsize));
+	}
+	if (!dfa) {
+		dfa.reset(BaseDFA::load_mmap(pathNLT.string(), m_schema.m_mmapPopulate));
+	}
 	m_dfa.reset(dynamic_cast<NestLoudsTrieDAWG_SE_512*>(dfa.get()));
 	if (m_dfa) {
 		dfa.release();
 	}
 	bool writable = false;
 	auto pathIdMap = path + ".idmap";
-	m_idmapBase = (FileHeader*)mmap_load(pathIdMap.string(), &m_idmapSize, writable, m_schema.m_mmapPopulate);
+	m_idmapBase = (FileHeader*)DbEnv::current()->mmapLoad(pathIdMap.string(), &m_idmapSize, writable, m_schema.m_mmapPopulate);
 
 	size_t rows  = m_idmapBase->rows;
 	size_t keys  = m_idmapBase->keys;
@@ -232,51 +599,132 @@ void NestLoudsTrieIndex::load(PathRef path) {
 			"path=%s, broken data: keys[dfa=%zd map=%zd]",
 			path.string().c_str(), m_dfa->num_words(), keys);
 	}
-	m_idToKey.risk_set_data((byte*)(m_idmapBase+1)        , rows, kbits);
-	m_keyToId.risk_set_data((byte*)(m_idmapBase+1) + bytes, rows, rbits);
-	assert(m_idToKey.mem_size() == bytes);
+	m_lazyIdToKey = (m_idmapBase->flags & FileHeader::FlagNoIdToKey) != 0;
+	m_keyToIdDelta = (m_idmapBase->flags & FileHeader::FlagKeyToIdDelta) != 0;
+	if (m_lazyIdToKey) {
+		bytes = 0;
+	} else {
+		m_idToKey.risk_set_data((byte*)(m_idmapBase+1), rows, kbits);
+		assert(m_idToKey.mem_size() == bytes);
+	}
+	m_postings = (m_idmapBase->flags & FileHeader::FlagPostings) != 0;
+	byte*  mapBase = (byte*)(m_idmapBase+1) + bytes;
+	size_t mapBytes;
+	if (m_postings) {
+		size_t blocks = (rows + PostingBlock - 1) / PostingBlock;
+		m_postOffsets.risk_set_data(mapBase, blocks + 1, m_idmapBase->postingOffsetBits);
+		m_postData.risk_set_data(mapBase + m_postOffsets.mem_size(), m_idmapBase->postingBytes);
+		mapBytes = m_postOffsets.mem_size() + m_postData.size();
+	}
+	else {
+		if (m_keyToIdDelta) {
+			rbits = m_idmapBase->keyToIdBits;
+			m_keyToIdMin = m_idmapBase->keyToIdMin;
+		}
+		m_keyToId.risk_set_data(mapBase, rows, rbits);
+		mapBytes = m_keyToId.mem_size();
+	}
 	m_isUnique = keys == rows;
 	if (!m_isUnique) {
-		m_recBits.risk_mmap_from((byte*)(m_idmapBase+1)+bytes+m_keyToId.mem_size(), rslen);
+		m_recBits.risk_mmap_from(mapBase + mapBytes, rslen);
 		m_recBits.risk_set_size(rows + 1);
 	}
 	m_dataInflateSize = m_idmapBase->dataInflateSize;
 }
 
 void NestLoudsTrieIndex::save(PathRef path) const {
+	const UintVecMin0* idToKeyVec = NULL;
+	if (!m_schema.m_nltLazyIdToKey) {
+		idToKeyVec = &idToKey();
 #ifndef NDEBUG
-	if (m_isUnique) {
-		assert(m_dfa->num_words() == m_idToKey.size());
-		assert(m_idToKey.mem_size() == m_keyToId.mem_size());
+		if (m_isUnique) {
+			assert(m_dfa->num_words() == idToKeyVec->size());
+		}
+		else {
+			assert(m_dfa->num_words() < idToKeyVec->size());
+		}
+		assert(idToKeyVec->size() == size_t(numDataRows()));
+		assert(idToKeyVec->mem_size() % 16 == 0);
+#endif
+		if (idToKeyVec->mem_size() % 16 != 0) {
+			THROW_STD(logic_error,
+				"(m_idToKey.mem_size()=%zd) %% 16 = %zd, must be 0",
+				  idToKeyVec->mem_size(), idToKeyVec->mem_size() % 16);
+		}
 	}
-	else {
-		assert(m_dfa->num_words() < m_idToKey.size());
-		assert(m_idToKey.uintbits() <= m_keyToId.uintbits());
+	// save m_keyToId as delta to identity if it is narrower, and a dupable
+	// map as postings if they are smaller than m_keyToId
+	const size_t rows = m_keyToId.size();
+	const UintVecMin0* keyToIdVec = &m_keyToId;
+	bool   keyToIdDelta = m_keyToIdDelta;
+	llong  keyToIdMin = m_keyToIdMin;
+	UintVecMin0 delta;
+	const UintVecMin0*  postOffsets = &m_postOffsets;
+	const valvec<byte>* postData = &m_postData;
+	UintVecMin0  newPostOffsets;
+	valvec<byte> newPostData;
+	bool postings = m_postings;
+	if (!m_postings && !m_isUnique &&
+			buildPostings(&newPostOffsets, &newPostData)) {
+		postings = true;
+		postOffsets = &newPostOffsets;
+		postData = &newPostData;
 	}
-	assert(m_idToKey.size() == m_keyToId.size());
-	assert(m_idToKey.mem_size() % 16 == 0);
-#endif
-	if (m_idToKey.mem_size() % 16 != 0) {
-		THROW_STD(logic_error,
-			"(m_idToKey.mem_size()=%zd) %% 16 = %zd, must be 0",
-			  m_idToKey.mem_size(), m_idToKey.mem_size() % 16);
+	if (!postings && !m_keyToIdDelta && rows) {
+		llong lo = 0, hi = 0;
+		for (size_t i = 0; i < rows; ++i) {
+			llong d = llong(m_keyToId.get(i)) - llong(i);
+			lo = std::min(lo, d);
+			hi = std::max(hi, d);
+		}
+		delta.resize_with_wire_max_val(rows, ullong(hi - lo));
+		if (delta.uintbits() < m_keyToId.uintbits()) {
+			for (size_t i = 0; i < rows; ++i) {
+				delta.set_wire(i, size_t(llong(m_keyToId.get(i)) - llong(i) - lo));
+			}
+			keyToIdVec = &delta;
+			keyToIdDelta = true;
+			keyToIdMin = lo;
+		}
 	}
 
 	auto pathNLT = path + ".nlt";
 	m_dfa->save_mmap(pathNLT.string().c_str());
+	DbEnv::current()->fileWritten(pathNLT.string());
 
 	auto pathIdMap = path + ".idmap";
-	FileStream dio(pathIdMap.string().c_str(), "wb");
+	EnvFileStream dio(pathIdMap.string().c_str(), "wb");
 	FileHeader header;
 	memset(&header, 0, sizeof(FileHeader));
 	header.rows = uint32_t(numDataRows());
 	header.keys = uint32_t(m_dfa->num_words());
-	header.idToKeyBytesDiv16 = uint32_t(m_idToKey.mem_size()/16);
+	header.idToKeyBytesDiv16 = idToKeyVec ? uint32_t(idToKeyVec->mem_size()/16) : 0;
 	header.recBitsMemSize = uint32_t(m_recBits.mem_size());
 	header.dataInflateSize = m_dataInflateSize;
+	if (!idToKeyVec) {
+		header.flags |= FileHeader::FlagNoIdToKey;
+	}
+	if (postings) {
+		header.flags |= FileHeader::FlagPostings;
+		header.postingBytes = postData->size();
+		header.postingOffsetBits = uint32_t(postOffsets->uintbits());
+	}
+	else if (keyToIdDelta) {
+		header.flags |= FileHeader::FlagKeyToIdDelta;
+		header.keyToIdBits = uint32_t(keyToIdVec->uintbits());
+		header.keyToIdMin = keyToIdMin;
+	}
 	dio.ensureWrite(&header, sizeof(FileHeader));
-	dio.ensureWrite(m_idToKey.data(), m_idToKey.mem_size());
-	dio.ensureWrite(m_keyToId.data(), m_keyToId.mem_size());
+	if (idToKeyVec) {
+		dio.ensureWrite(idToKeyVec->data(), idToKeyVec->mem_size());
+	}
+	if (postings) {
+		dio.ensureWrite(postOffsets->data(), postOffsets->mem_size());
+		dio.ensureWrite(postData->data(), postData->size());
+	}
+	else {
+		dio.ensureWrite(keyToIdVec->data(), keyToIdVec->mem_size());
+	}
 	if (!m_isUnique) {
 		assert(m_recBits.size() >= m_dfa->num_words()+2);
 		dio.ensureWrite(m_recBits.data(), m_recBits.mem_size());
@@ -287,6 +735,7 @@ class NestLoudsTrieIndex::UniqueIndexIterForward : public IndexIterator {
 public:
 	std::unique_ptr<ADFA_LexIterator> m_iter;
 	const NestLoudsTrieIndex* m_owner;
+	UintVecMin0ReadAhead m_idBuf; // word ids are visited in order
 	bool m_hasNext;
 
 	UniqueIndexIterForward(const NestLoudsTrieIndex* owner) {
@@ -304,7 +753,7 @@ public:
 		if (m_hasNext) {
 			size_t state = m_iter->word_state();
 			size_t dawgIdx = m_owner->m_dfa->state_to_word_id(state);
-			*id = m_owner->m_keyToId.get(dawgIdx);
+			*id = m_owner->keyToId(m_idBuf, dawgIdx);
 			key->assign(m_iter->word());
 			m_hasNext = m_iter->incr();
 			return true;
@@ -317,7 +766,7 @@ public:
 		if (m_iter->seek_lower_bound(key)) {
 			size_t state = m_iter->word_state();
 			size_t dawgIdx = m_owner->m_dfa->state_to_word_id(state);
-			*id = m_owner->m_keyToId.get(dawgIdx);
+			*id = m_owner->keyToId(m_idBuf, dawgIdx);
 			retKey->assign(m_iter->word());
 			int ret = (m_iter->word() == key) ? 0 : 1;
 			m_hasNext = m_iter->incr();
@@ -333,7 +782,7 @@ public:
 		size_t matchLen = m_iter->seek_max_prefix(key);
 		size_t state = m_iter->word_state();
 		size_t dawgIdx = m_owner->m_dfa->state_to_word_id(state);
-		*id = m_owner->m_keyToId.get(dawgIdx);
+		*id = m_owner->keyToId(m_idBuf, dawgIdx);
 		retKey->assign(m_iter->word());
 		m_hasNext = m_iter->incr();
 		return matchLen;
@@ -361,7 +810,7 @@ public:
 		if (m_hasNext) {
 			size_t state = m_iter->word_state();
 			size_t dawgIdx = m_owner->m_dfa->state_to_word_id(state);
-			*id = m_owner->m_keyToId.get(dawgIdx);
+			*id = m_owner->keyToId(dawgIdx);
 			key->assign(m_iter->word());
 			m_hasNext = m_iter->decr();
 			return true;
@@ -375,7 +824,7 @@ public:
 			if (m_iter->word() == key) {
 				size_t state = m_iter->word_state();
 				size_t dawgIdx = m_owner->m_dfa->state_to_word_id(state);
-				*id = m_owner->m_keyToId.get(dawgIdx);
+				*id = m_owner->keyToId(dawgIdx);
 				retKey->assign(key);
 				m_hasNext = m_iter->decr();
 				return 0;
@@ -394,7 +843,7 @@ public:
 		size_t matchLen = m_iter->seek_max_prefix(key);
 		size_t state = m_iter->word_state();
 		size_t dawgIdx = m_owner->m_dfa->state_to_word_id(state);
-		*id = m_owner->m_keyToId.get(dawgIdx);
+		*id = m_owner->keyToId(dawgIdx);
 		retKey->assign(m_iter->word());
 		m_hasNext = m_iter->decr();
 		return matchLen;
@@ -407,6 +856,7 @@ public:
 class NestLoudsTrieIndex::DupableIndexIterForward : public IndexIterator {
 	std::unique_ptr<ADFA_LexIterator> m_iter;
 	const NestLoudsTrieIndex* m_owner;
+	UintVecMin0ReadAhead m_idBuf; // word ids are visited in order
 	size_t m_bitPosCur;
 	size_t m_bitPosUpp;
 	bool m_hasNext;
@@ -439,7 +889,7 @@ public:
 		assert(nullptr != key);
 		if (m_hasNext) {
 			assert(m_bitPosCur < m_bitPosUpp);
-			*id = m_owner->m_keyToId.get(m_bitPosCur++);
+			*id = m_owner->keyToId(m_idBuf, m_bitPosCur++);
 			key->assign(m_iter->word());
 			if (m_bitPosCur == m_bitPosUpp)
 				syncBitPos(m_iter->incr());
@@ -452,7 +902,7 @@ public:
 		assert(nullptr != retKey);
 		if (m_iter->seek_lower_bound(key)) {
 			syncBitPos(true);
-			*id = m_owner->m_keyToId.get(m_bitPosCur++);
+			*id = m_owner->keyToId(m_idBuf, m_bitPosCur++);
 			retKey->assign(m_iter->word());
 			int ret = (m_iter->word() == key) ? 0 : 1;
 			if (m_bitPosCur == m_bitPosUpp)
@@ -480,7 +930,7 @@ public:
 					goto NotFoundUpperBound;
 			}
 			syncBitPos(true);
-			*id = m_owner->m_keyToId.get(m_bitPosCur++);
+			*id = m_owner->keyToId(m_idBuf, m_bitPosCur++);
 			retKey->assign(m_iter->word());
 			if (m_bitPosCur == m_bitPosUpp)
 				syncBitPos(m_iter->incr());
@@ -498,7 +948,7 @@ public:
 		assert(nullptr != retKey);
 		size_t matchLen = m_iter->seek_max_prefix(key);
 		syncBitPos(true);
-		*id = m_owner->m_keyToId.get(m_bitPosCur++);
+		*id = m_owner->keyToId(m_idBuf, m_bitPosCur++);
 		retKey->assign(m_iter->word());
 		if (m_bitPosCur == m_bitPosUpp)
 			syncBitPos(m_iter->incr());
@@ -541,7 +991,7 @@ public:
 		assert(nullptr != key);
 		if (m_hasNext) {
 			assert(m_bitPosCur > m_bitPosLow);
-			*id = m_owner->m_keyToId.get(--m_bitPosCur);
+			*id = m_owner->keyToId(--m_bitPosCur);
 			key->assign(m_iter->word());
 			if (m_bitPosCur == m_bitPosLow)
 				syncBitPos(m_iter->decr());
@@ -556,7 +1006,7 @@ public:
 		if (hasForwardLowerBound) {
 			if (m_iter->word() == key) {
 				syncBitPos(true);
-				*id = m_owner->m_keyToId.get(--m_bitPosCur);
+				*id = m_owner->keyToId(--m_bitPosCur);
 				retKey->assign(key);
 				if (m_bitPosCur == m_bitPosLow)
 					syncBitPos(m_iter->decr());
@@ -580,7 +1030,7 @@ public:
 				return -1;
 			}
 			syncBitPos(true);
-			*id = m_owner->m_keyToId.get(--m_bitPosCur);
+			*id = m_owner->keyToId(--m_bitPosCur);
 			retKey->assign(m_iter->word());
 			if (m_bitPosCur == m_bitPosLow)
 				syncBitPos(m_iter->decr());
@@ -597,7 +1047,7 @@ public:
 		assert(nullptr != retKey);
 		size_t matchLen = m_iter->seek_max_prefix(key);
 		syncBitPos(true);
-		*id = m_owner->m_keyToId.get(--m_bitPosCur);
+		*id = m_owner->keyToId(--m_bitPosCur);
 		retKey->assign(m_iter->word());
 		if (m_bitPosCur == m_bitPosLow)
 			syncBitPos(m_iter->decr());
@@ -605,6 +1055,83 @@ public:
 	}
 };
 
+// word ids of dawg are in lex order, m_recBits maps word id to m_keyToId
+std::pair<size_t, size_t>
+NestLoudsTrieIndex::mapRange(fstring lo, fstring hi) const {
+	auto dawg = m_dfa->get_dawg();
+	assert(dawg);
+	const size_t wordNum = dawg->num_words();
+	std::unique_ptr<ADFA_LexIterator> iter(m_dfa->adfa_make_iter());
+	auto lowerBound = [&](fstring key) {
+		if (iter->seek_lower_bound(key))
+			return m_dfa->state_to_word_id(iter->word_state());
+		else
+			return wordNum;
+	};
+	size_t beg = lo.empty() ? 0 : lowerBound(lo);
+	size_t end = hi.empty() ? wordNum : lowerBound(hi);
+	if (end < beg) {
+		end = beg;
+	}
+	if (!m_isUnique) {
+		assert(m_recBits.size() >= wordNum+2);
+		beg = m_recBits.select1(beg); // select1(wordNum) is the guard bit
+		end = m_recBits.select1(end);
+	}
+	return std::make_pair(beg, end);
+}
+
+llong NestLoudsTrieIndex::countRange(fstring lo, fstring hi, DbContext*) const {
+	auto range = mapRange(lo, hi);
+	return llong(range.second - range.first);
+}
+
+llong NestLoudsTrieIndex::scanRange(fstring lo, fstring hi,
+									const std::function<bool(llong)>& onRecord,
+									DbContext*)
+const {
+	auto range = mapRange(lo, hi);
+	llong cnt = 0;
+	for (size_t i = range.first; i < range.second; ++i) {
+		++cnt;
+		if (!onRecord(keyToId(i)))
+			break;
+	}
+	return cnt;
+}
+
+// the lex iterator walks the subtrie of prefix, keys are not copied
+llong NestLoudsTrieIndex::scanPrefix(fstring prefix,
+							const std::function<bool(fstring, llong)>& onKey,
+							DbContext*)
+const {
+	std::unique_ptr<ADFA_LexIterator> iter(m_dfa->adfa_make_iter());
+	llong cnt = 0;
+	bool hasWord = iter->seek_lower_bound(prefix);
+	while (hasWord) {
+		fstring word = iter->word();
+		if (!word.startsWith(prefix))
+			break;
+		size_t dawgIdx = m_dfa->state_to_word_id(iter->word_state());
+		if (m_isUnique) {
+			++cnt;
+			if (!onKey(word, keyToId(dawgIdx)))
+				break;
+		}
+		else {
+			size_t bitPosLow = m_recBits.select1(dawgIdx);
+			size_t bitPosHig = m_recBits.zero_seq_len(bitPosLow + 1) + bitPosLow + 1;
+			for (size_t mapId = bitPosLow; mapId < bitPosHig; ++mapId) {
+				++cnt;
+				if (!onKey(word, keyToId(mapId)))
+					return cnt;
+			}
+		}
+		hasWord = iter->incr();
+	}
+	return cnt;
+}
+
 IndexIterator* NestLoudsTrieIndex::createIndexIterForward(DbContext*) const {
 	if (this->m_isUnique)
 		return new UniqueIndexIterForward(this);
@@ -639,6 +1166,50 @@ public:
 	bool matchText(fstring text) override {
 		return m_dfa->first_mismatch_pos(text) == text.size();
 	}
+	// min ch > after which has a move from state, 256 if none
+	size_t nextMove(size_t state, int after) const {
+		for (int ch = after + 1; ch < 256; ++ch) {
+			if (m_dfa->state_move(state, ch) != m_dfa->nil_state)
+				return ch;
+		}
+		return 256;
+	}
+	// keys between key and *next die in the dfa, they are never matched
+	bool matchOrNext(fstring key, valvec<byte>* next) override {
+		static thread_local valvec<size_t> tls_states;
+		tls_states.resize_no_init(key.size() + 1);
+		size_t* states = tls_states.data();
+		size_t depth = 0;
+		states[0] = initial_state;
+		while (depth < key.size()) {
+			size_t s = m_dfa->state_move(states[depth], key.uch(depth));
+			if (m_dfa->nil_state == s)
+				break;
+			states[++depth] = s;
+		}
+		next->erase_all();
+		if (depth == key.size()) {
+			if (matchText(key))
+				return true;
+			size_t ch = nextMove(states[depth], -1);
+			if (ch < 256) {
+				next->assign(key.udata(), key.size());
+				next->push_back(byte(ch));
+				return false;
+			}
+		}
+		// greater char at the deepest position which has one
+		for (size_t i = std::min(depth + 1, key.size()); i > 0; ) {
+			--i;
+			size_t ch = nextMove(states[i], key.uch(i));
+			if (ch < 256) {
+				next->assign(key.udata(), i);
+				next->push_back(byte(ch));
+				return false;
+			}
+		}
+		return false;
+	}
 	std::unique_ptr<AdapterRegexDFA> m_dfa;
 };
 REGISTER_RegexForIndex(DfaDB_RegexForIndex, "DfaDB", "dfadb");
@@ -659,17 +1230,21 @@ bool NestLoudsTrieIndex::matchRegexAppend(RegexForIndex* regex,
 	if (m_isUnique) {
 		for(size_t state : matchStates) {
 			size_t keyId = m_dfa->state_to_word_id(state);
-			size_t recId = m_keyToId[keyId];
+			size_t recId = keyToId(keyId);
 			recIdvec->push_back(recId);
 		}
 	}
 	else {
-		for(size_t state : matchStates) {
-			size_t keyId = m_dfa->state_to_word_id(state);
-			size_t bitPosLow = m_recBits.select1(keyId);
+		// map states to word ids in place, then select them by one batch
+		valvec<size_t> bitPos(matchStates.size(), valvec_no_init());
+		for(size_t i = 0; i < matchStates.size(); ++i) {
+			matchStates[i] = m_dfa->state_to_word_id(matchStates[i]);
+		}
+		m_recBits.select1_batch(matchStates.data(), matchStates.size(), bitPos.data());
+		for(size_t bitPosLow : bitPos) {
 			size_t bitPosHig = m_recBits.zero_seq_len(bitPosLow + 1) + bitPosLow + 1;
 			for(size_t mapId = bitPosLow; mapId < bitPosHig; ++mapId) {
-				size_t recId = m_keyToId[mapId];
+				size_t recId = keyToId(mapId);
 				recIdvec->push_back(recId);
 			}
 		}
@@ -4,6 +4,7 @@
 #include <terark/int_vector.hpp>
 #include <terark/rank_select.hpp>
 #include <terark/fsa/nest_trie_dawg.hpp>
+#include <mutex>
 
 namespace terark {
 //	class Nest
@@ -21,11 +22,22 @@ public:
 	llong indexStorageSize() const override;
 
 	void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override;
+	void searchExactAppendBatch(const fstring* keys, size_t num,
+								valvec<llong>* recIdvec, size_t* offsets,
+								DbContext*) const override;
 	///@}
 
 	IndexIterator* createIndexIterForward(DbContext*) const override;
 	IndexIterator* createIndexIterBackward(DbContext*) const override;
 
+	llong countRange(fstring lo, fstring hi, DbContext*) const override;
+	llong scanRange(fstring lo, fstring hi,
+					const std::function<bool(llong recId)>& onRecord,
+					DbContext*) const override;
+	llong scanPrefix(fstring prefix,
+					 const std::function<bool(fstring key, llong recId)>& onKey,
+					 DbContext*) const override;
+
 	ReadableIndex* getReadableIndex() override;
 	ReadableStore* getReadableStore() override;
 
@@ -41,16 +53,84 @@ public:
 
 	bool matchRegexAppend(RegexForIndex* regex, valvec<llong>* recIdvec, DbContext*) const override;
 
+	// a dupable map may be saved as posting blocks of PostingBlock ids, a
+	// block is stream-vbyte of its first id then zigzag deltas, so ids of
+	// one key are small deltas, m_postOffsets are skips to the blocks
+	static const size_t PostingBlock = 16;
+	// the last decoded block of sequential readers
+	struct PostingBuf {
+		size_t   block = size_t(-1);
+		uint32_t ids[PostingBlock];
+	};
+
+	// recIds of one key in ascending order, they are decoded lazily
+	class PostingCursor {
+		friend class NestLoudsTrieIndex;
+		const NestLoudsTrieIndex* m_owner;
+		size_t m_pos; // map pos of id()
+		size_t m_end;
+		size_t m_id;
+		PostingBuf m_buf;
+	public:
+		PostingCursor() : m_owner(NULL), m_pos(0), m_end(0), m_id(0) {}
+		bool valid() const { return m_pos < m_end; }
+		llong id() const { assert(valid()); return llong(m_id); }
+		size_t remain() const { return m_end - m_pos; }
+		void next();
+		/// to the first id >= minId, never move backward
+		void seek(llong minId);
+	};
+	///@returns false if key is not found, then cur is not valid()
+	bool postingCursor(fstring key, PostingCursor* cur) const;
+	/// appends ids which are in all cursors, cursors are consumed
+	static void intersectPostings(PostingCursor* curs, size_t num, valvec<llong>* out);
+
 protected:
 	void build(SortableStrVec& strVec);
 
+	// [beg, end) of m_keyToId for keys in [lo, hi)
+	std::pair<size_t, size_t> mapRange(fstring lo, fstring hi) const;
+
+	// m_keyToId of a near sorted map is saved as delta to identity
+	size_t unzipKeyToId(size_t i, size_t val) const {
+		return m_keyToIdDelta ? size_t(llong(val + i) + m_keyToIdMin) : val;
+	}
+	size_t keyToId(size_t i) const {
+		if (m_postings)
+			return postingGet(i);
+		return unzipKeyToId(i, m_keyToId.get(i));
+	}
+	size_t keyToId(UintVecMin0ReadAhead& buf, size_t i) const {
+		if (m_postings)
+			return postingGet(i);
+		return unzipKeyToId(i, buf.get(m_keyToId, i));
+	}
+	void decodePostingBlock(size_t block, uint32_t* ids) const;
+	size_t postingGet(size_t pos) const;
+	// id at pos, the block of pos is decoded into buf if it is not in buf
+	size_t keyToIdNext(size_t pos, PostingBuf* buf) const;
+	bool buildPostings(UintVecMin0* offsets, valvec<byte>* data) const;
+	// m_idToKey is not saved if schema.m_nltLazyIdToKey, it is built from
+	// m_keyToId and m_recBits on the first id to key access
+	const UintVecMin0& idToKey() const;
+	void buildIdToKey() const;
+
 	struct FileHeader;
 	std::unique_ptr<NestLoudsTrieDAWG_SE_512> m_dfa;
+	byte*       m_dfaMem; // huge page copy of the dfa file if schema.m_nltHugePage
+	size_t      m_dfaMemSize;
 	FileHeader* m_idmapBase;
 	size_t      m_idmapSize;
 	size_t      m_dataInflateSize;
 	UintVecMin0 m_keyToId;
-	UintVecMin0 m_idToKey;
+	mutable UintVecMin0 m_idToKey;
+	mutable std::once_flag m_idToKeyOnce;
+	bool        m_lazyIdToKey; // m_idToKey is not loaded
+	bool        m_keyToIdDelta;
+	bool        m_postings; // m_keyToId is empty
+	llong       m_keyToIdMin;
+	UintVecMin0  m_postOffsets;
+	valvec<byte> m_postData;
 	rank_select_se_512 m_recBits; // only for dupable index
 	const Schema& m_schema;
 
@@ -1,7 +1,10 @@
 #include "nlt_store.hpp"
+#include <terark/db/db_env.hpp>
 #include <terark/int_vector.hpp>
 #include <terark/num_to_str.hpp>
 #include <terark/fsa/fsa.hpp>
+#include <terark/io/FileStream.hpp>
+#include <boost/filesystem.hpp>
 #include <typeinfo>
 #include <float.h>
 #include <mutex>
@@ -36,6 +39,15 @@ void NestLoudsTrieStore::getValueAppend(llong id, valvec<byte>* val, DbContext*
 	m_store->get_record_append(size_t(id), val);
 }
 
+void NestLoudsTrieStore::getValuesAppendBatch(const llong* ids, size_t num,
+											  valvec<byte>* vals, DbContext*)
+const {
+	const BlobStore* store = m_store.get();
+	for (size_t i = 0; i < num; ++i) {
+		store->get_record_append(size_t(ids[i]), &vals[i]);
+	}
+}
+
 StoreIterator* NestLoudsTrieStore::createStoreIterForward(DbContext*) const {
 	return nullptr; // not needed
 }
@@ -108,14 +120,156 @@ createDictZipBlobStoreBuilder(const Schema& schema) {
 			(DictZipBlobStore::createZipBuilder(opt));
 }
 
+DictZipSample::DictZipSample() {
+	m_offsets.push_back(0);
+	m_recNum = 0;
+	m_recLenSum = 0;
+	memset(m_hist, 0, sizeof(m_hist));
+}
+
+void DictZipSample::addSample(fstring rec) {
+	m_data.append(rec.udata(), rec.size());
+	m_offsets.push_back(uint32_t(m_data.size()));
+	for (size_t i = 0; i < rec.size(); ++i)
+		m_hist[rec.uch(i)]++;
+}
+
+void DictZipSample::addProbe(fstring rec) {
+	addRecordLen(rec.size());
+	for (size_t i = 0; i < rec.size(); ++i)
+		m_hist[rec.uch(i)]++;
+}
+
+// probe records evenly distributed in physic id space, deleted records
+// are also probed, they are just for statistics
+void DictZipSample::probe(StoreIterator& iter, size_t probeNum) {
+	llong rows = iter.getStore()->numDataRows();
+	llong prevId = -1;
+	valvec<byte> rec;
+	for (size_t k = 0; k < probeNum; ++k) {
+		llong id = llong(double(rows) * k / probeNum);
+		if (id <= prevId)
+			continue;
+		if (iter.seekExact(id, &rec))
+			addProbe(rec);
+		prevId = id;
+	}
+	iter.reset();
+}
+
+// average record length is within 25%, and total variation distance of
+// byte distributions is less than 0.1
+bool DictZipSample::isSimilarTo(const DictZipSample& y) const {
+	if (0 == m_recNum || 0 == y.m_recNum)
+		return false;
+	double avgLen1 = double(m_recLenSum) / m_recNum;
+	double avgLen2 = double(y.m_recLenSum) / y.m_recNum;
+	if (avgLen1 > avgLen2 * 1.25 || avgLen2 > avgLen1 * 1.25)
+		return false;
+	ullong sum1 = 0, sum2 = 0;
+	for (size_t i = 0; i < 256; ++i) {
+		sum1 += m_hist[i];
+		sum2 += y.m_hist[i];
+	}
+	if (0 == sum1 || 0 == sum2)
+		return sum1 == sum2;
+	double dist = 0;
+	for (size_t i = 0; i < 256; ++i) {
+		dist += std::abs(double(m_hist[i]) / sum1 - double(y.m_hist[i]) / sum2);
+	}
+	return dist / 2 < 0.1;
+}
+
+void DictZipSample::feed(DictZipBlobStore::ZipBuilder& builder) const {
+	for (size_t i = 0; i < sampleNum(); ++i) {
+		builder.addSample(fstring(m_data.data() + m_offsets[i],
+								  m_offsets[i+1] - m_offsets[i]));
+	}
+}
+
+namespace {
+struct DictZipSampleHeader {
+	char   magic[16];
+	ullong sampleNum;
+	ullong dataBytes;
+	ullong recNum;
+	ullong recLenSum;
+	ullong hist[256];
+};
+const char g_dictZipSampleMagic[] = "terark-dictzip";
+}
+
+void DictZipSample::save(fstring fpath) const {
+	DictZipSampleHeader h;
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, g_dictZipSampleMagic);
+	h.sampleNum = sampleNum();
+	h.dataBytes = m_data.size();
+	h.recNum = m_recNum;
+	h.recLenSum = m_recLenSum;
+	memcpy(h.hist, m_hist, sizeof(m_hist));
+	EnvFileStream fp(fpath.c_str(), "wb");
+	fp.ensureWrite(&h, sizeof(h));
+	fp.ensureWrite(m_offsets.data(), m_offsets.used_mem_size());
+	fp.ensureWrite(m_data.data(), m_data.size());
+}
+
+bool DictZipSample::load(fstring fpath) {
+	if (!boost::filesystem::exists(fpath.c_str()))
+		return false;
+	try {
+		DictZipSampleHeader h;
+		FileStream fp(fpath.c_str(), "rb");
+		fp.ensureRead(&h, sizeof(h));
+		if (strcmp(h.magic, g_dictZipSampleMagic) != 0 || 0 == h.sampleNum) {
+			fprintf(stderr, "WARN: DictZipSample::load(%s): bad file\n", fpath.c_str());
+			return false;
+		}
+		m_offsets.resize_no_init(size_t(h.sampleNum + 1));
+		m_data.resize_no_init(size_t(h.dataBytes));
+		fp.ensureRead(m_offsets.data(), m_offsets.used_mem_size());
+		fp.ensureRead(m_data.data(), m_data.size());
+		if (m_offsets[0] != 0 || m_offsets.back() != h.dataBytes) {
+			fprintf(stderr, "WARN: DictZipSample::load(%s): bad offsets\n", fpath.c_str());
+			return false;
+		}
+		m_recNum = h.recNum;
+		m_recLenSum = h.recLenSum;
+		memcpy(m_hist, h.hist, sizeof(m_hist));
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "WARN: DictZipSample::load(%s): %s\n", fpath.c_str(), ex.what());
+		return false;
+	}
+	return true;
+}
+
 void
 NestLoudsTrieStore::build_by_iter(const Schema& schema, PathRef fpath,
 								  StoreIterator& iter,
 								  const bm_uint_t* isDel,
-								  const febitvec* isPurged) {
+								  const febitvec* isPurged,
+								  fstring reuseDict) {
 	TERARK_RT_assert(schema.m_dictZipSampleRatio >= 0, std::invalid_argument);
 	std::unique_ptr<DictZipBlobStore::ZipBuilder>
 	builder(createDictZipBlobStoreBuilder(schema));
+	DictZipSample sample; // filled only if schema.m_dictZipReuse
+	bool reused = false;
+	if (schema.m_dictZipReuse && !reuseDict.empty() && sample.load(reuseDict)) {
+		DictZipSample probe;
+		probe.probe(iter, 1024);
+		reused = sample.isSimilarTo(probe);
+		fprintf(stderr, "INFO: %s: %s dict samples of %s\n"
+			, fpath.string().c_str(), reused ? "reuse" : "retrain, changed"
+			, reuseDict.c_str());
+		if (!reused)
+			sample = DictZipSample();
+	}
+	auto addSample = [&](fstring rec) {
+		builder->addSample(rec);
+		if (schema.m_dictZipReuse)
+			sample.addSample(rec);
+	};
 	double sampleRatio = schema.m_dictZipSampleRatio > FLT_EPSILON
 					   ? schema.m_dictZipSampleRatio : 0.05;
 	{
@@ -154,15 +308,21 @@ NestLoudsTrieStore::build_by_iter(const Schema& schema, PathRef fpath,
 	if (NULL == isPurged || isPurged->size() == 0) {
 		llong recId;
 		size_t sampled = 0;
-		while (iter.increment(&recId, &rec)) {
+		if (reused) {
+			sample.feed(*builder);
+			recId = iter.getStore()->numDataRows() - 1;
+		}
+		else while (iter.increment(&recId, &rec)) {
 			if (NULL == isDel || !terark_bit_test(isDel, recId)) {
+				sample.addRecordLen(rec.size());
 				if (!rec.empty() && random() < sampleUpperBound) {
-					builder->addSample(rec);
+					addSample(rec);
 					sampled++;
 				}
 			}
 		}
-		emptyCheckProtect(sampled, rec, *builder);
+		if (!reused)
+			emptyCheckProtect(sampled, rec, *builder);
 		lock.lock(); // start lock
 		builder->prepare(recId + 1, fpath.string());
 		iter.reset();
@@ -180,7 +340,17 @@ NestLoudsTrieStore::build_by_iter(const Schema& schema, PathRef fpath,
 		size_t physicNum = iter.getStore()->numDataRows();
 		size_t sampled = 0;
 		const bm_uint_t* isPurgedptr = isPurged->bldata();
-		for (size_t logicId = 0; logicId < logicNum; ++logicId) {
+		if (reused) {
+			sample.feed(*builder);
+			for (size_t logicId = 0; logicId < logicNum; ++logicId) {
+				if (!terark_bit_test(isPurgedptr, logicId)) {
+					if (!terark_bit_test(isDel, logicId))
+						newPhysicId++;
+					physicId++;
+				}
+			}
+		}
+		else for (size_t logicId = 0; logicId < logicNum; ++logicId) {
 			if (!terark_bit_test(isPurgedptr, logicId)) {
 				if (!terark_bit_test(isDel, logicId)) {
 					bool hasData = iter.seekExact(physicId, &rec);
@@ -194,8 +364,9 @@ NestLoudsTrieStore::build_by_iter(const Schema& schema, PathRef fpath,
 				//	if (hasData && rec.empty()) {
 				//		hasData = false;
 				//	}
+					sample.addRecordLen(rec.size());
 					if (!rec.empty() && random() < sampleUpperBound) {
-						builder->addSample(rec);
+						addSample(rec);
 						sampled++;
 					}
 					newPhysicId++;
@@ -208,7 +379,8 @@ NestLoudsTrieStore::build_by_iter(const Schema& schema, PathRef fpath,
 				, "ERROR: %s:%d: physicId != physicNum: physicId = %lld, physicNum = %zd, logicNum = %zd\n"
 				, __FILE__, __LINE__, physicId, physicNum, logicNum);
 		}
-		emptyCheckProtect(sampled, rec, *builder);
+		if (!reused)
+			emptyCheckProtect(sampled, rec, *builder);
 		lock.lock(); // start lock
 		builder->prepare(newPhysicId, fpath.string());
 		iter.reset();
@@ -238,6 +410,11 @@ NestLoudsTrieStore::build_by_iter(const Schema& schema, PathRef fpath,
 	}
 	m_store.reset(builder->finish());
 	builder.reset(); // explicit destory builder, before lock.unlock
+	if (schema.m_dictZipReuse && sample.sampleNum()) {
+		sample.save(fpath.string() + "-dict");
+	}
+	lock.unlock(); // other builders do not wait for the rate limit
+	DbEnv::current()->fileWritten(fpath.string());
 }
 
 void NestLoudsTrieStore::load(PathRef path) {
@@ -265,6 +442,7 @@ void NestLoudsTrieStore::save(PathRef path) const {
 	else {
 		THROW_STD(invalid_argument, "Unexpected");
 	}
+	DbEnv::current()->fileWritten(fpath);
 }
 
 }}} // namespace terark::db::dfadb
@@ -19,12 +19,15 @@ public:
 	llong dataInflateSize() const override;
 	llong numDataRows() const override;
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	void getValuesAppendBatch(const llong* ids, size_t num,
+							  valvec<byte>* vals, DbContext*) const override;
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
 
 	void build(const Schema&, SortableStrVec& strVec);
 	void build_by_iter(const Schema&, PathRef fpath, StoreIterator& iter,
-					   const bm_uint_t* isDel, const febitvec* isPurged);
+					   const bm_uint_t* isDel, const febitvec* isPurged,
+					   fstring reuseDict = fstring());
 	void load(PathRef path) override;
 	void save(PathRef path) const override;
 
@@ -36,5 +39,29 @@ protected:
 std::unique_ptr<DictZipBlobStore::ZipBuilder>
 createDictZipBlobStoreBuilder(const Schema& schema);
 
+// Training samples of a DictZipBlobStore with byte statistics, saved as
+// "<store file>-dict" if schema.m_dictZipReuse. A later build can feed the
+// saved samples to the builder instead of sampling the input again, when
+// the statistics of a few probed input records are close to the saved.
+class DictZipSample {
+public:
+	valvec<byte>     m_data;    // concatenated samples
+	valvec<uint32_t> m_offsets; // size is sampleNum + 1
+	ullong m_recNum;    // records which are sampled from or probed
+	ullong m_recLenSum;
+	ullong m_hist[256]; // byte histogram of samples or probed records
+
+	DictZipSample();
+	size_t sampleNum() const { return m_offsets.size() - 1; }
+	void addRecordLen(size_t len) { m_recNum++; m_recLenSum += len; }
+	void addSample(fstring rec);
+	void addProbe(fstring rec);
+	void probe(StoreIterator& iter, size_t probeNum);
+	bool isSimilarTo(const DictZipSample& y) const;
+	void feed(DictZipBlobStore::ZipBuilder& builder) const;
+	void save(fstring fpath) const;
+	bool load(fstring fpath); // false if missing or bad
+};
+
 
 }}} // namespace terark::db::dfadb
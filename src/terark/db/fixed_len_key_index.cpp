@@ -1,7 +1,11 @@
 #include "fixed_len_key_index.hpp"
+#include "db_env.hpp"
 #include <terark/io/FileStream.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/util/mmap.hpp>
+#include <terark/util/bsearch.hpp>
+#include <boost/filesystem.hpp>
+#include <limits>
 
 namespace terark { namespace db {
 
@@ -12,13 +16,19 @@ FixedLenKeyIndex::FixedLenKeyIndex(const Schema& schema) : m_schema(schema) {
 	m_mmapSize = 0;
 	m_fixedLen = 0;
 	m_uniqKeys = 0;
+	m_modelError = 0;
+	m_blockLayout = false;
 }
 
 FixedLenKeyIndex::~FixedLenKeyIndex() {
 	if (m_mmapBase) {
 		m_keys.risk_release_ownership();
 		m_index.risk_release_ownership();
-		mmap_close(m_mmapBase, m_mmapSize);
+		m_blockFirstKeys.risk_release_ownership();
+		m_blockOffset.risk_release_ownership();
+		m_blockPrefixLen.risk_release_ownership();
+		m_rank.risk_release_ownership();
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
 	}
 }
 
@@ -32,7 +42,37 @@ ReadableIndex* FixedLenKeyIndex::getReadableIndex() {
 
 ///@{ ordered and unordered index
 llong FixedLenKeyIndex::indexStorageSize() const {
-	return m_index.mem_size();
+	return m_index.mem_size() + m_modelKeys.used_mem_size()
+		+ m_modelSegs.used_mem_size();
+}
+
+// key of sorted pos, buf is used only by block layout
+inline const byte* FixedLenKeyIndex::sortedKey(size_t pos, byte* buf) const {
+	size_t fixlen = m_fixedLen;
+	if (!m_blockLayout) {
+		return m_keys.data() + fixlen * m_index[pos];
+	}
+	size_t b = pos / BlockKeys;
+	size_t p = m_blockPrefixLen[b];
+	size_t suffixLen = fixlen - p;
+	memcpy(buf, m_blockFirstKeys.data() + fixlen * b, p);
+	memcpy(buf + p, m_keys.data() + m_blockOffset[b]
+			+ suffixLen * (pos % BlockKeys), suffixLen);
+	return buf;
+}
+
+void FixedLenKeyIndex::getSortedKeyAppend(size_t pos, valvec<byte>* key) const {
+	size_t fixlen = m_fixedLen;
+	size_t oldsize = key->size();
+	key->resize_no_init(oldsize + fixlen);
+	byte* dst = key->data() + oldsize;
+	const byte* src = sortedKey(pos, dst);
+	if (src != dst) {
+		memcpy(dst, src, fixlen);
+	}
+	if (m_schema.m_needEncodeToLexByteComparable) {
+		m_schema.byteLexDecode(dst, fixlen);
+	}
 }
 
 void
@@ -46,12 +86,9 @@ const {
 		key.p = (char*)cvtbuf;
 	}
 	size_t j = searchLowerBound(key);
-	size_t id;
-	const  byte* keysData = m_keys.data();
-	while (j < m_index.size() && 
-		   memcmp(keysData + f*(id=m_index[j]), key.p, f) == 0)
-	{
-		recIdvec->push_back(id);
+	byte*  keybuf = (byte*)alloca(f);
+	while (j < m_index.size() && memcmp(sortedKey(j, keybuf), key.p, f) == 0) {
+		recIdvec->push_back(m_index[j]);
 		++j;
 	}
 }
@@ -84,52 +121,307 @@ size_t FixedLenKeyIndex::searchUpperBound_cvt(fstring key) const {
 
 size_t FixedLenKeyIndex::searchLowerBound(fstring key) const {
 	assert(key.size() == m_fixedLen);
+	if (m_blockLayout) {
+		return blockSearchBound(key, false);
+	}
 	auto indexData = m_index.data();
 	auto indexBits = m_index.uintbits();
 	auto indexMask = m_index.uintmask();
 	auto keysData = m_keys.data();
 	size_t fixlen = m_fixedLen;
 	size_t i = 0, j = m_index.size();
-	while (i < j) {
-		size_t mid = (i + j) / 2;
-		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, mid);
-		const byte* hitKey = keysData + fixlen * hitPos;
-		if (memcmp(hitKey, key.p, fixlen) < 0)
-			i = mid + 1;
-		else
-			j = mid;
+	if (!m_modelKeys.empty()) {
+		modelSearchRange(key, false, &i, &j);
 	}
-	return i;
+	return i + branchless_lower_bound_fn(j - i,
+		[=](size_t k) {
+			size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, i + k);
+			const byte* hitKey = keysData + fixlen * hitPos;
+			return memcmp(hitKey, key.p, fixlen) < 0;
+		},
+		[=](size_t k) {
+			bsearch_prefetch(indexData + (i + k) * indexBits / 8);
+		});
 }
 
 size_t FixedLenKeyIndex::searchUpperBound(fstring key) const {
 	assert(key.size() == m_fixedLen);
+	if (m_blockLayout) {
+		return blockSearchBound(key, true);
+	}
 	auto indexData = m_index.data();
 	auto indexBits = m_index.uintbits();
 	auto indexMask = m_index.uintmask();
 	auto keysData = m_keys.data();
 	size_t fixlen = m_fixedLen;
 	size_t i = 0, j = m_index.size();
-	while (i < j) {
-		size_t mid = (i + j) / 2;
-		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, mid);
-		const byte* hitKey = keysData + fixlen * hitPos;
-		if (memcmp(hitKey, key.p, fixlen) <= 0)
-			i = mid + 1;
-		else
-			j = mid;
+	if (!m_modelKeys.empty()) {
+		modelSearchRange(key, true, &i, &j);
+	}
+	return i + branchless_lower_bound_fn(j - i,
+		[=](size_t k) {
+			size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, i + k);
+			const byte* hitKey = keysData + fixlen * hitPos;
+			return memcmp(hitKey, key.p, fixlen) <= 0;
+		},
+		[=](size_t k) {
+			bsearch_prefetch(indexData + (i + k) * indexBits / 8);
+		});
+}
+
+// big endian prefix, keeps byte lex order
+uint64_t FixedLenKeyIndex::keyPrefix(const byte* key) const {
+	size_t n = std::min<size_t>(m_fixedLen, 8);
+	uint64_t x = 0;
+	for (size_t k = 0; k < n; ++k)
+		x = x << 8 | key[k];
+	return n < 8 ? x << (8 * (8 - n)) : x;
+}
+
+// shrinking cone: a segment is extended while one slope keeps every
+// first position of a distinct prefix within m_modelError
+void FixedLenKeyIndex::buildModel() {
+	const size_t rows = m_index.size();
+	const byte*  keysData = m_keys.data();
+	const size_t fixlen = m_fixedLen;
+	const double maxErr = double(m_modelError);
+	const double inf = std::numeric_limits<double>::infinity();
+	m_modelKeys.erase_all();
+	m_modelSegs.erase_all();
+	uint64_t x0 = 0, prevX = 0;
+	double slopeLo = 0, slopeHi = inf;
+	auto finishSeg = [&]() {
+		m_modelSegs.back().slope = slopeHi == inf ? 0 : (slopeLo + slopeHi) / 2;
+	};
+	for (size_t i = 0; i < rows; ++i) {
+		uint64_t x = keyPrefix(keysData + fixlen * m_index[i]);
+		if (i && x == prevX)
+			continue;
+		prevX = x;
+		if (i) {
+			double dx = double(x - x0);
+			double y = double(i - m_modelSegs.back().pos);
+			double lo = (y - maxErr) / dx;
+			double hi = (y + maxErr) / dx;
+			if (lo <= slopeHi && hi >= slopeLo) {
+				slopeLo = std::max(slopeLo, lo);
+				slopeHi = std::min(slopeHi, hi);
+				continue;
+			}
+			finishSeg();
+		}
+		x0 = x;
+		slopeLo = 0;
+		slopeHi = inf;
+		m_modelKeys.push_back(x);
+		m_modelSegs.push_back({0, i});
+	}
+	if (!m_modelSegs.empty())
+		finishSeg();
+	m_modelKeys.shrink_to_fit();
+	m_modelSegs.shrink_to_fit();
+}
+
+// the model is just a hint, [*lo, *hi] is widened until it
+// surely contains the lower bound(or upper bound)
+void FixedLenKeyIndex::modelSearchRange(fstring key, bool upper,
+										size_t* pLo, size_t* pHi)
+const {
+	size_t fixlen = m_fixedLen;
+	size_t rows = m_index.size();
+	byte*  keybuf = (byte*)alloca(fixlen);
+	auto less = [&](size_t pos) {
+		int cmp = memcmp(sortedKey(pos, keybuf), key.p, fixlen);
+		return upper ? cmp <= 0 : cmp < 0;
+	};
+	uint64_t x = keyPrefix((const byte*)key.p);
+	size_t k = branchless_upper_bound(m_modelKeys.data(), m_modelKeys.size(), x);
+	size_t lo, hi;
+	if (0 == k) {
+		lo = hi = 0;
+	}
+	else {
+		const ModelSeg& seg = m_modelSegs[k-1];
+		double pred = double(seg.pos) + seg.slope * double(x - m_modelKeys[k-1]);
+		size_t pos = size_t(std::min(pred, double(rows)));
+		lo = pos > m_modelError ? pos - m_modelError : 0;
+		hi = std::min(rows, pos + m_modelError + 1);
+	}
+	size_t step = m_modelError + 1;
+	while (lo > 0 && !less(lo - 1)) {
+		hi = lo - 1;
+		lo = lo > step ? lo - step : 0;
+		step *= 2;
+	}
+	while (hi < rows && less(hi)) {
+		lo = hi + 1;
+		hi = std::min(rows, hi + step);
+		step *= 2;
+	}
+	*pLo = lo;
+	*pHi = hi;
+}
+
+size_t FixedLenKeyIndex::blockSearchBound(fstring key, bool upper) const {
+	const size_t fixlen = m_fixedLen;
+	const size_t rows = m_index.size();
+	if (!m_modelKeys.empty()) {
+		byte* keybuf = (byte*)alloca(fixlen);
+		size_t i, j;
+		modelSearchRange(key, upper, &i, &j);
+		return i + branchless_lower_bound_fn(j - i, [&](size_t k) {
+			int cmp = memcmp(sortedKey(i + k, keybuf), key.p, fixlen);
+			return upper ? cmp <= 0 : cmp < 0;
+		});
+	}
+	// the bound is in the last block whose first key is less than key
+	const byte* firstKeys = m_blockFirstKeys.data();
+	size_t lo = branchless_lower_bound_fn(m_blockPrefixLen.size(),
+		[&](size_t k) {
+			int cmp = memcmp(firstKeys + fixlen * k, key.p, fixlen);
+			return upper ? cmp <= 0 : cmp < 0;
+		},
+		[&](size_t k) { bsearch_prefetch(firstKeys + fixlen * k); });
+	if (0 == lo) {
+		return 0;
+	}
+	size_t b = lo - 1;
+	size_t beg = b * BlockKeys;
+	size_t cnt = std::min(rows - beg, BlockKeys);
+	size_t p = m_blockPrefixLen[b];
+	int cmp = memcmp(firstKeys + fixlen * b, key.p, p);
+	if (cmp != 0) {
+		return cmp < 0 ? beg + cnt : beg;
+	}
+	// suffixes of a block are contiguous, 1st key is known to be less
+	size_t suffixLen = fixlen - p;
+	const byte* suffix = m_keys.data() + m_blockOffset[b];
+	const char* keySuffix = key.p + p;
+	size_t i = 1 + branchless_lower_bound_fn(cnt - 1, [&](size_t k) {
+		int c = memcmp(suffix + suffixLen * (1 + k), keySuffix, suffixLen);
+		return upper ? c <= 0 : c < 0;
+	});
+	return beg + i;
+}
+
+void FixedLenKeyIndex::buildBlockLayout() {
+	const size_t fixlen = m_fixedLen;
+	const size_t rows = m_index.size();
+	const size_t blockNum = (rows + BlockKeys - 1) / BlockKeys;
+	const byte*  data = m_keys.data();
+	valvec<byte> prefixLen(blockNum, valvec_no_init());
+	size_t suffixBytes = 0;
+	for (size_t b = 0; b < blockNum; ++b) {
+		size_t beg = b * BlockKeys;
+		size_t end = std::min(rows, beg + BlockKeys);
+		const byte* x = data + fixlen * m_index[beg];
+		const byte* y = data + fixlen * m_index[end - 1];
+		size_t p = 0;
+		while (p < fixlen && x[p] == y[p]) ++p;
+		prefixLen[b] = byte(p);
+		suffixBytes += (fixlen - p) * (end - beg);
+	}
+	size_t blockMemSize = suffixBytes + blockNum * (fixlen + 5)
+						+ rows * m_index.uintbits() / 8;
+	if (blockMemSize * 5 > rows * fixlen * 4) {
+		return; // saves less than 20%
+	}
+	valvec<byte> suffixes(suffixBytes, valvec_reserve());
+	m_blockFirstKeys.resize_no_init(blockNum * fixlen);
+	m_blockOffset.resize_no_init(blockNum);
+	for (size_t b = 0; b < blockNum; ++b) {
+		size_t beg = b * BlockKeys;
+		size_t end = std::min(rows, beg + BlockKeys);
+		size_t p = prefixLen[b];
+		memcpy(m_blockFirstKeys.data() + fixlen * b, data + fixlen * m_index[beg], fixlen);
+		m_blockOffset[b] = uint32_t(suffixes.size());
+		for (size_t i = beg; i < end; ++i) {
+			suffixes.append(data + fixlen * m_index[i] + p, fixlen - p);
+		}
+	}
+	valvec<uint32_t> rank(rows, valvec_no_init());
+	for (size_t i = 0; i < rows; ++i) {
+		rank[m_index[i]] = uint32_t(i);
+	}
+	m_rank.build_from(rank);
+	m_blockPrefixLen.swap(prefixLen);
+	m_keys.swap(suffixes);
+	m_blockLayout = true;
+}
+
+namespace {
+	struct ModelHeader {
+		uint32_t rows;
+		uint32_t segNum;
+		uint32_t maxError;
+		uint32_t padding;
+	};
+}
+
+void FixedLenKeyIndex::loadModel(PathRef path) {
+	auto fpath = path + ".fixlen.model";
+	if (!boost::filesystem::exists(fpath)) {
+		return;
+	}
+	FileStream fp(fpath.string().c_str(), "rb");
+	ModelHeader h;
+	fp.ensureRead(&h, sizeof(h));
+	if (h.rows != m_index.size()) {
+		fprintf(stderr, "WARN: %s: rows = %u, index rows = %zd, ignored\n"
+			, fpath.string().c_str(), h.rows, m_index.size());
+		return;
 	}
-	return i;
+	m_modelError = h.maxError;
+	m_modelKeys.resize_no_init(h.segNum);
+	m_modelSegs.resize_no_init(h.segNum);
+	fp.ensureRead(m_modelKeys.data(), m_modelKeys.used_mem_size());
+	fp.ensureRead(m_modelSegs.data(), m_modelSegs.used_mem_size());
+}
+
+void FixedLenKeyIndex::saveModel(PathRef path) const {
+	auto fpath = path + ".fixlen.model";
+	EnvFileStream fp(fpath.string().c_str(), "wb");
+	ModelHeader h;
+	h.rows     = uint32_t(m_index.size());
+	h.segNum   = uint32_t(m_modelKeys.size());
+	h.maxError = uint32_t(m_modelError);
+	h.padding  = 0;
+	fp.ensureWrite(&h, sizeof(h));
+	fp.ensureWrite(m_modelKeys.data(), m_modelKeys.used_mem_size());
+	fp.ensureWrite(m_modelSegs.data(), m_modelSegs.used_mem_size());
+}
+
+llong FixedLenKeyIndex::countRange(fstring lo, fstring hi, DbContext*) const {
+	size_t beg = lo.empty() ? 0 : searchLowerBound_cvt(lo);
+	size_t end = hi.empty() ? m_index.size() : searchLowerBound_cvt(hi);
+	return beg < end ? llong(end - beg) : 0;
+}
+
+llong FixedLenKeyIndex::scanRange(fstring lo, fstring hi,
+								  const std::function<bool(llong)>& onRecord,
+								  DbContext*)
+const {
+	size_t beg = lo.empty() ? 0 : searchLowerBound_cvt(lo);
+	size_t end = hi.empty() ? m_index.size() : searchLowerBound_cvt(hi);
+	llong cnt = 0;
+	for (size_t i = beg; i < end; ++i) {
+		++cnt;
+		if (!onRecord(m_index[i]))
+			break;
+	}
+	return cnt;
 }
 
 ///@}
 
 llong FixedLenKeyIndex::dataStorageSize() const {
-	return m_keys.used_mem_size() + m_index.mem_size();
+	return m_keys.used_mem_size() + m_index.mem_size()
+		+ m_blockFirstKeys.used_mem_size() + m_blockOffset.used_mem_size()
+		+ m_blockPrefixLen.used_mem_size() + m_rank.mem_size();
 }
 
 llong FixedLenKeyIndex::dataInflateSize() const {
-	return m_keys.size();
+	return m_fixedLen * m_index.size();
 }
 
 llong FixedLenKeyIndex::numDataRows() const {
@@ -140,6 +432,10 @@ void FixedLenKeyIndex::getValueAppend(llong id, valvec<byte>* val, DbContext*) c
 	assert(id >= 0);
 	size_t idx = size_t(id);
 	assert(idx < m_index.size());
+	if (m_blockLayout) {
+		getSortedKeyAppend(m_rank[idx], val);
+		return;
+	}
 	size_t fixlen = m_fixedLen;
 	const byte* dataPtr = m_keys.data() + fixlen * idx;
 	size_t oldsize = val->size();
@@ -200,6 +496,56 @@ void FixedLenKeyIndex::build(const Schema& schema, SortableStrVec& strVec) {
 	assert(0 == minIdx);
 	m_keys.clear();
 	m_keys.swap(strVec.m_strpool);
+	buildSearchAids(schema);
+}
+
+// keys are copied to m_keys[recId] and m_index is filled in input order,
+// no sorting and no extra copy of keys
+void FixedLenKeyIndex::buildFromSorted(const Schema& schema, SortedIndexInput& input) {
+	const size_t fixlen = schema.getFixedRowLen();
+	const size_t rows = size_t(input.numRows());
+	assert(fixlen > 0);
+	m_keys.resize_fill(fixlen * rows, 0);
+	m_index.resize_with_wire_max_val(rows, size_t(rows ? rows - 1 : 0));
+	m_fixedLen = fixlen;
+	m_uniqKeys = 0;
+	const byte* prev = NULL;
+	valvec<byte> key;
+	llong recId = -1;
+	size_t pos = 0;
+	while (input.next(&recId, &key)) {
+		if (key.size() != fixlen || pos >= rows ||
+				recId < 0 || size_t(recId) >= rows) {
+			THROW_STD(invalid_argument
+				, "bad sorted input: pos = %zd, recId = %lld, rows = %zd"
+				, pos, recId, rows);
+		}
+		byte* dst = m_keys.data() + fixlen * size_t(recId);
+		memcpy(dst, key.data(), fixlen);
+		if (schema.m_needEncodeToLexByteComparable) {
+			schema.byteLexEncode(dst, fixlen);
+		}
+		if (NULL == prev || memcmp(prev, dst, fixlen) != 0) {
+			m_uniqKeys++;
+		}
+		assert(NULL == prev || memcmp(prev, dst, fixlen) <= 0);
+		prev = dst;
+		m_index.set_wire(pos++, size_t(recId));
+	}
+	if (pos != rows) {
+		THROW_STD(invalid_argument
+			, "bad sorted input: got %zd keys, rows = %zd", pos, rows);
+	}
+	m_isUnique = m_uniqKeys == rows;
+	buildSearchAids(schema);
+}
+
+void FixedLenKeyIndex::buildSearchAids(const Schema& schema) {
+	if (schema.m_enableLearnedSearch && m_index.size() >= 1024) {
+		m_modelError = 16;
+		buildModel();
+	}
+	buildBlockLayout();
 }
 
 namespace {
@@ -207,41 +553,86 @@ namespace {
 		uint32_t rows;
 		uint32_t uniqKeys;
 		uint32_t fixlen;
-		uint32_t padding;
+		uint32_t flags; // 1 is block layout
 	};
+	struct BlockHeader {
+		uint64_t suffixBytes;
+		uint64_t padding;
+	};
+	inline size_t align16(size_t x) { return (x + 15) & ~size_t(15); }
 }
 
 void FixedLenKeyIndex::load(PathRef path) {
 	auto fpath = path + ".fixlen";
-	m_mmapBase = (byte_t*)mmap_load(fpath.string(), &m_mmapSize);
+	m_mmapBase = (byte_t*)DbEnv::current()->mmapLoad(fpath.string(), &m_mmapSize);
 	auto h = (const Header*)m_mmapBase;
 	m_isUnique = h->uniqKeys == h->rows;
 	m_uniqKeys = h->uniqKeys;
 	m_fixedLen = h->fixlen;
 	size_t rbits = terark_bsr_u32(h->rows-1) + 1;
-	size_t keyMemSize = h->fixlen * h->rows;
-	m_keys .risk_set_data((byte*)(h+1) , keyMemSize);
-	keyMemSize = (keyMemSize + 15) & ~15;
-	m_index.risk_set_data((byte*)(h+1) + keyMemSize, h->rows, rbits);
+	if (h->flags & 1) {
+		auto bh = (const BlockHeader*)(h+1);
+		size_t blockNum = (h->rows + BlockKeys - 1) / BlockKeys;
+		byte*  p = (byte*)(bh+1);
+		m_keys.risk_set_data(p, size_t(bh->suffixBytes));
+		p += align16(size_t(bh->suffixBytes));
+		m_blockFirstKeys.risk_set_data(p, h->fixlen * blockNum);
+		p += align16(h->fixlen * blockNum);
+		m_blockOffset.risk_set_data((uint32_t*)p, blockNum);
+		p += align16(sizeof(uint32_t) * blockNum);
+		m_blockPrefixLen.risk_set_data(p, blockNum);
+		p += align16(blockNum);
+		m_index.risk_set_data(p, h->rows, rbits);
+		p += m_index.mem_size();
+		m_rank.risk_set_data(p, h->rows, rbits);
+		m_blockLayout = true;
+	}
+	else {
+		size_t keyMemSize = h->fixlen * h->rows;
+		m_keys .risk_set_data((byte*)(h+1) , keyMemSize);
+		keyMemSize = (keyMemSize + 15) & ~15;
+		m_index.risk_set_data((byte*)(h+1) + keyMemSize, h->rows, rbits);
+	}
+	loadModel(path);
 }
 
 void FixedLenKeyIndex::save(PathRef path) const {
 	auto fpath = path + ".fixlen";
-	NativeDataOutput<FileStream> dio;
+	NativeDataOutput<EnvFileStream> dio;
 	dio.open(fpath.string().c_str(), "wb");
 	Header h;
 	h.rows     = uint32_t(m_index.size());
 	h.uniqKeys = m_uniqKeys;
 	h.fixlen   = m_fixedLen;
-	h.padding  = 0;
+	h.flags    = m_blockLayout ? 1 : 0;
 	dio.ensureWrite(&h, sizeof(h));
 	byte zero[16];
 	memset(zero, 0, sizeof(zero));
-	dio.ensureWrite(m_keys .data(), m_keys .used_mem_size());
-	if (m_keys.used_mem_size() % 16 != 0) {
-		dio.ensureWrite(zero, 16 - m_keys.used_mem_size() % 16);
+	auto writeAligned = [&](const void* data, size_t size) {
+		dio.ensureWrite(data, size);
+		if (size % 16 != 0) {
+			dio.ensureWrite(zero, 16 - size % 16);
+		}
+	};
+	if (m_blockLayout) {
+		BlockHeader bh;
+		bh.suffixBytes = m_keys.used_mem_size();
+		bh.padding = 0;
+		dio.ensureWrite(&bh, sizeof(bh));
+		writeAligned(m_keys.data(), m_keys.used_mem_size());
+		writeAligned(m_blockFirstKeys.data(), m_blockFirstKeys.used_mem_size());
+		writeAligned(m_blockOffset.data(), m_blockOffset.used_mem_size());
+		writeAligned(m_blockPrefixLen.data(), m_blockPrefixLen.used_mem_size());
+		dio.ensureWrite(m_index.data(), m_index.mem_size());
+		dio.ensureWrite(m_rank.data(), m_rank.mem_size());
+	}
+	else {
+		writeAligned(m_keys.data(), m_keys.used_mem_size());
+		dio.ensureWrite(m_index.data(), m_index.mem_size());
+	}
+	if (!m_modelKeys.empty()) {
+		saveModel(path);
 	}
-	dio.ensureWrite(m_index.data(), m_index.mem_size());
 }
 
 class FixedLenKeyIndex::MyIndexIterForward : public IndexIterator {
@@ -261,9 +652,9 @@ public:
 	bool increment(llong* id, valvec<byte>* key) override {
 		assert(nullptr != key);
 		if (m_keyIdx < m_owner->m_index.size()) {
-			*id = m_owner->m_index.get(m_keyIdx++);
+			*id = m_owner->m_index.get(m_keyIdx);
 			key->erase_all();
-			m_owner->getValueAppend(*id, key, nullptr);
+			m_owner->getSortedKeyAppend(m_keyIdx++, key);
 			return true;
 		}
 		return false;
@@ -275,7 +666,7 @@ public:
 		if (m_keyIdx < m_owner->m_index.size()) {
 			*id = m_owner->m_index.get(m_keyIdx);
 			retKey->erase_all();
-			m_owner->getValueAppend(*id, retKey, nullptr);
+			m_owner->getSortedKeyAppend(m_keyIdx, retKey);
 			m_keyIdx++;
 			return key == *retKey ? 0 : 1;
 		}
@@ -288,7 +679,7 @@ public:
 		if (m_keyIdx < m_owner->m_index.size()) {
 			*id = m_owner->m_index.get(m_keyIdx);
 			retKey->erase_all();
-			m_owner->getValueAppend(*id, retKey, nullptr);
+			m_owner->getSortedKeyAppend(m_keyIdx, retKey);
 			m_keyIdx++;
 			return 1;
 		}
@@ -315,7 +706,7 @@ public:
 		if (m_keyIdx > 0) {
 			*id = m_owner->m_index.get(--m_keyIdx);
 			key->erase_all();
-			m_owner->getValueAppend(*id, key, nullptr);
+			m_owner->getSortedKeyAppend(m_keyIdx, key);
 			return true;
 		}
 		return false;
@@ -331,7 +722,7 @@ public:
 		if (m_keyIdx > 0) {
 			*id = m_owner->m_index[--m_keyIdx];
 			retKey->erase_all();
-			m_owner->getValueAppend(*id, retKey, nullptr);
+			m_owner->getSortedKeyAppend(m_keyIdx, retKey);
 			return key == *retKey ? 0 : 1;
 		}
 		return -1;
@@ -347,7 +738,7 @@ public:
 		if (m_keyIdx > 0) {
 			*id = m_owner->m_index[--m_keyIdx];
 			retKey->erase_all();
-			m_owner->getValueAppend(*id, retKey, nullptr);
+			m_owner->getSortedKeyAppend(m_keyIdx, retKey);
 			return 1;
 		}
 		return -1;
@@ -21,6 +21,11 @@ public:
 	IndexIterator* createIndexIterForward(DbContext*) const override;
 	IndexIterator* createIndexIterBackward(DbContext*) const override;
 
+	llong countRange(fstring lo, fstring hi, DbContext*) const override;
+	llong scanRange(fstring lo, fstring hi,
+					const std::function<bool(llong recId)>& onRecord,
+					DbContext*) const override;
+
 	ReadableStore* getReadableStore() override;
 	ReadableIndex* getReadableIndex() override;
 
@@ -32,11 +37,12 @@ public:
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
 
 	void build(const Schema& schema, SortableStrVec& strVec);
+	void buildFromSorted(const Schema& schema, SortedIndexInput& input);
 	void load(PathRef path) override;
 	void save(PathRef path) const override;
 
 protected:
-	valvec<byte> m_keys;   // key   = m_keys[recId]
+	valvec<byte> m_keys;   // key   = m_keys[recId], or block suffixes
 	UintVecMin0  m_index;  // recId = m_index.lower_bound(key)
 	const Schema&m_schema;
 	byte_t*      m_mmapBase;
@@ -44,12 +50,44 @@ protected:
 	size_t       m_fixedLen;
 	size_t       m_uniqKeys;
 
+	// block layout, used when it saves enough memory: keys are stored
+	// in sorted order, BlockKeys keys per block share the prefix of
+	// block's first key, m_keys holds contiguous suffixes of each block
+	static const size_t BlockKeys = 64;
+	bool             m_blockLayout;
+	valvec<byte>     m_blockFirstKeys; // m_fixedLen bytes per block
+	valvec<uint32_t> m_blockOffset;    // suffixes offset in m_keys
+	valvec<byte>     m_blockPrefixLen;
+	UintVecMin0      m_rank;           // sorted pos = m_rank[recId]
+
+	const byte* sortedKey(size_t pos, byte* buf) const;
+	void getSortedKeyAppend(size_t pos, valvec<byte>* key) const;
+	void buildBlockLayout();
+	void buildSearchAids(const Schema& schema);
+	size_t blockSearchBound(fstring binkey, bool upper) const;
+
 	size_t searchLowerBound(fstring binkey) const;
 	size_t searchUpperBound(fstring binkey) const;
 
 	size_t searchLowerBound_cvt(fstring binkey) const;
 	size_t searchUpperBound_cvt(fstring binkey) const;
 
+	// optional piecewise linear model: lower bound position of a key is
+	// predicted by its first 8 bytes, binary search is in a small window
+	struct ModelSeg {
+		double   slope;
+		uint64_t pos;
+	};
+	valvec<uint64_t> m_modelKeys; // key prefix of each segment start
+	valvec<ModelSeg> m_modelSegs;
+	size_t           m_modelError;
+
+	uint64_t keyPrefix(const byte* key) const;
+	void buildModel();
+	void loadModel(PathRef path);
+	void saveModel(PathRef path) const;
+	void modelSearchRange(fstring binkey, bool upper, size_t* lo, size_t* hi) const;
+
 	class MyIndexIterForward;  friend class MyIndexIterForward;
 	class MyIndexIterBackward; friend class MyIndexIterBackward;
 };
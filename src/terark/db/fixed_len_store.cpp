@@ -1,4 +1,5 @@
 #include "fixed_len_store.hpp"
+#include "db_env.hpp"
 #include <terark/io/FileStream.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/util/mmap.hpp>
@@ -55,7 +56,7 @@ FixedLenStore::FixedLenStore(PathRef segDir, const Schema& schema)
 
 FixedLenStore::~FixedLenStore() {
 	if (m_mmapBase) {
-		mmap_close(m_mmapBase, m_mmapSize);
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
 	}
 }
 
@@ -82,6 +83,63 @@ void FixedLenStore::getValueAppend(llong id, valvec<byte>* val, DbContext*) cons
 	val->append(dataPtr, m_mmapBase->fixlen);
 }
 
+bool FixedLenStore::getValueSliceAppend(llong id, size_t offset, size_t len,
+										valvec<byte>* val, DbContext*)
+const {
+	assert(id >= 0);
+	assert(id < llong(m_mmapBase->rows));
+	assert(offset + len <= m_mmapBase->fixlen);
+	ScopeLock(false);
+	const byte* dataPtr = m_mmapBase->get_data(id);
+	val->append(dataPtr + offset, len);
+	return true;
+}
+
+size_t FixedLenStore::getFieldArray(llong beg, size_t num,
+									size_t offset, size_t len,
+									valvec<byte>*, const byte** data)
+const {
+	assert(beg >= 0);
+	assert(beg + num <= m_mmapBase->rows);
+	assert(offset + len <= m_mmapBase->fixlen);
+	(void)num; (void)len;
+	if (m_needsLock) // data may be moved by remap, can not be zero-copy
+		return 0;
+	*data = m_mmapBase->get_data(beg) + offset;
+	return m_mmapBase->fixlen;
+}
+
+// inplace updatable fields may be changed under the ref, but it is never
+// dangling since data is not moved when m_needsLock is false
+bool FixedLenStore::hasValueRef() const {
+	return !m_needsLock && NULL != m_mmapBase;
+}
+
+fstring FixedLenStore::getValueRef(llong id, DbContext*) const {
+	assert(id >= 0);
+	assert(id < llong(m_mmapBase->rows));
+	assert(!m_needsLock);
+	return fstring(m_mmapBase->get_data(id), m_mmapBase->fixlen);
+}
+
+void FixedLenStore::getValuesAppendBatch(const llong* ids, size_t num,
+										 valvec<byte>* vals, DbContext*)
+const {
+	const size_t PrefetchDistance = 8;
+	ScopeLock(false);
+	const Header* h = m_mmapBase;
+	const size_t fixlen = h->fixlen;
+	for (size_t i = 0; i < num; ++i) {
+#if defined(__GNUC__)
+		if (i + PrefetchDistance < num)
+			__builtin_prefetch(h->get_data(ids[i + PrefetchDistance]));
+#endif
+		assert(ids[i] >= 0);
+		assert(ids[i] < llong(h->rows));
+		vals[i].append(h->get_data(ids[i]), fixlen);
+	}
+}
+
 StoreIterator* FixedLenStore::createStoreIterForward(DbContext*) const {
 	return nullptr; // not needed
 }
@@ -101,7 +159,7 @@ void FixedLenStore::build(SortableStrVec& strVec) {
 	h.capacity = rows;
 	h.fixlen   = m_fixlen;
 	h.padding = 0;
-	FileStream fp(m_fpath.c_str(), "wb");
+	EnvFileStream fp(m_fpath.c_str(), "wb");
 	fp.ensureWrite(&h, sizeof(h));
 	fp.ensureWrite(strVec.m_strpool.data(), strVec.m_strpool.size());
 	fp.close();
@@ -112,7 +170,7 @@ void FixedLenStore::load(PathRef fpath) {
 	assert(fstring(fpath.string()).endsWith(".fixlen"));
 	assert(nullptr == m_mmapBase);
 	const bool writable = true;
-	m_mmapBase = (Header*)mmap_load(fpath.string(), &m_mmapSize, writable, m_schema.m_mmapPopulate);
+	m_mmapBase = (Header*)DbEnv::current()->mmapLoad(fpath.string(), &m_mmapSize, writable, m_schema.m_mmapPopulate);
 	assert(m_fixlen == m_mmapBase->fixlen);
 //	m_fixlen = m_mmapBase->fixlen;
 	m_recordsBasePtr = m_mmapBase->get_data(0);
@@ -124,7 +182,7 @@ void FixedLenStore::openStore() {
 	assert(fstring(m_fpath).endsWith(".fixlen"));
 	assert(nullptr == m_mmapBase);
 	const bool writable = true;
-	m_mmapBase = (Header*)mmap_load(m_fpath, &m_mmapSize, writable, m_schema.m_mmapPopulate);
+	m_mmapBase = (Header*)DbEnv::current()->mmapLoad(m_fpath, &m_mmapSize, writable, m_schema.m_mmapPopulate);
 	assert(m_fixlen == m_mmapBase->fixlen);
 //	m_fixlen = m_mmapBase->fixlen;
 	m_recordsBasePtr = m_mmapBase->get_data(0);
@@ -136,7 +194,7 @@ void FixedLenStore::save(PathRef path) const {
 		return;
 	}
 	assert(nullptr != m_mmapBase);
-	FileStream dio(fpath.string().c_str(), "wb");
+	EnvFileStream dio(fpath.string().c_str(), "wb");
 	dio.ensureWrite(m_mmapBase, m_mmapSize);
 }
 
@@ -200,7 +258,7 @@ void FixedLenStore::shrinkToFit() {
 		return;
 	}
 	ullong realSize = sizeof(Header) + m_mmapBase->mem_size();
-	mmap_close(m_mmapBase, m_mmapSize);
+	DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
 	m_mmapBase = nullptr;
 	truncate_file(m_fpath, realSize);
 	this->openStore();
@@ -244,12 +302,12 @@ FixedLenStore::allocFileSize(ullong fileSize) {
 	newBytes = ullong((newBytes+ChunkBytes-1)) & ~(ChunkBytes-1);
 	Header* h = m_mmapBase;
 	if (h) {
-		mmap_close(h, m_mmapSize);
+		DbEnv::current()->mmapClose(h, m_mmapSize);
 		m_mmapBase = nullptr;
 	}
 	truncate_file(m_fpath, newBytes);
 	const bool writable = true;
-	m_mmapBase = (Header*)mmap_load(m_fpath, &m_mmapSize, writable);
+	m_mmapBase = (Header*)DbEnv::current()->mmapLoad(m_fpath, &m_mmapSize, writable);
 	m_mmapBase->capacity = (m_mmapSize - sizeof(Header)) / m_fixlen;
 	if (nullptr == h) {
 		h = m_mmapBase;
@@ -267,7 +325,7 @@ FixedLenStore::allocFileSize(ullong fileSize) {
 }
 
 void FixedLenStore::deleteFiles() {
-	mmap_close(m_mmapBase, m_mmapSize);
+	DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
 	m_mmapBase = nullptr;
 	boost::filesystem::remove(m_fpath);
 }
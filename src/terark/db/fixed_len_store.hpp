@@ -20,6 +20,14 @@ public:
 	llong dataInflateSize() const override;
 	llong numDataRows() const override;
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	void getValuesAppendBatch(const llong* ids, size_t num,
+							  valvec<byte>* vals, DbContext*) const override;
+	bool getValueSliceAppend(llong id, size_t offset, size_t len,
+							 valvec<byte>* val, DbContext*) const override;
+	size_t getFieldArray(llong beg, size_t num, size_t offset, size_t len,
+						 valvec<byte>* buf, const byte** data) const override;
+	bool hasValueRef() const override;
+	fstring getValueRef(llong id, DbContext*) const override;
 
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
@@ -0,0 +1,283 @@
+#include "index_stats.hpp"
+#include "db_segment.hpp"
+#include "db_env.hpp"
+#include <terark/bitmanip.hpp>
+#include <terark/io/FileStream.hpp>
+#include <algorithm>
+#include <math.h>
+
+namespace terark { namespace db {
+
+HyperLogLog::HyperLogLog() {
+	clear();
+}
+
+void HyperLogLog::clear() {
+	memset(m_regs, 0, sizeof(m_regs));
+}
+
+void HyperLogLog::add(fstring key) {
+	addHash(IndexBloomFilter::hashKey(key));
+}
+
+// high Bits of hash select the register, the register keeps the max rank
+// of the first 1 bit in the rest bits
+void HyperLogLog::addHash(uint64_t h) {
+	size_t idx = size_t(h >> (64 - Bits));
+	uint64_t w = h << Bits;
+	byte rank = byte(w ? fast_clz64(w) + 1 : 64 - Bits + 1);
+	if (m_regs[idx] < rank)
+		m_regs[idx] = rank;
+}
+
+void HyperLogLog::merge(const HyperLogLog& y) {
+	for (size_t i = 0; i < RegNum; ++i) {
+		if (m_regs[i] < y.m_regs[i])
+			m_regs[i] = y.m_regs[i];
+	}
+}
+
+double HyperLogLog::estimate() const {
+	const double m = RegNum;
+	double sum = 0;
+	size_t zeros = 0;
+	for (size_t i = 0; i < RegNum; ++i) {
+		sum += ldexp(1.0, -int(m_regs[i]));
+		zeros += 0 == m_regs[i];
+	}
+	double est = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	if (est <= 2.5 * m && zeros) {
+		est = m * log(m / zeros); // linear counting for small cardinality
+	}
+	return est;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+IndexStats::IndexStats() {
+	rows = 0;
+	keyBytes = 0;
+	distinctKeys = 0;
+}
+
+double IndexStats::rowsPerKey() const {
+	if (0 == rows) {
+		return 0;
+	}
+	return rows / std::max(distinctKeys, 1.0);
+}
+
+double IndexStats::estimateRange(const Schema& schema, fstring lo, fstring hi)
+const {
+	if (bucketRows.empty()) {
+		return -1;
+	}
+	double sum = 0;
+	for (size_t k = 0; k < bucketRows.size(); ++k) {
+		fstring upper = bounds[k];
+		if (!lo.empty() && schema.compareData(upper, lo) < 0)
+			continue; // bucket is before lo
+		if (k > 0 && !hi.empty() && schema.compareData(bounds[k-1], hi) >= 0)
+			break; // keys of bucket k are greater than bounds[k-1]
+		bool coverLo = lo.empty() || (k > 0 && schema.compareData(bounds[k-1], lo) >= 0);
+		bool coverHi = hi.empty() || schema.compareData(upper, hi) < 0;
+		sum += coverLo && coverHi ? bucketRows[k] : bucketRows[k] * 0.5;
+	}
+	return sum;
+}
+
+// rows of a bucket are at its upper bound, the merged bounds are cut at
+// every rows/maxBuckets of cumulative rows
+void IndexStats::mergeHistograms(const Schema& schema,
+								 const IndexStats* const* inputs,
+								 size_t num, size_t maxBuckets) {
+	struct Bound {
+		fstring key;
+		ullong  rows;
+	};
+	valvec<Bound> all;
+	ullong total = 0;
+	for (size_t i = 0; i < num; ++i) {
+		const IndexStats* x = inputs[i];
+		for (size_t k = 0; k < x->bucketRows.size(); ++k) {
+			all.push_back(Bound{fstring(x->bounds[k]), x->bucketRows[k]});
+			total += x->bucketRows[k];
+		}
+	}
+	bounds.erase_all();
+	bucketRows.erase_all();
+	if (all.empty() || 0 == maxBuckets) {
+		return;
+	}
+	std::sort(all.begin(), all.end(), [&](const Bound& x, const Bound& y) {
+		return schema.compareData(x.key, y.key) < 0;
+	});
+	const double depth = double(total) / maxBuckets;
+	ullong cum = 0, bucket = 0;
+	for (size_t j = 0; j < all.size(); ++j) {
+		cum += all[j].rows;
+		bucket += all[j].rows;
+		bool last = j + 1 == all.size();
+		if (last || cum >= depth * (bucketRows.size() + 1)) {
+			bounds.emplace_back(all[j].key.data(), all[j].key.size());
+			bucketRows.push_back(bucket);
+			bucket = 0;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	struct StatsFileHeader {
+		char     magic[8];
+		uint32_t version;
+		uint32_t numIndices;
+		uint64_t physicRows;
+	};
+	BOOST_STATIC_ASSERT(sizeof(StatsFileHeader) == 24);
+	struct StatsFileIndex {
+		uint64_t rows;
+		uint64_t keyBytes;
+		uint64_t numBuckets;
+		uint64_t boundBytes;
+	};
+	const char g_statsMagic[8] = {'T','d','b','I','d','x','S','t'};
+}
+
+SegmentIndexStats::SegmentIndexStats() {
+	m_physicRows = 0;
+}
+SegmentIndexStats::~SegmentIndexStats() {
+}
+
+void SegmentIndexStats::build(const ReadonlySegment* seg, size_t maxBuckets) {
+	const SchemaConfig& sconf = *seg->m_schema;
+	const febitvec& isDel = seg->m_isDel;
+	const rank_select_se& isPurged = seg->m_isPurged;
+	m_physicRows = seg->getPhysicRows();
+	m_indices.clear();
+	m_indices.resize(sconf.getIndexNum());
+	const size_t liveRows = size_t(seg->m_isDel.size() - seg->m_delcnt);
+	const size_t stride = std::max<size_t>(liveRows / SampleKeys, 1);
+	valvec<byte> key;
+	fstrvecl samples;
+	valvec<size_t> order;
+	for (size_t indexId = 0; indexId < m_indices.size(); ++indexId) {
+		const Schema& schema = sconf.getIndexSchema(indexId);
+		const ReadableStore* store = seg->m_colgroups[indexId].get();
+		const bool ordered = seg->m_indices[indexId]->isOrdered();
+		IndexStats& st = m_indices[indexId];
+		samples.erase_all();
+		size_t logicId = 0;
+		for (size_t physicId = 0; physicId < m_physicRows; ++physicId, ++logicId) {
+			if (!isPurged.empty()) {
+				while (isPurged.is1(logicId))
+					logicId++;
+			}
+			if (isDel[logicId])
+				continue;
+			store->getValue(physicId, &key, NULL);
+			st.hll.add(key);
+			if (ordered && st.rows % stride == 0)
+				samples.emplace_back((const char*)key.data(), key.size());
+			st.rows++;
+			st.keyBytes += key.size();
+		}
+		st.distinctKeys = schema.m_isUnique ? double(st.rows) : st.hll.estimate();
+		if (!ordered || samples.size() == 0 || 0 == maxBuckets) {
+			continue;
+		}
+		order.resize_no_init(samples.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+			return schema.compareData(samples[x], samples[y]) < 0;
+		});
+		const size_t buckets = std::min(maxBuckets, order.size());
+		const double rowsPerSample = double(st.rows) / order.size();
+		size_t prev = 0;
+		ullong prevRows = 0;
+		for (size_t k = 1; k <= buckets; ++k) {
+			size_t end = order.size() * k / buckets;
+			if (end == prev)
+				continue;
+			fstring upper = samples[order[end - 1]];
+			ullong cumRows = k == buckets ? st.rows : ullong(end * rowsPerSample + 0.5);
+			if (st.bounds.size() && schema.compareData(upper, st.bounds.back()) == 0) {
+				st.bucketRows.back() += cumRows - prevRows; // duplicate keys
+			} else {
+				st.bounds.emplace_back(upper.data(), upper.size());
+				st.bucketRows.push_back(cumRows - prevRows);
+			}
+			prev = end;
+			prevRows = cumRows;
+		}
+	}
+}
+
+void SegmentIndexStats::load(PathRef fpath) {
+	std::string strFile = fpath.string();
+	FileStream fp(strFile.c_str(), "rb");
+	StatsFileHeader hdr;
+	fp.ensureRead(&hdr, sizeof(hdr));
+	if (memcmp(hdr.magic, g_statsMagic, 8) != 0 || hdr.version != 1) {
+		TERARK_THROW(DbException, "bad index stats file: %s", strFile.c_str());
+	}
+	m_physicRows = size_t(hdr.physicRows);
+	m_indices.clear();
+	m_indices.resize(hdr.numIndices);
+	valvec<uint32_t> lens;
+	for (IndexStats& st : m_indices) {
+		StatsFileIndex fi;
+		fp.ensureRead(&fi, sizeof(fi));
+		st.rows = fi.rows;
+		st.keyBytes = fi.keyBytes;
+		fp.ensureRead(st.hll.m_regs, sizeof(st.hll.m_regs));
+		fp.ensureRead(&st.distinctKeys, sizeof(double));
+		st.bucketRows.resize_no_init(size_t(fi.numBuckets));
+		fp.ensureRead(st.bucketRows.data(), sizeof(ullong) * st.bucketRows.size());
+		lens.resize_no_init(size_t(fi.numBuckets));
+		fp.ensureRead(lens.data(), sizeof(uint32_t) * lens.size());
+		valvec<char> pool(size_t(fi.boundBytes), valvec_no_init());
+		fp.ensureRead(pool.data(), pool.size());
+		st.bounds.erase_all();
+		size_t pos = 0;
+		for (uint32_t len : lens) {
+			if (pos + len > pool.size()) {
+				TERARK_THROW(DbException, "bad index stats file: %s", strFile.c_str());
+			}
+			st.bounds.emplace_back(pool.data() + pos, len);
+			pos += len;
+		}
+	}
+}
+
+void SegmentIndexStats::save(PathRef fpath) const {
+	StatsFileHeader hdr;
+	memcpy(hdr.magic, g_statsMagic, 8);
+	hdr.version = 1;
+	hdr.numIndices = uint32_t(m_indices.size());
+	hdr.physicRows = m_physicRows;
+	EnvFileStream fp(fpath.string().c_str(), "wb");
+	fp.ensureWrite(&hdr, sizeof(hdr));
+	valvec<uint32_t> lens;
+	for (const IndexStats& st : m_indices) {
+		StatsFileIndex fi;
+		fi.rows = st.rows;
+		fi.keyBytes = st.keyBytes;
+		fi.numBuckets = st.bucketRows.size();
+		fi.boundBytes = st.bounds.strpool.size();
+		fp.ensureWrite(&fi, sizeof(fi));
+		fp.ensureWrite(st.hll.m_regs, sizeof(st.hll.m_regs));
+		fp.ensureWrite(&st.distinctKeys, sizeof(double));
+		fp.ensureWrite(st.bucketRows.data(), sizeof(ullong) * st.bucketRows.size());
+		lens.resize_no_init(st.bucketRows.size());
+		for (size_t k = 0; k < lens.size(); ++k)
+			lens[k] = uint32_t(fstring(st.bounds[k]).size());
+		fp.ensureWrite(lens.data(), sizeof(uint32_t) * lens.size());
+		fp.ensureWrite(st.bounds.strpool.data(), st.bounds.strpool.size());
+	}
+}
+
+} } // namespace terark::db
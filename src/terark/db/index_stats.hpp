@@ -0,0 +1,72 @@
+#ifndef __terark_db_index_stats_hpp__
+#define __terark_db_index_stats_hpp__
+
+#include "db_store.hpp"
+#include <terark/util/fstrvec.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+namespace terark { namespace db {
+
+class ReadonlySegment;
+
+// distinct count sketch, standard error is 1.04 / sqrt(RegNum), about 1.6%,
+// sketches of segments are merged by max of registers
+class TERARK_DB_DLL HyperLogLog {
+public:
+	enum { Bits = 12, RegNum = 1 << Bits };
+	byte m_regs[RegNum];
+
+	HyperLogLog();
+	void clear();
+	void add(fstring key);
+	void addHash(uint64_t h);
+	void merge(const HyperLogLog&);
+	double estimate() const;
+};
+
+// statistics for query planning of an index, only live rows at build time
+// are counted. Histogram is equi-depth and only for ordered indices,
+// bounds[k] is the max key of bucket k, bucketRows[k] is rows whose key
+// is in (bounds[k-1], bounds[k]]
+struct TERARK_DB_DLL IndexStats {
+	ullong rows;
+	ullong keyBytes;
+	double distinctKeys;
+	HyperLogLog hll;
+	fstrvecl bounds;
+	valvec<ullong> bucketRows;
+
+	IndexStats();
+	double avgKeyLen() const { return rows ? double(keyBytes) / rows : 0; }
+	/// estimated rows of one key for searchExact
+	double rowsPerKey() const;
+	/// estimated rows of keys in [lo, hi), empty lo or hi is unbounded,
+	/// a partially covered bucket is counted as half, -1 if no histogram
+	double estimateRange(const Schema&, fstring lo, fstring hi) const;
+	/// re-bucket weighted bounds of input histograms into maxBuckets
+	void mergeHistograms(const Schema&, const IndexStats* const* inputs,
+						 size_t num, size_t maxBuckets);
+};
+
+// IndexStats of each index of a ReadonlySegment, they are built with the
+// zone map on conversion, purge and merge and saved as IndexStats.bin
+class TERARK_DB_DLL SegmentIndexStats : public RefCounter {
+public:
+	enum { SampleKeys = 16384 };
+	size_t m_physicRows;
+	std::vector<IndexStats> m_indices; // parallel with schema indices
+
+	SegmentIndexStats();
+	~SegmentIndexStats();
+	/// keys are read from index stores, histograms are made of sorted
+	/// samples of at most SampleKeys keys
+	void build(const ReadonlySegment*, size_t maxBuckets);
+	void load(PathRef fpath);
+	void save(PathRef fpath) const;
+};
+typedef boost::intrusive_ptr<SegmentIndexStats> SegmentIndexStatsPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_index_stats_hpp__
@@ -1,8 +1,10 @@
 #include "intkey_index.hpp"
+#include "db_env.hpp"
 #include <terark/util/sortable_strvec.hpp>
 #include <terark/io/FileStream.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/util/mmap.hpp>
+#include <terark/util/bsearch.hpp>
 #include <terark/num_to_str.hpp>
 
 namespace terark { namespace db {
@@ -14,12 +16,15 @@ ZipIntKeyIndex::ZipIntKeyIndex(const Schema& schema) : m_schema(schema) {
 	m_isOrdered = true;
 	m_mmapBase = nullptr;
 	m_mmapSize = 0;
+	m_searchMode = SearchBinary;
+	m_maxKey = 0;
 }
 ZipIntKeyIndex::~ZipIntKeyIndex() {
 	if (m_mmapBase) {
 		m_keys.risk_release_ownership();
 		m_index.risk_release_ownership();
-		mmap_close(m_mmapBase, m_mmapSize);
+		m_keyBitmap.risk_release_ownership();
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
 	}
 }
 
@@ -33,7 +38,45 @@ ReadableStore* ZipIntKeyIndex::getReadableStore() {
 
 ///@{ ordered and unordered index
 llong ZipIntKeyIndex::indexStorageSize() const {
-	return m_keys.mem_size() + m_index.mem_size();
+	return m_keys.mem_size() + m_index.mem_size() + m_keyBitmap.mem_size();
+}
+
+// branchless lower_bound(or upper_bound) of key on the keys which are
+// indirected by m_index, bits of the next mids of m_index are prefetched
+static inline size_t
+IndexedKeyBound(const UintVecMin0& index, const UintVecMin0& keys,
+				size_t lo, size_t hi, ullong key, bool upper) {
+	auto indexData = index.data();
+	auto indexBits = index.uintbits();
+	auto indexMask = index.uintmask();
+	auto keysData = keys.data();
+	auto keysBits = keys.uintbits();
+	auto keysMask = keys.uintmask();
+	return lo + branchless_lower_bound_fn(hi - lo,
+		[=](size_t i) {
+			size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, lo + i);
+			ullong hitKey = UintVecMin0::fast_get(keysData, keysBits, keysMask, hitPos);
+			return upper ? hitKey <= key : hitKey < key;
+		},
+		[=](size_t i) {
+			bsearch_prefetch(indexData + (lo + i) * indexBits / 8);
+		});
+}
+
+size_t ZipIntKeyIndex::rankLowerBound(ullong key) const {
+	assert(SearchBinary != m_searchMode);
+	if (key > m_maxKey) {
+		return m_index.size();
+	}
+	if (SearchDense == m_searchMode) {
+		return size_t(key);
+	}
+	if (0 == key) {
+		return 0; // no key is less than the min key
+	}
+	// the bit of row i has key(i) zeros before it, so the ones before
+	// zero (key - 1) are the rows of keys < key
+	return m_keyBitmap.select0(size_t(key - 1)) - size_t(key - 1);
 }
 
 template<class Int>
@@ -43,24 +86,11 @@ size_t ZipIntKeyIndex::IntVecLowerBound(fstring binkey) const {
 	if (rawkey <= Int(m_minKey)) {
 		return 0;
 	}
-	auto indexData = m_index.data();
-	auto indexBits = m_index.uintbits();
-	auto indexMask = m_index.uintmask();
-	auto keysData = m_keys.data();
-	auto keysBits = m_keys.uintbits();
-	auto keysMask = m_keys.uintmask();
 	ullong key = ullong(rawkey - Int(m_minKey));
-	size_t i = 0, j = m_index.size();
-	while (i < j) {
-		size_t mid = (i + j) / 2;
-		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, mid);
-		ullong hitKey = UintVecMin0::fast_get(keysData, keysBits, keysMask, hitPos);
-		if (hitKey < key)
-			i = mid + 1;
-		else
-			j = mid;
+	if (m_searchMode) {
+		return rankLowerBound(key);
 	}
-	return i;
+	return IndexedKeyBound(m_index, m_keys, 0, m_index.size(), key, false);
 }
 
 void ZipIntKeyIndex::searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const {
@@ -96,24 +126,11 @@ size_t ZipIntKeyIndex::IntVecUpperBound(fstring binkey) const {
 	if (rawkey < Int(m_minKey)) {
 		return 0;
 	}
-	auto indexData = m_index.data();
-	auto indexBits = m_index.uintbits();
-	auto indexMask = m_index.uintmask();
-	auto keysData = m_keys.data();
-	auto keysBits = m_keys.uintbits();
-	auto keysMask = m_keys.uintmask();
 	size_t key = size_t(rawkey - Int(m_minKey));
-	size_t i = 0, j = m_index.size();
-	while (i < j) {
-		size_t mid = (i + j) / 2;
-		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, mid);
-		ullong hitKey = UintVecMin0::fast_get(keysData, keysBits, keysMask, hitPos);
-		if (hitKey <= key)
-			i = mid + 1;
-		else
-			j = mid;
+	if (m_searchMode) {
+		return key >= m_maxKey ? m_index.size() : rankLowerBound(key + 1);
 	}
-	return i;
+	return IndexedKeyBound(m_index, m_keys, 0, m_index.size(), key, true);
 }
 
 size_t ZipIntKeyIndex::searchUpperBound(fstring key) const {
@@ -143,50 +160,16 @@ ZipIntKeyIndex::IntVecEqualRange(fstring binkey) const {
 	if (rawkey < Int(m_minKey)) {
 		return std::make_pair(0, false);
 	}
-	auto indexData = m_index.data();
-	auto indexBits = m_index.uintbits();
-	auto indexMask = m_index.uintmask();
-	auto keysData = m_keys.data();
-	auto keysBits = m_keys.uintbits();
-	auto keysMask = m_keys.uintmask();
 	size_t key = size_t(rawkey - Int(m_minKey));
-	size_t i = 0, j = m_index.size();
-	size_t mid = 0;
-	while (i < j) {
-		mid = (i + j) / 2;
-		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, mid);
-		size_t hitKey = UintVecMin0::fast_get(keysData, keysBits, keysMask, hitPos);
-		if (hitKey < key)
-			i = mid + 1;
-		else if (hitKey > key)
-			j = mid;
-		else
-			goto Found;
-	}
-	return std::make_pair(i, i);
-Found:
-	size_t lo = i, hi = mid;
-	while (lo < hi) {
-		size_t mid2 = (lo + hi) / 2;
-		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, mid2);
-		size_t hitKey = UintVecMin0::fast_get(keysData, keysBits, keysMask, hitPos);
-		if (hitKey < key) // for lower_bound
-			lo = mid2 + 1;
-		else
-			hi = mid2;
-	}
-	i = lo;
-	lo = mid + 1, hi = j;
-	while (lo < hi) {
-		size_t mid2 = (lo + hi) / 2;
-		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, mid2);
-		size_t hitKey = UintVecMin0::fast_get(keysData, keysBits, keysMask, hitPos);
-		if (hitKey <= key) // for upper_bound
-			lo = mid2 + 1;
-		else
-			hi = mid2;
-	}
-	return std::make_pair(i, hi);
+	if (m_searchMode) {
+		size_t lo = rankLowerBound(key);
+		size_t hi = key >= m_maxKey ? m_index.size() : rankLowerBound(key + 1);
+		return std::make_pair(lo, hi);
+	}
+	size_t n = m_index.size();
+	size_t lo = IndexedKeyBound(m_index, m_keys, 0, n, key, false);
+	size_t hi = IndexedKeyBound(m_index, m_keys, lo, n, key, true);
+	return std::make_pair(lo, hi);
 }
 
 std::pair<size_t, size_t>
@@ -209,10 +192,113 @@ ZipIntKeyIndex::searchEqualRange(fstring key) const {
 	return {};
 }
 
+// if keys are sorted, each search gallops from lower bound of previous key
+template<class Int>
+void
+ZipIntKeyIndex::IntVecSearchExactBatch(const fstring* keys, size_t num,
+									   valvec<llong>* recIdvec, size_t* offsets)
+const {
+	auto indexData = m_index.data();
+	auto indexBits = m_index.uintbits();
+	auto indexMask = m_index.uintmask();
+	auto keysData = m_keys.data();
+	auto keysBits = m_keys.uintbits();
+	auto keysMask = m_keys.uintmask();
+	auto keyAt = [&](size_t pos) {
+		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, pos);
+		return ullong(UintVecMin0::fast_get(keysData, keysBits, keysMask, hitPos));
+	};
+	const size_t n = m_index.size();
+	size_t lo = 0;    // lower bound of previous key
+	ullong prev = 0;  // previous key
+	for (size_t k = 0; k < num; ++k) {
+		offsets[k] = recIdvec->size();
+		assert(keys[k].size() == sizeof(Int));
+		Int rawkey = unaligned_load<Int>(keys[k].data());
+		if (rawkey < Int(m_minKey)) {
+			continue;
+		}
+		ullong key = ullong(rawkey - Int(m_minKey));
+		if (m_searchMode) {
+			size_t i = rankLowerBound(key);
+			size_t e = key >= m_maxKey ? n : rankLowerBound(key + 1);
+			for (; i < e; ++i) {
+				recIdvec->push_back(UintVecMin0::fast_get(indexData, indexBits, indexMask, i));
+			}
+			continue;
+		}
+		size_t i = 0, j = n;
+		if (key >= prev) {
+			size_t step = 1;
+			i = lo;
+			while (i + step < n && keyAt(i + step) < key) {
+				i += step;
+				step *= 2;
+			}
+			j = std::min(i + step, n);
+		}
+		i = IndexedKeyBound(m_index, m_keys, i, j, key, false);
+		lo = i;
+		prev = key;
+		for (; i < n; ++i) {
+			size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, i);
+			if (UintVecMin0::fast_get(keysData, keysBits, keysMask, hitPos) != key)
+				break;
+			recIdvec->push_back(hitPos);
+		}
+	}
+	offsets[num] = recIdvec->size();
+}
+
+void
+ZipIntKeyIndex::searchExactAppendBatch(const fstring* keys, size_t num,
+									   valvec<llong>* recIdvec, size_t* offsets,
+									   DbContext*)
+const {
+	switch (m_keyType) {
+	default:
+		THROW_STD(invalid_argument, "Bad m_keyType=%s", Schema::columnTypeStr(m_keyType));
+	case ColumnType::Sint08 : IntVecSearchExactBatch< int8_t >(keys, num, recIdvec, offsets); break;
+	case ColumnType::Uint08 : IntVecSearchExactBatch<uint8_t >(keys, num, recIdvec, offsets); break;
+	case ColumnType::Sint16 : IntVecSearchExactBatch< int16_t>(keys, num, recIdvec, offsets); break;
+	case ColumnType::Uint16 : IntVecSearchExactBatch<uint16_t>(keys, num, recIdvec, offsets); break;
+	case ColumnType::Sint32 : IntVecSearchExactBatch< int32_t>(keys, num, recIdvec, offsets); break;
+	case ColumnType::Uint32 : IntVecSearchExactBatch<uint32_t>(keys, num, recIdvec, offsets); break;
+	case ColumnType::Sint64 : IntVecSearchExactBatch< int64_t>(keys, num, recIdvec, offsets); break;
+	case ColumnType::Uint64 : IntVecSearchExactBatch<uint64_t>(keys, num, recIdvec, offsets); break;
+	case ColumnType::VarSint: IntVecSearchExactBatch< int64_t>(keys, num, recIdvec, offsets); break;
+	case ColumnType::VarUint: IntVecSearchExactBatch<uint64_t>(keys, num, recIdvec, offsets); break;
+	}
+}
+
+llong ZipIntKeyIndex::countRange(fstring lo, fstring hi, DbContext*) const {
+	size_t beg = lo.empty() ? 0 : searchLowerBound(lo);
+	size_t end = hi.empty() ? m_index.size() : searchLowerBound(hi);
+	return beg < end ? llong(end - beg) : 0;
+}
+
+llong ZipIntKeyIndex::scanRange(fstring lo, fstring hi,
+								const std::function<bool(llong)>& onRecord,
+								DbContext*)
+const {
+	size_t beg = lo.empty() ? 0 : searchLowerBound(lo);
+	size_t end = hi.empty() ? m_index.size() : searchLowerBound(hi);
+	auto indexData = m_index.data();
+	auto indexBits = m_index.uintbits();
+	auto indexMask = m_index.uintmask();
+	llong cnt = 0;
+	for (size_t i = beg; i < end; ++i) {
+		++cnt;
+		if (!onRecord(UintVecMin0::fast_get(indexData, indexBits, indexMask, i)))
+			break;
+	}
+	return cnt;
+}
+
 ///@}
 
 llong ZipIntKeyIndex::dataStorageSize() const {
-	return m_keys.mem_size() + m_index.mem_size();
+	return m_keys.mem_size() + m_index.mem_size() + m_keyBitmap.mem_size();
 }
 
 llong ZipIntKeyIndex::dataInflateSize() const {
@@ -353,6 +439,100 @@ void ZipIntKeyIndex::build(ColumnType keyType, SortableStrVec& strVec) {
 		assert(xk <= yk);
 	}
 #endif
+	buildSearchMode();
+}
+
+template<class Int>
+bool ZipIntKeyIndex::zipSortedKeys(SortedIndexInput& input) {
+	typedef typename boost::make_unsigned<Int>::type Uint;
+	valvec<byte> key, maxKey;
+	if (!input.keyBounds(&key, &maxKey)) {
+		m_keys.clear();
+		m_index.clear();
+		return true;
+	}
+	TERARK_RT_assert(key.size() == sizeof(Int), std::invalid_argument);
+	TERARK_RT_assert(maxKey.size() == sizeof(Int), std::invalid_argument);
+	const Int minVal = unaligned_load<Int>(key.data());
+	const Int maxVal = unaligned_load<Int>(maxKey.data());
+	const ullong wireMax = Uint(maxVal - minVal);
+	if (wireMax >> 58) {
+		return false; // UintVecMin0 does not support bits > 58
+	}
+	const size_t rows = size_t(input.numRows());
+	m_minKey = minVal;
+	m_keys.resize_with_wire_max_val(rows, wireMax);
+	m_index.resize_with_wire_max_val(rows, size_t(rows ? rows - 1 : 0));
+	size_t pos = 0;
+	llong recId = -1;
+	while (input.next(&recId, &key)) {
+		if (key.size() != sizeof(Int) || pos >= rows ||
+				recId < 0 || size_t(recId) >= rows ||
+				unaligned_load<Int>(key.data()) < minVal ||
+				unaligned_load<Int>(key.data()) > maxVal) {
+			THROW_STD(invalid_argument
+				, "bad sorted input: pos = %zd, recId = %lld, rows = %zd"
+				, pos, recId, rows);
+		}
+		Int val = unaligned_load<Int>(key.data());
+		m_keys.set_wire(size_t(recId), Uint(val - minVal));
+		m_index.set_wire(pos++, size_t(recId));
+	}
+	if (pos != rows) {
+		THROW_STD(invalid_argument
+			, "bad sorted input: got %zd keys, rows = %zd", pos, rows);
+	}
+	return true;
+}
+
+bool ZipIntKeyIndex::buildFromSorted(ColumnType keyType, SortedIndexInput& input) {
+	bool ok = false;
+	switch (keyType) {
+	default:
+		return false; // var int keys are not supported
+	case ColumnType::Sint08: ok = zipSortedKeys< int8_t >(input); break;
+	case ColumnType::Uint08: ok = zipSortedKeys<uint8_t >(input); break;
+	case ColumnType::Sint16: ok = zipSortedKeys< int16_t>(input); break;
+	case ColumnType::Uint16: ok = zipSortedKeys<uint16_t>(input); break;
+	case ColumnType::Sint32: ok = zipSortedKeys< int32_t>(input); break;
+	case ColumnType::Uint32: ok = zipSortedKeys<uint32_t>(input); break;
+	case ColumnType::Sint64: ok = zipSortedKeys< int64_t>(input); break;
+	case ColumnType::Uint64: ok = zipSortedKeys<uint64_t>(input); break;
+	}
+	if (ok) {
+		m_keyType = keyType;
+		buildSearchMode();
+	}
+	return ok;
+}
+
+void ZipIntKeyIndex::buildSearchMode() {
+	const size_t rows = m_index.size();
+	m_searchMode = SearchBinary;
+	m_keyBitmap.clear();
+	if (0 == rows) {
+		return;
+	}
+	m_maxKey = m_keys.get(m_index.get(rows - 1));
+	if (m_maxKey == rows - 1) {
+		size_t i = 0;
+		while (i < rows && m_keys.get(m_index.get(i)) == i) ++i;
+		if (i == rows) {
+			m_searchMode = SearchDense;
+			return;
+		}
+	}
+	// bitmap costs (rows + m_maxKey) bits, m_index is larger for most rows
+	if (m_maxKey >= 7ull * rows) {
+		return;
+	}
+	// m_maxKey + 2 zeros, select0(key) is valid for key <= m_maxKey + 1
+	m_keyBitmap.resize(rows + size_t(m_maxKey) + 2, false);
+	for (size_t i = 0; i < rows; ++i) {
+		m_keyBitmap.set1(size_t(m_keys.get(m_index.get(i))) + i);
+	}
+	m_keyBitmap.build_cache(true, false); // need select0
+	m_searchMode = SearchBitmap;
 }
 
 namespace {
@@ -361,7 +541,7 @@ namespace {
 		uint8_t  keyBits;
 		uint8_t  keyType;
 		uint8_t  isUnique;
-		uint8_t  padding;
+		uint8_t  searchMode;
 		 int64_t minKey;
 	};
 	BOOST_STATIC_ASSERT(sizeof(Header) == 16);
@@ -370,7 +550,7 @@ namespace {
 void ZipIntKeyIndex::load(PathRef path) {
 	auto fpath = path + ".zint";
 	bool writable = false;
-	m_mmapBase = (byte_t*)mmap_load(fpath.string(), &m_mmapSize, writable, m_schema.m_mmapPopulate);
+	m_mmapBase = (byte_t*)DbEnv::current()->mmapLoad(fpath.string(), &m_mmapSize, writable, m_schema.m_mmapPopulate);
 	auto h = (const Header*)m_mmapBase;
 	m_isUnique   = h->isUnique ? true : false;
 	m_keyType    = ColumnType(h->keyType);
@@ -378,28 +558,41 @@ void ZipIntKeyIndex::load(PathRef path) {
 	size_t indexBits = h->rows <= 1 ? 0 : terark_bsr_u64(h->rows - 1) + 1;
 	m_keys .risk_set_data((byte*)(h+1)                    , h->rows, h->keyBits);
 	m_index.risk_set_data((byte*)(h+1) + m_keys.mem_size(), h->rows,  indexBits);
+	m_searchMode = SearchMode(h->searchMode);
+	if (SearchDense == m_searchMode) {
+		m_maxKey = h->rows - 1;
+	}
+	else if (SearchBitmap == m_searchMode) {
+		size_t offset = sizeof(Header) + m_keys.mem_size() + m_index.mem_size();
+		m_keyBitmap.risk_mmap_from(m_mmapBase + offset, m_mmapSize - offset);
+		m_maxKey = m_keyBitmap.max_rank0() - 2;
+	}
 }
 
 void ZipIntKeyIndex::save(PathRef path) const {
 	auto fpath = path + ".zint";
-	NativeDataOutput<FileStream> dio;
+	NativeDataOutput<EnvFileStream> dio;
 	dio.open(fpath.string().c_str(), "wb");
 	Header h;
 	h.rows     = m_index.size();
 	h.keyBits  = m_keys.uintbits();
 	h.keyType  = uint8_t(m_keyType);
 	h.isUnique = m_isUnique;
-	h.padding  = 0;
+	h.searchMode = m_searchMode;
 	h.minKey   = m_minKey;
 	dio.ensureWrite(&h, sizeof(h));
 	dio.ensureWrite(m_keys .data(), m_keys .mem_size());
 	dio.ensureWrite(m_index.data(), m_index.mem_size());
+	if (SearchBitmap == m_searchMode) {
+		dio.ensureWrite(m_keyBitmap.data(), m_keyBitmap.mem_size());
+	}
 }
 
 class ZipIntKeyIndex::MyIndexIterForward : public IndexIterator {
 public:
 	size_t m_keyIdx;
 	const ZipIntKeyIndex* m_owner;
+	UintVecMin0ReadAhead  m_idBuf; // m_index is read sequentially
 
 	MyIndexIterForward(const ZipIntKeyIndex* owner) {
 		m_keyIdx = 0;
@@ -413,7 +606,7 @@ public:
 	bool increment(llong* id, valvec<byte>* key) override {
 		assert(nullptr != key);
 		if (m_keyIdx < m_owner->m_index.size()) {
-			*id = m_owner->m_index.get(m_keyIdx++);
+			*id = m_idBuf.get(m_owner->m_index, m_keyIdx++);
 			key->erase_all();
 			m_owner->getValueAppend(*id, key, nullptr);
 			return true;
@@ -425,7 +618,7 @@ public:
 		assert(nullptr != retKey);
 		m_keyIdx = key.empty() ? 0 : m_owner->searchLowerBound(key);
 		if (m_keyIdx < m_owner->m_index.size()) {
-			*id = m_owner->m_index[m_keyIdx];
+			*id = m_idBuf.get(m_owner->m_index, m_keyIdx);
 			retKey->erase_all();
 			m_owner->getValueAppend(*id, retKey, nullptr);
 			m_keyIdx++;
@@ -438,7 +631,7 @@ public:
 		assert(nullptr != retKey);
 		m_keyIdx = key.empty() ? 0 : m_owner->searchUpperBound(key);
 		if (m_keyIdx < m_owner->m_index.size()) {
-			*id = m_owner->m_index[m_keyIdx];
+			*id = m_idBuf.get(m_owner->m_index, m_keyIdx);
 			retKey->erase_all();
 			m_owner->getValueAppend(*id, retKey, nullptr);
 			m_keyIdx++;
@@ -16,11 +16,19 @@ public:
 	llong indexStorageSize() const override;
 
 	void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override;
+	void searchExactAppendBatch(const fstring* keys, size_t num,
+								valvec<llong>* recIdvec, size_t* offsets,
+								DbContext*) const override;
 	///@}
 
 	IndexIterator* createIndexIterForward(DbContext*) const override;
 	IndexIterator* createIndexIterBackward(DbContext*) const override;
 
+	llong countRange(fstring lo, fstring hi, DbContext*) const override;
+	llong scanRange(fstring lo, fstring hi,
+					const std::function<bool(llong recId)>& onRecord,
+					DbContext*) const override;
+
 	ReadableIndex* getReadableIndex() override;
 	ReadableStore* getReadableStore() override;
 
@@ -32,6 +40,9 @@ public:
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
 
 	void build(ColumnType keyType, SortableStrVec& strVec);
+	///@returns false if keyType or key range is not supported, and
+	///         input is not consumed
+	bool buildFromSorted(ColumnType keyType, SortedIndexInput& input);
 	void load(PathRef path) override;
 	void save(PathRef path) const override;
 
@@ -44,6 +55,23 @@ protected:
 	ColumnType  m_keyType;
 	const Schema& m_schema;
 
+	// searching by (key - m_minKey) without m_keys/m_index access:
+	// SearchDense : sorted keys are exactly 0..rows-1, lower_bound is key
+	// SearchBitmap: bit (key + sorted pos) is set for each row, so
+	//               lower_bound(key) is select0(key - 1) - (key - 1), and
+	//               0 for key 0
+	enum SearchMode : byte {
+		SearchBinary,
+		SearchDense,
+		SearchBitmap,
+	};
+	SearchMode     m_searchMode;
+	ullong         m_maxKey; // max of (key - m_minKey)
+	rank_select_se m_keyBitmap;
+
+	void buildSearchMode();
+	size_t rankLowerBound(ullong key) const;
+
 	template<class Int>
 	size_t IntVecLowerBound(fstring binkey) const;
 	size_t searchLowerBound(fstring binkey) const;
@@ -56,12 +84,19 @@ protected:
 	std::pair<size_t, size_t> IntVecEqualRange(fstring binkey) const;
 	std::pair<size_t, size_t> searchEqualRange(fstring binkey) const;
 
+	template<class Int>
+	void IntVecSearchExactBatch(const fstring* keys, size_t num,
+								valvec<llong>* recIdvec, size_t* offsets) const;
+
 	template<class Int>
 	void keyAppend(size_t recIdx, valvec<byte>* res) const;
 
 	template<class Int>
 	void zipKeys(const void* data, size_t size);
 
+	template<class Int>
+	bool zipSortedKeys(SortedIndexInput& input);
+
 	class MyIndexIterForward;  friend class MyIndexIterForward;
 	class MyIndexIterBackward; friend class MyIndexIterBackward;
 };
@@ -0,0 +1,261 @@
+#include "json_codec.hpp"
+#include <terark/bitmanip.hpp>
+#include <terark/num_to_str.hpp>
+#include <terark/util/throw.hpp>
+#include <math.h>
+#include <stdio.h>
+#include <stdexcept>
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+
+namespace terark { namespace db {
+
+static inline bool needEscape(byte c) {
+	return c < 0x20 || '"' == c || '\\' == c;
+}
+
+// @returns position of the first byte needs escape, n if none
+static inline size_t findEscape(const byte* p, size_t n) {
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctrl = _mm_set1_epi8(0x1F);
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, bslash));
+		// unsigned x <= 0x1F
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(x, ctrl), x));
+		unsigned mask = unsigned(_mm_movemask_epi8(m));
+		if (mask)
+			return i + fast_ctz32(mask);
+	}
+#endif
+	for (; i < n; ++i) {
+		if (needEscape(p[i]))
+			return i;
+	}
+	return n;
+}
+
+void JsonWriter::appendString(std::string* out, fstring str) {
+	static const char hex[] = "0123456789abcdef";
+	const byte* p = str.udata();
+	size_t n = str.size();
+	out->push_back('"');
+	for (;;) {
+		size_t k = findEscape(p, n);
+		out->append((const char*)p, k);
+		if (k == n)
+			break;
+		byte c = p[k];
+		char esc[6] = {'\\', 0};
+		size_t len = 2;
+		switch (c) {
+		case '"' : esc[1] = '"' ; break;
+		case '\\': esc[1] = '\\'; break;
+		case '\b': esc[1] = 'b' ; break;
+		case '\f': esc[1] = 'f' ; break;
+		case '\n': esc[1] = 'n' ; break;
+		case '\r': esc[1] = 'r' ; break;
+		case '\t': esc[1] = 't' ; break;
+		default:
+			esc[1] = 'u'; esc[2] = '0'; esc[3] = '0';
+			esc[4] = hex[c >> 4]; esc[5] = hex[c & 15];
+			len = 6;
+			break;
+		}
+		out->append(esc, len);
+		p += k + 1;
+		n -= k + 1;
+	}
+	out->push_back('"');
+}
+
+void JsonWriter::appendInt(std::string* out, llong x) {
+	char buf[32];
+	out->append(buf, num_to_str(buf, x));
+}
+
+void JsonWriter::appendUint(std::string* out, ullong x) {
+	char buf[32];
+	out->append(buf, num_to_str(buf, x));
+}
+
+// num_to_str of double is "%f", which loses precision
+void JsonWriter::appendDouble(std::string* out, double x, int precision) {
+	if (!isfinite(x)) {
+		out->append("null");
+		return;
+	}
+	char buf[64];
+	out->append(buf, snprintf(buf, sizeof(buf), "%.*g", precision, x));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+JsonReader::JsonReader(fstring text) {
+	m_beg = text.begin();
+	m_pos = text.begin();
+	m_end = text.end();
+}
+
+char JsonReader::peek() {
+	while (m_pos < m_end && (' ' == *m_pos || '\t' == *m_pos ||
+							 '\n' == *m_pos || '\r' == *m_pos))
+		m_pos++;
+	return m_pos < m_end ? *m_pos : 0;
+}
+
+bool JsonReader::consume(char ch) {
+	if (peek() == ch && m_pos < m_end) {
+		m_pos++;
+		return true;
+	}
+	return false;
+}
+
+void JsonReader::expect(char ch) {
+	if (!consume(ch)) {
+		char msg[32];
+		sprintf(msg, "expect '%c'", ch);
+		error(msg);
+	}
+}
+
+fstring JsonReader::skipValue() {
+	const char* beg = (peek(), m_pos);
+	if (m_pos >= m_end) {
+		error("expect a value");
+	}
+	switch (*m_pos) {
+	case '"':
+		for (++m_pos; ; ++m_pos) {
+			m_pos += findEscape((const byte*)m_pos, m_end - m_pos);
+			if (m_pos >= m_end || (byte)*m_pos < 0x20)
+				error("bad string");
+			if ('"' == *m_pos)
+				break;
+			if (++m_pos >= m_end) // '\\', skip the escaped char
+				error("bad string");
+		}
+		m_pos++;
+		break;
+	case '{':
+	case '[': {
+			const char close = '{' == *m_pos ? '}' : ']';
+			m_pos++;
+			if (consume(close))
+				break;
+			do {
+				if ('}' == close) {
+					if (peek() != '"')
+						error("expect a key");
+					skipValue();
+					expect(':');
+				}
+				skipValue();
+			} while (consume(','));
+			expect(close);
+		}
+		break;
+	default:
+		while (m_pos < m_end && !strchr(",:]} \t\r\n", *m_pos))
+			m_pos++;
+		if (m_pos == beg)
+			error("expect a value");
+		break;
+	}
+	return fstring(beg, m_pos);
+}
+
+static inline int hexValue(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static unsigned parseHex4(const char* p, const char* end) {
+	if (end - p < 4) {
+		THROW_STD(invalid_argument, "bad \\u escape");
+	}
+	unsigned u = 0;
+	for (int i = 0; i < 4; ++i) {
+		int h = hexValue(p[i]);
+		if (h < 0) {
+			THROW_STD(invalid_argument, "bad \\u escape");
+		}
+		u = u << 4 | h;
+	}
+	return u;
+}
+
+static void appendUtf8(unsigned u, valvec<byte>* out) {
+	if (u < 0x80) {
+		out->push_back(byte(u));
+	} else if (u < 0x800) {
+		out->push_back(byte(0xC0 | u >> 6));
+		out->push_back(byte(0x80 | (u & 63)));
+	} else if (u < 0x10000) {
+		out->push_back(byte(0xE0 | u >> 12));
+		out->push_back(byte(0x80 | (u >> 6 & 63)));
+		out->push_back(byte(0x80 | (u & 63)));
+	} else {
+		out->push_back(byte(0xF0 | u >> 18));
+		out->push_back(byte(0x80 | (u >> 12 & 63)));
+		out->push_back(byte(0x80 | (u >> 6 & 63)));
+		out->push_back(byte(0x80 | (u & 63)));
+	}
+}
+
+void JsonReader::decodeString(fstring str, valvec<byte>* out) {
+	assert(str.size() >= 2 && '"' == str[0] && '"' == str.end()[-1]);
+	const char* p = str.begin() + 1;
+	const char* end = str.end() - 1;
+	while (p < end) {
+		const char* q = (const char*)memchr(p, '\\', end - p);
+		if (NULL == q) {
+			out->append(p, end);
+			break;
+		}
+		out->append(p, q);
+		if (++q >= end) {
+			THROW_STD(invalid_argument, "bad escape at string end");
+		}
+		switch (*q++) {
+		default:
+			THROW_STD(invalid_argument, "bad escape char: %c", q[-1]);
+		case '"' : out->push_back('"' ); break;
+		case '\\': out->push_back('\\'); break;
+		case '/' : out->push_back('/' ); break;
+		case 'b' : out->push_back('\b'); break;
+		case 'f' : out->push_back('\f'); break;
+		case 'n' : out->push_back('\n'); break;
+		case 'r' : out->push_back('\r'); break;
+		case 't' : out->push_back('\t'); break;
+		case 'u' : {
+				unsigned u = parseHex4(q, end);
+				q += 4;
+				if (u >= 0xD800 && u < 0xDC00 && end - q >= 6 &&
+						'\\' == q[0] && 'u' == q[1]) {
+					unsigned lo = parseHex4(q + 2, end);
+					if (lo >= 0xDC00 && lo < 0xE000) {
+						u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+						q += 6;
+					}
+				}
+				appendUtf8(u, out);
+			}
+			break;
+		}
+		p = q;
+	}
+}
+
+void JsonReader::error(const char* msg) const {
+	THROW_STD(invalid_argument, "json: %s at offset %zd", msg, offset());
+}
+
+} } // namespace terark::db
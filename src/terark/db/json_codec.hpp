@@ -0,0 +1,47 @@
+#ifndef __terark_db_json_codec_hpp__
+#define __terark_db_json_codec_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/fstring.hpp>
+#include <terark/valvec.hpp>
+#include <string>
+
+namespace terark { namespace db {
+
+// JSON text of rows without building a DOM, used by Schema::appendJson and
+// Schema::parseJson. Strings are bytes, only '"', '\\' and control chars
+// are escaped, other bytes(such as utf8 or binary) are written as is
+class TERARK_DB_DLL JsonWriter {
+public:
+	/// quoted and escaped, escapes are found 16 bytes a time by SSE2
+	static void appendString(std::string* out, fstring str);
+	static void appendInt(std::string* out, llong x);
+	static void appendUint(std::string* out, ullong x);
+	/// "%.*g" of precision, 9 for float and 17 for double round trip,
+	/// non finite is null
+	static void appendDouble(std::string* out, double x, int precision);
+};
+
+// tokenizer of a JSON text, errors throw invalid_argument with the offset
+class TERARK_DB_DLL JsonReader {
+	const char* m_beg;
+	const char* m_pos;
+	const char* m_end;
+public:
+	explicit JsonReader(fstring text);
+	size_t offset() const { return m_pos - m_beg; }
+	/// skip white spaces and @returns the next char, 0 on end
+	char peek();
+	/// consume ch if it is the next char
+	bool consume(char ch);
+	void expect(char ch);
+	/// the next value of any type, it is skipped and its raw text returned
+	fstring skipValue();
+	/// decode the string token str, including the quotes, appended to out
+	static void decodeString(fstring str, valvec<byte>* out);
+	terark_no_return void error(const char* msg) const;
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_json_codec_hpp__
@@ -0,0 +1,131 @@
+#include "mem_budget.hpp"
+#include <terark/fstring.hpp>
+#include <algorithm>
+#include <mutex>
+#include <limits.h>
+#include <stdlib.h>
+
+namespace terark { namespace db {
+	TERARK_DB_DLL llong parseSizeValue(fstring str); // defined in db_conf.cpp
+}}
+
+namespace terark { namespace db {
+
+namespace {
+struct MemBudgetState {
+	std::mutex          mutex; // protect the member list
+	WritableMemBudget::Member* head = NULL;
+	ullong              seq = 0;
+	std::atomic<llong>  budget;
+	std::atomic<llong>  used;
+	MemBudgetState() {
+		budget = 0;
+		used = 0;
+		if (const char* env = getenv("TerarkDB_WritableMemBudget")) {
+			budget = parseSizeValue(env);
+		}
+	}
+};
+MemBudgetState& budgetState() {
+	static MemBudgetState st;
+	return st;
+}
+// members update the shared counter when the diff is larger than this,
+// writers of different segments don't bounce the counter on each write
+const llong AccountGranularity = 256 * 1024;
+}
+
+WritableMemBudget::Member::Member() {
+	auto& st = budgetState();
+	m_accounted = 0;
+	m_frozen = false;
+	m_prev = NULL;
+	std::lock_guard<std::mutex> lock(st.mutex);
+	m_seq = st.seq++;
+	m_next = st.head;
+	if (st.head)
+		st.head->m_prev = this;
+	st.head = this;
+}
+
+WritableMemBudget::Member::~Member() {
+	auto& st = budgetState();
+	st.used.fetch_sub(m_accounted.load(), std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(st.mutex);
+	if (m_prev)
+		m_prev->m_next = m_next;
+	else
+		st.head = m_next;
+	if (m_next)
+		m_next->m_prev = m_prev;
+}
+
+void WritableMemBudget::Member::update(llong bytes) {
+	llong old = m_accounted.load(std::memory_order_relaxed);
+	llong diff = bytes - old;
+	if (diff >= AccountGranularity || diff <= -AccountGranularity) {
+		// concurrent updaters, one of them wins and accounts the diff
+		if (m_accounted.compare_exchange_strong(old, bytes))
+			budgetState().used.fetch_add(diff, std::memory_order_relaxed);
+	}
+}
+
+void WritableMemBudget::Member::setFrozen() {
+	auto& st = budgetState();
+	std::lock_guard<std::mutex> lock(st.mutex);
+	m_frozen = true;
+}
+
+bool WritableMemBudget::Member::shouldFreeze() const {
+	if (pressure() == Pressure::none || m_frozen) {
+		return false;
+	}
+	auto& st = budgetState();
+	std::lock_guard<std::mutex> lock(st.mutex);
+	llong maxBytes = 0, sumBytes = 0, num = 0;
+	ullong minSeq = ULLONG_MAX;
+	for (const Member* p = st.head; p; p = p->m_next) {
+		if (p->m_frozen)
+			continue;
+		llong bytes = p->m_accounted.load(std::memory_order_relaxed);
+		maxBytes = std::max(maxBytes, bytes);
+		minSeq = std::min(minSeq, p->m_seq);
+		sumBytes += bytes;
+		num++;
+	}
+	llong myBytes = m_accounted.load(std::memory_order_relaxed);
+	if (0 == myBytes) {
+		return false; // an empty segment, freeze is useless
+	}
+	return myBytes == maxBytes || m_seq == minSeq || myBytes * num >= sumBytes;
+}
+
+llong WritableMemBudget::budget() {
+	return budgetState().budget.load(std::memory_order_relaxed);
+}
+
+void WritableMemBudget::setBudget(llong bytes) {
+	budgetState().budget.store(bytes, std::memory_order_relaxed);
+}
+
+llong WritableMemBudget::used() {
+	return budgetState().used.load(std::memory_order_relaxed);
+}
+
+WritableMemBudget::Pressure WritableMemBudget::pressure() {
+	auto& st = budgetState();
+	llong budget = st.budget.load(std::memory_order_relaxed);
+	if (budget <= 0) {
+		return Pressure::none;
+	}
+	llong used = st.used.load(std::memory_order_relaxed);
+	if (used >= budget + budget / 4)
+		return Pressure::stop;
+	if (used >= budget)
+		return Pressure::slowdown;
+	if (used >= budget / 10 * 9)
+		return Pressure::freeze;
+	return Pressure::none;
+}
+
+} } // namespace terark::db
@@ -0,0 +1,50 @@
+#ifndef __terark_db_mem_budget_hpp__
+#define __terark_db_mem_budget_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/stdtypes.hpp>
+#include <atomic>
+
+namespace terark { namespace db {
+
+// Process wide memory budget of in-memory writable segments(trbdb), shared
+// by all tables, the budget is env TerarkDB_WritableMemBudget(such as 8G),
+// 0 or unset is unlimited.
+// Segments account their memory by a Member, when the used memory reaches
+// 90% of the budget, some unfrozen segments are asked to freeze by
+// shouldFreeze(), writers are slowed down at 100% and stopped at 125%
+// by DbTable::getWriteStall, until converted segments release memory.
+class TERARK_DB_DLL WritableMemBudget {
+public:
+	enum class Pressure : unsigned char { none, freeze, slowdown, stop };
+
+	class TERARK_DB_DLL Member {
+		friend class WritableMemBudget;
+		Member* m_prev;
+		Member* m_next;
+		std::atomic<llong> m_accounted; // bytes added to the budget
+		ullong  m_seq;       // creation order, smaller is older
+		bool    m_frozen;
+		Member(const Member&) = delete;
+		Member& operator=(const Member&) = delete;
+	public:
+		Member();
+		~Member();
+		/// bytes is the current memory of the segment, thread safe
+		void update(llong bytes);
+		/// frozen segments keep their memory but are not freeze candidates
+		void setFrozen();
+		/// true if the segment is the largest, the oldest, or larger than
+		/// the average of unfrozen segments when pressure >= freeze
+		bool shouldFreeze() const;
+	};
+
+	static llong budget();
+	static void setBudget(llong);
+	static llong used();
+	static Pressure pressure();
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_mem_budget_hpp__
@@ -0,0 +1,93 @@
+#include "merge_policy.hpp"
+#include "db_conf.hpp"
+#include <terark/hash_strmap.hpp>
+
+namespace terark { namespace db {
+
+typedef hash_strmap< std::function<MergePolicy*()>
+					, fstring_func::hash_align
+					, fstring_func::equal_align
+					, ValueInline, SafeCopy
+					>
+		MergePolicyFactory;
+static	MergePolicyFactory& s_mergePolicyFactory() {
+	static MergePolicyFactory instance;
+	return instance;
+}
+
+MergePolicy::RegisterMergePolicy::
+RegisterMergePolicy(std::initializer_list<fstring> names, const PolicyCreator& creator) {
+	MergePolicyFactory& factory = s_mergePolicyFactory();
+	fstring clazz = *names.begin();
+	for (fstring name : names) {
+		auto ib = factory.insert_i(name, creator);
+		assert(ib.second);
+		if (!ib.second) {
+			THROW_STD(invalid_argument
+				, "duplicate merge policy name %s for class: %s"
+				, name.c_str(), clazz.c_str());
+		}
+	}
+}
+
+MergePolicy* MergePolicy::createMergePolicy(fstring policyName) {
+	const MergePolicyFactory& factory = s_mergePolicyFactory();
+	const size_t idx = factory.find_i(policyName);
+	if (idx < factory.end_i()) {
+		MergePolicy* policy = factory.val(idx)();
+		assert(policy);
+		return policy;
+	}
+	THROW_STD(invalid_argument, "unknown merge policy: %s", policyName.c_str());
+}
+
+MergePolicy::~MergePolicy() {
+}
+
+bool
+SizeTieredMergePolicy::pickMergeRange(const SchemaConfig& sconf,
+									  const MergeCandidate* segs, size_t num,
+									  size_t* rngBeg, size_t* rngLen)
+const {
+	const llong  maxSegSize = sconf.m_maxMergeSegSize;
+	const size_t maxFanIn = std::max<size_t>(sconf.m_maxMergeFanIn, 2);
+	const size_t minFanIn = std::min(maxFanIn,
+		std::max<size_t>(sconf.m_minMergeSegNum, 2));
+	const double sizeRatio = std::max(sconf.m_mergeSizeRatio, 1.0);
+	// tiny segments are all in the lowest tier
+	const llong  floorSize = std::max<llong>(sconf.m_mergeTierFloorSize, 1);
+	double bestScore = 0;
+	*rngBeg = 0;
+	*rngLen = 0;
+	for (size_t i = 0; i < num; ++i) {
+		llong sum = segs[i].storageSize;
+		if (sum >= maxSegSize)
+			continue;
+		double lo = double(std::max(sum, floorSize)), hi = lo;
+		for (size_t j = i + 1; j < num && j - i < maxFanIn; ++j) {
+			llong size = segs[j].storageSize;
+			if (sum + size > maxSegSize)
+				break;
+			double tier = double(std::max(size, floorSize));
+			lo = std::min(lo, tier);
+			hi = std::max(hi, tier);
+			if (hi > lo * sizeRatio)
+				break;
+			sum += size;
+			size_t len = j - i + 1;
+			if (len < minFanIn)
+				continue;
+			// segments eliminated per written byte
+			double score = double(len - 1) / std::max(sum, floorSize);
+			if (score > bestScore) {
+				bestScore = score;
+				*rngBeg = i;
+				*rngLen = len;
+			}
+		}
+	}
+	return *rngLen >= 2;
+}
+TERARK_DB_REGISTER_MERGE_POLICY(SizeTieredMergePolicy, "SizeTiered");
+
+} } // namespace terark::db
@@ -0,0 +1,62 @@
+#ifndef __terark_db_merge_policy_hpp__
+#define __terark_db_merge_policy_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/fstring.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <functional>
+
+namespace terark { namespace db {
+
+class TERARK_DB_DLL SchemaConfig;
+
+// A mergable segment as seen by MergePolicy, in table order
+struct MergeCandidate {
+	llong  storageSize; // bytes of all index and colgroup stores
+	size_t liveRows;
+	bool   isReadonly;
+};
+
+// Chooses which segments of a table are merged by autoConvMergePurge,
+// configured by json key "MergePolicy", empty name is the builtin rule.
+// Merged segments must be adjacent, record ids are positional.
+class TERARK_DB_DLL MergePolicy : public RefCounter {
+public:
+	struct TERARK_DB_DLL RegisterMergePolicy {
+		typedef std::function<MergePolicy*()> PolicyCreator;
+		RegisterMergePolicy(std::initializer_list<fstring> names, const PolicyCreator&);
+	};
+#define TERARK_DB_REGISTER_MERGE_POLICY(PolicyClass, ...) \
+	static MergePolicy::RegisterMergePolicy \
+	regMergePolicy_##PolicyClass({#PolicyClass,##__VA_ARGS__}, \
+		[]()->MergePolicy*{return new PolicyClass();})
+
+	static MergePolicy* createMergePolicy(fstring policyName);
+
+	virtual ~MergePolicy();
+
+	///@param segs   candidates, not forced merge
+	///@param rngBeg,rngLen  the range [rngBeg, rngBeg+rngLen) to be merged
+	///@returns false if nothing should be merged now
+	virtual bool pickMergeRange(const SchemaConfig&,
+								const MergeCandidate* segs, size_t num,
+								size_t* rngBeg, size_t* rngLen) const = 0;
+};
+typedef boost::intrusive_ptr<MergePolicy> MergePolicyPtr;
+
+// Merges runs of adjacent segments of similar size (max/min in a run is
+// at most MergeSizeRatio), a run has at most MaxMergeFanIn segments and
+// the merged segment is at most MaxMergeSegSize. Among qualified runs,
+// the run which eliminates most segments per written byte is chosen, so
+// a huge segment is not re-merged until enough peers of its tier exist.
+class TERARK_DB_DLL SizeTieredMergePolicy : public MergePolicy {
+public:
+	bool pickMergeRange(const SchemaConfig&,
+						const MergeCandidate* segs, size_t num,
+						size_t* rngBeg, size_t* rngLen) const override;
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_merge_policy_hpp__
@@ -1,6 +1,7 @@
 #include "mock_db_engine.hpp"
 #include <terark/io/FileStream.hpp>
 #include <terark/io/StreamBuffer.hpp>
+#include <terark/io/MmapInputBuffer.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/num_to_str.hpp>
 #include <terark/util/sortable_strvec.hpp>
@@ -16,6 +17,16 @@ MockReadonlyStore::MockReadonlyStore(const Schema& schema)
   : m_schema(schema)
 {
 	m_fixedLen = schema.getFixedRowLen();
+	m_mmapBase = NULL;
+	m_mmapSize = 0;
+}
+MockReadonlyStore::~MockReadonlyStore() {
+	if (m_mmapBase) {
+		if (0 == m_fixedLen)
+			m_rows.offsets.risk_release_ownership();
+		m_rows.strpool.risk_release_ownership();
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
+	}
 }
 llong MockReadonlyStore::dataStorageSize() const {
 	return m_rows.used_mem_size();
@@ -102,19 +113,24 @@ void MockReadonlyStore::save(PathRef path) const {
 	}
 	dio.ensureWrite(m_rows.strpool.data(), m_rows.strpool.used_mem_size());
 }
+// m_rows references the mmap'ed file, it is not copied
 void MockReadonlyStore::load(PathRef fpath) {
-	FileStream fp(fpath.string().c_str(), "rb");
-	fp.disbuf();
-	NativeDataInput<InputBuffer> dio; dio.attach(&fp);
+	assert(NULL == m_mmapBase);
+	m_mmapBase = (byte_t*)DbEnv::current()->mmapLoad(fpath.string(), &m_mmapSize);
+	NativeDataInput<MmapInputBuffer> dio; dio.set(m_mmapBase, m_mmapSize);
 	uint64_t fixlen, rows, strSize;
 	dio >> fixlen;
 	dio >> rows;
 	dio >> strSize;
 	m_fixedLen = size_t(fixlen);
-	m_rows.strpool.resize_no_init(size_t(strSize));
 	if (0 == m_fixedLen) {
-		m_rows.offsets.resize_no_init(size_t(rows + 1));
-		dio.ensureRead(m_rows.offsets.data(), m_rows.offsets.used_mem_size());
+		m_rows.offsets.clear();
+		// offsets follow the 24 bytes header, they are always aligned
+		bool isRef = dio.zc_load_array(m_rows.offsets, size_t(rows + 1));
+		TERARK_RT_assert(isRef, std::logic_error);
+	}
+	dio.zc_load_array(m_rows.strpool, size_t(strSize));
+	if (0 == m_fixedLen) {
 	#if !defined(NDEBUG)
 		assert(m_rows.strpool.size() == m_rows.offsets.back());
 		for (size_t i = 0; i < rows; ++i) {
@@ -125,7 +141,6 @@ void MockReadonlyStore::load(PathRef fpath) {
 		assert(m_rows.strpool.size() % m_fixedLen == 0);
 		assert(m_rows.strpool.size() / m_fixedLen == rows);
 	}
-	dio.ensureRead(m_rows.strpool.data(), m_rows.strpool.used_mem_size());
 }
 
 struct FixedLenKeyExtractor {
@@ -273,9 +288,18 @@ void MockReadonlyIndex::getIndexKey(llong* id, valvec<byte>* key, size_t pos) co
 MockReadonlyIndex::MockReadonlyIndex(const Schema& schema) {
 	m_schema = &schema;
 	m_fixedLen = schema.getFixedRowLen();
+	m_mmapBase = NULL;
+	m_mmapSize = 0;
 }
 
 MockReadonlyIndex::~MockReadonlyIndex() {
+	if (m_mmapBase) {
+		m_ids.risk_release_ownership();
+		if (0 == m_fixedLen)
+			m_keys.offsets.risk_release_ownership();
+		m_keys.strpool.risk_release_ownership();
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
+	}
 }
 
 StoreIterator* MockReadonlyIndex::createStoreIterForward(DbContext*) const {
@@ -363,25 +387,27 @@ void MockReadonlyIndex::save(PathRef fpath) const {
 	dio.ensureWrite(m_keys.strpool.data(), m_keys.strpool.used_mem_size());
 }
 
+// m_ids and m_keys reference the mmap'ed file, they are not copied
 void MockReadonlyIndex::load(PathRef fpath) {
-	FileStream fp(fpath.string().c_str(), "rb");
-	fp.disbuf();
-	NativeDataInput<InputBuffer> dio; dio.attach(&fp);
+	assert(NULL == m_mmapBase);
+	m_mmapBase = (byte_t*)DbEnv::current()->mmapLoad(fpath.string(), &m_mmapSize);
+	NativeDataInput<MmapInputBuffer> dio; dio.set(m_mmapBase, m_mmapSize);
 	uint64_t fixlen, rows, keylen;
 	dio >> fixlen;
 	dio >> rows;
 	dio >> keylen;
-	m_ids.resize_no_init(size_t(rows));
-	dio.ensureRead(m_ids.data(), m_ids.used_mem_size());
+	// ids and offsets are uint32 after the 24 bytes header, always aligned
+	bool isRef = dio.zc_load_array(m_ids, size_t(rows));
+	TERARK_RT_assert(isRef, std::logic_error);
 	if (0 == fixlen) {
-		m_keys.offsets.resize_no_init(size_t(rows + 1));
-		dio.ensureRead(m_keys.offsets.data(), m_keys.offsets.used_mem_size());
+		m_keys.offsets.clear();
+		isRef = dio.zc_load_array(m_keys.offsets, size_t(rows + 1));
+		TERARK_RT_assert(isRef, std::logic_error);
 	}
 	else {
 		assert(fixlen * rows == keylen);
 	}
-	m_keys.strpool.resize_no_init(size_t(keylen));
-	dio.ensureRead(m_keys.strpool.data(), size_t(keylen));
+	dio.zc_load_array(m_keys.strpool, size_t(keylen));
 	m_fixedLen = size_t(fixlen);
 }
 
@@ -874,6 +900,12 @@ const {
 	return index.release();
 }
 
+ReadableIndex*
+MockReadonlySegment::buildIndexFromSorted(const Schema&, SortedIndexInput&)
+const {
+	return nullptr; // always use MockReadonlyIndex
+}
+
 ReadableStore*
 MockReadonlySegment::buildStore(const Schema& schema, SortableStrVec& storeData)
 const {
@@ -888,7 +920,8 @@ const {
 ReadableStore*
 MockReadonlySegment::
 buildDictZipStore(const Schema& schema, PathRef segDir, StoreIterator& iter,
-				  const bm_uint_t* isDel, const febitvec* isPurged) const {
+				  const bm_uint_t* isDel, const febitvec* isPurged,
+				  fstring) const {
 	valvec<byte> rec;
 	std::unique_ptr<MockReadonlyStore> store(new MockReadonlyStore(schema));
 	if (NULL == isPurged || isPurged->size() == 0) {
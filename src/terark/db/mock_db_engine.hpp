@@ -12,9 +12,12 @@ namespace terark { namespace db {
 class TERARK_DB_DLL MockReadonlyStore : public ReadableStore {
 	size_t    m_fixedLen;
 	const Schema& m_schema;
+	byte_t*   m_mmapBase; // m_rows references it after load
+	size_t    m_mmapSize;
 public:
 	fstrvec m_rows;
 	explicit MockReadonlyStore(const Schema&);
+	~MockReadonlyStore();
 
 	void build(const Schema&, SortableStrVec& storeData);
 
@@ -37,6 +40,8 @@ class TERARK_DB_DLL MockReadonlyIndex : public ReadableIndex, public ReadableSto
 	valvec<uint32_t> m_ids;  // keys[ids[i]] <= keys[ids[i+1]]
 	size_t m_fixedLen;
 	const Schema* m_schema;
+	byte_t* m_mmapBase; // m_keys and m_ids reference it after load
+	size_t  m_mmapSize;
 	void getIndexKey(llong* id, valvec<byte>* key, size_t pos) const;
 	int forwardLowerBound(fstring key, size_t* pLower) const;
 public:
@@ -131,9 +136,11 @@ protected:
 	ReadableIndex* openIndex(const Schema&, PathRef path) const override;
 
 	ReadableIndex* buildIndex(const Schema&, SortableStrVec& indexData) const override;
+	ReadableIndex* buildIndexFromSorted(const Schema&, SortedIndexInput&) const override;
 	ReadableStore* buildStore(const Schema&, SortableStrVec& storeData) const override;
 	ReadableStore* buildDictZipStore(const Schema&, PathRef, StoreIterator& iter,
-					  const bm_uint_t* isDel, const febitvec* isPurged) const override;
+					  const bm_uint_t* isDel, const febitvec* isPurged,
+					  fstring reuseDict) const override;
 };
 
 class TERARK_DB_DLL MockWritableSegment : public PlainWritableSegment {
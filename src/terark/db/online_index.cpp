@@ -0,0 +1,98 @@
+#include "online_index.hpp"
+#include "db_segment.hpp"
+#include "db_env.hpp"
+#include <terark/util/sortable_strvec.hpp>
+#include <boost/filesystem.hpp>
+
+namespace terark { namespace db {
+
+namespace fs = boost::filesystem;
+
+OnlineIndex::OnlineIndex(const Schema& rowSchema, fstring name,
+						 const std::vector<std::string>& columns, bool ordered) {
+	if (columns.empty() || columns.size() > Schema::MaxProjColumns) {
+		THROW_STD(invalid_argument, "online index %.*s: columns = %zd, max = %zd"
+			, name.ilen(), name.data(), columns.size(), Schema::MaxProjColumns);
+	}
+	SchemaPtr schema(new Schema());
+	schema->m_name = name.str();
+	for (const std::string& colname : columns) {
+		size_t k = rowSchema.getColumnId(colname);
+		if (k == rowSchema.columnNum()) {
+			THROW_STD(invalid_argument,
+				"colname=%s is not in RowSchema", colname.c_str());
+		}
+		auto ib = schema->m_columnsMeta.insert_i(colname, rowSchema.getColumnMeta(k));
+		if (!ib.second) {
+			THROW_STD(invalid_argument,
+				"duplicate colname=%s in online index", colname.c_str());
+		}
+		m_columnIds.push_back(k);
+	}
+	schema->m_isOrdered = ordered;
+	schema->m_mmapPopulate = true; // same as default of TableIndex
+	schema->compile(&rowSchema);
+	m_schema = schema;
+}
+
+OnlineIndex::~OnlineIndex() {
+}
+
+std::string OnlineIndex::filePath(const ReadonlySegment* seg) const {
+	return (seg->m_segDir / ("online-index-" + m_schema->m_name)).string();
+}
+
+bool OnlineIndex::load(const ReadonlySegment* seg) {
+	std::string path = filePath(seg);
+	if (!fs::exists(path + ".done")) {
+		return false;
+	}
+	ReadableIndexPtr index = seg->openIndex(*m_schema, path);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_segIndices[seg] = SegIndex{const_cast<ReadonlySegment*>(seg), index};
+	return true;
+}
+
+// ids of the index are physic ids, deleted rows are also indexed because
+// isDel is checked by searches, same as indices of the schema
+void OnlineIndex::build(const ReadonlySegment* seg, DbContext* ctx) {
+	const size_t physicRows = seg->getPhysicRows();
+	SortableStrVec keys;
+	valvec<byte> key;
+	for (size_t physicId = 0; physicId < physicRows; ++physicId) {
+		seg->selectColumnsByPhysicId(physicId, m_columnIds.data(),
+									 m_columnIds.size(), &key, ctx);
+		keys.push_back(key);
+	}
+	std::string path = filePath(seg);
+	{
+		ReadableIndexPtr built = seg->buildIndex(*m_schema, keys);
+		built->save(path);
+	}
+	EnvFileStream(path + ".done", "wb").close();
+	ReadableIndexPtr index = seg->openIndex(*m_schema, path);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_segIndices[seg] = SegIndex{const_cast<ReadonlySegment*>(seg), index};
+}
+
+ReadableIndexPtr OnlineIndex::getIndex(const ReadableSegment* seg) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto iter = m_segIndices.find(seg);
+	if (m_segIndices.end() == iter) {
+		return NULL;
+	}
+	return iter->second.index;
+}
+
+void OnlineIndex::retain(const valvec<ReadableSegmentPtr>& segs) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto iter = m_segIndices.begin(); iter != m_segIndices.end(); ) {
+		auto seg = const_cast<ReadableSegment*>(iter->first);
+		if (std::find(segs.begin(), segs.end(), seg) == segs.end())
+			iter = m_segIndices.erase(iter);
+		else
+			++iter;
+	}
+}
+
+} } // namespace terark::db
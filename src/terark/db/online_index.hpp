@@ -0,0 +1,53 @@
+#ifndef __terark_db_online_index_hpp__
+#define __terark_db_online_index_hpp__
+
+#include "db_index.hpp"
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace terark { namespace db {
+
+class ReadableSegment;
+class ReadonlySegment;
+typedef boost::intrusive_ptr<ReadableSegment> ReadableSegmentPtr;
+
+// An index added to an existing table by DbTable::addOnlineIndex, it is not
+// in the schema, so colgroups and segments of the table are not changed.
+// It is built for each readonly segment in background by the index type of
+// the segment, from keys of physic rows, and saved in the segment dir as
+// online-index-<name> and a done marker file. Segments which have not been
+// built, and writable segments, are searched by scanning their rows.
+class TERARK_DB_DLL OnlineIndex : public RefCounter {
+	struct SegIndex {
+		ReadableSegmentPtr seg; // keep seg alive for the address as key
+		ReadableIndexPtr index;
+	};
+	mutable std::mutex m_mutex;
+	std::map<const ReadableSegment*, SegIndex> m_segIndices;
+public:
+	SchemaPtr m_schema; // key schema, compiled with the row schema as parent
+	valvec<size_t> m_columnIds; // of row schema, same as m_schema->getProj()
+
+	OnlineIndex(const Schema& rowSchema, fstring name,
+				const std::vector<std::string>& columns, bool ordered);
+	~OnlineIndex();
+	const std::string& name() const { return m_schema->m_name; }
+
+	std::string filePath(const ReadonlySegment*) const;
+	/// open the index if it was built and saved in the segment dir
+	bool load(const ReadonlySegment*);
+	/// build, save and open the index of the segment
+	void build(const ReadonlySegment*, DbContext*);
+	/// NULL if it is not built for the segment
+	ReadableIndexPtr getIndex(const ReadableSegment*) const;
+	/// drop indices of segments which are not in segs
+	void retain(const valvec<ReadableSegmentPtr>& segs);
+};
+typedef boost::intrusive_ptr<OnlineIndex> OnlineIndexPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_online_index_hpp__
@@ -0,0 +1,705 @@
+#include "partitioned_table.hpp"
+#include "json.hpp"
+#include <terark/util/linebuf.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+
+namespace terark { namespace db {
+
+namespace fs = boost::filesystem;
+
+static std::string keyToHex(fstring key) {
+	static const char hexdigits[] = "0123456789abcdef";
+	std::string hex(key.size() * 2, '\0');
+	for (size_t i = 0; i < key.size(); ++i) {
+		byte_t b = key.uch(i);
+		hex[2*i+0] = hexdigits[b >> 4];
+		hex[2*i+1] = hexdigits[b & 15];
+	}
+	return hex;
+}
+
+static int hexDigit(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static std::string hexToKey(const std::string& hex) {
+	if (hex.size() % 2) {
+		THROW_STD(invalid_argument, "odd length of hex key: %s", hex.c_str());
+	}
+	std::string key(hex.size() / 2, '\0');
+	for (size_t i = 0; i < key.size(); ++i) {
+		int hi = hexDigit(hex[2*i+0]);
+		int lo = hexDigit(hex[2*i+1]);
+		if (hi < 0 || lo < 0) {
+			THROW_STD(invalid_argument, "bad hex key: %s", hex.c_str());
+		}
+		key[i] = char(hi << 4 | lo);
+	}
+	return key;
+}
+
+PartitionedTable::Context::Context(PartitionedTable* tab) {
+	m_tab = tab;
+	m_version = size_t(-1);
+}
+
+PartitionedTable::Context::~Context() {
+}
+
+// called in the lock of m_tab->m_rwMutex
+DbContext* PartitionedTable::Context::partCtx(size_t part) {
+	if (m_tab->m_version != m_version) {
+		m_ctxs.erase_all();
+		m_ctxs.resize(m_tab->m_parts.size());
+		m_version = m_tab->m_version;
+	}
+	assert(part < m_ctxs.size());
+	DbContextPtr& ctx = m_ctxs[part];
+	if (!ctx) {
+		assert(m_tab->m_parts[part].tab);
+		ctx = m_tab->m_parts[part].tab->createDbContext();
+	}
+	return ctx.get();
+}
+
+PartitionedTable::PartitionedTable() {
+}
+
+PartitionedTable::~PartitionedTable() {
+}
+
+PartitionedTable*
+PartitionedTable::create(PathRef rootDir, fstring jsonSchema, fstring keyIndex) {
+	if (fs::exists(rootDir / "partitions.json")) {
+		THROW_STD(invalid_argument, "partitioned table %s already exists",
+			rootDir.string().c_str());
+	}
+	std::unique_ptr<PartitionedTable> tab(new PartitionedTable());
+	tab->m_schema = new SchemaConfig();
+	tab->m_schema->loadJsonString(jsonSchema);
+	tab->m_keyIndexName = keyIndex.str();
+	tab->m_keyIndexId = tab->m_schema->getIndexId(keyIndex);
+	if (tab->m_keyIndexId >= tab->m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "keyIndex %s is not an index of the schema",
+			keyIndex.c_str());
+	}
+	if (!tab->m_schema->getIndexSchema(tab->m_keyIndexId).m_isOrdered) {
+		THROW_STD(invalid_argument, "keyIndex %s is not ordered", keyIndex.c_str());
+	}
+	tab->m_dir = rootDir;
+	fs::create_directories(rootDir);
+	tab->m_schema->saveJsonFile((rootDir / "dbmeta.json").string());
+	Partition part;
+	part.dir = tab->newPartDir();
+	fs::create_directories(rootDir / part.dir);
+	tab->m_schema->saveJsonFile((rootDir / part.dir / "dbmeta.json").string());
+	tab->m_parts.push_back(part);
+	tab->saveLayout();
+	tab->openParts();
+	return tab.release();
+}
+
+PartitionedTable* PartitionedTable::open(PathRef rootDir) {
+	using terark::json;
+	std::unique_ptr<PartitionedTable> tab(new PartitionedTable());
+	tab->m_dir = rootDir;
+	tab->m_schema = new SchemaConfig();
+	tab->m_schema->loadJsonFile((rootDir / "dbmeta.json").string());
+	LineBuf text;
+	text.read_all((rootDir / "partitions.json").string().c_str());
+	const json js = json::parse(std::string(text.p, text.n));
+	tab->m_keyIndexName = js["KeyIndex"].get<std::string>();
+	tab->m_keyIndexId = tab->m_schema->getIndexId(tab->m_keyIndexName);
+	if (tab->m_keyIndexId >= tab->m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument, "%s: KeyIndex %s is not an index of the schema",
+			rootDir.string().c_str(), tab->m_keyIndexName.c_str());
+	}
+	tab->m_nextPartId = js["NextPartId"].get<size_t>();
+	for (const auto& jp : js["Partitions"]) {
+		Partition part;
+		part.dir = jp["Dir"].get<std::string>();
+		part.lo = hexToKey(jp["Lo"].get<std::string>());
+		auto iter = jp.find("Remote");
+		if (jp.end() != iter)
+			part.remote = iter.value().get<std::string>();
+		iter = jp.find("Trimmed");
+		if (jp.end() != iter)
+			part.trimmed = iter.value().get<bool>();
+		tab->m_parts.push_back(part);
+	}
+	if (tab->m_parts.empty() || !tab->m_parts[0].lo.empty()) {
+		THROW_STD(invalid_argument, "%s: Lo of the first partition must be empty",
+			rootDir.string().c_str());
+	}
+	auto staging = js.find("Staging");
+	if (js.end() != staging) {
+		for (const auto& jd : staging.value()) {
+			auto from = jd.find("From");
+			tab->m_staging[jd["Dir"].get<std::string>()] =
+				jd.end() != from ? from.value().get<std::string>() : std::string();
+		}
+	}
+	tab->recoverStaging();
+	DbTable::removeTrashInBackground(rootDir / ".trash");
+	tab->openParts();
+	tab->trimAll(); // of an interrupted split
+	return tab.release();
+}
+
+void PartitionedTable::openParts() {
+	size_t localNum = 0;
+	for (auto& part : m_parts) {
+		if (part.remote.empty() && !part.tab) {
+			part.tab = DbTable::open(m_dir / part.dir);
+			localNum++;
+		}
+	}
+	fprintf(stderr, "INFO: PartitionedTable::open(%s): partitions = %zd, local = %zd\n"
+		, m_dir.string().c_str(), m_parts.size(), localNum);
+}
+
+void PartitionedTable::saveLayout() const {
+	using terark::json;
+	json parts = json::array();
+	for (auto& part : m_parts) {
+		json jp;
+		jp["Dir"] = part.dir;
+		jp["Lo"] = keyToHex(part.lo);
+		if (!part.remote.empty())
+			jp["Remote"] = part.remote;
+		if (!part.trimmed)
+			jp["Trimmed"] = false;
+		parts.push_back(jp);
+	}
+	json js;
+	js["KeyIndex"] = m_keyIndexName;
+	js["NextPartId"] = m_nextPartId;
+	js["Partitions"] = parts;
+	if (!m_staging.empty()) {
+		json staging = json::array();
+		for (auto& x : m_staging) {
+			json jd;
+			jd["Dir"] = x.first;
+			if (!x.second.empty())
+				jd["From"] = x.second;
+			staging.push_back(jd);
+		}
+		js["Staging"] = staging;
+	}
+	std::string str = js.dump(2);
+	std::string fpath = (m_dir / "partitions.json").string();
+	std::string tmpFile = fpath + ".tmp";
+	{
+		EnvFileStream fp(tmpFile, "w");
+		fp.ensureWrite(str.data(), str.size());
+	}
+	fs::rename(tmpFile, fpath);
+}
+
+std::string PartitionedTable::newPartDir() {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "p-%06zd", m_nextPartId++);
+	return buf;
+}
+
+// staging dirs of a split or attachPartition which was interrupted before
+// it was committed to the layout
+void PartitionedTable::recoverStaging() {
+	if (m_staging.empty()) {
+		return;
+	}
+	for (auto& x : m_staging) {
+		fs::path dir = m_dir / x.first;
+		if (!fs::exists(dir)) {
+			continue;
+		}
+		if (x.second.empty()) {
+			fprintf(stderr, "WARN: PartitionedTable::open: remove %s of an interrupted split\n"
+				, dir.string().c_str());
+			DbTable::removeDirInBackground(dir, m_dir / ".trash");
+		}
+		else {
+			fprintf(stderr, "WARN: PartitionedTable::open: move %s of an interrupted attachPartition back to %s\n"
+				, dir.string().c_str(), x.second.c_str());
+			fs::rename(dir, x.second);
+		}
+	}
+	m_staging.clear();
+	saveLayout();
+}
+
+// m_parts[0].lo is empty, it is less than all keys
+size_t PartitionedTable::findPartition(fstring key) const {
+	const Schema& schema = getKeySchema();
+	size_t lo = 1, hi = m_parts.size();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (schema.compareData(m_parts[mid].lo, key) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+fstring PartitionedTable::hiOf(size_t part) const {
+	return part + 1 < m_parts.size() ? fstring(m_parts[part + 1].lo) : fstring();
+}
+
+void PartitionedTable::checkPartIdx(size_t part, const char* func) const {
+	if (part >= m_parts.size()) {
+		THROW_STD(invalid_argument, "%s(%s): part = %zd >= partitionNum = %zd"
+			, func, m_dir.string().c_str(), part, m_parts.size());
+	}
+}
+
+void PartitionedTable::checkLocal(size_t part, const char* func) const {
+	checkPartIdx(part, func);
+	if (!m_parts[part].tab) {
+		THROW_STD(invalid_argument, "%s(%s): part = %zd is of remote node %s"
+			, func, m_dir.string().c_str(), part, m_parts[part].remote.c_str());
+	}
+}
+
+fstring PartitionedTable::rowKey(fstring row, Context* ctx) const {
+	m_schema->m_rowSchema->parseRow(row, &ctx->m_cols);
+	getKeySchema().selectParent(ctx->m_cols, &ctx->m_key);
+	return ctx->m_key;
+}
+
+size_t PartitionedTable::partitionNum() const {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	return m_parts.size();
+}
+
+void PartitionedTable::getPartitions(std::vector<PartitionInfo>* parts) const {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	parts->clear();
+	parts->reserve(m_parts.size());
+	for (size_t i = 0; i < m_parts.size(); ++i) {
+		PartitionInfo info;
+		info.lo = m_parts[i].lo;
+		info.hi = hiOf(i).str();
+		info.dir = m_parts[i].dir;
+		info.remote = m_parts[i].remote;
+		info.tab = m_parts[i].tab;
+		info.trimmed = m_parts[i].trimmed;
+		parts->push_back(info);
+	}
+}
+
+size_t PartitionedTable::partitionOf(fstring key) const {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	return findPartition(key);
+}
+
+// called in the read lock of m_rwMutex before the write of key, so the
+// write is done before the swap of the split in the write lock
+void PartitionedTable::logSplitKey(size_t part, fstring key) const {
+	SplitLog* log = m_splitLog.get();
+	if (log && log->part == part &&
+			getKeySchema().compareData(key, log->lo) >= 0) {
+		std::lock_guard<std::mutex> lock(log->mutex);
+		log->keys.push_back(key.str());
+	}
+}
+
+llong PartitionedTable::upsertRow(fstring row, Context* ctx) {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	fstring key = rowKey(row, ctx);
+	size_t part = findPartition(key);
+	if (!m_parts[part].tab) {
+		return -2;
+	}
+	logSplitKey(part, key);
+	return m_parts[part].tab->upsertRow(row, ctx->partCtx(part));
+}
+
+llong PartitionedTable::insertRow(fstring row, Context* ctx) {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	fstring key = rowKey(row, ctx);
+	size_t part = findPartition(key);
+	if (!m_parts[part].tab) {
+		return -2;
+	}
+	logSplitKey(part, key);
+	return m_parts[part].tab->insertRow(row, ctx->partCtx(part));
+}
+
+llong PartitionedTable::removeByKey(fstring key, Context* ctx) {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	size_t part = findPartition(key);
+	DbTable* tab = m_parts[part].tab.get();
+	if (!tab) {
+		return -2;
+	}
+	logSplitKey(part, key);
+	DbContext* pctx = ctx->partCtx(part);
+	valvec<llong> recIds;
+	tab->indexSearchExact(m_keyIndexId, key, &recIds, pctx);
+	llong removed = 0;
+	for (llong recId : recIds) {
+		removed += tab->removeRow(recId, pctx);
+	}
+	return removed;
+}
+
+size_t
+PartitionedTable::getValuesByKeyBatch(const fstring* keys, size_t num, llong* recIds,
+									  valvec<byte>* vals, size_t* parts, Context* ctx)
+const {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	valvec<size_t> keyParts(num, valvec_no_init());
+	valvec<size_t> order(num, valvec_no_init());
+	for (size_t k = 0; k < num; ++k) {
+		keyParts[k] = findPartition(keys[k]);
+		order[k] = k;
+		if (parts)
+			parts[k] = keyParts[k];
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+		return keyParts[x] < keyParts[y];
+	});
+	valvec<fstring> groupKeys;
+	valvec<llong> groupIds;
+	valvec<valvec<byte> > groupVals;
+	size_t found = 0;
+	for (size_t i = 0; i < num; ) {
+		size_t part = keyParts[order[i]];
+		size_t j = i;
+		while (j < num && keyParts[order[j]] == part) ++j;
+		DbTable* tab = m_parts[part].tab.get();
+		if (!tab) {
+			for (size_t g = i; g < j; ++g) {
+				recIds[order[g]] = -2;
+				vals[order[g]].erase_all();
+			}
+			i = j;
+			continue;
+		}
+		size_t n = j - i;
+		groupKeys.resize_no_init(n);
+		groupIds.resize_no_init(n);
+		groupVals.resize(n);
+		for (size_t g = 0; g < n; ++g)
+			groupKeys[g] = keys[order[i + g]];
+		found += tab->getValuesByKeyBatch(m_keyIndexId, groupKeys.data(), n,
+						groupIds.data(), groupVals.data(), ctx->partCtx(part));
+		for (size_t g = 0; g < n; ++g) {
+			recIds[order[i + g]] = groupIds[g];
+			vals[order[i + g]].swap(groupVals[g]);
+		}
+		i = j;
+	}
+	return found;
+}
+
+llong
+PartitionedTable::scanRange(fstring lo, fstring hi, const OnRecord& onRecord,
+							valvec<size_t>* remoteParts, Context* ctx)
+const {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	const Schema& schema = getKeySchema();
+	if (remoteParts)
+		remoteParts->erase_all();
+	size_t part = lo.empty() ? 0 : findPartition(lo);
+	llong scanned = 0;
+	bool stopped = false;
+	for (; part < m_parts.size() && !stopped; ++part) {
+		fstring plo = m_parts[part].lo;
+		fstring phi = hiOf(part);
+		if (!hi.empty() && !plo.empty() && schema.compareData(plo, hi) >= 0) {
+			break;
+		}
+		DbTable* tab = m_parts[part].tab.get();
+		if (!tab) {
+			if (remoteParts)
+				remoteParts->push_back(part);
+			continue;
+		}
+		// [max(lo, plo), min(hi, phi)), empty is unbounded
+		fstring clo = lo.empty() || (!plo.empty() && schema.compareData(plo, lo) > 0) ? plo : lo;
+		fstring chi = hi;
+		if (hi.empty() || (!phi.empty() && schema.compareData(phi, hi) < 0))
+			chi = phi;
+		DbContext* pctx = ctx->partCtx(part);
+		scanned += tab->indexScanRange(m_keyIndexId, clo, chi, [&](llong recId) {
+			if (onRecord(tab, recId, pctx))
+				return true;
+			stopped = true;
+			return false;
+		}, pctx);
+	}
+	return scanned;
+}
+
+// rows of m_parts[part].tab out of [lo, hi) are removed, m_rwMutex is locked
+void PartitionedTable::trimPartition(size_t part) const {
+	DbTable* tab = m_parts[part].tab.get();
+	fstring lo = m_parts[part].lo;
+	fstring hi = hiOf(part);
+	DbContextPtr ctx = tab->createDbContext();
+	valvec<llong> recIds;
+	auto onRecord = [&](llong recId) { recIds.push_back(recId); return true; };
+	if (!lo.empty())
+		tab->indexScanRange(m_keyIndexId, fstring(), lo, onRecord, ctx.get());
+	if (!hi.empty())
+		tab->indexScanRange(m_keyIndexId, hi, fstring(), onRecord, ctx.get());
+	llong removed = 0;
+	for (llong recId : recIds) {
+		removed += tab->removeRow(recId, ctx.get());
+	}
+	fprintf(stderr, "INFO: PartitionedTable::trimPartition(%s): removed %lld rows out of range\n"
+		, (m_dir / m_parts[part].dir).string().c_str(), removed);
+}
+
+// writes are not blocked during the removal, rows out of range of a
+// partition are not seen by the router. Then they are marked trimmed
+void PartitionedTable::trimAll() {
+	std::lock_guard<std::mutex> layoutLock(m_layoutMutex);
+	std::vector<std::string> trimmedDirs;
+	{
+		TableRwMutex::scoped_lock lock(m_rwMutex, false);
+		for (size_t i = 0; i < m_parts.size(); ++i) {
+			if (m_parts[i].tab && !m_parts[i].trimmed) {
+				trimPartition(i);
+				trimmedDirs.push_back(m_parts[i].dir);
+			}
+		}
+	}
+	if (trimmedDirs.empty()) {
+		return;
+	}
+	TableRwMutex::scoped_lock lock(m_rwMutex, true);
+	for (auto& part : m_parts) {
+		if (trimmedDirs.end() !=
+				std::find(trimmedDirs.begin(), trimmedDirs.end(), part.dir))
+			part.trimmed = true;
+	}
+	saveLayout();
+}
+
+// rows of keys logged during the backup are copied from left to right,
+// in the write lock of m_rwMutex
+void PartitionedTable::replaySplitLog(DbTable* left, DbTable* right) {
+	std::vector<std::string>& keys = m_splitLog->keys;
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	DbContextPtr lctx = left->createDbContext();
+	DbContextPtr rctx = right->createDbContext();
+	valvec<llong> recIds;
+	valvec<byte> row;
+	for (const std::string& key : keys) {
+		right->indexSearchExact(m_keyIndexId, key, &recIds, rctx.get());
+		for (llong recId : recIds) {
+			right->removeRow(recId, rctx.get());
+		}
+		left->indexSearchExact(m_keyIndexId, key, &recIds, lctx.get());
+		for (llong recId : recIds) {
+			left->getValue(recId, &row, lctx.get());
+			if (right->insertRow(row, rctx.get()) < 0) {
+				THROW_STD(runtime_error, "split(%s): insertRow failed: %s"
+					, m_dir.string().c_str(), rctx->errMsg.c_str());
+			}
+		}
+	}
+}
+
+void PartitionedTable::split(size_t part, fstring splitKey) {
+	{
+		std::lock_guard<std::mutex> layoutLock(m_layoutMutex);
+		const Schema& schema = getKeySchema();
+		Partition right;
+		DbTablePtr left;
+		{
+			TableRwMutex::scoped_lock lock(m_rwMutex, true);
+			checkLocal(part, "split");
+			fstring lo = m_parts[part].lo;
+			fstring hi = hiOf(part);
+			if (splitKey.empty() || (!lo.empty() && schema.compareData(splitKey, lo) <= 0)
+					|| (!hi.empty() && schema.compareData(splitKey, hi) >= 0)) {
+				THROW_STD(invalid_argument, "split(%s): splitKey %s is out of part %zd(%s, %s)"
+					, m_dir.string().c_str(), schema.toJsonStr(splitKey).c_str(), part
+					, schema.toJsonStr(lo).c_str(), schema.toJsonStr(hi).c_str());
+			}
+			right.lo = splitKey.str();
+			right.dir = newPartDir();
+			right.trimmed = false;
+			m_staging[right.dir] = std::string();
+			saveLayout(); // NextPartId is saved before the dir is created
+			m_splitLog.reset(new SplitLog());
+			m_splitLog->part = part;
+			m_splitLog->lo = right.lo;
+			left = m_parts[part].tab;
+		}
+		fs::path rightDir = m_dir / right.dir;
+		// called in the write lock of m_rwMutex
+		auto unstage = [&]() {
+			m_splitLog.reset();
+			m_staging.erase(right.dir);
+			saveLayout();
+			right.tab = NULL;
+			boost::system::error_code ec;
+			fs::remove_all(rightDir, ec);
+		};
+		try {
+			left->backupTo(rightDir);
+			right.tab = DbTable::open(rightDir);
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: PartitionedTable::split(%s) failed: %s\n"
+				, rightDir.string().c_str(), ex.what());
+			TableRwMutex::scoped_lock lock(m_rwMutex, true);
+			unstage();
+			throw;
+		}
+		TableRwMutex::scoped_lock lock(m_rwMutex, true);
+		size_t logged = m_splitLog->keys.size();
+		try {
+			replaySplitLog(left.get(), right.tab.get());
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: PartitionedTable::split(%s) failed: %s\n"
+				, rightDir.string().c_str(), ex.what());
+			unstage();
+			throw;
+		}
+		m_splitLog.reset();
+		m_parts[part].trimmed = false;
+		m_parts.insert(m_parts.begin() + part + 1, right);
+		m_staging.erase(right.dir);
+		m_version++;
+		saveLayout();
+		fprintf(stderr, "INFO: PartitionedTable::split(%s): part %zd at %s, new part %s, logged keys = %zd\n"
+			, m_dir.string().c_str(), part, schema.toJsonStr(splitKey).c_str()
+			, right.dir.c_str(), logged);
+	}
+	trimAll();
+}
+
+// writes are blocked during the copy
+void PartitionedTable::merge(size_t part) {
+	std::lock_guard<std::mutex> layoutLock(m_layoutMutex);
+	TableRwMutex::scoped_lock lock(m_rwMutex, true);
+	checkLocal(part, "merge");
+	checkLocal(part + 1, "merge");
+	for (size_t i : {part, part + 1}) {
+		if (!m_parts[i].trimmed) { // rows out of range must not be copied
+			trimPartition(i);
+			m_parts[i].trimmed = true;
+		}
+	}
+	DbTable* dst = m_parts[part].tab.get();
+	DbTablePtr src = m_parts[part + 1].tab;
+	DbContextPtr dstCtx = dst->createDbContext();
+	DbContextPtr srcCtx = src->createDbContext();
+	valvec<byte> row;
+	llong copied = 0;
+	src->indexScanRange(m_keyIndexId, fstring(), fstring(), [&](llong recId) {
+		src->getValue(recId, &row, srcCtx.get());
+		if (dst->insertRow(row, dstCtx.get()) < 0) {
+			THROW_STD(runtime_error, "merge(%s): insertRow failed: %s"
+				, m_dir.string().c_str(), dstCtx->errMsg.c_str());
+		}
+		copied++;
+		return true;
+	}, srcCtx.get());
+	std::string srcDir = m_parts[part + 1].dir;
+	m_parts.erase(m_parts.begin() + part + 1);
+	m_version++;
+	saveLayout();
+	src->dropTable();
+	fprintf(stderr, "INFO: PartitionedTable::merge(%s): copied %lld rows of %s into %s\n"
+		, m_dir.string().c_str(), copied, srcDir.c_str(), m_parts[part].dir.c_str());
+}
+
+void PartitionedTable::shipPartitionTo(size_t part, PathRef dir, SegmentShipStat* stat) {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	checkLocal(part, "shipPartitionTo");
+	m_parts[part].tab->shipSegmentsTo(dir, stat);
+}
+
+void
+PartitionedTable::detachPartition(size_t part, PathRef dir, fstring node,
+								  TableBackupStat* stat) {
+	if (node.empty()) {
+		THROW_STD(invalid_argument, "node must not be empty");
+	}
+	std::lock_guard<std::mutex> layoutLock(m_layoutMutex);
+	TableRwMutex::scoped_lock lock(m_rwMutex, true);
+	checkLocal(part, "detachPartition");
+	DbTablePtr tab = m_parts[part].tab;
+	tab->backupTo(dir, stat);
+	m_parts[part].tab = NULL;
+	m_parts[part].remote = node.str();
+	m_version++;
+	saveLayout();
+	tab->dropTable();
+	fprintf(stderr, "INFO: PartitionedTable::detachPartition(%s): part %zd to %s, remote node %s\n"
+		, m_dir.string().c_str(), part, dir.string().c_str(), node.c_str());
+}
+
+// the remote partition gets no writes here, so dir is moved and opened
+// online, the write lock is only for the swap
+void PartitionedTable::attachPartition(size_t part, PathRef dir) {
+	{
+		std::lock_guard<std::mutex> layoutLock(m_layoutMutex);
+		std::string newDir;
+		{
+			TableRwMutex::scoped_lock lock(m_rwMutex, true);
+			checkPartIdx(part, "attachPartition");
+			if (m_parts[part].tab) {
+				THROW_STD(invalid_argument, "attachPartition(%s): part %zd is local"
+					, m_dir.string().c_str(), part);
+			}
+			newDir = newPartDir();
+			m_staging[newDir] = fs::absolute(dir).string();
+			saveLayout(); // NextPartId is saved before the dir is moved
+		}
+		fs::path partDir = m_dir / newDir;
+		DbTablePtr tab;
+		try {
+			fs::rename(dir, partDir);
+			tab = DbTable::open(partDir);
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: PartitionedTable::attachPartition(%s) failed: %s\n"
+				, partDir.string().c_str(), ex.what());
+			boost::system::error_code ec;
+			if (fs::exists(partDir, ec))
+				fs::rename(partDir, dir, ec);
+			if (!fs::exists(partDir, ec)) { // else it is recovered by open
+				TableRwMutex::scoped_lock lock(m_rwMutex, true);
+				m_staging.erase(newDir);
+				saveLayout();
+			}
+			throw;
+		}
+		TableRwMutex::scoped_lock lock(m_rwMutex, true);
+		Partition& p = m_parts[part];
+		p.tab = tab;
+		p.dir = newDir;
+		p.remote.clear();
+		p.trimmed = false; // it may be detached before it was trimmed
+		m_staging.erase(newDir);
+		m_version++;
+		saveLayout();
+		fprintf(stderr, "INFO: PartitionedTable::attachPartition(%s): part %zd from %s\n"
+			, m_dir.string().c_str(), part, dir.string().c_str());
+	}
+	trimAll();
+}
+
+void PartitionedTable::syncFinishWriting() {
+	TableRwMutex::scoped_lock lock(m_rwMutex, false);
+	for (auto& part : m_parts) {
+		if (part.tab)
+			part.tab->syncFinishWriting();
+	}
+}
+
+} } // namespace terark::db
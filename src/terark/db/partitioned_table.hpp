@@ -0,0 +1,178 @@
+#ifndef __terark_db_partitioned_table_hpp__
+#define __terark_db_partitioned_table_hpp__
+
+#include "db_table.hpp"
+#include "table_rwlock.hpp"
+#include <map>
+#include <mutex>
+
+namespace terark { namespace db {
+
+// A logical table of key range partitions, each partition is a DbTable of
+// a sub dir of the root dir, all of the same schema. Partitions are ranged
+// by keys of an ordered index(the key index) in the order of its schema,
+// partition i is [lo(i), lo(i+1)), lo(0) is empty(unbounded). The layout
+// is in rootDir/partitions.json, which is rewritten by split and merge:
+// {
+//   "KeyIndex": "key",
+//   "NextPartId": 4,
+//   "Partitions": [
+//     { "Dir": "p-000000", "Lo": "" },
+//     { "Dir": "p-000002", "Lo": "6d", "Trimmed": false },
+//     { "Dir": "p-000001", "Lo": "7a", "Remote": "node7" }
+//   ],
+//   "Staging": [ { "Dir": "p-000003" } ]
+// }
+// Lo is hex of the key. Staging are dirs of a split or attachPartition
+// which is not yet committed to Partitions, they are saved with NextPartId
+// before the dir is created, open of an interrupted one removes the dir of
+// a split, and moves the dir of an attachPartition back to "From". A remote partition is owned by another node, so
+// it has no DbTable here, ops of its keys are reported to the caller, who
+// routes them to the node. The router is process local, the transport of
+// dirs and requests between nodes is of the application.
+//
+// Moving a partition to another node:
+//   1. shipPartitionTo(i, dir) repeatedly, dir is copied to the target
+//      node(or is of a network file system), it is a replica which the
+//      target can serve reads by DbTable::openReplica
+//   2. detachPartition(i, dir, node): a final backup of i to dir, i is
+//      remote from now on, its table is dropped
+//   3. attachPartition(i, dir) on the target node
+class TERARK_DB_DLL PartitionedTable : public RefCounter {
+public:
+	struct PartitionInfo {
+		std::string lo;     // empty is unbounded
+		std::string hi;     // empty is unbounded
+		std::string dir;    // sub dir of the root dir
+		std::string remote; // node of a remote partition, else empty
+		DbTablePtr  tab;    // null if remote
+		bool trimmed;       // false if it has rows out of range after a split
+	};
+	class TERARK_DB_DLL Context : public RefCounter {
+		friend class PartitionedTable;
+		PartitionedTable*    m_tab;
+		size_t               m_version;
+		valvec<DbContextPtr> m_ctxs; // by partition index
+		ColumnVec            m_cols;
+		valvec<byte>         m_key;
+		DbContext* partCtx(size_t part);
+	public:
+		/// it must not outlive the table
+		explicit Context(PartitionedTable*);
+		~Context();
+	};
+	typedef boost::intrusive_ptr<Context> ContextPtr;
+	/// returns false to stop the scan
+	typedef std::function<bool(DbTable* tab, llong recId, DbContext* ctx)> OnRecord;
+
+private:
+	struct Partition {
+		std::string lo;
+		std::string dir;
+		std::string remote;
+		DbTablePtr  tab;
+		bool trimmed = true;
+	};
+	// keys written to [lo, hi) of a partition being split, they are copied
+	// to the right half when it is swapped in
+	struct SplitLog {
+		size_t      part;
+		std::string lo;
+		std::mutex  mutex;
+		std::vector<std::string> keys;
+	};
+	mutable TableRwMutex m_rwMutex; // read by ops, write by layout changes
+	std::mutex m_layoutMutex; // serializes layout changes
+	std::unique_ptr<SplitLog> m_splitLog; // of the split in progress
+	std::vector<Partition> m_parts;
+	std::map<std::string, std::string> m_staging; // dir -> From, empty of split
+	std::string m_keyIndexName;
+	size_t      m_keyIndexId = size_t(-1);
+	size_t      m_nextPartId = 0;
+	size_t      m_version = 0; // incremented on each layout change
+	SchemaConfigPtr m_schema; // of rootDir/dbmeta.json
+	boost::filesystem::path m_dir;
+
+	PartitionedTable();
+	void saveLayout() const;
+	void openParts();
+	std::string newPartDir();
+	void recoverStaging();
+	void logSplitKey(size_t part, fstring key) const;
+	void replaySplitLog(DbTable* left, DbTable* right);
+	size_t findPartition(fstring key) const;
+	fstring hiOf(size_t part) const;
+	void checkLocal(size_t part, const char* func) const;
+	void checkPartIdx(size_t part, const char* func) const;
+	void trimPartition(size_t part) const;
+	void trimAll();
+	fstring rowKey(fstring row, Context*) const;
+
+public:
+	~PartitionedTable();
+
+	/// create rootDir with one partition of the whole key space, keyIndex
+	/// is the column names of an ordered index of jsonSchema
+	static PartitionedTable* create(PathRef rootDir, fstring jsonSchema, fstring keyIndex);
+	static PartitionedTable* open(PathRef rootDir);
+
+	Context* createContext() { return new Context(this); }
+
+	size_t getKeyIndexId() const { return m_keyIndexId; }
+	const Schema& getKeySchema() const { return m_schema->getIndexSchema(m_keyIndexId); }
+	size_t partitionNum() const;
+	void getPartitions(std::vector<PartitionInfo>* parts) const;
+	/// index of the partition of key, key is of the key index
+	size_t partitionOf(fstring key) const;
+
+	///@{ write ops are routed by the key of the row
+	///@returns recId in the partition, -2 if the partition is remote
+	llong upsertRow(fstring row, Context*);
+	llong insertRow(fstring row, Context*);
+	///@returns removed rows, -2 if the partition is remote
+	llong removeByKey(fstring key, Context*);
+	///@}
+
+	/// recIds[k] is recId of keys[k] in partition parts[k], -1 if not found,
+	/// -2 if the partition is remote. Keys are grouped by partitions, each
+	/// group is one getValuesByKeyBatch of the partition. parts is optional
+	///@returns found
+	size_t getValuesByKeyBatch(const fstring* keys, size_t num, llong* recIds,
+							   valvec<byte>* vals, size_t* parts, Context*) const;
+
+	/// rows whose key is in [lo, hi), empty lo or hi is unbounded, local
+	/// partitions are scanned in key order, the range is clipped by each
+	/// partition. remoteParts are partitions overlapped by [lo, hi) which are
+	/// remote, it is optional
+	///@returns scanned rows
+	llong scanRange(fstring lo, fstring hi, const OnRecord& onRecord,
+					valvec<size_t>* remoteParts, Context*) const;
+
+	/// split part at splitKey into [lo, splitKey) and [splitKey, hi), files
+	/// of the right half are hard linked by DbTable::backupTo, then rows out
+	/// of range of both halves are removed. The backup and open of the right
+	/// half are online, keys written to [splitKey, hi) meanwhile are logged,
+	/// ops are blocked only while their rows are copied to the right half and
+	/// it is swapped in. The removal of rows out of range is online, it is
+	/// resumed by open if it was interrupted
+	void split(size_t part, fstring splitKey);
+	/// merge part + 1 into part, rows of part + 1 are copied into part
+	void merge(size_t part);
+
+	/// ship readonly segments of part to dir, see DbTable::shipSegmentsTo
+	void shipPartitionTo(size_t part, PathRef dir, SegmentShipStat* stat = NULL);
+	/// backup part to dir(see DbTable::backupTo), then part is remote on
+	/// node, its table is dropped. Writes of part are blocked during it
+	void detachPartition(size_t part, PathRef dir, fstring node, TableBackupStat* stat = NULL);
+	/// the dir of a backup or detachPartition of that remote partition is
+	/// moved into the root dir and opened online, then part is local
+	void attachPartition(size_t part, PathRef dir);
+
+	void syncFinishWriting();
+};
+typedef boost::intrusive_ptr<PartitionedTable> PartitionedTablePtr;
+typedef PartitionedTable::ContextPtr PartitionedContextPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_partitioned_table_hpp__
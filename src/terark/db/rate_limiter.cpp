@@ -0,0 +1,101 @@
+#include "rate_limiter.hpp"
+#include <algorithm>
+#include <chrono>
+#include <assert.h>
+
+namespace terark { namespace db {
+
+ullong WriteRateLimiter::nowNs() {
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+WriteRateLimiter::WriteRateLimiter(size_t bytesPerSec) {
+	m_bytesPerSec = bytesPerSec;
+	m_tokens = double(bytesPerSec);
+	m_lastNs = nowNs();
+}
+
+WriteRateLimiter::~WriteRateLimiter() {
+}
+
+void WriteRateLimiter::setRate(size_t bytesPerSec) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_bytesPerSec = bytesPerSec;
+	m_tokens = std::min(m_tokens, double(bytesPerSec));
+}
+
+void WriteRateLimiter::adjustRate(ullong) {
+}
+
+size_t WriteRateLimiter::consume(size_t bytes) {
+	const size_t MaxSleepMicrosec = 100000;
+	ullong curr = nowNs();
+	adjustRate(curr);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	double rate = double(m_bytesPerSec.load(std::memory_order_relaxed));
+	if (0 == rate) {
+		m_lastNs = curr;
+		return 0;
+	}
+	m_tokens = std::min(m_tokens + 1e-9 * (curr - m_lastNs) * rate, rate);
+	m_lastNs = curr;
+	m_tokens -= bytes;
+	if (m_tokens >= 0) {
+		return 0;
+	}
+	return std::min(size_t(-m_tokens / rate * 1e6), MaxSleepMicrosec);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+AdaptiveWriteRateLimiter::AdaptiveWriteRateLimiter(size_t minRate,
+												   size_t maxRate,
+												   ullong targetNs)
+  : WriteRateLimiter(maxRate)
+  , m_minRate(std::min(std::max<size_t>(minRate, 1), maxRate))
+  , m_maxRate(maxRate)
+  , m_targetNs(targetNs) {
+	assert(maxRate > 0);
+	m_reads = 0;
+	m_slowReads = 0;
+	m_periodBegNs = nowNs();
+	m_backoffNum = 0;
+}
+
+AdaptiveWriteRateLimiter::~AdaptiveWriteRateLimiter() {
+}
+
+void AdaptiveWriteRateLimiter::addReadLatency(ullong ns) {
+	ullong reads = m_reads.fetch_add(1, std::memory_order_relaxed);
+	if (ns > m_targetNs) {
+		m_slowReads.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (reads % 64 == 63) {
+		adjustRate(nowNs()); // writers may be idle
+	}
+}
+
+// on each period, just one thread wins the cas and adjusts the rate
+void AdaptiveWriteRateLimiter::adjustRate(ullong curr) {
+	ullong beg = m_periodBegNs.load(std::memory_order_relaxed);
+	if (curr < beg + ullong(PeriodMs) * 1000000 ||
+		!m_periodBegNs.compare_exchange_strong(beg, curr)) {
+		return;
+	}
+	ullong reads = m_reads.exchange(0, std::memory_order_relaxed);
+	ullong slow = m_slowReads.exchange(0, std::memory_order_relaxed);
+	size_t oldRate = rate();
+	size_t newRate;
+	if (slow * 100 > reads) {
+		newRate = std::max(oldRate / 2, m_minRate);
+		m_backoffNum.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		newRate = std::min(oldRate + std::max<size_t>(m_maxRate / 16, 1), m_maxRate);
+	}
+	if (newRate != oldRate) {
+		setRate(newRate);
+	}
+}
+
+} } // namespace terark::db
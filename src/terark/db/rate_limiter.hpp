@@ -0,0 +1,63 @@
+#ifndef __terark_db_rate_limiter_hpp__
+#define __terark_db_rate_limiter_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/stdtypes.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <mutex>
+
+namespace terark { namespace db {
+
+// Token bucket of bytes per second shared by writers of many tables, such
+// as the tables of a DataBase. Writers consume the bytes they have written
+// and sleep for the debt, the burst is one second of the rate.
+class TERARK_DB_DLL WriteRateLimiter : public RefCounter {
+	std::mutex m_mutex;
+	std::atomic<size_t> m_bytesPerSec; // 0 is unlimited
+	double m_tokens; // negative is the debt
+	ullong m_lastNs;
+public:
+	explicit WriteRateLimiter(size_t bytesPerSec);
+	~WriteRateLimiter();
+	void setRate(size_t bytesPerSec);
+	size_t rate() const { return m_bytesPerSec.load(std::memory_order_relaxed); }
+	///@returns microseconds the writer should sleep, at most 100ms, the
+	///         remaining debt is paid by later calls
+	size_t consume(size_t bytes);
+protected:
+	/// hook of subclasses to change the rate, called by consume out of lock
+	virtual void adjustRate(ullong nowNs);
+	static ullong nowNs();
+};
+typedef boost::intrusive_ptr<WriteRateLimiter> WriteRateLimiterPtr;
+
+// Limiter of background writes which backs off when foreground reads are
+// slow. Readers report sampled latencies by addReadLatency, at the end of
+// each period the rate is halved if more than 1% of the reads are slower
+// than the target(p99 is above the target), else it is raised by 1/16 of
+// maxRate, the rate is always in [minRate, maxRate].
+class TERARK_DB_DLL AdaptiveWriteRateLimiter : public WriteRateLimiter {
+	std::atomic<ullong> m_reads;
+	std::atomic<ullong> m_slowReads;
+	std::atomic<ullong> m_periodBegNs;
+	std::atomic<ullong> m_backoffNum;
+	const size_t m_minRate;
+	const size_t m_maxRate;
+	const ullong m_targetNs;
+protected:
+	void adjustRate(ullong nowNs) override;
+public:
+	enum { PeriodMs = 250 };
+	AdaptiveWriteRateLimiter(size_t minRate, size_t maxRate, ullong targetNs);
+	~AdaptiveWriteRateLimiter();
+	void addReadLatency(ullong ns);
+	ullong backoffNum() const { return m_backoffNum.load(std::memory_order_relaxed); }
+	ullong targetNs() const { return m_targetNs; }
+};
+typedef boost::intrusive_ptr<AdaptiveWriteRateLimiter> AdaptiveWriteRateLimiterPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_rate_limiter_hpp__
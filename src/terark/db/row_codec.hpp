@@ -0,0 +1,242 @@
+#ifndef __terark_db_row_codec_hpp__
+#define __terark_db_row_codec_hpp__
+
+#include "db_conf.hpp"
+#include <terark/io/var_int.hpp>
+#include <string.h>
+
+// Template specialized row codec, the column layout of a schema is template
+// arguments, so the per column ColumnType switch of the interpreter in
+// Schema::parseRow/combineRow/selectParent is resolved at compile time.
+//
+// terark-db-schema-compile generates a RowCodecOf<...> for each schema,
+// the generated Table::registerRowCodecs() registers them by
+// Schema::rowCodecHash(), Schema::compile() picks up the registered codec.
+
+namespace terark { namespace db {
+
+// FixLen must be ColumnMeta::fixedLen, it is 0 for var length columns
+template<ColumnType Type, uint32_t FixLen = 0>
+struct RowCodecCol {
+	static const ColumnType type = Type;
+	static const uint32_t fixedLen = FixLen;
+
+	template<bool IsLast>
+	static inline void
+	parse(const Schema& schema, size_t colIdx, const byte* base,
+		  const byte*& curr, const byte* last, ColumnVec* cols) {
+		size_t colpos = curr - base;
+		size_t collen = 0;
+		if (FixLen) {
+			if (terark_unlikely(curr + FixLen > last))
+				Schema::throwRowOutOfRange(schema, colIdx, FixLen, last-curr);
+			collen = FixLen;
+			curr += FixLen;
+		}
+		else switch (Type) {
+		default:
+			THROW_STD(runtime_error, "Invalid data row");
+			break;
+		case ColumnType::VarSint:
+			{
+				const byte* next = nullptr;
+				load_var_int64(curr, &next);
+				collen = next - curr;
+				curr = next;
+			}
+			break;
+		case ColumnType::VarUint:
+			{
+				const byte* next = nullptr;
+				load_var_uint64(curr, &next);
+				collen = next - curr;
+				curr = next;
+			}
+			break;
+		case ColumnType::StrZero:
+			collen = strnlen((const char*)curr, last - curr);
+			if (!IsLast) {
+				if (terark_unlikely(curr + collen + 1 > last))
+					Schema::throwRowOutOfRange(schema, colIdx, collen+1, last-curr);
+				curr += collen + 1;
+			}
+			else if (intptr_t(collen + 1) < last - curr) {
+				THROW_STD(invalid_argument,
+					"'\\0' in StrZero is not at string end");
+			}
+			break;
+		case ColumnType::TwoStrZero:
+			{
+				intptr_t n1 = strnlen((const char*)curr, last - curr);
+				if (!IsLast) {
+					if (terark_unlikely(curr + n1 + 1 > last))
+						Schema::throwRowOutOfRange(schema, colIdx, n1+1, last-curr);
+					intptr_t n2 = strnlen((const char*)curr+n1+1, last-curr-n1-1);
+					if (terark_unlikely(curr + n1+1 + n2+1 > last))
+						Schema::throwRowOutOfRange(schema, colIdx, n1+1+n2+1, last-curr);
+					collen = n1 + 1 + n2;
+					curr += n1+1 + n2+1;
+				}
+				else if (n1+1 < last - curr) {
+					intptr_t n2 = strnlen((const char*)curr+n1+1, last-curr-n1-1);
+					if (n1+1 + n2+1 < last - curr) {
+						THROW_STD(invalid_argument,
+							"'\\0' in TwoStrZero is not at string end");
+					}
+					collen = n1 + 1 + n2;
+				}
+				else {
+					collen = n1;
+				}
+			}
+			break;
+		case ColumnType::Binary:
+			if (!IsLast) {
+				const byte* next = nullptr;
+				collen = load_var_uint64(curr, &next);
+				colpos = next - base;
+				if (terark_unlikely(next + collen > last))
+					Schema::throwRowOutOfRange(schema, colIdx, collen, last-next);
+				curr = next + collen;
+			}
+			else {
+				collen = last - curr;
+			}
+			break;
+		case ColumnType::CarBin:
+			if (!IsLast) {
+			#if defined(BOOST_BIG_ENDIAN)
+				collen = byte_swap(unaligned_load<uint32_t>(curr));
+			#else
+				collen = unaligned_load<uint32_t>(curr);
+			#endif
+				colpos += 4;
+				if (terark_unlikely(curr + 4 + collen > last))
+					Schema::throwRowOutOfRange(schema, colIdx, collen, last-curr-4);
+				curr += 4 + collen;
+			}
+			else {
+				collen = last - curr;
+			}
+			break;
+		}
+		cols->push_back(colpos, collen);
+	}
+
+	template<bool IsLast>
+	static inline void combine(fstring coldata, valvec<byte>* rowData) {
+		if (FixLen) {
+			assert(FixLen == coldata.size());
+			memcpy(rowData->grow_no_init(FixLen), coldata.data(), FixLen);
+		}
+		else switch (Type) {
+		default:
+			THROW_STD(runtime_error, "Invalid data row");
+			break;
+		case ColumnType::VarSint:
+		case ColumnType::VarUint:
+			rowData->append(coldata.udata(), coldata.size());
+			break;
+		case ColumnType::StrZero:
+		case ColumnType::TwoStrZero:
+			rowData->append(coldata.udata(), coldata.size());
+			if (!IsLast) {
+				rowData->push_back('\0');
+			}
+			break;
+		case ColumnType::Binary:
+			if (!IsLast) {
+				byte* p1 = rowData->grow_no_init(10);
+				byte* p2 = save_var_uint32(p1, uint32_t(coldata.size()));
+				rowData->trim(p2);
+			}
+			rowData->append(coldata.data(), coldata.size());
+			break;
+		case ColumnType::CarBin:
+			if (!IsLast) {
+				uint32_t binlen = (uint32_t)coldata.size();
+			#if defined(BOOST_BIG_ENDIAN)
+				binlen = byte_swap(binlen);
+			#endif
+				rowData->append((byte*)&binlen, 4);
+			}
+			rowData->append(coldata.data(), coldata.size());
+			break;
+		}
+	}
+};
+
+template<class... Cols>
+struct RowCodecImpl;
+
+template<>
+struct RowCodecImpl<> {
+	static inline void
+	parse(const Schema&, size_t, const byte*, const byte*&, const byte*,
+		  ColumnVec*) {}
+	static inline void
+	combine(const ColumnVec&, size_t, valvec<byte>*) {}
+	static inline void
+	select(const size_t*, const ColumnVec&, size_t, valvec<byte>*) {}
+};
+
+template<class Col, class... Rest>
+struct RowCodecImpl<Col, Rest...> {
+	static const bool IsLast = sizeof...(Rest) == 0;
+	static inline void
+	parse(const Schema& schema, size_t colIdx, const byte* base,
+		  const byte*& curr, const byte* last, ColumnVec* cols) {
+		Col::template parse<IsLast>(schema, colIdx, base, curr, last, cols);
+		RowCodecImpl<Rest...>::parse(schema, colIdx+1, base, curr, last, cols);
+	}
+	static inline void
+	combine(const ColumnVec& cols, size_t colIdx, valvec<byte>* rowData) {
+		Col::template combine<IsLast>(cols[colIdx], rowData);
+		RowCodecImpl<Rest...>::combine(cols, colIdx+1, rowData);
+	}
+	static inline void
+	select(const size_t* proj, const ColumnVec& parentCols, size_t colIdx,
+		   valvec<byte>* rowData) {
+		assert(proj[colIdx] < parentCols.size());
+		Col::template combine<IsLast>(parentCols[proj[colIdx]], rowData);
+		RowCodecImpl<Rest...>::select(proj, parentCols, colIdx+1, rowData);
+	}
+};
+
+// SchemaHash is Schema::rowCodecHash() of the schema of Cols
+template<uint64_t SchemaHash, class... Cols>
+struct RowCodecOf {
+	static void
+	parseRowAppend(const Schema& schema, fstring row, size_t start,
+				   ColumnVec* cols) {
+		const byte* base = row.udata();
+		const byte* curr = base + start;
+		const byte* last = base + row.size();
+		cols->m_base = base;
+		cols->reserve(cols->size() + sizeof...(Cols));
+		RowCodecImpl<Cols...>::parse(schema, 0, base, curr, last, cols);
+	}
+	static void
+	combineRowAppend(const Schema&, const ColumnVec& cols,
+					 valvec<byte>* rowData) {
+		assert(cols.size() == sizeof...(Cols));
+		RowCodecImpl<Cols...>::combine(cols, 0, rowData);
+	}
+	static void
+	selectParent(const Schema& schema, const ColumnVec& parentCols,
+				 valvec<byte>* rowData) {
+		assert(schema.getProj().size() == sizeof...(Cols));
+		RowCodecImpl<Cols...>::select(schema.getProj().data(), parentCols, 0, rowData);
+	}
+	static const RowCodec* get() {
+		static const RowCodec codec = {
+			SchemaHash, sizeof...(Cols),
+			&parseRowAppend, &combineRowAppend, &selectParent,
+		};
+		return &codec;
+	}
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_row_codec_hpp__
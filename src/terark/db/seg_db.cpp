@@ -0,0 +1,194 @@
+#include "seg_db.hpp"
+#include "mem_budget.hpp"
+#include "json.hpp"
+#include <terark/util/linebuf.hpp>
+#include <boost/filesystem.hpp>
+#include <string.h>
+
+namespace terark { namespace db {
+	// defined in db_conf.cpp
+	llong getJsonSizeValue(const terark::json& js, const std::string& key, llong Default);
+}}
+
+namespace terark { namespace db {
+
+namespace fs = boost::filesystem;
+
+DataBase::DataBase() {
+	m_writeLimiter = new WriteRateLimiter(0);
+}
+
+DataBase::~DataBase() {
+	closeDb();
+}
+
+static TableQuota parseTableQuota(const terark::json& js, const TableQuota& Default) {
+	TableQuota quota;
+	quota.writeBytesPerSecond = getJsonSizeValue(js, "WriteBytesPerSecond",
+											Default.writeBytesPerSecond);
+	quota.writableBytes = getJsonSizeValue(js, "WritableBytes", Default.writableBytes);
+	auto iter = js.find("CompressWeight");
+	if (js.end() != iter) {
+		quota.compressWeight = iter.value();
+		if (quota.compressWeight <= 0) {
+			THROW_STD(invalid_argument,
+				"CompressWeight = %f must be positive", quota.compressWeight);
+		}
+	}
+	else {
+		quota.compressWeight = Default.compressWeight;
+	}
+	return quota;
+}
+
+void DataBase::loadConf() {
+	fs::path fname = fs::path(m_dbDir) / "dbconf.json";
+	if (!fs::exists(fname)) {
+		return;
+	}
+	LineBuf buf;
+	buf.read_all(fname.string().c_str());
+	const terark::json conf = terark::json::parse(buf.p);
+	llong budget = getJsonSizeValue(conf, "WritableMemBudget", -1);
+	if (budget >= 0) {
+		WritableMemBudget::setBudget(budget);
+	}
+	m_writeLimiter->setRate(size_t(getJsonSizeValue(conf, "WriteBytesPerSecond", 0)));
+	auto iter = conf.find("TableQuota");
+	if (conf.end() == iter) {
+		return;
+	}
+	const terark::json& quotas = iter.value();
+	auto def = quotas.find("*");
+	if (quotas.end() != def) {
+		m_defaultQuota = parseTableQuota(def.value(), TableQuota());
+	}
+	for (auto it = quotas.begin(); it != quotas.end(); ++it) {
+		if (it.key() != "*")
+			m_quotas[it.key()] = parseTableQuota(it.value(), m_defaultQuota);
+	}
+}
+
+void DataBase::openDb(fstring dbDir) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_dbDir.empty()) {
+		THROW_STD(invalid_argument, "DataBase %s is already opened", m_dbDir.c_str());
+	}
+	m_dbDir = dbDir.str();
+	fs::create_directories(m_dbDir);
+	try {
+		loadConf();
+	}
+	catch (const std::exception&) {
+		m_dbDir.clear();
+		throw;
+	}
+	DbTable::removeTrashInBackground(fs::path(m_dbDir) / ".trash");
+	fprintf(stderr
+		, "INFO: DataBase::openDb(%s): WriteBytesPerSecond = %zd, tables with quota = %zd\n"
+		, m_dbDir.c_str(), m_writeLimiter->rate(), m_quotas.size());
+}
+
+void DataBase::closeDb() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_tables.end_i(); ++i) {
+		if (!m_tables.is_deleted(i))
+			m_tables.val(i)->setSharedWriteLimiter(NULL);
+	}
+	m_tables.clear();
+	m_quotas.clear();
+	m_defaultQuota = TableQuota();
+	m_dbDir.clear();
+}
+
+std::string DataBase::tableDir(fstring tableName) const {
+	if (m_dbDir.empty()) {
+		THROW_STD(invalid_argument, "DataBase is not opened");
+	}
+	if (tableName.empty() || tableName[0] == '.' ||
+		memchr(tableName.data(), '/', tableName.size()) ||
+		memchr(tableName.data(), '\\', tableName.size())) {
+		THROW_STD(invalid_argument, "invalid tableName: %s", tableName.c_str());
+	}
+	return m_dbDir + "/" + tableName.str();
+}
+
+TableQuota DataBase::getQuotaNoLock(fstring tableName) const {
+	size_t f = m_quotas.find_i(tableName);
+	if (f < m_quotas.end_i()) {
+		return m_quotas.val(f);
+	}
+	return m_defaultQuota;
+}
+
+DbTablePtr DataBase::openTableNoLock(fstring tableName) {
+	size_t f = m_tables.find_i(tableName);
+	if (f < m_tables.end_i()) {
+		return m_tables.val(f);
+	}
+	DbTablePtr tab = DbTable::open(tableDir(tableName));
+	tab->setQuota(getQuotaNoLock(tableName));
+	tab->setSharedWriteLimiter(m_writeLimiter.get());
+	m_tables[tableName] = tab;
+	return tab;
+}
+
+DbTablePtr DataBase::createTable(fstring tableName, fstring jsonSchema) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::string dir = tableDir(tableName);
+	if (m_tables.exists(tableName) || fs::exists(dir)) {
+		THROW_STD(invalid_argument, "table %s already exists", dir.c_str());
+	}
+	SchemaConfigPtr sconf = new SchemaConfig();
+	sconf->loadJsonString(jsonSchema); // check the schema before mkdir
+	fs::create_directories(dir);
+	sconf->saveJsonFile(dir + "/dbmeta.json");
+	return openTableNoLock(tableName);
+}
+
+DbTablePtr DataBase::openTable(fstring tableName) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return openTableNoLock(tableName);
+}
+
+void DataBase::dropTable(fstring tableName) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	DbTablePtr tab = openTableNoLock(tableName);
+	m_tables.erase(tableName);
+	lock.unlock();
+	tab->setSharedWriteLimiter(NULL);
+	tab->dropTable(); // dir is renamed into dbDir/.trash
+}
+
+void DataBase::getTables(std::vector<std::pair<std::string, DbTablePtr> >* tables) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	tables->clear();
+	for (size_t i = 0; i < m_tables.end_i(); ++i) {
+		if (!m_tables.is_deleted(i))
+			tables->emplace_back(m_tables.key(i).str(), m_tables.val(i));
+	}
+}
+
+void DataBase::setTableQuota(fstring tableName, const TableQuota& quota) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (tableName == "*") {
+		m_defaultQuota = quota;
+	} else {
+		m_quotas[tableName] = quota;
+	}
+	for (size_t i = 0; i < m_tables.end_i(); ++i) {
+		if (!m_tables.is_deleted(i))
+			m_tables.val(i)->setQuota(getQuotaNoLock(m_tables.key(i)));
+	}
+}
+
+TableQuota DataBase::getTableQuota(fstring tableName) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return getQuotaNoLock(tableName);
+}
+
+void DataBase::setWriteBytesPerSecond(size_t bytesPerSec) {
+	m_writeLimiter->setRate(bytesPerSec);
+}
+
+} } // namespace terark::db
@@ -2,6 +2,7 @@
 #define __terark_db_seg_db_hpp__
 
 #include "db_table.hpp"
+#include <mutex>
 
 // 先只针对 NestLoudsTrie 的特性设计接口
 // NestLoudsTrie 的特性:
@@ -22,17 +23,59 @@
 
 namespace terark { namespace db {
 
-class DataBase : public RefCounter {
+// Tables of a DataBase are sub dirs of dbDir, the DataBase coordinates
+// background resources of its tables:
+//   * flush and compression threads are process wide pools shared by all
+//     tables(TerarkDB_FlushThreadsNum, TerarkDB_CompressionThreadsNum),
+//     compression time is shared by TableQuota::compressWeight
+//   * WritableMemBudget is the memory budget of all writable segments,
+//     it is process wide, see WritableMemBudget
+//   * WriteBytesPerSecond is a write throttle shared by all tables
+//   * TableQuota are quotas of each table, "*" is the default
+// They are loaded from the optional dbDir/dbconf.json by openDb:
+// {
+//   "WritableMemBudget": "8G",
+//   "WriteBytesPerSecond": "256M",
+//   "TableQuota": {
+//     "*"   : { "WriteBytesPerSecond": "64M", "WritableBytes": "1G" },
+//     "logs": { "WritableBytes": "256M", "CompressWeight": 0.5 }
+//   }
+// }
+class TERARK_DB_DLL DataBase : public RefCounter {
+	mutable std::mutex m_mutex;
 	hash_strmap<DbTablePtr> m_tables;
+	hash_strmap<TableQuota> m_quotas;
+	TableQuota  m_defaultQuota;
+	WriteRateLimiterPtr m_writeLimiter;
 	std::string m_dbDir;
 
+	void loadConf();
+	TableQuota getQuotaNoLock(fstring tableName) const;
+	DbTablePtr openTableNoLock(fstring tableName);
+	std::string tableDir(fstring tableName) const;
+
 public:
+	DataBase();
+	~DataBase();
+
 	void openDb(fstring dbDir);
+	void closeDb();
+	const std::string& getDbDir() const { return m_dbDir; }
 
 	DbTablePtr createTable(fstring tableName, fstring jsonSchema);
 	DbTablePtr openTable(fstring tableName);
 
 	void dropTable(fstring tableName);
+
+	/// opened tables
+	void getTables(std::vector<std::pair<std::string, DbTablePtr> >*) const;
+
+	/// runtime change of quotas, they are not saved to dbconf.json,
+	/// "*" changes the default of tables without quota of its own
+	void setTableQuota(fstring tableName, const TableQuota&);
+	TableQuota getTableQuota(fstring tableName) const;
+	void setWriteBytesPerSecond(size_t bytesPerSec);
+	size_t getWriteBytesPerSecond() const { return m_writeLimiter->rate(); }
 };
 typedef boost::intrusive_ptr<DataBase> DataBasePtr;
 
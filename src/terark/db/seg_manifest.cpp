@@ -0,0 +1,235 @@
+#include "seg_manifest.hpp"
+#include <terark/util/crc.hpp>
+#include <terark/util/linebuf.hpp>
+#include <terark/util/throw.hpp>
+#include <boost/filesystem.hpp>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace terark { namespace db {
+
+namespace fs = boost::filesystem;
+
+const char* const SegmentManifest::FileName = "SEGMENT-MANIFEST";
+
+SegmentManifest::SegmentManifest() {
+	m_editNum = 0;
+}
+
+SegmentManifest::~SegmentManifest() {
+}
+
+static std::string encodeLine(fstring edit) {
+	char crc[16];
+	sprintf(crc, "%08X ", Crc32c_update(0, edit.data(), edit.size()));
+	std::string line = crc;
+	line.append(edit.data(), edit.size());
+	line.push_back('\n');
+	return line;
+}
+
+// @returns false if the crc does not match
+static bool decodeLine(fstring line, fstring* edit) {
+	if (line.size() < 9 || ' ' != line[8]) {
+		return false;
+	}
+	char* end = NULL;
+	std::string hex(line.data(), 8);
+	uint32_t crc = (uint32_t)strtoul(hex.c_str(), &end, 16);
+	if (end != hex.c_str() + 8) {
+		return false;
+	}
+	*edit = line.substr(9);
+	return Crc32c_update(0, edit->data(), edit->size()) == crc;
+}
+
+static size_t parseSeq(fstring op) {
+	std::string str(op.data() + 1, op.size() - 1);
+	char* end = NULL;
+	size_t seq = (size_t)strtoull(str.c_str(), &end, 10);
+	if (str.empty() || *end) {
+		THROW_STD(invalid_argument, "bad op: %.*s", op.ilen(), op.data());
+	}
+	return seq;
+}
+
+void SegmentManifest::applyEdit(fstring edit, State* st) {
+	valvec<fstring> ops;
+	edit.split(' ', &ops);
+	for (fstring op : ops) {
+		if (op.empty()) {
+			continue;
+		}
+		switch (op[0]) {
+		default:
+			THROW_STD(invalid_argument, "bad op: %.*s", op.ilen(), op.data());
+		case 'g':
+			st->mergeSeq = parseSeq(op);
+			st->segments.clear();
+			if (st->pendingMergeSeq == st->mergeSeq)
+				st->pendingMergeSeq = size_t(-1);
+			break;
+		case 'm':
+			st->pendingMergeSeq = parseSeq(op);
+			break;
+		case 'o':
+			st->oldMergeSeqs.insert(parseSeq(op));
+			break;
+		case '+':
+			st->segments.insert(op.substr(1).str());
+			break;
+		case '-':
+			st->segments.erase(op.substr(1).str());
+			break;
+		}
+	}
+}
+
+std::string SegmentManifest::snapshotEdit(const State& st) {
+	char buf[32];
+	sprintf(buf, "g%zd", st.mergeSeq);
+	std::string edit = buf;
+	if (size_t(-1) != st.pendingMergeSeq) {
+		sprintf(buf, " m%zd", st.pendingMergeSeq);
+		edit += buf;
+	}
+	for (size_t seq : st.oldMergeSeqs) {
+		sprintf(buf, " o%zd", seq);
+		edit += buf;
+	}
+	for (const std::string& name : st.segments) {
+		edit += " +";
+		edit += name;
+	}
+	return edit;
+}
+
+// @returns false if the manifest does not exist or is empty, a bad last
+// line is a torn write, by a crash or by the writer appending it now
+static bool
+parseManifest(const std::string& fpath, SegmentManifest::State* st,
+			  size_t* lineNum, bool* torn) {
+	FILE* fp = fopen(fpath.c_str(), "r");
+	if (NULL == fp) {
+		if (ENOENT == errno)
+			return false;
+		THROW_STD(runtime_error, "fopen(%s, r) = %s", fpath.c_str(), strerror(errno));
+	}
+	std::vector<std::string> lines;
+	LineBuf line;
+	while (line.getline(fp) > 0) {
+		lines.emplace_back(line.p, line.size());
+	}
+	fclose(fp);
+	*torn = false;
+	for (size_t i = 0; i < lines.size(); ++i) {
+		fstring str = lines[i];
+		bool hasEol = str.endsWith("\n");
+		fstring edit;
+		if (!hasEol || !decodeLine(str.substr(0, str.size() - hasEol), &edit)) {
+			if (i + 1 == lines.size() && i > 0) {
+				*torn = true;
+				break;
+			}
+			THROW_STD(invalid_argument, "bad edit at line %zd: %s", i + 1, fpath.c_str());
+		}
+		if (0 == i && !edit.startsWith("g")) {
+			THROW_STD(invalid_argument, "no snapshot at line 1: %s", fpath.c_str());
+		}
+		SegmentManifest::applyEdit(edit, st);
+	}
+	if (lines.empty()) {
+		fprintf(stderr, "WARN: SegmentManifest: empty %s\n", fpath.c_str());
+		return false;
+	}
+	*lineNum = lines.size();
+	return true;
+}
+
+bool SegmentManifest::load(const std::string& tableDir) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::string fpath = tableDir + "/" + FileName;
+	State st;
+	size_t lineNum = 0;
+	bool torn = false;
+	if (!parseManifest(fpath, &st, &lineNum, &torn)) {
+		return false;
+	}
+	if (torn) {
+		fprintf(stderr, "WARN: SegmentManifest: ignore torn edit at line %zd: %s\n"
+			, lineNum, fpath.c_str());
+	}
+	m_fpath = fpath;
+	m_state = st;
+	m_editNum = lineNum - 1;
+	if (torn) {
+		writeSnapshotNoLock(); // later edits must not follow the torn line
+	} else {
+		openLogNoLock();
+	}
+	return true;
+}
+
+// the file is replaced by rename, so a reader sees a whole snapshot, and
+// a torn last line is an edit being appended by the writer
+bool SegmentManifest::readState(const std::string& tableDir, State* st) {
+	std::string fpath = tableDir + "/" + FileName;
+	size_t lineNum = 0;
+	bool torn = false;
+	*st = State();
+	return parseManifest(fpath, st, &lineNum, &torn);
+}
+
+void SegmentManifest::reset(const std::string& tableDir, const State& st) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_fpath = tableDir + "/" + FileName;
+	m_state = st;
+	writeSnapshotNoLock();
+}
+
+void SegmentManifest::logEdit(const std::string& edit) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_log) {
+		THROW_STD(logic_error, "manifest is not open: %s", m_fpath.c_str());
+	}
+	State st = m_state;
+	applyEdit(edit, &st);
+	std::string line = encodeLine(edit);
+	m_log->ensureWrite(line.data(), line.size());
+	m_log->sync(m_fpath);
+	m_state = std::move(st);
+	if (++m_editNum >= SnapshotEditNum) {
+		writeSnapshotNoLock();
+	}
+}
+
+SegmentManifest::State SegmentManifest::state() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_state;
+}
+
+void SegmentManifest::close() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_log.reset();
+}
+
+void SegmentManifest::writeSnapshotNoLock() {
+	std::string tmpFpath = m_fpath + ".tmp";
+	std::string line = encodeLine(snapshotEdit(m_state));
+	{
+		EnvFileStream fp(tmpFpath, "w");
+		fp.ensureWrite(line.data(), line.size());
+		fp.sync(tmpFpath);
+	}
+	m_log.reset();
+	fs::rename(tmpFpath, m_fpath); // the commit
+	m_editNum = 0;
+	openLogNoLock();
+}
+
+void SegmentManifest::openLogNoLock() {
+	m_log.reset(new EnvFileStream(m_fpath, "a"));
+}
+
+} } // namespace terark::db
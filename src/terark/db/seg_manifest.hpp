@@ -0,0 +1,69 @@
+#ifndef __terark_db_seg_manifest_hpp__
+#define __terark_db_seg_manifest_hpp__
+
+#include "db_dll_decl.hpp"
+#include "db_env.hpp"
+#include <terark/fstring.hpp>
+#include <terark/valvec.hpp>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace terark { namespace db {
+
+// Crash safe membership of segments and merge dirs of a DbTable, so open
+// needs not list and parse dirs. The file is an edit log, each line is
+// "<crc32c in hex> <edit>", an edit is space separated ops:
+//   g<seq>  merge dir g-<seq> is in use, the segments are cleared
+//   m<seq>  merge into g-<seq> is started, it is stale if not committed
+//   o<seq>  g-<seq> is an old merge dir, it is removed by the next open
+//   +name   segment dir name in the merge dir is added, such as rd-0003
+//   -name   segment dir name is removed
+// The first line is a snapshot of the whole state, a new snapshot is
+// written to a temp file and renamed to the manifest on reset(), which is
+// the commit of a merge, or when the log is long. A bad last line is a
+// torn write of a crash and it is ignored, other bad lines are errors.
+class TERARK_DB_DLL SegmentManifest {
+public:
+	struct State {
+		size_t mergeSeq = 0;
+		size_t pendingMergeSeq = size_t(-1); // not committed
+		std::set<size_t> oldMergeSeqs;
+		std::set<std::string> segments; // names are sorted by segIdx
+	};
+	enum { SnapshotEditNum = 1024 };
+	static const char* const FileName; // "SEGMENT-MANIFEST"
+
+	SegmentManifest();
+	~SegmentManifest();
+
+	///@returns false if the manifest does not exist
+	bool load(const std::string& tableDir);
+	/// write a snapshot of state atomically, the log is reopened by it
+	void reset(const std::string& tableDir, const State&);
+	/// apply edit and append it to the log, it is synced before return
+	void logEdit(const std::string& edit);
+	State state() const;
+	bool isOpen() const { return m_log.get() != NULL; }
+	void close();
+
+	static void applyEdit(fstring edit, State*); // throws on bad ops
+	/// read the manifest of another process, it is never written
+	///@returns false if the manifest does not exist
+	static bool readState(const std::string& tableDir, State*);
+	static std::string snapshotEdit(const State&);
+
+private:
+	void writeSnapshotNoLock();
+	void openLogNoLock();
+	mutable std::mutex m_mutex;
+	std::unique_ptr<EnvFileStream> m_log;
+	std::string m_fpath;
+	State  m_state;
+	size_t m_editNum; // since the snapshot
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_seg_manifest_hpp__
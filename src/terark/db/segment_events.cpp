@@ -0,0 +1,267 @@
+#include "segment_events.hpp"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace terark { namespace db {
+
+const char* SegmentEventTypeName(SegmentEventType t) {
+	switch (t) {
+	case SegmentEventType::freeze : return "freeze";
+	case SegmentEventType::flush  : return "flush";
+	case SegmentEventType::convert: return "convert";
+	case SegmentEventType::merge  : return "merge";
+	case SegmentEventType::purge  : return "purge";
+	}
+	return "unknown";
+}
+
+const char* SegmentPhaseName(SegmentPhase p) {
+	static const char* names[] = { "scan", "index", "store", "reload" };
+	static_assert(sizeof(names)/sizeof(names[0]) == size_t(SegmentPhase::Num),
+				  "names and SegmentPhase mismatch");
+	return size_t(p) < size_t(SegmentPhase::Num) ? names[size_t(p)] : "unknown";
+}
+
+static ullong steadyNowNs() {
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(
+		steady_clock::now().time_since_epoch()).count();
+}
+
+SegmentEvent::SegmentEvent() {
+	type = SegmentEventType::freeze;
+	failed = false;
+	startTime = 0;
+	durationNs = 0;
+	inputBytes = 0;
+	outputBytes = 0;
+	inputRows = 0;
+	inputDeletedRows = 0;
+	outputRows = 0;
+	memBytes = 0;
+	memset(phaseNs, 0, sizeof(phaseNs));
+}
+
+static void appendJsonStr(std::string& js, const std::string& s) {
+	js.push_back('"');
+	for (unsigned char c : s) {
+		if ('"' == c || '\\' == c) {
+			js.push_back('\\');
+			js.push_back(c);
+		}
+		else if (c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			js.append(buf);
+		}
+		else {
+			js.push_back(c);
+		}
+	}
+	js.push_back('"');
+}
+
+std::string SegmentEvent::toJsonStr() const {
+	std::string js;
+	char buf[512];
+	int len = snprintf(buf, sizeof(buf)
+		, "{\"type\":\"%s\",\"failed\":%s,\"startTime\":%llu,\"durationNs\":%llu"
+		  ",\"inputBytes\":%lld,\"outputBytes\":%lld,\"inputRows\":%lld"
+		  ",\"inputDeletedRows\":%lld,\"outputRows\":%lld,\"memBytes\":%lld"
+		, SegmentEventTypeName(type), failed ? "true" : "false"
+		, startTime, durationNs, inputBytes, outputBytes, inputRows
+		, inputDeletedRows, outputRows, memBytes);
+	js.append(buf, len);
+	js.append(",\"phaseNs\":{");
+	for (size_t i = 0; i < size_t(SegmentPhase::Num); ++i) {
+		len = snprintf(buf, sizeof(buf), "%s\"%s\":%llu"
+			, i ? "," : "", SegmentPhaseName(SegmentPhase(i)), phaseNs[i]);
+		js.append(buf, len);
+	}
+	js.append("},\"tableDir\":");
+	appendJsonStr(js, tableDir);
+	js.append(",\"inputSegs\":[");
+	for (size_t i = 0; i < inputSegs.size(); ++i) {
+		if (i)
+			js.push_back(',');
+		appendJsonStr(js, inputSegs[i]);
+	}
+	js.append("],\"outputSeg\":");
+	appendJsonStr(js, outputSeg);
+	if (!error.empty()) {
+		js.append(",\"error\":");
+		appendJsonStr(js, error);
+	}
+	js.push_back('}');
+	return js;
+}
+
+namespace {
+
+class SegmentEventLogImpl {
+public:
+	std::mutex m_mutex;
+	std::deque<SegmentEvent> m_ring;
+	size_t m_ringSize;
+	FILE*  m_logFile;
+	std::vector<SegmentEventSinkPtr> m_sinks;
+
+	SegmentEventLogImpl() {
+		m_ringSize = 1024;
+		m_logFile = NULL;
+		if (const char* env = getenv("TerarkDB_SegmentEventRingSize")) {
+			m_ringSize = (size_t)strtoull(env, NULL, 10);
+		}
+		if (const char* env = getenv("TerarkDB_SegmentEventLog")) {
+			if (*env)
+				openLogFile(env);
+		}
+	}
+	~SegmentEventLogImpl() {
+		if (m_logFile)
+			fclose(m_logFile);
+	}
+	void openLogFile(const std::string& fpath) {
+		m_logFile = fopen(fpath.c_str(), "a");
+		if (NULL == m_logFile) {
+			fprintf(stderr, "ERROR: SegmentEventLog: fopen(%s, a) = %s\n"
+				, fpath.c_str(), strerror(errno));
+		}
+	}
+};
+
+SegmentEventLogImpl& eventLog() {
+	static SegmentEventLogImpl log;
+	return log;
+}
+
+thread_local SegmentEventScope* tls_currentScope = NULL;
+
+} // namespace
+
+void SegmentEventLog::addSink(SegmentEventSink* sink) {
+	auto& log = eventLog();
+	std::lock_guard<std::mutex> lock(log.m_mutex);
+	log.m_sinks.push_back(sink);
+}
+
+void SegmentEventLog::removeSink(SegmentEventSink* sink) {
+	auto& log = eventLog();
+	std::lock_guard<std::mutex> lock(log.m_mutex);
+	auto& v = log.m_sinks;
+	v.erase(std::remove(v.begin(), v.end(), SegmentEventSinkPtr(sink)), v.end());
+}
+
+void SegmentEventLog::setJsonLogFile(const std::string& fpath) {
+	auto& log = eventLog();
+	std::lock_guard<std::mutex> lock(log.m_mutex);
+	if (log.m_logFile) {
+		fclose(log.m_logFile);
+		log.m_logFile = NULL;
+	}
+	if (!fpath.empty())
+		log.openLogFile(fpath);
+}
+
+void SegmentEventLog::setRingSize(size_t n) {
+	auto& log = eventLog();
+	std::lock_guard<std::mutex> lock(log.m_mutex);
+	log.m_ringSize = n;
+	while (log.m_ring.size() > n)
+		log.m_ring.pop_front();
+}
+
+void SegmentEventLog::getRecentEvents(std::vector<SegmentEvent>* events) {
+	auto& log = eventLog();
+	std::lock_guard<std::mutex> lock(log.m_mutex);
+	events->assign(log.m_ring.begin(), log.m_ring.end());
+}
+
+void SegmentEventLog::emit(const SegmentEvent& ev) {
+	auto& log = eventLog();
+	std::vector<SegmentEventSinkPtr> sinks;
+	{
+		std::lock_guard<std::mutex> lock(log.m_mutex);
+		if (log.m_ringSize) {
+			if (log.m_ring.size() >= log.m_ringSize)
+				log.m_ring.pop_front();
+			log.m_ring.push_back(ev);
+		}
+		if (log.m_logFile) {
+			std::string js = ev.toJsonStr();
+			js.push_back('\n');
+			fwrite(js.data(), 1, js.size(), log.m_logFile);
+			fflush(log.m_logFile);
+		}
+		sinks = log.m_sinks;
+	}
+	// sinks are called out of lock, they may call getRecentEvents
+	for (auto& sink : sinks) {
+		try {
+			sink->onSegmentEvent(ev);
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: SegmentEventSink: %s\n", ex.what());
+		}
+	}
+}
+
+SegmentEventScope::SegmentEventScope(SegmentEventType type,
+									 const std::string& tableDir) {
+	using namespace std::chrono;
+	m_ev.type = type;
+	m_ev.tableDir = tableDir;
+	m_ev.startTime = duration_cast<microseconds>(
+		system_clock::now().time_since_epoch()).count();
+	m_t0 = steadyNowNs();
+	for (auto& x : m_phaseNs)
+		x.store(0, std::memory_order_relaxed);
+	m_done = false;
+	m_prev = tls_currentScope;
+	tls_currentScope = this;
+}
+
+SegmentEventScope::~SegmentEventScope() {
+	tls_currentScope = m_prev;
+	m_ev.durationNs = steadyNowNs() - m_t0;
+	for (size_t i = 0; i < size_t(SegmentPhase::Num); ++i)
+		m_ev.phaseNs[i] = m_phaseNs[i].load(std::memory_order_relaxed);
+	if (!m_done && !m_ev.failed) {
+		m_ev.failed = true;
+		m_ev.error = "aborted";
+	}
+	try {
+		SegmentEventLog::emit(m_ev);
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: SegmentEventLog::emit: %s\n", ex.what());
+	}
+}
+
+void SegmentEventScope::setFailed(const char* error) {
+	m_ev.failed = true;
+	m_ev.error = error;
+}
+
+SegmentEventScope* SegmentEventScope::current() {
+	return tls_currentScope;
+}
+
+SegmentPhaseTimer::SegmentPhaseTimer(SegmentEventScope* scope,
+									 SegmentPhase phase)
+	: m_scope(scope), m_phase(phase), m_t0(scope ? steadyNowNs() : 0) {}
+
+void SegmentPhaseTimer::stop() {
+	if (m_scope) {
+		m_scope->addPhase(m_phase, steadyNowNs() - m_t0);
+		m_scope = NULL;
+	}
+}
+
+} } // namespace terark::db
@@ -0,0 +1,119 @@
+#ifndef __terark_db_segment_events_hpp__
+#define __terark_db_segment_events_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/stdtypes.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace terark { namespace db {
+
+// lifecycle of a segment: a writable segment is frozen and flushed, then
+// converted to a readonly segment, readonly segments are merged and purged
+enum class SegmentEventType : unsigned char {
+	freeze,
+	flush,
+	convert,
+	merge,
+	purge,
+};
+TERARK_DB_DLL const char* SegmentEventTypeName(SegmentEventType);
+
+// phases of building a readonly segment, phases of concurrent build jobs
+// are summed, so they may be larger than the duration of the event
+enum class SegmentPhase : unsigned char {
+	scan,   // read input rows and write temporary colgroup files
+	index,  // sort keys and build indices and bloom filters
+	store,  // build colgroup stores, including dict training of DictZip
+	reload, // save, reload as mmap and sync updates during the build
+	Num
+};
+TERARK_DB_DLL const char* SegmentPhaseName(SegmentPhase);
+
+struct TERARK_DB_DLL SegmentEvent {
+	SegmentEventType type;
+	bool   failed;
+	ullong startTime;  // microseconds since epoch
+	ullong durationNs;
+	std::string tableDir;
+	std::vector<std::string> inputSegs;
+	std::string outputSeg;   // empty for freeze and flush
+	llong  inputBytes;       // dataStorageSize of input segments
+	llong  outputBytes;
+	llong  inputRows;        // logic rows, including deleted rows
+	llong  inputDeletedRows;
+	llong  outputRows;       // physic rows of the output segment
+	llong  memBytes;         // compressing work memory or writable memory
+	ullong phaseNs[size_t(SegmentPhase::Num)];
+	std::string error;
+
+	SegmentEvent();
+	std::string toJsonStr() const;
+};
+
+// Sinks are called synchronously by the threads of the tasks, sometimes
+// with m_rwMutex of the table held(freeze), so they should be fast.
+class TERARK_DB_DLL SegmentEventSink : public RefCounter {
+public:
+	virtual void onSegmentEvent(const SegmentEvent&) = 0;
+};
+typedef boost::intrusive_ptr<SegmentEventSink> SegmentEventSinkPtr;
+
+// Process wide event log, recent events are kept in a ring buffer, events
+// are also appended as JSON lines to the log file if it is set, the env
+// TerarkDB_SegmentEventLog is the initial log file and the env
+// TerarkDB_SegmentEventRingSize is the ring size(default 1024).
+class TERARK_DB_DLL SegmentEventLog {
+public:
+	static void addSink(SegmentEventSink*);
+	static void removeSink(SegmentEventSink*);
+	/// empty fpath closes the log file
+	static void setJsonLogFile(const std::string& fpath);
+	static void setRingSize(size_t);
+	/// oldest first
+	static void getRecentEvents(std::vector<SegmentEvent>*);
+	static void emit(const SegmentEvent&);
+};
+
+// The event of a task on this thread, it is emitted on destruction, and
+// is failed if it is destructed by an exception without setDone().
+// Builders of segments add phase timings by SegmentPhaseTimer.
+class TERARK_DB_DLL SegmentEventScope {
+	SegmentEvent m_ev;
+	ullong m_t0;
+	SegmentEventScope* m_prev;
+	std::atomic<ullong> m_phaseNs[size_t(SegmentPhase::Num)];
+	bool m_done;
+	SegmentEventScope(const SegmentEventScope&) = delete;
+	SegmentEventScope& operator=(const SegmentEventScope&) = delete;
+public:
+	SegmentEventScope(SegmentEventType, const std::string& tableDir);
+	~SegmentEventScope();
+	SegmentEvent& ev() { return m_ev; }
+	void setDone() { m_done = true; }
+	void setFailed(const char* error);
+	/// thread safe, may be called by concurrent build jobs
+	void addPhase(SegmentPhase phase, ullong ns) {
+		m_phaseNs[size_t(phase)].fetch_add(ns, std::memory_order_relaxed);
+	}
+	/// the innermost scope of this thread, NULL if none
+	static SegmentEventScope* current();
+};
+
+// time the scope or until stop(), it is a noop if scope is NULL
+class SegmentPhaseTimer {
+	SegmentEventScope* m_scope;
+	SegmentPhase m_phase;
+	ullong m_t0;
+public:
+	SegmentPhaseTimer(SegmentEventScope* scope, SegmentPhase phase);
+	~SegmentPhaseTimer() { stop(); }
+	void stop();
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_segment_events_hpp__
@@ -0,0 +1,35 @@
+#ifndef __terark_db_segment_locator_hpp__
+#define __terark_db_segment_locator_hpp__
+
+#include <terark/stdtypes.hpp>
+#include <terark/util/bsearch.hpp>
+
+namespace terark { namespace db {
+
+// Map record id to segment index by segment base ids.
+// Base ids are copied into Eytzinger(bfs) layout, the search loop has no
+// unpredictable branch and the first levels of the tree share cache lines,
+// it is rebuilt only when DbContext::segArrayUpdateSeq changed.
+class SegmentLocator {
+	eytzinger_array<llong> m_tree;
+public:
+	size_t size() const { return m_tree.size(); }
+
+	///@param baseIds sorted segment base ids, baseIds[0] == 0
+	void build(const llong* baseIds, size_t segNum) {
+		assert(segNum == 0 || 0 == baseIds[0]);
+		m_tree.build(baseIds, segNum);
+	}
+
+	/// same as upper_bound_0(baseIds, segNum, id), id must be >= 0,
+	/// so the returned value is in [1, segNum], segIdx is returned value-1
+	size_t upper_bound(llong id) const {
+		assert(id >= 0);
+		assert(m_tree.size() >= 1);
+		return m_tree.upper_bound(id);
+	}
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_segment_locator_hpp__
@@ -0,0 +1,230 @@
+#include "segment_scrubber.hpp"
+#include <terark/util/crc.hpp>
+#include <terark/util/profiling.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <map>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#if defined(_MSC_VER)
+	#include <io.h>
+	#define fsync _commit
+#else
+	#include <unistd.h>
+#endif
+
+namespace terark { namespace db {
+
+namespace fs = boost::filesystem;
+
+const char SegmentScrubber::ChecksumFile[] = "ScrubChecksums";
+
+SegmentScrubber::SegmentScrubber(size_t bytesPerSec, llong intervalSeconds,
+								 const ListSegments& listSegments,
+								 const IsMutableFile& isMutable,
+								 const OnCorrupt& onCorrupt)
+  : m_listSegments(listSegments)
+  , m_isMutable(isMutable)
+  , m_onCorrupt(onCorrupt)
+  , m_bytesPerSec(bytesPerSec)
+  , m_intervalSeconds(intervalSeconds)
+  , m_limiter(bytesPerSec)
+{
+	m_follow = NULL;
+	m_followMaxRate = 0;
+	m_stop = false;
+}
+
+SegmentScrubber::~SegmentScrubber() {
+	stop();
+}
+
+void SegmentScrubber::followLimiter(const WriteRateLimiter* limiter, size_t maxRate) {
+	assert(!m_thread.joinable());
+	m_follow = limiter;
+	m_followMaxRate = maxRate;
+}
+
+void SegmentScrubber::start() {
+	m_thread = std::thread(&SegmentScrubber::threadProc, this);
+}
+
+void SegmentScrubber::stop() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_cond.notify_all();
+	}
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+SegmentScrubStat SegmentScrubber::getStat() const {
+	std::lock_guard<std::mutex> lock(m_statMutex);
+	return m_stat;
+}
+
+bool SegmentScrubber::waitFor(llong micros) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (micros > 0)
+		m_cond.wait_for(lock, std::chrono::microseconds(micros), [this]{ return m_stop; });
+	return !m_stop;
+}
+
+// ok is false if the file can not be read, such as removed by a merge
+bool SegmentScrubber::crcFile(const std::string& fpath, uint32_t* crc, bool* ok) {
+	*crc = 0;
+	*ok = false;
+	FILE* fp = fopen(fpath.c_str(), "rb");
+	if (NULL == fp)
+		return true;
+	m_buf.resize_no_init(ChunkSize);
+	for (;;) {
+		if (m_follow && m_followMaxRate) {
+			size_t rate = m_follow->rate();
+			rate = size_t(double(m_bytesPerSec) * rate / m_followMaxRate);
+			m_limiter.setRate(std::max<size_t>(rate, 1));
+		}
+		size_t n = fread(m_buf.data(), 1, ChunkSize, fp);
+		if (n) {
+			*crc = Crc32c_update(*crc, m_buf.data(), n);
+			std::lock_guard<std::mutex> lock(m_statMutex);
+			m_stat.scrubbedBytes += n;
+		}
+		if (n < ChunkSize) {
+			*ok = !ferror(fp);
+			break;
+		}
+		if (!waitFor(m_limiter.consume(n))) {
+			fclose(fp);
+			return false;
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+bool SegmentScrubber::scrubSegment(const std::string& segDir) {
+	std::string sumFpath = segDir + "/" + ChecksumFile;
+	std::map<std::string, FileSum> sums;
+	if (FILE* fp = fopen(sumFpath.c_str(), "r")) {
+		char line[4096], fname[4096];
+		while (fgets(line, sizeof(line), fp)) {
+			FileSum sum;
+			if (sscanf(line, "%X %lld %lld %4095s", &sum.crc, &sum.size, &sum.mtime, fname) == 4)
+				sums[fname] = sum;
+		}
+		fclose(fp);
+	}
+	bool changed = false;
+	std::map<std::string, FileSum> seen;
+	boost::system::error_code ec;
+	for (fs::directory_iterator iter(segDir, ec), end; !ec && iter != end; iter.increment(ec)) {
+		std::string fname = iter->path().filename().string();
+		if (!fs::is_regular_file(iter->status()) || // follows symlinks
+				fstring(fname).startsWith(ChecksumFile) || m_isMutable(fname)) {
+			continue;
+		}
+		std::string fpath = iter->path().string();
+		struct stat st0, st1;
+		if (::stat(fpath.c_str(), &st0) != 0)
+			continue;
+		uint32_t crc = 0;
+		bool ok = false;
+		if (!crcFile(fpath, &crc, &ok))
+			return false;
+		if (!ok || ::stat(fpath.c_str(), &st1) != 0)
+			continue; // removed
+		if (st0.st_size != st1.st_size || st0.st_mtime != st1.st_mtime)
+			continue; // rewritten in the read, it is checked by the next pass
+		FileSum cur = { crc, llong(st1.st_size), llong(st1.st_mtime) };
+		seen[fname] = cur;
+		auto found = sums.find(fname);
+		if (sums.end() == found) {
+			changed = true;
+		}
+		else if (found->second.size != cur.size || found->second.mtime != cur.mtime) {
+			changed = true;
+			std::lock_guard<std::mutex> lock(m_statMutex);
+			m_stat.rebasedFiles++;
+		}
+		else if (found->second.crc != cur.crc) {
+			char reason[256];
+			snprintf(reason, sizeof(reason), "%s: crc32c = %08X, expected %08X",
+					 fname.c_str(), cur.crc, found->second.crc);
+			fprintf(stderr, "ERROR: SegmentScrubber: %s/%s\n", segDir.c_str(), reason);
+			{
+				std::lock_guard<std::mutex> lock(m_statMutex);
+				m_stat.corruptFiles++;
+			}
+			m_onCorrupt(segDir, reason);
+			seen[fname] = found->second; // keep reporting it
+		}
+		std::lock_guard<std::mutex> lock(m_statMutex);
+		m_stat.scrubbedFiles++;
+	}
+	if (ec || !fs::exists(segDir))
+		return true; // the segment is removed
+	changed = changed || seen.size() != sums.size();
+	if (changed) {
+		std::string tmpFpath = sumFpath + ".tmp";
+		FILE* fp = fopen(tmpFpath.c_str(), "w");
+		if (NULL == fp) {
+			fprintf(stderr, "WARN: SegmentScrubber: fopen(%s) = %s\n"
+				, tmpFpath.c_str(), strerror(errno));
+			return true;
+		}
+		for (auto& kv : seen) {
+			fprintf(fp, "%08X %lld %lld %s\n", kv.second.crc,
+					kv.second.size, kv.second.mtime, kv.first.c_str());
+		}
+		bool written = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+		fclose(fp);
+		if (!written || ::rename(tmpFpath.c_str(), sumFpath.c_str()) != 0) {
+			fprintf(stderr, "WARN: SegmentScrubber: save %s = %s\n"
+				, sumFpath.c_str(), strerror(errno));
+			::remove(tmpFpath.c_str());
+		}
+	}
+	return true;
+}
+
+// segments without checksums are scrubbed first, they are new segments
+// whose baseline should be taken soon after they are built
+void SegmentScrubber::threadProc() {
+	do {
+		profiling pf;
+		llong t0 = pf.now();
+		std::vector<std::string> segDirs;
+		m_listSegments(&segDirs);
+		std::stable_partition(segDirs.begin(), segDirs.end(),
+			[](const std::string& dir) {
+				return !fs::exists(dir + "/" + ChecksumFile);
+			});
+		ullong corrupt0 = getStat().corruptFiles;
+		for (const std::string& segDir : segDirs) {
+			try {
+				if (!scrubSegment(segDir))
+					return;
+			}
+			catch (const std::exception& ex) {
+				fprintf(stderr, "WARN: SegmentScrubber: %s: %s\n", segDir.c_str(), ex.what());
+			}
+		}
+		SegmentScrubStat st;
+		{
+			std::lock_guard<std::mutex> lock(m_statMutex);
+			m_stat.passes++;
+			m_stat.lastPassTime = ::time(NULL);
+			st = m_stat;
+		}
+		fprintf(stderr
+			, "INFO: SegmentScrubber: pass %llu, segs = %zd, corrupt files = %llu, time = %.3f sec\n"
+			, st.passes, segDirs.size(), st.corruptFiles - corrupt0, pf.sf(t0, pf.now()));
+	} while (waitFor(m_intervalSeconds * 1000000));
+}
+
+} } // namespace terark::db
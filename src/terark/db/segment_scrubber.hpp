@@ -0,0 +1,90 @@
+#ifndef __terark_db_segment_scrubber_hpp__
+#define __terark_db_segment_scrubber_hpp__
+
+#include "db_dll_decl.hpp"
+#include "rate_limiter.hpp"
+#include <terark/fstring.hpp>
+#include <terark/valvec.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace terark { namespace db {
+
+struct SegmentScrubStat {
+	ullong passes        = 0; // finished passes over all segments
+	ullong scrubbedFiles = 0;
+	ullong scrubbedBytes = 0;
+	ullong corruptFiles  = 0;
+	ullong rebasedFiles  = 0; // rewritten files, their checksums are renewed
+	llong  lastPassTime  = 0; // time(NULL) of the last finished pass
+};
+
+// Background scrubber of readonly segment files. Each pass reads all files
+// of the segments by a thread, throttled to bytesPerSec, and checks their
+// crc32c(hardware crc of terark/util/crc.hpp) with the checksums saved in
+// SegmentScrubber::ChecksumFile of the segment dir when the file is seen
+// the first time. A file of another size or mtime is rewritten(such as by
+// moveColdSegments or an online index), its checksum is renewed, so just
+// silent changes are reported: by an ERROR log and onCorrupt. Segments are
+// verified within interval + time of a pass, so stores may run with a low
+// checksumLevel. Mutable files(isMutable), such as IsDel, are skipped.
+class TERARK_DB_DLL SegmentScrubber : public RefCounter {
+public:
+	typedef std::function<void(std::vector<std::string>* segDirs)> ListSegments;
+	typedef std::function<bool(fstring fname)> IsMutableFile;
+	typedef std::function<void(const std::string& segDir,
+							   const std::string& reason)> OnCorrupt;
+	static const char ChecksumFile[]; // "ScrubChecksums"
+	enum { ChunkSize = 1 << 20 };
+
+	SegmentScrubber(size_t bytesPerSec, llong intervalSeconds,
+					const ListSegments&, const IsMutableFile&, const OnCorrupt&);
+	~SegmentScrubber();
+
+	/// bytesPerSec is scaled by rate/maxRate of the limiter, it is slowed
+	/// down with compactions by an AdaptiveWriteRateLimiter
+	void followLimiter(const WriteRateLimiter*, size_t maxRate);
+	void start();
+	void stop(); // waits for the thread
+	SegmentScrubStat getStat() const;
+
+	/// one segment, @returns false if it is stopped
+	bool scrubSegment(const std::string& segDir);
+
+private:
+	struct FileSum {
+		uint32_t crc;
+		llong    size;
+		llong    mtime;
+	};
+	ListSegments  m_listSegments;
+	IsMutableFile m_isMutable;
+	OnCorrupt     m_onCorrupt;
+	const size_t  m_bytesPerSec;
+	const llong   m_intervalSeconds;
+	const WriteRateLimiter* m_follow;
+	size_t        m_followMaxRate;
+	WriteRateLimiter m_limiter;
+	std::thread   m_thread;
+	std::mutex    m_mutex;
+	std::condition_variable m_cond;
+	bool          m_stop;
+	mutable std::mutex m_statMutex;
+	SegmentScrubStat   m_stat;
+	valvec<byte>  m_buf;
+	void threadProc();
+	bool waitFor(llong micros); // false if stopped
+	bool crcFile(const std::string& fpath, uint32_t* crc, bool* ok);
+};
+typedef boost::intrusive_ptr<SegmentScrubber> SegmentScrubberPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_segment_scrubber_hpp__
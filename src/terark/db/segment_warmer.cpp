@@ -0,0 +1,140 @@
+#include "segment_warmer.hpp"
+#include <terark/util/mmap.hpp>
+#include <terark/util/profiling.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <stdio.h>
+
+namespace terark { namespace db {
+
+namespace fs = boost::filesystem;
+
+static const size_t WarmChunkSize = 4 << 20;
+
+template<class OnFile>
+static void forEachSegmentFile(const std::string& segDir, OnFile onFile) {
+	for (auto& ent : fs::recursive_directory_iterator(segDir)) {
+		if (fs::is_regular_file(ent.status())) {
+			llong bytes = llong(fs::file_size(ent.path()));
+			if (bytes > 0)
+				onFile(ent.path(), bytes);
+		}
+	}
+}
+
+SegmentWarmer::SegmentWarmer() {
+	m_stop = false;
+	m_done = false;
+}
+
+SegmentWarmer::~SegmentWarmer() {
+	stop();
+	for (SegInfo* seg : m_segs)
+		delete seg;
+}
+
+void SegmentWarmer::addSegment(const std::string& segDir, double heat) {
+	assert(!m_thread.joinable());
+	std::unique_ptr<SegInfo> seg(new SegInfo());
+	seg->segDir = segDir;
+	seg->fileBytes = 0;
+	seg->warmedBytes = 0;
+	forEachSegmentFile(segDir, [&](const fs::path& fpath, llong bytes) {
+		std::string fname = fpath.filename().string();
+		FileInfo fi;
+		fi.fpath = fpath.string();
+		fi.segNth = m_segs.size();
+		fi.fileBytes = bytes;
+		// indices and deletion bits are needed by all queries
+		fi.priority = fname.compare(0, 6, "index-") == 0
+					|| fname.compare(0, 5, "IsDel") == 0 ? 0 : 1;
+		fi.heat = heat;
+		m_files.push_back(fi);
+		seg->fileBytes += bytes;
+	});
+	m_segs.push_back(seg.release());
+}
+
+void SegmentWarmer::start() {
+	std::stable_sort(m_files.begin(), m_files.end(),
+		[](const FileInfo& x, const FileInfo& y) {
+			if (x.priority != y.priority)
+				return x.priority < y.priority;
+			return x.heat > y.heat;
+		});
+	m_thread = std::thread(&SegmentWarmer::threadProc, this);
+}
+
+void SegmentWarmer::stop() {
+	m_stop = true;
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void SegmentWarmer::threadProc() {
+	profiling pf;
+	llong t0 = pf.now();
+	llong total = 0;
+	size_t fileNum = 0;
+	for (const FileInfo& fi : m_files) {
+		if (m_stop)
+			break;
+		// merge or purge may have removed the segment
+		size_t size = 0;
+		void* base = NULL;
+		try {
+			base = mmap_load(fi.fpath, &size);
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "WARN: SegmentWarmer: skip %s: %s\n"
+				, fi.fpath.c_str(), ex.what());
+			continue;
+		}
+		const size_t pgsize = 4096;
+		for (size_t pos = 0; pos < size && !m_stop; pos += WarmChunkSize) {
+			size_t len = std::min(size - pos, WarmChunkSize);
+			const volatile byte* p = (const byte*)base + pos;
+			mmap_advise_willneed((const byte*)p, len);
+			for (size_t i = 0; i < len; i += pgsize)
+				(void)p[i]; // wait for the pages
+			m_segs[fi.segNth]->warmedBytes += len;
+			total += len;
+		}
+		mmap_close(base, size);
+		fileNum++;
+	}
+	fprintf(stderr
+		, "INFO: SegmentWarmer: %s, files = %zd of %zd, bytes = %lld, time = %.3f sec\n"
+		, m_stop ? "stopped" : "done", fileNum, m_files.size(), total
+		, pf.sf(t0, pf.now()));
+	m_done = true;
+}
+
+llong SegmentWarmer::warmedBytes(const std::string& segDir) const {
+	for (const SegInfo* seg : m_segs) {
+		if (seg->segDir == segDir)
+			return seg->warmedBytes.load(std::memory_order_relaxed);
+	}
+	return 0;
+}
+
+void SegmentWarmer::getSegmentStat(const std::string& segDir, SegmentLoadStat* st) {
+	st->segDir = segDir;
+	st->fileBytes = 0;
+	st->warmedBytes = 0;
+	st->residentBytes = 0;
+	forEachSegmentFile(segDir, [&](const fs::path& fpath, llong bytes) {
+		st->fileBytes += bytes;
+		try {
+			size_t size = 0;
+			void* base = mmap_load(fpath.string(), &size);
+			st->residentBytes += mmap_resident_bytes(base, size);
+			mmap_close(base, size);
+		}
+		catch (const std::exception&) {
+			// removed by merge or purge
+		}
+	});
+}
+
+} } // namespace terark::db
@@ -0,0 +1,68 @@
+#ifndef __terark_db_segment_warmer_hpp__
+#define __terark_db_segment_warmer_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/valvec.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace terark { namespace db {
+
+struct SegmentLoadStat {
+	std::string segDir;
+	llong  fileBytes;     // sum of file sizes of the segment
+	llong  warmedBytes;   // read ahead by SegmentWarmer
+	llong  residentBytes; // in page cache, 0 if unknown
+};
+
+// Warm-up thread of SegmentLoadPolicy::background. Files of readonly
+// segments are mapped and madvise(MADV_WILLNEED)'ed chunk by chunk, which
+// fills the page cache, so the lazily mmap'ed stores and indices of the
+// segments take just minor faults on first queries. Index files of all
+// segments are warmed before colgroup and other files, files of the same
+// priority are warmed by the saved read heat of their segments.
+class TERARK_DB_DLL SegmentWarmer : public RefCounter {
+	struct FileInfo {
+		std::string fpath;
+		size_t segNth;
+		llong  fileBytes;
+		int    priority; // lower is warmed earlier
+		double heat;     // reads per sec of the segment, hotter is earlier
+	};
+	struct SegInfo {
+		std::string segDir;
+		llong fileBytes;
+		std::atomic<llong> warmedBytes;
+	};
+	std::vector<FileInfo> m_files;
+	valvec<SegInfo*>  m_segs;
+	std::thread       m_thread;
+	std::atomic<bool> m_stop;
+	std::atomic<bool> m_done;
+	void threadProc();
+public:
+	SegmentWarmer();
+	~SegmentWarmer();
+
+	/// must be called before start()
+	void addSegment(const std::string& segDir, double heat = 0);
+	void start();
+	void stop(); // waits for the thread
+	bool isDone() const { return m_done.load(std::memory_order_relaxed); }
+
+	/// warmedBytes of segDir, 0 if segDir is not added
+	llong warmedBytes(const std::string& segDir) const;
+
+	/// list files of segDir, fileBytes and residentBytes, without warming
+	static void getSegmentStat(const std::string& segDir, SegmentLoadStat*);
+};
+typedef boost::intrusive_ptr<SegmentWarmer> SegmentWarmerPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_segment_warmer_hpp__
@@ -1,11 +1,17 @@
 #include "seq_num_index.hpp"
+#include "db_env.hpp"
+#include <terark/io/FileStream.hpp>
+#include <terark/io/DataIO.hpp>
+#include <terark/util/mmap.hpp>
+#include <boost/type_traits/make_unsigned.hpp>
+#include <limits>
 
 namespace terark { namespace db {
 
 template<class Int>
 class SeqNumIndex<Int>::MyIndexIterForward : public IndexIterator {
 	boost::intrusive_ptr<SeqNumIndex<Int> > m_index;
-	Int m_curr;
+	size_t m_curr;
 public:
 	MyIndexIterForward(const SeqNumIndex* owner) {
 		m_index.reset(const_cast<SeqNumIndex*>(owner));
@@ -16,7 +22,7 @@ public:
 	}
 	bool increment(llong* id, valvec<byte>* key) override {
 		auto owner = static_cast<const SeqNumIndex*>(m_index.get());
-		if (terark_likely(m_curr < owner->m_cnt)) {
+		if (terark_likely(m_curr < size_t(owner->m_cnt))) {
 			getIndexKey(id, key, owner, m_curr++);
 			return true;
 		}
@@ -30,27 +36,18 @@ public:
 		}
 		auto owner = static_cast<const SeqNumIndex*>(m_index.get());
 		Int keyId = unaligned_load<Int>(key.udata());
-		if (keyId >= owner->m_min + owner->m_cnt) {
+		size_t lo = owner->lowerBound(keyId);
+		if (lo >= size_t(owner->m_cnt)) {
 			m_curr = owner->m_cnt;
 			return -1;
 		}
-		else if (keyId < owner->m_min) {
-			m_curr = 1;
-			*id = 0;
-			retKey->assign((const byte*)&owner->m_min, sizeof(Int));
-			return 1;
-		}
-		else {
-			keyId -= owner->m_min;
-			m_curr = keyId + 1;
-			*id = keyId;
-			retKey->assign(key.udata(), key.size());
-			return 0;
-		}
+		getIndexKey(id, retKey, owner, lo);
+		m_curr = lo + 1;
+		return owner->keyOf(lo) == keyId ? 0 : 1;
 	}
 private:
-	void getIndexKey(llong* id, valvec<byte>* key, const SeqNumIndex* owner, Int curr) const {
-		Int keyId = owner->m_min + curr;
+	void getIndexKey(llong* id, valvec<byte>* key, const SeqNumIndex* owner, size_t curr) const {
+		Int keyId = owner->keyOf(curr);
 		*id = llong(curr);
 		key->erase_all();
 		key->assign((const byte*)&keyId, sizeof(Int));
@@ -60,7 +57,7 @@ private:
 template<class Int>
 class SeqNumIndex<Int>::MyIndexIterBackward : public IndexIterator {
 	boost::intrusive_ptr<SeqNumIndex<Int> > m_index;
-	Int m_curr;
+	size_t m_curr;
 public:
 	MyIndexIterBackward(const SeqNumIndex* owner) {
 		m_index.reset(const_cast<SeqNumIndex*>(owner));
@@ -72,7 +69,7 @@ public:
 	}
 	bool increment(llong* id, valvec<byte>* key) override {
 		auto owner = static_cast<const SeqNumIndex*>(m_index.get());
-		if (terark_likely(m_curr < owner->m_cnt)) {
+		if (terark_likely(m_curr > 0)) {
 			getIndexKey(id, key, owner, --m_curr);
 			return true;
 		}
@@ -86,28 +83,23 @@ public:
 		}
 		auto owner = static_cast<const SeqNumIndex*>(m_index.get());
 		Int keyId = unaligned_load<Int>(key.udata());
-		if (keyId <= owner->m_min) {
+		size_t lo = owner->lowerBound(keyId);
+		if (lo < size_t(owner->m_cnt) && owner->keyOf(lo) == keyId) {
+			getIndexKey(id, retKey, owner, lo);
+			m_curr = lo;
+			return 0;
+		}
+		if (0 == lo) {
 			m_curr = 0;
 			return -1;
 		}
-		else if (keyId > owner->m_min + owner->m_cnt) {
-			m_curr = owner->m_cnt;
-			*id = owner->m_cnt - 1;
-			Int forwardMax = owner->m_min + owner->m_cnt - 1;
-			retKey->assign((const byte*)&forwardMax, sizeof(Int));
-			return 1;
-		}
-		else {
-			keyId -= owner->m_min;
-			m_curr = keyId;
-			*id = keyId;
-			retKey->assign(key.udata(), key.size());
-			return 0;
-		}
+		getIndexKey(id, retKey, owner, lo - 1);
+		m_curr = lo - 1;
+		return 1;
 	}
 private:
-	void getIndexKey(llong* id, valvec<byte>* key, const SeqNumIndex* owner, Int curr) const {
-		Int keyId = owner->m_min + curr;
+	void getIndexKey(llong* id, valvec<byte>* key, const SeqNumIndex* owner, size_t curr) const {
+		Int keyId = owner->keyOf(curr);
 		*id = llong(curr);
 		key->erase_all();
 		key->assign((const byte*)&keyId, sizeof(Int));
@@ -118,20 +110,100 @@ template<class Int>
 SeqNumIndex<Int>::SeqNumIndex(Int min, Int cnt) {
 	m_min = min;
 	m_cnt = cnt;
+	m_mmapBase = nullptr;
+	m_mmapSize = 0;
+	m_isOrdered = true;
+	m_isUnique = true;
+}
+
+template<class Int>
+SeqNumIndex<Int>::~SeqNumIndex() {
+	if (m_mmapBase) {
+		m_bitmap.risk_release_ownership();
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
+	}
+}
+
+template<class Int>
+bool SeqNumIndex<Int>::build(const Int* keys, size_t rows, double minDensity) {
+	typedef typename boost::make_unsigned<Int>::type Uint;
+	assert(nullptr == m_mmapBase);
+	m_bitmap.clear();
+	m_min = 0;
+	m_cnt = 0;
+	if (0 == rows) {
+		return true;
+	}
+	if (rows > size_t(std::numeric_limits<Int>::max()) || !(minDensity > 0)) {
+		return false;
+	}
+	for (size_t i = 1; i < rows; ++i) {
+		if (keys[i-1] >= keys[i])
+			return false;
+	}
+	// keys are increasing, range is in [rows, max of Uint + 1]
+	const ullong range = ullong(Uint(keys[rows-1]) - Uint(keys[0])) + 1;
+	if (rows < minDensity * range) {
+		return false;
+	}
+	m_min = keys[0];
+	m_cnt = Int(rows);
+	if (range == rows) {
+		return true; // dense
+	}
+	m_bitmap.resize(size_t(range), false);
+	for (size_t i = 0; i < rows; ++i) {
+		m_bitmap.set1(size_t(Uint(keys[i]) - Uint(m_min)));
+	}
+	m_bitmap.build_cache(false, true); // need select1
+	return true;
 }
 
 template<class Int>
-SeqNumIndex<Int>::~SeqNumIndex() { }
+size_t SeqNumIndex<Int>::lowerBound(Int key) const {
+	typedef typename boost::make_unsigned<Int>::type Uint;
+	if (key < m_min) {
+		return 0;
+	}
+	size_t pos = size_t(Uint(key) - Uint(m_min));
+	if (isDense()) {
+		return std::min(pos, size_t(m_cnt));
+	}
+	if (pos >= m_bitmap.size()) {
+		return m_cnt;
+	}
+	return m_bitmap.rank1(pos);
+}
 
 template<class Int>
 IndexIterator*
-SeqNumIndex<Int>::createIndexIterForward(DbContext*) const { return nullptr; }
+SeqNumIndex<Int>::createIndexIterForward(DbContext*) const {
+	return new MyIndexIterForward(this);
+}
 template<class Int>
 IndexIterator*
-SeqNumIndex<Int>::createIndexIterBackward(DbContext*) const { return nullptr; }
+SeqNumIndex<Int>::createIndexIterBackward(DbContext*) const {
+	return new MyIndexIterBackward(this);
+}
 
 template<class Int>
-llong SeqNumIndex<Int>::indexStorageSize() const { return 2 * sizeof(llong); }
+void
+SeqNumIndex<Int>::searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const {
+	if (key.size() != sizeof(Int)) {
+		THROW_STD(invalid_argument,
+			"key.size must be sizeof(Int)=%d", int(sizeof(Int)));
+	}
+	Int keyId = unaligned_load<Int>(key.udata());
+	size_t lo = lowerBound(keyId);
+	if (lo < size_t(m_cnt) && keyOf(lo) == keyId) {
+		recIdvec->push_back(llong(lo));
+	}
+}
+
+template<class Int>
+llong SeqNumIndex<Int>::indexStorageSize() const {
+	return 2 * sizeof(llong) + m_bitmap.mem_size();
+}
 
 template<class Int>
 bool SeqNumIndex<Int>::remove(fstring key, llong id, DbContext*) {
@@ -147,6 +219,10 @@ bool SeqNumIndex<Int>::insert(fstring key, llong id, DbContext*) {
 		THROW_STD(invalid_argument,
 			"key.size must be sizeof(Int)=%d", int(sizeof(Int)));
 	}
+	if (!isDense()) {
+		THROW_STD(invalid_argument,
+			"sparse SeqNumIndex is readonly");
+	}
 	Int keyId = unaligned_load<Int>(key.udata());
 	if (keyId != m_min + id) {
 		THROW_STD(invalid_argument,
@@ -171,7 +247,7 @@ bool SeqNumIndex<Int>::replace(fstring key, llong id, llong newId, DbContext*) {
 			"replace with different id is not supported by SeqNumIndex");
 	}
 	Int keyId = unaligned_load<Int>(key.udata());
-	if (keyId != m_min + newId) {
+	if (newId >= llong(m_cnt) || keyId != keyOf(size_t(newId))) {
 		THROW_STD(invalid_argument,
 			"key must be consistent with id in SeqNumIndex");
 	}
@@ -182,7 +258,7 @@ template<class Int>
 void SeqNumIndex<Int>::clear() {}
 
 template<class Int>
-llong SeqNumIndex<Int>::dataStorageSize() const { return 2 * sizeof(llong); }
+llong SeqNumIndex<Int>::dataStorageSize() const { return indexStorageSize(); }
 template<class Int>
 llong SeqNumIndex<Int>::dataInflateSize() const { return sizeof(Int) * m_cnt; }
 template<class Int>
@@ -190,17 +266,50 @@ llong SeqNumIndex<Int>::numDataRows() const { return m_cnt; }
 
 template<class Int>
 void SeqNumIndex<Int>::getValueAppend(llong id, valvec<byte>* val, DbContext*) const {
-	Int keyAsVal = Int(this->m_min + id);
+	assert(id >= 0);
+	assert(id < llong(m_cnt));
+	Int keyAsVal = keyOf(size_t(id));
 	val->append((byte*)&keyAsVal, sizeof(Int));
 }
 
 template<class Int>
-StoreIterator* SeqNumIndex<Int>::createStoreIterForward(DbContext*) const {
-	return nullptr;
+StoreIterator* SeqNumIndex<Int>::createStoreIterForward(DbContext* ctx) const {
+	return createDefaultStoreIterForward(ctx);
+}
+template<class Int>
+StoreIterator* SeqNumIndex<Int>::createStoreIterBackward(DbContext* ctx) const {
+	return createDefaultStoreIterBackward(ctx);
+}
+
+// file is min and cnt, followed by the bitmap of sparse keys
+template<class Int>
+void SeqNumIndex<Int>::load(PathRef path) {
+	assert(nullptr == m_mmapBase);
+	auto fpath = path + ".seqnum";
+	bool writable = false;
+	m_mmapBase = (byte_t*)DbEnv::current()->mmapLoad(fpath.string(), &m_mmapSize, writable);
+	if (m_mmapSize < 2 * sizeof(Int)) {
+		THROW_STD(invalid_argument, "bad file: %s, size = %zd"
+			, fpath.string().c_str(), m_mmapSize);
+	}
+	m_min = unaligned_load<Int>(m_mmapBase);
+	m_cnt = unaligned_load<Int>(m_mmapBase + sizeof(Int));
+	if (m_mmapSize > 2 * sizeof(Int)) {
+		size_t offset = 2 * sizeof(Int);
+		m_bitmap.risk_mmap_from(m_mmapBase + offset, m_mmapSize - offset);
+		assert(m_bitmap.max_rank1() == size_t(m_cnt));
+	}
 }
+
 template<class Int>
-StoreIterator* SeqNumIndex<Int>::createStoreIterBackward(DbContext*) const {
-	return nullptr;
+void SeqNumIndex<Int>::save(PathRef path) const {
+	auto fpath = path + ".seqnum";
+	NativeDataOutput<EnvFileStream> dio;
+	dio.open(fpath.string().c_str(), "wb");
+	dio << m_min << m_cnt;
+	if (!isDense()) {
+		dio.ensureWrite(m_bitmap.data(), m_bitmap.mem_size());
+	}
 }
 
 template<class Int>
@@ -221,4 +330,79 @@ template class SeqNumIndex<uint64_t>;
 template class SeqNumIndex<int32_t>;
 template class SeqNumIndex<int64_t>;
 
+template<class Int>
+static ReadableIndex* buildSeqNumIndexT(fstring keys, double minDensity) {
+	std::unique_ptr<SeqNumIndex<Int> > index(new SeqNumIndex<Int>(0, 0));
+	if (keys.size() % sizeof(Int) != 0) {
+		return NULL;
+	}
+	if (!index->build((const Int*)keys.data(), keys.size() / sizeof(Int), minDensity)) {
+		return NULL;
+	}
+	return index.release();
+}
+
+ReadableIndex*
+buildSeqNumIndex(ColumnType keyType, fstring keys, double minDensity) {
+	switch (keyType) {
+	default:
+		return NULL;
+	case ColumnType::Sint32: return buildSeqNumIndexT< int32_t>(keys, minDensity);
+	case ColumnType::Uint32: return buildSeqNumIndexT<uint32_t>(keys, minDensity);
+	case ColumnType::Sint64: return buildSeqNumIndexT< int64_t>(keys, minDensity);
+	case ColumnType::Uint64: return buildSeqNumIndexT<uint64_t>(keys, minDensity);
+	}
+}
+
+template<class Int>
+static bool seqNumIndexMayFitT(SortedIndexInput& input, double minDensity) {
+	typedef typename boost::make_unsigned<Int>::type Uint;
+	valvec<byte> minKey, maxKey;
+	const llong rows = input.numRows();
+	if (rows <= 0 || !input.keyBounds(&minKey, &maxKey)) {
+		return false;
+	}
+	if (minKey.size() != sizeof(Int) || maxKey.size() != sizeof(Int)) {
+		return false;
+	}
+	Int lo = unaligned_load<Int>(minKey.data());
+	Int hi = unaligned_load<Int>(maxKey.data());
+	// bounds may be looser than actual, so the range is an upper bound
+	return lo <= hi && rows >= minDensity * (ullong(Uint(hi) - Uint(lo)) + 1);
+}
+
+bool
+seqNumIndexMayFit(ColumnType keyType, SortedIndexInput& input, double minDensity) {
+	if (!(minDensity > 0)) {
+		return false;
+	}
+	switch (keyType) {
+	default:
+		return false;
+	case ColumnType::Sint32: return seqNumIndexMayFitT< int32_t>(input, minDensity);
+	case ColumnType::Uint32: return seqNumIndexMayFitT<uint32_t>(input, minDensity);
+	case ColumnType::Sint64: return seqNumIndexMayFitT< int64_t>(input, minDensity);
+	case ColumnType::Uint64: return seqNumIndexMayFitT<uint64_t>(input, minDensity);
+	}
+}
+
+template<class Int>
+static ReadableIndex* openSeqNumIndexT(PathRef path) {
+	std::unique_ptr<SeqNumIndex<Int> > index(new SeqNumIndex<Int>(0, 0));
+	index->load(path);
+	return index.release();
+}
+
+ReadableIndex* openSeqNumIndex(ColumnType keyType, PathRef path) {
+	switch (keyType) {
+	default:
+		THROW_STD(invalid_argument, "SeqNumIndex does not support keyType %s"
+			, Schema::columnTypeStr(keyType));
+	case ColumnType::Sint32: return openSeqNumIndexT< int32_t>(path);
+	case ColumnType::Uint32: return openSeqNumIndexT<uint32_t>(path);
+	case ColumnType::Sint64: return openSeqNumIndexT< int64_t>(path);
+	case ColumnType::Uint64: return openSeqNumIndexT<uint64_t>(path);
+	}
+}
+
 } } // namespace terark::db
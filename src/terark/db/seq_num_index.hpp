@@ -2,16 +2,23 @@
 #define __terark_db_seq_num_index_hpp__
 
 #include "db_index.hpp"
+#include <terark/rank_select.hpp>
 
 namespace terark { namespace db {
 
 // SeqNumIndex can be used as a primary key of Id
+// dense : key of id is m_min + id
+// sparse: keys are increasing with ids, bit (key - m_min) of m_bitmap is set,
+//         key of id is m_min + select1(id), id of key is rank1(key - m_min)
 template<class Int>
 class TERARK_DB_DLL SeqNumIndex :
 	public ReadableIndex, public ReadableStore, public WritableIndex
 {
 	Int m_min;
 	Int m_cnt;
+	rank_select_se m_bitmap; // empty for dense keys
+	byte_t* m_mmapBase;
+	size_t  m_mmapSize;
 	class MyIndexIterForward; friend class MyIndexIterForward;
 	class MyIndexIterBackward; friend class MyIndexIterBackward;
 	class MyStoreIter; friend class MyStoreIter;
@@ -19,9 +26,20 @@ public:
 	SeqNumIndex(Int min, Int cnt);
 	~SeqNumIndex();
 
+	///@param keys are Int of ids [0, rows)
+	///@returns false if keys are not increasing with ids
+	///         or rows / (maxKey - minKey + 1) < minDensity
+	bool build(const Int* keys, size_t rows, double minDensity);
+	bool isDense() const { return 0 == m_bitmap.size(); }
+	Int  keyOf(size_t id) const
+	  { return Int(m_min + (isDense() ? id : m_bitmap.select1(id))); }
+	///@returns id of the first key >= key, m_cnt if no such key
+	size_t lowerBound(Int key) const;
+
 	IndexIterator* createIndexIterForward(DbContext*) const override;
 	IndexIterator* createIndexIterBackward(DbContext*) const override;
 	llong indexStorageSize() const override;
+	void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override;
 
 	bool remove(fstring key, llong id, DbContext*) override;
 	bool insert(fstring key, llong id, DbContext*) override;
@@ -36,11 +54,25 @@ public:
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
 
+	void load(PathRef path) override;
+	void save(PathRef path) const override;
+
 	WritableIndex* getWritableIndex() override;
 	ReadableIndex* getReadableIndex() override;
 	ReadableStore* getReadableStore() override;
 };
 
+///@{ SeqNumIndex supports Sint32, Uint32, Sint64 and Uint64 keys
+///@param keys are fixed length keys in recId order
+///@returns NULL if the keys do not fit SeqNumIndex
+TERARK_DB_DLL ReadableIndex*
+buildSeqNumIndex(ColumnType keyType, fstring keys, double minDensity);
+///@returns false if the keys do not fit SeqNumIndex, input is not consumed
+TERARK_DB_DLL bool
+seqNumIndexMayFit(ColumnType keyType, SortedIndexInput&, double minDensity);
+TERARK_DB_DLL ReadableIndex* openSeqNumIndex(ColumnType keyType, PathRef);
+///@}
+
 } } // namespace terark::db
 
 #endif // __terark_db_seq_num_index_hpp__
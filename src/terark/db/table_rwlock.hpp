@@ -0,0 +1,165 @@
+#ifndef __terark_db_table_rwlock_hpp__
+#define __terark_db_table_rwlock_hpp__
+
+#include "db_conf.hpp"
+#include <tbb/queuing_rw_mutex.h>
+#include <tbb/spin_rw_mutex.h>
+#include <new>
+
+// speculative_spin_rw_mutex of tbb 4.x is defined just if the compiler
+// has the tsx intrinsics, it falls back to spin_rw_mutex on cpus without
+// rtm at run time
+#if TBB_VERSION_MAJOR >= 2021 || defined(__TBB_TSX_AVAILABLE) && __TBB_TSX_AVAILABLE
+	#define TERARK_DB_HAS_SPECULATIVE_RW_MUTEX 1
+#else
+	#define TERARK_DB_HAS_SPECULATIVE_RW_MUTEX 0
+#endif
+
+namespace terark { namespace db {
+
+// The table lock, whose type is selected at run time by the TableLock
+// option of the table schema, with the interface of tbb rw mutexes. The
+// type is set before the first lock, a scoped_lock switches its own type
+// to the type of the mutex on acquire, lock ops are one switch over the
+// type. Type speculative is spin if tsx is unavailable(at compile time).
+class TableRwMutex {
+public:
+	typedef tbb::queuing_rw_mutex QueuingMutex;
+	typedef tbb::spin_rw_mutex    SpinMutex;
+#if TERARK_DB_HAS_SPECULATIVE_RW_MUTEX
+	typedef tbb::speculative_spin_rw_mutex SpeculativeMutex;
+#else
+	typedef tbb::spin_rw_mutex    SpeculativeMutex;
+#endif
+
+private:
+	union {
+		QueuingMutex     m_queuing;
+		SpinMutex        m_spin;
+		SpeculativeMutex m_speculative;
+	};
+	TableLockType m_type;
+
+	TableRwMutex(const TableRwMutex&) = delete;
+	TableRwMutex& operator=(const TableRwMutex&) = delete;
+
+	void construct() {
+		switch (m_type) {
+		case TableLockType::queuing    : new(&m_queuing) QueuingMutex(); break;
+		case TableLockType::spin       : new(&m_spin) SpinMutex(); break;
+		case TableLockType::speculative: new(&m_speculative) SpeculativeMutex(); break;
+		}
+	}
+	void destroy() {
+		switch (m_type) {
+		case TableLockType::queuing    : m_queuing.~QueuingMutex(); break;
+		case TableLockType::spin       : m_spin.~SpinMutex(); break;
+		case TableLockType::speculative: m_speculative.~SpeculativeMutex(); break;
+		}
+	}
+
+public:
+	explicit TableRwMutex(TableLockType type = TableLockType::queuing)
+	  : m_type(type) { construct(); }
+	~TableRwMutex() { destroy(); }
+
+	TableLockType type() const { return m_type; }
+
+	/// the mutex must not be used by any thread
+	void setType(TableLockType type) {
+		if (type != m_type) {
+			destroy();
+			m_type = type;
+			construct();
+		}
+	}
+
+	class scoped_lock {
+		typedef QueuingMutex::scoped_lock     QueuingLock;
+		typedef SpinMutex::scoped_lock        SpinLock;
+		typedef SpeculativeMutex::scoped_lock SpeculativeLock;
+		union {
+			QueuingLock     m_queuing;
+			SpinLock        m_spin;
+			SpeculativeLock m_speculative;
+		};
+		TableLockType m_type;
+
+		scoped_lock(const scoped_lock&) = delete;
+		scoped_lock& operator=(const scoped_lock&) = delete;
+
+		void construct() {
+			switch (m_type) {
+			case TableLockType::queuing    : new(&m_queuing) QueuingLock(); break;
+			case TableLockType::spin       : new(&m_spin) SpinLock(); break;
+			case TableLockType::speculative: new(&m_speculative) SpeculativeLock(); break;
+			}
+		}
+		void destroy() {
+			switch (m_type) {
+			case TableLockType::queuing    : m_queuing.~QueuingLock(); break;
+			case TableLockType::spin       : m_spin.~SpinLock(); break;
+			case TableLockType::speculative: m_speculative.~SpeculativeLock(); break;
+			}
+		}
+
+	public:
+		scoped_lock() : m_type(TableLockType::queuing) { construct(); }
+		scoped_lock(TableRwMutex& m, bool write = true) : m_type(m.m_type) {
+			construct();
+			acquire(m, write);
+		}
+		~scoped_lock() { destroy(); } // releases the lock if it is held
+
+		/// this lock must not hold a mutex
+		void acquire(TableRwMutex& m, bool write = true) {
+			if (terark_unlikely(m.m_type != m_type)) {
+				destroy();
+				m_type = m.m_type;
+				construct();
+			}
+			switch (m_type) {
+			case TableLockType::queuing    : m_queuing.acquire(m.m_queuing, write); break;
+			case TableLockType::spin       : m_spin.acquire(m.m_spin, write); break;
+			case TableLockType::speculative: m_speculative.acquire(m.m_speculative, write); break;
+			}
+		}
+		void release() {
+			switch (m_type) {
+			case TableLockType::queuing    : m_queuing.release(); break;
+			case TableLockType::spin       : m_spin.release(); break;
+			case TableLockType::speculative: m_speculative.release(); break;
+			}
+		}
+		/// false if the lock was released and re-acquired
+		bool upgrade_to_writer() {
+			switch (m_type) {
+			case TableLockType::queuing    : return m_queuing.upgrade_to_writer();
+			case TableLockType::spin       : return m_spin.upgrade_to_writer();
+			case TableLockType::speculative: return m_speculative.upgrade_to_writer();
+			}
+			return false;
+		}
+		bool downgrade_to_reader() {
+			switch (m_type) {
+			case TableLockType::queuing    : return m_queuing.downgrade_to_reader();
+			case TableLockType::spin       : return m_spin.downgrade_to_reader();
+			case TableLockType::speculative: return m_speculative.downgrade_to_reader();
+			}
+			return false;
+		}
+	};
+};
+
+inline const char* tableLockTypeName(TableLockType type) {
+	switch (type) {
+	case TableLockType::queuing    : return "queuing";
+	case TableLockType::spin       : return "spin";
+	case TableLockType::speculative: return "speculative";
+	}
+	return "unknown";
+}
+
+} } // namespace terark::db
+
+#endif // __terark_db_table_rwlock_hpp__
@@ -0,0 +1,1058 @@
+#include "trb_db_index.hpp"
+#include "trb_db_segment.hpp"
+#include <terark/io/var_int.hpp>
+#include <terark/mempool.hpp>
+#include "trb_db_rwlock.hpp"
+#include <algorithm>
+
+namespace terark { namespace db { namespace trbdb {
+
+typedef TrbRWLock TrbBtreeRWLock;
+
+class TrbBtreeIndexIter;
+class TrbBtreeStoreIter;
+
+// B+tree alternative of the threaded rbtree index, selected by index
+// schema option "writableBtree".
+// Each slot of a node is an 8 byte key head and a 4 byte record id, the
+// key head is order preserving(first 8 bytes in big endian, or the whole
+// transformed number for numeric keys), most compares in a node are done
+// by the heads in one or two cache lines and the key is only read when the
+// heads are equal.
+// Entries are ordered by (key, id desc) as the rbtree index, separators of
+// inner nodes have their own key copies, because the record of a separator
+// may be removed, sep[i-1] <= entries of child[i] < sep[i].
+// Nodes are not merged on remove, empty nodes are freed.
+class TrbBtreeIndex : public TrbWritableIndex
+{
+    friend class TrbBtreeIndexIter;
+    friend class TrbBtreeStoreIter;
+
+    static size_t constexpr LeafCap = 64;
+    static size_t constexpr InnerCap = 64;
+    static size_t constexpr MaxHeight = 16;
+    static uint32_t constexpr nil = UINT32_MAX;
+    static size_t constexpr index_shift = 3;
+    typedef MemPool<8> pool_type;
+
+    struct data_object
+    {
+        byte data[1];
+    };
+    // arrays have one more slot, a full node is split after the insert
+    struct Node
+    {
+        uint32_t num; // slots of leaf, separators of inner
+        bool isLeaf;
+    };
+    struct Leaf : Node
+    {
+        Leaf *prev;
+        Leaf *next;
+        uint64_t heads[LeafCap + 1];
+        uint32_t ids[LeafCap + 1];
+    };
+    struct Inner : Node
+    {
+        uint64_t heads[InnerCap + 1];
+        uint32_t ids[InnerCap + 1];
+        uint32_t keys[InnerCap + 1]; // in m_sepKeys, nil if m_exactHead
+        Node *child[InnerCap + 2];
+    };
+    struct Pos
+    {
+        Leaf *leaf;
+        size_t slot;
+    };
+    enum class ProbeMode
+    {
+        lowerKey,   // first entry whose key >= probe key
+        upperKey,   // first entry whose key >  probe key
+        lowerEntry, // first entry >= (key, id)
+        upperEntry, // first entry >  (key, id)
+    };
+    struct Probe
+    {
+        fstring key;
+        uint64_t head;
+        uint32_t id;
+        ProbeMode mode;
+    };
+
+    valvec<uint32_t> m_keyPos; // id to key pos in m_keys, nil if absent
+    pool_type m_keys;
+    pool_type m_sepKeys;
+    Node *m_root;
+    Leaf *m_first;
+    Leaf *m_last;
+    size_t m_nodeBytes;
+    size_t m_totalLen;
+    size_t m_numLive;
+    uint64_t m_version; // changed by every insert and remove
+    uint64_t m_seqSeed;
+    ColumnType m_numType; // Any if keys are compared as bytes
+    bool m_exactHead;     // head order is key order
+    mutable TrbBtreeRWLock m_rwMutex;
+
+    struct ReadLock
+    {
+        TrbBtreeRWLock::scoped_lock l;
+        explicit ReadLock(TrbBtreeIndex const *o)
+        {
+            if(!o->m_isFreezed)
+            {
+                l.acquire(o->m_rwMutex, false);
+            }
+        }
+    };
+
+    static fstring readKey(pool_type const &pool, uint32_t pos)
+    {
+        byte const *ptr;
+        size_t len = load_var_uint32(pool.at<data_object>(size_t(pos) << index_shift).data, &ptr);
+        return fstring(ptr, len);
+    }
+    static uint32_t storeKey(pool_type &pool, fstring d)
+    {
+        byte len_data[8];
+        byte *end_ptr = save_var_uint32(len_data, uint32_t(d.size()));
+        size_t len_len = size_t(end_ptr - len_data);
+        size_t dst_len = pool_type::align_to(d.size() + len_len);
+        size_t pos = pool.alloc(dst_len);
+        size_t pos_shift = pos >> index_shift;
+        if(pos_shift >= nil)
+        {
+            pool.sfree(pos, dst_len);
+            throw TrbMemoryFullException();
+        }
+        byte *dst_ptr = pool.at<data_object>(pos).data;
+        std::memcpy(dst_ptr, len_data, len_len);
+        std::memcpy(dst_ptr + len_len, d.data(), d.size());
+        return uint32_t(pos_shift);
+    }
+    static void freeKey(pool_type &pool, uint32_t pos_shift)
+    {
+        size_t pos = size_t(pos_shift) << index_shift;
+        byte const *ptr = pool.at<data_object>(pos).data, *end_ptr;
+        size_t len = load_var_uint32(ptr, &end_ptr);
+        pool.sfree(pos, pool_type::align_to(end_ptr - ptr + len));
+    }
+
+    bool hasId(size_t id) const
+    {
+        return id < m_keyPos.size() && m_keyPos[id] != nil;
+    }
+    fstring recordKey(uint32_t id) const
+    {
+        assert(hasId(id));
+        return readKey(m_keys, m_keyPos[id]);
+    }
+
+    uint64_t keyHead(fstring key) const
+    {
+        static uint64_t constexpr SignBit = uint64_t(1) << 63;
+        byte const *p = key.udata();
+        switch(m_numType)
+        {
+        default: break;
+        case ColumnType::Uint08: return p[0];
+        case ColumnType::Sint08: return uint64_t(int64_t(int8_t(p[0]))) ^ SignBit;
+        case ColumnType::Uint16: return unaligned_load<uint16_t>(p);
+        case ColumnType::Sint16: return uint64_t(int64_t(unaligned_load<int16_t>(p))) ^ SignBit;
+        case ColumnType::Uint32: return unaligned_load<uint32_t>(p);
+        case ColumnType::Sint32: return uint64_t(int64_t(unaligned_load<int32_t>(p))) ^ SignBit;
+        case ColumnType::Uint64: return unaligned_load<uint64_t>(p);
+        case ColumnType::Sint64: return uint64_t(unaligned_load<int64_t>(p)) ^ SignBit;
+        case ColumnType::Float32:
+            {
+                uint32_t u = unaligned_load<uint32_t>(p);
+                return (u & 0x80000000U) ? ~u : (u | 0x80000000U);
+            }
+        case ColumnType::Float64:
+            {
+                uint64_t u = unaligned_load<uint64_t>(p);
+                return (u & SignBit) ? ~u : (u | SignBit);
+            }
+        }
+        uint64_t h = 0;
+        size_t n = std::min<size_t>(8, key.size());
+        for(size_t i = 0; i < n; ++i)
+        {
+            h |= uint64_t(p[i]) << (56 - 8 * i);
+        }
+        return h;
+    }
+
+    // is the entry (head, id, getKey()) less than the probe
+    template<class GetKey>
+    bool entryLess(uint64_t head, uint32_t id, GetKey getKey, Probe const &p) const
+    {
+        if(head != p.head)
+        {
+            return head < p.head;
+        }
+        if(!m_exactHead)
+        {
+            int c = fstring_func::compare3()(getKey(), p.key);
+            if(c != 0)
+            {
+                return c < 0;
+            }
+        }
+        switch(p.mode)
+        {
+        default:
+        case ProbeMode::lowerKey:   return false;
+        case ProbeMode::upperKey:   return true;
+        case ProbeMode::lowerEntry: return !m_isUnique && id > p.id;
+        case ProbeMode::upperEntry: return m_isUnique || id >= p.id;
+        }
+    }
+    size_t leafLowerBound(Leaf const *leaf, Probe const &p) const
+    {
+        size_t lo = 0, hi = leaf->num;
+        while(lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            uint32_t id = leaf->ids[mid];
+            if(entryLess(leaf->heads[mid], id, [&]{ return recordKey(id); }, p))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+    // index of the child which may have the first entry not less than p
+    size_t innerLowerBound(Inner const *inner, Probe const &p) const
+    {
+        Probe q = p;
+        if(ProbeMode::lowerEntry == q.mode)
+        {
+            q.mode = ProbeMode::upperEntry; // an entry equal to sep is right
+        }
+        size_t lo = 0, hi = inner->num;
+        while(lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            uint32_t key = inner->keys[mid];
+            if(entryLess(inner->heads[mid], inner->ids[mid], [&]{ return readKey(m_sepKeys, key); }, q))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+    // the leaf is the one which should have the entry, slot may be num
+    Pos descend(Probe const &p, Inner **path, size_t *pathPos, size_t *depth) const
+    {
+        Node *node = m_root;
+        size_t d = 0;
+        while(!node->isLeaf)
+        {
+            Inner *inner = static_cast<Inner *>(node);
+            size_t i = innerLowerBound(inner, p);
+            if(path)
+            {
+                assert(d < MaxHeight);
+                path[d] = inner;
+                pathPos[d] = i;
+            }
+            d++;
+            node = inner->child[i];
+        }
+        if(depth)
+        {
+            *depth = d;
+        }
+        Leaf *leaf = static_cast<Leaf *>(node);
+        return Pos{leaf, leafLowerBound(leaf, p)};
+    }
+    static Pos normalize(Pos pos)
+    {
+        if(pos.leaf && pos.slot >= pos.leaf->num)
+        {
+            return Pos{pos.leaf->next, 0};
+        }
+        return pos;
+    }
+    static Pos prevPos(Pos pos)
+    {
+        if(pos.slot > 0)
+        {
+            return Pos{pos.leaf, pos.slot - 1};
+        }
+        Leaf *prev = pos.leaf->prev;
+        return Pos{prev, prev ? prev->num - 1 : 0};
+    }
+    Pos lowerBound(Probe const &p) const
+    {
+        if(NULL == m_root)
+        {
+            return Pos{NULL, 0};
+        }
+        return normalize(descend(p, NULL, NULL, NULL));
+    }
+    // last entry less than p
+    Pos reverseBound(Probe const &p) const
+    {
+        if(NULL == m_root)
+        {
+            return Pos{NULL, 0};
+        }
+        return prevPos(descend(p, NULL, NULL, NULL));
+    }
+    Probe makeProbe(fstring key, uint32_t id, ProbeMode mode) const
+    {
+        return Probe{key, keyHead(key), id, mode};
+    }
+
+    Leaf *newLeaf()
+    {
+        Leaf *leaf = new Leaf;
+        leaf->num = 0;
+        leaf->isLeaf = true;
+        leaf->prev = leaf->next = NULL;
+        m_nodeBytes += sizeof(Leaf);
+        return leaf;
+    }
+    Inner *newInner()
+    {
+        Inner *inner = new Inner;
+        inner->num = 0;
+        inner->isLeaf = false;
+        m_nodeBytes += sizeof(Inner);
+        return inner;
+    }
+    void freeNode(Node *node)
+    {
+        if(node->isLeaf)
+        {
+            m_nodeBytes -= sizeof(Leaf);
+            delete static_cast<Leaf *>(node);
+        }
+        else
+        {
+            Inner *inner = static_cast<Inner *>(node);
+            if(!m_exactHead)
+            {
+                for(size_t i = 0; i < inner->num; ++i)
+                    freeKey(m_sepKeys, inner->keys[i]);
+            }
+            m_nodeBytes -= sizeof(Inner);
+            delete inner;
+        }
+    }
+    void freeTree(Node *node)
+    {
+        if(!node->isLeaf)
+        {
+            Inner *inner = static_cast<Inner *>(node);
+            for(size_t i = 0; i <= inner->num; ++i)
+                freeTree(inner->child[i]);
+        }
+        freeNode(node);
+    }
+
+    // insert separator i of inner and its right child
+    static void innerInsert(Inner *inner, size_t i, uint64_t head, uint32_t id, uint32_t key, Node *right)
+    {
+        size_t n = inner->num;
+        assert(i <= n && n <= InnerCap);
+        std::memmove(inner->heads + i + 1, inner->heads + i, sizeof(uint64_t) * (n - i));
+        std::memmove(inner->ids + i + 1, inner->ids + i, sizeof(uint32_t) * (n - i));
+        std::memmove(inner->keys + i + 1, inner->keys + i, sizeof(uint32_t) * (n - i));
+        std::memmove(inner->child + i + 2, inner->child + i + 1, sizeof(Node *) * (n - i));
+        inner->heads[i] = head;
+        inner->ids[i] = id;
+        inner->keys[i] = key;
+        inner->child[i + 1] = right;
+        inner->num = uint32_t(n + 1);
+    }
+    void insertEntry(uint32_t id, fstring key)
+    {
+        Probe p = makeProbe(key, id, ProbeMode::lowerEntry);
+        if(NULL == m_root)
+        {
+            m_first = m_last = newLeaf();
+            m_root = m_first;
+        }
+        Inner *path[MaxHeight];
+        size_t pathPos[MaxHeight];
+        size_t depth;
+        Pos pos = descend(p, path, pathPos, &depth);
+        Leaf *leaf = pos.leaf;
+        size_t n = leaf->num;
+        std::memmove(leaf->heads + pos.slot + 1, leaf->heads + pos.slot, sizeof(uint64_t) * (n - pos.slot));
+        std::memmove(leaf->ids + pos.slot + 1, leaf->ids + pos.slot, sizeof(uint32_t) * (n - pos.slot));
+        leaf->heads[pos.slot] = p.head;
+        leaf->ids[pos.slot] = id;
+        leaf->num = uint32_t(n + 1);
+        if(leaf->num <= LeafCap)
+        {
+            return;
+        }
+        // split the leaf, the separator is the first entry of right
+        Leaf *right = newLeaf();
+        size_t half = leaf->num / 2;
+        right->num = leaf->num - uint32_t(half);
+        std::memcpy(right->heads, leaf->heads + half, sizeof(uint64_t) * right->num);
+        std::memcpy(right->ids, leaf->ids + half, sizeof(uint32_t) * right->num);
+        leaf->num = uint32_t(half);
+        right->prev = leaf;
+        right->next = leaf->next;
+        if(leaf->next)
+            leaf->next->prev = right;
+        else
+            m_last = right;
+        leaf->next = right;
+        uint64_t sepHead = right->heads[0];
+        uint32_t sepId = right->ids[0];
+        uint32_t sepKey = m_exactHead ? nil : storeKey(m_sepKeys, recordKey(sepId));
+        Node *newChild = right;
+        while(depth > 0)
+        {
+            --depth;
+            Inner *inner = path[depth];
+            innerInsert(inner, pathPos[depth], sepHead, sepId, sepKey, newChild);
+            if(inner->num <= InnerCap)
+            {
+                return;
+            }
+            // split the inner, the middle separator goes up
+            Inner *iright = newInner();
+            size_t mid = inner->num / 2;
+            iright->num = inner->num - uint32_t(mid) - 1;
+            std::memcpy(iright->heads, inner->heads + mid + 1, sizeof(uint64_t) * iright->num);
+            std::memcpy(iright->ids, inner->ids + mid + 1, sizeof(uint32_t) * iright->num);
+            std::memcpy(iright->keys, inner->keys + mid + 1, sizeof(uint32_t) * iright->num);
+            std::memcpy(iright->child, inner->child + mid + 1, sizeof(Node *) * (iright->num + 1));
+            sepHead = inner->heads[mid];
+            sepId = inner->ids[mid];
+            sepKey = inner->keys[mid];
+            inner->num = uint32_t(mid);
+            newChild = iright;
+        }
+        Inner *root = newInner();
+        root->child[0] = m_root;
+        innerInsert(root, 0, sepHead, sepId, sepKey, newChild);
+        m_root = root;
+    }
+    bool removeEntry(uint32_t id, fstring key)
+    {
+        if(NULL == m_root)
+        {
+            return false;
+        }
+        Probe p = makeProbe(key, id, ProbeMode::lowerEntry);
+        Inner *path[MaxHeight];
+        size_t pathPos[MaxHeight];
+        size_t depth;
+        Pos pos = descend(p, path, pathPos, &depth);
+        Leaf *leaf = pos.leaf;
+        if(pos.slot >= leaf->num || leaf->ids[pos.slot] != id)
+        {
+            return false;
+        }
+        size_t n = leaf->num - 1;
+        std::memmove(leaf->heads + pos.slot, leaf->heads + pos.slot + 1, sizeof(uint64_t) * (n - pos.slot));
+        std::memmove(leaf->ids + pos.slot, leaf->ids + pos.slot + 1, sizeof(uint32_t) * (n - pos.slot));
+        leaf->num = uint32_t(n);
+        if(n > 0)
+        {
+            return true;
+        }
+        if(leaf->prev)
+            leaf->prev->next = leaf->next;
+        else
+            m_first = leaf->next;
+        if(leaf->next)
+            leaf->next->prev = leaf->prev;
+        else
+            m_last = leaf->prev;
+        Node *empty = leaf;
+        while(depth > 0)
+        {
+            --depth;
+            Inner *inner = path[depth];
+            size_t i = pathPos[depth];
+            assert(inner->child[i] == empty);
+            freeNode(empty);
+            if(0 == inner->num)
+            {
+                // the only child is removed, remove inner from its parent
+                empty = inner;
+                continue;
+            }
+            // remove child i and the separator on its left(or right if 0)
+            size_t s = i > 0 ? i - 1 : 0;
+            size_t c = i;
+            if(!m_exactHead)
+                freeKey(m_sepKeys, inner->keys[s]);
+            size_t sn = inner->num - 1;
+            std::memmove(inner->heads + s, inner->heads + s + 1, sizeof(uint64_t) * (sn - s));
+            std::memmove(inner->ids + s, inner->ids + s + 1, sizeof(uint32_t) * (sn - s));
+            std::memmove(inner->keys + s, inner->keys + s + 1, sizeof(uint32_t) * (sn - s));
+            std::memmove(inner->child + c, inner->child + c + 1, sizeof(Node *) * (sn + 1 - c));
+            inner->num = uint32_t(sn);
+            empty = NULL;
+            break;
+        }
+        if(empty)
+        {
+            // the whole tree is empty
+            assert(empty == m_root);
+            freeNode(empty);
+            m_root = NULL;
+            m_first = m_last = NULL;
+            return true;
+        }
+        while(!m_root->isLeaf && 0 == m_root->num)
+        {
+            Inner *root = static_cast<Inner *>(m_root);
+            m_root = root->child[0];
+            freeNode(root);
+        }
+        return true;
+    }
+
+    // write lock must be held
+    bool removeId(size_t id)
+    {
+        if(!hasId(id))
+        {
+            return false;
+        }
+        uint32_t kpos = m_keyPos[id];
+        fstring key = readKey(m_keys, kpos);
+        bool exists = removeEntry(uint32_t(id), key);
+        assert(exists);
+        (void)exists;
+        m_totalLen -= key.size();
+        freeKey(m_keys, kpos);
+        m_keyPos[id] = nil;
+        m_numLive--;
+        m_version++;
+        return true;
+    }
+    // write lock must be held, an old key of id is replaced
+    bool insertId(size_t id, fstring key)
+    {
+        if(id >= nil)
+        {
+            throw TrbMemoryFullException();
+        }
+        removeId(id);
+        if(m_isUnique && NULL != m_root)
+        {
+            Pos pos = lowerBound(makeProbe(key, 0, ProbeMode::lowerKey));
+            if(pos.leaf && recordKey(pos.leaf->ids[pos.slot]) == key)
+            {
+                return false;
+            }
+        }
+        if(id >= m_keyPos.size())
+        {
+            m_keyPos.resize(id + 1, nil);
+        }
+        m_keyPos[id] = storeKey(m_keys, key);
+        try
+        {
+            insertEntry(uint32_t(id), key);
+        }
+        catch(...)
+        {
+            freeKey(m_keys, m_keyPos[id]);
+            m_keyPos[id] = nil;
+            throw;
+        }
+        m_totalLen += key.size();
+        m_numLive++;
+        m_version++;
+        return true;
+    }
+
+public:
+    explicit TrbBtreeIndex(Schema const &schema)
+        : m_keys(256)
+        , m_sepKeys(256)
+    {
+        m_root = NULL;
+        m_first = m_last = NULL;
+        m_nodeBytes = 0;
+        m_totalLen = 0;
+        m_numLive = 0;
+        m_version = 0;
+        m_seqSeed = 0;
+        m_numType = ColumnType::Any;
+        if(schema.columnNum() == 1)
+        {
+            switch(schema.getColumnMeta(0).type)
+            {
+            default: break;
+            case ColumnType::Uint08:
+            case ColumnType::Sint08:
+            case ColumnType::Uint16:
+            case ColumnType::Sint16:
+            case ColumnType::Uint32:
+            case ColumnType::Sint32:
+            case ColumnType::Uint64:
+            case ColumnType::Sint64:
+            case ColumnType::Float32:
+            case ColumnType::Float64:
+                m_numType = schema.getColumnMeta(0).type;
+                break;
+            }
+        }
+        m_exactHead = ColumnType::Any != m_numType;
+        ReadableIndex::m_isUnique = schema.m_isUnique;
+    }
+    ~TrbBtreeIndex()
+    {
+        if(m_root)
+        {
+            freeTree(m_root);
+        }
+    }
+    void save(PathRef) const override
+    {
+        //nothing todo ...
+    }
+    void load(PathRef) override
+    {
+        //nothing todo ...
+    }
+
+    IndexIterator* createIndexIterForward(DbContext*) const override;
+    IndexIterator* createIndexIterBackward(DbContext*) const override;
+
+    llong indexStorageSize() const override
+    {
+        return m_keyPos.used_mem_size() + m_keys.size() + m_sepKeys.size() + m_nodeBytes;
+    }
+
+    bool removeWithSeqId(fstring key, llong id, uint64_t &seq, DbContext*) override
+    {
+        assert(!m_isFreezed);
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        assert(recordKey(uint32_t(id)) == key);
+        if(!removeId(size_t(id)))
+        {
+            return false;
+        }
+        seq = m_seqSeed++;
+        return true;
+    }
+    bool insertWithSeqId(fstring key, llong id, uint64_t &seq, DbContext*) override
+    {
+        assert(!m_isFreezed);
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        if(!insertId(size_t(id), key))
+        {
+            return false;
+        }
+        seq = m_seqSeed++;
+        return true;
+    }
+    uint64_t allocSeqId() override
+    {
+        assert(!m_isFreezed);
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        return m_seqSeed++;
+    }
+
+    bool remove(fstring key, llong id, DbContext*) override
+    {
+        assert(!m_isFreezed);
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        assert(recordKey(uint32_t(id)) == key);
+        return removeId(size_t(id));
+    }
+    bool insert(fstring key, llong id, DbContext*) override
+    {
+        assert(!m_isFreezed);
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        return insertId(size_t(id), key);
+    }
+    bool replace(fstring key, llong oldId, llong newId, DbContext*) override
+    {
+        assert(!m_isFreezed);
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        assert(key == recordKey(uint32_t(oldId)));
+        bool success = removeId(size_t(oldId));
+        assert(success);
+        success = insertId(size_t(newId), key);
+        assert(success);
+        (void)success;
+        return true;
+    }
+
+    void clear() override
+    {
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        if(m_root)
+        {
+            freeTree(m_root);
+        }
+        m_root = NULL;
+        m_first = m_last = NULL;
+        m_keyPos.clear();
+        m_keys.clear();
+        m_sepKeys.clear();
+        m_totalLen = 0;
+        m_numLive = 0;
+        m_version++;
+    }
+
+    void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override
+    {
+        ReadLock l(this);
+        Pos pos = lowerBound(makeProbe(key, 0, ProbeMode::lowerKey));
+        while(pos.leaf)
+        {
+            uint32_t id = pos.leaf->ids[pos.slot];
+            if(recordKey(id) != key)
+            {
+                break;
+            }
+            recIdvec->push_back(id);
+            pos = normalize(Pos{pos.leaf, pos.slot + 1});
+        }
+    }
+
+    llong dataStorageSize() const override
+    {
+        return indexStorageSize();
+    }
+    llong dataInflateSize() const override
+    {
+        return m_totalLen;
+    }
+    llong numDataRows() const override
+    {
+        return m_keyPos.size();
+    }
+    void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override
+    {
+        ReadLock l(this);
+        if(terark_likely(hasId(size_t(id))))
+        {
+            fstring key = recordKey(uint32_t(id));
+            val->append(key.data(), key.size());
+        }
+        else
+        {
+            throw TrbReadDeletedRecordException{id};
+        }
+    }
+
+    StoreIterator* createStoreIterForward(DbContext*) const override;
+    StoreIterator* createStoreIterBackward(DbContext*) const override;
+
+    llong append(fstring row, DbContext*) override
+    {
+        assert(!m_isFreezed);
+        size_t id;
+        bool success;
+        {
+            TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+            id = m_keyPos.size();
+            success = insertId(id, row);
+        }
+        if(!success)
+        {
+            TERARK_THROW(StoreInternalException,
+                         "StoreInternalException: TrbBtreeIndex::append"
+            );
+        }
+        return llong(id);
+    }
+    void update(llong id, fstring row, DbContext*) override
+    {
+        assert(!m_isFreezed);
+        bool success;
+        {
+            TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+            success = insertId(size_t(id), row);
+        }
+        if(!success)
+        {
+            TERARK_THROW(StoreInternalException,
+                         "StoreInternalException: TrbBtreeIndex::update = %lld",
+                         id
+            );
+        }
+    }
+    void remove(llong id, DbContext*) override
+    {
+        assert(!m_isFreezed);
+        bool success;
+        {
+            TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+            success = removeId(size_t(id));
+        }
+        if(!success)
+        {
+            TERARK_THROW(StoreInternalException,
+                         "StoreInternalException: TrbBtreeIndex::remove = %lld",
+                         id
+            );
+        }
+    }
+
+    void shrinkToFit() override
+    {
+        assert(!m_isFreezed);
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        m_keyPos.shrink_to_fit();
+    }
+    void shrinkToSize(size_t size) override
+    {
+        assert(!m_isFreezed);
+        TrbBtreeRWLock::scoped_lock l(m_rwMutex, true);
+        assert(size <= m_keyPos.size());
+        assert(std::all_of(m_keyPos.begin() + size, m_keyPos.end(),
+                           [](uint32_t x) { return x == nil; }));
+        m_keyPos.resize(size);
+    }
+
+    ReadableIndex* getReadableIndex() override
+    {
+        return this;
+    }
+    WritableIndex* getWritableIndex() override
+    {
+        return this;
+    }
+    ReadableStore* getReadableStore() override
+    {
+        return this;
+    }
+    AppendableStore* getAppendableStore() override
+    {
+        return this;
+    }
+    UpdatableStore* getUpdatableStore() override
+    {
+        return this;
+    }
+    WritableStore* getWritableStore() override
+    {
+        return this;
+    }
+};
+
+// The position of the last returned entry is kept with the tree version,
+// if the tree is changed, the iterator seeks after the last returned entry
+class TrbBtreeIndexIter : public IndexIterator
+{
+    typedef TrbBtreeIndex owner_t;
+    typedef owner_t::Pos Pos;
+    typedef owner_t::ProbeMode ProbeMode;
+    boost::intrusive_ptr<owner_t> m_owner;
+    Pos m_pos;
+    uint64_t m_version;
+    valvec<byte> m_lastKey;
+    uint32_t m_lastId;
+    bool m_forward;
+    bool m_hasLast;
+
+    bool output(Pos pos, llong* id, valvec<byte>* key)
+    {
+        owner_t const *o = m_owner.get();
+        if(NULL == pos.leaf)
+        {
+            m_hasLast = false;
+            m_pos = pos;
+            return false;
+        }
+        uint32_t recId = pos.leaf->ids[pos.slot];
+        fstring k = o->recordKey(recId);
+        *id = recId;
+        key->assign(k.data(), k.size());
+        m_lastKey.assign(k.data(), k.size());
+        m_lastId = recId;
+        m_hasLast = true;
+        m_pos = pos;
+        m_version = o->m_version;
+        return true;
+    }
+
+public:
+    TrbBtreeIndexIter(owner_t const *o, bool forward)
+    {
+        m_isUniqueInSchema = o->m_isUnique;
+        m_owner.reset(const_cast<owner_t *>(o));
+        m_forward = forward;
+        reset();
+    }
+    void reset() override
+    {
+        m_pos = Pos{NULL, 0};
+        m_version = 0;
+        m_lastId = 0;
+        m_hasLast = false;
+        m_lastKey.erase_all();
+        m_state = 0;
+    }
+    bool increment(llong* id, valvec<byte>* key) override
+    {
+        owner_t const *o = m_owner.get();
+        owner_t::ReadLock l(o);
+        Pos pos;
+        if(0 == m_state)
+        {
+            m_state = 1;
+            if(m_forward)
+                pos = Pos{o->m_first, 0};
+            else
+                pos = Pos{o->m_last, o->m_last ? o->m_last->num - 1 : 0};
+        }
+        else if(!m_hasLast)
+        {
+            return false; // eof
+        }
+        else if(m_version == o->m_version)
+        {
+            if(m_forward)
+                pos = owner_t::normalize(Pos{m_pos.leaf, m_pos.slot + 1});
+            else
+                pos = owner_t::prevPos(m_pos);
+        }
+        else if(m_forward)
+        {
+            pos = o->lowerBound(o->makeProbe(m_lastKey, m_lastId, ProbeMode::upperEntry));
+        }
+        else
+        {
+            pos = o->reverseBound(o->makeProbe(m_lastKey, m_lastId, ProbeMode::lowerEntry));
+        }
+        return output(pos, id, key);
+    }
+    int seekLowerBound(fstring key, llong* id, valvec<byte>* retKey) override
+    {
+        owner_t const *o = m_owner.get();
+        owner_t::ReadLock l(o);
+        m_state = 1;
+        Pos pos;
+        if(m_forward)
+            pos = o->lowerBound(o->makeProbe(key, 0, ProbeMode::lowerKey));
+        else
+            pos = o->reverseBound(o->makeProbe(key, 0, ProbeMode::upperKey));
+        if(!output(pos, id, retKey))
+        {
+            return -1;
+        }
+        return fstring(*retKey) == key ? 0 : 1;
+    }
+    int seekUpperBound(fstring key, llong* id, valvec<byte>* retKey) override
+    {
+        owner_t const *o = m_owner.get();
+        owner_t::ReadLock l(o);
+        m_state = 1;
+        Pos pos;
+        if(m_forward)
+            pos = o->lowerBound(o->makeProbe(key, 0, ProbeMode::upperKey));
+        else
+            pos = o->reverseBound(o->makeProbe(key, 0, ProbeMode::lowerKey));
+        return output(pos, id, retKey) ? 1 : -1;
+    }
+
+private:
+    int m_state; // 0: not started
+};
+
+class TrbBtreeStoreIter : public StoreIterator
+{
+    typedef TrbBtreeIndex owner_t;
+    size_t m_where;
+    bool m_forward;
+public:
+    TrbBtreeStoreIter(owner_t const *o, bool forward)
+    {
+        m_store.reset(const_cast<owner_t *>(o));
+        m_forward = forward;
+        reset();
+    }
+    bool increment(llong* id, valvec<byte>* val) override
+    {
+        auto const *o = static_cast<owner_t const *>(m_store.get());
+        owner_t::ReadLock l(o);
+        if(m_forward)
+        {
+            size_t max = o->m_keyPos.size();
+            while(m_where < max)
+            {
+                size_t k = m_where++;
+                if(o->hasId(k))
+                {
+                    fstring key = o->recordKey(uint32_t(k));
+                    *id = k;
+                    val->assign(key.data(), key.size());
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            while(m_where > 0)
+            {
+                size_t k = --m_where;
+                if(o->hasId(k))
+                {
+                    fstring key = o->recordKey(uint32_t(k));
+                    *id = k;
+                    val->assign(key.data(), key.size());
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    bool seekExact(llong id, valvec<byte>* val) override
+    {
+        auto const *o = static_cast<owner_t const *>(m_store.get());
+        owner_t::ReadLock l(o);
+        if(id < 0 || id >= llong(o->m_keyPos.size()))
+        {
+            THROW_STD(out_of_range, "Invalid id = %lld, rows = %zd"
+                      , id, o->m_keyPos.size());
+        }
+        m_where = m_forward ? size_t(id) + 1 : size_t(id);
+        if(o->hasId(size_t(id)))
+        {
+            fstring key = o->recordKey(uint32_t(id));
+            val->assign(key.data(), key.size());
+            return true;
+        }
+        return false;
+    }
+    void reset() override
+    {
+        auto const *o = static_cast<owner_t const *>(m_store.get());
+        m_where = m_forward ? 0 : o->m_keyPos.size();
+    }
+};
+
+IndexIterator* TrbBtreeIndex::createIndexIterForward(DbContext*) const
+{
+    return new TrbBtreeIndexIter(this, true);
+}
+IndexIterator* TrbBtreeIndex::createIndexIterBackward(DbContext*) const
+{
+    return new TrbBtreeIndexIter(this, false);
+}
+StoreIterator* TrbBtreeIndex::createStoreIterForward(DbContext*) const
+{
+    return new TrbBtreeStoreIter(this, true);
+}
+StoreIterator* TrbBtreeIndex::createStoreIterBackward(DbContext*) const
+{
+    return new TrbBtreeStoreIter(this, false);
+}
+
+TrbWritableIndex *TrbWritableIndex::createBtreeIndex(Schema const &schema)
+{
+    return new TrbBtreeIndex(schema);
+}
+
+}}} // namespace terark::db::trbdb
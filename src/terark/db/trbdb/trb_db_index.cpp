@@ -4,7 +4,8 @@
 #include <terark/util/fstrvec.hpp>
 #include <terark/io/var_int.hpp>
 #include <type_traits>
-#include <tbb/spin_rw_mutex.h>
+#include <algorithm>
+#include "trb_db_rwlock.hpp"
 #include <terark/threaded_rbtree.h>
 #include <terark/mempool.hpp>
 #include <terark/lcast.hpp>
@@ -17,7 +18,7 @@ using namespace terark::db;
 
 namespace terark { namespace db { namespace trbdb {
 
-typedef tbb::spin_rw_mutex TrbIndexRWLock;
+typedef TrbRWLock TrbIndexRWLock;
 
 typedef std::true_type TrbLockWrite;
 typedef std::false_type TrbLockRead;
@@ -32,6 +33,149 @@ class TrbIndexStoreIterForward;
 template<class Key, class Fixed>
 class TrbIndexStoreIterBackward;
 
+// Companion of a unique TrbWritableIndexTemplate, Schema::m_writableHash,
+// exact searches and unique checks of the index probe it without walking
+// the tree. Slots are ids of the index by hash of their keys, with linear
+// probing, keys are not copied, they are compared by storage.key(id).
+// It is changed only in the writer lock of the index, after the tree.
+class TrbKeyHash
+{
+    struct Slot
+    {
+        uint32_t id;
+        uint32_t hash;
+    };
+    static uint32_t constexpr empty_id = 0xFFFFFFFFU;
+    static uint32_t constexpr tomb_id = 0xFFFFFFFEU;
+
+    valvec<Slot> m_slots; // size is 0 or power of 2
+    size_t m_count;
+    size_t m_used; // m_count + tombs
+
+    void rehash(size_t newSize)
+    {
+        valvec<Slot> slots(newSize, Slot{empty_id, 0});
+        size_t mask = newSize - 1;
+        for(const Slot &s : m_slots)
+        {
+            if(s.id < tomb_id)
+            {
+                size_t i = s.hash & mask;
+                while(slots[i].id != empty_id)
+                {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = s;
+            }
+        }
+        m_slots.swap(slots);
+        m_used = m_count;
+    }
+
+public:
+    TrbKeyHash() : m_count(0), m_used(0) {}
+
+    static uint32_t hashKey(fstring key)
+    {
+        uint64_t h = fstring_func::hash()(key);
+        return uint32_t(h ^ (h >> 32));
+    }
+
+    ///@returns id of key, or size_t(-1)
+    template<class Storage>
+    size_t find(fstring key, const Storage &s) const
+    {
+        if(m_slots.empty())
+        {
+            return size_t(-1);
+        }
+        uint32_t h = hashKey(key);
+        size_t mask = m_slots.size() - 1;
+        for(size_t i = h & mask; m_slots[i].id != empty_id; i = (i + 1) & mask)
+        {
+            const Slot &x = m_slots[i];
+            if(x.id != tomb_id && x.hash == h && s.node(x.id).is_used() && s.key(x.id) == key)
+            {
+                return x.id;
+            }
+        }
+        return size_t(-1);
+    }
+
+    void insert(uint32_t h, size_t id)
+    {
+        if((m_used + 1) * 2 > m_slots.size())
+        {
+            // drop tombs, grow only if live ids need it
+            size_t newSize = 16;
+            while(newSize < (m_count + 1) * 4)
+            {
+                newSize *= 2;
+            }
+            rehash(newSize);
+        }
+        size_t mask = m_slots.size() - 1;
+        size_t i = h & mask;
+        while(m_slots[i].id < tomb_id)
+        {
+            i = (i + 1) & mask;
+        }
+        if(m_slots[i].id == empty_id)
+        {
+            m_used++;
+        }
+        m_slots[i] = Slot{uint32_t(id), h};
+        m_count++;
+    }
+
+    void erase(uint32_t h, size_t id)
+    {
+        if(m_slots.empty())
+        {
+            return;
+        }
+        size_t mask = m_slots.size() - 1;
+        for(size_t i = h & mask; m_slots[i].id != empty_id; i = (i + 1) & mask)
+        {
+            if(m_slots[i].id == id)
+            {
+                m_slots[i].id = tomb_id;
+                m_count--;
+                return;
+            }
+        }
+        assert(false);
+    }
+
+    void clear()
+    {
+        m_slots.clear();
+        m_count = 0;
+        m_used = 0;
+    }
+    void shrink_to_fit()
+    {
+        size_t newSize = 16;
+        while(newSize < m_count * 4)
+        {
+            newSize *= 2;
+        }
+        if(m_count == 0)
+        {
+            clear();
+            m_slots.shrink_to_fit();
+        }
+        else if(newSize < m_slots.size() || m_used > m_count)
+        {
+            rehash(newSize);
+        }
+    }
+    size_t memory_size() const
+    {
+        return m_slots.capacity() * sizeof(Slot);
+    }
+};
+
 
 // var length
 // fixed length
@@ -1056,12 +1200,60 @@ class TrbWritableIndexTemplate : public TrbWritableIndex
     uint32_t m_version;
     uint64_t m_seqSeed;
     mutable TrbIndexRWLock m_rwMutex;
+    bool m_withHash;
+    TrbKeyHash m_hash;
+
+    // same result as m_storage.unique_insert_pos, and keeps m_hash
+    bool unique_insert(TrbIndexRWLock::scoped_lock &l, size_type id, fstring key)
+    {
+        if(!m_withHash)
+        {
+            return m_storage.template unique_insert_pos<TrbLockRead, key_compare_type>(l, m_version, id, key);
+        }
+        size_type found = m_hash.find(key, m_storage);
+        if(found != size_type(-1))
+        {
+            return found == id;
+        }
+        // an used id is moved to the new key by the tree
+        bool moved = id < m_storage.max_index() && m_storage.node(id).is_used();
+        uint32_t oldHash = moved ? TrbKeyHash::hashKey(m_storage.key(id)) : 0;
+        if(!m_storage.template unique_insert_pos<TrbLockRead, key_compare_type>(l, m_version, id, key))
+        {
+            return false;
+        }
+        if(moved)
+        {
+            m_hash.erase(oldHash, id);
+        }
+        m_hash.insert(TrbKeyHash::hashKey(key), id);
+        return true;
+    }
+    bool remove_id(TrbIndexRWLock::scoped_lock &l, size_type id)
+    {
+        uint32_t h = 0;
+        if(m_withHash && id < m_storage.max_index() && m_storage.node(id).is_used())
+        {
+            h = TrbKeyHash::hashKey(m_storage.key(id));
+        }
+        if(!m_storage.template remove_pos<TrbLockRead, key_compare_type>(l, m_version, id))
+        {
+            return false;
+        }
+        if(m_withHash)
+        {
+            m_hash.erase(h, id);
+        }
+        return true;
+    }
 
 public:
-    explicit TrbWritableIndexTemplate(size_type fixedLen, bool isUnique)
+    // floating keys are equal by value, not by bytes, they are not hashed
+    TrbWritableIndexTemplate(size_type fixedLen, bool isUnique, bool withHash = false)
         : m_storage(fixedLen)
         , m_version()
         , m_seqSeed()
+        , m_withHash(withHash && isUnique && !std::is_floating_point<Key>::value)
     {
         ReadableIndex::m_isUnique = isUnique;
     }
@@ -1086,7 +1278,7 @@ public:
     llong indexStorageSize() const override
     {
         //TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
-        return m_storage.memory_size();
+        return m_storage.memory_size() + m_hash.memory_size();
     }
 
     bool removeWithSeqId(fstring key, llong id, uint64_t &seq, DbContext*) override
@@ -1094,7 +1286,7 @@ public:
         assert(!m_isFreezed);
         TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
         assert(m_storage.key(id) == key);
-        if(!m_storage.template remove_pos<TrbLockRead, key_compare_type>(l, m_version, id))
+        if(!remove_id(l, id))
         {
             return false;
         }
@@ -1108,7 +1300,7 @@ public:
         TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
         if(m_isUnique)
         {
-            if(!m_storage.template unique_insert_pos<TrbLockRead, key_compare_type>(l, m_version, id, key))
+            if(!unique_insert(l, id, key))
             {
                 return false;
             }
@@ -1137,7 +1329,7 @@ public:
         assert(!m_isFreezed);
         TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
         assert(m_storage.key(id) == key);
-        return m_storage.template remove_pos<TrbLockRead, key_compare_type>(l, m_version, id);
+        return remove_id(l, id);
     }
     bool insert(fstring key, llong id, DbContext*) override
     {
@@ -1145,7 +1337,7 @@ public:
         TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
         if(m_isUnique)
         {
-            if(!m_storage.template unique_insert_pos<TrbLockRead, key_compare_type>(l, m_version, id, key))
+            if(!unique_insert(l, id, key))
             {
                 return false;
             }
@@ -1161,22 +1353,72 @@ public:
         assert(!m_isFreezed);
         TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
         assert(key == m_storage.key(oldId));
+        uint32_t h = m_withHash ? TrbKeyHash::hashKey(key) : 0;
         m_storage.template multi_insert_pos<TrbLockRead, key_compare_type>(l, m_version, newId, key);
         bool success = m_storage.template remove_pos<TrbLockWrite, key_compare_type>(l, m_version, oldId);
         assert(success);
         (void)success;
+        if(m_withHash)
+        {
+            m_hash.erase(h, oldId);
+            m_hash.insert(h, newId);
+        }
         return true;
     }
+    // the tree has no finger search, keys are inserted in tree order with
+    // the writer lock taken once, adjacent keys have hot search paths
+    size_t insertBatch(const fstring* keys, const llong* ids, size_t num, DbContext* ctx) override
+    {
+        assert(!m_isFreezed);
+        if(m_isUnique)
+        {
+            return WritableIndex::insertBatch(keys, ids, num, ctx);
+        }
+        valvec<size_type> order(num, valvec_no_init());
+        for(size_type i = 0; i < num; ++i)
+        {
+            order[i] = i;
+        }
+        key_compare_type comp{m_storage};
+        std::sort(order.begin(), order.end(), [&](size_type x, size_type y)
+        {
+            return comp(std::make_pair(keys[x], size_type(ids[x])), std::make_pair(keys[y], size_type(ids[y])));
+        });
+        TrbIndexRWLock::scoped_lock l(m_rwMutex, true);
+        for(size_type i : order)
+        {
+            m_storage.template multi_insert_pos<TrbLockWrite, key_compare_type>(l, m_version, ids[i], keys[i]);
+        }
+        return num;
+    }
 
     void clear() override
     {
         TrbIndexRWLock::scoped_lock l(m_rwMutex);
         m_storage.clear();
+        m_hash.clear();
     }
 
     void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override
     {
-        if(m_isFreezed)
+        if(m_withHash)
+        {
+            size_type id;
+            if(m_isFreezed)
+            {
+                id = m_hash.find(key, m_storage);
+            }
+            else
+            {
+                TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
+                id = m_hash.find(key, m_storage);
+            }
+            if(id != size_type(-1))
+            {
+                recIdvec->emplace_back(llong(id));
+            }
+        }
+        else if(m_isFreezed)
         {
             size_type lower, upper;
             threaded_rbtree_equal_range(m_storage.root,
@@ -1277,7 +1519,7 @@ public:
             id = m_storage.max_index();
             if(m_isUnique)
             {
-                success = m_storage.template unique_insert_pos<TrbLockRead, key_compare_type>(l, m_version, id, row);
+                success = unique_insert(l, id, row);
             }
             else
             {
@@ -1301,7 +1543,7 @@ public:
             TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
             if(m_isUnique)
             {
-                success = m_storage.template unique_insert_pos<TrbLockRead, key_compare_type>(l, m_version, id, row);
+                success = unique_insert(l, id, row);
             }
             else
             {
@@ -1323,7 +1565,7 @@ public:
         bool success;
         {
             TrbIndexRWLock::scoped_lock l(m_rwMutex, false);
-            success = m_storage.template remove_pos<TrbLockRead, key_compare_type>(l, m_version, id);
+            success = remove_id(l, id);
         }
         if(!success)
         {
@@ -1339,6 +1581,7 @@ public:
         assert(!m_isFreezed);
         TrbIndexRWLock::scoped_lock l(m_rwMutex);
         m_storage.shrink_to_fit();
+        m_hash.shrink_to_fit();
     }
 
     void shrinkToSize(size_t size)
@@ -1934,13 +2177,294 @@ public:
     }
 };
 
+// index of Schema::m_compactKey, keys of m_index are compactKeyEncode of
+// the keys, memcmp of them is the column order and common small integers
+// of composite keys take one byte instead of 4 or 8
+class TrbCompactKeyIndexIter : public IndexIterator
+{
+    IndexIteratorPtr m_iter;
+    const Schema &m_schema;
+    valvec<byte> m_enc;
+    valvec<byte> m_buf;
+
+    int decodeRet(int ret, valvec<byte>* retKey)
+    {
+        if(ret >= 0 && retKey)
+        {
+            m_schema.compactKeyDecode(m_buf, retKey);
+        }
+        return ret;
+    }
+public:
+    TrbCompactKeyIndexIter(IndexIterator *iter, const Schema &schema)
+        : m_iter(iter)
+        , m_schema(schema)
+    {
+        m_isUniqueInSchema = iter->isUniqueInSchema();
+    }
+    void reset() override
+    {
+        m_iter->reset();
+    }
+    bool increment(llong* id, valvec<byte>* key) override
+    {
+        if(!m_iter->increment(id, key ? &m_buf : NULL))
+        {
+            return false;
+        }
+        if(key)
+        {
+            m_schema.compactKeyDecode(m_buf, key);
+        }
+        return true;
+    }
+    int seekLowerBound(fstring key, llong* id, valvec<byte>* retKey) override
+    {
+        m_schema.compactKeyEncode(key, &m_enc);
+        return decodeRet(m_iter->seekLowerBound(m_enc, id, retKey ? &m_buf : NULL), retKey);
+    }
+    int seekUpperBound(fstring key, llong* id, valvec<byte>* retKey) override
+    {
+        m_schema.compactKeyEncode(key, &m_enc);
+        return decodeRet(m_iter->seekUpperBound(m_enc, id, retKey ? &m_buf : NULL), retKey);
+    }
+};
+
+class TrbCompactKeyStoreIter : public StoreIterator
+{
+    StoreIteratorPtr m_iter;
+    const Schema &m_schema;
+    valvec<byte> m_buf;
+public:
+    TrbCompactKeyStoreIter(const ReadableStore *store, StoreIterator *iter, const Schema &schema)
+        : m_iter(iter)
+        , m_schema(schema)
+    {
+        m_store.reset(const_cast<ReadableStore *>(store));
+    }
+    bool increment(llong* id, valvec<byte>* val) override
+    {
+        if(!m_iter->increment(id, &m_buf))
+        {
+            return false;
+        }
+        m_schema.compactKeyDecode(m_buf, val);
+        return true;
+    }
+    bool seekExact(llong id, valvec<byte>* val) override
+    {
+        if(!m_iter->seekExact(id, &m_buf))
+        {
+            return false;
+        }
+        m_schema.compactKeyDecode(m_buf, val);
+        return true;
+    }
+    void reset() override
+    {
+        m_iter->reset();
+    }
+};
+
+class TrbCompactKeyIndex : public TrbWritableIndex
+{
+    const Schema &m_schema;
+    TrbWritableIndexPtr m_index;
+
+    // keys are short, a local buffer per call keeps it reentrant
+    struct Encoded
+    {
+        valvec<byte> buf;
+        Encoded(const Schema &schema, fstring key)
+        {
+            schema.compactKeyEncode(key, &buf);
+        }
+        operator fstring() const
+        {
+            return fstring(buf.data(), buf.size());
+        }
+    };
+
+public:
+    TrbCompactKeyIndex(const Schema &schema, TrbWritableIndex *index)
+        : m_schema(schema)
+        , m_index(index)
+    {
+        ReadableIndex::m_isOrdered = true;
+        ReadableIndex::m_isUnique = index->isUnique();
+    }
+    void save(PathRef path) const override
+    {
+        m_index->save(path);
+    }
+    void load(PathRef path) override
+    {
+        m_index->load(path);
+    }
+    void markFrozen() override
+    {
+        ReadableStore::markFrozen();
+        m_index->markFrozen();
+    }
+
+    IndexIterator* createIndexIterForward(DbContext* ctx) const override
+    {
+        return new TrbCompactKeyIndexIter(m_index->createIndexIterForward(ctx), m_schema);
+    }
+    IndexIterator* createIndexIterBackward(DbContext* ctx) const override
+    {
+        return new TrbCompactKeyIndexIter(m_index->createIndexIterBackward(ctx), m_schema);
+    }
+    llong indexStorageSize() const override
+    {
+        return m_index->indexStorageSize();
+    }
+    void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext* ctx) const override
+    {
+        m_index->searchExactAppend(Encoded(m_schema, key), recIdvec, ctx);
+    }
+
+    bool removeWithSeqId(fstring key, llong id, uint64_t &seq, DbContext* ctx) override
+    {
+        return m_index->removeWithSeqId(Encoded(m_schema, key), id, seq, ctx);
+    }
+    bool insertWithSeqId(fstring key, llong id, uint64_t &seq, DbContext* ctx) override
+    {
+        return m_index->insertWithSeqId(Encoded(m_schema, key), id, seq, ctx);
+    }
+    uint64_t allocSeqId() override
+    {
+        return m_index->allocSeqId();
+    }
+    bool remove(fstring key, llong id, DbContext* ctx) override
+    {
+        WritableIndex *index = m_index.get();
+        return index->remove(Encoded(m_schema, key), id, ctx);
+    }
+    bool insert(fstring key, llong id, DbContext* ctx) override
+    {
+        return m_index->insert(Encoded(m_schema, key), id, ctx);
+    }
+    bool replace(fstring key, llong oldId, llong newId, DbContext* ctx) override
+    {
+        return m_index->replace(Encoded(m_schema, key), oldId, newId, ctx);
+    }
+    size_t insertBatch(const fstring* keys, const llong* ids, size_t num, DbContext* ctx) override
+    {
+        fstrvecl encoded;
+        valvec<byte> buf;
+        for(size_t i = 0; i < num; ++i)
+        {
+            m_schema.compactKeyEncode(keys[i], &buf);
+            encoded.push_back(buf);
+        }
+        valvec<fstring> ekeys(num, valvec_no_init());
+        for(size_t i = 0; i < num; ++i)
+        {
+            ekeys[i] = encoded[i];
+        }
+        return m_index->insertBatch(ekeys.data(), ids, num, ctx);
+    }
+    void clear() override
+    {
+        m_index->clear();
+    }
+
+    llong dataStorageSize() const override
+    {
+        return m_index->dataStorageSize();
+    }
+    llong dataInflateSize() const override
+    {
+        return m_index->dataInflateSize();
+    }
+    llong numDataRows() const override
+    {
+        return m_index->numDataRows();
+    }
+    void getValueAppend(llong id, valvec<byte>* val, DbContext* ctx) const override
+    {
+        valvec<byte> enc, key;
+        m_index->getValueAppend(id, &enc, ctx);
+        m_schema.compactKeyDecode(enc, &key);
+        val->append(key.data(), key.size());
+    }
+    StoreIterator* createStoreIterForward(DbContext* ctx) const override
+    {
+        return new TrbCompactKeyStoreIter(this, m_index->createStoreIterForward(ctx), m_schema);
+    }
+    StoreIterator* createStoreIterBackward(DbContext* ctx) const override
+    {
+        return new TrbCompactKeyStoreIter(this, m_index->createStoreIterBackward(ctx), m_schema);
+    }
+
+    llong append(fstring row, DbContext* ctx) override
+    {
+        return m_index->append(Encoded(m_schema, row), ctx);
+    }
+    void update(llong id, fstring row, DbContext* ctx) override
+    {
+        m_index->update(id, Encoded(m_schema, row), ctx);
+    }
+    void remove(llong id, DbContext* ctx) override
+    {
+        WritableStore *store = m_index.get();
+        store->remove(id, ctx);
+    }
+    void shrinkToFit() override
+    {
+        m_index->shrinkToFit();
+    }
+    void shrinkToSize(size_t size) override
+    {
+        m_index->shrinkToSize(size);
+    }
+
+    ReadableIndex* getReadableIndex() override
+    {
+        return this;
+    }
+    WritableIndex* getWritableIndex() override
+    {
+        return this;
+    }
+    ReadableStore* getReadableStore() override
+    {
+        return this;
+    }
+    AppendableStore* getAppendableStore() override
+    {
+        return this;
+    }
+    UpdatableStore* getUpdatableStore() override
+    {
+        return this;
+    }
+    WritableStore* getWritableStore() override
+    {
+        return this;
+    }
+};
+
 TrbWritableIndex *TrbWritableIndex::createIndex(Schema const &schema)
 {
+    if(schema.m_compactKey && schema.columnNum() > 1)
+    {
+        // compact keys are var length, so they are not in fixed storage
+        TrbWritableIndex *index = schema.m_writableBtree
+            ? createBtreeIndex(schema)
+            : new TrbWritableIndexTemplate<void, std::false_type>(0, schema.m_isUnique, schema.m_writableHash);
+        return new TrbCompactKeyIndex(schema, index);
+    }
+    if(schema.m_writableBtree)
+    {
+        return createBtreeIndex(schema);
+    }
     if(schema.columnNum() == 1)
     {
         ColumnMeta cm = schema.getColumnMeta(0);
 #define CASE_COL_TYPE(Enum, Type) \
-    case ColumnType::Enum: return new TrbWritableIndexTemplate<Type, std::false_type>(schema.getFixedRowLen(), schema.m_isUnique);
+    case ColumnType::Enum: return new TrbWritableIndexTemplate<Type, std::false_type>(schema.getFixedRowLen(), schema.m_isUnique, schema.m_writableHash);
         //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
         switch(cm.type)
         {
@@ -1960,11 +2484,11 @@ TrbWritableIndex *TrbWritableIndex::createIndex(Schema const &schema)
     }
     if(schema.getFixedRowLen() != 0)
     {
-        return new TrbWritableIndexTemplate<void, std::true_type>(schema.getFixedRowLen(), schema.m_isUnique);
+        return new TrbWritableIndexTemplate<void, std::true_type>(schema.getFixedRowLen(), schema.m_isUnique, schema.m_writableHash);
     }
     else
     {
-        return new TrbWritableIndexTemplate<void, std::false_type>(schema.getFixedRowLen(), schema.m_isUnique);
+        return new TrbWritableIndexTemplate<void, std::false_type>(schema.getFixedRowLen(), schema.m_isUnique, schema.m_writableHash);
     }
 }
 
@@ -9,6 +9,8 @@ namespace terark { namespace db { namespace trbdb {
 class TERARK_DB_DLL TrbWritableIndex : public ReadableIndex, public WritableIndex, public ReadableStore, public WritableStore {
 public:
     static TrbWritableIndex *createIndex(Schema const &);
+    // B+tree index, used if Schema::m_writableBtree
+    static TrbWritableIndex *createBtreeIndex(Schema const &);
 
     virtual bool removeWithSeqId(fstring key, llong id, uint64_t &seq, DbContext*) = 0;
     virtual bool insertWithSeqId(fstring key, llong id, uint64_t &seq, DbContext*) = 0;
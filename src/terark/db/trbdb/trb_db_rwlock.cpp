@@ -0,0 +1,50 @@
+#include "trb_db_rwlock.hpp"
+#include <thread>
+
+namespace terark { namespace db { namespace trbdb {
+
+TrbRWLock::TrbRWLock()
+{
+    for(size_t i = 0; i < SlotNum; ++i)
+    {
+        m_slots[i].readers.store(0, std::memory_order_relaxed);
+    }
+    m_writer.store(0, std::memory_order_relaxed);
+}
+
+size_t TrbRWLock::currentSlot()
+{
+    static std::atomic<size_t> s_next(0);
+    static thread_local size_t t_slot = s_next++ % SlotNum;
+    return t_slot;
+}
+
+void TrbRWLock::waitWriter(std::atomic<uint32_t> const &w)
+{
+    for(size_t spin = 0; w.load(std::memory_order_relaxed); ++spin)
+    {
+        if(spin >= 64)
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void TrbRWLock::lock_write()
+{
+    m_writeMutex.lock();
+    m_writer.store(1, std::memory_order_seq_cst);
+    for(size_t i = 0; i < SlotNum; ++i)
+    {
+        std::atomic<uint32_t> &n = m_slots[i].readers;
+        for(size_t spin = 0; n.load(std::memory_order_acquire); ++spin)
+        {
+            if(spin >= 64)
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
+
+}}} // namespace terark::db::trbdb
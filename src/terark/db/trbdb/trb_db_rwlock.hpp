@@ -0,0 +1,135 @@
+#pragma once
+
+#include <terark/db/db_dll_decl.hpp>
+#include <terark/config.hpp>
+#include <tbb/spin_mutex.h>
+#include <atomic>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace terark { namespace db { namespace trbdb {
+
+// Read mostly rw lock, readers of different threads count in different
+// cache lines, so concurrent readers don't bounce a shared lock word.
+// A writer raises m_writer then waits all reader counters drain, readers
+// back off while m_writer is set, writers are preferred.
+// Readers can not read optimistically without a lock(seqlock), because
+// writers realloc valvec and MemPool and free the memory being read.
+// The interface is the same as tbb::spin_rw_mutex.
+class TERARK_DB_DLL TrbRWLock
+{
+public:
+    static size_t constexpr SlotNum = 16;
+
+private:
+    static size_t constexpr CacheLine = 64;
+    struct Slot
+    {
+        std::atomic<uint32_t> readers;
+        char padding[CacheLine - sizeof(std::atomic<uint32_t>)];
+    };
+    Slot m_slots[SlotNum];
+    std::atomic<uint32_t> m_writer;
+    char m_padding[CacheLine - sizeof(std::atomic<uint32_t>)];
+    tbb::spin_mutex m_writeMutex;
+
+    TrbRWLock(TrbRWLock const &) = delete;
+    TrbRWLock &operator = (TrbRWLock const &) = delete;
+
+    static void waitWriter(std::atomic<uint32_t> const &w);
+
+public:
+    // per thread, round robin
+    static size_t currentSlot();
+
+    TrbRWLock();
+
+    void lock_read(size_t slot)
+    {
+        std::atomic<uint32_t> &n = m_slots[slot].readers;
+        for(;;)
+        {
+            n.fetch_add(1, std::memory_order_seq_cst);
+            if(terark_likely(!m_writer.load(std::memory_order_seq_cst)))
+            {
+                return;
+            }
+            n.fetch_sub(1, std::memory_order_release);
+            waitWriter(m_writer);
+        }
+    }
+    void unlock_read(size_t slot)
+    {
+        m_slots[slot].readers.fetch_sub(1, std::memory_order_release);
+    }
+    void lock_write();
+    void unlock_write()
+    {
+        m_writer.store(0, std::memory_order_release);
+        m_writeMutex.unlock();
+    }
+
+    class scoped_lock
+    {
+        TrbRWLock *m_mutex;
+        size_t m_slot;
+        bool m_isWriter;
+
+        scoped_lock(scoped_lock const &) = delete;
+        scoped_lock &operator = (scoped_lock const &) = delete;
+
+    public:
+        scoped_lock() : m_mutex(NULL), m_slot(0), m_isWriter(false)
+        {
+        }
+        scoped_lock(TrbRWLock &m, bool write = true)
+            : m_mutex(NULL), m_slot(0), m_isWriter(false)
+        {
+            acquire(m, write);
+        }
+        ~scoped_lock()
+        {
+            if(m_mutex)
+            {
+                release();
+            }
+        }
+        void acquire(TrbRWLock &m, bool write = true)
+        {
+            assert(NULL == m_mutex);
+            m_mutex = &m;
+            m_isWriter = write;
+            if(write)
+            {
+                m.lock_write();
+            }
+            else
+            {
+                m_slot = currentSlot();
+                m.lock_read(m_slot);
+            }
+        }
+        void release()
+        {
+            assert(NULL != m_mutex);
+            if(m_isWriter)
+                m_mutex->unlock_write();
+            else
+                m_mutex->unlock_read(m_slot);
+            m_mutex = NULL;
+        }
+        // the read lock is released before the write lock is acquired,
+        // always returns false, the caller must revalidate what it read
+        bool upgrade_to_writer()
+        {
+            assert(NULL != m_mutex && !m_isWriter);
+            m_mutex->unlock_read(m_slot);
+            m_mutex->lock_write();
+            m_isWriter = true;
+            return false;
+        }
+    };
+};
+
+}}} // namespace terark::db::trbdb
@@ -12,17 +12,36 @@
 #include <terark/io/DataIO.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/optional.hpp>
+#include <boost/filesystem.hpp>
+#include <functional>
 #include <thread>
-#include <tbb/queuing_mutex.h>
+#include <condition_variable>
+#include <chrono>
+#include <terark/bitmanip.hpp>
 #include <terark/io/MemStream.hpp>
 #include <terark/util/mmap.hpp>
 #include <algorithm>
+#include <random>
+#if defined(TERARK_DB_WITH_ZSTD)
+    #include <zstd.h>
+#endif
+#if defined(_MSC_VER)
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <errno.h>
 
 #undef min
 #undef max
 
 
-namespace terark { namespace db { namespace trbdb {
+namespace terark { namespace db {
+
+TERARK_DB_DLL llong parseSizeValue(fstring str); // defined in db_conf.cpp
+
+namespace trbdb {
 
 TERARK_DB_REGISTER_SEGMENT(TrbColgroupSegment, "trbdb", "trb");
 
@@ -35,7 +54,18 @@ struct TrbLogHeader
     byte name[16];
     uint32_t magic;
     uint32_t ver;
-    byte empty[128 - 24];
+    uint64_t baseSeq;   // seq of the first record, since ver 2
+                        // ver 3 may have Batch and delta records
+    uint32_t salt;      // init of record crc, since ver 4
+    uint32_t flags;     // since ver 4
+    byte empty[128 - 40];
+
+    enum : uint32_t
+    {
+        // bytes after the last valid record are stale or zero, the file is
+        // preallocated, recycled or written by O_DIRECT
+        TolerateTail = 1,
+    };
 
     static TrbLogHeader getDefault()
     {
@@ -49,7 +79,13 @@ struct TrbLogHeader
             // magic =
             0x12239275,
             // ver =
-            1,
+            4,
+            // baseSeq =
+            0,
+            // salt =
+            0,
+            // flags =
+            0,
             // empty =
             {},
         };
@@ -66,6 +102,264 @@ static size_t constexpr logCheckPointSize = 8192;
 
 typedef LittleEndianDataOutput<AutoGrownMemIO> LogOutout_t;
 
+// log bytes since last checkpoint to trigger a new checkpoint, 0 is disabled
+static const uint64_t g_logCheckpointSize = []
+{
+    const char* env = getenv("TerarkDB_TrbLogCheckpointSize");
+    return env ? uint64_t(parseSizeValue(env)) : uint64_t(1) << 30;
+}();
+
+// sync committers wait this long for others to join their group
+static const long g_logGroupCommitDelayUs =
+    getEnvLong("TerarkDB_TrbLogGroupCommitDelayUs", 0);
+
+// group commit buffers and image batches are compressed by zstd
+static const bool g_logCompress = []
+{
+    bool compress = getEnvBool("TerarkDB_TrbLogCompress", false);
+#if !defined(TERARK_DB_WITH_ZSTD)
+    if(compress)
+    {
+        fprintf(stderr, "WARN: TerarkDB_TrbLogCompress is ignored, zstd is not enabled(WITH_ZSTD=1)\n");
+        compress = false;
+    }
+#endif
+    return compress;
+}();
+
+// updated rows are logged as delta of their previous version
+static const bool g_logDelta = getEnvBool("TerarkDB_TrbLogDelta", false);
+
+// log files are extended by fallocate in chunks of this size, 0 is disabled
+static const uint64_t g_logPreallocSize = []
+{
+    const char* env = getenv("TerarkDB_TrbLogPreallocSize");
+    return env ? uint64_t(parseSizeValue(env)) : uint64_t(0);
+}();
+
+// the log replaced by a checkpoint is reused as the next log, its blocks are
+// allocated and written, so syncs of the next log don't update metadata
+static const bool g_logRecycle = []
+{
+    bool recycle = getEnvBool("TerarkDB_TrbLogRecycle", false);
+#if defined(_MSC_VER)
+    if(recycle)
+    {
+        fprintf(stderr, "WARN: TerarkDB_TrbLogRecycle is not supported on this platform\n");
+        recycle = false;
+    }
+#endif
+    return recycle;
+}();
+
+// logs are written by O_DIRECT, the last partial block is rewritten by the
+// next write
+static const bool g_logDirectIO = getEnvBool("TerarkDB_TrbLogDirectIO", false);
+
+// log file is created on the first write, a writable segment which is never
+// written holds no file descriptor, this is the case of most tables when
+// there are many small tables in a process
+static const bool g_logLazyOpen = getEnvBool("TerarkDB_TrbLogLazyOpen", true);
+
+// append only log file written by offset, the physical size may be larger
+// than the logical size, the tail is cut when the file is closed
+class TrbLogFile
+{
+    static size_t constexpr DirectAlign = 4096;
+
+    std::string m_path;
+    int m_fd;
+    bool m_direct;
+    bool m_prealloc;
+    uint64_t m_size;        // logical size
+    uint64_t m_allocEnd;    // physical size
+    byte *m_dbuf;           // O_DIRECT, the last partial block and new data
+    size_t m_dcap;
+
+    void writeAt(uint64_t offset, void const *data, size_t size)
+    {
+        byte const *p = (byte const *)data;
+        while(size)
+        {
+#if defined(_MSC_VER)
+            _lseeki64(m_fd, offset, SEEK_SET);
+            int len = ::_write(m_fd, p, unsigned(std::min<size_t>(size, 1u << 30)));
+#else
+            ssize_t len = ::pwrite(m_fd, p, size, off_t(offset));
+#endif
+            if(len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(len <= 0)
+            {
+                THROW_STD(runtime_error, "write(%s, %zd) = %s", m_path.c_str(), size, strerror(errno));
+            }
+            p += len;
+            offset += len;
+            size -= len;
+        }
+    }
+    void reserve(uint64_t end)
+    {
+        if(end <= m_allocEnd)
+        {
+            return;
+        }
+#if defined(__linux__)
+        if(m_prealloc)
+        {
+            uint64_t newEnd = (end + g_logPreallocSize - 1) / g_logPreallocSize * g_logPreallocSize;
+            if(::fallocate(m_fd, 0, off_t(m_allocEnd), off_t(newEnd - m_allocEnd)) == 0)
+            {
+                m_allocEnd = newEnd;
+                return;
+            }
+            fprintf(stderr, "WARN: TrbLogger fallocate(%s) = %s, preallocation is disabled\n",
+                    m_path.c_str(), strerror(errno));
+            m_prealloc = false;
+        }
+#endif
+        m_allocEnd = end;
+    }
+    void writeDirect(void const *data, size_t size)
+    {
+        size_t tail = size_t(m_size % DirectAlign);
+        size_t need = (tail + size + DirectAlign - 1) / DirectAlign * DirectAlign;
+        if(need > m_dcap)
+        {
+            size_t cap = std::max(need, m_dcap * 2);
+            void *buf = nullptr;
+            if(posix_memalign(&buf, DirectAlign, cap) != 0)
+            {
+                throw std::bad_alloc();
+            }
+            memcpy(buf, m_dbuf, tail);
+            free(m_dbuf);
+            m_dbuf = (byte *)buf;
+            m_dcap = cap;
+        }
+        memcpy(m_dbuf + tail, data, size);
+        memset(m_dbuf + tail + size, 0, need - tail - size);
+        uint64_t offset = m_size - tail;
+        reserve(offset + need);
+        writeAt(offset, m_dbuf, need);
+        m_size += size;
+        size_t newTail = size_t(m_size % DirectAlign);
+        if(newTail && need > DirectAlign)
+        {
+            memmove(m_dbuf, m_dbuf + need - DirectAlign, newTail);
+        }
+    }
+
+public:
+    TrbLogFile() : m_fd(-1), m_direct(), m_prealloc(), m_size(), m_allocEnd()
+                 , m_dbuf(), m_dcap()
+    {
+    }
+    ~TrbLogFile()
+    {
+        close();
+        free(m_dbuf);
+    }
+    bool isOpen() const
+    {
+        return m_fd >= 0;
+    }
+    uint64_t size() const
+    {
+        return m_size;
+    }
+    // reuse keeps the blocks of an existing file, it is overwritten from 0
+    void open(std::string const &path, bool reuse, bool direct)
+    {
+        assert(m_fd < 0);
+        int flags = O_WRONLY | O_CREAT | (reuse ? 0 : O_TRUNC);
+#if defined(_MSC_VER)
+        flags |= O_BINARY;
+#endif
+#if defined(O_DIRECT)
+        if(direct)
+        {
+            m_fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            if(m_fd < 0)
+            {
+                fprintf(stderr, "WARN: TrbLogger open(%s, O_DIRECT) = %s, use buffered io\n",
+                        path.c_str(), strerror(errno));
+                direct = false;
+            }
+        }
+#else
+        direct = false;
+#endif
+        if(m_fd < 0)
+        {
+            m_fd = ::open(path.c_str(), flags, 0644);
+        }
+        if(m_fd < 0)
+        {
+            THROW_STD(runtime_error, "open(%s) = %s", path.c_str(), strerror(errno));
+        }
+        m_path = path;
+        m_direct = direct;
+        m_prealloc = g_logPreallocSize > 0;
+        m_size = 0;
+#if defined(_MSC_VER)
+        m_allocEnd = reuse ? uint64_t(_lseeki64(m_fd, 0, SEEK_END)) : 0;
+#else
+        m_allocEnd = reuse ? uint64_t(::lseek(m_fd, 0, SEEK_END)) : 0;
+#endif
+    }
+    void write(void const *data, size_t size)
+    {
+        assert(m_fd >= 0);
+        if(m_direct)
+        {
+            writeDirect(data, size);
+            return;
+        }
+        reserve(m_size + size);
+        writeAt(m_size, data, size);
+        m_size += size;
+    }
+    void sync()
+    {
+        assert(m_fd >= 0);
+#if defined(_MSC_VER)
+        int err = ::_commit(m_fd);
+#elif defined(__linux__)
+        int err = ::fdatasync(m_fd);
+#else
+        int err = ::fsync(m_fd);
+#endif
+        if(err != 0)
+        {
+            THROW_STD(runtime_error, "fdatasync(%s) = %s", m_path.c_str(), strerror(errno));
+        }
+    }
+    // keepTail leaves the physical size for recycling
+    void close(bool keepTail = false)
+    {
+        if(m_fd < 0)
+        {
+            return;
+        }
+#if !defined(_MSC_VER)
+        if(!keepTail && m_allocEnd > m_size && ::ftruncate(m_fd, off_t(m_size)) != 0)
+        {
+            fprintf(stderr, "WARN: TrbLogger ftruncate(%s) = %s\n", m_path.c_str(), strerror(errno));
+        }
+#endif
+        ::close(m_fd);
+        m_fd = -1;
+    }
+};
+
+static std::atomic<uint64_t> g_logGroupNum{0};
+static std::atomic<uint64_t> g_logSyncGroupNum{0};
+static std::atomic<uint64_t> g_logGroupRecordNum{0};
+static std::atomic<uint64_t> g_logGroupSizeHist[TrbLogGroupCommitStat::HistSize];
+
 //this should be in Transaction.cpp
 //tempory place here
 struct CommitPair
@@ -90,6 +384,9 @@ public:
  * |    crc size = crc ( data size    +    crc data )  |              |                |
  * |                |                 |                |              |                |
  * |--- crc size ---|--- data size ---|--- crc data ---|--- action ---|--- param(s) ---|
+ *
+ * params of a Batch record are a zstd frame of whole records(a group commit
+ * or an image batch), a checkpoint marker follows each Batch record
  */
 class TrbLogger
 {
@@ -103,18 +400,18 @@ private:
         TableRemoveRow,         //RecId, Version
         TransactionUpdateRow,   //SubId, Version, Data
         TransactionCommitRow,   //[RecId, Version]
+        WritableUpdateRowDelta, //SubId, PrefixLen, SuffixLen, Data
+        Batch,                  //RawSize, zstd of records, not in seq order
     };
+    // smaller group buffers are not compressed
+    static size_t constexpr logBatchMinSize = 1024;
+    // rows with less unchanged bytes are logged as full rows
+    static size_t constexpr logDeltaMinSave = 16;
 
     template<class ...args_t>
-    void writeLog(DbContext *ctx, uint64_t seq, LogAction action, args_t const &...args)
+    size_t encodeLog(LogOutout_t &buffer, uint32_t salt, uint64_t seq, LogAction action,
+                     args_t const &...args)
     {
-        if(!ctx->trbLog)
-        {
-            ctx->trbLog.reset(new TrbLoggerContext);
-        }
-        assert(dynamic_cast<TrbLoggerContext *>(ctx->trbLog.get()) != nullptr);
-        auto &buffer = static_cast<TrbLoggerContext *>(ctx->trbLog.get())->buf;
-
         buffer.rewind();
         buffer.resize(12);
         buffer.seek(12);
@@ -133,24 +430,145 @@ private:
 
         buffer.seek(4);
         buffer << uint32_t(size);
-        buffer << Crc32c_update(0, buffer.buf() + 12, size - 12);
+        buffer << Crc32c_update(salt, buffer.buf() + 12, size - 12);
         buffer.seek(0);
-        buffer << Crc32c_update(0, buffer.buf() + 4, 8);
+        buffer << Crc32c_update(salt, buffer.buf() + 4, 8);
 
         ++m_logCount;
         m_logSize += size;
+        return size;
+    }
+
+    // records in raw as one Batch record in buffer, 0 if it is not smaller
+    size_t packBatch(fstring raw, uint32_t salt, LogOutout_t &buffer, valvec<byte> &zbuf)
+    {
+#if defined(TERARK_DB_WITH_ZSTD)
+        if(raw.size() < logBatchMinSize)
+        {
+            return 0;
+        }
+        zbuf.resize_no_init(ZSTD_compressBound(raw.size()));
+        size_t res = ZSTD_compress(zbuf.data(), zbuf.size(), raw.data(), raw.size(), 1);
+        if(ZSTD_isError(res) || res + 32 >= size_t(raw.size()))
+        {
+            return 0;
+        }
+        // a checkpoint marker after each batch, replay chunks start there
+        m_logCount = logCheckPointCount;
+        return encodeLog(buffer, salt, 0, LogAction::Batch, var_size_t(raw.size()), fstring(zbuf.data(), res));
+#else
+        (void)raw; (void)salt; (void)buffer; (void)zbuf;
+        return 0;
+#endif
+    }
+
+    template<class ...args_t>
+    void writeLog(DbContext *ctx, uint64_t seq, LogAction action, args_t const &...args)
+    {
+        if(!ctx->trbLog)
+        {
+            ctx->trbLog.reset(new TrbLoggerContext);
+        }
+        assert(dynamic_cast<TrbLoggerContext *>(ctx->trbLog.get()) != nullptr);
+        auto &buffer = static_cast<TrbLoggerContext *>(ctx->trbLog.get())->buf;
+
+        size_t size = encodeLog(buffer, m_salt, seq, action, args...);
         m_totalLogSize += size;
 
+        // group commit: append to shared buffer, the first committer which
+        // finds no leader writes the whole group, sync committers wait for
+        // the flushed lsn
+        bool const sync = ctx->syncOnCommit;
         lock_t l(m_mutex);
-        m_fp.write(buffer.buf(), size);
-        if(ctx->syncOnCommit)
+        m_groupBuf.append(buffer.buf(), size);
+        m_groupRecords++;
+        m_groupNeedSync |= sync;
+        uint64_t const lsn = m_appendLsn += size;
+        while(true)
         {
-            m_fp.flush();
+            if(!m_hasLeader)
+            {
+                leadGroupCommit(l);
+            }
+            if(!sync || m_syncedLsn >= lsn)
+            {
+                break;
+            }
+            if(m_brokenLsn >= lsn)
+            {
+                THROW_STD(runtime_error, "TrbLogger group commit failed, lsn = %llu",
+                          (unsigned long long)lsn);
+            }
+            m_cond.wait(l);
         }
     }
 
-    typedef tbb::queuing_mutex mutex_t;
-    typedef mutex_t::scoped_lock lock_t;
+    typedef std::mutex mutex_t;
+    typedef std::unique_lock<mutex_t> lock_t;
+
+    // write m_groupBuf until it is empty, m_mutex is released during write
+    void leadGroupCommit(lock_t &l)
+    {
+        assert(!m_hasLeader);
+        m_hasLeader = true;
+        if(m_groupNeedSync && g_logGroupCommitDelayUs > 0)
+        {
+            m_cond.wait_for(l, std::chrono::microseconds(g_logGroupCommitDelayUs));
+        }
+        while(!m_groupBuf.empty())
+        {
+            m_writeBuf.swap(m_groupBuf);
+            m_groupBuf.erase_all();
+            uint64_t const endLsn = m_appendLsn;
+            size_t const records = m_groupRecords;
+            bool const needSync = m_groupNeedSync;
+            m_groupRecords = 0;
+            m_groupNeedSync = false;
+            l.unlock();
+            try
+            {
+                if(m_logPending)
+                {
+                    openPendingLog();
+                }
+                fstring out(m_writeBuf.data(), m_writeBuf.size());
+                if(g_logCompress)
+                {
+                    size_t packed = packBatch(out, m_salt, m_packBuf, m_zipBuf);
+                    if(packed)
+                    {
+                        m_totalLogSize -= out.size() - packed;
+                        out = fstring(m_packBuf.buf(), packed);
+                    }
+                }
+                m_file.write(out.data(), out.size());
+                if(needSync)
+                {
+                    m_file.sync();
+                }
+            }
+            catch(...)
+            {
+                l.lock();
+                m_brokenLsn = endLsn;
+                m_hasLeader = false;
+                m_cond.notify_all();
+                throw;
+            }
+            l.lock();
+            if(needSync)
+            {
+                m_syncedLsn = endLsn;
+            }
+            size_t bucket = 63 - fast_clz64(records);
+            g_logGroupSizeHist[std::min(bucket, TrbLogGroupCommitStat::HistSize - 1)]++;
+            g_logGroupNum++;
+            g_logSyncGroupNum += needSync;
+            g_logGroupRecordNum += records;
+            m_cond.notify_all();
+        }
+        m_hasLeader = false;
+    }
 
 public:
     struct Param
@@ -161,27 +579,48 @@ public:
         std::function<bool(llong, llong)> tableRemoveRow;
         std::function<bool(uint32_t, llong, ColumnVec const &, valvec<byte> &)> transactionUpdateRow;
         std::function<bool(CommitVec_t const &)> transactionCommitRow;
+        // current row of subId, for WritableUpdateRowDelta
+        std::function<bool(uint32_t, valvec<byte> &)> readRow;
     };
 
 private:
     mutex_t m_mutex;
+    std::condition_variable m_cond;
+    valvec<byte> m_groupBuf;    // appended logs not yet written
+    valvec<byte> m_writeBuf;    // owned by leader
+    LogOutout_t m_packBuf;      // owned by leader
+    valvec<byte> m_zipBuf;      // owned by leader
+    uint64_t m_appendLsn;       // lsn is end offset of appended logs
+    uint64_t m_syncedLsn;
+    uint64_t m_brokenLsn;       // write failed up to this lsn
+    size_t m_groupRecords;
+    bool m_groupNeedSync;
+    bool m_hasLeader;
     uint32_t m_seed;
+    uint32_t m_salt;    // of current log file
     Param m_param;
-    FileStream m_fp;
+    TrbLogFile m_file;
+    bool m_logPending;          // m_file is opened by the first write
+    TrbLogHeader m_pendingHeader;
+    std::string m_logDir;
     uint32_t m_logSize; // these two fields didn't need sync ...
     size_t m_logCount;  // we don't care add check point later
-    std::atomic<uint64_t> m_totalLogSize;   //togal log size
+    std::atomic<uint64_t> m_totalLogSize;   //togal log size, including image
+    uint64_t m_imageSize;
 
 public:
-    TrbLogger() : m_seed(), m_logSize(), m_logCount(), m_totalLogSize{0}
+    TrbLogger() : m_appendLsn(), m_syncedLsn(), m_brokenLsn(), m_groupRecords()
+                , m_groupNeedSync(), m_hasLeader()
+                , m_seed(), m_salt(), m_logPending(), m_logSize(), m_logCount(), m_totalLogSize{0}
+                , m_imageSize()
     {
     }
     ~TrbLogger()
     {
-        if(m_fp.isOpen())
+        if(m_file.isOpen())
         {
-            m_fp.flush();
-            m_fp.close();
+            flush();
+            m_file.close();
         }
     }
 
@@ -189,6 +628,10 @@ public:
     {
         return m_totalLogSize;
     }
+    uint64_t logSizeSinceCheckpoint()
+    {
+        return m_totalLogSize - m_imageSize;
+    }
 
     void initCallback(Param p)
     {
@@ -202,238 +645,682 @@ public:
         snprintf(szBuf, sizeof(szBuf), "trb.%04ld.log", long(seed));
         return (path / szBuf).string();
     }
+    // image trb.NNNN.img replaces all logs before trb.NNNN.log
+    static std::string getImagePath(PathRef path, uint32_t seed)
+    {
+        char szBuf[64];
+        snprintf(szBuf, sizeof(szBuf), "trb.%04ld.img", long(seed));
+        return (path / szBuf).string();
+    }
+    static std::string getImageTmpPath(PathRef path)
+    {
+        return (path / "trb.img.tmp").string();
+    }
+    static std::string getRecyclePath(PathRef path)
+    {
+        return (path / "trb.recycle.log").string();
+    }
+    static bool parseFileSeed(std::string const &name, char const *suffix, uint32_t *seed)
+    {
+        unsigned long val = 0;
+        char ext[8] = {};
+        if(sscanf(name.c_str(), "trb.%lu.%4s", &val, ext) != 2 || strcmp(ext, suffix) != 0)
+        {
+            return false;
+        }
+        *seed = uint32_t(val);
+        return true;
+    }
+    // remove logs and images which are replaced by image of seed
+    static void removeReplacedFiles(PathRef path, uint32_t seed)
+    {
+        namespace fs = boost::filesystem;
+        std::vector<fs::path> files;
+        for(fs::directory_iterator iter(path), end; iter != end; ++iter)
+        {
+            std::string name = iter->path().filename().string();
+            uint32_t fileSeed;
+            if((parseFileSeed(name, "log", &fileSeed) || parseFileSeed(name, "img", &fileSeed))
+               && fileSeed < seed)
+            {
+                files.push_back(iter->path());
+            }
+        }
+        for(auto &f : files)
+        {
+            fs::remove(f);
+        }
+    }
     void flush()
     {
-        assert(m_fp.isOpen());
+        assert(m_file.isOpen() || m_logPending);
         lock_t l(m_mutex);
-        m_fp.flush();
+        m_cond.wait(l, [this]{ return !m_hasLeader; });
+        leadGroupCommit(l);
+        if(m_file.isOpen())
+        {
+            m_file.sync();
+        }
+        m_syncedLsn = m_appendLsn;
+    }
+
+    void initLog(PathRef path, uint64_t baseSeq = 0)
+    {
+        TrbLogHeader header = logHeader;
+        header.baseSeq = baseSeq;
+        // records left in a recycled file don't match the new salt
+        do
+        {
+            header.salt = std::random_device()();
+        }
+        while(header.salt == m_salt);
+        m_salt = header.salt;
+        if(g_logPreallocSize || g_logRecycle || g_logDirectIO)
+        {
+            header.flags |= TrbLogHeader::TolerateTail;
+        }
+        // records are encoded by m_salt before the file is opened
+        m_pendingHeader = header;
+        m_logDir = path.string();
+        m_logPending = true;
+        if(!g_logLazyOpen)
+        {
+            openPendingLog();
+        }
     }
 
-    void initLog(PathRef path)
+    // called by initLog or by the group commit leader
+    void openPendingLog()
     {
-        m_fp.open(getFilePath(path, m_seed).c_str(), "wb");
-        assert(m_fp.isOpen());
-        m_fp.disbuf();
-        m_fp.write(&logHeader, sizeof logHeader);
-        m_totalLogSize += sizeof logHeader;
+        assert(m_logPending);
+        assert(!m_file.isOpen());
+        const TrbLogHeader &header = m_pendingHeader;
+        std::string fileName = getFilePath(m_logDir, m_seed);
+        std::string recycled = getRecyclePath(m_logDir);
+        if(g_logRecycle && boost::filesystem::exists(recycled))
+        {
+            // the new header is synced before the file gets the log name
+            m_file.open(recycled, true, g_logDirectIO);
+            m_file.write(&header, sizeof header);
+            m_file.sync();
+            boost::filesystem::rename(recycled, fileName);
+        }
+        else
+        {
+            m_file.open(fileName, false, g_logDirectIO);
+            m_file.write(&header, sizeof header);
+        }
+        m_logPending = false;
+        m_totalLogSize += sizeof header;
+    }
+
+    // writers must be stopped by caller, readRow returns false for deleted
+    // row, the image is a log of live rows, logs before it are removed
+    void checkpoint(PathRef path, uint64_t baseSeq, size_t rows,
+                    std::function<bool(uint32_t, valvec<byte> &)> const &readRow)
+    {
+        flush();
+        {
+            lock_t l(m_mutex);
+            assert(!m_hasLeader);
+            assert(m_groupBuf.empty());
+            m_file.close(g_logRecycle);
+            ++m_seed;
+            m_totalLogSize = 0;
+            initLog(path, baseSeq);
+        }
+        std::string tmpFile = getImageTmpPath(path);
+        FileStream fp(tmpFile.c_str(), "wb");
+        fp.disbuf();
+        fp.write(&logHeader, sizeof logHeader);
+        uint64_t imageSize = sizeof logHeader;
+        LogOutout_t buffer;
+        LogOutout_t packBuf;
+        valvec<byte> zipBuf;
+        valvec<byte> row;
+        valvec<byte> batch;
+        uint64_t seq = 0;
+        auto write_batch = [&]
+        {
+            fstring out(batch.data(), batch.size());
+            if(g_logCompress)
+            {
+                size_t packed = packBatch(out, 0, packBuf, zipBuf);
+                if(packed)
+                {
+                    out = fstring(packBuf.buf(), packed);
+                }
+            }
+            fp.write(out.data(), out.size());
+            imageSize += out.size();
+            batch.erase_all();
+        };
+        for(size_t subId = 0; subId < rows; ++subId)
+        {
+            row.erase_all();
+            if(!readRow(uint32_t(subId), row))
+            {
+                continue;
+            }
+            size_t size = encodeLog(buffer, 0, seq++, LogAction::WritableUpdateRow,
+                                    uint32_t(subId), fstring(row));
+            batch.append(buffer.buf(), size);
+            if(batch.size() >= (1u << 20))
+            {
+                write_batch();
+            }
+        }
+        write_batch();
+        fp.flush();
+        fp.close();
+        boost::filesystem::rename(tmpFile, getImagePath(path, m_seed));
+        if(g_logRecycle)
+        {
+            // the log replaced by the image is the next log to reuse
+            std::string prev = getFilePath(path, m_seed - 1);
+            if(boost::filesystem::exists(prev))
+            {
+                boost::filesystem::rename(prev, getRecyclePath(path));
+            }
+        }
+        removeReplacedFiles(path, m_seed);
+        m_totalLogSize += imageSize;
+        m_imageSize = imageSize;
+    }
+    struct LogRecord
+    {
+        uint64_t seq;
+        byte const *beg;   // after seq
+        byte const *end;
+    };
+    // a chunk starts right after a checkpoint marker, it stops at the first
+    // record boundary after a marker which is not before limit
+    struct LogChunk
+    {
+        byte const *beg;
+        byte const *limit;
+        byte const *pos;   // where decoding stopped
+        valvec<LogRecord> records;
+        valvec<valvec<byte> > unpacked; // records of Batch point here
+        uint32_t salt;     // of the file
+        bool eof;          // stopped by a truncated record or file end
+        bool bad;          // crc or size error
+    };
+    static size_t replayChunkSize()
+    {
+        static size_t const size = std::max<long>(
+            getEnvLong("TerarkDB_TrbLogReplayChunkSize", 64L << 20), logCheckPointSize * 4);
+        return size;
+    }
+    static size_t replayThreadNum()
+    {
+        static size_t const num = std::max<long>(1, getEnvLong("TerarkDB_TrbLogReplayThreads",
+                                                               std::thread::hardware_concurrency()));
+        return num;
+    }
+    static bool isRecordHead(byte const *p, byte const *end, uint32_t salt)
+    {
+        if(end - p < 20)
+        {
+            return false;
+        }
+        uint32_t sizeCrc = unaligned_load<uint32_t>(p);
+        uint32_t size = unaligned_load<uint32_t>(p + 4);
+        return Crc32c_update(salt, p + 4, 8) == sizeCrc && size >= 20;
+    }
+    static byte const *findChunkBeg(byte const *nominal, byte const *end, uint32_t salt)
+    {
+        byte const *p = nominal;
+        while(true)
+        {
+            p = std::search(p, end, logCheckPoint, logCheckPoint + sizeof logCheckPoint);
+            if(p == end)
+            {
+                return end;
+            }
+            if(isRecordHead(p + sizeof logCheckPoint, end, salt))
+            {
+                return p + sizeof logCheckPoint;
+            }
+            ++p;
+        }
+    }
+    // decompress a Batch record(after action) and add its records
+    static bool unpackBatch(LogChunk &c, byte const *beg, byte const *end)
+    {
+#if defined(TERARK_DB_WITH_ZSTD)
+        byte const *pos = beg;
+        size_t rawSize = size_t(load_var_uint64(pos, &pos));
+        size_t zipSize = size_t(load_var_uint64(pos, &pos));
+        if(pos > end || size_t(end - pos) < zipSize)
+        {
+            return false;
+        }
+        c.unpacked.emplace_back();
+        valvec<byte> &raw = c.unpacked.back();
+        raw.resize_no_init(rawSize);
+        size_t res = ZSTD_decompress(raw.data(), rawSize, pos, zipSize);
+        if(ZSTD_isError(res) || res != rawSize)
+        {
+            return false;
+        }
+        pos = raw.data();
+        end = raw.data() + rawSize;
+        while(pos < end)
+        {
+            if(end - pos < 20)
+            {
+                return false;
+            }
+            uint32_t sizeCrc = unaligned_load<uint32_t>(pos);
+            uint32_t size = unaligned_load<uint32_t>(pos + 4);
+            uint32_t dataCrc = unaligned_load<uint32_t>(pos + 8);
+            if(Crc32c_update(c.salt, pos + 4, 8) != sizeCrc || size < 20 || size_t(end - pos) < size
+               || Crc32c_update(c.salt, pos + 12, size - 12) != dataCrc)
+            {
+                return false;
+            }
+            c.records.push_back({unaligned_load<uint64_t>(pos + 12), pos + 20, pos + size});
+            pos += size;
+        }
+        return true;
+#else
+        (void)c; (void)beg; (void)end;
+        fprintf(stderr, "ERROR: TrbSegment log has zstd Batch records, but zstd is not enabled(WITH_ZSTD=1)\n");
+        return false;
+#endif
+    }
+    static void decodeChunk(LogChunk &c, byte const *end)
+    {
+        byte const *pos = c.beg;
+        c.records.erase_all();
+        c.unpacked.erase_all();
+        c.eof = false;
+        c.bad = false;
+        bool afterMarker = false;
+        while(!(afterMarker && pos - sizeof logCheckPoint >= c.limit))
+        {
+            if(end - pos < 20)
+            {
+                c.eof = true;
+                break;
+            }
+            uint32_t sizeCrc = unaligned_load<uint32_t>(pos);
+            uint32_t size = unaligned_load<uint32_t>(pos + 4);
+            uint32_t dataCrc = unaligned_load<uint32_t>(pos + 8);
+            if(Crc32c_update(c.salt, pos + 4, 8) != sizeCrc || size < 20)
+            {
+                c.bad = true;
+                break;
+            }
+            if(size_t(end - pos) < size)
+            {
+                c.eof = true;
+                break;
+            }
+            if(Crc32c_update(c.salt, pos + 12, size - 12) != dataCrc)
+            {
+                c.bad = true;
+                break;
+            }
+            if(size > 20 && pos[20] == byte(LogAction::Batch))
+            {
+                if(!unpackBatch(c, pos + 21, pos + size))
+                {
+                    c.bad = true;
+                    break;
+                }
+            }
+            else
+            {
+                c.records.push_back({unaligned_load<uint64_t>(pos + 12), pos + 20, pos + size});
+            }
+            pos += size;
+            afterMarker = size >= 20 + sizeof logCheckPoint &&
+                std::memcmp(pos - sizeof logCheckPoint, logCheckPoint, sizeof logCheckPoint) == 0;
+        }
+        c.pos = pos;
     }
+
     void loadLog(PathRef path, Schema *schema)
     {
+        namespace fs = boost::filesystem;
+        fs::remove(getImageTmpPath(path));
+        bool hasImage = false;
+        uint32_t imageSeed = 0;
+        for(fs::directory_iterator iter(path), end; iter != end; ++iter)
+        {
+            uint32_t fileSeed;
+            if(parseFileSeed(iter->path().filename().string(), "img", &fileSeed)
+               && (!hasImage || fileSeed > imageSeed))
+            {
+                hasImage = true;
+                imageSeed = fileSeed;
+            }
+        }
+        if(hasImage)
+        {
+            // files left by a checkpoint interrupted before removing them
+            removeReplacedFiles(path, imageSeed);
+            replayFile(getImagePath(path, imageSeed), schema);
+            m_imageSize = m_totalLogSize;
+            m_seed = imageSeed;
+        }
         while(true)
         {
             std::string fileName = getFilePath(path, m_seed);
-            if(!boost::filesystem::exists(fileName))
+            if(!fs::exists(fileName))
             {
                 break;
             }
             ++m_seed;
-            if(boost::filesystem::file_size(fileName) == 0)
+            if(fs::file_size(fileName) == 0)
             {
                 continue;
             }
-            struct BadTrbLogException : public std::logic_error
+            replayFile(fileName, schema);
+        }
+        initLog(path);
+    }
+
+    void replayFile(std::string const &fileName, Schema *schema)
+    {
+        struct BadTrbLogException : public std::logic_error
+        {
+            BadTrbLogException(std::string f) : std::logic_error("TrbSegment bad log : " + f)
+            {
+            }
+        } badLog(fileName);
+
+        MmapWholeFile file(fileName);
+        assert(file.base != nullptr);
+        m_totalLogSize += file.size;
+        LittleEndianDataInput<MemIO> in; in.set(file.base, file.size);
+        TrbLogHeader header;
+        in.ensureRead(&header, sizeof header);
+        if(false
+           || std::memcmp(header.name, logHeader.name, sizeof header.name) != 0
+           || header.magic != logHeader.magic
+           || header.ver < 1 || header.ver > logHeader.ver
+           || (header.ver < 2 && header.baseSeq != 0)
+           || (header.ver < 4 && (header.salt != 0 || header.flags != 0))
+           || (header.flags & ~uint32_t(TrbLogHeader::TolerateTail)) != 0
+           || std::find_if(header.empty,
+                           header.empty + sizeof header.empty,
+                           [](byte b){ return b != 0; }
+           ) != header.empty + sizeof header.empty
+           )
+        {
+            //TODO compatible old version
+            throw badLog;
+        }
+        uint8_t action = 0;
+        uint32_t subId = 0;
+        llong recId = 0;
+        llong version = 0;
+        valvec<byte> data;
+        valvec<byte> base;
+        var_size_t prefixLen, suffixLen;
+        CommitVec_t commitVec;
+
+        valvec<byte> buf;
+        ColumnVec cols;
+        struct heap_item
+        {
+            uint64_t seq;
+            LittleEndianDataInput<MemIO> in;
+            struct comp
             {
-                BadTrbLogException(std::string f) : std::logic_error("TrbSegment bad log : " + f)
+                bool operator()(heap_item const &left, heap_item const &right)
                 {
+                    return left.seq > right.seq;
                 }
-            } badLog(fileName);
-
-            MmapWholeFile file(fileName);
-            assert(file.base != nullptr);
-            m_totalLogSize += file.size;
-            LittleEndianDataInput<MemIO> in; in.set(file.base, file.size);
-            TrbLogHeader header;
-            in.ensureRead(&header, sizeof header);
-            if(false
-               || std::memcmp(header.name, logHeader.name, sizeof header.name) != 0
-               || header.magic != logHeader.magic
-               || header.ver != logHeader.ver
-               || std::find_if(header.empty,
-                               header.empty + sizeof header.empty,
-                               [](byte b){ return b != 0; }
-               ) != header.empty + sizeof header.empty
-               )
-            {
-                //TODO compatible old version
-                throw badLog;
-            }
-            uint8_t action = 0;
-            uint32_t sizeCrc = 0;
-            uint32_t size = 0;
-            uint32_t dataCrc = 0;
-            uint32_t subId = 0;
-            llong recId = 0;
-            llong version = 0;
-            valvec<byte> data;
-            CommitVec_t commitVec;
-            uint64_t seq = 0;
-
-            valvec<byte> buf;
-            ColumnVec cols;
-            struct heap_item
-            {
-                uint64_t seq;
-                LittleEndianDataInput<MemIO> in;
-                struct comp
-                {
-                    bool operator()(heap_item const &left, heap_item const &right)
-                    {
-                        return left.seq > right.seq;
-                    }
-                };
             };
-            valvec<heap_item> seqHeap;
-            uint64_t currentSeq = 0;
-            byte const *pos = in.current();
+        };
+        valvec<heap_item> seqHeap;
+        uint64_t currentSeq = header.baseSeq;
+        uint32_t const salt = header.salt;
+        bool const tolerateTail = (header.flags & TrbLogHeader::TolerateTail) != 0;
 
-            auto proc_seq = [&]
+        auto proc_seq = [&]
+        {
+            while(!seqHeap.empty() && seqHeap.front().seq == currentSeq)
             {
-                while(!seqHeap.empty() && seqHeap.front().seq == currentSeq)
+                std::pop_heap(seqHeap.begin(), seqHeap.end(), heap_item::comp());
+                auto seq_in = seqHeap.pop_val().in;
+                ++currentSeq;
+                seq_in >> action;
+                try
                 {
-                    std::pop_heap(seqHeap.begin(), seqHeap.end(), heap_item::comp());
-                    auto seq_in = seqHeap.pop_val().in;
-                    ++currentSeq;
-                    seq_in >> action;
-                    try
+                    switch(LogAction(action))
                     {
-                        switch(LogAction(action))
+                    case LogAction::WritableUpdateRow:
+                        seq_in >> subId >> data;
+                        schema->parseRow(data, &cols);
+                        if(!m_param.writableUpdateRow(subId, cols, buf))
                         {
-                        case LogAction::WritableUpdateRow:
-                            seq_in >> subId >> data;
-                            schema->parseRow(data, &cols);
-                            if(!m_param.writableUpdateRow(subId, cols, buf))
-                            {
-                                throw badLog;
-                            }
-                            break;
-                        case LogAction::WritableRemoveRow:
-                            seq_in >> subId >> version;
-                            if(!m_param.writableRemoveRow(subId, version))
-                            {
-                                throw badLog;
-                            }
-                            break;
-                        case LogAction::TableUpdateRow:
-                            seq_in >> subId >> recId >> version >> data;
-                            schema->parseRow(data, &cols);
-                            if(!m_param.tableUpdateRow(subId, recId, version, cols, buf))
-                            {
-                                throw badLog;
-                            }
-                            break;
-                        case LogAction::TableRemoveRow:
-                            seq_in >> recId >> version;
-                            if(!m_param.tableRemoveRow(recId, version))
-                            {
-                                throw badLog;
-                            }
-                            break;
-                        case LogAction::TransactionUpdateRow:
-                            seq_in >> subId >> version >> data;
-                            schema->parseRow(data, &cols);
-                            if(!m_param.transactionUpdateRow(subId, version, cols, buf))
-                            {
-                                throw badLog;
-                            }
-                            break;
-                        case LogAction::TransactionCommitRow:
-                            seq_in >> commitVec;
-                            if(!m_param.transactionCommitRow(commitVec))
-                            {
-                                throw badLog;
-                            }
-                            break;
-                        default:
-                            // verify by crc32 , but still error action ?
                             throw badLog;
                         }
-                    }
-                    catch(EndOfFileException const &)
-                    {
-                        // verify by crc32 , but still overflow ?
+                        break;
+                    case LogAction::WritableUpdateRowDelta:
+                        seq_in >> subId >> prefixLen >> suffixLen >> data;
+                        base.erase_all();
+                        if(!m_param.readRow || !m_param.readRow(subId, base)
+                           || prefixLen.t + suffixLen.t > base.size())
+                        {
+                            throw badLog;
+                        }
+                        data.insert(0, base.data(), prefixLen.t);
+                        data.append(base.end() - suffixLen.t, suffixLen.t);
+                        schema->parseRow(data, &cols);
+                        if(!m_param.writableUpdateRow(subId, cols, buf))
+                        {
+                            throw badLog;
+                        }
+                        break;
+                    case LogAction::WritableRemoveRow:
+                        seq_in >> subId >> version;
+                        if(!m_param.writableRemoveRow(subId, version))
+                        {
+                            throw badLog;
+                        }
+                        break;
+                    case LogAction::TableUpdateRow:
+                        seq_in >> subId >> recId >> version >> data;
+                        schema->parseRow(data, &cols);
+                        if(!m_param.tableUpdateRow(subId, recId, version, cols, buf))
+                        {
+                            throw badLog;
+                        }
+                        break;
+                    case LogAction::TableRemoveRow:
+                        seq_in >> recId >> version;
+                        if(!m_param.tableRemoveRow(recId, version))
+                        {
+                            throw badLog;
+                        }
+                        break;
+                    case LogAction::TransactionUpdateRow:
+                        seq_in >> subId >> version >> data;
+                        schema->parseRow(data, &cols);
+                        if(!m_param.transactionUpdateRow(subId, version, cols, buf))
+                        {
+                            throw badLog;
+                        }
+                        break;
+                    case LogAction::TransactionCommitRow:
+                        seq_in >> commitVec;
+                        if(!m_param.transactionCommitRow(commitVec))
+                        {
+                            throw badLog;
+                        }
+                        break;
+                    default:
+                        // verify by crc32 , but still error action ?
                         throw badLog;
                     }
                 }
-            };
+                catch(EndOfFileException const &)
+                {
+                    // verify by crc32 , but still overflow ?
+                    throw badLog;
+                }
+            }
+        };
 
-            try
+        // records are decoded and crc verified by a window of chunks in
+        // parallel, while the previous window is applied in seq order
+        byte const *fileBeg = in.current();
+        byte const *fileEnd = in.end();
+        size_t const chunkSize = replayChunkSize();
+        size_t const chunkNum = (fileEnd - fileBeg + chunkSize - 1) / chunkSize;
+        size_t const windowSize = std::min(replayThreadNum(), chunkNum);
+        valvec<LogChunk> chunks[2];
+        // unpacked Batch records which may be pending in seqHeap
+        valvec<valvec<byte> > pinned;
+        std::vector<std::thread> threads;
+        auto start_window = [&](valvec<LogChunk> &window, size_t first)
+        {
+            size_t num = std::min(windowSize, chunkNum - first);
+            window.resize(num);
+            threads.clear();
+            for(size_t i = 0; i < num; ++i)
             {
-                while(true)
+                size_t k = first + i;
+                LogChunk &c = window[i];
+                c.limit = k + 1 < chunkNum ? fileBeg + chunkSize * (k + 1) : fileEnd;
+                c.beg = nullptr;
+                c.salt = salt;
+                if(num == 1)
                 {
-                    in >> sizeCrc >> size >> dataCrc;
-                    if(Crc32c_update(0, in.current() - 8, 8) != sizeCrc)
-                    {
-                        throw badLog;
-                    }
-                    if(size < 12)
-                    {
-                        // verify by crc32 , but still error size ?
-                        throw badLog;
-                    }
-                    if(in.end() - in.current() < size - 12)
-                    {
-                        throw EndOfFileException();
-                    }
-                    if(Crc32c_update(0, in.current(), size - 12) != dataCrc)
-                    {
-                        throw badLog;
-                    }
-                    in >> seq;
-                    seqHeap.emplace_back(heap_item{seq, {in.current(), in.current() + size - 8}});
-                    std::push_heap(seqHeap.begin(), seqHeap.end(), heap_item::comp());
-                    in.skip(size - 20);
-                    if(in.current() - pos != size)
-                    {
-                        if(false
-                           || in.current() - pos + sizeof logCheckPoint != size
-                           || std::memcmp(logCheckPoint, in.current(), sizeof logCheckPoint) != 0
-                           )
-                        {
-                            throw badLog;
-                        }
-                        in.skip(sizeof logCheckPoint);
-                    }
-                    pos = in.current();
-                    proc_seq();
+                    c.beg = k ? findChunkBeg(fileBeg + chunkSize * k, fileEnd, salt) : fileBeg;
+                    decodeChunk(c, fileEnd);
+                    continue;
                 }
+                threads.emplace_back([&c, k, fileBeg, fileEnd, chunkSize, salt]
+                {
+                    c.beg = k ? findChunkBeg(fileBeg + chunkSize * k, fileEnd, salt) : fileBeg;
+                    decodeChunk(c, fileEnd);
+                });
             }
-            catch(BadTrbLogException const &)
+        };
+        auto join_window = [&]
+        {
+            for(auto &t : threads)
             {
-                throw;
+                t.join();
+            }
+            threads.clear();
+        };
+        BOOST_SCOPE_EXIT(&join_window)
+        {
+            join_window();
+        } BOOST_SCOPE_EXIT_END;
+        byte const *pos = fileBeg;
+        bool eof = chunkNum == 0;
+        size_t reportPercent = 0;
+        if(chunkNum)
+        {
+            start_window(chunks[0], 0);
+            join_window();
+        }
+        for(size_t first = 0; first < chunkNum && !eof; first += windowSize)
+        {
+            valvec<LogChunk> &window = chunks[first / windowSize % 2];
+            if(first + windowSize < chunkNum)
+            {
+                start_window(chunks[(first / windowSize + 1) % 2], first + windowSize);
             }
-            catch(EndOfFileException const &)
+            for(size_t i = 0; i < window.size() && !eof; ++i)
             {
-                try
+                LogChunk &c = window[i];
+                if(c.beg != pos || c.bad || (c.eof && c.pos != fileEnd))
                 {
-                    proc_seq();
+                    // false marker in data or damaged log, decode sequentially
+                    c.beg = pos;
+                    decodeChunk(c, fileEnd);
+                    if(c.bad)
+                    {
+                        if(!tolerateTail)
+                        {
+                            throw badLog;
+                        }
+                        // stale records of a recycled file or zero padding
+                        c.eof = true;
+                    }
                 }
-                catch(EndOfFileException const &)
+                for(auto &u : c.unpacked)
                 {
-                    throw badLog;
+                    pinned.emplace_back();
+                    pinned.back().swap(u);
                 }
-                if(!seqHeap.empty())
+                c.unpacked.erase_all();
+                for(auto &r : c.records)
                 {
-                    fprintf(stderr,
-                            "WARN: TrgSegment log incomplete , caused by unsafe shutdown . %s : %zd operation(s)\n",
-                            fileName.c_str(),
-                            seqHeap.size()
-                    );
+                    seqHeap.emplace_back(heap_item{r.seq, {(void*)r.beg, (void*)r.end}});
+                    std::push_heap(seqHeap.begin(), seqHeap.end(), heap_item::comp());
+                    proc_seq();
                 }
-                if(pos != in.end())
+                if(seqHeap.empty())
                 {
-                    fprintf(stderr,
-                            "INFO: TrgSegment log incomplete , caused by unsafe shutdown . %s : %zd byte(s)\n",
-                            fileName.c_str(),
-                            in.end() - pos
-                    );
+                    pinned.clear();
                 }
+                pos = c.pos;
+                eof = c.eof;
+            }
+            join_window();
+            size_t percent = size_t((pos - fileBeg) * 100.0 / (fileEnd - fileBeg));
+            if(chunkNum > 1 && percent / 10 > reportPercent / 10)
+            {
+                reportPercent = percent;
+                fprintf(stderr, "INFO: TrbSegment replay %s : %zd%%, %zd records pending\n",
+                        fileName.c_str(), percent, seqHeap.size());
             }
         }
-        initLog(path);
+        if(!seqHeap.empty())
+        {
+            fprintf(stderr,
+                    "WARN: TrgSegment log incomplete , caused by unsafe shutdown . %s : %zd operation(s)\n",
+                    fileName.c_str(),
+                    seqHeap.size()
+            );
+        }
+        if(tolerateTail)
+        {
+            m_totalLogSize -= fileEnd - pos;
+        }
+        else if(pos != fileEnd)
+        {
+            fprintf(stderr,
+                    "INFO: TrgSegment log incomplete , caused by unsafe shutdown . %s : %zd byte(s)\n",
+                    fileName.c_str(),
+                    fileEnd - pos
+            );
+        }
     }
-    void writableUpdateRow(DbContext *ctx, uint64_t seq, uint32_t subId, fstring data)
+    // base is the previous version of the row, empty if it is unknown
+    void writableUpdateRow(DbContext *ctx, uint64_t seq, uint32_t subId, fstring data,
+                           fstring base = fstring())
     {
-        writeLog(ctx, seq, LogAction::WritableUpdateRow, subId, data);
+        size_t n = std::min(data.size(), base.size());
+        size_t prefix = 0;
+        while(prefix < n && data[prefix] == base[prefix])
+        {
+            ++prefix;
+        }
+        size_t suffix = 0;
+        while(suffix < n - prefix && data.end()[-1 - ptrdiff_t(suffix)] == base.end()[-1 - ptrdiff_t(suffix)])
+        {
+            ++suffix;
+        }
+        if(prefix + suffix < logDeltaMinSave)
+        {
+            writeLog(ctx, seq, LogAction::WritableUpdateRow, subId, data);
+            return;
+        }
+        fstring delta(data.data() + prefix, data.size() - prefix - suffix);
+        writeLog(ctx, seq, LogAction::WritableUpdateRowDelta, subId,
+                 var_size_t(prefix), var_size_t(suffix), delta);
     }
     void writableRemoveRow(DbContext *ctx, uint64_t seq, uint32_t id, llong version)
     {
@@ -468,14 +1355,44 @@ TrbRWRowMutex::map_item::map_item(uint32_t _id)
 {
 }
 
+// 0 is a lock per row in a hash map
+static const long g_rowLockStripes =
+    getEnvLong("TerarkDB_TrbRowLockStripes", 0);
+
+static const bool g_rowLockOptimisticRead =
+    getEnvBool("TerarkDB_TrbRowLockOptimisticRead", false);
+
 TrbRWRowMutex::TrbRWRowMutex(spin_mutex_t &mutex)
-    : g_mutex(mutex)
+    : TrbRWRowMutex(mutex, size_t(std::max<long>(g_rowLockStripes, 0)), g_rowLockOptimisticRead)
 {
+}
 
+TrbRWRowMutex::TrbRWRowMutex(spin_mutex_t &mutex, size_t stripeNum, bool optimisticRead)
+    : g_mutex(mutex)
+    , stripes(NULL)
+    , stripe_mask(0)
+    , optimistic_read(false)
+{
+    if(stripeNum)
+    {
+        size_t n = 1;
+        while(n < stripeNum && n < (size_t(1) << 20))
+        {
+            n <<= 1;
+        }
+        stripes = new stripe_item[n];
+        for(size_t i = 0; i < n; ++i)
+        {
+            stripes[i].version.store(0, std::memory_order_relaxed);
+        }
+        stripe_mask = n - 1;
+        optimistic_read = optimisticRead;
+    }
 }
 
 TrbRWRowMutex::~TrbRWRowMutex()
 {
+    delete[] stripes;
     for(auto pair : row_mutex)
     {
         delete pair.second;
@@ -488,24 +1405,37 @@ TrbRWRowMutex::~TrbRWRowMutex()
 
 TrbRWRowMutex::scoped_lock::scoped_lock(TrbRWRowMutex &mutex, llong index, bool write)
     : parent(&mutex)
+    , item(NULL)
+    , stripe(NULL)
+    , is_writer(write)
 {
     assert(index >= 0);
     assert(index <= 0x3FFFFFFFU);
+    if(parent->stripes)
+    {
+        stripe = &parent->getStripe(index);
+        lock.acquire(stripe->lock, write);
+        if(write)
+        {
+            beginWrite();
+        }
+        return;
+    }
     uint32_t u32_index = uint32_t(index);
     {
         spin_mutex_t::scoped_lock l(parent->g_mutex);
-        auto ib = parent->row_mutex.emplace(u32_index, nullptr);
+        auto ib = parent->row_mutex.insert_i(u32_index, nullptr);
         if(ib.second)
         {
             if(terark_unlikely(parent->mutex_pool.empty()))
             {
-                ib.first->second = item = new map_item(u32_index);
+                parent->row_mutex.val(ib.first) = item = new map_item(u32_index);
                 assert(item->count == 1);
                 assert(item->id == u32_index);
             }
             else
             {
-                ib.first->second = item = parent->mutex_pool.pop_val();
+                parent->row_mutex.val(ib.first) = item = parent->mutex_pool.pop_val();
                 assert(item->count == 0);
                 item->id = u32_index;
                 ++item->count;
@@ -513,7 +1443,7 @@ TrbRWRowMutex::scoped_lock::scoped_lock(TrbRWRowMutex &mutex, llong index, bool
         }
         else
         {
-            item = ib.first->second;
+            item = parent->row_mutex.val(ib.first);
             assert(item->id == u32_index);
             ++item->count;
         }
@@ -523,6 +1453,15 @@ TrbRWRowMutex::scoped_lock::scoped_lock(TrbRWRowMutex &mutex, llong index, bool
 
 TrbRWRowMutex::scoped_lock::~scoped_lock()
 {
+    if(stripe)
+    {
+        if(is_writer)
+        {
+            endWrite();
+        }
+        lock.release();
+        return;
+    }
     lock.release();
     spin_mutex_t::scoped_lock l(parent->g_mutex);
     if(--item->count == 0)
@@ -532,13 +1471,41 @@ TrbRWRowMutex::scoped_lock::~scoped_lock()
     }
 }
 
+void TrbRWRowMutex::scoped_lock::beginWrite()
+{
+    assert(stripe);
+    uint32_t v = stripe->version.load(std::memory_order_relaxed);
+    assert((v & 1) == 0);
+    stripe->version.store(v + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void TrbRWRowMutex::scoped_lock::endWrite()
+{
+    assert(stripe);
+    uint32_t v = stripe->version.load(std::memory_order_relaxed);
+    assert((v & 1) == 1);
+    stripe->version.store(v + 1, std::memory_order_release);
+}
+
 bool TrbRWRowMutex::scoped_lock::upgrade()
 {
-    return lock.upgrade_to_writer();
+    bool ret = lock.upgrade_to_writer();
+    if(stripe && !is_writer)
+    {
+        beginWrite();
+    }
+    is_writer = true;
+    return ret;
 }
 
 bool TrbRWRowMutex::scoped_lock::downgrade()
 {
+    if(stripe && is_writer)
+    {
+        endWrite();
+    }
+    is_writer = false;
     return lock.downgrade_to_reader();
 }
 
@@ -552,6 +1519,7 @@ class RowLockTransaction : public DbTransaction
     DbContext          *m_ctx;
     uint64_t            m_seq;
     size_t              m_seqIndex;
+    boost::optional<tbb::queuing_rw_mutex::scoped_lock> m_gateLock;
     boost::optional<TrbRWRowMutex::scoped_lock> m_lock;
 
 public:
@@ -617,6 +1585,15 @@ public:
         }
         auto cols = m_ctx->cols.get();
         auto buf = m_ctx->bufs.get();
+        m_oldRow.erase_all();
+        if(g_logDelta && !m_seg->locked_testIsDel(size_t(m_recId)))
+        {
+            // under the write lock of the row, it is the logged version
+            if(!m_seg->readRowOfStores(uint32_t(m_recId), m_oldRow, m_cols1, m_cols2, *buf))
+            {
+                m_oldRow.erase_all();
+            }
+        }
         m_sconf.m_rowSchema->parseRow(row, cols.get());
         size_t const colgroups_size = m_seg->m_colgroups.size();
         for(size_t i = m_seg->m_indices.size(); i < colgroups_size; ++i)
@@ -626,7 +1603,7 @@ public:
             schema.selectParent(*cols, buf.get());
             store->getUpdatableStore()->update(m_recId, *buf, m_ctx);
         }
-        m_seg->m_logger->writableUpdateRow(m_ctx, m_seq, uint32_t(m_recId), row);
+        m_seg->m_logger->writableUpdateRow(m_ctx, m_seq, uint32_t(m_recId), row, m_oldRow);
     }
     void storeGetRow(valvec<byte>* row) override
     {
@@ -645,16 +1622,21 @@ public:
     void do_startTransaction() override
     {
         m_seq = std::numeric_limits<uint64_t>::max();
+        m_gateLock.emplace(m_seg->m_logGateMutex, false);
         m_lock.emplace(m_seg->m_rowMutex, m_recId, true);
     }
     bool do_commit() override
     {
         m_lock.reset();
+        m_gateLock.reset();
+        m_seg->maybeCheckpointLog();
+        m_seg->accountMemory();
         return true;
     }
     void do_rollback() override
     {
         m_lock.reset();
+        m_gateLock.reset();
     }
     const std::string& strError() const override
     {
@@ -662,6 +1644,7 @@ public:
     }
 
     valvec<byte> m_wrtBuf;
+    valvec<byte> m_oldRow;
     ColumnVec    m_cols1;
     ColumnVec    m_cols2;
     std::string  m_strError;
@@ -678,6 +1661,7 @@ DbTransaction *TrbColgroupSegment::createTransaction(DbContext* ctx)
 
 TrbColgroupSegment::TrbColgroupSegment()
     : m_rowMutex(m_segMutex)
+    , m_checkpointing(false)
 {
     m_hasLockFreePointSearch = true;
     m_logger = new TrbLogger();
@@ -710,9 +1694,30 @@ TrbColgroupSegment::TrbColgroupSegment()
         return true;
         //TODO add fail check !!!
     };
+    param.readRow = [this](uint32_t subId, valvec<byte> &row)
+    {
+        if(subId >= m_isDel.size() || m_isDel[subId])
+        {
+            return false;
+        }
+        ColumnVec cols1, cols2;
+        valvec<byte> buf;
+        return readRowOfStores(subId, row, cols1, cols2, buf);
+    };
     m_logger->initCallback(param);
 }
 
+void TrbColgroupSegment::getLogGroupCommitStat(TrbLogGroupCommitStat* stat)
+{
+    stat->groupNum = g_logGroupNum;
+    stat->syncGroupNum = g_logSyncGroupNum;
+    stat->recordNum = g_logGroupRecordNum;
+    for(size_t i = 0; i < TrbLogGroupCommitStat::HistSize; ++i)
+    {
+        stat->sizeHist[i] = g_logGroupSizeHist[i];
+    }
+}
+
 TrbColgroupSegment::~TrbColgroupSegment()
 {
     delete m_logger;
@@ -745,6 +1750,7 @@ void TrbColgroupSegment::load(PathRef path)
         }
     }
     m_delcnt = m_isDel.popcnt();
+    accountMemory();
 }
 
 void TrbColgroupSegment::save(PathRef path) const
@@ -752,6 +1758,120 @@ void TrbColgroupSegment::save(PathRef path) const
     m_logger->flush();
 }
 
+void TrbColgroupSegment::checkpointLog()
+{
+    // wait running transactions, every allocated seq is in log now
+    tbb::queuing_rw_mutex::scoped_lock gate(m_logGateMutex, true);
+    if(m_isFreezed)
+    {
+        return;
+    }
+    size_t seqIndex = m_schema->m_uniqIndices.empty() ? 0 : m_schema->m_uniqIndices.back();
+    assert(dynamic_cast<TrbWritableIndex *>(m_indices[seqIndex]->getWritableIndex()) != nullptr);
+    TrbWritableIndex *idx = static_cast<TrbWritableIndex *>(m_indices[seqIndex]->getWritableIndex());
+    uint64_t baseSeq = idx->allocSeqId() + 1;
+    size_t rows;
+    {
+        SpinRwLock l(m_segMutex, false);
+        rows = m_isDel.size();
+    }
+    ColumnVec cols1, cols2;
+    valvec<byte> buf;
+    size_t liveRows = 0;
+    m_logger->checkpoint(m_segDir, baseSeq, rows, [&](uint32_t subId, valvec<byte> &row)
+    {
+        if(locked_testIsDel(subId) || !readRowOfStores(subId, row, cols1, cols2, buf))
+        {
+            return false;
+        }
+        ++liveRows;
+        return true;
+    });
+    fprintf(stderr, "INFO: TrbSegment %s checkpoint : %zd rows, image size = %llu\n"
+            , m_segDir.string().c_str(), liveRows
+            , (unsigned long long)m_logger->logSize()
+    );
+}
+
+bool TrbColgroupSegment::readRowOfStores(uint32_t subId, valvec<byte> &row,
+                                         ColumnVec &cols1, ColumnVec &cols2,
+                                         valvec<byte> &buf) const
+{
+    buf.risk_set_size(0);
+    cols1.erase_all();
+    try
+    {
+        const size_t colgroupNum = m_colgroups.size();
+        for(size_t i = 0; i < colgroupNum; ++i)
+        {
+            const Schema &iSchema = m_schema->getColgroupSchema(i);
+            if(iSchema.m_keepCols.has_any1())
+            {
+                size_t oldsize = buf.size();
+                m_colgroups[i]->getValueAppend(subId, &buf, nullptr);
+                iSchema.parseRowAppend(buf, oldsize, &cols1);
+            }
+            else
+            {
+                cols1.grow(iSchema.columnNum());
+            }
+        }
+    }
+    catch(TrbReadDeletedRecordException const &)
+    {
+        return false;
+    }
+    combineColgroupColumns(cols1, &cols2, &row);
+    return true;
+}
+
+void TrbColgroupSegment::maybeCheckpointLog()
+{
+    if(g_logCheckpointSize == 0 || m_isFreezed
+       || m_logger->logSizeSinceCheckpoint() < g_logCheckpointSize)
+    {
+        return;
+    }
+    bool expected = false;
+    if(!m_checkpointing.compare_exchange_strong(expected, true))
+    {
+        return;
+    }
+    try
+    {
+        checkpointLog();
+    }
+    catch(std::exception const &ex)
+    {
+        // logs are still complete without the image
+        fprintf(stderr, "ERROR: TrbSegment %s checkpoint failed : %s\n"
+                , m_segDir.string().c_str(), ex.what()
+        );
+    }
+    m_checkpointing = false;
+}
+
+void TrbColgroupSegment::accountMemory()
+{
+    llong bytes = 0;
+    for(auto &colgroup : m_colgroups)
+    {
+        bytes += colgroup->dataStorageSize();
+    }
+    m_memBudget.update(bytes);
+}
+
+bool TrbColgroupSegment::needFreezeByMemBudget() const
+{
+    return m_memBudget.shouldFreeze();
+}
+
+void TrbColgroupSegment::markFrozen()
+{
+    ColgroupWritableSegment::markFrozen();
+    m_memBudget.setFrozen();
+}
+
 void TrbColgroupSegment::initEmptySegment()
 {
     size_t const indices_size = m_schema->getIndexNum();
@@ -785,7 +1905,7 @@ ReadableIndex *TrbColgroupSegment::createIndex(const Schema &schema, PathRef) co
 {
     return TrbWritableIndex::createIndex(schema);
 }
-ReadableStore *TrbColgroupSegment::createStore(const Schema &schema, PathRef) const
+ReadableStore *TrbColgroupSegment::createStore(const Schema &schema, PathRef segDir) const
 {
     if(schema.getFixedRowLen() > 0)
     {
@@ -793,8 +1913,40 @@ ReadableStore *TrbColgroupSegment::createStore(const Schema &schema, PathRef) co
     }
     else
     {
-        return new TrbWritableStore(schema);
+        return new TrbWritableStore(schema, segDir);
+    }
+}
+
+// read a row without row lock, read() must reset its output on retry,
+// false if the row keeps being written, the caller should take the lock
+template<class Read>
+static bool optimisticReadRow(TrbRWRowMutex const &mutex, llong id, Read read)
+{
+    for(size_t retry = 0; retry < TrbRWRowMutex::OptimisticRetry; ++retry)
+    {
+        uint32_t version;
+        if(!mutex.readBegin(id, version))
+        {
+            continue;
+        }
+        try
+        {
+            read();
+        }
+        catch(TrbReadDeletedRecordException const &)
+        {
+            if(mutex.readValidate(id, version))
+            {
+                throw;
+            }
+            continue;
+        }
+        if(mutex.readValidate(id, version))
+        {
+            return true;
+        }
     }
+    return false;
 }
 
 void TrbColgroupSegment::getValueAppend(llong id, valvec<byte>* val, DbContext *ctx) const
@@ -807,6 +1959,16 @@ void TrbColgroupSegment::getValueAppend(llong id, valvec<byte>* val, DbContext *
         }
         else
         {
+            size_t oldsize = val->size();
+            if(m_rowMutex.optimisticRead() && optimisticReadRow(m_rowMutex, id, [&]
+            {
+                val->risk_set_size(oldsize);
+                ColgroupWritableSegment::getValueAppend(id, val, ctx);
+            }))
+            {
+                return;
+            }
+            val->risk_set_size(oldsize);
             TrbRWRowMutex::scoped_lock l(m_rowMutex, id, false);
             ColgroupWritableSegment::getValueAppend(id, val, ctx);
         }
@@ -817,6 +1979,28 @@ void TrbColgroupSegment::getValueAppend(llong id, valvec<byte>* val, DbContext *
     }
 }
 
+void TrbColgroupSegment::getValuesAppendBatch(llong const *ids,
+                                              size_t num,
+                                              valvec<byte> *vals,
+                                              DbContext *ctx
+) const
+{
+    if(!m_isFreezed)
+    {
+        // row lock for each id
+        ReadableSegment::getValuesAppendBatch(ids, num, vals, ctx);
+        return;
+    }
+    try
+    {
+        ColgroupWritableSegment::getValuesAppendBatch(ids, num, vals, ctx);
+    }
+    catch(TrbReadDeletedRecordException const &ex)
+    {
+        throw ReadDeletedRecordException(m_segDir.string(), -1, ex.id);
+    }
+}
+
 void TrbColgroupSegment::selectColumns(llong recId,
                                        size_t const *colsId,
                                        size_t colsNum,
@@ -832,6 +2016,13 @@ void TrbColgroupSegment::selectColumns(llong recId,
         }
         else
         {
+            if(m_rowMutex.optimisticRead() && optimisticReadRow(m_rowMutex, recId, [&]
+            {
+                ColgroupSegment::selectColumnsByPhysicId(recId, colsId, colsNum, colsData, ctx);
+            }))
+            {
+                return;
+            }
             TrbRWRowMutex::scoped_lock l(m_rowMutex, recId, false);
             ColgroupSegment::selectColumnsByPhysicId(recId, colsId, colsNum, colsData, ctx);
         }
@@ -873,6 +2064,13 @@ void TrbColgroupSegment::selectColgroups(llong id,
         }
         else
         {
+            if(m_rowMutex.optimisticRead() && optimisticReadRow(m_rowMutex, id, [&]
+            {
+                ColgroupSegment::selectColgroupsByPhysicId(id, cgIdvec, cgIdvecSize, cgDataVec, ctx);
+            }))
+            {
+                return;
+            }
             TrbRWRowMutex::scoped_lock l(m_rowMutex, id, false);
             ColgroupSegment::selectColgroupsByPhysicId(id, cgIdvec, cgIdvecSize, cgDataVec, ctx);
         }
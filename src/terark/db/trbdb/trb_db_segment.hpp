@@ -5,6 +5,7 @@
 #include <terark/io/StreamBuffer.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/db/db_segment.hpp>
+#include <terark/db/mem_budget.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <tbb/spin_mutex.h>
 #include <tbb/queuing_rw_mutex.h>
@@ -12,6 +13,7 @@
 #undef min
 #undef max
 #include <terark/threaded_rbtree_hash.h>
+#include <terark/swiss_hash_map.hpp>
 
 
 namespace terark { namespace db { namespace trbdb {
@@ -27,12 +29,37 @@ struct TrbMemoryFullException
 {
 };
 
-struct TrbRWRowMutex : boost::noncopyable
+struct TrbLogGroupCommitStat
+{
+    static const size_t HistSize = 8;
+    uint64_t groupNum;      // number of log writes
+    uint64_t syncGroupNum;  // log writes with flush
+    uint64_t recordNum;
+    uint64_t sizeHist[HistSize]; // groups of [2^i, 2^(i+1)) records, last is open
+};
+
+// Row locks of a writable segment, in two modes:
+// 1. default: a lock item per locked row in a hash map, items are pooled,
+//    the map is guarded by the segment mutex
+// 2. striped(env TerarkDB_TrbRowLockStripes > 0): rows are hashed to a
+//    fixed table of locks, no map and no allocation, different rows may
+//    share a lock, so a thread must not lock two rows at the same time.
+//    Each stripe has a seqlock version changed by writers, if env
+//    TerarkDB_TrbRowLockOptimisticRead is set, readers read without lock
+//    and retry if the version is changed(readBegin/readValidate)
+struct TERARK_DB_DLL TrbRWRowMutex : boost::noncopyable
 {
 private:
     typedef tbb::queuing_rw_mutex rw_mutex_t;
     typedef SpinRwMutex spin_mutex_t;
 
+    struct stripe_item
+    {
+        rw_mutex_t lock;
+        std::atomic<uint32_t> version; // odd while a writer holds lock
+        char padding[64 - sizeof(rw_mutex_t) - sizeof(std::atomic<uint32_t>)];
+    };
+
     struct map_item
     {
         map_item(uint32_t);
@@ -40,37 +67,62 @@ private:
         uint32_t count;
         rw_mutex_t lock;
     };
-    template<size_t Size, class Unused>
-    struct hasher
-    {
-        size_t operator()(llong id) const
-        {
-            return size_t(id);
-        }
-    };
-    template<class Unused>
-    struct hasher<4, Unused>
-    {
-        size_t operator()(llong id) const
-        {
-            return size_t(id & 0xFFFFFFFF) | size_t(uint64_t(id) >> 32);
-        }
-    };
-    trb_hash_map<uint32_t, map_item *, hasher<sizeof(size_t), void>> row_mutex;
+    // looked up on every transactional row access, SIMD probed
+    swiss_hash_map<uint32_t, map_item *> row_mutex;
     valvec<map_item *> mutex_pool;
     spin_mutex_t &g_mutex;
+    stripe_item *stripes;
+    size_t stripe_mask;
+    bool optimistic_read;
+
+    stripe_item &getStripe(llong id) const
+    {
+        // fibonacci hash, adjacent ids go to different stripes
+        return stripes[(uint64_t(id) * 0x9E3779B97F4A7C15ULL >> 32) & stripe_mask];
+    }
 
 public:
+    // retries of an optimistic read before it takes the lock
+    static size_t constexpr OptimisticRetry = 8;
+
+    // mode by env
     TrbRWRowMutex(spin_mutex_t &);
+    // stripes is rounded up to power of 2, 0 is the hash map mode
+    TrbRWRowMutex(spin_mutex_t &, size_t stripes, bool optimisticRead);
     ~TrbRWRowMutex();
 
+    bool isStriped() const
+    {
+        return NULL != stripes;
+    }
+    bool optimisticRead() const
+    {
+        return optimistic_read;
+    }
+    // false if a writer holds the row
+    bool readBegin(llong id, uint32_t &version) const
+    {
+        version = getStripe(id).version.load(std::memory_order_acquire);
+        return (version & 1) == 0;
+    }
+    bool readValidate(llong id, uint32_t version) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return getStripe(id).version.load(std::memory_order_relaxed) == version;
+    }
+
     class scoped_lock
     {
     protected:
         TrbRWRowMutex *parent;
         map_item *item;
+        stripe_item *stripe;
+        bool is_writer;
         rw_mutex_t::scoped_lock lock;
 
+        void beginWrite();
+        void endWrite();
+
     public:
         scoped_lock(TrbRWRowMutex &mutex, llong id, bool write = true);
         ~scoped_lock();
@@ -86,6 +138,11 @@ protected:
     friend class RowLockTransaction;
     mutable TrbRWRowMutex m_rowMutex;
     mutable TrbLogger *m_logger;
+    // transactions are readers, checkpoint is writer
+    tbb::queuing_rw_mutex m_logGateMutex;
+    std::atomic<bool> m_checkpointing;
+    // memory of stores and indices in the process wide budget
+    WritableMemBudget::Member m_memBudget;
 
 public:
 	class TrbDbTransaction; friend class TrbDbTransaction;
@@ -94,11 +151,26 @@ public:
     TrbColgroupSegment();
 	~TrbColgroupSegment();
 
+    static void getLogGroupCommitStat(TrbLogGroupCommitStat*);
+
     void load(PathRef path) override;
     void save(PathRef path) const override;
 
+    // write image of live rows, remove logs it replaced
+    void checkpointLog();
+    // checkpoint if log grows TerarkDB_TrbLogCheckpointSize since last one
+    void maybeCheckpointLog();
+
+    // update m_memBudget by memory of colgroups, called after commits
+    void accountMemory();
+    bool needFreezeByMemBudget() const override;
+    void markFrozen() override;
+
 protected:
     void initEmptySegment() override;
+    // combined row of colgroups, false if it is deleted
+    bool readRowOfStores(uint32_t subId, valvec<byte> &row,
+                         ColumnVec &cols1, ColumnVec &cols2, valvec<byte> &buf) const;
 
     ReadableIndex *openIndex(const Schema &, PathRef segDir) const override;
     ReadableIndex *createIndex(const Schema &, PathRef segDir) const override;
@@ -106,6 +178,8 @@ protected:
 
 public:
     void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+    void getValuesAppendBatch(const llong* ids, size_t num,
+                              valvec<byte>* vals, DbContext*) const override;
 
     void selectColumns(llong recId, const size_t* colsId, size_t colsNum,
                        valvec<byte>* colsData, DbContext*) const override;
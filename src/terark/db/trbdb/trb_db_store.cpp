@@ -8,7 +8,15 @@
 #include <terark/num_to_str.hpp>
 #include <boost/filesystem.hpp>
 #include <terark/io/var_int.hpp>
-
+#if defined(_MSC_VER)
+    #include <io.h>
+    #include <sys/stat.h>
+#else
+    #include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
 
 namespace fs = boost::filesystem;
 using namespace terark;
@@ -17,6 +25,185 @@ using namespace terark::db;
 namespace terark { namespace db { namespace trbdb {
 
 static uint32_t constexpr store_nil_index = 0xFFFFFFFFU;
+static uint64_t constexpr store_nil_index64 = ~uint64_t(0);
+
+// slots of m_index are published by release stores of appends in the
+// shared lock, see tryStoreNewItem, other writes hold the exclusive lock
+template<class T>
+static inline T loadSlot(T const &x)
+{
+    return reinterpret_cast<std::atomic<T> const &>(x).load(std::memory_order_acquire);
+}
+template<class T>
+static inline void publishSlot(T &x, T val)
+{
+    reinterpret_cast<std::atomic<T> &>(x).store(val, std::memory_order_release);
+}
+
+// a reserved slot may be beyond the index until its append is done
+bool TrbWritableStore::hasItem(size_type i) const
+{
+    if(m_wideIndex)
+        return i < m_index64.size() && loadSlot(m_index64[i]) != store_nil_index64;
+    else
+        return i < m_index.size() && loadSlot(m_index[i]) != store_nil_index;
+}
+
+// append only file of large values of a TrbWritableStore, written and read
+// by offsets, so appends in the shared lock of the store are concurrent.
+// Rows of a loaded segment are replayed from the trb log, which writes the
+// values again, so the file is truncated on open
+class TrbValueLog
+{
+    std::string m_path;
+    int m_fd;
+    std::atomic<uint64_t> m_size;
+#if defined(_MSC_VER)
+    mutable std::mutex m_mutex; // of the file pointer
+#endif
+
+public:
+    explicit TrbValueLog(std::string path) : m_path(std::move(path)), m_size(0)
+    {
+#if defined(_MSC_VER)
+        m_fd = ::_open(m_path.c_str(), _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+        if(m_fd < 0)
+        {
+            THROW_STD(runtime_error, "open(%s) = %s", m_path.c_str(), strerror(errno));
+        }
+    }
+    ~TrbValueLog()
+    {
+#if defined(_MSC_VER)
+        ::_close(m_fd);
+#else
+        ::close(m_fd);
+#endif
+    }
+    uint64_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+    uint64_t append(fstring val)
+    {
+        uint64_t offset = m_size.fetch_add(val.size());
+        byte const *p = (byte const *)val.data();
+        size_t size = val.size();
+        uint64_t pos = offset;
+        while(size)
+        {
+#if defined(_MSC_VER)
+            std::lock_guard<std::mutex> lock(m_mutex);
+            _lseeki64(m_fd, pos, SEEK_SET);
+            int len = ::_write(m_fd, p, unsigned(std::min<size_t>(size, 1u << 30)));
+#else
+            ssize_t len = ::pwrite(m_fd, p, size, off_t(pos));
+#endif
+            if(len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(len <= 0)
+            {
+                THROW_STD(runtime_error, "write(%s, %zd) = %s", m_path.c_str(), size, strerror(errno));
+            }
+            p += len;
+            pos += len;
+            size -= len;
+        }
+        return offset;
+    }
+
+    void read(uint64_t offset, size_t size, valvec<byte> *val) const
+    {
+        size_t oldsize = val->size();
+        val->resize_no_init(oldsize + size);
+        byte *p = val->data() + oldsize;
+        while(size)
+        {
+#if defined(_MSC_VER)
+            std::lock_guard<std::mutex> lock(m_mutex);
+            _lseeki64(m_fd, offset, SEEK_SET);
+            int len = ::_read(m_fd, p, unsigned(std::min<size_t>(size, 1u << 30)));
+#else
+            ssize_t len = ::pread(m_fd, p, size, off_t(offset));
+#endif
+            if(len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(len <= 0)
+            {
+                val->risk_set_size(oldsize);
+                THROW_STD(runtime_error, "read(%s, %zd, %llu) = %s", m_path.c_str(), size
+                          , (unsigned long long)offset, len ? strerror(errno) : "EOF");
+            }
+            p += len;
+            offset += len;
+            size -= len;
+        }
+    }
+};
+
+// the head of an item is var_uint32(len << 1 | inLog), data of an item in
+// the value log is ValueLogPtrSize bytes: uint64 offset and uint32 length
+static size_t constexpr ValueLogPtrSize = 12;
+
+static inline size_t valueLogLen(byte const *ptr)
+{
+    uint32_t len;
+    std::memcpy(&len, ptr + 8, 4);
+    return len;
+}
+
+static inline size_t itemInflateSize(fstring d, bool inLog)
+{
+    return inLog ? valueLogLen((byte const *)d.data()) : d.size();
+}
+
+// each thread has a slot number, which indexes its chunk of each store,
+// slots of exited threads are reused, so the slots are few
+class TrbThreadSlots
+{
+    std::mutex m_mutex;
+    valvec<size_t> m_free;
+    size_t m_next = 0;
+public:
+    size_t acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_free.empty() ? m_next++ : m_free.pop_val();
+    }
+    void release(size_t slot)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(slot);
+    }
+};
+static TrbThreadSlots g_trbThreadSlots;
+
+struct TrbThreadSlot
+{
+    size_t slot;
+    TrbThreadSlot() : slot(g_trbThreadSlots.acquire()) {}
+    ~TrbThreadSlot() { g_trbThreadSlots.release(slot); }
+};
+static thread_local TrbThreadSlot tls_threadSlot;
+
+static size_t allocChunkSize()
+{
+    static const size_t size = TrbWritableStore::pool_type::align_to(
+        size_t(std::max<long>(getEnvLong("TerarkDB_TrbAllocChunkKB", 64), 1)) << 10);
+    return size;
+}
+
+// threads of slots beyond it allocate under m_allocMutex without chunks
+static size_t allocChunkThreads()
+{
+    static const size_t num = size_t(std::max<long>(getEnvLong("TerarkDB_TrbAllocChunkThreads", 64), 0));
+    return num;
+}
 
 class TrbStoreIterForward : public StoreIterator
 {
@@ -33,15 +220,15 @@ public:
         auto const *o = static_cast<owner_t const *>(m_store.get());
         if(o->m_isFreezed)
         {
-            size_t max = o->m_index.size();
+            size_t max = o->rowNum();
             while(m_where < max)
             {
                 size_t k = m_where++;
-                if(o->m_index[k] != store_nil_index)
+                if(o->hasItem(k))
                 {
-                    fstring item = o->readItem(k);
+                    val->erase_all();
+                    o->appendItem(k, val);
                     *id = k;
-                    val->assign(item.data(), item.size());
                     return true;
                 }
             }
@@ -49,15 +236,15 @@ public:
         else
         {
             TrbStoreRWLock::scoped_lock l(o->m_rwMutex, false);
-            size_t max = o->m_index.size();
+            size_t max = o->rowNum();
             while(m_where < max)
             {
                 size_t k = m_where++;
-                if(o->m_index[k] != store_nil_index)
+                if(o->hasItem(k))
                 {
-                    fstring item = o->readItem(k);
+                    val->erase_all();
+                    o->appendItem(k, val);
                     *id = k;
-                    val->assign(item.data(), item.size());
                     return true;
                 }
             }
@@ -69,30 +256,30 @@ public:
         auto const *o = static_cast<owner_t const *>(m_store.get());
         if(o->m_isFreezed)
         {
-            if(id < 0 || id >= llong(o->m_index.size()))
+            if(id < 0 || id >= llong(o->rowNum()))
             {
                 THROW_STD(out_of_range, "Invalid id = %lld, rows = %zd"
-                          , id, o->m_index.size());
+                          , id, o->rowNum());
             }
-            if(o->m_index[id] != store_nil_index)
+            if(o->hasItem(size_t(id)))
             {
-                fstring item = o->readItem(size_t(id));
-                val->assign(item.data(), item.size());
+                val->erase_all();
+                o->appendItem(size_t(id), val);
                 return true;
             }
         }
         else
         {
             TrbStoreRWLock::scoped_lock l(o->m_rwMutex, false);
-            if(id < 0 || id >= llong(o->m_index.size()))
+            if(id < 0 || id >= llong(o->rowNum()))
             {
                 THROW_STD(out_of_range, "Invalid id = %lld, rows = %zd"
-                          , id, o->m_index.size());
+                          , id, o->rowNum());
             }
-            if(o->m_index[id] != store_nil_index)
+            if(o->hasItem(size_t(id)))
             {
-                fstring item = o->readItem(size_t(id));
-                val->assign(item.data(), item.size());
+                val->erase_all();
+                o->appendItem(size_t(id), val);
                 return true;
             }
         }
@@ -113,7 +300,7 @@ public:
     {
         m_store.reset(const_cast<owner_t *>(o));
         //TrbStoreRWLock::scoped_lock l(o->m_rwMutex, false);
-        m_where = o->m_index.size();
+        m_where = o->rowNum();
     }
     bool increment(llong* id, valvec<byte>* val) override
     {
@@ -123,11 +310,11 @@ public:
             while(m_where > 0)
             {
                 size_t k = --m_where;
-                if(o->m_index[k] != store_nil_index)
+                if(o->hasItem(k))
                 {
-                    fstring item = o->readItem(k);
+                    val->erase_all();
+                    o->appendItem(k, val);
                     *id = k;
-                    val->assign(item.data(), item.size());
                     return true;
                 }
             }
@@ -138,11 +325,11 @@ public:
             while(m_where > 0)
             {
                 size_t k = --m_where;
-                if(o->m_index[k] != store_nil_index)
+                if(o->hasItem(k))
                 {
-                    fstring item = o->readItem(k);
+                    val->erase_all();
+                    o->appendItem(k, val);
                     *id = k;
-                    val->assign(item.data(), item.size());
                     return true;
                 }
             }
@@ -154,30 +341,30 @@ public:
         auto const *o = static_cast<owner_t const *>(m_store.get());
         if(o->m_isFreezed)
         {
-            if(id < 0 || id >= llong(o->m_index.size()))
+            if(id < 0 || id >= llong(o->rowNum()))
             {
                 THROW_STD(out_of_range, "Invalid id = %lld, rows = %zd"
-                          , id, o->m_index.size());
+                          , id, o->rowNum());
             }
-            if(o->m_index[id] != store_nil_index)
+            if(o->hasItem(size_t(id)))
             {
-                fstring item = o->readItem(size_t(id));
-                val->assign(item.data(), item.size());
+                val->erase_all();
+                o->appendItem(size_t(id), val);
                 return true;
             }
         }
         else
         {
             TrbStoreRWLock::scoped_lock l(o->m_rwMutex, false);
-            if(id < 0 || id >= llong(o->m_index.size()))
+            if(id < 0 || id >= llong(o->rowNum()))
             {
                 THROW_STD(out_of_range, "Invalid id = %lld, rows = %zd"
-                          , id, o->m_index.size());
+                          , id, o->rowNum());
             }
-            if(o->m_index[id] != store_nil_index)
+            if(o->hasItem(size_t(id)))
             {
-                fstring item = o->readItem(size_t(id));
-                val->assign(item.data(), item.size());
+                val->erase_all();
+                o->appendItem(size_t(id), val);
                 return true;
             }
         }
@@ -187,67 +374,322 @@ public:
     {
         auto const *o = static_cast<owner_t const *>(m_store.get());
         //TrbStoreRWLock::scoped_lock l(o->m_rwMutex, false);
-        m_where = o->m_index.size();
+        m_where = o->rowNum();
     }
 };
 
 
-TrbWritableStore::TrbWritableStore(Schema const &)
+TrbWritableStore::TrbWritableStore(Schema const &schema, PathRef segDir)
     : m_data(256)
+    , m_defragData(256)
     , m_size()
+    , m_rowNum()
 {
+    m_chunks.reset(new AllocChunk[allocChunkThreads()]);
+    for(size_t k = 0; k < allocChunkThreads(); ++k)
+    {
+        m_chunks[k].poolGen = 0;
+        m_chunks[k].pos = m_chunks[k].end = 0;
+    }
+    m_poolGen = 0;
+    m_wideIndex = false;
+    m_defragging = false;
+    m_defragCursor = 0;
+    m_defragMovedBytes = 0;
+    m_valueLogThreshold = schema.m_valueLogThreshold;
+    if(m_valueLogThreshold && !segDir.empty())
+    {
+        m_valueLog.reset(new TrbValueLog((segDir / ("valuelog-" + schema.m_name)).string()));
+    }
 }
 
 TrbWritableStore::~TrbWritableStore()
 {
 }
 
-fstring TrbWritableStore::readItem(size_type i) const
+// the index has slack beyond m_rowNum, so appends in the shared lock need
+// not grow it
+void TrbWritableStore::growIndex(size_type n)
+{
+    size_t cap = indexSize();
+    if(n <= cap)
+        return;
+    cap = std::max(n, cap + cap / 2 + 64);
+    if(m_wideIndex)
+        m_index64.resize(cap, store_nil_index64);
+    else
+        m_index.resize(cap, store_nil_index);
+}
+
+size_t TrbWritableStore::itemPos(size_type i) const
+{
+    return m_wideIndex ? size_t(loadSlot(m_index64[i]))
+                       : size_t(loadSlot(m_index[i])) << index_shift;
+}
+
+// offsets of m_index are uint32 of (pos >> index_shift), it is widened to
+// m_index64 when the pool is larger than 32G, instead of a memory full
+void TrbWritableStore::setItemPos(size_type i, size_t pos)
+{
+    assert(pos % pool_type::align_size == 0);
+    if(terark_unlikely(!m_wideIndex && (pos >> index_shift) >= store_nil_index))
+    {
+        m_index64.resize_no_init(m_index.size());
+        for(size_t k = 0; k < m_index.size(); ++k)
+        {
+            m_index64[k] = m_index[k] == store_nil_index
+                ? store_nil_index64 : uint64_t(m_index[k]) << index_shift;
+        }
+        m_index.clear();
+        m_wideIndex = true;
+        fprintf(stderr, "INFO: TrbWritableStore: widen offsets to 64 bits, rows = %zd, pool = %zd\n"
+            , m_index64.size(), m_data.size() + m_defragData.size());
+    }
+    if(m_wideIndex)
+        m_index64[i] = pos;
+    else
+        m_index[i] = uint32_t(pos >> index_shift);
+}
+
+fstring TrbWritableStore::readItem(size_type i, bool* inLog) const
 {
-    assert(i < m_index.size());
+    assert(i < rowNum());
     byte const *ptr;
-    size_type len = load_var_uint32(m_data.at<data_object>(size_t(m_index[i]) << index_shift).data, &ptr);
-    return fstring(ptr, len);
+    size_type head = load_var_uint32(poolOf(i).at<data_object>(itemPos(i)).data, &ptr);
+    *inLog = (head & 1) != 0;
+    return fstring(ptr, head >> 1);
 }
 
-void TrbWritableStore::storeItem(size_type i, fstring d)
+// values in the value log are never rewritten, removed ones are garbage of
+// the file until the segment is converted
+void TrbWritableStore::appendItem(size_type i, valvec<byte>* val) const
 {
-    if(terark_likely(i >= m_index.size()))
+    bool inLog;
+    fstring item = readItem(i, &inLog);
+    if(terark_likely(!inLog))
     {
-        m_index.resize(i + 1, store_nil_index);
+        val->append(item.data(), item.size());
+        return;
     }
-    else if(m_index[i] != store_nil_index)
+    assert(item.size() == ValueLogPtrSize);
+    uint64_t offset;
+    std::memcpy(&offset, item.data(), 8);
+    m_valueLog->read(offset, valueLogLen((byte const *)item.data()), val);
+}
+
+// large values are written to the value log before any lock, *row is
+// replaced by the pointer in buf of ValueLogPtrSize bytes
+bool TrbWritableStore::logValue(fstring* row, byte* buf)
+{
+    if(!m_valueLog || row->size() < m_valueLogThreshold)
+        return false;
+    uint64_t offset = m_valueLog->append(*row);
+    uint32_t len = uint32_t(row->size());
+    std::memcpy(buf, &offset, 8);
+    std::memcpy(buf + 8, &len, 4);
+    *row = fstring(buf, ValueLogPtrSize);
+    return true;
+}
+
+void TrbWritableStore::storeItem(size_type i, fstring d, bool inLog)
+{
+    if(terark_likely(i >= indexSize()))
+    {
+        growIndex(i + 1);
+    }
+    else if(hasItem(i))
     {
         removeItem(i);
     }
+    if(m_data.capacity() - m_data.size() < 2 * allocChunkSize())
+    {
+        // room for chunks of appends in the shared lock
+        m_data.reserve(m_data.size() + std::max(m_data.size() / 2, 4 * allocChunkSize()));
+    }
     byte len_data[8];
-    byte *end_ptr = save_var_uint32(len_data, uint32_t(d.size()));
+    byte *end_ptr = save_var_uint32(len_data, uint32_t(d.size()) << 1 | uint32_t(inLog));
     size_type len_len = size_type(end_ptr - len_data);
     size_type dst_len = pool_type::align_to(d.size() + len_len);
-    size_t pos = m_data.alloc(dst_len);
-    assert(pos % 4 == 0);
-    size_t pos_shift = pos >> index_shift;
-    if(pos_shift >= store_nil_index)
+    pool_type &pool = poolOf(i);
+    size_t pos = pool.alloc(dst_len);
+    setItemPos(i, pos);
+    byte *dst_ptr = pool.at<data_object>(pos).data;
+    m_size += itemInflateSize(d, inLog);
+    std::memcpy(dst_ptr, len_data, len_len);
+    std::memcpy(dst_ptr + len_len, d.data(), d.size());
+    if(rowNum() <= i)
+        m_rowNum = i + 1;
+    defragStep();
+}
+
+// Bump allocation in the chunk of this thread in this store, chunks are
+// taken from m_data under m_allocMutex. Chunks are kept by each store, so
+// writes of a thread to several stores(colgroups of a row) do not drop the
+// chunks of the other stores. m_data must not be realloc'ed in the shared
+// lock, so it fails if the capacity of m_data is used up.
+//@returns size_t(-1) on failure
+size_t TrbWritableStore::allocInChunk(size_t len)
+{
+    size_t slot = tls_threadSlot.slot;
+    AllocChunk *ch = slot < allocChunkThreads() ? &m_chunks[slot] : NULL;
+    bool mine = ch && ch->poolGen == m_poolGen; // else it is of an old pool
+    if(mine && ch->end - ch->pos >= len)
     {
+        size_t pos = ch->pos;
+        ch->pos += len;
+        return pos;
+    }
+    size_t chunk = allocChunkSize();
+    size_t want = !ch || len * 4 > chunk ? len : chunk;
+    std::lock_guard<std::mutex> lock(m_allocMutex);
+    if(mine && ch->end > ch->pos)
+    {
+        m_data.sfree(ch->pos, ch->end - ch->pos);
+        ch->pos = ch->end;
+    }
+    if(m_data.capacity() - m_data.size() < want)
+        return size_t(-1);
+    size_t pos = m_data.alloc(want);
+    if(want == len)
+        return pos; // too large for a chunk
+    ch->poolGen = m_poolGen;
+    ch->pos = pos + len;
+    ch->end = pos + want;
+    return pos;
+}
+
+// unused bytes of chunks are freed before the store is shrunk, in the
+// exclusive lock, so no thread is allocating in its chunk
+void TrbWritableStore::releaseChunks()
+{
+    for(size_t k = 0; k < allocChunkThreads(); ++k)
+    {
+        AllocChunk &ch = m_chunks[k];
+        if(ch.poolGen == m_poolGen && ch.end > ch.pos)
+            m_data.sfree(ch.pos, ch.end - ch.pos);
+        ch.pos = ch.end = 0;
+    }
+}
+
+// insert into an empty slot in the shared lock, concurrent with readers and
+// other such inserts, slots of the same row are serialized by the caller.
+//@returns false if the exclusive lock is needed
+bool TrbWritableStore::tryStoreNewItem(size_type i, fstring d, bool inLog)
+{
+    if(m_defragging || i >= indexSize() || hasItem(i))
+        return false;
+    byte len_data[8];
+    byte *end_ptr = save_var_uint32(len_data, uint32_t(d.size()) << 1 | uint32_t(inLog));
+    size_type len_len = size_type(end_ptr - len_data);
+    size_type dst_len = pool_type::align_to(d.size() + len_len);
+    size_t pos = allocInChunk(dst_len);
+    if(size_t(-1) == pos)
+        return false;
+    if(!m_wideIndex && (pos >> index_shift) >= store_nil_index)
+    {
+        std::lock_guard<std::mutex> lock(m_allocMutex);
         m_data.sfree(pos, dst_len);
-        throw TrbMemoryFullException();
+        return false; // widened in the exclusive lock
     }
-    m_index[i] = uint32_t(pos_shift);
     byte *dst_ptr = m_data.at<data_object>(pos).data;
-    m_size += d.size();
     std::memcpy(dst_ptr, len_data, len_len);
     std::memcpy(dst_ptr + len_len, d.data(), d.size());
+    if(m_wideIndex)
+        publishSlot(m_index64[i], uint64_t(pos));
+    else
+        publishSlot(m_index[i], uint32_t(pos >> index_shift));
+    m_size += itemInflateSize(d, inLog);
+    size_t rows = m_rowNum.load();
+    while(rows <= i && !m_rowNum.compare_exchange_weak(rows, i + 1))
+    {
+    }
+    return true;
 }
 
 void TrbWritableStore::removeItem(size_type i)
 {
-    assert(i < m_index.size() && m_index[i] != store_nil_index);
-    size_t pos = size_t(m_index[i]) << index_shift;
-    byte const *ptr = m_data.at<data_object>(pos).data, *end_ptr;
-    size_type len = load_var_uint32(ptr, &end_ptr);
-    m_data.sfree(pos, pool_type::align_to(end_ptr - ptr + len));
-    m_index[i] = store_nil_index;
-    m_size -= len;
+    assert(i < rowNum() && hasItem(i));
+    pool_type &pool = poolOf(i);
+    size_t pos = itemPos(i);
+    byte const *ptr = pool.at<data_object>(pos).data, *end_ptr;
+    size_type head = load_var_uint32(ptr, &end_ptr);
+    size_type len = head >> 1;
+    m_size -= (head & 1) ? valueLogLen(end_ptr) : len;
+    pool.sfree(pos, pool_type::align_to(end_ptr - ptr + len));
+    if(m_wideIndex)
+        m_index64[i] = store_nil_index64;
+    else
+        m_index[i] = store_nil_index;
+}
+
+double TrbWritableStore::fragmentRatio() const
+{
+    TrbStoreRWLock::scoped_lock l(m_rwMutex, false);
+    size_t bytes = m_data.size() + m_defragData.size();
+    size_t frag = m_data.free_size() + m_defragData.free_size();
+    if(m_defragging)
+        frag += m_defragMovedBytes; // copies in m_data are not used
+    return bytes ? double(frag) / bytes : 0.0;
+}
+
+// Update heavy stores fragment the free lists of m_data. When free_size of
+// m_data is over TerarkDB_TrbDefragPercent(default 50) of the pool, and the
+// pool is at least TerarkDB_TrbDefragMinMB(default 64), live rows are moved
+// into m_defragData by id order, TerarkDB_TrbDefragStepRows(default 256)
+// rows by each write in the write lock, so the copy is amortized to writes
+// and readers are blocked just for a step. Rows before m_defragCursor are
+// in m_defragData, which replaces m_data when the cursor reaches the end.
+void TrbWritableStore::defragStep()
+{
+    static const long percent = getEnvLong("TerarkDB_TrbDefragPercent", 50);
+    static const size_t minBytes = size_t(getEnvLong("TerarkDB_TrbDefragMinMB", 64)) << 20;
+    static const size_t stepRows = std::max<long>(getEnvLong("TerarkDB_TrbDefragStepRows", 256), 1);
+    if(!m_defragging)
+    {
+        if(percent <= 0 || m_data.size() < minBytes ||
+            m_data.free_size() * 100 < m_data.size() * size_t(percent))
+            return;
+        fprintf(stderr, "INFO: TrbWritableStore: defrag start, pool = %zd, free = %zd(%.1f%%), rows = %zd\n"
+            , m_data.size(), m_data.free_size()
+            , 100.0 * m_data.free_size() / m_data.size(), rowNum());
+        m_defragData.erase_all();
+        m_defragData.reserve(m_data.size() - m_data.free_size());
+        m_defragCursor = 0;
+        m_defragMovedBytes = 0;
+        m_defragging = true;
+    }
+    size_t end = std::min(m_defragCursor + stepRows, rowNum());
+    for(size_t i = m_defragCursor; i < end; ++i)
+    {
+        if(!hasItem(i))
+            continue;
+        byte const *ptr = m_data.at<data_object>(itemPos(i)).data, *end_ptr;
+        size_type len = load_var_uint32(ptr, &end_ptr) >> 1;
+        size_type dst_len = pool_type::align_to(end_ptr - ptr + len);
+        size_t pos = m_defragData.alloc(dst_len);
+        // ptr was not changed by alloc of the other pool
+        std::memcpy(m_defragData.at<data_object>(pos).data, ptr, end_ptr - ptr + len);
+        setItemPos(i, pos);
+        m_defragMovedBytes += dst_len;
+    }
+    m_defragCursor = end;
+    if(end == rowNum())
+    {
+        size_t oldBytes = m_data.size();
+        m_data.swap(m_defragData);
+        m_defragData.clear(); // free the old pool
+        m_poolGen++; // chunks of appends are in the old pool
+        m_defragging = false;
+        m_defragCursor = 0;
+        fprintf(stderr, "INFO: TrbWritableStore: defrag done, pool = %zd -> %zd, rows = %zd\n"
+            , oldBytes, m_data.size(), rowNum());
+    }
+}
+
+void TrbWritableStore::finishDefrag()
+{
+    while(m_defragging)
+        defragStep();
 }
 
 void TrbWritableStore::save(PathRef) const
@@ -262,10 +704,13 @@ void TrbWritableStore::load(PathRef)
     assert(false);
 }
 
+// the value log is on disk and is not counted, the memory budget of the
+// segment counts just the pointers of large values
 llong TrbWritableStore::dataStorageSize() const
 {
     //TrbStoreRWLock::scoped_lock l(m_rwMutex, false);
-    return m_index.used_mem_size() + m_data.size();
+    return m_index.used_mem_size() + m_index64.used_mem_size()
+        + m_data.size() + m_defragData.size();
 }
 
 llong TrbWritableStore::dataInflateSize() const
@@ -277,17 +722,16 @@ llong TrbWritableStore::dataInflateSize() const
 llong TrbWritableStore::numDataRows() const
 {
     //TrbStoreRWLock::scoped_lock l(m_rwMutex, false);
-    return m_index.size();
+    return rowNum();
 }
 
 void TrbWritableStore::getValueAppend(llong id, valvec<byte>* val, DbContext *) const
 {
     if(m_isFreezed)
     {
-        if(terark_likely(size_t(id) < m_index.size() && m_index[id] != store_nil_index))
+        if(terark_likely(size_t(id) < rowNum() && hasItem(size_t(id))))
         {
-            fstring item = readItem(size_t(id));
-            val->append(item.data(), item.size());
+            appendItem(size_t(id), val);
         }
         else
         {
@@ -297,10 +741,9 @@ void TrbWritableStore::getValueAppend(llong id, valvec<byte>* val, DbContext *)
     else
     {
         TrbStoreRWLock::scoped_lock l(m_rwMutex, false);
-        if(terark_likely(size_t(id) < m_index.size() && m_index[id] != store_nil_index))
+        if(terark_likely(size_t(id) < rowNum() && hasItem(size_t(id))))
         {
-            fstring item = readItem(size_t(id));
-            val->append(item.data(), item.size());
+            appendItem(size_t(id), val);
         }
         else
         {
@@ -319,35 +762,61 @@ StoreIterator *TrbWritableStore::createStoreIterBackward(DbContext *) const
     return new TrbStoreIterBackward(this);
 }
 
+// the slot is reserved by the atomic m_rowNum, the row is stored in the
+// shared lock if possible, readers skip the slot until it is published
 llong TrbWritableStore::append(fstring row, DbContext *)
 {
     assert(!m_isFreezed);
-    TrbStoreRWLock::scoped_lock l(m_rwMutex);
+    byte ptrBuf[ValueLogPtrSize];
+    bool inLog = logValue(&row, ptrBuf);
     size_t id;
-    storeItem(id = m_index.size(), row);
+    {
+        TrbStoreRWLock::scoped_lock l(m_rwMutex, false);
+        id = m_rowNum.fetch_add(1);
+        if(tryStoreNewItem(id, row, inLog))
+            return id;
+    }
+    TrbStoreRWLock::scoped_lock l(m_rwMutex);
+    storeItem(id, row, inLog);
     return id;
 }
 
+// inserts of a writable segment are updates of new ids
 void TrbWritableStore::update(llong id, fstring row, DbContext *)
 {
     assert(!m_isFreezed);
+    byte ptrBuf[ValueLogPtrSize];
+    bool inLog = logValue(&row, ptrBuf);
+    {
+        TrbStoreRWLock::scoped_lock l(m_rwMutex, false);
+        if(tryStoreNewItem(size_t(id), row, inLog))
+            return;
+    }
     TrbStoreRWLock::scoped_lock l(m_rwMutex);
-    storeItem(size_t(id), row);
+    storeItem(size_t(id), row, inLog);
 }
 
 void TrbWritableStore::remove(llong id, DbContext *)
 {
     assert(!m_isFreezed);
     TrbStoreRWLock::scoped_lock l(m_rwMutex);
-    assert(size_t(id) < m_index.size() && m_index[id] != store_nil_index);
+    assert(size_t(id) < rowNum() && hasItem(size_t(id)));
     removeItem(size_t(id));
+    defragStep();
 }
 
 void TrbWritableStore::shrinkToFit()
 {
     assert(!m_isFreezed);
     TrbStoreRWLock::scoped_lock l(m_rwMutex);
+    finishDefrag();
+    if(m_wideIndex)
+        m_index64.resize(rowNum());
+    else
+        m_index.resize(rowNum());
     m_index.shrink_to_fit();
+    m_index64.shrink_to_fit();
+    releaseChunks();
     m_data.shrink_to_fit();
 }
 
@@ -355,12 +824,14 @@ void TrbWritableStore::shrinkToSize(size_t size)
 {
     assert(!m_isFreezed);
     TrbStoreRWLock::scoped_lock l(m_rwMutex);
-    assert(size <= m_index.size());
-    assert(std::find_if(m_index.begin() + size, m_index.end(), [](uint32_t o)
-    {
-        return o != store_nil_index;
-    }) == m_index.end());
-    m_index.resize(size);
+    assert(size <= rowNum());
+#if !defined(NDEBUG)
+    for(size_t i = size; i < rowNum(); ++i)
+        assert(!hasItem(i));
+#endif
+    finishDefrag();
+    m_rowNum = size;
+    releaseChunks();
     m_data.shrink_to_fit();
 }
 
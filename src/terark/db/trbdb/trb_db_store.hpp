@@ -3,8 +3,11 @@
 #include <terark/db/db_table.hpp>
 #include <terark/db/db_segment.hpp>
 #include <terark/util/fstrvec.hpp>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <set>
-#include <tbb/spin_rw_mutex.h>
+#include "trb_db_rwlock.hpp"
 #include <terark/mempool.hpp>
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <terark/io/var_int.hpp>
@@ -13,32 +16,76 @@ namespace terark { namespace db { namespace trbdb {
 
 class TrbStoreIterForward;
 class TrbStoreIterBackward;
+class TrbValueLog;
 
-typedef tbb::spin_rw_mutex TrbStoreRWLock;
+typedef TrbRWLock TrbStoreRWLock;
 
 class TERARK_DB_DLL TrbWritableStore : public ReadableStore, public WritableStore {
+public:
+    typedef terark::MemPool<8> pool_type;
 protected:
     typedef std::size_t size_type;
-    typedef terark::MemPool<8> pool_type;
     static size_t constexpr index_shift = 3;
     struct data_object
     {
         byte data[1];
     };
-    valvec<uint32_t> m_index;
+    valvec<uint32_t> m_index;   // pos >> index_shift if !m_wideIndex
+    valvec<uint64_t> m_index64; // pos, replaces m_index for pools over 32G
     pool_type m_data;
-    size_t m_size;
+    pool_type m_defragData; // rows of [0, m_defragCursor) if m_defragging
+    std::atomic<size_t> m_size;
+    std::atomic<size_t> m_rowNum; // slots reserved by appends
+    // chunk of m_data being bump allocated by appends of a thread, padded
+    // to limit false sharing of chunks of threads
+    struct AllocChunk
+    {
+        size_t poolGen;
+        size_t pos;
+        size_t end;
+        char padding[64 - 3 * sizeof(size_t)];
+    };
+    std::unique_ptr<AllocChunk[]> m_chunks; // by thread slot, see allocInChunk
+    size_t m_poolGen; // changed when m_data is replaced
+    std::mutex m_allocMutex; // of chunks of m_data in the shared lock
+    size_t m_defragCursor;
+    size_t m_defragMovedBytes; // copied from m_data by the defragmentation
+    bool   m_wideIndex;
+    bool   m_defragging;
     mutable TrbStoreRWLock m_rwMutex;
-
-    fstring readItem(size_type i) const;
-    void storeItem(size_type i, fstring d);
+    // values of at least m_valueLogThreshold are in m_valueLog, items of
+    // them in m_data are just the offset and length, see appendItem
+    std::unique_ptr<TrbValueLog> m_valueLog;
+    size_t m_valueLogThreshold;
+
+    size_type rowNum() const { return m_rowNum.load(std::memory_order_acquire); }
+    size_type indexSize() const { return m_wideIndex ? m_index64.size() : m_index.size(); }
+    bool hasItem(size_type i) const;
+    size_t itemPos(size_type i) const;
+    void setItemPos(size_type i, size_t pos);
+    void growIndex(size_type n);
+    size_t allocInChunk(size_t len);
+    void releaseChunks();
+    bool tryStoreNewItem(size_type i, fstring d, bool inLog);
+    const pool_type& poolOf(size_type i) const {
+        return m_defragging && i < m_defragCursor ? m_defragData : m_data;
+    }
+    pool_type& poolOf(size_type i) {
+        return m_defragging && i < m_defragCursor ? m_defragData : m_data;
+    }
+    fstring readItem(size_type i, bool* inLog) const;
+    void appendItem(size_type i, valvec<byte>* val) const;
+    bool logValue(fstring* row, byte* buf);
+    void storeItem(size_type i, fstring d, bool inLog);
     void removeItem(size_type i);
+    void defragStep();
+    void finishDefrag();
 
     friend class TrbStoreIterForward;
     friend class TrbStoreIterBackward;
 
 public:
-    TrbWritableStore(Schema const &);
+    TrbWritableStore(Schema const &, PathRef segDir);
 	~TrbWritableStore();
 
 	void save(PathRef) const override;
@@ -48,6 +95,9 @@ public:
 	llong dataInflateSize() const override;
 	llong numDataRows() const override;
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	/// free bytes in the pool / pool bytes, moved rows of an ongoing
+	/// defragmentation are counted as free
+	double fragmentRatio() const;
 
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
@@ -1,3 +1,4 @@
+	checkNotReplica("updateColumn");
 	const Schema& rowSchema = *m_schema->m_rowSchema;
 	assert(columnId < rowSchema.columnNum());
 	if (columnId >= rowSchema.columnNum()) {
@@ -0,0 +1,162 @@
+#include "value_cache.hpp"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace terark { namespace db {
+
+namespace {
+struct CacheKey {
+	ullong segId;
+	ullong cgIdAndPhysicId; // colgroupId in high 16 bits
+	bool operator==(const CacheKey& y) const {
+		return segId == y.segId && cgIdAndPhysicId == y.cgIdAndPhysicId;
+	}
+};
+inline uint64_t fmix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+struct CacheKeyHash {
+	size_t operator()(const CacheKey& k) const {
+		return size_t(fmix64(k.segId * 0x9E3779B97F4A7C15ULL ^ k.cgIdAndPhysicId));
+	}
+};
+inline CacheKey makeKey(ullong segId, size_t colgroupId, llong physicId) {
+	assert(colgroupId < 65536);
+	assert(physicId >= 0 && physicId < (1LL << 48));
+	return CacheKey{segId, ullong(colgroupId) << 48 | ullong(physicId)};
+}
+} // namespace
+
+struct ValueCache::Shard {
+	struct Entry {
+		CacheKey key;
+		valvec<byte> val;
+	};
+	typedef std::list<Entry> LruList; // front is the most recently used
+	static const size_t SketchRows = 4;
+	static const size_t SketchWidth = 4096; // power of 2
+	static const size_t EntryOverhead = sizeof(Entry) + 64; // list+map node
+
+	std::mutex mutex;
+	LruList lru;
+	std::unordered_map<CacheKey, LruList::iterator, CacheKeyHash> map;
+	size_t usedBytes = 0;
+	size_t capacity = 0;
+	size_t sketchAdds = 0;
+	byte   sketch[SketchRows][SketchWidth / 2]; // 4 bits per counter
+
+	Shard() { memset(sketch, 0, sizeof(sketch)); }
+
+	static size_t counterPos(uint64_t h, size_t row) {
+		return size_t(h >> (12 * row)) & (SketchWidth - 1); // bits [0,48)
+	}
+	size_t frequency(uint64_t h) const {
+		size_t freq = 15;
+		for (size_t row = 0; row < SketchRows; ++row) {
+			size_t pos = counterPos(h, row);
+			size_t cnt = sketch[row][pos/2] >> (pos % 2 * 4) & 15;
+			freq = std::min(freq, cnt);
+		}
+		return freq;
+	}
+	void increment(uint64_t h) {
+		for (size_t row = 0; row < SketchRows; ++row) {
+			size_t pos = counterPos(h, row);
+			size_t shift = pos % 2 * 4;
+			if ((sketch[row][pos/2] >> shift & 15) < 15)
+				sketch[row][pos/2] += byte(1 << shift);
+		}
+		if (++sketchAdds >= 10 * SketchWidth) { // aging: halve all counters
+			for (size_t row = 0; row < SketchRows; ++row)
+				for (size_t k = 0; k < SketchWidth / 2; ++k)
+					sketch[row][k] = (sketch[row][k] >> 1) & 0x77;
+			sketchAdds = 0;
+		}
+	}
+	void evictBack() {
+		Entry& e = lru.back();
+		usedBytes -= e.val.capacity() + EntryOverhead;
+		map.erase(e.key);
+		lru.pop_back();
+	}
+};
+
+ValueCache::ValueCache(size_t capacityBytes, size_t shardNum) {
+	m_shardNum = std::max<size_t>(shardNum, 1);
+	m_shards = new Shard[m_shardNum];
+	for (size_t i = 0; i < m_shardNum; ++i) {
+		m_shards[i].capacity = capacityBytes / m_shardNum;
+	}
+	m_hits = 0;
+	m_misses = 0;
+}
+
+ValueCache::~ValueCache() {
+	delete[] m_shards;
+}
+
+ullong ValueCache::newSegmentId() {
+	static std::atomic<ullong> s_nextId(1);
+	return s_nextId++;
+}
+
+bool ValueCache::get(ullong segId, size_t colgroupId, llong physicId,
+					 valvec<byte>* val) const {
+	CacheKey key = makeKey(segId, colgroupId, physicId);
+	uint64_t h = CacheKeyHash()(key);
+	Shard& shard = m_shards[(h >> 48) % m_shardNum];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.increment(h);
+	auto iter = shard.map.find(key);
+	if (shard.map.end() == iter) {
+		m_misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+	val->append(iter->second->val);
+	m_hits.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void ValueCache::put(ullong segId, size_t colgroupId, llong physicId,
+					 fstring val) {
+	CacheKey key = makeKey(segId, colgroupId, physicId);
+	uint64_t h = CacheKeyHash()(key);
+	Shard& shard = m_shards[(h >> 48) % m_shardNum];
+	const size_t bytes = val.size() + Shard::EntryOverhead;
+	if (bytes > shard.capacity)
+		return;
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (shard.map.count(key))
+		return; // put by another thread
+	size_t freq = shard.frequency(h);
+	while (shard.usedBytes + bytes > shard.capacity) {
+		const CacheKey& victim = shard.lru.back().key;
+		if (freq <= shard.frequency(CacheKeyHash()(victim)))
+			return; // not admitted
+		shard.evictBack();
+	}
+	shard.lru.emplace_front();
+	Shard::Entry& e = shard.lru.front();
+	e.key = key;
+	e.val.assign(val.udata(), val.size());
+	shard.map.emplace(key, shard.lru.begin());
+	shard.usedBytes += e.val.capacity() + Shard::EntryOverhead;
+}
+
+size_t ValueCache::usedBytes() const {
+	size_t sum = 0;
+	for (size_t i = 0; i < m_shardNum; ++i) {
+		std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+		sum += m_shards[i].usedBytes;
+	}
+	return sum;
+}
+
+} } // namespace terark::db
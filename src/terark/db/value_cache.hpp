@@ -0,0 +1,46 @@
+#ifndef __terark_db_value_cache_hpp__
+#define __terark_db_value_cache_hpp__
+
+#include "db_dll_decl.hpp"
+#include <terark/fstring.hpp>
+#include <terark/valvec.hpp>
+#include <terark/util/refcount.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+
+namespace terark { namespace db {
+
+// Size bounded cache of decompressed colgroup values of ReadonlySegment,
+// keyed by (segment, colgroup, physic id). It is sharded by key hash, each
+// shard is a LRU list with a TinyLFU admission: when the shard is full, a
+// new value is admitted only if its estimated access frequency (by a 4-bit
+// count-min sketch) is higher than the victim's.
+//
+// A segment gets a new id by newSegmentId() whenever it is (re)loaded, so
+// values of replaced segments are never hit again and just age out.
+class TERARK_DB_DLL ValueCache : public RefCounter {
+	struct Shard;
+	Shard* m_shards;
+	size_t m_shardNum;
+	mutable std::atomic<ullong> m_hits;
+	mutable std::atomic<ullong> m_misses;
+public:
+	explicit ValueCache(size_t capacityBytes, size_t shardNum = 16);
+	~ValueCache();
+
+	static ullong newSegmentId();
+
+	/// append the cached value to val
+	///@returns false on miss, val is not changed
+	bool get(ullong segId, size_t colgroupId, llong physicId, valvec<byte>* val) const;
+	void put(ullong segId, size_t colgroupId, llong physicId, fstring val);
+
+	ullong hits() const { return m_hits.load(std::memory_order_relaxed); }
+	ullong misses() const { return m_misses.load(std::memory_order_relaxed); }
+	size_t usedBytes() const; // approximate, includes per value overhead
+};
+typedef boost::intrusive_ptr<ValueCache> ValueCachePtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_value_cache_hpp__
@@ -1,4 +1,9 @@
 #include "wt_db_context.hpp"
+#include <mutex>
+
+namespace terark { namespace db {
+	TERARK_DB_DLL llong parseSizeValue(fstring str); // defined in db_conf.cpp
+}}
 
 namespace terark { namespace db { namespace wt {
 
@@ -53,6 +58,166 @@ void WtSession::close() {
 	ses = NULL;
 }
 
+void WtSessionPool::ThreadSession::closeIdle() {
+	for (IdleCursor& x : idle) {
+		WtCursor c;
+		c.cursor = x.cursor;
+		c.close();
+	}
+	idle.erase_all();
+}
+
+WtSessionPool::WtSessionPool(WT_CONNECTION* conn) : m_conn(conn) {
+	m_epoch = 1;
+}
+
+WtSessionPool::~WtSessionPool() {
+	m_tls.clear(); // close cursors and sessions of all threads
+}
+
+WT_SESSION* WtSessionPool::threadSession() {
+	ThreadSession& ts = m_tls.local();
+	if (NULL == ts.session.ses) {
+		int err = m_conn->open_session(m_conn, NULL, NULL, &ts.session.ses);
+		if (err) {
+			THROW_STD(invalid_argument
+				, "FATAL: wiredtiger open session(dir=%s) = %s"
+				, m_conn->get_home(m_conn), wiredtiger_strerror(err)
+				);
+		}
+	}
+	return ts.session.ses;
+}
+
+WT_CURSOR* WtSessionPool::acquire(const char* uri, const char* config) {
+	WT_SESSION* ses = threadSession();
+	ThreadSession& ts = m_tls.local();
+	size_t epoch = m_epoch.load(std::memory_order_relaxed);
+	if (ts.epoch != epoch) {
+		ts.closeIdle();
+		ts.epoch = epoch;
+	}
+	for (size_t i = ts.idle.size(); i > 0; --i) {
+		IdleCursor& x = ts.idle[i-1];
+		bool sameConfig = x.config == config ||
+			(x.config && config && strcmp(x.config, config) == 0);
+		if (sameConfig && strcmp(x.cursor->uri, uri) == 0) {
+			WT_CURSOR* cursor = x.cursor;
+			ts.idle.erase_i(i-1, 1);
+			return cursor;
+		}
+	}
+	WT_CURSOR* cursor = NULL;
+	int err = ses->open_cursor(ses, uri, NULL, config, &cursor);
+	if (err) {
+		THROW_STD(invalid_argument
+			, "ERROR: wiredtiger open_cursor(%s, %s): %s"
+			, uri, config ? config : "", ses->strerror(ses, err));
+	}
+	return cursor;
+}
+
+void WtSessionPool::release(WT_CURSOR* cursor, const char* config,
+							size_t epoch) {
+	ThreadSession& ts = m_tls.local();
+	assert(cursor->session == ts.session.ses);
+	WtCursor c;
+	c.cursor = cursor;
+	if (epoch != m_epoch.load(std::memory_order_relaxed) ||
+			ts.idle.size() >= MaxIdlePerThread) {
+		c.close();
+		return;
+	}
+	c.reset();
+	c.cursor = NULL;
+	ts.idle.push_back({cursor, config});
+}
+
+namespace {
+struct WtSharedConnState {
+	std::mutex     mutex;
+	WT_CONNECTION* conn = NULL;
+	size_t         refcnt = 0;
+	size_t         cacheSize = size_t(1) << 30; // 1GB
+	WtSharedConnState() {
+		if (const char* env = getenv("TerarkDB_WtSharedCacheSize")) {
+			cacheSize = (size_t)parseSizeValue(env);
+		}
+	}
+};
+WtSharedConnState& sharedConnState() {
+	static WtSharedConnState state;
+	return state;
+}
+const char* sharedConnDir() {
+	const char* dir = getenv("TerarkDB_WtSharedConnDir");
+	return dir && *dir ? dir : NULL;
+}
+}
+
+bool WtSharedConn::enabled() {
+	return NULL != sharedConnDir();
+}
+
+WT_CONNECTION* WtSharedConn::acquire() {
+	const char* dir = sharedConnDir();
+	if (NULL == dir) {
+		THROW_STD(invalid_argument, "env TerarkDB_WtSharedConnDir is not set");
+	}
+	WtSharedConnState& st = sharedConnState();
+	std::lock_guard<std::mutex> lock(st.mutex);
+	if (NULL == st.conn) {
+		fs::create_directories(dir);
+		char conf[512];
+		snprintf(conf, sizeof(conf)
+			, "create,cache_size=%zd,"
+			  "log=(enabled,recover=on),"
+			  "session_max=30000,"
+			  "checkpoint=(log_size=256MB,wait=60)"
+			, st.cacheSize);
+		int err = wiredtiger_open(dir, NULL, conf, &st.conn);
+		if (err) {
+			st.conn = NULL;
+			THROW_STD(invalid_argument, "FATAL: wiredtiger_open(dir=%s,conf=%s) = %s"
+				, dir, conf, wiredtiger_strerror(err)
+				);
+		}
+		fprintf(stderr, "INFO: wiredtiger shared conn opened, dir=%s, cache_size=%zd\n"
+			, dir, st.cacheSize);
+	}
+	st.refcnt++;
+	return st.conn;
+}
+
+void WtSharedConn::release() {
+	WtSharedConnState& st = sharedConnState();
+	std::lock_guard<std::mutex> lock(st.mutex);
+	assert(st.refcnt > 0);
+	if (0 == --st.refcnt) {
+		int err = st.conn->close(st.conn, NULL);
+		if (err) {
+			fprintf(stderr, "ERROR: wiredtiger shared conn close = %s\n"
+				, wiredtiger_strerror(err));
+		}
+		st.conn = NULL;
+	}
+}
+
+void WtSharedConn::setCacheSize(size_t cacheSize) {
+	WtSharedConnState& st = sharedConnState();
+	std::lock_guard<std::mutex> lock(st.mutex);
+	st.cacheSize = cacheSize;
+	if (st.conn) {
+		char conf[64];
+		snprintf(conf, sizeof(conf), "cache_size=%zd", cacheSize);
+		int err = st.conn->reconfigure(st.conn, conf);
+		if (err) {
+			THROW_STD(invalid_argument, "wiredtiger reconfigure(%s) = %s"
+				, conf, wiredtiger_strerror(err));
+		}
+	}
+}
+
 /*
 WtContext::WtContext(const DbTable* tab) : DbContext(tab) {
 	wtSession = NULL;
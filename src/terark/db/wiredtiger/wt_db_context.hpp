@@ -2,6 +2,8 @@
 
 #include <terark/db/db_table.hpp>
 #include <wiredtiger.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <atomic>
 
 namespace terark { namespace db { namespace wt {
 
@@ -32,6 +34,71 @@ struct WtSession {
 	WT_SESSION* operator->() const { return ses; }
 };
 
+// Per thread sessions of a WT_CONNECTION, each session keeps idle cursors
+// by (uri, config), so concurrent readers and writers of a writable segment
+// are not serialized by one shared session.
+// A cursor must be released by the thread which acquired it. invalidate()
+// is called when the segment is frozen, then idle cursors of each thread
+// are closed by the thread on its next acquire, sessions and cursors of all
+// threads are closed on destruction, which must be before the conn close.
+class TERARK_DB_DLL WtSessionPool : boost::noncopyable {
+	struct IdleCursor {
+		WT_CURSOR*  cursor;
+		const char* config; // NULL or a literal
+	};
+	struct ThreadSession : boost::noncopyable {
+		WtSession          session;
+		valvec<IdleCursor> idle;
+		size_t             epoch = 0;
+		void closeIdle();
+		~ThreadSession() { closeIdle(); }
+	};
+	WT_CONNECTION* m_conn; // not owned
+	std::atomic_size_t m_epoch;
+	tbb::enumerable_thread_specific<ThreadSession> m_tls;
+
+public:
+	static const size_t MaxIdlePerThread = 16;
+	explicit WtSessionPool(WT_CONNECTION*);
+	~WtSessionPool();
+	WT_CONNECTION* connection() const { return m_conn; }
+	WT_SESSION* threadSession();
+	WT_CURSOR* acquire(const char* uri, const char* config);
+	void release(WT_CURSOR*, const char* config, size_t epoch);
+	size_t epoch() const { return m_epoch.load(std::memory_order_relaxed); }
+	void invalidate() { m_epoch++; }
+};
+
+// Process wide WT_CONNECTION shared by writable segments of all tables, it
+// is enabled by env TerarkDB_WtSharedConnDir as the home dir, the cache
+// size is env TerarkDB_WtSharedCacheSize(default 1G) or setCacheSize().
+// A segment is a set of tables named by a uri prefix in the shared conn,
+// so all segments share one cache, one log and one set of eviction threads.
+// The conn is opened by the first acquire and closed by the last release.
+class TERARK_DB_DLL WtSharedConn {
+public:
+	static bool enabled();
+	static WT_CONNECTION* acquire();
+	static void release();
+	static void setCacheSize(size_t);
+};
+
+// RAII of a cursor from WtSessionPool, it is reset on release
+class WtPooledCursor : boost::noncopyable {
+	WtSessionPool* m_pool;
+	WT_CURSOR*     m_cursor;
+	const char*    m_config;
+	size_t         m_epoch;
+public:
+	WtPooledCursor(WtSessionPool* pool, const char* uri, const char* config)
+		: m_pool(pool), m_config(config), m_epoch(pool->epoch()) {
+		m_cursor = pool->acquire(uri, config);
+	}
+	~WtPooledCursor() { m_pool->release(m_cursor, m_config, m_epoch); }
+	operator WT_CURSOR*() const { return m_cursor; }
+	WT_CURSOR* operator->() const { return m_cursor; }
+};
+
 /*
 class TERARK_DB_DLL WtContext : public DbContext {
 public:
@@ -23,7 +23,7 @@ protected:
 	MyIndexIterBase(const WtWritableIndex* owner) {
 		m_isUniqueInSchema = owner->m_schema->m_isUnique;
 		m_index.reset(const_cast<WtWritableIndex*>(owner));
-		WT_CONNECTION* conn = m_index->m_wtSession->connection;
+		WT_CONNECTION* conn = m_index->m_conn;
 		WT_SESSION* session; // WT_SESSION is not thread safe
 		int err = conn->open_session(conn, NULL, NULL, &session);
 		if (err) {
@@ -363,7 +363,12 @@ void WtWritableIndex::getKeyVal(const Schema& schema, WT_CURSOR* cursor,
 		int64_t r = unaligned_load<int64_t>((byte*)item.data + item.size-8);
 		*recId = BigEndianValue(r);
 	}
-	if (schema.m_needEncodeToLexByteComparable) {
+	if (schema.m_compactKey) {
+		valvec<byte> enc;
+		enc.swap(*key);
+		schema.compactKeyDecode(enc, key);
+	}
+	else if (schema.m_needEncodeToLexByteComparable) {
 		schema.byteLexDecode(*key);
 	}
 }
@@ -379,7 +384,20 @@ void WtWritableIndex::setKeyVal(const Schema& schema, WT_CURSOR* cursor,
 {
 	memset(item, 0, sizeof(*item));
 	item->size = key.size();
-	if (schema.m_needEncodeToLexByteComparable) {
+	if (schema.m_compactKey) {
+		schema.compactKeyEncode(key, buf);
+		if (schema.m_isUnique) {
+			cursor->set_value(cursor, recId);
+		}
+		else {
+			cursor->set_value(cursor, 1);
+			buf->push_back('\0');
+			unaligned_save(buf->grow_no_init(8), BigEndianValue(recId));
+		}
+		item->data = buf->data();
+		item->size = buf->size();
+	}
+	else if (schema.m_needEncodeToLexByteComparable) {
 		buf->assign(key);
 		schema.byteLexEncode(*buf);
 		if (schema.m_isUnique) {
@@ -413,7 +431,9 @@ void WtWritableIndex::setKeyVal(const Schema& schema, WT_CURSOR* cursor,
 	cursor->set_key(cursor, item);
 }
 
-WtWritableIndex::WtWritableIndex(const Schema& schema, WT_CONNECTION* conn) {
+WtWritableIndex::WtWritableIndex(const Schema& schema, WT_CONNECTION* conn,
+								 WtSessionPool* pool,
+								 const std::string& uriPrefix) {
 	WT_SESSION* session;
 	int err = conn->open_session(conn, NULL, NULL, &session);
 	if (err) {
@@ -422,7 +442,7 @@ WtWritableIndex::WtWritableIndex(const Schema& schema, WT_CONNECTION* conn) {
 			);
 	}
 	m_keyFmt = toWtSchema(schema);
-	m_uri = "table:" + schema.m_name;
+	m_uri = "table:" + uriPrefix + schema.m_name;
 	std::replace(m_uri.begin(), m_uri.end(), ',', '.');
 	err = session->create(session, m_uri.c_str(), m_keyFmt.c_str());
 	if (err) {
@@ -432,37 +452,23 @@ WtWritableIndex::WtWritableIndex(const Schema& schema, WT_CONNECTION* conn) {
 			, conn->get_home(conn), wiredtiger_strerror(err)
 			);
 	}
-	err = session->open_cursor(session,
-			m_uri.c_str(), NULL, "overwrite=true", &m_wtReplace);
-	if (err) {
-		session->close(session, NULL);
-		THROW_STD(logic_error, "open_cursor failed: %s", wiredtiger_strerror(err));
-	}
-	err = session->open_cursor(session,
-			m_uri.c_str(), NULL, "overwrite=false", &m_wtCursor);
-	if (err) {
-		m_wtReplace->close(m_wtReplace);
-		session->close(session, NULL);
-		THROW_STD(logic_error, "open_cursor failed: %s", wiredtiger_strerror(err));
-	}
 	this->m_wtSession = session;
+	this->m_conn = conn;
+	this->m_sessionPool = pool;
+	this->m_indexStorageSize = 0;
 	this->m_isUnique = schema.m_isUnique;
 	this->m_schema = &schema;
 }
 
 WtWritableIndex::~WtWritableIndex() {
-	m_wtCursor->close(m_wtCursor);
-	m_wtReplace->close(m_wtReplace);
 	m_wtSession->close(m_wtSession, NULL);
 }
 
 IndexIterator* WtWritableIndex::createIndexIterForward(DbContext*) const {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
 	return new MyIndexIterForward(this);
 }
 
 IndexIterator* WtWritableIndex::createIndexIterBackward(DbContext*) const {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
 	return new MyIndexIterBackward(this);
 }
 
@@ -476,8 +482,7 @@ void WtWritableIndex::save(PathRef path1) const {
 }
 
 void WtWritableIndex::load(PathRef path1) {
-	WT_CONNECTION* conn = m_wtSession->connection;
-	boost::filesystem::path segDir = conn->get_home(conn);
+	boost::filesystem::path segDir = m_conn->get_home(m_conn);
 	auto fpath = segDir / m_uri.substr(6); // remove beginning "table:"
 	m_indexStorageSize = boost::filesystem::file_size(fpath);
 }
@@ -488,10 +493,10 @@ llong WtWritableIndex::indexStorageSize() const {
 
 bool WtWritableIndex::insert(fstring key, llong id, DbContext* ctx) {
     auto buf = ctx->bufs.get();
-	tbb::mutex::scoped_lock lock(m_wtMutex);
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), "overwrite=false");
 	WT_ITEM item;
-	setKeyVal(m_wtCursor, key, id, &item, buf.get());
-	int err = m_wtCursor->insert(m_wtCursor);
+	setKeyVal(cursor, key, id, &item, buf.get());
+	int err = cursor->insert(cursor);
 	if (err == WT_DUPLICATE_KEY) {
 	//	fprintf(stderr, "wiredtiger dupkey: %s\n", m_schema->toJsonStr(key).c_str());
 		return false;
@@ -499,7 +504,7 @@ bool WtWritableIndex::insert(fstring key, llong id, DbContext* ctx) {
 	if (err) {
 		THROW_STD(invalid_argument
 			, "FATAL: wiredtiger insert(dir=%s, uri=%s, key=%s) = %s"
-			, m_wtSession->connection->get_home(m_wtSession->connection)
+			, m_conn->get_home(m_conn)
 			, m_uri.c_str(), m_schema->toJsonStr(key).c_str()
 			, wiredtiger_strerror(err)
 			);
@@ -508,10 +513,38 @@ bool WtWritableIndex::insert(fstring key, llong id, DbContext* ctx) {
 	return true;
 }
 
+// one cursor for all keys, in key order the cursor stays on hot pages
+size_t WtWritableIndex::insertBatch(const fstring* keys, const llong* ids,
+									size_t num, DbContext* ctx) {
+	valvec<size_t> order;
+	sortBatchOrder(keys, ids, num, &order);
+	auto buf = ctx->bufs.get();
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), "overwrite=false");
+	WT_ITEM item;
+	size_t inserted = 0;
+	for (size_t i : order) {
+		setKeyVal(cursor, keys[i], ids[i], &item, buf.get());
+		int err = cursor->insert(cursor);
+		if (err == WT_DUPLICATE_KEY) {
+			continue;
+		}
+		if (err) {
+			THROW_STD(invalid_argument
+				, "FATAL: wiredtiger insertBatch(dir=%s, uri=%s, key=%s) = %s"
+				, m_conn->get_home(m_conn)
+				, m_uri.c_str(), m_schema->toJsonStr(keys[i]).c_str()
+				, wiredtiger_strerror(err)
+				);
+		}
+		m_indexStorageSize += keys[i].size() + sizeof(llong); // estimate
+		inserted++;
+	}
+	return inserted;
+}
+
 bool WtWritableIndex::replace(fstring key, llong oldId, llong newId, DbContext* ctx) {
     auto buf = ctx->bufs.get();
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	WT_CURSOR* cursor = m_wtReplace;
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), "overwrite=true");
 	WT_ITEM item;
 	if (!m_isUnique) {
 		setKeyVal(cursor, key, oldId, &item, buf.get());
@@ -523,10 +556,9 @@ bool WtWritableIndex::replace(fstring key, llong oldId, llong newId, DbContext*
 		return false;
 	}
 	if (err) {
-		WT_CONNECTION* conn = m_wtSession->connection;
 		THROW_STD(invalid_argument
 			, "FATAL: wiredtiger replace(dir=%s, uri=%s, key=%s) = %s"
-			, conn->get_home(conn)
+			, m_conn->get_home(m_conn)
 			, m_uri.c_str(), m_schema->toJsonStr(key).c_str()
 			, wiredtiger_strerror(err)
 			);
@@ -610,10 +642,10 @@ const {
 
 bool WtWritableIndex::remove(fstring key, llong id, DbContext* ctx) {
     auto buf = ctx->bufs.get();
-	tbb::mutex::scoped_lock lock(m_wtMutex);
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), "overwrite=false");
 	WT_ITEM item;
-	setKeyVal(m_wtCursor, key, id, &item, buf.get());
-	int err = m_wtCursor->remove(m_wtCursor);
+	setKeyVal(cursor, key, id, &item, buf.get());
+	int err = cursor->remove(cursor);
 	if (WT_NOTFOUND == err) {
 		fprintf(stderr
 			, "WARN: wt_remove non-existing key = %s\n"
@@ -624,7 +656,6 @@ bool WtWritableIndex::remove(fstring key, llong id, DbContext* ctx) {
 	if (err) {
 		THROW_STD(logic_error, "remove failed: %s", wiredtiger_strerror(err));
 	}
-	m_wtCursor->reset(m_wtCursor);
 	m_indexStorageSize -= key.size() + sizeof(id); // estimate
 	return true;
 }
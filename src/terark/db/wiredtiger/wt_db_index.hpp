@@ -5,6 +5,7 @@
 #include <set>
 #include <wiredtiger.h>
 #include <tbb/mutex.h>
+#include <atomic>
 
 namespace terark { namespace db { namespace wt {
 
@@ -16,18 +17,20 @@ struct WtItem : public WT_ITEM {
 	const char* charData() const { return (const char*)data; }
 };
 
+class WtSessionPool;
+
 class TERARK_DB_DLL WtWritableIndex : public ReadableIndex, public WritableIndex {
 	class MyIndexIterBase;     friend class MyIndexIterBase;
 	class MyIndexIterForward;  friend class MyIndexIterForward;
 	class MyIndexIterBackward; friend class MyIndexIterBackward;
 
-	// brain dead wiredtiger api makes multi-thread code hard to write
-	// use mutex to protect wiredtiger objects
+	// WT_SESSION is not thread safe, m_wtSession is just for create and
+	// truncate in m_wtMutex, reads and writes use per thread cursors
 	mutable tbb::mutex   m_wtMutex;
 	mutable WT_SESSION*  m_wtSession;
-	mutable WT_CURSOR*   m_wtCursor;
-	mutable WT_CURSOR*   m_wtReplace;
-	llong        m_indexStorageSize;
+	WT_CONNECTION* m_conn; // not owned
+	WtSessionPool* m_sessionPool; // not owned, owned by the segment
+	std::atomic<llong> m_indexStorageSize;
 	size_t       m_indexId;
 	std::string  m_keyFmt;
 	std::string  m_uri;
@@ -42,7 +45,9 @@ public:
 	static void setKeyVal(const Schema&, WT_CURSOR*, fstring key, llong recId,
 				   WT_ITEM* item, valvec<byte>* buf);
 
-	explicit WtWritableIndex(const Schema&, WT_CONNECTION* conn);
+	/// uriPrefix is empty if conn is owned by the segment
+	WtWritableIndex(const Schema&, WT_CONNECTION*, WtSessionPool*,
+					const std::string& uriPrefix);
 	~WtWritableIndex();
 	void save(PathRef) const override;
 	void load(PathRef) override;
@@ -54,6 +59,7 @@ public:
 	bool insert(fstring key, llong id, DbContext*) override;
 	bool replace(fstring key, llong oldId, llong newId, DbContext*) override;
 	void clear() override;
+	size_t insertBatch(const fstring* keys, const llong* ids, size_t num, DbContext*) override;
 
 	void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override;
 	WritableIndex* getWritableIndex() override { return this; }
@@ -2,7 +2,10 @@
 #include "wt_db_index.hpp"
 #include "wt_db_store.hpp"
 #include "wt_db_context.hpp"
+#include <terark/io/FileStream.hpp>
+#include <terark/util/linebuf.hpp>
 #include <boost/scope_exit.hpp>
+#include <chrono>
 
 #undef min
 #undef max
@@ -18,6 +21,7 @@ TERARK_DB_REGISTER_SEGMENT(WtWritableSegment, "wiredtiger", "wt");
 WtWritableSegment::WtWritableSegment() {
 	m_wtConn = NULL;
 	m_wrRowStore = NULL;
+	m_isSharedConn = false;
 	m_cacheSize = 1*(1ul << 30); // 1GB
 	if (const char* env = getenv("TerarkDB_WrSegCacheSizeMB")) {
 		m_cacheSize = (size_t)strtoull(env, NULL, 10) * 1024 * 1024;
@@ -28,12 +32,50 @@ WtWritableSegment::WtWritableSegment() {
 	m_hasLockFreePointSearch = false;
 }
 WtWritableSegment::~WtWritableSegment() {
+	if (m_isSharedConn && m_tobeDel) {
+		dropSharedTables();
+	}
 	m_indices.clear();
 	m_wrtStore.reset();
-	if (m_wtConn)
+	m_sessionPool.reset(); // close pooled cursors before the connection
+	if (m_isSharedConn)
+		WtSharedConn::release();
+	else if (m_wtConn)
 		m_wtConn->close(m_wtConn, NULL);
 }
 
+// the segment dir of a shared conn segment has no WiredTiger files, its
+// tables are dropped here and the dir is removed by ~ReadableSegment
+void WtWritableSegment::dropSharedTables() {
+	std::vector<std::string> uris;
+	for (auto& index : m_indices) {
+		auto wtIndex = dynamic_cast<WtWritableIndex*>(index.get());
+		if (wtIndex)
+			uris.push_back(wtIndex->getIndexUri());
+	}
+	if (auto store = dynamic_cast<WtWritableStore*>(m_wrtStore.get())) {
+		uris.push_back(store->getStoreUri());
+	}
+	m_indices.clear();
+	m_wrtStore.reset();
+	m_sessionPool.reset(); // a table can not be dropped with open cursors
+	WtSession ses;
+	int err = m_wtConn->open_session(m_wtConn, NULL, NULL, &ses.ses);
+	if (err) {
+		fprintf(stderr, "ERROR: wiredtiger open session(dir=%s) = %s\n"
+			, m_wtConn->get_home(m_wtConn), wiredtiger_strerror(err));
+		return;
+	}
+	for (const std::string& uri : uris) {
+		err = ses->drop(ses, uri.c_str(), NULL);
+		if (err) {
+			fprintf(stderr, "WARN: wiredtiger drop(%s, dir=%s) = %s\n"
+				, uri.c_str(), m_wtConn->get_home(m_wtConn)
+				, ses->strerror(ses, err));
+		}
+	}
+}
+
 #if defined(fuck_wiredtiger_brain_damaged_collator_and_recover)
 static
 int DupableIndexKey_compare(WT_COLLATOR *collator,
@@ -71,7 +113,55 @@ int DupableIndexKey_compare(WT_COLLATOR *collator,
 }
 #endif
 
+void WtWritableSegment::initSharedConn(PathRef segDir) {
+	auto prefixFile = segDir / "WtSharedUriPrefix";
+	if (boost::filesystem::exists(prefixFile)) {
+		FileStream fp(prefixFile.string().c_str(), "r");
+		LineBuf line;
+		line.getline(fp);
+		line.chomp();
+		m_uriPrefix.assign(line.p, line.n);
+	}
+	else {
+		// uniq by dir and time, a re-created segment of the same dir
+		// does not see stale tables in the shared conn
+		std::string strDir = boost::filesystem::absolute(segDir).string();
+		uint64_t h = 14695981039346656037ULL; // FNV-1a
+		for (unsigned char c : strDir) {
+			h = (h ^ c) * 1099511628211ULL;
+		}
+		h ^= (uint64_t)std::chrono::system_clock::now().time_since_epoch().count();
+		std::string name = segDir.filename().string();
+		for (char& c : name) {
+			if (!isalnum((unsigned char)c)) c = '_';
+		}
+		char buf[32];
+		snprintf(buf, sizeof(buf), "_%016llx_", (unsigned long long)h);
+		m_uriPrefix = name + buf;
+		boost::filesystem::create_directories(segDir);
+		FileStream fp(prefixFile.string().c_str(), "w");
+		fp.puts(m_uriPrefix);
+		fp.puts("\n");
+	}
+	if (m_uriPrefix.empty()) {
+		THROW_STD(invalid_argument, "empty uri prefix in file: %s"
+			, prefixFile.string().c_str());
+	}
+	m_wtConn = WtSharedConn::acquire();
+	m_isSharedConn = true;
+}
+
 void WtWritableSegment::init(PathRef segDir) {
+	// segments created in private conn mode are still opened by private
+	// conn, so TerarkDB_WtSharedConnDir can be set on an existing db
+	if (WtSharedConn::enabled() &&
+			!boost::filesystem::exists(segDir / "WiredTiger")) {
+		initSharedConn(segDir);
+		m_sessionPool.reset(new WtSessionPool(m_wtConn));
+		m_wrtStore = new WtWritableStore(m_wtConn, m_sessionPool.get(), m_uriPrefix);
+		m_wrRowStore = m_wrtStore->getWritableStore();
+		return;
+	}
 	std::string strDir = segDir.string();
 	char conf[512];
 	snprintf(conf, sizeof(conf)
@@ -90,18 +180,19 @@ void WtWritableSegment::init(PathRef segDir) {
 // Using binary encoded (key,record_id) should save the world
 //	static WT_COLLATOR collator = { DupableIndexKey_compare, NULL, NULL };
 //	m_wtConn->add_collator(m_wtConn, "terark_wt_dup_index_compare", &collator, NULL);
-	m_wrtStore = new WtWritableStore(m_wtConn);
+	m_sessionPool.reset(new WtSessionPool(m_wtConn));
+	m_wrtStore = new WtWritableStore(m_wtConn, m_sessionPool.get(), m_uriPrefix);
 	m_wrRowStore = m_wrtStore->getWritableStore();
 }
 
 ReadableIndex*
 WtWritableSegment::createIndex(const Schema& schema, PathRef segDir) const {
-	return new WtWritableIndex(schema, m_wtConn);
+	return new WtWritableIndex(schema, m_wtConn, m_sessionPool.get(), m_uriPrefix);
 }
 
 ReadableIndex*
 WtWritableSegment::openIndex(const Schema& schema, PathRef segDir) const {
-	return new WtWritableIndex(schema, m_wtConn);
+	return new WtWritableIndex(schema, m_wtConn, m_sessionPool.get(), m_uriPrefix);
 }
 
 void WtWritableSegment::initEmptySegment() {
@@ -110,6 +201,13 @@ void WtWritableSegment::initEmptySegment() {
 	PlainWritableSegment::initEmptySegment();
 }
 
+void WtWritableSegment::markFrozen() {
+	PlainWritableSegment::markFrozen();
+	// no more writes, idle cursors of pooled sessions are closed lazily
+	if (m_sessionPool)
+		m_sessionPool->invalidate();
+}
+
 void WtWritableSegment::load(PathRef path) {
 	init(path);
 	if (boost::filesystem::exists(path / "IsDel")) {
@@ -142,8 +240,6 @@ void WtWritableSegment::save(PathRef path) const {
 	m_wtConn->async_flush(m_wtConn);
 }
 
-extern const char g_dataStoreUri[];
-
 struct WtCursor2 {
 	WtCursor insert;
 	WtCursor overwrite;
@@ -180,7 +276,10 @@ public:
 				);
 		}
 		WT_SESSION* ses = m_session.ses;
-		err = ses->open_cursor(ses, g_dataStoreUri, NULL, "overwrite=true", &m_store.cursor);
+		m_wrtStore = dynamic_cast<WtWritableStore*>(seg->m_wrtStore.get());
+		assert(nullptr != m_wrtStore);
+		const char* storeUri = m_wrtStore->getStoreUri().c_str();
+		err = ses->open_cursor(ses, storeUri, NULL, "overwrite=true", &m_store.cursor);
 		if (err) {
 			THROW_STD(invalid_argument
 				, "ERROR: wiredtiger store open cursor: %s"
@@ -206,8 +305,6 @@ public:
 			}
 		}
 		m_sizeDiff = 0;
-		m_wrtStore = dynamic_cast<WtWritableStore*>(seg->m_wrtStore.get());
-		assert(nullptr != m_store);
 		g_wtDbTxnLiveCnt++;
 		g_wtDbTxnCreatedCnt++;
 		if (getEnvBool("TerarkDB_TrackBuggyObjectLife")) {
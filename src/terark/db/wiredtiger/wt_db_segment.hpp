@@ -2,9 +2,12 @@
 
 #include <terark/db/db_segment.hpp>
 #include <wiredtiger.h>
+#include <memory>
 
 namespace terark { namespace db { namespace wt {
 
+class WtSessionPool;
+
 class TERARK_DB_DLL WtWritableSegment : public PlainWritableSegment {
 public:
 	class WtDbTransaction; friend class WtDbTransaction;
@@ -15,15 +18,21 @@ public:
 
 protected:
 	void init(PathRef segDir);
+	void initSharedConn(PathRef segDir);
+	void dropSharedTables();
 
 	ReadableIndex* createIndex(const Schema&, PathRef segDir) const override;
 	ReadableIndex* openIndex(const Schema&, PathRef segDir) const override;
 
 	void initEmptySegment() override;
+	void markFrozen() override;
 	void load(PathRef path) override;
 	void save(PathRef path) const override;
 
 	WT_CONNECTION* m_wtConn;
+	std::unique_ptr<WtSessionPool> m_sessionPool; // per thread sessions
+	std::string m_uriPrefix; // of tables in WtSharedConn, empty if private
+	bool m_isSharedConn;
 	WritableStore* m_wrRowStore;
 	size_t m_cacheSize;
 };
@@ -11,42 +11,10 @@ namespace terark { namespace db { namespace wt {
 
 namespace fs = boost::filesystem;
 
-extern const char g_dataStoreUri[] = "table:__BlobStore__";
+static const char g_dataStoreName[] = "__BlobStore__";
 std::atomic<size_t> g_wtStoreIterLiveCnt;
 std::atomic<size_t> g_wtStoreIterCreatedCnt;
 
-//////////////////////////////////////////////////////////////////
-WtWritableStore::SessionCursor::~SessionCursor() {
-	WT_SESSION* ses = NULL;
-	if (insert) {
-		ses = insert->session;
-		insert.close();
-	}
-	if (append) {
-		if (ses) {
-			assert(ses == append->session);
-			if (ses != append->session) {
-				fprintf(stderr
-					, "ERROR: %s:%d: append->session != insert->session\n"
-					, __FILE__, __LINE__);
-			}
-		} else {
-			ses = append->session;
-		}
-		append.close();
-	}
-	if (NULL == ses) {
-		return;
-	}
-	int err = ses->close(ses, NULL);
-	if (err) {
-		WT_CONNECTION* conn = ses->connection;
-		const char*    home = conn->get_home(conn);
-		const char*   szErr = ses->strerror(ses, err);
-		fprintf(stderr, "ERROR: WT_SESSION.close(%s) failed: %s\n", home, szErr);
-	}
-}
-
 //////////////////////////////////////////////////////////////////
 class WtWritableStoreIterBase : public StoreIterator {
 	WT_CURSOR* m_cursor;
@@ -61,7 +29,8 @@ public:
 				);
 		}
 		WT_CURSOR* cursor;
-		err = ses->open_cursor(ses, g_dataStoreUri, NULL, "overwrite=true", &cursor);
+		// iterators never write, readonly cursors skip the update path
+		err = ses->open_cursor(ses, store->getStoreUri().c_str(), NULL, "readonly=true", &cursor);
 		if (err) {
 			std::string msg = ses->strerror(ses, err);
 			ses->close(ses, NULL);
@@ -85,6 +54,34 @@ public:
 	}
 	virtual int advance(WT_CURSOR*) = 0;
 
+	// value_format=u is already raw, values are copied once from the
+	// cursor to the batch, without the valvec of increment
+	size_t incrementBatch(StoreBatch* batch, size_t maxRows, size_t maxBytes)
+	override {
+		batch->erase_all();
+		WT_CURSOR* cursor = m_cursor;
+		while (batch->size() < maxRows && batch->vals.size() < maxBytes) {
+			int err = advance(cursor);
+			if (WT_NOTFOUND == err) {
+				break;
+			}
+			if (err) {
+				WT_CONNECTION* conn = cursor->session->connection;
+				THROW_STD(invalid_argument
+					, "FATAL: wiredtiger next(%s, dir=%s) = %s"
+					, cursor->uri, conn->get_home(conn)
+					, wiredtiger_strerror(err)
+					);
+			}
+			WT_ITEM item;
+			llong recno;
+			cursor->get_key(cursor, &recno);
+			cursor->get_value(cursor, &item);
+			batch->push_back(recno - 1, fstring((const char*)item.data, item.size));
+		}
+		return batch->size();
+	}
+
 	bool increment(llong* id, valvec<byte>* val) override {
 		int err = advance(m_cursor);
 		if (0 == err) {
@@ -105,7 +102,7 @@ public:
 		WT_CONNECTION* conn = m_cursor->session->connection;
 		THROW_STD(invalid_argument
 			, "FATAL: wiredtiger search(%s, dir=%s) = %s"
-			, g_dataStoreUri, conn->get_home(conn)
+			, m_cursor->uri, conn->get_home(conn)
 			, wiredtiger_strerror(err)
 			);
 	}
@@ -130,7 +127,7 @@ public:
 		WT_CONNECTION* conn = m_cursor->session->connection;
 		THROW_STD(invalid_argument
 			, "FATAL: wiredtiger search(%s, dir=%s) = %s"
-			, g_dataStoreUri, conn->get_home(conn)
+			, m_cursor->uri, conn->get_home(conn)
 			, wiredtiger_strerror(err)
 			);
 	}
@@ -155,7 +152,8 @@ public:
 		: WtWritableStoreIterBase(store, conn) {}
 };
 
-WtWritableStore::WtWritableStore(WT_CONNECTION* conn) {
+WtWritableStore::WtWritableStore(WT_CONNECTION* conn, WtSessionPool* pool,
+								 const std::string& uriPrefix) {
 	WT_SESSION* session;
 	int err = conn->open_session(conn, NULL, NULL, &session);
 	if (err) {
@@ -164,64 +162,35 @@ WtWritableStore::WtWritableStore(WT_CONNECTION* conn) {
 			, conn->get_home(conn), wiredtiger_strerror(err)
 			);
 	}
-	err = session->create(session, g_dataStoreUri, "key_format=r,value_format=u");
+	m_uri = "table:" + uriPrefix + g_dataStoreName;
+	err = session->create(session, m_uri.c_str(), "key_format=r,value_format=u");
 	if (err) {
 		session->close(session, NULL);
 		THROW_STD(invalid_argument, "FATAL: wiredtiger create(%s, dir=%s) = %s"
-			, g_dataStoreUri
+			, m_uri.c_str()
 			, conn->get_home(conn), wiredtiger_strerror(err)
 			);
 	}
 	m_conn = conn; // not owned
+	m_sessionPool = pool;
 	m_wtSession = session;
-	m_wtCursor = NULL;
-	m_wtAppend = NULL;
 	m_dataSize = 0;
 	m_lastSyncedDataSize = 0;
 }
 WtWritableStore::~WtWritableStore() {
-	if (m_wtCursor)
-		m_wtCursor->close(m_wtCursor);
-	if (m_wtAppend)
-		m_wtAppend->close(m_wtAppend);
 	m_wtSession->close(m_wtSession, NULL);
 }
 
 void WtWritableStore::estimateIncDataSize(llong sizeDiff) {
-	if (std::abs(m_dataSize - m_lastSyncedDataSize) > 10*1024*1024) {
-		WT_CONNECTION* conn = m_wtSession->connection;
-		boost::filesystem::path fpath = conn->get_home(conn);
-		fpath /= "__BlobStore__.wt";
-		m_dataSize = boost::filesystem::file_size(fpath);
-		m_lastSyncedDataSize = m_dataSize;
+	llong size = m_dataSize.fetch_add(sizeDiff) + sizeDiff;
+	if (std::abs(size - m_lastSyncedDataSize.load()) > 10*1024*1024) {
+		tbb::mutex::scoped_lock lock(m_wtMutex);
+		boost::filesystem::path fpath = m_conn->get_home(m_conn);
+		fpath /= m_uri.substr(6) + ".wt"; // remove beginning "table:"
+		llong fsize = boost::filesystem::file_size(fpath);
+		m_dataSize = fsize;
+		m_lastSyncedDataSize = fsize;
 	}
-	else {
-		m_dataSize += sizeDiff;
-	}
-}
-
-WT_CURSOR* WtWritableStore::getReplaceCursor() const {
-	if (NULL == m_wtCursor) {
-		int err = m_wtSession->open_cursor(m_wtSession, g_dataStoreUri, NULL, NULL, &m_wtCursor);
-		if (err) {
-			auto msg = m_wtSession->strerror(m_wtSession, err);
-			THROW_STD(invalid_argument,
-				"ERROR: wiredtiger store open_cursor for replace: %s", msg);
-		}
-	}
-	return m_wtCursor;
-}
-
-WT_CURSOR* WtWritableStore::getAppendCursor() const {
-	if (NULL == m_wtAppend) {
-		int err = m_wtSession->open_cursor(m_wtSession, g_dataStoreUri, NULL, "append", &m_wtAppend);
-		if (err) {
-			auto msg = m_wtSession->strerror(m_wtSession, err);
-			THROW_STD(invalid_argument,
-				"ERROR: wiredtiger store open_cursor for append: %s", msg);
-		}
-	}
-	return m_wtAppend;
 }
 
 void WtWritableStore::save(PathRef path1) const {
@@ -230,11 +199,10 @@ void WtWritableStore::save(PathRef path1) const {
 }
 
 void WtWritableStore::load(PathRef path1) {
-	WT_CONNECTION* conn = m_wtSession->connection;
-	boost::filesystem::path segDir = conn->get_home(conn);
-	auto dataFile = segDir / "__BlobStore__.wt";
+	boost::filesystem::path segDir = m_conn->get_home(m_conn);
+	auto dataFile = segDir / (m_uri.substr(6) + ".wt");
 	m_dataSize = boost::filesystem::file_size(dataFile);
-	m_lastSyncedDataSize = m_dataSize;
+	m_lastSyncedDataSize = m_dataSize.load();
 }
 
 llong WtWritableStore::dataStorageSize() const {
@@ -246,8 +214,7 @@ llong WtWritableStore::dataInflateSize() const {
 }
 
 llong WtWritableStore::numDataRows() const {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	WT_CURSOR* cursor = getReplaceCursor();
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), NULL);
 	cursor->set_key(cursor, LLONG_MAX);
 	int cmp;
 	int err = cursor->search_near(cursor, &cmp);
@@ -255,12 +222,12 @@ llong WtWritableStore::numDataRows() const {
 		return 0;
 	}
 	if (err) {
+		WT_SESSION* ses = cursor->session;
 		THROW_STD(invalid_argument, "wiredtiger search near failed: %s"
-			, m_wtSession->strerror(m_wtSession, err));
+			, ses->strerror(ses, err));
 	}
 	llong recno;
 	cursor->get_key(cursor, &recno);
-	cursor->reset(cursor);
 	return recno; // max recno is the rows
 }
 
@@ -270,8 +237,7 @@ const {
 //	WtContext* ctx = dynamic_cast<WtContext*>(ctx0);
 //	TERARK_RT_assert(NULL != ctx, std::invalid_argument);
 	llong recno = id + 1;
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	auto cursor = getReplaceCursor();
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), NULL);
 	auto ses = cursor->session;
 	auto conn = ses->connection;
 	cursor->set_key(cursor, recno);
@@ -290,22 +256,20 @@ const {
 	WT_ITEM item;
 	cursor->get_value(cursor, &item);
 	val->append((const byte*)item.data, item.size);
-	cursor->reset(cursor);
 }
 
 StoreIterator* WtWritableStore::createStoreIterForward(DbContext*) const {
-	return new WtWritableStoreIterForward(this, m_wtSession->connection);
+	return new WtWritableStoreIterForward(this, m_conn);
 }
 
 StoreIterator* WtWritableStore::createStoreIterBackward(DbContext*) const {
-	return new WtWritableStoreIterBackward(this, m_wtSession->connection);
+	return new WtWritableStoreIterBackward(this, m_conn);
 }
 
 llong WtWritableStore::append(fstring row, DbContext* ctx0) {
 //	WtContext* ctx = dynamic_cast<WtContext*>(ctx0);
 //	TERARK_RT_assert(NULL != ctx, std::invalid_argument);
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	auto cursor = getAppendCursor();
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), "append");
 	WT_ITEM item;
 	memset(&item, 0, sizeof(item));
 	item.data = row.data();
@@ -315,7 +279,7 @@ llong WtWritableStore::append(fstring row, DbContext* ctx0) {
 	if (err) {
 		THROW_STD(invalid_argument
 			, "wiredtiger append failed, err=%s, row=%s"
-			, m_wtSession->strerror(m_wtSession, err)
+			, cursor->session->strerror(cursor->session, err)
 			, ctx0->m_tab->rowSchema().toJsonStr(row).c_str()
 			);
 	}
@@ -330,8 +294,7 @@ void WtWritableStore::update(llong id, fstring row, DbContext* ctx0) {
 //	WtContext* ctx = dynamic_cast<WtContext*>(ctx0);
 //	TERARK_RT_assert(NULL != ctx, std::invalid_argument);
 	llong recno = id + 1;
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	auto cursor = getReplaceCursor();
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), NULL);
 	WT_ITEM item;
 	memset(&item, 0, sizeof(item));
 	item.data = row.data();
@@ -342,7 +305,7 @@ void WtWritableStore::update(llong id, fstring row, DbContext* ctx0) {
 	if (err) {
 		THROW_STD(invalid_argument
 			, "wiredtiger replace failed, err=%s, row=%s"
-			, m_wtSession->strerror(m_wtSession, err)
+			, cursor->session->strerror(cursor->session, err)
 			, ctx0->m_tab->rowSchema().toJsonStr(row).c_str()
 			);
 	}
@@ -358,21 +321,19 @@ void WtWritableStore::remove(llong id, DbContext* ctx0) {
 	update(id, emptyValue, ctx0);
 #else
 	llong recno = id + 1;
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	auto cursor = getReplaceCursor();
+	WtPooledCursor cursor(m_sessionPool, m_uri.c_str(), NULL);
 	cursor->set_key(cursor, recno);
 	int err = cursor->remove(cursor);
 	if (err) {
 		if (WT_NOTFOUND != err) {
 			THROW_STD(invalid_argument
 				, "wiredtiger remove failed, err=%s"
-				, m_wtSession->strerror(m_wtSession, err)
+				, cursor->session->strerror(cursor->session, err)
 				);
 		} else {
 			fprintf(stderr, "WARN: WtWritableStore::remove: recno=%lld not found", recno);
 		}
 	}
-	cursor->reset(cursor);
 #endif
 }
 
@@ -387,7 +348,7 @@ void WtWritableStore::shrinkToSize(size_t size)
 /*
 void WtWritableStore::clear() {
 	tbb::mutex::scoped_lock lock(m_wtMutex);
-	m_wtSession->truncate(m_wtSession, g_dataStoreUri, NULL, NULL, NULL);
+	m_wtSession->truncate(m_wtSession, m_uri.c_str(), NULL, NULL, NULL);
 }
 */
 
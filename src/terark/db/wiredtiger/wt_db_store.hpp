@@ -11,29 +11,24 @@ namespace terark { namespace db { namespace wt {
 
 class TERARK_DB_DLL WtWritableStore : public ReadableStore, public WritableStore {
 
-	// brain dead wiredtiger api makes multi-thread code hard to write
-	// use mutex to protect wiredtiger objects
+	// WT_SESSION is not thread safe, m_wtSession is just for create and
+	// checkpoint in m_wtMutex, reads and writes use per thread cursors
 	mutable tbb::mutex   m_wtMutex;
 	mutable WT_SESSION*  m_wtSession;
-	mutable WT_CURSOR*   m_wtCursor;
-	mutable WT_CURSOR*   m_wtAppend;
-	struct SessionCursor : boost::noncopyable {
-		WtCursor insert;
-		WtCursor append;
-		~SessionCursor();
-	};
 	WT_CONNECTION* m_conn; // not owned
-//	tbb::enumerable_thread_specific<SessionCursor> m_cursor;
-	llong m_lastSyncedDataSize;
-	llong m_dataSize;
-
-	WT_CURSOR* getReplaceCursor() const;
-	WT_CURSOR* getAppendCursor() const;
+	WtSessionPool* m_sessionPool; // not owned, owned by the segment
+	std::string    m_uri;
+	std::atomic<llong> m_lastSyncedDataSize;
+	std::atomic<llong> m_dataSize;
 
 public:
-	WtWritableStore(WT_CONNECTION* conn);
+	/// uriPrefix is empty if conn is owned by the segment
+	WtWritableStore(WT_CONNECTION* conn, WtSessionPool* sessionPool,
+					const std::string& uriPrefix);
 	~WtWritableStore();
 
+	const std::string& getStoreUri() const { return m_uri; }
+
 	void estimateIncDataSize(llong sizeDiff);
 
 	void save(PathRef) const override;
@@ -1,4 +1,5 @@
 #include "zip_int_store.hpp"
+#include "db_env.hpp"
 #include <terark/io/FileStream.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/num_to_str.hpp>
@@ -13,21 +14,24 @@ ZipIntStore::ZipIntStore(const Schema& schema) : m_schema(schema) {
 	m_minValue = 0;
 	m_mmapBase = nullptr;
 	m_mmapSize = 0;
+	m_zipMode = ZipMode::Plain;
+	m_blockModeRows = 0;
 }
 ZipIntStore::~ZipIntStore() {
 	if (m_mmapBase) {
 		m_dedup.risk_release_ownership();
 		m_index.risk_release_ownership();
-		mmap_close(m_mmapBase, m_mmapSize);
+		m_blockData.risk_release_ownership();
+		DbEnv::current()->mmapClose(m_mmapBase, m_mmapSize);
 	}
 }
 
 llong ZipIntStore::dataStorageSize() const {
-	return m_dedup.mem_size() + m_index.mem_size();
+	return m_dedup.mem_size() + m_index.mem_size() + m_blockData.size();
 }
 
 llong ZipIntStore::dataInflateSize() const {
-	size_t rows = m_index.size() ? m_index.size() : m_dedup.size();
+	size_t rows = size_t(numDataRows());
 	switch (m_intType) {
 	default:
 		THROW_STD(invalid_argument,
@@ -44,12 +48,36 @@ llong ZipIntStore::dataInflateSize() const {
 }
 
 llong ZipIntStore::numDataRows() const {
+	if (ZipMode::Plain != m_zipMode)
+		return m_blockModeRows;
 	return m_index.size() ? m_index.size() : m_dedup.size();
 }
 
+// base is in value domain, packed data of a block is byte aligned
+struct ZipIntStore::BlockHeader {
+	uint64_t base;
+	uint64_t slope; // always 0 for BlockFOR
+	uint64_t offsetAndBits; // (byte offset in m_blockData << 8) | bits
+};
+
+inline ullong ZipIntStore::blockValue(size_t recIdx) const {
+	assert(recIdx < m_blockModeRows);
+	auto blocks = (const BlockHeader*)m_blockData.data();
+	const BlockHeader& blk = blocks[recIdx / BlockRows];
+	size_t i = recIdx % BlockRows;
+	size_t bits = size_t(blk.offsetAndBits & 255);
+	size_t mask = (size_t(1) << bits) - 1;
+	const byte* data = m_blockData.data() + (blk.offsetAndBits >> 8);
+	return blk.base + blk.slope * i + UintVecMin0::fast_get(data, bits, mask, i);
+}
+
 template<class Int>
 void ZipIntStore::valueAppend(size_t recIdx, valvec<byte>* key) const {
-	if (m_index.size()) {
+	if (ZipMode::Plain != m_zipMode) {
+		Int iValue = Int(blockValue(recIdx));
+		unaligned_save<Int>(key->grow_no_init(sizeof(Int)), iValue);
+	}
+	else if (m_index.size()) {
 		size_t idx = m_index.get(recIdx);
 		assert(idx < m_dedup.size());
 		Int iValue = Int(m_minValue + m_dedup.get(idx));
@@ -78,17 +106,84 @@ void ZipIntStore::getValueAppend(llong id, valvec<byte>* val, DbContext*) const
 	case ColumnType::Uint64: valueAppend<uint64_t>(idx, val); break;
 	case ColumnType::VarSint: {
 		byte  buf[16];
-		byte* end = save_var_int64(buf, int64_t(m_minValue + m_dedup.get(idx)));
+		ullong raw = ZipMode::Plain == m_zipMode
+				   ? ullong(m_minValue + m_dedup.get(idx)) : blockValue(idx);
+		byte* end = save_var_int64(buf, int64_t(raw));
 		val->append(buf, end - buf);
 		break; }
 	case ColumnType::VarUint: {
 		byte  buf[16];
-		byte* end = save_var_uint64(buf, uint64_t(m_minValue + m_dedup.get(idx)));
+		ullong raw = ZipMode::Plain == m_zipMode
+				   ? ullong(m_minValue + m_dedup.get(idx)) : blockValue(idx);
+		byte* end = save_var_uint64(buf, uint64_t(raw));
 		val->append(buf, end - buf);
 		break; }
 	}
 }
 
+template<class Int>
+void ZipIntStore::valuesDecode(size_t beg, size_t num, byte* out) const {
+	const Int minValue = Int(m_minValue);
+	Int* values = (Int*)out;
+	if (ZipMode::Plain != m_zipMode) {
+		for (size_t i = 0; i < num; ++i)
+			values[i] = Int(blockValue(beg + i));
+	}
+	else {
+		const size_t ChunkSize = 256;
+		const UintVecMin0& seq = m_index.size() ? m_index : m_dedup;
+		size_t chunk[ChunkSize];
+		for (size_t i = 0; i < num; i += ChunkSize) {
+			size_t n = std::min(ChunkSize, num - i);
+			seq.get_range(beg + i, beg + i + n, chunk);
+			if (m_index.size()) {
+				for (size_t j = 0; j < n; ++j) {
+					assert(chunk[j] < m_dedup.size());
+					values[i + j] = Int(minValue + m_dedup.get(chunk[j]));
+				}
+			}
+			else {
+				for (size_t j = 0; j < n; ++j)
+					values[i + j] = Int(minValue + chunk[j]);
+			}
+		}
+	}
+}
+
+size_t ZipIntStore::getFieldArray(llong beg, size_t num,
+								  size_t offset, size_t len,
+								  valvec<byte>* buf, const byte** data)
+const {
+	assert(beg >= 0);
+	assert(beg + llong(num) <= numDataRows());
+	if (0 != offset)
+		return 0;
+	size_t idx = size_t(beg);
+	size_t width;
+	switch (m_intType) {
+	default: return 0; // var int
+	case ColumnType::Sint08:
+	case ColumnType::Uint08: width = 1; break;
+	case ColumnType::Sint16:
+	case ColumnType::Uint16: width = 2; break;
+	case ColumnType::Sint32:
+	case ColumnType::Uint32: width = 4; break;
+	case ColumnType::Sint64:
+	case ColumnType::Uint64: width = 8; break;
+	}
+	if (len != width)
+		return 0;
+	buf->resize_no_init(width * num);
+	switch (width) {
+	case 1: valuesDecode<uint8_t >(idx, num, buf->data()); break;
+	case 2: valuesDecode<uint16_t>(idx, num, buf->data()); break;
+	case 4: valuesDecode<uint32_t>(idx, num, buf->data()); break;
+	case 8: valuesDecode<uint64_t>(idx, num, buf->data()); break;
+	}
+	*data = buf->data();
+	return width;
+}
+
 StoreIterator* ZipIntStore::createStoreIterForward(DbContext*) const {
 	return nullptr; // not needed
 }
@@ -97,6 +192,108 @@ StoreIterator* ZipIntStore::createStoreIterBackward(DbContext*) const {
 	return nullptr; // not needed
 }
 
+namespace {
+	// order preserving map of Int to unsigned
+	template<class Int>
+	inline ullong zintKey(Int v) {
+		return boost::is_signed<Int>::value
+			? ullong(llong(v)) ^ (ullong(1) << 63) : ullong(v);
+	}
+
+	///@returns bits of residuals, base and slope are in key domain
+	template<class Int>
+	size_t zipOneBlock(const Int* values, size_t num, bool linear,
+					   ullong* base, ullong* slope, ullong* packed) {
+		assert(num > 0);
+		ullong k0 = zintKey(values[0]);
+		ullong b = k0, s = 0;
+		if (linear) {
+			if (num > 1)
+				s = ullong(llong(zintKey(values[num-1]) - k0) / llong(num-1));
+			llong rmin = 0;
+			for (size_t i = 1; i < num; ++i) {
+				llong r = llong(zintKey(values[i]) - k0 - s * i);
+				rmin = std::min(rmin, r);
+			}
+			b = k0 + ullong(rmin);
+		}
+		else {
+			for (size_t i = 1; i < num; ++i)
+				b = std::min(b, zintKey(values[i]));
+		}
+		ullong maxd = 0;
+		for (size_t i = 0; i < num; ++i) {
+			ullong d = zintKey(values[i]) - b - s * i;
+			maxd = std::max(maxd, d);
+			if (packed)
+				packed[i] = d;
+		}
+		*base = b;
+		*slope = s;
+		return maxd ? terark_bsr_u64(maxd) + 1 : 0;
+	}
+}
+
+template<class Int>
+size_t
+ZipIntStore::estimateBlockSize(const Int* values, size_t rows, ZipMode mode)
+const {
+	const size_t blockNum = (rows + BlockRows - 1) / BlockRows;
+	const size_t step = std::max<size_t>(blockNum / 64, 1);
+	size_t sampled = 0, bitsSum = 0;
+	for (size_t blk = 0; blk < blockNum; blk += step) {
+		size_t beg = blk * BlockRows;
+		size_t num = std::min(BlockRows, rows - beg);
+		ullong base, slope;
+		size_t bits = zipOneBlock(values + beg, num,
+			ZipMode::BlockLinear == mode, &base, &slope, NULL);
+		if (bits > 58) // UintVecMin0::fast_get limit
+			return size_t(-1);
+		bitsSum += bits;
+		sampled++;
+	}
+	return bitsSum * BlockRows / 8 * blockNum / sampled
+		+ sizeof(BlockHeader) * blockNum + 16;
+}
+
+template<class Int>
+void ZipIntStore::zipBlocks(const Int* values, size_t rows, ZipMode mode) {
+	BOOST_STATIC_ASSERT(sizeof(BlockHeader) == 24);
+	const ullong flip = zintKey(Int(0)); // key -> value
+	const size_t blockNum = (rows + BlockRows - 1) / BlockRows;
+	valvec<byte> blockData(sizeof(BlockHeader) * blockNum, valvec_reserve());
+	blockData.resize_no_init(sizeof(BlockHeader) * blockNum);
+	ullong packed[BlockRows];
+	for (size_t blk = 0; blk < blockNum; ++blk) {
+		size_t beg = blk * BlockRows;
+		size_t num = std::min(BlockRows, rows - beg);
+		ullong base, slope;
+		size_t bits = zipOneBlock(values + beg, num,
+			ZipMode::BlockLinear == mode, &base, &slope, packed);
+		if (bits > 58) {
+			THROW_STD(logic_error, "bits=%zd is too large(max=58)", bits);
+		}
+		size_t offset = blockData.size();
+		BlockHeader* hdr = (BlockHeader*)blockData.data() + blk;
+		hdr->base = base - flip;
+		hdr->slope = slope;
+		hdr->offsetAndBits = uint64_t(offset) << 8 | bits;
+		if (bits) {
+			UintVecMin0 uv(num, (ullong(1) << bits) - 1);
+			for (size_t i = 0; i < num; ++i)
+				uv.set_wire(i, size_t(packed[i]));
+			blockData.append(uv.data(), (bits * num + 7) / 8);
+		}
+	}
+	blockData.resize(blockData.size() + 16, 0); // for unaligned_load
+	m_blockData.swap(blockData);
+	m_blockModeRows = rows;
+	m_zipMode = mode;
+	m_minValue = 0;
+	m_dedup.clear();
+	m_index.clear();
+}
+
 template<class Int>
 void ZipIntStore::zipValues(const void* data, size_t size) {
 	size_t rows = size / sizeof(Int);
@@ -130,6 +327,18 @@ void ZipIntStore::zipValues(const void* data, size_t size) {
 	else {
 		m_dedup.swap(dup);
 	}
+
+	// block modes are used only when they are clearly smaller, because
+	// they need one more memory access for random reads
+	if (rows >= BlockRows) {
+		size_t plainSize = m_dedup.mem_size() + m_index.mem_size();
+		size_t forSize = estimateBlockSize(values, rows, ZipMode::BlockFOR);
+		size_t linSize = estimateBlockSize(values, rows, ZipMode::BlockLinear);
+		ZipMode mode = linSize < forSize ? ZipMode::BlockLinear : ZipMode::BlockFOR;
+		if (std::min(forSize, linSize) < plainSize / 8 * 7) {
+			zipBlocks(values, rows, mode);
+		}
+	}
 }
 
 void ZipIntStore::build(ColumnType keyType, SortableStrVec& strVec) {
@@ -181,7 +390,8 @@ namespace {
 		uint32_t uniqNum;
 		uint8_t  intBits;
 		uint8_t  intType;
-		uint16_t padding1;
+		uint8_t  zipMode;
+		uint8_t  padding1;
 		uint32_t padding2;
 		uint64_t padding3;
 		 int64_t minValue;
@@ -194,11 +404,17 @@ TERARK_DB_REGISTER_STORE("zint", ZipIntStore);
 void ZipIntStore::load(PathRef fpath) {
 	assert(fstring(fpath.string()).endsWith(".zint"));
 	bool writable = false;
-	m_mmapBase = (byte_t*)mmap_load(fpath.string(), &m_mmapSize, writable, m_schema.m_mmapPopulate);
+	m_mmapBase = (byte_t*)DbEnv::current()->mmapLoad(fpath.string(), &m_mmapSize, writable, m_schema.m_mmapPopulate);
 	auto header = (const ZipIntStoreHeader*)m_mmapBase;
 	size_t rows = header->rows;
 	m_intType = ColumnType(header->intType);
 	m_minValue  = header->minValue;
+	m_zipMode = ZipMode(header->zipMode);
+	if (ZipMode::Plain != m_zipMode) {
+		m_blockModeRows = rows;
+		m_blockData.risk_set_data((byte*)(header+1), m_mmapSize - sizeof(*header));
+		return;
+	}
 	m_dedup.risk_set_data((byte*)(header+1), header->uniqNum, header->intBits);
 	if (header->uniqNum != rows) {
 		assert(header->uniqNum < rows);
@@ -210,13 +426,14 @@ void ZipIntStore::load(PathRef fpath) {
 
 void ZipIntStore::save(PathRef path) const {
 	auto fpath = path + ".zint";
-	NativeDataOutput<FileStream> dio;
+	NativeDataOutput<EnvFileStream> dio;
 	dio.open(fpath.string().c_str(), "wb");
 	ZipIntStoreHeader header;
 	header.rows = uint32_t(numDataRows());
 	header.uniqNum = m_dedup.size();
 	header.intBits = byte(m_dedup.uintbits());
 	header.intType = byte(m_intType);
+	header.zipMode = byte(m_zipMode);
 	header.padding1 = 0;
 	header.padding2 = 0;
 	header.padding3 = 0;
@@ -224,6 +441,7 @@ void ZipIntStore::save(PathRef path) const {
 	dio.ensureWrite(&header, sizeof(header));
 	dio.ensureWrite(m_dedup.data(), m_dedup.mem_size());
 	dio.ensureWrite(m_index.data(), m_index.mem_size());
+	dio.ensureWrite(m_blockData.data(), m_blockData.size());
 }
 
 }} // namespace terark::db
@@ -16,6 +16,8 @@ public:
 	llong dataInflateSize() const override;
 	llong numDataRows() const override;
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	size_t getFieldArray(llong beg, size_t num, size_t offset, size_t len,
+						 valvec<byte>* buf, const byte** data) const override;
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
 
@@ -24,19 +26,45 @@ public:
 	void save(PathRef path) const override;
 
 protected:
+	// Plain     : m_dedup, or m_dedup + m_index
+	// BlockFOR  : per block minimum, value = base + packed[i]
+	// BlockLinear: per block linear prediction, value = base + slope*i + packed[i],
+	//             residuals of timestamp/sequence columns are near zero
+	enum class ZipMode : uint8_t {
+		Plain,
+		BlockFOR,
+		BlockLinear,
+	};
+	struct BlockHeader;
+	static const size_t BlockRows = 256;
+
 	UintVecMin0 m_dedup;
 	UintVecMin0 m_index;
 	byte_t*     m_mmapBase;
 	size_t      m_mmapSize;
 	llong       m_minValue; // may be unsigned
 	ColumnType  m_intType;
+	ZipMode     m_zipMode;
+	size_t      m_blockModeRows;
+	valvec<byte> m_blockData; // BlockHeader array + packed residuals
 	const Schema& m_schema;
 
+	ullong blockValue(size_t recIdx) const;
+
 	template<class Int>
 	void valueAppend(size_t recIdx, valvec<byte>* res) const;
 
+	template<class Int>
+	void valuesDecode(size_t beg, size_t num, byte* out) const;
+
 	template<class Int>
 	void zipValues(const void* data, size_t size);
+
+	template<class Int>
+	size_t estimateBlockSize(const Int* values, size_t rows, ZipMode) const;
+
+	template<class Int>
+	void zipBlocks(const Int* values, size_t rows, ZipMode);
 };
 
 }} // namespace terark::db
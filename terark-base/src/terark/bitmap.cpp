@@ -170,6 +170,7 @@ void febitvec::reserve(size_t newcap) {
 		bm_uint_t* q = (bm_uint_t*)realloc(m_words, newcap/8);
 		if (NULL == q)
 			throw std::bad_alloc();
+		onLargeMemAlloc(q, newcap/8);
 		m_words = q;
 		m_capacity = newcap;
 	}
@@ -192,6 +193,7 @@ void febitvec::resize_no_init(size_t newsize) {
 		bm_uint_t* q = (bm_uint_t*)realloc(m_words, newcap/8);
 		if (NULL == q)
 			throw std::bad_alloc();
+		onLargeMemAlloc(q, newcap/8);
 		m_words = q;
 		m_capacity = newcap;
 	}
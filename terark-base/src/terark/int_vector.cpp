@@ -0,0 +1,84 @@
+#include "int_vector.hpp"
+#if defined(__BMI2__) || defined(__AVX2__)
+	#include <immintrin.h>
+#endif
+
+namespace terark {
+
+#if defined(__BMI2__) && TERARK_WORD_BITS == 64
+// unpack 64/LaneBits values of a group by one pdep, a group must be read by
+// one unaligned 64 bit load, so (64/LaneBits)*bits + bit_idx%8 <= 64
+template<size_t LaneBits>
+static inline
+size_t pdep_get_range(const byte* data, size_t bits, size_t beg, size_t end,
+					  size_t* out) {
+	const size_t  Group = 64 / LaneBits;
+	const uint64_t laneMask = (uint64_t(1) << bits) - 1;
+	uint64_t depMask = 0;
+	for (size_t j = 0; j < Group; ++j)
+		depMask |= laneMask << (LaneBits * j);
+	size_t i = beg;
+	for (; i + Group <= end; i += Group) {
+		size_t bit_idx = bits * i;
+		uint64_t w = unaligned_load<uint64_t>(data + bit_idx / 8) >> bit_idx % 8;
+		uint64_t x = _pdep_u64(w, depMask);
+		for (size_t j = 0; j < Group; ++j)
+			out[i - beg + j] = size_t(x >> (LaneBits * j)) & laneMask;
+	}
+	return i;
+}
+#endif
+
+#if defined(__AVX2__) && TERARK_WORD_BITS == 64
+static inline
+size_t avx2_get_range(const byte* data, size_t bits, size_t mask,
+					  size_t beg, size_t end, size_t* out) {
+	const __m256i vmask = _mm256_set1_epi64x(mask);
+	const __m256i step  = _mm256_set1_epi64x(4 * bits);
+	const __m256i seven = _mm256_set1_epi64x(7);
+	__m256i bitIdx = _mm256_set_epi64x(bits * (beg + 3), bits * (beg + 2),
+									   bits * (beg + 1), bits * (beg + 0));
+	size_t i = beg;
+	for (; i + 4 <= end; i += 4) {
+		__m256i byteIdx = _mm256_srli_epi64(bitIdx, 3);
+		__m256i shift = _mm256_and_si256(bitIdx, seven);
+		__m256i w = _mm256_i64gather_epi64((const long long*)data, byteIdx, 1);
+		w = _mm256_and_si256(_mm256_srlv_epi64(w, shift), vmask);
+		_mm256_storeu_si256((__m256i*)(out + (i - beg)), w);
+		bitIdx = _mm256_add_epi64(bitIdx, step);
+	}
+	return i;
+}
+#endif
+
+void UintVecMin0::fast_get_range(const byte* data, size_t bits, size_t mask,
+								 size_t beg, size_t end, size_t* out) {
+	size_t i = beg;
+	if (0 == bits) {
+		std::fill_n(out, end - beg, size_t(0));
+		return;
+	}
+#if defined(__BMI2__) && TERARK_WORD_BITS == 64
+	// max bit offset in the first byte of a group
+	const size_t pad = bits % 8 ? 7 : 0;
+	if (bits <= 8 && 8 * bits + pad <= 64)
+		i = pdep_get_range<8>(data, bits, beg, end, out);
+	else if (bits <= 16 && 4 * bits + pad <= 64)
+		i = pdep_get_range<16>(data, bits, beg, end, out);
+	else if (bits <= 32 && 2 * bits + pad <= 64)
+		i = pdep_get_range<32>(data, bits, beg, end, out);
+	else
+#endif
+	{
+#if defined(__AVX2__) && TERARK_WORD_BITS == 64
+		i = avx2_get_range(data, bits, mask, beg, end, out);
+#endif
+	}
+	size_t bit_idx = bits * i;
+	for (; i < end; ++i, bit_idx += bits) {
+		size_t val = unaligned_load<size_t>(data + bit_idx / 8);
+		out[i - beg] = (val >> bit_idx % 8) & mask;
+	}
+}
+
+} // namespace terark
@@ -89,6 +89,17 @@ public:
 		return (val >> bit_idx % 8) & mask;
 	}
 
+	/// out[i - beg] = get(i) for i in [beg, end), for scanning sequential
+	/// ranges, it is vectorized by BMI2 pdep/AVX2 gather if enabled by build
+	void get_range(size_t beg, size_t end, size_t* out) const {
+		assert(beg <= end);
+		assert(end <= m_size);
+		fast_get_range(m_data.data(), m_bits, m_mask, beg, end, out);
+	}
+	static TERARK_DLL_EXPORT
+	void fast_get_range(const byte* data, size_t bits, size_t mask,
+						size_t beg, size_t end, size_t* out);
+
 	void set_wire(size_t idx, size_t val) {
 		assert(idx < m_size);
 		assert(val <= m_mask);
@@ -170,6 +181,27 @@ public:
 	}
 };
 
+// Read ahead buffer for sequential UintVecMin0::get, such as in iterators,
+// refills a window of values by get_range when idx is out of the window
+class UintVecMin0ReadAhead {
+	static const size_t WindowSize = 64;
+	size_t m_beg;
+	size_t m_end;
+	size_t m_buf[WindowSize];
+public:
+	UintVecMin0ReadAhead() : m_beg(0), m_end(0) {}
+	void clear() { m_beg = m_end = 0; }
+	size_t get(const UintVecMin0& vec, size_t idx) {
+		if (idx - m_beg >= m_end - m_beg) {
+			assert(idx < vec.size());
+			m_beg = idx;
+			m_end = std::min(idx + WindowSize, vec.size());
+			vec.get_range(m_beg, m_end, m_buf);
+		}
+		return m_buf[idx - m_beg];
+	}
+};
+
 template<class Int>
 class ZipIntVector : private UintVecMin0 {
 	Int  m_min_val;
@@ -0,0 +1,146 @@
+/* vim: set tabstop=4 : */
+#ifndef __terark_io_DataIO_VarIntGroup_h__
+#define __terark_io_DataIO_VarIntGroup_h__
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+# pragma once
+#endif
+
+#include <terark/valvec.hpp>
+#include <terark/io/var_int.hpp>
+#include <terark/io/stream_vbyte.hpp>
+#include <boost/static_assert.hpp>
+
+namespace terark {
+
+//! serialize a vector of 32/64 bit integers by stream_vbyte, used as:
+//! @code
+//!   dio << as_var_int_group(recIdvec, true); // recIdvec is sorted
+//!   auto group = as_var_int_group(recIdvec);
+//!   dio >> group;
+//! @endcode
+//! format:
+//!   var_size_t(n), byte(flags), var_size_t(bytes), low 32 bits stream,
+//!   if flags & HighPart: var_size_t(bytes), high 32 bits stream
+//! when sorted, the deltas are encoded. High 32 bits are written only if
+//! some 64 bit value(or delta) does not fit in 32 bits.
+template<class Vec>
+class var_int_group_ref {
+	typedef typename Vec::value_type Int;
+	BOOST_STATIC_ASSERT(sizeof(Int) == 4 || sizeof(Int) == 8);
+	enum { Sorted = 1, HighPart = 2 };
+	Vec*  m_vec;
+	bool  m_sorted;
+
+	template<class Output>
+	static void save_stream(Output& out, const uint32_t* p, size_t n,
+							bool delta, valvec<byte>& buf) {
+		buf.resize_no_init(stream_vbyte_max_bytes(n));
+		size_t bytes = delta ? stream_vbyte_encode_delta(p, n, buf.data())
+							 : stream_vbyte_encode(p, n, buf.data());
+		out << var_size_t(bytes);
+		out.ensureWrite(buf.data(), bytes);
+	}
+	template<class Input>
+	static void load_stream(Input& in, uint32_t* p, size_t n,
+							bool delta, valvec<byte>& buf) {
+		size_t bytes = in.template load_as<var_size_t>();
+		if (bytes > stream_vbyte_max_bytes(n)) {
+			throw std::runtime_error("var_int_group: bad stream size");
+		}
+		buf.resize_no_init(bytes);
+		in.ensureRead(buf.data(), bytes);
+		size_t used = delta ? stream_vbyte_decode_delta(buf.data(), n, p)
+							: stream_vbyte_decode(buf.data(), n, p);
+		if (used != bytes) {
+			throw std::runtime_error("var_int_group: bad stream data");
+		}
+	}
+
+public:
+	var_int_group_ref(Vec& vec, bool sorted) : m_vec(&vec), m_sorted(sorted) {}
+
+	template<class Output>
+	friend void DataIO_saveObject(Output& out, const var_int_group_ref& x) {
+		const Vec& vec = *x.m_vec;
+		const size_t n = vec.size();
+		valvec<uint32_t> lo(n, valvec_no_init());
+		valvec<uint32_t> hi;
+		valvec<byte> buf;
+		byte flags = x.m_sorted ? Sorted : 0;
+		if (sizeof(Int) == 4) {
+			for (size_t i = 0; i < n; ++i) lo[i] = uint32_t(vec[i]);
+		}
+		else {
+			// 64 bit deltas are computed here, lo/hi are not delta coded
+			uint64_t prev = 0;
+			uint64_t bits = 0;
+			hi.resize_no_init(n);
+			for (size_t i = 0; i < n; ++i) {
+				uint64_t v = uint64_t(vec[i]);
+				uint64_t d = x.m_sorted ? v - prev : v;
+				prev = v;
+				lo[i] = uint32_t(d);
+				hi[i] = uint32_t(d >> 32);
+				bits |= d;
+			}
+			if (bits >> 32)
+				flags |= HighPart;
+		}
+		out << var_size_t(n);
+		out << flags;
+		if (0 == n)
+			return;
+		bool delta32 = sizeof(Int) == 4 && x.m_sorted;
+		save_stream(out, lo.data(), n, delta32, buf);
+		if (flags & HighPart)
+			save_stream(out, hi.data(), n, false, buf);
+	}
+
+	template<class Input>
+	friend void DataIO_loadObject(Input& in, var_int_group_ref x) {
+		Vec& vec = *x.m_vec;
+		const size_t n = in.template load_as<var_size_t>();
+		byte flags;
+		in >> flags;
+		vec.resize(n);
+		if (0 == n)
+			return;
+		valvec<byte> buf;
+		valvec<uint32_t> lo(n, valvec_no_init());
+		if (sizeof(Int) == 4) {
+			load_stream(in, lo.data(), n, (flags & Sorted) != 0, buf);
+			for (size_t i = 0; i < n; ++i) vec[i] = Int(lo[i]);
+			return;
+		}
+		load_stream(in, lo.data(), n, false, buf);
+		valvec<uint32_t> hi;
+		if (flags & HighPart) {
+			hi.resize_no_init(n);
+			load_stream(in, hi.data(), n, false, buf);
+		}
+		uint64_t prev = 0;
+		for (size_t i = 0; i < n; ++i) {
+			uint64_t d = lo[i];
+			if (flags & HighPart)
+				d |= uint64_t(hi[i]) << 32;
+			uint64_t v = flags & Sorted ? prev + d : d;
+			prev = v;
+			vec[i] = Int(v);
+		}
+	}
+};
+
+template<class Vec>
+inline var_int_group_ref<Vec> as_var_int_group(Vec& vec, bool sorted = false) {
+	return var_int_group_ref<Vec>(vec, sorted);
+}
+template<class Vec>
+inline const var_int_group_ref<Vec>
+as_var_int_group(const Vec& vec, bool sorted = false) {
+	return var_int_group_ref<Vec>(const_cast<Vec&>(vec), sorted);
+}
+
+} // namespace terark
+
+#endif // __terark_io_DataIO_VarIntGroup_h__
@@ -0,0 +1,55 @@
+/* vim: set tabstop=4 : */
+#include "MmapInputBuffer.hpp"
+#include "IOException.hpp"
+#include <terark/num_to_str.hpp>
+#include <terark/util/mmap.hpp>
+#include <boost/current_function.hpp>
+
+namespace terark {
+
+MmapInputBuffer::MmapInputBuffer() {
+	m_owns_mmap = false;
+}
+
+MmapInputBuffer::MmapInputBuffer(const void* base, size_t size) {
+	m_owns_mmap = false;
+	set(base, size);
+}
+
+MmapInputBuffer::~MmapInputBuffer() {
+	close();
+}
+
+void MmapInputBuffer::open(fstring fpath, bool populate) {
+	close();
+	size_t size = 0;
+	void* base = mmap_load(fpath.str(), &size, false, populate);
+	set(base, size);
+	m_owns_mmap = true;
+}
+
+void MmapInputBuffer::set(const void* base, size_t size) {
+	close();
+	m_beg = m_pos = (byte*)base;
+	m_end = m_beg + size;
+	m_capacity = size;
+}
+
+void MmapInputBuffer::close() {
+	if (m_owns_mmap && m_beg) {
+		mmap_close(m_beg, m_end - m_beg);
+	}
+	m_owns_mmap = false;
+	// m_beg is not malloc'ed, IOBufferBase must not free it
+	m_beg = m_pos = m_end = NULL;
+	m_capacity = 0;
+}
+
+void MmapInputBuffer::throw_eof(size_t length) const {
+	string_appender<> oss;
+	oss << "\"" << BOOST_CURRENT_FUNCTION << "\""
+		<< ", ReadBytes[want=" << length << ", remain=" << (m_end - m_pos) << "]";
+	throw EndOfFileException(oss);
+}
+
+} // namespace terark
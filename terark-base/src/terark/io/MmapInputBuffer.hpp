@@ -0,0 +1,88 @@
+/* vim: set tabstop=4 : */
+#ifndef __terark_io_MmapInputBuffer_h__
+#define __terark_io_MmapInputBuffer_h__
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+# pragma once
+#endif
+
+#include "StreamBuffer.hpp"
+#include <terark/fstring.hpp>
+#include <terark/valvec.hpp>
+#include <type_traits>
+
+namespace terark {
+
+//! InputBuffer whose buffer is a whole mmap'ed file, so read/ensureRead
+//! and var int reads of DataInput never touch a stream, and reading over
+//! the end throws EndOfFileException.
+//!
+//! zc_load/zc_load_uintvec make a valvec/UintVecMin0 reference the mapped
+//! bytes instead of copying them, the caller must then call
+//! risk_release_ownership of x before the mapping is closed. zc_load
+//! copies if the bytes are not aligned for T, and returns false.
+class TERARK_DLL_EXPORT MmapInputBuffer : public InputBuffer
+{
+	bool m_owns_mmap;
+
+public:
+	MmapInputBuffer();
+	//! not owned, [base, base+size) must be valid during the lifetime
+	MmapInputBuffer(const void* base, size_t size);
+	~MmapInputBuffer();
+
+	//! mmap the whole file readonly, the buffer owns the mapping
+	void open(fstring fpath, bool populate = false);
+	void set(const void* base, size_t size); //!< not owned
+	void close();
+
+	//! the caller takes the mapping [bufbeg(), bufend()), it outlives the
+	//! buffer, for keeping zc_load'ed vectors alive
+	void release_mmap() { m_owns_mmap = false; }
+
+	//! @return pointer to the next length bytes and skip them
+	const byte* zc_read(size_t length) {
+		if (terark_unlikely(m_pos + length > m_end))
+			throw_eof(length);
+		const byte* p = m_pos;
+		m_pos += length;
+		return p;
+	}
+
+	//! layout is the same as DataIO of valvec of pod: var_size_t(n), T[n]
+	template<class T>
+	bool zc_load(valvec<T>& x) {
+		return zc_load_array(x, this->read_var_uint64());
+	}
+
+	//! n raw elements without size prefix
+	template<class T>
+	bool zc_load_array(valvec<T>& x, size_t n) {
+		static_assert(std::is_trivially_destructible<T>::value, "T must be pod");
+		const byte* p = zc_read(sizeof(T) * n);
+		if (size_t(p) % std::alignment_of<T>::value != 0) {
+			x.resize_no_init(n);
+			memcpy(x.data(), p, sizeof(T) * n);
+			return false;
+		}
+		x.risk_set_data((T*)p, n);
+		return true;
+	}
+
+	//! data of UintVecMin0 is UintVecMin0::compute_mem_size bytes, the
+	//! padding tail is touched by fast_get so it must be in the file too,
+	//! fast_get is unaligned, so it is always referenced
+	template<class UintVec>
+	void zc_load_uintvec(UintVec& x, size_t num, size_t bits) {
+		size_t bytes = 0 == num ? 0 : UintVec::compute_mem_size(bits, num);
+		const byte* p = zc_read(bytes);
+		x.risk_set_data((byte*)p, num, bits);
+	}
+
+private:
+	terark_no_return void throw_eof(size_t length) const;
+};
+
+} // namespace terark
+
+#endif // __terark_io_MmapInputBuffer_h__
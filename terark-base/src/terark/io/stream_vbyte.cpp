@@ -0,0 +1,148 @@
+/* vim: set tabstop=4 : */
+#include "stream_vbyte.hpp"
+#include <string.h>
+
+#if defined(__SSSE3__)
+	#include <tmmintrin.h>
+	#define TERARK_STREAM_VBYTE_SSSE3
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	#include <arm_neon.h>
+	#define TERARK_STREAM_VBYTE_NEON
+#endif
+
+namespace terark {
+
+namespace {
+
+// shuffle masks and data lengths of the 256 control bytes
+struct StreamVbyteTables {
+	unsigned char shuf[256][16];
+	unsigned char len[256];
+	StreamVbyteTables() {
+		for (int c = 0; c < 256; ++c) {
+			int pos = 0;
+			for (int k = 0; k < 4; ++k) {
+				int n = (c >> (2*k) & 3) + 1;
+				for (int b = 0; b < 4; ++b)
+					shuf[c][4*k + b] = b < n ? (unsigned char)(pos + b) : 0x80;
+				pos += n;
+			}
+			len[c] = (unsigned char)pos;
+		}
+	}
+};
+const StreamVbyteTables& vbyteTables() {
+	static const StreamVbyteTables t;
+	return t;
+}
+
+inline int value_len(uint32_t x) {
+	return x < (1u << 8) ? 0 : x < (1u << 16) ? 1 : x < (1u << 24) ? 2 : 3;
+}
+
+template<bool Delta>
+size_t encode(const uint32_t* in, size_t n, unsigned char* out, uint32_t prev) {
+	unsigned char* ctrl = out;
+	unsigned char* data = out + (n + 3) / 4;
+	memset(ctrl, 0, (n + 3) / 4);
+	for (size_t i = 0; i < n; ++i) {
+		uint32_t x = in[i];
+		if (Delta) {
+			uint32_t d = x - prev;
+			prev = x;
+			x = d;
+		}
+		int l = value_len(x);
+		ctrl[i / 4] |= (unsigned char)(l << (2 * (i % 4)));
+		for (int b = 0; b <= l; ++b)
+			*data++ = (unsigned char)(x >> (8 * b));
+	}
+	return data - out;
+}
+
+inline uint32_t decode_one(const unsigned char*& data, int l) {
+	uint32_t x = data[0];
+	for (int b = 1; b <= l; ++b)
+		x |= uint32_t(data[b]) << (8 * b);
+	data += l + 1;
+	return x;
+}
+
+template<bool Delta>
+size_t decode(const unsigned char* in, size_t n, uint32_t* out, uint32_t prev) {
+	const unsigned char* ctrl = in;
+	const unsigned char* data = in + (n + 3) / 4;
+	size_t i = 0;
+#if defined(TERARK_STREAM_VBYTE_SSSE3) || defined(TERARK_STREAM_VBYTE_NEON)
+	// a group has at least 4 data bytes, the 16 bytes load of a group is
+	// in the buffer if 3 more full groups follow it
+	const StreamVbyteTables& t = vbyteTables();
+	const size_t groups = n / 4;
+	const size_t simdGroups = groups > 3 ? groups - 3 : 0;
+  #if defined(TERARK_STREAM_VBYTE_SSSE3)
+	__m128i vprev = _mm_set1_epi32(int(prev));
+	for (size_t g = 0; g < simdGroups; ++g) {
+		unsigned c = ctrl[g];
+		__m128i v = _mm_loadu_si128((const __m128i*)data);
+		v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)t.shuf[c]));
+		if (Delta) {
+			v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+			v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+			v = _mm_add_epi32(v, vprev);
+			vprev = _mm_shuffle_epi32(v, 0xFF);
+		}
+		_mm_storeu_si128((__m128i*)(out + 4*g), v);
+		data += t.len[c];
+	}
+	if (Delta && simdGroups)
+		prev = uint32_t(_mm_cvtsi128_si32(vprev));
+  #else
+	uint32x4_t vprev = vdupq_n_u32(prev);
+	const uint32x4_t zero = vdupq_n_u32(0);
+	for (size_t g = 0; g < simdGroups; ++g) {
+		unsigned c = ctrl[g];
+		uint8x16_t b = vqtbl1q_u8(vld1q_u8(data), vld1q_u8(t.shuf[c]));
+		uint32x4_t v = vreinterpretq_u32_u8(b);
+		if (Delta) {
+			v = vaddq_u32(v, vextq_u32(zero, v, 3));
+			v = vaddq_u32(v, vextq_u32(zero, v, 2));
+			v = vaddq_u32(v, vprev);
+			vprev = vdupq_laneq_u32(v, 3);
+		}
+		vst1q_u32(out + 4*g, v);
+		data += t.len[c];
+	}
+	if (Delta && simdGroups)
+		prev = vgetq_lane_u32(vprev, 0);
+  #endif
+	i = 4 * simdGroups;
+#endif
+	for (; i < n; ++i) {
+		uint32_t x = decode_one(data, ctrl[i / 4] >> (2 * (i % 4)) & 3);
+		if (Delta) {
+			x += prev;
+			prev = x;
+		}
+		out[i] = x;
+	}
+	return data - in;
+}
+
+} // namespace
+
+size_t stream_vbyte_encode(const uint32_t* in, size_t n, unsigned char* out) {
+	return encode<false>(in, n, out, 0);
+}
+size_t stream_vbyte_decode(const unsigned char* in, size_t n, uint32_t* out) {
+	return decode<false>(in, n, out, 0);
+}
+size_t stream_vbyte_encode_delta(const uint32_t* in, size_t n,
+								 unsigned char* out, uint32_t prev) {
+	return encode<true>(in, n, out, prev);
+}
+size_t stream_vbyte_decode_delta(const unsigned char* in, size_t n,
+								 uint32_t* out, uint32_t prev) {
+	return decode<true>(in, n, out, prev);
+}
+
+} // namespace terark
@@ -0,0 +1,43 @@
+/* vim: set tabstop=4 : */
+#ifndef __terark_io_stream_vbyte_hpp__
+#define __terark_io_stream_vbyte_hpp__
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+# pragma once
+#endif
+
+#include <stddef.h>
+#include <terark/config.hpp>
+#include <terark/stdtypes.hpp>
+
+namespace terark {
+
+//! Group varint of uint32 in stream-vbyte layout: all control bytes come
+//! first, a control byte has 2 bits(len-1) for each of 4 values, then the
+//! data bytes of the values, little endian. Decoding 4 values is just one
+//! shuffle(SSSE3/NEON), with no branch on the value length.
+//!  - delta versions encode in[i] - in[i-1], in must be non-decreasing
+//!  - decode does not read beyond the encoded bytes
+
+//! max encoded bytes of n values
+inline size_t stream_vbyte_max_bytes(size_t n) { return (n + 3) / 4 + 4 * n; }
+
+//! @return encoded bytes
+TERARK_DLL_EXPORT size_t
+stream_vbyte_encode(const uint32_t* in, size_t n, unsigned char* out);
+
+//! @return consumed bytes
+TERARK_DLL_EXPORT size_t
+stream_vbyte_decode(const unsigned char* in, size_t n, uint32_t* out);
+
+TERARK_DLL_EXPORT size_t
+stream_vbyte_encode_delta(const uint32_t* in, size_t n, unsigned char* out,
+						  uint32_t prev = 0);
+
+TERARK_DLL_EXPORT size_t
+stream_vbyte_decode_delta(const unsigned char* in, size_t n, uint32_t* out,
+						  uint32_t prev = 0);
+
+} // namespace terark
+
+#endif // __terark_io_stream_vbyte_hpp__
@@ -1,6 +1,9 @@
 #include "rank_select.hpp"
 #include "rank_select_inline.hpp"
 #include <terark/util/throw.hpp>
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 namespace terark {
 
@@ -664,11 +667,21 @@ void rank_select_se_512::build_cache(bool speed_select0, bool speed_select1) {
 		size_t r = 0;
 		uint64_t rela = 0;
 		BOOST_STATIC_ASSERT(LineBits/64 == 8);
+	#if defined(__AVX512VPOPCNTDQ__)
+		// popcount the whole line by one instruction
+		uint64_t cnt[8];
+		_mm512_storeu_si512(cnt, _mm512_popcnt_epi64(
+				_mm512_loadu_si512(pBit64 + i*(LineBits/64))));
+		#define SE512_LINE_POPCNT(j) cnt[j]
+	#else
+		#define SE512_LINE_POPCNT(j) fast_popcount(pBit64[i*(LineBits/64) + j])
+	#endif
 		for(size_t j = 0; j < (LineBits/64); ++j) {
-			r += fast_popcount(pBit64[i*(LineBits/64) + j]);
+			r += SE512_LINE_POPCNT(j);
 			rela |= uint64_t(r) << (j*9); // last 'r' will not be in 'rela'
 		//	printf("i = %zd, j = %zd, r = %zd\n", i, j, r);
 		}
+	#undef SE512_LINE_POPCNT
 		rela &= uint64_t(-1) >> 1; // set unused bit as zero
 		rank_cache[i].base = uint32_t(Rank1);
 		rank_cache[i].rela = rela;
@@ -793,8 +806,8 @@ size_t rank_select_se_512::select0(size_t Rank0) const {
 #undef select0_nth64
 }
 
-size_t rank_select_se_512::select1(size_t Rank1) const {
-	GUARD_MAX_RANK(1, Rank1);
+// returns lo, line (lo-1) has the bit of Rank1
+inline size_t rank_select_se_512::select1_line(size_t Rank1) const {
 	size_t lo, hi;
 	if (m_sel1_cache) { // get the very small [lo, hi) range
 		lo = m_sel1_cache[Rank1 / LineBits];
@@ -815,13 +828,34 @@ size_t rank_select_se_512::select1(size_t Rank1) const {
 			hi = mid;
 	}
 	assert(Rank1 < rank_cache[lo].base);
-	size_t hit = rank_cache[lo].base;
+	return lo;
+}
+
+inline size_t
+rank_select_se_512::select1_in_line(size_t lo, size_t Rank1) const {
+	const RankCache512* rank_cache = m_rank_cache;
 	const bm_uint_t* bm_words = this->bldata();
 	size_t line_bitpos = (lo-1) * LineBits;
 	uint64_t rcRela = rank_cache[lo-1].rela;
-	hit = rank_cache[lo-1].base;
+	size_t hit = rank_cache[lo-1].base;
 	const uint64_t* pBit64 = (const uint64_t*)(bm_words + LineWords * (lo-1));
 
+#if defined(__AVX512F__)
+	{
+		// rank512(rcRela, k) for k in [0, 8) by one compare, the word is
+		// the last k whose prefix count is <= Rank1 - hit
+		const __m512i shift = _mm512_set_epi64(54, 45, 36, 27, 18, 9, 0, 0);
+		__m512i prefix = _mm512_and_si512(
+			_mm512_srlv_epi64(_mm512_set1_epi64(rcRela), shift),
+			_mm512_set_epi64(511, 511, 511, 511, 511, 511, 511, 0));
+		size_t r = Rank1 - hit;
+		__mmask8 le = _mm512_cmple_epu64_mask(prefix, _mm512_set1_epi64(r));
+		size_t n = fast_popcount32(le) - 1;
+		return line_bitpos + 64*n +
+			UintSelect1(pBit64[n], r - (n ? rcRela >> (n-1)*9 & 511 : 0));
+	}
+#endif
+
 #define select1_nth64(n) line_bitpos + 64*n + \
 	 UintSelect1(pBit64[n], Rank1 - (hit + rank512(rcRela, n)))
 
@@ -851,6 +885,70 @@ size_t rank_select_se_512::select1(size_t Rank1) const {
 #undef select1_nth64
 }
 
+size_t rank_select_se_512::select1(size_t Rank1) const {
+	GUARD_MAX_RANK(1, Rank1);
+	return select1_in_line(select1_line(Rank1), Rank1);
+}
+
+#if defined(_MSC_VER)
+	#include <xmmintrin.h>
+	#define SE512_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+	#define SE512_PREFETCH(p) __builtin_prefetch(p)
+#endif
+
+// must be small, prefetched lines should not be evicted before used
+static const size_t SE512_PrefetchDist = 8;
+
+void rank_select_se_512::
+rank1_batch(const size_t* bitpos, size_t n, size_t* out) const {
+	const RankCache512* rank_cache = m_rank_cache;
+	const uint64_t* pu64 = (const uint64_t*)this->m_words;
+	for (size_t i = 0; i < n && i < SE512_PrefetchDist; ++i) {
+		SE512_PREFETCH(rank_cache + bitpos[i] / 512);
+		SE512_PREFETCH(pu64 + bitpos[i] / 64);
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (i + SE512_PrefetchDist < n) {
+			size_t ahead = bitpos[i + SE512_PrefetchDist];
+			SE512_PREFETCH(rank_cache + ahead / 512);
+			SE512_PREFETCH(pu64 + ahead / 64);
+		}
+		out[i] = rank1(bitpos[i]);
+	}
+}
+
+// items are processed by groups of SE512_PrefetchDist, the sel1 cache of
+// the next group is prefetched, the lines of a group are located first and
+// their bit lines are prefetched, then the bits are selected in the lines
+void rank_select_se_512::
+select1_batch(const size_t* ranks, size_t n, size_t* out) const {
+	const size_t dist = SE512_PrefetchDist;
+	const uint32_t* sel1 = m_sel1_cache;
+	const bm_uint_t* bm_words = this->bldata();
+	size_t lines[SE512_PrefetchDist];
+	if (sel1) {
+		for (size_t i = 0; i < n && i < dist; ++i)
+			SE512_PREFETCH(sel1 + ranks[i] / LineBits);
+	}
+	for (size_t beg = 0; beg < n; beg += dist) {
+		size_t num = std::min(n - beg, dist);
+		if (sel1) {
+			size_t upp = std::min(n, beg + 2*dist);
+			for (size_t i = beg + dist; i < upp; ++i)
+				SE512_PREFETCH(sel1 + ranks[i] / LineBits);
+		}
+		for (size_t j = 0; j < num; ++j) {
+			assert(ranks[beg + j] < m_max_rank1);
+			size_t lo = select1_line(ranks[beg + j]);
+			SE512_PREFETCH(bm_words + LineWords * (lo-1));
+			lines[j] = lo;
+		}
+		for (size_t j = 0; j < num; ++j)
+			out[beg + j] = select1_in_line(lines[j], ranks[beg + j]);
+	}
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
@@ -36,10 +36,18 @@ public:
 	size_t rank0(size_t bitpos) const;
 	size_t select0(size_t id) const;
 	size_t select1(size_t id) const;
+
+	///@{ out[i] = rank1(bitpos[i]) or select1(ranks[i]), memory of items
+	/// ahead is prefetched, so the cache misses of the items are overlapped
+	void rank1_batch(const size_t* bitpos, size_t n, size_t* out) const;
+	void select1_batch(const size_t* ranks, size_t n, size_t* out) const;
+	///@}
 	size_t max_rank1() const { return m_max_rank1; }
 	size_t max_rank0() const { return m_max_rank0; }
 protected:
 	void nullize_cache();
+	size_t select1_line(size_t id) const;
+	size_t select1_in_line(size_t line, size_t id) const;
 #pragma pack(push,4)
 	struct RankCache512 {
 		uint32_t  base;
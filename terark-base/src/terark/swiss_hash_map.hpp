@@ -0,0 +1,393 @@
+#ifndef __terark_swiss_hash_map_hpp__
+#define __terark_swiss_hash_map_hpp__
+
+#include "hash_common.hpp"
+#include "fstring.hpp"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define TERARK_SWISS_HASH_SSE2
+#endif
+
+namespace terark {
+
+/// hash of swiss_hash_map, the std hash of integers is identity, it is
+/// mixed because swiss_hash_map uses the low 7 bits as the metadata byte
+/// and the high bits as the group index
+template<class Key>
+struct swiss_hash {
+	size_t operator()(const Key& x) const {
+		uint64_t h = uint64_t(std::hash<Key>()(x));
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return size_t(h);
+	}
+};
+
+/// word at a time hash of bytes, 8 bytes per multiply
+inline size_t swiss_hash_bytes(const void* data, size_t len) {
+	const unsigned char* p = (const unsigned char*)data;
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ (len * 0xC2B2AE3D27D4EB4FULL);
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	if (len) {
+		uint64_t w = 0;
+		memcpy(&w, p, len);
+		h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+	}
+	h ^= h >> 29;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
+	return size_t(h);
+}
+template<>
+struct swiss_hash<fstring> {
+	size_t operator()(fstring x) const { return swiss_hash_bytes(x.data(), x.size()); }
+};
+template<>
+struct swiss_hash<std::string> {
+	size_t operator()(const std::string& x) const { return swiss_hash_bytes(x.data(), x.size()); }
+	size_t operator()(fstring x) const { return swiss_hash_bytes(x.data(), x.size()); }
+};
+
+/// Open addressing hash map with SwissTable style probing:
+///
+///   - slots are in groups of 16, each slot has a metadata byte which is
+///     Empty, Deleted or the low 7 bits of the hash(h2)
+///   - a lookup loads the 16 metadata bytes of a group, compares them with
+///     h2 by SSE2, then just checks keys of the matched slots, the probe
+///     is ended by a group which has an Empty slot
+///   - groups are probed quadratically from the group of the high bits
+///
+/// The index api(find_i, end_i, key, val, insert_i, erase_i) is same as
+/// gold_hash_map, the index is a slot index, it is invalidated by insert
+/// which grows the table. The iterator api is same as std::unordered_map,
+/// elem is std::pair<Key, Value>.
+///
+/// @note compared with gold_hash_map, there is no link per elem and no
+///       bucket array, a miss does not touch elems
+template<class Key, class Value,
+		 class HashEqual = hash_and_equal<Key, swiss_hash<Key>, std::equal_to<Key> > >
+class swiss_hash_map : private HashEqual {
+public:
+	typedef Key   key_type;
+	typedef Value mapped_type;
+	typedef std::pair<Key, Value> value_type;
+	typedef size_t size_type;
+
+private:
+	enum : signed char { Empty = -128, Deleted = -2 };
+	static const size_t GroupSize = 16;
+
+	signed char* m_ctrl;  // m_cap metadata bytes
+	value_type*  m_slots;
+	size_t m_cap;    // 0 or power of 2, >= GroupSize
+	size_t m_size;
+	size_t m_growth; // number of inserts before grow, Deleted slots use it
+
+	static signed char h2(size_t h) { return (signed char)(h & 127); }
+
+	// bitmask of slots in group g whose ctrl is c
+	unsigned match(size_t g, signed char c) const {
+		const signed char* ctrl = m_ctrl + g * GroupSize;
+#if defined(TERARK_SWISS_HASH_SSE2)
+		__m128i grp = _mm_loadu_si128((const __m128i*)ctrl);
+		return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(grp, _mm_set1_epi8(c)));
+#else
+		unsigned mask = 0;
+		for (size_t i = 0; i < GroupSize; ++i)
+			mask |= unsigned(ctrl[i] == c) << i;
+		return mask;
+#endif
+	}
+	// bitmask of Empty or Deleted slots in group g
+	unsigned match_free(size_t g) const {
+		const signed char* ctrl = m_ctrl + g * GroupSize;
+#if defined(TERARK_SWISS_HASH_SSE2)
+		// Empty and Deleted are negative, full slot is [0, 127]
+		__m128i grp = _mm_loadu_si128((const __m128i*)ctrl);
+		return (unsigned)_mm_movemask_epi8(grp);
+#else
+		unsigned mask = 0;
+		for (size_t i = 0; i < GroupSize; ++i)
+			mask |= unsigned(ctrl[i] < 0) << i;
+		return mask;
+#endif
+	}
+	static size_t lowest_bit(unsigned mask) {
+		assert(mask);
+#if defined(__GNUC__) || defined(__clang__)
+		return (size_t)__builtin_ctz(mask);
+#else
+		size_t i = 0;
+		while (!(mask & 1)) { mask >>= 1; i++; }
+		return i;
+#endif
+	}
+
+	template<class CompatibleKey>
+	size_t find_slot(const CompatibleKey& key, size_t h) const {
+		if (0 == m_cap)
+			return m_cap;
+		const size_t gmask = m_cap / GroupSize - 1;
+		size_t g = (h >> 7) & gmask;
+		for (size_t step = 1; ; ++step) {
+			for (unsigned m = match(g, h2(h)); m; m &= m - 1) {
+				size_t i = g * GroupSize + lowest_bit(m);
+				if (HashEqual::equal(m_slots[i].first, key))
+					return i;
+			}
+			if (match(g, Empty))
+				return m_cap;
+			if (step > gmask)
+				return m_cap; // all groups are probed
+			g = (g + step) & gmask;
+		}
+	}
+	size_t find_free(size_t h) const {
+		const size_t gmask = m_cap / GroupSize - 1;
+		size_t g = (h >> 7) & gmask;
+		for (size_t step = 1; ; ++step) {
+			if (unsigned m = match_free(g))
+				return g * GroupSize + lowest_bit(m);
+			g = (g + step) & gmask;
+		}
+	}
+
+	void init(size_t cap) {
+		m_ctrl = (signed char*)malloc(cap);
+		m_slots = (value_type*)malloc(sizeof(value_type) * cap);
+		if (NULL == m_ctrl || NULL == m_slots) {
+			free(m_ctrl);
+			free(m_slots);
+			throw std::bad_alloc();
+		}
+		memset(m_ctrl, Empty, cap);
+		m_cap = cap;
+		m_size = 0;
+		m_growth = cap / 8 * 7;
+	}
+	void destroy() {
+		for (size_t i = 0; i < m_cap; ++i)
+			if (m_ctrl[i] >= 0)
+				m_slots[i].~value_type();
+		free(m_ctrl);
+		free(m_slots);
+	}
+	void rehash(size_t newcap) {
+		signed char* oldctrl = m_ctrl;
+		value_type*  oldslots = m_slots;
+		size_t oldcap = m_cap;
+		size_t oldsize = m_size;
+		init(newcap);
+		for (size_t i = 0; i < oldcap; ++i) {
+			if (oldctrl[i] >= 0) {
+				size_t h = HashEqual::hash(oldslots[i].first);
+				size_t j = find_free(h);
+				m_ctrl[j] = h2(h);
+				new(&m_slots[j]) value_type(std::move(oldslots[i]));
+				oldslots[i].~value_type();
+			}
+		}
+		m_size = oldsize;
+		m_growth -= oldsize;
+		free(oldctrl);
+		free(oldslots);
+	}
+	void grow_for_insert() {
+		if (0 == m_cap)
+			init(GroupSize);
+		else if (m_size * 32 <= m_cap * 25)
+			rehash(m_cap); // too many Deleted, cleanup
+		else
+			rehash(m_cap * 2);
+	}
+
+public:
+	template<class Map, class Elem>
+	class iterator_tpl {
+		friend class swiss_hash_map;
+		Map*   m_map;
+		size_t m_idx;
+		iterator_tpl(Map* m, size_t i) : m_map(m), m_idx(i) {}
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef Elem      value_type;
+		typedef ptrdiff_t difference_type;
+		typedef Elem*     pointer;
+		typedef Elem&     reference;
+		iterator_tpl() : m_map(NULL), m_idx(0) {}
+		template<class M2, class E2>
+		iterator_tpl(const iterator_tpl<M2, E2>& y) : m_map(y.get_owner()), m_idx(y.get_index()) {}
+		Map*   get_owner() const { return m_map; }
+		size_t get_index() const { return m_idx; }
+		Elem& operator*() const { return m_map->m_slots[m_idx]; }
+		Elem* operator->() const { return &m_map->m_slots[m_idx]; }
+		iterator_tpl& operator++() { m_idx = m_map->next_i(m_idx); return *this; }
+		iterator_tpl operator++(int) { iterator_tpl t = *this; ++*this; return t; }
+		bool operator==(const iterator_tpl& y) const { return m_idx == y.m_idx; }
+		bool operator!=(const iterator_tpl& y) const { return m_idx != y.m_idx; }
+	};
+	typedef iterator_tpl<swiss_hash_map, value_type> iterator;
+	typedef iterator_tpl<const swiss_hash_map, const value_type> const_iterator;
+
+	swiss_hash_map() : m_ctrl(NULL), m_slots(NULL), m_cap(0), m_size(0), m_growth(0) {}
+	explicit swiss_hash_map(const HashEqual& he)
+	  : HashEqual(he), m_ctrl(NULL), m_slots(NULL), m_cap(0), m_size(0), m_growth(0) {}
+	swiss_hash_map(const swiss_hash_map& y)
+	  : HashEqual(y), m_ctrl(NULL), m_slots(NULL), m_cap(0), m_size(0), m_growth(0) {
+		reserve(y.m_size);
+		for (size_t i = 0; i < y.m_cap; ++i)
+			if (y.m_ctrl[i] >= 0)
+				insert_i(y.m_slots[i].first, y.m_slots[i].second);
+	}
+	swiss_hash_map& operator=(const swiss_hash_map& y) {
+		if (this != &y) {
+			swiss_hash_map t(y);
+			swap(t);
+		}
+		return *this;
+	}
+	~swiss_hash_map() { if (m_cap) destroy(); }
+
+	void swap(swiss_hash_map& y) {
+		std::swap(static_cast<HashEqual&>(*this), static_cast<HashEqual&>(y));
+		std::swap(m_ctrl, y.m_ctrl);
+		std::swap(m_slots, y.m_slots);
+		std::swap(m_cap, y.m_cap);
+		std::swap(m_size, y.m_size);
+		std::swap(m_growth, y.m_growth);
+	}
+
+	size_t size() const { return m_size; }
+	bool  empty() const { return 0 == m_size; }
+	size_t capacity() const { return m_cap; }
+
+	void clear() {
+		if (m_cap) {
+			destroy();
+			m_ctrl = NULL;
+			m_slots = NULL;
+			m_cap = m_size = m_growth = 0;
+		}
+	}
+	void reserve(size_t n) {
+		size_t cap = GroupSize;
+		while (cap / 8 * 7 < n)
+			cap *= 2;
+		if (cap > m_cap)
+			rehash(cap);
+	}
+
+	///@{ index api, same as gold_hash_map
+	size_t end_i() const { return m_cap; }
+	size_t beg_i() const { return next_i(size_t(-1)); }
+	size_t next_i(size_t i) const {
+		for (++i; i < m_cap; ++i)
+			if (m_ctrl[i] >= 0)
+				return i;
+		return m_cap;
+	}
+	template<class CompatibleKey>
+	size_t find_i(const CompatibleKey& key) const {
+		return find_slot(key, HashEqual::hash(key));
+	}
+	const Key& key(size_t i) const { assert(i < m_cap && m_ctrl[i] >= 0); return m_slots[i].first; }
+	      Value& val(size_t i)       { assert(i < m_cap && m_ctrl[i] >= 0); return m_slots[i].second; }
+	const Value& val(size_t i) const { assert(i < m_cap && m_ctrl[i] >= 0); return m_slots[i].second; }
+	      value_type& elem_at(size_t i)       { assert(i < m_cap && m_ctrl[i] >= 0); return m_slots[i]; }
+	const value_type& elem_at(size_t i) const { assert(i < m_cap && m_ctrl[i] >= 0); return m_slots[i]; }
+
+	///@return (slot index, true if inserted)
+	std::pair<size_t, bool> insert_i(const Key& key, const Value& val = Value()) {
+		const size_t h = HashEqual::hash(key);
+		size_t i = find_slot(key, h);
+		if (i != m_cap)
+			return std::make_pair(i, false);
+		if (0 == m_growth || 0 == m_cap)
+			grow_for_insert();
+		i = find_free(h);
+		if (Empty == m_ctrl[i])
+			m_growth--; // reuse of Deleted slot does not consume m_growth
+		new(&m_slots[i]) value_type(key, val);
+		m_ctrl[i] = h2(h);
+		m_size++;
+		return std::make_pair(i, true);
+	}
+	void erase_i(size_t i) {
+		assert(i < m_cap && m_ctrl[i] >= 0);
+		m_slots[i].~value_type();
+		// if the group has an Empty slot, no probe passes through it
+		size_t g = i / GroupSize;
+		if (match(g, Empty)) {
+			m_ctrl[i] = Empty;
+			m_growth++;
+		} else {
+			m_ctrl[i] = Deleted;
+		}
+		m_size--;
+	}
+	///@}
+
+	template<class CompatibleKey>
+	size_t erase(const CompatibleKey& key) {
+		size_t i = find_i(key);
+		if (i == m_cap)
+			return 0;
+		erase_i(i);
+		return 1;
+	}
+	void erase(iterator iter) { erase_i(iter.m_idx); }
+
+	template<class CompatibleKey>
+	bool exists(const CompatibleKey& key) const { return find_i(key) != m_cap; }
+	template<class CompatibleKey>
+	size_t count(const CompatibleKey& key) const { return find_i(key) != m_cap ? 1 : 0; }
+
+	Value& operator[](const Key& key) {
+		size_t i = insert_i(key).first; // m_slots may be changed by insert_i
+		return m_slots[i].second;
+	}
+
+	std::pair<iterator, bool> emplace(const Key& key, const Value& val) {
+		std::pair<size_t, bool> ib = insert_i(key, val);
+		return std::make_pair(iterator(this, ib.first), ib.second);
+	}
+	std::pair<iterator, bool> insert(const value_type& kv) { return emplace(kv.first, kv.second); }
+
+	template<class CompatibleKey>
+	iterator find(const CompatibleKey& key) { return iterator(this, find_i(key)); }
+	template<class CompatibleKey>
+	const_iterator find(const CompatibleKey& key) const { return const_iterator(this, find_i(key)); }
+
+	iterator begin() { return iterator(this, beg_i()); }
+	iterator end()   { return iterator(this, m_cap); }
+	const_iterator begin() const { return const_iterator(this, beg_i()); }
+	const_iterator end()   const { return const_iterator(this, m_cap); }
+
+	template<class OP>
+	void for_each(OP op) {
+		for (size_t i = 0; i < m_cap; ++i)
+			if (m_ctrl[i] >= 0)
+				op(m_slots[i]);
+	}
+};
+
+} // namespace terark
+
+#endif // __terark_swiss_hash_map_hpp__
@@ -8,6 +8,7 @@
 //#include <deque>
 //#include <boost/circular_buffer.hpp>
 #include <terark/util/concurrent_queue.hpp>
+#include <terark/util/mpmc_queue.hpp>
 #include <stdio.h>
 #include <iostream>
 
@@ -39,13 +40,13 @@ PipelineTask::~PipelineTask()
 }
 
 //typedef concurrent_queue<std::deque<PipelineQueueItem> > base_queue;
-typedef util::concurrent_queue<circular_queue<PipelineQueueItem> > base_queue;
+//typedef util::concurrent_queue<circular_queue<PipelineQueueItem> > base_queue;
+typedef util::mpmc_ring_queue<PipelineQueueItem> base_queue;
 class PipelineStage::queue_t : public base_queue
 {
 public:
 	queue_t(size_t size) : base_queue(size)
 	{
-		base_queue::queue().init(size);
 	}
 };
 
@@ -54,6 +55,13 @@ PipelineStage::ThreadData::ThreadData() : m_run(false) {
 }
 PipelineStage::ThreadData::~ThreadData() {}
 
+// items popped by a thread of the stage but not yet processed,
+// sibling threads of the stage may steal from it
+struct PipelineStage::StealQueue {
+	mutex lock;
+	valvec<PipelineQueueItem> items; // owner takes back, thief takes front
+};
+
 //////////////////////////////////////////////////////////////////////////
 
 PipelineStage::PipelineStage(int thread_count)
@@ -75,6 +83,9 @@ PipelineStage::PipelineStage(int thread_count)
 	}
 	assert(0 < thread_count);
 	m_plserial = 0;
+	m_batch_size = 1;
+	m_work_stealing = false;
+	m_steal_queues = NULL;
 	m_prev = m_next = NULL;
 	m_out_queue = NULL;
 	m_threads.resize(thread_count);
@@ -82,6 +93,7 @@ PipelineStage::PipelineStage(int thread_count)
 
 PipelineStage::~PipelineStage()
 {
+	delete[] m_steal_queues;
 	delete m_out_queue;
 	for (size_t threadno = 0; threadno != m_threads.size(); ++threadno)
 	{
@@ -106,6 +118,16 @@ void PipelineStage::setOutputQueueSize(size_t size) {
 	}
 }
 
+void PipelineStage::setBatchSize(size_t n) {
+	assert(NULL == m_owner || !m_owner->isRunning());
+	m_batch_size = n ? n : 1;
+}
+
+void PipelineStage::setWorkStealing(bool enable) {
+	assert(NULL == m_owner || !m_owner->isRunning());
+	m_work_stealing = enable;
+}
+
 const std::string& PipelineStage::err(int threadno) const
 {
 	return m_threads[threadno].m_err_text;
@@ -163,6 +185,10 @@ void PipelineStage::start(int queue_size)
 	if (m_threads.size() == 0) {
 		throw std::runtime_error("thread count = 0");
 	}
+	if (m_work_stealing && ple_none == m_pl_enum && m_threads.size() > 1) {
+		if (NULL == m_steal_queues)
+			m_steal_queues = new StealQueue[m_threads.size()];
+	}
 
 	for (size_t threadno = 0; threadno != m_threads.size(); ++threadno)
 	{
@@ -245,6 +271,20 @@ void PipelineStage::run_wrapper(int threadno)
 
 		m_owner->stop();
 
+		// items held by this thread will never be processed
+		valvec<PipelineQueueItem>& outbuf = m_threads[threadno].m_outbuf;
+		if (m_steal_queues) {
+			StealQueue& sq = m_steal_queues[threadno];
+			PipelineLockGuard lock(sq.lock);
+			outbuf.append(sq.items);
+			sq.items.erase_all();
+		}
+		for (size_t i = 0; i < outbuf.size(); ++i) {
+			if (outbuf[i].task)
+				m_owner->destroyTask(outbuf[i].task);
+		}
+		outbuf.erase_all();
+
 		if (m_prev != m_owner->m_head)
 		{ // 不是第一个 step, 清空前一个 step 的 out_queue
 			while (!m_prev->m_out_queue->empty() || m_prev->isRunning())
@@ -278,7 +318,9 @@ void PipelineStage::run(int threadno)
 			break;
 		case ple_none:
 		case ple_generate:
-			if (this == m_owner->m_head->m_prev)
+			if (m_batch_size > 1 || m_steal_queues)
+				run_step_batch(threadno);
+			else if (this == m_owner->m_head->m_prev)
 				run_step_last(threadno);
 			else
 				run_step_mid(threadno);
@@ -309,9 +351,10 @@ void PipelineStage::run_step_first(int threadno)
  			//	queue_t::MutexLockSentry lock(*m_out_queue); // not need lock
 				item.plserial = ++m_plserial;
 			}
-			m_out_queue->push_back(item);
+			push_out(threadno, item);
 		}
 	}
+	flush_out(threadno);
 }
 
 void PipelineStage::run_step_last(int threadno)
@@ -354,6 +397,116 @@ void PipelineStage::run_step_mid(int threadno)
 	}
 }
 
+void PipelineStage::push_out(int threadno, const PipelineQueueItem& item)
+{
+	if (1 == m_batch_size) {
+		m_out_queue->push_back(item);
+		return;
+	}
+	valvec<PipelineQueueItem>& outbuf = m_threads[threadno].m_outbuf;
+	outbuf.push_back(item);
+	if (outbuf.size() >= m_batch_size)
+		flush_out(threadno);
+}
+
+void PipelineStage::flush_out(int threadno)
+{
+	valvec<PipelineQueueItem>& outbuf = m_threads[threadno].m_outbuf;
+	if (!outbuf.empty()) {
+		m_out_queue->push_back_n(outbuf.data(), outbuf.size());
+		outbuf.erase_all();
+	}
+}
+
+void PipelineStage::batch_do_item(int threadno, PipelineQueueItem& item)
+{
+	if (ple_generate == m_pl_enum) // only 1 thread, do not mutex lock
+		item.plserial = ++m_plserial;
+	if (item.task)
+		process(threadno, &item);
+	if (this == m_owner->m_head->m_prev) { // is last step
+		if (item.task)
+			m_owner->destroyTask(item.task);
+	}
+	else if (item.task || m_owner->m_keepSerial)
+		push_out(threadno, item);
+}
+
+// take (the older) half of items of a sibling thread into own StealQueue
+bool PipelineStage::steal(int threadno)
+{
+	const size_t n = m_threads.size();
+	valvec<PipelineQueueItem> stolen;
+	for (size_t k = 1; k < n && stolen.empty(); ++k) {
+		StealQueue& victim = m_steal_queues[(threadno + k) % n];
+		PipelineLockGuard lock(victim.lock);
+		size_t cnt = (victim.items.size() + 1) / 2;
+		if (cnt) {
+			stolen.assign(victim.items.data(), cnt);
+			victim.items.erase_i(0, cnt);
+		}
+	}
+	if (stolen.empty())
+		return false;
+	StealQueue& mine = m_steal_queues[threadno];
+	PipelineLockGuard lock(mine.lock);
+	mine.items.append(stolen);
+	return true;
+}
+
+// same as run_step_mid/run_step_last, but items are popped by batch,
+// and when m_steal_queues is not NULL, an idle thread steals from siblings
+void PipelineStage::run_step_batch(int threadno)
+{
+	assert(ple_none == m_pl_enum || (ple_generate == m_pl_enum && m_threads.size() == 1));
+	const size_t batch = m_batch_size;
+	const int timeout = m_owner->m_queue_timeout;
+	queue_t* inq = m_prev->m_out_queue;
+	valvec<PipelineQueueItem> buf(batch);
+	if (NULL == m_steal_queues) {
+		while (isPrevRunning()) {
+			size_t n = inq->pop_front_n(buf.data(), batch, timeout);
+			for (size_t i = 0; i < n; ++i)
+				batch_do_item(threadno, buf[i]);
+			if (inq->empty())
+				flush_out(threadno); // do not hold items when input is idle
+		}
+		flush_out(threadno);
+		return;
+	}
+	StealQueue& mine = m_steal_queues[threadno];
+	for (;;) {
+		PipelineQueueItem item;
+		bool hasItem = false;
+		{
+			PipelineLockGuard lock(mine.lock);
+			if (!mine.items.empty()) {
+				item = mine.items.back();
+				mine.items.pop_back();
+				hasItem = true;
+			}
+		}
+		if (hasItem) {
+			batch_do_item(threadno, item);
+			continue;
+		}
+		size_t n = inq->try_pop_front_n(buf.data(), batch);
+		if (0 == n && !steal(threadno)) {
+			flush_out(threadno);
+			if (!isPrevRunning())
+				break;
+			n = inq->pop_front_n(buf.data(), batch, timeout);
+		}
+		if (n) {
+			// reversed, so the owner takes items in queue order
+			std::reverse(buf.begin(), buf.begin() + n);
+			PipelineLockGuard lock(mine.lock);
+			mine.items.append(buf.data(), n);
+		}
+	}
+	flush_out(threadno);
+}
+
 namespace {
 //SAME_NAME_MEMBER_COMPARATOR_EX(plserial_greater, uintptr_t, uintptr_t, .plserial, std::greater<uintptr_t>)
 //SAME_NAME_MEMBER_COMPARATOR_EX(plserial_less   , uintptr_t, uintptr_t, .plserial, std::less   <uintptr_t>)
@@ -374,7 +527,7 @@ struct plserial_less {
 
 void PipelineStage::serial_step_do_mid(PipelineQueueItem& item)
 {
-	m_out_queue->push_back(item);
+	push_out(0, item);
 }
 void PipelineStage::serial_step_do_last(PipelineQueueItem& item)
 {
@@ -453,10 +606,18 @@ void PipelineStage::run_serial_step_fast(int threadno,
 	ptrdiff_t head = 0;
 	valvec<PipelineQueueItem> cache(nlen), overflow;
 	m_plserial = 1; // this is expected_serial
-	while (isPrevRunning()) {
-		PipelineQueueItem item;
-		if (!m_prev->m_out_queue->pop_front(item, m_owner->m_queue_timeout))
+	valvec<PipelineQueueItem> inbuf(m_batch_size);
+	size_t inpos = 0, incnt = 0;
+	while (isPrevRunning() || inpos < incnt) {
+		if (inpos == incnt) {
+			if (m_prev->m_out_queue->empty())
+				flush_out(threadno); // do not hold items when input is idle
+			inpos = 0;
+			incnt = m_prev->m_out_queue->pop_front_n(inbuf.data(),
+							inbuf.size(), m_owner->m_queue_timeout);
 			continue;
+		}
+		PipelineQueueItem item = inbuf[inpos++];
 		CHECK_SERIAL()
 		ptrdiff_t diff = item.plserial - m_plserial; // diff is in [0, nlen)
 		//  not all equivalent to cycle queue, so it is not 'diff < nlen-1'
@@ -507,6 +668,8 @@ void PipelineStage::run_serial_step_fast(int threadno,
 			process(threadno, i);
 		(this->*fdo)(*i);
 	}
+	if (m_out_queue)
+		flush_out(threadno);
 }
 
 //////////////////////////////////////////////////////////////////////////
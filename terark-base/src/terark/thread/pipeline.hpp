@@ -88,6 +88,7 @@ protected:
 		std::string m_err_text;
 		thread*  m_thread;
 		volatile size_t m_run; // size_t is a CPU word, should be bool
+		valvec<PipelineQueueItem> m_outbuf; // pending batch of m_out_queue
 
 		ThreadData();
 		~ThreadData();
@@ -99,12 +100,21 @@ protected:
 		ple_keep
 	} m_pl_enum;
 	uintptr_t m_plserial;
+	size_t m_batch_size;
+	bool   m_work_stealing;
+	struct StealQueue;
+	StealQueue* m_steal_queues; // one per thread, NULL if not stealing
 
 	void run_wrapper(int threadno);
 
 	void run_step_first(int threadno);
 	void run_step_last(int threadno);
 	void run_step_mid(int threadno);
+	void run_step_batch(int threadno);
+	void batch_do_item(int threadno, PipelineQueueItem& item);
+	bool steal(int threadno);
+	void push_out(int threadno, const PipelineQueueItem& item);
+	void flush_out(int threadno);
 
 	void run_serial_step_slow(int threadno, void (PipelineStage::*fdo)(PipelineQueueItem&));
 	void run_serial_step_fast(int threadno, void (PipelineStage::*fdo)(PipelineQueueItem&));
@@ -143,6 +153,17 @@ public:
 	size_t getInputQueueSize()  const;
 	size_t getOutputQueueSize() const;
 	void setOutputQueueSize(size_t size);
+
+	//! items are popped from input queue and pushed to output queue by
+	//! batch of up to n items per queue operation, default is 1
+	//! @note output items are held until the batch is full or input is idle
+	void setBatchSize(size_t n);
+	size_t getBatchSize() const { return m_batch_size; }
+
+	//! for a multi-thread stage without serial keeping, an idle thread
+	//! steals half of the items popped but not yet processed by a sibling
+	//! thread, it is useful just if batch size > 1
+	void setWorkStealing(bool enable);
 };
 
 class TERARK_DLL_EXPORT FunPipelineStage : public PipelineStage
@@ -0,0 +1,164 @@
+#ifndef __terark_util_bsearch_hpp__
+#define __terark_util_bsearch_hpp__
+
+#include <terark/stdtypes.hpp>
+#include <terark/bitmanip.hpp>
+#include <terark/valvec.hpp>
+#include <assert.h>
+#include <stddef.h>
+
+#if defined(_MSC_VER)
+	#include <xmmintrin.h>
+#endif
+
+namespace terark {
+
+inline void bsearch_prefetch(const void* p) {
+#if defined(__GNUC__)
+	__builtin_prefetch(p);
+#elif defined(_MSC_VER)
+	_mm_prefetch((const char*)p, _MM_HINT_T0);
+#else
+	(void)p;
+#endif
+}
+
+struct bsearch_no_prefetch {
+	void operator()(size_t) const {}
+};
+
+/// Branchless binary search on [0, n) by a monotone predicate, less(i) is
+/// true for i in [0, result) and false for i in [result, n). The loop is
+/// a fixed log2(n) steps of conditional moves, the comparison result is
+/// not predicted. prefetch(i) is called on both candidate positions of the
+/// next step, so the latency of a cache miss overlaps with a step.
+template<class Less, class Prefetch>
+inline size_t branchless_lower_bound_fn(size_t n, Less less, Prefetch prefetch) {
+	if (0 == n)
+		return 0;
+	size_t base = 0;
+	while (n > 1) {
+		size_t half = n / 2;
+		prefetch(base + half / 2);
+		prefetch(base + half + half / 2);
+		base = less(base + half) ? base + half : base;
+		n -= half;
+	}
+	return base + less(base);
+}
+
+template<class Less>
+inline size_t branchless_lower_bound_fn(size_t n, Less less) {
+	return branchless_lower_bound_fn(n, less, bsearch_no_prefetch());
+}
+
+/// same as std::lower_bound(a, a + n, key) - a, comp is less
+template<class T, class Key, class Comp>
+inline size_t
+branchless_lower_bound(const T* a, size_t n, const Key& key, Comp comp) {
+	return branchless_lower_bound_fn(n,
+		[&](size_t i) { return comp(a[i], key); },
+		[a](size_t i) { bsearch_prefetch(a + i); });
+}
+template<class T, class Key>
+inline size_t branchless_lower_bound(const T* a, size_t n, const Key& key) {
+	return branchless_lower_bound_fn(n,
+		[&](size_t i) { return a[i] < key; },
+		[a](size_t i) { bsearch_prefetch(a + i); });
+}
+
+/// same as std::upper_bound(a, a + n, key) - a, comp is less
+template<class T, class Key, class Comp>
+inline size_t
+branchless_upper_bound(const T* a, size_t n, const Key& key, Comp comp) {
+	return branchless_lower_bound_fn(n,
+		[&](size_t i) { return !comp(key, a[i]); },
+		[a](size_t i) { bsearch_prefetch(a + i); });
+}
+template<class T, class Key>
+inline size_t branchless_upper_bound(const T* a, size_t n, const Key& key) {
+	return branchless_lower_bound_fn(n,
+		[&](size_t i) { return !(key < a[i]); },
+		[a](size_t i) { bsearch_prefetch(a + i); });
+}
+
+/// Eytzinger(bfs) ordered copy of a sorted array for hot small arrays, the
+/// first levels of the implicit tree share cache lines, and the children
+/// of a node are adjacent, so the nodes 4 levels down are prefetched by
+/// one cache line for 8 byte keys. Searches return ranks in the sorted
+/// array, it is rebuilt if the sorted array is changed.
+template<class T>
+class eytzinger_array {
+	valvec<T>      m_tree; // m_tree[0] is unused, m_tree[1..n] in bfs order
+	valvec<size_t> m_rank; // index in sorted order, m_rank[0] is n
+	size_t build(const T* sorted, size_t i, size_t k) {
+		if (k < m_tree.size()) {
+			i = build(sorted, i, 2*k);
+			m_tree[k] = sorted[i];
+			m_rank[k] = i++;
+			i = build(sorted, i, 2*k+1);
+		}
+		return i;
+	}
+	// k is the path of the search, drop trailing right-turns and the last
+	// left-turn, k == 0 means all nodes are less
+	size_t rankOf(size_t k) const {
+		k >>= fast_ctz64(~ullong(k)) + 1;
+		return m_rank[k];
+	}
+	static size_t prefetchDist() {
+		size_t d = 64 / sizeof(T);
+		return d ? d : 1;
+	}
+public:
+	eytzinger_array() { m_rank.push_back(0); }
+
+	size_t size() const { return m_rank[0]; }
+	bool  empty() const { return 0 == m_rank[0]; }
+
+	void build(const T* sorted, size_t n) {
+		m_tree.resize_no_init(n + 1);
+		m_rank.resize_no_init(n + 1);
+		if (n)
+			m_tree[0] = sorted[0];
+		m_rank[0] = n;
+		size_t i = build(sorted, 0, 1);
+		assert(i == n); (void)i;
+	}
+
+	/// same as std::lower_bound on the sorted array
+	template<class Key>
+	size_t lower_bound(const Key& key) const {
+		const T* tree = m_tree.data();
+		const size_t n = m_tree.size() - 1;
+		const size_t dist = 2 * prefetchDist();
+		size_t k = 1;
+		while (k <= n) {
+			bsearch_prefetch(tree + dist * k);
+			k = 2*k + (tree[k] < key);
+		}
+		return rankOf(k);
+	}
+
+	/// same as std::upper_bound on the sorted array
+	template<class Key>
+	size_t upper_bound(const Key& key) const {
+		const T* tree = m_tree.data();
+		const size_t n = m_tree.size() - 1;
+		const size_t dist = 2 * prefetchDist();
+		size_t k = 1;
+		while (k <= n) {
+			bsearch_prefetch(tree + dist * k);
+			k = 2*k + !(key < tree[k]);
+		}
+		return rankOf(k);
+	}
+
+	size_t mem_size() const {
+		return m_tree.capacity() * sizeof(T) + m_rank.capacity() * sizeof(size_t);
+	}
+};
+
+} // namespace terark
+
+#endif // __terark_util_bsearch_hpp__
@@ -61,8 +61,6 @@ BadCrc32cException(fstring msg, uint32_t old_crc32, uint32_t new_crc32)
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifndef __SSE4_2__
-
 /***
  *** What follows is derived from Intel's Slicing-by-8 CRC32 impl, which is BSD
  *** licensed and available from http://sourceforge.net/projects/slicing-by-8/
@@ -614,62 +612,210 @@ uint32_t crc32c_sb8_64_bit(uint32_t running_crc, const unsigned char* p_buf,
     return crc;
 }
 
-#else // __SSE4_2__
+///////////////////////////////////////////////////////////////////////////////
+// CRC of concatenation: crc(A+B) = shift(crc(A), len(B)) ^ crc(B) when
+// crc(B) is computed with initial value 0, shift(crc, n) is crc * x^(8n)
+// mod P in GF(2), both in the reflected bit order.
+
+static const uint32_t CRC32C_POLY = 0x82F63B78; // reflected 0x1EDC6F41
+
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = uint32_t(1) << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(8n) mod P
+static uint32_t crc32c_x8nmodp(size_t n) {
+    uint32_t p = uint32_t(1) << 31; // x^0
+    uint32_t xp = uint32_t(1) << 23; // x^8
+    while (n) {
+        if (n & 1)
+            p = crc32c_multmodp(xp, p);
+        xp = crc32c_multmodp(xp, xp);
+        n >>= 1;
+    }
+    return p;
+}
+
+// shift(crc, len) for a fixed len by table, shift is linear on crc bytes
+struct Crc32cShift {
+    uint32_t tab[4][256];
+    explicit Crc32cShift(size_t len) {
+        uint32_t xn = crc32c_x8nmodp(len);
+        for (int i = 0; i < 4; ++i)
+            for (uint32_t b = 0; b < 256; ++b)
+                tab[i][b] = crc32c_multmodp(xn, b << (8 * i));
+    }
+    uint32_t operator()(uint32_t crc) const {
+        return tab[0][crc & 255] ^ tab[1][crc >> 8 & 255]
+             ^ tab[2][crc >> 16 & 255] ^ tab[3][crc >> 24];
+    }
+};
 
-#if TERARK_WORD_BITS == 64
-#define CRC_WORD 8
-#define CRC_TYPE uint64_t
-#define CRC_FUNC _mm_crc32_u64
-#else
-#define CRC_WORD 4
-#define CRC_TYPE uint32_t
-#define CRC_FUNC _mm_crc32_u32
+///////////////////////////////////////////////////////////////////////////////
+// crc32 instruction of SSE4.2 and ARMv8, they are used if cpu supports,
+// so the binary is not required to be compiled with -msse4.2 or +crc
+
+#if defined(__GNUC__) || defined(__clang__)
+  #if defined(__x86_64__) || defined(__i386__)
+    #define TERARK_CRC32C_X86
+    #define TERARK_CRC32C_TARGET __attribute__((target("sse4.2")))
+  #elif defined(__aarch64__)
+    #define TERARK_CRC32C_ARM
+    #if defined(__ARM_FEATURE_CRC32)
+      #include <arm_acle.h>
+      #define TERARK_CRC32C_TARGET
+    #elif defined(__clang__)
+      #define TERARK_CRC32C_TARGET __attribute__((target("crc")))
+    #else
+      #define TERARK_CRC32C_TARGET __attribute__((target("+crc")))
+    #endif
+    #if defined(__linux__)
+      #include <sys/auxv.h>
+    #endif
+  #endif
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  #define TERARK_CRC32C_X86
+  #define TERARK_CRC32C_TARGET
 #endif
 
-/*
- * Use the crc32 instruction from SSE4.2 to compute our checksum - same
- * polynomial as the above function.
- */
-static really_inline
-uint32_t crc32c_sse42(uint32_t running_crc, const unsigned char* p_buf,
-                      const size_t length) {
-    uint32_t crc = running_crc;
+#if defined(TERARK_CRC32C_X86) || defined(TERARK_CRC32C_ARM)
 
-	if (terark_unlikely(length < CRC_WORD)) {
-		for (size_t i = 0; i < length; ++i) {
-		   crc = _mm_crc32_u8(crc, p_buf[i]);
-		}
-		return crc;
-	}
+#if defined(TERARK_CRC32C_X86)
+  #if TERARK_WORD_BITS == 64
+    #define CRC_WORD 8
+    typedef uint64_t crc_word_t;
+  #else
+    #define CRC_WORD 4
+    typedef uint32_t crc_word_t;
+  #endif
+  static inline TERARK_CRC32C_TARGET
+  uint32_t hw_crc_u8(uint32_t crc, unsigned char v) { return _mm_crc32_u8(crc, v); }
+  static inline TERARK_CRC32C_TARGET
+  uint32_t hw_crc_word(uint32_t crc, crc_word_t v) {
+  #if TERARK_WORD_BITS == 64
+    return (uint32_t)_mm_crc32_u64(crc, v);
+  #else
+    return _mm_crc32_u32(crc, v);
+  #endif
+  }
+  static bool crc32c_hw_supported() {
+  #if defined(__SSE4_2__)
+    return true;
+  #elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 20) & 1;
+  #else
+    return __builtin_cpu_supports("sse4.2");
+  #endif
+  }
+#else // TERARK_CRC32C_ARM
+  #define CRC_WORD 8
+  typedef uint64_t crc_word_t;
+  #if defined(__ARM_FEATURE_CRC32)
+  static inline uint32_t hw_crc_u8(uint32_t crc, unsigned char v) { return __crc32cb(crc, v); }
+  static inline uint32_t hw_crc_word(uint32_t crc, uint64_t v) { return __crc32cd(crc, v); }
+  #else
+  static inline TERARK_CRC32C_TARGET
+  uint32_t hw_crc_u8(uint32_t crc, unsigned char v) {
+    __asm__("crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"(v));
+    return crc;
+  }
+  static inline TERARK_CRC32C_TARGET
+  uint32_t hw_crc_word(uint32_t crc, uint64_t v) {
+    __asm__("crc32cx %w0, %w0, %x1" : "+r"(crc) : "r"(v));
+    return crc;
+  }
+  #endif
+  static bool crc32c_hw_supported() {
+  #if defined(__ARM_FEATURE_CRC32)
+    return true;
+  #elif defined(__linux__) && defined(HWCAP_CRC32)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+  #else
+    return false;
+  #endif
+  }
+#endif
+
+// bytes of each of the 3 interleaved streams, the crc instruction has a
+// latency of 3 cycles and a throughput of 1 cycle, 3 independent streams
+// keep it busy, then the stream crcs are combined by Crc32cShift
+static const size_t CRC_STREAM = 1024;
+
+static const Crc32cShift& crc32c_stream_shift() {
+    static const Crc32cShift shift(CRC_STREAM);
+    return shift;
+}
+
+static TERARK_CRC32C_TARGET
+uint32_t crc32c_hw(uint32_t running_crc, const unsigned char* p_buf,
+                   size_t length) {
+    uint32_t crc = running_crc;
 
     // Process byte-by-byte until p_buf is aligned
 
-    const unsigned char *aligned_buf = (const unsigned char *)ROUNDUP_PTR(p_buf, CRC_WORD);
-    size_t init_bytes = aligned_buf - p_buf;
-    size_t running_length = ((length - init_bytes)/CRC_WORD)*CRC_WORD;
-    size_t end_bytes = length - init_bytes - running_length;
+    while (length && (uintptr_t(p_buf) & (CRC_WORD - 1))) {
+        crc = hw_crc_u8(crc, *p_buf++);
+        length--;
+    }
 
-    while (p_buf < aligned_buf) {
-        crc = _mm_crc32_u8(crc, *p_buf++);
+    // 3 interleaved streams of CRC_STREAM bytes
+
+    if (length >= 3 * CRC_STREAM) {
+        const Crc32cShift& shift = crc32c_stream_shift();
+        do {
+            uint32_t crc1 = 0, crc2 = 0;
+            const unsigned char* end = p_buf + CRC_STREAM;
+            for (; p_buf < end; p_buf += CRC_WORD) {
+                crc  = hw_crc_word(crc , *(const crc_word_t*)(p_buf));
+                crc1 = hw_crc_word(crc1, *(const crc_word_t*)(p_buf + CRC_STREAM));
+                crc2 = hw_crc_word(crc2, *(const crc_word_t*)(p_buf + CRC_STREAM*2));
+            }
+            crc = shift(crc) ^ crc1;
+            crc = shift(crc) ^ crc2;
+            p_buf += CRC_STREAM * 2;
+            length -= CRC_STREAM * 3;
+        } while (length >= 3 * CRC_STREAM);
     }
 
     // Main aligned loop, processes a word at a time.
 
-    for (size_t li = 0; li < running_length/CRC_WORD; li++) {
-        CRC_TYPE block = *(const CRC_TYPE *)p_buf;
-        crc = CRC_FUNC(crc, block);
+    for (; length >= CRC_WORD; length -= CRC_WORD) {
+        crc = hw_crc_word(crc, *(const crc_word_t*)p_buf);
         p_buf += CRC_WORD;
     }
 
     // Remaining bytes
 
-    for(size_t li = 0; li < end_bytes; li++) {
-        crc = _mm_crc32_u8(crc, *p_buf++);
+    while (length--) {
+        crc = hw_crc_u8(crc, *p_buf++);
     }
 
     return crc;
 }
+#define TERARK_CRC32C_HW
+#endif // TERARK_CRC32C_X86 || TERARK_CRC32C_ARM
+
+typedef uint32_t (*Crc32cFunc)(uint32_t, const unsigned char*, size_t);
+
+static Crc32cFunc crc32c_choose() {
+#if defined(TERARK_CRC32C_HW)
+    if (crc32c_hw_supported())
+        return &crc32c_hw;
 #endif
+    return &crc32c_sb8_64_bit;
+}
 
 } // namespace terark
 
@@ -677,15 +823,15 @@ uint32_t crc32c_sse42(uint32_t running_crc, const unsigned char* p_buf,
 #ifdef VERIFY_ASSERTION
 #include <assert.h>
 #endif
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 namespace terark {
 // Externally visible function
 uint32_t Crc32c_update(uint32_t inCrc32, const void *buf, size_t bufLen) {
-#ifdef __SSE4_2__
-    uint32_t crc = crc32c_sse42(inCrc32, (const unsigned char *)buf, bufLen);
-#else
-    uint32_t crc = crc32c_sb8_64_bit(inCrc32, (const unsigned char *)buf, bufLen);
-#endif
+    static const Crc32cFunc crcFunc = crc32c_choose();
+    uint32_t crc = crcFunc(inCrc32, (const unsigned char *)buf, bufLen);
 
 #ifdef VERIFY_ASSERTION
     assert(crc == crc32c(inCrc32, (const unsigned char *)buf, bufLen));
@@ -694,5 +840,36 @@ uint32_t Crc32c_update(uint32_t inCrc32, const void *buf, size_t bufLen) {
     return crc;
 }
 
-} // namespace terark
+uint32_t Crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    return crc32c_multmodp(crc32c_x8nmodp(len2), crc1) ^ crc2;
+}
 
+uint32_t Crc32c_update_parallel(uint32_t inCrc32, const void *buf,
+                                size_t bufLen, size_t threadNum) {
+    const size_t minPartLen = 1 << 20;
+    if (0 == threadNum)
+        threadNum = std::max(1u, std::thread::hardware_concurrency());
+    threadNum = std::min(threadNum, bufLen / minPartLen);
+    if (threadNum <= 1)
+        return Crc32c_update(inCrc32, buf, bufLen);
+    const unsigned char* p = (const unsigned char*)buf;
+    const size_t partLen = bufLen / threadNum;
+    std::vector<uint32_t> crcs(threadNum);
+    std::vector<std::thread> threads;
+    threads.reserve(threadNum - 1);
+    for (size_t i = 1; i < threadNum; ++i) {
+        size_t len = i + 1 == threadNum ? bufLen - partLen * i : partLen;
+        threads.emplace_back([&crcs,p,partLen,len,i]() {
+            crcs[i] = Crc32c_update(0, p + partLen * i, len);
+        });
+    }
+    uint32_t crc = Crc32c_update(inCrc32, p, partLen);
+    for (size_t i = 1; i < threadNum; ++i) {
+        threads[i-1].join();
+        size_t len = i + 1 == threadNum ? bufLen - partLen * i : partLen;
+        crc = Crc32c_combine(crc, crcs[i], len);
+    }
+    return crc;
+}
+
+} // namespace terark
@@ -11,6 +11,17 @@ namespace terark {
 TERARK_DLL_EXPORT
 uint32_t Crc32c_update(uint32_t inCrc32, const void *buf, size_t bufLen);
 
+// crc of A+B, crc1 is crc of A, crc2 is crc of B with inCrc32 = 0
+TERARK_DLL_EXPORT
+uint32_t Crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+// same as Crc32c_update, buf is split into parts which are computed by
+// threadNum threads and then combined, for verifying large files.
+// threadNum = 0 means hardware concurrency, parts are at least 1MB
+TERARK_DLL_EXPORT
+uint32_t Crc32c_update_parallel(uint32_t inCrc32, const void *buf,
+								size_t bufLen, size_t threadNum = 0);
+
 // If crc32 does not match, user should throw this exception
 class TERARK_DLL_EXPORT BadCrc32cException : public std::logic_error {
 	typedef std::logic_error super;
@@ -0,0 +1,92 @@
+#include "large_mem.hpp"
+#include <terark/fstring.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <mutex>
+
+#if defined(__linux__)
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+	#include <malloc.h>
+#endif
+
+namespace terark {
+
+size_t g_largeMemThreshold = size_t(-1);
+
+static LargeMemPolicy g_largeMemPolicy;
+static std::mutex     g_largeMemMutex;
+
+void setLargeMemPolicy(const LargeMemPolicy& policy) {
+	std::lock_guard<std::mutex> lock(g_largeMemMutex);
+	g_largeMemPolicy = policy;
+#if defined(__GLIBC__)
+	if (policy.threshold) {
+		// glibc does not accept M_MMAP_THRESHOLD above 32MB(64bit),
+		// larger buffers are mmap-ed anyway after dynamic threshold
+		// adjust, they are just not guaranteed
+		size_t mmapThreshold = std::min<size_t>(policy.threshold, 32<<20);
+		if (!mallopt(M_MMAP_THRESHOLD, int(mmapThreshold))) {
+			fprintf(stderr, "WARN: setLargeMemPolicy: mallopt(M_MMAP_THRESHOLD, %zd) failed\n"
+					, mmapThreshold);
+		}
+	}
+#endif
+	g_largeMemThreshold = policy.threshold ? policy.threshold : size_t(-1);
+}
+
+LargeMemPolicy getLargeMemPolicy() {
+	std::lock_guard<std::mutex> lock(g_largeMemMutex);
+	return g_largeMemPolicy;
+}
+
+void largeMemAdvise(void* p, size_t bytes) {
+#if defined(__linux__)
+	const LargeMemPolicy policy = g_largeMemPolicy; // racy read is ok
+	const size_t pageSize = 4096;
+	size_t beg = (size_t(p) + pageSize - 1) & ~(pageSize - 1);
+	size_t end = (size_t(p) + bytes) & ~(pageSize - 1);
+	if (beg >= end)
+		return;
+  #if defined(MADV_HUGEPAGE)
+	if (policy.hugePage) {
+		madvise((void*)beg, end - beg, MADV_HUGEPAGE);
+	}
+  #endif
+  #if defined(SYS_mbind)
+	if (policy.numaNode >= 0 && policy.numaNode < 64) {
+		const int MPOL_PREFERRED_ = 1; // avoid dependency to libnuma
+		unsigned long nodemask = 1UL << policy.numaNode;
+		if (syscall(SYS_mbind, beg, end - beg, MPOL_PREFERRED_,
+					&nodemask, 64UL, 0U) != 0) {
+			static bool warned = false;
+			if (!warned) {
+				warned = true;
+				perror("WARN: largeMemAdvise: mbind");
+			}
+		}
+	}
+  #endif
+#else
+	(void)p; (void)bytes;
+#endif
+}
+
+namespace {
+	struct LargeMemPolicyEnvInit {
+		LargeMemPolicyEnvInit() {
+			LargeMemPolicy policy;
+			if (const char* env = getenv("TerarkLargeMemThreshold"))
+				policy.threshold = strtoull(env, NULL, 10);
+			policy.hugePage = getEnvLong("TerarkLargeMemHugePage", 1) != 0;
+			policy.numaNode = int(getEnvLong("TerarkLargeMemNumaNode", -1));
+			if (policy.threshold)
+				setLargeMemPolicy(policy);
+		}
+	};
+	static LargeMemPolicyEnvInit s_largeMemPolicyEnvInit;
+}
+
+} // namespace terark
@@ -0,0 +1,48 @@
+#ifndef __terark_util_large_mem_hpp__
+#define __terark_util_large_mem_hpp__
+
+#include <stddef.h>
+#include "../config.hpp"
+
+namespace terark {
+
+/// Process wide policy for large heap buffers of valvec, MemPool, febitvec
+/// ... (and everything built on them, such as SortableStrVec and the
+/// pool_type of TrbWritableStore).
+///
+/// Buffers are still malloc/realloc/free-ed, so risk_release_ownership()
+/// and free() keep working, but when a buffer reaches the threshold:
+///   - glibc M_MMAP_THRESHOLD is lowered to it, so realloc of such a
+///     buffer is mremap, grows without memcpy
+///   - its pages are madvise(MADV_HUGEPAGE)-ed, if hugePage
+///   - its pages are mbind(MPOL_PREFERRED) to numaNode, if numaNode >= 0
+///
+/// Initial policy is from env vars:
+///   TerarkLargeMemThreshold  threshold bytes, 0(default) disables policy
+///   TerarkLargeMemHugePage   default 1
+///   TerarkLargeMemNumaNode   default -1
+struct TERARK_DLL_EXPORT LargeMemPolicy {
+	size_t threshold; ///< 0 disables the policy
+	bool   hugePage;
+	int    numaNode;  ///< -1 means no binding
+	LargeMemPolicy() : threshold(0), hugePage(true), numaNode(-1) {}
+};
+
+TERARK_DLL_EXPORT void setLargeMemPolicy(const LargeMemPolicy&);
+TERARK_DLL_EXPORT LargeMemPolicy getLargeMemPolicy();
+
+/// size_t(-1) when the policy is disabled, just for the inline check
+TERARK_DLL_EXPORT extern size_t g_largeMemThreshold;
+
+/// apply the policy to the malloc-ed block [p, p+bytes)
+TERARK_DLL_EXPORT void largeMemAdvise(void* p, size_t bytes);
+
+/// called after a buffer is malloc/realloc-ed, cheap for small buffers
+inline void onLargeMemAlloc(void* p, size_t bytes) {
+	if (terark_unlikely(bytes >= g_largeMemThreshold))
+		largeMemAdvise(p, bytes);
+}
+
+} // namespace terark
+
+#endif // __terark_util_large_mem_hpp__
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdexcept>
+#include <algorithm>
 
 #ifdef _MSC_VER
 	#define WIN32_LEAN_AND_MEAN
@@ -131,5 +132,38 @@ mmap_load(const char* fname, size_t* fsize, bool writable, bool populate) {
 	return base;
 }
 
+void mmap_advise_willneed(const void* base, size_t size) {
+	if (0 == size) return;
+#ifdef _MSC_VER
+	WIN32_MEMORY_RANGE_ENTRY vm;
+	vm.VirtualAddress = const_cast<void*>(base);
+	vm.NumberOfBytes  = size;
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &vm, 0);
+#else
+	::madvise(const_cast<void*>(base), size, MADV_WILLNEED);
+#endif
+}
+
+size_t mmap_resident_bytes(const void* base, size_t size) {
+#ifdef _MSC_VER
+	(void)base; (void)size;
+	return 0;
+#else
+	const size_t pgsize = sysconf(_SC_PAGESIZE);
+	const size_t chunkPages = 4096;
+	unsigned char vec[chunkPages];
+	size_t resident = 0;
+	for (size_t pos = 0; pos < size; pos += chunkPages * pgsize) {
+		size_t len = std::min(size - pos, chunkPages * pgsize);
+		if (::mincore((char*)base + pos, len, vec) < 0)
+			return 0;
+		size_t pages = (len + pgsize - 1) / pgsize;
+		for (size_t i = 0; i < pages; ++i)
+			resident += vec[i] & 1;
+	}
+	return std::min(resident * pgsize, size);
+#endif
+}
+
 } // namespace terark
 
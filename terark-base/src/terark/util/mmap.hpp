@@ -14,6 +14,12 @@ void* mmap_load(const char* fname, size_t* size,
 				bool writable = false,
 				bool populate = false);
 
+/// hint the os to read pages of the mapped range in background
+TERARK_DLL_EXPORT void mmap_advise_willneed(const void* base, size_t size);
+
+/// bytes of the mapped range which are in memory, 0 if unknown
+TERARK_DLL_EXPORT size_t mmap_resident_bytes(const void* base, size_t size);
+
 template<class String>
 void* mmap_load(const String& fname, size_t* size,
 				bool writable = false,
@@ -0,0 +1,297 @@
+/* vim: set tabstop=4 : */
+#ifndef __terark_mpmc_queue_hpp__
+#define __terark_mpmc_queue_hpp__
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+# pragma once
+#endif
+
+#include "../stdtypes.hpp"
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace terark { namespace util {
+
+/**
+ @ingroup util
+ @brief bounded lock-free multi-producer multi-consumer ring queue
+
+  - push_back/pop_front are a CAS on the enqueue/dequeue position and a
+    sequence number per cell(Dmitry Vyukov's bounded MPMC queue)
+
+  - when the queue is full/empty, a thread spins a while, then parks on
+    a condition variable, the other side notifies just if some thread is
+    parked, so there is no mutex on the fast path
+
+  - push_back/pop_front(timeout) are compatible with concurrent_queue,
+    use this class when the Container of concurrent_queue is not needed
+
+ @note capacity is rounded up to a power of 2
+ @note T must be default constructible and assignable
+ */
+template<class T>
+class mpmc_ring_queue
+{
+	DECLARE_NONE_COPYABLE_CLASS(mpmc_ring_queue)
+
+	typedef std::unique_lock<std::mutex> UniqueLock;
+	typedef std::chrono::steady_clock    Clock;
+
+	struct Cell {
+		std::atomic<size_t> seq;
+		T data;
+	};
+	static const int SpinCount = 64;
+
+	Cell*  m_cells;
+	size_t m_mask;
+	char   m_pad0[64];
+	std::atomic<size_t> m_enqPos;
+	char   m_pad1[64];
+	std::atomic<size_t> m_deqPos;
+	char   m_pad2[64];
+	std::atomic<int> m_popWaiters;
+	std::atomic<int> m_pushWaiters;
+	std::mutex m_mtx;
+	std::condition_variable m_popCond;
+	std::condition_variable m_pushCond;
+
+	/// locked is true if the caller holds m_mtx
+	void wake(std::atomic<int>& waiters, std::condition_variable& cond,
+			  bool locked = false) {
+		// pairs with the fence after waiters++ in wait_for()
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed) > 0) {
+			if (locked)
+				cond.notify_all();
+			else {
+				std::lock_guard<std::mutex> lock(m_mtx);
+				cond.notify_one();
+			}
+		}
+	}
+
+	/// bool tryOp(bool locked), timeout < 0 is infinite
+	template<class TryOp>
+	bool wait_for(TryOp tryOp, std::atomic<int>& waiters,
+				  std::condition_variable& cond, int timeout) {
+		for (int i = 0; i < SpinCount; ++i) {
+			if (tryOp(false))
+				return true;
+			std::this_thread::yield();
+		}
+		const Clock::time_point deadline = Clock::now()
+										 + std::chrono::milliseconds(timeout);
+		UniqueLock lock(m_mtx);
+		waiters.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool ok;
+		for (;;) {
+			if ((ok = tryOp(true)) == true)
+				break;
+			if (timeout < 0)
+				cond.wait(lock);
+			else if (cond.wait_until(lock, deadline) == std::cv_status::timeout) {
+				ok = tryOp(true);
+				break;
+			}
+		}
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+		return ok;
+	}
+
+public:
+	typedef T      value_type;
+	typedef size_t size_type;
+
+	explicit mpmc_ring_queue(size_t maxSize) {
+		size_t cap = 2;
+		while (cap < maxSize) cap *= 2;
+		m_cells = new Cell[cap];
+		for (size_t i = 0; i < cap; ++i)
+			m_cells[i].seq.store(i, std::memory_order_relaxed);
+		m_mask = cap - 1;
+		m_enqPos = 0;
+		m_deqPos = 0;
+		m_popWaiters = 0;
+		m_pushWaiters = 0;
+	}
+	~mpmc_ring_queue() { delete[] m_cells; }
+
+	size_t maxSize() const throw() { return m_mask + 1; }
+
+	//! approximate when there are concurrent push/pop
+	size_type size() const throw() {
+		size_t deq = m_deqPos.load(std::memory_order_acquire);
+		size_t enq = m_enqPos.load(std::memory_order_acquire);
+		return enq > deq ? enq - deq : 0;
+	}
+	bool empty() const throw() { return size() == 0; }
+	bool full()  const throw() { return size() >= maxSize(); }
+
+	//@{
+	//! same as size/empty/full, for compatible with concurrent_queue
+	size_type peekSize() const throw() { return size(); }
+	bool peekEmpty() const throw() { return empty(); }
+	bool peekFull()  const throw() { return full(); }
+	//@}
+
+	bool try_push_back(const value_type& value) {
+		size_t pos = m_enqPos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& c = m_cells[pos & m_mask];
+			size_t seq = c.seq.load(std::memory_order_acquire);
+			intptr_t dif = intptr_t(seq) - intptr_t(pos);
+			if (0 == dif) {
+				if (m_enqPos.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed)) {
+					c.data = value;
+					c.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (dif < 0) {
+				return false; // full
+			}
+			else {
+				pos = m_enqPos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+	bool try_pop_front(value_type& result) {
+		size_t pos = m_deqPos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& c = m_cells[pos & m_mask];
+			size_t seq = c.seq.load(std::memory_order_acquire);
+			intptr_t dif = intptr_t(seq) - intptr_t(pos + 1);
+			if (0 == dif) {
+				if (m_deqPos.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed)) {
+					result = c.data;
+					c.seq.store(pos + m_mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (dif < 0) {
+				return false; // empty
+			}
+			else {
+				pos = m_deqPos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	//@{
+	//! claim up to n consecutive cells by one CAS
+	//! @return number of values pushed/popped, 0 if full/empty
+	size_t try_push_back_n(const value_type* values, size_t n) {
+		size_t pos = m_enqPos.load(std::memory_order_relaxed);
+		for (;;) {
+			size_t k = 0;
+			while (k < n && m_cells[(pos + k) & m_mask].seq.load(
+								std::memory_order_acquire) == pos + k)
+				k++;
+			if (0 == k) {
+				size_t seq = m_cells[pos & m_mask].seq.load(std::memory_order_acquire);
+				if (intptr_t(seq) - intptr_t(pos) < 0)
+					return 0; // full
+				pos = m_enqPos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (m_enqPos.compare_exchange_weak(pos, pos + k,
+					std::memory_order_relaxed)) {
+				for (size_t i = 0; i < k; ++i) {
+					Cell& c = m_cells[(pos + i) & m_mask];
+					c.data = values[i];
+					c.seq.store(pos + i + 1, std::memory_order_release);
+				}
+				return k;
+			}
+		}
+	}
+	size_t try_pop_front_n(value_type* results, size_t n) {
+		size_t pos = m_deqPos.load(std::memory_order_relaxed);
+		for (;;) {
+			size_t k = 0;
+			while (k < n && m_cells[(pos + k) & m_mask].seq.load(
+								std::memory_order_acquire) == pos + k + 1)
+				k++;
+			if (0 == k) {
+				size_t seq = m_cells[pos & m_mask].seq.load(std::memory_order_acquire);
+				if (intptr_t(seq) - intptr_t(pos + 1) < 0)
+					return 0; // empty
+				pos = m_deqPos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (m_deqPos.compare_exchange_weak(pos, pos + k,
+					std::memory_order_relaxed)) {
+				for (size_t i = 0; i < k; ++i) {
+					Cell& c = m_cells[(pos + i) & m_mask];
+					results[i] = c.data;
+					c.seq.store(pos + i + m_mask + 1, std::memory_order_release);
+				}
+				return k;
+			}
+		}
+	}
+	//@}
+
+	void push_back(const value_type& value) {
+		push_back(value, -1);
+	}
+	bool push_back(const value_type& value, int timeout) {
+		bool ok = wait_for([&](bool) { return try_push_back(value); },
+						   m_pushWaiters, m_pushCond, timeout);
+		if (ok)
+			wake(m_popWaiters, m_popCond);
+		return ok;
+	}
+	void pop_front(value_type& result) {
+		pop_front(result, -1);
+	}
+	bool pop_front(value_type& result, int timeout) {
+		bool ok = wait_for([&](bool) { return try_pop_front(result); },
+						   m_popWaiters, m_popCond, timeout);
+		if (ok)
+			wake(m_pushWaiters, m_pushCond);
+		return ok;
+	}
+
+	//! push all of values, consumers are woken on each partial progress
+	//! @return number of values pushed, less than n just on timeout
+	size_t push_back_n(const value_type* values, size_t n, int timeout = -1) {
+		size_t done = 0;
+		wait_for([&](bool locked) {
+				size_t k = try_push_back_n(values + done, n - done);
+				if (k) {
+					done += k;
+					wake(m_popWaiters, m_popCond, locked);
+				}
+				return done == n;
+			}, m_pushWaiters, m_pushCond, timeout);
+		return done;
+	}
+	//! wait for at least one value, then pop up to n values by one CAS
+	//! @return number of values popped, 0 on timeout
+	size_t pop_front_n(value_type* results, size_t n, int timeout = -1) {
+		size_t got = 0;
+		wait_for([&](bool) { return (got = try_pop_front_n(results, n)) != 0; },
+				 m_popWaiters, m_popCond, timeout);
+		if (got)
+			wake(m_pushWaiters, m_pushCond);
+		return got;
+	}
+	value_type pop_front() {
+		value_type value;
+		pop_front(value);
+		return value;
+	}
+};
+
+} } // namespace terark::util
+
+#endif // __terark_mpmc_queue_hpp__
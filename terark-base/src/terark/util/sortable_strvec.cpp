@@ -1,6 +1,9 @@
 #include "sortable_strvec.hpp"
 #include <terark/radix_sort.hpp>
 #include <terark/gold_hash_map.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 // memcpy on gcc-4.9+ linux fails on some corner case
 // so use memmove, it is always ok
@@ -75,7 +78,138 @@ void SortableStrVec::reverse_keys() {
 	}
 }
 
+namespace {
+typedef SortableStrVec::SEntry SEntry;
+
+// all strings of a bucket share the first depth bytes
+struct MsdBucket {
+	SEntry* beg;
+	size_t  num;
+	size_t  depth;
+};
+
+struct MsdRadixSorter {
+	static const size_t ComparisonSortCutoff = 64;
+	const byte* pool;
+
+	// 0 if x ends at depth, else 1 + the byte at depth
+	size_t key(const SEntry& x, size_t depth) const {
+		return x.length > depth ? 1 + pool[x.offset + depth] : 0;
+	}
+	void comparison_sort(SEntry* a, size_t n, size_t depth) const {
+		const byte* pool = this->pool;
+		std::sort(a, a + n, [pool,depth](const SEntry& x, const SEntry& y) {
+			fstring sx(pool + x.offset + depth, x.length - depth);
+			fstring sy(pool + y.offset + depth, y.length - depth);
+			return sx < sy;
+		});
+	}
+	// in-place(American flag) partition of a by the byte at depth, depth
+	// is advanced over bytes shared by all strings of a
+	///@returns false if all strings of a are equal
+	bool partition(SEntry* a, size_t n, size_t& depth, size_t* bucketBeg) const {
+		size_t cnt[257];
+		for (;;) {
+			std::fill_n(cnt, 257, 0);
+			for (size_t i = 0; i < n; ++i)
+				cnt[key(a[i], depth)]++;
+			if (cnt[0] == n)
+				return false;
+			if (std::find(cnt + 1, cnt + 257, n) == cnt + 257)
+				break;
+			depth++;
+		}
+		size_t next[257];
+		bucketBeg[0] = next[0] = 0;
+		for (size_t b = 0; b < 257; ++b)
+			bucketBeg[b+1] = next[b+1] = bucketBeg[b] + cnt[b];
+		for (size_t b = 0; b < 257; ++b) {
+			while (next[b] < bucketBeg[b+1]) {
+				SEntry e = a[next[b]];
+				size_t k = key(e, depth);
+				while (k != b) {
+					std::swap(e, a[next[k]++]);
+					k = key(e, depth);
+				}
+				a[next[b]++] = e;
+			}
+		}
+		return true;
+	}
+	void sort(SEntry* a, size_t n, size_t depth) const {
+		if (n < ComparisonSortCutoff) {
+			comparison_sort(a, n, depth);
+			return;
+		}
+		size_t bucketBeg[258];
+		if (!partition(a, n, depth, bucketBeg))
+			return;
+		// bucket 0 are strings ending at depth, they are equal
+		for (size_t b = 1; b < 257; ++b) {
+			size_t num = bucketBeg[b+1] - bucketBeg[b];
+			if (num > 1)
+				sort(a + bucketBeg[b], num, depth + 1);
+		}
+	}
+};
+} // namespace
+
+// Buckets larger than 1/16 of a thread's share are partitioned again in
+// the calling thread, then buckets are sorted by threads, largest first.
+void SortableStrVec::sort_parallel(size_t threadNum) {
+	if (0 == threadNum)
+		threadNum = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	MsdRadixSorter sorter = { m_strpool.data() };
+	const size_t n = m_index.size();
+	if (threadNum < 2 || n < 2 * MsdRadixSorter::ComparisonSortCutoff) {
+		sorter.sort(m_index.data(), n, 0);
+		return;
+	}
+	const size_t maxBucket = std::max<size_t>(n / (threadNum * 16),
+								MsdRadixSorter::ComparisonSortCutoff);
+	valvec<MsdBucket> todo, buckets;
+	todo.push_back(MsdBucket{m_index.data(), n, 0});
+	while (!todo.empty()) {
+		MsdBucket x = todo.pop_val();
+		size_t bucketBeg[258];
+		if (!sorter.partition(x.beg, x.num, x.depth, bucketBeg))
+			continue;
+		for (size_t b = 1; b < 257; ++b) {
+			MsdBucket y = {x.beg + bucketBeg[b], bucketBeg[b+1] - bucketBeg[b], x.depth + 1};
+			if (y.num > maxBucket)
+				todo.push_back(y);
+			else if (y.num > 1)
+				buckets.push_back(y);
+		}
+	}
+	std::sort(buckets.begin(), buckets.end(),
+		[](const MsdBucket& x, const MsdBucket& y) { return x.num > y.num; });
+	std::atomic<size_t> nextBucket(0);
+	auto worker = [&]() {
+		for (;;) {
+			size_t i = nextBucket.fetch_add(1, std::memory_order_relaxed);
+			if (i >= buckets.size())
+				break;
+			sorter.sort(buckets[i].beg, buckets[i].num, buckets[i].depth);
+		}
+	};
+	std::vector<std::thread> threads;
+	threads.reserve(threadNum - 1);
+	for (size_t i = 0; i < threadNum - 1; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& t : threads)
+		t.join();
+}
+
+// large vectors are sorted by sort_parallel, env SortableStrVec_sortThreads
+// is the number of threads, 1 disables it
 void SortableStrVec::sort() {
+	static const long sortThreads = getEnvLong("SortableStrVec_sortThreads", 0);
+	if (m_index.size() >= 1024*1024 && sortThreads != 1) {
+		sort_parallel(size_t(std::max(sortThreads, 0L)));
+		return;
+	}
 	const byte* pool = m_strpool.data();
 	double avgLen = double(m_strpool.size()+1) / double(m_index.size() + 1);
 	double minRadixSortStrLen = UINT32_MAX; // disable radix sort by default
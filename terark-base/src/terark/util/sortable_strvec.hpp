@@ -52,6 +52,8 @@ public:
 	void back_grow_no_init(size_t nGrow);
 	void reverse_keys();
 	void sort();
+	/// MSD radix sort by threadNum threads, 0 is hardware concurrency
+	void sort_parallel(size_t threadNum = 0);
 	void sort_by_offset();
 	void sort_by_seq_id();
 	void clear();
@@ -18,6 +18,7 @@
 #include <boost/mpl/bool.hpp>
 
 #include <terark/util/autofree.hpp>
+#include <terark/util/large_mem.hpp>
 #include "config.hpp"
 
 namespace terark {
@@ -104,6 +105,7 @@ protected:
 		explicit AutoMemory(size_t n) {
 			p = (T*)malloc(sizeof(T) * n);
 			if (NULL == p) throw std::bad_alloc();
+			onLargeMemAlloc(p, sizeof(T) * n);
 		}
 	//	explicit AutoMemory(T* q) {
 	//		p = q;
@@ -356,6 +358,7 @@ public:
             return; // nothing to do
         T* q = (T*)realloc(p, sizeof(T) * newcap);
         if (NULL == q) throw std::bad_alloc();
+        onLargeMemAlloc(q, sizeof(T) * newcap);
         p = q;
         c = newcap;
     }
@@ -369,6 +372,7 @@ public:
             min_cap = 2 * c;
         T* q = (T*)realloc(p, sizeof(T) * min_cap);
         if (NULL == q) throw std::bad_alloc();
+        onLargeMemAlloc(q, sizeof(T) * min_cap);
         p = q;
         c = min_cap;
     }
@@ -385,6 +389,7 @@ public:
 		for (;;) {
 			T* q = (T*)realloc(p, sizeof(T) * cur_cap);
 			if (q) {
+				onLargeMemAlloc(q, sizeof(T) * cur_cap);
 				p = q;
 				c = cur_cap;
 				return;
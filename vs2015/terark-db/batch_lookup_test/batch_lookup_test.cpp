@@ -0,0 +1,142 @@
+// batch_lookup_test.cpp : functional test of DbTable::getValuesByKeyBatch
+//
+// usage: batch_lookup_test.exe [dir], default ./batch_lookup_test.db
+// rows are inserted and updated in two segments, then the found and the
+// missing keys are looked up in random order in batches larger and smaller
+// than a lookup group, each result must be the newest row of the key, as
+// indexSearchExact and getValue return it. Exits 1 on failure
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/db_table.hpp>
+#include <terark/db/db_context.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <map>
+#include <random>
+
+using namespace terark;
+using namespace terark::db;
+namespace fs = boost::filesystem;
+
+static int g_failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failed++; \
+	} \
+} while (0)
+
+static void createTable(const std::string& dir) {
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+	static const char meta[] = R"({
+	"RowSchema": {
+		"columns": {
+			"key": { "type": "fixed", "length": 8 },
+			"val": { "type": "binary" }
+		}
+	},
+	"TableIndex": [ { "fields": "key", "ordered": true, "unique": true } ],
+	"WritableSegmentClass": "trbdb",
+	"ReadonlySegmentClass": "dfadb"
+}
+)";
+	FILE* fp = fopen((dir + "/dbmeta.json").c_str(), "w");
+	if (!fp) {
+		THROW_STD(invalid_argument, "fopen(%s/dbmeta.json) = %s"
+			, dir.c_str(), strerror(errno));
+	}
+	fwrite(meta, 1, sizeof(meta) - 1, fp);
+	fclose(fp);
+}
+
+static std::string makeKey(size_t i) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%08zd", i);
+	return std::string(buf, 8);
+}
+
+int main(int argc, char* argv[]) {
+	const std::string dir = argc > 1 ? argv[1] : "batch_lookup_test.db";
+	const size_t keyNum = 2000;
+	createTable(dir);
+	DbTablePtr tab = DbTable::open(dir);
+	DbContextPtr ctx = tab->createDbContext();
+	const size_t keyIndexId = 0;
+	std::map<std::string, std::string> expected;
+	valvec<byte> row;
+	auto put = [&](size_t i, int version) {
+		std::string key = makeKey(i);
+		std::string val = "v" + std::to_string(i) + "-" + std::to_string(version);
+		ColumnVec cols(2, valvec_reserve());
+		std::string buf = key + val;
+		cols.m_base = (const byte*)buf.data();
+		cols.push_back(0, key.size());
+		cols.push_back(key.size(), val.size());
+		tab->rowSchema().combineRow(cols, &row);
+		CHECK(ctx->upsertRow(row) >= 0);
+		expected[key].assign((const char*)row.data(), row.size());
+	};
+	for (size_t i = 0; i < keyNum; ++i) {
+		if (i % 3 != 0) // keys i % 3 == 0 are missing
+			put(i, 0);
+	}
+	tab->syncFinishWriting(); // the newest rows are in another segment
+	for (size_t i = 0; i < keyNum; i += 5) {
+		if (i % 3 != 0)
+			put(i, 1);
+	}
+	std::mt19937 rng(12345);
+	std::vector<std::string> keys;
+	for (size_t i = 0; i < keyNum; ++i)
+		keys.push_back(makeKey(i));
+	std::shuffle(keys.begin(), keys.end(), rng);
+	valvec<llong> recIdvec;
+	valvec<byte> val;
+	size_t totalFound = 0;
+	for (size_t batch : {size_t(1), size_t(7), size_t(32), size_t(100), keyNum}) {
+		size_t found = 0;
+		for (size_t beg = 0; beg < keys.size(); beg += batch) {
+			size_t num = std::min(batch, keys.size() - beg);
+			std::vector<fstring> fkeys(keys.begin() + beg, keys.begin() + beg + num);
+			std::vector<llong> recIds(num, -3);
+			std::vector<valvec<byte> > vals(num);
+			size_t n = tab->getValuesByKeyBatch(keyIndexId, fkeys.data(), num,
+											recIds.data(), vals.data(), ctx.get());
+			for (size_t k = 0; k < num; ++k) {
+				const std::string& key = keys[beg + k];
+				auto iter = expected.find(key);
+				ctx->indexSearchExact(keyIndexId, key, &recIdvec);
+				if (expected.end() == iter) {
+					CHECK(recIds[k] == -1);
+					CHECK(vals[k].empty());
+					CHECK(recIdvec.empty());
+					continue;
+				}
+				found++;
+				CHECK(recIds[k] >= 0);
+				CHECK(fstring(vals[k]) == iter->second);
+				CHECK(recIdvec.size() == 1);
+				if (recIdvec.size() == 1) {
+					CHECK(recIds[k] == recIdvec[0]);
+					ctx->getValue(recIdvec[0], &val);
+					CHECK(fstring(val) == fstring(vals[k]));
+				}
+			}
+			totalFound += n;
+		}
+		CHECK(found == expected.size());
+	}
+	CHECK(totalFound == 5 * expected.size());
+	ctx = NULL;
+	tab = NULL;
+	fs::remove_all(dir);
+	if (g_failed) {
+		fprintf(stderr, "ERROR: %d checks failed\n", g_failed);
+		return 1;
+	}
+	fprintf(stderr, "INFO: all passed, keys = %zd, found = %zd\n", keyNum, expected.size());
+	return 0;
+}
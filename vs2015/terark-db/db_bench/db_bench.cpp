@@ -0,0 +1,486 @@
+// db_bench.cpp : db_bench style workloads on DbTable engines
+//
+// usage: see usage() or run with -h
+// results are printed as json to stdout, or to the file of -o
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/db_table.hpp>
+#include <terark/db/db_context.hpp>
+#include <terark/util/profiling.hpp>
+#include <terark/lcast.hpp>
+#include <terark/bitmanip.hpp>
+#include <boost/filesystem.hpp>
+#include <getopt.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <thread>
+
+using namespace terark;
+using namespace terark::db;
+namespace fs = boost::filesystem;
+
+void usage(const char* prog) {
+	fprintf(stderr, R"EOS(usage: %s options
+options:
+  -d dir         table dir, default ./db_bench.db
+  -w class       WritableSegmentClass: wiredtiger, trbdb, ... default wiredtiger
+  -r class       ReadonlySegmentClass, default dfadb
+  -b benchmarks  comma separated, default is all:
+                 fillseq,fillrandom,readrandom,readseq,seekrandom,updaterandom,mixed
+  -n num         number of keys, default 1000000
+  -R reads       ops of each read/update benchmark, default num
+  -t threads     default 1
+  -k keysize     default 16, >= 8
+  -v valuesize   default 100
+  -D dist        uniform or zipfian, default uniform
+  -z theta       zipfian theta, default 0.99
+  -s segsize     MaxWritingSegmentSize, default 64M
+  -S seed        random seed
+  -u             use existing table, do not recreate it
+  -o file        write json results to file, default is stdout
+  mixed: threads-1 readers run readrandom while one writer runs updaterandom,
+         writable segments are frozen and converted in background
+)EOS", prog);
+}
+
+struct Options {
+	std::string dir = "db_bench.db";
+	std::string wrClass = "wiredtiger";
+	std::string rdClass = "dfadb";
+	std::string benchmarks = "fillseq,fillrandom,readrandom,readseq,seekrandom,updaterandom,mixed";
+	std::string jsonFile;
+	std::string dist = "uniform";
+	size_t num = 1000000;
+	size_t reads = 0;
+	size_t threads = 1;
+	size_t keySize = 16;
+	size_t valueSize = 100;
+	size_t wrSegSize = 64 << 20;
+	double theta = 0.99;
+	unsigned seed = 301;
+	bool useExisting = false;
+};
+
+// log-linear buckets of nanoseconds, each power of 2 is split into 8
+// sub buckets, so relative error of percentiles is below 12.5%
+class LatencyHist {
+	enum { SubBits = 3, SubNum = 1 << SubBits, BucketNum = 64 * SubNum };
+	valvec<ullong> m_buckets;
+	ullong m_count = 0, m_sum = 0, m_max = 0;
+	static size_t index(ullong ns) {
+		if (ns < SubNum)
+			return size_t(ns);
+		int hi = 63 - fast_clz64(ns);
+		size_t sub = size_t(ns >> (hi - SubBits)) & (SubNum - 1);
+		return (hi - SubBits + 1) * SubNum + sub;
+	}
+	static ullong upper(size_t idx) {
+		if (idx < SubNum)
+			return idx;
+		int hi = int(idx / SubNum) + SubBits - 1;
+		ullong sub = idx % SubNum;
+		return ((SubNum + sub + 1) << (hi - SubBits)) - 1;
+	}
+public:
+	LatencyHist() : m_buckets(BucketNum, 0) {}
+	void add(ullong ns) {
+		m_buckets[index(ns)]++;
+		m_count++;
+		m_sum += ns;
+		m_max = std::max(m_max, ns);
+	}
+	void merge(const LatencyHist& y) {
+		for (size_t i = 0; i < BucketNum; ++i)
+			m_buckets[i] += y.m_buckets[i];
+		m_count += y.m_count;
+		m_sum += y.m_sum;
+		m_max = std::max(m_max, y.m_max);
+	}
+	ullong count() const { return m_count; }
+	double avg() const { return m_count ? double(m_sum) / m_count : 0; }
+	ullong max() const { return m_max; }
+	ullong percentile(double p) const {
+		ullong rank = ullong(std::ceil(p / 100 * m_count));
+		ullong acc = 0;
+		for (size_t i = 0; i < BucketNum; ++i) {
+			acc += m_buckets[i];
+			if (acc >= rank && acc)
+				return std::min(upper(i), m_max);
+		}
+		return m_max;
+	}
+};
+
+// zipfian of Gray et al, used by YCSB, keys are scrambled by a hash
+// so hot keys are spread over the key space
+class KeyGen {
+	std::mt19937_64 m_rng;
+	size_t m_num;
+	bool   m_zipf;
+	double m_theta, m_zetan, m_alpha, m_eta;
+	static double zeta(size_t n, double theta) {
+		double sum = 0;
+		for (size_t i = 1; i <= n; ++i)
+			sum += 1 / std::pow(double(i), theta);
+		return sum;
+	}
+public:
+	KeyGen(const Options& opt, size_t num, double zetan, unsigned seed)
+		: m_rng(seed), m_num(num), m_zipf(opt.dist == "zipfian") {
+		m_theta = opt.theta;
+		m_zetan = zetan;
+		m_alpha = 1 / (1 - m_theta);
+		m_eta = (1 - std::pow(2.0 / num, 1 - m_theta)) /
+				(1 - zeta(2, m_theta) / m_zetan);
+	}
+	static double zetaOf(const Options& opt, size_t num) {
+		return opt.dist == "zipfian" ? zeta(num, opt.theta) : 0;
+	}
+	size_t next() {
+		if (!m_zipf)
+			return size_t(m_rng() % m_num);
+		double u = std::uniform_real_distribution<double>(0, 1)(m_rng);
+		double uz = u * m_zetan;
+		size_t rank;
+		if (uz < 1)
+			rank = 0;
+		else if (uz < 1 + std::pow(0.5, m_theta))
+			rank = 1;
+		else
+			rank = size_t(m_num * std::pow(m_eta * u - m_eta + 1, m_alpha));
+		uint64_t h = (rank + 1) * 0x9E3779B97F4A7C15ull;
+		return size_t((h ^ (h >> 29)) % m_num);
+	}
+};
+
+struct Result {
+	std::string name;
+	size_t ops = 0;
+	size_t found = 0;
+	double seconds = 0;
+	llong  segs = 0;
+	LatencyHist hist;
+};
+
+class Bench {
+	Options m_opt;
+	DbTablePtr m_tab;
+	double m_zetan = 0;
+	std::vector<Result> m_results;
+
+	void makeKey(size_t k, valvec<byte>* buf) const {
+		char tmp[32];
+		int len = snprintf(tmp, sizeof(tmp), "%016zd", k);
+		buf->resize(m_opt.keySize, '0');
+		size_t n = std::min<size_t>(len, m_opt.keySize);
+		memcpy(buf->data() + m_opt.keySize - n, tmp + len - n, n);
+	}
+	void makeRow(size_t k, std::mt19937_64& rng, valvec<byte>* buf,
+				 valvec<byte>* row) const {
+		makeKey(k, buf);
+		buf->resize(m_opt.keySize + m_opt.valueSize);
+		for (size_t i = m_opt.keySize; i < buf->size(); ++i)
+			(*buf)[i] = byte('a' + rng() % 26);
+		ColumnVec cols(2, valvec_reserve());
+		cols.m_base = buf->data();
+		cols.push_back(0, m_opt.keySize);
+		cols.push_back(m_opt.keySize, m_opt.valueSize);
+		m_tab->rowSchema().combineRow(cols, row);
+	}
+	void createTable() {
+		fs::remove_all(m_opt.dir);
+		fs::create_directories(m_opt.dir);
+		std::string meta = R"({
+	"RowSchema": {
+		"columns": {
+			"key": { "type": "fixed", "length": )" + lcast(m_opt.keySize) + R"( },
+			"val": { "type": "binary" }
+		}
+	},
+	"TableIndex": [ { "fields": "key", "ordered": true, "unique": true } ],
+	"WritableSegmentClass": ")" + m_opt.wrClass + R"(",
+	"ReadonlySegmentClass": ")" + m_opt.rdClass + R"(",
+	"MaxWritingSegmentSize": )" + lcast(m_opt.wrSegSize) + R"(
+}
+)";
+		FILE* fp = fopen((m_opt.dir + "/dbmeta.json").c_str(), "w");
+		if (!fp) {
+			THROW_STD(invalid_argument, "fopen(%s/dbmeta.json) = %s"
+				, m_opt.dir.c_str(), strerror(errno));
+		}
+		fwrite(meta.data(), 1, meta.size(), fp);
+		fclose(fp);
+	}
+
+	// run fn(threadno, &localResult) on each thread, merge results
+	template<class Fn>
+	void run(const std::string& name, size_t threads, Fn fn) {
+		std::vector<Result> local(threads);
+		std::vector<std::thread> ths;
+		profiling pf;
+		llong t0 = pf.now();
+		for (size_t i = 0; i < threads; ++i)
+			ths.emplace_back([&,i]() { fn(i, &local[i]); });
+		for (auto& th : ths)
+			th.join();
+		Result r;
+		r.name = name;
+		r.seconds = pf.sf(t0, pf.now());
+		for (auto& x : local) {
+			r.ops += x.ops;
+			r.found += x.found;
+			r.hist.merge(x.hist);
+		}
+		r.segs = m_tab->getSegNum();
+		fprintf(stderr, "%-12s : %10.3f micros/op, %10.0f ops/sec, p99 = %.3f us\n"
+			, name.c_str(), r.seconds * 1e6 / std::max<size_t>(r.ops, 1)
+			, r.ops / r.seconds, r.hist.percentile(99) / 1e3);
+		m_results.push_back(std::move(r));
+	}
+
+	void fill(bool seq) {
+		size_t perThread = (m_opt.num + m_opt.threads - 1) / m_opt.threads;
+		run(seq ? "fillseq" : "fillrandom", m_opt.threads, [&](size_t tno, Result* r) {
+			DbContextPtr ctx = m_tab->createDbContext();
+			std::mt19937_64 rng(m_opt.seed + tno);
+			valvec<byte> buf, row;
+			profiling pf;
+			size_t beg = tno * perThread;
+			size_t end = std::min(beg + perThread, m_opt.num);
+			for (size_t i = beg; i < end; ++i) {
+				size_t k = seq ? i : size_t(rng() % m_opt.num);
+				makeRow(k, rng, &buf, &row);
+				llong t0 = pf.now();
+				ctx->upsertRow(row);
+				r->hist.add(pf.ns(t0, pf.now()));
+				r->ops++;
+			}
+		});
+	}
+	void readRandom(const char* name, size_t threads, size_t tnoBase) {
+		size_t perThread = m_opt.reads / std::max<size_t>(threads, 1);
+		run(name, threads, [&](size_t tno, Result* r) {
+			DbContextPtr ctx = m_tab->createDbContext();
+			KeyGen gen(m_opt, m_opt.num, m_zetan, m_opt.seed + tnoBase + tno);
+			valvec<byte> key, val;
+			valvec<llong> ids;
+			profiling pf;
+			for (size_t i = 0; i < perThread; ++i) {
+				makeKey(gen.next(), &key);
+				llong t0 = pf.now();
+				ctx->indexSearchExact(0, key, &ids);
+				if (!ids.empty()) {
+					ctx->getValue(ids[0], &val);
+					r->found++;
+				}
+				r->hist.add(pf.ns(t0, pf.now()));
+				r->ops++;
+			}
+		});
+	}
+	void readSeq() {
+		size_t perThread = m_opt.reads / m_opt.threads;
+		run("readseq", m_opt.threads, [&](size_t, Result* r) {
+			DbContextPtr ctx = m_tab->createDbContext();
+			StoreIteratorPtr iter = ctx->createTableIterForward();
+			valvec<byte> val;
+			llong id = -1;
+			profiling pf;
+			llong t0 = pf.now();
+			while (r->ops < perThread && iter->increment(&id, &val)) {
+				llong t1 = pf.now();
+				r->hist.add(pf.ns(t0, t1));
+				t0 = t1;
+				r->ops++;
+				r->found++;
+			}
+		});
+	}
+	void seekRandom() {
+		size_t perThread = m_opt.reads / m_opt.threads;
+		run("seekrandom", m_opt.threads, [&](size_t tno, Result* r) {
+			DbContextPtr ctx = m_tab->createDbContext();
+			IndexIteratorPtr iter = m_tab->createIndexIterForward(0, ctx.get());
+			KeyGen gen(m_opt, m_opt.num, m_zetan, m_opt.seed + tno);
+			valvec<byte> key, retKey;
+			llong id = -1;
+			profiling pf;
+			for (size_t i = 0; i < perThread; ++i) {
+				makeKey(gen.next(), &key);
+				llong t0 = pf.now();
+				int ret = iter->seekLowerBound(key, &id, &retKey);
+				if (ret >= 0) {
+					iter->increment(&id, &retKey);
+					r->found += ret == 0;
+				}
+				r->hist.add(pf.ns(t0, pf.now()));
+				r->ops++;
+			}
+		});
+	}
+	void updateRandom(const char* name, size_t ops, size_t tnoBase) {
+		size_t perThread = ops / m_opt.threads;
+		run(name, m_opt.threads, [&](size_t tno, Result* r) {
+			DbContextPtr ctx = m_tab->createDbContext();
+			KeyGen gen(m_opt, m_opt.num, m_zetan, m_opt.seed + tnoBase + tno);
+			std::mt19937_64 rng(m_opt.seed + tno);
+			valvec<byte> buf, row;
+			profiling pf;
+			for (size_t i = 0; i < perThread; ++i) {
+				makeRow(gen.next(), rng, &buf, &row);
+				llong t0 = pf.now();
+				ctx->upsertRow(row);
+				r->hist.add(pf.ns(t0, pf.now()));
+				r->ops++;
+			}
+		});
+	}
+	void mixed() {
+		size_t readers = std::max<size_t>(m_opt.threads, 2) - 1;
+		std::atomic<bool> stop(false);
+		Result wr;
+		wr.name = "mixed.write";
+		profiling pf;
+		llong t0 = pf.now();
+		std::thread writer([&]() {
+			DbContextPtr ctx = m_tab->createDbContext();
+			KeyGen gen(m_opt, m_opt.num, m_zetan, m_opt.seed + 1000);
+			std::mt19937_64 rng(m_opt.seed + 1000);
+			valvec<byte> buf, row;
+			profiling pf2;
+			while (!stop) {
+				makeRow(gen.next(), rng, &buf, &row);
+				llong t1 = pf2.now();
+				ctx->upsertRow(row);
+				wr.hist.add(pf2.ns(t1, pf2.now()));
+				wr.ops++;
+			}
+		});
+		readRandom("mixed.read", readers, 2000);
+		stop = true;
+		writer.join();
+		wr.seconds = pf.sf(t0, pf.now());
+		wr.segs = m_tab->getSegNum();
+		fprintf(stderr, "%-12s : %10.0f ops/sec, p99 = %.3f us, bg tasks = %zd\n"
+			, wr.name.c_str(), wr.ops / wr.seconds, wr.hist.percentile(99) / 1e3
+			, m_tab->getBackgroundTaskNum());
+		m_results.push_back(std::move(wr));
+	}
+
+	void printJson(FILE* fp) const {
+		fprintf(fp, "{\n  \"options\": {\"writable\": \"%s\", \"readonly\": \"%s\""
+			", \"num\": %zd, \"reads\": %zd, \"threads\": %zd, \"key_size\": %zd"
+			", \"value_size\": %zd, \"dist\": \"%s\", \"theta\": %g},\n"
+			"  \"results\": [\n"
+			, m_opt.wrClass.c_str(), m_opt.rdClass.c_str(), m_opt.num, m_opt.reads
+			, m_opt.threads, m_opt.keySize, m_opt.valueSize, m_opt.dist.c_str()
+			, m_opt.theta);
+		for (size_t i = 0; i < m_results.size(); ++i) {
+			const Result& r = m_results[i];
+			const LatencyHist& h = r.hist;
+			fprintf(fp, "    {\"name\": \"%s\", \"ops\": %zd, \"found\": %zd"
+				", \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"segments\": %lld"
+				", \"latency_us\": {\"avg\": %.3f, \"p50\": %.3f, \"p90\": %.3f"
+				", \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}}%s\n"
+				, r.name.c_str(), r.ops, r.found, r.seconds
+				, r.seconds > 0 ? r.ops / r.seconds : 0.0, r.segs
+				, h.avg() / 1e3, h.percentile(50) / 1e3, h.percentile(90) / 1e3
+				, h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.max() / 1e3
+				, i + 1 < m_results.size() ? "," : "");
+		}
+		fprintf(fp, "  ]\n}\n");
+	}
+
+public:
+	explicit Bench(const Options& opt) : m_opt(opt) {
+		if (0 == m_opt.reads)
+			m_opt.reads = m_opt.num;
+		m_opt.threads = std::max<size_t>(m_opt.threads, 1);
+		m_zetan = KeyGen::zetaOf(m_opt, m_opt.num);
+	}
+	int run() {
+		if (!m_opt.useExisting)
+			createTable();
+		m_tab = DbTable::open(m_opt.dir);
+		valvec<fstring> names;
+		fstring(m_opt.benchmarks).split(',', &names);
+		for (fstring name : names) {
+			if (name == "fillseq")           fill(true);
+			else if (name == "fillrandom")   fill(false);
+			else if (name == "readrandom")   readRandom("readrandom", m_opt.threads, 0);
+			else if (name == "readseq")      readSeq();
+			else if (name == "seekrandom")   seekRandom();
+			else if (name == "updaterandom") updateRandom("updaterandom", m_opt.reads, 0);
+			else if (name == "mixed")        mixed();
+			else {
+				fprintf(stderr, "ERROR: unknown benchmark: %.*s\n", name.ilen(), name.data());
+				return 1;
+			}
+		}
+		FILE* fp = stdout;
+		if (!m_opt.jsonFile.empty()) {
+			fp = fopen(m_opt.jsonFile.c_str(), "w");
+			if (!fp) {
+				fprintf(stderr, "ERROR: fopen(%s, w) = %s\n"
+					, m_opt.jsonFile.c_str(), strerror(errno));
+				return 1;
+			}
+		}
+		printJson(fp);
+		if (fp != stdout)
+			fclose(fp);
+		m_tab->syncFinishWriting();
+		m_tab = nullptr;
+		DbTable::safeStopAndWaitForCompress();
+		return 0;
+	}
+};
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	for (;;) {
+		int c = getopt(argc, argv, "d:w:r:b:n:R:t:k:v:D:z:s:S:uo:h");
+		switch (c) {
+		case -1:
+			goto GetoptDone;
+		case 'd': opt.dir = optarg; break;
+		case 'w': opt.wrClass = optarg; break;
+		case 'r': opt.rdClass = optarg; break;
+		case 'b': opt.benchmarks = optarg; break;
+		case 'n': opt.num = strtoull(optarg, NULL, 10); break;
+		case 'R': opt.reads = strtoull(optarg, NULL, 10); break;
+		case 't': opt.threads = strtoull(optarg, NULL, 10); break;
+		case 'k': opt.keySize = std::max<size_t>(strtoull(optarg, NULL, 10), 8); break;
+		case 'v': opt.valueSize = strtoull(optarg, NULL, 10); break;
+		case 'D': opt.dist = optarg; break;
+		case 'z': opt.theta = strtod(optarg, NULL); break;
+		case 's': opt.wrSegSize = strtoull(optarg, NULL, 10); break;
+		case 'S': opt.seed = (unsigned)strtoul(optarg, NULL, 10); break;
+		case 'u': opt.useExisting = true; break;
+		case 'o': opt.jsonFile = optarg; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+GetoptDone:
+	if (opt.dist != "uniform" && opt.dist != "zipfian") {
+		fprintf(stderr, "ERROR: bad dist: %s\n", opt.dist.c_str());
+		return 1;
+	}
+	if (opt.dist == "zipfian" && (opt.theta <= 0 || opt.theta >= 1)) {
+		fprintf(stderr, "ERROR: zipfian theta must be in (0, 1)\n");
+		return 1;
+	}
+	try {
+		Bench bench(opt);
+		return bench.run();
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: %s\n", ex.what());
+		return 1;
+	}
+}
@@ -0,0 +1,466 @@
+// dictzip_bench.cpp : ratio and speed of NestLoudsTrieStore, DictZip and
+//                     NestLoudsTrieIndex over a grid of colgroup options
+//
+// usage: see usage() or run with -h
+// each config of the grid is built from the same records, its compression
+// ratio, build throughput, random read latency and sequential decode
+// throughput are printed to stdout and are checked with a baseline saved by
+// a previous run(-B), exit code is 2 if a metric is regressed or a decoded
+// record is different from the input.
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/db_table.hpp>
+#include <terark/db/db_context.hpp>
+#include <terark/db/db_perf.hpp>
+#include <terark/db/json.hpp>
+#include <terark/db/dfadb/nlt_index.hpp>
+#include <terark/db/dfadb/nlt_store.hpp>
+#include <terark/util/linebuf.hpp>
+#include <terark/util/profiling.hpp>
+#include <terark/util/sortable_strvec.hpp>
+#include <boost/filesystem.hpp>
+#include <getopt.h>
+#include <algorithm>
+#include <random>
+
+using namespace terark;
+using namespace terark::db;
+namespace fs = boost::filesystem;
+
+void usage(const char* prog) {
+	fprintf(stderr, R"EOS(usage: %s options dataFile
+options:
+  -g grid     grid file, default is a builtin grid, see below
+  -n num      max records loaded from dataFile, default all
+  -R ops      random reads of each config, default 100000
+  -d dir      scratch dir, default ./dictzip_bench.tmp
+  -S seed     random seed
+  -b file     check with the baseline file
+  -B file     save results as the baseline file
+  -r tol      relative tolerance of ratio, default 0.02
+  -s tol      relative tolerance of speed and latency, default 0.20
+A record is a line of dataFile, its key for index configs is the field
+before the first tab, or the whole line.
+A line of the grid file is "name kind json", kind is store or index, json is
+an object of colgroup options(store) or of TableIndex options(index):
+  dz_fse store {"dictZipSampleRatio":0.03, "dictZipEntropyType":"fse"}
+  nlt2   store {"dictZipSampleRatio":0, "nltNestLevel":2}
+  idx    index {"nltNestLevel":3, "minFragLen":8, "maxFragLen":64}
+Empty lines and lines starting with # are skipped. Speeds of a baseline are
+comparable just on the same machine, data and build.
+)EOS", prog);
+}
+
+const char* const g_defaultGrid = R"EOS(
+nlt_nest2    store {"dictZipSampleRatio":0, "nltNestLevel":2}
+nlt_nest4    store {"dictZipSampleRatio":0, "nltNestLevel":4}
+dz_none      store {"dictZipSampleRatio":0.03, "dictZipEntropyType":"none"}
+dz_huffman   store {"dictZipSampleRatio":0.03, "dictZipEntropyType":"huffman"}
+dz_fse       store {"dictZipSampleRatio":0.03, "dictZipEntropyType":"fse"}
+dz_fse_s10   store {"dictZipSampleRatio":0.10, "dictZipEntropyType":"fse"}
+dz_sa_fse    store {"dictZipSampleRatio":0.03, "dictZipEntropyType":"fse", "dictZipUseSuffixArrayLocalMatch":true}
+idx_nest3    index {"nltNestLevel":3}
+idx_frag     index {"nltNestLevel":3, "minFragLen":8, "maxFragLen":64}
+)EOS";
+
+struct Options {
+	std::string grid;
+	std::string dir = "dictzip_bench.tmp";
+	std::string baseline;
+	std::string saveBaseline;
+	size_t num = size_t(-1);
+	size_t ops = 100000;
+	unsigned seed = 301;
+	double ratioTol = 0.02;
+	double speedTol = 0.20;
+};
+
+struct Config {
+	std::string name;
+	bool isIndex = false;
+	json opts;
+};
+
+struct Result {
+	std::string name;
+	bool isIndex = false;
+	llong  storageSize = 0;
+	double ratio = 0;     // input bytes / storage bytes
+	double buildMBps = 0; // of input bytes
+	double readAvgNs = 0; // getValue or searchExact of random records
+	double readP99Ns = 0;
+	double seqMBps = 0;   // sequential decode or iteration
+	size_t diff = 0;      // wrong records, must be 0
+	std::string regress;  // regressed metrics
+};
+
+class DictZipBench {
+	Options m_opt;
+	fstrvecl m_recs;
+	fstrvecl m_keys;
+	size_t m_recBytes = 0;
+	size_t m_keyBytes = 0;
+	valvec<size_t> m_randIds;
+	std::vector<Config> m_grid;
+	std::vector<Result> m_results;
+
+	void loadRecords(const char* fname) {
+		FILE* fp = fopen(fname, "r");
+		if (!fp) {
+			THROW_STD(invalid_argument, "fopen(%s) = %s", fname, strerror(errno));
+		}
+		LineBuf line;
+		while (m_recs.size() < m_opt.num && line.getline(fp) > 0) {
+			line.chomp();
+			fstring rec(line.p, line.size());
+			const char* tab = (const char*)memchr(rec.data(), '\t', rec.size());
+			fstring key = tab ? fstring(rec.data(), tab) : rec;
+			m_recs.emplace_back(rec.data(), rec.size());
+			m_keys.emplace_back(key.data(), key.size());
+			m_recBytes += rec.size();
+			m_keyBytes += key.size();
+		}
+		fclose(fp);
+		if (0 == m_recs.size()) {
+			THROW_STD(invalid_argument, "no records in %s", fname);
+		}
+		std::mt19937_64 rng(m_opt.seed);
+		m_randIds.resize_no_init(m_opt.ops);
+		for (size_t i = 0; i < m_opt.ops; ++i)
+			m_randIds[i] = rng() % m_recs.size();
+		fprintf(stderr, "INFO: loaded %zd records, %zd bytes, keys %zd bytes\n"
+			, m_recs.size(), m_recBytes, m_keyBytes);
+	}
+
+	void parseGrid(fstring text, const char* from) {
+		valvec<fstring> lines;
+		text.split('\n', &lines);
+		for (size_t ln = 0; ln < lines.size(); ++ln) {
+			std::string line = lines[ln].str();
+			size_t beg = line.find_first_not_of(" \t\r");
+			if (std::string::npos == beg || '#' == line[beg])
+				continue;
+			char name[256], kind[32];
+			int jsonPos = 0;
+			if (sscanf(line.c_str(), "%255s %31s %n", name, kind, &jsonPos) < 2 || !jsonPos) {
+				THROW_STD(invalid_argument, "%s:%zd: bad line: %s", from, ln+1, line.c_str());
+			}
+			Config conf;
+			conf.name = name;
+			if (strcmp(kind, "index") == 0)
+				conf.isIndex = true;
+			else if (strcmp(kind, "store") != 0) {
+				THROW_STD(invalid_argument, "%s:%zd: kind must be store or index: %s"
+					, from, ln+1, kind);
+			}
+			conf.opts = json::parse(line.c_str() + jsonPos);
+			if (!conf.opts.is_object()) {
+				THROW_STD(invalid_argument, "%s:%zd: options must be a json object"
+					, from, ln+1);
+			}
+			m_grid.push_back(std::move(conf));
+		}
+		if (m_grid.empty()) {
+			THROW_STD(invalid_argument, "no configs in %s", from);
+		}
+	}
+
+	void loadGrid() {
+		if (m_opt.grid.empty()) {
+			parseGrid(g_defaultGrid, "<builtin grid>");
+			return;
+		}
+		LineBuf text;
+		text.read_all(m_opt.grid.c_str());
+		parseGrid(fstring(text.p, text.n), m_opt.grid.c_str());
+	}
+
+	// options of the config are checked by the table, as a user table
+	DbTablePtr createScratchTable(const Config& conf) {
+		std::string dir = m_opt.dir + "/" + conf.name;
+		fs::create_directories(dir);
+		json meta = json::parse(R"({
+	"RowSchema": { "columns": {
+		"key": { "type": "strzero" },
+		"val": { "type": "strzero" }
+	} },
+	"ColumnGroups": { "valcg": { "fields": [ "val" ] } },
+	"TableIndex": [ { "fields": "key", "ordered": true } ]
+}
+)");
+		json& target = conf.isIndex ? meta["TableIndex"][0] : meta["ColumnGroups"]["valcg"];
+		for (auto iter = conf.opts.begin(); iter != conf.opts.end(); ++iter)
+			target[iter.key()] = iter.value();
+		std::string str = meta.dump(2);
+		std::string fname = dir + "/dbmeta.json";
+		FILE* fp = fopen(fname.c_str(), "w");
+		if (!fp) {
+			THROW_STD(invalid_argument, "fopen(%s) = %s", fname.c_str(), strerror(errno));
+		}
+		fwrite(str.data(), 1, str.size(), fp);
+		fclose(fp);
+		return DbTable::open(dir);
+	}
+
+	// the same path as NestLoudsTrieStore::build_by_iter of a segment
+	ReadableStore* buildStore(const Schema& schema, const std::string& fpath) {
+		if (schema.m_dictZipSampleRatio <= 0) {
+			SortableStrVec strVec;
+			for (size_t i = 0; i < m_recs.size(); ++i)
+				strVec.push_back(m_recs[i]);
+			auto store = new dfadb::NestLoudsTrieStore(schema);
+			store->build(schema, strVec);
+			return store;
+		}
+		auto builder = dfadb::createDictZipBlobStoreBuilder(schema);
+		std::mt19937_64 random(m_opt.seed);
+		uint64_t sampleUpperBound = random.min() +
+			(random.max() - random.min()) * schema.m_dictZipSampleRatio;
+		size_t sampled = 0;
+		for (size_t i = 0; i < m_recs.size(); ++i) {
+			fstring rec = m_recs[i];
+			if (random() < sampleUpperBound) {
+				builder->addSample(rec);
+				sampled += rec.size();
+			}
+		}
+		if (0 == sampled) {
+			fstring rec = m_recs[0];
+			builder->addSample(rec.empty() ? fstring("Hello World!") : rec);
+		}
+		builder->prepare(m_recs.size(), fpath);
+		for (size_t i = 0; i < m_recs.size(); ++i)
+			builder->addRecord(m_recs[i]);
+		return new dfadb::NestLoudsTrieStore(schema, builder->finish());
+	}
+
+	static void readStat(const DbPerfCounters& pc, DbPerfOp op, Result* r) {
+		DbPerfSnapshot snap;
+		pc.snapshot(&snap);
+		const DbPerfOpStat& st = snap[op];
+		r->readAvgNs = st.count ? double(st.sumNs) / st.count : 0;
+		r->readP99Ns = double(st.p99Ns);
+	}
+
+	void measureStore(const Config& conf, Result* r) {
+		DbTablePtr tab = createScratchTable(conf);
+		const Schema& schema = tab->getColgroupSchema(tab->getColgroupId("valcg"));
+		std::string fpath = m_opt.dir + "/" + conf.name + "/store.nlt";
+		profiling pf;
+		llong t0 = pf.now();
+		ReadableStorePtr store = buildStore(schema, fpath);
+		r->buildMBps = m_recBytes / pf.uf(t0, pf.now());
+		r->storageSize = store->dataStorageSize();
+		r->ratio = double(m_recBytes) / std::max<llong>(r->storageSize, 1);
+		DbContextPtr ctx = tab->createDbContext();
+		DbPerfCounters pc;
+		valvec<byte> val;
+		for (size_t id : m_randIds) {
+			val.risk_set_size(0);
+			ullong t1 = DbPerfCounters::nowNs();
+			store->getValueAppend(id, &val, ctx.get());
+			pc.add(DbPerfOp::get, DbPerfCounters::nowNs() - t1);
+			if (fstring(val) != fstring(m_recs[id]))
+				r->diff++;
+		}
+		readStat(pc, DbPerfOp::get, r);
+		size_t bytes = 0;
+		t0 = pf.now();
+		for (size_t id = 0; id < m_recs.size(); ++id) {
+			val.risk_set_size(0);
+			store->getValueAppend(id, &val, ctx.get());
+			bytes += val.size();
+		}
+		r->seqMBps = bytes / pf.uf(t0, pf.now());
+		if (bytes != m_recBytes)
+			r->diff++;
+	}
+
+	void measureIndex(const Config& conf, Result* r) {
+		DbTablePtr tab = createScratchTable(conf);
+		const Schema& schema = tab->getIndexSchema(0);
+		profiling pf;
+		llong t0 = pf.now();
+		SortableStrVec strVec;
+		for (size_t i = 0; i < m_keys.size(); ++i)
+			strVec.push_back(m_keys[i]);
+		ReadableIndexPtr index = new dfadb::NestLoudsTrieIndex(schema, strVec);
+		r->buildMBps = m_keyBytes / pf.uf(t0, pf.now());
+		r->storageSize = index->indexStorageSize();
+		r->ratio = double(m_keyBytes) / std::max<llong>(r->storageSize, 1);
+		DbContextPtr ctx = tab->createDbContext();
+		DbPerfCounters pc;
+		valvec<llong> recIds;
+		for (size_t id : m_randIds) {
+			ullong t1 = DbPerfCounters::nowNs();
+			index->searchExact(m_keys[id], &recIds, ctx.get());
+			pc.add(DbPerfOp::indexSearch, DbPerfCounters::nowNs() - t1);
+			if (std::find(recIds.begin(), recIds.end(), llong(id)) == recIds.end())
+				r->diff++;
+		}
+		readStat(pc, DbPerfOp::indexSearch, r);
+		IndexIteratorPtr iter = index->createIndexIterForward(ctx.get());
+		valvec<byte> key;
+		llong  id = -1;
+		size_t bytes = 0, rows = 0;
+		t0 = pf.now();
+		while (iter->increment(&id, &key)) {
+			bytes += key.size();
+			rows++;
+		}
+		r->seqMBps = bytes / pf.uf(t0, pf.now());
+		if (rows != m_keys.size())
+			r->diff++;
+	}
+
+	static json toJson(const Result& r) {
+		json js;
+		js["kind"] = r.isIndex ? "index" : "store";
+		js["storageSize"] = r.storageSize;
+		js["ratio"] = r.ratio;
+		js["buildMBps"] = r.buildMBps;
+		js["readAvgNs"] = r.readAvgNs;
+		js["readP99Ns"] = r.readP99Ns;
+		js["seqMBps"] = r.seqMBps;
+		return js;
+	}
+
+	// p99 is not checked, it is a histogram bucket which is too coarse
+	void checkBaseline() {
+		LineBuf text;
+		text.read_all(m_opt.baseline.c_str());
+		const json base = json::parse(std::string(text.p, text.n));
+		if (base.value("records", llong(0)) != llong(m_recs.size()) ||
+			base.value("inputBytes", llong(0)) != llong(m_recBytes)) {
+			fprintf(stderr, "WARN: baseline %s is of other data: records = %lld, inputBytes = %lld\n"
+				, m_opt.baseline.c_str(), base.value("records", llong(0))
+				, base.value("inputBytes", llong(0)));
+		}
+		const json& results = base["results"];
+		for (Result& r : m_results) {
+			auto found = results.find(r.name);
+			if (results.end() == found) {
+				fprintf(stderr, "WARN: %s is not in baseline %s\n"
+					, r.name.c_str(), m_opt.baseline.c_str());
+				continue;
+			}
+			const json& b = found.value();
+			auto lower = [&](const char* metric, double cur, double tol) {
+				double old = b.value(metric, 0.0);
+				if (old > 0 && cur < old * (1 - tol))
+					r.regress += r.regress.empty() ? metric : std::string(",") + metric;
+			};
+			auto higher = [&](const char* metric, double cur, double tol) {
+				double old = b.value(metric, 0.0);
+				if (old > 0 && cur > old * (1 + tol))
+					r.regress += r.regress.empty() ? metric : std::string(",") + metric;
+			};
+			lower("ratio", r.ratio, m_opt.ratioTol);
+			lower("buildMBps", r.buildMBps, m_opt.speedTol);
+			lower("seqMBps", r.seqMBps, m_opt.speedTol);
+			higher("readAvgNs", r.readAvgNs, m_opt.speedTol);
+		}
+	}
+
+	void saveBaseline() const {
+		json js;
+		js["records"] = m_recs.size();
+		js["inputBytes"] = m_recBytes;
+		js["keyBytes"] = m_keyBytes;
+		json& results = js["results"];
+		for (const Result& r : m_results)
+			results[r.name] = toJson(r);
+		std::string str = js.dump(2);
+		FILE* fp = fopen(m_opt.saveBaseline.c_str(), "w");
+		if (!fp) {
+			THROW_STD(invalid_argument, "fopen(%s) = %s"
+				, m_opt.saveBaseline.c_str(), strerror(errno));
+		}
+		fwrite(str.data(), 1, str.size(), fp);
+		fclose(fp);
+		fprintf(stderr, "INFO: saved baseline %s\n", m_opt.saveBaseline.c_str());
+	}
+
+	void printTable() const {
+		printf("records = %zd, bytes = %zd, keyBytes = %zd, ops = %zd, speeds are MB/sec\n"
+			, m_recs.size(), m_recBytes, m_keyBytes, m_randIds.size());
+		printf("%-14s %5s %12s %7s %9s %9s %9s %9s %5s %s\n"
+			, "name", "kind", "storageSize", "ratio", "buildMBps"
+			, "readAvgNs", "readP99Ns", "seqMBps", "diff", "regress");
+		for (const Result& r : m_results) {
+			printf("%-14s %5s %12lld %7.3f %9.2f %9.0f %9.0f %9.2f %5zd %s\n"
+				, r.name.c_str(), r.isIndex ? "index" : "store", r.storageSize
+				, r.ratio, r.buildMBps, r.readAvgNs, r.readP99Ns, r.seqMBps
+				, r.diff, r.regress.c_str());
+		}
+	}
+
+public:
+	explicit DictZipBench(const Options& opt) : m_opt(opt) {}
+	int run(const char* dataFile) {
+		loadGrid();
+		loadRecords(dataFile);
+		fs::remove_all(m_opt.dir);
+		for (const Config& conf : m_grid) {
+			Result r;
+			r.name = conf.name;
+			r.isIndex = conf.isIndex;
+			if (conf.isIndex)
+				measureIndex(conf, &r);
+			else
+				measureStore(conf, &r);
+			fprintf(stderr, "INFO: %s: ratio = %.3f, build = %.2f MB/s\n"
+				, r.name.c_str(), r.ratio, r.buildMBps);
+			m_results.push_back(r);
+		}
+		if (!m_opt.baseline.empty())
+			checkBaseline();
+		if (!m_opt.saveBaseline.empty())
+			saveBaseline();
+		printTable();
+		int ret = 0;
+		for (const Result& r : m_results) {
+			if (r.diff || !r.regress.empty())
+				ret = 2;
+		}
+		DbTable::safeStopAndWaitForCompress();
+		return ret;
+	}
+};
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	for (;;) {
+		int c = getopt(argc, argv, "g:n:R:d:S:b:B:r:s:h");
+		switch (c) {
+		case -1:
+			goto GetoptDone;
+		case 'g': opt.grid = optarg; break;
+		case 'n': opt.num = strtoull(optarg, NULL, 10); break;
+		case 'R': opt.ops = std::max<size_t>(strtoull(optarg, NULL, 10), 1); break;
+		case 'd': opt.dir = optarg; break;
+		case 'S': opt.seed = (unsigned)strtoul(optarg, NULL, 10); break;
+		case 'b': opt.baseline = optarg; break;
+		case 'B': opt.saveBaseline = optarg; break;
+		case 'r': opt.ratioTol = strtod(optarg, NULL); break;
+		case 's': opt.speedTol = strtod(optarg, NULL); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+GetoptDone:
+	if (optind + 1 > argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	try {
+		DictZipBench bench(opt);
+		return bench.run(argv[optind]);
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: %s\n", ex.what());
+		return 1;
+	}
+}
@@ -0,0 +1,420 @@
+// index_bench.cpp : compare index implementations built from one key file
+//
+// usage: see usage() or run with -h
+// the comparison table is printed to stdout
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/db_table.hpp>
+#include <terark/db/db_context.hpp>
+#include <terark/db/intkey_index.hpp>
+#include <terark/db/fixed_len_key_index.hpp>
+#include <terark/db/seq_num_index.hpp>
+#include <terark/db/dfadb/nlt_index.hpp>
+#include <terark/db/trbdb/trb_db_index.hpp>
+#include <terark/db/wiredtiger/wt_db_index.hpp>
+#include <terark/util/linebuf.hpp>
+#include <terark/util/profiling.hpp>
+#include <terark/util/sortable_strvec.hpp>
+#include <terark/lcast.hpp>
+#include <boost/filesystem.hpp>
+#include <wiredtiger.h>
+#include <getopt.h>
+#include <algorithm>
+#include <random>
+#include <thread>
+
+using namespace terark;
+using namespace terark::db;
+namespace fs = boost::filesystem;
+
+void usage(const char* prog) {
+	fprintf(stderr, R"EOS(usage: %s options keyFile
+options:
+  -T type     key type: strzero, uint32, uint64, sint64 or fixed:N, default
+              strzero, integers are parsed from text lines, fixed keys are
+              padded with '\0' or truncated to N bytes
+  -i indices  comma separated, default is all applicable:
+              nlt,zipint,fixedlen,seqnum,trb,wt
+  -n num      max keys loaded from keyFile, default all
+  -R ops      lookups and seeks of each benchmark, default number of keys
+  -t threads  the N of N threads benchmarks, default cpu num
+  -d dir      scratch dir, default ./index_bench.tmp
+  -u          keys are unique
+  -S seed     random seed
+recId of a key is its line number, seqnum is applicable only if keys are
+integers and key == first key + recId.
+)EOS", prog);
+}
+
+struct Options {
+	std::string keyType = "strzero";
+	std::string indices = "nlt,zipint,fixedlen,seqnum,trb,wt";
+	std::string dir = "index_bench.tmp";
+	size_t num = size_t(-1);
+	size_t ops = 0;
+	size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	bool unique = false;
+	unsigned seed = 301;
+};
+
+struct Result {
+	std::string name;
+	double buildSec = 0;
+	double memBytesPerKey = 0;
+	double diskBytesPerKey = -1; // < 0 : not applicable
+	double exact[2] = {0, 0};    // ops/sec of 1 and N threads
+	double seek[2]  = {0, 0};
+	double iter[2]  = {0, 0};    // keys/sec
+};
+
+class IndexBench {
+	Options m_opt;
+	DbTablePtr m_tab; // just for DbContext and index schema
+	const Schema* m_schema = NULL;
+	size_t m_fixlen = 0;
+	valvec<byte>  m_keyBuf; // all keys of fixed len, or strpool
+	valvec<size_t> m_keyOffsets; // size is numKeys + 1
+	valvec<size_t> m_probes;     // key ids of lookups and seeks
+	std::vector<Result> m_results;
+	WT_CONNECTION* m_wtConn = NULL;
+
+	size_t numKeys() const { return m_keyOffsets.size() - 1; }
+	fstring key(size_t i) const {
+		return fstring(m_keyBuf.data() + m_keyOffsets[i],
+					   m_keyOffsets[i+1] - m_keyOffsets[i]);
+	}
+
+	void createScratchTable() {
+		fs::remove_all(m_opt.dir);
+		fs::create_directories(m_opt.dir + "/table");
+		std::string colType;
+		if (strncmp(m_opt.keyType.c_str(), "fixed:", 6) == 0) {
+			colType = R"("type": "fixed", "length": )" + m_opt.keyType.substr(6);
+		} else {
+			colType = R"("type": ")" + m_opt.keyType + "\"";
+		}
+		std::string meta = R"({
+	"RowSchema": { "columns": { "key": { )" + colType + R"( } } },
+	"TableIndex": [ { "fields": "key", "ordered": true, "unique": )"
+		+ std::string(m_opt.unique ? "true" : "false") + R"( } ]
+}
+)";
+		std::string fname = m_opt.dir + "/table/dbmeta.json";
+		FILE* fp = fopen(fname.c_str(), "w");
+		if (!fp) {
+			THROW_STD(invalid_argument, "fopen(%s) = %s", fname.c_str(), strerror(errno));
+		}
+		fwrite(meta.data(), 1, meta.size(), fp);
+		fclose(fp);
+		m_tab = DbTable::open(m_opt.dir + "/table");
+		m_schema = &m_tab->getIndexSchema(0);
+		m_fixlen = m_schema->getFixedRowLen();
+	}
+
+	void loadKeys(const char* fname) {
+		FILE* fp = fopen(fname, "r");
+		if (!fp) {
+			THROW_STD(invalid_argument, "fopen(%s) = %s", fname, strerror(errno));
+		}
+		const ColumnType type = m_schema->getColumnMeta(0).type;
+		LineBuf line;
+		m_keyOffsets.push_back(0);
+		while (numKeys() < m_opt.num && line.getline(fp) > 0) {
+			line.chomp();
+			switch (type) {
+			default:
+				if (m_fixlen) {
+					size_t n = std::min(m_fixlen, line.size());
+					m_keyBuf.append((const byte*)line.p, n);
+					m_keyBuf.resize(m_keyOffsets.back() + m_fixlen, 0);
+				} else {
+					m_keyBuf.append((const byte*)line.p, line.size());
+				}
+				break;
+			case ColumnType::Uint32: {
+				uint32_t x = (uint32_t)strtoul(line.p, NULL, 10);
+				m_keyBuf.append((const byte*)&x, 4);
+				break; }
+			case ColumnType::Uint64: {
+				uint64_t x = strtoull(line.p, NULL, 10);
+				m_keyBuf.append((const byte*)&x, 8);
+				break; }
+			case ColumnType::Sint64: {
+				int64_t x = strtoll(line.p, NULL, 10);
+				m_keyBuf.append((const byte*)&x, 8);
+				break; }
+			}
+			m_keyOffsets.push_back(m_keyBuf.size());
+		}
+		fclose(fp);
+		if (0 == numKeys()) {
+			THROW_STD(invalid_argument, "no keys in %s", fname);
+		}
+		if (0 == m_opt.ops)
+			m_opt.ops = numKeys();
+		std::mt19937_64 rng(m_opt.seed);
+		m_probes.resize_no_init(m_opt.ops);
+		for (size_t i = 0; i < m_opt.ops; ++i)
+			m_probes[i] = size_t(rng() % numKeys());
+		fprintf(stderr, "INFO: loaded %zd keys, %zd bytes, type = %s\n"
+			, numKeys(), m_keyBuf.size(), m_opt.keyType.c_str());
+	}
+
+	// strpool only for fixed len keys, as ReadonlySegment does
+	void fillStrVec(SortableStrVec& strVec, bool forcePushBack) const {
+		for (size_t i = 0; i < numKeys(); ++i) {
+			if (m_fixlen && !forcePushBack)
+				strVec.m_strpool.append(key(i));
+			else
+				strVec.push_back(key(i));
+		}
+	}
+
+	bool isSeqNum() const {
+		const ColumnType type = m_schema->getColumnMeta(0).type;
+		if (type != ColumnType::Uint32 && type != ColumnType::Uint64 &&
+			type != ColumnType::Sint64)
+			return false;
+		for (size_t i = 1; i < numKeys(); ++i) {
+			ullong prev = 0, curr = 0;
+			memcpy(&prev, key(i-1).data(), m_fixlen);
+			memcpy(&curr, key(i).data(), m_fixlen);
+			if (curr != prev + 1)
+				return false;
+		}
+		return true;
+	}
+
+	ReadableIndex* createSeqNumIndex() const {
+		switch (m_schema->getColumnMeta(0).type) {
+		default: break;
+		case ColumnType::Uint32:
+			return new SeqNumIndex<uint32_t>(unaligned_load<uint32_t>(key(0).udata()), numKeys());
+		case ColumnType::Uint64:
+			return new SeqNumIndex<uint64_t>(unaligned_load<uint64_t>(key(0).udata()), numKeys());
+		case ColumnType::Sint64:
+			return new SeqNumIndex<int64_t>(unaligned_load<int64_t>(key(0).udata()), numKeys());
+		}
+		return NULL;
+	}
+
+	ReadableIndexPtr build(fstring name, Result* r) {
+		const ColumnType type = m_schema->getColumnMeta(0).type;
+		ReadableIndexPtr index;
+		SortableStrVec strVec;
+		DbContextPtr ctx = m_tab->createDbContext();
+		profiling pf;
+		if (name == "nlt") {
+			fillStrVec(strVec, true);
+			llong t0 = pf.now();
+			index = new dfadb::NestLoudsTrieIndex(*m_schema, strVec);
+			r->buildSec = pf.sf(t0, pf.now());
+		}
+		else if (name == "zipint") {
+			if (1 != m_schema->columnNum() || !m_schema->getColumnMeta(0).isInteger())
+				return NULL;
+			fillStrVec(strVec, false);
+			llong t0 = pf.now();
+			std::unique_ptr<ZipIntKeyIndex> zi(new ZipIntKeyIndex(*m_schema));
+			zi->build(type, strVec);
+			index = zi.release();
+			r->buildSec = pf.sf(t0, pf.now());
+		}
+		else if (name == "fixedlen") {
+			if (0 == m_fixlen)
+				return NULL;
+			fillStrVec(strVec, false);
+			llong t0 = pf.now();
+			std::unique_ptr<FixedLenKeyIndex> fi(new FixedLenKeyIndex(*m_schema));
+			fi->build(*m_schema, strVec);
+			index = fi.release();
+			r->buildSec = pf.sf(t0, pf.now());
+		}
+		else if (name == "seqnum") {
+			if (!isSeqNum())
+				return NULL;
+			llong t0 = pf.now();
+			index = createSeqNumIndex();
+			r->buildSec = pf.sf(t0, pf.now());
+		}
+		else if (name == "trb" || name == "wt") {
+			llong t0 = pf.now();
+			if (name == "trb") {
+				index = trbdb::TrbWritableIndex::createIndex(*m_schema);
+			} else {
+				std::string home = m_opt.dir + "/wt";
+				fs::create_directories(home);
+				int err = wiredtiger_open(home.c_str(), NULL, "create", &m_wtConn);
+				if (err) {
+					THROW_STD(invalid_argument, "wiredtiger_open(%s) = %s"
+						, home.c_str(), wiredtiger_strerror(err));
+				}
+				index = new wt::WtWritableIndex(*m_schema, m_wtConn);
+			}
+			WritableIndex* wi = index->getWritableIndex();
+			for (size_t i = 0; i < numKeys(); ++i)
+				wi->insert(key(i), llong(i), ctx.get());
+			r->buildSec = pf.sf(t0, pf.now());
+		}
+		else {
+			THROW_STD(invalid_argument, "unknown index: %.*s", name.ilen(), name.data());
+		}
+		r->memBytesPerKey = double(index->indexStorageSize()) / numKeys();
+		if (name != "trb" && name != "wt") {
+			fs::path subdir = fs::path(m_opt.dir) / name.str();
+			fs::create_directories(subdir);
+			index->save(subdir / "index");
+			llong bytes = 0;
+			for (auto& e : fs::directory_iterator(subdir))
+				if (fs::is_regular_file(e.path()))
+					bytes += fs::file_size(e.path());
+			r->diskBytesPerKey = double(bytes) / numKeys();
+		}
+		return index;
+	}
+
+	// run fn(threadno, ctx) on threads, returns ops/sec of total ops
+	template<class Fn>
+	double run(size_t threads, size_t totalOps, Fn fn) {
+		std::vector<std::thread> ths;
+		profiling pf;
+		llong t0 = pf.now();
+		for (size_t i = 0; i < threads; ++i) {
+			ths.emplace_back([&,i]() {
+				DbContextPtr ctx = m_tab->createDbContext();
+				fn(i, ctx.get());
+			});
+		}
+		for (auto& th : ths)
+			th.join();
+		return totalOps / pf.sf(t0, pf.now());
+	}
+
+	void measure(const ReadableIndex* index, Result* r) {
+		std::atomic<size_t> misses(0), seekMisses(0);
+		for (int k = 0; k < 2; ++k) {
+			const size_t threads = 0 == k ? 1 : m_opt.threads;
+			const size_t perThread = (m_probes.size() + threads - 1) / threads;
+			r->exact[k] = run(threads, m_probes.size(), [&](size_t tid, DbContext* ctx) {
+				valvec<llong> recIds;
+				size_t beg = tid * perThread;
+				size_t end = std::min(beg + perThread, m_probes.size());
+				for (size_t i = beg; i < end; ++i) {
+					index->searchExact(key(m_probes[i]), &recIds, ctx);
+					if (recIds.empty())
+						misses++;
+				}
+			});
+			r->seek[k] = run(threads, m_probes.size(), [&](size_t tid, DbContext* ctx) {
+				IndexIteratorPtr iter(index->createIndexIterForward(ctx));
+				valvec<byte> retKey;
+				llong id = -1;
+				size_t beg = tid * perThread;
+				size_t end = std::min(beg + perThread, m_probes.size());
+				for (size_t i = beg; i < end; ++i) {
+					if (iter->seekLowerBound(key(m_probes[i]), &id, &retKey) < 0)
+						seekMisses++;
+				}
+			});
+			r->iter[k] = run(threads, threads * numKeys(), [&](size_t, DbContext* ctx) {
+				IndexIteratorPtr iter(index->createIndexIterForward(ctx));
+				valvec<byte> retKey;
+				llong id = -1;
+				while (iter->increment(&id, &retKey)) {}
+			});
+		}
+		if (misses || seekMisses) {
+			fprintf(stderr, "WARN: %s: exact misses = %zd, seek eof = %zd\n"
+				, r->name.c_str(), size_t(misses), size_t(seekMisses));
+		}
+	}
+
+	void printTable() const {
+		printf("keys = %zd, ops = %zd, N = %zd threads, throughput is M/sec\n"
+			, numKeys(), m_opt.ops, m_opt.threads);
+		printf("%-9s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n"
+			, "index", "build_s", "memB/key", "diskB/key"
+			, "exact_1", "exact_N", "seek_1", "seek_N", "iter_1", "iter_N");
+		for (const Result& r : m_results) {
+			char disk[32] = "-";
+			if (r.diskBytesPerKey >= 0)
+				snprintf(disk, sizeof(disk), "%.2f", r.diskBytesPerKey);
+			printf("%-9s %9.3f %9.2f %9s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n"
+				, r.name.c_str(), r.buildSec, r.memBytesPerKey, disk
+				, r.exact[0]/1e6, r.exact[1]/1e6, r.seek[0]/1e6, r.seek[1]/1e6
+				, r.iter[0]/1e6, r.iter[1]/1e6);
+		}
+	}
+
+public:
+	explicit IndexBench(const Options& opt) : m_opt(opt) {}
+	~IndexBench() {
+		if (m_wtConn)
+			m_wtConn->close(m_wtConn, NULL);
+	}
+	int run(const char* keyFile) {
+		createScratchTable();
+		loadKeys(keyFile);
+		valvec<fstring> names;
+		fstring(m_opt.indices).split(',', &names);
+		for (fstring name : names) {
+			Result r;
+			r.name = name.str();
+			ReadableIndexPtr index;
+			try {
+				index = build(name, &r);
+			}
+			catch (const std::exception& ex) {
+				fprintf(stderr, "WARN: build %s failed: %s, skipped\n", r.name.c_str(), ex.what());
+				continue;
+			}
+			if (!index) {
+				fprintf(stderr, "INFO: %s is not applicable to the keys, skipped\n", r.name.c_str());
+				continue;
+			}
+			fprintf(stderr, "INFO: %s built in %.3f sec\n", r.name.c_str(), r.buildSec);
+			measure(index.get(), &r);
+			m_results.push_back(r);
+		}
+		printTable();
+		m_tab = nullptr;
+		DbTable::safeStopAndWaitForCompress();
+		return 0;
+	}
+};
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	for (;;) {
+		int c = getopt(argc, argv, "T:i:n:R:t:d:uS:h");
+		switch (c) {
+		case -1:
+			goto GetoptDone;
+		case 'T': opt.keyType = optarg; break;
+		case 'i': opt.indices = optarg; break;
+		case 'n': opt.num = strtoull(optarg, NULL, 10); break;
+		case 'R': opt.ops = strtoull(optarg, NULL, 10); break;
+		case 't': opt.threads = std::max<size_t>(strtoull(optarg, NULL, 10), 1); break;
+		case 'd': opt.dir = optarg; break;
+		case 'u': opt.unique = true; break;
+		case 'S': opt.seed = (unsigned)strtoul(optarg, NULL, 10); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+GetoptDone:
+	if (optind + 1 > argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	try {
+		IndexBench bench(opt);
+		return bench.run(argv[optind]);
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: %s\n", ex.what());
+		return 1;
+	}
+}
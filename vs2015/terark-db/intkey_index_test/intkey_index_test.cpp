@@ -0,0 +1,124 @@
+// intkey_index_test.cpp : functional test of searches of ZipIntKeyIndex
+//
+// keys with duplicates and gaps are built in each search mode(dense, bitmap
+// and binary), lower_bound, upper_bound, equal_range, exact search and exact
+// batch search of keys around and between the keys are compared with them
+// of a binary search on the plain sorted keys. Exits 1 on failure
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/intkey_index.hpp>
+#include <algorithm>
+#include <random>
+
+using namespace terark;
+using namespace terark::db;
+
+static int g_failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failed++; \
+	} \
+} while (0)
+
+class TestIndex : public ZipIntKeyIndex {
+public:
+	using ZipIntKeyIndex::ZipIntKeyIndex;
+	using ZipIntKeyIndex::searchLowerBound;
+	using ZipIntKeyIndex::searchUpperBound;
+	using ZipIntKeyIndex::searchEqualRange;
+};
+
+template<class Int>
+static void testKeys(const char* name, ColumnType type, const std::vector<Int>& keys) {
+	Schema schema;
+	schema.m_columnsMeta.insert_i("key", ColumnMeta(type));
+	schema.compile();
+	SortableStrVec strVec;
+	strVec.m_strpool.append((const byte*)keys.data(), sizeof(Int) * keys.size());
+	TestIndex index(schema);
+	index.build(type, strVec);
+	std::vector<Int> sorted(keys);
+	std::sort(sorted.begin(), sorted.end());
+	Int lo = sorted.front(), hi = sorted.back();
+	std::vector<Int> probes;
+	for (llong k = llong(lo) - 3; k <= llong(hi) + 3; ++k) {
+		if (Int(k) == k)
+			probes.push_back(Int(k));
+	}
+	size_t failed = g_failed;
+	valvec<llong> recIds, batchIds;
+	for (Int k : probes) {
+		fstring key((const char*)&k, sizeof(Int));
+		size_t lb = std::lower_bound(sorted.begin(), sorted.end(), k) - sorted.begin();
+		size_t ub = std::upper_bound(sorted.begin(), sorted.end(), k) - sorted.begin();
+		CHECK(index.searchLowerBound(key) == lb);
+		CHECK(index.searchUpperBound(key) == ub);
+		auto er = index.searchEqualRange(key);
+		CHECK(er.first == lb);
+		CHECK(er.second == ub);
+		recIds.erase_all();
+		index.searchExactAppend(key, &recIds, NULL);
+		CHECK(recIds.size() == ub - lb);
+		for (llong recId : recIds) {
+			CHECK(keys[size_t(recId)] == k);
+		}
+	}
+	// batch of the probes in a random order
+	std::shuffle(probes.begin(), probes.end(), std::mt19937(7));
+	std::vector<fstring> fkeys;
+	for (const Int& k : probes)
+		fkeys.push_back(fstring((const char*)&k, sizeof(Int)));
+	std::vector<size_t> offsets(probes.size() + 1);
+	index.searchExactAppendBatch(fkeys.data(), fkeys.size(), &batchIds, offsets.data(), NULL);
+	for (size_t j = 0; j < probes.size(); ++j) {
+		size_t end = offsets[j + 1];
+		recIds.erase_all();
+		index.searchExactAppend(fkeys[j], &recIds, NULL);
+		CHECK(end - offsets[j] == recIds.size());
+		for (size_t i = offsets[j]; i < end && i - offsets[j] < recIds.size(); ++i) {
+			CHECK(batchIds[i] == recIds[i - offsets[j]]);
+		}
+	}
+	fprintf(stderr, "INFO: %s: rows = %zd, probes = %zd, %s\n", name, keys.size()
+		, probes.size(), size_t(g_failed) == failed ? "passed" : "FAILED");
+}
+
+int main() {
+	std::mt19937 rng(12345);
+	const size_t rows = 1000;
+	// dense: 0..rows-1 shifted
+	std::vector<uint32_t> dense(rows);
+	for (size_t i = 0; i < rows; ++i)
+		dense[i] = uint32_t(100 + i);
+	std::shuffle(dense.begin(), dense.end(), rng);
+	testKeys("dense", ColumnType::Uint32, dense);
+	// bitmap: duplicates and gaps, max key < 7 * rows
+	std::vector<uint32_t> bitmap(rows);
+	for (size_t i = 0; i < rows; ++i)
+		bitmap[i] = uint32_t(50 + rng() % (2 * rows)) / 3 * 3; // gaps of 3
+	bitmap[0] = bitmap[1] = bitmap[2] = 50 / 3 * 3; // duplicates of min key
+	testKeys("bitmap", ColumnType::Uint32, bitmap);
+	std::vector<int32_t> sbitmap(rows);
+	for (size_t i = 0; i < rows; ++i)
+		sbitmap[i] = int32_t(rng() % (3 * rows)) - int32_t(rows);
+	testKeys("bitmap signed", ColumnType::Sint32, sbitmap);
+	std::vector<uint16_t> small(rows);
+	for (size_t i = 0; i < rows; ++i)
+		small[i] = uint16_t(rng() % 37); // many duplicates
+	testKeys("bitmap dups", ColumnType::Uint16, small);
+	// binary: too sparse for the bitmap
+	std::vector<uint32_t> sparse(rows);
+	for (size_t i = 0; i < rows; ++i)
+		sparse[i] = uint32_t(rng() % (100 * rows));
+	sparse[1] = sparse[0];
+	testKeys("binary", ColumnType::Uint32, sparse);
+	if (g_failed) {
+		fprintf(stderr, "ERROR: %d checks failed\n", g_failed);
+		return 1;
+	}
+	fprintf(stderr, "INFO: all passed\n");
+	return 0;
+}
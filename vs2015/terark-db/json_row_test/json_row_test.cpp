@@ -0,0 +1,92 @@
+// json_row_test.cpp : functional test of integers of Schema::parseJson
+//
+// values at the bounds of each integer column type must be parsed into the
+// row, values beyond the bounds(and negatives of unsigned types) must throw
+// invalid_argument instead of being truncated. Exits 1 on failure
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/db_conf.hpp>
+#include <stdexcept>
+
+using namespace terark;
+using namespace terark::db;
+
+static int g_failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failed++; \
+	} \
+} while (0)
+
+struct IntCase {
+	ColumnType  type;
+	const char* minVal;
+	const char* maxVal;
+	const char* below; // out of range
+	const char* above; // out of range
+	size_t      size;
+};
+
+static const IntCase g_cases[] = {
+	{ ColumnType::Uint08, "0", "255", "-1", "256", 1 },
+	{ ColumnType::Sint08, "-128", "127", "-129", "128", 1 },
+	{ ColumnType::Uint16, "0", "65535", "-1", "65536", 2 },
+	{ ColumnType::Sint16, "-32768", "32767", "-32769", "32768", 2 },
+	{ ColumnType::Uint32, "0", "4294967295", "-1", "4294967296", 4 },
+	{ ColumnType::Sint32, "-2147483648", "2147483647", "-2147483649", "2147483648", 4 },
+	{ ColumnType::Uint64, "0", "18446744073709551615", "-1", "18446744073709551616", 8 },
+	{ ColumnType::Sint64, "-9223372036854775808", "9223372036854775807",
+	  "-9223372036854775809", "9223372036854775808", 8 },
+};
+
+static bool parses(const Schema& schema, const char* val, valvec<byte>* row) {
+	std::string json = std::string("{\"x\":") + val + "}";
+	try {
+		schema.parseJson(json, row);
+		return true;
+	}
+	catch (const std::invalid_argument&) {
+		return false;
+	}
+}
+
+int main() {
+	for (const IntCase& c : g_cases) {
+		Schema schema;
+		schema.m_columnsMeta.insert_i("x", ColumnMeta(c.type));
+		schema.compile();
+		valvec<byte> row;
+		CHECK(parses(schema, c.minVal, &row));
+		CHECK(row.size() == c.size);
+		CHECK(parses(schema, c.maxVal, &row));
+		CHECK(row.size() == c.size);
+		if (row.size() == c.size) {
+			// the max of a signed type is 7f ff.., of an unsigned ff ff..
+			bool isSigned = '-' == c.minVal[0];
+			CHECK(row[c.size - 1] == (isSigned ? 0x7f : 0xff));
+			CHECK(c.size == 1 || row[0] == 0xff);
+		}
+		CHECK(!parses(schema, c.below, &row));
+		CHECK(!parses(schema, c.above, &row));
+		CHECK(!parses(schema, "300x", &row));
+		fprintf(stderr, "INFO: %s done\n", Schema::columnTypeStr(c.type));
+	}
+	{
+		// 300 in a uint08 column was stored as 44
+		Schema schema;
+		schema.m_columnsMeta.insert_i("x", ColumnMeta(ColumnType::Uint08));
+		schema.compile();
+		valvec<byte> row;
+		CHECK(!parses(schema, "300", &row));
+		CHECK(parses(schema, "200", &row) && row.size() == 1 && row[0] == 200);
+	}
+	if (g_failed) {
+		fprintf(stderr, "ERROR: %d checks failed\n", g_failed);
+		return 1;
+	}
+	fprintf(stderr, "INFO: all passed\n");
+	return 0;
+}
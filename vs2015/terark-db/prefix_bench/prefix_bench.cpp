@@ -0,0 +1,275 @@
+// prefix_bench.cpp : top k keys of a prefix over N NestLoudsTrieIndex
+//
+// usage: see usage() or run with -h
+// keys are split into N indices as segments of a table, the top k of a
+// prefix are merged from the N indices by iterators(seekLowerBound and
+// increment) and by ReadableIndex::scanPrefix, the table is printed to stdout
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/db_table.hpp>
+#include <terark/db/db_context.hpp>
+#include <terark/db/dfadb/nlt_index.hpp>
+#include <terark/util/linebuf.hpp>
+#include <terark/util/profiling.hpp>
+#include <terark/util/sortable_strvec.hpp>
+#include <boost/filesystem.hpp>
+#include <getopt.h>
+#include <algorithm>
+#include <random>
+
+using namespace terark;
+using namespace terark::db;
+namespace fs = boost::filesystem;
+
+void usage(const char* prog) {
+	fprintf(stderr, R"EOS(usage: %s options keyFile
+options:
+  -s segs     number of indices the keys are split into, default 8
+  -k topk     comma separated k of top k, default 1,10,100,1000
+  -p len      prefix len, default 3, prefixes are taken from random keys
+  -n num      max keys loaded from keyFile, default all
+  -R ops      prefix searches of each benchmark, default 100000
+  -d dir      scratch dir, default ./prefix_bench.tmp
+  -S seed     random seed
+recId of a key is its line number, keys are strzero.
+)EOS", prog);
+}
+
+struct Options {
+	std::string topk = "1,10,100,1000";
+	std::string dir = "prefix_bench.tmp";
+	size_t segs = 8;
+	size_t prefixLen = 3;
+	size_t num = size_t(-1);
+	size_t ops = 100000;
+	unsigned seed = 301;
+};
+
+struct Result {
+	size_t k = 0;
+	double iter = 0; // searches/sec
+	double scan = 0;
+	double avgKeys = 0;
+	size_t diff = 0; // searches of different results, must be 0
+};
+
+class PrefixBench {
+	Options m_opt;
+	DbTablePtr m_tab; // just for DbContext and index schema
+	const Schema* m_schema = NULL;
+	fstrvecl m_keys;
+	valvec<fstring> m_prefixes;
+	valvec<ReadableIndexPtr> m_indices;
+	std::vector<Result> m_results;
+
+	void createScratchTable() {
+		fs::remove_all(m_opt.dir);
+		fs::create_directories(m_opt.dir + "/table");
+		std::string meta = R"({
+	"RowSchema": { "columns": { "key": { "type": "strzero" } } },
+	"TableIndex": [ { "fields": "key", "ordered": true } ]
+}
+)";
+		std::string fname = m_opt.dir + "/table/dbmeta.json";
+		FILE* fp = fopen(fname.c_str(), "w");
+		if (!fp) {
+			THROW_STD(invalid_argument, "fopen(%s) = %s", fname.c_str(), strerror(errno));
+		}
+		fwrite(meta.data(), 1, meta.size(), fp);
+		fclose(fp);
+		m_tab = DbTable::open(m_opt.dir + "/table");
+		m_schema = &m_tab->getIndexSchema(0);
+	}
+
+	void loadKeys(const char* fname) {
+		FILE* fp = fopen(fname, "r");
+		if (!fp) {
+			THROW_STD(invalid_argument, "fopen(%s) = %s", fname, strerror(errno));
+		}
+		LineBuf line;
+		while (m_keys.size() < m_opt.num && line.getline(fp) > 0) {
+			line.chomp();
+			m_keys.emplace_back(line.p, line.size());
+		}
+		fclose(fp);
+		if (0 == m_keys.size()) {
+			THROW_STD(invalid_argument, "no keys in %s", fname);
+		}
+		std::mt19937_64 rng(m_opt.seed);
+		m_prefixes.resize_no_init(m_opt.ops);
+		for (size_t i = 0; i < m_opt.ops; ++i) {
+			fstring key = m_keys[rng() % m_keys.size()];
+			m_prefixes[i] = key.substr(0, std::min(key.size(), m_opt.prefixLen));
+		}
+		fprintf(stderr, "INFO: loaded %zd keys, %zd bytes\n"
+			, m_keys.size(), m_keys.strpool.size());
+	}
+
+	// recIds of an index are its physic ids, key i is in index i % segs
+	void build() {
+		profiling pf;
+		llong t0 = pf.now();
+		for (size_t j = 0; j < m_opt.segs; ++j) {
+			SortableStrVec strVec;
+			for (size_t i = j; i < m_keys.size(); i += m_opt.segs)
+				strVec.push_back(m_keys[i]);
+			m_indices.push_back(new dfadb::NestLoudsTrieIndex(*m_schema, strVec));
+		}
+		fprintf(stderr, "INFO: %zd indices built in %.3f sec\n"
+			, m_opt.segs, pf.sf(t0, pf.now()));
+	}
+
+	struct Cursor {
+		size_t seg;
+		size_t pos;
+		size_t end;
+	};
+	// merge top k of each segment, keys[seg] and ids[seg] are sorted by key
+	void merge(const valvec<fstrvecl>& keys, const valvec<valvec<llong> >& ids,
+			   size_t k, valvec<llong>* recIds) const {
+		valvec<Cursor> heap(keys.size(), valvec_reserve());
+		for (size_t j = 0; j < keys.size(); ++j) {
+			if (keys[j].size())
+				heap.push_back({j, 0, keys[j].size()});
+		}
+		auto greater = [&](const Cursor& x, const Cursor& y) {
+			int cmp = m_schema->compareData(keys[x.seg][x.pos], keys[y.seg][y.pos]);
+			return cmp ? cmp > 0 : x.seg > y.seg;
+		};
+		std::make_heap(heap.begin(), heap.end(), greater);
+		recIds->erase_all();
+		while (!heap.empty() && recIds->size() < k) {
+			std::pop_heap(heap.begin(), heap.end(), greater);
+			Cursor& top = heap.back();
+			recIds->push_back(ids[top.seg][top.pos] * m_opt.segs + top.seg);
+			if (++top.pos < top.end)
+				std::push_heap(heap.begin(), heap.end(), greater);
+			else
+				heap.pop_back();
+		}
+	}
+
+	void measure(Result* r) {
+		const size_t k = r->k;
+		const size_t segs = m_opt.segs;
+		DbContextPtr ctx = m_tab->createDbContext();
+		valvec<fstrvecl> keys(segs);
+		valvec<valvec<llong> > ids(segs);
+		valvec<valvec<llong> > iterResults(m_prefixes.size());
+		valvec<llong> recIds;
+		profiling pf;
+		size_t totalKeys = 0;
+		llong t0 = pf.now();
+		{
+			valvec<IndexIteratorPtr> iters(segs, valvec_reserve());
+			for (size_t j = 0; j < segs; ++j)
+				iters.emplace_back(m_indices[j]->createIndexIterForward(ctx.get()));
+			valvec<byte> key;
+			llong id = -1;
+			for (size_t i = 0; i < m_prefixes.size(); ++i) {
+				fstring prefix = m_prefixes[i];
+				for (size_t j = 0; j < segs; ++j) {
+					keys[j].erase_all();
+					ids[j].erase_all();
+					bool found = iters[j]->seekLowerBound(prefix, &id, &key) >= 0;
+					while (found && keys[j].size() < k && fstring(key).startsWith(prefix)) {
+						keys[j].emplace_back((const char*)key.data(), key.size());
+						ids[j].push_back(id);
+						found = iters[j]->increment(&id, &key);
+					}
+				}
+				merge(keys, ids, k, &iterResults[i]);
+				totalKeys += iterResults[i].size();
+			}
+		}
+		r->iter = m_prefixes.size() / pf.sf(t0, pf.now());
+		t0 = pf.now();
+		for (size_t i = 0; i < m_prefixes.size(); ++i) {
+			fstring prefix = m_prefixes[i];
+			for (size_t j = 0; j < segs; ++j) {
+				keys[j].erase_all();
+				ids[j].erase_all();
+				m_indices[j]->scanPrefix(prefix, [&](fstring key, llong id) {
+					keys[j].emplace_back(key.data(), key.size());
+					ids[j].push_back(id);
+					return keys[j].size() < k;
+				}, ctx.get());
+			}
+			merge(keys, ids, k, &recIds);
+			if (recIds != iterResults[i])
+				r->diff++;
+		}
+		r->scan = m_prefixes.size() / pf.sf(t0, pf.now());
+		r->avgKeys = double(totalKeys) / m_prefixes.size();
+	}
+
+	void printTable() const {
+		printf("keys = %zd, segs = %zd, prefixLen = %zd, ops = %zd, throughput is K/sec\n"
+			, m_keys.size(), m_opt.segs, m_opt.prefixLen, m_prefixes.size());
+		printf("%7s %9s %10s %10s %7s %6s\n"
+			, "k", "avgKeys", "iter", "scan", "speedup", "diff");
+		for (const Result& r : m_results) {
+			printf("%7zd %9.2f %10.3f %10.3f %7.2f %6zd\n"
+				, r.k, r.avgKeys, r.iter/1e3, r.scan/1e3, r.scan/r.iter, r.diff);
+		}
+	}
+
+public:
+	explicit PrefixBench(const Options& opt) : m_opt(opt) {}
+	int run(const char* keyFile) {
+		createScratchTable();
+		loadKeys(keyFile);
+		build();
+		valvec<fstring> topk;
+		fstring(m_opt.topk).split(',', &topk);
+		int ret = 0;
+		for (fstring k : topk) {
+			Result r;
+			r.k = std::max<size_t>(strtoull(k.str().c_str(), NULL, 10), 1);
+			measure(&r);
+			m_results.push_back(r);
+			if (r.diff)
+				ret = 2;
+		}
+		printTable();
+		m_indices.clear();
+		m_tab = nullptr;
+		DbTable::safeStopAndWaitForCompress();
+		return ret;
+	}
+};
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	for (;;) {
+		int c = getopt(argc, argv, "s:k:p:n:R:d:S:h");
+		switch (c) {
+		case -1:
+			goto GetoptDone;
+		case 's': opt.segs = std::max<size_t>(strtoull(optarg, NULL, 10), 1); break;
+		case 'k': opt.topk = optarg; break;
+		case 'p': opt.prefixLen = strtoull(optarg, NULL, 10); break;
+		case 'n': opt.num = strtoull(optarg, NULL, 10); break;
+		case 'R': opt.ops = std::max<size_t>(strtoull(optarg, NULL, 10), 1); break;
+		case 'd': opt.dir = optarg; break;
+		case 'S': opt.seed = (unsigned)strtoul(optarg, NULL, 10); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+GetoptDone:
+	if (optind + 1 > argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	try {
+		PrefixBench bench(opt);
+		return bench.run(argv[optind]);
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: %s\n", ex.what());
+		return 1;
+	}
+}
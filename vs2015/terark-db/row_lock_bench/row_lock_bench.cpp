@@ -0,0 +1,219 @@
+// row_lock_bench.cpp : contention of TrbRWRowMutex modes on hot rows
+//
+// usage: see usage() or run with -h
+// each thread locks zipfian rows, writers update the two words of a row,
+// readers check the words are equal, the table is printed to stdout
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/trbdb/trb_db_segment.hpp>
+#include <terark/util/profiling.hpp>
+#include <terark/lcast.hpp>
+#include <getopt.h>
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <thread>
+
+using namespace terark;
+using namespace terark::db;
+using namespace terark::db::trbdb;
+
+void usage(const char* prog) {
+	fprintf(stderr, R"EOS(usage: %s options
+options:
+  -m modes    comma separated, default map,stripe,optimistic
+              map       : a lock per row in a hash map
+              stripe    : fixed lock table of -s stripes
+              optimistic: stripe with optimistic(seqlock) readers
+  -n rows     default 1000000
+  -R ops      ops of each thread, default 1000000
+  -t threads  default 8
+  -w percent  writes in percent of ops, default 50
+  -s stripes  default 1024
+  -z theta    zipfian theta, default 0.99, 0 is uniform
+  -S seed     random seed
+)EOS", prog);
+}
+
+struct Options {
+	std::string modes = "map,stripe,optimistic";
+	size_t rows = 1000000;
+	size_t ops = 1000000;
+	size_t threads = 8;
+	size_t writePercent = 50;
+	size_t stripes = 1024;
+	double theta = 0.99;
+	unsigned seed = 301;
+};
+
+// zipfian of Gray et al, same as db_bench
+class KeyGen {
+	std::mt19937_64 m_rng;
+	size_t m_num;
+	double m_theta, m_zetan, m_alpha, m_eta;
+public:
+	static double zeta(size_t n, double theta) {
+		double sum = 0;
+		for (size_t i = 1; i <= n; ++i)
+			sum += 1 / std::pow(double(i), theta);
+		return sum;
+	}
+	KeyGen(size_t num, double theta, double zetan, unsigned seed)
+		: m_rng(seed), m_num(num), m_theta(theta), m_zetan(zetan) {
+		if (m_theta > 0) {
+			m_alpha = 1 / (1 - m_theta);
+			m_eta = (1 - std::pow(2.0 / num, 1 - m_theta)) /
+					(1 - zeta(2, m_theta) / m_zetan);
+		}
+	}
+	size_t next() {
+		if (m_theta <= 0)
+			return size_t(m_rng() % m_num);
+		double u = std::uniform_real_distribution<double>(0, 1)(m_rng);
+		double uz = u * m_zetan;
+		size_t rank;
+		if (uz < 1)
+			rank = 0;
+		else if (uz < 1 + std::pow(0.5, m_theta))
+			rank = 1;
+		else
+			rank = size_t(m_num * std::pow(m_eta * u - m_eta + 1, m_alpha));
+		uint64_t h = (rank + 1) * 0x9E3779B97F4A7C15ull;
+		return size_t((h ^ (h >> 29)) % m_num);
+	}
+	size_t rand() { return size_t(m_rng()); }
+};
+
+// words are atomic because optimistic readers race with writers
+struct Row {
+	std::atomic<ullong> a, b;
+};
+
+struct Result {
+	std::string mode;
+	double seconds = 0;
+	size_t ops = 0;
+	size_t fallback = 0; // optimistic reads which took the lock
+	size_t torn = 0;     // must be 0
+};
+
+static Result runMode(const Options& opt, const std::string& mode,
+					  double zetan, Row* rows) {
+	size_t stripes = "map" == mode ? 0 : opt.stripes;
+	bool optimistic = "optimistic" == mode;
+	SpinRwMutex segMutex;
+	TrbRWRowMutex rowMutex(segMutex, stripes, optimistic);
+	for (size_t i = 0; i < opt.rows; ++i) {
+		rows[i].a.store(0, std::memory_order_relaxed);
+		rows[i].b.store(0, std::memory_order_relaxed);
+	}
+	std::atomic<size_t> fallback(0), torn(0);
+	auto work = [&](size_t tid) {
+		KeyGen gen(opt.rows, opt.theta, zetan, unsigned(opt.seed + tid));
+		size_t myFallback = 0, myTorn = 0;
+		for (size_t i = 0; i < opt.ops; ++i) {
+			size_t id = gen.next();
+			Row& r = rows[id];
+			if (gen.rand() % 100 < opt.writePercent) {
+				TrbRWRowMutex::scoped_lock l(rowMutex, id, true);
+				ullong v = r.a.load(std::memory_order_relaxed) + 1;
+				r.a.store(v, std::memory_order_relaxed);
+				r.b.store(v, std::memory_order_relaxed);
+				continue;
+			}
+			if (optimistic) {
+				bool done = false;
+				for (size_t k = 0; k < TrbRWRowMutex::OptimisticRetry; ++k) {
+					uint32_t version;
+					if (!rowMutex.readBegin(id, version))
+						continue;
+					ullong a = r.a.load(std::memory_order_relaxed);
+					ullong b = r.b.load(std::memory_order_relaxed);
+					if (rowMutex.readValidate(id, version)) {
+						myTorn += a != b;
+						done = true;
+						break;
+					}
+				}
+				if (done)
+					continue;
+				myFallback++;
+			}
+			TrbRWRowMutex::scoped_lock l(rowMutex, id, false);
+			myTorn += r.a.load(std::memory_order_relaxed) !=
+					  r.b.load(std::memory_order_relaxed);
+		}
+		fallback += myFallback;
+		torn += myTorn;
+	};
+	profiling pf;
+	llong t0 = pf.now();
+	std::vector<std::thread> thr;
+	for (size_t i = 0; i < opt.threads; ++i)
+		thr.emplace_back(work, i);
+	for (auto& t : thr)
+		t.join();
+	Result res;
+	res.mode = mode;
+	res.seconds = pf.sf(t0, pf.now());
+	res.ops = opt.ops * opt.threads;
+	res.fallback = fallback;
+	res.torn = torn;
+	return res;
+}
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	for (;;) {
+		int opch = getopt(argc, argv, "hm:n:R:t:w:s:z:S:");
+		switch (opch) {
+		case -1:
+			goto GetoptDone;
+		case 'h':
+		case '?':
+		default:
+			usage(argv[0]);
+			return 1;
+		case 'm': opt.modes = optarg; break;
+		case 'n': opt.rows = lcast(optarg); break;
+		case 'R': opt.ops = lcast(optarg); break;
+		case 't': opt.threads = lcast(optarg); break;
+		case 'w': opt.writePercent = lcast(optarg); break;
+		case 's': opt.stripes = lcast(optarg); break;
+		case 'z': opt.theta = strtod(optarg, NULL); break;
+		case 'S': opt.seed = (unsigned)lcast(optarg); break;
+		}
+	}
+GetoptDone:
+	if (opt.rows < 2 || opt.rows > 0x3FFFFFFF || 0 == opt.threads ||
+		opt.writePercent > 100 || 0 == opt.stripes) {
+		fprintf(stderr, "ERROR: invalid options\n");
+		usage(argv[0]);
+		return 1;
+	}
+	if (opt.theta < 0 || opt.theta >= 1) {
+		fprintf(stderr, "ERROR: zipfian theta must be in [0, 1)\n");
+		return 1;
+	}
+	double zetan = opt.theta > 0 ? KeyGen::zeta(opt.rows, opt.theta) : 0;
+	std::unique_ptr<Row[]> rows(new Row[opt.rows]);
+	printf("rows=%zd threads=%zd ops/thread=%zd writes=%zd%% stripes=%zd theta=%.2f\n"
+		, opt.rows, opt.threads, opt.ops, opt.writePercent, opt.stripes, opt.theta);
+	printf("%-12s %10s %12s %10s %6s\n", "mode", "seconds", "Mops/sec", "fallback", "torn");
+	int ret = 0;
+	valvec<fstring> modes;
+	fstring(opt.modes).split(',', &modes);
+	for (fstring mode : modes) {
+		if (mode != "map" && mode != "stripe" && mode != "optimistic") {
+			fprintf(stderr, "ERROR: unknown mode: %.*s\n", mode.ilen(), mode.data());
+			return 1;
+		}
+		Result res = runMode(opt, mode.str(), zetan, rows.get());
+		printf("%-12s %10.3f %12.3f %10zd %6zd\n", res.mode.c_str(), res.seconds
+			, res.ops / res.seconds / 1e6, res.fallback, res.torn);
+		if (res.torn)
+			ret = 2;
+	}
+	return ret;
+}
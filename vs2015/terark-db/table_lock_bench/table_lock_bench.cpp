@@ -0,0 +1,198 @@
+// table_lock_bench.cpp : contention of TableRwMutex types(TableLock option)
+//
+// usage: see usage() or run with -h
+// threads lock one TableRwMutex as DbTable does: readers copy words of a
+// shared segment array, upgraders take a read lock then upgrade it as a
+// writable segment roll, writers update all words. Each type runs with each
+// thread count, the table is printed to stdout, the type of the highest
+// geometric mean throughput over thread counts is picked for this host.
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/table_rwlock.hpp>
+#include <terark/util/profiling.hpp>
+#include <terark/lcast.hpp>
+#include <getopt.h>
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <thread>
+
+using namespace terark;
+using namespace terark::db;
+
+void usage(const char* prog) {
+	fprintf(stderr, R"EOS(usage: %s options
+options:
+  -l types    comma separated, default queuing,spin,speculative
+  -t threads  comma separated thread counts, default 1,4,16
+  -R ops      ops of each thread, default 1000000
+  -w percent  write locks in percent of ops, default 1
+  -u percent  read locks upgraded to writer in percent of ops, default 1
+  -n words    words of the shared array read in a read lock, default 16
+  -S seed     random seed
+The picked type is used by the "TableLock" option of a table schema, or by
+env TerarkDB_TableLock for tables without the option.
+)EOS", prog);
+}
+
+struct Options {
+	std::string types = "queuing,spin,speculative";
+	std::string threads = "1,4,16";
+	size_t ops = 1000000;
+	size_t writePercent = 1;
+	size_t upgradePercent = 1;
+	size_t words = 16;
+	unsigned seed = 301;
+};
+
+struct Result {
+	double seconds = 0;
+	size_t ops = 0;
+	size_t retried = 0; // upgrades which re-acquired the lock
+	size_t torn = 0;    // must be 0
+};
+
+// words are atomic, just to avoid data race reports of the compiler
+static Result runType(const Options& opt, TableLockType type, size_t threads,
+					  std::atomic<ullong>* words) {
+	TableRwMutex mutex(type);
+	for (size_t i = 0; i < opt.words; ++i)
+		words[i].store(0, std::memory_order_relaxed);
+	std::atomic<size_t> retried(0), torn(0);
+	auto work = [&](size_t tid) {
+		std::mt19937_64 rng(opt.seed + tid);
+		size_t myRetried = 0, myTorn = 0;
+		ullong sum = 0;
+		auto writeAll = [&]() {
+			ullong v = words[0].load(std::memory_order_relaxed) + 1;
+			for (size_t k = 0; k < opt.words; ++k)
+				words[k].store(v, std::memory_order_relaxed);
+		};
+		for (size_t i = 0; i < opt.ops; ++i) {
+			size_t r = size_t(rng() % 100);
+			if (r < opt.writePercent) {
+				TableRwMutex::scoped_lock lock(mutex, true);
+				writeAll();
+				continue;
+			}
+			TableRwMutex::scoped_lock lock(mutex, false);
+			ullong w0 = words[0].load(std::memory_order_relaxed);
+			for (size_t k = 0; k < opt.words; ++k) {
+				ullong w = words[k].load(std::memory_order_relaxed);
+				myTorn += w != w0;
+				sum += w;
+			}
+			if (r < opt.writePercent + opt.upgradePercent) {
+				if (!lock.upgrade_to_writer())
+					myRetried++;
+				writeAll();
+			}
+		}
+		retried += myRetried;
+		torn += myTorn + (sum == ullong(-1)); // sum is used
+	};
+	profiling pf;
+	llong t0 = pf.now();
+	std::vector<std::thread> thr;
+	for (size_t i = 0; i < threads; ++i)
+		thr.emplace_back(work, i);
+	for (auto& t : thr)
+		t.join();
+	Result res;
+	res.seconds = pf.sf(t0, pf.now());
+	res.ops = opt.ops * threads;
+	res.retried = retried;
+	res.torn = torn;
+	return res;
+}
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	for (;;) {
+		int opch = getopt(argc, argv, "hl:t:R:w:u:n:S:");
+		switch (opch) {
+		case -1:
+			goto GetoptDone;
+		case 'h':
+		case '?':
+		default:
+			usage(argv[0]);
+			return 1;
+		case 'l': opt.types = optarg; break;
+		case 't': opt.threads = optarg; break;
+		case 'R': opt.ops = lcast(optarg); break;
+		case 'w': opt.writePercent = lcast(optarg); break;
+		case 'u': opt.upgradePercent = lcast(optarg); break;
+		case 'n': opt.words = lcast(optarg); break;
+		case 'S': opt.seed = (unsigned)lcast(optarg); break;
+		}
+	}
+GetoptDone:
+	if (opt.writePercent + opt.upgradePercent > 100 || 0 == opt.words) {
+		fprintf(stderr, "ERROR: invalid options\n");
+		usage(argv[0]);
+		return 1;
+	}
+	valvec<TableLockType> types;
+	valvec<fstring> names;
+	fstring(opt.types).split(',', &names);
+	for (fstring name : names) {
+		if ("queuing" == name)
+			types.push_back(TableLockType::queuing);
+		else if ("spin" == name)
+			types.push_back(TableLockType::spin);
+		else if ("speculative" == name)
+			types.push_back(TableLockType::speculative);
+		else {
+			fprintf(stderr, "ERROR: unknown lock type: %.*s\n", name.ilen(), name.data());
+			return 1;
+		}
+	}
+	valvec<size_t> threadNums;
+	fstring(opt.threads).split(',', &names);
+	for (fstring name : names) {
+		size_t n = lcast(name);
+		if (0 == n) {
+			fprintf(stderr, "ERROR: invalid thread count: %.*s\n", name.ilen(), name.data());
+			return 1;
+		}
+		threadNums.push_back(n);
+	}
+	if (types.empty() || threadNums.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+#if !TERARK_DB_HAS_SPECULATIVE_RW_MUTEX
+	fprintf(stderr, "WARN: tbb is built without tsx, speculative is spin\n");
+#endif
+	std::unique_ptr<std::atomic<ullong>[]> words(new std::atomic<ullong>[opt.words]);
+	printf("ops/thread=%zd writes=%zd%% upgrades=%zd%% words=%zd\n"
+		, opt.ops, opt.writePercent, opt.upgradePercent, opt.words);
+	printf("%-12s %8s %10s %12s %10s %6s\n"
+		, "type", "threads", "seconds", "Mops/sec", "retried", "torn");
+	int ret = 0;
+	TableLockType best = types[0];
+	double bestScore = -1;
+	for (TableLockType type : types) {
+		double logSum = 0;
+		for (size_t threads : threadNums) {
+			Result res = runType(opt, type, threads, words.get());
+			double mops = res.ops / res.seconds / 1e6;
+			printf("%-12s %8zd %10.3f %12.3f %10zd %6zd\n", tableLockTypeName(type)
+				, threads, res.seconds, mops, res.retried, res.torn);
+			logSum += std::log(mops);
+			if (res.torn)
+				ret = 2;
+		}
+		double score = std::exp(logSum / threadNums.size());
+		if (score > bestScore) {
+			bestScore = score;
+			best = type;
+		}
+	}
+	printf("best: %s, geometric mean = %.3f Mops/sec, use \"TableLock\": \"%s\""
+		   " or env TerarkDB_TableLock=%s\n", tableLockTypeName(best), bestScore
+		, tableLockTypeName(best), tableLockTypeName(best));
+	return ret;
+}
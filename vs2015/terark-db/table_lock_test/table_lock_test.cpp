@@ -0,0 +1,105 @@
+// table_lock_test.cpp : functional test of TableRwMutex(TableLock option)
+//
+// each lock type is set on one mutex in turn, one scoped_lock is reused
+// across the types, writers are exclusive with writers and readers, and an
+// upgraded reader is exclusive until it is downgraded. Exits 1 on failure
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/table_rwlock.hpp>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace terark;
+using namespace terark::db;
+
+static int g_failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failed++; \
+	} \
+} while (0)
+
+static const TableLockType g_types[] = {
+	TableLockType::queuing, TableLockType::spin, TableLockType::speculative,
+};
+
+// writers increment two words in the write lock, readers see them equal
+static void testExclusion(TableRwMutex& m) {
+	const int threadNum = 8, ops = 20000;
+	llong words[2] = { 0, 0 };
+	std::atomic<int> torn(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threadNum; ++t) {
+		threads.emplace_back([&,t]() {
+			for (int i = 0; i < ops; ++i) {
+				if ((t + i) % 4 == 0) {
+					TableRwMutex::scoped_lock lock(m, true);
+					words[0]++;
+					words[1]++;
+				} else {
+					TableRwMutex::scoped_lock lock(m, false);
+					if (*(volatile llong*)&words[0] != *(volatile llong*)&words[1])
+						torn++;
+				}
+			}
+		});
+	}
+	for (auto& th : threads) th.join();
+	llong writes = 0;
+	for (int t = 0; t < threadNum; ++t)
+		for (int i = 0; i < ops; ++i)
+			writes += (t + i) % 4 == 0;
+	CHECK(words[0] == writes);
+	CHECK(words[1] == writes);
+	CHECK(torn == 0);
+}
+
+// an upgraded reader excludes readers until it is downgraded
+static void testUpgrade(TableRwMutex& m) {
+	TableRwMutex::scoped_lock lock(m, false);
+	lock.upgrade_to_writer();
+	std::atomic<bool> entered(false);
+	std::thread reader([&]() {
+		TableRwMutex::scoped_lock rlock(m, false);
+		entered = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	CHECK(!entered);
+	lock.downgrade_to_reader();
+	reader.join(); // readers share the downgraded lock
+	CHECK(entered);
+	lock.release();
+	lock.acquire(m, true); // exclusive again after the release
+	lock.release();
+}
+
+int main() {
+	TableRwMutex m;
+	CHECK(m.type() == TableLockType::queuing);
+	TableRwMutex::scoped_lock reused;
+	for (TableLockType type : g_types) {
+		m.setType(type);
+		CHECK(m.type() == type);
+		reused.acquire(m, true); // switches the lock to the type of m
+		reused.release();
+		reused.acquire(m, false);
+		reused.release();
+		testExclusion(m);
+		testUpgrade(m);
+		fprintf(stderr, "INFO: TableLock %s done\n", tableLockTypeName(type));
+	}
+	m.setType(TableLockType::queuing); // back from another type
+	CHECK(m.type() == TableLockType::queuing);
+	testExclusion(m);
+	if (g_failed) {
+		fprintf(stderr, "ERROR: %d checks failed\n", g_failed);
+		return 1;
+	}
+	fprintf(stderr, "INFO: all passed\n");
+	return 0;
+}
@@ -24,6 +24,42 @@ int maxColnameLen(const Schema& schema) {
 	return maxNameLen;
 }
 
+bool isRowCodecSupported(const Schema& schema) {
+	for (size_t i = 0; i < schema.columnNum(); ++i) {
+		switch (schema.getColumnType(i)) {
+		case ColumnType::Any:
+		case ColumnType::Nested:
+		case ColumnType::Decimal128:
+			return false;
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+// codec specialized by column types, unsupported schemas use interpreter
+void compileRowCodec(const Schema& schema) {
+	if (!isRowCodecSupported(schema)) {
+		printf(
+R"EOS(
+    static const terark::db::RowCodec* getRowCodec() { return nullptr; }
+)EOS");
+		return;
+	}
+	printf("\n    typedef terark::db::RowCodecOf<0x%016llxULL\n"
+		, (unsigned long long)schema.rowCodecHash());
+	for (size_t i = 0; i < schema.columnNum(); ++i) {
+		const ColumnMeta& colmeta = schema.getColumnMeta(i);
+		printf("      , terark::db::RowCodecCol<terark::db::ColumnType::%s, %u>\n"
+			, colmeta.typeNameString(), unsigned(colmeta.fixedLen));
+	}
+	printf(
+R"EOS(      > RowCodec;
+    static const terark::db::RowCodec* getRowCodec() { return RowCodec::get(); }
+)EOS");
+}
+
 void compileOneSchema(const Schema& schema, const char* className,
 					  const char* rowClassName) {
 	const size_t colnum = schema.columnNum();
@@ -220,9 +256,14 @@ R"EOS(
     static bool
     checkTableSchema(terark::db::DbTablePtr& tab, bool checkColname = false);
 
+    // register codecs of row schema and colgroup schemas, tables opened
+    // after this use the generated codecs instead of the interpreter
+    static void registerRowCodecs();
+
     static terark::db::DbTablePtr
     openTable(const boost::filesystem::path& dbdir, bool checkColname = false) {
       using namespace terark::db;
+      registerRowCodecs();
       DbTablePtr tab = DbTable::open(dbdir);
       if (!checkTableSchema(tab, checkColname)) {
         THROW_STD(invalid_argument,
@@ -325,6 +366,8 @@ R"EOS(      return true;
     }
 )EOS"); // checkSchema
 
+	compileRowCodec(schema);
+
 	printf("  }; // %s\n", className);
 }
 
@@ -386,6 +429,7 @@ GetoptDone:
 //*******************************************************************
 
 #include <terark/db/db_table.hpp>
+#include <terark/db/row_codec.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/io/MemStream.hpp>
 #include <terark/io/RangeStream.hpp>
@@ -440,8 +484,26 @@ R"EOS(    if (!%s_Colgroup_%s::checkSchema(
 R"EOS(    return true;
   } // %s
 
+  inline void %s::registerRowCodecs() {
+    using terark::db::Schema;
+    if (auto codec = %s::getRowCodec())
+      Schema::registerRowCodec(codec);
+)EOS", tabName, tabName, tabName);
+
+	for (size_t i = 0; i < cgNum; ++i) {
+		const Schema& schema = *sconf.m_colgroupSchemaSet->getSchema(i);
+		std::string cgName = TransformColgroupName(schema.m_name);
+		printf(
+R"EOS(    if (auto codec = %s_Colgroup_%s::getRowCodec())
+      Schema::registerRowCodec(codec);
+)EOS", tabName, cgName.c_str());
+	}
+
+	printf(
+R"EOS(  } // registerRowCodecs
+
 } // namespace %s
-)EOS", tabName, ns);
+)EOS", ns);
 
     return 0;
 }
@@ -1,39 +1,245 @@
 #include <terark/util/autoclose.hpp>
 #include <terark/util/linebuf.hpp>
 #include <terark/db/db_table.hpp>
+#include <terark/db/db_segment.hpp>
+#include <terark/db/arrow_export.hpp>
+#include <terark/io/FileStream.hpp>
+#include <terark/io/StreamBuffer.hpp>
+#include <terark/io/DataIO.hpp>
+#include <terark/lcast.hpp>
 #include <terark/util/profiling.hpp>
 #include <mongo_terarkdb/record_codec.h>
 #include <mongo/bson/bsonobj.h>
+#include <thread>
 
 #ifdef _MSC_VER
 	#include <getopt.c>
 #endif
 
 void usage(const char* prog) {
-	fprintf(stderr, "usage: %s options dbDir startId count...\n", prog);
+	fprintf(stderr, R"EOS(usage: %s options dbDir startId count...
+options:
+  -P threads: parallel dump, the id range is split by segment boundaries,
+     thread i writes rows in id order to file <outPrefix>.<i>, so cat of
+     the files in order is the whole range in id order
+  -o outPrefix: output file prefix of parallel dump, default is "dump"
+  -b binary output of parallel dump, each row is:
+     var_uint64(recId), var_uint(len), native row of row schema
+     default output is text, each line is: recId<TAB>json
+  -a Arrow output, live rows of readonly segments are written to file
+     <outPrefix>.arrows in Arrow IPC streaming format, startId and count
+     are ignored, writable segments are skipped, -P is threads of
+     reading columns
+)EOS", prog);
 }
 
+using namespace terark;
+using terark::db::SegArrayVersionPtr;
+
+namespace {
+
+// [lo, hi) of record ids in one segment
+struct IdRange {
+	size_t segIdx;
+	llong  lo;
+	llong  hi;
+};
+
+struct DumpJob {
+	valvec<IdRange> ranges;
+	std::string fname;
+	llong rows = 0;
+	llong bytes = 0;
+	std::string err;
+};
+
+void dumpRanges(const db::DbTable* tab, const db::SegArrayVersion* version,
+				bool binary, DumpJob* job) {
+	FileStream fp(job->fname.c_str(), "wb");
+	fp.disbuf();
+	NativeDataOutput<OutputBuffer> dio;
+	dio.attach(&fp);
+	dio.set_bufsize(4 << 20);
+	db::DbContextPtr ctx = tab->createDbContext();
+	const db::Schema& rowSchema = tab->rowSchema();
+	valvec<byte> buf;
+	std::string line;
+	for (const IdRange& r : job->ranges) {
+		const db::ReadableSegment* seg = version->m_segments[r.segIdx].get();
+		const db::ReadonlySegment* rdseg = seg->getReadonlySegment();
+		// the row is a zero-copy ref to the mmap'ed store if possible
+		const bool valueRef = rdseg && rdseg->hasValueRef();
+		const llong baseId = version->m_rowNumVec[r.segIdx];
+		for (llong id = r.lo; id < r.hi; ++id) {
+			llong subId = id - baseId;
+			if (seg->m_isDel[subId])
+				continue;
+			fstring row;
+			if (valueRef) {
+				row = rdseg->getValueRef(subId, ctx.get());
+			} else {
+				seg->getValue(subId, &buf, ctx.get());
+				row = buf;
+			}
+			if (binary) {
+				dio << var_uint64_t(id);
+				dio << var_size_t(row.size());
+				dio.ensureWrite(row.data(), row.size());
+			}
+			else {
+				line.assign(lcast(id));
+				line.push_back('\t');
+				rowSchema.appendJson(row, &line);
+				line.push_back('\n');
+				dio.ensureWrite(line.data(), line.size());
+			}
+			job->rows++;
+			job->bytes += row.size();
+		}
+	}
+	dio.flush();
+	fp.close();
+}
+
+int parallelDump(db::DbTable* tab, llong startId, llong cnt, int threads,
+				 const char* outPrefix, bool binary) {
+	SegArrayVersionPtr version = tab->getSegArrayVersion();
+	const valvec<llong>& rowNumVec = version->m_rowNumVec;
+	const llong endId = std::min(startId + cnt, rowNumVec.back());
+	valvec<IdRange> ranges;
+	for (size_t i = 0; i < version->m_segments.size(); ++i) {
+		llong lo = std::max(startId, rowNumVec[i]);
+		llong hi = std::min(endId, rowNumVec[i+1]);
+		if (lo < hi)
+			ranges.push_back({i, lo, hi});
+	}
+	// contiguous ranges of about total/threads rows per job, a segment
+	// larger than that is split, so each job is in id order
+	const llong total = std::max<llong>(endId - startId, 0);
+	const llong perJob = std::max<llong>((total + threads - 1) / threads, 1);
+	std::vector<DumpJob> jobs(threads);
+	size_t jobIdx = 0;
+	for (IdRange r : ranges) {
+		while (r.lo < r.hi) {
+			DumpJob& job = jobs[jobIdx];
+			llong jobRows = 0;
+			for (auto& x : job.ranges) jobRows += x.hi - x.lo;
+			llong take = std::min(r.hi - r.lo, perJob - jobRows);
+			job.ranges.push_back({r.segIdx, r.lo, r.lo + take});
+			r.lo += take;
+			if (jobRows + take >= perJob && jobIdx + 1 < jobs.size())
+				jobIdx++;
+		}
+	}
+	profiling pf;
+	llong t0 = pf.now();
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%03zd", i);
+		jobs[i].fname = std::string(outPrefix) + suffix;
+		workers.emplace_back([&,i]() {
+			try {
+				dumpRanges(tab, version.get(), binary, &jobs[i]);
+			}
+			catch (const std::exception& ex) {
+				jobs[i].err = ex.what();
+			}
+		});
+	}
+	llong rows = 0, bytes = 0;
+	int ret = 0;
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		workers[i].join();
+		if (!jobs[i].err.empty()) {
+			fprintf(stderr, "ERROR: %s: %s\n", jobs[i].fname.c_str(), jobs[i].err.c_str());
+			ret = 1;
+		}
+		rows += jobs[i].rows;
+		bytes += jobs[i].bytes;
+	}
+	double sec = pf.sf(t0, pf.now());
+	fprintf(stderr, "dumped %lld rows, %lld bytes in %zd files, %.3f sec, %.3f MB/s\n"
+		, rows, bytes, jobs.size(), sec, bytes / sec / 1e6);
+	return ret;
+}
+
+int arrowDump(db::DbTable* tab, int threads, const char* outPrefix) {
+	SegArrayVersionPtr version = tab->getSegArrayVersion();
+	std::string fname = std::string(outPrefix) + ".arrows";
+	profiling pf;
+	llong t0 = pf.now();
+	llong rows = 0;
+	size_t skipped = 0;
+	db::ArrowStreamExporter exporter(tab->getSchemaConfig(), fname, 65536, threads);
+	for (size_t i = 0; i < version->m_segments.size(); ++i) {
+		const db::ReadableSegment* seg = version->m_segments[i].get();
+		const db::ReadonlySegment* rdseg = seg->getReadonlySegment();
+		if (rdseg)
+			rows += exporter.exportSegment(rdseg);
+		else
+			skipped++;
+	}
+	exporter.close();
+	if (skipped) {
+		fprintf(stderr, "INFO: skipped %zd writable segments\n", skipped);
+	}
+	double sec = pf.sf(t0, pf.now());
+	fprintf(stderr, "exported %lld rows to %s, %lld bytes, %.3f sec, %.3f MB/s\n"
+		, rows, fname.c_str(), exporter.fileSize(), sec
+		, exporter.fileSize() / sec / 1e6);
+	return 0;
+}
+
+} // namespace
+
 int main(int argc, char* argv[]) {
+	int threads = 0;
+	bool binary = false;
+	bool arrow = false;
+	const char* outPrefix = "dump";
 	for (;;) {
-		int opt = getopt(argc, argv, "tj");
+		int opt = getopt(argc, argv, "tjbaP:o:");
 		switch (opt) {
 		case -1:
 			goto GetoptDone;
 		case 'j':
 			break;
+		case 'b':
+			binary = true;
+			break;
+		case 'a':
+			arrow = true;
+			break;
+		case 'P':
+			threads = atoi(optarg);
+			break;
+		case 'o':
+			outPrefix = optarg;
+			break;
 		}
 	}
 GetoptDone:
-	if (optind + 3 < argc) {
+	if (optind + 3 > argc) {
 		usage(argv[0]);
 		return 1;
 	}
-	using namespace terark;
 	mongo::terarkdb::SchemaRecordCoder coder;
 	const char* dbdir = argv[optind + 0];
 	llong startId = strtoll(argv[optind + 1], NULL, 10);
 	llong cnt = strtoll(argv[optind + 2], NULL, 10);
 	terark::db::DbTablePtr tab = terark::db::DbTable::open(dbdir);
+	if (arrow) {
+		return arrowDump(tab.get(), threads, outPrefix);
+	}
+	if (threads > 0) {
+		return parallelDump(tab.get(), startId, cnt, threads, outPrefix, binary);
+	}
+	std::string dictFile = std::string(dbdir) + "/fieldnames.dict";
+	if (FILE* fp = fopen(dictFile.c_str(), "rb")) {
+		fclose(fp);
+		coder.setFieldDict(new mongo::terarkdb::FieldNameDict(dictFile));
+	}
 	terark::db::DbContextPtr ctx = tab->createDbContext();
 	terark::valvec<unsigned char> row;
 	size_t colnum = tab->rowSchema().columnNum();
@@ -65,4 +271,3 @@ GetoptDone:
 	printf("done!\n");
     return 0;
 }
-
@@ -2,21 +2,158 @@
 #include <terark/util/autoclose.hpp>
 #include <terark/util/linebuf.hpp>
 #include <terark/util/profiling.hpp>
+#include <terark/thread/pipeline.hpp>
 #include <terark/db/db_table.hpp>
 #ifdef _MSC_VER
 	#include <getopt.c>
 #endif
 
+using namespace std::placeholders;
+
+// @returns parsed columns, a line of terarkdb_dump is prefixed by recId<TAB>
+static size_t parseLine(const terark::db::Schema& schema, int inputFormat,
+						terark::fstring line, terark::valvec<unsigned char>* row) {
+	if ('j' != inputFormat)
+		return schema.parseDelimText('\t', line, row);
+	const char* tab = (const char*)memchr(line.data(), '\t', line.size());
+	if (tab && '{' != line[0])
+		line = terark::fstring(tab + 1, line.end());
+	try {
+		return schema.parseJson(line, row);
+	}
+	catch (const std::exception&) {
+		return 0; // bad line
+	}
+}
+
 void usage(const char* prog) {
-	fprintf(stderr, "usage: %s options db-dir input-data-files...\n", prog);
+	fprintf(stderr, R"EOS(usage: %s options db-dir input-data-files...
+options:
+  -t tab delimited text input(default)
+  -j json input, each line is a json object or recId<TAB>json of terarkdb_dump
+  -L rows limit
+  -B bulk load: build readonly segments directly from input rows, then
+     attach them to the table at the end, the table must have no unflushed
+     writes and unique keys of input rows must not be duplicated
+  -S bytes of rows per bulk segment, default is MaxWritingSegmentSize
+  -T parse threads of bulk load, default is cpu num
+)EOS", prog);
 }
 
+// parse lines in parallel, rows are collected in input order and a
+// readonly segment is built when a chunk is full
+class BulkImporter {
+	struct LineBatch : public terark::PipelineTask {
+		terark::fstrvecl lines;
+		terark::fstrvecl rows;
+		size_t badLines = 0;
+	};
+	terark::db::DbTable* m_tab;
+	int m_inputFormat;
+	size_t m_segBytes;
+	size_t m_colnum;
+	terark::fstrvecl m_chunk;
+	std::vector<std::string> m_stagingDirs;
+	std::string m_err;
+	size_t m_rows = 0;
+	size_t m_badLines = 0;
+
+	void parse(terark::PipelineStage*, int, terark::PipelineQueueItem* item) {
+		auto batch = static_cast<LineBatch*>(item->task);
+		const terark::db::Schema& schema = m_tab->rowSchema();
+		terark::valvec<unsigned char> row;
+		for (size_t i = 0; i < batch->lines.size(); ++i) {
+			size_t parsed = parseLine(schema, m_inputFormat, batch->lines[i], &row);
+			if (parsed == m_colnum)
+				batch->rows.push_back(row);
+			else
+				batch->badLines++;
+		}
+		batch->lines.erase_all();
+	}
+	void collect(terark::PipelineStage*, int, terark::PipelineQueueItem* item) {
+		auto batch = static_cast<LineBatch*>(item->task);
+		m_badLines += batch->badLines;
+		if (!m_err.empty())
+			return;
+		for (size_t i = 0; i < batch->rows.size(); ++i) {
+			m_chunk.push_back(batch->rows[i]);
+			if (m_chunk.strpool.size() >= m_segBytes)
+				buildChunk();
+		}
+		m_rows += batch->rows.size();
+	}
+	void buildChunk() {
+		if (0 == m_chunk.size())
+			return;
+		try {
+			m_stagingDirs.push_back(m_tab->buildBulkSegment(m_chunk));
+		}
+		catch (const std::exception& ex) {
+			m_err = ex.what();
+		}
+		m_chunk.erase_all();
+	}
+
+public:
+	BulkImporter(terark::db::DbTable* tab, int inputFormat, size_t segBytes)
+		: m_tab(tab), m_inputFormat(inputFormat), m_segBytes(segBytes) {
+		m_colnum = tab->rowSchema().columnNum();
+	}
+	// returns imported rows
+	size_t run(terark::LineBuf& line, FILE** files, size_t nfiles,
+			   size_t rowsLimit, int threads) {
+		terark::PipelineProcessor pipeline;
+		pipeline.setQueueSize(2 * threads);
+		pipeline
+		| new terark::FunPipelineStage(threads,
+			TerarkFuncBind(&BulkImporter::parse, this, _1, _2, _3), "parse")
+		| new terark::FunPipelineStage(0,
+			TerarkFuncBind(&BulkImporter::collect, this, _1, _2, _3), "collect")
+		;
+		pipeline.compile();
+		const size_t batchLines = 10000;
+		size_t lines = 0;
+		std::unique_ptr<LineBatch> batch(new LineBatch());
+		for (size_t f = 0; f < nfiles && lines < rowsLimit; ++f) {
+			while (lines < rowsLimit && line.getline(files[f]) > 0) {
+				line.chomp();
+				batch->lines.push_back(terark::fstring(line.p, line.n));
+				if (batch->lines.size() == batchLines) {
+					pipeline.inqueue(batch.release());
+					batch.reset(new LineBatch());
+				}
+				lines++;
+				if (lines % TERARK_IF_DEBUG(100000, 1000000) == 0) {
+					fprintf(stderr, "read %zd lines\n", lines);
+				}
+			}
+		}
+		if (batch->lines.size())
+			pipeline.inqueue(batch.release());
+		pipeline.stop();
+		pipeline.wait();
+		buildChunk();
+		if (!m_err.empty()) {
+			fprintf(stderr, "ERROR: bulk load failed: %s\n", m_err.c_str());
+			return 0;
+		}
+		m_tab->attachBulkSegments(m_stagingDirs);
+		fprintf(stderr, "bulk loaded %zd rows in %zd segments, bad lines = %zd\n"
+			, m_rows, m_stagingDirs.size(), m_badLines);
+		return m_rows;
+	}
+};
+
 int main(int argc, char* argv[]) {
 	int inputFormat = 't';
 	size_t rowsLimit = 10000000;
+	bool bulkLoad = false;
+	size_t bulkSegBytes = 0;
+	int bulkThreads = (int)std::thread::hardware_concurrency();
 	terark::hash_strmap<const char*> colformat;
 	for (;;) {
-		int opt = getopt(argc, argv, "tjL:");
+		int opt = getopt(argc, argv, "tjL:BS:T:");
 		switch (opt) {
 		case -1:
 			goto GetoptDone;
@@ -27,10 +164,19 @@ int main(int argc, char* argv[]) {
 		case 'L':
 			rowsLimit = strtoull(optarg, NULL, 10);
 			break;
+		case 'B':
+			bulkLoad = true;
+			break;
+		case 'S':
+			bulkSegBytes = strtoull(optarg, NULL, 10);
+			break;
+		case 'T':
+			bulkThreads = std::max(atoi(optarg), 1);
+			break;
 		}
 	}
 GetoptDone:
-	if (optind + 2 < argc) {
+	if (optind + 2 > argc) {
 		usage(argv[0]);
 		return 1;
 	}
@@ -47,6 +193,35 @@ GetoptDone:
 	size_t bytes = 0;
 	size_t colnum = tab->rowSchema().columnNum();
 	printf("skip existed %zd rows and import %zd rows\n", existedRows, rowsLimit);
+	if (bulkLoad) {
+		if (0 == bulkSegBytes)
+			bulkSegBytes = size_t(tab->getSchemaConfig().m_maxWritingSegmentSize);
+		terark::valvec<FILE*> files;
+		for (int argIdx = optind + 1; argIdx < argc; ++argIdx) {
+			const char* fname = argv[argIdx];
+			FILE* fp = fopen(fname, "r");
+			if (!fp) {
+				fprintf(stderr, "ERROR: fopen(%s, r) = %s\n", fname, strerror(errno));
+				continue;
+			}
+			while (skippedRows < existedRows && line.getline(fp) > 0) {
+				skippedRows++;
+			}
+			files.push_back(fp);
+		}
+		fprintf(stderr, "total skipped %zd rows\n", skippedRows);
+		terark::profiling pf;
+		long long t0 = pf.now();
+		BulkImporter importer(tab.get(), inputFormat, bulkSegBytes);
+		rows = importer.run(line, files.data(), files.size(), rowsLimit, bulkThreads);
+		for (FILE* fp : files)
+			fclose(fp);
+		printf("bulk load: rows=%zd, time=%.3f sec\n", rows, pf.sf(t0, pf.now()));
+		tab->syncFinishWriting();
+		terark::db::DbTable::safeStopAndWaitForCompress();
+		printf("done!\n");
+		return 0;
+	}
 	for (int argIdx = optind + 1; argIdx < argc; ++argIdx) {
 		const char* fname = argv[argIdx];
 		terark::Auto_fclose fp(fopen(fname, "r"));
@@ -64,7 +239,7 @@ GetoptDone:
 		while (rows < rowsLimit && line.getline(fp) > 0) {
 			bytes += line.size();
 			line.chomp();
-			size_t parsed = tab->rowSchema().parseDelimText('\t', line, &row);
+			size_t parsed = parseLine(tab->rowSchema(), inputFormat, line, &row);
 			if (parsed == colnum) {
 				ctx->insertRow(row);
 				rows++;
@@ -90,4 +265,3 @@ GetoptDone:
 	printf("done!\n");
     return 0;
 }
-
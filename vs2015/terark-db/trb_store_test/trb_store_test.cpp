@@ -0,0 +1,85 @@
+// trb_store_test.cpp : functional test of chunk allocation of TrbWritableStore
+//
+// rows are appended to two stores in alternation, as a row of colgroups is
+// written by TrbColgroupSegment::storeUpdate, after the warm-up rows(which
+// reserve the pool in the exclusive lock) the pool of each store must grow
+// by about the rows, as it does with one store. Exits 1 on failure
+//
+//Makefile: LDFLAGS: -lpthread
+
+#include <terark/db/trbdb/trb_db_store.hpp>
+#include <thread>
+
+using namespace terark;
+using namespace terark::db;
+using namespace terark::db::trbdb;
+
+static int g_failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failed++; \
+	} \
+} while (0)
+
+// pool bytes of each store after rows of rowLen bytes are appended to
+// storeNum stores in alternation by one thread
+static llong poolBytesPerStore(size_t storeNum, size_t rows, size_t rowLen) {
+	Schema schema;
+	std::vector<TrbWritableStorePtr> stores;
+	for (size_t s = 0; s < storeNum; ++s)
+		stores.push_back(new TrbWritableStore(schema, ""));
+	std::string row(rowLen, 'x');
+	for (size_t i = 0; i < rows; ++i) {
+		for (auto& store : stores)
+			store->append(row, NULL);
+	}
+	llong bytes = 0;
+	for (auto& store : stores) {
+		CHECK(store->numDataRows() == llong(rows));
+		valvec<byte> val;
+		store->getValueAppend(llong(rows - 1), &val, NULL);
+		CHECK(fstring(val) == row);
+		bytes += store->dataStorageSize();
+	}
+	return bytes / llong(storeNum);
+}
+
+int main() {
+	const size_t rows = 20000, rowLen = 24;
+	llong one = poolBytesPerStore(1, rows, rowLen);
+	llong two = poolBytesPerStore(2, rows, rowLen);
+	fprintf(stderr, "INFO: pool bytes per store: one store = %lld, two stores = %lld\n", one, two);
+	// a chunk per thread and store is at most unused
+	CHECK(two <= one + (256 << 10));
+	// stores of threads in alternation, each thread keeps a chunk per store
+	llong threaded = 0;
+	{
+		Schema schema;
+		TrbWritableStorePtr a = new TrbWritableStore(schema, "");
+		TrbWritableStorePtr b = new TrbWritableStore(schema, "");
+		std::string row(rowLen, 'y');
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t) {
+			threads.emplace_back([&]() {
+				for (size_t i = 0; i < rows / 4; ++i) {
+					a->append(row, NULL);
+					b->append(row, NULL);
+				}
+			});
+		}
+		for (auto& th : threads) th.join();
+		CHECK(a->numDataRows() == llong(rows));
+		CHECK(b->numDataRows() == llong(rows));
+		threaded = a->dataStorageSize();
+	}
+	fprintf(stderr, "INFO: pool bytes per store of 4 threads = %lld\n", threaded);
+	CHECK(threaded <= one + 4 * (256 << 10));
+	if (g_failed) {
+		fprintf(stderr, "ERROR: %d checks failed\n", g_failed);
+		return 1;
+	}
+	fprintf(stderr, "INFO: all passed\n");
+	return 0;
+}